@@ -51,8 +51,8 @@ int readPostBody( cgiRequestObj *request, char **data )
   /* -------------------------------------------------------------------- */
   /*      If the length is provided, read in one gulp.                    */
   /* -------------------------------------------------------------------- */
-  if( getenv("CONTENT_LENGTH") != NULL ) {
-    data_max = (size_t) atoi(getenv("CONTENT_LENGTH"));
+  if( msIO_getenv("CONTENT_LENGTH") != NULL ) {
+    data_max = (size_t) atoi(msIO_getenv("CONTENT_LENGTH"));
     /* Test for suspicious CONTENT_LENGTH (negative value or SIZE_MAX) */
     if( data_max >= SIZE_MAX ) {
       msIO_setHeader("Content-Type","text/html");
@@ -110,7 +110,7 @@ int readPostBody( cgiRequestObj *request, char **data )
 
 static char* msGetEnv(const char *name, void* thread_context)
 {
-  return getenv(name);
+  return msIO_getenv(name);
 }
 
 int loadParams(cgiRequestObj *request,
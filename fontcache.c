@@ -36,6 +36,7 @@ typedef struct {
   FT_Library library;
   face_element *face_cache;
   glyph_element *bitmap_glyph_cache;
+  textpath_element *textpath_cache; /* in least to most recently used order */
 } ft_cache;
 
 #ifdef USE_THREAD
@@ -45,7 +46,18 @@ struct ft_thread_cache{
   ft_thread_cache *next;
   ft_cache cache;
 };
-ft_thread_cache *ft_caches;
+/* one list per shard of TLOCK_TTF, picked from the thread id */
+ft_thread_cache *ft_caches[MS_LOCK_SHARDS];
+
+/* folds all the bits of the id, thread ids are aligned pointers */
+static unsigned int msFontCacheShardKey(void *thread_id) {
+  size_t id = (size_t) thread_id;
+  unsigned int key = (unsigned int) id ^ (unsigned int) ((id >> 16) >> 16);
+  key ^= key >> 16;
+  key ^= key >> 8;
+  key ^= key >> 4;
+  return key % MS_LOCK_SHARDS;
+}
 #else
   ft_cache global_ft_cache;
 #endif
@@ -60,9 +72,17 @@ void msFreeFontCache(ft_cache *c) {
   /* ... TODO ... */
   face_element *cur_face,*tmp_face;
   glyph_element *cur_bitmap, *tmp_bitmap;
+  textpath_element *cur_textpath, *tmp_textpath;
+  UT_HASH_ITER(hh, c->textpath_cache, cur_textpath, tmp_textpath) {
+    UT_HASH_DEL(c->textpath_cache, cur_textpath);
+    free(cur_textpath->key);
+    free(cur_textpath->textpath.glyphs);
+    free(cur_textpath);
+  }
   UT_HASH_ITER(hh, c->face_cache, cur_face, tmp_face) {
       index_element *cur_index,*tmp_index;
       outline_element *cur_outline,*tmp_outline;
+      bitmap_element *cur_bitmap_glyph,*tmp_bitmap_glyph;
       glyph_element *cur_glyph,*tmp_glyph;
       UT_HASH_ITER(hh, cur_face->index_cache, cur_index, tmp_index) {
         UT_HASH_DEL(cur_face->index_cache,cur_index);
@@ -73,6 +93,12 @@ void msFreeFontCache(ft_cache *c) {
         FT_Outline_Done(c->library,&cur_outline->outline);
         free(cur_outline);
       }
+      UT_HASH_ITER(hh, cur_face->bitmap_cache, cur_bitmap_glyph, tmp_bitmap_glyph) {
+        UT_HASH_DEL(cur_face->bitmap_cache,cur_bitmap_glyph);
+        free(cur_bitmap_glyph->spans);
+        free(cur_bitmap_glyph->covers);
+        free(cur_bitmap_glyph);
+      }
       UT_HASH_ITER(hh, cur_face->glyph_cache, cur_glyph, tmp_glyph) {
         UT_HASH_DEL(cur_face->glyph_cache,cur_glyph);
         free(cur_glyph);
@@ -103,17 +129,20 @@ ft_cache* msGetFontCache() {
   return &global_ft_cache;
 #else
   void* nThreadId = msGetThreadId();
-  ft_thread_cache *prev = NULL, *cur = ft_caches;
+  unsigned int key = msFontCacheShardKey(nThreadId);
+  ft_thread_cache **shard = &ft_caches[key];
+  ft_thread_cache *prev = NULL, *cur = *shard;
 
   if( cur != NULL && cur->thread_id == nThreadId )
     return &cur->cache;
 
   /* -------------------------------------------------------------------- */
-  /*      Search for cache for this thread                                */
+  /*      Search for cache for this thread, only the threads sharing      */
+  /*      the shard of this one contend for its lock.                     */
   /* -------------------------------------------------------------------- */
-  msAcquireLock( TLOCK_TTF );
+  msAcquireShardLock( TLOCK_TTF, key );
 
-  cur = ft_caches;
+  cur = *shard;
   while( cur != NULL && cur->thread_id != nThreadId ) {
     prev = cur;
     cur = cur->next;
@@ -126,11 +155,11 @@ ft_cache* msGetFontCache() {
   if( cur != NULL ) {
     if( prev != NULL ) {
       prev->next = cur->next;
-      cur->next = ft_caches;
-      ft_caches = cur;
+      cur->next = *shard;
+      *shard = cur;
     }
 
-    msReleaseLock( TLOCK_TTF );
+    msReleaseShardLock( TLOCK_TTF, key );
     return &cur->cache;
   }
 
@@ -141,10 +170,10 @@ ft_cache* msGetFontCache() {
   cur->next = NULL;
   cur->thread_id = nThreadId;
   msInitFontCache(&cur->cache);
-  cur->next = ft_caches;
-  ft_caches = cur;
+  cur->next = *shard;
+  *shard = cur;
 
-  msReleaseLock( TLOCK_TTF );
+  msReleaseShardLock( TLOCK_TTF, key );
 
   return &cur->cache;
 #endif
@@ -155,7 +184,7 @@ void msFontCacheSetup() {
   ft_cache *c = msGetFontCache();
   msInitFontCache(c);
 #else
-  ft_caches = NULL;
+  memset(ft_caches, 0, sizeof(ft_caches));
 #endif
 }
 
@@ -165,16 +194,19 @@ void msFontCacheCleanup() {
   msFreeFontCache(c);
 #else
   ft_thread_cache *cur,*next;
-  msAcquireLock( TLOCK_TTF );
-  cur =  ft_caches;
-  while( cur != NULL ) {
-    msFreeFontCache(&cur->cache);
-    next = cur->next;
-    free(cur);
-    cur = next;
+  unsigned int i;
+  for( i = 0; i < MS_LOCK_SHARDS; i++ ) {
+    msAcquireShardLock( TLOCK_TTF, i );
+    cur =  ft_caches[i];
+    while( cur != NULL ) {
+      msFreeFontCache(&cur->cache);
+      next = cur->next;
+      free(cur);
+      cur = next;
+    }
+    ft_caches[i] = NULL;
+    msReleaseShardLock( TLOCK_TTF, i );
   }
-  ft_caches = NULL;
-  msReleaseLock( TLOCK_TTF );
 #endif
 }
 
@@ -235,6 +267,41 @@ face_element* msGetFontFace(char *key, fontSetObj *fontset) {
   return fc;
 }
 
+/*
+** Shaped text paths, so that the labels of repeated strings skip bidi
+** analysis, shaping and glyph lookups. The glyphs point into this thread's
+** face cache, which is why the cache lives here and not process wide.
+*/
+textPathObj* msGetCachedTextPath(const char *key) {
+  textpath_element *tc;
+  ft_cache *cache = msGetFontCache();
+  UT_HASH_FIND_STR(cache->textpath_cache,key,tc);
+  if(!tc) return NULL;
+  /* move to the most recently used end */
+  UT_HASH_DELETE(hh,cache->textpath_cache,tc);
+  UT_HASH_ADD_KEYPTR(hh,cache->textpath_cache,tc->key,strlen(tc->key),tc);
+  return &tc->textpath;
+}
+
+void msCacheTextPath(const char *key, textPathObj *tp) {
+  textpath_element *tc;
+  ft_cache *cache = msGetFontCache();
+  if(UT_HASH_COUNT(cache->textpath_cache) >= MS_TEXTPATH_CACHE_SIZE) {
+    tc = cache->textpath_cache; /* least recently used */
+    UT_HASH_DEL(cache->textpath_cache,tc);
+    free(tc->key);
+    free(tc->textpath.glyphs);
+  } else {
+    tc = msSmallMalloc(sizeof(textpath_element));
+  }
+  tc->key = msStrdup(key);
+  tc->textpath = *tp;
+  tc->textpath.bounds.poly = NULL;
+  tc->textpath.glyphs = msSmallMalloc(MS_MAX(tp->numglyphs,1) * sizeof(glyphObj));
+  memcpy(tc->textpath.glyphs, tp->glyphs, tp->numglyphs * sizeof(glyphObj));
+  UT_HASH_ADD_KEYPTR(hh,cache->textpath_cache,tc->key,strlen(tc->key),tc);
+}
+
 glyph_element* msGetGlyphByIndex(face_element *face, unsigned int size, unsigned int codepoint) {
   glyph_element *gc;
   glyph_element_key key;
@@ -292,6 +359,32 @@ outline_element* msGetGlyphOutline(face_element *face, glyph_element *glyph) {
   return oc;
 }
 
+bitmap_element* msGetGlyphBitmap(face_element *face, glyph_element *glyph, int subpixel, int outlinewidth) {
+  bitmap_element *bc;
+  bitmap_element_key key;
+  memset(&key,0,sizeof(bitmap_element_key));
+  key.glyph = glyph;
+  key.subpixel = subpixel;
+  key.outlinewidth = outlinewidth;
+  UT_HASH_FIND(hh,face->bitmap_cache,&key, sizeof(bitmap_element_key),bc);
+  return bc;
+}
+
+/* takes ownership of spans and covers, which the renderer rasterized */
+bitmap_element* msAddGlyphBitmap(face_element *face, glyph_element *glyph, int subpixel, int outlinewidth,
+                                 int numspans, bitmap_span *spans, unsigned char *covers) {
+  bitmap_element *bc = msSmallMalloc(sizeof(bitmap_element));
+  memset(&bc->key,0,sizeof(bitmap_element_key));
+  bc->key.glyph = glyph;
+  bc->key.subpixel = subpixel;
+  bc->key.outlinewidth = outlinewidth;
+  bc->numspans = numspans;
+  bc->spans = spans;
+  bc->covers = covers;
+  UT_HASH_ADD(hh,face->bitmap_cache,key,sizeof(bitmap_element_key), bc);
+  return bc;
+}
+
 int msIsGlyphASpace(glyphObj *glyph) {
   /* space or tab, for now */
   unsigned int space,tab;
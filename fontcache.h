@@ -54,22 +54,42 @@ typedef struct {
   UT_hash_handle hh;
 } outline_element;
 
+#define MS_GLYPH_SUBPIXELS 4 /* glyph bitmaps are rasterized at quarter pixel offsets */
+
 typedef struct {
   glyph_element *glyph;
+  int subpixel; /* offset of the glyph origin, x + MS_GLYPH_SUBPIXELS * y */
+  int outlinewidth; /* 0 for the glyph itself, the width of its outline contour otherwise */
 } bitmap_element_key;
 
+typedef struct {
+  int x, y, len; /* relative to the glyph origin */
+  int offset; /* of the first coverage value of the span */
+} bitmap_span;
+
 typedef struct {
   bitmap_element_key key;
-  void *bitmap;
+  int numspans;
+  bitmap_span *spans;
+  unsigned char *covers;
   UT_hash_handle hh;
 } bitmap_element;
 
+#define MS_TEXTPATH_CACHE_SIZE 2048 /* shaped strings kept per thread, least recently used ones are dropped */
+
+typedef struct {
+  char *key; /* string, font list and layout settings, see msLayoutTextSymbol() */
+  textPathObj textpath; /* relative glyph positions and bounds, as laid out */
+  UT_hash_handle hh;
+} textpath_element;
+
 struct face_element{
   char *font;
   FT_Face face;
   index_element *index_cache;
   glyph_element *glyph_cache;
   outline_element *outline_cache;
+  bitmap_element *bitmap_cache;
   hb_font_element *hbfont;
   UT_hash_handle hh;
 };
@@ -77,6 +97,11 @@ struct face_element{
 
 face_element* msGetFontFace(char *key, fontSetObj *fontset);
 outline_element* msGetGlyphOutline(face_element *face, glyph_element *glyph);
+bitmap_element* msGetGlyphBitmap(face_element *face, glyph_element *glyph, int subpixel, int outlinewidth);
+bitmap_element* msAddGlyphBitmap(face_element *face, glyph_element *glyph, int subpixel, int outlinewidth,
+                                 int numspans, bitmap_span *spans, unsigned char *covers);
+textPathObj* msGetCachedTextPath(const char *key);
+void msCacheTextPath(const char *key, textPathObj *tp);
 glyph_element* msGetBitmapGlyph(rendererVTableObj *renderer, unsigned int size, unsigned int unicode);
 unsigned int msGetGlyphIndex(face_element *face, unsigned int unicode);
 glyph_element* msGetGlyphByIndex(face_element *face, unsigned int size, unsigned int codepoint);
@@ -0,0 +1,452 @@
+/******************************************************************************
+ * $Id$
+ *
+ * Project:  MapServer
+ * Purpose:  Command line utility measuring the throughput of the hot geometry
+ *           functions (clipping, pixel transformation, label points and paths,
+ *           GEOS conversion) on generated and shapefile geometries.
+ * Author:   Steve Lime and the MapServer team.
+ *
+ ******************************************************************************
+ * Copyright (c) 1996-2005 Regents of the University of Minnesota.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies of this Software or works derived from this Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mapserver.h"
+#include "mapshape.h"
+#include "maptime.h"
+
+
+
+enum { BENCH_CLIPPOLYGON, BENCH_CLIPPOLYLINE, BENCH_SIMPLIFY, BENCH_LABELPOINT, BENCH_LABELPATH, BENCH_GEOS, BENCH_COUNT };
+static const char *bench_names[BENCH_COUNT] = { "msClipPolygonRect", "msClipPolylineRect", "msTransformShapeSimplify",
+                                                "msPolygonLabelPoint", "msPolylineLabelPath", "msGEOSShape2Geometry"
+                                              };
+static const char *bench_keys[BENCH_COUNT] = { "clippolygon", "clippolyline", "simplify", "labelpoint", "labelpath", "geos" };
+
+/* ---- the image the geometries are drawn on is this wide, in pixels ---- */
+#define BENCH_IMAGE_SIZE 1024
+
+typedef struct {
+  char *name;
+  int type; /* MS_SHAPE_POLYGON or MS_SHAPE_LINE */
+  shapeObj *shapes;
+  int numshapes;
+  long numvertices;
+  rectObj extent;
+} benchSetObj;
+
+/* ---- a small LCG so that the generated sets are reproducible ---- */
+static double bench_random(unsigned int *seed)
+{
+  *seed = *seed * 1103515245 + 12345;
+  return ((*seed >> 8) & 0xffffff) / (double) 0x1000000;
+}
+
+static void bench_add_shape(benchSetObj *set, shapeObj *shape)
+{
+  int i;
+
+  set->shapes = (shapeObj *) msSmallRealloc(set->shapes, sizeof(shapeObj) * (set->numshapes + 1));
+  msInitShape(&set->shapes[set->numshapes]);
+  msCopyShape(shape, &set->shapes[set->numshapes]);
+  msComputeBounds(&set->shapes[set->numshapes]);
+  if(set->numshapes == 0)
+    set->extent = set->shapes[0].bounds;
+  else
+    msMergeRect(&set->extent, &set->shapes[set->numshapes].bounds);
+  for(i=0; i<shape->numlines; i++)
+    set->numvertices += shape->line[i].numpoints;
+  set->numshapes++;
+}
+
+/*
+** Generated sets: star shaped polygons with a hole, numpoints vertices on
+** the outer ring, and wandering lines of numpoints vertices, scattered
+** over a 1000x1000 extent and overlapping each other.
+*/
+static void bench_generate(benchSetObj *set, int type, int numshapes, int numpoints)
+{
+  unsigned int seed = 1;
+  lineObj line;
+  int i, j;
+
+  memset(set, 0, sizeof(benchSetObj));
+  set->name = msStrdup(type == MS_SHAPE_POLYGON ? "generated polygons" : "generated lines");
+  set->type = type;
+
+  line.point = (pointObj *) msSmallMalloc(sizeof(pointObj) * (numpoints + 1));
+  for(i=0; i<numshapes; i++) {
+    shapeObj shape;
+    double cx = 1000 * bench_random(&seed), cy = 1000 * bench_random(&seed);
+    double radius = 50 + 100 * bench_random(&seed);
+
+    msInitShape(&shape);
+    shape.type = type;
+    if(type == MS_SHAPE_POLYGON) {
+      int ring;
+
+      for(ring=0; ring<2; ring++) { /* the outer ring clockwise, the hole counter clockwise */
+        int n = (ring == 0) ? numpoints : MS_MAX(3, numpoints / 4);
+        double scale = (ring == 0) ? 1 : 0.2;
+
+        line.numpoints = n + 1;
+        for(j=0; j<n; j++) {
+          double angle = (ring == 0 ? -2 : 2) * MS_PI * j / n;
+          double r = radius * scale * ((ring == 0) ? 0.5 + 0.5 * bench_random(&seed) : 1);
+
+          line.point[j].x = cx + r * cos(angle);
+          line.point[j].y = cy + r * sin(angle);
+        }
+        line.point[n] = line.point[0];
+        msAddLine(&shape, &line);
+      }
+    } else {
+      double x = cx, y = cy, step = radius * 4 / numpoints;
+      double heading = 2 * MS_PI * bench_random(&seed);
+
+      line.numpoints = numpoints;
+      for(j=0; j<numpoints; j++) {
+        heading += 0.1 * (bench_random(&seed) - 0.5);
+        x += step * cos(heading);
+        y += step * sin(heading);
+        line.point[j].x = x;
+        line.point[j].y = y;
+      }
+      msAddLine(&shape, &line);
+    }
+    bench_add_shape(set, &shape);
+    msFreeShape(&shape);
+  }
+  free(line.point);
+}
+
+static int bench_read_shapefile(benchSetObj *set, const char *filename)
+{
+  shapefileObj shpfile;
+  int i;
+
+  memset(set, 0, sizeof(benchSetObj));
+  if(msShapefileOpen(&shpfile, "rb", filename, MS_TRUE) == -1)
+    return MS_FAILURE;
+
+  set->name = msStrdup(filename);
+  set->type = MS_SHAPE_NULL;
+  for(i=0; i<shpfile.numshapes; i++) {
+    shapeObj shape;
+
+    msInitShape(&shape);
+    msSHPReadShape(shpfile.hSHP, i, &shape);
+    if((shape.type == MS_SHAPE_POLYGON || shape.type == MS_SHAPE_LINE) && shape.numlines > 0) {
+      set->type = shape.type;
+      bench_add_shape(set, &shape);
+    }
+    msFreeShape(&shape);
+  }
+  msShapefileClose(&shpfile);
+
+  if(set->numshapes == 0) {
+    msSetError(MS_SHPERR, "No line or polygon in %s.", "bench_read_shapefile()", filename);
+    return MS_FAILURE;
+  }
+  return MS_SUCCESS;
+}
+
+static double bench_elapsed(struct mstimeval *starttime)
+{
+  struct mstimeval endtime;
+
+  msGettimeofday(&endtime, NULL);
+  return (endtime.tv_sec - starttime->tv_sec) + (endtime.tv_usec - starttime->tv_usec) / 1000000.0;
+}
+
+/* ---- the lines of the set in the pixel space of a BENCH_IMAGE_SIZE wide image ---- */
+static shapeObj *bench_pixel_shapes(benchSetObj *set, double cellsize)
+{
+  shapeObj *shapes = (shapeObj *) msSmallMalloc(sizeof(shapeObj) * set->numshapes);
+  int i;
+
+  for(i=0; i<set->numshapes; i++) {
+    msInitShape(&shapes[i]);
+    msCopyShape(&set->shapes[i], &shapes[i]);
+    shapes[i].type = MS_SHAPE_LINE;
+    msTransformShapeToPixelDoublePrecision(&shapes[i], set->extent, cellsize);
+  }
+  return shapes;
+}
+
+/*
+** Runs one benchmark over the set, returns the seconds spent in the
+** measured function only: the copies of the shapes it modifies are made
+** beforehand. -1 if the benchmark doesn't apply to the set.
+*/
+static double run_bench(int what, benchSetObj *set, int iterations, mapObj *map, textSymbolObj *ts, labelObj *label)
+{
+  double elapsed = 0;
+  double cellsize = MS_MAX(set->extent.maxx - set->extent.minx, set->extent.maxy - set->extent.miny) / BENCH_IMAGE_SIZE;
+  rectObj cliprect;
+  shapeObj *copies = NULL;
+  struct mstimeval starttime;
+  int i, j;
+
+  if((what == BENCH_CLIPPOLYGON || what == BENCH_LABELPOINT) && set->type != MS_SHAPE_POLYGON)
+    return -1;
+  if(what == BENCH_LABELPATH && (set->type != MS_SHAPE_LINE || !map))
+    return -1;
+#ifndef USE_GEOS
+  if(what == BENCH_GEOS)
+    return -1;
+#endif
+
+  /* ---- the middle half of the extent, so that most shapes are clipped ---- */
+  cliprect.minx = set->extent.minx + (set->extent.maxx - set->extent.minx) / 4;
+  cliprect.maxx = set->extent.maxx - (set->extent.maxx - set->extent.minx) / 4;
+  cliprect.miny = set->extent.miny + (set->extent.maxy - set->extent.miny) / 4;
+  cliprect.maxy = set->extent.maxy - (set->extent.maxy - set->extent.miny) / 4;
+
+  if(what == BENCH_CLIPPOLYGON || what == BENCH_CLIPPOLYLINE || what == BENCH_SIMPLIFY)
+    copies = (shapeObj *) msSmallMalloc(sizeof(shapeObj) * set->numshapes);
+  else if(what == BENCH_LABELPATH)
+    copies = bench_pixel_shapes(set, cellsize);
+
+  for(i=0; i<iterations; i++) {
+    if(what == BENCH_CLIPPOLYGON || what == BENCH_CLIPPOLYLINE || what == BENCH_SIMPLIFY) {
+      for(j=0; j<set->numshapes; j++) {
+        msInitShape(&copies[j]);
+        msCopyShape(&set->shapes[j], &copies[j]);
+      }
+    }
+
+    msGettimeofday(&starttime, NULL);
+    switch(what) {
+      case BENCH_CLIPPOLYGON:
+        for(j=0; j<set->numshapes; j++)
+          msClipPolygonRect(&copies[j], cliprect);
+        break;
+      case BENCH_CLIPPOLYLINE:
+        for(j=0; j<set->numshapes; j++)
+          msClipPolylineRect(&copies[j], cliprect);
+        break;
+      case BENCH_SIMPLIFY:
+        for(j=0; j<set->numshapes; j++)
+          msTransformShapeSimplify(&copies[j], set->extent, cellsize);
+        break;
+      case BENCH_LABELPOINT:
+        for(j=0; j<set->numshapes; j++) {
+          pointObj labelpoint;
+          if(msPolygonLabelPoint(&set->shapes[j], &labelpoint, -1) != MS_SUCCESS)
+            break;
+        }
+        break;
+      case BENCH_LABELPATH: {
+        /* ---- only the resolution factor of the image is used ---- */
+        imageObj image;
+
+        memset(&image, 0, sizeof(imageObj));
+        image.resolutionfactor = 1;
+        for(j=0; j<set->numshapes; j++) {
+          struct polyline_lengths pll;
+          struct label_follow_result lfr;
+          int k;
+
+          memset(&lfr, 0, sizeof(lfr));
+          msPolylineComputeLineSegments(&copies[j], &pll);
+          msPolylineLabelPath(map, &image, &copies[j], &pll, ts, label, &lfr);
+          msPolylineFreeLineSegments(&copies[j], &pll);
+
+          for(k=0; k<lfr.num_follow_labels; k++) {
+            freeTextSymbol(lfr.follow_labels[k]);
+            free(lfr.follow_labels[k]);
+          }
+          free(lfr.follow_labels);
+          free(lfr.lar.angles);
+          free(lfr.lar.label_points);
+        }
+        break;
+      }
+      case BENCH_GEOS:
+        /* ---- msGEOSArea() converts the shape, the area costs next to nothing ---- */
+        for(j=0; j<set->numshapes; j++) {
+          msGEOSArea(&set->shapes[j]);
+          msGEOSFreeGeometry(&set->shapes[j]);
+        }
+        break;
+    }
+    elapsed += bench_elapsed(&starttime);
+
+    if(what == BENCH_CLIPPOLYGON || what == BENCH_CLIPPOLYLINE || what == BENCH_SIMPLIFY) {
+      for(j=0; j<set->numshapes; j++)
+        msFreeShape(&copies[j]);
+    }
+  }
+
+  if(what == BENCH_LABELPATH) {
+    for(j=0; j<set->numshapes; j++)
+      msFreeShape(&copies[j]);
+  }
+  free(copies);
+
+  return elapsed;
+}
+
+static void usage(void)
+{
+  fprintf(stderr,"Syntax: geombench [-n points] [-k shapes] [-i iterations] [-b benchmark] [-s shapefile] [-f fontset]\n");
+  fprintf(stderr,"  -n: vertices of the generated shapes (default 1000)\n");
+  fprintf(stderr,"  -k: number of generated shapes of each type (default 100)\n");
+  fprintf(stderr,"  -i: iterations over each set (default 10)\n");
+  fprintf(stderr,"  -b: only run this benchmark (clippolygon, clippolyline, simplify, labelpoint,\n");
+  fprintf(stderr,"      labelpath or geos), may be repeated\n");
+  fprintf(stderr,"  -s: also run over the lines or polygons of this shapefile, eg. tests/polygon.shp,\n");
+  fprintf(stderr,"      may be repeated\n");
+  fprintf(stderr,"  -f: fontset file, the labelpath benchmark follows the lines with the first font\n");
+  fprintf(stderr,"      (eg. tests/fonts.txt) and is skipped without one\n");
+  exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+  int numpoints = 1000, numgenerated = 100, iterations = 10;
+  int benches[BENCH_COUNT], anybench = MS_FALSE;
+  int numsets = 2, i, j;
+  benchSetObj *sets;
+  mapObj *map = NULL;
+  labelObj *label = NULL;
+  textSymbolObj ts;
+  char *fontset = NULL;
+
+  if(argc > 1 && strcmp(argv[1], "-v") == 0) {
+    printf("%s\n", msGetVersion());
+    exit(0);
+  }
+
+  if(msSetup() != MS_SUCCESS) {
+    msWriteError(stderr);
+    exit(1);
+  }
+
+  /* ---- there can't be more shapefiles than arguments ---- */
+  sets = (benchSetObj *) msSmallMalloc(sizeof(benchSetObj) * (argc + 2));
+  memset(benches, 0, sizeof(benches));
+
+  for(i=1; i<argc; i++) {
+    if(strcmp(argv[i], "-n") == 0 && i+1 < argc) {
+      numpoints = atoi(argv[++i]);
+    } else if(strcmp(argv[i], "-k") == 0 && i+1 < argc) {
+      numgenerated = atoi(argv[++i]);
+    } else if(strcmp(argv[i], "-i") == 0 && i+1 < argc) {
+      iterations = atoi(argv[++i]);
+    } else if(strcmp(argv[i], "-b") == 0 && i+1 < argc) {
+      i++;
+      for(j=0; j<BENCH_COUNT; j++) {
+        if(strcmp(argv[i], bench_keys[j]) == 0) break;
+      }
+      if(j == BENCH_COUNT) usage();
+      benches[j] = 1;
+      anybench = MS_TRUE;
+    } else if(strcmp(argv[i], "-s") == 0 && i+1 < argc) {
+      if(bench_read_shapefile(&sets[numsets], argv[++i]) != MS_SUCCESS) {
+        msWriteError(stderr);
+        exit(1);
+      }
+      numsets++;
+    } else if(strcmp(argv[i], "-f") == 0 && i+1 < argc) {
+      fontset = argv[++i];
+    } else {
+      usage();
+    }
+  }
+
+  if(numpoints < 4 || numgenerated < 1 || iterations < 1)
+    usage();
+  if(!anybench) {
+    for(j=0; j<BENCH_COUNT; j++)
+      benches[j] = 1;
+  }
+
+  if(fontset && benches[BENCH_LABELPATH]) {
+    map = msNewMapObj();
+    map->fontset.filename = msStrdup(fontset);
+    if(msLoadFontSet(&map->fontset, map) != MS_SUCCESS || map->fontset.numfonts == 0) {
+      msSetError(MS_IOERR, "No font loaded from %s.", "geombench", fontset);
+      msWriteError(stderr);
+      exit(1);
+    }
+
+    label = (labelObj *) msSmallMalloc(sizeof(labelObj));
+    initLabel(label);
+    label->font = msStrdup(msFirstKeyFromHashTable(&map->fontset.fonts));
+    label->size = 10;
+    label->anglemode = MS_FOLLOW;
+    label->repeatdistance = 200;
+    initTextSymbol(&ts);
+    msPopulateTextSymbolForLabelAndString(&ts, label, msStrdup("MapServer geometry benchmark"), 1, 1, duplicate_never);
+  }
+
+  bench_generate(&sets[0], MS_SHAPE_POLYGON, numgenerated, numpoints);
+  bench_generate(&sets[1], MS_SHAPE_LINE, numgenerated, numpoints);
+
+  printf("%d iteration(s)\n", iterations);
+
+  for(i=0; i<numsets; i++) {
+    printf("%s: %d shape(s), %ld vertices\n", sets[i].name, sets[i].numshapes, sets[i].numvertices);
+
+    for(j=0; j<BENCH_COUNT; j++) {
+      double elapsed;
+
+      if(!benches[j]) continue;
+
+      elapsed = run_bench(j, &sets[i], iterations, map, &ts, label);
+      if(elapsed < 0) continue;
+
+      printf("  %-26s %8.3fs, %12.0f vertices/s, %10.0f shapes/s\n", bench_names[j], elapsed,
+             elapsed > 0 ? sets[i].numvertices * iterations / elapsed : 0.0,
+             elapsed > 0 ? sets[i].numshapes * iterations / elapsed : 0.0);
+    }
+  }
+
+  if(benches[BENCH_LABELPATH] && !map)
+    printf("msPolylineLabelPath skipped, no fontset given (-f)\n");
+#ifndef USE_GEOS
+  if(benches[BENCH_GEOS])
+    printf("msGEOSShape2Geometry skipped, MapServer was built without GEOS\n");
+#endif
+
+  for(i=0; i<numsets; i++) {
+    for(j=0; j<sets[i].numshapes; j++)
+      msFreeShape(&sets[i].shapes[j]);
+    free(sets[i].shapes);
+    free(sets[i].name);
+  }
+  free(sets);
+  if(map) {
+    freeTextSymbol(&ts);
+    freeLabel(label);
+    free(label);
+    msFreeMap(map);
+  }
+  msCleanup();
+
+  return(0);
+}
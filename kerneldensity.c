@@ -27,21 +27,130 @@
  *****************************************************************************/
 
 #include "mapserver.h"
+#include "mapthread.h"
+#include "uthash.h"
 #include <float.h>
 #ifdef USE_GDAL
 
 #include "gdal.h"
 #include "cpl_string.h"
 
-void gaussian_blur(float *values, int width, int height, int radius) {
+/*
+** Large radii use the recursive gaussian filter of Young and van Vliet, whose
+** cost per pixel does not depend on the radius. Rows and then bands of
+** columns are filtered as independent tasks, in several threads when map
+** CONFIG "MS_DRAW_THREADS" allows it.
+*/
+#define KD_RECURSIVE_MINRADIUS 20
+
+typedef struct {
+  float *values, *tmp;
+  int width, height;
+  int start, end; /* rows of the horizontal pass, columns of the vertical one */
+  int vertical;
+  double B, b[3];
+} blurTaskObj;
+
+static void recursive_blur_task(void *vtask) {
+  blurTaskObj *task = (blurTaskObj*)vtask;
+  int width = task->width, height = task->height;
+  double B = task->B, b0 = task->b[0], b1 = task->b[1], b2 = task->b[2];
+  int x,y;
+
+  if(!task->vertical) {
+    double *w = (double*)msSmallMalloc(width*sizeof(double));
+    for(y=task->start; y<task->end; y++) {
+      float *row = task->values + width*y;
+      double w1 = 0, w2 = 0, w3 = 0;
+      for(x=0; x<width; x++) {
+        w[x] = B*row[x] + b0*w1 + b1*w2 + b2*w3;
+        w3 = w2; w2 = w1; w1 = w[x];
+      }
+      w1 = w2 = w3 = 0;
+      for(x=width-1; x>=0; x--) {
+        double v = B*w[x] + b0*w1 + b1*w2 + b2*w3;
+        row[x] = v;
+        w3 = w2; w2 = w1; w1 = v;
+      }
+    }
+    free(w);
+  } else {
+    /* sweep a band of columns down and back up, keeping the filter state of each column */
+    int ncols = task->end - task->start;
+    double *state = (double*)msSmallCalloc(3*ncols, sizeof(double));
+    double *w1 = state, *w2 = state + ncols, *w3 = state + 2*ncols;
+    float *values = task->values + task->start, *tmp = task->tmp + task->start;
+    for(y=0; y<height; y++) {
+      float *in = values + width*y, *out = tmp + width*y;
+      for(x=0; x<ncols; x++) {
+        double v = B*in[x] + b0*w1[x] + b1*w2[x] + b2*w3[x];
+        out[x] = v;
+        w3[x] = w2[x]; w2[x] = w1[x]; w1[x] = v;
+      }
+    }
+    memset(state, 0, 3*ncols*sizeof(double));
+    for(y=height-1; y>=0; y--) {
+      float *in = tmp + width*y, *out = values + width*y;
+      for(x=0; x<ncols; x++) {
+        double v = B*in[x] + b0*w1[x] + b1*w2[x] + b2*w3[x];
+        out[x] = v;
+        w3[x] = w2[x]; w2[x] = w1[x]; w1[x] = v;
+      }
+    }
+    free(state);
+  }
+}
+
+static void recursive_gaussian_blur(float *values, int width, int height, int radius, int numthreads) {
   float *tmp = (float*)msSmallMalloc(width*height*sizeof(float));
+  int numtasks = MS_MAX(1, MS_MIN(numthreads, 64)) * 4;
+  blurTaskObj *tasks = (blurTaskObj*)msSmallMalloc(numtasks*sizeof(blurTaskObj));
+  void **taskptrs = (void**)msSmallMalloc(numtasks*sizeof(void*));
+  double sigma = radius/3.0, q, b0;
+  int pass,i;
+
+  q = 0.98711*sigma - 0.96330; /* sigma is above 2.5 */
+  b0 = 1.57825 + 2.44413*q + 1.4281*q*q + 0.422205*q*q*q;
+
+  for(pass=0; pass<2; pass++) {
+    int n = pass ? width : height;
+    for(i=0; i<numtasks; i++) {
+      tasks[i].values = values;
+      tasks[i].tmp = tmp;
+      tasks[i].width = width;
+      tasks[i].height = height;
+      tasks[i].start = (int)((long)n*i/numtasks);
+      tasks[i].end = (int)((long)n*(i+1)/numtasks);
+      tasks[i].vertical = pass;
+      tasks[i].b[0] = (2.44413*q + 2.85619*q*q + 1.26661*q*q*q)/b0;
+      tasks[i].b[1] = -(1.4281*q*q + 1.26661*q*q*q)/b0;
+      tasks[i].b[2] = 0.422205*q*q*q/b0;
+      tasks[i].B = 1 - (tasks[i].b[0] + tasks[i].b[1] + tasks[i].b[2]);
+      taskptrs[i] = &tasks[i];
+    }
+    msThreadPoolRun(recursive_blur_task, taskptrs, numtasks, numthreads);
+  }
+  free(tmp);
+  free(tasks);
+  free(taskptrs);
+}
+
+static void gaussian_blur(float *values, int width, int height, int radius, int numthreads) {
+  float *tmp;
   int length = radius*2+1;
-  float *kernel = (float*)msSmallMalloc(length*sizeof(float));
+  float *kernel;
   float sigma=radius/3.0;
 	float a=1.0/ sqrt(2.0*M_PI*sigma*sigma);
 	float den=2.0*sigma*sigma;
 	int i,x,y;
 
+  if(radius >= KD_RECURSIVE_MINRADIUS) {
+    recursive_gaussian_blur(values, width, height, radius, numthreads);
+    return;
+  }
+
+  tmp = (float*)msSmallMalloc(width*height*sizeof(float));
+  kernel = (float*)msSmallMalloc(length*sizeof(float));
 	for (i=0; i<length; i++) {
 	  float x=i - radius;
 	  float v=a * exp(-(x*x) / den);
@@ -79,15 +188,273 @@ void gaussian_blur(float *values, int width, int height, int radius) {
 }
 
 
+/*
+** With PROCESSING "KERNELDENSITY_CACHE_TTL=seconds", the blurred density is
+** computed on a grid of KD_CACHE_CELL pixel cells aligned on multiples of the
+** cellsize, each from the samples of the cell and its radius wide margin. The
+** cells are kept in a process wide LRU keyed on the map, sample layer, radius
+** and resolution, and are recomputed once older than the TTL. Tiles of a same
+** zoom level then reuse the density of the cells they overlap. The static
+** structures are protected by the TLOCK_KERNELDENSITY mutex.
+*/
+#define KD_CACHE_CELL 256
+#define KD_CACHE_MAX 64
+
+typedef struct {
+  char *key;
+  float *values; /* KD_CACHE_CELL*KD_CACHE_CELL, NULL if the cell has no sample */
+  time_t expires;
+  UT_hash_handle hh;
+} kernelDensityCacheObj;
+
+static kernelDensityCacheObj *kernelDensityCache = NULL;
+static int kernelDensityCacheCount = 0;
+
+static void msKernelDensityCacheFree(kernelDensityCacheObj *entry) {
+  UT_HASH_DEL(kernelDensityCache, entry);
+  free(entry->key);
+  free(entry->values);
+  free(entry);
+  kernelDensityCacheCount--;
+}
+
+void msKernelDensityCacheCleanup(void) {
+  msAcquireLock(TLOCK_KERNELDENSITY);
+  while(kernelDensityCache)
+    msKernelDensityCacheFree(kernelDensityCache);
+  msReleaseLock(TLOCK_KERNELDENSITY);
+}
+
+/*
+** Accumulate the weights of the samples of layer found in searchrect (in map
+** coordinates) into the width*height grid of map->cellsize pixels whose top
+** left corner is at (minx,maxy). The grid is allocated on the first sample.
+*/
+static int kernelDensityReadSamples(mapObj *map, layerObj *layer, int *classgroup, int nclasses,
+                                     rectObj searchrect, double minx, double maxy,
+                                     float **values, int width, int height, int *have_sample) {
+  int status;
+  shapeObj shape;
+  double invcellsize = 1.0 / map->cellsize;
+
+#ifdef USE_PROJ
+  if(layer->project)
+    msProjectRect(&map->projection, &layer->projection, &searchrect); /* project the searchrect to source coords */
+#endif
+
+  status = msLayerWhichShapes(layer, searchrect, MS_FALSE);
+  if(status == MS_DONE) /* nothing to do */
+    return MS_SUCCESS;
+  if(status != MS_SUCCESS)
+    return MS_FAILURE;
+
+  msInitShape(&shape);
+  while((status = msLayerNextShape(layer, &shape)) == MS_SUCCESS) {
+    int l,p,s,c;
+    double weight = 1.0;
+    if(!*values) /* defer allocation until we effectively have a feature */
+      *values = (float*) msSmallCalloc(width * height, sizeof(float));
+#ifdef USE_PROJ
+    if(layer->project)
+      msProjectShape(&layer->projection, &map->projection, &shape);
+#endif
+
+    /* the weight for the sample is set to 1.0 by default. If the
+     * layer has some classes defined, we will read the weight from
+     * the class->style->size (which can be binded to an attribute)
+     */
+    if(layer->numclasses > 0) {
+      c = msShapeGetClass(layer, map, &shape, classgroup, nclasses);
+      if((c == -1) || (layer->class[c]->status == MS_OFF)) {
+        goto nextshape; /* no class matched, skip */
+      }
+      for (s = 0; s < layer->class[c]->numstyles; s++) {
+        if (msScaleInBounds(map->scaledenom,
+                layer->class[c]->styles[s]->minscaledenom,
+                layer->class[c]->styles[s]->maxscaledenom)) {
+          if(layer->class[c]->styles[s]->bindings[MS_STYLE_BINDING_SIZE].index != -1) {
+            weight = atof(shape.values[layer->class[c]->styles[s]->bindings[MS_STYLE_BINDING_SIZE].index]);
+          } else {
+            weight = layer->class[c]->styles[s]->size;
+          }
+          break;
+        }
+      }
+      if(s == layer->class[c]->numstyles) {
+        /* no style in scale bounds */
+        goto nextshape;
+      }
+    }
+    for(l=0; l<shape.numlines; l++) {
+      for(p=0; p<shape.line[l].numpoints; p++) {
+        int x = MS_MAP2IMAGE_XCELL_IC(shape.line[l].point[p].x, minx, invcellsize);
+        int y = MS_MAP2IMAGE_YCELL_IC(shape.line[l].point[p].y, maxy, invcellsize);
+        if(x>=0 && y>=0 && x<width && y<height) {
+          float *value = *values + y * width + x;
+          (*value) += weight;
+          *have_sample = 1;
+        }
+      }
+    }
+
+    nextshape:
+    msFreeShape(&shape);
+  }
+  return MS_SUCCESS;
+}
+
+/*
+** Blurred density of cache cell (cx,cy), whose first pixel is at
+** (cx*cellsize, -cy*cellsize). *cell is set to NULL if the cell has no sample.
+*/
+static int kernelDensityComputeCell(mapObj *map, layerObj *layer, int *classgroup, int nclasses,
+                                    int radius, int cx, int cy, int numthreads, float **cell) {
+  int size = KD_CACHE_CELL + 2*radius, have_sample = 0, j;
+  double minx = ((double)cx*KD_CACHE_CELL - radius) * map->cellsize;
+  double maxy = -((double)cy*KD_CACHE_CELL - radius) * map->cellsize;
+  float *values = NULL;
+  rectObj searchrect;
+
+  searchrect.minx = minx;
+  searchrect.maxx = minx + size * map->cellsize;
+  searchrect.maxy = maxy;
+  searchrect.miny = maxy - size * map->cellsize;
+  *cell = NULL;
+  if(kernelDensityReadSamples(map, layer, classgroup, nclasses, searchrect, minx, maxy,
+                              &values, size, size, &have_sample) != MS_SUCCESS) {
+    free(values);
+    return MS_FAILURE;
+  }
+
+  if(have_sample) {
+    gaussian_blur(values, size, size, radius, numthreads);
+    *cell = (float*) msSmallMalloc(KD_CACHE_CELL * KD_CACHE_CELL * sizeof(float));
+    for(j=0; j<KD_CACHE_CELL; j++)
+      memcpy(*cell + j*KD_CACHE_CELL, values + (j+radius)*size + radius, KD_CACHE_CELL * sizeof(float));
+  }
+  free(values);
+  return MS_SUCCESS;
+}
+
+/* copy the part of a cache cell overlapping the grid starting at global pixel (gx,gy) */
+static void kernelDensityCopyCell(const float *cell, int cx, int cy,
+                                  float *values, double gx, double gy, int width, int height) {
+  double x0 = MS_MAX(gx, (double)cx*KD_CACHE_CELL), x1 = MS_MIN(gx + width, ((double)cx+1)*KD_CACHE_CELL);
+  double y0 = MS_MAX(gy, (double)cy*KD_CACHE_CELL), y1 = MS_MIN(gy + height, ((double)cy+1)*KD_CACHE_CELL);
+  int dst_x = (int)(x0 - gx), src_x = (int)(x0 - (double)cx*KD_CACHE_CELL), n = (int)(x1 - x0);
+  int dst_y = (int)(y0 - gy), src_y = (int)(y0 - (double)cy*KD_CACHE_CELL), j;
+
+  for(j=0; j<(int)(y1 - y0); j++)
+    memcpy(values + (dst_y+j)*width + dst_x, cell + (src_y+j)*KD_CACHE_CELL + src_x, n * sizeof(float));
+}
+
+/*
+** Fill the width*height grid of blurred density starting at global pixel
+** (gx,gy) from the cache cells, computing the missing or expired ones.
+*/
+static int kernelDensityCachedValues(mapObj *map, layerObj *kerneldensity_layer, layerObj *layer,
+                                     int *classgroup, int nclasses, int radius, int ttl,
+                                     double gx, double gy, int width, int height,
+                                     int numthreads, float **values, int *have_sample) {
+  char *keybase, *projstring, buf[64];
+  int cx, cy;
+
+  *values = (float*) msSmallCalloc(width * height, sizeof(float));
+
+  keybase = msStringConcatenate(NULL, map->mappath);
+  keybase = msStringConcatenate(keybase, "|");
+  keybase = msStringConcatenate(keybase, map->name);
+  keybase = msStringConcatenate(keybase, "|");
+  keybase = msStringConcatenate(keybase, layer->name);
+  keybase = msStringConcatenate(keybase, "|");
+  keybase = msStringConcatenate(keybase, layer->data);
+  keybase = msStringConcatenate(keybase, "|");
+  keybase = msStringConcatenate(keybase, layer->filter.string);
+  keybase = msStringConcatenate(keybase, "|");
+  projstring = msGetProjectionString(&map->projection);
+  keybase = msStringConcatenate(keybase, projstring);
+  msFree(projstring);
+  sprintf(buf, "|%d|%.17g", radius, map->cellsize);
+  keybase = msStringConcatenate(keybase, buf);
+
+  for(cy = (int)floor(gy / KD_CACHE_CELL); cy <= (int)floor((gy + height - 1) / KD_CACHE_CELL); cy++) {
+    for(cx = (int)floor(gx / KD_CACHE_CELL); cx <= (int)floor((gx + width - 1) / KD_CACHE_CELL); cx++) {
+      kernelDensityCacheObj *entry = NULL;
+      float *cell = NULL;
+      char *key = (char*) msSmallMalloc(strlen(keybase) + 32);
+
+      sprintf(key, "%s|%d,%d", keybase, cx, cy);
+
+      msAcquireLock(TLOCK_KERNELDENSITY);
+      UT_HASH_FIND_STR(kernelDensityCache, key, entry);
+      if(entry && entry->expires <= time(NULL)) {
+        msKernelDensityCacheFree(entry);
+        entry = NULL;
+      }
+      if(entry) {
+        /* most recently used last */
+        UT_HASH_DEL(kernelDensityCache, entry);
+        UT_HASH_ADD_KEYPTR(hh, kernelDensityCache, entry->key, strlen(entry->key), entry);
+        if(entry->values) {
+          kernelDensityCopyCell(entry->values, cx, cy, *values, gx, gy, width, height);
+          *have_sample = 1;
+        }
+        msReleaseLock(TLOCK_KERNELDENSITY);
+        free(key);
+        continue;
+      }
+      msReleaseLock(TLOCK_KERNELDENSITY);
+
+      if(kernelDensityComputeCell(map, layer, classgroup, nclasses, radius, cx, cy,
+                                  numthreads, &cell) != MS_SUCCESS) {
+        free(key);
+        free(keybase);
+        return MS_FAILURE;
+      }
+      if(cell) {
+        kernelDensityCopyCell(cell, cx, cy, *values, gx, gy, width, height);
+        *have_sample = 1;
+      }
+
+      msAcquireLock(TLOCK_KERNELDENSITY);
+      UT_HASH_FIND_STR(kernelDensityCache, key, entry);
+      if(!entry) {
+        if(kernelDensityCacheCount >= KD_CACHE_MAX)
+          msKernelDensityCacheFree(kernelDensityCache); /* the least recently used */
+        entry = (kernelDensityCacheObj*) msSmallMalloc(sizeof(kernelDensityCacheObj));
+        entry->key = key;
+        entry->values = cell;
+        entry->expires = time(NULL) + ttl;
+        UT_HASH_ADD_KEYPTR(hh, kernelDensityCache, entry->key, strlen(entry->key), entry);
+        kernelDensityCacheCount++;
+        key = NULL;
+        cell = NULL;
+      }
+      msReleaseLock(TLOCK_KERNELDENSITY);
+
+      /* another thread got there first */
+      free(cell);
+      free(key);
+    }
+  }
+
+  if(kerneldensity_layer->debug >= MS_DEBUGLEVEL_V)
+    msDebug("msComputeKernelDensityDataset(%s): %d cached density cells\n",
+            kerneldensity_layer->name, kernelDensityCacheCount);
+
+  free(keybase);
+  return MS_SUCCESS;
+}
+
+
 int msComputeKernelDensityDataset(mapObj *map, imageObj *image, layerObj *kerneldensity_layer, void **hDSvoid, void **cleanup_ptr) {
 
   int status,layer_idx, i,j, nclasses=0, have_sample=0;
   rectObj searchrect;
-  shapeObj shape;
   layerObj *layer = NULL;
   float *values = NULL;
   int radius = 10, im_width = image->width, im_height = image->height;
-  int expand_searchrect=1;
+  int expand_searchrect=1, cache_ttl=0, numthreads=1;
   float normalization_scale=0.0;
   double invcellsize = 1.0 / map->cellsize, georadius=0;
   float valmax=FLT_MIN, valmin=FLT_MAX;
@@ -127,6 +494,13 @@ int msComputeKernelDensityDataset(mapObj *map, imageObj *image, layerObj *kernel
     }
   }
 
+  pszProcessing = msLayerGetProcessingKey( kerneldensity_layer, "KERNELDENSITY_CACHE_TTL" );
+  if(pszProcessing)
+    cache_ttl = atoi(pszProcessing);
+
+  if(msGetConfigOption(map, "MS_DRAW_THREADS"))
+    numthreads = atoi(msGetConfigOption(map, "MS_DRAW_THREADS"));
+
   layer_idx = msGetLayerIndex(map,kerneldensity_layer->connection);
   if(layer_idx == -1) {
     int nLayers, *aLayers;
@@ -182,81 +556,39 @@ int msComputeKernelDensityDataset(mapObj *map, imageObj *image, layerObj *kernel
 
 #ifdef USE_PROJ
   layer->project = msProjectionsDiffer(&(layer->projection), &(map->projection));
-  if(layer->project)
-    msProjectRect(&map->projection, &layer->projection, &searchrect); /* project the searchrect to source coords */
 #endif
 
-  status = msLayerWhichShapes(layer, searchrect, MS_FALSE);
-    /* nothing to do */
-  if(status == MS_SUCCESS) { /* at least one sample may have overlapped */
-    
-    if(layer->classgroup && layer->numclasses > 0)
-      classgroup = msAllocateValidClassGroups(layer, &nclasses);
-    
-    msInitShape(&shape);
-    while((status = msLayerNextShape(layer, &shape)) == MS_SUCCESS) {
-      int l,p,s,c;
-      double weight = 1.0;
-      if(!values) /* defer allocation until we effectively have a feature */
-        values = (float*) msSmallCalloc(im_width * im_height, sizeof(float));
-#ifdef USE_PROJ
-      if(layer->project)
-        msProjectShape(&layer->projection, &map->projection, &shape);
-#endif
-      
-      /* the weight for the sample is set to 1.0 by default. If the
-       * layer has some classes defined, we will read the weight from
-       * the class->style->size (which can be binded to an attribute)
-       */
-      if(layer->numclasses > 0) {
-        c = msShapeGetClass(layer, map, &shape, classgroup, nclasses);
-        if((c == -1) || (layer->class[c]->status == MS_OFF)) {
-          goto nextshape; /* no class matched, skip */
-        }
-        for (s = 0; s < layer->class[c]->numstyles; s++) {
-          if (msScaleInBounds(map->scaledenom,
-                  layer->class[c]->styles[s]->minscaledenom,
-                  layer->class[c]->styles[s]->maxscaledenom)) {
-            if(layer->class[c]->styles[s]->bindings[MS_STYLE_BINDING_SIZE].index != -1) {
-              weight = atof(shape.values[layer->class[c]->styles[s]->bindings[MS_STYLE_BINDING_SIZE].index]);
-            } else {
-              weight = layer->class[c]->styles[s]->size;
-            }
-            break;
-          }
-        }
-        if(s == layer->class[c]->numstyles) {
-          /* no style in scale bounds */
-          goto nextshape;
-        }
-      }
-      for(l=0; l<shape.numlines; l++) {
-        for(p=0; p<shape.line[l].numpoints; p++) {
-          int x = MS_MAP2IMAGE_XCELL_IC(shape.line[l].point[p].x, map->extent.minx - georadius, invcellsize);
-          int y = MS_MAP2IMAGE_YCELL_IC(shape.line[l].point[p].y, map->extent.maxy + georadius, invcellsize);
-          if(x>=0 && y>=0 && x<im_width && y<im_height) {
-            float *value = values + y * im_width + x;
-            (*value) += weight;
-            have_sample = 1;
-          }
-        }
-      }
-      
-      nextshape:
-      msFreeShape(&shape);
-    }
-  } else if(status != MS_DONE) {
-    msLayerClose(layer);
-    return MS_FAILURE;
+  if(layer->classgroup && layer->numclasses > 0)
+    classgroup = msAllocateValidClassGroups(layer, &nclasses);
+
+  /* the cells are only meaningful for georeferenced samples with their margin */
+  if(layer->transform != MS_TRUE || !expand_searchrect)
+    cache_ttl = 0;
+
+  if(cache_ttl > 0) {
+    /* global pixel of the top left corner of the expanded grid */
+    double gx = floor(map->extent.minx * invcellsize + 0.5) - radius;
+    double gy = floor(-map->extent.maxy * invcellsize + 0.5) - radius;
+    status = kernelDensityCachedValues(map, kerneldensity_layer, layer, classgroup, nclasses,
+                                       radius, cache_ttl, gx, gy, im_width, im_height,
+                                       numthreads, &values, &have_sample);
+  } else {
+    status = kernelDensityReadSamples(map, layer, classgroup, nclasses, searchrect,
+                                      map->extent.minx - georadius, map->extent.maxy + georadius,
+                                      &values, im_width, im_height, &have_sample);
   }
-  
-  /* status == MS_DONE */
+
+  msFree(classgroup);
   msLayerClose(layer);
-  status = MS_SUCCESS;
+  if(status != MS_SUCCESS) {
+    free(values);
+    return MS_FAILURE;
+  }
 
 
   if(have_sample) { /* no use applying the filtering kernel if we have no samples */
-    gaussian_blur(values,im_width, im_height, radius);
+    if(cache_ttl <= 0) /* cached cells are already blurred */
+      gaussian_blur(values,im_width, im_height, radius, numthreads);
 
     if(normalization_scale == 0.0) {   /* auto normalization */
       for (j=radius; j<im_height-radius; j++) {
@@ -339,6 +671,9 @@ int msComputeKernelDensityDataset(mapObj *map, imageObj *image, layerObj *layer,
     return MS_FAILURE;
 }
 
+void msKernelDensityCacheCleanup(void) {
+}
+
 #endif
 
 int msCleanupKernelDensityDataset(mapObj *map, imageObj *image, layerObj *layer, void *cleanup_ptr) {
@@ -111,6 +111,17 @@ public:
   aggRendererCache(): m_fman(m_feng) {}
 };
 
+/* number of prerendered hatch tiles kept per image, and their largest side */
+#define AGG_HATCH_TILES 8
+#define AGG_HATCH_TILE_MAXSIZE 256
+
+/* a hatch rendered once into a tile that repeats it exactly, see msHatchPolygon() */
+typedef struct {
+  double angle, spacing, width, gamma;
+  colorObj color;
+  imageObj *tile;
+} hatchTileObj;
+
 class AGG2Renderer
 {
 public:
@@ -125,6 +136,10 @@ public:
     stroke = NULL;
     dash = NULL;
     stroke_dash = NULL;
+    for(int i=0; i<AGG_HATCH_TILES; i++) {
+      hatchtiles[i].tile = NULL;
+    }
+    nexthatchtile = 0;
   }
 
   ~AGG2Renderer() {
@@ -162,6 +177,8 @@ public:
   mapserver::conv_stroke<mapserver::conv_dash<line_adaptor> > *stroke_dash;
   double default_gamma;
   mapserver::gamma_linear gamma_function;
+  hatchTileObj hatchtiles[AGG_HATCH_TILES];
+  int nexthatchtile; /* slot replaced by the next hatch tile, round robin */
 };
 
 #define AGG_RENDERER(image) ((AGG2Renderer*) (image)->img.plugin)
@@ -560,12 +577,113 @@ int agg2RenderPolygonTiled(imageObj *img, shapeObj *p, imageObj * tile)
   return MS_SUCCESS;
 }
 
+/* rasterize a glyph, or the outline contour around it, once per quarter pixel offset and keep its coverage spans */
+static bitmap_element* aggGetGlyphBitmap(glyphObj *gl, int subx, int suby, int ow)
+{
+  int subpixel = subx + MS_GLYPH_SUBPIXELS * suby;
+  bitmap_element *bm = msGetGlyphBitmap(gl->face, gl->glyph, subpixel, ow);
+  if(!bm) {
+    mapserver::path_storage glyph;
+    mapserver::trans_affine trans;
+    rasterizer_scanline ras;
+    mapserver::scanline_u8 sl;
+    bitmap_span *spans = NULL;
+    unsigned char *covers = NULL;
+    int numspans = 0, numcovers = 0;
+    outline_element *ol = msGetGlyphOutline(gl->face,gl->glyph);
+    if(!ol) {
+      return NULL;
+    }
+    trans.translate((double)subx / MS_GLYPH_SUBPIXELS, (double)suby / MS_GLYPH_SUBPIXELS);
+    decompose_ft_outline(ol->outline,true,trans,glyph);
+    mapserver::conv_curve<mapserver::path_storage> curves(glyph);
+    ras.filling_rule(mapserver::fill_non_zero);
+    if(ow) {
+      mapserver::conv_contour<mapserver::conv_curve<mapserver::path_storage> > cc(curves);
+      cc.width(ow);
+      ras.add_path(cc);
+    } else {
+      ras.add_path(curves);
+    }
+
+    /* count the spans first, then copy them */
+    if(ras.rewind_scanlines()) {
+      sl.reset(ras.min_x(), ras.max_x());
+      while(ras.sweep_scanline(sl)) {
+        unsigned num_spans = sl.num_spans();
+        mapserver::scanline_u8::const_iterator span = sl.begin();
+        for(; num_spans; --num_spans, ++span) {
+          numspans++;
+          numcovers += span->len;
+        }
+      }
+      spans = (bitmap_span*)msSmallMalloc(MS_MAX(1,numspans) * sizeof(bitmap_span));
+      covers = (unsigned char*)msSmallMalloc(MS_MAX(1,numcovers));
+      numspans = numcovers = 0;
+      ras.rewind_scanlines();
+      sl.reset(ras.min_x(), ras.max_x());
+      while(ras.sweep_scanline(sl)) {
+        unsigned num_spans = sl.num_spans();
+        mapserver::scanline_u8::const_iterator span = sl.begin();
+        for(; num_spans; --num_spans, ++span) {
+          spans[numspans].x = span->x;
+          spans[numspans].y = sl.y();
+          spans[numspans].len = span->len;
+          spans[numspans].offset = numcovers;
+          memcpy(covers + numcovers, span->covers, span->len);
+          numcovers += span->len;
+          numspans++;
+        }
+      }
+    }
+    bm = msAddGlyphBitmap(gl->face, gl->glyph, subpixel, ow, numspans, spans, covers);
+  }
+  return bm;
+}
+
+/* draw horizontal glyphs as blits of their cached coverage, returns MS_FAILURE if a glyph could not be rasterized */
+static int agg2RenderGlyphsBitmap(AGG2Renderer *r, textPathObj *tp, colorObj *c, int ow)
+{
+  color_type color = aggColor(c);
+  for(int i=0; i<tp->numglyphs; i++) {
+    glyphObj *gl  = tp->glyphs + i;
+    double qx = floor(gl->pnt.x * MS_GLYPH_SUBPIXELS + 0.5);
+    double qy = floor(gl->pnt.y * MS_GLYPH_SUBPIXELS + 0.5);
+    int ix = (int)floor(qx / MS_GLYPH_SUBPIXELS);
+    int iy = (int)floor(qy / MS_GLYPH_SUBPIXELS);
+    bitmap_element *bm = aggGetGlyphBitmap(gl, (int)(qx - ix * MS_GLYPH_SUBPIXELS), (int)(qy - iy * MS_GLYPH_SUBPIXELS), ow);
+    if(!bm) {
+      return MS_FAILURE;
+    }
+    for(int j=0; j<bm->numspans; j++) {
+      bitmap_span *span = bm->spans + j;
+      r->m_renderer_base.blend_solid_hspan(ix + span->x, iy + span->y, span->len, color, bm->covers + span->offset);
+    }
+  }
+  return MS_SUCCESS;
+}
+
 int agg2RenderGlyphsPath(imageObj *img, textPathObj *tp, colorObj *c, colorObj *oc, int ow) {
   mapserver::path_storage glyphs;
   mapserver::trans_affine trans;
   AGG2Renderer *r = AGG_RENDERER(img);
+  int i;
+
+  /* unrotated glyphs in opaque colors are blitted from the glyph bitmap cache, overlapping
+   * glyphs and outlines would otherwise be blended twice where they overlap */
+  for(i=0; i<tp->numglyphs; i++) {
+    if(tp->glyphs[i].rot != 0) break;
+  }
+  if(i == tp->numglyphs && (!c || c->alpha == 255) && (!oc || oc->alpha == 255)) {
+    if(oc && agg2RenderGlyphsBitmap(r, tp, oc, ow + 1) != MS_SUCCESS)
+      return MS_FAILURE;
+    if(c && agg2RenderGlyphsBitmap(r, tp, c, 0) != MS_SUCCESS)
+      return MS_FAILURE;
+    return MS_SUCCESS;
+  }
+
   r->m_rasterizer_aa.filling_rule(mapserver::fill_non_zero);
-  for(int i=0; i<tp->numglyphs; i++) {
+  for(i=0; i<tp->numglyphs; i++) {
     glyphObj *gl  = tp->glyphs + i;
     trans.reset();
     trans.rotate(-gl->rot);
@@ -697,6 +815,94 @@ int agg2RenderPixmapSymbol(imageObj *img, double x, double y, symbolObj *symbol,
   return MS_SUCCESS;
 }
 
+/* the symbol path is built once and only transformed for each marker */
+int agg2RenderVectorSymbols(imageObj *img, int numpoints, pointObj *points, double *rotations,
+                            symbolObj *symbol, symbolStyleObj * style)
+{
+  AGG2Renderer *r = AGG_RENDERER(img);
+  double ox = symbol->sizex * 0.5;
+  double oy = symbol->sizey * 0.5;
+  mapserver::path_storage path = imageVectorSymbol(symbol);
+
+  for(int i=0; i<numpoints; i++) {
+    mapserver::trans_affine mtx;
+    mtx *= mapserver::trans_affine_translation(-ox,-oy);
+    mtx *= mapserver::trans_affine_scaling(style->scale);
+    mtx *= mapserver::trans_affine_rotation(-rotations[i]);
+    mtx *= mapserver::trans_affine_translation(points[i].x, points[i].y);
+    mapserver::conv_transform<mapserver::path_storage> marker(path, mtx);
+    if (style->color) {
+      r->m_rasterizer_aa.reset();
+      r->m_rasterizer_aa.filling_rule(mapserver::fill_even_odd);
+      r->m_rasterizer_aa.add_path(marker);
+      r->m_renderer_scanline.color(aggColor(style->color));
+      mapserver::render_scanlines(r->m_rasterizer_aa, r->sl_poly, r->m_renderer_scanline);
+    }
+    if(style->outlinecolor) {
+      r->m_rasterizer_aa.reset();
+      r->m_rasterizer_aa.filling_rule(mapserver::fill_non_zero);
+      r->m_renderer_scanline.color(aggColor(style->outlinecolor));
+      mapserver::conv_stroke<mapserver::conv_transform<mapserver::path_storage> > stroke(marker);
+      stroke.width(style->outlinewidth);
+      r->m_rasterizer_aa.add_path(stroke);
+      mapserver::render_scanlines(r->m_rasterizer_aa, r->sl_poly, r->m_renderer_scanline);
+    }
+  }
+  return MS_SUCCESS;
+}
+
+/* markers sharing the rotation of the previous one reuse its transform and span generator */
+int agg2RenderPixmapSymbols(imageObj *img, int numpoints, pointObj *points, double *rotations,
+                            symbolObj *symbol, symbolStyleObj * style)
+{
+  AGG2Renderer *r = AGG_RENDERER(img);
+  rasterBufferObj *pixmap = symbol->pixmap_buffer;
+  assert(pixmap->type == MS_BUFFER_BYTE_RGBA);
+  rendering_buffer b(pixmap->data.rgba.pixels,pixmap->width,pixmap->height,pixmap->data.rgba.row_step);
+  pixel_format pf(b);
+  typedef mapserver::span_interpolator_linear<> interpolator_type;
+  typedef mapserver::span_image_filter_rgba_bilinear_clip<pixel_format, interpolator_type> span_gen_type;
+  mapserver::trans_affine image_mtx, rotation_mtx;
+  interpolator_type interpolator(image_mtx);
+  span_gen_type sg(pf, mapserver::rgba(0,0,0,0), interpolator);
+  mapserver::span_allocator<color_type> sa;
+  int ims_2 = MS_NINT(MS_MAX(pixmap->width,pixmap->height)*style->scale*1.415)/2+1;
+  double rotation = 0;
+  int have_rotation = 0;
+
+  r->m_rasterizer_aa.filling_rule(mapserver::fill_non_zero);
+  for(int i=0; i<numpoints; i++) {
+    double x = points[i].x, y = points[i].y;
+    if ( (rotations[i] != 0 && rotations[i] != MS_PI*2.)|| style->scale != 1) {
+      mapserver::path_storage pixmap_bbox;
+      if(!have_rotation || rotations[i] != rotation) {
+        rotation = rotations[i];
+        have_rotation = 1;
+        rotation_mtx.reset();
+        rotation_mtx *= mapserver::trans_affine_translation(-(pf.width()/2.),-(pf.height()/2.));
+        /*agg angles are antitrigonometric*/
+        rotation_mtx *= mapserver::trans_affine_rotation(-rotation);
+        rotation_mtx *= mapserver::trans_affine_scaling(style->scale);
+      }
+      image_mtx = rotation_mtx;
+      image_mtx *= mapserver::trans_affine_translation(x,y);
+      image_mtx.invert();
+
+      pixmap_bbox.move_to(x-ims_2,y-ims_2);
+      pixmap_bbox.line_to(x+ims_2,y-ims_2);
+      pixmap_bbox.line_to(x+ims_2,y+ims_2);
+      pixmap_bbox.line_to(x-ims_2,y+ims_2);
+
+      r->m_rasterizer_aa.reset();
+      r->m_rasterizer_aa.add_path(pixmap_bbox);
+      mapserver::render_scanlines_aa(r->m_rasterizer_aa, r->sl_poly, r->m_renderer_base, sa, sg);
+    } else {
+      r->m_renderer_base.blend_from(pf,0,MS_NINT(x-pixmap->width/2.),MS_NINT(y-pixmap->height/2.));
+    }
+  }
+  return MS_SUCCESS;
+}
+
 int agg2RenderEllipseSymbol(imageObj *image, double x, double y,
                             symbolObj *symbol, symbolStyleObj * style)
 {
@@ -798,7 +1004,7 @@ int agg2MergeRasterBuffer(imageObj *dest, rasterBufferObj *overlay, double opaci
   rendering_buffer b(overlay->data.rgba.pixels, overlay->width, overlay->height, overlay->data.rgba.row_step);
   pixel_format pf(b);
   AGG2Renderer *r = AGG_RENDERER(dest);
-  mapserver::rect_base<int> src_rect(srcX,srcY,srcX+width,srcY+height);
+  mapserver::rect_base<int> src_rect(srcX,srcY,srcX+width-1,srcY+height-1); /* inclusive */
   r->m_renderer_base.blend_from(pf,&src_rect, dstX-srcX, dstY-srcY, unsigned(opacity * 255));
   return MS_SUCCESS;
 }
@@ -895,6 +1101,11 @@ int agg2CloseNewLayer(imageObj *img, mapObj *map, layerObj *layer)
 int agg2FreeImage(imageObj * image)
 {
   AGG2Renderer *r = AGG_RENDERER(image);
+  for(int i=0; i<AGG_HATCH_TILES; i++) {
+    if(r->hatchtiles[i].tile) {
+      msFreeImage(r->hatchtiles[i].tile);
+    }
+  }
   free(r->buffer);
   delete r;
   image->img.plugin = NULL;
@@ -1102,11 +1313,105 @@ template<class VertexSource> int renderPolygonHatches(imageObj *img,VertexSource
   return MS_SUCCESS;
 }
 
+/*
+** Returns the side of the smallest tile over which a hatch repeating every
+** period pixels along an axis is itself periodic, i.e. the smallest integer
+** multiple of period, or 0 if there is none within AGG_HATCH_TILE_MAXSIZE.
+*/
+static int hatchTileSize(double period)
+{
+  for(int k=1; k*period < AGG_HATCH_TILE_MAXSIZE+0.5; k++) {
+    double n = floor(k*period+0.5);
+    if(n >= 1 && fabs(k*period-n) < 1e-6) {
+      return (int)n;
+    }
+  }
+  return 0;
+}
+
+/*
+** A solid hatch is an infinite family of parallel lines anchored on the
+** image refpt, so whenever its period along both image axes is a whole
+** number of pixels it can be rendered once into a tile and repeated with
+** agg2RenderPolygonTiled() instead of being built and clipped against every
+** polygon. Returns the cached or newly rendered tile, or NULL when the hatch
+** does not repeat exactly on the pixel grid.
+*/
+static imageObj *getHatchTile(imageObj *img, double spacing, double width, double angle, colorObj *color)
+{
+  AGG2Renderer *r = AGG_RENDERER(img);
+  double gamma = r->gamma_function.end();
+  int tw, th;
+
+  for(int i=0; i<AGG_HATCH_TILES; i++) {
+    hatchTileObj *ht = &r->hatchtiles[i];
+    if(ht->tile && ht->angle == angle && ht->spacing == spacing && ht->width == width &&
+        ht->gamma == gamma && MS_COMPARE_COLOR(ht->color, *color) && ht->color.alpha == color->alpha) {
+      return ht->tile;
+    }
+  }
+
+  /* same angle normalization as createHatch() */
+  double a = fmod(angle, 360.0);
+  if(a < 0) a += 360;
+  if(a >= 180) a -= 180;
+  if(a == 0) { /* horizontal lines, any width repeats */
+    tw = 1;
+    th = hatchTileSize(spacing);
+  } else if(a == 90) {
+    tw = hatchTileSize(spacing);
+    th = 1;
+  } else {
+    tw = hatchTileSize(spacing/fabs(sin(a*MS_DEG_TO_RAD)));
+    th = hatchTileSize(spacing/fabs(cos(a*MS_DEG_TO_RAD)));
+  }
+  if(!tw || !th) return NULL;
+
+  imageObj *tile = msImageCreate(tw, th, img->format, NULL, NULL, img->resolution, img->resolution, NULL);
+  if(!tile) return NULL;
+  AGG2Renderer *tr = AGG_RENDERER(tile);
+
+  /* hatch the tile and a margin around it, so that no line ends inside the tile */
+  double exp = width * 0.7072 + 1;
+  mapserver::path_storage hatch = createHatch(-exp, -exp, img->refpt.x, img->refpt.y,
+                                  (int)(tw+exp*2)+1, (int)(th+exp*2)+1, angle, spacing);
+  hatch.transform(mapserver::trans_affine_translation(-exp,-exp));
+  mapserver::conv_stroke <mapserver::path_storage > stroke(hatch);
+  stroke.width(width);
+  stroke.line_cap(mapserver::butt_cap);
+  tr->gamma_function = r->gamma_function;
+  tr->m_rasterizer_aa_gamma.gamma(tr->gamma_function);
+  tr->m_rasterizer_aa_gamma.reset();
+  tr->m_rasterizer_aa_gamma.filling_rule(mapserver::fill_non_zero);
+  tr->m_rasterizer_aa_gamma.add_path(stroke);
+  tr->m_renderer_scanline.color(aggColor(color));
+  mapserver::render_scanlines(tr->m_rasterizer_aa_gamma, tr->sl_poly, tr->m_renderer_scanline);
+
+  hatchTileObj *ht = &r->hatchtiles[r->nexthatchtile];
+  r->nexthatchtile = (r->nexthatchtile + 1) % AGG_HATCH_TILES;
+  if(ht->tile) msFreeImage(ht->tile);
+  ht->angle = angle;
+  ht->spacing = spacing;
+  ht->width = width;
+  ht->gamma = gamma;
+  ht->color = *color;
+  ht->tile = tile;
+  return tile;
+}
+
 int msHatchPolygon(imageObj *img, shapeObj *poly, double spacing, double width, double *pattern, int patternlength, double angle, colorObj *color)
 {
   assert(MS_RENDERER_PLUGIN(img->format));
   msComputeBounds(poly);
 
+  /* dashes are laid out from each polygon's bounding box, only solid hatches repeat */
+  if(img->format->renderer == MS_RENDER_WITH_AGG && patternlength <= 1) {
+    imageObj *tile = getHatchTile(img, spacing, width, angle, color);
+    if(tile) {
+      return agg2RenderPolygonTiled(img, poly, tile);
+    }
+  }
+
   /* amount we should expand the bounding box by */
   double exp = width * 0.7072;
 
@@ -1318,9 +1623,21 @@ int aggCompositeRasterBuffer(imageObj *dest, rasterBufferObj *overlay, Compositi
   }
   return MS_SUCCESS;
 #else
+  mapserver::comp_op_e comp_op = ms2agg_compop(comp);
+  if(overlay->width == (unsigned int)dest->width && overlay->height == (unsigned int)dest->height &&
+      (comp_op == mapserver::comp_op_src_over || comp_op == mapserver::comp_op_multiply)) {
+    /* the common operators have their own row kernels, see mapcompositingfilter.c */
+    rasterBufferObj rb;
+    aggGetRasterBufferHandle(dest, &rb);
+    rb.data.rgba.a = &(r->buffer[band_order::A]); /* blended even when the image has no alpha */
+    if(comp_op == mapserver::comp_op_src_over)
+      msBlendRasterBufferSrcOver(&rb, overlay, unsigned(opacity * 2.55));
+    else
+      msBlendRasterBufferMultiply(&rb, overlay, unsigned(opacity * 2.55));
+    return MS_SUCCESS;
+  }
   rendering_buffer b(overlay->data.rgba.pixels, overlay->width, overlay->height, overlay->data.rgba.row_step);
   pixel_format pf(b);
-  mapserver::comp_op_e comp_op = ms2agg_compop(comp);
   if(comp_op == mapserver::comp_op_src_over) {
     r->m_renderer_base.blend_from(pf,0,0,0,unsigned(opacity * 2.55));
   } else {
@@ -1360,6 +1677,8 @@ int msPopulateRendererVTableAGG(rendererVTableObj * renderer)
   renderer->renderVectorSymbol = &agg2RenderVectorSymbol;
 
   renderer->renderPixmapSymbol = &agg2RenderPixmapSymbol;
+  renderer->renderVectorSymbols = &agg2RenderVectorSymbols;
+  renderer->renderPixmapSymbols = &agg2RenderPixmapSymbols;
 
   renderer->renderEllipseSymbol = &agg2RenderEllipseSymbol;
 
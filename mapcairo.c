@@ -137,6 +137,8 @@ typedef struct {
   cairo_surface_t *surface;
   cairo_t *cr;
   bufferObj *outputStream;
+  FILE *fp; /* where the document is streamed to while it is finished, see saveImageCairo() */
+  int streamed;
   int use_alpha;
 } cairo_renderer;
 
@@ -451,9 +453,15 @@ int renderGlyphs2Cairo(imageObj *img, textPathObj *tp, colorObj *c, colorObj *oc
   return MS_SUCCESS;
 }
 
-cairo_status_t _stream_write_fn(void *b, const unsigned char *data, unsigned int length)
+cairo_status_t _stream_write_fn(void *closure, const unsigned char *data, unsigned int length)
 {
-  msBufferAppend((bufferObj*)b,(void*)data,length);
+  cairo_renderer *r = (cairo_renderer*)closure;
+  if(r->fp) {
+    if(msIO_fwrite(data,1,length,r->fp) != length)
+      return CAIRO_STATUS_WRITE_ERROR;
+  } else {
+    msBufferAppend(r->outputStream,(void*)data,length);
+  }
   return CAIRO_STATUS_SUCCESS;
 }
 
@@ -474,14 +482,14 @@ imageObj* createImageCairo(int width, int height, outputFormatObj *format,colorO
       msBufferInit(r->outputStream);
       r->surface = cairo_pdf_surface_create_for_stream(
                      _stream_write_fn,
-                     r->outputStream,
+                     r,
                      width,height);
     } else if(!strcasecmp(format->driver,"cairo/svg")) {
       r->outputStream = (bufferObj*)malloc(sizeof(bufferObj));
       msBufferInit(r->outputStream);
       r->surface = cairo_svg_surface_create_for_stream(
                      _stream_write_fn,
-                     r->outputStream,
+                     r,
                      width,height);
     } else if(!strcasecmp(format->driver,"cairo/winGDI") && format->device) {
 #if CAIRO_HAS_WIN32_SURFACE
@@ -648,10 +656,49 @@ static void msTransformToGeospatialPDF(imageObj *img, mapObj *map, cairo_rendere
 #endif
 }
 
+/*
+** With FORMATOPTION "STREAMING=ON" the PDF or SVG document is written to fp as cairo
+** produces it when the surface is finished, rather than collected in memory first. The
+** image can then be saved only once. Geospatial PDFs need the whole document and are
+** never streamed.
+*/
+static int msCairoCanStream(imageObj *img, mapObj *map, cairo_renderer *r)
+{
+  if(strcasecmp(msGetOutputFormatOption(img->format, "STREAMING", "OFF"), "ON") != 0)
+    return MS_FALSE;
+  if(cairo_surface_status(r->surface) != CAIRO_STATUS_SUCCESS)
+    return MS_FALSE;
+  if(map != NULL && !strcasecmp(img->format->driver,"cairo/pdf") &&
+      msGetOutputFormatOption(img->format, "GEO_ENCODING", NULL) != NULL)
+    return MS_FALSE;
+  return MS_TRUE;
+}
+
 int saveImageCairo(imageObj *img, mapObj *map, FILE *fp, outputFormatObj *format)
 {
   cairo_renderer *r = CAIRO_RENDERER(img);
   if(!strcasecmp(img->format->driver,"cairo/pdf") || !strcasecmp(img->format->driver,"cairo/svg")) {
+    if(r->streamed) {
+      msSetError(MS_RENDERERERR, "Streamed image already written, it can only be saved once.", "saveImageCairo()");
+      return MS_FAILURE;
+    }
+    if(msCairoCanStream(img, map, r)) {
+      /* what cairo already produced, then the rest straight to fp */
+      msIO_fwrite(r->outputStream->data,r->outputStream->size,1,fp);
+      msBufferFree(r->outputStream);
+      msBufferInit(r->outputStream);
+      r->fp = fp;
+      cairo_surface_finish (r->surface);
+      r->fp = NULL;
+      r->streamed = MS_TRUE;
+      if(cairo_surface_status(r->surface) != CAIRO_STATUS_SUCCESS) {
+        msSetError(MS_RENDERERERR, "Failed to write image: %s", "saveImageCairo()",
+                   cairo_status_to_string(cairo_surface_status(r->surface)));
+        return MS_FAILURE;
+      }
+      return MS_SUCCESS;
+    }
+
     cairo_surface_finish (r->surface);
 
     if (map != NULL && !strcasecmp(img->format->driver,"cairo/pdf"))
@@ -669,6 +716,10 @@ unsigned char* saveImageBufferCairo(imageObj *img, int *size_ptr, outputFormatOb
   cairo_renderer *r = CAIRO_RENDERER(img);
   unsigned char *data;
   assert(!strcasecmp(img->format->driver,"cairo/pdf") || !strcasecmp(img->format->driver,"cairo/svg"));
+  if(r->streamed) {
+    msSetError(MS_RENDERERERR, "Streamed image already written, it can only be saved once.", "saveImageBufferCairo()");
+    return NULL;
+  }
   cairo_surface_finish (r->surface);
   data = msSmallMalloc(r->outputStream->size);
   memcpy(data,r->outputStream->data,r->outputStream->size);
@@ -109,8 +109,167 @@ int findChartPoint(mapObj *map, shapeObj *shape, int width, int height, pointObj
   }
 }
 
+/*
+** Batched charts (PROCESSING "CHART_BATCH=ON"): rather than one renderer call per slice
+** or bar, the rings of all the charts are collected per class and each class is filled
+** once with its style. Charts whose pixels don't overlap are drawn the same either way;
+** when a chart would touch the pixels of a batched one, the batch is drawn first so
+** that the charts still stack in feature order. The batched charts are indexed in a
+** grid of MS_CHART_BATCH_CELL pixel cells to find the ones a chart may touch. Only
+** layers whose chart styles are the same for every feature (no attribute binding other
+** than the SIZE of a solid fill, no range) and renderers without startShape/endShape
+** hooks are batched.
+*/
+#define MS_CHART_BATCH_CELL 32
+#define MS_CHART_BATCH_MAX_RINGS 4096
+
+typedef struct {
+  shapeObj *shapes;     /* rings to fill, one shape per class */
+  int numclasses;
+  int numrings;
+  double margin;        /* drawn around the charts by the offsets and outlines */
+  rectObj *boxes;       /* pixels touched by the charts of the batch */
+  int numboxes, maxboxes;
+  int gridwidth, gridheight;
+  int *cells;           /* first entry of each cell, -1 if none */
+  int *entrybox, *entrynext;
+  int numentries, maxentries;
+} chartBatchObj;
+
+static int chartBatchInit(mapObj *map, layerObj *layer, imageObj *image, chartBatchObj *batch)
+{
+  const char *batchProcessingKey = msLayerGetProcessingKey(layer, "CHART_BATCH");
+  double margin = 1;
+  int c, b;
+
+  if(!batchProcessingKey || strcasecmp(batchProcessingKey, "ON") != 0)
+    return MS_FALSE;
+  if(image->format->vtable->startShape || image->format->vtable->endShape)
+    return MS_FALSE;
+
+  for(c=0; c<layer->numclasses; c++) {
+    styleObj *style;
+    if(layer->class[c]->numstyles == 0) return MS_FALSE;
+    style = layer->class[c]->styles[0];
+    for(b=0; b<MS_STYLE_BINDING_LENGTH; b++) {
+      if(style->bindings[b].item && (b != MS_STYLE_BINDING_SIZE || style->symbol != 0))
+        return MS_FALSE;
+    }
+    if(style->rangeitem) return MS_FALSE;
+    /* outlines are stroked with miter joins, allow for their spikes */
+    margin = MS_MAX(margin, fabs(style->offsetx) + fabs(style->offsety) + 2 * (style->width + style->outlinewidth) + 1);
+  }
+
+  memset(batch, 0, sizeof(chartBatchObj));
+  batch->margin = margin;
+  batch->numclasses = layer->numclasses;
+  batch->shapes = (shapeObj*) msSmallMalloc(layer->numclasses * sizeof(shapeObj));
+  for(c=0; c<layer->numclasses; c++)
+    msInitShape(&batch->shapes[c]);
+  batch->gridwidth = image->width / MS_CHART_BATCH_CELL + 1;
+  batch->gridheight = image->height / MS_CHART_BATCH_CELL + 1;
+  batch->cells = (int*) msSmallMalloc(batch->gridwidth * batch->gridheight * sizeof(int));
+  for(c=0; c<batch->gridwidth * batch->gridheight; c++)
+    batch->cells[c] = -1;
+  return MS_TRUE;
+}
+
+static int chartBatchFlush(mapObj *map, layerObj *layer, imageObj *image, chartBatchObj *batch)
+{
+  int c, status = MS_SUCCESS;
+
+  for(c=0; c<batch->numclasses; c++) {
+    if(batch->shapes[c].numlines > 0 && status == MS_SUCCESS)
+      status = msDrawShadeSymbol(map, image, &batch->shapes[c], layer->class[c]->styles[0], 1.0);
+    msFreeShape(&batch->shapes[c]);
+  }
+  for(c=0; c<batch->gridwidth * batch->gridheight; c++)
+    batch->cells[c] = -1;
+  batch->numrings = batch->numboxes = batch->numentries = 0;
+  return status;
+}
+
+static void chartBatchFree(chartBatchObj *batch)
+{
+  int c;
+
+  for(c=0; c<batch->numclasses; c++)
+    msFreeShape(&batch->shapes[c]);
+  free(batch->shapes);
+  free(batch->boxes);
+  free(batch->cells);
+  free(batch->entrybox);
+  free(batch->entrynext);
+}
+
+/* adds a chart covering the given pixels to the batch, drawing the batch first if they are taken */
+static int chartBatchReserve(mapObj *map, layerObj *layer, imageObj *image, chartBatchObj *batch,
+                             double minx, double miny, double maxx, double maxy)
+{
+  rectObj box;
+  int x, y, x0, y0, x1, y1, e, taken = MS_FALSE;
+
+  box.minx = floor(minx - batch->margin);
+  box.miny = floor(miny - batch->margin);
+  box.maxx = floor(maxx + batch->margin);
+  box.maxy = floor(maxy + batch->margin);
+  x0 = MS_MAX(0, (int)floor(box.minx / MS_CHART_BATCH_CELL));
+  y0 = MS_MAX(0, (int)floor(box.miny / MS_CHART_BATCH_CELL));
+  x1 = MS_MIN(batch->gridwidth - 1, (int)floor(box.maxx / MS_CHART_BATCH_CELL));
+  y1 = MS_MIN(batch->gridheight - 1, (int)floor(box.maxy / MS_CHART_BATCH_CELL));
+
+  if(batch->numrings >= MS_CHART_BATCH_MAX_RINGS)
+    taken = MS_TRUE;
+  for(y=y0; y<=y1 && !taken; y++) {
+    for(x=x0; x<=x1 && !taken; x++) {
+      for(e=batch->cells[y * batch->gridwidth + x]; e>=0; e=batch->entrynext[e]) {
+        rectObj *other = &batch->boxes[batch->entrybox[e]];
+        if(box.minx <= other->maxx && other->minx <= box.maxx && box.miny <= other->maxy && other->miny <= box.maxy) {
+          taken = MS_TRUE;
+          break;
+        }
+      }
+    }
+  }
+  if(taken && chartBatchFlush(map, layer, image, batch) != MS_SUCCESS)
+    return MS_FAILURE;
+
+  if(batch->numboxes == batch->maxboxes) {
+    batch->maxboxes = MS_MAX(64, batch->maxboxes * 2);
+    batch->boxes = (rectObj*) msSmallRealloc(batch->boxes, batch->maxboxes * sizeof(rectObj));
+  }
+  batch->boxes[batch->numboxes] = box;
+  for(y=y0; y<=y1; y++) {
+    for(x=x0; x<=x1; x++) {
+      if(batch->numentries == batch->maxentries) {
+        batch->maxentries = MS_MAX(256, batch->maxentries * 2);
+        batch->entrybox = (int*) msSmallRealloc(batch->entrybox, batch->maxentries * sizeof(int));
+        batch->entrynext = (int*) msSmallRealloc(batch->entrynext, batch->maxentries * sizeof(int));
+      }
+      batch->entrybox[batch->numentries] = batch->numboxes;
+      batch->entrynext[batch->numentries] = batch->cells[y * batch->gridwidth + x];
+      batch->cells[y * batch->gridwidth + x] = batch->numentries++;
+    }
+  }
+  batch->numboxes++;
+  return MS_SUCCESS;
+}
+
+static void chartBatchAddRing(layerObj *layer, chartBatchObj *batch, styleObj *style, lineObj *line)
+{
+  int c;
+
+  for(c=0; c<batch->numclasses; c++) {
+    if(layer->class[c]->numstyles > 0 && layer->class[c]->styles[0] == style) {
+      msAddLine(&batch->shapes[c], line);
+      batch->numrings++;
+      return;
+    }
+  }
+}
+
 int WARN_UNUSED drawRectangle(mapObj *map, imageObj *image, double mx, double my, double Mx, double My,
-                   styleObj *style)
+                   styleObj *style, layerObj *layer, chartBatchObj *batch)
 {
   shapeObj shape;
   lineObj line;
@@ -125,12 +284,16 @@ int WARN_UNUSED drawRectangle(mapObj *map, imageObj *image, double mx, double my
   point[1].x = point[2].x = Mx;
   point[2].y = point[3].y = My;
 
+  if(batch) {
+    chartBatchAddRing(layer, batch, style, &line);
+    return MS_SUCCESS;
+  }
   return msDrawShadeSymbol(map,image,&shape,style,1.0);
 }
 
 int WARN_UNUSED msDrawVBarChart(mapObj *map, imageObj *image, pointObj *center,
                     double *values, styleObj **styles, int numvalues,
-                    double barWidth)
+                    double barWidth, layerObj *layer, chartBatchObj *batch)
 {
 
   int c;
@@ -144,8 +307,11 @@ int WARN_UNUSED msDrawVBarChart(mapObj *map, imageObj *image, pointObj *center,
   cur = bottom = center->y+height/2.;
   left = center->x-barWidth/2.;
 
+  if(batch && chartBatchReserve(map, layer, image, batch, left, bottom-height, left+barWidth, bottom) != MS_SUCCESS)
+    return MS_FAILURE;
+
   for(c=0; c<numvalues; c++) {
-    if(UNLIKELY(MS_FAILURE == drawRectangle(map, image, left, cur, left+barWidth, cur-values[c], styles[c])))
+    if(UNLIKELY(MS_FAILURE == drawRectangle(map, image, left, cur, left+barWidth, cur-values[c], styles[c], layer, batch)))
       return MS_FAILURE;
     cur -= values[c];
   }
@@ -155,7 +321,8 @@ int WARN_UNUSED msDrawVBarChart(mapObj *map, imageObj *image, pointObj *center,
 
 int msDrawBarChart(mapObj *map, imageObj *image, pointObj *center,
                    double *values, styleObj **styles, int numvalues,
-                   double width, double height, double *maxVal, double *minVal, double barWidth)
+                   double width, double height, double *maxVal, double *minVal, double barWidth,
+                   layerObj *layer, chartBatchObj *batch)
 {
 
   double upperLimit,lowerLimit;
@@ -195,7 +362,10 @@ int msDrawBarChart(mapObj *map, imageObj *image, pointObj *center,
   vertOriginClipped=(vertOrigin<top) ? top :
                     (vertOrigin>bottom) ? bottom : vertOrigin;
   horizStart=left;
-  
+
+  if(batch && chartBatchReserve(map, layer, image, batch, left, top, left+width, bottom) != MS_SUCCESS)
+    return MS_FAILURE;
+
   for(c=0; c<numvalues; c++) {
     double barHeight=values[c]*pixperval;
     /*clip bars*/
@@ -203,11 +373,11 @@ int msDrawBarChart(mapObj *map, imageObj *image, pointObj *center,
       (vertOrigin-barHeight>bottom) ? bottom : vertOrigin-barHeight;
     if(y!=vertOriginClipped) { /*don't draw bars of height == 0 (i.e. either values==0, or clipped)*/
       if(values[c]>0) {
-        if(UNLIKELY(MS_FAILURE == drawRectangle(map, image, horizStart, y, horizStart+barWidth-1, vertOriginClipped, styles[c])))
+        if(UNLIKELY(MS_FAILURE == drawRectangle(map, image, horizStart, y, horizStart+barWidth-1, vertOriginClipped, styles[c], layer, batch)))
           return MS_FAILURE;
       }
       else {
-        if(UNLIKELY(MS_FAILURE == drawRectangle(map,image, horizStart, vertOriginClipped, horizStart+barWidth-1 , y, styles[c])))
+        if(UNLIKELY(MS_FAILURE == drawRectangle(map,image, horizStart, vertOriginClipped, horizStart+barWidth-1 , y, styles[c], layer, batch)))
           return MS_FAILURE;
       }
     }
@@ -218,7 +388,8 @@ int msDrawBarChart(mapObj *map, imageObj *image, pointObj *center,
 
 int WARN_UNUSED msDrawPieChart(mapObj *map, imageObj *image,
                    pointObj *center, double diameter,
-                   double *values, styleObj **styles, int numvalues)
+                   double *values, styleObj **styles, int numvalues,
+                   layerObj *layer, chartBatchObj *batch)
 {
   int i;
   double dTotal=0.,start=0;
@@ -231,11 +402,28 @@ int WARN_UNUSED msDrawPieChart(mapObj *map, imageObj *image,
     dTotal+=values[i];
   }
 
+  if(batch && chartBatchReserve(map, layer, image, batch, center->x-diameter/2., center->y-diameter/2.,
+                                center->x+diameter/2., center->y+diameter/2.) != MS_SUCCESS)
+    return MS_FAILURE;
+
   for(i=0; i < numvalues; i++) {
     double angle = values[i];
     if(angle==0) continue; /*no need to draw. causes artifacts with outlines*/
     angle*=360.0/dTotal;
-    if(UNLIKELY(MS_FAILURE == msDrawPieSlice(map ,image, center, styles[i], diameter/2., start, start+angle)))
+    if(batch) {
+      /* the slice of msDrawPieSlice() */
+      double center_x = center->x, center_y = center->y;
+      shapeObj *slice;
+      if(styles[i]->offsetx>0) {
+        center_x+=styles[i]->offsetx*cos(((-start-(start+angle))*MS_PI/360.));
+        center_y-=styles[i]->offsetx*sin(((-start-(start+angle))*MS_PI/360.));
+      }
+      slice = msRasterizeArc(center_x, center_y, diameter/2., start, start+angle, 1);
+      if(!slice) return MS_FAILURE;
+      chartBatchAddRing(layer, batch, styles[i], &slice->line[0]);
+      msFreeShape(slice);
+      msFree(slice);
+    } else if(UNLIKELY(MS_FAILURE == msDrawPieSlice(map ,image, center, styles[i], diameter/2., start, start+angle)))
       return MS_FAILURE;
 
     start+=angle;
@@ -346,6 +534,7 @@ int msDrawPieChartLayer(mapObj *map, layerObj *layer, imageObj *image)
   pointObj center;
   int numvalues = layer->numclasses; /* the number of classes to represent in the graph */
   int numvalues_for_shape = 0;
+  chartBatchObj batch, *pbatch = NULL;
 
   if(chartSizeProcessingKey==NULL) {
     chartRangeProcessingKey=msLayerGetProcessingKey( layer,"CHART_SIZE_RANGE" );
@@ -376,6 +565,8 @@ int msDrawPieChartLayer(mapObj *map, layerObj *layer, imageObj *image)
     free(values);
     return MS_FAILURE;
   }
+  if(chartBatchInit(map, layer, image, &batch))
+    pbatch = &batch;
 
   while(MS_SUCCESS == getNextShape(map,layer,values,&numvalues_for_shape,styles,&shape)) {
     if(chartRangeProcessingKey!=NULL)
@@ -410,11 +601,16 @@ int msDrawPieChartLayer(mapObj *map, layerObj *layer, imageObj *image)
     }
     if(findChartPoint(map, &shape, diameter, diameter, &center) == MS_SUCCESS) {
       status = msDrawPieChart(map,image, &center, diameter,
-                              values,styles,numvalues_for_shape);
+                              values,styles,numvalues_for_shape,layer,pbatch);
     }
     msDrawEndShape(map,layer,image,&shape);
     msFreeShape(&shape);
   }
+  if(pbatch) {
+    if(status == MS_SUCCESS)
+      status = chartBatchFlush(map, layer, image, pbatch);
+    chartBatchFree(pbatch);
+  }
   free(values);
   free(styles);
   return status;
@@ -432,6 +628,7 @@ int msDrawVBarChartLayer(mapObj *map, layerObj *layer, imageObj *image)
   pointObj center;
   int numvalues = layer->numclasses;
   int numvalues_for_shape;
+  chartBatchObj batch, *pbatch = NULL;
   if(chartSizeProcessingKey==NULL) {
     barWidth=20;
   } else {
@@ -458,11 +655,14 @@ int msDrawVBarChartLayer(mapObj *map, layerObj *layer, imageObj *image)
     free(values);
     return MS_FAILURE;
   }
+  if(chartBatchInit(map, layer, image, &batch))
+    pbatch = &batch;
 
   while(MS_SUCCESS == getNextShape(map,layer,values,&numvalues_for_shape,styles,&shape)) {
     int i;
     double h=0;
     if(numvalues_for_shape == 0) {
+      msFreeShape(&shape);
       continue;
     }
     for(i=0; i<numvalues_for_shape; i++) {
@@ -474,11 +674,16 @@ int msDrawVBarChartLayer(mapObj *map, layerObj *layer, imageObj *image)
       status = msDrawVBarChart(map,image,
                                &center,
                                values, styles, numvalues_for_shape,
-                               barWidth);
+                               barWidth, layer, pbatch);
     }
     msDrawEndShape(map,layer,image,&shape);
     msFreeShape(&shape);
   }
+  if(pbatch) {
+    if(status == MS_SUCCESS)
+      status = chartBatchFlush(map, layer, image, pbatch);
+    chartBatchFree(pbatch);
+  }
   free(values);
   free(styles);
   return status;
@@ -500,6 +705,7 @@ int msDrawBarChartLayer(mapObj *map, layerObj *layer, imageObj *image)
   double barMaxVal,barMinVal;
   int numvalues = layer->numclasses;
   int numvalues_for_shape;
+  chartBatchObj batch, *pbatch = NULL;
   if(chartSizeProcessingKey==NULL) {
     width=height=20;
   } else {
@@ -548,9 +754,14 @@ int msDrawBarChartLayer(mapObj *map, layerObj *layer, imageObj *image)
     free(values);
     return MS_FAILURE;
   }
+  if(chartBatchInit(map, layer, image, &batch))
+    pbatch = &batch;
 
   while(MS_SUCCESS == getNextShape(map,layer,values,&numvalues_for_shape,styles,&shape)) {
-    if(numvalues_for_shape == 0 ) continue;
+    if(numvalues_for_shape == 0 ) {
+      msFreeShape(&shape);
+      continue;
+    }
     msDrawStartShape(map, layer, image, &shape);
     if(findChartPoint(map, &shape, width,height, &center)==MS_SUCCESS) {
       status = msDrawBarChart(map,image,
@@ -559,11 +770,16 @@ int msDrawBarChartLayer(mapObj *map, layerObj *layer, imageObj *image)
                               width,height,
                               (barMax!=NULL)?&barMaxVal:NULL,
                               (barMin!=NULL)?&barMinVal:NULL,
-                              barWidth);
+                              barWidth, layer, pbatch);
     }
     msDrawEndShape(map,layer,image,&shape);
     msFreeShape(&shape);
   }
+  if(pbatch) {
+    if(status == MS_SUCCESS)
+      status = chartBatchFlush(map, layer, image, pbatch);
+    chartBatchFree(pbatch);
+  }
   free(values);
   free(styles);
   return status;
@@ -32,6 +32,7 @@
 /* $Id$ */
 #include <assert.h>
 #include "mapserver.h"
+#include "uthash.h"
 
 
 
@@ -64,6 +65,9 @@ typedef int (*clusterCompareRegionFunc)(clusterInfo* current, clusterInfo* other
 #define SPLITRATIO  0.55
 #define TREE_MAX_DEPTH  10
 
+/* tentative clusters allocated at once by the grid algorithm */
+#define CLUSTER_ARENA_BLOCK  1024
+
 /* cluster data */
 struct cluster_info {
   double x;    /* x position of the current point */
@@ -88,8 +92,20 @@ struct cluster_info {
   /* current group */
   char* group;
   int filter;
+  /* allocated in layerinfo->arena, not freed on its own */
+  int arena;
 };
 
+/* grid cell, see RebuildGridClusters() */
+typedef struct {
+  struct {
+    long long x, y;
+  } key;
+  clusterInfo* shapes;
+  clusterInfo* last;
+  UT_hash_handle hh;
+} clusterGridCell;
+
 /* quadtree node */
 struct cluster_tree_node {
   /* area covered by this node */
@@ -135,10 +151,15 @@ struct cluster_layer_info {
   clusterCompareRegionFunc fnCompare;
   /* diagnostics */
   int depth;
+  /* cluster on a grid instead of the quadtree (CLUSTER_ALGORITHM=GRID) */
+  int use_grid;
+  /* blocks of CLUSTER_ARENA_BLOCK tentative clusters */
+  clusterInfo** arena;
+  int numArenaBlocks;
+  int arenaUsed; /* in the last block */
 };
 
 
-extern int yyparse(parseObj *p);
 
 /* evaluate the filter expression */
 int msClusterEvaluateFilter(expressionObj* expression, shapeObj *shape)
@@ -152,7 +173,7 @@ int msClusterEvaluateFilter(expressionObj* expression, shapeObj *shape)
     p.expr->curtoken = p.expr->tokens; /* reset */
     p.type = MS_PARSE_TYPE_BOOLEAN;
 
-    status = yyparse(&p);
+    status = msEvalParsedExpression(&p);
 
     if (status != 0) {
       msSetError(MS_PARSEERR, "Failed to parse expression: %s", "msClusterEvaluateFilter", expression->string);
@@ -184,7 +205,7 @@ char *msClusterGetGroupText(expressionObj* expression, shapeObj *shape)
         p.expr->curtoken = p.expr->tokens; /* reset */
         p.type = MS_PARSE_TYPE_STRING;
 
-        status = yyparse(&p);
+        status = msEvalParsedExpression(&p);
 
         if (status != 0) {
           msSetError(MS_PARSEERR, "Failed to process text expression: %s", "msClusterGetGroupText", expression->string);
@@ -279,6 +300,34 @@ static clusterInfo *clusterInfoCreate(msClusterLayerInfo* layerinfo)
   feature->siblings = NULL;
   feature->index = layerinfo->numFeatures;
   feature->filter = -1; /* not yet calculated */
+  feature->arena = MS_FALSE;
+  ++layerinfo->numFeatures;
+  return feature;
+}
+
+/* take a new tentative cluster from the arena */
+static clusterInfo *clusterInfoArenaCreate(msClusterLayerInfo* layerinfo)
+{
+  clusterInfo* feature;
+
+  if (layerinfo->numArenaBlocks == 0 || layerinfo->arenaUsed == CLUSTER_ARENA_BLOCK) {
+    layerinfo->arena = (clusterInfo**)msSmallRealloc(layerinfo->arena, sizeof(clusterInfo*) * (layerinfo->numArenaBlocks + 1));
+    layerinfo->arena[layerinfo->numArenaBlocks++] = (clusterInfo*)msSmallMalloc(sizeof(clusterInfo) * CLUSTER_ARENA_BLOCK);
+    layerinfo->arenaUsed = 0;
+  }
+
+  feature = &layerinfo->arena[layerinfo->numArenaBlocks - 1][layerinfo->arenaUsed++];
+  msInitShape(&feature->shape);
+  feature->numsiblings = 0;
+  feature->numcollected = 0;
+  feature->numremoved = 0;
+  feature->next = NULL;
+  feature->group = NULL;
+  feature->node = NULL;
+  feature->siblings = NULL;
+  feature->index = layerinfo->numFeatures;
+  feature->filter = -1; /* not yet calculated */
+  feature->arena = MS_TRUE;
   ++layerinfo->numFeatures;
   return feature;
 }
@@ -296,7 +345,8 @@ static void clusterInfoDestroyList(msClusterLayerInfo* layerinfo, clusterInfo* f
     }
     msFreeShape(&s->shape);
     msFree(s->group);
-    msFree(s);
+    if (!s->arena)
+      msFree(s);
     --layerinfo->numFeatures;
     s = next;
   }
@@ -381,6 +431,13 @@ void clusterDestroyData(msClusterLayerInfo *layerinfo)
   }
 
   layerinfo->numNodes = 0;
+
+  /* the lists above are destroyed, the arena has no more shapes */
+  while (layerinfo->numArenaBlocks > 0)
+    msFree(layerinfo->arena[--layerinfo->numArenaBlocks]);
+  msFree(layerinfo->arena);
+  layerinfo->arena = NULL;
+  layerinfo->arenaUsed = 0;
 }
 
 /* traverse the quadtree to find the neighbouring shapes and update some data
@@ -871,6 +928,195 @@ static int ValidateTree(msClusterLayerInfo* layerinfo, clusterTreeNode *node)
 }
 #endif
 
+/* add the shapes of a finalized grid cluster to the lists of the layer */
+static void finalizeGridCluster(layerObj* layer, msClusterLayerInfo* layerinfo, clusterInfo* shapes, int count)
+{
+  clusterInfo *s, *base, *next, *siblings = NULL;
+  double avgx = 0, avgy = 0, d, best = -1;
+
+  for (s = shapes; s; s = s->next) {
+    avgx += s->x;
+    avgy += s->y;
+  }
+  avgx /= count;
+  avgy /= count;
+
+  /* the shape nearest to the average represents the cluster */
+  base = shapes;
+  for (s = shapes; s; s = s->next) {
+    d = (s->x - avgx) * (s->x - avgx) + (s->y - avgy) * (s->y - avgy);
+    if (best < 0 || d < best) {
+      best = d;
+      base = s;
+    }
+  }
+
+  base->numsiblings = count - 1;
+  base->numcollected = count;
+  base->avgx = avgx;
+  base->avgy = avgy;
+  InitShapeAttributes(layer, base);
+
+  if (layer->cluster.filter.string != NULL)
+    base->filter = msClusterEvaluateFilter(&layer->cluster.filter, &base->shape);
+
+  if (base->filter == 0) {
+    /* the whole cluster is filtered */
+    for (s = shapes; s; s = next) {
+      next = s->next;
+      s->next = layerinfo->filtered;
+      layerinfo->filtered = s;
+      ++layerinfo->numFiltered;
+    }
+    return;
+  }
+
+  for (s = shapes; s; s = next) {
+    next = s->next;
+    if (s == base)
+      continue;
+    UpdateShapeAttributes(layer, base, s);
+    s->avgx = avgx;
+    s->avgy = avgy;
+    s->next = siblings;
+    siblings = s;
+    ++layerinfo->numFinalizedSiblings;
+  }
+
+  base->next = layerinfo->finalized;
+  layerinfo->finalized = base;
+  ++layerinfo->numFinalized;
+
+  if (siblings) {
+    if (layerinfo->get_all_shapes == MS_TRUE) {
+      /* insert the siblings into the finalization list */
+      for (s = siblings; s->next; s = s->next);
+      s->next = layerinfo->finalized;
+      layerinfo->finalized = siblings;
+    } else {
+      /* preserve the clustered siblings for later use */
+      base->siblings = siblings;
+    }
+  }
+}
+
+/* cluster the shapes falling into the same cell of a grid of the size of the
+cluster regions. Unlike the quadtree algorithm this runs in linear time, but
+the clusters are bound to the grid rather than to the shapes. */
+static int RebuildGridClusters(layerObj *layer, msClusterLayerInfo* layerinfo, rectObj searchrect,
+                               double maxDistanceX, double maxDistanceY, int isQuery)
+{
+  layerObj* srcLayer = &layerinfo->srcLayer;
+  clusterGridCell *cells = NULL, *cell, *tmp;
+  clusterInfo *current, *s, *prev, *next, *cluster;
+  double cellSizeX = 2 * maxDistanceX, cellSizeY = 2 * maxDistanceY;
+  int status, count;
+
+  status = msLayerWhichShapes(srcLayer, searchrect, isQuery);
+  if(status == MS_DONE) {
+    /* no overlap */
+    return MS_SUCCESS;
+  } else if(status != MS_SUCCESS) {
+    return MS_FAILURE;
+  }
+
+  current = clusterInfoArenaCreate(layerinfo);
+
+  while((status = msLayerNextShape(srcLayer, &current->shape)) == MS_SUCCESS) {
+    long long key[2];
+
+#if defined(USE_PROJ) && defined(USE_CLUSTER_EXTERNAL)
+    /* transform the shape to the projection of this layer */
+    if(srcLayer->transform == MS_TRUE && srcLayer->project && layer->transform == MS_TRUE && layer->project &&msProjectionsDiffer(&(srcLayer->projection), &(layer->projection)))
+      msProjectShape(&srcLayer->projection, &layer->projection, &current->shape);
+#endif
+    current->avgx = current->x = current->shape.bounds.minx;
+    current->avgy = current->y = current->shape.bounds.miny;
+    current->varx = current->vary = 0;
+    current->bounds.minx = current->x - maxDistanceX;
+    current->bounds.miny = current->y - maxDistanceY;
+    current->bounds.maxx = current->x + maxDistanceX;
+    current->bounds.maxy = current->y + maxDistanceY;
+
+    /* if the shape doesn't overlap we must skip it to avoid further issues */
+    if(!msRectOverlap(&searchrect, &current->bounds)) {
+      msFreeShape(&current->shape);
+      msInitShape(&current->shape);
+
+      msDebug("Skipping an invalid shape falling outside of the given extent\n");
+      continue;
+    }
+
+    /* construct the item array */
+    if (layer->iteminfo)
+      BuildFeatureAttributes(layer, layerinfo, &current->shape);
+
+    /* evaluate the group expression */
+    if (layer->cluster.group.string)
+      current->group = msClusterGetGroupText(&layer->cluster.group, &current->shape);
+
+    /* append the shape to its cell, keeping the order of the source */
+    key[0] = (long long)floor((current->x - searchrect.minx) / cellSizeX);
+    key[1] = (long long)floor((current->y - searchrect.miny) / cellSizeY);
+    UT_HASH_FIND(hh, cells, key, sizeof(key), cell);
+    if (cell == NULL) {
+      cell = (clusterGridCell*)msSmallCalloc(1, sizeof(clusterGridCell));
+      cell->key.x = key[0];
+      cell->key.y = key[1];
+      UT_HASH_ADD(hh, cells, key, sizeof(cell->key), cell);
+      cell->shapes = current;
+    } else
+      cell->last->next = current;
+    cell->last = current;
+
+    current = clusterInfoArenaCreate(layerinfo);
+  }
+
+  clusterInfoDestroyList(layerinfo, current);
+
+  /* a cluster for each group of the shapes of a cell */
+  UT_HASH_ITER(hh, cells, cell, tmp) {
+    while (cell->shapes) {
+      cluster = cell->shapes;
+      cell->shapes = cluster->next;
+      cluster->next = NULL;
+      current = cluster;
+      count = 1;
+
+      prev = NULL;
+      for (s = cell->shapes; s; s = next) {
+        next = s->next;
+        if ((s->group == NULL && cluster->group == NULL) ||
+            (s->group && cluster->group && strcmp(s->group, cluster->group) == 0)) {
+          if (prev)
+            prev->next = next;
+          else
+            cell->shapes = next;
+          s->next = NULL;
+          current->next = s;
+          current = s;
+          ++count;
+        } else
+          prev = s;
+      }
+
+      finalizeGridCluster(layer, layerinfo, cluster, count);
+    }
+
+    UT_HASH_DEL(cells, cell);
+    msFree(cell);
+  }
+
+  if (layer->debug >= MS_DEBUGLEVEL_VVV)
+    msDebug("Grid clustering of %d shapes: %d clusters, %d filtered.\n", layerinfo->numFeatures,
+            layerinfo->numFinalized, layerinfo->numFiltered);
+
+  /* set the pointer to the first shape */
+  layerinfo->current = layerinfo->finalized;
+
+  return status == MS_FAILURE ? MS_FAILURE : MS_SUCCESS;
+}
+
 /* rebuild the clusters according to the current extent */
 int RebuildClusters(layerObj *layer, int isQuery)
 {
@@ -923,6 +1169,13 @@ int RebuildClusters(layerObj *layer, int isQuery)
   else
     layerinfo->use_map_units = MS_FALSE;
 
+  /* check whether the faster grid algorithm is requested */
+  if(msLayerGetProcessingKey(layer, "CLUSTER_ALGORITHM") != NULL &&
+     EQUAL(msLayerGetProcessingKey(layer, "CLUSTER_ALGORITHM"), "GRID"))
+    layerinfo->use_grid = MS_TRUE;
+  else
+    layerinfo->use_grid = MS_FALSE;
+
   /* identify the current extent */
   if(layer->transform == MS_TRUE)
     searchrect = map->extent;
@@ -989,6 +1242,9 @@ int RebuildClusters(layerObj *layer, int isQuery)
   searchrect.miny -= layer->cluster.buffer * cellSizeY;
   searchrect.maxy += layer->cluster.buffer * cellSizeY;
 
+  if (layerinfo->use_grid && maxDistanceX > 0 && maxDistanceY > 0)
+    return RebuildGridClusters(layer, layerinfo, searchrect, maxDistanceX, maxDistanceY, isQuery);
+
   /* create the root node */
   if (layerinfo->root)
     clusterTreeNodeDestroy(layerinfo, layerinfo->root);
@@ -1424,6 +1680,11 @@ msClusterLayerInfo* msClusterInitialize(layerObj *layer)
   layerinfo->finalizedNodes = NULL;
   layerinfo->numFinalizedNodes = 0;
 
+  layerinfo->use_grid = MS_FALSE;
+  layerinfo->arena = NULL;
+  layerinfo->numArenaBlocks = 0;
+  layerinfo->arenaUsed = 0;
+
   return layerinfo;
 }
 
@@ -1551,6 +1812,7 @@ void msClusterLayerCopyVirtualTable(layerVTableObj* vtable)
   vtable->LayerIsOpen = msClusterLayerIsOpen;
   vtable->LayerWhichShapes = msClusterLayerWhichShapes;
   vtable->LayerNextShape = msClusterLayerNextShape;
+  vtable->LayerNextShapes = LayerDefaultNextShapes; /* not the batches of the source driver */
   vtable->LayerGetShape = msClusterLayerGetShape;
   /* layer->vtable->LayerGetShapeCount, use default */
 
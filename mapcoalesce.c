@@ -0,0 +1,575 @@
+/******************************************************************************
+ * $Id$
+ *
+ * Project:  MapServer
+ * Purpose:  Coalescing of identical concurrent image requests
+ * Author:   MapServer team.
+ *
+ ******************************************************************************
+ * Copyright (c) 1996-2016 Regents of the University of Minnesota.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies of this Software or works derived from this Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+/*
+** When identical image requests (same map, same parameters once sorted)
+** arrive together, only the first one renders, the others wait for its
+** encoded image and send that.
+**
+** CONFIG "MS_COALESCE_REQUESTS" "ON" coalesces the requests of one process
+** (threaded FastCGI, embedding servers). CONFIG "MS_COALESCE_DIR" "/path"
+** extends it to several processes through lock files in that directory:
+** the renderer holds <hash>.lock while drawing and leaves the image in
+** <hash>.res for the requests that were waiting on the lock. Requests not
+** served after MS_COALESCE_TIMEOUT seconds (default 30) render themselves.
+*/
+
+#include "mapserver.h"
+#include "mapthread.h"
+#include "uthash.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <ctype.h>
+
+#ifdef _WIN32
+#include <io.h>
+#include <windows.h>
+#else
+#include <unistd.h>
+#include <dirent.h>
+#endif
+
+#define MS_COALESCE_TIMEOUT 30
+#define MS_COALESCE_SWEEP_DELAY 60 /* seconds between removals of old results */
+#define MS_COALESCE_POLL_MS 10
+
+/* in process requests being rendered, by key */
+typedef struct coalesceEntryObj {
+  char *key;
+  int refcount;  /* renderer and waiters */
+  int done;      /* result published, or abandoned with data NULL */
+  unsigned char *data;
+  int size;
+  char *mimetype;
+  UT_hash_handle hh;
+} coalesceEntryObj;
+
+struct msCoalesceObj {
+  char *key;
+  coalesceEntryObj *entry; /* set when rendering for the waiters of this process */
+  char *lockfile;          /* set when holding the lock file */
+  char *resultfile;
+  int timeout;
+
+  unsigned char *data;     /* encoded image, rendered here or by an identical request */
+  int size;
+  char *mimetype;
+};
+
+static int msCoalesceCompareParams(const void *a, const void *b)
+{
+  char * const *pa = (char * const *) a;
+  char * const *pb = (char * const *) b;
+  int c = strcasecmp(pa[0], pb[0]);
+
+  if(c == 0)
+    c = strcmp(pa[1] ? pa[1] : "", pb[1] ? pb[1] : "");
+  return c;
+}
+
+/************************************************************************/
+/*                         msBuildRequestKey()                          */
+/*                                                                      */
+/*      Normalized request key: the mapfile and the parameters sorted   */
+/*      by name, names upper cased. mapfile is the file map was loaded  */
+/*      from, when NULL the map path and name are used instead.         */
+/************************************************************************/
+
+char *msBuildRequestKey(mapObj *map, const char *mapfile, char **names, char **values, int numentries)
+{
+  char **pairs;
+  char *key;
+  size_t len;
+  int i;
+
+  pairs = (char **) msSmallMalloc(sizeof(char *) * 2 * MS_MAX(numentries, 1));
+  if(mapfile)
+    len = strlen(mapfile) + 1;
+  else
+    len = strlen(map->mappath ? map->mappath : "") + strlen(map->name ? map->name : "") + 2;
+  for(i=0; i<numentries; i++) {
+    pairs[2*i] = names[i];
+    pairs[2*i+1] = values[i];
+    len += strlen(names[i]) + (values[i] ? strlen(values[i]) : 0) + 2;
+  }
+  qsort(pairs, numentries, 2 * sizeof(char *), msCoalesceCompareParams);
+
+  key = (char *) msSmallMalloc(len + 1);
+  if(mapfile)
+    strcpy(key, mapfile);
+  else
+    sprintf(key, "%s|%s", map->mappath ? map->mappath : "", map->name ? map->name : "");
+  for(i=0; i<numentries; i++) {
+    char *s = key + strlen(key), *n;
+
+    *s++ = '&';
+    for(n=pairs[2*i]; *n; n++)
+      *s++ = toupper((unsigned char) *n);
+    *s++ = '=';
+    strcpy(s, pairs[2*i+1] ? pairs[2*i+1] : "");
+  }
+  free(pairs);
+
+  return key;
+}
+
+static void msCoalesceSleep(int ms)
+{
+#ifdef _WIN32
+  Sleep(ms);
+#else
+  usleep(ms * 1000);
+#endif
+}
+
+/* ==================================================================== */
+/*      In process coalescing.                                          */
+/* ==================================================================== */
+
+#if defined(USE_THREAD) && !defined(_WIN32)
+#include <pthread.h>
+
+static pthread_mutex_t coalesce_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t coalesce_done = PTHREAD_COND_INITIALIZER;
+static coalesceEntryObj *coalesce_entries = NULL;
+
+static void msCoalesceReleaseEntry(coalesceEntryObj *entry)
+{
+  /* coalesce_lock is held */
+  if(--entry->refcount == 0) {
+    free(entry->key);
+    free(entry->data);
+    free(entry->mimetype);
+    free(entry);
+  }
+}
+
+/*
+** Returns MS_TRUE if c is to render for the other requests of this
+** process, MS_FALSE if the result of another request was copied in
+** (data may still be NULL if that one failed or timed out).
+*/
+static int msCoalesceJoin(msCoalesceObj *c, unsigned char **data, int *size, char **mimetype)
+{
+  coalesceEntryObj *entry;
+  struct timespec deadline;
+
+  pthread_mutex_lock(&coalesce_lock);
+  UT_HASH_FIND_STR(coalesce_entries, c->key, entry);
+  if(entry == NULL) {
+    entry = (coalesceEntryObj *) msSmallCalloc(1, sizeof(coalesceEntryObj));
+    entry->key = msStrdup(c->key);
+    entry->refcount = 1;
+    UT_HASH_ADD_KEYPTR(hh, coalesce_entries, entry->key, strlen(entry->key), entry);
+    c->entry = entry;
+    pthread_mutex_unlock(&coalesce_lock);
+    return MS_TRUE;
+  }
+
+  entry->refcount++;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += c->timeout;
+  while(!entry->done) {
+    if(pthread_cond_timedwait(&coalesce_done, &coalesce_lock, &deadline) == ETIMEDOUT)
+      break;
+  }
+  if(entry->done && entry->data) {
+    *data = (unsigned char *) msSmallMalloc(entry->size);
+    memcpy(*data, entry->data, entry->size);
+    *size = entry->size;
+    *mimetype = msStrdup(entry->mimetype);
+  }
+  msCoalesceReleaseEntry(entry);
+  pthread_mutex_unlock(&coalesce_lock);
+
+  return MS_FALSE;
+}
+
+static void msCoalescePublish(msCoalesceObj *c, unsigned char *data, int size, const char *mimetype)
+{
+  coalesceEntryObj *entry = c->entry;
+
+  pthread_mutex_lock(&coalesce_lock);
+  if(data) {
+    entry->data = (unsigned char *) msSmallMalloc(size);
+    memcpy(entry->data, data, size);
+    entry->size = size;
+    entry->mimetype = msStrdup(mimetype);
+  }
+  entry->done = MS_TRUE;
+  UT_HASH_DEL(coalesce_entries, entry);
+  pthread_cond_broadcast(&coalesce_done);
+  msCoalesceReleaseEntry(entry);
+  pthread_mutex_unlock(&coalesce_lock);
+  c->entry = NULL;
+}
+
+#else
+
+static int msCoalesceJoin(msCoalesceObj *c, unsigned char **data, int *size, char **mimetype)
+{
+  return MS_TRUE;
+}
+
+static void msCoalescePublish(msCoalesceObj *c, unsigned char *data, int size, const char *mimetype)
+{
+}
+
+#endif
+
+/* ==================================================================== */
+/*      Coalescing across processes.                                    */
+/* ==================================================================== */
+
+static void msCoalesceFileNames(msCoalesceObj *c, const char *dir)
+{
+  char name[17];
+
+  msHashRequestKey(c->key, name);
+  c->lockfile = msStringConcatenate(msStringConcatenate(msStringConcatenate(msStrdup(dir), "/"), name), ".lock");
+  c->resultfile = msStringConcatenate(msStringConcatenate(msStringConcatenate(msStrdup(dir), "/"), name), ".res");
+}
+
+/* removes results older than MS_COALESCE_SWEEP_DELAY, at most that often */
+static void msCoalesceSweep(const char *dir)
+{
+#ifndef _WIN32
+  static time_t last_sweep = 0;
+  time_t now = time(NULL);
+  DIR *d;
+  struct dirent *de;
+
+  if(now - last_sweep < MS_COALESCE_SWEEP_DELAY)
+    return;
+  last_sweep = now;
+
+  if((d = opendir(dir)) == NULL)
+    return;
+  while((de = readdir(d)) != NULL) {
+    struct stat st;
+    char *path;
+    size_t len = strlen(de->d_name);
+
+    if(len < 4 || strcmp(de->d_name + len - 4, ".res") != 0)
+      continue;
+    path = msStringConcatenate(msStringConcatenate(msStrdup(dir), "/"), de->d_name);
+    if(stat(path, &st) == 0 && now - st.st_mtime > MS_COALESCE_SWEEP_DELAY)
+      unlink(path);
+    free(path);
+  }
+  closedir(d);
+#endif
+}
+
+/* reads the result left by the renderer, if it is not older than since */
+static int msCoalesceReadResult(msCoalesceObj *c, time_t since, unsigned char **data, int *size, char **mimetype)
+{
+  struct stat st;
+
+  if(stat(c->resultfile, &st) != 0 || st.st_mtime < since - 1)
+    return MS_FAILURE;
+  return msReadKeyedFile(c->resultfile, c->key, data, size, mimetype);
+}
+
+/*
+** Takes the lock file (returns MS_TRUE), or waits for its holder and
+** copies its result in (data stays NULL if there is none).
+*/
+static int msCoalesceLockFile(msCoalesceObj *c, unsigned char **data, int *size, char **mimetype)
+{
+  time_t start = time(NULL);
+  int fd, waited = MS_FALSE;
+
+  for( ;; ) {
+    struct stat st;
+
+    fd = open(c->lockfile, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if(fd >= 0) {
+      close(fd);
+      if(waited) {
+        /* the previous holder left, take its result if it just made one */
+        if(msCoalesceReadResult(c, start, data, size, mimetype) == MS_SUCCESS) {
+          unlink(c->lockfile);
+          return MS_FALSE;
+        }
+      }
+      return MS_TRUE;
+    }
+    if(errno != EEXIST)
+      return MS_FALSE; /* unusable directory, just render */
+
+    /* a holder that died is given up on after the timeout */
+    if(stat(c->lockfile, &st) == 0 && time(NULL) - st.st_mtime > c->timeout) {
+      unlink(c->lockfile);
+      continue;
+    }
+    if(time(NULL) - start > c->timeout)
+      return MS_FALSE;
+
+    waited = MS_TRUE;
+    msCoalesceSleep(MS_COALESCE_POLL_MS);
+    if(stat(c->lockfile, &st) != 0 &&
+        msCoalesceReadResult(c, start, data, size, mimetype) == MS_SUCCESS)
+      return MS_FALSE;
+  }
+}
+
+/* ==================================================================== */
+/*      Request keys and keyed files, shared with the tile cache.       */
+/* ==================================================================== */
+
+/************************************************************************/
+/*                          msHashRequestKey()                          */
+/*                                                                      */
+/*      16 hex digits naming the files of a request key, from two       */
+/*      FNV-1a hashes. Files carry the full key to rule out collisions. */
+/************************************************************************/
+
+void msHashRequestKey(const char *key, char *hash)
+{
+  ms_uint32 h1 = 2166136261U, h2 = 84696351U;
+  const unsigned char *s;
+
+  for(s = (const unsigned char *) key; *s; s++) {
+    h1 = ((h1 ^ *s) * 16777619U) & 0xffffffffU;
+    h2 = ((h2 ^ *s) * 16777619U) & 0xffffffffU;
+  }
+  sprintf(hash, "%08x%08x", (unsigned int) h1, (unsigned int) h2);
+}
+
+/************************************************************************/
+/*                          msReadKeyedFile()                           */
+/*                                                                      */
+/*      Reads an image written by msWriteKeyedFile(), failing if the    */
+/*      file is missing, truncated or for another key.                  */
+/************************************************************************/
+
+int msReadKeyedFile(const char *path, const char *key, unsigned char **data, int *size, char **mimetype)
+{
+  FILE *fp;
+  struct stat st;
+  size_t keylen = strlen(key);
+  char *header = NULL, mime[256];
+  long bodystart;
+  int status = MS_FAILURE;
+
+  if((fp = fopen(path, "rb")) == NULL)
+    return MS_FAILURE;
+  if(fstat(fileno(fp), &st) != 0) {
+    fclose(fp);
+    return MS_FAILURE;
+  }
+
+  header = (char *) msSmallMalloc(keylen + 2);
+  if(fread(header, 1, keylen + 1, fp) == keylen + 1 && memcmp(header, key, keylen) == 0 &&
+      header[keylen] == '\n' && fgets(mime, sizeof(mime), fp) && mime[0] && mime[strlen(mime)-1] == '\n') {
+    mime[strlen(mime)-1] = '\0';
+    bodystart = ftell(fp);
+    if(st.st_size > bodystart) {
+      *size = (int) (st.st_size - bodystart);
+      *data = (unsigned char *) msSmallMalloc(*size);
+      if(fread(*data, 1, *size, fp) == (size_t) *size) {
+        *mimetype = msStrdup(mime);
+        status = MS_SUCCESS;
+      } else {
+        msFree(*data);
+        *data = NULL;
+      }
+    }
+  }
+  free(header);
+  fclose(fp);
+
+  return status;
+}
+
+/************************************************************************/
+/*                          msWriteKeyedFile()                          */
+/*                                                                      */
+/*      Writes key, mime type and image, through a temporary file so    */
+/*      that readers never see a partial one.                           */
+/************************************************************************/
+
+int msWriteKeyedFile(const char *path, const char *key, const unsigned char *data, int size, const char *mimetype)
+{
+  static int counter = 0;
+  char tmpname[64];
+  char *tmpfile;
+  FILE *fp;
+  int status = MS_FAILURE;
+
+  snprintf(tmpname, sizeof(tmpname), ".%ld.%d", (long) getpid(), ++counter);
+  tmpfile = msStringConcatenate(msStrdup(path), tmpname);
+  if((fp = fopen(tmpfile, "wb")) != NULL) {
+    int ok = fprintf(fp, "%s\n%s\n", key, mimetype) > 0 && fwrite(data, 1, size, fp) == (size_t) size;
+
+    if(fclose(fp) == 0 && ok) {
+#ifdef _WIN32
+      unlink(path);
+#endif
+      if(rename(tmpfile, path) == 0)
+        status = MS_SUCCESS;
+      else
+        unlink(tmpfile);
+    } else
+      unlink(tmpfile);
+  }
+  free(tmpfile);
+
+  return status;
+}
+
+/* ==================================================================== */
+/*      Public interface.                                               */
+/* ==================================================================== */
+
+/************************************************************************/
+/*                          msCoalesceBegin()                           */
+/*                                                                      */
+/*      To be called once the request parameters are applied to map.    */
+/*      Returns NULL when coalescing is off. Otherwise, if              */
+/*      msCoalesceGetMimeType() gives a type, the image of an identical */
+/*      request is there and the caller only has to send it with        */
+/*      msCoalesceWrite(), else the caller                              */
+/*      renders, sends and hands the image to msCoalesceSetImage(). In  */
+/*      both cases msCoalesceEnd() must be called. mapfile is the file  */
+/*      map was loaded from, see msBuildRequestKey().                   */
+/************************************************************************/
+
+msCoalesceObj *msCoalesceBegin(mapObj *map, const char *mapfile, char **names, char **values, int numentries)
+{
+  const char *inprocess = msGetConfigOption(map, "MS_COALESCE_REQUESTS");
+  const char *dir = msGetConfigOption(map, "MS_COALESCE_DIR");
+  const char *timeout = msGetConfigOption(map, "MS_COALESCE_TIMEOUT");
+  msCoalesceObj *c;
+  int render = MS_TRUE;
+
+  if(!(inprocess && strcasecmp(inprocess, "ON") == 0) && !(dir && *dir))
+    return NULL;
+
+  c = (msCoalesceObj *) msSmallCalloc(1, sizeof(msCoalesceObj));
+  c->key = msBuildRequestKey(map, mapfile, names, values, numentries);
+  c->timeout = timeout ? atoi(timeout) : MS_COALESCE_TIMEOUT;
+  if(c->timeout <= 0)
+    c->timeout = MS_COALESCE_TIMEOUT;
+
+  render = msCoalesceJoin(c, &c->data, &c->size, &c->mimetype);
+
+  if(render && dir && *dir) {
+    msCoalesceFileNames(c, dir);
+    msCoalesceSweep(dir);
+    if(!msCoalesceLockFile(c, &c->data, &c->size, &c->mimetype)) {
+      msFree(c->lockfile);
+      c->lockfile = NULL;
+    }
+  }
+
+  if(c->data && map->debug >= MS_DEBUGLEVEL_V)
+    msDebug("msCoalesceBegin(): sending the image rendered for an identical request.\n");
+
+  return c;
+}
+
+/************************************************************************/
+/*                       msCoalesceGetMimeType()                        */
+/*                                                                      */
+/*      Returns the mime type of the image of an identical request if   */
+/*      msCoalesceBegin() got one, NULL when the caller has to render.  */
+/************************************************************************/
+
+const char *msCoalesceGetMimeType(msCoalesceObj *c)
+{
+  return (c && c->data) ? c->mimetype : NULL;
+}
+
+/************************************************************************/
+/*                         msCoalesceSetImage()                         */
+/*                                                                      */
+/*      Keeps a copy of the encoded image for the waiting requests,     */
+/*      see msSaveImageCapture().                                       */
+/************************************************************************/
+
+void msCoalesceSetImage(msCoalesceObj *c, const unsigned char *data, int size, const char *mimetype)
+{
+  if(c == NULL || c->data != NULL || size <= 0)
+    return;
+
+  c->data = (unsigned char *) msSmallMalloc(size);
+  memcpy(c->data, data, size);
+  c->size = size;
+  c->mimetype = msStrdup(mimetype);
+}
+
+/************************************************************************/
+/*                          msCoalesceWrite()                           */
+/*                                                                      */
+/*      Sends the image of the identical request.                       */
+/************************************************************************/
+
+int msCoalesceWrite(msCoalesceObj *c)
+{
+  if(msIO_needBinaryStdout() == MS_FAILURE)
+    return MS_FAILURE;
+  if(msIO_fwrite(c->data, 1, c->size, stdout) != c->size) {
+    msSetError(MS_IOERR, "Failed to write the coalesced image.", "msCoalesceWrite()");
+    return MS_FAILURE;
+  }
+  return MS_SUCCESS;
+}
+
+/************************************************************************/
+/*                           msCoalesceEnd()                            */
+/*                                                                      */
+/*      Hands the image (if any) to the waiting requests and frees c.   */
+/************************************************************************/
+
+void msCoalesceEnd(msCoalesceObj *c)
+{
+  if(c == NULL)
+    return;
+
+  if(c->lockfile) {
+    if(c->data)
+      msWriteKeyedFile(c->resultfile, c->key, c->data, c->size, c->mimetype);
+    unlink(c->lockfile);
+  }
+  if(c->entry)
+    msCoalescePublish(c, c->data, c->size, c->mimetype);
+
+  msFree(c->key);
+  msFree(c->lockfile);
+  msFree(c->resultfile);
+  msFree(c->data);
+  msFree(c->mimetype);
+  free(c);
+}
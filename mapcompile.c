@@ -0,0 +1,73 @@
+/******************************************************************************
+ * $Id$
+ *
+ * Project:  MapServer
+ * Purpose:  Command line utility to compile a mapfile, with its includes and
+ *           symbolset, into a file msLoadMap() reads without scanning it.
+ * Author:   Steve Lime and the MapServer team.
+ *
+ ******************************************************************************
+ * Copyright (c) 1996-2005 Regents of the University of Minnesota.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies of this Software or works derived from this Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mapserver.h"
+
+
+
+int main(int argc, char *argv[])
+{
+  if(argc > 1 && strcmp(argv[1], "-v") == 0) {
+    printf("%s\n", msGetVersion());
+    exit(0);
+  }
+
+  /* ------------------------------------------------------------------------------- */
+  /*       Check the number of arguments, return syntax if not correct               */
+  /* ------------------------------------------------------------------------------- */
+  if( argc != 3 ) {
+    fprintf(stderr,"Syntax: mapcompile [mapfile] [compiled mapfile]\n" );
+    fprintf(stderr,"Writes the tokens of [mapfile], its includes and its symbolset to [compiled mapfile],\n" );
+    fprintf(stderr,"which MapServer then loads in place of the mapfile. Relative paths are taken from the\n" );
+    fprintf(stderr,"location of the compiled mapfile. Compile it again when any of these files change, or\n" );
+    fprintf(stderr,"after upgrading MapServer.\n" );
+    exit(1);
+  }
+
+  msSetErrorFile("stderr", NULL);
+
+  if(msSetup() != MS_SUCCESS) {
+    msWriteError(stderr);
+    exit(1);
+  }
+
+  if(msSaveCompiledMap(argv[1], argv[2]) != MS_SUCCESS) {
+    msWriteError(stderr);
+    msCleanup();
+    exit(1);
+  }
+
+  msCleanup();
+  return(0);
+}
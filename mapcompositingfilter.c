@@ -27,89 +27,228 @@
  *****************************************************************************/
 #include "mapserver.h"
 #include <regex.h>
-#define pixmove(rb,srcx,srcy,dstx,dsty) \
-  memcpy(rb->data.rgba.pixels+dsty*rb->data.rgba.row_step+dstx*4,\
-          rb->data.rgba.pixels+srcy*rb->data.rgba.row_step+srcx*4,\
-          4)
-#define pixerase(rb,x,y) memset(rb->data.rgba.pixels+y*rb->data.rgba.row_step+x*4,0,4)
 
-void msApplyTranslationCompositingFilter(rasterBufferObj *rb, int xtrans, int ytrans) {
-  int src_sx,src_sy,dst_sx,dst_sy,x,y,dst_x,dst_y;
-  if(abs(xtrans)>=rb->width || abs(ytrans)>=rb->height) {
-    for(y = 0; y<rb->height; y++)
-      for(x = 0; x<rb->width; x++)
-        pixerase(rb,x,y);
-  }
-  if(xtrans == 0 && ytrans == 0)
-    return;
-  if(xtrans>=0) {
-    if(ytrans>=0) {
-      src_sx = rb->width - xtrans - 1;
-      src_sy = rb->height - ytrans - 1;
-      dst_sx = rb->width - 1;
-      dst_sy = rb->height -1;
-      for(y = src_sy,dst_y= dst_sy;y>=0;y--,dst_y--) {
-        for(x = src_sx,dst_x= dst_sx;x>=0;x--,dst_x--) {
-          pixmove(rb,x,y,dst_x,dst_y);
-        }
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define MS_COMPOSITING_SSE2
+#endif
+
+/*
+** The pixel kernels below work on whole rows of premultiplied pixels. The SSE2
+** versions handle four pixels at a time and require the alpha to be the last
+** byte of each pixel, the scalar versions handle the remaining pixels and any
+** other layout. Both reproduce the integer arithmetic of the AGG blenders so
+** the output does not depend on which of them ran.
+*/
+#define RB_ALPHA_LAST(rb) ((rb)->data.rgba.a == (rb)->data.rgba.pixels + 3)
+
+/* src over dst, as agg's blender_rgba_pre with a cover */
+static void blendSrcOverScalar(unsigned char *d, const unsigned char *s, int n, unsigned int cover, int ai)
+{
+  int i,c;
+  for(i=0; i<n; i++, d+=4, s+=4) {
+    unsigned int alpha = s[ai];
+    if(!alpha) continue;
+    if(cover == 255) {
+      if(alpha == 255) {
+        memcpy(d,s,4);
+        continue;
+      }
+      alpha = 255 - alpha;
+      for(c=0; c<4; c++) {
+        if(c == ai)
+          d[c] = (unsigned char)(255 - ((alpha * (255 - d[c])) >> 8));
+        else
+          d[c] = (unsigned char)(((d[c] * alpha) >> 8) + s[c]);
       }
-      for(y=0;y<ytrans;y++)
-        for(x=0;x<rb->width;x++)
-          pixerase(rb,x,y);  
-      for(y=ytrans;y<rb->height;y++)
-        for(x=0;x<xtrans;x++)
-          pixerase(rb,x,y);
     } else {
-      src_sx = rb->width - xtrans - 1;
-      src_sy = - ytrans;
-      dst_sx = rb->width - 1;
-      dst_sy = 0;
-      for(y = src_sy,dst_y= dst_sy;y<rb->height;y++,dst_y++) {
-        for(x = src_sx,dst_x= dst_sx;x>=0;x--,dst_x--) {
-          pixmove(rb,x,y,dst_x,dst_y);
-        }
+      /* alpha * (cover + 1) >> 8 can not reach 255 here */
+      alpha = 255 - ((alpha * (cover + 1)) >> 8);
+      for(c=0; c<4; c++) {
+        if(c == ai)
+          d[c] = (unsigned char)(255 - ((alpha * (255 - d[c])) >> 8));
+        else
+          d[c] = (unsigned char)((d[c] * alpha + s[c] * (cover + 1)) >> 8);
       }
-      for(y=0;y<rb->height+ytrans;y++)
-        for(x=0;x<xtrans;x++)
-          pixerase(rb,x,y);  
-      for(y=rb->height+ytrans;y<rb->height;y++)
-        for(x=0;x<rb->width;x++)
-          pixerase(rb,x,y);
     }
-  } else {
-    if(ytrans>=0) {
-      src_sx = - xtrans;
-      src_sy = rb->height - ytrans - 1;
-      dst_sx = 0;
-      dst_sy = rb->height -1;
-      for(y = src_sy,dst_y= dst_sy;y>=0;y--,dst_y--) {
-        for(x = src_sx,dst_x= dst_sx;x<rb->width;x++,dst_x++) {
-          pixmove(rb,x,y,dst_x,dst_y);
-        }
-      }
-      for(y=0;y<ytrans;y++)
-        for(x=0;x<rb->width;x++)
-          pixerase(rb,x,y);
-      for(y=ytrans;y<rb->height;y++)
-        for(x=rb->width+xtrans;x<rb->width;x++)
-          pixerase(rb,x,y);
-    } else {
-      src_sx = - xtrans;
-      src_sy = - ytrans;
-      dst_sx = 0;
-      dst_sy = 0;
-      for(y = src_sy,dst_y= dst_sy;y<rb->height;y++,dst_y++) {
-        for(x = src_sx,dst_x= dst_sx;x<rb->width;x++,dst_x++) {
-          pixmove(rb,x,y,dst_x,dst_y);
-        }
+  }
+}
+
+/* Dca' = Sca.Dca + Sca.(1 - Da) + Dca.(1 - Sa), Da' = Sa + Da - Sa.Da, as agg's comp_op_rgba_multiply */
+static void blendMultiplyScalar(unsigned char *d, const unsigned char *s, int n, unsigned int cover, int ai)
+{
+  int i,c;
+  for(i=0; i<n; i++, d+=4, s+=4) {
+    unsigned int sp[4], sa, s1a, d1a;
+    for(c=0; c<4; c++)
+      sp[c] = (cover < 255) ? (s[c] * cover + 255) >> 8 : s[c];
+    sa = sp[ai];
+    if(!sa) continue;
+    s1a = 255 - sa;
+    d1a = 255 - d[ai];
+    for(c=0; c<4; c++) {
+      if(c != ai)
+        d[c] = (unsigned char)((sp[c] * d[c] + sp[c] * d1a + d[c] * s1a + 255) >> 8);
+    }
+    d[ai] = (unsigned char)(sa + d[ai] - ((sa * d[ai] + 255) >> 8));
+  }
+}
+
+#ifdef MS_COMPOSITING_SSE2
+/* the 16 bit alpha of each pixel of a row of two unpacked pixels, in all four of its lanes */
+#define SSE2_SPLAT_ALPHA(v) _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, _MM_SHUFFLE(3,3,3,3)), _MM_SHUFFLE(3,3,3,3))
+
+static void blendSrcOverSSE2(unsigned char *d, const unsigned char *s, int n, unsigned int cover)
+{
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i mask = _mm_set1_epi16(255);
+  const __m128i one = _mm_set1_epi16(1);
+  const __m128i cov = _mm_set1_epi16((short)(cover + 1));
+  const __m128i opaque = _mm_set1_epi32(255);
+  const __m128i alphalanes = _mm_set_epi16(-1,0,0,0,-1,0,0,0);
+  int i;
+  for(i=0; i+4<=n; i+=4, d+=16, s+=16) {
+    __m128i sv = _mm_loadu_si128((const __m128i*)s);
+    __m128i dv = _mm_loadu_si128((const __m128i*)d);
+    __m128i skip = _mm_cmpeq_epi32(_mm_srli_epi32(sv,24), zero);
+    __m128i res[2];
+    int h;
+    if(_mm_movemask_epi8(skip) == 0xFFFF) continue;
+    if(cover == 255 && _mm_movemask_epi8(_mm_cmpeq_epi32(_mm_srli_epi32(sv,24), opaque)) == 0xFFFF) {
+      _mm_storeu_si128((__m128i*)d, sv);
+      continue;
+    }
+    for(h=0; h<2; h++) {
+      __m128i s16 = h ? _mm_unpackhi_epi8(sv,zero) : _mm_unpacklo_epi8(sv,zero);
+      __m128i d16 = h ? _mm_unpackhi_epi8(dv,zero) : _mm_unpacklo_epi8(dv,zero);
+      __m128i alpha = SSE2_SPLAT_ALPHA(s16), color, a;
+      if(cover == 255) {
+        alpha = _mm_sub_epi16(mask, alpha);
+        color = _mm_add_epi16(_mm_srli_epi16(_mm_mullo_epi16(d16,alpha),8), s16);
+      } else {
+        __m128i x,y;
+        alpha = _mm_sub_epi16(mask, _mm_srli_epi16(_mm_mullo_epi16(alpha,cov),8));
+        /* (x + y) >> 8 without overflowing 16 bits */
+        x = _mm_mullo_epi16(d16,alpha);
+        y = _mm_mullo_epi16(s16,cov);
+        color = _mm_add_epi16(_mm_add_epi16(_mm_srli_epi16(x,1), _mm_srli_epi16(y,1)), _mm_and_si128(_mm_and_si128(x,y),one));
+        color = _mm_srli_epi16(color,7);
       }
-      for(y=0;y<rb->height+ytrans;y++)
-        for(x=rb->width+xtrans;x<rb->width;x++)
-          pixerase(rb,x,y);
-      for(y=rb->height+ytrans;y<rb->height;y++)
-        for(x=0;x<rb->width;x++)
-          pixerase(rb,x,y);
+      a = _mm_sub_epi16(mask, _mm_srli_epi16(_mm_mullo_epi16(alpha,_mm_sub_epi16(mask,d16)),8));
+      color = _mm_or_si128(_mm_andnot_si128(alphalanes,color), _mm_and_si128(alphalanes,a));
+      res[h] = _mm_and_si128(color,mask);
+    }
+    dv = _mm_or_si128(_mm_and_si128(skip,dv), _mm_andnot_si128(skip,_mm_packus_epi16(res[0],res[1])));
+    _mm_storeu_si128((__m128i*)d, dv);
+  }
+  blendSrcOverScalar(d, s, n-i, cover, 3);
+}
+
+static void blendMultiplySSE2(unsigned char *d, const unsigned char *s, int n, unsigned int cover)
+{
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i mask = _mm_set1_epi16(255);
+  const __m128i mask32 = _mm_set1_epi32(255);
+  const __m128i cov = _mm_set1_epi16((short)cover);
+  const __m128i alphalanes = _mm_set_epi16(-1,0,0,0,-1,0,0,0);
+  int i;
+  for(i=0; i+4<=n; i+=4, d+=16, s+=16) {
+    __m128i sv = _mm_loadu_si128((const __m128i*)s);
+    __m128i dv = _mm_loadu_si128((const __m128i*)d);
+    __m128i skip, res[2];
+    int h;
+    if(cover < 255) {
+      __m128i lo = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(sv,zero),cov),mask),8);
+      __m128i hi = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(sv,zero),cov),mask),8);
+      sv = _mm_packus_epi16(lo,hi);
+    }
+    skip = _mm_cmpeq_epi32(_mm_srli_epi32(sv,24), zero);
+    if(_mm_movemask_epi8(skip) == 0xFFFF) continue;
+    for(h=0; h<2; h++) {
+      __m128i s16 = h ? _mm_unpackhi_epi8(sv,zero) : _mm_unpacklo_epi8(sv,zero);
+      __m128i d16 = h ? _mm_unpackhi_epi8(dv,zero) : _mm_unpacklo_epi8(dv,zero);
+      __m128i sa = SSE2_SPLAT_ALPHA(s16), da = SSE2_SPLAT_ALPHA(d16);
+      /* sca * (dca + 1 - da) + dca * (1 - sa) summed in 32 bits as agg does */
+      __m128i f1 = _mm_add_epi16(d16, _mm_sub_epi16(mask,da));
+      __m128i f2 = _mm_sub_epi16(mask,sa);
+      __m128i lo = _mm_madd_epi16(_mm_unpacklo_epi16(s16,d16), _mm_unpacklo_epi16(f1,f2));
+      __m128i hi = _mm_madd_epi16(_mm_unpackhi_epi16(s16,d16), _mm_unpackhi_epi16(f1,f2));
+      __m128i color, a;
+      lo = _mm_and_si128(_mm_srli_epi32(_mm_add_epi32(lo,mask32),8),mask32);
+      hi = _mm_and_si128(_mm_srli_epi32(_mm_add_epi32(hi,mask32),8),mask32);
+      color = _mm_packs_epi32(lo,hi);
+      a = _mm_sub_epi16(_mm_add_epi16(sa,da), _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(sa,da),mask),8));
+      color = _mm_or_si128(_mm_andnot_si128(alphalanes,color), _mm_and_si128(alphalanes,a));
+      res[h] = _mm_and_si128(color,mask);
     }
+    dv = _mm_or_si128(_mm_and_si128(skip,dv), _mm_andnot_si128(skip,_mm_packus_epi16(res[0],res[1])));
+    _mm_storeu_si128((__m128i*)d, dv);
+  }
+  blendMultiplyScalar(d, s, n-i, cover, 3);
+}
+#endif
+
+/* blend src over dst, both premultiplied and of the same size, cover being the 0-255 layer opacity */
+void msBlendRasterBufferSrcOver(rasterBufferObj *dst, rasterBufferObj *src, unsigned int cover)
+{
+  int row;
+  int ai = dst->data.rgba.a - dst->data.rgba.pixels;
+  for(row=0; row<dst->height; row++) {
+    unsigned char *d = dst->data.rgba.pixels + row*dst->data.rgba.row_step;
+    const unsigned char *s = src->data.rgba.pixels + row*src->data.rgba.row_step;
+#ifdef MS_COMPOSITING_SSE2
+    if(RB_ALPHA_LAST(dst)) {
+      blendSrcOverSSE2(d, s, dst->width, cover);
+      continue;
+    }
+#endif
+    blendSrcOverScalar(d, s, dst->width, cover, ai);
+  }
+}
+
+/* same as msBlendRasterBufferSrcOver() with the multiply compositing operator */
+void msBlendRasterBufferMultiply(rasterBufferObj *dst, rasterBufferObj *src, unsigned int cover)
+{
+  int row;
+  int ai = dst->data.rgba.a - dst->data.rgba.pixels;
+  for(row=0; row<dst->height; row++) {
+    unsigned char *d = dst->data.rgba.pixels + row*dst->data.rgba.row_step;
+    const unsigned char *s = src->data.rgba.pixels + row*src->data.rgba.row_step;
+#ifdef MS_COMPOSITING_SSE2
+    if(RB_ALPHA_LAST(dst)) {
+      blendMultiplySSE2(d, s, dst->width, cover);
+      continue;
+    }
+#endif
+    blendMultiplyScalar(d, s, dst->width, cover, ai);
+  }
+}
+
+/* shift the whole buffer, rows are moved at once and the uncovered pixels cleared */
+void msApplyTranslationCompositingFilter(rasterBufferObj *rb, int xtrans, int ytrans) {
+  int y, step, width;
+  if(xtrans == 0 && ytrans == 0)
+    return;
+  if(abs(xtrans)>=rb->width || abs(ytrans)>=rb->height) {
+    for(y = 0; y<rb->height; y++)
+      memset(rb->data.rgba.pixels + y*rb->data.rgba.row_step, 0, rb->width*4);
+    return;
+  }
+  width = rb->width - abs(xtrans);
+  /* walk the rows away from the direction of the shift so sources are read before being overwritten */
+  step = (ytrans > 0) ? -1 : 1;
+  for(y = (ytrans > 0) ? rb->height-1 : 0; y>=0 && y<rb->height; y+=step) {
+    unsigned char *dst = rb->data.rgba.pixels + y*rb->data.rgba.row_step;
+    int srcy = y - ytrans;
+    if(srcy < 0 || srcy >= rb->height) {
+      memset(dst, 0, rb->width*4);
+      continue;
+    }
+    memmove(dst + MS_MAX(xtrans,0)*4, rb->data.rgba.pixels + srcy*rb->data.rgba.row_step + MS_MAX(-xtrans,0)*4, width*4);
+    if(xtrans > 0)
+      memset(dst, 0, xtrans*4);
+    else if(xtrans < 0)
+      memset(dst + width*4, 0, -xtrans*4);
   }
 }
 
@@ -120,7 +259,17 @@ void msApplyBlackeningCompositingFilter(rasterBufferObj *rb) {
     r = rb->data.rgba.r + row*rb->data.rgba.row_step;
     g = rb->data.rgba.g + row*rb->data.rgba.row_step;
     b = rb->data.rgba.b + row*rb->data.rgba.row_step;
-    for(col=0;col<rb->width;col++) {
+    col = 0;
+#ifdef MS_COMPOSITING_SSE2
+    if(RB_ALPHA_LAST(rb)) {
+      const __m128i alphas = _mm_set1_epi32((int)0xFF000000);
+      unsigned char *p = rb->data.rgba.pixels + row*rb->data.rgba.row_step;
+      for(; col+4<=rb->width; col+=4, p+=16)
+        _mm_storeu_si128((__m128i*)p, _mm_and_si128(_mm_loadu_si128((__m128i*)p), alphas));
+      r+=4*col;g+=4*col;b+=4*col;
+    }
+#endif
+    for(;col<rb->width;col++) {
       *r = *g = *b = 0;
       r+=4;g+=4;b+=4;
     }    
@@ -135,7 +284,20 @@ void msApplyWhiteningCompositingFilter(rasterBufferObj *rb) {
     g = rb->data.rgba.g + row*rb->data.rgba.row_step;
     b = rb->data.rgba.b + row*rb->data.rgba.row_step;
     a = rb->data.rgba.a + row*rb->data.rgba.row_step;
-    for(col=0;col<rb->width;col++) {
+    col = 0;
+#ifdef MS_COMPOSITING_SSE2
+    if(RB_ALPHA_LAST(rb)) {
+      unsigned char *p = rb->data.rgba.pixels + row*rb->data.rgba.row_step;
+      for(; col+4<=rb->width; col+=4, p+=16) {
+        __m128i v = _mm_srli_epi32(_mm_loadu_si128((__m128i*)p), 24);
+        v = _mm_or_si128(v, _mm_slli_epi32(v, 8));
+        v = _mm_or_si128(v, _mm_slli_epi32(v, 16));
+        _mm_storeu_si128((__m128i*)p, v);
+      }
+      r+=4*col;g+=4*col;b+=4*col;a+=4*col;
+    }
+#endif
+    for(;col<rb->width;col++) {
       *r = *g = *b = *a;
       r+=4;g+=4;b+=4;a+=4;
     }    
@@ -149,7 +311,25 @@ void msApplyGrayscaleCompositingFilter(rasterBufferObj *rb) {
     r = rb->data.rgba.r + row*rb->data.rgba.row_step;
     g = rb->data.rgba.g + row*rb->data.rgba.row_step;
     b = rb->data.rgba.b + row*rb->data.rgba.row_step;
-    for(col=0;col<rb->width;col++) {
+    col = 0;
+#ifdef MS_COMPOSITING_SSE2
+    if(RB_ALPHA_LAST(rb)) {
+      const __m128i low = _mm_set1_epi32(0xFF);
+      const __m128i third = _mm_set1_epi16((short)43691); /* x * 43691 >> 17 == x / 3 for x <= 765 */
+      unsigned char *p = rb->data.rgba.pixels + row*rb->data.rgba.row_step;
+      for(; col+4<=rb->width; col+=4, p+=16) {
+        __m128i v = _mm_loadu_si128((__m128i*)p);
+        __m128i mix = _mm_add_epi32(_mm_add_epi32(_mm_and_si128(v,low), _mm_and_si128(_mm_srli_epi32(v,8),low)),
+                                    _mm_and_si128(_mm_srli_epi32(v,16),low));
+        /* mix fits the low 16 bits of each 32 bit lane, the high ones are 0 */
+        mix = _mm_and_si128(_mm_srli_epi32(_mm_mulhi_epu16(mix,third),1),low);
+        mix = _mm_or_si128(mix, _mm_or_si128(_mm_slli_epi32(mix,8), _mm_slli_epi32(mix,16)));
+        _mm_storeu_si128((__m128i*)p, _mm_or_si128(mix, _mm_andnot_si128(_mm_srli_epi32(_mm_set1_epi32(-1),8), v)));
+      }
+      r+=4*col;g+=4*col;b+=4*col;
+    }
+#endif
+    for(;col<rb->width;col++) {
       unsigned int mix = (unsigned int)*r + (unsigned int)*g + (unsigned int)*b;
       mix /=3;
       *r = *g = *b = (unsigned char)mix;
@@ -41,6 +41,7 @@
 #include "mapthread.h"
 #include "mapraster.h"
 #include "cpl_string.h"
+#include "uthash.h"
 
 #define GEO_TRANS(tr,x,y)  ((tr)[0]+(tr)[1]*(x)+(tr)[2]*(y))
 
@@ -59,8 +60,63 @@ typedef struct {
   OGRDataSourceH hOGRDS;
   double cellsize;
 
+  /* PROCESSING "CONTOUR_CACHE=ON": window to build from cached cells */
+  int cache_window;
+  int band;
+  int step_x, step_y;
+  int src_xoff, src_yoff, src_xsize, src_ysize;
+  double adfGeoTransform[6]; /* of the original dataset */
+  rectObj window; /* georeferenced extent of the window */
+
 } contourLayerInfo;
 
+/************************************************************************/
+/*                            Contour cache                             */
+/*                                                                      */
+/*      With PROCESSING "CONTOUR_CACHE=ON", contours are generated on   */
+/*      a grid of cells of MS_CONTOUR_CACHE_CELL samples aligned on     */
+/*      the virtual grid of the DEM, and the cells are kept in a        */
+/*      process wide LRU keyed on the dataset, band, sampling step,     */
+/*      contour item, interval and levels.  Neighbouring tiles and      */
+/*      repeated requests then copy the isolines of the cells they      */
+/*      overlap instead of contouring the same samples again.  Cells    */
+/*      share their edge samples, so isolines join across cells.        */
+/*                                                                      */
+/*      These static structures are protected by the TLOCK_CONTOUR      */
+/*      mutex.                                                          */
+/************************************************************************/
+
+#define MS_CONTOUR_CACHE_CELL 256
+#define MS_CONTOUR_CACHE_MAX 128
+
+typedef struct {
+  char *key;
+  OGRDataSourceH hDS;
+  UT_hash_handle hh;
+} contourCacheObj;
+
+static contourCacheObj *contourCache = NULL;
+static int contourCacheCount = 0;
+
+static void msContourCacheFree(contourCacheObj *entry)
+{
+  UT_HASH_DEL(contourCache, entry);
+  msAcquireLock(TLOCK_OGR);
+  OGR_DS_Destroy(entry->hDS);
+  msReleaseLock(TLOCK_OGR);
+  free(entry->key);
+  free(entry);
+  contourCacheCount--;
+}
+
+void msContourCacheCleanup(void)
+{
+  msAcquireLock(TLOCK_CONTOUR);
+  while (contourCache)
+    msContourCacheFree(contourCache);
+  msReleaseLock(TLOCK_CONTOUR);
+}
+
 
 static int msContourLayerInitItemInfo(layerObj *layer)
 {
@@ -127,6 +183,16 @@ static void msContourLayerInfoFree(layerObj *layer)
   layer->layerinfo = NULL;
 }
 
+static void msContourLayerSetCellsize(layerObj *layer, double cellsize)
+{
+  contourLayerInfo *clinfo = (contourLayerInfo *) layer->layerinfo;
+  char buf[64];
+
+  clinfo->cellsize = cellsize;
+  sprintf(buf, "%lf", clinfo->cellsize);
+  msInsertHashTable(&layer->metadata, "__data_cellsize__", buf);
+}
+
 static int msContourLayerReadRaster(layerObj *layer, rectObj rect)
 {
   mapObj *map = layer->map;  
@@ -154,6 +220,8 @@ static int msContourLayerReadRaster(layerObj *layer, rectObj rect)
     return MS_FAILURE;    
   }
 
+  clinfo->cache_window = MS_FALSE;
+
   bands = CSLTokenizeStringComplex(
                CSLFetchNameValue(layer->processing,"BANDS"), " ,", FALSE, FALSE );
   if (CSLCount(bands) > 0) {
@@ -383,6 +451,22 @@ static int msContourLayerReadRaster(layerObj *layer, rectObj rect)
       msDebug( "msContourLayerReadRaster(): src=%d,%d,%d,%d, dst=%d,%d,%d,%d\n",
                src_xoff, src_yoff, src_xsize, src_ysize,
                0, 0, dst_xsize, dst_ysize );
+
+    /* the cached cells are read by msContourLayerGenerateContour() */
+    if (CSLFetchBoolean(layer->processing, "CONTOUR_CACHE", FALSE)) {
+      clinfo->cache_window = MS_TRUE;
+      clinfo->band = band;
+      clinfo->step_x = virtual_grid_step_x;
+      clinfo->step_y = virtual_grid_step_y;
+      clinfo->src_xoff = src_xoff;
+      clinfo->src_yoff = src_yoff;
+      clinfo->src_xsize = src_xsize;
+      clinfo->src_ysize = src_ysize;
+      memcpy(clinfo->adfGeoTransform, adfGeoTransform, sizeof(adfGeoTransform));
+      clinfo->window = copyRect;
+      msContourLayerSetCellsize(layer, MS_MAX(dst_cellsize_x, dst_cellsize_y));
+      return MS_SUCCESS;
+    }
   } else {
     src_xoff = 0;
     src_yoff = 0;
@@ -436,12 +520,7 @@ static int msContourLayerReadRaster(layerObj *layer, rectObj rect)
   adfGeoTransform[4] = 0;
   adfGeoTransform[5] = -dst_cellsize_y;
 
-  clinfo->cellsize = MS_MAX(dst_cellsize_x, dst_cellsize_y);
-  {
-    char buf[64];
-    sprintf(buf, "%lf", clinfo->cellsize);
-    msInsertHashTable(&layer->metadata, "__data_cellsize__", buf);
-  }
+  msContourLayerSetCellsize(layer, MS_MAX(dst_cellsize_x, dst_cellsize_y));
       
   GDALSetGeoTransform(clinfo->hDS, adfGeoTransform);
   return MS_SUCCESS;
@@ -505,79 +584,303 @@ static char* msContourGetOption(layerObj *layer, const char *name)
   return value;
 }
 
-static int msContourLayerGenerateContour(layerObj *layer)
+/* Create an in-memory OGR DataSource with an empty contour layer */
+static OGRDataSourceH msContourCreateDataSource(layerObj *layer,
+                                                const char *elevItem,
+                                                OGRLayerH *phLayer)
 {
   OGRSFDriverH hDriver;
   OGRFieldDefnH hFld;
-  OGRLayerH hLayer;
-  const char *elevItem;
-  char *option;
-  double interval = 1.0, levels[1000];
-  int levelCount = 0;
-  GDALRasterBandH hBand = NULL;
-  CPLErr eErr;
-
+  OGRDataSourceH hOGRDS;
   contourLayerInfo *clinfo = (contourLayerInfo *) layer->layerinfo;
 
-  OGRRegisterAll();
-
-  if (clinfo == NULL) {
-    msSetError(MS_MISCERR, "Assertion failed: Contour layer not opened!!!",
-               "msContourLayerCreateOGRDataSource()");
-    return MS_FAILURE;
-  }
-
-  if (!clinfo->hDS) { /* no overlap */
-    return MS_SUCCESS;
-  }
-  
-  hBand = GDALGetRasterBand(clinfo->hDS, 1);
-  if (hBand == NULL)
-  {
-    msSetError(MS_IMGERR,
-               "Band %d does not exist on dataset.",
-               "msContourLayerGenerateContour()", 1);
-    return MS_FAILURE;
-  }
-
-  /* Create the OGR DataSource */
   hDriver = OGRGetDriverByName("Memory");
   if (hDriver == NULL) {
     msSetError(MS_OGRERR,
                "Unable to get OGR driver 'Memory'.",
                "msContourLayerCreateOGRDataSource()");
-    return MS_FAILURE;
+    return NULL;
   }
 
-  clinfo->hOGRDS = OGR_Dr_CreateDataSource(hDriver, "", NULL);
-  if (clinfo->hOGRDS == NULL) {
+  hOGRDS = OGR_Dr_CreateDataSource(hDriver, "", NULL);
+  if (hOGRDS == NULL) {
     msSetError(MS_OGRERR,
                "Unable to create OGR DataSource.",
                "msContourLayerCreateOGRDataSource()");
-    return MS_FAILURE;
+    return NULL;
   }
 
-  hLayer = OGR_DS_CreateLayer(clinfo->hOGRDS, clinfo->ogrLayer.name, NULL,
-                              wkbLineString, NULL );
+  *phLayer = OGR_DS_CreateLayer(hOGRDS, clinfo->ogrLayer.name, NULL,
+                                wkbLineString, NULL );
 
   hFld = OGR_Fld_Create("ID", OFTInteger);
   OGR_Fld_SetWidth(hFld, 8);
-  OGR_L_CreateField(hLayer, hFld, FALSE);
+  OGR_L_CreateField(*phLayer, hFld, FALSE);
   OGR_Fld_Destroy(hFld);
 
-  /* Check if we have a coutour item specified */
-  elevItem = CSLFetchNameValue(layer->processing,"CONTOUR_ITEM");
-  if (elevItem && strlen(elevItem) > 0) {
+  if (elevItem) {
     hFld = OGR_Fld_Create(elevItem, OFTReal);
     OGR_Fld_SetWidth(hFld, 12);
     OGR_Fld_SetPrecision(hFld, 3);
-    OGR_L_CreateField(hLayer, hFld, FALSE);
+    OGR_L_CreateField(*phLayer, hFld, FALSE);
     OGR_Fld_Destroy(hFld);
   }
-  else {
-    elevItem = NULL;
+
+  return hOGRDS;
+}
+
+static int msContourGenerate(GDALRasterBandH hBand, OGRLayerH hLayer,
+                             const char *elevItem, double interval,
+                             int levelCount, double *levels)
+{
+  CPLErr eErr;
+
+  eErr = GDALContourGenerate( hBand, interval, 0.0,
+                              levelCount, levels,
+                              FALSE, 0.0, hLayer,
+                              OGR_FD_GetFieldIndex(OGR_L_GetLayerDefn( hLayer),
+                                                    "ID" ),
+                              (elevItem == NULL) ? -1 :
+                              OGR_FD_GetFieldIndex(OGR_L_GetLayerDefn( hLayer), 
+                                                    elevItem ),
+                              NULL, NULL );
+
+  if (eErr != CE_None) {
+    msSetError( MS_IOERR, "GDALContourGenerate() failed: %s",
+                "msContourLayerGenerateContour()", CPLGetLastErrorMsg() );
+    return MS_FAILURE;
+  }
+
+  return MS_SUCCESS;
+}
+
+/* Contour one cell of the cache grid, see "Contour cache" above */
+static OGRDataSourceH msContourLayerContourCell(layerObj *layer,
+                                                GDALRasterBandH hBand,
+                                                int cx, int cy,
+                                                const char *elevItem,
+                                                double interval,
+                                                int levelCount, double *levels)
+{
+  contourLayerInfo *clinfo = (contourLayerInfo *) layer->layerinfo;
+  int xoff = cx * MS_CONTOUR_CACHE_CELL * clinfo->step_x;
+  int yoff = cy * MS_CONTOUR_CACHE_CELL * clinfo->step_y;
+  int dst_xsize, dst_ysize;
+  char pointer[64], memDSPointer[128];
+  double adfGeoTransform[6], *buffer;
+  GDALDatasetH hMemDS;
+  OGRDataSourceH hCellDS;
+  OGRLayerH hCellLayer;
+  CPLErr eErr;
+  int status;
+
+  /* one more sample than the cell, the first of the next cells */
+  dst_xsize = MS_MIN(MS_CONTOUR_CACHE_CELL + 1,
+                     (GDALGetRasterXSize(clinfo->hOrigDS) - xoff) / clinfo->step_x);
+  dst_ysize = MS_MIN(MS_CONTOUR_CACHE_CELL + 1,
+                     (GDALGetRasterYSize(clinfo->hOrigDS) - yoff) / clinfo->step_y);
+
+  hCellDS = msContourCreateDataSource(layer, elevItem, &hCellLayer);
+  if (hCellDS == NULL || dst_xsize < 2 || dst_ysize < 2)
+    return hCellDS;
+
+  if (layer->debug)
+    msDebug("msContourLayerContourCell(): contouring cell %d,%d.\n", cx, cy);
+
+  buffer = (double *) malloc(sizeof(double) * dst_xsize * dst_ysize);
+  if (buffer == NULL) {
+    msSetError(MS_MEMERR, "Malloc(): Out of memory.", "msContourLayerContourCell()");
+    OGR_DS_Destroy(hCellDS);
+    return NULL;
   }
 
+  eErr = GDALRasterIO(hBand, GF_Read,
+                      xoff, yoff,
+                      dst_xsize * clinfo->step_x, dst_ysize * clinfo->step_y,
+                      buffer, dst_xsize, dst_ysize, GDT_Float64,
+                      0, 0);
+  if (eErr != CE_None) {
+    msSetError( MS_IOERR, "GDALRasterIO() failed: %s",
+                "msContourLayerContourCell()", CPLGetLastErrorMsg() );
+    free(buffer);
+    OGR_DS_Destroy(hCellDS);
+    return NULL;
+  }
+
+  memset(pointer, 0, sizeof(pointer));
+  CPLPrintPointer(pointer, buffer, sizeof(pointer));
+  sprintf(memDSPointer,"MEM:::DATAPOINTER=%s,PIXELS=%d,LINES=%d,BANDS=1,DATATYPE=Float64",
+          pointer, dst_xsize, dst_ysize);
+  hMemDS = GDALOpen(memDSPointer,  GA_ReadOnly);
+  if (hMemDS == NULL) {
+    msSetError(MS_IMGERR,
+               "Unable to open GDAL Memory dataset.",
+               "msContourLayerContourCell()");
+    free(buffer);
+    OGR_DS_Destroy(hCellDS);
+    return NULL;
+  }
+
+  adfGeoTransform[0] = GEO_TRANS(clinfo->adfGeoTransform+0,xoff,0);
+  adfGeoTransform[1] = ABS(clinfo->adfGeoTransform[1]) * clinfo->step_x;
+  adfGeoTransform[2] = 0;
+  adfGeoTransform[3] = GEO_TRANS(clinfo->adfGeoTransform+3,0,yoff);
+  adfGeoTransform[4] = 0;
+  adfGeoTransform[5] = -ABS(clinfo->adfGeoTransform[5]) * clinfo->step_y;
+  GDALSetGeoTransform(hMemDS, adfGeoTransform);
+
+  status = msContourGenerate(GDALGetRasterBand(hMemDS, 1), hCellLayer,
+                             elevItem, interval, levelCount, levels);
+
+  GDALClose(hMemDS);
+  free(buffer);
+
+  if (status != MS_SUCCESS) {
+    OGR_DS_Destroy(hCellDS);
+    return NULL;
+  }
+
+  return hCellDS;
+}
+
+/* Copy the isolines of a cached cell overlapping rect */
+static void msContourCopyFeatures(OGRDataSourceH hSrcDS, OGRLayerH hDstLayer,
+                                  rectObj *rect)
+{
+  OGRLayerH hSrcLayer = OGR_DS_GetLayer(hSrcDS, 0);
+  OGRFeatureH hFeat;
+
+  OGR_L_SetSpatialFilterRect(hSrcLayer, rect->minx, rect->miny,
+                             rect->maxx, rect->maxy);
+  OGR_L_ResetReading(hSrcLayer);
+  while ((hFeat = OGR_L_GetNextFeature(hSrcLayer)) != NULL) {
+    OGRFeatureH hNewFeat = OGR_F_Create(OGR_L_GetLayerDefn(hDstLayer));
+
+    OGR_F_SetFrom(hNewFeat, hFeat, TRUE);
+    OGR_L_CreateFeature(hDstLayer, hNewFeat);
+    OGR_F_Destroy(hNewFeat);
+    OGR_F_Destroy(hFeat);
+  }
+  OGR_L_SetSpatialFilter(hSrcLayer, NULL);
+}
+
+static int msContourLayerGenerateCachedContour(layerObj *layer,
+                                               const char *elevItem,
+                                               double interval,
+                                               int levelCount, double *levels)
+{
+  contourLayerInfo *clinfo = (contourLayerInfo *) layer->layerinfo;
+  GDALRasterBandH hBand = GDALGetRasterBand(clinfo->hOrigDS, clinfo->band);
+  int cell_xsize = MS_CONTOUR_CACHE_CELL * clinfo->step_x;
+  int cell_ysize = MS_CONTOUR_CACHE_CELL * clinfo->step_y;
+  int i, cx, cy;
+  char *keybase, buf[64];
+  OGRLayerH hLayer;
+
+  clinfo->hOGRDS = msContourCreateDataSource(layer, elevItem, &hLayer);
+  if (clinfo->hOGRDS == NULL)
+    return MS_FAILURE;
+
+  keybase = msStringConcatenate(NULL, GDALGetDescription(clinfo->hOrigDS));
+  sprintf(buf, "|%d|%d|%d|%.17g|", clinfo->band, clinfo->step_x,
+          clinfo->step_y, interval);
+  keybase = msStringConcatenate(keybase, buf);
+  for (i=0; i<levelCount; i++) {
+    sprintf(buf, "%.17g,", levels[i]);
+    keybase = msStringConcatenate(keybase, buf);
+  }
+  keybase = msStringConcatenate(keybase, "|");
+  if (elevItem)
+    keybase = msStringConcatenate(keybase, elevItem);
+
+  for (cy = clinfo->src_yoff / cell_ysize;
+       cy <= (clinfo->src_yoff + clinfo->src_ysize - 1) / cell_ysize; cy++) {
+    for (cx = clinfo->src_xoff / cell_xsize;
+         cx <= (clinfo->src_xoff + clinfo->src_xsize - 1) / cell_xsize; cx++) {
+      contourCacheObj *entry = NULL;
+      OGRDataSourceH hCellDS;
+      char *key = (char *) msSmallMalloc(strlen(keybase) + 32);
+
+      sprintf(key, "%s|%d,%d", keybase, cx, cy);
+
+      msAcquireLock(TLOCK_CONTOUR);
+      UT_HASH_FIND_STR(contourCache, key, entry);
+      if (entry) {
+        /* most recently used last */
+        UT_HASH_DEL(contourCache, entry);
+        UT_HASH_ADD_KEYPTR(hh, contourCache, entry->key, strlen(entry->key), entry);
+        msContourCopyFeatures(entry->hDS, hLayer, &clinfo->window);
+        msReleaseLock(TLOCK_CONTOUR);
+        free(key);
+        continue;
+      }
+      msReleaseLock(TLOCK_CONTOUR);
+
+      hCellDS = msContourLayerContourCell(layer, hBand, cx, cy, elevItem,
+                                          interval, levelCount, levels);
+      if (hCellDS == NULL) {
+        free(key);
+        free(keybase);
+        OGR_DS_Destroy(clinfo->hOGRDS);
+        clinfo->hOGRDS = NULL;
+        return MS_FAILURE;
+      }
+
+      msAcquireLock(TLOCK_CONTOUR);
+      UT_HASH_FIND_STR(contourCache, key, entry);
+      if (!entry) {
+        if (contourCacheCount >= MS_CONTOUR_CACHE_MAX)
+          msContourCacheFree(contourCache); /* the least recently used */
+        entry = (contourCacheObj *) msSmallMalloc(sizeof(contourCacheObj));
+        entry->key = key;
+        entry->hDS = hCellDS;
+        UT_HASH_ADD_KEYPTR(hh, contourCache, entry->key, strlen(entry->key), entry);
+        contourCacheCount++;
+        key = NULL;
+        hCellDS = NULL;
+      }
+      msContourCopyFeatures(entry->hDS, hLayer, &clinfo->window);
+      msReleaseLock(TLOCK_CONTOUR);
+
+      /* another thread got there first */
+      if (hCellDS)
+        OGR_DS_Destroy(hCellDS);
+      free(key);
+    }
+  }
+
+  free(keybase);
+  return MS_SUCCESS;
+}
+
+static int msContourLayerGenerateContour(layerObj *layer)
+{
+  OGRLayerH hLayer;
+  const char *elevItem;
+  char *option;
+  double interval = 1.0, levels[1000];
+  int levelCount = 0;
+  GDALRasterBandH hBand = NULL;
+
+  contourLayerInfo *clinfo = (contourLayerInfo *) layer->layerinfo;
+
+  OGRRegisterAll();
+
+  if (clinfo == NULL) {
+    msSetError(MS_MISCERR, "Assertion failed: Contour layer not opened!!!",
+               "msContourLayerCreateOGRDataSource()");
+    return MS_FAILURE;
+  }
+
+  if (!clinfo->hDS && !clinfo->cache_window) { /* no overlap */
+    return MS_SUCCESS;
+  }
+  
+  /* Check if we have a coutour item specified */
+  elevItem = CSLFetchNameValue(layer->processing,"CONTOUR_ITEM");
+  if (elevItem == NULL || strlen(elevItem) == 0)
+    elevItem = NULL;
+
   option = msContourGetOption(layer, "CONTOUR_INTERVAL");
   if (option) {
     interval = atof(option);
@@ -596,21 +899,29 @@ static int msContourLayerGenerateContour(layerObj *layer)
     CSLDestroy(levelsTmp);
     free(option);
   }
-    
-  eErr = GDALContourGenerate( hBand, interval, 0.0,
-                              levelCount, levels,
-                              FALSE, 0.0, hLayer,
-                              OGR_FD_GetFieldIndex(OGR_L_GetLayerDefn( hLayer),
-                                                    "ID" ),
-                              (elevItem == NULL) ? -1 :
-                              OGR_FD_GetFieldIndex(OGR_L_GetLayerDefn( hLayer), 
-                                                    elevItem ),
-                              NULL, NULL );
 
-  if (eErr != CE_None) {
-    msSetError( MS_IOERR, "GDALContourGenerate() failed: %s",
-                "msContourLayerGenerateContour()", CPLGetLastErrorMsg() );
-    return MS_FAILURE;
+  if (clinfo->cache_window) {
+    if (msContourLayerGenerateCachedContour(layer, elevItem, interval,
+                                            levelCount, levels) != MS_SUCCESS)
+      return MS_FAILURE;
+  } else {
+    hBand = GDALGetRasterBand(clinfo->hDS, 1);
+    if (hBand == NULL)
+    {
+      msSetError(MS_IMGERR,
+                 "Band %d does not exist on dataset.",
+                 "msContourLayerGenerateContour()", 1);
+      return MS_FAILURE;
+    }
+
+    /* Create the OGR DataSource */
+    clinfo->hOGRDS = msContourCreateDataSource(layer, elevItem, &hLayer);
+    if (clinfo->hOGRDS == NULL)
+      return MS_FAILURE;
+
+    if (msContourGenerate(hBand, hLayer, elevItem, interval,
+                          levelCount, levels) != MS_SUCCESS)
+      return MS_FAILURE;
   }
   
   msConnPoolRegister(&clinfo->ogrLayer, clinfo->hOGRDS, msContourOGRCloseConnection);
@@ -998,5 +1309,9 @@ int msContourLayerInitializeVirtualTable(layerObj *layer)
   msSetError(MS_MISCERR, "Contour Layer needs GDAL support, but it it not compiled in", "msContourLayerInitializeVirtualTable()");
   return MS_FAILURE;
 }
+
+void msContourCacheCleanup(void)
+{
+}
 #endif
 
@@ -163,6 +163,11 @@ int msCopyItem(itemObj *dst, itemObj *src)
 int msCopyHashTable(hashTableObj *dst, hashTableObj *src)
 {
   const char *key=NULL;
+
+  /* the common case of copying into a fresh table, items are shared until modified */
+  if (msShareHashTable(dst, src) == MS_SUCCESS)
+    return MS_SUCCESS;
+
   while (1) {
     key = msNextKeyFromHashTable(src, key);
     if (!key)
@@ -208,6 +213,7 @@ int msCopyExpression(expressionObj *dst, expressionObj *src)
   MS_COPYSTELEM(type);
   MS_COPYSTELEM(flags);
   dst->compiled = MS_FALSE;
+  dst->regexmemo = NULL;
 
   return MS_SUCCESS;
 }
@@ -1199,6 +1205,8 @@ int msCopyMap(mapObj *dst, mapObj *src)
   MS_COPYSTELEM(imagequality);
 
   MS_COPYRECT(&(dst->extent), &(src->extent));
+  MS_COPYSTELEM(gt);
+  MS_COPYRECT(&(dst->saved_extent), &(src->saved_extent));
 
   MS_COPYSTELEM(cellsize);
   MS_COPYSTELEM(units);
@@ -1285,6 +1293,8 @@ int msCopyMap(mapObj *dst, mapObj *src)
   if( msCopyHashTable( &(dst->configoptions), &(src->configoptions) ) != MS_SUCCESS )
     return MS_FAILURE;
 
+  msShareDecryptCache(dst, src);
+
   return MS_SUCCESS;
 }
 
@@ -33,6 +33,7 @@
 #include <time.h>     /* time() */
 
 #include "mapserver.h"
+#include "mapthread.h"
 
 
 
@@ -236,6 +237,16 @@ int msReadEncryptionKeyFromFile(const char *keyfile, unsigned char *k)
   return MS_SUCCESS;
 }
 
+/* the key file set with MS_ENCRYPTION_KEY, NULL if none */
+static const char *msGetEncryptionKeyFile(mapObj *map)
+{
+  const char *keyfile = msGetConfigOption(map, "MS_ENCRYPTION_KEY");
+
+  if (keyfile == NULL)
+    keyfile = getenv("MS_ENCRYPTION_KEY");
+  return keyfile;
+}
+
 /**********************************************************************
  *                       msLoadEncryptionKey()
  *
@@ -266,10 +277,7 @@ static int msLoadEncryptionKey(mapObj *map)
   if (map->encryption_key_loaded)
     return MS_SUCCESS;  /* Already loaded */
 
-  keyfile = msGetConfigOption(map, "MS_ENCRYPTION_KEY");
-
-  if (keyfile == NULL)
-    keyfile = getenv("MS_ENCRYPTION_KEY");
+  keyfile = msGetEncryptionKeyFile(map);
 
   if (keyfile &&
       msReadEncryptionKeyFromFile(keyfile,map->encryption_key) == MS_SUCCESS) {
@@ -400,6 +408,74 @@ void msDecryptStringWithKey(const unsigned char *key, const char *in, char *out)
   *out = '\0';
 }
 
+/**********************************************************************
+ *                        Decrypted strings cache
+ *
+ * The strings decrypted by msDecryptStringTokens() are remembered in a
+ * cache shared by a map and the copies made of it with msCopyMap(), so
+ * that the maps copied from a cached template (see msLoadMapCached())
+ * neither read the key file nor decrypt the connection strings again.
+ * The entries belong to the key file they were decrypted with. The
+ * cache is protected by TLOCK_DECRYPTCACHE.
+ **********************************************************************/
+
+#define MS_DECRYPT_CACHE_MAX 64
+
+struct decryptCacheObj {
+  int refcount;
+  char *keyfile;
+  int numentries;
+  char *in[MS_DECRYPT_CACHE_MAX];
+  char *out[MS_DECRYPT_CACHE_MAX];
+};
+
+static void msClearDecryptCache(struct decryptCacheObj *cache)
+{
+  int i;
+
+  for (i = 0; i < cache->numentries; i++) {
+    msFree(cache->in[i]);
+    msFree(cache->out[i]);
+  }
+  cache->numentries = 0;
+  msFree(cache->keyfile);
+  cache->keyfile = NULL;
+}
+
+/* with TLOCK_DECRYPTCACHE held */
+static struct decryptCacheObj *msGetDecryptCache(mapObj *map)
+{
+  if (map->decryptcache == NULL) {
+    map->decryptcache = (struct decryptCacheObj *) msSmallCalloc(1, sizeof(struct decryptCacheObj));
+    MS_REFCNT_INIT(map->decryptcache);
+  }
+  return map->decryptcache;
+}
+
+void msReleaseDecryptCache(struct decryptCacheObj *cache)
+{
+  if (!cache || MS_REFCNT_DECR_IS_NOT_ZERO(cache))
+    return;
+  msClearDecryptCache(cache);
+  msFree(cache);
+}
+
+/* called by msCopyMap(): dst shares the cache of src */
+void msShareDecryptCache(mapObj *dst, mapObj *src)
+{
+  struct decryptCacheObj *cache;
+
+  msAcquireLock(TLOCK_DECRYPTCACHE);
+  cache = msGetDecryptCache(src);
+  MS_REFCNT_INCR(cache);
+  msReleaseLock(TLOCK_DECRYPTCACHE);
+
+  msReleaseDecryptCache(dst->decryptcache);
+  dst->decryptcache = cache;
+}
+
+static char *msDecryptStringTokensUncached(mapObj *map, const char *in);
+
 /**********************************************************************
  *                        msDecryptStringTokens()
  *
@@ -411,13 +487,64 @@ void msDecryptStringWithKey(const unsigned char *key, const char *in, char *out)
 
 char *msDecryptStringTokens(mapObj *map, const char *in)
 {
-  char *outbuf, *out;
+  struct decryptCacheObj *cache;
+  const char *keyfile;
+  char *out = NULL;
+  int i;
 
   if (map == NULL) {
     msSetError(MS_MISCERR, "NULL MapObj.", "msLoadEncryptionKey()");
     return NULL;
   }
 
+  if (strchr(in, '{') == NULL)
+    return msStrdup(in); /* nothing to decrypt */
+
+  keyfile = msGetEncryptionKeyFile(map);
+  if (keyfile) {
+    msAcquireLock(TLOCK_DECRYPTCACHE);
+    cache = msGetDecryptCache(map);
+    if (cache->keyfile && strcmp(cache->keyfile, keyfile) == 0) {
+      for (i = 0; i < cache->numentries; i++) {
+        if (strcmp(cache->in[i], in) == 0) {
+          out = msStrdup(cache->out[i]);
+          break;
+        }
+      }
+    }
+    msReleaseLock(TLOCK_DECRYPTCACHE);
+    if (out)
+      return out;
+  }
+
+  out = msDecryptStringTokensUncached(map, in);
+  if (out == NULL || keyfile == NULL || !map->encryption_key_loaded)
+    return out; /* failed, or no valid token */
+
+  msAcquireLock(TLOCK_DECRYPTCACHE);
+  cache = msGetDecryptCache(map);
+  if (!cache->keyfile || strcmp(cache->keyfile, keyfile) != 0) {
+    msClearDecryptCache(cache); /* decrypted with another key */
+    cache->keyfile = msStrdup(keyfile);
+  }
+  for (i = 0; i < cache->numentries; i++) {
+    if (strcmp(cache->in[i], in) == 0)
+      break;
+  }
+  if (i == cache->numentries && cache->numentries < MS_DECRYPT_CACHE_MAX) {
+    cache->in[cache->numentries] = msStrdup(in);
+    cache->out[cache->numentries] = msStrdup(out);
+    cache->numentries++;
+  }
+  msReleaseLock(TLOCK_DECRYPTCACHE);
+
+  return out;
+}
+
+static char *msDecryptStringTokensUncached(mapObj *map, const char *in)
+{
+  char *outbuf, *out;
+
   /* Start with a copy of the string. Decryption can only result in
    * a string with the same or shorter length */
   if ((outbuf = (char *)malloc((strlen(in)+1)*sizeof(char))) == NULL) {
@@ -456,8 +583,10 @@ char *msDecryptStringTokens(mapObj *map, const char *in)
          * key unless ready necessary. This is a very cheap call if
          * the key is already loaded
          */
-        if (msLoadEncryptionKey(map) != MS_SUCCESS)
+        if (msLoadEncryptionKey(map) != MS_SUCCESS) {
+          free(outbuf);
           return NULL;
+        }
 
         pszTmp = (char*)malloc( (pszEnd-pszStart+1)*sizeof(char));
         strlcpy(pszTmp, pszStart, (pszEnd-pszStart)+1);
@@ -375,3 +375,202 @@ void msDebug( const char * pszFormat, ... )
 void msDebug2( int level, ... )
 {
 }
+
+
+/* msStatsCreate()
+**
+** Map statistics, enabled by map CONFIG "MS_STATS" set to "LOG" (or "ON"),
+** "HEADER" or both ("LOG,HEADER"): each stage of the drawing (layer open,
+** WhichShapes, NextShape and classification per batch, reprojection,
+** rendering, label cache, encoding) is timed and the features read, drawn
+** and their vertices counted, by layer. LOG writes them as a JSON line
+** through msDebug() when the map is freed, HEADER adds them to the mapserv
+** image responses in an X-MapServer-Stats header (without the encoding,
+** still to come when the headers are sent). Timing takes a couple of
+** msGettimeofday() calls per feature drawn and per batch of features read.
+** The statistics are also gathered for the process metrics when enabled,
+** see mapmetrics.c.
+**
+** loadstart is the msStatsNow() time the map load started, 0 if unknown.
+*/
+void msStatsCreate(mapObj *map, double loadstart)
+{
+  const char *value;
+  int output = 0;
+
+  if (map->stats)
+    return;
+
+  if ((value = msGetConfigOption(map, "MS_STATS")) != NULL) {
+    if (strcasestr(value, "LOG") || strcasecmp(value, "ON") == 0)
+      output |= MS_STATS_LOG;
+    if (strcasestr(value, "HEADER"))
+      output |= MS_STATS_HEADER;
+  }
+  if (!output && !msMetricsEnabled() && !msSlowLogEnabled())
+    return;
+
+  map->stats = (mapStatsObj *) msSmallCalloc(1, sizeof(mapStatsObj));
+  map->stats->output = output;
+  map->stats->numlayers = map->numlayers;
+  map->stats->layers = (layerStatsObj *) msSmallCalloc(MS_MAX(map->numlayers, 1), sizeof(layerStatsObj));
+
+  if (loadstart > 0)
+    map->stats->seconds[MS_STATS_LOAD] = msStatsElapsed(&loadstart);
+}
+
+/* msFreeStats()
+**
+** Logs the statistics if asked for, and frees them.
+*/
+void msFreeStats(mapObj *map)
+{
+  if (!map->stats)
+    return;
+
+  if (map->stats->output & MS_STATS_LOG) {
+    char *json = msStatsToJSON(map);
+    msDebug("msStats: %s\n", json);
+    msFree(json);
+  }
+
+  msFree(map->stats->layers);
+  msFree(map->stats);
+  map->stats = NULL;
+}
+
+/* msStatsReset()
+**
+** Clears the statistics for the next drawing of the map, creating them
+** (without any output) if they are not enabled.
+*/
+void msStatsReset(mapObj *map)
+{
+  if (map->stats && map->stats->numlayers != map->numlayers) {
+    msFree(map->stats->layers);
+    map->stats->numlayers = map->numlayers;
+    map->stats->layers = (layerStatsObj *) msSmallMalloc(MS_MAX(map->numlayers, 1) * sizeof(layerStatsObj));
+  } else if (!map->stats) {
+    map->stats = (mapStatsObj *) msSmallCalloc(1, sizeof(mapStatsObj));
+    map->stats->numlayers = map->numlayers;
+    map->stats->layers = (layerStatsObj *) msSmallMalloc(MS_MAX(map->numlayers, 1) * sizeof(layerStatsObj));
+  }
+
+  memset(map->stats->seconds, 0, sizeof(map->stats->seconds));
+  memset(map->stats->layers, 0, MS_MAX(map->numlayers, 1) * sizeof(layerStatsObj));
+}
+
+/* msGetLayerStats()
+**
+** Returns the statistics of a layer, NULL unless they are gathered.
+*/
+layerStatsObj *msGetLayerStats(mapObj *map, layerObj *layer)
+{
+  if (!map || !map->stats || layer->index < 0 || layer->index >= map->stats->numlayers)
+    return NULL;
+  return &map->stats->layers[layer->index];
+}
+
+/* msStatsNow()
+**
+** Returns the current time in seconds.
+*/
+double msStatsNow(void)
+{
+  struct mstimeval now;
+
+  msGettimeofday(&now, NULL);
+  return now.tv_sec + now.tv_usec / 1.0e6;
+}
+
+/* msStatsElapsed()
+**
+** Returns the seconds elapsed since *start, and moves *start to now so that
+** the next stage can be timed from there.
+*/
+double msStatsElapsed(double *start)
+{
+  double now = msStatsNow();
+  double elapsed = now - *start;
+
+  *start = now;
+  return elapsed;
+}
+
+static void msStatsAppend(bufferObj *buffer, const char *pszFormat, ...)
+{
+  char szBuffer[256];
+  va_list args;
+  int n;
+
+  va_start(args, pszFormat);
+  n = vsnprintf(szBuffer, sizeof(szBuffer), pszFormat, args);
+  va_end(args);
+
+  if (n > 0)
+    msBufferAppend(buffer, szBuffer, MS_MIN(n, (int)sizeof(szBuffer) - 1));
+}
+
+/* msStatsToJSON()
+**
+** Returns the statistics as a JSON object, on one line:
+**   {"load":s,"labelcache":s,"encode":s,"memory":{"peak":b,"image":b,
+**    "resultcache":b,"labelcache":b,"layerdata":b},"layers":[{"name":"...",
+**    "total":s,"open":s,"whichshapes":s,"nextshape":s,"classify":s,
+**    "project":s,"render":s,"read":n,"drawn":n,"vertices":n},...]}
+** times in seconds, "render" not including "project", memory the peaks of
+** the request memory accounting (see msIO_setRequestMemoryLimit()) in
+** bytes. Layers that were not drawn are left out. The caller frees the
+** string.
+*/
+char *msStatsToJSON(mapObj *map)
+{
+  static const char *stages[MS_STATS_NUMSTAGES] = { "load", "open", "whichshapes", "nextshape", "classify",
+                                                     "project", "render", "labelcache", "encode"
+                                                   };
+  bufferObj buffer;
+  int i, s, first = MS_TRUE;
+  char nul = '\0';
+
+  msBufferInit(&buffer);
+
+  if (!map->stats) {
+    msStatsAppend(&buffer, "{}");
+  } else {
+    mapStatsObj *stats = map->stats;
+    size_t memory[MS_REQUEST_MEMORY_NUMTAGS], peak = msIO_getRequestMemoryPeak(memory);
+
+    msStatsAppend(&buffer, "{\"load\":%.6f,\"labelcache\":%.6f,\"encode\":%.6f,",
+                  stats->seconds[MS_STATS_LOAD], stats->seconds[MS_STATS_LABELCACHE], stats->seconds[MS_STATS_ENCODE]);
+    msStatsAppend(&buffer, "\"memory\":{\"peak\":%lu,\"image\":%lu,\"resultcache\":%lu,\"labelcache\":%lu,\"layerdata\":%lu},\"layers\":[",
+                  (unsigned long) peak, (unsigned long) memory[MS_REQUEST_MEMORY_IMAGE], (unsigned long) memory[MS_REQUEST_MEMORY_RESULTCACHE],
+                  (unsigned long) memory[MS_REQUEST_MEMORY_LABELCACHE], (unsigned long) memory[MS_REQUEST_MEMORY_LAYERDATA]);
+
+    for (i = 0; i < stats->numlayers && i < map->numlayers; i++) {
+      layerStatsObj *ls = &stats->layers[i];
+      char *name;
+
+      if (ls->total == 0 && ls->read == 0)
+        continue;
+
+      name = msEscapeJSonString(GET_LAYER(map, i)->name ? GET_LAYER(map, i)->name : "");
+      msStatsAppend(&buffer, "%s{\"name\":\"", first ? "" : ",");
+      msBufferAppend(&buffer, name, strlen(name));
+      msFree(name);
+      msStatsAppend(&buffer, "\",\"total\":%.6f", ls->total);
+      for (s = MS_STATS_OPEN; s <= MS_STATS_RENDER; s++) {
+        double seconds = ls->seconds[s];
+        if (s == MS_STATS_RENDER)
+          seconds = MS_MAX(0, seconds - ls->seconds[MS_STATS_PROJECT]);
+        msStatsAppend(&buffer, ",\"%s\":%.6f", stages[s], seconds);
+      }
+      msStatsAppend(&buffer, ",\"read\":%d,\"drawn\":%d,\"vertices\":%ld}", ls->read, ls->drawn, ls->vertices);
+      first = MS_FALSE;
+    }
+
+    msStatsAppend(&buffer, "]}");
+  }
+
+  msBufferAppend(&buffer, &nul, 1);
+  return (char *) buffer.data;
+}
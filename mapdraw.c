@@ -28,12 +28,16 @@
  *****************************************************************************/
 
 #include <assert.h>
+#include <ctype.h>
+#include <limits.h>
 #include <math.h>
 #include "mapserver.h"
 #include "maptime.h"
 #include "mapcopy.h"
 #include "mapfile.h"
 #include "mapows.h"
+#include "mapthread.h"
+#include "uthash.h"
 
 
 /* msPrepareImage()
@@ -80,9 +84,16 @@ imageObj *msPrepareImage(mapObj *map, int allow_nonsquare)
       bg = NULL;
     }
 
+  msIO_requestMemoryAlloc(MS_REQUEST_MEMORY_IMAGE, msImageMemorySize(map->width, map->height, map->outputformat));
+  if(msIO_checkRequestMemory("msPrepareImage()") != MS_SUCCESS) {
+    msIO_requestMemoryFree(MS_REQUEST_MEMORY_IMAGE, msImageMemorySize(map->width, map->height, map->outputformat));
+    return(NULL);
+  }
   image = renderer->createImage(map->width, map->height, map->outputformat,bg);
-  if (image == NULL)
+  if (image == NULL) {
+    msIO_requestMemoryFree(MS_REQUEST_MEMORY_IMAGE, msImageMemorySize(map->width, map->height, map->outputformat));
     return(NULL);
+  }
   image->format = map->outputformat;
   image->format->refcount++;
   image->width = map->width;
@@ -209,6 +220,449 @@ static int msCompositeRasterBuffer(mapObj *map, imageObj *img, rasterBufferObj *
   return ret;
 }
 
+/*
+** Threaded layer drawing (map CONFIG "MS_DRAW_THREADS" "n"): runs of consecutive
+** layers that only touch their own state are drawn up to n at a time, each into its
+** own transparent image, and the images are then composited into the map image in
+** layer order like those of layers with a COMPOSITE block.
+*/
+typedef struct {
+  mapObj *map;
+  layerObj *layer;
+  imageObj *image;
+  void *threadid; /* of the thread running msDrawMap() */
+  msThreadTaskGroupObj *group; /* cancelled by the first layer that fails */
+  int status; /* MS_DONE if not drawn because another layer failed */
+  char *errormsg; /* errors of a failed layer drawn in another thread */
+} drawLayerTaskObj;
+
+static int msStylesCanDrawInThread(mapObj *map, rendererVTableObj *renderer, styleObj **styles, int numstyles)
+{
+  int s;
+
+  for(s=0; s<numstyles; s++) {
+    symbolObj *symbol;
+
+    if(styles[s]->bindings[MS_STYLE_BINDING_SYMBOL].item) return MS_FALSE;
+    if(styles[s]->symbol <= 0 || styles[s]->symbol >= map->symbolset.numsymbols) continue;
+
+    /* symbols are loaded lazily by the renderers, do it before the threads are started */
+    symbol = map->symbolset.symbol[styles[s]->symbol];
+    if(symbol->type == MS_SYMBOL_SVG) return MS_FALSE;
+    if(symbol->type == MS_SYMBOL_PIXMAP && msPreloadImageSymbol(renderer, symbol) != MS_SUCCESS) return MS_FALSE;
+  }
+
+  return MS_TRUE;
+}
+
+/*
+** Tells if layer can be drawn in its own thread: a local vector layer, in the map
+** projection, that doesn't add to the label cache and has no mask, alternate
+** renderer or per layer renderer settings. Anything else is drawn by msDrawLayer().
+*/
+static int msLayerCanDrawInThread(mapObj *map, layerObj *layer, imageObj *image)
+{
+  rendererVTableObj *renderer = MS_IMAGE_RENDERER(image);
+  int i, l;
+
+  if(image->format->renderer != MS_RENDER_WITH_AGG) return MS_FALSE;
+  if(layer->postlabelcache || !msLayerIsVisible(map, layer)) return MS_FALSE;
+  if(layer->type != MS_LAYER_POINT && layer->type != MS_LAYER_LINE && layer->type != MS_LAYER_POLYGON) return MS_FALSE;
+
+  switch(layer->connectiontype) {
+    case MS_SHAPEFILE:
+    case MS_TILED_SHAPEFILE:
+      if(layer->tileindex && msGetLayerIndex(map, layer->tileindex) != -1) return MS_FALSE; /* tile index layer shared with others */
+      break;
+    case MS_INLINE:
+      break;
+    default:
+      return MS_FALSE;
+  }
+
+  if(layer->mask || layer->maskimage) return MS_FALSE;
+  if(layer->compositer && !layer->compositer->next && layer->compositer->opacity == 0) return MS_FALSE; /* skipped by msDrawLayer() */
+  if(msLayerGetProcessingKey(layer, "RENDERER") || msLayerGetProcessingKey(layer, "APPROXIMATION_SCALE") ||
+      msLayerGetProcessingKey(layer, "FORCE_DRAW_LABEL_CACHE")) return MS_FALSE;
+
+  layer->project = msProjectionsDiffer(&(layer->projection), &(map->projection));
+  if(layer->project) return MS_FALSE;
+
+  for(i=0; i<layer->numclasses; i++) {
+    classObj *c = layer->class[i];
+
+    if(c->numlabels > 0 && layer->labelcache) return MS_FALSE;
+    if(!msStylesCanDrawInThread(map, renderer, c->styles, c->numstyles)) return MS_FALSE;
+    for(l=0; l<c->numlabels; l++) {
+      if(!msStylesCanDrawInThread(map, renderer, c->labels[l]->styles, c->labels[l]->numstyles)) return MS_FALSE;
+    }
+  }
+
+  return MS_TRUE;
+}
+
+/*
+** Errors of a task run in a thread other than threadid are cleared from that thread,
+** and returned as a string if the task failed so that they can be reported by the
+** thread running msDrawMap().
+*/
+static char *msTakeThreadErrors(void *threadid, int status)
+{
+  char *errormsg = NULL;
+
+  if(msGetThreadId() != threadid) {
+    if(status != MS_SUCCESS)
+      errormsg = msGetErrorString("\n");
+    msResetErrorList();
+  }
+
+  return errormsg;
+}
+
+static void msDrawLayerTask(void *data)
+{
+  drawLayerTaskObj *task = (drawLayerTaskObj *) data;
+
+  msImageStartLayer(task->map, task->layer, task->image);
+  task->status = msDrawVectorLayer(task->map, task->layer, task->image);
+  msImageEndLayer(task->map, task->layer, task->image);
+
+  task->errormsg = msTakeThreadErrors(task->threadid, task->status);
+  if(task->status != MS_SUCCESS)
+    msThreadTaskGroupCancel(task->group); /* the map fails, leave the other layers alone */
+}
+
+/*
+** Draws the layers from layerorder[*next] on that can be drawn in threads, up to
+** numthreads of them, and sets *next to the first layer left. Nothing is drawn if
+** fewer than 2 layers qualify.
+*/
+static int msDrawLayersInThreads(mapObj *map, imageObj *image, int numthreads, int *next)
+{
+  drawLayerTaskObj *tasks;
+  void **taskptrs;
+  int i, numtasks = 0, last = *next, status = MS_SUCCESS;
+
+  tasks = (drawLayerTaskObj *) msSmallCalloc(numthreads, sizeof(drawLayerTaskObj));
+  taskptrs = (void **) msSmallMalloc(numthreads * sizeof(void *));
+
+  for(i=*next; i<map->numlayers && numtasks<numthreads; i++) {
+    layerObj *lp;
+
+    if(map->layerorder[i] == -1) continue;
+    lp = GET_LAYER(map, map->layerorder[i]);
+    if(lp->postlabelcache || !msLayerIsVisible(map, lp)) continue; /* not drawn here anyway */
+    if(!msLayerCanDrawInThread(map, lp, image)) break;
+
+    tasks[numtasks].map = map;
+    tasks[numtasks].layer = lp;
+    tasks[numtasks].threadid = msGetThreadId();
+    taskptrs[numtasks] = &tasks[numtasks];
+    numtasks++;
+    last = i+1;
+  }
+
+  if(numtasks < 2) {
+    msFree(tasks);
+    msFree(taskptrs);
+    return MS_SUCCESS;
+  }
+
+  for(i=0; i<numtasks; i++) {
+    tasks[i].image = msImageCreate(image->width, image->height, image->format, image->imagepath, image->imageurl,
+                                   map->resolution, map->defresolution, NULL);
+    if(!tasks[i].image) {
+      msSetError(MS_MISCERR, "Unable to initialize temporary transparent image.", "msDrawLayersInThreads()");
+      status = MS_FAILURE;
+      break;
+    }
+    tasks[i].image->map = map;
+  }
+
+  if(status == MS_SUCCESS) {
+    msThreadTaskGroupObj *group = msThreadTaskGroupCreate(numthreads);
+
+    if(map->debug >= MS_DEBUGLEVEL_V)
+      msDebug("msDrawLayersInThreads(): drawing %d layers in %d threads.\n", numtasks, numthreads);
+
+    for(i=0; i<numtasks; i++) {
+      tasks[i].group = group;
+      tasks[i].status = MS_DONE;
+      msThreadTaskGroupAdd(group, msDrawLayerTask, taskptrs[i]);
+    }
+    msThreadTaskGroupWait(group);
+  }
+
+  /* composite in layer order */
+  for(i=0; i<numtasks && status == MS_SUCCESS; i++) {
+    layerObj *lp;
+    rasterBufferObj rb;
+
+    if(tasks[i].status == MS_DONE) {
+      /* skipped, the errors are those of the layer that failed */
+      int j;
+
+      for(j=i+1; j<numtasks && tasks[j].status != MS_FAILURE; j++) ;
+      i = MS_MIN(j, numtasks-1);
+    }
+    lp = tasks[i].layer;
+
+    if(tasks[i].status != MS_SUCCESS) {
+      if(tasks[i].errormsg)
+        msSetError(MS_IMGERR, "%s", "msDrawLayersInThreads()", tasks[i].errormsg);
+      msSetError(MS_IMGERR, "Failed to draw layer named '%s'.", "msDrawMap()", lp->name);
+      status = MS_FAILURE;
+      break;
+    }
+
+    memset(&rb, 0, sizeof(rasterBufferObj));
+    msImageStartLayer(map, lp, image);
+    status = MS_IMAGE_RENDERER(tasks[i].image)->getRasterBufferHandle(tasks[i].image, &rb);
+    if(status == MS_SUCCESS) {
+      if(!lp->compositer)
+        status = MS_IMAGE_RENDERER(image)->mergeRasterBuffer(image, &rb, 1.0, 0, 0, 0, 0, rb.width, rb.height);
+      else
+        status = msCompositeRasterBuffer(map, image, &rb, lp->compositer);
+    }
+    msImageEndLayer(map, lp, image);
+  }
+
+  for(i=0; i<numtasks; i++) {
+    if(tasks[i].image) msFreeImage(tasks[i].image);
+    msFree(tasks[i].errormsg);
+  }
+  msFree(tasks);
+  msFree(taskptrs);
+
+  *next = last;
+  return status;
+}
+
+/*
+** Band drawing (map CONFIG "MS_DRAW_BANDS" "n"): for large images, runs of
+** consecutive local vector layers are drawn with the image split into n horizontal
+** bands. Each band is drawn in its own thread by a copy of the map whose extent is
+** that of the band. Bands overlap by the largest symbol size so that symbols
+** straddling band edges are complete, and only their own rows are stitched back
+** into the map image.
+*/
+#define MS_DRAW_BAND_MINHEIGHT 64
+#define MS_DRAW_BAND_MAXMARGIN 256
+
+typedef struct {
+  mapObj *map; /* copy of the map restricted to the band */
+  imageObj *image;
+  int first, last; /* layerorder range to draw */
+  int y, height; /* rows of the band in the map image */
+  int top; /* rows drawn above the band */
+  void *threadid; /* of the thread running msDrawMap() */
+  int status;
+  char *errormsg;
+} drawBandTaskObj;
+
+/*
+** Returns how far (in pixels) the symbols of layer can reach from the shapes they are
+** drawn for, or -1 if the layer can't be drawn in bands: only vector layers in the map
+** projection without labels, geometry transformations or compositing qualify. Tiled
+** fills and line patterns, dashes and marker gaps are laid out from where each band
+** starts drawing, so the styles using them don't qualify either: they would not line
+** up across band edges.
+*/
+static int msLayerBandMargin(mapObj *map, layerObj *layer, imageObj *image)
+{
+  double margin = 0, resolutionfactor = map->resolution/map->defresolution;
+  int i, s;
+
+  if(image->format->renderer != MS_RENDER_WITH_AGG) return -1;
+  if(layer->postlabelcache || !msLayerIsVisible(map, layer)) return -1;
+  if(layer->type != MS_LAYER_POINT && layer->type != MS_LAYER_LINE && layer->type != MS_LAYER_POLYGON) return -1;
+  if(layer->connectiontype != MS_SHAPEFILE && layer->connectiontype != MS_TILED_SHAPEFILE && layer->connectiontype != MS_INLINE) return -1;
+  if(layer->compositer || layer->mask || layer->_geomtransform.type != MS_GEOMTRANSFORM_NONE) return -1;
+  if(msLayerGetProcessingKey(layer, "RENDERER") || msLayerGetProcessingKey(layer, "FORCE_DRAW_LABEL_CACHE")) return -1;
+
+  if(msProjectionsDiffer(&(layer->projection), &(map->projection))) return -1;
+
+  for(i=0; i<layer->numclasses; i++) {
+    classObj *c = layer->class[i];
+
+    if(c->numlabels > 0) return -1;
+
+    for(s=0; s<c->numstyles; s++) {
+      styleObj *style = c->styles[s];
+      symbolObj *symbol = NULL;
+      double size, width;
+
+      if(style->_geomtransform.type != MS_GEOMTRANSFORM_NONE) return -1;
+      if(style->bindings[MS_STYLE_BINDING_OFFSET_X].item || style->bindings[MS_STYLE_BINDING_OFFSET_Y].item ||
+          style->bindings[MS_STYLE_BINDING_POLAROFFSET_PIXEL].item || style->bindings[MS_STYLE_BINDING_SYMBOL].item ||
+          style->bindings[MS_STYLE_BINDING_OUTLINEWIDTH].item) return -1;
+
+      if(style->symbol > 0 && style->symbol < map->symbolset.numsymbols)
+        symbol = map->symbolset.symbol[style->symbol];
+      if(layer->type != MS_LAYER_POINT && style->symbol > 0) return -1; /* tiled or hatched fill, symbol along a line */
+      if(style->patternlength > 0 || style->gap != 0) return -1;
+
+      if(style->bindings[MS_STYLE_BINDING_SIZE].item) {
+        size = style->maxsize;
+      } else if(style->size == -1) {
+        if(symbol && symbol->type == MS_SYMBOL_SVG) return -1;
+        if(symbol && symbol->type == MS_SYMBOL_PIXMAP && msPreloadImageSymbol(MS_IMAGE_RENDERER(image), symbol) != MS_SUCCESS) return -1;
+        size = msSymbolGetDefaultSize(symbol);
+      } else {
+        size = style->size;
+      }
+      width = style->bindings[MS_STYLE_BINDING_WIDTH].item ? style->maxwidth : style->width;
+
+      size = MS_MIN(size * layer->scalefactor, style->maxsize * resolutionfactor);
+      width = MS_MIN(width * layer->scalefactor, style->maxwidth * resolutionfactor);
+      margin = MS_MAX(margin, MS_MAX(size, width) + 2 * style->outlinewidth * layer->scalefactor +
+                      (fabs(style->offsetx) + fabs(style->offsety) + fabs(style->polaroffsetpixel)) * layer->scalefactor);
+    }
+  }
+
+  margin = ceil(margin) + 8; /* antialiasing, and shapes clipped just outside the band */
+  return (margin > MS_DRAW_BAND_MAXMARGIN) ? -1 : (int) margin;
+}
+
+static void msDrawBandTask(void *data)
+{
+  drawBandTaskObj *task = (drawBandTaskObj *) data;
+  int i;
+
+  task->status = MS_SUCCESS;
+  for(i=task->first; i<=task->last && task->status == MS_SUCCESS; i++) {
+    layerObj *lp;
+
+    if(task->map->layerorder[i] == -1) continue;
+    lp = GET_LAYER(task->map, task->map->layerorder[i]);
+    if(lp->postlabelcache || !msLayerIsVisible(task->map, lp)) continue;
+
+    task->status = msDrawLayer(task->map, lp, task->image);
+    if(task->status != MS_SUCCESS)
+      msSetError(MS_IMGERR, "Failed to draw layer named '%s'.", "msDrawMap()", lp->name);
+  }
+
+  task->errormsg = msTakeThreadErrors(task->threadid, task->status);
+}
+
+/*
+** Draws the layers from layerorder[*next] on that can be drawn in bands, and sets
+** *next to the first layer left. Nothing is drawn if the image is too small to be
+** split or if the first layer doesn't qualify.
+*/
+static int msDrawLayersInBands(mapObj *map, imageObj *image, int numbands, int *next)
+{
+  drawBandTaskObj *tasks;
+  void **taskptrs;
+  int i, b, first = *next, last = -1, margin = 0, status = MS_SUCCESS;
+
+  if(map->gt.need_geotransform) return MS_SUCCESS;
+
+  numbands = MS_MIN(numbands, image->height / MS_DRAW_BAND_MINHEIGHT);
+  if(numbands < 2) return MS_SUCCESS;
+
+  for(i=first; i<map->numlayers; i++) {
+    layerObj *lp;
+    int layermargin;
+
+    if(map->layerorder[i] == -1) continue;
+    lp = GET_LAYER(map, map->layerorder[i]);
+    if(lp->postlabelcache || !msLayerIsVisible(map, lp)) continue; /* not drawn here anyway */
+    if((layermargin = msLayerBandMargin(map, lp, image)) == -1) break;
+
+    margin = MS_MAX(margin, layermargin);
+    last = i;
+  }
+
+  if(last == -1) return MS_SUCCESS;
+
+  tasks = (drawBandTaskObj *) msSmallCalloc(numbands, sizeof(drawBandTaskObj));
+  taskptrs = (void **) msSmallMalloc(numbands * sizeof(void *));
+
+  for(b=0; b<numbands && status == MS_SUCCESS; b++) {
+    drawBandTaskObj *task = &tasks[b];
+    int bottom, bandheight;
+
+    task->first = first;
+    task->last = last;
+    task->y = b * image->height / numbands;
+    task->height = (b+1) * image->height / numbands - task->y;
+    task->top = MS_MIN(margin, task->y);
+    task->threadid = msGetThreadId();
+    taskptrs[b] = task;
+
+    bottom = MS_MIN(margin, image->height - task->y - task->height);
+    bandheight = task->top + task->height + bottom;
+
+    task->map = msNewMapObj();
+    if(!task->map || msCopyMap(task->map, map) != MS_SUCCESS) {
+      msSetError(MS_MISCERR, "Failed to copy the map for band %d.", "msDrawLayersInBands()", b);
+      status = MS_FAILURE;
+      break;
+    }
+
+    task->map->width = map->width;
+    task->map->height = bandheight;
+    task->map->extent.minx = map->extent.minx;
+    task->map->extent.maxx = map->extent.maxx;
+    task->map->extent.maxy = map->extent.maxy - (task->y - task->top) * map->cellsize;
+    task->map->extent.miny = task->map->extent.maxy - (bandheight-1) * map->cellsize; /* extents go through pixel centers */
+    task->map->cellsize = msAdjustExtent(&(task->map->extent), task->map->width, task->map->height);
+    task->map->scaledenom = map->scaledenom; /* same scale, whatever the rounding */
+
+    msInitializeRendererVTable(task->map->outputformat);
+    task->image = msImageCreate(map->width, bandheight, task->map->outputformat, NULL, NULL,
+                                map->resolution, map->defresolution, NULL);
+    if(!task->image) {
+      msSetError(MS_MISCERR, "Unable to initialize temporary transparent image.", "msDrawLayersInBands()");
+      status = MS_FAILURE;
+      break;
+    }
+    task->image->map = task->map;
+  }
+
+  if(status == MS_SUCCESS) {
+    if(map->debug >= MS_DEBUGLEVEL_V)
+      msDebug("msDrawLayersInBands(): drawing layers %d to %d in %d bands, %d pixels margin.\n", first, last, numbands, margin);
+    msThreadPoolRun(msDrawBandTask, taskptrs, numbands, numbands);
+  }
+
+  /* stitch the bands */
+  for(b=0; b<numbands && status == MS_SUCCESS; b++) {
+    rasterBufferObj rb;
+
+    if(tasks[b].status != MS_SUCCESS) {
+      if(tasks[b].errormsg)
+        msSetError(MS_IMGERR, "%s", "msDrawLayersInBands()", tasks[b].errormsg);
+      status = MS_FAILURE;
+      break;
+    }
+
+    memset(&rb, 0, sizeof(rasterBufferObj));
+    status = MS_IMAGE_RENDERER(tasks[b].image)->getRasterBufferHandle(tasks[b].image, &rb);
+    if(status == MS_SUCCESS)
+      status = MS_IMAGE_RENDERER(image)->mergeRasterBuffer(image, &rb, 1.0, 0, tasks[b].top, 0, tasks[b].y, rb.width, tasks[b].height);
+  }
+
+  for(b=0; b<numbands; b++) {
+    if(tasks[b].image) msFreeImage(tasks[b].image);
+    if(tasks[b].map) msFreeMap(tasks[b].map);
+    msFree(tasks[b].errormsg);
+  }
+  msFree(tasks);
+  msFree(taskptrs);
+
+  *next = last+1;
+  return status;
+}
+
+/* layer prefetch, see msPrefetchLayers() */
+static void msPrefetchLayers(mapObj *map, int first, int numprefetch);
+static void msLayerPrefetchWait(layerObj *layer);
+static void msLayerPrefetchDiscard(layerObj *layer);
+static void msPrefetchCleanup(mapObj *map);
+static void msPipelineLayers(mapObj *map);
+
 /*
  * Generic function to render the map file.
  * The type of the image created is based on the imagetype parameter in the map file.
@@ -216,9 +670,29 @@ static int msCompositeRasterBuffer(mapObj *map, imageObj *img, rasterBufferObj *
  * mapObj *map - map object loaded in MapScript or via a mapfile to use
  * int querymap - is this map the result of a query operation, MS_TRUE|MS_FALSE
 */
+/* msDrawLayer() or msDrawQueryLayer(), timed for the map statistics and traced */
+static int msDrawMapLayer(mapObj *map, layerObj *layer, imageObj *image, int querymap)
+{
+  int status;
+  layerStatsObj *stats = msGetLayerStats(map, layer);
+  double start = 0;
+  int span = msTraceSpanBegin(querymap ? "msDrawQueryLayer" : "msDrawLayer", MS_TRACE_INTERNAL);
+
+  msTraceSpanAttribute(span, "mapserver.layer", layer->name);
+  if(stats) start = msStatsNow();
+  if(querymap)
+    status = msDrawQueryLayer(map, layer, image);
+  else
+    status = msDrawLayer(map, layer, image);
+  if(stats) stats->total += msStatsElapsed(&start);
+  msTraceSpanEnd(span, status);
+
+  return status;
+}
+
 imageObj *msDrawMap(mapObj *map, int querymap)
 {
-  int i;
+  int i, numthreads, numbands, numprefetch;
   layerObj *lp=NULL;
   int status = MS_FAILURE;
   imageObj *image = NULL;
@@ -334,9 +808,82 @@ imageObj *msDrawMap(mapObj *map, int querymap)
 
 #endif /* USE_WMS_LYR || USE_WFS_LYR */
 
+  numthreads = 0;
+  if(!querymap && msGetConfigOption(map, "MS_DRAW_THREADS"))
+    numthreads = atoi(msGetConfigOption(map, "MS_DRAW_THREADS"));
+  numbands = 0;
+  if(!querymap && msGetConfigOption(map, "MS_DRAW_BANDS"))
+    numbands = atoi(msGetConfigOption(map, "MS_DRAW_BANDS"));
+  numprefetch = 0;
+  if(!querymap && msGetConfigOption(map, "MS_PREFETCH_LAYERS"))
+    numprefetch = atoi(msGetConfigOption(map, "MS_PREFETCH_LAYERS"));
+  if(!querymap && numthreads <= 1 && numbands <= 1 && msGetConfigOption(map, "MS_POSTGIS_PIPELINE") &&
+      strcasecmp(msGetConfigOption(map, "MS_POSTGIS_PIPELINE"), "ON") == 0)
+    msPipelineLayers(map);
+
   /* OK, now we can start drawing */
   for(i=0; i<map->numlayers; i++) {
 
+    if(numbands > 1) {
+      int next = i;
+
+      if(map->debug >= MS_DEBUGLEVEL_TUNING) msGettimeofday(&starttime, NULL);
+
+      status = msDrawLayersInBands(map, image, numbands, &next);
+      if(status == MS_FAILURE) {
+        msPrefetchCleanup(map);
+        msFreeImage(image);
+#if defined(USE_WMS_LYR) || defined(USE_WFS_LYR)
+        if (pasOWSReqInfo) {
+          msHTTPFreeRequestObj(pasOWSReqInfo, numOWSRequests);
+          msFree(pasOWSReqInfo);
+        }
+#endif /* USE_WMS_LYR || USE_WFS_LYR */
+        return(NULL);
+      }
+
+      if(next != i) {
+        if(map->debug >= MS_DEBUGLEVEL_TUNING) {
+          msGettimeofday(&endtime, NULL);
+          msDebug("msDrawMap(): Layers %d to %d in bands, %.3fs\n", i, next-1,
+                  (endtime.tv_sec+endtime.tv_usec/1.0e6)-
+                  (starttime.tv_sec+starttime.tv_usec/1.0e6) );
+        }
+        i = next-1;
+        continue;
+      }
+    }
+
+    if(numthreads > 1) {
+      int next = i;
+
+      if(map->debug >= MS_DEBUGLEVEL_TUNING) msGettimeofday(&starttime, NULL);
+
+      status = msDrawLayersInThreads(map, image, numthreads, &next);
+      if(status == MS_FAILURE) {
+        msPrefetchCleanup(map);
+        msFreeImage(image);
+#if defined(USE_WMS_LYR) || defined(USE_WFS_LYR)
+        if (pasOWSReqInfo) {
+          msHTTPFreeRequestObj(pasOWSReqInfo, numOWSRequests);
+          msFree(pasOWSReqInfo);
+        }
+#endif /* USE_WMS_LYR || USE_WFS_LYR */
+        return(NULL);
+      }
+
+      if(next != i) {
+        if(map->debug >= MS_DEBUGLEVEL_TUNING) {
+          msGettimeofday(&endtime, NULL);
+          msDebug("msDrawMap(): Layers %d to %d in threads, %.3fs\n", i, next-1,
+                  (endtime.tv_sec+endtime.tv_usec/1.0e6)-
+                  (starttime.tv_sec+starttime.tv_usec/1.0e6) );
+        }
+        i = next-1;
+        continue;
+      }
+    }
+
     if(map->layerorder[i] != -1) {
       char *force_draw_label_cache = NULL;
 
@@ -349,6 +896,9 @@ imageObj *msDrawMap(mapObj *map, int querymap)
 
       if(!msLayerIsVisible(map, lp)) continue;
 
+      if(numprefetch > 0)
+        msPrefetchLayers(map, i+1, numprefetch);
+
       if(lp->connectiontype == MS_WMS) {
 #ifdef USE_WMS_LYR
         if(MS_RENDERER_PLUGIN(image->format) || MS_RENDERER_RAWDATA(image->format))
@@ -365,6 +915,7 @@ imageObj *msDrawMap(mapObj *map, int querymap)
                      "or another unexpected result in response to the GetMap request. Also check "
                      "and make sure that the layer's connection URL is valid.",
                      "msDrawMap()", lp->name);
+          msPrefetchCleanup(map);
           msFreeImage(image);
           msHTTPFreeRequestObj(pasOWSReqInfo, numOWSRequests);
           msFree(pasOWSReqInfo);
@@ -374,16 +925,15 @@ imageObj *msDrawMap(mapObj *map, int querymap)
 
 #else /* ndef USE_WMS_LYR */
         msSetError(MS_WMSCONNERR, "MapServer not built with WMS Client support, unable to render layer '%s'.", "msDrawMap()", lp->name);
+        msPrefetchCleanup(map);
         msFreeImage(image);
         return(NULL);
 #endif
       } else { /* Default case: anything but WMS layers */
-        if(querymap)
-          status = msDrawQueryLayer(map, lp, image);
-        else
-          status = msDrawLayer(map, lp, image);
+        status = msDrawMapLayer(map, lp, image, querymap);
         if(status == MS_FAILURE) {
           msSetError(MS_IMGERR, "Failed to draw layer named '%s'.", "msDrawMap()", lp->name);
+          msPrefetchCleanup(map);
           msFreeImage(image);
 #if defined(USE_WMS_LYR) || defined(USE_WFS_LYR)
           if (pasOWSReqInfo) {
@@ -394,6 +944,8 @@ imageObj *msDrawMap(mapObj *map, int querymap)
           return(NULL);
         }
       }
+      msLayerPrefetchDiscard(lp);
+
       if(map->debug >= MS_DEBUGLEVEL_TUNING || lp->debug >= MS_DEBUGLEVEL_TUNING) {
         msGettimeofday(&endtime, NULL);
         msDebug("msDrawMap(): Layer %d (%s), %.3fs\n",
@@ -409,6 +961,7 @@ imageObj *msDrawMap(mapObj *map, int querymap)
 	if(map->debug >= MS_DEBUGLEVEL_V)
 	  msDebug("msDrawMap(): PROCESSING FORCE_DRAW_LABEL_CACHE=FLUSH found.\n");
 	if(msDrawLabelCache(map, image) != MS_SUCCESS) {
+	  msPrefetchCleanup(map);
 	  msFreeImage(image);
 #if defined(USE_WMS_LYR) || defined(USE_WFS_LYR)
 	  if (pasOWSReqInfo) {
@@ -424,6 +977,7 @@ imageObj *msDrawMap(mapObj *map, int querymap)
 
     }
   }
+  msPrefetchCleanup(map);
 
   if(map->scalebar.status == MS_EMBED && !map->scalebar.postlabelcache) {
 
@@ -494,10 +1048,7 @@ imageObj *msDrawMap(mapObj *map, int querymap)
       status = MS_FAILURE;
 #endif
     } else {
-      if(querymap)
-        status = msDrawQueryLayer(map, lp, image);
-      else
-        status = msDrawLayer(map, lp, image);
+      status = msDrawMapLayer(map, lp, image, querymap);
     }
 
     if(status == MS_FAILURE) {
@@ -660,6 +1211,53 @@ int msLayerIsVisible(mapObj *map, layerObj *layer)
 /*
  * Generic function to render a layer object.
 */
+#ifdef USE_PROJ
+/*
+** Looks for a PROCESSING "PROJECTED_DATA=<srs> <data>" entry whose projection
+** is the one of the map, i.e. a copy of the layer data already stored in the
+** output projection. Sets *data to a copy of its DATA and *projection to its
+** projection, or *data to NULL if there is none.
+*/
+static int msSelectProjectedData(mapObj *map, layerObj *layer, char **data, projectionObj *projection)
+{
+  int i;
+
+  *data = NULL;
+  for(i=0; i<layer->numprocessing; i++) {
+    const char *value = layer->processing[i], *sep;
+    char *srs;
+
+    if(strncasecmp(value, "PROJECTED_DATA=", 15) != 0) continue;
+    value += 15;
+    sep = strpbrk(value, " \t");
+    if(!sep || sep == value) {
+      msSetError(MS_MISCERR, "Layer (%s) PROJECTED_DATA \"%s\" is not of the form \"<srs> <data>\".", "msDrawLayer()", layer->name, value);
+      return MS_FAILURE;
+    }
+
+    srs = (char *) msSmallMalloc(sep - value + 1);
+    strlcpy(srs, value, sep - value + 1);
+    msInitProjection(projection);
+    if(msLoadProjectionString(projection, srs) != 0) {
+      msSetError(MS_MISCERR, "Layer (%s) PROJECTED_DATA uses an invalid projection (%s).", "msDrawLayer()", layer->name, srs);
+      msFreeProjection(projection);
+      free(srs);
+      return MS_FAILURE;
+    }
+    free(srs);
+
+    if(!msProjectionsDiffer(projection, &(map->projection))) {
+      while(isspace(*sep)) sep++;
+      *data = msStrdup(sep);
+      return MS_SUCCESS;
+    }
+    msFreeProjection(projection);
+  }
+
+  return MS_SUCCESS;
+}
+#endif
+
 int msDrawLayer(mapObj *map, layerObj *layer, imageObj *image)
 {
   imageObj *image_draw = image;
@@ -672,7 +1270,50 @@ int msDrawLayer(mapObj *map, layerObj *layer, imageObj *image)
     return MS_SUCCESS;
 
   if(layer->compositer && !layer->compositer->next && layer->compositer->opacity == 0) return MS_SUCCESS; /* layer is completely transparent, skip it */
-  
+
+  /* skip the remaining layers of a request out of time with partial output */
+  if(msIO_checkRequestCancelled("msDrawLayer()"))
+    return msIO_isRequestOutputPartial() ? MS_SUCCESS : MS_FAILURE;
+
+  /* the prefetch thread may still be using the layer */
+  msLayerPrefetchWait(layer);
+
+#ifdef USE_PROJ
+  /* draw from a copy of the data in the map projection if the layer lists one */
+  if(layer->numprocessing > 0 && msProjectionsDiffer(&(layer->projection),&(map->projection))) {
+    char *data, *origdata;
+    projectionObj projection, origprojection;
+    rectObj origextent = layer->extent;
+
+    if(msSelectProjectedData(map, layer, &data, &projection) != MS_SUCCESS)
+      return MS_FAILURE;
+    if(data) {
+      if(layer->debug >= MS_DEBUGLEVEL_V)
+        msDebug("msDrawLayer(): drawing layer %s from PROJECTED_DATA \"%s\".\n", layer->name, data);
+      if(msLayerIsOpen(layer))
+        msLayerClose(layer);
+      if(MS_VALID_EXTENT(layer->extent))
+        msProjectRect(&(layer->projection), &projection, &(layer->extent));
+
+      origdata = layer->data;
+      origprojection = layer->projection;
+      layer->data = data;
+      layer->projection = projection;
+
+      retcode = msDrawLayer(map, layer, image); /* the projections no longer differ */
+
+      if(msLayerIsOpen(layer))
+        msLayerClose(layer);
+      msFree(layer->data);
+      msFreeProjection(&(layer->projection));
+      layer->data = origdata;
+      layer->projection = origprojection;
+      layer->extent = origextent;
+      layer->project = msProjectionsDiffer(&(layer->projection),&(map->projection));
+      return retcode;
+    }
+  }
+#endif
 
   /* conditions may have changed since this layer last drawn, so retest
      layer->project (Bug #673) */
@@ -861,43 +1502,558 @@ altformat_cleanup:
       }
       /* modify the pixels of the overlay */
 
-      if(rb.type == MS_BUFFER_BYTE_RGBA) {
-        for(row=0; row<rb.height; row++) {
-          unsigned char *ma,*a,*r,*g,*b;
-          r=rb.data.rgba.r+row*rb.data.rgba.row_step;
-          g=rb.data.rgba.g+row*rb.data.rgba.row_step;
-          b=rb.data.rgba.b+row*rb.data.rgba.row_step;
-          a=rb.data.rgba.a+row*rb.data.rgba.row_step;
-          ma=mask.data.rgba.a+row*mask.data.rgba.row_step;
-          for(col=0; col<rb.width; col++) {
-            if(*ma == 0) {
-              *a = *r = *g = *b = 0;
-            }
-            a+=rb.data.rgba.pixel_step;
-            r+=rb.data.rgba.pixel_step;
-            g+=rb.data.rgba.pixel_step;
-            b+=rb.data.rgba.pixel_step;
-            ma+=mask.data.rgba.pixel_step;
-          }
-        }
-      }
-    }
-    if(!layer->compositer) {
-      /*we have a mask layer with no composition configured, do a nomral blend */
-      retcode = renderer->mergeRasterBuffer(image,&rb,1.0,0,0,0,0,rb.width,rb.height);
-    } else {
-      retcode = msCompositeRasterBuffer(map,image,&rb,layer->compositer);
+      if(rb.type == MS_BUFFER_BYTE_RGBA) {
+        for(row=0; row<rb.height; row++) {
+          unsigned char *ma,*a,*r,*g,*b;
+          r=rb.data.rgba.r+row*rb.data.rgba.row_step;
+          g=rb.data.rgba.g+row*rb.data.rgba.row_step;
+          b=rb.data.rgba.b+row*rb.data.rgba.row_step;
+          a=rb.data.rgba.a+row*rb.data.rgba.row_step;
+          ma=mask.data.rgba.a+row*mask.data.rgba.row_step;
+          for(col=0; col<rb.width; col++) {
+            if(*ma == 0) {
+              *a = *r = *g = *b = 0;
+            }
+            a+=rb.data.rgba.pixel_step;
+            r+=rb.data.rgba.pixel_step;
+            g+=rb.data.rgba.pixel_step;
+            b+=rb.data.rgba.pixel_step;
+            ma+=mask.data.rgba.pixel_step;
+          }
+        }
+      }
+    }
+    if(!layer->compositer) {
+      /*we have a mask layer with no composition configured, do a nomral blend */
+      retcode = renderer->mergeRasterBuffer(image,&rb,1.0,0,0,0,0,rb.width,rb.height);
+    } else {
+      retcode = msCompositeRasterBuffer(map,image,&rb,layer->compositer);
+    }
+    if(UNLIKELY(retcode == MS_FAILURE)) {
+      goto imagedraw_cleanup;
+    }
+
+imagedraw_cleanup:
+    msFreeImage(image_draw);
+  }
+
+  msImageEndLayer(map,layer,image);
+  return(retcode);
+}
+
+/*
+** Draws one classified shape of msDrawVectorLayer(), line shapes that have to be
+** drawn one style at a time are added to shpcache. The shape is left to the caller
+** to free.
+*/
+static int drawVectorLayerShape(mapObj *map, layerObj *layer, imageObj *image, shapeObj *shape, char annotate, int *drawmode, featureListNodeObjPtr *shpcache, int *maxnumstyles)
+{
+  int status;
+  char cache = MS_FALSE;
+  layerStatsObj *stats = msGetLayerStats(map, layer);
+  double stagestart = 0;
+
+  if(layer->type == MS_LAYER_LINE && (layer->class[shape->classindex]->numstyles > 1 || (layer->class[shape->classindex]->numstyles == 1 && layer->class[shape->classindex]->styles[0]->outlinewidth > 0))) {
+    int i;
+    cache = MS_TRUE; /* only line layers with multiple styles need be cached (I don't think POLYLINE layers need caching - SDL) */
+
+    /* we can't handle caching with attribute binding other than for the first style (#3976) */
+    for(i=1; i<layer->class[shape->classindex]->numstyles; i++) {
+      if(layer->class[shape->classindex]->styles[i]->numbindings > 0) cache = MS_FALSE;
+    }
+  }
+
+  /* With 'STYLEITEM AUTO', we will have the datasource fill the class' */
+  /* style parameters for this shape. */
+  if(layer->styleitem) {
+    if(strcasecmp(layer->styleitem, "AUTO") == 0) {
+      if(msLayerGetAutoStyle(map, layer, layer->class[shape->classindex], shape) != MS_SUCCESS)
+        return MS_FAILURE;
+    } else {
+      /* Generic feature style handling as per RFC-61 */
+      if(msLayerGetFeatureStyle(map, layer, layer->class[shape->classindex], shape) != MS_SUCCESS)
+        return MS_FAILURE;
+    }
+
+    /* __TODO__ For now, we can't cache features with 'AUTO' style */
+    cache = MS_FALSE;
+  }
+
+  /* RFC77 TODO: check return value, may need a more sophisticated if-then test. */
+  if(annotate && layer->class[shape->classindex]->numlabels > 0) {
+    *drawmode |= MS_DRAWMODE_LABELS;
+    if (msLayerGetProcessingKey(layer, "LABEL_NO_CLIP")) {
+      *drawmode |= MS_DRAWMODE_UNCLIPPEDLABELS;
+    }
+  }
+
+  if (layer->type == MS_LAYER_LINE && msLayerGetProcessingKey(layer, "POLYLINE_NO_CLIP")) {
+    *drawmode |= MS_DRAWMODE_UNCLIPPEDLINES;
+  }
+
+  if(stats) {
+    int i;
+    stats->drawn++;
+    for(i=0; i<shape->numlines; i++)
+      stats->vertices += shape->line[i].numpoints;
+    stagestart = msStatsNow();
+  }
+
+  if (cache) {
+    styleObj *pStyle = layer->class[shape->classindex]->styles[0];
+    if (pStyle->outlinewidth > 0) {
+      /*
+       * RFC 49 implementation
+       * if an outlinewidth is used:
+       *  - augment the style's width to account for the outline width
+       *  - swap the style color and outlinecolor
+       *  - draw the shape (the outline) in the first pass of the
+       *    caching mechanism
+       */
+      msOutlineRenderingPrepareStyle(pStyle, map, layer, image);
+    }
+    status = msDrawShape(map, layer, shape, image, 0, *drawmode|MS_DRAWMODE_SINGLESTYLE); /* draw a single style */
+    if (pStyle->outlinewidth > 0) {
+      /*
+       * RFC 49 implementation: switch back the styleobj to its
+       * original state, so the line fill will be drawn in the
+       * second pass of the caching mechanism
+       */
+      msOutlineRenderingRestoreStyle(pStyle, map, layer, image);
+    }
+  }
+
+  else
+    status = msDrawShape(map, layer, shape, image, -1, *drawmode); /* all styles  */
+  if(stats) stats->seconds[MS_STATS_RENDER] += msStatsElapsed(&stagestart);
+  if(status != MS_SUCCESS)
+    return MS_FAILURE;
+
+  if(shape->numlines == 0) /* once clipped the shape didn't need to be drawn */
+    return MS_SUCCESS;
+
+  if(cache) {
+    if(insertFeatureList(shpcache, shape) == NULL)
+      return MS_FAILURE; /* problem adding to the cache */
+  }
+
+  *maxnumstyles = MS_MAX(*maxnumstyles, layer->class[shape->classindex]->numstyles);
+
+  return MS_SUCCESS;
+}
+
+/*
+** PROCESSING "DRAW_SORT_WINDOW=n": shapes are buffered n at a time and drawn
+** grouped by class so that consecutive draws share the same styles (and the
+** symbol tile caches of the renderers). Only used when the layer draws no labels,
+** so the label cache sees the same shapes in the same order.
+*/
+typedef struct {
+  shapeObj shape;
+  int sequence;
+} sortedShapeObj;
+
+static int compareSortedShapes(const void *a, const void *b)
+{
+  const sortedShapeObj *sa = a, *sb = b;
+
+  if(sa->shape.classindex != sb->shape.classindex)
+    return (sa->shape.classindex < sb->shape.classindex) ? -1 : 1;
+  return sa->sequence - sb->sequence;
+}
+
+static int getDrawSortWindow(layerObj *layer, char annotate)
+{
+  const char *value;
+  int i, window;
+
+  if((value = msLayerGetProcessingKey(layer, "DRAW_SORT_WINDOW")) == NULL) return 0;
+  window = atoi(value);
+  if(window < 2 || layer->styleitem) return 0;
+
+  if(annotate) {
+    for(i=0; i<layer->numclasses; i++) {
+      if(layer->class[i]->numlabels > 0) {
+        if(layer->debug >= MS_DEBUGLEVEL_V)
+          msDebug("msDrawVectorLayer(): DRAW_SORT_WINDOW ignored for layer %s because it has labels.\n", layer->name);
+        return 0;
+      }
+    }
+  }
+
+  return window;
+}
+
+/*
+** Screen space aggregation (PROCESSING "DRAW_PIXEL_AGGREGATE=ON"): features
+** that are smaller than a pixel are drawn only if the last sub-pixel feature
+** drawn in their pixel was of a different class, so piles of identical
+** symbols in one pixel cost a single rendering. The occupancy bitmap keeps
+** the index (+1) of the class last drawn in each pixel.
+*/
+typedef struct {
+  unsigned short *pixels;
+  double pixelsize; /* a pixel, in layer units */
+} pixelAggregateObj;
+
+static int initPixelAggregate(mapObj *map, layerObj *layer, imageObj *image, char annotate, int sortwindow, pixelAggregateObj *pa)
+{
+  const char *value;
+  int i, j;
+
+  pa->pixels = NULL;
+  if((value = msLayerGetProcessingKey(layer, "DRAW_PIXEL_AGGREGATE")) == NULL || strcasecmp(value, "ON") != 0) return MS_FALSE;
+  if(!image || layer->transform != MS_TRUE || layer->styleitem) return MS_FALSE;
+  if(layer->numclasses >= USHRT_MAX) return MS_FALSE;
+
+  /* a skipped feature must not lose anything but its rendering: no reordering, no labels */
+  if(sortwindow > 0) {
+    if(layer->debug >= MS_DEBUGLEVEL_V)
+      msDebug("msDrawVectorLayer(): DRAW_PIXEL_AGGREGATE ignored for layer %s because of DRAW_SORT_WINDOW.\n", layer->name);
+    return MS_FALSE;
+  }
+  for(i=0; i<layer->numclasses; i++) {
+    if(annotate && layer->class[i]->numlabels > 0) {
+      if(layer->debug >= MS_DEBUGLEVEL_V)
+        msDebug("msDrawVectorLayer(): DRAW_PIXEL_AGGREGATE ignored for layer %s because it has labels.\n", layer->name);
+      return MS_FALSE;
+    }
+    for(j=0; j<layer->class[i]->numstyles; j++) {
+      if(layer->class[i]->styles[j]->numbindings > 0) return MS_FALSE; /* styles vary per feature */
+    }
+  }
+
+  pa->pixelsize = Pix2LayerGeoref(map, layer, 1);
+  pa->pixels = (unsigned short *) msSmallCalloc((size_t)image->width * image->height, sizeof(unsigned short));
+  return MS_TRUE;
+}
+
+/*
+** Returns MS_TRUE if shape can be skipped because its pixel already holds a
+** feature of the same class, otherwise records it as the last one drawn there.
+*/
+static int pixelAlreadyCovered(mapObj *map, layerObj *layer, imageObj *image, pixelAggregateObj *pa, shapeObj *shape)
+{
+  pointObj p;
+  int x, y;
+  unsigned short *pixel;
+
+  if(shape->numlines == 0) return MS_FALSE;
+  if(shape->type == MS_SHAPE_POINT) {
+    if(shape->numlines != 1 || shape->line[0].numpoints != 1) return MS_FALSE;
+    p = shape->line[0].point[0];
+  } else {
+    if(shape->bounds.maxx - shape->bounds.minx > pa->pixelsize ||
+        shape->bounds.maxy - shape->bounds.miny > pa->pixelsize) return MS_FALSE;
+    p.x = (shape->bounds.minx + shape->bounds.maxx) / 2;
+    p.y = (shape->bounds.miny + shape->bounds.maxy) / 2;
+  }
+
+#ifdef USE_PROJ
+  if(layer->project)
+    msProjectPoint(&layer->projection, &map->projection, &p);
+#endif
+
+  x = (int) floor((p.x - map->extent.minx) / map->cellsize);
+  y = (int) floor((map->extent.maxy - p.y) / map->cellsize);
+  if(x < 0 || y < 0 || x >= image->width || y >= image->height) return MS_FALSE;
+
+  pixel = &pa->pixels[(size_t)y * image->width + x];
+  if(*pixel == shape->classindex + 1) return MS_TRUE;
+  *pixel = shape->classindex + 1;
+  return MS_FALSE;
+}
+
+/*
+** Draws the buffered shapes in class order and frees them.
+*/
+static int drawSortedShapes(mapObj *map, layerObj *layer, imageObj *image, sortedShapeObj *sorted, int numsorted, char annotate, int *drawmode, featureListNodeObjPtr *shpcache, int *maxnumstyles)
+{
+  int i, status = MS_SUCCESS;
+
+  qsort(sorted, numsorted, sizeof(sortedShapeObj), compareSortedShapes);
+  for(i=0; i<numsorted; i++) {
+    if(status == MS_SUCCESS)
+      status = drawVectorLayerShape(map, layer, image, &sorted[i].shape, annotate, drawmode, shpcache, maxnumstyles);
+    msFreeShape(&sorted[i].shape);
+  }
+
+  return status;
+}
+
+#ifdef USE_PROJ
+#define MS_SEARCH_SHAPE_SAMPLES 16 /* points per side of the map extent */
+
+/*
+** Builds the map extent as a polygon in the layer projection into searchshape,
+** for the data sources that filter on it (see layerObj::searchshape). Once
+** projected the extent may be bent or rotated, and its bounding rect then holds
+** many more features than needed. The extent is grown by 1% so that the straight
+** edges between the projected samples stay outside of it. Returns MS_FAILURE if
+** the polygon can't be built or would hardly be tighter than searchrect.
+*/
+static int layerSearchShape(mapObj *map, layerObj *layer, rectObj *searchrect, shapeObj *searchshape)
+{
+  const int n = MS_SEARCH_SHAPE_SAMPLES;
+  rectObj extent = map->extent;
+  double width = extent.maxx - extent.minx, height = extent.maxy - extent.miny;
+  lineObj line;
+  int i;
+
+  extent.minx -= width * 0.01;
+  extent.maxx += width * 0.01;
+  extent.miny -= height * 0.01;
+  extent.maxy += height * 0.01;
+  width = extent.maxx - extent.minx;
+  height = extent.maxy - extent.miny;
+
+  line.numpoints = 4 * n + 1;
+  line.point = (pointObj *) msSmallCalloc(line.numpoints, sizeof(pointObj));
+  for(i=0; i<n; i++) {
+    line.point[i].x = extent.minx + width * i / n;
+    line.point[i].y = extent.miny;
+    line.point[n+i].x = extent.maxx;
+    line.point[n+i].y = extent.miny + height * i / n;
+    line.point[2*n+i].x = extent.maxx - width * i / n;
+    line.point[2*n+i].y = extent.maxy;
+    line.point[3*n+i].x = extent.minx;
+    line.point[3*n+i].y = extent.maxy - height * i / n;
+  }
+  line.point[4*n] = line.point[0];
+
+  msInitShape(searchshape);
+  searchshape->type = MS_SHAPE_POLYGON;
+  msAddLineDirectly(searchshape, &line);
+
+  /* give up on anything that went over the horizon or across the dateline */
+  if(msProjectShape(&(map->projection), &(layer->projection), searchshape) != MS_SUCCESS ||
+      searchshape->numlines != 1 || searchshape->line[0].numpoints != 4 * n + 1 ||
+      (layer->projection.proj && pj_is_latlong(layer->projection.proj) && searchshape->bounds.maxx - searchshape->bounds.minx > 180)) {
+    msFreeShape(searchshape);
+    return MS_FAILURE;
+  }
+
+  if(msGetPolygonArea(searchshape) > 0.9 * (searchrect->maxx - searchrect->minx) * (searchrect->maxy - searchrect->miny)) {
+    msFreeShape(searchshape);
+    return MS_FAILURE;
+  }
+
+  return MS_SUCCESS;
+}
+#endif
+
+/*
+** Opens layer and selects the shapes drawn by msDrawVectorLayer(). Returns the
+** status of msLayerWhichShapes(), the layer is only left open for MS_SUCCESS.
+*/
+static int msDrawVectorLayerSelect(mapObj *map, layerObj *layer, rectObj *searchrect)
+{
+  int status;
+  layerStatsObj *stats = msGetLayerStats(map, layer);
+  double stagestart = 0;
+#ifdef USE_PROJ
+  shapeObj shape;
+#endif
+
+  if(stats) stagestart = msStatsNow();
+
+  /* open this layer */
+  status = msLayerOpen(layer);
+  if(status != MS_SUCCESS) return MS_FAILURE;
+
+  if(stats) stats->seconds[MS_STATS_OPEN] += msStatsElapsed(&stagestart);
+
+  /* build item list. STYLEITEM javascript needs the shape attributes */
+  if (layer->styleitem && (strncasecmp(layer->styleitem, "javascript://", 13) == 0)) {  
+    status = msLayerWhichItems(layer, MS_TRUE, NULL);
+  } else {
+    status = msLayerWhichItemsForScale(layer, MS_FALSE, NULL, map->scaledenom); /* classes out of scale need no items */
+  }
+
+  if(status != MS_SUCCESS) {
+    msLayerClose(layer);
+    return MS_FAILURE;
+  }
+
+  /* identify target shapes */
+  if(layer->transform == MS_TRUE) {
+    *searchrect = map->extent;
+#ifdef USE_PROJ
+    if((map->projection.numargs > 0) && (layer->projection.numargs > 0))
+      msProjectRect(&map->projection, &layer->projection, searchrect); /* project the searchrect to source coords */
+#endif
+  } else {
+    searchrect->minx = searchrect->miny = 0;
+    searchrect->maxx = map->width-1;
+    searchrect->maxy = map->height-1;
+  }
+
+#ifdef USE_PROJ
+  if(layer->transform == MS_TRUE && layer->project && map->projection.numargs > 0 && layer->projection.numargs > 0 &&
+      layerSearchShape(map, layer, searchrect, &shape) == MS_SUCCESS)
+    layer->searchshape = &shape; /* freed once the candidates are selected */
+#endif
+
+  status = msLayerWhichShapes(layer, *searchrect, MS_FALSE);
+  if(layer->searchshape) {
+    msFreeShape(layer->searchshape);
+    layer->searchshape = NULL;
+  }
+  if(status != MS_SUCCESS)
+    msLayerClose(layer);
+
+  if(stats) stats->seconds[MS_STATS_WHICHSHAPES] += msStatsElapsed(&stagestart);
+
+  return status;
+}
+
+/*
+** Layer prefetch (map CONFIG "MS_PREFETCH_LAYERS" "n"): while a layer is drawn by
+** msDrawMap(), the next n PostGIS or OGR layers are opened and their shapes selected
+** in threads of their own, so that the database round trips overlap the drawing.
+** msDrawVectorLayer() then goes on from the selection of the prefetch.
+*/
+struct layerPrefetchObj {
+  mapObj *map;
+  layerObj *layer;
+  msThreadTaskObj *thread; /* NULL once done */
+  void *threadid; /* of the thread running msDrawMap() */
+  rectObj searchrect;
+  int status; /* of msDrawVectorLayerSelect() */
+  char *errormsg;
+};
+
+static void msLayerPrefetchTask(void *data)
+{
+  struct layerPrefetchObj *prefetch = (struct layerPrefetchObj *) data;
+
+  prefetch->status = msDrawVectorLayerSelect(prefetch->map, prefetch->layer, &prefetch->searchrect);
+  prefetch->errormsg = msTakeThreadErrors(prefetch->threadid, prefetch->status == MS_FAILURE ? MS_FAILURE : MS_SUCCESS);
+}
+
+/* a layer whose draw goes straight to msDrawVectorLayer() and selects from a database */
+static int msLayerCanPrefetch(mapObj *map, layerObj *layer)
+{
+  if(layer->postlabelcache || !msLayerIsVisible(map, layer)) return MS_FALSE;
+  if(layer->type != MS_LAYER_POINT && layer->type != MS_LAYER_LINE && layer->type != MS_LAYER_POLYGON) return MS_FALSE;
+  if(layer->connectiontype != MS_POSTGIS && layer->connectiontype != MS_OGR) return MS_FALSE;
+  if(layer->tileindex || layer->mask || msLayerIsOpen(layer)) return MS_FALSE;
+  if(layer->compositer && !layer->compositer->next && layer->compositer->opacity == 0) return MS_FALSE; /* skipped by msDrawLayer() */
+  if(msLayerGetProcessingKey(layer, "PROJECTED_DATA")) return MS_FALSE;
+
+  return MS_TRUE;
+}
+
+/*
+** Starts the prefetch of the first numprefetch layers that qualify from layerorder[first]
+** on, those already started included.
+*/
+static void msPrefetchLayers(mapObj *map, int first, int numprefetch)
+{
+  int i, n = 0;
+
+  for(i=first; i<map->numlayers && n<numprefetch; i++) {
+    struct layerPrefetchObj *prefetch;
+    layerObj *lp;
+
+    if(map->layerorder[i] == -1) continue;
+    lp = GET_LAYER(map, map->layerorder[i]);
+    if(lp->prefetch) {
+      n++;
+      continue;
     }
-    if(UNLIKELY(retcode == MS_FAILURE)) {
-      goto imagedraw_cleanup;
+    if(!msLayerCanPrefetch(map, lp)) continue;
+
+    prefetch = (struct layerPrefetchObj *) msSmallCalloc(1, sizeof(struct layerPrefetchObj));
+    prefetch->map = map;
+    prefetch->layer = lp;
+    prefetch->threadid = msGetThreadId();
+    lp->project = msProjectionsDiffer(&(lp->projection), &(map->projection)); /* as msDrawLayer() would */
+
+    prefetch->thread = msThreadTaskStart(msLayerPrefetchTask, prefetch);
+    if(!prefetch->thread) { /* no threads, layers are opened when drawn */
+      msFree(prefetch);
+      return;
     }
+    lp->prefetch = prefetch;
+    n++;
 
-imagedraw_cleanup:
-    msFreeImage(image_draw);
+    if(map->debug >= MS_DEBUGLEVEL_V)
+      msDebug("msPrefetchLayers(): prefetching layer %s.\n", lp->name?lp->name:"(null)");
   }
+}
 
-  msImageEndLayer(map,layer,image);
-  return(retcode);
+/* waits for the prefetch of layer, if any, to be done */
+static void msLayerPrefetchWait(layerObj *layer)
+{
+  if(layer->prefetch && layer->prefetch->thread) {
+    msThreadTaskWait(layer->prefetch->thread);
+    layer->prefetch->thread = NULL;
+  }
+}
+
+/* drops a prefetch its layer draw didn't use, closing the layer */
+static void msLayerPrefetchDiscard(layerObj *layer)
+{
+  if(!layer->prefetch) return;
+
+  msLayerPrefetchWait(layer);
+  if(layer->prefetch->status == MS_SUCCESS)
+    msLayerClose(layer);
+  msFree(layer->prefetch->errormsg);
+  msFree(layer->prefetch);
+  layer->prefetch = NULL;
+}
+
+static void msPrefetchCleanup(mapObj *map)
+{
+  int i;
+
+  for(i=0; i<map->numlayers; i++)
+    msLayerPrefetchDiscard(GET_LAYER(map, i));
+}
+
+/*
+** Layer pipeline (map CONFIG "MS_POSTGIS_PIPELINE" "ON"): before any layer is drawn,
+** the PostGIS layers that could be prefetched are opened and their shapes selected
+** with the queries left pending, and msPostGISPipelineFlush() sends all of them at
+** once. msDrawVectorLayer() takes these selections as prefetches already done.
+*/
+static void msPipelineLayers(mapObj *map)
+{
+  layerObj **layers;
+  int i, numlayers = 0;
+
+  layers = (layerObj **) msSmallMalloc(sizeof(layerObj *) * MS_MAX(map->numlayers, 1));
+
+  for(i=0; i<map->numlayers; i++) {
+    struct layerPrefetchObj *prefetch;
+    layerObj *lp;
+
+    if(map->layerorder[i] == -1) continue;
+    lp = GET_LAYER(map, map->layerorder[i]);
+    if(lp->prefetch || lp->connectiontype != MS_POSTGIS || !msLayerCanPrefetch(map, lp)) continue;
+
+    lp->project = msProjectionsDiffer(&(lp->projection), &(map->projection)); /* as msDrawLayer() would */
+    if(msLayerOpen(lp) != MS_SUCCESS) continue; /* reported by the draw of the layer */
+    msPostGISLayerEnablePipeline(lp, MS_TRUE);
+
+    prefetch = (struct layerPrefetchObj *) msSmallCalloc(1, sizeof(struct layerPrefetchObj));
+    prefetch->map = map;
+    prefetch->layer = lp;
+    prefetch->status = msDrawVectorLayerSelect(map, lp, &prefetch->searchrect);
+    lp->prefetch = prefetch;
+    if(prefetch->status == MS_SUCCESS)
+      layers[numlayers++] = lp;
+  }
+
+  msPostGISPipelineFlush(layers, numlayers);
+  for(i=0; i<numlayers; i++)
+    msPostGISLayerEnablePipeline(layers[i], MS_FALSE);
+  free(layers);
+
+  if(map->debug >= MS_DEBUGLEVEL_V)
+    msDebug("msPipelineLayers(): %d layers selected in the pipeline.\n", numlayers);
 }
 
 int msDrawVectorLayer(mapObj *map, layerObj *layer, imageObj *image)
@@ -907,7 +2063,6 @@ int msDrawVectorLayer(mapObj *map, layerObj *layer, imageObj *image)
   char        annotate=MS_TRUE;
   shapeObj    shape;
   rectObj     searchrect;
-  char        cache=MS_FALSE;
   int         maxnumstyles=1;
   featureListNodeObjPtr shpcache=NULL, current=NULL;
   int nclasses = 0;
@@ -915,6 +2070,11 @@ int msDrawVectorLayer(mapObj *map, layerObj *layer, imageObj *image)
   double minfeaturesize = -1;
   int maxfeatures=-1;
   int featuresdrawn=0;
+  shapeBatchObj batch;
+  sortedShapeObj *sorted=NULL;
+  int numsorted=0, sortwindow;
+  pixelAggregateObj pixelaggregate;
+  int aggregated=0;
 
   if (image)
     maxfeatures=msLayerGetMaxFeaturesToDraw(layer, image->format);
@@ -927,43 +2087,22 @@ int msDrawVectorLayer(mapObj *map, layerObj *layer, imageObj *image)
     if((layer->labelminscaledenom != -1) && (map->scaledenom < layer->labelminscaledenom)) annotate = MS_FALSE;
   }
 
-  /* open this layer */
-  status = msLayerOpen(layer);
-  if(status != MS_SUCCESS) return MS_FAILURE;
-
-  /* build item list. STYLEITEM javascript needs the shape attributes */
-  if (layer->styleitem && (strncasecmp(layer->styleitem, "javascript://", 13) == 0)) {  
-    status = msLayerWhichItems(layer, MS_TRUE, NULL);
-  } else {
-    status = msLayerWhichItems(layer, MS_FALSE, NULL);
-  }
-
-  if(status != MS_SUCCESS) {
-    msLayerClose(layer);
-    return MS_FAILURE;
-  }
-
-  /* identify target shapes */
-  if(layer->transform == MS_TRUE) {
-    searchrect = map->extent;
-#ifdef USE_PROJ
-    if((map->projection.numargs > 0) && (layer->projection.numargs > 0))
-      msProjectRect(&map->projection, &layer->projection, &searchrect); /* project the searchrect to source coords */
-#endif
-  } else {
-    searchrect.minx = searchrect.miny = 0;
-    searchrect.maxx = map->width-1;
-    searchrect.maxy = map->height-1;
-  }
+  if(layer->prefetch) { /* opened and selected ahead by msDrawMap() */
+    msLayerPrefetchWait(layer);
+    status = layer->prefetch->status;
+    searchrect = layer->prefetch->searchrect;
+    if(layer->prefetch->errormsg)
+      msSetError(MS_MISCERR, "%s", "msDrawVectorLayer()", layer->prefetch->errormsg);
+    msFree(layer->prefetch->errormsg);
+    msFree(layer->prefetch);
+    layer->prefetch = NULL;
+  } else
+    status = msDrawVectorLayerSelect(map, layer, &searchrect);
 
-  status = msLayerWhichShapes(layer, searchrect, MS_FALSE);
-  if(status == MS_DONE) { /* no overlap */
-    msLayerClose(layer);
+  if(status == MS_DONE) /* no overlap */
     return MS_SUCCESS;
-  } else if(status != MS_SUCCESS) {
-    msLayerClose(layer);
+  else if(status != MS_SUCCESS)
     return MS_FAILURE;
-  }
 
   /* step through the target shapes */
   msInitShape(&shape);
@@ -976,122 +2115,104 @@ int msDrawVectorLayer(mapObj *map, layerObj *layer, imageObj *image)
   if(layer->minfeaturesize > 0)
     minfeaturesize = Pix2LayerGeoref(map, layer, layer->minfeaturesize);
 
-  while((status = msLayerNextShape(layer, &shape)) == MS_SUCCESS) {
+  sortwindow = getDrawSortWindow(layer, annotate);
+  if(sortwindow > 0)
+    sorted = (sortedShapeObj *) msSmallMalloc(sizeof(sortedShapeObj) * sortwindow);
+  initPixelAggregate(map, layer, image, annotate, sortwindow, &pixelaggregate);
+  msPrepareLabelPointCache(map, layer);
+  msPrepareProjApprox(map, layer, &searchrect);
+
+  if(msGetConfigOption(map, "MS_SHAPE_POOL") && strcasecmp(msGetConfigOption(map, "MS_SHAPE_POOL"), "ON") == 0)
+    layer->shapepool = msCreateShapePool();
+
+  msInitShapeBatch(&batch);
+  msShapeBatchClassify(&batch, map, classgroup, nclasses);
+  while((status = msShapeBatchNext(layer, &batch, &shape)) == MS_SUCCESS) {
 
     /* Check if the shape size is ok to be drawn */
     if((shape.type == MS_SHAPE_LINE || shape.type == MS_SHAPE_POLYGON) && (minfeaturesize > 0) && (msShapeCheckSize(&shape, minfeaturesize) == MS_FALSE)) {
       if(layer->debug >= MS_DEBUGLEVEL_V)
         msDebug("msDrawVectorLayer(): Skipping shape (%ld) because LAYER::MINFEATURESIZE is bigger than shape size\n", shape.index);
-      msFreeShape(&shape);
+      msShapePoolFreeShape(layer->shapepool, &shape);
       continue;
     }
 
-    shape.classindex = msShapeGetClass(layer, map, &shape, classgroup, nclasses);
+    /* shape.classindex was set by msShapeBatchNext() */
     if((shape.classindex == -1) || (layer->class[shape.classindex]->status == MS_OFF)) {
-      msFreeShape(&shape);
+      msShapePoolFreeShape(layer->shapepool, &shape);
+      continue;
+    }
+
+    if(pixelaggregate.pixels && pixelAlreadyCovered(map, layer, image, &pixelaggregate, &shape)) {
+      aggregated++;
+      msShapePoolFreeShape(layer->shapepool, &shape);
       continue;
     }
 
     if(maxfeatures >=0 && featuresdrawn >= maxfeatures) {
-      msFreeShape(&shape);
+      msShapePoolFreeShape(layer->shapepool, &shape);
       status = MS_DONE;
       break;
     }
     featuresdrawn++;
 
-    cache = MS_FALSE;
-    if(layer->type == MS_LAYER_LINE && (layer->class[shape.classindex]->numstyles > 1 || (layer->class[shape.classindex]->numstyles == 1 && layer->class[shape.classindex]->styles[0]->outlinewidth > 0))) {
-      int i;
-      cache = MS_TRUE; /* only line layers with multiple styles need be cached (I don't think POLYLINE layers need caching - SDL) */
-
-      /* we can't handle caching with attribute binding other than for the first style (#3976) */
-      for(i=1; i<layer->class[shape.classindex]->numstyles; i++) {
-        if(layer->class[shape.classindex]->styles[i]->numbindings > 0) cache = MS_FALSE;
-      }
+    /* poll the request cancellation and time budget now and then */
+    if((featuresdrawn & 1023) == 0 && msIO_checkRequestCancelled("msDrawVectorLayer()")) {
+      msShapePoolFreeShape(layer->shapepool, &shape);
+      if(msIO_isRequestOutputPartial())
+        status = MS_DONE; /* keep what was drawn, as for maxfeatures */
+      else
+        retcode = MS_FAILURE;
+      break;
     }
 
-    /* With 'STYLEITEM AUTO', we will have the datasource fill the class' */
-    /* style parameters for this shape. */
-    if(layer->styleitem) {
-      if(strcasecmp(layer->styleitem, "AUTO") == 0) {
-        if(msLayerGetAutoStyle(map, layer, layer->class[shape.classindex], &shape) != MS_SUCCESS) {
-          retcode = MS_FAILURE;
-          msFreeShape(&shape);
-          break;
-        }
-      } else {
-        /* Generic feature style handling as per RFC-61 */
-        if(msLayerGetFeatureStyle(map, layer, layer->class[shape.classindex], &shape) != MS_SUCCESS) {
+    if(sorted) {
+      sorted[numsorted].shape = shape; /* the buffer takes over the shape */
+      sorted[numsorted].sequence = numsorted;
+      msInitShape(&shape);
+      if(++numsorted == sortwindow) {
+        status = drawSortedShapes(map, layer, image, sorted, numsorted, annotate, &drawmode, &shpcache, &maxnumstyles);
+        numsorted = 0;
+        if(status != MS_SUCCESS) {
           retcode = MS_FAILURE;
-          msFreeShape(&shape);
           break;
         }
       }
-
-      /* __TODO__ For now, we can't cache features with 'AUTO' style */
-      cache = MS_FALSE;
-    }
-
-    /* RFC77 TODO: check return value, may need a more sophisticated if-then test. */
-    if(annotate && layer->class[shape.classindex]->numlabels > 0) {
-      drawmode |= MS_DRAWMODE_LABELS;
-      if (msLayerGetProcessingKey(layer, "LABEL_NO_CLIP")) {
-        drawmode |= MS_DRAWMODE_UNCLIPPEDLABELS;
-      }
-    }
-
-    if (layer->type == MS_LAYER_LINE && msLayerGetProcessingKey(layer, "POLYLINE_NO_CLIP")) {
-      drawmode |= MS_DRAWMODE_UNCLIPPEDLINES;
-    }
-
-    if (cache) {
-      styleObj *pStyle = layer->class[shape.classindex]->styles[0];
-      if (pStyle->outlinewidth > 0) {
-        /*
-         * RFC 49 implementation
-         * if an outlinewidth is used:
-         *  - augment the style's width to account for the outline width
-         *  - swap the style color and outlinecolor
-         *  - draw the shape (the outline) in the first pass of the
-         *    caching mechanism
-         */
-	msOutlineRenderingPrepareStyle(pStyle, map, layer, image);
-      }
-      status = msDrawShape(map, layer, &shape, image, 0, drawmode|MS_DRAWMODE_SINGLESTYLE); /* draw a single style */
-      if (pStyle->outlinewidth > 0) {
-        /*
-         * RFC 49 implementation: switch back the styleobj to its
-         * original state, so the line fill will be drawn in the
-         * second pass of the caching mechanism
-         */
-	msOutlineRenderingRestoreStyle(pStyle, map, layer, image);
-      }
+      continue;
     }
 
-    else
-      status = msDrawShape(map, layer, &shape, image, -1, drawmode); /* all styles  */
-    if(status != MS_SUCCESS) {
-      msFreeShape(&shape);
+    if(drawVectorLayerShape(map, layer, image, &shape, annotate, &drawmode, &shpcache, &maxnumstyles) != MS_SUCCESS) {
+      msShapePoolFreeShape(layer->shapepool, &shape);
       retcode = MS_FAILURE;
       break;
     }
-    
-    if(shape.numlines == 0) { /* once clipped the shape didn't need to be drawn */
-      msFreeShape(&shape);
-      continue;
-    }
-
-    if(cache) {
-      if(insertFeatureList(&shpcache, &shape) == NULL) {
-        msFreeShape(&shape);
-        retcode = MS_FAILURE; /* problem adding to the cache */
-        break;
-      }
-    }
 
-    maxnumstyles = MS_MAX(maxnumstyles, layer->class[shape.classindex]->numstyles);
+    msShapePoolFreeShape(layer->shapepool, &shape);
+  }
+  msFreeShapeBatch(&batch);
+  msShapePoolDebug(layer->shapepool, layer);
+  msFreeShapePool(layer->shapepool); /* the shapes still around own their arrays */
+  layer->shapepool = NULL;
+
+  if(layer->projapprox && layer->debug >= MS_DEBUGLEVEL_V)
+    msDebug("msDrawVectorLayer(): %ld vertices of layer %s interpolated by PROJ_APPROX_TOLERANCE, %ld projected exactly.\n",
+            layer->projapprox->numinterpolated, layer->name, layer->projapprox->numexact);
+
+  if(pixelaggregate.pixels) {
+    if(layer->debug >= MS_DEBUGLEVEL_V)
+      msDebug("msDrawVectorLayer(): %d features of layer %s skipped by DRAW_PIXEL_AGGREGATE.\n", aggregated, layer->name);
+    msFree(pixelaggregate.pixels);
+  }
 
-    msFreeShape(&shape);
+  if(sorted) {
+    if(numsorted > 0 && (status == MS_DONE && retcode == MS_SUCCESS)) {
+      if(drawSortedShapes(map, layer, image, sorted, numsorted, annotate, &drawmode, &shpcache, &maxnumstyles) != MS_SUCCESS)
+        retcode = MS_FAILURE;
+    } else {
+      int i;
+      for(i=0; i<numsorted; i++) msFreeShape(&sorted[i].shape);
+    }
+    msFree(sorted);
   }
 
   if (classgroup)
@@ -1108,6 +2229,10 @@ int msDrawVectorLayer(mapObj *map, layerObj *layer, imageObj *image)
 
   if(shpcache && MS_DRAW_FEATURES(drawmode)) {
     int s;
+    layerStatsObj *stats = msGetLayerStats(map, layer);
+    double stagestart = 0;
+
+    if(stats) stagestart = msStatsNow();
     for(s=0; s<maxnumstyles; s++) {
       for(current=shpcache; current; current=current->next) {
         if(layer->class[current->shape.classindex]->numstyles > s) {
@@ -1163,6 +2288,7 @@ int msDrawVectorLayer(mapObj *map, layerObj *layer, imageObj *image)
       }
     }
 
+    if(stats) stats->seconds[MS_STATS_RENDER] += msStatsElapsed(&stagestart);
     freeFeatureList(shpcache);
     shpcache = NULL;
   }
@@ -1202,6 +2328,7 @@ int msDrawQueryLayer(mapObj *map, layerObj *layer, imageObj *image)
     if((layer->labelmaxscaledenom != -1) && (map->scaledenom >= layer->labelmaxscaledenom)) annotate = MS_FALSE;
     if((layer->labelminscaledenom != -1) && (map->scaledenom < layer->labelminscaledenom)) annotate = MS_FALSE;
   }
+  msPrepareLabelPointCache(map, layer);
 
   /*
   ** Certain query map styles require us to render all features only (MS_NORMAL) or first (MS_HILITE). With
@@ -1277,7 +2404,7 @@ int msDrawQueryLayer(mapObj *map, layerObj *layer, imageObj *image)
   msInitShape(&shape);
 
   for(i=0; i<layer->resultcache->numresults; i++) {
-    status = msLayerGetShape(layer, &shape, &(layer->resultcache->results[i]));
+    status = msLayerGetResultShape(layer, &shape, i);
     if(status != MS_SUCCESS) {
       msFree(colorbuffer);
       msFree(mindistancebuffer);
@@ -1551,6 +2678,19 @@ int circleLayerDrawShape(mapObj *map, imageObj *image, layerObj *layer, shapeObj
   /* TODO: need to handle circle annotation */
 }
 
+#ifdef USE_PROJ
+/* projects a shape to draw, timed for the map statistics */
+static void drawProjectShape(mapObj *map, layerObj *layer, shapeObj *shape)
+{
+  layerStatsObj *stats = msGetLayerStats(map, layer);
+  double stagestart = 0;
+
+  if(stats) stagestart = msStatsNow();
+  msProjectShapeApprox(&layer->projection, &map->projection, layer->projapprox, shape);
+  if(stats) stats->seconds[MS_STATS_PROJECT] += msStatsElapsed(&stagestart);
+}
+#endif
+
 int pointLayerDrawShape(mapObj *map, imageObj *image, layerObj *layer, shapeObj *shape, int drawmode)
 {
   int l, c = shape->classindex, j, i, s;
@@ -1558,7 +2698,7 @@ int pointLayerDrawShape(mapObj *map, imageObj *image, layerObj *layer, shapeObj
 
 #ifdef USE_PROJ
   if (layer->project && layer->transform == MS_TRUE)
-    msProjectShape(&layer->projection, &map->projection, shape);
+    drawProjectShape(map, layer, shape);
 #endif
 
   for (l = 0; l < layer->class[c]->numlabels; l++)
@@ -1607,6 +2747,8 @@ int lineLayerDrawShape(mapObj *map, imageObj *image, layerObj *layer, shapeObj *
   int c = shape->classindex;
   int ret = MS_SUCCESS;
   int i, s, l = 0;
+  struct polyline_lengths pll; /* of anno_shape, shared by its labels */
+  int have_pll = MS_FALSE;
 
   /* RFC48: loop through the styles, and pass off to the type-specific
   function if the style has an appropriate type */
@@ -1654,7 +2796,11 @@ int lineLayerDrawShape(mapObj *map, imageObj *image, layerObj *layer, shapeObj *
         }
         
         memset(&lfr,0,sizeof(lfr));
-        msPolylineLabelPath(map, image, anno_shape, &ts, label, &lfr);
+        if(!have_pll) {
+          msPolylineComputeLineSegments(anno_shape, &pll);
+          have_pll = MS_TRUE;
+        }
+        msPolylineLabelPath(map, image, anno_shape, &pll, &ts, label, &lfr);
 
         for (i = 0; i < lfr.num_follow_labels; i++) {
           if (msAddLabel(map, image, label, layer->index, c, anno_shape, NULL, -1, lfr.follow_labels[i]) != MS_SUCCESS) {
@@ -1690,7 +2836,11 @@ int lineLayerDrawShape(mapObj *map, imageObj *image, layerObj *layer, shapeObj *
       } else {
         struct label_auto_result lar;
         memset(&lar,0,sizeof(struct label_auto_result));
-        ret = msPolylineLabelPoint(map, anno_shape, &ts, label, &lar, image->resolutionfactor);
+        if(!have_pll) {
+          msPolylineComputeLineSegments(anno_shape, &pll);
+          have_pll = MS_TRUE;
+        }
+        ret = msPolylineLabelPoint(map, anno_shape, &pll, &ts, label, &lar, image->resolutionfactor);
         if(UNLIKELY(MS_FAILURE == ret)) goto line_cleanup;
 
         if (label->angle != 0)
@@ -1744,12 +2894,184 @@ line_cleanup:
     } /* next label */
   }
 
+  if(have_pll)
+    msPolylineFreeLineSegments(anno_shape, &pll);
   return ret;
 
 }
 
+/*
+** Polygon label points with PROCESSING "LABEL_POINT=POLE".
+*/
+#define MS_LABELPOINT_CACHE_SIZE 100000
+
+typedef struct {
+  long shapeindex;
+  int tileindex;
+} labelPointKeyObj;
+
+struct labelPointCacheEntryObj {
+  labelPointKeyObj key;
+  pointObj point; /* map coordinates */
+  UT_hash_handle hh;
+};
+
+static void clearLabelPointCache(labelPointCacheObj *cache)
+{
+  labelPointCacheEntryObj *entry, *tmp;
+
+  UT_HASH_ITER(hh, cache->entries, entry, tmp) {
+    UT_HASH_DEL(cache->entries, entry);
+    free(entry);
+  }
+  cache->numentries = 0;
+}
+
+void msFreeLabelPointCache(labelPointCacheObj *cache)
+{
+  if(!cache) return;
+  clearLabelPointCache(cache);
+  msFree(cache->signature);
+  free(cache);
+}
+
+/*
+** Called before each draw of the layer: enables the pole of inaccessibility
+** placement if the layer asks for it, and drops the cached points if the scale,
+** projections or data source changed since they were computed.
+*/
+void msPrepareLabelPointCache(mapObj *map, layerObj *layer)
+{
+  const char *mode = msLayerGetProcessingKey(layer, "LABEL_POINT");
+  const char *value;
+  labelPointCacheObj *cache = layer->labelpointcache;
+  char *mapproj, *layerproj, *signature;
+  double precision = 1;
+
+  if(!mode || strcasecmp(mode, "POLE") != 0) {
+    if(mode && strcasecmp(mode, "DEFAULT") != 0 && layer->debug)
+      msDebug("msPrepareLabelPointCache(): unknown LABEL_POINT \"%s\" for layer %s, using the default placement.\n", mode, layer->name);
+    if(cache) cache->enabled = MS_FALSE;
+    return;
+  }
+
+  value = msLayerGetProcessingKey(layer, "LABEL_POINT_PRECISION");
+  if(value && atof(value) > 0)
+    precision = atof(value);
+
+  if(!cache) {
+    cache = layer->labelpointcache = (labelPointCacheObj *) msSmallCalloc(1, sizeof(labelPointCacheObj));
+  }
+  cache->enabled = MS_TRUE;
+  cache->precision = precision;
+
+  mapproj = msGetProjectionString(&(map->projection));
+  layerproj = msGetProjectionString(&(layer->projection));
+  signature = msSmallMalloc(strlen(mapproj) + strlen(layerproj) + (layer->data ? strlen(layer->data) : 0) +
+                            (layer->connection ? strlen(layer->connection) : 0) + (layer->tileindex ? strlen(layer->tileindex) : 0) + 100);
+  sprintf(signature, "%.17g:%.17g:%s\x1f%s\x1f%s\x1f%s\x1f%s", map->cellsize, precision, mapproj, layerproj,
+          layer->data ? layer->data : "", layer->connection ? layer->connection : "", layer->tileindex ? layer->tileindex : "");
+  msFree(mapproj);
+  msFree(layerproj);
+
+  if(!cache->signature || strcmp(cache->signature, signature) != 0) {
+    clearLabelPointCache(cache);
+    msFree(cache->signature);
+    cache->signature = signature;
+  } else {
+    free(signature);
+  }
+}
+
+/*
+** Called before each draw of the layer: sets up the approximate reprojection
+** grid if PROCESSING "PROJ_APPROX_TOLERANCE" is set. The tolerance is in
+** output pixels, vertices are interpolated wherever that keeps them within it.
+** The grid covers the search rectangle and as much again on each side, for the
+** parts of the features that stick out of the map.
+*/
+#define MS_PROJ_APPROX_CELLS 32 /* grid cells across the search rectangle */
+
+void msPrepareProjApprox(mapObj *map, layerObj *layer, rectObj *searchrect)
+{
+  const char *value = msLayerGetProcessingKey(layer, "PROJ_APPROX_TOLERANCE");
+  rectObj extent;
+  double tolerance, width, height;
+
+  msFreeProjApprox(layer->projapprox);
+  layer->projapprox = NULL;
+
+  if(!value || !layer->project || layer->transform != MS_TRUE)
+    return;
+
+  tolerance = atof(value);
+  if(!(tolerance > 0) || map->cellsize <= 0) {
+    if(layer->debug)
+      msDebug("msPrepareProjApprox(): invalid PROJ_APPROX_TOLERANCE \"%s\" for layer %s, projecting exactly.\n", value, layer->name);
+    return;
+  }
+
+  width = searchrect->maxx - searchrect->minx;
+  height = searchrect->maxy - searchrect->miny;
+  extent.minx = searchrect->minx - width;
+  extent.miny = searchrect->miny - height;
+  extent.maxx = searchrect->maxx + width;
+  extent.maxy = searchrect->maxy + height;
+
+  layer->projapprox = msCreateProjApprox(&(layer->projection), &(map->projection), &extent,
+                                         3 * MS_PROJ_APPROX_CELLS, 3 * MS_PROJ_APPROX_CELLS, tolerance * map->cellsize);
+}
+
+/*
+** Finds the label point of a polygon. In pole of inaccessibility mode points
+** found on whole features are remembered, to be reused by the other tiles
+** the feature is drawn in.
+*/
+static int getPolygonLabelPoint(mapObj *map, layerObj *layer, shapeObj *shape, shapeObj *anno_shape, int anno_clipped,
+                                pointObj *lp, double minfeaturesize)
+{
+  labelPointCacheObj *cache = layer->labelpointcache;
+  labelPointCacheEntryObj *entry = NULL;
+  labelPointKeyObj key;
+  int cacheable, status;
+
+  if(!cache || !cache->enabled)
+    return msPolygonLabelPoint(anno_shape, lp, minfeaturesize);
+
+  cacheable = !anno_clipped && shape->index >= 0 && layer->transform == MS_TRUE && !map->gt.need_geotransform;
+  if(cacheable) {
+    memset(&key, 0, sizeof(key));
+    key.shapeindex = shape->index;
+    key.tileindex = shape->tileindex;
+    UT_HASH_FIND(hh, cache->entries, &key, sizeof(key), entry);
+    if(entry) {
+      if(minfeaturesize > 0 && MS_MIN(anno_shape->bounds.maxx - anno_shape->bounds.minx, anno_shape->bounds.maxy - anno_shape->bounds.miny) < minfeaturesize)
+        return MS_FAILURE;
+      lp->x = MS_MAP2IMAGE_X_IC_DBL(entry->point.x, map->extent.minx, 1.0 / map->cellsize);
+      lp->y = MS_MAP2IMAGE_Y_IC_DBL(entry->point.y, map->extent.maxy, 1.0 / map->cellsize);
+      return MS_SUCCESS;
+    }
+  }
+
+  status = msPolygonPoleOfInaccessibility(anno_shape, lp, cache->precision, minfeaturesize);
+  if(status != MS_SUCCESS)
+    return msPolygonLabelPoint(anno_shape, lp, minfeaturesize);
+
+  if(cacheable) {
+    if(cache->numentries >= MS_LABELPOINT_CACHE_SIZE)
+      clearLabelPointCache(cache);
+    entry = (labelPointCacheEntryObj *) msSmallMalloc(sizeof(labelPointCacheEntryObj));
+    entry->key = key;
+    entry->point.x = MS_IMAGE2MAP_X(lp->x, map->extent.minx, map->cellsize);
+    entry->point.y = MS_IMAGE2MAP_Y(lp->y, map->extent.maxy, map->cellsize);
+    UT_HASH_ADD(hh, cache->entries, key, sizeof(key), entry);
+    cache->numentries++;
+  }
+  return MS_SUCCESS;
+}
+
 int polygonLayerDrawShape(mapObj *map, imageObj *image, layerObj *layer,
-                          shapeObj *shape, shapeObj *anno_shape, shapeObj *unclipped_shape, int drawmode)
+                          shapeObj *shape, shapeObj *anno_shape, shapeObj *unclipped_shape, int anno_clipped, int drawmode)
 {
 
   int c = shape->classindex;
@@ -1778,7 +3100,7 @@ int polygonLayerDrawShape(mapObj *map, imageObj *image, layerObj *layer,
   if(MS_DRAW_LABELS(drawmode)) {
     if (layer->class[c]->numlabels > 0) {
       double minfeaturesize = layer->class[c]->labels[0]->minfeaturesize * image->resolutionfactor;
-      if (msPolygonLabelPoint(anno_shape, &annopnt, minfeaturesize) == MS_SUCCESS) {
+      if (getPolygonLabelPoint(map, layer, shape, anno_shape, anno_clipped, &annopnt, minfeaturesize) == MS_SUCCESS) {
         for (i = 0; i < layer->class[c]->numlabels; i++)
           if (layer->class[c]->labels[i]->angle != 0) layer->class[c]->labels[i]->angle -= map->gt.rotation_angle; /* TODO: is this correct ??? */
         if (layer->labelcache) {
@@ -1814,6 +3136,7 @@ int msDrawShape(mapObj *map, layerObj *layer, shapeObj *shape, imageObj *image,
   int bNeedUnclippedShape = MS_FALSE;
   int bNeedUnclippedAnnoShape = MS_FALSE;
   int bShapeNeedsClipping = MS_TRUE;
+  int bAnnoShapeClipped = MS_FALSE;
 
   if(shape->numlines == 0 || shape->type == MS_SHAPE_NULL) return MS_SUCCESS;
 
@@ -1854,7 +3177,7 @@ int msDrawShape(mapObj *map, layerObj *layer, shapeObj *shape, imageObj *image,
 
 #ifdef USE_PROJ
   if (layer->project && layer->transform == MS_TRUE)
-    msProjectShape(&layer->projection, &map->projection, shape);
+    drawProjectShape(map, layer, shape);
 #endif
 
   /* check if we'll need the unclipped shape */
@@ -1954,6 +3277,7 @@ int msDrawShape(mapObj *map, layerObj *layer, shapeObj *shape, imageObj *image,
         anno_shape = unclipped_shape;
       } else {
         anno_shape = shape;
+        bAnnoShapeClipped = MS_TRUE;
       }
     } else {
       /* clip first, then transform. This means we are clipping in geographical space */
@@ -1970,15 +3294,11 @@ int msDrawShape(mapObj *map, layerObj *layer, shapeObj *shape, imageObj *image,
       cliprect.miny = map->extent.miny - clip_buf_d;
       cliprect.maxx = map->extent.maxx + clip_buf_d;
       cliprect.maxy = map->extent.maxy + clip_buf_d;
-      if(shape->type == MS_SHAPE_POLYGON) {
-        msClipPolygonRect(shape, cliprect);
-      } else {
-        assert(shape->type == MS_SHAPE_LINE);
-        msClipPolylineRect(shape, cliprect);
-      }
-      msTransformShape(shape, map->extent, map->cellsize, image);
+      assert(shape->type == MS_SHAPE_POLYGON || shape->type == MS_SHAPE_LINE);
+      msClipTransformShape(shape, cliprect, map->extent, map->cellsize, image);
       msComputeBounds(shape);
       anno_shape = shape;
+      bAnnoShapeClipped = MS_TRUE;
     }
 
   } else {
@@ -2009,7 +3329,7 @@ int msDrawShape(mapObj *map, layerObj *layer, shapeObj *shape, imageObj *image,
       break;
     case MS_LAYER_POLYGON:
       msDrawStartShape(map, layer, image, shape);
-      ret = polygonLayerDrawShape(map, image, layer, shape, anno_shape, unclipped_shape, drawmode);
+      ret = polygonLayerDrawShape(map, image, layer, shape, anno_shape, unclipped_shape, bAnnoShapeClipped, drawmode);
       break;
     case MS_LAYER_POINT:
     case MS_LAYER_RASTER:
@@ -2258,6 +3578,18 @@ static inline void offset_label_bounds(const label_bounds *from, label_bounds *t
   offset_bbox(&from->bbox, &to->bbox, ox, oy);
 }
 
+/* seconds elapsed since *t, which is reset to the current time */
+static double labelStatsLap(struct mstimeval *t)
+{
+  struct mstimeval now;
+  double elapsed;
+
+  msGettimeofday(&now, NULL);
+  elapsed = (now.tv_sec - t->tv_sec) + (now.tv_usec - t->tv_usec)/1.0e6;
+  *t = now;
+  return elapsed;
+}
+
 /* private shortcut function to try a leader offsetted label
  * the caller must ensure that scratch->poly->points has been sufficiently allocated
  * to hold the points from the cachePtr's label_bounds */
@@ -2299,9 +3631,9 @@ void offsetAndTest(mapObj *map, labelCacheMemberObj *cachePtr, double ox, double
 
 
   /* the current offset is ok */
-  cachePtr->leaderbbox = msSmallMalloc(sizeof(rectObj));
-  cachePtr->leaderline = msSmallMalloc(sizeof(lineObj));
-  cachePtr->leaderline->point = msSmallMalloc(2 * sizeof(pointObj));
+  cachePtr->leaderbbox = msLabelCacheAlloc(&map->labelcache, sizeof(rectObj));
+  cachePtr->leaderline = msLabelCacheAlloc(&map->labelcache, sizeof(lineObj));
+  cachePtr->leaderline->point = msLabelCacheAlloc(&map->labelcache, 2 * sizeof(pointObj));
   cachePtr->leaderline->numpoints = 2;
   cachePtr->leaderline->point[0] = cachePtr->point;
   cachePtr->leaderline->point[1] = leaderpt;
@@ -2342,6 +3674,8 @@ int msDrawOffsettedLabels(imageObj *image, mapObj *map, int priority)
   lineObj scratch_line;
   pointObj *scratch_points = NULL;
   int num_allocated_scratch_points = 0;
+  labelCacheStatsObj *st = NULL;
+  struct mstimeval lap;
   assert(MS_RENDERER_PLUGIN(image->format));
   cacheslot = &(labelcache->slots[priority]);
   scratch.poly = &scratch_line;
@@ -2357,11 +3691,17 @@ int msDrawOffsettedLabels(imageObj *image, mapObj *map, int priority)
 
       assert(classPtr->leader); /* cachePtrs that don't need to be tested have been marked as status on or delete */
 
+      if(labelcache->stats) {
+        st = &labelcache->stats[cachePtr->layerindex];
+        labelStatsLap(&lap);
+      }
+
       if(cachePtr->point.x < labelcache->gutter ||
           cachePtr->point.y < labelcache->gutter ||
           cachePtr->point.x >= image->width - labelcache->gutter ||
           cachePtr->point.y >= image->height - labelcache->gutter) {
         /* don't look for leaders if point is in edge buffer as the leader line would end up chopped off */
+        if(st) st->collided++;
         continue;
       }
 
@@ -2399,6 +3739,7 @@ int msDrawOffsettedLabels(imageObj *image, mapObj *map, int priority)
                 (y0+(oy)) < image->height + labelcache->gutter) {\
                    scratch_line.point = scratch_points;\
                    scratch.poly = &scratch_line; \
+                   if(st) st->leadertests++; \
                    offsetAndTest(map,cachePtr,(ox),(oy),priority,l,&scratch); \
                    if(cachePtr->status == MS_ON) break;\
                 }
@@ -2500,6 +3841,13 @@ int msDrawOffsettedLabels(imageObj *image, mapObj *map, int priority)
         otest(0,-i*gridstepsc);
         otest(0,i*gridstepsc);
       }
+      if(st) {
+        st->placement += labelStatsLap(&lap);
+        if(cachePtr->status == MS_ON)
+          st->leaderplaced++;
+        else
+          st->collided++;
+      }
       if(cachePtr->status == MS_ON) {
         int ll;
         shapeObj labelLeader; /* label polygon (bounding box, possibly rotated) */
@@ -2561,6 +3909,7 @@ int msDrawOffsettedLabels(imageObj *image, mapObj *map, int priority)
          msDrawLineSymbol(&map->symbolset, image, cachePtr->poly, &tstyle, layerPtr->scalefactor);
         */
 
+        if(st) st->rendering += labelStatsLap(&lap);
       }
     }
   }
@@ -2699,8 +4048,10 @@ int msDrawLabelCache(mapObj *map, imageObj *image)
 {
   int nReturnVal = MS_SUCCESS;
   struct mstimeval starttime, endtime;
+  double labelcachestart = 0;
 
   if(map->debug >= MS_DEBUGLEVEL_TUNING) msGettimeofday(&starttime, NULL);
+  if(map->stats) labelcachestart = msStatsNow();
 
   if(image) {
     if(MS_RENDERER_PLUGIN(image->format)) {
@@ -2709,6 +4060,10 @@ int msDrawLabelCache(mapObj *map, imageObj *image)
       double marker_offset_x, marker_offset_y;
       int label_offset_x, label_offset_y;
       const char *value;
+      int use_placement_cache;
+      labelCacheStatsObj *st = NULL;
+      struct mstimeval lap;
+      double prepass = 0;
 
       labelCacheMemberObj *cachePtr=NULL;
       layerObj *layerPtr=NULL;
@@ -2748,21 +4103,59 @@ int msDrawLabelCache(mapObj *map, imageObj *image)
         if(map->debug) msDebug("msDrawLabelCache(): labelcache_map_edge_buffer = %d\n", map->labelcache.gutter);
       }
 
+      /* reuse the AUTO positions picked for the labels of previously rendered (meta)tiles */
+      use_placement_cache = msLabelPlacementCacheEnabled(map);
+
+      /* per layer counters and timings, reported below */
+      if(map->debug >= MS_DEBUGLEVEL_TUNING) {
+        msFree(map->labelcache.stats);
+        map->labelcache.stats = (labelCacheStatsObj *) msSmallCalloc(MS_MAX(map->numlayers,1), sizeof(labelCacheStatsObj));
+        labelStatsLap(&lap);
+      }
+
+      /* shape the label texts ahead of placement, in parallel */
+      if(msGetConfigOption(map, "MS_DRAW_THREADS")) {
+        msComputeLabelCacheTextPaths(map, atoi(msGetConfigOption(map, "MS_DRAW_THREADS")));
+        if(map->labelcache.stats)
+          prepass = labelStatsLap(&lap);
+      }
+
       for(priority=MS_MAX_LABEL_PRIORITY-1; priority>=0; priority--) {
         labelCacheSlotObj *cacheslot;
         cacheslot = &(map->labelcache.slots[priority]);
 
+        /* out of time with partial output: keep the labels placed so far */
+        if(msIO_checkRequestCancelled("msDrawLabelCache()")) {
+          if(!msIO_isRequestOutputPartial())
+            return MS_FAILURE;
+          break;
+        }
+
         for(l=cacheslot->numlabels-1; l>=0; l--) {
           cachePtr = &(cacheslot->labels[l]); /* point to right spot in the label cache */
 
+          if((l & 255) == 0 && msIO_checkRequestCancelled("msDrawLabelCache()")) {
+            if(!msIO_isRequestOutputPartial())
+              return MS_FAILURE;
+            break;
+          }
+
           layerPtr = (GET_LAYER(map, cachePtr->layerindex)); /* set a couple of other pointers, avoids nasty references */
           classPtr = (GET_CLASS(map, cachePtr->layerindex, cachePtr->classindex));
 
+          if(map->labelcache.stats) {
+            double elapsed = labelStatsLap(&lap);
+            if(st) st->placement += elapsed; /* the end of the previous member */
+            st = &map->labelcache.stats[cachePtr->layerindex];
+            st->candidates++;
+          }
+
           /* before going any futher (and maybe even computing label size for performance,
            check that mindistance is respected */ 
           if(cachePtr->numtextsymbols && cachePtr->textsymbols[0]->label->mindistance > 0.0 && cachePtr->textsymbols[0]->annotext) {
             if(msCheckLabelMinDistance(map, cachePtr) == MS_TRUE) {
               cachePtr->status = MS_DELETE;
+              if(st) st->mindistance++;
               MS_DEBUG(MS_DEBUGLEVEL_DEVDEBUG,map,
                   "Skipping labelgroup %d \"%s\" in layer \"%s\": too close to an identical label (mindistance)\n",
                   l, cachePtr->textsymbols[0]->annotext, layerPtr->name);
@@ -2776,12 +4169,18 @@ int msDrawLabelCache(mapObj *map, imageObj *image)
             else
               cachePtr->status = MS_ON;
             if(cachePtr->status) {
+                if(st) {
+                  st->placement += labelStatsLap(&lap);
+                  st->placed++;
+                }
                 if(UNLIKELY(MS_FAILURE == msDrawTextSymbol(map,image,cachePtr->textsymbols[0]->annopoint /*not used*/,cachePtr->textsymbols[0]))) {
                   return MS_FAILURE;
                 }
                 cachePtr->bbox = cachePtr->textsymbols[0]->textpath->bounds.bbox;
                 insertRenderedLabelMember(map, cachePtr);
+                if(st) st->rendering += labelStatsLap(&lap);
             } else {
+              if(st) st->collided++;
               MS_DEBUG(MS_DEBUGLEVEL_DEVDEBUG,map,
                   "Skipping follow labelgroup %d \"%s\" in layer \"%s\": text collided\n",
                   l, cachePtr->textsymbols[0]->annotext, layerPtr->name);
@@ -2867,11 +4266,22 @@ int msDrawLabelCache(mapObj *map, imageObj *image)
                   }
                 }
 
+                /* don't shape texts that can't end up in the image */
+                if(!textSymbolPtr->textpath && !msTextSymbolMayBeInImage(map, cachePtr, textSymbolPtr, MS_MAX(marker_offset_x, marker_offset_y))) {
+                  cachePtr->status = MS_DELETE;
+                  MS_DEBUG(MS_DEBUGLEVEL_DEVDEBUG,map,
+                      "Skipping label %d \"%s\" of labelgroup %d of class %d in layer \"%s\": too far outside of the image\n",
+                      ll, textSymbolPtr->annotext, l, cachePtr->classindex, layerPtr->name);
+                  break;
+                }
+
                 /* compute label size */
                 if(!textSymbolPtr->textpath) {
+                  if(st) st->placement += labelStatsLap(&lap);
                   if(UNLIKELY(MS_FAILURE == msComputeTextPath(map,textSymbolPtr))) {
                     return MS_FAILURE;
                   }
+                  if(st) st->shaping += labelStatsLap(&lap);
                 }
 
                 /* if our label has an outline, adjust the marker offset so the outlinecolor does
@@ -2921,6 +4331,18 @@ int msDrawLabelCache(mapObj *map, imageObj *image)
                     npositions = 8;
                   }
 
+                  if(use_placement_cache) {
+                    /* try the position this label got in a neighbouring tile first */
+                    int cached = msLabelPlacementCacheLookup(map, cachePtr, ll);
+                    for(i=1; i<npositions; i++) {
+                      if(positions[i] == cached) {
+                        memmove(positions+1, positions, i * sizeof(int));
+                        positions[0] = cached;
+                        break;
+                      }
+                    }
+                  }
+
                   for(i=0; i<npositions; i++) {
                     // RFC 77 TODO: take label_marker_offset_x/y into account
                     metrics_bounds.poly = &metrics_line;
@@ -2949,6 +4371,8 @@ int msDrawLabelCache(mapObj *map, imageObj *image)
                                                                 marker_offset_x + label_offset_x, marker_offset_y + label_offset_y,
                                                                 textSymbolPtr->rotation, 1, &labelpoly_bounds);
 
+                      if(use_placement_cache)
+                        msLabelPlacementCacheStore(map, cachePtr, ll, positions[i]);
                       break; /* ...out of position loop */
                     }
                   } /* next position */
@@ -3092,9 +4516,16 @@ int msDrawLabelCache(mapObj *map, imageObj *image)
               }
             }
 
+            if(st && cachePtr->status == MS_DELETE)
+              st->collided++; /* leader candidates (MS_OFF) are counted by msDrawOffsettedLabels() */
             if(cachePtr->status == MS_OFF || cachePtr->status == MS_DELETE)
               continue; /* next labelCacheMemberObj, as we had a collision */
 
+            if(st) {
+              st->placement += labelStatsLap(&lap);
+              st->placed++;
+            }
+
             /* insert the rendered label */
             insertRenderedLabelMember(map, cachePtr);
 
@@ -3129,8 +4560,13 @@ int msDrawLabelCache(mapObj *map, imageObj *image)
                 }
               }
             }
+            if(st) st->rendering += labelStatsLap(&lap);
           }
         } /* next label(group) from cacheslot */
+        if(st) {
+          st->placement += labelStatsLap(&lap);
+          st = NULL; /* the leader pass keeps its own times */
+        }
         if(UNLIKELY(MS_FAILURE == msDrawOffsettedLabels(image, map, priority))) {
           return MS_FAILURE;
         }
@@ -3160,10 +4596,27 @@ int msDrawLabelCache(mapObj *map, imageObj *image)
       }
 #endif
 
+      if(map->labelcache.stats) {
+        if(prepass > 0)
+          msDebug("msDrawLabelCache(): parallel text shaping, %.3fs\n", prepass);
+        for(i=0; i<map->numlayers; i++) {
+          labelCacheStatsObj *ls = &map->labelcache.stats[i];
+          if(ls->candidates == 0) continue;
+          msDebug("msDrawLabelCache(): layer=\"%s\" candidates=%d placed=%d leader_placed=%d collided=%d mindistance=%d"
+                  " leader_tests=%d shaping=%.3fs placement=%.3fs rendering=%.3fs\n",
+                  GET_LAYER(map, i)->name ? GET_LAYER(map, i)->name : "", ls->candidates, ls->placed, ls->leaderplaced,
+                  ls->collided, ls->mindistance, ls->leadertests, ls->shaping, ls->placement, ls->rendering);
+        }
+        msFree(map->labelcache.stats);
+        map->labelcache.stats = NULL;
+      }
+
       nReturnVal = MS_SUCCESS; /* necessary? */
     }
   }
 
+  if(map->stats) map->stats->seconds[MS_STATS_LABELCACHE] += msStatsElapsed(&labelcachestart);
+
   if(map->debug >= MS_DEBUGLEVEL_TUNING) {
     msGettimeofday(&endtime, NULL);
     msDebug("msDrawMap(): Drawing Label Cache, %.3fs\n",
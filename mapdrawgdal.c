@@ -1238,6 +1238,60 @@ static int ApplyLUT( int iColorIndex, const char* lut_def,
   return err;
 }
 
+/************************************************************************/
+/*                          ScaleFloatToByte()                          */
+/*                                                                      */
+/*      Linear scaling of a float buffer to 8bit, with clamping.  The   */
+/*      loop is kept free of branches so that it can be vectorized.     */
+/************************************************************************/
+
+static void ScaleFloatToByte( const float *pafInBuffer, GByte *pabyOutBuffer,
+                              int nPixelCount,
+                              double dfScaleMin, double dfScaleRatio )
+{
+  int i;
+
+  for( i = 0; i < nPixelCount; i++ ) {
+    float fScaledValue = (float) ((pafInBuffer[i]-dfScaleMin)*dfScaleRatio);
+
+    fScaledValue = (fScaledValue < 0.0f) ? 0.0f : fScaledValue;
+    fScaledValue = (fScaledValue > 255.0f) ? 255.0f : fScaledValue;
+    pabyOutBuffer[i] = (GByte) (int) fScaledValue;
+  }
+}
+
+/************************************************************************/
+/*                        ScaleFloatToBuckets()                         */
+/*                                                                      */
+/*      Compute the classification bucket of each value of a float      */
+/*      buffer, or -1 for nodata, NaN and out of range values.  Like    */
+/*      ScaleFloatToByte(), written without branches.                   */
+/************************************************************************/
+
+static void ScaleFloatToBuckets( const float *pafInBuffer, int *panOutBuffer,
+                                 int nPixelCount,
+                                 double dfScaleMin, double dfScaleRatio,
+                                 int nBucketCount,
+                                 int bGotNoData, float fNoDataValue )
+{
+  int i;
+
+  for( i = 0; i < nPixelCount; i++ ) {
+    float fRawValue = pafInBuffer[i];
+
+    /*
+     * The funny +1/-1 is to avoid odd rounding around zero.  Values that
+     * would truncate outside of [1,nBucketCount] (NaN included) are turned
+     * into 0, and so into the -1 bucket.
+     */
+    double dfIndex = (fRawValue - dfScaleMin) * dfScaleRatio + 1;
+    int bValid = (dfIndex >= 1.0) & (dfIndex < nBucketCount + 1.0)
+                 & !(bGotNoData & (fRawValue == fNoDataValue));
+
+    panOutBuffer[i] = (int) (bValid ? dfIndex : 0.0) - 1;
+  }
+}
+
 /************************************************************************/
 /*                           LoadGDALImages()                           */
 /*                                                                      */
@@ -1501,16 +1555,8 @@ LoadGDALImages( GDALDatasetH hDS, int band_numbers[4], int band_count,
     dfScaleRatio = 256.0 / (dfScaleMax - dfScaleMin);
     pabyBuffer = pabyWholeBuffer + iColorIndex * nPixelCount;
 
-    for( i = 0; i < nPixelCount; i++ ) {
-      float fScaledValue = (float) ((pafRawData[i]-dfScaleMin)*dfScaleRatio);
-
-      if( fScaledValue < 0.0 )
-        pabyBuffer[i] = 0;
-      else if( fScaledValue > 255.0 )
-        pabyBuffer[i] = 255;
-      else
-        pabyBuffer[i] = (int) fScaledValue;
-    }
+    ScaleFloatToByte( pafRawData, pabyBuffer, nPixelCount,
+                      dfScaleMin, dfScaleRatio );
 
     /* -------------------------------------------------------------------- */
     /*      Report a warning if NODATA keyword was applied.  We are         */
@@ -1839,6 +1885,44 @@ msDrawRasterLayerGDAL_RawMode(
     return -1;
   }
 
+  /* -------------------------------------------------------------------- */
+  /*      Without nodata nor mask, every pixel is copied: transfer whole  */
+  /*      rows to the imageObj.                                           */
+  /* -------------------------------------------------------------------- */
+  if( f_nodatas == NULL && mask_rb == NULL ) {
+    int nPixelSize = GDALGetDataTypeSize(eDataType)/8;
+    unsigned char *pabyImage;
+
+    if( image->format->imagemode == MS_IMAGEMODE_INT16 )
+      pabyImage = (unsigned char *) image->img.raw_16bit;
+    else if( image->format->imagemode == MS_IMAGEMODE_FLOAT32 )
+      pabyImage = (unsigned char *) image->img.raw_float;
+    else
+      pabyImage = image->img.raw_byte;
+
+    k = 0;
+    for( band = 0; band < image->format->bands; band++ ) {
+      for( i = dst_yoff; i < dst_yoff + dst_ysize; i++ ) {
+        int off = dst_xoff + i * image->width
+                  + band*image->width*image->height;
+
+        memcpy( pabyImage + off * nPixelSize,
+                ((unsigned char *) pBuffer) + k * nPixelSize,
+                dst_xsize * nPixelSize );
+        k += dst_xsize;
+      }
+    }
+
+    for( i = dst_yoff; i < dst_yoff + dst_ysize; i++ ) {
+      for( j = dst_xoff; j < dst_xoff + dst_xsize; j++ )
+        MS_SET_BIT(image->img_mask, j + i * image->width);
+    }
+
+    free( pBuffer );
+
+    return 0;
+  }
+
   /* -------------------------------------------------------------------- */
   /*      Transfer the data to the imageObj.                              */
   /* -------------------------------------------------------------------- */
@@ -1921,14 +2005,15 @@ msDrawRasterLayerGDAL_16BitClassification(
 
 {
   float *pafRawData;
+  int   *panMapIndex;
   double dfScaleMin=0.0, dfScaleMax=0.0, dfScaleRatio;
   int   nPixelCount = dst_xsize * dst_ysize, i, nBucketCount=0;
   GDALDataType eDataType;
   float fDataMin=0.0, fDataMax=255.0, fNoDataValue;
   const char *pszScaleInfo;
   const char *pszBuckets;
-  int  *cmap, c, j, k, bGotNoData = FALSE, bGotFirstValue;
-  unsigned char *rb_cmap[4];
+  int  j, k, bGotNoData = FALSE, bGotFirstValue;
+  const unsigned char *rb_cmap;
   CPLErr eErr;
   rasterBufferObj *mask_rb = NULL;
   rasterBufferObj s_mask_rb;
@@ -2083,95 +2168,54 @@ msDrawRasterLayerGDAL_16BitClassification(
              layer->name, nBucketCount, dfScaleMin, dfScaleMax );
 
   /* ==================================================================== */
-  /*      Compute classification lookup table.                            */
+  /*      Fetch the classification lookup table, it is only computed      */
+  /*      again when the buckets or the classes change.                   */
   /* ==================================================================== */
-
-  cmap = (int *) msSmallCalloc(sizeof(int),nBucketCount);
-  rb_cmap[0] = (unsigned char *) msSmallCalloc(1,nBucketCount);
-  rb_cmap[1] = (unsigned char *) msSmallCalloc(1,nBucketCount);
-  rb_cmap[2] = (unsigned char *) msSmallCalloc(1,nBucketCount);
-  rb_cmap[3] = (unsigned char *) msSmallCalloc(1,nBucketCount);
-
-  for(i=0; i < nBucketCount; i++) {
-    double dfOriginalValue;
-
-    cmap[i] = -1;
-
-    dfOriginalValue = (i+0.5) / dfScaleRatio + dfScaleMin;
-
-    c = msGetClass_FloatRGB(layer, (float) dfOriginalValue, -1, -1, -1);
-    if( c != -1 ) {
-      int s;
-
-      /* change colour based on colour range? */
-      for(s=0; s<layer->class[c]->numstyles; s++) {
-        if( MS_VALID_COLOR(layer->class[c]->styles[s]->mincolor)
-            && MS_VALID_COLOR(layer->class[c]->styles[s]->maxcolor) )
-          msValueToRange(layer->class[c]->styles[s],dfOriginalValue, MS_COLORSPACE_RGB);
-      }
-      if( MS_TRANSPARENT_COLOR(layer->class[c]->styles[0]->color) ) {
-        /* leave it transparent */
-      } else if( MS_VALID_COLOR(layer->class[c]->styles[0]->color)) {
-        /* use class color */
-        rb_cmap[0][i] = layer->class[c]->styles[0]->color.red;
-        rb_cmap[1][i] = layer->class[c]->styles[0]->color.green;
-        rb_cmap[2][i] = layer->class[c]->styles[0]->color.blue;
-        rb_cmap[3][i] = (255*layer->class[c]->styles[0]->opacity / 100);
-      }
-    }
-  }
+  rb_cmap = msGetRasterClassTable(layer, nBucketCount, dfScaleMin, dfScaleRatio)->rgba;
 
   /* ==================================================================== */
   /*      Now process the data, applying to the working imageObj.         */
   /* ==================================================================== */
+  panMapIndex = (int *) malloc(sizeof(int) * dst_xsize);
+  if( panMapIndex == NULL ) {
+    free( pafRawData );
+    msSetError( MS_MEMERR, "Out of memory allocating working buffer.",
+                "msDrawRasterLayerGDAL_16BitClassification()" );
+    return -1;
+  }
+
   k = 0;
 
   for( i = dst_yoff; i < dst_yoff + dst_ysize; i++ ) {
+    ScaleFloatToBuckets( pafRawData + k, panMapIndex, dst_xsize,
+                         dfScaleMin, dfScaleRatio, nBucketCount,
+                         bGotNoData, fNoDataValue );
+    k += dst_xsize;
+
     for( j = dst_xoff; j < dst_xoff + dst_xsize; j++ ) {
-      float fRawValue = pafRawData[k++];
-      int   iMapIndex;
+      const unsigned char *rgba;
+      int   iMapIndex = panMapIndex[j - dst_xoff];
 
       /*
-       * Skip nodata pixels ... no processing.
+       * Skip nodata and out of range pixels ... no processing.
        */
-      if( bGotNoData && fRawValue == fNoDataValue ) {
-        continue;
-      }
-
-      if( CPLIsNan(fRawValue) )
+      if( iMapIndex < 0 || SKIP_MASK(j,i) )
         continue;
 
-      if(SKIP_MASK(j,i))
-        continue;
+      rgba = rb_cmap + 4 * iMapIndex;
 
-      /*
-       * The funny +1/-1 is to avoid odd rounding around zero.
-       * We could use floor() but sometimes it is expensive.
-       */
-      iMapIndex = (int) ((fRawValue - dfScaleMin) * dfScaleRatio+1)-1;
-
-      if( iMapIndex >= nBucketCount || iMapIndex < 0 ) {
-        continue;
-      }
       /* currently we never have partial alpha so keep simple */
-      if( rb_cmap[3][iMapIndex] > 0 )
-        RB_SET_PIXEL( rb, j, i,
-                      rb_cmap[0][iMapIndex],
-                      rb_cmap[1][iMapIndex],
-                      rb_cmap[2][iMapIndex],
-                      rb_cmap[3][iMapIndex] );
+      if( rgba[3] > 0 )
+        RB_SET_PIXEL( rb, j, i, rgba[0], rgba[1], rgba[2], rgba[3] );
     }
   }
 
+  free( panMapIndex );
+
   /* -------------------------------------------------------------------- */
   /*      Cleanup                                                         */
   /* -------------------------------------------------------------------- */
   free( pafRawData );
-  free( cmap );
-  free( rb_cmap[0] );
-  free( rb_cmap[1] );
-  free( rb_cmap[2] );
-  free( rb_cmap[3] );
 
   assert( k == dst_xsize * dst_ysize );
 
@@ -86,7 +86,7 @@ static char *ms_errorCodes[MS_NUMERRORCODES] = {"",
     "Renderer error.",
     "V8 engine error."                                                
                                                };
-#ifndef USE_THREAD
+#if !defined(USE_THREAD)
 
 errorObj *msGetErrorObj()
 {
@@ -94,9 +94,27 @@ errorObj *msGetErrorObj()
 
   return &ms_error;
 }
-#endif
 
-#ifdef USE_THREAD
+#elif defined(MS_THREAD_LOCAL)
+
+/*
+** Each thread has its own head of the error list in thread local storage,
+** so that fetching it, which happens on every msSetError() and
+** msResetErrorList(), takes no lock.
+*/
+errorObj *msGetErrorObj()
+{
+  static MS_THREAD_LOCAL errorObj ms_error = {MS_NOERR, "", "", MS_FALSE, 0, NULL};
+
+  return &ms_error;
+}
+
+#else
+
+/*
+** Without thread local storage the heads are kept in a list of threads
+** behind TLOCK_ERROROBJ, the most recently used thread first.
+*/
 
 typedef struct te_info {
   struct te_info *next;
@@ -238,7 +256,7 @@ void msResetErrorList()
   /*      Cleanup our entry in the thread list.  This is mainly           */
   /*      imprortant when msCleanup() calls msResetErrorList().           */
   /* -------------------------------------------------------------------- */
-#ifdef USE_THREAD
+#if defined(USE_THREAD) && !defined(MS_THREAD_LOCAL)
   {
     void*  thread_id = msGetThreadId();
     te_info_t *link;
@@ -530,6 +548,9 @@ char *msGetVersion()
 #if (defined USE_JPEG)
   strcat(version, " OUTPUT=JPEG");
 #endif
+#ifdef USE_WEBP
+  strcat(version, " OUTPUT=WEBP");
+#endif
 #ifdef USE_KML
   strcat(version, " OUTPUT=KML");
 #endif
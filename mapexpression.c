@@ -0,0 +1,1310 @@
+/******************************************************************************
+ *
+ * Project:  MapServer
+ * Purpose:  Compilation of logical expressions to a small stack machine so
+ *           that they don't go through yyparse() for every feature.
+ * Author:   Steve Lime and the MapServer team.
+ *
+ ******************************************************************************
+ * Copyright (c) 1996-2015 Regents of the University of Minnesota.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies of this Software or works derived from this Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+#include <math.h>
+
+#include "mapserver.h"
+#include "mapparser.h"
+
+extern int yyparse(parseObj *);
+
+/*
+** The compiler covers the logical, numeric and string parts of the grammar
+** in mapparser.y, with the same operator precedence and the same (sometimes
+** surprising) semantics, and the geometry functions of GEOMTRANSFORM
+** expressions such as (buffer([shape], 5)). Expressions using time values or
+** spatial predicates, or any construct not handled here, are left to yyparse(). So is anything yyparse()
+** would reject, so errors are reported exactly as before.
+*/
+
+enum {
+  MS_EXPR_TYPE_LOGICAL, MS_EXPR_TYPE_MATH, MS_EXPR_TYPE_STRING, MS_EXPR_TYPE_TEMPLATE, MS_EXPR_TYPE_SHAPE, MS_EXPR_TYPE_UNSUPPORTED=-1
+};
+
+enum {
+  MS_EXPR_OP_NUMBER, MS_EXPR_OP_BOOLEAN, MS_EXPR_OP_STRING,
+  MS_EXPR_OP_BIND_NUMBER, MS_EXPR_OP_BIND_STRING, MS_EXPR_OP_MAP_CELLSIZE, MS_EXPR_OP_DATA_CELLSIZE,
+  MS_EXPR_OP_TOBOOL, MS_EXPR_OP_AND, MS_EXPR_OP_OR, MS_EXPR_OP_NOT, MS_EXPR_OP_EQ_LOGICAL,
+  MS_EXPR_OP_EQ_MATH, MS_EXPR_OP_NE_MATH, MS_EXPR_OP_GT_MATH, MS_EXPR_OP_LT_MATH, MS_EXPR_OP_LE_MATH, MS_EXPR_OP_GE_MATH,
+  MS_EXPR_OP_EQ_STRING, MS_EXPR_OP_NE_STRING, MS_EXPR_OP_GT_STRING, MS_EXPR_OP_LT_STRING, MS_EXPR_OP_LE_STRING, MS_EXPR_OP_GE_STRING,
+  MS_EXPR_OP_IEQ_STRING, MS_EXPR_OP_RE, MS_EXPR_OP_IRE, MS_EXPR_OP_RE_COMPILED, MS_EXPR_OP_IN_STRING, MS_EXPR_OP_IN_MATH,
+  MS_EXPR_OP_ADD, MS_EXPR_OP_SUB, MS_EXPR_OP_MUL, MS_EXPR_OP_DIV, MS_EXPR_OP_MOD, MS_EXPR_OP_POW,
+  MS_EXPR_OP_CONCAT, MS_EXPR_OP_LENGTH, MS_EXPR_OP_ROUND, MS_EXPR_OP_TOSTRING, MS_EXPR_OP_COMMIFY,
+  MS_EXPR_OP_UPPER, MS_EXPR_OP_LOWER, MS_EXPR_OP_INITCAP, MS_EXPR_OP_FIRSTCAP,
+  MS_EXPR_OP_SHAPE, MS_EXPR_OP_BIND_SHAPE, MS_EXPR_OP_BUFFER, MS_EXPR_OP_DIFFERENCE, MS_EXPR_OP_SIMPLIFY,
+  MS_EXPR_OP_SIMPLIFYPT, MS_EXPR_OP_GENERALIZE, MS_EXPR_OP_SMOOTHSIA
+};
+
+typedef struct {
+  int op;
+  union {
+    double dblval;
+    int intval;
+    const char *strval; /* literal, owned by the token list */
+    shapeObj *shpval; /* literal, owned by the token list */
+    const tokenListNodeObj *node; /* bindings, the item index is read at run time */
+    int regex; /* index in the regex table */
+  } arg;
+} expressionInstructionObj;
+
+struct expressionProgramObj {
+  expressionInstructionObj *code;
+  int numcode, maxcode;
+  int maxstack; /* deepest stack the program needs */
+  int resulttype;
+  int batch; /* can be run by msEvalExpressionBatch() */
+
+  ms_regex_t *regex; /* patterns of =~ and ~* with a literal right hand side */
+  int numregex;
+
+  char *literals; /* text of the literal parts of a template */
+};
+
+typedef struct {
+  const tokenListNodeObj *token; /* next token to consume */
+  expressionProgramObj *program;
+  int depth, maxdepth; /* stack depth tracking */
+} expressionCompilerObj;
+
+/* binary operator precedence, mirrors the %left/%right declarations of mapparser.y */
+#define MS_EXPR_PREC_OR 1
+#define MS_EXPR_PREC_AND 2
+#define MS_EXPR_PREC_NOT 3
+#define MS_EXPR_PREC_COMPARISON 4
+#define MS_EXPR_PREC_ADD 5
+#define MS_EXPR_PREC_MUL 6
+#define MS_EXPR_PREC_NEG 7
+#define MS_EXPR_PREC_POW 8
+
+static int binaryPrecedence(int token)
+{
+  switch(token) {
+    case MS_TOKEN_LOGICAL_OR:
+      return MS_EXPR_PREC_OR;
+    case MS_TOKEN_LOGICAL_AND:
+      return MS_EXPR_PREC_AND;
+    case MS_TOKEN_COMPARISON_EQ:
+    case MS_TOKEN_COMPARISON_NE:
+    case MS_TOKEN_COMPARISON_GT:
+    case MS_TOKEN_COMPARISON_LT:
+    case MS_TOKEN_COMPARISON_LE:
+    case MS_TOKEN_COMPARISON_GE:
+    case MS_TOKEN_COMPARISON_IEQ:
+    case MS_TOKEN_COMPARISON_RE:
+    case MS_TOKEN_COMPARISON_IRE:
+    case MS_TOKEN_COMPARISON_IN:
+      return MS_EXPR_PREC_COMPARISON;
+    case '+':
+    case '-':
+      return MS_EXPR_PREC_ADD;
+    case '*':
+    case '/':
+    case '%':
+      return MS_EXPR_PREC_MUL;
+    case '^':
+      return MS_EXPR_PREC_POW;
+    default:
+      return -1; /* not a binary operator */
+  }
+}
+
+static void emit(expressionCompilerObj *c, int op, int stackchange)
+{
+  expressionProgramObj *program = c->program;
+
+  if(program->numcode == program->maxcode) {
+    program->maxcode = program->maxcode ? program->maxcode * 2 : 16;
+    program->code = (expressionInstructionObj *) msSmallRealloc(program->code, sizeof(expressionInstructionObj) * program->maxcode);
+  }
+  program->code[program->numcode].op = op;
+  program->numcode++;
+
+  c->depth += stackchange;
+  if(c->depth > c->maxdepth) c->maxdepth = c->depth;
+}
+
+#define LAST_ARG(c) ((c)->program->code[(c)->program->numcode-1].arg)
+
+static int expect(expressionCompilerObj *c, int token)
+{
+  if(!c->token || c->token->token != token) return MS_FALSE;
+  c->token = c->token->next;
+  return MS_TRUE;
+}
+
+static int compileExpression(expressionCompilerObj *c, int minprec);
+
+/* compile the operand of a function taking a single string */
+static int compileStringArgument(expressionCompilerObj *c)
+{
+  if(!expect(c, '(')) return MS_FALSE;
+  if(compileExpression(c, 0) != MS_EXPR_TYPE_STRING) return MS_FALSE;
+  return expect(c, ')');
+}
+
+static int compilePrimary(expressionCompilerObj *c)
+{
+  const tokenListNodeObj *token = c->token;
+  int type;
+
+  if(!token) return MS_EXPR_TYPE_UNSUPPORTED;
+  c->token = token->next;
+
+  switch(token->token) {
+    case '(':
+      type = compileExpression(c, 0);
+      if(!expect(c, ')')) return MS_EXPR_TYPE_UNSUPPORTED;
+      return type;
+
+    case MS_TOKEN_LOGICAL_NOT:
+      type = compileExpression(c, MS_EXPR_PREC_NOT + 1);
+      if(type == MS_EXPR_TYPE_MATH)
+        emit(c, MS_EXPR_OP_TOBOOL, 0);
+      else if(type != MS_EXPR_TYPE_LOGICAL)
+        return MS_EXPR_TYPE_UNSUPPORTED;
+      emit(c, MS_EXPR_OP_NOT, 0);
+      return MS_EXPR_TYPE_LOGICAL;
+
+    case '-':
+      /* the parser keeps the value as is for an unary minus, and so do we */
+      type = compileExpression(c, MS_EXPR_PREC_NEG + 1);
+      return (type == MS_EXPR_TYPE_MATH) ? type : MS_EXPR_TYPE_UNSUPPORTED;
+
+    case MS_TOKEN_LITERAL_NUMBER:
+      emit(c, MS_EXPR_OP_NUMBER, 1);
+      LAST_ARG(c).dblval = token->tokenval.dblval;
+      return MS_EXPR_TYPE_MATH;
+    case MS_TOKEN_LITERAL_BOOLEAN:
+      emit(c, MS_EXPR_OP_BOOLEAN, 1);
+      LAST_ARG(c).intval = token->tokenval.dblval;
+      return MS_EXPR_TYPE_LOGICAL;
+    case MS_TOKEN_LITERAL_STRING:
+      emit(c, MS_EXPR_OP_STRING, 1);
+      LAST_ARG(c).strval = token->tokenval.strval;
+      return MS_EXPR_TYPE_STRING;
+
+    case MS_TOKEN_BINDING_DOUBLE:
+    case MS_TOKEN_BINDING_INTEGER:
+      emit(c, MS_EXPR_OP_BIND_NUMBER, 1);
+      LAST_ARG(c).node = token;
+      return MS_EXPR_TYPE_MATH;
+    case MS_TOKEN_BINDING_STRING:
+      emit(c, MS_EXPR_OP_BIND_STRING, 1);
+      LAST_ARG(c).node = token;
+      return MS_EXPR_TYPE_STRING;
+    case MS_TOKEN_BINDING_MAP_CELLSIZE:
+      emit(c, MS_EXPR_OP_MAP_CELLSIZE, 1);
+      return MS_EXPR_TYPE_MATH;
+    case MS_TOKEN_BINDING_DATA_CELLSIZE:
+      emit(c, MS_EXPR_OP_DATA_CELLSIZE, 1);
+      return MS_EXPR_TYPE_MATH;
+
+    case MS_TOKEN_FUNCTION_LENGTH:
+      if(!compileStringArgument(c)) return MS_EXPR_TYPE_UNSUPPORTED;
+      emit(c, MS_EXPR_OP_LENGTH, 0);
+      return MS_EXPR_TYPE_MATH;
+    case MS_TOKEN_FUNCTION_COMMIFY:
+    case MS_TOKEN_FUNCTION_UPPER:
+    case MS_TOKEN_FUNCTION_LOWER:
+    case MS_TOKEN_FUNCTION_INITCAP:
+    case MS_TOKEN_FUNCTION_FIRSTCAP:
+      if(!compileStringArgument(c)) return MS_EXPR_TYPE_UNSUPPORTED;
+      switch(token->token) {
+        case MS_TOKEN_FUNCTION_COMMIFY: emit(c, MS_EXPR_OP_COMMIFY, 0); break;
+        case MS_TOKEN_FUNCTION_UPPER: emit(c, MS_EXPR_OP_UPPER, 0); break;
+        case MS_TOKEN_FUNCTION_LOWER: emit(c, MS_EXPR_OP_LOWER, 0); break;
+        case MS_TOKEN_FUNCTION_INITCAP: emit(c, MS_EXPR_OP_INITCAP, 0); break;
+        default: emit(c, MS_EXPR_OP_FIRSTCAP, 0); break;
+      }
+      return MS_EXPR_TYPE_STRING;
+    case MS_TOKEN_FUNCTION_ROUND:
+    case MS_TOKEN_FUNCTION_TOSTRING:
+      if(!expect(c, '(')) return MS_EXPR_TYPE_UNSUPPORTED;
+      if(compileExpression(c, 0) != MS_EXPR_TYPE_MATH) return MS_EXPR_TYPE_UNSUPPORTED;
+      if(!expect(c, ',')) return MS_EXPR_TYPE_UNSUPPORTED;
+      type = compileExpression(c, 0);
+      if(!expect(c, ')')) return MS_EXPR_TYPE_UNSUPPORTED;
+      if(token->token == MS_TOKEN_FUNCTION_ROUND) {
+        if(type != MS_EXPR_TYPE_MATH) return MS_EXPR_TYPE_UNSUPPORTED;
+        emit(c, MS_EXPR_OP_ROUND, -1);
+        return MS_EXPR_TYPE_MATH;
+      }
+      if(type != MS_EXPR_TYPE_STRING) return MS_EXPR_TYPE_UNSUPPORTED;
+      emit(c, MS_EXPR_OP_TOSTRING, -1);
+      return MS_EXPR_TYPE_STRING;
+
+    case MS_TOKEN_LITERAL_SHAPE:
+      emit(c, MS_EXPR_OP_SHAPE, 1);
+      LAST_ARG(c).shpval = token->tokenval.shpval;
+      return MS_EXPR_TYPE_SHAPE;
+    case MS_TOKEN_BINDING_SHAPE:
+      emit(c, MS_EXPR_OP_BIND_SHAPE, 1);
+      return MS_EXPR_TYPE_SHAPE;
+
+    case MS_TOKEN_FUNCTION_BUFFER:
+    case MS_TOKEN_FUNCTION_SIMPLIFY:
+    case MS_TOKEN_FUNCTION_SIMPLIFYPT:
+    case MS_TOKEN_FUNCTION_GENERALIZE:
+    case MS_TOKEN_FUNCTION_DIFFERENCE:
+      if(!expect(c, '(')) return MS_EXPR_TYPE_UNSUPPORTED;
+      if(compileExpression(c, 0) != MS_EXPR_TYPE_SHAPE) return MS_EXPR_TYPE_UNSUPPORTED;
+      if(!expect(c, ',')) return MS_EXPR_TYPE_UNSUPPORTED;
+      type = compileExpression(c, 0);
+      if(!expect(c, ')')) return MS_EXPR_TYPE_UNSUPPORTED;
+      if(type != ((token->token == MS_TOKEN_FUNCTION_DIFFERENCE) ? MS_EXPR_TYPE_SHAPE : MS_EXPR_TYPE_MATH))
+        return MS_EXPR_TYPE_UNSUPPORTED;
+      switch(token->token) {
+        case MS_TOKEN_FUNCTION_BUFFER: emit(c, MS_EXPR_OP_BUFFER, -1); break;
+        case MS_TOKEN_FUNCTION_SIMPLIFY: emit(c, MS_EXPR_OP_SIMPLIFY, -1); break;
+        case MS_TOKEN_FUNCTION_SIMPLIFYPT: emit(c, MS_EXPR_OP_SIMPLIFYPT, -1); break;
+        case MS_TOKEN_FUNCTION_GENERALIZE: emit(c, MS_EXPR_OP_GENERALIZE, -1); break;
+        default: emit(c, MS_EXPR_OP_DIFFERENCE, -1); break;
+      }
+      return MS_EXPR_TYPE_SHAPE;
+    case MS_TOKEN_FUNCTION_SMOOTHSIA: {
+      int numargs = 1;
+
+      /* smoothsia(shape [, math [, math [, string]]]) */
+      if(!expect(c, '(')) return MS_EXPR_TYPE_UNSUPPORTED;
+      if(compileExpression(c, 0) != MS_EXPR_TYPE_SHAPE) return MS_EXPR_TYPE_UNSUPPORTED;
+      while(numargs < 4 && expect(c, ',')) {
+        type = compileExpression(c, 0);
+        if(type != ((numargs == 3) ? MS_EXPR_TYPE_STRING : MS_EXPR_TYPE_MATH)) return MS_EXPR_TYPE_UNSUPPORTED;
+        numargs++;
+      }
+      if(!expect(c, ')')) return MS_EXPR_TYPE_UNSUPPORTED;
+      emit(c, MS_EXPR_OP_SMOOTHSIA, 1 - numargs);
+      LAST_ARG(c).intval = numargs;
+      return MS_EXPR_TYPE_SHAPE;
+    }
+
+    default:
+      return MS_EXPR_TYPE_UNSUPPORTED; /* time, spatial predicates, javascript... */
+  }
+}
+
+/*
+** Pick the instruction for "left op right", MS_FALSE if the parser has no
+** rule for that combination of types.
+*/
+static int compileBinary(expressionCompilerObj *c, int token, int left, int right, int *type)
+{
+  int op = -1;
+
+  switch(token) {
+    case MS_TOKEN_LOGICAL_AND:
+    case MS_TOKEN_LOGICAL_OR:
+      if((left != MS_EXPR_TYPE_LOGICAL && left != MS_EXPR_TYPE_MATH) ||
+         (right != MS_EXPR_TYPE_LOGICAL && right != MS_EXPR_TYPE_MATH))
+        return MS_FALSE;
+      if(right == MS_EXPR_TYPE_MATH) emit(c, MS_EXPR_OP_TOBOOL, 0);
+      if(left == MS_EXPR_TYPE_MATH) {
+        /* the left value is below the right one, fold both into a logical AND/OR of math values */
+        emit(c, (token == MS_TOKEN_LOGICAL_AND) ? MS_EXPR_OP_AND : MS_EXPR_OP_OR, -1);
+        LAST_ARG(c).intval = MS_TRUE;
+      } else {
+        emit(c, (token == MS_TOKEN_LOGICAL_AND) ? MS_EXPR_OP_AND : MS_EXPR_OP_OR, -1);
+        LAST_ARG(c).intval = MS_FALSE;
+      }
+      *type = MS_EXPR_TYPE_LOGICAL;
+      return MS_TRUE;
+
+    case MS_TOKEN_COMPARISON_EQ:
+      if(left == MS_EXPR_TYPE_LOGICAL && right == MS_EXPR_TYPE_LOGICAL) op = MS_EXPR_OP_EQ_LOGICAL;
+      else if(left == MS_EXPR_TYPE_MATH && right == MS_EXPR_TYPE_MATH) op = MS_EXPR_OP_EQ_MATH;
+      else if(left == MS_EXPR_TYPE_STRING && right == MS_EXPR_TYPE_STRING) op = MS_EXPR_OP_EQ_STRING;
+      break;
+    case MS_TOKEN_COMPARISON_IEQ:
+      if(left == MS_EXPR_TYPE_MATH && right == MS_EXPR_TYPE_MATH) op = MS_EXPR_OP_EQ_MATH;
+      else if(left == MS_EXPR_TYPE_STRING && right == MS_EXPR_TYPE_STRING) op = MS_EXPR_OP_IEQ_STRING;
+      break;
+    case MS_TOKEN_COMPARISON_NE:
+    case MS_TOKEN_COMPARISON_GT:
+    case MS_TOKEN_COMPARISON_LT:
+    case MS_TOKEN_COMPARISON_GE:
+    case MS_TOKEN_COMPARISON_LE:
+      if(left == MS_EXPR_TYPE_MATH && right == MS_EXPR_TYPE_MATH)
+        op = MS_EXPR_OP_NE_MATH + (token - MS_TOKEN_COMPARISON_NE);
+      else if(left == MS_EXPR_TYPE_STRING && right == MS_EXPR_TYPE_STRING)
+        op = MS_EXPR_OP_NE_STRING + (token - MS_TOKEN_COMPARISON_NE);
+      break;
+    case MS_TOKEN_COMPARISON_RE:
+    case MS_TOKEN_COMPARISON_IRE:
+      if(left == MS_EXPR_TYPE_STRING && right == MS_EXPR_TYPE_STRING) {
+        expressionProgramObj *program = c->program;
+        expressionInstructionObj *last = &program->code[program->numcode-1];
+        int flags = MS_REG_EXTENDED|MS_REG_NOSUB|((token == MS_TOKEN_COMPARISON_IRE) ? MS_REG_ICASE : 0);
+
+        if(last->op == MS_EXPR_OP_STRING) {
+          /* constant pattern, compile it once. Invalid ones never match, as in the parser */
+          program->regex = (ms_regex_t *) msSmallRealloc(program->regex, sizeof(ms_regex_t) * (program->numregex + 1));
+          if(ms_regcomp(&program->regex[program->numregex], last->arg.strval, flags) != 0) {
+            last->op = MS_EXPR_OP_RE_COMPILED;
+            last->arg.regex = -1;
+          } else {
+            last->op = MS_EXPR_OP_RE_COMPILED;
+            last->arg.regex = program->numregex++;
+          }
+          c->depth--;
+          *type = MS_EXPR_TYPE_LOGICAL;
+          return MS_TRUE;
+        }
+        op = (token == MS_TOKEN_COMPARISON_IRE) ? MS_EXPR_OP_IRE : MS_EXPR_OP_RE;
+      }
+      break;
+    case MS_TOKEN_COMPARISON_IN:
+      if(right == MS_EXPR_TYPE_STRING) {
+        if(left == MS_EXPR_TYPE_STRING) op = MS_EXPR_OP_IN_STRING;
+        else if(left == MS_EXPR_TYPE_MATH) op = MS_EXPR_OP_IN_MATH;
+      }
+      break;
+    case '+':
+      if(left == MS_EXPR_TYPE_MATH && right == MS_EXPR_TYPE_MATH) {
+        emit(c, MS_EXPR_OP_ADD, -1);
+        *type = MS_EXPR_TYPE_MATH;
+        return MS_TRUE;
+      }
+      if(left == MS_EXPR_TYPE_STRING && right == MS_EXPR_TYPE_STRING) {
+        emit(c, MS_EXPR_OP_CONCAT, -1);
+        *type = MS_EXPR_TYPE_STRING;
+        return MS_TRUE;
+      }
+      return MS_FALSE;
+    case '-':
+    case '*':
+    case '/':
+    case '%':
+    case '^':
+      if(left != MS_EXPR_TYPE_MATH || right != MS_EXPR_TYPE_MATH) return MS_FALSE;
+      switch(token) {
+        case '-': emit(c, MS_EXPR_OP_SUB, -1); break;
+        case '*': emit(c, MS_EXPR_OP_MUL, -1); break;
+        case '/': emit(c, MS_EXPR_OP_DIV, -1); break;
+        case '%': emit(c, MS_EXPR_OP_MOD, -1); break;
+        default: emit(c, MS_EXPR_OP_POW, -1); break;
+      }
+      *type = MS_EXPR_TYPE_MATH;
+      return MS_TRUE;
+  }
+
+  if(op == -1) return MS_FALSE;
+
+  emit(c, op, -1);
+  *type = MS_EXPR_TYPE_LOGICAL;
+  return MS_TRUE;
+}
+
+static int compileExpression(expressionCompilerObj *c, int minprec)
+{
+  int left, right, prec, token;
+
+  left = compilePrimary(c);
+
+  while(left != MS_EXPR_TYPE_UNSUPPORTED && c->token) {
+    token = c->token->token;
+    if(token == IN) token = MS_TOKEN_COMPARISON_IN; /* the lexer hands out the parser token for this one */
+    prec = binaryPrecedence(token);
+    if(prec < minprec || prec == -1) break;
+
+    c->token = c->token->next;
+    right = compileExpression(c, (token == '^') ? prec : prec + 1); /* '^' is right associative */
+    if(right == MS_EXPR_TYPE_UNSUPPORTED || !compileBinary(c, token, left, right, &left))
+      return MS_EXPR_TYPE_UNSUPPORTED;
+  }
+
+  return left;
+}
+
+/* instructions that need anything but borrowed strings and the feature values */
+static int isBatchProgram(const expressionProgramObj *program)
+{
+  int i;
+
+  for(i=0; i<program->numcode; i++) {
+    switch(program->code[i].op) {
+      case MS_EXPR_OP_MAP_CELLSIZE:
+      case MS_EXPR_OP_DATA_CELLSIZE:
+      case MS_EXPR_OP_RE:
+      case MS_EXPR_OP_IRE:
+      case MS_EXPR_OP_CONCAT:
+      case MS_EXPR_OP_TOSTRING:
+      case MS_EXPR_OP_COMMIFY:
+      case MS_EXPR_OP_UPPER:
+      case MS_EXPR_OP_LOWER:
+      case MS_EXPR_OP_INITCAP:
+      case MS_EXPR_OP_FIRSTCAP:
+        return MS_FALSE;
+    }
+  }
+  return (program->resulttype != MS_EXPR_TYPE_SHAPE);
+}
+
+void msFreeExpressionProgram(expressionProgramObj *program)
+{
+  int i;
+
+  if(!program) return;
+  for(i=0; i<program->numregex; i++)
+    ms_regfree(&program->regex[i]);
+  free(program->regex);
+  free(program->literals);
+  free(program->code);
+  free(program);
+}
+
+static int isBindingToken(int token)
+{
+  return (token == MS_TOKEN_BINDING_DOUBLE || token == MS_TOKEN_BINDING_INTEGER || token == MS_TOKEN_BINDING_STRING || token == MS_TOKEN_BINDING_TIME);
+}
+
+/*
+** Text (MS_STRING) expressions such as "[name] ([ref])" are compiled into a
+** template, a list of literal parts and item references, so that
+** msEvalTextTemplate() can produce the text in one allocation.
+*/
+static expressionProgramObj *compileTextTemplate(expressionObj *expression)
+{
+  expressionCompilerObj c;
+  const char *src = expression->string;
+  char *literal;
+
+  c.program = (expressionProgramObj *) msSmallCalloc(1, sizeof(expressionProgramObj));
+  c.depth = c.maxdepth = 0;
+  c.program->resulttype = MS_EXPR_TYPE_TEMPLATE;
+  c.program->literals = literal = (char *) msSmallMalloc(2 * strlen(src) + 1); /* parts are separated by a \0 */
+  literal[0] = '\0';
+
+  while(*src) {
+    const tokenListNodeObj *node = NULL;
+
+    if(*src == '[') {
+      for(node=expression->tokens; node; node=node->next) {
+        size_t length;
+
+        if(!isBindingToken(node->token)) continue;
+        length = strlen(node->tokenval.bindval.item);
+        if(strncmp(src + 1, node->tokenval.bindval.item, length) == 0 && src[length + 1] == ']') {
+          src += length + 2;
+          break;
+        }
+      }
+    }
+
+    if(node) {
+      if(*literal) { /* close the literal part */
+        emit(&c, MS_EXPR_OP_STRING, 0);
+        LAST_ARG(&c).strval = literal;
+        literal += strlen(literal) + 1;
+        literal[0] = '\0';
+      }
+      emit(&c, MS_EXPR_OP_BIND_STRING, 0);
+      LAST_ARG(&c).node = node;
+    } else {
+      size_t length = strlen(literal);
+      literal[length] = *src++;
+      literal[length+1] = '\0';
+    }
+  }
+  if(*literal) {
+    emit(&c, MS_EXPR_OP_STRING, 0);
+    LAST_ARG(&c).strval = literal;
+  }
+
+  return c.program;
+}
+
+/*
+** Render the template of a text expression (see msCompileExpression()) for
+** shape, item values are JSON escaped if bJSonEscape is set. Returns a new
+** string, NULL if the text is empty.
+*/
+char *msEvalTextTemplate(expressionObj *expression, shapeObj *shape, int bJSonEscape)
+{
+  const expressionProgramObj *program = expression->program;
+  char *buffer[16], **values = buffer, *result, *p;
+  size_t length = 0;
+  int i;
+
+  if(program->numcode > 16)
+    values = (char **) msSmallMalloc(sizeof(char *) * program->numcode);
+
+  for(i=0; i<program->numcode; i++) {
+    const expressionInstructionObj *ins = &program->code[i];
+
+    if(ins->op == MS_EXPR_OP_STRING)
+      values[i] = (char *) ins->arg.strval;
+    else if(bJSonEscape)
+      values[i] = msEscapeJSonString(shape->values[ins->arg.node->tokenval.bindval.index]);
+    else
+      values[i] = shape->values[ins->arg.node->tokenval.bindval.index];
+    length += strlen(values[i]);
+  }
+
+  result = NULL;
+  if(length > 0) {
+    p = result = (char *) msSmallMalloc(length + 1);
+    for(i=0; i<program->numcode; i++) {
+      size_t n = strlen(values[i]);
+      memcpy(p, values[i], n);
+      p += n;
+    }
+    *p = '\0';
+  }
+
+  if(bJSonEscape) {
+    for(i=0; i<program->numcode; i++)
+      if(program->code[i].op == MS_EXPR_OP_BIND_STRING) free(values[i]);
+  }
+  if(values != buffer) free(values);
+
+  return result;
+}
+
+/*
+** Compile the tokens of expression (see msTokenizeExpression()). Leaves
+** expression->program NULL if the expression has to be evaluated by yyparse().
+** Text expressions get a template instead (see msEvalTextTemplate()).
+*/
+void msCompileExpression(expressionObj *expression)
+{
+  expressionCompilerObj c;
+
+  msFreeExpressionProgram(expression->program);
+  expression->program = NULL;
+
+  if(!expression->tokens) return;
+
+  if(expression->type == MS_STRING) {
+    if(expression->string) expression->program = compileTextTemplate(expression);
+    return;
+  }
+
+  c.token = expression->tokens;
+  c.program = (expressionProgramObj *) msSmallCalloc(1, sizeof(expressionProgramObj));
+  c.depth = c.maxdepth = 0;
+
+  c.program->resulttype = compileExpression(&c, 0);
+  if(c.program->resulttype == MS_EXPR_TYPE_UNSUPPORTED || c.token != NULL) {
+    msFreeExpressionProgram(c.program);
+    return;
+  }
+
+  c.program->maxstack = c.maxdepth;
+  c.program->batch = isBatchProgram(c.program);
+  expression->program = c.program;
+}
+
+typedef struct {
+  double dblval;
+  int intval;
+  char *strval;
+  int owned; /* strval has to be freed */
+  shapeObj *shpval;
+  int shpowned; /* shpval is an intermediate result, freed once used */
+} expressionValueObj;
+
+static void setString(expressionValueObj *v, char *s, int owned)
+{
+  v->strval = s;
+  v->owned = owned;
+}
+
+static void freeString(expressionValueObj *v)
+{
+  if(v->owned) free(v->strval);
+  v->strval = NULL;
+  v->owned = MS_FALSE;
+}
+
+/* make sure the string of v can be modified in place */
+static void ownString(expressionValueObj *v)
+{
+  if(!v->owned) setString(v, msStrdup(v->strval), MS_TRUE);
+}
+
+static void setShape(expressionValueObj *v, shapeObj *shape, int owned)
+{
+  v->shpval = shape;
+  v->shpowned = owned;
+}
+
+static void freeShape(expressionValueObj *v)
+{
+  if(v->shpowned) {
+    msFreeShape(v->shpval);
+    free(v->shpval);
+  }
+  v->shpval = NULL;
+  v->shpowned = MS_FALSE;
+}
+
+/* same matching as the IN rules of mapparser.y */
+static int inList(expressionValueObj *value, const char *list, int isMath)
+{
+  const char *start = list, *end;
+
+  while(1) {
+    end = strchr(start, ',');
+    if(isMath) {
+      if(value->dblval == atof(start)) return MS_TRUE;
+    } else {
+      size_t len = end ? (size_t)(end - start) : strlen(start);
+      if(strlen(value->strval) == len && strncmp(value->strval, start, len) == 0) return MS_TRUE;
+    }
+    if(!end) return MS_FALSE;
+    start = end + 1;
+  }
+}
+
+/*
+** Run the program of p->expr for p->shape. Same return value as yyparse()
+** and the result is stored the same way in p->result.
+*/
+static int runExpressionProgram(parseObj *p)
+{
+  const expressionProgramObj *program = p->expr->program;
+  expressionValueObj stackbuf[16], *stack = stackbuf, *top;
+  int i, status = 0;
+
+  if(program->maxstack > 16)
+    stack = (expressionValueObj *) msSmallMalloc(sizeof(expressionValueObj) * program->maxstack);
+  for(i=0; i<program->maxstack; i++)
+    stack[i].owned = stack[i].shpowned = MS_FALSE; /* so that the stack can be cleaned up after an error */
+  top = stack - 1;
+
+  for(i=0; i<program->numcode; i++) {
+    const expressionInstructionObj *ins = &program->code[i];
+
+    switch(ins->op) {
+      case MS_EXPR_OP_NUMBER:
+        (++top)->dblval = ins->arg.dblval;
+        break;
+      case MS_EXPR_OP_BOOLEAN:
+        (++top)->intval = ins->arg.intval;
+        break;
+      case MS_EXPR_OP_STRING:
+        setString(++top, (char *) ins->arg.strval, MS_FALSE);
+        break;
+      case MS_EXPR_OP_BIND_NUMBER:
+        (++top)->dblval = atof(p->shape->values[ins->arg.node->tokenval.bindval.index]);
+        break;
+      case MS_EXPR_OP_BIND_STRING:
+        setString(++top, p->shape->values[ins->arg.node->tokenval.bindval.index], MS_FALSE);
+        break;
+      case MS_EXPR_OP_MAP_CELLSIZE:
+        (++top)->dblval = p->dblval;
+        break;
+      case MS_EXPR_OP_DATA_CELLSIZE:
+        (++top)->dblval = p->dblval2;
+        break;
+
+      case MS_EXPR_OP_TOBOOL:
+        top->intval = (top->dblval != 0) ? MS_TRUE : MS_FALSE;
+        break;
+      case MS_EXPR_OP_AND:
+        top--;
+        top->intval = ((ins->arg.intval ? (top->dblval != 0) : (top->intval == MS_TRUE)) && top[1].intval == MS_TRUE) ? MS_TRUE : MS_FALSE;
+        break;
+      case MS_EXPR_OP_OR:
+        top--;
+        top->intval = ((ins->arg.intval ? (top->dblval != 0) : (top->intval == MS_TRUE)) || top[1].intval == MS_TRUE) ? MS_TRUE : MS_FALSE;
+        break;
+      case MS_EXPR_OP_NOT:
+        top->intval = !top->intval;
+        break;
+      case MS_EXPR_OP_EQ_LOGICAL:
+        top--;
+        top->intval = (top->intval == top[1].intval) ? MS_TRUE : MS_FALSE;
+        break;
+
+      case MS_EXPR_OP_EQ_MATH:
+        top--;
+        top->intval = (top->dblval == top[1].dblval) ? MS_TRUE : MS_FALSE;
+        break;
+      case MS_EXPR_OP_NE_MATH:
+        top--;
+        top->intval = (top->dblval != top[1].dblval) ? MS_TRUE : MS_FALSE;
+        break;
+      case MS_EXPR_OP_GT_MATH:
+        top--;
+        top->intval = (top->dblval > top[1].dblval) ? MS_TRUE : MS_FALSE;
+        break;
+      case MS_EXPR_OP_LT_MATH:
+        top--;
+        top->intval = (top->dblval < top[1].dblval) ? MS_TRUE : MS_FALSE;
+        break;
+      case MS_EXPR_OP_GE_MATH:
+        top--;
+        top->intval = (top->dblval >= top[1].dblval) ? MS_TRUE : MS_FALSE;
+        break;
+      case MS_EXPR_OP_LE_MATH:
+        top--;
+        top->intval = (top->dblval <= top[1].dblval) ? MS_TRUE : MS_FALSE;
+        break;
+
+      case MS_EXPR_OP_EQ_STRING:
+      case MS_EXPR_OP_NE_STRING:
+      case MS_EXPR_OP_GT_STRING:
+      case MS_EXPR_OP_LT_STRING:
+      case MS_EXPR_OP_GE_STRING:
+      case MS_EXPR_OP_LE_STRING:
+      case MS_EXPR_OP_IEQ_STRING: {
+        int cmp, result;
+
+        top--;
+        if(ins->op == MS_EXPR_OP_IEQ_STRING)
+          cmp = strcasecmp(top->strval, top[1].strval);
+        else
+          cmp = strcmp(top->strval, top[1].strval);
+        switch(ins->op) {
+          case MS_EXPR_OP_NE_STRING: result = (cmp != 0); break;
+          case MS_EXPR_OP_GT_STRING: result = (cmp > 0); break;
+          case MS_EXPR_OP_LT_STRING: result = (cmp < 0); break;
+          case MS_EXPR_OP_GE_STRING: result = (cmp >= 0); break;
+          case MS_EXPR_OP_LE_STRING: result = (cmp <= 0); break;
+          default: result = (cmp == 0); break;
+        }
+        freeString(top);
+        freeString(top+1);
+        top->intval = result ? MS_TRUE : MS_FALSE;
+        break;
+      }
+
+      case MS_EXPR_OP_RE:
+      case MS_EXPR_OP_IRE: {
+        ms_regex_t re;
+        int result = MS_FALSE;
+
+        top--;
+        if(MS_STRING_IS_NULL_OR_EMPTY(top->strval) == MS_FALSE &&
+           ms_regcomp(&re, top[1].strval, MS_REG_EXTENDED|MS_REG_NOSUB|((ins->op == MS_EXPR_OP_IRE) ? MS_REG_ICASE : 0)) == 0) {
+          if(ms_regexec(&re, top->strval, 0, NULL, 0) == 0) result = MS_TRUE;
+          ms_regfree(&re);
+        }
+        freeString(top);
+        freeString(top+1);
+        top->intval = result;
+        break;
+      }
+      case MS_EXPR_OP_RE_COMPILED: {
+        int result = MS_FALSE;
+
+        if(ins->arg.regex != -1 && MS_STRING_IS_NULL_OR_EMPTY(top->strval) == MS_FALSE &&
+           ms_regexec(&program->regex[ins->arg.regex], top->strval, 0, NULL, 0) == 0)
+          result = MS_TRUE;
+        freeString(top);
+        top->intval = result;
+        break;
+      }
+      case MS_EXPR_OP_IN_STRING:
+      case MS_EXPR_OP_IN_MATH: {
+        int result;
+
+        top--;
+        result = inList(top, top[1].strval, ins->op == MS_EXPR_OP_IN_MATH);
+        if(ins->op == MS_EXPR_OP_IN_STRING) freeString(top);
+        freeString(top+1);
+        top->intval = result;
+        break;
+      }
+
+      case MS_EXPR_OP_ADD:
+        top--;
+        top->dblval += top[1].dblval;
+        break;
+      case MS_EXPR_OP_SUB:
+        top--;
+        top->dblval -= top[1].dblval;
+        break;
+      case MS_EXPR_OP_MUL:
+        top--;
+        top->dblval *= top[1].dblval;
+        break;
+      case MS_EXPR_OP_DIV:
+        top--;
+        if(top[1].dblval == 0.0) {
+          msSetError(MS_PARSEERR, "Division by zero.", "msEvalParsedExpression()");
+          status = -1;
+          goto done;
+        }
+        top->dblval /= top[1].dblval;
+        break;
+      case MS_EXPR_OP_MOD:
+        top--;
+        if((int)top[1].dblval == 0) {
+          msSetError(MS_PARSEERR, "Division by zero.", "msEvalParsedExpression()");
+          status = -1;
+          goto done;
+        }
+        top->dblval = (int)top->dblval % (int)top[1].dblval;
+        break;
+      case MS_EXPR_OP_POW:
+        top--;
+        top->dblval = pow(top->dblval, top[1].dblval);
+        break;
+
+      case MS_EXPR_OP_CONCAT: {
+        char *s;
+
+        top--;
+        s = (char *) msSmallMalloc(strlen(top->strval) + strlen(top[1].strval) + 1);
+        sprintf(s, "%s%s", top->strval, top[1].strval);
+        freeString(top);
+        freeString(top+1);
+        setString(top, s, MS_TRUE);
+        break;
+      }
+      case MS_EXPR_OP_LENGTH: {
+        double length = strlen(top->strval);
+        freeString(top);
+        top->dblval = length;
+        break;
+      }
+      case MS_EXPR_OP_ROUND:
+        top--;
+        top->dblval = (MS_NINT(top->dblval/top[1].dblval))*top[1].dblval;
+        break;
+      case MS_EXPR_OP_TOSTRING: {
+        char *s;
+
+        top--;
+        s = (char *) msSmallMalloc(strlen(top[1].strval) + 64); /* same buffer as the parser */
+        sprintf(s, top[1].strval, top->dblval);
+        freeString(top+1);
+        setString(top, s, MS_TRUE);
+        break;
+      }
+      case MS_EXPR_OP_COMMIFY:
+        ownString(top);
+        top->strval = msCommifyString(top->strval);
+        break;
+      case MS_EXPR_OP_UPPER:
+        ownString(top);
+        msStringToUpper(top->strval);
+        break;
+      case MS_EXPR_OP_LOWER:
+        ownString(top);
+        msStringToLower(top->strval);
+        break;
+      case MS_EXPR_OP_INITCAP:
+        ownString(top);
+        msStringInitCap(top->strval);
+        break;
+      case MS_EXPR_OP_FIRSTCAP:
+        ownString(top);
+        msStringFirstCap(top->strval);
+        break;
+
+      case MS_EXPR_OP_SHAPE:
+        setShape(++top, ins->arg.shpval, MS_FALSE);
+        break;
+      case MS_EXPR_OP_BIND_SHAPE:
+        setShape(++top, p->shape, MS_FALSE);
+        break;
+      case MS_EXPR_OP_BUFFER:
+      case MS_EXPR_OP_SIMPLIFY:
+      case MS_EXPR_OP_SIMPLIFYPT:
+      case MS_EXPR_OP_GENERALIZE:
+      case MS_EXPR_OP_DIFFERENCE: {
+        shapeObj *s;
+        const char *name;
+
+        top--;
+        switch(ins->op) {
+          case MS_EXPR_OP_BUFFER: s = msGEOSBuffer(top->shpval, top[1].dblval); name = "buffer"; break;
+          case MS_EXPR_OP_SIMPLIFY: s = msGEOSSimplify(top->shpval, top[1].dblval); name = "simplify"; break;
+          case MS_EXPR_OP_SIMPLIFYPT: s = msGEOSTopologyPreservingSimplify(top->shpval, top[1].dblval); name = "simplifypt"; break;
+          case MS_EXPR_OP_GENERALIZE: s = msGeneralize(top->shpval, top[1].dblval); name = "generalize"; break;
+          default:
+            s = msGEOSDifference(top->shpval, top[1].shpval); name = "difference";
+            freeShape(top+1);
+            break;
+        }
+        freeShape(top); /* intermediate results are not needed any more */
+        if(!s) {
+          msSetError(MS_PARSEERR, "Executing %s failed.", "msEvalParsedExpression()", name);
+          status = -1;
+          goto done;
+        }
+        setShape(top, s, MS_TRUE);
+        break;
+      }
+      case MS_EXPR_OP_SMOOTHSIA: {
+        shapeObj *s;
+        int n = ins->arg.intval;
+
+        top -= n - 1;
+        s = msSmoothShapeSIA(top->shpval, (n > 1) ? (int) top[1].dblval : 3, (n > 2) ? (int) top[2].dblval : 1, (n > 3) ? top[3].strval : NULL);
+        if(n > 3) freeString(top+3);
+        freeShape(top);
+        if(!s) {
+          msSetError(MS_PARSEERR, "Executing smoothsia failed.", "msEvalParsedExpression()");
+          status = -1;
+          goto done;
+        }
+        setShape(top, s, MS_TRUE);
+        break;
+      }
+    }
+  }
+
+  switch(program->resulttype) {
+    case MS_EXPR_TYPE_LOGICAL:
+      if(p->type == MS_PARSE_TYPE_BOOLEAN)
+        p->result.intval = top->intval;
+      else if(p->type == MS_PARSE_TYPE_STRING)
+        p->result.strval = msStrdup(top->intval ? "true" : "false");
+      break;
+    case MS_EXPR_TYPE_MATH:
+      if(p->type == MS_PARSE_TYPE_BOOLEAN)
+        p->result.intval = (top->dblval != 0) ? MS_TRUE : MS_FALSE;
+      else if(p->type == MS_PARSE_TYPE_STRING) {
+        p->result.strval = (char *) msSmallMalloc(64); /* large enough for a double */
+        snprintf(p->result.strval, 64, "%g", top->dblval);
+      }
+      break;
+    case MS_EXPR_TYPE_STRING:
+      if(p->type == MS_PARSE_TYPE_BOOLEAN)
+        p->result.intval = MS_TRUE; /* string is not NULL */
+      else if(p->type == MS_PARSE_TYPE_STRING) {
+        ownString(top);
+        p->result.strval = top->strval;
+        top->owned = MS_FALSE;
+      }
+      freeString(top);
+      break;
+    case MS_EXPR_TYPE_SHAPE:
+      p->result.shpval = top->shpval; /* handed over to the caller */
+      p->result.shpval->scratch = MS_FALSE;
+      top->shpowned = MS_FALSE;
+      break;
+  }
+  top--;
+
+done:
+  /* only reached with values left on the stack after an error */
+  for(; top >= stack; top--) {
+    if(top->owned) free(top->strval);
+    freeShape(top);
+  }
+  if(stack != stackbuf) free(stack);
+
+  return status;
+}
+
+/*
+** Evaluate an expression for the values in p (see parseObj) with its compiled
+** program if there is one, with yyparse() otherwise. Returns 0 on success,
+** like yyparse().
+*/
+int msEvalParsedExpression(parseObj *p)
+{
+  const expressionProgramObj *program = p->expr->program;
+
+  if(program && program->resulttype != MS_EXPR_TYPE_TEMPLATE &&
+     (program->resulttype == MS_EXPR_TYPE_SHAPE) == (p->type == MS_PARSE_TYPE_SHAPE))
+    return runExpressionProgram(p);
+
+  p->expr->curtoken = p->expr->tokens; /* reset */
+  return yyparse(p);
+}
+
+/*
+** Batch evaluation: a program is run for a set of features at once, each
+** instruction working on a column of values (one per feature) rather than
+** on a single value. The loops over the columns are simple enough for the
+** compiler to vectorize, and numeric attribute values are converted once
+** per batch and item no matter how many expressions use them.
+*/
+
+void msInitExpressionBatch(expressionBatchObj *batch, shapeObj *shapes, int numshapes)
+{
+  batch->shapes = shapes;
+  batch->numshapes = numshapes;
+  batch->numbers = NULL;
+  batch->numitems = 0;
+}
+
+void msFreeExpressionBatch(expressionBatchObj *batch)
+{
+  int i;
+
+  for(i=0; i<batch->numitems; i++)
+    free(batch->numbers[i]);
+  free(batch->numbers);
+  batch->numbers = NULL;
+  batch->numitems = 0;
+}
+
+/* numeric values of item index for every feature of the batch */
+static const double *getBatchNumbers(expressionBatchObj *batch, int index)
+{
+  int i;
+
+  if(index >= batch->numitems) {
+    batch->numbers = (double **) msSmallRealloc(batch->numbers, sizeof(double *) * (index + 1));
+    for(i=batch->numitems; i<=index; i++) batch->numbers[i] = NULL;
+    batch->numitems = index + 1;
+  }
+
+  if(!batch->numbers[index]) {
+    batch->numbers[index] = (double *) msSmallMalloc(sizeof(double) * batch->numshapes);
+    for(i=0; i<batch->numshapes; i++)
+      batch->numbers[index][i] = atof(batch->shapes[i].values[index]);
+  }
+
+  return batch->numbers[index];
+}
+
+/*
+** Evaluate expression for the features batch->shapes[lanes[0..numlanes-1]],
+** results[i] is the boolean result for lanes[i]. Returns MS_FAILURE, without
+** an error, if the expression can't be evaluated that way (see msEvalExpression()).
+*/
+int msEvalExpressionBatch(expressionBatchObj *batch, expressionObj *expression, const int *lanes, int numlanes, int *results)
+{
+  const expressionProgramObj *program = expression->program;
+  double *dbl;
+  int *intval;
+  const char **strval;
+  int i, k, top = -1, status = MS_SUCCESS;
+
+  if(!program || !program->batch || program->resulttype == MS_EXPR_TYPE_TEMPLATE) return MS_FAILURE;
+  if(numlanes == 0) return MS_SUCCESS;
+
+  /* one column of each kind for every stack slot */
+  dbl = (double *) msSmallMalloc(sizeof(double) * program->maxstack * numlanes);
+  intval = (int *) msSmallMalloc(sizeof(int) * program->maxstack * numlanes);
+  strval = (const char **) msSmallMalloc(sizeof(char *) * program->maxstack * numlanes);
+
+#define D(n) (dbl + (n)*numlanes)
+#define I(n) (intval + (n)*numlanes)
+#define S(n) (strval + (n)*numlanes)
+
+  for(i=0; i<program->numcode && status == MS_SUCCESS; i++) {
+    const expressionInstructionObj *ins = &program->code[i];
+    double *d0, *d1;
+    int *i0, *i1;
+    const char **s0, **s1;
+
+    /* d0/i0/s0 is the column under the top one, d1/i1/s1 the top one */
+    switch(ins->op) {
+      case MS_EXPR_OP_NUMBER:
+      case MS_EXPR_OP_BOOLEAN:
+      case MS_EXPR_OP_STRING:
+      case MS_EXPR_OP_BIND_NUMBER:
+      case MS_EXPR_OP_BIND_STRING:
+        top++;
+        break;
+    }
+    d1 = D(top); i1 = I(top); s1 = S(top);
+    d0 = NULL; i0 = NULL; s0 = NULL;
+    if(top > 0) {
+      d0 = D(top-1); i0 = I(top-1); s0 = S(top-1);
+    }
+
+    switch(ins->op) {
+      case MS_EXPR_OP_NUMBER:
+        for(k=0; k<numlanes; k++) d1[k] = ins->arg.dblval;
+        break;
+      case MS_EXPR_OP_BOOLEAN:
+        for(k=0; k<numlanes; k++) i1[k] = ins->arg.intval;
+        break;
+      case MS_EXPR_OP_STRING:
+        for(k=0; k<numlanes; k++) s1[k] = ins->arg.strval;
+        break;
+      case MS_EXPR_OP_BIND_NUMBER: {
+        const double *numbers = getBatchNumbers(batch, ins->arg.node->tokenval.bindval.index);
+        for(k=0; k<numlanes; k++) d1[k] = numbers[lanes[k]];
+        break;
+      }
+      case MS_EXPR_OP_BIND_STRING:
+        for(k=0; k<numlanes; k++) s1[k] = batch->shapes[lanes[k]].values[ins->arg.node->tokenval.bindval.index];
+        break;
+
+      case MS_EXPR_OP_TOBOOL:
+        for(k=0; k<numlanes; k++) i1[k] = (d1[k] != 0);
+        break;
+      case MS_EXPR_OP_AND:
+        if(ins->arg.intval)
+          for(k=0; k<numlanes; k++) i0[k] = (d0[k] != 0 && i1[k] == MS_TRUE);
+        else
+          for(k=0; k<numlanes; k++) i0[k] = (i0[k] == MS_TRUE && i1[k] == MS_TRUE);
+        top--;
+        break;
+      case MS_EXPR_OP_OR:
+        if(ins->arg.intval)
+          for(k=0; k<numlanes; k++) i0[k] = (d0[k] != 0 || i1[k] == MS_TRUE);
+        else
+          for(k=0; k<numlanes; k++) i0[k] = (i0[k] == MS_TRUE || i1[k] == MS_TRUE);
+        top--;
+        break;
+      case MS_EXPR_OP_NOT:
+        for(k=0; k<numlanes; k++) i1[k] = !i1[k];
+        break;
+      case MS_EXPR_OP_EQ_LOGICAL:
+        for(k=0; k<numlanes; k++) i0[k] = (i0[k] == i1[k]);
+        top--;
+        break;
+
+      case MS_EXPR_OP_EQ_MATH:
+        for(k=0; k<numlanes; k++) i0[k] = (d0[k] == d1[k]);
+        top--;
+        break;
+      case MS_EXPR_OP_NE_MATH:
+        for(k=0; k<numlanes; k++) i0[k] = (d0[k] != d1[k]);
+        top--;
+        break;
+      case MS_EXPR_OP_GT_MATH:
+        for(k=0; k<numlanes; k++) i0[k] = (d0[k] > d1[k]);
+        top--;
+        break;
+      case MS_EXPR_OP_LT_MATH:
+        for(k=0; k<numlanes; k++) i0[k] = (d0[k] < d1[k]);
+        top--;
+        break;
+      case MS_EXPR_OP_GE_MATH:
+        for(k=0; k<numlanes; k++) i0[k] = (d0[k] >= d1[k]);
+        top--;
+        break;
+      case MS_EXPR_OP_LE_MATH:
+        for(k=0; k<numlanes; k++) i0[k] = (d0[k] <= d1[k]);
+        top--;
+        break;
+
+      case MS_EXPR_OP_EQ_STRING:
+        for(k=0; k<numlanes; k++) i0[k] = (strcmp(s0[k], s1[k]) == 0);
+        top--;
+        break;
+      case MS_EXPR_OP_NE_STRING:
+        for(k=0; k<numlanes; k++) i0[k] = (strcmp(s0[k], s1[k]) != 0);
+        top--;
+        break;
+      case MS_EXPR_OP_GT_STRING:
+        for(k=0; k<numlanes; k++) i0[k] = (strcmp(s0[k], s1[k]) > 0);
+        top--;
+        break;
+      case MS_EXPR_OP_LT_STRING:
+        for(k=0; k<numlanes; k++) i0[k] = (strcmp(s0[k], s1[k]) < 0);
+        top--;
+        break;
+      case MS_EXPR_OP_GE_STRING:
+        for(k=0; k<numlanes; k++) i0[k] = (strcmp(s0[k], s1[k]) >= 0);
+        top--;
+        break;
+      case MS_EXPR_OP_LE_STRING:
+        for(k=0; k<numlanes; k++) i0[k] = (strcmp(s0[k], s1[k]) <= 0);
+        top--;
+        break;
+      case MS_EXPR_OP_IEQ_STRING:
+        for(k=0; k<numlanes; k++) i0[k] = (strcasecmp(s0[k], s1[k]) == 0);
+        top--;
+        break;
+      case MS_EXPR_OP_RE_COMPILED:
+        for(k=0; k<numlanes; k++)
+          i1[k] = (ins->arg.regex != -1 && MS_STRING_IS_NULL_OR_EMPTY(s1[k]) == MS_FALSE &&
+                   ms_regexec(&program->regex[ins->arg.regex], s1[k], 0, NULL, 0) == 0);
+        break;
+      case MS_EXPR_OP_IN_STRING:
+      case MS_EXPR_OP_IN_MATH:
+        for(k=0; k<numlanes; k++) {
+          expressionValueObj v;
+          v.dblval = d0[k];
+          v.strval = (char *) s0[k];
+          i0[k] = inList(&v, s1[k], ins->op == MS_EXPR_OP_IN_MATH);
+        }
+        top--;
+        break;
+
+      case MS_EXPR_OP_ADD:
+        for(k=0; k<numlanes; k++) d0[k] += d1[k];
+        top--;
+        break;
+      case MS_EXPR_OP_SUB:
+        for(k=0; k<numlanes; k++) d0[k] -= d1[k];
+        top--;
+        break;
+      case MS_EXPR_OP_MUL:
+        for(k=0; k<numlanes; k++) d0[k] *= d1[k];
+        top--;
+        break;
+      case MS_EXPR_OP_DIV:
+      case MS_EXPR_OP_MOD:
+        for(k=0; k<numlanes; k++) {
+          if((ins->op == MS_EXPR_OP_DIV) ? (d1[k] == 0.0) : ((int)d1[k] == 0)) {
+            status = MS_FAILURE; /* left to msEvalExpression() to report */
+            break;
+          }
+          d0[k] = (ins->op == MS_EXPR_OP_DIV) ? (d0[k] / d1[k]) : ((int)d0[k] % (int)d1[k]);
+        }
+        top--;
+        break;
+      case MS_EXPR_OP_POW:
+        for(k=0; k<numlanes; k++) d0[k] = pow(d0[k], d1[k]);
+        top--;
+        break;
+
+      case MS_EXPR_OP_LENGTH:
+        for(k=0; k<numlanes; k++) d1[k] = strlen(s1[k]);
+        break;
+      case MS_EXPR_OP_ROUND:
+        for(k=0; k<numlanes; k++) d0[k] = (MS_NINT(d0[k]/d1[k]))*d1[k];
+        top--;
+        break;
+
+      default:
+        status = MS_FAILURE; /* not a batch program */
+        break;
+    }
+  }
+
+  if(status == MS_SUCCESS) {
+    switch(program->resulttype) {
+      case MS_EXPR_TYPE_LOGICAL:
+        for(k=0; k<numlanes; k++) results[k] = I(0)[k];
+        break;
+      case MS_EXPR_TYPE_MATH:
+        for(k=0; k<numlanes; k++) results[k] = (D(0)[k] != 0) ? MS_TRUE : MS_FALSE;
+        break;
+      default:
+        for(k=0; k<numlanes; k++) results[k] = MS_TRUE;
+        break;
+    }
+  }
+
+#undef D
+#undef I
+#undef S
+
+  free(dbl);
+  free(intval);
+  free(strval);
+
+  return status;
+}
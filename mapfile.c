@@ -35,6 +35,7 @@
 #include <assert.h>
 #include <ctype.h>
 #include <float.h>
+#include <sys/stat.h>
 
 #include "mapserver.h"
 #include "mapfile.h"
@@ -63,6 +64,7 @@ extern char *msyybasepath;
 extern int msyyreturncomments;
 extern char *msyystring_buffer;
 extern int msyystring_icase;
+extern mapTokenStreamObj *msyytokens;
 
 extern int loadSymbol(symbolObj *s, char *symbolpath); /* in mapsymbol.c */
 extern void writeSymbol(symbolObj *s, FILE *stream); /* in mapsymbol.c */
@@ -338,6 +340,10 @@ int msGetSymbolIndex(symbolSetObj *symbols, char *name, int try_addimage_if_notf
 
   if(!symbols || !name) return(-1);
 
+  /* symbols copied from a cached symbol file, see loadSymbolSet() */
+  i = msSymbolFileLookup(symbols, name);
+  if(i > 0) return(i);
+
   /* symbol 0 has no name */
   for(i=1; i<symbols->numsymbols; i++) {
     if(symbols->symbol[i]->name)
@@ -355,17 +361,9 @@ int msGetSymbolIndex(symbolSetObj *symbols, char *name, int try_addimage_if_notf
 */
 int msGetLayerIndex(mapObj *map, const char *name)
 {
-  int i;
-
   if(!name) return(-1);
 
-  for(i=0; i<map->numlayers; i++) {
-    if(!GET_LAYER(map, i)->name) /* skip it */
-      continue;
-    if(strcmp(name, GET_LAYER(map, i)->name) == 0)
-      return(i);
-  }
-  return(-1);
+  return msLayerNameIndexNext(map, name, MS_FALSE, -1); /* hashed, see mapobject.c */
 }
 
 static
@@ -1042,6 +1040,7 @@ void freeGrid( graticuleObj *pGraticule )
   msFree(pGraticule->labelformat);
   msFree(pGraticule->pboundingpoints);
   msFree(pGraticule->pboundinglines);
+  msGraticuleReleaseArcs(pGraticule->parcs);
 }
 
 static int loadGrid( layerObj *pLayer )
@@ -1121,6 +1120,8 @@ int msInitProjection(projectionObj *p)
   p->wellknownprojection = wkp_none;
 #ifdef USE_PROJ
   p->proj = NULL;
+  p->proj_thread = NULL;
+  p->proj_serial = 0;
   p->args = (char **)malloc(MS_MAXPROJARGS*sizeof(char *));
   MS_CHECK_ALLOC(p->args, MS_MAXPROJARGS*sizeof(char *), -1);
 #if PJ_VERSION >= 480
@@ -1137,6 +1138,8 @@ void msFreeProjection(projectionObj *p)
     pj_free(p->proj);
     p->proj = NULL;
   }
+  p->proj_thread = NULL;
+  p->proj_serial = 0;
 #if PJ_VERSION >= 480
   if(p->proj_ctx) {
     pj_ctx_free(p->proj_ctx);
@@ -1269,6 +1272,7 @@ static int _msProcessAutoProjection(projectionObj *p)
     return(-1);
   }
 
+  msSetProjectionThread(p);
   msReleaseLock( TLOCK_PROJ );
 
   msFreeCharArray(args, numargs);
@@ -1280,6 +1284,9 @@ static int _msProcessAutoProjection(projectionObj *p)
 int msProcessProjection(projectionObj *p)
 {
 #ifdef USE_PROJ
+  char **args;
+  int numargs, cached;
+
   assert( p->proj == NULL );
 
   if( strcasecmp(p->args[0],"GEOGRAPHIC") == 0 ) {
@@ -1304,11 +1311,17 @@ int msProcessProjection(projectionObj *p)
     return _msProcessAutoProjection(p);
   }
   msAcquireLock( TLOCK_PROJ );
+  /* definitions already expanded by a previous map skip the init file lookups */
+  cached = msGetCachedProjectionArgs(p, &args, &numargs);
+  if(!cached) {
+    args = p->args;
+    numargs = p->numargs;
+  }
 #if PJ_VERSION < 480
-  if( !(p->proj = pj_init(p->numargs, p->args)) ) {
+  if( !(p->proj = pj_init(numargs, args)) ) {
 #else
   p->proj_ctx = pj_ctx_alloc();
-  if( !(p->proj=pj_init_ctx(p->proj_ctx, p->numargs, p->args)) ) {
+  if( !(p->proj=pj_init_ctx(p->proj_ctx, numargs, args)) ) {
 #endif
 
     int *pj_errno_ref = pj_get_errno_ref();
@@ -1323,6 +1336,9 @@ int msProcessProjection(projectionObj *p)
     return(-1);
   }
 
+  if(!cached)
+    msCacheProjectionArgs(p);
+  msSetProjectionThread(p);
   msReleaseLock( TLOCK_PROJ );
 
 #ifdef USE_PROJ_FASTPATHS
@@ -1405,25 +1421,36 @@ static int loadProjection(projectionObj *p)
 /*                     msLoadProjectionStringEPSGLike                   */
 /************************************************************************/
 
-static int msLoadProjectionStringEPSGLike(projectionObj *p, const char *value,
-                                          const char* pszPrefix,
-                                          int bFollowEPSGAxisOrder)
+static const char *msProjectionStringEPSGCode(const char *value, const char* pszPrefix)
 {
-    size_t buffer_size = 0;
-    char *init_string =  NULL;
     const char *code;
     const char *next_sep;
     size_t prefix_len;
 
     prefix_len = strlen(pszPrefix);
     if( strncasecmp(value, pszPrefix, prefix_len) != 0 )
-        return -1;
+        return NULL;
 
     code = value + prefix_len;
     next_sep = strchr(code, pszPrefix[prefix_len-1]);
     if( next_sep != NULL )
         code = next_sep + 1;
 
+    return code;
+}
+
+static int msLoadProjectionStringEPSGLike(projectionObj *p, const char *value,
+                                          const char* pszPrefix,
+                                          int bFollowEPSGAxisOrder)
+{
+    size_t buffer_size = 0;
+    char *init_string =  NULL;
+    const char *code;
+
+    code = msProjectionStringEPSGCode(value, pszPrefix);
+    if( code == NULL )
+        return -1;
+
     buffer_size = 10 + strlen(code) + 1;
     init_string = (char*)msSmallMalloc(buffer_size);
 
@@ -1524,6 +1551,43 @@ int msLoadProjectionStringEPSG(projectionObj *p, const char *value)
 #endif
 }
 
+/************************************************************************/
+/*                         msIsAxisInvertedSRS                          */
+/*                                                                      */
+/*      Tells if the projection msLoadProjectionStringEPSG() would      */
+/*      load for value has north/east axis order. The EPSG code forms   */
+/*      are looked up directly, without initializing the projection.    */
+/************************************************************************/
+
+int msIsAxisInvertedSRS(const char *value)
+{
+  static const struct {
+    const char *prefix;
+    int follow_axis_order;
+  } epsg_forms[] = {
+    { "EPSG:", MS_TRUE },
+    { "urn:ogc:def:crs:EPSG:", MS_TRUE },
+    { "urn:EPSG:geographicCRS:", MS_TRUE },
+    { "urn:x-ogc:def:crs:EPSG:", MS_TRUE },
+    { "http://www.opengis.net/def/crs/EPSG/", MS_TRUE },
+    { "http://www.opengis.net/gml/srs/epsg.xml#", MS_FALSE }
+  };
+  projectionObj proj;
+  int i, inverted = MS_FALSE;
+
+  for( i = 0; i < sizeof(epsg_forms) / sizeof(epsg_forms[0]); i++ ) {
+    const char *code = msProjectionStringEPSGCode(value, epsg_forms[i].prefix);
+    if( code != NULL )
+      return epsg_forms[i].follow_axis_order && msIsAxisInverted(atoi(code));
+  }
+
+  msInitProjection(&proj);
+  if( msLoadProjectionStringEPSG(&proj, value) == 0 )
+    inverted = msIsAxisInvertedProj(&proj);
+  msFreeProjection(&proj);
+  return inverted;
+}
+
 int msLoadProjectionString(projectionObj *p, const char *value)
 {
   assert(p);
@@ -2142,6 +2206,7 @@ char* msWriteLabelToString(labelObj *label)
   buffer.data = NULL;
   buffer.data_len = 0;
   buffer.data_offset = 0;
+  buffer.data_skip = 0;
 
   msIO_installHandlers( NULL, &context, NULL );
 
@@ -2159,8 +2224,10 @@ void msInitExpression(expressionObj *exp)
   exp->string = NULL;
   exp->native_string = NULL;
   exp->compiled = MS_FALSE;
+  exp->regexmemo = NULL;
   exp->flags = 0;
   exp->tokens = exp->curtoken = NULL;
+  exp->program = NULL;
 }
 
 void msFreeExpressionTokens(expressionObj *exp)
@@ -2201,6 +2268,9 @@ void msFreeExpressionTokens(expressionObj *exp)
     }
     exp->tokens = exp->curtoken = NULL;
   }
+
+  msFreeExpressionProgram(exp->program);
+  exp->program = NULL;
 }
 
 void msFreeExpression(expressionObj *exp)
@@ -2209,6 +2279,7 @@ void msFreeExpression(expressionObj *exp)
   msFree(exp->string);
   msFree(exp->native_string);
   if((exp->type == MS_REGEX) && exp->compiled) ms_regfree(&(exp->regex));
+  msFreeRegexMemo(exp->regexmemo);
   msFreeExpressionTokens(exp);
   msInitExpression(exp); /* re-initialize */
 }
@@ -2390,43 +2461,33 @@ int loadHashTable(hashTableObj *ptable)
 
 static void writeHashTable(FILE *stream, int indent, const char *title, hashTableObj *table)
 {
-  struct hashObj *tp;
-  int i;
+  const char *key;
 
   if(!table) return;
   if(msHashIsEmpty(table)) return;
 
   indent++;
   writeBlockBegin(stream, indent, title);
-  for (i=0; i<MS_HASHSIZE; i++) {
-    if (table->items[i] != NULL) {
-      for (tp=table->items[i]; tp!=NULL; tp=tp->next)
-        writeNameValuePair(stream, indent, tp->key, tp->data);
-    }
-  }
+  for (key=msFirstKeyFromHashTable(table); key!=NULL; key=msNextKeyFromHashTable(table, key))
+    writeNameValuePair(stream, indent, key, msLookupHashTable(table, key));
   writeBlockEnd(stream, indent, title);
 }
 
 static void writeHashTableInline(FILE *stream, int indent, char *name, hashTableObj* table)
 {
-  struct hashObj *tp = NULL;
-  int i;
+  const char *key;
 
   if(!table) return;
   if(msHashIsEmpty(table)) return;
 
   ++indent;
-  for (i=0; i<MS_HASHSIZE; ++i) {
-    if (table->items[i] != NULL) {
-      for (tp=table->items[i]; tp!=NULL; tp=tp->next) {
-        writeIndent(stream, indent);
-        msIO_fprintf(stream, "%s ", name);
-        writeStringElement(stream, tp->key);
-        msIO_fprintf(stream," ");
-        writeStringElement(stream, tp->data);
-        writeLineFeed(stream);
-      }
-    }
+  for (key=msFirstKeyFromHashTable(table); key!=NULL; key=msNextKeyFromHashTable(table, key)) {
+    writeIndent(stream, indent);
+    msIO_fprintf(stream, "%s ", name);
+    writeStringElement(stream, (char *) key);
+    msIO_fprintf(stream," ");
+    writeStringElement(stream, msLookupHashTable(table, key));
+    writeLineFeed(stream);
   }
 }
 
@@ -2540,6 +2601,7 @@ char* msWriteClusterToString(clusterObj *cluster)
   buffer.data = NULL;
   buffer.data_len = 0;
   buffer.data_offset = 0;
+  buffer.data_skip = 0;
 
   msIO_installHandlers( NULL, &context, NULL );
 
@@ -3053,6 +3115,7 @@ char* msWriteStyleToString(styleObj *style)
   buffer.data = NULL;
   buffer.data_len = 0;
   buffer.data_offset = 0;
+  buffer.data_skip = 0;
 
   msIO_installHandlers( NULL, &context, NULL );
 
@@ -3686,6 +3749,7 @@ char* msWriteClassToString(classObj *class)
   buffer.data = NULL;
   buffer.data_len = 0;
   buffer.data_offset = 0;
+  buffer.data_skip = 0;
 
   msIO_installHandlers( NULL, &context, NULL );
 
@@ -3779,6 +3843,16 @@ int initLayer(layerObj *layer, mapObj *map)
 
   layer->classitem = NULL;
   layer->classitemindex = -1;
+  layer->classlookup = NULL;
+  layer->bindingplan = NULL;
+  layer->rasterclasstable = NULL;
+  layer->labelpointcache = NULL;
+  layer->projapprox = NULL;
+  layer->connpoolkey = NULL;
+  layer->searchshape = NULL;
+  layer->prefetch = NULL;
+  layer->shapepool = NULL;
+  layer->resultshapes = NULL;
 
   layer->units = MS_METERS;
   if(msInitProjection(&(layer->projection)) == -1) return(-1);
@@ -3951,10 +4025,14 @@ int freeLayer(layerObj *layer)
   if(layer->features)
     freeFeatureList(layer->features);
 
-  if(layer->resultcache) {
-    if(layer->resultcache->results) free(layer->resultcache->results);
-    msFree(layer->resultcache);
-  }
+  msFreeResultCache(layer->resultcache);
+  msFreeClassLookup(layer->classlookup);
+  msFreeBindingPlan(layer->bindingplan);
+  msFreeResultShapes(layer->resultshapes);
+  msFreeRasterClassTable(layer->rasterclasstable);
+  msFreeLabelPointCache(layer->labelpointcache);
+  msFreeProjApprox(layer->projapprox);
+  msFree(layer->connpoolkey);
 
   msFree(layer->styleitem);
 
@@ -4397,6 +4475,7 @@ int loadLayer(layerObj *layer, mapObj *map)
         loadGrid(layer);
         break;
       case(GROUP):
+        msInvalidateLayerNameIndex(map);
         if(getString(&layer->group) == MS_FAILURE) return(-1); /* getString() cleans up previously allocated string */
         if(msyysource == MS_URL_TOKENS) {
           if(msValidateParameter(layer->group, msLookupHashTable(&(layer->validation), "group"), msLookupHashTable(&(map->web.validation), "group"), NULL, NULL) != MS_SUCCESS) {
@@ -4506,6 +4585,7 @@ int loadLayer(layerObj *layer, mapObj *map)
         if(getInteger(&(layer->minfeaturesize)) == -1) return(-1);
         break;
       case(NAME):
+        msInvalidateLayerNameIndex(map);
         if(getString(&layer->name) == MS_FAILURE) return(-1);
         break;
       case(OFFSITE):
@@ -4927,6 +5007,7 @@ char* msWriteLayerToString(layerObj *layer)
   buffer.data = NULL;
   buffer.data_len = 0;
   buffer.data_offset = 0;
+  buffer.data_skip = 0;
 
   msIO_installHandlers( NULL, &context, NULL );
 
@@ -5106,6 +5187,7 @@ char* msWriteReferenceMapToString(referenceMapObj *ref)
   buffer.data = NULL;
   buffer.data_len = 0;
   buffer.data_offset = 0;
+  buffer.data_skip = 0;
 
   msIO_installHandlers( NULL, &context, NULL );
 
@@ -5477,6 +5559,7 @@ char* msWriteLegendToString(legendObj *legend)
   buffer.data = NULL;
   buffer.data_len = 0;
   buffer.data_offset = 0;
+  buffer.data_skip = 0;
 
   msIO_installHandlers( NULL, &context, NULL );
 
@@ -5651,6 +5734,7 @@ char* msWriteScalebarToString(scalebarObj *scalebar)
   buffer.data = NULL;
   buffer.data_len = 0;
   buffer.data_offset = 0;
+  buffer.data_skip = 0;
 
   msIO_installHandlers( NULL, &context, NULL );
 
@@ -5762,6 +5846,7 @@ char* msWriteQueryMapToString(queryMapObj *querymap)
   buffer.data = NULL;
   buffer.data_len = 0;
   buffer.data_offset = 0;
+  buffer.data_skip = 0;
 
   msIO_installHandlers( NULL, &context, NULL );
 
@@ -5857,6 +5942,7 @@ char* msWriteWebToString(webObj *web)
   buffer.data = NULL;
   buffer.data_len = 0;
   buffer.data_offset = 0;
+  buffer.data_skip = 0;
 
   msIO_installHandlers( NULL, &context, NULL );
 
@@ -6034,6 +6120,8 @@ int initMap(mapObj *map)
   map->maxlayers = 0;
   map->layers = NULL;
   map->layerorder = NULL; /* used to modify the order in which the layers are drawn */
+  map->layernameindex = NULL;
+  map->stats = NULL;
 
   map->status = MS_ON;
   map->name = msStrdup("MS");
@@ -6113,6 +6201,7 @@ int initMap(mapObj *map)
 
   /* Encryption key information - see mapcrypto.c */
   map->encryption_key_loaded = MS_FALSE;
+  map->decryptcache = NULL;
 
   msInitQuery(&(map->query));
 
@@ -6137,6 +6226,8 @@ int initMap(mapObj *map)
 */
 layerObj *msGrowMapLayers( mapObj *map )
 {
+  msInvalidateLayerNameIndex(map); /* a layer is being added */
+
   /* Do we need to increase the size of layers/layerorder by
    * MS_LAYER_ALLOCSIZE?
    */
@@ -6177,31 +6268,33 @@ layerObj *msGrowMapLayers( mapObj *map )
 }
 
 
-int msFreeLabelCacheSlot(labelCacheSlotObj *cacheslot)
+/* the textsymbol arrays and leader lines of the members are in the label cache arena */
+static void freeLabelCacheSlotMembers(labelCacheSlotObj *cacheslot)
 {
   int i, j;
 
-  /* free the labels */
-  if (cacheslot->labels) {
-    for(i=0; i<cacheslot->numlabels; i++) {
-
-      for(j=0; j<cacheslot->labels[i].numtextsymbols; j++) {
-        freeTextSymbol(cacheslot->labels[i].textsymbols[j]);
-        free(cacheslot->labels[i].textsymbols[j]);
-      }
-      msFree(cacheslot->labels[i].textsymbols);
+  for(i=0; i<cacheslot->numlabels; i++) {
+    for(j=0; j<cacheslot->labels[i].numtextsymbols; j++) {
+      freeTextSymbol(cacheslot->labels[i].textsymbols[j]);
+      free(cacheslot->labels[i].textsymbols[j]);
+    }
 
 #ifdef include_deprecated
-      for(j=0; j<cacheslot->labels[i].numstyles; j++) freeStyle(&(cacheslot->labels[i].styles[j]));
-      msFree(cacheslot->labels[i].styles);
+    for(j=0; j<cacheslot->labels[i].numstyles; j++) freeStyle(&(cacheslot->labels[i].styles[j]));
+    msFree(cacheslot->labels[i].styles);
 #endif
-      if(cacheslot->labels[i].leaderline) {
-        msFree(cacheslot->labels[i].leaderline->point);
-        msFree(cacheslot->labels[i].leaderline);
-        msFree(cacheslot->labels[i].leaderbbox);
-      }
-    }
   }
+  cacheslot->numlabels = 0;
+  cacheslot->nummarkers = 0;
+}
+
+int msFreeLabelCacheSlot(labelCacheSlotObj *cacheslot)
+{
+  /* free the labels */
+  if (cacheslot->labels)
+    freeLabelCacheSlotMembers(cacheslot);
+  msIO_requestMemoryFree(MS_REQUEST_MEMORY_LABELCACHE, sizeof(labelCacheMemberObj)*cacheslot->cachesize +
+                         sizeof(markerCacheMemberObj)*cacheslot->markercachesize);
   msFree(cacheslot->labels);
   cacheslot->labels = NULL;
   cacheslot->cachesize = 0;
@@ -6226,26 +6319,34 @@ int msFreeLabelCache(labelCacheObj *cache)
 
   cache->num_allocated_rendered_members = cache->num_rendered_members = 0;
   msFree(cache->rendered_text_symbols);
+  cache->rendered_text_symbols = NULL;
+  msFreeLabelCacheGrid(cache);
+  msFreeLabelCacheArena(cache);
+  msFree(cache->stats);
+  cache->stats = NULL;
 
   return MS_SUCCESS;
 }
 
 int msInitLabelCacheSlot(labelCacheSlotObj *cacheslot)
 {
-
-  if(cacheslot->labels || cacheslot->markers)
-    msFreeLabelCacheSlot(cacheslot);
-
-  cacheslot->labels = (labelCacheMemberObj *)malloc(sizeof(labelCacheMemberObj)*MS_LABELCACHEINITSIZE);
-  MS_CHECK_ALLOC(cacheslot->labels, sizeof(labelCacheMemberObj)*MS_LABELCACHEINITSIZE, MS_FAILURE);
-
-  cacheslot->cachesize = MS_LABELCACHEINITSIZE;
+  /* arrays left by a previous draw are emptied and reused */
+  if(cacheslot->labels) {
+    freeLabelCacheSlotMembers(cacheslot);
+  } else {
+    cacheslot->labels = (labelCacheMemberObj *)malloc(sizeof(labelCacheMemberObj)*MS_LABELCACHEINITSIZE);
+    MS_CHECK_ALLOC(cacheslot->labels, sizeof(labelCacheMemberObj)*MS_LABELCACHEINITSIZE, MS_FAILURE);
+    cacheslot->cachesize = MS_LABELCACHEINITSIZE;
+    msIO_requestMemoryAlloc(MS_REQUEST_MEMORY_LABELCACHE, sizeof(labelCacheMemberObj)*MS_LABELCACHEINITSIZE);
+  }
   cacheslot->numlabels = 0;
 
-  cacheslot->markers = (markerCacheMemberObj *)malloc(sizeof(markerCacheMemberObj)*MS_LABELCACHEINITSIZE);
-  MS_CHECK_ALLOC(cacheslot->markers, sizeof(markerCacheMemberObj)*MS_LABELCACHEINITSIZE, MS_FAILURE);
-
-  cacheslot->markercachesize = MS_LABELCACHEINITSIZE;
+  if(!cacheslot->markers) {
+    cacheslot->markers = (markerCacheMemberObj *)malloc(sizeof(markerCacheMemberObj)*MS_LABELCACHEINITSIZE);
+    MS_CHECK_ALLOC(cacheslot->markers, sizeof(markerCacheMemberObj)*MS_LABELCACHEINITSIZE, MS_FAILURE);
+    cacheslot->markercachesize = MS_LABELCACHEINITSIZE;
+    msIO_requestMemoryAlloc(MS_REQUEST_MEMORY_LABELCACHE, sizeof(markerCacheMemberObj)*MS_LABELCACHEINITSIZE);
+  }
   cacheslot->nummarkers = 0;
 
   return(MS_SUCCESS);
@@ -6260,8 +6361,11 @@ int msInitLabelCache(labelCacheObj *cache)
       return MS_FAILURE;
   }
   cache->gutter = 0;
-  cache->num_allocated_rendered_members = cache->num_rendered_members = 0;
-  cache->rendered_text_symbols = NULL;
+  cache->num_rendered_members = 0; /* rendered_text_symbols is reused */
+  msFreeLabelCacheGrid(cache); /* the grid is built for the image size of each draw */
+  msResetLabelCacheArena(cache);
+  msFree(cache->stats); /* left by a draw that failed */
+  cache->stats = NULL;
 
   return MS_SUCCESS;
 }
@@ -6328,6 +6432,7 @@ char* msWriteMapToString(mapObj *map)
   buffer.data = NULL;
   buffer.data_len = 0;
   buffer.data_offset = 0;
+  buffer.data_skip = 0;
 
   msIO_installHandlers( NULL, &context, NULL );
 
@@ -6366,6 +6471,14 @@ int msSaveMap(mapObj *map, char *filename)
   return(0);
 }
 
+/* index of the next token of the stream recorded or replayed by the lexer */
+static int msMapTokenPosition(void)
+{
+  if(!msyytokens)
+    return 0;
+  return msyytokens->replay ? msyytokens->next : msyytokens->numtokens;
+}
+
 static int loadMapInternal(mapObj *map)
 {
   int foundMapToken=MS_FALSE;
@@ -6486,7 +6599,9 @@ static int loadMapInternal(mapObj *map)
         msFreeProjection(&map->latlon);
         if(loadProjection(&map->latlon) == -1) return MS_FAILURE;
         break;
-      case(LAYER):
+      case(LAYER): {
+        int first = msMapTokenPosition() - 1; /* the LAYER token */
+
         if(msGrowMapLayers(map) == NULL)
           return MS_FAILURE;
         if(initLayer((GET_LAYER(map, map->numlayers)), map) == -1) return MS_FAILURE;
@@ -6495,7 +6610,18 @@ static int loadMapInternal(mapObj *map)
         /* Update the layer order list with the layer's index. */
         map->layerorder[map->numlayers] = map->numlayers;
         map->numlayers++;
-        break;
+
+        if(msyytokens && msyytokens->indexlayers) { /* up to its END */
+          if(msyytokens->numlayers == msyytokens->maxlayers) {
+            msyytokens->maxlayers = MS_MAX(64, msyytokens->maxlayers * 2);
+            msyytokens->layers = (mapTokenRangeObj *) msSmallRealloc(msyytokens->layers, sizeof(mapTokenRangeObj) * msyytokens->maxlayers);
+          }
+          msyytokens->layers[msyytokens->numlayers].first = first;
+          msyytokens->layers[msyytokens->numlayers].last = msMapTokenPosition() - 1;
+          msyytokens->numlayers++;
+        }
+      }
+      break;
       case(OUTPUTFORMAT):
         if(loadOutputFormat(map) == -1) return MS_FAILURE;
         break;
@@ -6652,15 +6778,110 @@ mapObj *msLoadMapFromString(char *buffer, char *new_mappath)
   return map;
 }
 
+/*
+** Compiled mapfiles, written by msSaveCompiledMap(): a header then the tokens
+** the parser read from the mapfile, its includes and its symbolset, then the
+** text of these tokens. msLoadMap() replays the tokens through the lexer
+** instead of scanning the files, the keywords come already matched and there
+** are no includes or symbolset to open. The tokens depend on the MapServer
+** version that wrote them, the other versions refuse the file.
+*/
+typedef struct {
+  char magic[32]; /* MS_COMPILED_MAP_MAGIC_STRING */
+  char version[16]; /* MS_VERSION */
+  int format; /* MS_COMPILED_MAP_VERSION */
+  int byteorder; /* 0x01020304 written in the order of the machine */
+  int numtokens;
+  int stringsize;
+} compiledMapHeaderObj;
+
+static void msFreeMapTokenStream(mapTokenStreamObj *stream)
+{
+  if(!stream) return;
+  free(stream->tokens);
+  free(stream->strings);
+  free(stream->layers);
+  free(stream->skips);
+  free(stream);
+}
+
+/*
+** Reads the tokens of a compiled mapfile into *stream, fp being at its start.
+** *stream is left NULL (and fp rewound) if this isn't a compiled mapfile.
+*/
+static int msReadCompiledMap(FILE *fp, const char *filename, mapTokenStreamObj **stream)
+{
+  compiledMapHeaderObj header;
+  mapTokenStreamObj *tokens;
+  size_t tokensize;
+  int i;
+
+  *stream = NULL;
+  if(fread(&header, sizeof(header), 1, fp) != 1 ||
+      strncmp(header.magic, MS_COMPILED_MAP_MAGIC_STRING, sizeof(header.magic)) != 0) {
+    rewind(fp);
+    return MS_SUCCESS;
+  }
+
+  if(header.format != MS_COMPILED_MAP_VERSION || header.byteorder != 0x01020304 ||
+      strncmp(header.version, MS_VERSION, sizeof(header.version)) != 0) {
+    msSetError(MS_IOERR, "(%s) was compiled by another MapServer version or machine, compile it again.", "msLoadMap()", filename);
+    return MS_FAILURE;
+  }
+  if(header.numtokens < 0 || header.stringsize < 0 ||
+      (size_t) header.numtokens > INT_MAX / sizeof(mapTokenObj)) {
+    msSetError(MS_IOERR, "(%s) corrupted compiled mapfile.", "msLoadMap()", filename);
+    return MS_FAILURE;
+  }
+
+  tokensize = header.numtokens * sizeof(mapTokenObj);
+  tokens = (mapTokenStreamObj *) msSmallCalloc(1, sizeof(mapTokenStreamObj));
+  tokens->tokens = (mapTokenObj *) malloc(MS_MAX(tokensize, 1));
+  tokens->strings = (char *) malloc(header.stringsize + 1);
+  tokens->replay = MS_TRUE;
+  if(!tokens->tokens || !tokens->strings) {
+    msSetError(MS_MEMERR, NULL, "msLoadMap()");
+    msFreeMapTokenStream(tokens);
+    return MS_FAILURE;
+  }
+  if(fread(tokens->tokens, 1, tokensize, fp) != tokensize ||
+      fread(tokens->strings, 1, header.stringsize, fp) != (size_t) header.stringsize) {
+    msSetError(MS_IOERR, "(%s) truncated compiled mapfile.", "msLoadMap()", filename);
+    msFreeMapTokenStream(tokens);
+    return MS_FAILURE;
+  }
+  tokens->strings[header.stringsize] = '\0';
+  tokens->numtokens = header.numtokens;
+  tokens->stringsize = header.stringsize;
+  for(i=0; i<tokens->numtokens; i++) {
+    mapTokenObj *t = &tokens->tokens[i];
+    if(t->string < 0 || t->length < 0 || t->length >= header.stringsize - t->string ||
+        tokens->strings[t->string + t->length] != '\0') {
+      msSetError(MS_IOERR, "(%s) corrupted compiled mapfile.", "msLoadMap()", filename);
+      msFreeMapTokenStream(tokens);
+      return MS_FAILURE;
+    }
+  }
+  tokens->maxtokens = tokens->numtokens;
+  tokens->maxstringsize = tokens->stringsize;
+
+  *stream = tokens;
+  return MS_SUCCESS;
+}
+
 /*
 ** Sets up file-based mapfile loading and calls loadMapInternal to do the work.
+** With a stream set to replay its tokens are parsed instead of the file. Else
+** the tokens read are recorded in it (see msSaveCompiledMap()), those of a
+** compiled file being moved there.
 */
-mapObj *msLoadMap(char *filename, char *new_mappath)
+static mapObj *msLoadMapFile(char *filename, char *new_mappath, mapTokenStreamObj *stream)
 {
   mapObj *map;
   struct mstimeval starttime, endtime;
   char szPath[MS_MAXPATHLEN], szCWDPath[MS_MAXPATHLEN];
   int debuglevel;
+  mapTokenStreamObj *replay = NULL;
 
   debuglevel = (int)msGetGlobalDebugLevel();
 
@@ -6674,8 +6895,8 @@ mapObj *msLoadMap(char *filename, char *new_mappath)
     return(NULL);
   }
 
-  if(getenv("MS_MAPFILE_PATTERN")) { /* user override */
-    if(msEvalRegex(getenv("MS_MAPFILE_PATTERN"), filename) != MS_TRUE) {
+  if(msIO_getenv("MS_MAPFILE_PATTERN")) { /* user override */
+    if(msEvalRegex(msIO_getenv("MS_MAPFILE_PATTERN"), filename) != MS_TRUE) {
       msSetError(MS_REGEXERR, "MS_MAPFILE_PATTERN validation failed." , "msLoadMap()");
       return(NULL);
     }
@@ -6699,6 +6920,9 @@ mapObj *msLoadMap(char *filename, char *new_mappath)
 
   msAcquireLock( TLOCK_PARSER );  /* Steve: might need to move this lock a bit higher; Umberto: done */
 
+  if(stream && stream->replay) {
+    msyyin = NULL; /* nothing to open */
+  } else
 #ifdef USE_XMLMAPFILE
   /* If the mapfile is an xml mapfile, transform it */
   if ((getenv("MS_XMLMAPFILE_XSLT")) &&
@@ -6726,10 +6950,40 @@ mapObj *msLoadMap(char *filename, char *new_mappath)
   }
 #endif
 
+  if(msyyin) {
+    if(msReadCompiledMap(msyyin, filename, &replay) != MS_SUCCESS) {
+      fclose(msyyin);
+      msyyin = NULL;
+      msFreeMap(map);
+      msReleaseLock( TLOCK_PARSER );
+      return NULL;
+    }
+    if(replay) { /* the tokens are all read */
+      fclose(msyyin);
+      msyyin = NULL;
+      if(stream) { /* recorded as is */
+        free(stream->tokens);
+        free(stream->strings);
+        stream->tokens = replay->tokens;
+        stream->numtokens = stream->maxtokens = replay->numtokens;
+        stream->strings = replay->strings;
+        stream->stringsize = stream->maxstringsize = replay->stringsize;
+        stream->next = 0;
+        stream->replay = MS_TRUE;
+        replay->tokens = NULL;
+        replay->strings = NULL;
+        msFreeMapTokenStream(replay);
+        replay = NULL;
+      }
+    }
+  }
+  msyytokens = stream ? stream : replay;
+
   msyystate = MS_TOKENIZE_FILE;
   msyylex(); /* sets things up, but doesn't process any tokens */
 
-  msyyrestart(msyyin); /* start at line begining, line 1 */
+  if(msyyin)
+    msyyrestart(msyyin); /* start at line begining, line 1 */
   msyylineno = 1;
 
   /* If new_mappath is provided then use it, otherwise use the location */
@@ -6751,6 +7005,8 @@ mapObj *msLoadMap(char *filename, char *new_mappath)
   msyybasepath = map->mappath; /* for INCLUDEs */
 
   if(loadMapInternal(map) != MS_SUCCESS) {
+    msyytokens = NULL;
+    msFreeMapTokenStream(replay);
     msFreeMap(map);
     msReleaseLock( TLOCK_PARSER );
     if( msyyin ) {
@@ -6759,6 +7015,8 @@ mapObj *msLoadMap(char *filename, char *new_mappath)
     }
     return NULL;
   }
+  msyytokens = NULL;
+  msFreeMapTokenStream(replay);
   msReleaseLock( TLOCK_PARSER );
 
   if (debuglevel >= MS_DEBUGLEVEL_TUNING) {
@@ -6772,6 +7030,503 @@ mapObj *msLoadMap(char *filename, char *new_mappath)
   return map;
 }
 
+mapObj *msLoadMap(char *filename, char *new_mappath)
+{
+  return msLoadMapFile(filename, new_mappath, NULL);
+}
+
+/*
+** Writes the compiled form of mapfile filename to outfile, loaded by msLoadMap()
+** as the mapfile itself would be (relative paths being taken from the location
+** of the compiled file). Includes and the symbolset are part of the compiled
+** file, it has to be compiled again when any of them changes.
+*/
+int msSaveCompiledMap(char *filename, char *outfile)
+{
+  mapTokenStreamObj stream;
+  compiledMapHeaderObj header;
+  mapObj *map;
+  FILE *fp;
+  int status = MS_SUCCESS;
+
+  memset(&stream, 0, sizeof(stream));
+  map = msLoadMapFile(filename, NULL, &stream);
+  if(!map) {
+    free(stream.tokens);
+    free(stream.strings);
+    return MS_FAILURE;
+  }
+  msFreeMap(map);
+
+  memset(&header, 0, sizeof(header));
+  strlcpy(header.magic, MS_COMPILED_MAP_MAGIC_STRING, sizeof(header.magic));
+  strlcpy(header.version, MS_VERSION, sizeof(header.version));
+  header.format = MS_COMPILED_MAP_VERSION;
+  header.byteorder = 0x01020304;
+  header.numtokens = stream.numtokens;
+  header.stringsize = stream.stringsize;
+
+  if((fp = fopen(outfile, "wb")) == NULL) {
+    msSetError(MS_IOERR, "(%s)", "msSaveCompiledMap()", outfile);
+    status = MS_FAILURE;
+  } else {
+    if(fwrite(&header, sizeof(header), 1, fp) != 1 ||
+        (stream.numtokens > 0 && fwrite(stream.tokens, sizeof(mapTokenObj), stream.numtokens, fp) != (size_t) stream.numtokens) ||
+        (stream.stringsize > 0 && fwrite(stream.strings, 1, stream.stringsize, fp) != (size_t) stream.stringsize)) {
+      msSetError(MS_IOERR, "Error writing (%s)", "msSaveCompiledMap()", outfile);
+      status = MS_FAILURE;
+    }
+    if(fclose(fp) != 0 && status == MS_SUCCESS) {
+      msSetError(MS_IOERR, "Error writing (%s)", "msSaveCompiledMap()", outfile);
+      status = MS_FAILURE;
+    }
+  }
+
+  free(stream.tokens);
+  free(stream.strings);
+  return status;
+}
+
+/*
+** Per process cache of parsed mapfiles for long running processes (FastCGI).
+** The parsed map is kept as a template and each call returns a copy of it
+** made with msCopyMap(), the template being reparsed when the mapfile
+** modification time or size changes. Files pulled in with INCLUDE are not
+** checked. The cache is protected by TLOCK_MAPCACHE, copies are made
+** outside of it while holding a reference on the template, and share the
+** template hash tables (metadata...) until they modify them. With CONFIG
+** "MS_WARMUP" set the template is warmed up once, see msWarmupMap().
+*/
+#define MS_MAP_CACHE_MAX 16
+
+typedef struct {
+  char *filename;
+  time_t mtime;
+  off_t size;
+  unsigned long last_used;
+  mapObj *map;
+} mapCacheEntryObj;
+
+static int mapCacheCount = 0;
+static unsigned long mapCacheClock = 0;
+static mapCacheEntryObj mapCache[MS_MAP_CACHE_MAX];
+
+static void msMapCacheRemove(int i)
+{
+  msFreeMap(mapCache[i].map);
+  free(mapCache[i].filename);
+
+  mapCacheCount--;
+  if( i != mapCacheCount )
+    mapCache[i] = mapCache[mapCacheCount];
+}
+
+void msMapCacheCleanup(void)
+{
+  msAcquireLock( TLOCK_MAPCACHE );
+  while( mapCacheCount > 0 )
+    msMapCacheRemove(mapCacheCount - 1);
+  msReleaseLock( TLOCK_MAPCACHE );
+}
+
+static mapObj *msCloneCachedMap(mapObj *src)
+{
+  mapObj *map = msNewMapObj();
+
+  if( !map )
+    return NULL;
+  if( msCopyMap(map, src) != MS_SUCCESS ) {
+    msFreeMap(map);
+    return NULL;
+  }
+  msApplyMapConfigOptions(map);
+  return map;
+}
+
+mapObj *msLoadMapCached(char *filename)
+{
+  struct stat sStat;
+  mapObj *template, *map;
+  int i, slot;
+
+  if( !filename || stat(filename, &sStat) != 0 )
+    return msLoadMap(filename, NULL); /* let msLoadMap() report the error */
+
+  msAcquireLock( TLOCK_MAPCACHE );
+  for( i = 0; i < mapCacheCount; i++ ) {
+    if( strcmp(mapCache[i].filename, filename) != 0 )
+      continue;
+    if( mapCache[i].mtime == sStat.st_mtime && mapCache[i].size == sStat.st_size ) {
+      /* hold a reference so the copy can be made outside of the lock */
+      template = mapCache[i].map;
+      MS_REFCNT_INCR(template);
+      mapCache[i].last_used = ++mapCacheClock;
+      msReleaseLock( TLOCK_MAPCACHE );
+      msMetricsCacheLookup(MS_METRICS_CACHE_MAP, MS_TRUE);
+      map = msCloneCachedMap(template);
+      msFreeMap(template);
+      return map;
+    }
+    msMapCacheRemove(i); /* the mapfile has been modified */
+    break;
+  }
+  msReleaseLock( TLOCK_MAPCACHE );
+  msMetricsCacheLookup(MS_METRICS_CACHE_MAP, MS_FALSE);
+
+  template = msLoadMap(filename, NULL);
+  if( !template )
+    return NULL;
+  if( msGetConfigOption(template, "MS_WARMUP") )
+    msWarmupMap(template); /* the copies inherit the decoded symbols */
+  map = msCloneCachedMap(template);
+  if( !map ) {
+    msResetErrorList();
+    return template; /* serve the request uncached */
+  }
+
+  msAcquireLock( TLOCK_MAPCACHE );
+  for( i = 0; i < mapCacheCount; i++ ) {
+    if( strcmp(mapCache[i].filename, filename) == 0 )
+      break;
+  }
+  if( i < mapCacheCount ) {
+    /* loaded by another thread in the meantime */
+    msFreeMap(template);
+  } else {
+    if( mapCacheCount == MS_MAP_CACHE_MAX ) {
+      slot = 0;
+      for( i = 1; i < mapCacheCount; i++ ) {
+        if( mapCache[i].last_used < mapCache[slot].last_used )
+          slot = i;
+      }
+      msMapCacheRemove(slot);
+    }
+    mapCache[mapCacheCount].filename = msStrdup(filename);
+    mapCache[mapCacheCount].mtime = sStat.st_mtime;
+    mapCache[mapCacheCount].size = sStat.st_size;
+    mapCache[mapCacheCount].last_used = ++mapCacheClock;
+    mapCache[mapCacheCount].map = template;
+    mapCacheCount++;
+  }
+  msReleaseLock( TLOCK_MAPCACHE );
+
+  return map;
+}
+
+/*
+** Lazy layer loading for mapfiles with many layers of which a request uses a
+** few, see msLoadMapLayers(). The first load parses the whole mapfile once,
+** recording its tokens with the range of each LAYER block, and keeps an index
+** of the layers: name, group, STATUS DEFAULT and the layers each needs (tile
+** index, mask, requires and labelrequires, union sources). The next loads
+** replay the tokens leaving the unneeded LAYER blocks out. The index is kept
+** per process like the map cache, rebuilt when the mapfile modification time
+** or size changes (includes are not checked).
+*/
+typedef struct {
+  char *name;
+  char *group;
+  int isdefault;   /* STATUS DEFAULT, always loaded */
+  int *needs;      /* indexes of the layers it needs */
+  int numneeds;
+} layerIndexItemObj;
+
+typedef struct {
+  int refcount;
+  mapTokenStreamObj *stream;
+  char *mapname;
+  layerIndexItemObj *layers;
+  int numlayers;
+} layerIndexObj;
+
+typedef struct {
+  char *filename;
+  time_t mtime;
+  off_t size;
+  unsigned long last_used;
+  layerIndexObj *index;
+} layerIndexCacheEntryObj;
+
+static int layerIndexCacheCount = 0;
+static unsigned long layerIndexCacheClock = 0;
+static layerIndexCacheEntryObj layerIndexCache[MS_MAP_CACHE_MAX];
+
+/* to be called under TLOCK_MAPCACHE */
+static void msReleaseLayerIndex(layerIndexObj *index)
+{
+  int i;
+
+  if(--index->refcount > 0)
+    return;
+  for(i=0; i<index->numlayers; i++) {
+    msFree(index->layers[i].name);
+    msFree(index->layers[i].group);
+    msFree(index->layers[i].needs);
+  }
+  msFree(index->layers);
+  msFree(index->mapname);
+  msFreeMapTokenStream(index->stream);
+  msFree(index);
+}
+
+static void msLayerIndexCacheRemove(int i)
+{
+  msReleaseLayerIndex(layerIndexCache[i].index);
+  free(layerIndexCache[i].filename);
+
+  layerIndexCacheCount--;
+  if( i != layerIndexCacheCount )
+    layerIndexCache[i] = layerIndexCache[layerIndexCacheCount];
+}
+
+void msLayerIndexCacheCleanup(void)
+{
+  msAcquireLock( TLOCK_MAPCACHE );
+  while( layerIndexCacheCount > 0 )
+    msLayerIndexCacheRemove(layerIndexCacheCount - 1);
+  msReleaseLock( TLOCK_MAPCACHE );
+}
+
+/* adds the layers named (or grouped) name to the needs of item */
+static void msLayerIndexAddNeeds(mapObj *map, layerIndexItemObj *item, int self, const char *name)
+{
+  int i;
+
+  for(i=0; i<map->numlayers; i++) {
+    layerObj *lp = GET_LAYER(map, i);
+    if(i == self || !((lp->name && strcasecmp(lp->name, name) == 0) || (lp->group && strcasecmp(lp->group, name) == 0)))
+      continue;
+    item->needs = (int *) msSmallRealloc(item->needs, sizeof(int) * (item->numneeds + 1));
+    item->needs[item->numneeds++] = i;
+  }
+}
+
+/* adds the layers a requires or labelrequires context refers to, as msEvalContext() finds them */
+static void msLayerIndexAddContextNeeds(mapObj *map, layerIndexItemObj *item, int self, const char *context)
+{
+  char tag[256];
+  int i;
+
+  if(!context)
+    return;
+  for(i=0; i<map->numlayers; i++) {
+    layerObj *lp = GET_LAYER(map, i);
+    if(i == self || !lp->name)
+      continue;
+    snprintf(tag, sizeof(tag), "[%s]", lp->name);
+    if(strstr(context, tag))
+      msLayerIndexAddNeeds(map, item, self, lp->name);
+  }
+}
+
+/* the index of the layers of map loaded from stream, NULL if the LAYER blocks weren't all found */
+static layerIndexObj *msBuildLayerIndex(mapObj *map, mapTokenStreamObj *stream)
+{
+  layerIndexObj *index;
+  int i, j;
+
+  if(stream->numlayers != map->numlayers)
+    return NULL;
+
+  index = (layerIndexObj *) msSmallCalloc(1, sizeof(layerIndexObj));
+  index->refcount = 1;
+  index->stream = stream;
+  index->mapname = map->name ? msStrdup(map->name) : NULL;
+  index->numlayers = map->numlayers;
+  index->layers = (layerIndexItemObj *) msSmallCalloc(MS_MAX(map->numlayers, 1), sizeof(layerIndexItemObj));
+
+  for(i=0; i<map->numlayers; i++) {
+    layerObj *lp = GET_LAYER(map, i);
+    layerIndexItemObj *item = &index->layers[i];
+
+    item->name = lp->name ? msStrdup(lp->name) : NULL;
+    item->group = lp->group ? msStrdup(lp->group) : NULL;
+    item->isdefault = (lp->status == MS_DEFAULT);
+
+    if(lp->tileindex)
+      msLayerIndexAddNeeds(map, item, i, lp->tileindex);
+    if(lp->mask)
+      msLayerIndexAddNeeds(map, item, i, lp->mask);
+    msLayerIndexAddContextNeeds(map, item, i, lp->requires);
+    msLayerIndexAddContextNeeds(map, item, i, lp->labelrequires);
+    if(lp->connectiontype == MS_UNION && lp->connection) {
+      int numnames = 0;
+      char **names = msStringSplit(lp->connection, ',', &numnames);
+      for(j=0; j<numnames; j++) {
+        msStringTrim(names[j]);
+        msLayerIndexAddNeeds(map, item, i, names[j]);
+      }
+      msFreeCharArray(names, numnames);
+    }
+  }
+
+  return index;
+}
+
+/*
+** The ranges of the LAYER blocks of the layers not needed for names, NULL if
+** the whole map is to be loaded (a name that is no layer nor group).
+*/
+static mapTokenRangeObj *msSelectIndexedLayers(layerIndexObj *index, char **names, int numnames, int *numskips)
+{
+  mapTokenRangeObj *skips;
+  char *selected;
+  int *pending, numpending = 0;
+  int i, j, found;
+
+  *numskips = 0;
+  selected = (char *) msSmallCalloc(MS_MAX(index->numlayers, 1), sizeof(char));
+  pending = (int *) msSmallMalloc(sizeof(int) * MS_MAX(index->numlayers, 1));
+
+  for(i=0; i<index->numlayers; i++) {
+    if(index->layers[i].isdefault) {
+      selected[i] = 1;
+      pending[numpending++] = i;
+    }
+  }
+
+  for(j=0; j<numnames; j++) {
+    if(index->mapname && strcasecmp(names[j], index->mapname) == 0)
+      break; /* the root layer */
+    found = MS_FALSE;
+    for(i=0; i<index->numlayers; i++) {
+      layerIndexItemObj *item = &index->layers[i];
+      if((item->name && strcasecmp(item->name, names[j]) == 0) || (item->group && strcasecmp(item->group, names[j]) == 0)) {
+        found = MS_TRUE;
+        if(!selected[i]) {
+          selected[i] = 1;
+          pending[numpending++] = i;
+        }
+      }
+    }
+    if(!found)
+      break;
+  }
+  if(j < numnames) {
+    msFree(selected);
+    msFree(pending);
+    return NULL;
+  }
+
+  while(numpending > 0) { /* and what they need */
+    layerIndexItemObj *item = &index->layers[pending[--numpending]];
+    for(j=0; j<item->numneeds; j++) {
+      if(!selected[item->needs[j]]) {
+        selected[item->needs[j]] = 1;
+        pending[numpending++] = item->needs[j];
+      }
+    }
+  }
+
+  skips = (mapTokenRangeObj *) msSmallMalloc(sizeof(mapTokenRangeObj) * MS_MAX(index->numlayers, 1));
+  for(i=0; i<index->numlayers; i++) {
+    if(!selected[i])
+      skips[(*numskips)++] = index->stream->layers[i];
+  }
+
+  msFree(selected);
+  msFree(pending);
+  return skips;
+}
+
+/*
+** Loads mapfile filename with only the layers named (by name or group) in
+** names, the STATUS DEFAULT layers and the layers these need. The whole map is
+** loaded the first time, without names, or when a name is no layer nor group
+** of the map. Enabled in mapserv with MS_MAP_LAZY_LAYERS=ON.
+*/
+mapObj *msLoadMapLayers(char *filename, char **names, int numnames)
+{
+  struct stat sStat;
+  mapTokenStreamObj *stream, replay;
+  layerIndexObj *index = NULL;
+  mapObj *map;
+  int i, slot;
+
+  if( !filename || stat(filename, &sStat) != 0 )
+    return msLoadMap(filename, NULL); /* let msLoadMap() report the error */
+
+  msAcquireLock( TLOCK_MAPCACHE );
+  for( i = 0; i < layerIndexCacheCount; i++ ) {
+    if( strcmp(layerIndexCache[i].filename, filename) != 0 )
+      continue;
+    if( layerIndexCache[i].mtime == sStat.st_mtime && layerIndexCache[i].size == sStat.st_size ) {
+      /* hold a reference so that the tokens can be replayed outside of the lock */
+      index = layerIndexCache[i].index;
+      index->refcount++;
+      layerIndexCache[i].last_used = ++layerIndexCacheClock;
+    } else
+      msLayerIndexCacheRemove(i); /* the mapfile has been modified */
+    break;
+  }
+  msReleaseLock( TLOCK_MAPCACHE );
+
+  if( index ) {
+    replay = *(index->stream);
+    replay.next = 0;
+    replay.replay = MS_TRUE;
+    replay.indexlayers = MS_FALSE;
+    replay.nextskip = 0;
+    replay.numskips = 0;
+    replay.skips = NULL;
+    if( numnames > 0 )
+      replay.skips = msSelectIndexedLayers(index, names, numnames, &replay.numskips);
+
+    map = msLoadMapFile(filename, NULL, &replay);
+
+    if( map && msGetGlobalDebugLevel() >= MS_DEBUGLEVEL_TUNING )
+      msDebug("msLoadMapLayers(): %d of %d layers loaded.\n", map->numlayers, index->numlayers);
+    msFree(replay.skips);
+    msAcquireLock( TLOCK_MAPCACHE );
+    msReleaseLayerIndex(index);
+    msReleaseLock( TLOCK_MAPCACHE );
+    return map;
+  }
+
+  stream = (mapTokenStreamObj *) msSmallCalloc(1, sizeof(mapTokenStreamObj));
+  stream->indexlayers = MS_TRUE;
+  map = msLoadMapFile(filename, NULL, stream);
+  if( !map ) {
+    msFreeMapTokenStream(stream);
+    return NULL;
+  }
+  stream->indexlayers = MS_FALSE;
+
+  index = msBuildLayerIndex(map, stream);
+  if( !index ) {
+    msFreeMapTokenStream(stream);
+    return map;
+  }
+
+  msAcquireLock( TLOCK_MAPCACHE );
+  for( i = 0; i < layerIndexCacheCount; i++ ) {
+    if( strcmp(layerIndexCache[i].filename, filename) == 0 )
+      break;
+  }
+  if( i < layerIndexCacheCount ) {
+    /* indexed by another thread in the meantime */
+    msReleaseLayerIndex(index);
+  } else {
+    if( layerIndexCacheCount == MS_MAP_CACHE_MAX ) {
+      slot = 0;
+      for( i = 1; i < layerIndexCacheCount; i++ ) {
+        if( layerIndexCache[i].last_used < layerIndexCache[slot].last_used )
+          slot = i;
+      }
+      msLayerIndexCacheRemove(slot);
+    }
+    layerIndexCache[layerIndexCacheCount].filename = msStrdup(filename);
+    layerIndexCache[layerIndexCacheCount].mtime = sStat.st_mtime;
+    layerIndexCache[layerIndexCacheCount].size = sStat.st_size;
+    layerIndexCache[layerIndexCacheCount].last_used = ++layerIndexCacheClock;
+    layerIndexCache[layerIndexCacheCount].index = index;
+    layerIndexCacheCount++;
+  }
+  msReleaseLock( TLOCK_MAPCACHE );
+
+  return map;
+}
+
 /*
 ** Loads mapfile snippets via a URL (only via the CGI so don't worry about thread locks)
 */
@@ -7252,8 +8007,8 @@ static char **tokenizeMapInternal(char *filename, int *ret_numtokens)
   /*
   ** Check map filename to make sure it's legal
   */
-  if(getenv("MS_MAPFILE_PATTERN")) { /* user override */
-    if(msEvalRegex(getenv("MS_MAPFILE_PATTERN"), filename) != MS_TRUE) {
+  if(msIO_getenv("MS_MAPFILE_PATTERN")) { /* user override */
+    if(msEvalRegex(msIO_getenv("MS_MAPFILE_PATTERN"), filename) != MS_TRUE) {
       msSetError(MS_REGEXERR, "MS_MAPFILE_PATTERN validation failed." , "msLoadMap()");
       return(NULL);
     }
@@ -7375,6 +8130,7 @@ void initResultCache(resultCacheObj *resultcache)
     resultcache->results = NULL;
     resultcache->numresults = 0;
     resultcache->cachesize = 0;
+    resultcache->mapping = NULL;
     resultcache->bounds.minx = resultcache->bounds.miny = resultcache->bounds.maxx = resultcache->bounds.maxy = -1;
     resultcache->previousBounds = resultcache->bounds;
     resultcache->usegetshape = MS_FALSE;
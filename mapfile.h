@@ -34,6 +34,41 @@
 enum MS_LEXER_STATES {MS_TOKENIZE_DEFAULT=0, MS_TOKENIZE_FILE, MS_TOKENIZE_STRING, MS_TOKENIZE_EXPRESSION, MS_TOKENIZE_URL_VARIABLE, MS_TOKENIZE_URL_STRING, MS_TOKENIZE_VALUE, MS_TOKENIZE_NAME};
 enum MS_TOKEN_SOURCES {MS_FILE_TOKENS=0, MS_STRING_TOKENS, MS_URL_TOKENS};
 
+/*
+** Tokens scanned from a mapfile (and its includes and symbolset) in the order
+** the parser read them, saved by msSaveCompiledMap() and replayed by the lexer
+** when msLoadMap() reads the compiled file.
+*/
+typedef struct {
+  int token;
+  int lineno;
+  int string; /* offset of the token text in the strings */
+  int length;
+  double number;
+} mapTokenObj;
+
+typedef struct {
+  int first, last; /* indexes of the first and last tokens */
+} mapTokenRangeObj;
+
+typedef struct {
+  mapTokenObj *tokens;
+  int numtokens, maxtokens;
+  char *strings;
+  int stringsize, maxstringsize;
+  int next;   /* next token to replay */
+  int replay; /* MS_TRUE to replay the tokens, MS_FALSE to record them */
+
+  /* with indexlayers the parser notes the tokens of each LAYER block */
+  int indexlayers;
+  mapTokenRangeObj *layers;
+  int numlayers, maxlayers;
+
+  /* ranges left out when replaying, in order (see msLoadMapLayers()) */
+  mapTokenRangeObj *skips;
+  int numskips, nextskip;
+} mapTokenStreamObj;
+
 /*
 ** Keyword definitions for the mapfiles and symbolfiles (used by lexer)
 */
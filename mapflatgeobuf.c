@@ -0,0 +1,1187 @@
+/******************************************************************************
+ * $Id$
+ *
+ * Project:  MapServer
+ * Purpose:  Native FlatGeobuf layer support.
+ * Author:   MapServer team.
+ *
+ ******************************************************************************
+ * Copyright (c) 1996-2019 Regents of the University of Minnesota.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies of this Software or works derived from this Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ ****************************************************************************/
+
+/*
+** A layer whose DATA names a FlatGeobuf (.fgb) file is read natively, without
+** going through OGR: the file is mapped into memory, the packed Hilbert R-tree
+** that follows the header is searched for the features overlapping the request
+** and these are decoded from their flatbuffers straight into shapeObjs. Files
+** without an index are scanned sequentially.
+*/
+
+#include <assert.h>
+#include <float.h>
+#include <limits.h>
+#include "mapserver.h"
+#include "mapows.h"
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#endif
+
+/* FlatGeobuf geometry types */
+#define FGB_UNKNOWN 0
+#define FGB_POINT 1
+#define FGB_LINESTRING 2
+#define FGB_POLYGON 3
+#define FGB_MULTIPOINT 4
+#define FGB_MULTILINESTRING 5
+#define FGB_MULTIPOLYGON 6
+#define FGB_GEOMETRYCOLLECTION 7
+
+/* FlatGeobuf column types */
+#define FGB_BYTE 0
+#define FGB_UBYTE 1
+#define FGB_BOOL 2
+#define FGB_SHORT 3
+#define FGB_USHORT 4
+#define FGB_INT 5
+#define FGB_UINT 6
+#define FGB_LONG 7
+#define FGB_ULONG 8
+#define FGB_FLOAT 9
+#define FGB_DOUBLE 10
+#define FGB_STRING 11
+#define FGB_JSON 12
+#define FGB_DATETIME 13
+#define FGB_BINARY 14
+
+#define FGB_NODE_ITEM_SIZE 40 /* minx, miny, maxx, maxy, offset */
+#define FGB_MAX_LEVELS 64
+#define FGB_MAX_NESTING 8 /* of the parts of geometry collections */
+
+/* a table of a flatbuffer */
+typedef struct {
+  const uchar *buf;
+  size_t size;
+  size_t pos;    /* of the table */
+  size_t vtable; /* its field offsets */
+  int vtsize;
+} fgbTableObj;
+
+typedef struct {
+  size_t offset; /* of the feature, from the start of the features */
+  long index;    /* its position in the file */
+} fgbResultObj;
+
+typedef struct {
+  uchar *data;
+  size_t size;
+  int mapped;
+
+  /* from the header */
+  int geometrytype;
+  int hasz, hasm;
+  int numcolumns;
+  char **columnnames;
+  int *columntypes;
+  int *columnwidths;
+  int *columnprecisions;
+  long numfeatures;
+  int nodesize;
+  int crscode;
+  rectObj bounds;
+
+  size_t indexoffset; /* 0 if the file has no index */
+  size_t featuresoffset;
+  int numlevels;
+  size_t levelstart[FGB_MAX_LEVELS], levelend[FGB_MAX_LEVELS]; /* in nodes, leaves first */
+
+  /* features selected by msFlatGeobufLayerWhichShapes() */
+  fgbResultObj *results;
+  int numresults, maxresults, nextresult;
+  int scanning;    /* no index: the features are read one after another */
+  size_t scanoffset;
+  long scanindex;
+  rectObj searchrect;
+
+  size_t *featureoffsets; /* no index: filled on the first random access */
+} msFlatGeobufLayerInfo;
+
+/************************************************************************/
+/*                         flatbuffer helpers                           */
+/************************************************************************/
+
+static ms_uint32 fgbUInt32(const uchar *p)
+{
+  return (ms_uint32) p[0] | ((ms_uint32) p[1] << 8) | ((ms_uint32) p[2] << 16) | ((ms_uint32) p[3] << 24);
+}
+
+static unsigned long long fgbUInt64(const uchar *p)
+{
+  return (unsigned long long) fgbUInt32(p) | ((unsigned long long) fgbUInt32(p + 4) << 32);
+}
+
+static double fgbDouble(const uchar *p)
+{
+  unsigned long long bits = fgbUInt64(p);
+  double d;
+
+  memcpy(&d, &bits, sizeof(d));
+  return d;
+}
+
+static float fgbFloat(const uchar *p)
+{
+  ms_uint32 bits = fgbUInt32(p);
+  float f;
+
+  memcpy(&f, &bits, sizeof(f));
+  return f;
+}
+
+static int fgbTableAt(const uchar *buf, size_t size, size_t pos, fgbTableObj *table)
+{
+  long long vtable;
+
+  if(pos + 4 > size)
+    return MS_FAILURE;
+  vtable = (long long) pos - (ms_int32) fgbUInt32(buf + pos);
+  if(vtable < 0 || (size_t) vtable + 4 > size)
+    return MS_FAILURE;
+
+  table->buf = buf;
+  table->size = size;
+  table->pos = pos;
+  table->vtable = (size_t) vtable;
+  table->vtsize = buf[vtable] | (buf[vtable + 1] << 8);
+  if(table->vtsize < 4 || table->vtable + table->vtsize > size)
+    return MS_FAILURE;
+
+  return MS_SUCCESS;
+}
+
+/* the root table of a flatbuffer */
+static int fgbRoot(const uchar *buf, size_t size, fgbTableObj *table)
+{
+  if(size < 4)
+    return MS_FAILURE;
+  return fgbTableAt(buf, size, fgbUInt32(buf), table);
+}
+
+/* position of field id of the table, 0 if it is absent */
+static size_t fgbField(const fgbTableObj *table, int id, int width)
+{
+  size_t entry = table->vtable + 4 + 2 * id;
+  int offset;
+
+  if(entry + 2 > table->vtable + table->vtsize)
+    return 0;
+  offset = table->buf[entry] | (table->buf[entry + 1] << 8);
+  if(offset == 0 || table->pos + offset + width > table->size)
+    return 0;
+
+  return table->pos + offset;
+}
+
+static int fgbGetUByte(const fgbTableObj *table, int id, int defaultvalue)
+{
+  size_t pos = fgbField(table, id, 1);
+  return pos ? table->buf[pos] : defaultvalue;
+}
+
+static int fgbGetUShort(const fgbTableObj *table, int id, int defaultvalue)
+{
+  size_t pos = fgbField(table, id, 2);
+  return pos ? table->buf[pos] | (table->buf[pos + 1] << 8) : defaultvalue;
+}
+
+static int fgbGetInt(const fgbTableObj *table, int id, int defaultvalue)
+{
+  size_t pos = fgbField(table, id, 4);
+  return pos ? (ms_int32) fgbUInt32(table->buf + pos) : defaultvalue;
+}
+
+static unsigned long long fgbGetULong(const fgbTableObj *table, int id)
+{
+  size_t pos = fgbField(table, id, 8);
+  return pos ? fgbUInt64(table->buf + pos) : 0;
+}
+
+/* what the offset in field id points to, 0 if the field is absent */
+static size_t fgbGetOffset(const fgbTableObj *table, int id)
+{
+  size_t pos = fgbField(table, id, 4), target;
+
+  if(!pos)
+    return 0;
+  target = pos + fgbUInt32(table->buf + pos);
+  return target < table->size ? target : 0;
+}
+
+/* a vector of length elements of elementsize bytes, starting at *data */
+static int fgbGetVector(const fgbTableObj *table, int id, int elementsize, size_t *data, ms_uint32 *length)
+{
+  size_t pos = fgbGetOffset(table, id);
+
+  *length = 0;
+  if(!pos || pos + 4 > table->size)
+    return MS_FAILURE;
+  *length = fgbUInt32(table->buf + pos);
+  if((table->size - pos - 4) / elementsize < *length) {
+    *length = 0;
+    return MS_FAILURE;
+  }
+  *data = pos + 4;
+
+  return MS_SUCCESS;
+}
+
+static char *fgbGetString(const fgbTableObj *table, int id)
+{
+  size_t data;
+  ms_uint32 length;
+  char *string;
+
+  if(fgbGetVector(table, id, 1, &data, &length) != MS_SUCCESS)
+    return NULL;
+  string = (char *) msSmallMalloc(length + 1);
+  memcpy(string, table->buf + data, length);
+  string[length] = '\0';
+
+  return string;
+}
+
+static int fgbGetTable(const fgbTableObj *table, int id, fgbTableObj *subtable)
+{
+  size_t pos = fgbGetOffset(table, id);
+
+  if(!pos)
+    return MS_FAILURE;
+  return fgbTableAt(table->buf, table->size, pos, subtable);
+}
+
+/* element i of a vector of tables starting at data */
+static int fgbGetVectorTable(const fgbTableObj *table, size_t data, ms_uint32 i, fgbTableObj *subtable)
+{
+  size_t element = data + 4 * (size_t) i;
+
+  return fgbTableAt(table->buf, table->size, element + fgbUInt32(table->buf + element), subtable);
+}
+
+/************************************************************************/
+/*                          header and index                            */
+/************************************************************************/
+
+static void msFlatGeobufFreeLayerInfo(msFlatGeobufLayerInfo *info)
+{
+  int i;
+
+  if(info->data) {
+#ifdef HAVE_MMAP
+    if(info->mapped)
+      munmap(info->data, info->size);
+    else
+#endif
+      free(info->data);
+  }
+  for(i=0; i<info->numcolumns; i++)
+    free(info->columnnames[i]);
+  free(info->columnnames);
+  free(info->columntypes);
+  free(info->columnwidths);
+  free(info->columnprecisions);
+  free(info->results);
+  free(info->featureoffsets);
+  free(info);
+}
+
+/* maps (or reads) the whole file */
+static int msFlatGeobufLoadFile(msFlatGeobufLayerInfo *info, const char *path)
+{
+  FILE *fp;
+  struct stat st;
+
+  if((fp = fopen(path, "rb")) == NULL)
+    return MS_FAILURE;
+  if(fstat(fileno(fp), &st) != 0 || st.st_size <= 0) {
+    fclose(fp);
+    return MS_FAILURE;
+  }
+  info->size = (size_t) st.st_size;
+
+#ifdef HAVE_MMAP
+  info->data = (uchar *) mmap(NULL, info->size, PROT_READ, MAP_SHARED, fileno(fp), 0);
+  if(info->data != (uchar *) MAP_FAILED) {
+    info->mapped = MS_TRUE;
+    fclose(fp);
+    return MS_SUCCESS;
+  }
+#endif
+
+  info->data = (uchar *) malloc(info->size);
+  if(info->data == NULL || fread(info->data, 1, info->size, fp) != info->size) {
+    free(info->data);
+    info->data = NULL;
+    fclose(fp);
+    return MS_FAILURE;
+  }
+  fclose(fp);
+
+  return MS_SUCCESS;
+}
+
+/* level bounds of the packed Hilbert R-tree, as laid out by the writers */
+static int msFlatGeobufInitIndex(msFlatGeobufLayerInfo *info, size_t headerend)
+{
+  size_t n = info->numfeatures, numnodes = n, levelnumnodes[FGB_MAX_LEVELS];
+  int i;
+
+  info->numlevels = 0;
+  levelnumnodes[info->numlevels++] = n;
+  do {
+    if(info->numlevels == FGB_MAX_LEVELS)
+      return MS_FAILURE;
+    n = (n + info->nodesize - 1) / info->nodesize;
+    numnodes += n;
+    levelnumnodes[info->numlevels++] = n;
+  } while(n != 1);
+
+  n = numnodes;
+  for(i=0; i<info->numlevels; i++) {
+    n -= levelnumnodes[i];
+    info->levelstart[i] = n;
+    info->levelend[i] = n + levelnumnodes[i];
+  }
+
+  if((info->size - headerend) / FGB_NODE_ITEM_SIZE < numnodes)
+    return MS_FAILURE;
+  info->indexoffset = headerend;
+  info->featuresoffset = headerend + numnodes * FGB_NODE_ITEM_SIZE;
+
+  return MS_SUCCESS;
+}
+
+static int msFlatGeobufReadHeader(msFlatGeobufLayerInfo *info)
+{
+  static const uchar magic[] = { 'f', 'g', 'b', 3, 'f', 'g', 'b' };
+  fgbTableObj header, crs;
+  size_t data, headerend;
+  ms_uint32 length, i;
+
+  if(info->size < 12 || memcmp(info->data, magic, sizeof(magic)) != 0)
+    return MS_FAILURE;
+  length = fgbUInt32(info->data + 8);
+  if(length > info->size - 12 || fgbRoot(info->data + 12, length, &header) != MS_SUCCESS)
+    return MS_FAILURE;
+  headerend = 12 + (size_t) length;
+
+  info->geometrytype = fgbGetUByte(&header, 2, FGB_UNKNOWN);
+  info->hasz = fgbGetUByte(&header, 3, 0);
+  info->hasm = fgbGetUByte(&header, 4, 0);
+  info->numfeatures = (long) fgbGetULong(&header, 8);
+  info->nodesize = fgbGetUShort(&header, 9, 16);
+  if(info->numfeatures < 0)
+    return MS_FAILURE;
+
+  if(fgbGetVector(&header, 7, 4, &data, &length) == MS_SUCCESS && length > 0) {
+    info->columnnames = (char **) msSmallCalloc(length, sizeof(char *));
+    info->columntypes = (int *) msSmallMalloc(length * sizeof(int));
+    info->columnwidths = (int *) msSmallMalloc(length * sizeof(int));
+    info->columnprecisions = (int *) msSmallMalloc(length * sizeof(int));
+    for(i=0; i<length; i++) {
+      fgbTableObj column;
+
+      if(fgbGetVectorTable(&header, data, i, &column) != MS_SUCCESS ||
+          (info->columnnames[i] = fgbGetString(&column, 0)) == NULL)
+        return MS_FAILURE;
+      info->numcolumns++;
+      info->columntypes[i] = fgbGetUByte(&column, 1, FGB_STRING);
+      info->columnwidths[i] = fgbGetInt(&column, 4, -1);
+      info->columnprecisions[i] = fgbGetInt(&column, 5, -1);
+    }
+  }
+
+  if(fgbGetTable(&header, 10, &crs) == MS_SUCCESS)
+    info->crscode = fgbGetInt(&crs, 1, 0);
+
+  info->bounds.minx = info->bounds.miny = -1;
+  info->bounds.maxx = info->bounds.maxy = -2; /* unknown */
+  if(fgbGetVector(&header, 1, 8, &data, &length) == MS_SUCCESS && length >= 4) {
+    info->bounds.minx = fgbDouble(header.buf + data);
+    info->bounds.miny = fgbDouble(header.buf + data + 8);
+    info->bounds.maxx = fgbDouble(header.buf + data + 16);
+    info->bounds.maxy = fgbDouble(header.buf + data + 24);
+  }
+
+  if(info->nodesize > 0 && info->numfeatures > 0) {
+    if(info->nodesize < 2 || msFlatGeobufInitIndex(info, headerend) != MS_SUCCESS)
+      return MS_FAILURE;
+    if(info->bounds.minx > info->bounds.maxx) { /* the root node bounds all */
+      const uchar *root = info->data + info->indexoffset;
+      info->bounds.minx = fgbDouble(root);
+      info->bounds.miny = fgbDouble(root + 8);
+      info->bounds.maxx = fgbDouble(root + 16);
+      info->bounds.maxy = fgbDouble(root + 24);
+    }
+  } else {
+    info->featuresoffset = headerend;
+  }
+
+  return MS_SUCCESS;
+}
+
+static void msFlatGeobufAddResult(msFlatGeobufLayerInfo *info, size_t offset, long index)
+{
+  if(info->numresults == info->maxresults) {
+    info->maxresults = info->maxresults ? info->maxresults * 2 : 256;
+    info->results = (fgbResultObj *) msSmallRealloc(info->results, info->maxresults * sizeof(fgbResultObj));
+  }
+  info->results[info->numresults].offset = offset;
+  info->results[info->numresults].index = index;
+  info->numresults++;
+}
+
+static int compareResults(const void *a, const void *b)
+{
+  const fgbResultObj *ra = (const fgbResultObj *) a, *rb = (const fgbResultObj *) b;
+
+  if(ra->offset != rb->offset)
+    return ra->offset < rb->offset ? -1 : 1;
+  return 0;
+}
+
+/* the features whose bounds overlap rect, in file order */
+static void msFlatGeobufSearchIndex(msFlatGeobufLayerInfo *info, rectObj rect)
+{
+  size_t *stack, pos, end, child;
+  int *levels, numstack = 0, maxstack = 64, level;
+
+  info->numresults = 0;
+  stack = (size_t *) msSmallMalloc(maxstack * sizeof(size_t));
+  levels = (int *) msSmallMalloc(maxstack * sizeof(int));
+  stack[numstack] = 0;
+  levels[numstack++] = info->numlevels - 1;
+
+  while(numstack > 0) {
+    numstack--;
+    pos = stack[numstack];
+    level = levels[numstack];
+    end = MS_MIN(pos + info->nodesize, info->levelend[level]);
+
+    for(; pos < end; pos++) {
+      const uchar *node = info->data + info->indexoffset + pos * FGB_NODE_ITEM_SIZE;
+
+      if(fgbDouble(node) > rect.maxx || fgbDouble(node + 8) > rect.maxy ||
+          fgbDouble(node + 16) < rect.minx || fgbDouble(node + 24) < rect.miny)
+        continue;
+
+      if(level == 0) {
+        msFlatGeobufAddResult(info, (size_t) fgbUInt64(node + 32), (long) (pos - info->levelstart[0]));
+        continue;
+      }
+
+      child = (size_t) fgbUInt64(node + 32);
+      if(child < info->levelstart[level - 1] || child >= info->levelend[level - 1])
+        continue; /* corrupt */
+      if(numstack == maxstack) {
+        maxstack *= 2;
+        stack = (size_t *) msSmallRealloc(stack, maxstack * sizeof(size_t));
+        levels = (int *) msSmallRealloc(levels, maxstack * sizeof(int));
+      }
+      stack[numstack] = child;
+      levels[numstack++] = level - 1;
+    }
+  }
+
+  free(stack);
+  free(levels);
+
+  if(info->numresults > 1)
+    qsort(info->results, info->numresults, sizeof(fgbResultObj), compareResults);
+}
+
+/************************************************************************/
+/*                              features                                */
+/************************************************************************/
+
+/* the feature at offset, into table; its size is stored in *next */
+static int msFlatGeobufFeatureAt(msFlatGeobufLayerInfo *info, size_t offset, fgbTableObj *feature, size_t *next)
+{
+  size_t pos = info->featuresoffset + offset;
+  ms_uint32 length;
+
+  if(pos < info->featuresoffset || pos + 4 > info->size)
+    return MS_FAILURE;
+  length = fgbUInt32(info->data + pos);
+  if(length > info->size - pos - 4)
+    return MS_FAILURE;
+  if(next)
+    *next = offset + 4 + length;
+
+  return fgbRoot(info->data + pos + 4, length, feature);
+}
+
+static void msFlatGeobufAddLine(shapeObj *shape, const fgbTableObj *geometry, size_t xy,
+                                size_t z, ms_uint32 numz, size_t m, ms_uint32 numm,
+                                ms_uint32 first, ms_uint32 last)
+{
+  lineObj line;
+  ms_uint32 i;
+
+  if(last <= first)
+    return;
+  line.numpoints = last - first;
+  line.point = (pointObj *) msSmallMalloc(line.numpoints * sizeof(pointObj));
+  for(i=first; i<last; i++) {
+    pointObj *point = &line.point[i - first];
+
+    point->x = fgbDouble(geometry->buf + xy + 16 * (size_t) i);
+    point->y = fgbDouble(geometry->buf + xy + 16 * (size_t) i + 8);
+#ifdef USE_POINT_Z_M
+    point->z = i < numz ? fgbDouble(geometry->buf + z + 8 * (size_t) i) : 0;
+    point->m = i < numm ? fgbDouble(geometry->buf + m + 8 * (size_t) i) : 0;
+#else
+    (void) z;
+    (void) numz;
+    (void) m;
+    (void) numm;
+#endif
+  }
+  msAddLineDirectly(shape, &line);
+}
+
+/* adds the lines of a geometry to shape, MS_FAILURE if the geometry type isn't supported */
+static int msFlatGeobufAddGeometry(shapeObj *shape, const fgbTableObj *geometry, int type, int depth)
+{
+  size_t xy = 0, z = 0, m = 0, ends = 0, parts = 0;
+  ms_uint32 numxy, numz, numm, numends, numparts, i, first;
+  int shapetype;
+
+  if(type == FGB_UNKNOWN || type == FGB_GEOMETRYCOLLECTION)
+    type = fgbGetUByte(geometry, 6, FGB_UNKNOWN);
+
+  switch(type) {
+    case FGB_POINT:
+    case FGB_MULTIPOINT:
+      shapetype = MS_SHAPE_POINT;
+      break;
+    case FGB_LINESTRING:
+    case FGB_MULTILINESTRING:
+      shapetype = MS_SHAPE_LINE;
+      break;
+    case FGB_POLYGON:
+      shapetype = MS_SHAPE_POLYGON;
+      break;
+    case FGB_MULTIPOLYGON:
+    case FGB_GEOMETRYCOLLECTION:
+      if(depth >= FGB_MAX_NESTING || fgbGetVector(geometry, 7, 4, &parts, &numparts) != MS_SUCCESS)
+        return MS_FAILURE;
+      for(i=0; i<numparts; i++) {
+        fgbTableObj part;
+
+        if(fgbGetVectorTable(geometry, parts, i, &part) != MS_SUCCESS ||
+            msFlatGeobufAddGeometry(shape, &part, type == FGB_MULTIPOLYGON ? FGB_POLYGON : FGB_UNKNOWN,
+                                    depth + 1) != MS_SUCCESS)
+          return MS_FAILURE;
+      }
+      return MS_SUCCESS;
+    default: /* curves, surfaces... */
+      return MS_FAILURE;
+  }
+
+  /* the parts of a collection are all drawn as its first one */
+  if(shape->type == MS_SHAPE_NULL)
+    shape->type = shapetype;
+
+  if(fgbGetVector(geometry, 1, 8, &xy, &numxy) != MS_SUCCESS || numxy < 2)
+    return MS_SUCCESS; /* empty */
+  numxy /= 2; /* points */
+  fgbGetVector(geometry, 2, 8, &z, &numz);
+  fgbGetVector(geometry, 3, 8, &m, &numm);
+
+  if(shapetype == MS_SHAPE_POINT ||
+      fgbGetVector(geometry, 0, 4, &ends, &numends) != MS_SUCCESS || numends < 2) {
+    msFlatGeobufAddLine(shape, geometry, xy, z, numz, m, numm, 0, numxy);
+    return MS_SUCCESS;
+  }
+
+  first = 0;
+  for(i=0; i<numends; i++) {
+    ms_uint32 end = MS_MIN(fgbUInt32(geometry->buf + ends + 4 * (size_t) i), numxy);
+
+    msFlatGeobufAddLine(shape, geometry, xy, z, numz, m, numm, first, end);
+    first = MS_MAX(first, end);
+  }
+
+  return MS_SUCCESS;
+}
+
+static char *msFlatGeobufFormatValue(const uchar *p, int type, ms_uint32 length)
+{
+  char buffer[64], *value;
+
+  switch(type) {
+    case FGB_BYTE:
+      snprintf(buffer, sizeof(buffer), "%d", (signed char) p[0]);
+      break;
+    case FGB_UBYTE:
+    case FGB_BOOL:
+      snprintf(buffer, sizeof(buffer), "%d", p[0]);
+      break;
+    case FGB_SHORT:
+      snprintf(buffer, sizeof(buffer), "%d", (short) (p[0] | (p[1] << 8)));
+      break;
+    case FGB_USHORT:
+      snprintf(buffer, sizeof(buffer), "%d", p[0] | (p[1] << 8));
+      break;
+    case FGB_INT:
+      snprintf(buffer, sizeof(buffer), "%d", (int) (ms_int32) fgbUInt32(p));
+      break;
+    case FGB_UINT:
+      snprintf(buffer, sizeof(buffer), "%u", (unsigned int) fgbUInt32(p));
+      break;
+    case FGB_LONG:
+      snprintf(buffer, sizeof(buffer), "%lld", (long long) fgbUInt64(p));
+      break;
+    case FGB_ULONG:
+      snprintf(buffer, sizeof(buffer), "%llu", fgbUInt64(p));
+      break;
+    case FGB_FLOAT:
+      snprintf(buffer, sizeof(buffer), "%.8g", fgbFloat(p));
+      break;
+    case FGB_DOUBLE:
+      snprintf(buffer, sizeof(buffer), "%.15g", fgbDouble(p));
+      break;
+    case FGB_STRING:
+    case FGB_JSON:
+    case FGB_DATETIME:
+      value = (char *) msSmallMalloc(length + 1);
+      memcpy(value, p, length);
+      value[length] = '\0';
+      return value;
+    default: /* binary */
+      buffer[0] = '\0';
+      break;
+  }
+
+  return msStrdup(buffer);
+}
+
+/* size in the properties of a value of type, with its length prefix */
+static size_t msFlatGeobufValueSize(int type)
+{
+  switch(type) {
+    case FGB_BYTE:
+    case FGB_UBYTE:
+    case FGB_BOOL:
+      return 1;
+    case FGB_SHORT:
+    case FGB_USHORT:
+      return 2;
+    case FGB_INT:
+    case FGB_UINT:
+    case FGB_FLOAT:
+      return 4;
+    case FGB_LONG:
+    case FGB_ULONG:
+    case FGB_DOUBLE:
+      return 8;
+    default:
+      return 4;
+  }
+}
+
+static void msFlatGeobufReadValues(layerObj *layer, msFlatGeobufLayerInfo *info, const fgbTableObj *feature, shapeObj *shape)
+{
+  int *iteminfo = (int *) layer->iteminfo;
+  size_t data, pos, end, size;
+  ms_uint32 length;
+  int i;
+
+  if(layer->numitems == 0 || !iteminfo)
+    return;
+
+  shape->values = (char **) msSmallCalloc(layer->numitems, sizeof(char *));
+  shape->numvalues = layer->numitems;
+
+  if(fgbGetVector(feature, 1, 1, &data, &length) == MS_SUCCESS) {
+    pos = data;
+    end = data + length;
+    while(pos + 2 <= end) {
+      int column = feature->buf[pos] | (feature->buf[pos + 1] << 8), type;
+      ms_uint32 valuelength = 0;
+
+      pos += 2;
+      if(column >= info->numcolumns)
+        break; /* corrupt */
+      type = info->columntypes[column];
+      size = msFlatGeobufValueSize(type);
+      if(pos + size > end)
+        break;
+      if(type >= FGB_STRING) {
+        valuelength = fgbUInt32(feature->buf + pos);
+        pos += 4;
+        if(valuelength > end - pos)
+          break;
+        size = valuelength;
+      }
+      for(i=0; i<layer->numitems; i++) {
+        if(iteminfo[i] == column && shape->values[i] == NULL)
+          shape->values[i] = msFlatGeobufFormatValue(feature->buf + pos, type, valuelength);
+      }
+      pos += size;
+    }
+  }
+
+  /* missing (null) values */
+  for(i=0; i<layer->numitems; i++) {
+    if(shape->values[i] == NULL)
+      shape->values[i] = msStrdup("");
+  }
+}
+
+static int msFlatGeobufReadShape(layerObj *layer, msFlatGeobufLayerInfo *info, const fgbTableObj *feature, long index, shapeObj *shape)
+{
+  fgbTableObj geometry;
+
+  msInitShape(shape);
+  shape->index = index;
+
+  if(fgbGetTable(feature, 0, &geometry) != MS_SUCCESS ||
+      msFlatGeobufAddGeometry(shape, &geometry, info->geometrytype, 0) != MS_SUCCESS ||
+      shape->numlines == 0) {
+    msFreeShape(shape);
+    shape->index = index;
+    shape->type = MS_SHAPE_NULL;
+    return MS_SUCCESS;
+  }
+  msComputeBounds(shape);
+  msFlatGeobufReadValues(layer, info, feature, shape);
+
+  return MS_SUCCESS;
+}
+
+/* the offsets of all the features of a file without an index */
+static int msFlatGeobufScanOffsets(msFlatGeobufLayerInfo *info)
+{
+  size_t offset = 0, next;
+  long i;
+  fgbTableObj feature;
+
+  if(info->featureoffsets)
+    return MS_SUCCESS;
+
+  info->featureoffsets = (size_t *) msSmallMalloc((info->numfeatures + 1) * sizeof(size_t));
+  for(i=0; i<info->numfeatures; i++) {
+    if(msFlatGeobufFeatureAt(info, offset, &feature, &next) != MS_SUCCESS)
+      break;
+    info->featureoffsets[i] = offset;
+    offset = next;
+  }
+  info->numfeatures = i;
+
+  return MS_SUCCESS;
+}
+
+/************************************************************************/
+/*                           layer functions                            */
+/************************************************************************/
+
+int msFlatGeobufLayerOpen(layerObj *layer)
+{
+  char szPath[MS_MAXPATHLEN];
+  msFlatGeobufLayerInfo *info;
+
+  if(layer->layerinfo) return MS_SUCCESS; /* layer already open */
+
+  if(msCheckParentPointer(layer->map, "map") == MS_FAILURE)
+    return MS_FAILURE;
+
+  info = (msFlatGeobufLayerInfo *) msSmallCalloc(1, sizeof(msFlatGeobufLayerInfo));
+
+  if(msFlatGeobufLoadFile(info, msBuildPath3(szPath, layer->map->mappath, layer->map->shapepath, layer->data)) != MS_SUCCESS &&
+      msFlatGeobufLoadFile(info, msBuildPath(szPath, layer->map->mappath, layer->data)) != MS_SUCCESS) {
+    msSetError(MS_IOERR, "(%s)", "msFlatGeobufLayerOpen()", layer->data);
+    msFlatGeobufFreeLayerInfo(info);
+    return MS_FAILURE;
+  }
+
+  if(msFlatGeobufReadHeader(info) != MS_SUCCESS) {
+    msSetError(MS_IOERR, "%s is not a valid FlatGeobuf file.", "msFlatGeobufLayerOpen()", szPath);
+    msFlatGeobufFreeLayerInfo(info);
+    return MS_FAILURE;
+  }
+
+  if(layer->debug)
+    msDebug("msFlatGeobufLayerOpen(): %s, %ld features, %s.\n", szPath, info->numfeatures,
+            info->indexoffset ? "indexed" : "not indexed");
+
+  if(layer->projection.numargs > 0 && EQUAL(layer->projection.args[0], "auto")) {
+    if(info->crscode > 0) {
+      char epsg[32];
+
+      snprintf(epsg, sizeof(epsg), "EPSG:%d", info->crscode);
+      if(msLoadProjectionString(&(layer->projection), epsg) != 0) {
+        msFlatGeobufFreeLayerInfo(info);
+        return MS_FAILURE;
+      }
+    } else if(layer->debug || layer->map->debug) {
+      msDebug("Unable to get SRS from FlatGeobuf '%s' for layer '%s'.\n", szPath, layer->name);
+    }
+  }
+
+  layer->layerinfo = info;
+
+  return MS_SUCCESS;
+}
+
+int msFlatGeobufLayerIsOpen(layerObj *layer)
+{
+  return layer->layerinfo ? MS_TRUE : MS_FALSE;
+}
+
+int msFlatGeobufLayerClose(layerObj *layer)
+{
+  if(!layer->layerinfo) return MS_SUCCESS; /* nothing to do */
+
+  msFlatGeobufFreeLayerInfo((msFlatGeobufLayerInfo *) layer->layerinfo);
+  layer->layerinfo = NULL;
+
+  return MS_SUCCESS;
+}
+
+int msFlatGeobufLayerInitItemInfo(layerObj *layer)
+{
+  msFlatGeobufLayerInfo *info = (msFlatGeobufLayerInfo *) layer->layerinfo;
+  int i, j, *itemindexes;
+
+  if(!info) {
+    msSetError(MS_MISCERR, "FlatGeobuf layer has not been opened.", "msFlatGeobufLayerInitItemInfo()");
+    return MS_FAILURE;
+  }
+
+  msFree(layer->iteminfo);
+  layer->iteminfo = NULL;
+  if(layer->numitems == 0)
+    return MS_SUCCESS;
+
+  itemindexes = (int *) msSmallMalloc(sizeof(int) * layer->numitems);
+  for(i=0; i<layer->numitems; i++) {
+    for(j=0; j<info->numcolumns; j++) {
+      if(strcasecmp(layer->items[i], info->columnnames[j]) == 0)
+        break;
+    }
+    if(j == info->numcolumns) {
+      msSetError(MS_MISCERR, "Item '%s' not found in FlatGeobuf layer %s.", "msFlatGeobufLayerInitItemInfo()",
+                 layer->items[i], layer->name ? layer->name : "(null)");
+      free(itemindexes);
+      return MS_FAILURE;
+    }
+    itemindexes[i] = j;
+  }
+  layer->iteminfo = itemindexes;
+
+  return MS_SUCCESS;
+}
+
+void msFlatGeobufLayerFreeItemInfo(layerObj *layer)
+{
+  msFree(layer->iteminfo);
+  layer->iteminfo = NULL;
+}
+
+static void msFlatGeobufPassThroughFieldDefinitions(layerObj *layer, msFlatGeobufLayerInfo *info)
+{
+  int i;
+
+  for(i=0; i<info->numcolumns; i++) {
+    char md_item_name[256];
+    char gml_width[32], gml_precision[32];
+    const char *gml_type = NULL;
+    const char *item = info->columnnames[i];
+
+    gml_width[0] = '\0';
+    gml_precision[0] = '\0';
+
+    switch(info->columntypes[i]) {
+      case FGB_BYTE:
+      case FGB_UBYTE:
+      case FGB_BOOL:
+      case FGB_SHORT:
+      case FGB_USHORT:
+      case FGB_INT:
+        gml_type = "Integer";
+        break;
+      case FGB_UINT:
+      case FGB_LONG:
+      case FGB_ULONG:
+        gml_type = "Long";
+        break;
+      case FGB_FLOAT:
+      case FGB_DOUBLE:
+        gml_type = "Real";
+        if(info->columnprecisions[i] > 0)
+          sprintf(gml_precision, "%d", info->columnprecisions[i]);
+        break;
+      case FGB_DATETIME:
+        gml_type = "Date";
+        break;
+      default:
+        gml_type = "Character";
+        break;
+    }
+    if(info->columnwidths[i] > 0)
+      sprintf(gml_width, "%d", info->columnwidths[i]);
+
+    snprintf(md_item_name, sizeof(md_item_name), "gml_%s_type", item);
+    if(msOWSLookupMetadata(&(layer->metadata), "G", "type") == NULL)
+      msInsertHashTable(&(layer->metadata), md_item_name, gml_type);
+
+    snprintf(md_item_name, sizeof(md_item_name), "gml_%s_width", item);
+    if(strlen(gml_width) > 0
+        && msOWSLookupMetadata(&(layer->metadata), "G", "width") == NULL)
+      msInsertHashTable(&(layer->metadata), md_item_name, gml_width);
+
+    snprintf(md_item_name, sizeof(md_item_name), "gml_%s_precision", item);
+    if(strlen(gml_precision) > 0
+        && msOWSLookupMetadata(&(layer->metadata), "G", "precision") == NULL)
+      msInsertHashTable(&(layer->metadata), md_item_name, gml_precision);
+  }
+}
+
+int msFlatGeobufLayerGetItems(layerObj *layer)
+{
+  msFlatGeobufLayerInfo *info = (msFlatGeobufLayerInfo *) layer->layerinfo;
+  const char *value;
+  int i;
+
+  if(!info) {
+    msSetError(MS_MISCERR, "FlatGeobuf layer has not been opened.", "msFlatGeobufLayerGetItems()");
+    return MS_FAILURE;
+  }
+
+  layer->numitems = info->numcolumns;
+  if(layer->numitems == 0) return MS_SUCCESS;
+  layer->items = (char **) msSmallMalloc(sizeof(char *) * info->numcolumns);
+  for(i=0; i<info->numcolumns; i++)
+    layer->items[i] = msStrdup(info->columnnames[i]);
+
+  if((value = msOWSLookupMetadata(&(layer->metadata), "G", "types")) != NULL
+      && strcasecmp(value, "auto") == 0)
+    msFlatGeobufPassThroughFieldDefinitions(layer, info);
+
+  return msLayerInitItemInfo(layer);
+}
+
+int msFlatGeobufLayerWhichShapes(layerObj *layer, rectObj rect, int isQuery)
+{
+  msFlatGeobufLayerInfo *info = (msFlatGeobufLayerInfo *) layer->layerinfo;
+
+  (void) isQuery;
+
+  if(!info) {
+    msSetError(MS_MISCERR, "FlatGeobuf layer has not been opened.", "msFlatGeobufLayerWhichShapes()");
+    return MS_FAILURE;
+  }
+
+  info->numresults = info->nextresult = 0;
+  info->searchrect = rect;
+  info->scanning = MS_FALSE;
+
+  if(info->numfeatures == 0 ||
+      (info->bounds.minx <= info->bounds.maxx && !msRectOverlap(&(info->bounds), &rect)))
+    return MS_DONE;
+
+  if(info->indexoffset) {
+    msFlatGeobufSearchIndex(info, rect);
+    if(layer->debug)
+      msDebug("msFlatGeobufLayerWhichShapes(): %d features of layer %s in the search rectangle.\n",
+              info->numresults, layer->name);
+    return info->numresults > 0 ? MS_SUCCESS : MS_DONE;
+  }
+
+  info->scanning = MS_TRUE;
+  info->scanoffset = 0;
+  info->scanindex = 0;
+
+  return MS_SUCCESS;
+}
+
+int msFlatGeobufLayerNextShape(layerObj *layer, shapeObj *shape)
+{
+  msFlatGeobufLayerInfo *info = (msFlatGeobufLayerInfo *) layer->layerinfo;
+  fgbTableObj feature;
+  size_t next;
+
+  if(!info) {
+    msSetError(MS_MISCERR, "FlatGeobuf layer has not been opened.", "msFlatGeobufLayerNextShape()");
+    return MS_FAILURE;
+  }
+
+  if(!info->scanning) {
+    while(info->nextresult < info->numresults) {
+      fgbResultObj *result = &info->results[info->nextresult++];
+
+      if(msFlatGeobufFeatureAt(info, result->offset, &feature, NULL) != MS_SUCCESS) {
+        msSetError(MS_IOERR, "Invalid feature %ld in FlatGeobuf layer %s.", "msFlatGeobufLayerNextShape()",
+                   result->index, layer->name ? layer->name : "(null)");
+        return MS_FAILURE;
+      }
+      msFlatGeobufReadShape(layer, info, &feature, result->index, shape);
+      if(shape->type != MS_SHAPE_NULL)
+        return MS_SUCCESS;
+    }
+    return MS_DONE;
+  }
+
+  while(info->scanindex < info->numfeatures) {
+    if(msFlatGeobufFeatureAt(info, info->scanoffset, &feature, &next) != MS_SUCCESS)
+      return MS_DONE; /* truncated */
+    info->scanoffset = next;
+    msFlatGeobufReadShape(layer, info, &feature, info->scanindex++, shape);
+    if(shape->type == MS_SHAPE_NULL)
+      continue;
+    if(msRectOverlap(&(shape->bounds), &(info->searchrect)))
+      return MS_SUCCESS;
+    msFreeShape(shape);
+  }
+
+  return MS_DONE;
+}
+
+int msFlatGeobufLayerGetShape(layerObj *layer, shapeObj *shape, resultObj *record)
+{
+  msFlatGeobufLayerInfo *info = (msFlatGeobufLayerInfo *) layer->layerinfo;
+  long shapeindex = record->shapeindex;
+  fgbTableObj feature;
+  size_t offset;
+
+  if(!info) {
+    msSetError(MS_MISCERR, "FlatGeobuf layer has not been opened.", "msFlatGeobufLayerGetShape()");
+    return MS_FAILURE;
+  }
+
+  if(!info->indexoffset)
+    msFlatGeobufScanOffsets(info);
+  if(shapeindex < 0 || shapeindex >= info->numfeatures) {
+    msSetError(MS_MISCERR, "Invalid feature id.", "msFlatGeobufLayerGetShape()");
+    return MS_FAILURE;
+  }
+
+  if(info->indexoffset)
+    offset = (size_t) fgbUInt64(info->data + info->indexoffset +
+                                (info->levelstart[0] + shapeindex) * FGB_NODE_ITEM_SIZE + 32);
+  else
+    offset = info->featureoffsets[shapeindex];
+
+  if(msFlatGeobufFeatureAt(info, offset, &feature, NULL) != MS_SUCCESS) {
+    msSetError(MS_IOERR, "Invalid feature %ld in FlatGeobuf layer %s.", "msFlatGeobufLayerGetShape()",
+               shapeindex, layer->name ? layer->name : "(null)");
+    return MS_FAILURE;
+  }
+
+  return msFlatGeobufReadShape(layer, info, &feature, shapeindex, shape);
+}
+
+int msFlatGeobufLayerGetExtent(layerObj *layer, rectObj *extent)
+{
+  msFlatGeobufLayerInfo *info = (msFlatGeobufLayerInfo *) layer->layerinfo;
+
+  if(!info) {
+    msSetError(MS_MISCERR, "FlatGeobuf layer has not been opened.", "msFlatGeobufLayerGetExtent()");
+    return MS_FAILURE;
+  }
+
+  if(info->bounds.minx > info->bounds.maxx) { /* neither in the header nor indexed */
+    rectObj all;
+    shapeObj shape;
+    int status;
+
+    all.minx = all.miny = -DBL_MAX;
+    all.maxx = all.maxy = DBL_MAX;
+    msInitShape(&shape);
+    if(msFlatGeobufLayerWhichShapes(layer, all, MS_FALSE) == MS_SUCCESS) {
+      while((status = msFlatGeobufLayerNextShape(layer, &shape)) == MS_SUCCESS) {
+        if(info->bounds.minx > info->bounds.maxx)
+          info->bounds = shape.bounds;
+        else
+          msMergeRect(&(info->bounds), &(shape.bounds));
+        msFreeShape(&shape);
+      }
+    }
+    if(info->bounds.minx > info->bounds.maxx) {
+      msSetError(MS_MISCERR, "Unable to get the extent of FlatGeobuf layer %s.", "msFlatGeobufLayerGetExtent()",
+                 layer->name ? layer->name : "(null)");
+      return MS_FAILURE;
+    }
+  }
+
+  *extent = info->bounds;
+  return MS_SUCCESS;
+}
+
+int msFlatGeobufLayerSupportsCommonFilters(layerObj *layer)
+{
+  return MS_TRUE;
+}
+
+/*
+** Whether DATA names a FlatGeobuf file, these are read with this driver
+** rather than as shapefiles.
+*/
+int msFlatGeobufIsDataset(const char *data)
+{
+  size_t length;
+
+  if(data == NULL)
+    return MS_FALSE;
+  length = strlen(data);
+  return length > 4 && strcasecmp(data + length - 4, ".fgb") == 0;
+}
+
+int msFlatGeobufLayerInitializeVirtualTable(layerObj *layer)
+{
+  assert(layer != NULL);
+  assert(layer->vtable != NULL);
+
+  layer->vtable->LayerSupportsCommonFilters = msFlatGeobufLayerSupportsCommonFilters;
+  layer->vtable->LayerInitItemInfo = msFlatGeobufLayerInitItemInfo;
+  layer->vtable->LayerFreeItemInfo = msFlatGeobufLayerFreeItemInfo;
+  layer->vtable->LayerOpen = msFlatGeobufLayerOpen;
+  layer->vtable->LayerIsOpen = msFlatGeobufLayerIsOpen;
+  layer->vtable->LayerWhichShapes = msFlatGeobufLayerWhichShapes;
+  layer->vtable->LayerNextShape = msFlatGeobufLayerNextShape;
+  /* layer->vtable->LayerNextShapes, use default */
+  layer->vtable->LayerGetShape = msFlatGeobufLayerGetShape;
+  /* layer->vtable->LayerGetShapeCount, use default */
+  layer->vtable->LayerClose = msFlatGeobufLayerClose;
+  layer->vtable->LayerGetItems = msFlatGeobufLayerGetItems;
+  layer->vtable->LayerGetExtent = msFlatGeobufLayerGetExtent;
+  /* layer->vtable->LayerGetAutoStyle, use default */
+  /* layer->vtable->LayerCloseConnection, use default */
+  layer->vtable->LayerSetTimeFilter = msLayerMakeBackticsTimeFilter;
+  /* layer->vtable->LayerTranslateFilter, use default */
+  /* layer->vtable->LayerApplyFilterToLayer, use default */
+  /* layer->vtable->LayerCreateItems, use default */
+  /* layer->vtable->LayerGetNumFeatures, use default */
+
+  return MS_SUCCESS;
+}
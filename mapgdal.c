@@ -30,6 +30,8 @@
 #include "mapserver.h"
 #include "mapthread.h"
 #include <assert.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 
 
 
@@ -45,6 +47,200 @@
 
 static int    bGDALInitialized = 0;
 
+/* -------------------------------------------------------------------- */
+/*      Process wide pool of open raster datasets, so that the files    */
+/*      drawn by every request are not opened again each time. A        */
+/*      dataset is handed to one caller at a time, several can be open  */
+/*      on the same file for concurrent requests. Unused datasets are   */
+/*      closed after MS_GDAL_POOL_IDLE_TIME seconds, or least recently  */
+/*      used first when the pool is full, and those of a file that was  */
+/*      modified (its time or size changed) are dropped when looked up. */
+/*      Datasets are opened without any lock, so that several can be    */
+/*      opened at once, and closed with the TLOCK_GDAL mutex held.      */
+/*                                                                      */
+/*      These static structures are protected by the TLOCK_GDALPOOL     */
+/*      mutex.                                                          */
+/* -------------------------------------------------------------------- */
+#define MS_GDAL_POOL_MAX 32
+#define MS_GDAL_POOL_IDLE_TIME 60
+
+typedef struct {
+  char *path;
+  time_t mtime; /* of the file when the dataset was opened, 0 and -1 if unknown */
+  off_t size;
+  GDALDatasetH hDS;
+  int inuse;
+  time_t last_used;
+} gdalPoolEntryObj;
+
+static int gdalPoolCount = 0;
+static gdalPoolEntryObj gdalPool[MS_GDAL_POOL_MAX];
+
+/* removes entry i, returns its dataset for the caller to close without TLOCK_GDALPOOL */
+static GDALDatasetH msGDALPoolRemove(int i)
+{
+  GDALDatasetH hDS = gdalPool[i].hDS;
+
+  free(gdalPool[i].path);
+  gdalPoolCount--;
+  if( i != gdalPoolCount )
+    gdalPool[i] = gdalPool[gdalPoolCount];
+
+  return hDS;
+}
+
+static void msGDALPoolClose(GDALDatasetH *pahDS, int nDS)
+{
+  int i;
+
+  if( nDS == 0 )
+    return;
+
+  msAcquireLock( TLOCK_GDAL );
+  for( i = 0; i < nDS; i++ )
+    GDALClose( pahDS[i] );
+  msReleaseLock( TLOCK_GDAL );
+}
+
+/************************************************************************/
+/*                           msGDALPoolOpen()                           */
+/*                                                                      */
+/*      Returns an open dataset on path for the exclusive use of the    */
+/*      caller until msGDALPoolRelease(), or NULL if GDAL can't open    */
+/*      it. The GDAL error is left for CPLGetLastErrorMsg().            */
+/************************************************************************/
+
+void *msGDALPoolOpen( const char *path )
+
+{
+  GDALDatasetH hDS = NULL, ahExpired[MS_GDAL_POOL_MAX];
+  int i, nExpired = 0;
+  time_t now = time(NULL), mtime = 0;
+  off_t size = -1;
+  struct stat sStat;
+
+  /* not a file (eg. a connection string), then only the idle time applies */
+  if( stat(path, &sStat) == 0 ) {
+    mtime = sStat.st_mtime;
+    size = sStat.st_size;
+  }
+
+  msAcquireLock( TLOCK_GDALPOOL );
+  for( i = gdalPoolCount - 1; i >= 0; i-- ) {
+    if( gdalPool[i].inuse )
+      continue;
+    if( now - gdalPool[i].last_used > MS_GDAL_POOL_IDLE_TIME ) {
+      ahExpired[nExpired++] = msGDALPoolRemove(i);
+      continue;
+    }
+    if( strcmp(gdalPool[i].path, path) == 0 &&
+        (gdalPool[i].mtime != mtime || gdalPool[i].size != size) ) {
+      ahExpired[nExpired++] = msGDALPoolRemove(i); /* rewritten since it was opened */
+      continue;
+    }
+    if( hDS == NULL && strcmp(gdalPool[i].path, path) == 0 ) {
+      gdalPool[i].inuse = MS_TRUE;
+      hDS = gdalPool[i].hDS;
+    }
+  }
+  msReleaseLock( TLOCK_GDALPOOL );
+
+  msGDALPoolClose( ahExpired, nExpired );
+  if( hDS != NULL )
+    return hDS;
+
+  /* a private, unshared, handle: several can be opened at once */
+  hDS = GDALOpen( path, GA_ReadOnly );
+  if( hDS == NULL )
+    return NULL;
+
+  /* track it, making room if possible, or it will simply be closed on release */
+  nExpired = 0;
+  msAcquireLock( TLOCK_GDALPOOL );
+  if( gdalPoolCount == MS_GDAL_POOL_MAX ) {
+    int oldest = -1;
+    for( i = 0; i < gdalPoolCount; i++ ) {
+      if( !gdalPool[i].inuse &&
+          (oldest == -1 || gdalPool[i].last_used < gdalPool[oldest].last_used) )
+        oldest = i;
+    }
+    if( oldest != -1 )
+      ahExpired[nExpired++] = msGDALPoolRemove(oldest);
+  }
+  if( gdalPoolCount < MS_GDAL_POOL_MAX ) {
+    gdalPool[gdalPoolCount].path = msStrdup(path);
+    gdalPool[gdalPoolCount].mtime = mtime;
+    gdalPool[gdalPoolCount].size = size;
+    gdalPool[gdalPoolCount].hDS = hDS;
+    gdalPool[gdalPoolCount].inuse = MS_TRUE;
+    gdalPool[gdalPoolCount].last_used = now;
+    gdalPoolCount++;
+  }
+  msReleaseLock( TLOCK_GDALPOOL );
+
+  msGDALPoolClose( ahExpired, nExpired );
+  return hDS;
+}
+
+/************************************************************************/
+/*                         msGDALPoolRelease()                          */
+/*                                                                      */
+/*      Gives back a dataset from msGDALPoolOpen(), it is closed        */
+/*      unless keep_open is set.                                        */
+/************************************************************************/
+
+void msGDALPoolRelease( void *hDSVoid, int keep_open )
+
+{
+  GDALDatasetH hDS = (GDALDatasetH) hDSVoid;
+  int i, found = MS_FALSE;
+
+  msAcquireLock( TLOCK_GDALPOOL );
+  for( i = 0; i < gdalPoolCount; i++ ) {
+    if( gdalPool[i].hDS == hDS ) {
+      found = MS_TRUE;
+      if( keep_open ) {
+        gdalPool[i].inuse = MS_FALSE;
+        gdalPool[i].last_used = time(NULL);
+      } else
+        msGDALPoolRemove(i);
+      break;
+    }
+  }
+  msReleaseLock( TLOCK_GDALPOOL );
+
+  if( !found || !keep_open )
+    msGDALPoolClose( &hDS, 1 );
+}
+
+/* closes all the unused datasets, TLOCK_GDAL is held by msGDALCleanup() */
+static void msGDALPoolCleanup( void )
+
+{
+  int i;
+
+  msAcquireLock( TLOCK_GDALPOOL );
+  for( i = gdalPoolCount - 1; i >= 0; i-- ) {
+    if( !gdalPool[i].inuse )
+      GDALClose( msGDALPoolRemove(i) );
+  }
+  msReleaseLock( TLOCK_GDALPOOL );
+}
+
+/************************************************************************/
+/*                        msGDALPoolCloseUnused()                       */
+/************************************************************************/
+
+void msGDALPoolCloseUnused( void )
+
+{
+  if( bGDALInitialized ) {
+    msAcquireLock( TLOCK_GDAL );
+    msGDALPoolCleanup();
+    msReleaseLock( TLOCK_GDAL );
+  }
+}
+
 /************************************************************************/
 /*                          msGDALInitialize()                          */
 /************************************************************************/
@@ -74,6 +270,8 @@ void msGDALCleanup( void )
     int iRepeat = 5;
     msAcquireLock( TLOCK_GDAL );
 
+    msGDALPoolCleanup();
+
 #if GDAL_RELEASE_DATE > 20101207
     {
       /*
@@ -139,6 +337,47 @@ void CleanVSIDir( const char *pszDir )
   CSLDestroy( papszFiles );
 }
 
+/************************************************************************/
+/*                      msGDALAddBandFromPointer()                      */
+/*                                                                      */
+/*      Add a band to a MEM dataset that references pData rather        */
+/*      than allocating its own copy of the pixels.                     */
+/************************************************************************/
+
+static int msGDALAddBandFromPointer( GDALDatasetH hDS, GDALDataType eType,
+                                     void *pData, int nPixelOffset,
+                                     int nLineOffset )
+
+{
+  char szPointer[64];
+  char szDataPointer[100], szPixelOffset[64], szLineOffset[64];
+  char *apszOptions[4];
+  int nLen;
+
+  nLen = CPLPrintPointer( szPointer, pData, sizeof(szPointer) - 1 );
+  szPointer[nLen] = '\0';
+  snprintf( szDataPointer, sizeof(szDataPointer), "DATAPOINTER=%s", szPointer );
+  snprintf( szPixelOffset, sizeof(szPixelOffset), "PIXELOFFSET=%d", nPixelOffset );
+  snprintf( szLineOffset, sizeof(szLineOffset), "LINEOFFSET=%d", nLineOffset );
+  apszOptions[0] = szDataPointer;
+  apszOptions[1] = szPixelOffset;
+  apszOptions[2] = szLineOffset;
+  apszOptions[3] = NULL;
+
+  if( GDALAddBand( hDS, eType, apszOptions ) != CE_None )
+    return MS_FAILURE;
+  return MS_SUCCESS;
+}
+
+#if GDAL_VERSION_NUM >= 1100
+/* /vsistdout/ redirection target, so that drivers write through msIO */
+static size_t msGDALWriteToStdout( const void *ptr, size_t size, size_t nmemb,
+                                   FILE *fp )
+{
+  return msIO_fwrite( ptr, size, nmemb, fp );
+}
+#endif
+
 /************************************************************************/
 /*                          msSaveImageGDAL()                           */
 /************************************************************************/
@@ -147,11 +386,12 @@ int msSaveImageGDAL( mapObj *map, imageObj *image, char *filename )
 
 {
   int  bFileIsTemporary = MS_FALSE;
+  int  bStreamOutput = MS_FALSE;
   GDALDatasetH hMemDS, hOutputDS;
   GDALDriverH  hMemDriver, hOutputDriver;
   int          nBands = 1;
-  int          iLine;
-  GByte       *pabyAlphaLine = NULL;
+  int          iLine, iBand;
+  GByte       *papabyUPM[3] = { NULL, NULL, NULL };
   char        **papszOptions = NULL;
   outputFormatObj *format = image->format;
   rasterBufferObj rb;
@@ -186,7 +426,24 @@ int msSaveImageGDAL( mapObj *map, imageObj *image, char *filename )
   /*      driver supports virtualio then we hold the temporary file in    */
   /*      memory, otherwise we try to put it in a reasonable temporary    */
   /*      file location.                                                  */
+  /*                                                                      */
+  /*      With STREAM_OUTPUT=YES the driver writes straight to msIO       */
+  /*      through /vsistdout/ instead.  Only drivers that write their     */
+  /*      output sequentially support this, e.g. PNG, JPEG, or GTiff      */
+  /*      with STREAMABLE_OUTPUT=YES.                                     */
   /* -------------------------------------------------------------------- */
+#if GDAL_VERSION_NUM >= 1100
+  if( filename == NULL && bUseXmp == MS_FALSE
+      && CSLTestBoolean(msGetOutputFormatOption(format,"STREAM_OUTPUT","NO")) ) {
+    if( msIO_needBinaryStdout() == MS_FAILURE ) {
+      msReleaseLock( TLOCK_GDAL );
+      return MS_FAILURE;
+    }
+    filename = msStrdup( "/vsistdout/" );
+    bStreamOutput = MS_TRUE;
+  }
+#endif
+
   if( filename == NULL ) {
     const char *pszExtension = format->extension;
     if( pszExtension == NULL )
@@ -220,12 +477,6 @@ int msSaveImageGDAL( mapObj *map, imageObj *image, char *filename )
       return MS_FAILURE;
     }
   } else if( format->imagemode == MS_IMAGEMODE_RGBA ) {
-    pabyAlphaLine = (GByte *) calloc(image->width,1);
-    if (pabyAlphaLine == NULL) {
-      msReleaseLock( TLOCK_GDAL );
-      msSetError( MS_MEMERR, "Out of memory allocating %u bytes.\n", "msSaveImageGDAL()", image->width);
-      return MS_FAILURE;
-    }
     nBands = 4;
     assert( MS_RENDERER_PLUGIN(format) && format->vtable->supports_pixel_buffer );
     if(UNLIKELY(MS_FAILURE == format->vtable->getRasterBufferHandle(image,&rb))) {
@@ -249,7 +500,9 @@ int msSaveImageGDAL( mapObj *map, imageObj *image, char *filename )
 
   /* -------------------------------------------------------------------- */
   /*      Create a memory dataset which we can use as a source for a      */
-  /*      CreateCopy().                                                   */
+  /*      CreateCopy().  Its bands wrap our image buffers directly        */
+  /*      rather than holding a copy, except for premultiplied RGB        */
+  /*      bands which GDAL needs un-premultiplied.                        */
   /* -------------------------------------------------------------------- */
   hMemDriver = GDALGetDriverByName( "MEM" );
   if( hMemDriver == NULL ) {
@@ -260,7 +513,7 @@ int msSaveImageGDAL( mapObj *map, imageObj *image, char *filename )
   }
 
   hMemDS = GDALCreate( hMemDriver, "msSaveImageGDAL_temp",
-                       image->width, image->height, nBands,
+                       image->width, image->height, 0,
                        eDataType, NULL );
   if( hMemDS == NULL ) {
     msReleaseLock( TLOCK_GDAL );
@@ -269,93 +522,97 @@ int msSaveImageGDAL( mapObj *map, imageObj *image, char *filename )
     return MS_FAILURE;
   }
 
-  /* -------------------------------------------------------------------- */
-  /*      Copy the gd image into the memory dataset.                      */
-  /* -------------------------------------------------------------------- */
-  for( iLine = 0; iLine < image->height; iLine++ ) {
-    int iBand;
-
-    for( iBand = 0; iBand < nBands; iBand++ ) {
-      GDALRasterBandH hBand = GDALGetRasterBand( hMemDS, iBand+1 );
-
-      if( format->imagemode == MS_IMAGEMODE_INT16 ) {
-        GDALRasterIO( hBand, GF_Write, 0, iLine, image->width, 1,
-                      image->img.raw_16bit + iLine * image->width
-                      + iBand * image->width * image->height,
-                      image->width, 1, GDT_Int16, 2, 0 );
-
-      } else if( format->imagemode == MS_IMAGEMODE_FLOAT32 ) {
-        GDALRasterIO( hBand, GF_Write, 0, iLine, image->width, 1,
-                      image->img.raw_float + iLine * image->width
-                      + iBand * image->width * image->height,
-                      image->width, 1, GDT_Float32, 4, 0 );
-      } else if( format->imagemode == MS_IMAGEMODE_BYTE ) {
-        GDALRasterIO( hBand, GF_Write, 0, iLine, image->width, 1,
-                      image->img.raw_byte + iLine * image->width
-                      + iBand * image->width * image->height,
-                      image->width, 1, GDT_Byte, 1, 0 );
-      } else {
-        GByte *pabyData;
-        unsigned char *pixptr = NULL;
-        assert( rb.type == MS_BUFFER_BYTE_RGBA );
-        switch(iBand) {
-          case 0:
-            pixptr = rb.data.rgba.r;
-            break;
-          case 1:
-            pixptr = rb.data.rgba.g;
-            break;
-          case 2:
-            pixptr = rb.data.rgba.b;
-            break;
-          case 3:
-            pixptr = rb.data.rgba.a;
-            break;
-        }
-        assert(pixptr);
-        if( pixptr == NULL ) {
-          msReleaseLock( TLOCK_GDAL );
-          msSetError( MS_MISCERR, "Missing RGB or A buffer.\n",
-                      "msSaveImageGDAL()" );
-          return MS_FAILURE;
-        }
+  for( iBand = 0; iBand < nBands; iBand++ ) {
+    void *pData = NULL;
+    int nPixelOffset, nLineOffset, nStatus;
+
+    if( format->imagemode == MS_IMAGEMODE_INT16 ) {
+      pData = image->img.raw_16bit + iBand * image->width * image->height;
+      nPixelOffset = 2;
+      nLineOffset = image->width * 2;
+    } else if( format->imagemode == MS_IMAGEMODE_FLOAT32 ) {
+      pData = image->img.raw_float + iBand * image->width * image->height;
+      nPixelOffset = 4;
+      nLineOffset = image->width * 4;
+    } else if( format->imagemode == MS_IMAGEMODE_BYTE ) {
+      pData = image->img.raw_byte + iBand * image->width * image->height;
+      nPixelOffset = 1;
+      nLineOffset = image->width;
+    } else {
+      unsigned char *pixptr = NULL;
+      assert( rb.type == MS_BUFFER_BYTE_RGBA );
+      switch(iBand) {
+        case 0:
+          pixptr = rb.data.rgba.r;
+          break;
+        case 1:
+          pixptr = rb.data.rgba.g;
+          break;
+        case 2:
+          pixptr = rb.data.rgba.b;
+          break;
+        case 3:
+          pixptr = rb.data.rgba.a;
+          break;
+      }
+      assert(pixptr);
+      if( pixptr == NULL ) {
+        GDALClose( hMemDS );
+        for( iBand = 0; iBand < 3; iBand++ )
+          free( papabyUPM[iBand] );
+        msReleaseLock( TLOCK_GDAL );
+        msSetError( MS_MISCERR, "Missing RGB or A buffer.\n",
+                    "msSaveImageGDAL()" );
+        return MS_FAILURE;
+      }
 
-        pabyData = (GByte *)(pixptr + iLine*rb.data.rgba.row_step);
+      if( rb.data.rgba.a == NULL || iBand == 3 ) {
+        pData = pixptr;
+        nPixelOffset = rb.data.rgba.pixel_step;
+        nLineOffset = rb.data.rgba.row_step;
+      } else { /* We need to un-pre-multiple RGB by alpha. */
+        GByte *pabyUPM = (GByte*) msSmallMalloc(image->width * image->height);
 
-        if( rb.data.rgba.a == NULL || iBand == 3 ) {
-          GDALRasterIO( hBand, GF_Write, 0, iLine, image->width, 1,
-                        pabyData, image->width, 1, GDT_Byte,
-                        rb.data.rgba.pixel_step, 0 );
-        } else { /* We need to un-pre-multiple RGB by alpha. */
-          GByte *pabyUPM = (GByte*) malloc(image->width);
+        for( iLine = 0; iLine < image->height; iLine++ ) {
+          GByte *pabyData = (GByte *)(pixptr + iLine*rb.data.rgba.row_step);
           GByte *pabyAlpha= (GByte *)(rb.data.rgba.a + iLine*rb.data.rgba.row_step);
+          GByte *pabyOut = pabyUPM + iLine * image->width;
           int i;
 
           for( i = 0; i < image->width; i++ ) {
             int alpha = pabyAlpha[i*rb.data.rgba.pixel_step];
 
             if( alpha == 0 )
-              pabyUPM[i] = 0;
+              pabyOut[i] = 0;
             else {
               int result = (pabyData[i*rb.data.rgba.pixel_step] * 255) / alpha;
 
               if( result > 255 )
                 result = 255;
 
-              pabyUPM[i] = result;
+              pabyOut[i] = result;
             }
           }
-
-          GDALRasterIO( hBand, GF_Write, 0, iLine, image->width, 1,
-                        pabyUPM, image->width, 1, GDT_Byte, 1, 0 );
-          free( pabyUPM );
         }
+        papabyUPM[iBand] = pabyUPM;
+        pData = pabyUPM;
+        nPixelOffset = 1;
+        nLineOffset = image->width;
       }
     }
-  }
 
-  if( pabyAlphaLine != NULL )
-    free( pabyAlphaLine );
+    nStatus = msGDALAddBandFromPointer( hMemDS, eDataType, pData,
+                                        nPixelOffset, nLineOffset );
+    if( nStatus != MS_SUCCESS ) {
+      GDALClose( hMemDS );
+      for( iBand = 0; iBand < 3; iBand++ )
+        free( papabyUPM[iBand] );
+      msReleaseLock( TLOCK_GDAL );
+      msSetError( MS_MISCERR, "Failed to add band to MEM dataset.\n%s",
+                  "msSaveImageGDAL()", CPLGetLastErrorMsg() );
+      return MS_FAILURE;
+    }
+  }
 
   /* -------------------------------------------------------------------- */
   /*      Attach the palette if appropriate.                              */
@@ -399,7 +656,6 @@ int msSaveImageGDAL( mapObj *map, imageObj *image, char *filename )
   /*      Possibly assign a nodata value.                                 */
   /* -------------------------------------------------------------------- */
   if( msGetOutputFormatOption(format,"NULLVALUE",NULL) != NULL ) {
-    int iBand;
     const char *nullvalue = msGetOutputFormatOption(format,
                             "NULLVALUE",NULL);
 
@@ -436,13 +692,26 @@ int msSaveImageGDAL( mapObj *map, imageObj *image, char *filename )
   memcpy( papszOptions, format->formatoptions,
           sizeof(char *) * format->numformatoptions );
 
+#if GDAL_VERSION_NUM >= 1100
+  if( bStreamOutput )
+    VSIStdoutSetRedirection( msGDALWriteToStdout, stdout );
+#endif
+
   hOutputDS = GDALCreateCopy( hOutputDriver, filename, hMemDS, FALSE,
                               papszOptions, NULL, NULL );
 
   free( papszOptions );
 
   if( hOutputDS == NULL ) {
+#if GDAL_VERSION_NUM >= 1100
+    if( bStreamOutput ) {
+      VSIStdoutSetRedirection( fwrite, stdout );
+      free( filename );
+    }
+#endif
     GDALClose( hMemDS );
+    for( iBand = 0; iBand < 3; iBand++ )
+      free( papabyUPM[iBand] );
     msReleaseLock( TLOCK_GDAL );
     msSetError( MS_MISCERR, "Failed to create output %s file.\n%s",
                 "msSaveImageGDAL()", format->driver+5,
@@ -450,10 +719,19 @@ int msSaveImageGDAL( mapObj *map, imageObj *image, char *filename )
     return MS_FAILURE;
   }
 
-  /* closing the memory DS also frees all associated resources. */
+  /* the memory DS only references our buffers, free the copies it used */
   GDALClose( hMemDS );
+  for( iBand = 0; iBand < 3; iBand++ )
+    free( papabyUPM[iBand] );
 
   GDALClose( hOutputDS );
+#if GDAL_VERSION_NUM >= 1100
+  /* the last bytes only reach /vsistdout/ once the dataset is closed */
+  if( bStreamOutput ) {
+    VSIStdoutSetRedirection( fwrite, stdout );
+    free( filename );
+  }
+#endif
   msReleaseLock( TLOCK_GDAL );
 
 
@@ -509,6 +787,181 @@ int msSaveImageGDAL( mapObj *map, imageObj *image, char *filename )
   return MS_SUCCESS;
 }
 
+/************************************************************************/
+/*                         msGDALBeginStripes()                         */
+/*                                                                      */
+/*      Striped GeoTIFF output straight to msIO, for raw data images    */
+/*      too large to be drawn at once.  The caller draws the image in   */
+/*      stripes of stripe_rows rows (the last one may be shorter),      */
+/*      hands them in order to msGDALWriteStripe() and finishes with    */
+/*      msGDALEndStripes().  GTiff writes to an unseekable output in    */
+/*      Create() mode for uncompressed pixel interleaved strips only,   */
+/*      each stripe is one strip.  /vsistdout/ is redirected to msIO    */
+/*      with TLOCK_GDAL held during each call only, so that the         */
+/*      stripes can be drawn meanwhile.                                 */
+/************************************************************************/
+
+void *msGDALBeginStripes( mapObj *map, outputFormatObj *format,
+                          int width, int height, int stripe_rows )
+
+{
+#if GDAL_VERSION_MAJOR >= 2
+  GDALDriverH hDriver;
+  GDALDatasetH hDS;
+  GDALDataType eDataType;
+  char **papszOptions = NULL;
+  char szRows[32];
+  int i;
+
+  if( format->imagemode == MS_IMAGEMODE_INT16 )
+    eDataType = GDT_Int16;
+  else if( format->imagemode == MS_IMAGEMODE_FLOAT32 )
+    eDataType = GDT_Float32;
+  else if( format->imagemode == MS_IMAGEMODE_BYTE )
+    eDataType = GDT_Byte;
+  else {
+    msSetError( MS_MISCERR, "Striped output needs a raw data format.",
+                "msGDALBeginStripes()" );
+    return NULL;
+  }
+
+  if( msIO_needBinaryStdout() == MS_FAILURE )
+    return NULL;
+
+  msGDALInitialize();
+
+  for( i = 0; i < format->numformatoptions; i++ )
+    papszOptions = CSLAddString( papszOptions, format->formatoptions[i] );
+  snprintf( szRows, sizeof(szRows), "%d", stripe_rows );
+  papszOptions = CSLSetNameValue( papszOptions, "STREAMABLE_OUTPUT", "YES" );
+  papszOptions = CSLSetNameValue( papszOptions, "INTERLEAVE", "PIXEL" );
+  papszOptions = CSLSetNameValue( papszOptions, "TILED", "NO" );
+  papszOptions = CSLSetNameValue( papszOptions, "COMPRESS", "NONE" );
+  papszOptions = CSLSetNameValue( papszOptions, "BLOCKYSIZE", szRows );
+
+  msAcquireLock( TLOCK_GDAL );
+  hDriver = GDALGetDriverByName( "GTiff" );
+  if( hDriver == NULL ) {
+    msReleaseLock( TLOCK_GDAL );
+    CSLDestroy( papszOptions );
+    msSetError( MS_MISCERR, "Failed to find GTiff driver.",
+                "msGDALBeginStripes()" );
+    return NULL;
+  }
+
+  VSIStdoutSetRedirection( msGDALWriteToStdout, stdout );
+  hDS = GDALCreate( hDriver, "/vsistdout/", width, height, format->bands,
+                    eDataType, papszOptions );
+  CSLDestroy( papszOptions );
+  if( hDS == NULL ) {
+    VSIStdoutSetRedirection( fwrite, stdout );
+    msReleaseLock( TLOCK_GDAL );
+    msSetError( MS_MISCERR, "Failed to create striped GTiff output.\n%s",
+                "msGDALBeginStripes()", CPLGetLastErrorMsg() );
+    return NULL;
+  }
+
+  /* the header is only written with the first strip */
+  if( map != NULL ) {
+    char *pszWKT;
+
+    GDALSetGeoTransform( hDS, map->gt.geotransform );
+    pszWKT = msProjectionObj2OGCWKT( &(map->projection) );
+    if( pszWKT != NULL ) {
+      GDALSetProjection( hDS, pszWKT );
+      msFree( pszWKT );
+    }
+  }
+
+  if( msGetOutputFormatOption(format,"NULLVALUE",NULL) != NULL ) {
+    double dfNullValue = atof(msGetOutputFormatOption(format,"NULLVALUE",NULL));
+
+    for( i = 0; i < format->bands; i++ )
+      GDALSetRasterNoDataValue( GDALGetRasterBand( hDS, i+1 ), dfNullValue );
+  }
+  VSIStdoutSetRedirection( fwrite, stdout );
+  msReleaseLock( TLOCK_GDAL );
+
+  return hDS;
+#else
+  msSetError( MS_MISCERR, "Striped output requires GDAL 2.0 or later.",
+              "msGDALBeginStripes()" );
+  return NULL;
+#endif
+}
+
+/************************************************************************/
+/*                         msGDALWriteStripe()                          */
+/*                                                                      */
+/*      Writes the rows of image after the first skip_rows ones as      */
+/*      the rows of the output starting at first_row.                   */
+/************************************************************************/
+
+int msGDALWriteStripe( void *hDSIn, imageObj *image, int first_row, int skip_rows )
+
+{
+#if GDAL_VERSION_MAJOR >= 2
+  GDALDatasetH hDS = (GDALDatasetH) hDSIn;
+  GDALDataType eDataType;
+  GByte *pabyData;
+  int nPixelSize, nRows = image->height - skip_rows;
+  CPLErr eErr;
+
+  if( image->format->imagemode == MS_IMAGEMODE_INT16 ) {
+    eDataType = GDT_Int16;
+    pabyData = (GByte *) image->img.raw_16bit;
+    nPixelSize = 2;
+  } else if( image->format->imagemode == MS_IMAGEMODE_FLOAT32 ) {
+    eDataType = GDT_Float32;
+    pabyData = (GByte *) image->img.raw_float;
+    nPixelSize = 4;
+  } else {
+    eDataType = GDT_Byte;
+    pabyData = image->img.raw_byte;
+    nPixelSize = 1;
+  }
+  pabyData += (size_t) skip_rows * image->width * nPixelSize;
+
+  msAcquireLock( TLOCK_GDAL );
+  VSIStdoutSetRedirection( msGDALWriteToStdout, stdout );
+  eErr = GDALDatasetRasterIO( hDS, GF_Write, 0, first_row, image->width, nRows,
+                              pabyData, image->width, nRows, eDataType,
+                              GDALGetRasterCount( hDS ), NULL,
+                              nPixelSize, image->width * nPixelSize,
+                              image->width * image->height * nPixelSize );
+  /* pushes the completed strip out while the redirection is set */
+  if( eErr == CE_None )
+    GDALFlushCache( hDS );
+  VSIStdoutSetRedirection( fwrite, stdout );
+  msReleaseLock( TLOCK_GDAL );
+
+  if( eErr != CE_None ) {
+    msSetError( MS_MISCERR, "Failed to write stripe at row %d.\n%s",
+                "msGDALWriteStripe()", first_row, CPLGetLastErrorMsg() );
+    return MS_FAILURE;
+  }
+  return MS_SUCCESS;
+#else
+  return MS_FAILURE;
+#endif
+}
+
+/************************************************************************/
+/*                          msGDALEndStripes()                          */
+/************************************************************************/
+
+void msGDALEndStripes( void *hDS )
+
+{
+#if GDAL_VERSION_MAJOR >= 2
+  msAcquireLock( TLOCK_GDAL );
+  VSIStdoutSetRedirection( msGDALWriteToStdout, stdout );
+  GDALClose( (GDALDatasetH) hDS );
+  VSIStdoutSetRedirection( fwrite, stdout );
+  msReleaseLock( TLOCK_GDAL );
+#endif
+}
+
 /************************************************************************/
 /*                       msInitGDALOutputFormat()                       */
 /************************************************************************/
@@ -559,6 +1012,9 @@ int msInitDefaultGDALOutputFormat( outputFormatObj *format )
 
 void msGDALInitialize( void ) {}
 void msGDALCleanup(void) {}
+void *msGDALPoolOpen(const char *path) { return NULL; }
+void msGDALPoolRelease(void *hDS, int keep_open) {}
+void msGDALPoolCloseUnused(void) {}
 
 
 #endif /* def USE_GDAL */
@@ -30,8 +30,6 @@
 #include "mapserver.h"
 #include "mapthread.h"
 
-extern int yyparse(parseObj *p);
-
 void msStyleSetGeomTransform(styleObj *s, char *transform)
 {
   msFree(s->_geomtransform.string);
@@ -207,10 +205,9 @@ int msDrawTransformedShape(mapObj *map, imageObj *image, shapeObj *shape, styleO
         }
       }
 
-      p.expr->curtoken = p.expr->tokens; /* reset */
       p.type = MS_PARSE_TYPE_SHAPE;
 
-      status = yyparse(&p);
+      status = msEvalParsedExpression(&p);
       if (status != 0) {
         msSetError(MS_PARSEERR, "Failed to process shape expression: %s", "msDrawTransformedShape", style->_geomtransform.string);
         return MS_FAILURE;
@@ -227,8 +224,10 @@ int msDrawTransformedShape(mapObj *map, imageObj *image, shapeObj *shape, styleO
           break;
       }
 
-      msFreeShape(tmpshp);
-      msFree(tmpshp);
+      if(tmpshp != shape) { /* (e.g. [shape] alone) */
+        msFreeShape(tmpshp);
+        msFree(tmpshp);
+      }
     }
     break;
     case MS_GEOMTRANSFORM_LABELPOINT:
@@ -271,7 +270,6 @@ int msGeomTransformShape(mapObj *map, layerObj *layer, shapeObj *shape)
 
       p.shape = shape; /* set a few parser globals (hence the lock) */
       p.expr = e;
-      p.expr->curtoken = p.expr->tokens; /* reset */
       p.type = MS_PARSE_TYPE_SHAPE;
       p.dblval = map->cellsize * (msInchesPerUnit(map->units,0)/msInchesPerUnit(layer->units,0));
       p.dblval2 = 0;
@@ -283,21 +281,24 @@ int msGeomTransformShape(mapObj *map, layerObj *layer, shapeObj *shape)
           p.dblval2 = atof(value);
       }
           
-      status = yyparse(&p);
+      status = msEvalParsedExpression(&p);
       if (status != 0) {
         msSetError(MS_PARSEERR, "Failed to process shape expression: %s", "msGeomTransformShape()", e->string);
         return MS_FAILURE;
       }
       
       tmpshp = p.result.shpval;
+      if(tmpshp == shape) break; /* nothing to transform */
 
       for (i= 0; i < shape->numlines; i++)
         free(shape->line[i].point);
-      shape->numlines = 0;
       if (shape->line) free(shape->line);
-      
-      for(i=0; i<tmpshp->numlines; i++)
-        msAddLine(shape, &(tmpshp->line[i])); /* copy each line */
+
+      /* take over the lines of the result rather than copying them */
+      shape->line = tmpshp->line;
+      shape->numlines = tmpshp->numlines;
+      tmpshp->line = NULL;
+      tmpshp->numlines = 0;
 
       msFreeShape(tmpshp);
       msFree(tmpshp);
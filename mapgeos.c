@@ -74,12 +74,28 @@ typedef struct geos_thread_info {
 
 static geos_thread_info_t *geos_list = NULL;
 
+#ifdef MS_THREAD_LOCAL
+/*
+** The handle of each thread is also kept in thread local storage, so that
+** fetching it, which happens on every conversion and operation, takes no
+** lock. msGEOSCleanup() bumps the generation to tell the finished ones.
+*/
+static MS_THREAD_LOCAL GEOSContextHandle_t geos_thread_handle = NULL;
+static MS_THREAD_LOCAL int geos_thread_generation = -1;
+static int geos_generation = 0;
+#endif
+
 static GEOSContextHandle_t msGetGeosContextHandle()
 {
   geos_thread_info_t *link;
   GEOSContextHandle_t ret_obj;
   void*        thread_id;
 
+#ifdef MS_THREAD_LOCAL
+  if( geos_thread_handle != NULL && geos_thread_generation == geos_generation )
+    return geos_thread_handle;
+#endif
+
   msAcquireLock( TLOCK_GEOS );
 
   thread_id = msGetThreadId();
@@ -117,6 +133,11 @@ static GEOSContextHandle_t msGetGeosContextHandle()
 
   ret_obj = geos_list->geos_handle;
 
+#ifdef MS_THREAD_LOCAL
+  geos_thread_handle = ret_obj;
+  geos_thread_generation = geos_generation;
+#endif
+
   msReleaseLock( TLOCK_GEOS );
 
   return ret_obj;
@@ -147,6 +168,9 @@ void msGEOSCleanup()
     free(cur);
   }
   geos_list = NULL;
+#ifdef MS_THREAD_LOCAL
+  geos_generation++;
+#endif
   msReleaseLock( TLOCK_GEOS );
 #endif
 }
@@ -154,11 +178,62 @@ void msGEOSCleanup()
 /*
 ** Translation functions
 */
-static GEOSGeom msGEOSShape2Geometry_point(pointObj *point)
+
+/*
+** GEOS 3.10 copies coordinates from and to x/y buffers in one call, it takes
+** the points of a lineObj as they are when pointObj holds just x and y.
+*/
+#if (GEOS_VERSION_MAJOR > 3 || (GEOS_VERSION_MAJOR == 3 && GEOS_VERSION_MINOR >= 10)) && !defined(USE_POINT_Z_M)
+#define MS_GEOS_COORDS_BUFFER
+#endif
+
+static GEOSCoordSeq msGEOSPoints2CoordSeq(GEOSContextHandle_t handle, pointObj *points, int numpoints)
+{
+#ifdef MS_GEOS_COORDS_BUFFER
+  return GEOSCoordSeq_copyFromBuffer_r(handle, (const double *) points, numpoints, 0, 0);
+#else
+  int i;
+  GEOSCoordSeq coords;
+
+  coords = GEOSCoordSeq_create_r(handle, numpoints, 2); /* todo handle z's */
+  if(!coords) return NULL;
+
+  for(i=0; i<numpoints; i++) {
+    GEOSCoordSeq_setX_r(handle, coords, i, points[i].x);
+    GEOSCoordSeq_setY_r(handle, coords, i, points[i].y);
+    /* GEOSCoordSeq_setZ(coords, i, points[i].z); */
+  }
+
+  return coords;
+#endif
+}
+
+/* fills line with the coordinates of g, a linestring or a ring */
+static void msGEOSGeometry2Line(GEOSContextHandle_t handle, GEOSGeom g, lineObj *line)
+{
+  GEOSCoordSeq coords = (GEOSCoordSeq) GEOSGeom_getCoordSeq_r(handle, g);
+
+  line->numpoints = GEOSGetNumCoordinates_r(handle, g);
+  line->point = (pointObj *) malloc(sizeof(pointObj)*line->numpoints);
+
+#ifdef MS_GEOS_COORDS_BUFFER
+  GEOSCoordSeq_copyToBuffer_r(handle, coords, (double *) line->point, 0, 0);
+#else
+  {
+    int i;
+    for(i=0; i<line->numpoints; i++) {
+      GEOSCoordSeq_getX_r(handle, coords, i, &(line->point[i].x));
+      GEOSCoordSeq_getY_r(handle, coords, i, &(line->point[i].y));
+      /* GEOSCoordSeq_getZ(coords, i, &(line->point[i].z)); */
+    }
+  }
+#endif
+}
+
+static GEOSGeom msGEOSShape2Geometry_point(GEOSContextHandle_t handle, pointObj *point)
 {
   GEOSCoordSeq coords;
   GEOSGeom g;
-  GEOSContextHandle_t handle = msGetGeosContextHandle();
 
   if(!point) return NULL;
 
@@ -174,12 +249,11 @@ static GEOSGeom msGEOSShape2Geometry_point(pointObj *point)
   return g;
 }
 
-static GEOSGeom msGEOSShape2Geometry_multipoint(lineObj *multipoint)
+static GEOSGeom msGEOSShape2Geometry_multipoint(GEOSContextHandle_t handle, lineObj *multipoint)
 {
   int i;
   GEOSGeom g;
   GEOSGeom *points;
-  GEOSContextHandle_t handle = msGetGeosContextHandle();
 
   if(!multipoint) return NULL;
 
@@ -187,7 +261,7 @@ static GEOSGeom msGEOSShape2Geometry_multipoint(lineObj *multipoint)
   if(!points) return NULL;
 
   for(i=0; i<multipoint->numpoints; i++)
-    points[i] = msGEOSShape2Geometry_point(&(multipoint->point[i]));
+    points[i] = msGEOSShape2Geometry_point(handle, &(multipoint->point[i]));
 
   g = GEOSGeom_createCollection_r(handle,GEOS_MULTIPOINT, points, multipoint->numpoints);
 
@@ -196,35 +270,26 @@ static GEOSGeom msGEOSShape2Geometry_multipoint(lineObj *multipoint)
   return g;
 }
 
-static GEOSGeom msGEOSShape2Geometry_line(lineObj *line)
+static GEOSGeom msGEOSShape2Geometry_line(GEOSContextHandle_t handle, lineObj *line)
 {
-  int i;
   GEOSGeom g;
   GEOSCoordSeq coords;
-  GEOSContextHandle_t handle = msGetGeosContextHandle();
 
   if(!line) return NULL;
 
-  coords = GEOSCoordSeq_create_r(handle,line->numpoints, 2); /* todo handle z's */
+  coords = msGEOSPoints2CoordSeq(handle, line->point, line->numpoints);
   if(!coords) return NULL;
 
-  for(i=0; i<line->numpoints; i++) {
-    GEOSCoordSeq_setX_r(handle,coords, i, line->point[i].x);
-    GEOSCoordSeq_setY_r(handle,coords, i, line->point[i].y);
-    /* GEOSCoordSeq_setZ(coords, i, line->point[i].z); */
-  }
-
   g = GEOSGeom_createLineString_r(handle,coords); /* g owns the coordinates in coords */
 
   return g;
 }
 
-static GEOSGeom msGEOSShape2Geometry_multiline(shapeObj *multiline)
+static GEOSGeom msGEOSShape2Geometry_multiline(GEOSContextHandle_t handle, shapeObj *multiline)
 {
   int i;
   GEOSGeom g;
   GEOSGeom *lines;
-  GEOSContextHandle_t handle = msGetGeosContextHandle();
 
   if(!multiline) return NULL;
 
@@ -232,7 +297,7 @@ static GEOSGeom msGEOSShape2Geometry_multiline(shapeObj *multiline)
   if(!lines) return NULL;
 
   for(i=0; i<multiline->numlines; i++)
-    lines[i] = msGEOSShape2Geometry_line(&(multiline->line[i]));
+    lines[i] = msGEOSShape2Geometry_line(handle, &(multiline->line[i]));
 
   g = GEOSGeom_createCollection_r(handle,GEOS_MULTILINESTRING, lines, multiline->numlines);
 
@@ -241,28 +306,21 @@ static GEOSGeom msGEOSShape2Geometry_multiline(shapeObj *multiline)
   return g;
 }
 
-static GEOSGeom msGEOSShape2Geometry_simplepolygon(shapeObj *shape, int r, int *outerList)
+static GEOSGeom msGEOSShape2Geometry_simplepolygon(GEOSContextHandle_t handle, shapeObj *shape, int r, int *outerList)
 {
-  int i, j, k;
+  int j, k;
   GEOSCoordSeq coords;
   GEOSGeom g;
   GEOSGeom outerRing;
   GEOSGeom *innerRings=NULL;
   int numInnerRings=0, *innerList;
-  GEOSContextHandle_t handle = msGetGeosContextHandle();
 
   if(!shape || !outerList) return NULL;
 
   /* build the outer shell */
-  coords = GEOSCoordSeq_create_r(handle,shape->line[r].numpoints, 2); /* todo handle z's */
+  coords = msGEOSPoints2CoordSeq(handle, shape->line[r].point, shape->line[r].numpoints);
   if(!coords) return NULL;
 
-  for(i=0; i<shape->line[r].numpoints; i++) {
-    GEOSCoordSeq_setX_r(handle,coords, i, shape->line[r].point[i].x);
-    GEOSCoordSeq_setY_r(handle,coords, i, shape->line[r].point[i].y);
-    /* GEOSCoordSeq_setZ(coords, i, shape->line[r].point[i].z); */
-  }
-
   outerRing = GEOSGeom_createLinearRing_r(handle,coords); /* outerRing owns the coordinates in coords */
 
   /* build the holes */
@@ -278,19 +336,13 @@ static GEOSGeom msGEOSShape2Geometry_simplepolygon(shapeObj *shape, int r, int *
     for(j=0; j<shape->numlines; j++) {
       if(innerList[j] == MS_FALSE) continue;
 
-      coords = GEOSCoordSeq_create_r(handle,shape->line[j].numpoints, 2); /* todo handle z's */
+      coords = msGEOSPoints2CoordSeq(handle, shape->line[j].point, shape->line[j].numpoints);
       if(!coords) {
         free(innerRings);
         free(innerList);
         return NULL; /* todo, this will leak memory (shell + allocated holes) */
       }
 
-      for(i=0; i<shape->line[j].numpoints; i++) {
-        GEOSCoordSeq_setX_r(handle,coords, i, shape->line[j].point[i].x);
-        GEOSCoordSeq_setY_r(handle,coords, i, shape->line[j].point[i].y);
-        /* GEOSCoordSeq_setZ(coords, i, shape->line[j].point[i].z); */
-      }
-
       innerRings[k] = GEOSGeom_createLinearRing_r(handle,coords); /* innerRings[k] owns the coordinates in coords */
       k++;
     }
@@ -304,13 +356,12 @@ static GEOSGeom msGEOSShape2Geometry_simplepolygon(shapeObj *shape, int r, int *
   return g;
 }
 
-static GEOSGeom msGEOSShape2Geometry_polygon(shapeObj *shape)
+static GEOSGeom msGEOSShape2Geometry_polygon(GEOSContextHandle_t handle, shapeObj *shape)
 {
   int i, j;
   GEOSGeom *polygons;
   int *outerList, numOuterRings=0, lastOuterRing=0;
   GEOSGeom g;
-  GEOSContextHandle_t handle = msGetGeosContextHandle();
 
   outerList = msGetOuterList(shape);
   for(i=0; i<shape->numlines; i++) {
@@ -321,14 +372,14 @@ static GEOSGeom msGEOSShape2Geometry_polygon(shapeObj *shape)
   }
 
   if(numOuterRings == 1) {
-    g = msGEOSShape2Geometry_simplepolygon(shape, lastOuterRing, outerList);
+    g = msGEOSShape2Geometry_simplepolygon(handle, shape, lastOuterRing, outerList);
   } else { /* a true multipolygon */
     polygons = msSmallMalloc(numOuterRings*sizeof(GEOSGeom));
 
     j = 0; /* part counter */
     for(i=0; i<shape->numlines; i++) {
       if(outerList[i] == MS_FALSE) continue;
-      polygons[j] = msGEOSShape2Geometry_simplepolygon(shape, i, outerList); /* TODO: account for NULL return values */
+      polygons[j] = msGEOSShape2Geometry_simplepolygon(handle, shape, i, outerList); /* TODO: account for NULL return values */
       j++;
     }
 
@@ -342,33 +393,37 @@ static GEOSGeom msGEOSShape2Geometry_polygon(shapeObj *shape)
 
 GEOSGeom msGEOSShape2Geometry(shapeObj *shape)
 {
+  GEOSContextHandle_t handle;
+
   if(!shape)
     return NULL; /* a NULL shape generates a NULL geometry */
 
+  handle = msGetGeosContextHandle();
+
   switch(shape->type) {
     case MS_SHAPE_POINT:
       if(shape->numlines == 0 || shape->line[0].numpoints == 0) /* not enough info for a point */
         return NULL;
 
       if(shape->line[0].numpoints == 1) /* simple point */
-        return msGEOSShape2Geometry_point(&(shape->line[0].point[0]));
+        return msGEOSShape2Geometry_point(handle, &(shape->line[0].point[0]));
       else /* multi-point */
-        return msGEOSShape2Geometry_multipoint(&(shape->line[0]));
+        return msGEOSShape2Geometry_multipoint(handle, &(shape->line[0]));
       break;
     case MS_SHAPE_LINE:
       if(shape->numlines == 0 || shape->line[0].numpoints < 2) /* not enough info for a line */
         return NULL;
 
       if(shape->numlines == 1) /* simple line */
-        return msGEOSShape2Geometry_line(&(shape->line[0]));
+        return msGEOSShape2Geometry_line(handle, &(shape->line[0]));
       else /* multi-line */
-        return msGEOSShape2Geometry_multiline(shape);
+        return msGEOSShape2Geometry_multiline(handle, shape);
       break;
     case MS_SHAPE_POLYGON:
       if(shape->numlines == 0 || shape->line[0].numpoints < 4) /* not enough info for a polygon (first=last) */
         return NULL;
 
-      return msGEOSShape2Geometry_polygon(shape); /* simple and multipolygon cases are addressed */
+      return msGEOSShape2Geometry_polygon(handle, shape); /* simple and multipolygon cases are addressed */
       break;
     default:
       break;
@@ -377,11 +432,10 @@ GEOSGeom msGEOSShape2Geometry(shapeObj *shape)
   return NULL; /* should not get here */
 }
 
-static shapeObj *msGEOSGeometry2Shape_point(GEOSGeom g)
+static shapeObj *msGEOSGeometry2Shape_point(GEOSContextHandle_t handle, GEOSGeom g)
 {
   GEOSCoordSeq coords;
   shapeObj *shape=NULL;
-  GEOSContextHandle_t handle = msGetGeosContextHandle();
 
   if(!g) return NULL;
 
@@ -407,7 +461,7 @@ static shapeObj *msGEOSGeometry2Shape_point(GEOSGeom g)
   return shape;
 }
 
-static shapeObj *msGEOSGeometry2Shape_multipoint(GEOSGeom g)
+static shapeObj *msGEOSGeometry2Shape_multipoint(GEOSContextHandle_t handle, GEOSGeom g)
 {
   int i;
   int numPoints;
@@ -415,7 +469,6 @@ static shapeObj *msGEOSGeometry2Shape_multipoint(GEOSGeom g)
   GEOSGeom point;
 
   shapeObj *shape=NULL;
-  GEOSContextHandle_t handle = msGetGeosContextHandle();
 
   if(!g) return NULL;
   numPoints = GEOSGetNumGeometries_r(handle,g); /* each geometry has 1 point */
@@ -444,18 +497,11 @@ static shapeObj *msGEOSGeometry2Shape_multipoint(GEOSGeom g)
   return shape;
 }
 
-static shapeObj *msGEOSGeometry2Shape_line(GEOSGeom g)
+static shapeObj *msGEOSGeometry2Shape_line(GEOSContextHandle_t handle, GEOSGeom g)
 {
   shapeObj *shape=NULL;
-  GEOSContextHandle_t handle = msGetGeosContextHandle();
-
-  int i;
-  int numPoints;
-  GEOSCoordSeq coords;
 
   if(!g) return NULL;
-  numPoints = GEOSGetNumCoordinates_r(handle,g);
-  coords = (GEOSCoordSeq) GEOSGeom_getCoordSeq_r(handle,g);
 
   shape = (shapeObj *) malloc(sizeof(shapeObj));
   msInitShape(shape);
@@ -463,31 +509,22 @@ static shapeObj *msGEOSGeometry2Shape_line(GEOSGeom g)
   shape->type = MS_SHAPE_LINE;
   shape->line = (lineObj *) malloc(sizeof(lineObj));
   shape->numlines = 1;
-  shape->line[0].point = (pointObj *) malloc(sizeof(pointObj)*numPoints);
-  shape->line[0].numpoints = numPoints;
+  msGEOSGeometry2Line(handle, g, &(shape->line[0]));
   shape->geometry = (GEOSGeom) g;
 
-  for(i=0; i<numPoints; i++) {
-    GEOSCoordSeq_getX_r(handle,coords, i, &(shape->line[0].point[i].x));
-    GEOSCoordSeq_getY_r(handle,coords, i, &(shape->line[0].point[i].y));
-    /* GEOSCoordSeq_getZ(coords, i, &(shape->line[0].point[i].z)); */
-  }
-
   msComputeBounds(shape);
 
   return shape;
 }
 
-static shapeObj *msGEOSGeometry2Shape_multiline(GEOSGeom g)
+static shapeObj *msGEOSGeometry2Shape_multiline(GEOSContextHandle_t handle, GEOSGeom g)
 {
-  int i, j;
-  int numPoints, numLines;
-  GEOSCoordSeq coords;
+  int j;
+  int numLines;
   GEOSGeom lineString;
 
   shapeObj *shape=NULL;
   lineObj line;
-  GEOSContextHandle_t handle = msGetGeosContextHandle();
 
   if(!g) return NULL;
   numLines = GEOSGetNumGeometries_r(handle,g);
@@ -500,18 +537,7 @@ static shapeObj *msGEOSGeometry2Shape_multiline(GEOSGeom g)
 
   for(j=0; j<numLines; j++) {
     lineString = (GEOSGeom) GEOSGetGeometryN_r(handle,g, j);
-    numPoints = GEOSGetNumCoordinates_r(handle,lineString);
-    coords = (GEOSCoordSeq) GEOSGeom_getCoordSeq_r(handle,lineString);
-
-    line.point = (pointObj *) malloc(sizeof(pointObj)*numPoints);
-    line.numpoints = numPoints;
-
-    for(i=0; i<numPoints; i++) {
-      GEOSCoordSeq_getX_r(handle,coords, i, &(line.point[i].x));
-      GEOSCoordSeq_getY_r(handle,coords, i, &(line.point[i].y));
-      /* GEOSCoordSeq_getZ(coords, i, &(line.point[i].z)); */
-    }
-
+    msGEOSGeometry2Line(handle, lineString, &line);
     msAddLineDirectly(shape, &line);
   }
 
@@ -520,16 +546,14 @@ static shapeObj *msGEOSGeometry2Shape_multiline(GEOSGeom g)
   return shape;
 }
 
-static shapeObj *msGEOSGeometry2Shape_polygon(GEOSGeom g)
+static shapeObj *msGEOSGeometry2Shape_polygon(GEOSContextHandle_t handle, GEOSGeom g)
 {
   shapeObj *shape=NULL;
   lineObj line;
-  int numPoints, numRings;
-  int i, j;
+  int numRings;
+  int j;
 
-  GEOSCoordSeq coords;
   GEOSGeom ring;
-  GEOSContextHandle_t handle = msGetGeosContextHandle();
 
   if(!g) return NULL;
 
@@ -540,17 +564,7 @@ static shapeObj *msGEOSGeometry2Shape_polygon(GEOSGeom g)
 
   /* exterior ring */
   ring = (GEOSGeom) GEOSGetExteriorRing_r(handle,g);
-  numPoints = GEOSGetNumCoordinates_r(handle,ring);
-  coords = (GEOSCoordSeq) GEOSGeom_getCoordSeq_r(handle,ring);
-
-  line.point = (pointObj *) malloc(sizeof(pointObj)*numPoints);
-  line.numpoints = numPoints;
-
-  for(i=0; i<numPoints; i++) {
-    GEOSCoordSeq_getX_r(handle,coords, i, &(line.point[i].x));
-    GEOSCoordSeq_getY_r(handle,coords, i, &(line.point[i].y));
-    /* GEOSCoordSeq_getZ(coords, i, &(line.point[i].z)); */
-  }
+  msGEOSGeometry2Line(handle, ring, &line);
   msAddLineDirectly(shape, &line);
 
   /* interior rings */
@@ -559,17 +573,7 @@ static shapeObj *msGEOSGeometry2Shape_polygon(GEOSGeom g)
     ring = (GEOSGeom) GEOSGetInteriorRingN_r(handle,g, j);
     if(GEOSisRing_r(handle,ring) != 1) continue; /* skip it */
 
-    numPoints = GEOSGetNumCoordinates_r(handle,ring);
-    coords = (GEOSCoordSeq) GEOSGeom_getCoordSeq_r(handle,ring);
-
-    line.point = (pointObj *) malloc(sizeof(pointObj)*numPoints);
-    line.numpoints = numPoints;
-
-    for(i=0; i<numPoints; i++) {
-      GEOSCoordSeq_getX_r(handle,coords, i, &(line.point[i].x));
-      GEOSCoordSeq_getY_r(handle,coords, i, &(line.point[i].y));
-      /* GEOSCoordSeq_getZ(coords, i, &(line.point[i].z)); */
-    }
+    msGEOSGeometry2Line(handle, ring, &line);
     msAddLineDirectly(shape, &line);
   }
 
@@ -578,16 +582,14 @@ static shapeObj *msGEOSGeometry2Shape_polygon(GEOSGeom g)
   return shape;
 }
 
-static shapeObj *msGEOSGeometry2Shape_multipolygon(GEOSGeom g)
+static shapeObj *msGEOSGeometry2Shape_multipolygon(GEOSContextHandle_t handle, GEOSGeom g)
 {
-  int i, j, k;
+  int j, k;
   shapeObj *shape=NULL;
   lineObj line;
-  int numPoints, numRings, numPolygons;
+  int numRings, numPolygons;
 
-  GEOSCoordSeq coords;
   GEOSGeom polygon, ring;
-  GEOSContextHandle_t handle = msGetGeosContextHandle();
 
   if(!g) return NULL;
   numPolygons = GEOSGetNumGeometries_r(handle,g);
@@ -602,17 +604,7 @@ static shapeObj *msGEOSGeometry2Shape_multipolygon(GEOSGeom g)
 
     /* exterior ring */
     ring = (GEOSGeom) GEOSGetExteriorRing_r(handle,polygon);
-    numPoints = GEOSGetNumCoordinates_r(handle,ring);
-    coords = (GEOSCoordSeq) GEOSGeom_getCoordSeq_r(handle,ring);
-
-    line.point = (pointObj *) malloc(sizeof(pointObj)*numPoints);
-    line.numpoints = numPoints;
-
-    for(i=0; i<numPoints; i++) {
-      GEOSCoordSeq_getX_r(handle,coords, i, &(line.point[i].x));
-      GEOSCoordSeq_getY_r(handle,coords, i, &(line.point[i].y));
-      /* GEOSCoordSeq_getZ(coords, i, &(line.point[i].z)); */
-    }
+    msGEOSGeometry2Line(handle, ring, &line);
     msAddLineDirectly(shape, &line);
 
     /* interior rings */
@@ -622,17 +614,7 @@ static shapeObj *msGEOSGeometry2Shape_multipolygon(GEOSGeom g)
       ring = (GEOSGeom) GEOSGetInteriorRingN_r(handle,polygon, j);
       if(GEOSisRing_r(handle,ring) != 1) continue; /* skip it */
 
-      numPoints = GEOSGetNumCoordinates_r(handle,ring);
-      coords = (GEOSCoordSeq) GEOSGeom_getCoordSeq_r(handle,ring);
-
-      line.point = (pointObj *) malloc(sizeof(pointObj)*numPoints);
-      line.numpoints = numPoints;
-
-      for(i=0; i<numPoints; i++) {
-        GEOSCoordSeq_getX_r(handle,coords, i, &(line.point[i].x));
-        GEOSCoordSeq_getY_r(handle,coords, i, &(line.point[i].y));
-        /* GEOSCoordSeq_getZ(coords, i, &(line.point[i].z)); */
-      }
+      msGEOSGeometry2Line(handle, ring, &line);
       msAddLineDirectly(shape, &line);
     }
   } /* next polygon */
@@ -653,22 +635,22 @@ shapeObj *msGEOSGeometry2Shape(GEOSGeom g)
   type = GEOSGeomTypeId_r(handle,g);
   switch(type) {
     case GEOS_POINT:
-      return msGEOSGeometry2Shape_point(g);
+      return msGEOSGeometry2Shape_point(handle, g);
       break;
     case GEOS_MULTIPOINT:
-      return msGEOSGeometry2Shape_multipoint(g);
+      return msGEOSGeometry2Shape_multipoint(handle, g);
       break;
     case GEOS_LINESTRING:
-      return msGEOSGeometry2Shape_line(g);
+      return msGEOSGeometry2Shape_line(handle, g);
       break;
     case GEOS_MULTILINESTRING:
-      return msGEOSGeometry2Shape_multiline(g);
+      return msGEOSGeometry2Shape_multiline(handle, g);
       break;
     case GEOS_POLYGON:
-      return msGEOSGeometry2Shape_polygon(g);
+      return msGEOSGeometry2Shape_polygon(handle, g);
       break;
     case GEOS_MULTIPOLYGON:
-      return msGEOSGeometry2Shape_multipolygon(g);
+      return msGEOSGeometry2Shape_multipolygon(handle, g);
       break;
     case GEOS_GEOMETRYCOLLECTION:
       if (!GEOSisEmpty_r(handle,g))
@@ -718,6 +700,13 @@ void msGEOSFreeGeometry(shapeObj *shape)
   if(!shape || !shape->geometry)
     return;
 
+#if GEOS_VERSION_MAJOR > 3 || (GEOS_VERSION_MAJOR == 3 && GEOS_VERSION_MINOR >= 3)
+  if(shape->prepared_geometry) {
+    GEOSPreparedGeom_destroy_r(handle, (const GEOSPreparedGeometry *) shape->prepared_geometry);
+    shape->prepared_geometry = NULL;
+  }
+#endif
+
   g = (GEOSGeom) shape->geometry;
   GEOSGeom_destroy_r(handle,g);
   shape->geometry = NULL;
@@ -727,6 +716,134 @@ void msGEOSFreeGeometry(shapeObj *shape)
 #endif
 }
 
+/*
+** Prepared geometries. A shape tested against many others, like the
+** fromText() literals of an expression, can be given a GEOS prepared
+** geometry and up to date bounds once. The predicates below then reject the
+** shapes whose bounds miss it without converting them to GEOS at all, and
+** test the others against the indexed prepared geometry. Returns MS_SUCCESS
+** or MS_FAILURE, the shape is usable the plain way either way.
+*/
+int msGEOSPrepareGeometry(shapeObj *shape)
+{
+#if defined USE_GEOS && (GEOS_VERSION_MAJOR > 3 || (GEOS_VERSION_MAJOR == 3 && GEOS_VERSION_MINOR >= 3))
+  GEOSContextHandle_t handle = msGetGeosContextHandle();
+
+  if(!shape || shape->numlines == 0)
+    return MS_FAILURE;
+  if(shape->prepared_geometry)
+    return MS_SUCCESS;
+
+  if(!shape->geometry) /* if no geometry for the shape then build one */
+    shape->geometry = (GEOSGeom) msGEOSShape2Geometry(shape);
+  if(!shape->geometry)
+    return MS_FAILURE;
+
+  msComputeBounds(shape);
+  shape->prepared_geometry = (void *) GEOSPrepare_r(handle, (GEOSGeom) shape->geometry);
+  return (shape->prepared_geometry) ? MS_SUCCESS : MS_FAILURE;
+#else
+  (void)shape;
+  return MS_FAILURE;
+#endif
+}
+
+#if defined USE_GEOS && (GEOS_VERSION_MAJOR > 3 || (GEOS_VERSION_MAJOR == 3 && GEOS_VERSION_MINOR >= 3))
+
+/*
+** Evaluates predicate(shape1, shape2) when one of them has a prepared
+** geometry. Returns MS_FALSE if it did not and the plain GEOS test is to be
+** made, else MS_TRUE with MS_TRUE/MS_FALSE or -1 for an error in *result.
+*/
+static int msGEOSPreparedPredicate(shapeObj *shape1, shapeObj *shape2, int predicate, int *result)
+{
+  shapeObj *prepared, *other;
+  const GEOSPreparedGeometry *p;
+  GEOSGeom g;
+  rectObj bounds;
+  int i, j, swapped, r;
+  GEOSContextHandle_t handle = msGetGeosContextHandle();
+
+  if(shape1->prepared_geometry) {
+    prepared = shape1;
+    other = shape2;
+    swapped = MS_FALSE;
+  } else if(shape2->prepared_geometry) {
+    prepared = shape2;
+    other = shape1;
+    swapped = MS_TRUE;
+  } else
+    return MS_FALSE;
+
+  if(other->numlines == 0 || other->line[0].numpoints == 0)
+    return MS_FALSE;
+
+  /* the bounds of the other shape are not trusted, they are cheap to get anyway */
+  bounds.minx = bounds.maxx = other->line[0].point[0].x;
+  bounds.miny = bounds.maxy = other->line[0].point[0].y;
+  for(i=0; i<other->numlines; i++) {
+    for(j=0; j<other->line[i].numpoints; j++) {
+      const pointObj *point = &(other->line[i].point[j]);
+      bounds.minx = MS_MIN(bounds.minx, point->x);
+      bounds.maxx = MS_MAX(bounds.maxx, point->x);
+      bounds.miny = MS_MIN(bounds.miny, point->y);
+      bounds.maxy = MS_MAX(bounds.maxy, point->y);
+    }
+  }
+
+  if(!msRectOverlap(&(prepared->bounds), &bounds)) { /* every predicate but disjoint needs a common point */
+    *result = (predicate == MS_GEOS_DISJOINT) ? MS_TRUE : MS_FALSE;
+    return MS_TRUE;
+  }
+
+  if(predicate == MS_GEOS_EQUALS) /* no prepared version of this one */
+    return MS_FALSE;
+
+  if(!other->geometry) /* if no geometry for the shape then build one */
+    other->geometry = (GEOSGeom) msGEOSShape2Geometry(other);
+  g = (GEOSGeom) other->geometry;
+  if(!g) {
+    *result = -1;
+    return MS_TRUE;
+  }
+
+  p = (const GEOSPreparedGeometry *) prepared->prepared_geometry;
+  switch(predicate) {
+    case MS_GEOS_CONTAINS: /* shape1 contains shape2 is shape2 within shape1 */
+      r = swapped ? GEOSPreparedWithin_r(handle, p, g) : GEOSPreparedContains_r(handle, p, g);
+      break;
+    case MS_GEOS_WITHIN:
+      r = swapped ? GEOSPreparedContains_r(handle, p, g) : GEOSPreparedWithin_r(handle, p, g);
+      break;
+    case MS_GEOS_OVERLAPS:
+      r = GEOSPreparedOverlaps_r(handle, p, g);
+      break;
+    case MS_GEOS_CROSSES:
+      r = GEOSPreparedCrosses_r(handle, p, g);
+      break;
+    case MS_GEOS_INTERSECTS:
+      r = GEOSPreparedIntersects_r(handle, p, g);
+      break;
+    case MS_GEOS_TOUCHES:
+      r = GEOSPreparedTouches_r(handle, p, g);
+      break;
+    case MS_GEOS_DISJOINT:
+      r = GEOSPreparedDisjoint_r(handle, p, g);
+      break;
+    default:
+      return MS_FALSE;
+  }
+
+  *result = ((r==2) ? -1 : r);
+  return MS_TRUE;
+}
+
+#define MS_GEOS_TRY_PREPARED(shape1, shape2, predicate) \
+  if(msGEOSPreparedPredicate(shape1, shape2, predicate, &result)) return result
+#else
+#define MS_GEOS_TRY_PREPARED(shape1, shape2, predicate)
+#endif
+
 /*
 ** WKT input and output functions
 */
@@ -1085,6 +1202,8 @@ int msGEOSContains(shapeObj *shape1, shapeObj *shape2)
   if(!shape1 || !shape2)
     return -1;
 
+  MS_GEOS_TRY_PREPARED(shape1, shape2, MS_GEOS_CONTAINS);
+
   if(!shape1->geometry) /* if no geometry for shape1 then build one */
     shape1->geometry = (GEOSGeom) msGEOSShape2Geometry(shape1);
   g1 = shape1->geometry;
@@ -1116,6 +1235,8 @@ int msGEOSOverlaps(shapeObj *shape1, shapeObj *shape2)
   if(!shape1 || !shape2)
     return -1;
 
+  MS_GEOS_TRY_PREPARED(shape1, shape2, MS_GEOS_OVERLAPS);
+
   if(!shape1->geometry) /* if no geometry for shape1 then build one */
     shape1->geometry = (GEOSGeom) msGEOSShape2Geometry(shape1);
   g1 = shape1->geometry;
@@ -1147,6 +1268,8 @@ int msGEOSWithin(shapeObj *shape1, shapeObj *shape2)
   if(!shape1 || !shape2)
     return -1;
 
+  MS_GEOS_TRY_PREPARED(shape1, shape2, MS_GEOS_WITHIN);
+
   if(!shape1->geometry) /* if no geometry for shape1 then build one */
     shape1->geometry = (GEOSGeom) msGEOSShape2Geometry(shape1);
   g1 = shape1->geometry;
@@ -1178,6 +1301,8 @@ int msGEOSCrosses(shapeObj *shape1, shapeObj *shape2)
   if(!shape1 || !shape2)
     return -1;
 
+  MS_GEOS_TRY_PREPARED(shape1, shape2, MS_GEOS_CROSSES);
+
   if(!shape1->geometry) /* if no geometry for shape1 then build one */
     shape1->geometry = (GEOSGeom) msGEOSShape2Geometry(shape1);
   g1 = shape1->geometry;
@@ -1209,6 +1334,8 @@ int msGEOSIntersects(shapeObj *shape1, shapeObj *shape2)
   if(!shape1 || !shape2)
     return -1;
 
+  MS_GEOS_TRY_PREPARED(shape1, shape2, MS_GEOS_INTERSECTS);
+
   if(!shape1->geometry) /* if no geometry for shape1 then build one */
     shape1->geometry = (GEOSGeom) msGEOSShape2Geometry(shape1);
   g1 = (GEOSGeom) shape1->geometry;
@@ -1261,6 +1388,8 @@ int msGEOSTouches(shapeObj *shape1, shapeObj *shape2)
   if(!shape1 || !shape2)
     return -1;
 
+  MS_GEOS_TRY_PREPARED(shape1, shape2, MS_GEOS_TOUCHES);
+
   if(!shape1->geometry) /* if no geometry for shape1 then build one */
     shape1->geometry = (GEOSGeom) msGEOSShape2Geometry(shape1);
   g1 = (GEOSGeom) shape1->geometry;
@@ -1292,6 +1421,8 @@ int msGEOSEquals(shapeObj *shape1, shapeObj *shape2)
   if(!shape1 || !shape2)
     return -1;
 
+  MS_GEOS_TRY_PREPARED(shape1, shape2, MS_GEOS_EQUALS);
+
   if(!shape1->geometry) /* if no geometry for shape1 then build one */
     shape1->geometry = (GEOSGeom) msGEOSShape2Geometry(shape1);
   g1 = (GEOSGeom) shape1->geometry;
@@ -1323,6 +1454,8 @@ int msGEOSDisjoint(shapeObj *shape1, shapeObj *shape2)
   if(!shape1 || !shape2)
     return -1;
 
+  MS_GEOS_TRY_PREPARED(shape1, shape2, MS_GEOS_DISJOINT);
+
   if(!shape1->geometry) /* if no geometry for shape1 then build one */
     shape1->geometry = (GEOSGeom) msGEOSShape2Geometry(shape1);
   g1 = (GEOSGeom) shape1->geometry;
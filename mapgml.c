@@ -1479,7 +1479,7 @@ int msGMLWriteQuery(mapObj *map, char *filename, const char *namespaces)
       }
 
       for(j=0; j<lp->resultcache->numresults; j++) {
-        status = msLayerGetShape(lp, &shape, &(lp->resultcache->results[j]));
+        status = msLayerGetResultShape(lp, &shape, j);
         if(status != MS_SUCCESS) {
            msGMLFreeGroups(groupList);
            msGMLFreeConstants(constantList);
@@ -1621,6 +1621,336 @@ void msGMLWriteWFSBounds(mapObj *map, FILE *stream, const char *tab,
 
 #endif
 
+#ifdef USE_WFS_SVR
+/*
+** gmlWFSWriterObj: what msGMLWriteWFSQuery() and a streamed GetFeature
+** response need to write the features of one layer after the other.
+*/
+struct gmlWFSWriterObj {
+  mapObj *map;
+  FILE *stream;
+  const char *default_namespace_prefix;
+  OWSGMLVersion outputformat;
+  int nWFSVersion;
+  int bUseURN;
+  int bGetPropertyValueRequest;
+  int bSwapAxis;
+
+  /* layer whose features are being written, NULL before the first one */
+  layerObj *lp;
+  const char *namespace_prefix;
+  char *layerName;
+  int featureIdIndex;
+  char *srs;
+  int bOutputGMLIdOnly;
+  int nSRSDimension;
+  gmlGroupListObj *groupList;
+  gmlItemListObj *itemList;
+  gmlConstantListObj *constantList;
+  gmlGeometryListObj *geometryList;
+
+  int maxfeatures; /* features msGMLWriteWFSStreamShape() writes at most, -1 for no limit */
+  int numfeatures; /* features msGMLWriteWFSStreamShape() wrote */
+};
+
+static void gmlWFSWriterEndLayer(gmlWFSWriterObj *writer)
+{
+  if(writer->lp == NULL) return;
+
+  msFree(writer->srs);
+  msFree(writer->layerName);
+  msGMLFreeGroups(writer->groupList);
+  msGMLFreeConstants(writer->constantList);
+  msGMLFreeItems(writer->itemList);
+  msGMLFreeGeometries(writer->geometryList);
+
+  writer->srs = NULL;
+  writer->layerName = NULL;
+  writer->groupList = NULL;
+  writer->constantList = NULL;
+  writer->itemList = NULL;
+  writer->geometryList = NULL;
+  writer->lp = NULL;
+}
+
+/* Sets up the writer for the features of lp, whose items must be known. */
+static int gmlWFSWriterBeginLayer(gmlWFSWriterObj *writer, layerObj *lp)
+{
+  mapObj *map = writer->map;
+  FILE *stream = writer->stream;
+  const char *value;
+  const char* geomtype;
+  int j;
+
+  gmlWFSWriterEndLayer(writer);
+
+  writer->lp = lp;
+  writer->featureIdIndex = -1; /* no feature id */
+  writer->bOutputGMLIdOnly = MS_FALSE;
+  writer->nSRSDimension = 2;
+
+  /* setup namespace, a layer can override the default */
+  writer->namespace_prefix = msOWSLookupMetadata(&(lp->metadata), "OFG", "namespace_prefix");
+  if(!writer->namespace_prefix) writer->namespace_prefix = writer->default_namespace_prefix;
+
+  geomtype = msOWSLookupMetadata(&(lp->metadata), "OFG", "geomtype");
+  if( geomtype != NULL && (strstr(geomtype, "25d") != NULL || strstr(geomtype, "25D") != NULL) )
+  {
+#ifdef USE_POINT_Z_M
+      writer->nSRSDimension = 3;
+#else
+      msIO_fprintf(stream, "<!-- WARNING: 25d requested forn typename '%s' but MapServer compiled without USE_POINT_Z_M support. -->\n", lp->name);
+#endif
+  }
+
+  value = msOWSLookupMetadata(&(lp->metadata), "OFG", "featureid");
+  if(value) { /* find the featureid amongst the items for this layer */
+    for(j=0; j<lp->numitems; j++) {
+      if(strcasecmp(lp->items[j], value) == 0) { /* found it */
+        writer->featureIdIndex = j;
+        break;
+      }
+    }
+
+    /* Produce a warning if a featureid was set but the corresponding item is not found. */
+    if (writer->featureIdIndex == -1)
+      msIO_fprintf(stream, "<!-- WARNING: FeatureId item '%s' not found in typename '%s'. -->\n", value, lp->name);
+  }
+  else if( writer->outputformat == OWS_GML32 )
+      msIO_fprintf(stream, "<!-- WARNING: No featureid defined for typename '%s'. Output will not validate. -->\n", lp->name);
+
+  /* populate item and group metadata structures */
+  writer->itemList = msGMLGetItems(lp, "G");
+  writer->constantList = msGMLGetConstants(lp, "G");
+  writer->groupList = msGMLGetGroups(lp, "G");
+  writer->geometryList = msGMLGetGeometries(lp, "GFO", MS_FALSE);
+  if (writer->itemList == NULL || writer->constantList == NULL || writer->groupList == NULL || writer->geometryList == NULL) {
+    msSetError(MS_MISCERR, "Unable to populate item and group metadata structures", "msGMLWriteWFSQuery()");
+    return MS_FAILURE;
+  }
+
+  if( writer->bGetPropertyValueRequest )
+  {
+    const char* value = msOWSLookupMetadata(&(lp->metadata), "G", "include_items");
+    if( value != NULL && strcmp(value, "@gml:id") == 0 )
+        writer->bOutputGMLIdOnly = MS_TRUE;
+  }
+
+  if (writer->namespace_prefix) {
+    writer->layerName = (char *) msSmallMalloc(strlen(writer->namespace_prefix)+strlen(lp->name)+2);
+    sprintf(writer->layerName, "%s:%s", writer->namespace_prefix, lp->name);
+  } else {
+    writer->layerName = msStrdup(lp->name);
+  }
+
+#ifdef USE_PROJ
+  if( writer->bUseURN )
+  {
+      writer->srs = msOWSGetProjURN(&(map->projection), NULL, "FGO", MS_TRUE);
+      if (!writer->srs)
+        writer->srs = msOWSGetProjURN(&(map->projection), &(map->web.metadata), "FGO", MS_TRUE);
+      if (!writer->srs)
+        writer->srs = msOWSGetProjURN(&(lp->projection), &(lp->metadata), "FGO", MS_TRUE);
+  }
+  else
+  {
+      msOWSGetEPSGProj(&(map->projection), NULL, "FGO", MS_TRUE, &writer->srs);
+      if (!writer->srs)
+        msOWSGetEPSGProj(&(map->projection), &(map->web.metadata), "FGO", MS_TRUE, &writer->srs);
+      if (!writer->srs)
+        msOWSGetEPSGProj(&(lp->projection), &(lp->metadata), "FGO", MS_TRUE, &writer->srs);
+  }
+#else
+  (void)map;
+#endif
+
+  return MS_SUCCESS;
+}
+
+/* Writes one feature of the current layer, shape is in the map projection. */
+static void gmlWFSWriterWriteFeature(gmlWFSWriterObj *writer, shapeObj *shape)
+{
+  FILE *stream = writer->stream;
+  layerObj *lp = writer->lp;
+  const char *namespace_prefix = writer->namespace_prefix;
+  const char *layerName = writer->layerName;
+  OWSGMLVersion outputformat = writer->outputformat;
+  int bGetPropertyValueRequest = writer->bGetPropertyValueRequest;
+  gmlGroupListObj *groupList = writer->groupList;
+  gmlItemListObj *itemList = writer->itemList;
+  gmlConstantListObj *constantList = writer->constantList;
+  gmlGeometryListObj *geometryList = writer->geometryList;
+  gmlItemObj *item=NULL;
+  gmlConstantObj *constant=NULL;
+  char* pszFID;
+  int k;
+
+  if(writer->featureIdIndex != -1) {
+      pszFID = (char*) msSmallMalloc( strlen(lp->name) + 1 + strlen(shape->values[writer->featureIdIndex]) + 1 );
+      sprintf(pszFID, "%s.%s", lp->name, shape->values[writer->featureIdIndex]);
+  }
+  else
+      pszFID = msStrdup("");
+
+
+  if( writer->bOutputGMLIdOnly )
+  {
+      msIO_fprintf(stream, "    <wfs:member>%s</wfs:member>\n", pszFID);
+      msFree(pszFID);
+      return;
+  }
+
+  /*
+  ** start this feature
+  */
+  if( writer->nWFSVersion == OWS_2_0_0 )
+      msIO_fprintf(stream, "    <wfs:member>\n");
+  else
+      msIO_fprintf(stream, "    <gml:featureMember>\n");
+  if(msIsXMLTagValid(layerName) == MS_FALSE)
+      msIO_fprintf(stream, "<!-- WARNING: The value '%s' is not valid in a XML tag context. -->\n", layerName);
+  if(writer->featureIdIndex != -1) {
+      if( !bGetPropertyValueRequest )
+      {
+          if(outputformat == OWS_GML2)
+              msIO_fprintf(stream, "      <%s fid=\"%s\">\n", layerName, pszFID);
+          else  /* OWS_GML3 or OWS_GML32 */
+              msIO_fprintf(stream, "      <%s gml:id=\"%s\">\n", layerName, pszFID);
+      }
+  } else {
+      if( !bGetPropertyValueRequest )
+          msIO_fprintf(stream, "      <%s>\n", layerName);
+  }
+
+  if (writer->bSwapAxis)
+    msAxisSwapShape(shape);
+
+  /* write the feature geometry and bounding box */
+  if(!(geometryList && geometryList->numgeometries == 1 &&
+      strcasecmp(geometryList->geometries[0].name, "none") == 0)) {
+    if( !bGetPropertyValueRequest )
+      gmlWriteBounds(stream, outputformat, &(shape->bounds), writer->srs, "        ", "gml");
+    gmlWriteGeometry(stream, geometryList, outputformat, shape, writer->srs,
+                     namespace_prefix, "        ", pszFID, writer->nSRSDimension);
+  }
+
+  /* write any item/values */
+  for(k=0; k<itemList->numitems; k++) {
+    item = &(itemList->items[k]);
+    if(msItemInGroups(item->name, groupList) == MS_FALSE)
+      msGMLWriteItem(stream, item, shape->values[k], namespace_prefix,
+                     "        ", outputformat, pszFID);
+  }
+
+  /* write any constants */
+  for(k=0; k<constantList->numconstants; k++) {
+    constant = &(constantList->constants[k]);
+    if(msItemInGroups(constant->name, groupList) == MS_FALSE)
+      msGMLWriteConstant(stream, constant, namespace_prefix, "        ");
+  }
+
+  /* write any groups */
+  for(k=0; k<groupList->numgroups; k++)
+    msGMLWriteGroup(stream, &(groupList->groups[k]), shape, itemList,
+                    constantList, namespace_prefix, "        ", outputformat, pszFID);
+
+  if( !bGetPropertyValueRequest )
+      /* end this feature */
+      msIO_fprintf(stream, "      </%s>\n", layerName);
+
+  if( writer->nWFSVersion == OWS_2_0_0 )
+    msIO_fprintf(stream, "    </wfs:member>\n");
+  else
+    msIO_fprintf(stream, "    </gml:featureMember>\n");
+
+
+  msFree(pszFID);
+}
+
+static void gmlWFSWriterInit(gmlWFSWriterObj *writer, mapObj *map, FILE *stream,
+                             const char *default_namespace_prefix,
+                             OWSGMLVersion outputformat, int nWFSVersion, int bUseURN,
+                             int bGetPropertyValueRequest)
+{
+  memset(writer, 0, sizeof(gmlWFSWriterObj));
+  writer->map = map;
+  writer->stream = stream;
+  writer->default_namespace_prefix = default_namespace_prefix;
+  writer->outputformat = outputformat;
+  writer->nWFSVersion = nWFSVersion;
+  writer->bUseURN = bUseURN;
+  writer->bGetPropertyValueRequest = bGetPropertyValueRequest;
+  writer->maxfeatures = -1;
+
+  /*add a check to see if the map projection is set to be north-east*/
+  writer->bSwapAxis = msIsAxisInvertedProj(&(map->projection));
+}
+
+/*
+** msGMLBeginWFSStream()
+**
+** Streamed GetFeature response: rather than running the query and then
+** fetching every result again, msWFSGetFeature() sets
+** msGMLWriteWFSStreamShape() as the shape function of the query, so the
+** features are written while the layers are scanned. At most maxfeatures
+** (-1 for no limit) features are written, the collection bounds are not.
+*/
+gmlWFSWriterObj *msGMLBeginWFSStream(mapObj *map, FILE *stream, const char *default_namespace_prefix,
+                                     OWSGMLVersion outputformat, int nWFSVersion, int bUseURN,
+                                     int maxfeatures)
+{
+  gmlWFSWriterObj *writer = (gmlWFSWriterObj *) msSmallMalloc(sizeof(gmlWFSWriterObj));
+
+  gmlWFSWriterInit(writer, map, stream, default_namespace_prefix, outputformat,
+                   nWFSVersion, bUseURN, MS_FALSE);
+  writer->maxfeatures = maxfeatures;
+
+  return writer;
+}
+
+/*
+** msGMLWriteWFSStreamShape()
+**
+** Query shape function (see queryObj) writing the shapes of a streamed
+** GetFeature response, data is what msGMLBeginWFSStream() returned.
+*/
+int msGMLWriteWFSStreamShape(layerObj *lp, shapeObj *shape, void *data)
+{
+  gmlWFSWriterObj *writer = (gmlWFSWriterObj *) data;
+
+  /* the extra feature asked for to know whether there is a next page */
+  if(writer->maxfeatures >= 0 && writer->numfeatures >= writer->maxfeatures)
+    return MS_SUCCESS;
+
+  if(lp != writer->lp && gmlWFSWriterBeginLayer(writer, lp) != MS_SUCCESS)
+    return MS_FAILURE;
+
+  gmlWFSWriterWriteFeature(writer, shape);
+  writer->numfeatures++;
+
+  return MS_SUCCESS;
+}
+
+/*
+** msGMLEndWFSStream()
+**
+** Frees what msGMLBeginWFSStream() returned, returns the number of
+** features written.
+*/
+int msGMLEndWFSStream(gmlWFSWriterObj *writer)
+{
+  int numfeatures;
+
+  if(writer == NULL) return 0;
+
+  gmlWFSWriterEndLayer(writer);
+  numfeatures = writer->numfeatures;
+  msFree(writer);
+
+  return numfeatures;
+}
+#endif /* USE_WFS_SVR */
+
 /*
 ** msGMLWriteWFSQuery()
 **
@@ -1632,24 +1962,15 @@ int msGMLWriteWFSQuery(mapObj *map, FILE *stream, const char *default_namespace_
 {
 #ifdef USE_WFS_SVR
   int status;
-  int i,j,k;
+  int i,j;
   layerObj *lp=NULL;
   shapeObj shape;
-
-  gmlGroupListObj *groupList=NULL;
-  gmlItemListObj *itemList=NULL;
-  gmlConstantListObj *constantList=NULL;
-  gmlGeometryListObj *geometryList=NULL;
-  gmlItemObj *item=NULL;
-  gmlConstantObj *constant=NULL;
-
-  const char *namespace_prefix=NULL;
-  int bSwapAxis;
+  gmlWFSWriterObj writer;
 
   msInitShape(&shape);
 
-  /*add a check to see if the map projection is set to be north-east*/
-  bSwapAxis = msIsAxisInvertedProj(&(map->projection));
+  gmlWFSWriterInit(&writer, map, stream, default_namespace_prefix, outputformat,
+                   nWFSVersion, bUseURN, bGetPropertyValueRequest);
 
   /* Need to start with BBOX of the whole resultset */
   if (!bGetPropertyValueRequest) {
@@ -1661,97 +1982,16 @@ int msGMLWriteWFSQuery(mapObj *map, FILE *stream, const char *default_namespace_
     lp = GET_LAYER(map, map->layerorder[i]);
 
     if(lp->resultcache && lp->resultcache->numresults > 0)  { /* found results */
-      char *layerName;
-      const char *value;
-      int featureIdIndex=-1; /* no feature id */
-      char* srs = NULL;
-      int bOutputGMLIdOnly = MS_FALSE;
-      int nSRSDimension = 2;
-      const char* geomtype;
-
-      /* setup namespace, a layer can override the default */
-      namespace_prefix = msOWSLookupMetadata(&(lp->metadata), "OFG", "namespace_prefix");
-      if(!namespace_prefix) namespace_prefix = default_namespace_prefix;
-      
-      geomtype = msOWSLookupMetadata(&(lp->metadata), "OFG", "geomtype");
-      if( geomtype != NULL && (strstr(geomtype, "25d") != NULL || strstr(geomtype, "25D") != NULL) )
-      {
-#ifdef USE_POINT_Z_M
-          nSRSDimension = 3;
-#else
-          msIO_fprintf(stream, "<!-- WARNING: 25d requested forn typename '%s' but MapServer compiled without USE_POINT_Z_M support. -->\n", lp->name);
-#endif
-      }
-
-      value = msOWSLookupMetadata(&(lp->metadata), "OFG", "featureid");
-      if(value) { /* find the featureid amongst the items for this layer */
-        for(j=0; j<lp->numitems; j++) {
-          if(strcasecmp(lp->items[j], value) == 0) { /* found it */
-            featureIdIndex = j;
-            break;
-          }
-        }
-
-        /* Produce a warning if a featureid was set but the corresponding item is not found. */
-        if (featureIdIndex == -1)
-          msIO_fprintf(stream, "<!-- WARNING: FeatureId item '%s' not found in typename '%s'. -->\n", value, lp->name);
-      }
-      else if( outputformat == OWS_GML32 )
-          msIO_fprintf(stream, "<!-- WARNING: No featureid defined for typename '%s'. Output will not validate. -->\n", lp->name);
 
-      /* populate item and group metadata structures */
-      itemList = msGMLGetItems(lp, "G");
-      constantList = msGMLGetConstants(lp, "G");
-      groupList = msGMLGetGroups(lp, "G");
-      geometryList = msGMLGetGeometries(lp, "GFO", MS_FALSE);
-      if (itemList == NULL || constantList == NULL || groupList == NULL || geometryList == NULL) {
-        msSetError(MS_MISCERR, "Unable to populate item and group metadata structures", "msGMLWriteWFSQuery()");
+      if(gmlWFSWriterBeginLayer(&writer, lp) != MS_SUCCESS) {
+        gmlWFSWriterEndLayer(&writer);
         return MS_FAILURE;
       }
-      
-      if( bGetPropertyValueRequest )
-      {
-        const char* value = msOWSLookupMetadata(&(lp->metadata), "G", "include_items");
-        if( value != NULL && strcmp(value, "@gml:id") == 0 )
-            bOutputGMLIdOnly = MS_TRUE;
-      }
-
-      if (namespace_prefix) {
-        layerName = (char *) msSmallMalloc(strlen(namespace_prefix)+strlen(lp->name)+2);
-        sprintf(layerName, "%s:%s", namespace_prefix, lp->name);
-      } else {
-        layerName = msStrdup(lp->name);
-      }
-
-#ifdef USE_PROJ
-      if( bUseURN )
-      {
-          srs = msOWSGetProjURN(&(map->projection), NULL, "FGO", MS_TRUE);
-          if (!srs)
-            srs = msOWSGetProjURN(&(map->projection), &(map->web.metadata), "FGO", MS_TRUE);
-          if (!srs)
-            srs = msOWSGetProjURN(&(lp->projection), &(lp->metadata), "FGO", MS_TRUE);
-      }
-      else
-      {
-          msOWSGetEPSGProj(&(map->projection), NULL, "FGO", MS_TRUE, &srs);
-          if (!srs)
-            msOWSGetEPSGProj(&(map->projection), &(map->web.metadata), "FGO", MS_TRUE, &srs);
-          if (!srs)
-            msOWSGetEPSGProj(&(lp->projection), &(lp->metadata), "FGO", MS_TRUE, &srs);
-      }
-#endif
 
       for(j=0; j<lp->resultcache->numresults; j++) {
-        char* pszFID;
-
-        status = msLayerGetShape(lp, &shape, &(lp->resultcache->results[j]));
+        status = msLayerGetResultShape(lp, &shape, j);
         if(status != MS_SUCCESS) {
-          msGMLFreeGroups(groupList);
-          msGMLFreeConstants(constantList);
-          msGMLFreeItems(itemList);
-          msGMLFreeGeometries(geometryList);
-          msFree(layerName);
+          gmlWFSWriterEndLayer(&writer);
           return(status);
         }
 
@@ -1761,100 +2001,12 @@ int msGMLWriteWFSQuery(mapObj *map, FILE *stream, const char *default_namespace_
           msProjectShape(&lp->projection, &map->projection, &shape);
 #endif
 
-        if(featureIdIndex != -1) {
-            pszFID = (char*) msSmallMalloc( strlen(lp->name) + 1 + strlen(shape.values[featureIdIndex]) + 1 );
-            sprintf(pszFID, "%s.%s", lp->name, shape.values[featureIdIndex]);
-        }
-        else
-            pszFID = msStrdup("");
-
-
-        if( bOutputGMLIdOnly )
-        {
-            msIO_fprintf(stream, "    <wfs:member>%s</wfs:member>\n", pszFID);
-            msFree(pszFID);
-            msFreeShape(&shape); /* init too */
-            continue;
-        }
-
-        /*
-        ** start this feature
-        */
-        if( nWFSVersion == OWS_2_0_0 )
-            msIO_fprintf(stream, "    <wfs:member>\n");
-        else
-            msIO_fprintf(stream, "    <gml:featureMember>\n");
-        if(msIsXMLTagValid(layerName) == MS_FALSE)
-            msIO_fprintf(stream, "<!-- WARNING: The value '%s' is not valid in a XML tag context. -->\n", layerName);
-        if(featureIdIndex != -1) {
-            if( !bGetPropertyValueRequest )
-            {
-                if(outputformat == OWS_GML2)
-                    msIO_fprintf(stream, "      <%s fid=\"%s\">\n", layerName, pszFID);
-                else  /* OWS_GML3 or OWS_GML32 */
-                    msIO_fprintf(stream, "      <%s gml:id=\"%s\">\n", layerName, pszFID);
-            }
-        } else {
-            if( !bGetPropertyValueRequest )
-                msIO_fprintf(stream, "      <%s>\n", layerName);
-        }
-
-        if (bSwapAxis)
-          msAxisSwapShape(&shape);
-
-        /* write the feature geometry and bounding box */
-        if(!(geometryList && geometryList->numgeometries == 1 &&
-            strcasecmp(geometryList->geometries[0].name, "none") == 0)) {
-          if( !bGetPropertyValueRequest )
-            gmlWriteBounds(stream, outputformat, &(shape.bounds), srs, "        ", "gml");
-          gmlWriteGeometry(stream, geometryList, outputformat, &(shape), srs,
-                           namespace_prefix, "        ", pszFID, nSRSDimension);
-        }
-
-        /* write any item/values */
-        for(k=0; k<itemList->numitems; k++) {
-          item = &(itemList->items[k]);
-          if(msItemInGroups(item->name, groupList) == MS_FALSE)
-            msGMLWriteItem(stream, item, shape.values[k], namespace_prefix,
-                           "        ", outputformat, pszFID);
-        }
-
-        /* write any constants */
-        for(k=0; k<constantList->numconstants; k++) {
-          constant = &(constantList->constants[k]);
-          if(msItemInGroups(constant->name, groupList) == MS_FALSE)
-            msGMLWriteConstant(stream, constant, namespace_prefix, "        ");
-        }
-
-        /* write any groups */
-        for(k=0; k<groupList->numgroups; k++)
-          msGMLWriteGroup(stream, &(groupList->groups[k]), &shape, itemList,
-                          constantList, namespace_prefix, "        ", outputformat, pszFID);
-
-        if( !bGetPropertyValueRequest )
-            /* end this feature */
-            msIO_fprintf(stream, "      </%s>\n", layerName);
-
-        if( nWFSVersion == OWS_2_0_0 )
-          msIO_fprintf(stream, "    </wfs:member>\n");
-        else
-          msIO_fprintf(stream, "    </gml:featureMember>\n");
-
-
-        msFree(pszFID);
-        pszFID = NULL;
+        gmlWFSWriterWriteFeature(&writer, &shape);
         msFreeShape(&shape); /* init too */
       }
 
-      msFree(srs);
-
       /* done with this layer, do a little clean-up */
-      msFree(layerName);
-
-      msGMLFreeGroups(groupList);
-      msGMLFreeConstants(constantList);
-      msGMLFreeItems(itemList);
-      msGMLFreeGeometries(geometryList);
+      gmlWFSWriterEndLayer(&writer);
 
       /* msLayerClose(lp); */
     }
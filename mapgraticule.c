@@ -29,6 +29,7 @@
 #include "mapserver.h"
 #include <assert.h>
 #include "mapproject.h"
+#include "mapthread.h"
 
 
 
@@ -62,6 +63,165 @@ int msGraticuleLayerInitItemInfo(layerObj *layer);
 #define MAPGRATICULE_FORMAT_STRING_DDMM         "%3d %02d"
 #define MAPGRATICULE_FORMAT_STRING_DD                   "%3d"
 
+/**********************************************************************************************************************
+ *
+ * Per process cache of the grid arcs projected to the map (PROCESSING "GRID_CACHE=ON"). The arcs only depend on the
+ * projections and on the axes of msGraticuleLayerWhichShapes(), whose ends are multiples of the increments: the
+ * maps and tiles that see the same part of the grid share them, and only the labels, placed along the map edges,
+ * are computed again. The layer then returns its shapes in the map projection and is no longer projected by the
+ * drawing code. The cache is protected by TLOCK_GRIDCACHE, the entries are reference counted and shared with the
+ * layers drawing them.
+ */
+#define MAPGRATICULE_CACHE_MAX  32
+
+struct graticuleArcsObj {
+  int refcount;
+  char *key;
+  unsigned long last_used;
+  int complete;  /* all the arcs are there, as cached */
+  int numarcs, maxarcs;
+  shapeObj *arcs;
+};
+
+static int graticuleCacheCount = 0;
+static unsigned long graticuleCacheClock = 0;
+static struct graticuleArcsObj *graticuleCache[MAPGRATICULE_CACHE_MAX];
+
+void msGraticuleReleaseArcs(struct graticuleArcsObj *arcs)
+{
+  int i;
+
+  if(!arcs || MS_REFCNT_DECR_IS_NOT_ZERO(arcs))
+    return;
+  for(i=0; i<arcs->numarcs; i++)
+    msFreeShape(&arcs->arcs[i]);
+  msFree(arcs->arcs);
+  msFree(arcs->key);
+  msFree(arcs);
+}
+
+void msGraticuleCacheCleanup(void)
+{
+  msAcquireLock( TLOCK_GRIDCACHE );
+  while(graticuleCacheCount > 0)
+    msGraticuleReleaseArcs(graticuleCache[--graticuleCacheCount]);
+  msReleaseLock( TLOCK_GRIDCACHE );
+}
+
+/* caches the arcs built by a layer once it has returned all of them */
+static void msGraticuleCacheArcs(struct graticuleArcsObj *arcs)
+{
+  int i, slot;
+
+  arcs->complete = MS_TRUE;
+
+  msAcquireLock( TLOCK_GRIDCACHE );
+  for(i=0; i<graticuleCacheCount; i++) {
+    if(strcmp(graticuleCache[i]->key, arcs->key) == 0)
+      break;
+  }
+  if(i == graticuleCacheCount) { /* unless built by another layer in the meantime */
+    if(graticuleCacheCount == MAPGRATICULE_CACHE_MAX) {
+      slot = 0;
+      for(i=1; i<graticuleCacheCount; i++) {
+        if(graticuleCache[i]->last_used < graticuleCache[slot]->last_used)
+          slot = i;
+      }
+      msGraticuleReleaseArcs(graticuleCache[slot]);
+      graticuleCache[slot] = graticuleCache[--graticuleCacheCount];
+    }
+    arcs->last_used = ++graticuleCacheClock;
+    MS_REFCNT_INCR(arcs);
+    graticuleCache[graticuleCacheCount++] = arcs;
+  }
+  msReleaseLock( TLOCK_GRIDCACHE );
+}
+
+#ifdef USE_PROJ
+/* the cached arcs of key, or new ones to be built by the caller, with a reference for the caller */
+static struct graticuleArcsObj *msGraticuleGetArcs(const char *key)
+{
+  struct graticuleArcsObj *arcs;
+  int i;
+
+  msAcquireLock( TLOCK_GRIDCACHE );
+  for(i=0; i<graticuleCacheCount; i++) {
+    arcs = graticuleCache[i];
+    if(strcmp(arcs->key, key) == 0) {
+      MS_REFCNT_INCR(arcs);
+      arcs->last_used = ++graticuleCacheClock;
+      msReleaseLock( TLOCK_GRIDCACHE );
+      return arcs;
+    }
+  }
+  msReleaseLock( TLOCK_GRIDCACHE );
+
+  arcs = (struct graticuleArcsObj *) msSmallCalloc(1, sizeof(struct graticuleArcsObj));
+  MS_REFCNT_INIT(arcs);
+  arcs->key = msStrdup(key);
+  return arcs;
+}
+
+/* returns the shapes of the grid in the map projection, from the cache, if the layer asks for it */
+static void msGraticuleUseCache(layerObj *layer)
+{
+  graticuleObj *pInfo = layer->grid;
+  const char *value = msLayerGetProcessingKey(layer, "GRID_CACHE");
+  char *layerproj, *mapproj, *key;
+  double subdivides;
+
+  if(!value || strcasecmp(value, "ON") != 0 || !layer->project || pInfo->bintersections)
+    return;
+
+  subdivides = pInfo->maxsubdivides;
+  if( pInfo->minsubdivides <= 0.0 || pInfo->maxsubdivides <= 0.0 )
+    subdivides = MAPGRATICULE_ARC_SUBDIVISION_DEFAULT;
+
+  layerproj = msGetProjectionString(&layer->projection);
+  mapproj = msGetProjectionString(&layer->map->projection);
+  key = (char *) msSmallMalloc(strlen(layerproj) + strlen(mapproj) + 200);
+  sprintf(key, "%s|%s|%.17g,%.17g,%.17g|%.17g,%.17g,%.17g|%d", layerproj, mapproj,
+          pInfo->dstartlongitude, pInfo->dendlongitude, pInfo->dincrementlongitude,
+          pInfo->dstartlatitude, pInfo->dendlatitude, pInfo->dincrementlatitude, (int) subdivides);
+  pInfo->parcs = msGraticuleGetArcs(key);
+  pInfo->bmapcoords = MS_TRUE;
+  layer->project = MS_FALSE; /* done here */
+
+  if(layer->debug >= MS_DEBUGLEVEL_V)
+    msDebug("msGraticuleLayerWhichShapes(): %s grid arcs of layer %s.\n", pInfo->parcs->complete ? "reusing the cached" : "caching the", layer->name);
+
+  msFree(layerproj);
+  msFree(mapproj);
+  msFree(key);
+}
+#endif
+
+/* projects an arc to the map, or takes it from the cache */
+static void msGraticuleMapArc(layerObj *layer, shapeObj *shape)
+{
+  graticuleObj *pInfo = layer->grid;
+  struct graticuleArcsObj *arcs = pInfo->parcs;
+
+  if(arcs->complete && pInfo->iarc < arcs->numarcs) {
+    msFreeShape(shape);
+    msCopyShape(&arcs->arcs[pInfo->iarc++], shape);
+    return;
+  }
+
+#ifdef USE_PROJ
+  msProjectShape(&layer->projection, &layer->map->projection, shape);
+#endif
+  if(!arcs->complete) {
+    if(arcs->numarcs == arcs->maxarcs) {
+      arcs->maxarcs = MS_MAX(16, arcs->maxarcs * 2);
+      arcs->arcs = (shapeObj *) msSmallRealloc(arcs->arcs, sizeof(shapeObj) * arcs->maxarcs);
+    }
+    msInitShape(&arcs->arcs[arcs->numarcs]);
+    msCopyShape(shape, &arcs->arcs[arcs->numarcs++]);
+  }
+  pInfo->iarc++;
+}
+
 /**********************************************************************************************************************
  *
  */
@@ -256,6 +416,16 @@ int msGraticuleLayerWhichShapes(layerObj *layer, rectObj rect, int isQuery)
 #endif
   }
 
+  pInfo->bproject = layer->project;
+  pInfo->bmapcoords = MS_FALSE;
+  msGraticuleReleaseArcs(pInfo->parcs);
+  pInfo->parcs = NULL;
+  pInfo->iarc = 0;
+#ifdef USE_PROJ
+  if(!isQuery)
+    msGraticuleUseCache(layer);
+#endif
+
   return MS_SUCCESS;
 }
 
@@ -265,6 +435,7 @@ int msGraticuleLayerWhichShapes(layerObj *layer, rectObj rect, int isQuery)
 int msGraticuleLayerNextShape(layerObj *layer, shapeObj *shape)
 {
   graticuleObj *pInfo = layer->grid;
+  int bArc = MS_FALSE;
 
   if( pInfo->minsubdivides <= 0.0 || pInfo->maxsubdivides <= 0.0 )
     pInfo->minsubdivides = pInfo->maxsubdivides = MAPGRATICULE_ARC_SUBDIVISION_DEFAULT;
@@ -353,6 +524,7 @@ int msGraticuleLayerNextShape(layerObj *layer, shapeObj *shape)
         }
 
         pInfo->ilabelstate = 0;
+        bArc = MS_TRUE;
 
         pInfo->dwhichlongitude      += pInfo->dincrementlongitude;
         break;
@@ -438,6 +610,7 @@ int msGraticuleLayerNextShape(layerObj *layer, shapeObj *shape)
         }
 
         pInfo->ilabelstate    = 0;
+        bArc = MS_TRUE;
         pInfo->dwhichlatitude += pInfo->dincrementlatitude;
         break;
 
@@ -459,9 +632,14 @@ int msGraticuleLayerNextShape(layerObj *layer, shapeObj *shape)
   if (pInfo->dwhichlatitude >  pInfo->dendlatitude) {
     /* free the lineObj and pointObj that have been erroneously allocated beforehand */
     msFreeShape(shape);
+    if(pInfo->bmapcoords && !pInfo->parcs->complete)
+      msGraticuleCacheArcs(pInfo->parcs);
     return MS_DONE;
   }
 
+  if(bArc && pInfo->bmapcoords)
+    msGraticuleMapArc(layer, shape);
+
   return MS_SUCCESS;
 }
 
@@ -640,7 +818,9 @@ graticuleIntersectionObj *msGraticuleLayerGetIntersectionPoints(mapObj *map,
  if(status != MS_SUCCESS)
    return NULL;
 
+  pInfo->bintersections = MS_TRUE;
   status = msLayerWhichShapes(layer, searchrect, MS_FALSE);
+  pInfo->bintersections = MS_FALSE;
   if(status == MS_DONE) { /* no overlap */
     msLayerClose(layer);
     return NULL;
@@ -1039,7 +1219,7 @@ static int _AdjustLabelPosition( layerObj *pLayer, shapeObj *pShape, msGraticule
   ptPoint = pShape->line->point[0];
 
 #ifdef USE_PROJ
-  if(pLayer->project)
+  if(pInfo->bproject)
     msProjectShape( &pLayer->projection, &pLayer->map->projection, pShape );
 #endif
 
@@ -1081,7 +1261,7 @@ static int _AdjustLabelPosition( layerObj *pLayer, shapeObj *pShape, msGraticule
     msTransformPixelToShape( pShape, pLayer->map->extent, pLayer->map->cellsize );
 
 #ifdef USE_PROJ
-  if(pLayer->project)
+  if(pInfo->bproject)
     msProjectShape( &pLayer->map->projection, &pLayer->projection, pShape );
 #endif
 
@@ -1098,6 +1278,11 @@ static int _AdjustLabelPosition( layerObj *pLayer, shapeObj *pShape, msGraticule
       break;
   }
 
+#ifdef USE_PROJ
+  if(pInfo->bmapcoords)
+    msProjectShape( &pLayer->projection, &pLayer->map->projection, pShape );
+#endif
+
   return MS_SUCCESS;
 }
 
@@ -34,26 +34,141 @@
 
 
 
+/* case insensitive FNV-1a, the slot is taken from its low bits */
 static unsigned hash(const char *key)
 {
-  unsigned hashval;
+  unsigned hashval = 2166136261U;
 
-  for(hashval=0; *key!='\0'; key++)
-    hashval = tolower(*key) + 31 * hashval;
+  for(; *key!='\0'; key++)
+    hashval = ((hashval ^ (unsigned char) tolower((unsigned char) *key)) * 16777619U) & 0xffffffffU;
 
-  return(hashval % MS_HASHSIZE);
+  return(hashval);
 }
 
-hashTableObj *msCreateHashTable()
+static hashStorageObj *hashStorageCreate(void)
+{
+  hashStorageObj *storage;
+
+  storage = (hashStorageObj *) calloc(1, sizeof(hashStorageObj));
+  if (storage == NULL)
+    return NULL;
+  MS_REFCNT_INIT(storage);
+  return storage;
+}
+
+static void hashStorageRelease(hashStorageObj *storage)
 {
   int i;
+
+  if (MS_REFCNT_DECR_IS_NOT_ZERO(storage))
+    return;
+  for (i=0; i<storage->numentries; i++) {
+    msFree(storage->items[i].key);
+    msFree(storage->items[i].data);
+  }
+  free(storage->items);
+  free(storage->slots);
+  free(storage);
+}
+
+/*
+** Slot of key, or of the free slot ending its probe sequence if it is
+** not there. There is always a free slot, see hashResize().
+*/
+static int hashFindSlot(hashStorageObj *storage, const char *key, unsigned hashval)
+{
+  unsigned mask = storage->numslots - 1;
+  unsigned i;
+
+  for (i=hashval & mask; storage->slots[i] >= 0; i=(i+1) & mask) {
+    struct hashObj *tp = &(storage->items[storage->slots[i]]);
+    if (tp->key && tp->hashval == hashval && strcasecmp(key, tp->key) == 0)
+      break;
+  }
+  return i;
+}
+
+static struct hashObj *hashFind(hashStorageObj *storage, const char *key, unsigned hashval)
+{
+  int i;
+
+  if (storage->numslots == 0)
+    return NULL;
+  i = hashFindSlot(storage, key, hashval);
+  return (storage->slots[i] >= 0) ? &(storage->items[storage->slots[i]]) : NULL;
+}
+
+/*
+** Rebuild storage with room for numitems and more, dropping the removed
+** items. If copy is set the keys and values are duplicated, the old ones
+** being left to their owner. Items keep their order.
+*/
+static void hashResize(hashStorageObj *storage, int numitems, int copy)
+{
+  struct hashObj *items = storage->items;
+  int numentries = storage->numentries;
+  int numslots = 8, i, n;
+
+  /* at most 2/3 of the slots in use, removed items included */
+  while (numslots / 3 * 2 < numitems + 1)
+    numslots *= 2;
+
+  free(storage->slots);
+  storage->numslots = numslots;
+  storage->slots = (int *) msSmallMalloc(sizeof(int) * numslots);
+  for (i=0; i<numslots; i++)
+    storage->slots[i] = -1;
+  storage->maxentries = numslots / 3 * 2;
+  storage->items = (struct hashObj *) msSmallMalloc(sizeof(struct hashObj) * storage->maxentries);
+
+  for (i=0, n=0; i<numentries; i++) {
+    struct hashObj *tp = &(items[i]);
+    if (tp->key == NULL)
+      continue;
+    storage->items[n].key = copy ? msStrdup(tp->key) : tp->key;
+    storage->items[n].data = copy ? msStrdup(tp->data) : tp->data;
+    storage->items[n].hashval = tp->hashval;
+    storage->slots[hashFindSlot(storage, tp->key, tp->hashval)] = n;
+    n++;
+  }
+  storage->numentries = n;
+  if (!copy)
+    free(items);
+}
+
+/*
+** Give the table its own copy of shared items before modifying it.
+*/
+static int hashMakeWritable(hashTableObj *table)
+{
+  hashStorageObj *storage, *shared = table->storage;
+
+  if (shared->refcount <= 1)
+    return MS_SUCCESS;
+
+  storage = hashStorageCreate();
+  MS_CHECK_ALLOC(storage, sizeof(hashStorageObj), MS_FAILURE);
+  if (shared->numentries > 0) {
+    storage->items = shared->items;
+    storage->numentries = shared->numentries;
+    hashResize(storage, table->numitems, MS_TRUE);
+  }
+  hashStorageRelease(shared);
+  table->storage = storage;
+  return MS_SUCCESS;
+}
+
+hashTableObj *msCreateHashTable()
+{
   hashTableObj *table;
 
   table = (hashTableObj *) msSmallMalloc(sizeof(hashTableObj));
-  table->items = (struct hashObj **) msSmallMalloc(sizeof(struct hashObj *)*MS_HASHSIZE);
-
-  for (i=0; i<MS_HASHSIZE; i++)
-    table->items[i] = NULL;
+  table->storage = hashStorageCreate();
+  if (table->storage == NULL) {
+    msSetError(MS_MEMERR, "Failed to allocate hash table.", "msCreateHashTable()");
+    free(table);
+    return NULL;
+  }
   table->numitems = 0;
 
   return table;
@@ -61,13 +176,8 @@ hashTableObj *msCreateHashTable()
 
 int initHashTable( hashTableObj *table )
 {
-  int i;
-
-  table->items = (struct hashObj **) malloc(sizeof(struct hashObj *)*MS_HASHSIZE);
-  MS_CHECK_ALLOC(table->items, sizeof(struct hashObj *)*MS_HASHSIZE, MS_FAILURE);
-
-  for (i=0; i<MS_HASHSIZE; i++)
-    table->items[i] = NULL;
+  table->storage = hashStorageCreate();
+  MS_CHECK_ALLOC(table->storage, sizeof(hashStorageObj), MS_FAILURE);
   table->numitems = 0;
   return MS_SUCCESS;
 }
@@ -92,22 +202,10 @@ int msHashIsEmpty( hashTableObj *table )
 
 void msFreeHashItems( hashTableObj *table )
 {
-  int i;
-  struct hashObj *tp=NULL;
-  struct hashObj *prev_tp=NULL;
-
   if (table) {
-    if(table->items) {
-      for (i=0; i<MS_HASHSIZE; i++) {
-        if (table->items[i] != NULL) {
-          for (tp=table->items[i]; tp!=NULL; prev_tp=tp,tp=tp->next,free(prev_tp)) {
-            msFree(tp->key);
-            msFree(tp->data);
-          }
-        }
-      }
-      free(table->items);
-      table->items = NULL;
+    if(table->storage) {
+      hashStorageRelease(table->storage);
+      table->storage = NULL;
     } else {
       msSetError(MS_HASHERR, "No items allocated.", "msFreeHashItems()");
     }
@@ -116,8 +214,21 @@ void msFreeHashItems( hashTableObj *table )
   }
 }
 
+int msShareHashTable( hashTableObj *dst, hashTableObj *src )
+{
+  if (!dst || !src || !dst->storage || !src->storage || dst->numitems > 0)
+    return MS_FAILURE;
+
+  MS_REFCNT_INCR(src->storage);
+  hashStorageRelease(dst->storage);
+  dst->storage = src->storage;
+  dst->numitems = src->numitems;
+  return MS_SUCCESS;
+}
+
 struct hashObj *msInsertHashTable(hashTableObj *table,
                                   const char *key, const char *value) {
+  hashStorageObj *storage;
   struct hashObj *tp;
   unsigned hashval;
 
@@ -127,17 +238,20 @@ struct hashObj *msInsertHashTable(hashTableObj *table,
     return NULL;
   }
 
-  for (tp=table->items[hash(key)]; tp!=NULL; tp=tp->next)
-    if(strcasecmp(key, tp->key) == 0)
-      break;
+  if (hashMakeWritable(table) != MS_SUCCESS)
+    return NULL;
+  storage = table->storage;
+
+  hashval = hash(key);
+  tp = hashFind(storage, key, hashval);
 
   if (tp == NULL) { /* not found */
-    tp = (struct hashObj *) malloc(sizeof(*tp));
-    MS_CHECK_ALLOC(tp, sizeof(*tp), NULL);
+    if (storage->numentries >= storage->maxentries)
+      hashResize(storage, table->numitems + 1, MS_FALSE);
+    tp = &(storage->items[storage->numentries]);
     tp->key = msStrdup(key);
-    hashval = hash(key);
-    tp->next = table->items[hashval];
-    table->items[hashval] = tp;
+    tp->hashval = hashval;
+    storage->slots[hashFindSlot(storage, key, hashval)] = storage->numentries++;
     table->numitems++;
   } else {
     free(tp->data);
@@ -153,70 +267,58 @@ char *msLookupHashTable(hashTableObj *table, const char *key)
 {
   struct hashObj *tp;
 
-  if (!table || !key) {
+  if (!table || !key || !table->storage) {
     return(NULL);
   }
 
-  for (tp=table->items[hash(key)]; tp!=NULL; tp=tp->next)
-    if (strcasecmp(key, tp->key) == 0)
-      return(tp->data);
-
-  return NULL;
+  tp = hashFind(table->storage, key, hash(key));
+  return tp ? tp->data : NULL;
 }
 
 int msRemoveHashTable(hashTableObj *table, const char *key)
 {
   struct hashObj *tp;
-  struct hashObj *prev_tp=NULL;
-  int status = MS_FAILURE;
+  unsigned hashval;
 
   if (!table || !key) {
     msSetError(MS_HASHERR, "No hash table", "msRemoveHashTable");
     return MS_FAILURE;
   }
 
-  tp=table->items[hash(key)];
-  if (!tp) {
+  hashval = hash(key);
+  if (!table->storage || !hashFind(table->storage, key, hashval)) {
     msSetError(MS_HASHERR, "No such hash entry", "msRemoveHashTable");
     return MS_FAILURE;
   }
 
-  prev_tp = NULL;
-  while (tp != NULL) {
-    if (strcasecmp(key, tp->key) == 0) {
-      status = MS_SUCCESS;
-      if (prev_tp) {
-        prev_tp->next = tp->next;
-        free(tp);
-        break;
-      } else {
-        table->items[hash(key)] = tp->next;
-        free(tp);
-        break;
-      }
-    }
-    prev_tp = tp;
-    tp = tp->next;
-  }
+  if (hashMakeWritable(table) != MS_SUCCESS)
+    return MS_FAILURE;
 
-  if (status == MS_SUCCESS)
-    table->numitems--;
+  /* the item stays in its slot to keep the probe sequences, as removed */
+  tp = hashFind(table->storage, key, hashval);
+  msFree(tp->key);
+  msFree(tp->data);
+  tp->key = NULL;
+  tp->data = NULL;
+  table->numitems--;
 
-  return status;
+  return MS_SUCCESS;
 }
 
 const char *msFirstKeyFromHashTable( hashTableObj *table )
 {
-  int hash_index;
+  int i;
 
   if (!table) {
     msSetError(MS_HASHERR, "No hash table", "msFirstKeyFromHashTable");
     return NULL;
   }
 
-  for (hash_index = 0; hash_index < MS_HASHSIZE; hash_index++ ) {
-    if (table->items[hash_index] != NULL )
-      return table->items[hash_index]->key;
+  if (table->storage) {
+    for (i=0; i<table->storage->numentries; i++) {
+      if (table->storage->items[i].key != NULL)
+        return table->storage->items[i].key;
+    }
   }
 
   return NULL;
@@ -224,8 +326,9 @@ const char *msFirstKeyFromHashTable( hashTableObj *table )
 
 const char *msNextKeyFromHashTable( hashTableObj *table, const char *lastKey )
 {
-  int hash_index;
-  struct hashObj *link;
+  hashStorageObj *storage;
+  struct hashObj *tp;
+  int i;
 
   if (!table) {
     msSetError(MS_HASHERR, "No hash table", "msNextKeyFromHashTable");
@@ -235,19 +338,14 @@ const char *msNextKeyFromHashTable( hashTableObj *table, const char *lastKey )
   if ( lastKey == NULL )
     return msFirstKeyFromHashTable( table );
 
-  hash_index = hash(lastKey);
-  for ( link = table->items[hash_index];
-        link != NULL && strcasecmp(lastKey,link->key) != 0;
-        link = link->next ) {}
-
-  if ( link != NULL && link->next != NULL )
-    return link->next->key;
+  storage = table->storage;
+  if (!storage || (tp = hashFind(storage, lastKey, hash(lastKey))) == NULL)
+    return NULL;
 
-  while ( ++hash_index < MS_HASHSIZE ) {
-    if ( table->items[hash_index] != NULL )
-      return table->items[hash_index]->key;
+  for (i=(tp - storage->items) + 1; i<storage->numentries; i++) {
+    if (storage->items[i].key != NULL)
+      return storage->items[i].key;
   }
 
   return NULL;
 }
-
@@ -40,23 +40,34 @@ extern "C" {
 #define  MS_DLL_EXPORT
 #endif
 
-#define MS_HASHSIZE 41
-
   /* =========================================================================
    * Structs
    * ========================================================================= */
 
 #ifndef SWIG
   struct hashObj {
-    struct hashObj *next;  /* pointer to next item */
-    char           *key;   /* string key that is hashed */
+    char           *key;   /* string key that is hashed, NULL once removed */
     char           *data;  /* string stored in this item */
+    unsigned        hashval; /* hash of the key, saves recomputing it */
   };
+
+  /* the items of a table, shared by the tables copied with
+     msCopyHashTable() until one of them is modified (copy on write).
+     The items are kept in insertion order, slots is an open addressing
+     index into them of numslots (a power of two, or 0 while empty) */
+  typedef struct {
+    int refcount;
+    int numslots;
+    int *slots;              /* index into items, -1 for a free slot */
+    int numentries;          /* used items, removed ones included */
+    int maxentries;          /* allocated items */
+    struct hashObj *items;
+  } hashStorageObj;
 #endif /*SWIG*/
 
   typedef struct {
 #ifndef SWIG
-    struct hashObj **items;  /* the hash table */
+    hashStorageObj *storage;
 #endif
 #ifdef SWIG
     %immutable;
@@ -94,13 +105,24 @@ extern "C" {
   /* Free only the items for hashTableObj structure members (metadata, &c) */
   MS_DLL_EXPORT void msFreeHashItems( hashTableObj *table );
 
+  /* msShareHashTable - make an empty table share the items of src, the
+   * items being copied once either table is modified
+   * ARGS:
+   *     dst - empty target hash table
+   *     src - source hash table
+   * RETURNS:
+   *     MS_SUCCESS, or MS_FAILURE if dst is not empty
+   */
+  MS_DLL_EXPORT int msShareHashTable( hashTableObj *dst, hashTableObj *src );
+
   /* msInsertHashTable - insert new item
    * ARGS:
    *     table - the target hash table
    *     key   - key string for new item
    *     value - data string for new item
    * RETURNS:
-   *     pointer to the new item or NULL
+   *     pointer to the new item or NULL, valid until the table is
+   *     modified again
    * EXCEPTIONS:
    *     raise MS_HASHERR on failure
    */
@@ -69,6 +69,41 @@
  **********************************************************************/
 static int gbCurlInitialized = MS_FALSE;
 
+/* DNS cache, TLS sessions and (libcurl >= 7.57) open connections shared by
+ * all the requests of the process, so that these to the same servers keep
+ * reusing their connections. Each kind of data has its own TLOCK_CURLSHARE
+ * shard lock.
+ */
+static CURLSH *gpsCurlShare = NULL;
+
+static void msHTTPShareLock(CURL *handle, curl_lock_data data,
+                            curl_lock_access access, void *userptr)
+{
+  msAcquireShardLock(TLOCK_CURLSHARE, (unsigned int) data);
+}
+
+static void msHTTPShareUnlock(CURL *handle, curl_lock_data data, void *userptr)
+{
+  msReleaseShardLock(TLOCK_CURLSHARE, (unsigned int) data);
+}
+
+static void msHTTPShareInit()
+{
+  gpsCurlShare = curl_share_init();
+  if (gpsCurlShare == NULL)
+    return; /* requests just won't share anything */
+
+  curl_share_setopt(gpsCurlShare, CURLSHOPT_LOCKFUNC, msHTTPShareLock);
+  curl_share_setopt(gpsCurlShare, CURLSHOPT_UNLOCKFUNC, msHTTPShareUnlock);
+  curl_share_setopt(gpsCurlShare, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+#if LIBCURL_VERSION_NUM >= 0x071700
+  curl_share_setopt(gpsCurlShare, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+#endif
+#if LIBCURL_VERSION_NUM >= 0x073900
+  curl_share_setopt(gpsCurlShare, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+#endif
+}
+
 int msHTTPInit()
 {
   /* curl_global_init() should only be called once (no matter how
@@ -76,18 +111,29 @@ int msHTTPInit()
    * application that uses libcurl.
    */
 
-  msAcquireLock(TLOCK_OWS);
+  int initialized;
+
+  /* every request after the first one only needs the shared lock */
+  msAcquireReadLock(TLOCK_OWS);
+  initialized = gbCurlInitialized;
+  msReleaseReadLock(TLOCK_OWS);
+  if (initialized)
+    return MS_SUCCESS;
+
+  msAcquireWriteLock(TLOCK_OWS);
   if (!gbCurlInitialized &&
       curl_global_init(CURL_GLOBAL_ALL) != 0) {
-    msReleaseLock(TLOCK_OWS);
+    msReleaseWriteLock(TLOCK_OWS);
     msSetError(MS_HTTPERR, "Libcurl initialization failed.",
                "msHTTPInit()");
     return MS_FAILURE;
   }
 
+  if (!gbCurlInitialized)
+    msHTTPShareInit();
   gbCurlInitialized = MS_TRUE;
 
-  msReleaseLock(TLOCK_OWS);
+  msReleaseWriteLock(TLOCK_OWS);
   return MS_SUCCESS;
 }
 
@@ -98,12 +144,16 @@ int msHTTPInit()
  **********************************************************************/
 void msHTTPCleanup()
 {
-  msAcquireLock(TLOCK_OWS);
+  msAcquireWriteLock(TLOCK_OWS);
+  if (gpsCurlShare)
+    curl_share_cleanup(gpsCurlShare);
+  gpsCurlShare = NULL;
+
   if (gbCurlInitialized)
     curl_global_cleanup();
 
   gbCurlInitialized = MS_FALSE;
-  msReleaseLock(TLOCK_OWS);
+  msReleaseWriteLock(TLOCK_OWS);
 }
 
 
@@ -136,6 +186,7 @@ void msHTTPInitRequestObj(httpRequestObj *pasReqInfo, int numRequests)
     pasReqInfo[i].pszErrBuf = NULL;
     pasReqInfo[i].pszUserAgent = NULL;
     pasReqInfo[i].pszHTTPCookieData = NULL;
+    pasReqInfo[i].nCacheTTL = 0;
     pasReqInfo[i].pszProxyAddress = NULL;
     pasReqInfo[i].pszProxyUsername = NULL;
     pasReqInfo[i].pszProxyPassword = NULL;
@@ -145,6 +196,7 @@ void msHTTPInitRequestObj(httpRequestObj *pasReqInfo, int numRequests)
     pasReqInfo[i].debug = MS_FALSE;
 
     pasReqInfo[i].curl_handle = NULL;
+    pasReqInfo[i].curl_headers = NULL;
     pasReqInfo[i].fp = NULL;
     pasReqInfo[i].result_data = NULL;
     pasReqInfo[i].result_size = 0;
@@ -195,6 +247,10 @@ void msHTTPFreeRequestObj(httpRequestObj *pasReqInfo, int numRequests)
 
     pasReqInfo[i].curl_handle = NULL;
 
+    if (pasReqInfo[i].curl_headers)
+      curl_slist_free_all((struct curl_slist *) pasReqInfo[i].curl_headers);
+    pasReqInfo[i].curl_headers = NULL;
+
     free( pasReqInfo[i].result_data );
     pasReqInfo[i].result_data = NULL;
     pasReqInfo[i].result_size = 0;
@@ -435,14 +491,46 @@ int msHTTPAuthProxySetup(hashTableObj *mapmd, hashTableObj *lyrmd,
  *
  * If bCheckLocalCache==MS_TRUE then if the pszOutputfile already exists
  * then is is not downloaded again, and status 242 is returned.
+ * Requests that come in with status 242 already have their response
+ * (in result_data or pszOutputFile) and are skipped as well.
  *
  * Return value:
  * MS_SUCCESS if all requests completed succesfully.
  * MS_FAILURE if a fatal error happened
  * MS_DONE if some requests failed with 40x status for instance (not fatal)
+ *
+ * With request tracing (see maptrace.c) the requests are made from a
+ * span of their own, and carry a traceparent header naming it.
  **********************************************************************/
+static int msHTTPRunRequests(httpRequestObj *pasReqInfo, int numRequests,
+                             int bCheckLocalCache, const char *pszTraceParent);
+
 int msHTTPExecuteRequests(httpRequestObj *pasReqInfo, int numRequests,
                           int bCheckLocalCache)
+{
+  char szTraceParent[64];
+  char szCount[32];
+  int nSpan, nStatus;
+
+  if (numRequests == 0)
+    return MS_SUCCESS;  /* Nothing to do */
+
+  nSpan = msTraceSpanBegin("msHTTPExecuteRequests", MS_TRACE_CLIENT);
+  msTraceSpanAttribute(nSpan, "http.url", pasReqInfo[0].pszGetUrl);
+  if (numRequests > 1) {
+    snprintf(szCount, sizeof(szCount), "%d", numRequests);
+    msTraceSpanAttribute(nSpan, "mapserver.http.requests", szCount);
+  }
+
+  nStatus = msHTTPRunRequests(pasReqInfo, numRequests, bCheckLocalCache,
+                              msTraceGetParent(szTraceParent, sizeof(szTraceParent)) ? szTraceParent : NULL);
+
+  msTraceSpanEnd(nSpan, nStatus == MS_FAILURE ? MS_FAILURE : MS_SUCCESS);
+  return nStatus;
+}
+
+static int msHTTPRunRequests(httpRequestObj *pasReqInfo, int numRequests,
+                             int bCheckLocalCache, const char *pszTraceParent)
 {
   int     i, nStatus = MS_SUCCESS, nTimeout, still_running=0, num_msgs=0;
   CURLM   *multi_handle;
@@ -450,9 +538,6 @@ int msHTTPExecuteRequests(httpRequestObj *pasReqInfo, int numRequests,
   char     debug = MS_FALSE;
   const char *pszCurlCABundle = NULL;
 
-  if (numRequests == 0)
-    return MS_SUCCESS;  /* Nothing to do */
-
   if (!gbCurlInitialized)
     msHTTPInit();
 
@@ -493,10 +578,14 @@ int msHTTPExecuteRequests(httpRequestObj *pasReqInfo, int numRequests,
                "msHTTPExecuteRequests()");
     return(MS_FAILURE);
   }
+#if LIBCURL_VERSION_NUM >= 0x072b00
+  curl_multi_setopt(multi_handle, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+#endif
 
   for (i=0; i<numRequests; i++) {
     CURL *http_handle;
     FILE *fp;
+    struct curl_slist *headers = NULL;
 
     if (pasReqInfo[i].pszGetUrl == NULL ) {
       msSetError(MS_HTTPERR, "URL or output file parameter missing.",
@@ -504,6 +593,15 @@ int msHTTPExecuteRequests(httpRequestObj *pasReqInfo, int numRequests,
       return(MS_FAILURE);
     }
 
+    /* Response already filled in by the caller, e.g. from the */
+    /* cascaded WMS cache, see msWMSCacheGet() */
+    if (pasReqInfo[i].nStatus == 242) {
+      if (pasReqInfo[i].debug)
+        msDebug("HTTP request: id=%d, found in cache, skipping.\n",
+                pasReqInfo[i].nLayerId);
+      continue;
+    }
+
     if (pasReqInfo[i].debug) {
       msDebug("HTTP request: id=%d, %s\n",
               pasReqInfo[i].nLayerId, pasReqInfo[i].pszGetUrl);
@@ -667,6 +765,20 @@ int msHTTPExecuteRequests(httpRequestObj *pasReqInfo, int numRequests,
     curl_easy_setopt(http_handle, CURLOPT_WRITEDATA, &(pasReqInfo[i]));
     curl_easy_setopt(http_handle, CURLOPT_WRITEFUNCTION, msHTTPWriteFct);
 
+    /* Reuse the connections of the previous requests, keep them alive
+     * and, with HTTP/2, multiplex the requests sent to the same server
+     * on one connection rather than opening one for each.
+     */
+    if (gpsCurlShare)
+      curl_easy_setopt(http_handle, CURLOPT_SHARE, gpsCurlShare);
+#if LIBCURL_VERSION_NUM >= 0x071900
+    curl_easy_setopt(http_handle, CURLOPT_TCP_KEEPALIVE, 1L);
+#endif
+#if LIBCURL_VERSION_NUM >= 0x072f00
+    curl_easy_setopt(http_handle, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+    curl_easy_setopt(http_handle, CURLOPT_PIPEWAIT, 1L);
+#endif
+
     /* Provide a buffer where libcurl can write human readable error msgs
      */
     if (pasReqInfo[i].pszErrBuf == NULL)
@@ -680,7 +792,6 @@ int msHTTPExecuteRequests(httpRequestObj *pasReqInfo, int numRequests,
     if(pasReqInfo[i].pszPostRequest != NULL ) {
       char szBuf[100];
 
-      struct curl_slist *headers=NULL;
       snprintf(szBuf, 100,
                "Content-Type: %s", pasReqInfo[i].pszPostContentType);
       headers = curl_slist_append(headers, szBuf);
@@ -692,8 +803,20 @@ int msHTTPExecuteRequests(httpRequestObj *pasReqInfo, int numRequests,
       {
           msDebug("HTTP: POST = %s", pasReqInfo[i].pszPostRequest);
       }
+    }
+
+    /* W3C trace context of the cascaded request */
+    if(pszTraceParent != NULL) {
+      char szBuf[100];
+
+      snprintf(szBuf, 100, "traceparent: %s", pszTraceParent);
+      headers = curl_slist_append(headers, szBuf);
+    }
+
+    /* curl keeps only a ref to the header list, freed with the handle */
+    if(headers != NULL) {
       curl_easy_setopt(http_handle, CURLOPT_HTTPHEADER, headers);
-      /* curl_slist_free_all(headers); */ /* free the header list */
+      pasReqInfo[i].curl_headers = headers;
     }
 
     /* Added by RFC-42 HTTP Cookie Forwarding */
@@ -730,6 +853,16 @@ int msHTTPExecuteRequests(httpRequestObj *pasReqInfo, int numRequests,
   while(CURLM_CALL_MULTI_PERFORM ==
         curl_multi_perform(multi_handle, &still_running));
 
+#if LIBCURL_VERSION_NUM >= 0x071c00
+  /* curl_multi_wait() polls the transfers sockets, without the FD_SETSIZE
+   * limit of select(), and returns as soon as one of them is ready.
+   */
+  while(still_running) {
+    if (curl_multi_wait(multi_handle, NULL, 0, 100, NULL) != CURLM_OK)
+      break;
+    curl_multi_perform(multi_handle, &still_running);
+  }
+#else
   while(still_running) {
     struct timeval timeout;
     int rc; /* select() return code */
@@ -773,6 +906,7 @@ int msHTTPExecuteRequests(httpRequestObj *pasReqInfo, int numRequests,
         break;
     }
   }
+#endif /* LIBCURL_VERSION_NUM >= 0x071c00 */
 
   if (debug)
     msDebug("HTTP: After download loop\n");
@@ -920,6 +1054,9 @@ int msHTTPExecuteRequests(httpRequestObj *pasReqInfo, int numRequests,
     curl_multi_remove_handle(multi_handle, http_handle);
     curl_easy_cleanup(http_handle);
     psReq->curl_handle = NULL;
+    if (psReq->curl_headers)
+      curl_slist_free_all((struct curl_slist *) psReq->curl_headers);
+    psReq->curl_headers = NULL;
 
   }
 
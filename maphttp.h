@@ -71,6 +71,7 @@ extern "C" {
     char    *pszPostContentType;/* post request MIME type */
     char    *pszUserAgent;      /* User-Agent, auto-generated if not set */
     char    *pszHTTPCookieData; /* HTTP Cookie data */
+    int     nCacheTTL;          /* seconds the response may be cached, 0=never */
 
     char    *pszProxyAddress;   /* The address (IP or hostname) of proxy svr */
     long     nProxyPort;        /* The proxy's port                          */
@@ -88,6 +89,7 @@ extern "C" {
 
     /* Private members */
     void      * curl_handle;   /* CURLM * handle */
+    void      * curl_headers;  /* struct curl_slist * of the request headers */
     FILE      * fp;            /* FILE * used during download */
 
     char      * result_data;   /* output if pszOutputFile is NULL */
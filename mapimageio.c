@@ -28,7 +28,10 @@
  ****************************************************************************/
 
 #include "mapserver.h"
+#include "mapthread.h"
 #include <png.h>
+#include <zlib.h>
+#include "uthash.h"
 #include <setjmp.h>
 #include <assert.h>
 #include <jpeglib.h>
@@ -38,11 +41,16 @@
 #include <gif_lib.h>
 #endif
 
+#ifdef USE_WEBP
+#include <webp/encode.h>
+#endif
+
 
 
 typedef struct _streamInfo {
   FILE *fp;
   bufferObj *buffer;
+  int flush_rows; /* push encoded data to fp every flush_rows rows, 0 to only flush at the end */
 } streamInfo;
 
 void png_write_data_to_stream(png_structp png_ptr, png_bytep data, png_size_t length)
@@ -59,7 +67,9 @@ void png_write_data_to_buffer(png_structp png_ptr, png_bytep data, png_size_t le
 
 void png_flush_data(png_structp png_ptr)
 {
-  /* do nothing */
+  FILE *fp = ((streamInfo*)png_get_io_ptr(png_ptr))->fp;
+  if(fp)
+    msIO_fflush(fp);
 }
 
 typedef struct {
@@ -154,12 +164,30 @@ int saveAsJPEG(mapObj *map, rasterBufferObj *rb, streamInfo *info,
   JSAMPLE *rowdata = NULL;
   unsigned int row;
   jmp_buf setjmp_buffer;
-  
+  const char *pszDCT;
+  J_COLOR_SPACE colorspace = JCS_RGB;
+  int components = 3;
+
   quality = atoi(msGetOutputFormatOption( format, "QUALITY", "75"));
   pszOptimized = msGetOutputFormatOption( format, "OPTIMIZED", "YES");
   optimized = EQUAL(pszOptimized, "YES") || EQUAL(pszOptimized, "ON") ||
               EQUAL(pszOptimized, "TRUE");
   arithmetic = EQUAL(pszOptimized, "ARITHMETIC");
+  pszDCT = msGetOutputFormatOption( format, "DCT_METHOD", "ISLOW");
+
+#ifdef JCS_EXTENSIONS
+  /* libjpeg-turbo can read the 4 byte pixels of the raster buffer as is,
+     the alpha (or padding) byte being ignored */
+  if(rb->data.rgba.pixels && rb->data.rgba.pixel_step == 4) {
+    unsigned char *base = rb->data.rgba.pixels;
+    if(rb->data.rgba.b == base && rb->data.rgba.g == base + 1 && rb->data.rgba.r == base + 2)
+      colorspace = JCS_EXT_BGRX;
+    else if(rb->data.rgba.r == base && rb->data.rgba.g == base + 1 && rb->data.rgba.b == base + 2)
+      colorspace = JCS_EXT_RGBX;
+    if(colorspace != JCS_RGB)
+      components = 4;
+  }
+#endif
 
   if (setjmp(setjmp_buffer)) 
   {
@@ -196,52 +224,169 @@ int saveAsJPEG(mapObj *map, rasterBufferObj *rb, streamInfo *info,
 
   cinfo.image_width = rb->width;
   cinfo.image_height = rb->height;
-  cinfo.input_components = 3;
-  cinfo.in_color_space = JCS_RGB;
+  cinfo.input_components = components;
+  cinfo.in_color_space = colorspace;
   jpeg_set_defaults(&cinfo);
   jpeg_set_quality(&cinfo, quality, TRUE);
+  if( EQUAL(pszDCT, "FAST") || EQUAL(pszDCT, "IFAST") )
+    cinfo.dct_method = JDCT_IFAST;
+  else if( EQUAL(pszDCT, "FLOAT") )
+    cinfo.dct_method = JDCT_FLOAT;
   if( arithmetic )
     cinfo.arith_code = TRUE;
   else if( optimized )
     cinfo.optimize_coding = TRUE;
 
   if( arithmetic || optimized ) {
-    if (map == NULL || msGetConfigOption(map, "JPEGMEM") == NULL) {
+    if ((map == NULL || msGetConfigOption(map, "JPEGMEM") == NULL) &&
+        cinfo.mem->max_memory_to_use > 0) {
       /* If the user doesn't provide a value for JPEGMEM, we want to be sure */
-      /* that at least the image size will be used before creating the temporary file */
+      /* that at least the whole coefficient buffer (3 components of JCOEF  */
+      /* per pixel) fits before creating the temporary file. 0 means no limit. */
       cinfo.mem->max_memory_to_use =
-        MS_MAX(cinfo.mem->max_memory_to_use, cinfo.input_components * rb->width * rb->height);
+        MS_MAX(cinfo.mem->max_memory_to_use, 3 * sizeof(JCOEF) * rb->width * rb->height);
     }
   }
 
   jpeg_start_compress(&cinfo, TRUE);
-  rowdata = (JSAMPLE*)malloc(rb->width*cinfo.input_components*sizeof(JSAMPLE));
+  if(colorspace == JCS_RGB)
+    rowdata = (JSAMPLE*)malloc(rb->width*cinfo.input_components*sizeof(JSAMPLE));
 
   for(row=0; row<rb->height; row++) {
-    JSAMPLE *pixptr = rowdata;
+    JSAMPROW rowptr;
+    if(colorspace != JCS_RGB) {
+      rowptr = rb->data.rgba.pixels + row*rb->data.rgba.row_step;
+    } else {
+      JSAMPLE *pixptr = rowdata;
+      int col;
+      unsigned char *r,*g,*b;
+      r=rb->data.rgba.r+row*rb->data.rgba.row_step;
+      g=rb->data.rgba.g+row*rb->data.rgba.row_step;
+      b=rb->data.rgba.b+row*rb->data.rgba.row_step;
+      for(col=0; col<rb->width; col++) {
+        *(pixptr++) = *r;
+        *(pixptr++) = *g;
+        *(pixptr++) = *b;
+        r+=rb->data.rgba.pixel_step;
+        g+=rb->data.rgba.pixel_step;
+        b+=rb->data.rgba.pixel_step;
+      }
+      rowptr = rowdata;
+    }
+    (void) jpeg_write_scanlines(&cinfo, &rowptr, 1);
+    if(info->fp && info->flush_rows > 0 && (row + 1) % info->flush_rows == 0)
+      msIO_fflush(info->fp);
+  }
+
+  /* Step 6: Finish compression */
+
+  jpeg_finish_compress(&cinfo);
+  jpeg_destroy_compress(&cinfo);
+  free(rowdata);
+  return MS_SUCCESS;
+}
+
+#ifdef USE_WEBP
+static int webp_write_data(const uint8_t *data, size_t data_size, const WebPPicture *picture)
+{
+  streamInfo *info = (streamInfo*)picture->custom_ptr;
+  if(data_size == 0)
+    return 1;
+  if(info->fp)
+    return msIO_fwrite(data,data_size,1,info->fp) == 1;
+  msBufferAppend(info->buffer,(void*)data,data_size);
+  return 1;
+}
+
+int saveAsWEBP(mapObj *map, rasterBufferObj *rb, streamInfo *info,
+               outputFormatObj *format)
+{
+  WebPConfig config;
+  WebPPicture picture;
+  unsigned char *pixels, *pixptr;
+  const char *pszLossless;
+  int row, channels, ok;
+
+  if(rb->type != MS_BUFFER_BYTE_RGBA) {
+    msSetError(MS_MISCERR,"Unknown buffer type","saveAsWEBP()");
+    return MS_FAILURE;
+  }
+
+  if(!WebPConfigInit(&config) || !WebPPictureInit(&picture)) {
+    msSetError(MS_MISCERR,"libwebp version mismatch","saveAsWEBP()");
+    return MS_FAILURE;
+  }
+
+  pszLossless = msGetOutputFormatOption( format, "LOSSLESS", "OFF");
+  config.lossless = EQUAL(pszLossless, "ON") || EQUAL(pszLossless, "YES") ||
+                    EQUAL(pszLossless, "TRUE");
+  config.quality = atof(msGetOutputFormatOption( format, "QUALITY", "75"));
+  config.method = atoi(msGetOutputFormatOption( format, "METHOD", "4"));
+  /* let libwebp use its worker threads for analysis and alpha compression */
+  config.thread_level = 1;
+  if(!WebPValidateConfig(&config)) {
+    msSetError(MS_MISCERR,"invalid WEBP FORMATOPTIONs, expecting QUALITY from 0 to 100 and METHOD from 0 to 6.","saveAsWEBP()");
+    return MS_FAILURE;
+  }
+
+  /* libwebp wants packed, non premultiplied samples */
+  channels = rb->data.rgba.a ? 4 : 3;
+  pixels = (unsigned char*)msSmallMalloc(rb->width * rb->height * channels);
+  pixptr = pixels;
+  for(row=0; row<rb->height; row++) {
     int col;
-    unsigned char *r,*g,*b;
+    unsigned char *a,*r,*g,*b;
     r=rb->data.rgba.r+row*rb->data.rgba.row_step;
     g=rb->data.rgba.g+row*rb->data.rgba.row_step;
     b=rb->data.rgba.b+row*rb->data.rgba.row_step;
+    a=rb->data.rgba.a?rb->data.rgba.a+row*rb->data.rgba.row_step:NULL;
     for(col=0; col<rb->width; col++) {
-      *(pixptr++) = *r;
-      *(pixptr++) = *g;
-      *(pixptr++) = *b;
+      if(!a) {
+        *(pixptr++) = *r;
+        *(pixptr++) = *g;
+        *(pixptr++) = *b;
+      } else if(*a) {
+        double da = *a/255.0;
+        *(pixptr++) = *r/da;
+        *(pixptr++) = *g/da;
+        *(pixptr++) = *b/da;
+        *(pixptr++) = *a;
+      } else {
+        *(pixptr++) = 0;
+        *(pixptr++) = 0;
+        *(pixptr++) = 0;
+        *(pixptr++) = 0;
+      }
+      if(a) a+=rb->data.rgba.pixel_step;
       r+=rb->data.rgba.pixel_step;
       g+=rb->data.rgba.pixel_step;
       b+=rb->data.rgba.pixel_step;
     }
-    (void) jpeg_write_scanlines(&cinfo, &rowdata, 1);
   }
 
-  /* Step 6: Finish compression */
+  picture.width = rb->width;
+  picture.height = rb->height;
+  picture.use_argb = config.lossless;
+  if(channels == 4)
+    ok = WebPPictureImportRGBA(&picture, pixels, rb->width * channels);
+  else
+    ok = WebPPictureImportRGB(&picture, pixels, rb->width * channels);
+  free(pixels);
+  if(!ok) {
+    msSetError(MS_MEMERR,"failed to import image into libwebp","saveAsWEBP()");
+    WebPPictureFree(&picture);
+    return MS_FAILURE;
+  }
 
-  jpeg_finish_compress(&cinfo);
-  jpeg_destroy_compress(&cinfo);
-  free(rowdata);
-  return MS_SUCCESS;
+  picture.writer = webp_write_data;
+  picture.custom_ptr = info;
+  ok = WebPEncode(&config, &picture);
+  if(!ok)
+    msSetError(MS_MISCERR,"libwebp encoding failed (error %d)","saveAsWEBP()",(int)picture.error_code);
+  WebPPictureFree(&picture);
+  return ok ? MS_SUCCESS : MS_FAILURE;
 }
+#endif /* USE_WEBP */
 
 /*
  * sort a given list of rgba entries so that all the opaque pixels are at the end
@@ -305,7 +450,219 @@ int remapPaletteForPNG(rasterBufferObj *rb, rgbPixel *rgb, unsigned char *a, int
   return MS_SUCCESS;
 }
 
-int savePalettePNG(rasterBufferObj *rb, streamInfo *info, int compression)
+/*
+** With FORMATOPTION "PNG_THREADS=n" (n>1) the image data is not written
+** through libpng's single deflate stream: bands of rows of about 128KB are
+** deflated independently, n at a time, and joined pigz-style into one zlib
+** stream. Each band is primed with the last 32KB of the rows preceding it,
+** non final bands end with a sync flush so they join on a byte boundary,
+** and the adler32 checksums are combined. The band size does not depend on
+** the number of threads, so the output is the same for any n.
+*/
+#define PNG_BAND_SIZE 131072
+#define PNG_WINDOW_SIZE 32768
+
+typedef struct {
+  rasterBufferObj *rb;
+  int sample_depth; /* of palette images */
+  int rowbytes;
+  int start, end; /* of the rows of the band */
+  int level;
+  int last;
+  unsigned char *out; /* with 2 bytes reserved before and 4 after the deflate data */
+  size_t outlen;
+  uLong adler, inlen;
+  int status;
+} pngDeflateTaskObj;
+
+/* png row data (without the filter type byte) for row of rb */
+static void pngPrepareRow(rasterBufferObj *rb, int sample_depth, int row, unsigned char *dst)
+{
+  int col;
+  if(rb->type == MS_BUFFER_BYTE_PALETTE) {
+    unsigned char *src = &(rb->data.palette.pixels[row*rb->width]);
+    if(sample_depth == 8) {
+      memcpy(dst, src, rb->width);
+    } else {
+      int per_byte = 8 / sample_depth, nbytes = (rb->width * sample_depth + 7) / 8;
+      memset(dst, 0, nbytes);
+      for(col=0; col<rb->width; col++)
+        dst[col/per_byte] |= src[col] << (8 - sample_depth * (col%per_byte + 1));
+    }
+  } else {
+    unsigned char *a,*r,*g,*b;
+    r=rb->data.rgba.r+row*rb->data.rgba.row_step;
+    g=rb->data.rgba.g+row*rb->data.rgba.row_step;
+    b=rb->data.rgba.b+row*rb->data.rgba.row_step;
+    if(rb->data.rgba.a) {
+      a=rb->data.rgba.a+row*rb->data.rgba.row_step;
+      for(col=0; col<rb->width; col++) {
+        if(*a) {
+          double da = *a/255.0;
+          dst[0] = *r/da;
+          dst[1] = *g/da;
+          dst[2] = *b/da;
+          dst[3] = *a;
+        } else {
+          dst[0] = dst[1] = dst[2] = dst[3] = 0;
+        }
+        dst+=4;
+        a+=rb->data.rgba.pixel_step;
+        r+=rb->data.rgba.pixel_step;
+        g+=rb->data.rgba.pixel_step;
+        b+=rb->data.rgba.pixel_step;
+      }
+    } else {
+      for(col=0; col<rb->width; col++) {
+        dst[0] = *r;
+        dst[1] = *g;
+        dst[2] = *b;
+        dst+=3;
+        r+=rb->data.rgba.pixel_step;
+        g+=rb->data.rgba.pixel_step;
+        b+=rb->data.rgba.pixel_step;
+      }
+    }
+  }
+}
+
+static void pngDeflateTask(void *vtask)
+{
+  pngDeflateTaskObj *task = (pngDeflateTaskObj*)vtask;
+  int linebytes = task->rowbytes + 1, dictrows = 0, row, ret;
+  unsigned char *in, *own;
+  size_t outsize;
+  z_stream zs;
+
+  task->status = MS_FAILURE;
+  if(task->start > 0)
+    dictrows = MS_MIN(task->start, (PNG_WINDOW_SIZE + linebytes - 1) / linebytes);
+
+  in = (unsigned char*)msSmallMalloc((size_t)(task->end - task->start + dictrows) * linebytes);
+  for(row = task->start - dictrows; row < task->end; row++) {
+    unsigned char *line = in + (size_t)(row - task->start + dictrows) * linebytes;
+    line[0] = PNG_FILTER_VALUE_NONE;
+    pngPrepareRow(task->rb, task->sample_depth, row, line + 1);
+  }
+  own = in + (size_t)dictrows * linebytes;
+  task->inlen = (uLong)(task->end - task->start) * linebytes;
+  task->adler = adler32(adler32(0L, Z_NULL, 0), own, task->inlen);
+
+  memset(&zs, 0, sizeof(zs));
+  if(deflateInit2(&zs, task->level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+    free(in);
+    return;
+  }
+  if(dictrows) {
+    uInt dictlen = MS_MIN(PNG_WINDOW_SIZE, dictrows * linebytes);
+    deflateSetDictionary(&zs, own - dictlen, dictlen);
+  }
+
+  outsize = deflateBound(&zs, task->inlen) + 16;
+  task->out = (unsigned char*)msSmallMalloc(outsize + 6);
+  zs.next_in = own;
+  zs.avail_in = task->inlen;
+  zs.next_out = task->out + 2;
+  zs.avail_out = outsize;
+  for(;;) {
+    ret = deflate(&zs, task->last ? Z_FINISH : Z_SYNC_FLUSH);
+    if(ret == Z_STREAM_END || (ret == Z_OK && !task->last && zs.avail_out != 0))
+      break;
+    if(ret != Z_OK && ret != Z_BUF_ERROR) {
+      deflateEnd(&zs);
+      free(in);
+      return;
+    }
+    /* out of room, grow the output buffer */
+    task->out = (unsigned char*)msSmallRealloc(task->out, 2 * outsize + 6);
+    zs.next_out = task->out + 2 + outsize;
+    zs.avail_out = outsize;
+    outsize *= 2;
+  }
+  task->outlen = zs.total_out;
+  deflateEnd(&zs);
+  free(in);
+  task->status = MS_SUCCESS;
+}
+
+/*
+** write the IDAT and IEND chunks of rb, whose header chunks have already been
+** written by png_write_info(). Used instead of png_write_row()/png_write_end().
+*/
+static int pngWriteParallelImage(png_structp png_ptr, rasterBufferObj *rb, int sample_depth,
+                                 int bytes_per_pixel, int compression, int numthreads)
+{
+  int rowbytes, rows_per_band, numbands, batch, band, i, status = MS_SUCCESS;
+  int level = (compression == -1) ? Z_DEFAULT_COMPRESSION : compression;
+  pngDeflateTaskObj *tasks;
+  void **taskptrs;
+  uLong adler = adler32(0L, Z_NULL, 0);
+
+  if(rb->type == MS_BUFFER_BYTE_PALETTE)
+    rowbytes = (rb->width * sample_depth + 7) / 8;
+  else
+    rowbytes = rb->width * bytes_per_pixel;
+  rows_per_band = MS_MAX(1, PNG_BAND_SIZE / (rowbytes + 1));
+  numbands = (rb->height + rows_per_band - 1) / rows_per_band;
+  batch = MS_MIN(numbands, numthreads * 4);
+
+  tasks = (pngDeflateTaskObj*)msSmallCalloc(batch, sizeof(pngDeflateTaskObj));
+  taskptrs = (void**)msSmallMalloc(batch * sizeof(void*));
+
+  for(band=0; band<numbands; band+=batch) {
+    int ntasks = MS_MIN(batch, numbands - band);
+    for(i=0; i<ntasks; i++) {
+      tasks[i].rb = rb;
+      tasks[i].sample_depth = sample_depth;
+      tasks[i].rowbytes = rowbytes;
+      tasks[i].start = (band + i) * rows_per_band;
+      tasks[i].end = MS_MIN(rb->height, tasks[i].start + rows_per_band);
+      tasks[i].level = level;
+      tasks[i].last = (band + i == numbands - 1);
+      tasks[i].out = NULL;
+      taskptrs[i] = &tasks[i];
+    }
+    msThreadPoolRun(pngDeflateTask, taskptrs, ntasks, numthreads);
+
+    for(i=0; i<ntasks; i++) {
+      unsigned char *data = tasks[i].out + 2;
+      size_t length = tasks[i].outlen;
+      if(status == MS_SUCCESS && tasks[i].status == MS_SUCCESS) {
+        adler = adler32_combine(adler, tasks[i].adler, tasks[i].inlen);
+        if(band + i == 0) {
+          /* zlib header: deflate with a 32K window, level hint and check bits */
+          int flevel = (level == Z_DEFAULT_COMPRESSION || level == 6) ? 2 : (level < 2) ? 0 : (level < 6) ? 1 : 3;
+          data[-2] = 0x78;
+          data[-1] = flevel << 6;
+          data[-1] += (31 - (0x78 * 256 + data[-1]) % 31) % 31;
+          data -= 2;
+          length += 2;
+        }
+        if(tasks[i].last) {
+          data[length++] = (adler >> 24) & 0xff;
+          data[length++] = (adler >> 16) & 0xff;
+          data[length++] = (adler >> 8) & 0xff;
+          data[length++] = adler & 0xff;
+        }
+        png_write_chunk(png_ptr, (png_bytep)"IDAT", data, length);
+        if(((streamInfo*)png_get_io_ptr(png_ptr))->flush_rows > 0)
+          png_flush_data(png_ptr);
+      } else if(status == MS_SUCCESS) {
+        msSetError(MS_MISCERR, "zlib compression failed", "saveAsPNG()");
+        status = MS_FAILURE;
+      }
+      free(tasks[i].out);
+    }
+  }
+  free(tasks);
+  free(taskptrs);
+
+  if(status == MS_SUCCESS)
+    png_write_chunk(png_ptr, (png_bytep)"IEND", NULL, 0);
+  return status;
+}
+
+int savePalettePNG(rasterBufferObj *rb, streamInfo *info, int compression, int numthreads)
 {
   png_infop info_ptr;
   rgbPixel rgb[256];
@@ -334,9 +691,11 @@ int savePalettePNG(rasterBufferObj *rb, streamInfo *info, int compression)
     png_destroy_write_struct(&png_ptr, &info_ptr);
     return (MS_FAILURE);
   }
-  if(info->fp)
+  if(info->fp) {
     png_set_write_fn(png_ptr,info, png_write_data_to_stream, png_flush_data);
-  else
+    if(info->flush_rows > 0)
+      png_set_flush(png_ptr, info->flush_rows);
+  } else
     png_set_write_fn(png_ptr,info, png_write_data_to_buffer, png_flush_data);
 
 
@@ -361,6 +720,13 @@ int savePalettePNG(rasterBufferObj *rb, streamInfo *info, int compression)
     png_set_tRNS(png_ptr, info_ptr, a,num_a, NULL);
 
   png_write_info(png_ptr, info_ptr);
+
+  if(numthreads > 1) {
+    int status = pngWriteParallelImage(png_ptr, rb, sample_depth, 1, compression, numthreads);
+    png_destroy_write_struct(&png_ptr, &info_ptr);
+    return status;
+  }
+
   png_set_packing(png_ptr);
 
   for(row=0; row<rb->height; row++) {
@@ -420,15 +786,121 @@ int readPalette(const char *palette, rgbaPixel *entries, unsigned int *nEntries,
   return MS_SUCCESS;
 }
 
+/*
+** With FORMATOPTION "PALETTE_CACHE=ON", the palette computed by the
+** quantizer for the first image saved with an output format is kept and
+** reused for all following images of that format, which are then only
+** classified against it. Tiles rendered with the format thus share one
+** palette, and skip the histogram and palette computation. The cache is
+** keyed on the map (when known), the output format name and its options,
+** and protected by the TLOCK_PALETTECACHE mutex.
+*/
+typedef struct {
+  char *key;
+  rgbaPixel palette[256];
+  unsigned int num_entries;
+  UT_hash_handle hh;
+} paletteCacheObj;
+
+static paletteCacheObj *paletteCache = NULL;
+
+void msPNGPaletteCacheCleanup(void)
+{
+  msAcquireLock(TLOCK_PALETTECACHE);
+  while(paletteCache) {
+    paletteCacheObj *entry = paletteCache;
+    UT_HASH_DEL(paletteCache, entry);
+    free(entry->key);
+    free(entry);
+  }
+  msReleaseLock(TLOCK_PALETTECACHE);
+}
+
+static int quantizeWithPaletteCache(mapObj *map, outputFormatObj *format,
+                                    int (*quantize)(rasterBufferObj*, unsigned int*, rgbaPixel*, rgbaPixel*, int, unsigned int*),
+                                    rasterBufferObj *rb, rasterBufferObj *qrb,
+                                    rgbaPixel *forced_palette, int num_forced_palette_entries)
+{
+  paletteCacheObj *entry = NULL;
+  char *key = NULL;
+  unsigned int maxval, i;
+  int ret;
+
+  if(map) {
+    key = msStringConcatenate(key, map->mappath);
+    key = msStringConcatenate(key, map->name);
+  }
+  key = msStringConcatenate(key, "|");
+  key = msStringConcatenate(key, format->name);
+  for(i=0; i<format->numformatoptions; i++) {
+    key = msStringConcatenate(key, "|");
+    key = msStringConcatenate(key, format->formatoptions[i]);
+  }
+
+  msAcquireLock(TLOCK_PALETTECACHE);
+  UT_HASH_FIND_STR(paletteCache, key, entry);
+  if(entry) {
+    memcpy(qrb->data.palette.palette, entry->palette, entry->num_entries * sizeof(rgbaPixel));
+    qrb->data.palette.num_entries = entry->num_entries;
+    qrb->data.palette.scaling_maxval = 255;
+    msReleaseLock(TLOCK_PALETTECACHE);
+    free(key);
+    return MS_SUCCESS;
+  }
+  msReleaseLock(TLOCK_PALETTECACHE);
+
+  ret = quantize(rb, &(qrb->data.palette.num_entries), qrb->data.palette.palette,
+                 forced_palette, num_forced_palette_entries,
+                 &qrb->data.palette.scaling_maxval);
+  if(ret != MS_SUCCESS) {
+    free(key);
+    return ret;
+  }
+
+  entry = (paletteCacheObj*)msSmallMalloc(sizeof(paletteCacheObj));
+  entry->key = key;
+  entry->num_entries = qrb->data.palette.num_entries;
+  maxval = qrb->data.palette.scaling_maxval;
+  for(i=0; i<entry->num_entries; i++) {
+    /* the cached palette is for images at full depth */
+    rgbaPixel *p = &(qrb->data.palette.palette[i]);
+    entry->palette[i].r = (p->r * 255 + (maxval >> 1)) / maxval;
+    entry->palette[i].g = (p->g * 255 + (maxval >> 1)) / maxval;
+    entry->palette[i].b = (p->b * 255 + (maxval >> 1)) / maxval;
+    entry->palette[i].a = (p->a * 255 + (maxval >> 1)) / maxval;
+  }
+
+  msAcquireLock(TLOCK_PALETTECACHE);
+  {
+    paletteCacheObj *existing = NULL;
+    UT_HASH_FIND_STR(paletteCache, key, existing);
+    if(!existing) {
+      UT_HASH_ADD_KEYPTR(hh, paletteCache, entry->key, strlen(entry->key), entry);
+      entry = NULL;
+    }
+  }
+  msReleaseLock(TLOCK_PALETTECACHE);
+
+  if(entry) { /* another thread got there first */
+    free(entry->key);
+    free(entry);
+  }
+  return MS_SUCCESS;
+}
+
 int saveAsPNG(mapObj *map,rasterBufferObj *rb, streamInfo *info, outputFormatObj *format)
 {
   int force_pc256 = MS_FALSE;
   int force_palette = MS_FALSE;
+  int palette_cache = MS_FALSE;
 
   int ret = MS_FAILURE;
 
-  const char *force_string,*zlib_compression;
+  const char *force_string,*zlib_compression,*quantize_method;
   int compression = -1;
+  int numthreads = atoi(msGetOutputFormatOption( format, "PNG_THREADS", "1"));
+  int (*quantize)(rasterBufferObj*, unsigned int*, rgbaPixel*, rgbaPixel*, int, unsigned int*) = msQuantizeRasterBuffer;
+  int (*classify)(rasterBufferObj*, rasterBufferObj*) = msClassifyRasterBuffer;
 
   zlib_compression = msGetOutputFormatOption( format, "COMPRESSION", NULL);
   if(zlib_compression && *zlib_compression) {
@@ -441,6 +913,15 @@ int saveAsPNG(mapObj *map,rasterBufferObj *rb, streamInfo *info, outputFormatObj
   }
 
 
+  quantize_method = msGetOutputFormatOption( format, "QUANTIZE_METHOD", "MEDIANCUT" );
+  if(!strcasecmp(quantize_method,"KMEANS")) {
+    quantize = msQuantizeRasterBufferKMeans;
+    classify = msClassifyRasterBufferKMeans;
+  } else if(strcasecmp(quantize_method,"MEDIANCUT")) {
+    msSetError(MS_MISCERR,"failed to parse FORMATOPTION \"QUANTIZE_METHOD=%s\", expecting MEDIANCUT or KMEANS.","saveAsPNG()",quantize_method);
+    return MS_FAILURE;
+  }
+
   force_string = msGetOutputFormatOption( format, "QUANTIZE_FORCE", NULL );
   if( force_string && (strcasecmp(force_string,"on") == 0  || strcasecmp(force_string,"yes") == 0 || strcasecmp(force_string,"true") == 0) )
     force_pc256 = MS_TRUE;
@@ -449,6 +930,10 @@ int saveAsPNG(mapObj *map,rasterBufferObj *rb, streamInfo *info, outputFormatObj
   if( force_string && (strcasecmp(force_string,"on") == 0  || strcasecmp(force_string,"yes") == 0 || strcasecmp(force_string,"true") == 0) )
     force_palette = MS_TRUE;
 
+  force_string = msGetOutputFormatOption( format, "PALETTE_CACHE", NULL );
+  if( force_string && (strcasecmp(force_string,"on") == 0  || strcasecmp(force_string,"yes") == 0 || strcasecmp(force_string,"true") == 0) )
+    palette_cache = MS_TRUE;
+
   if(force_pc256 || force_palette) {
     rasterBufferObj qrb;
     rgbaPixel palette[256], paletteGiven[256];
@@ -462,9 +947,12 @@ int saveAsPNG(mapObj *map,rasterBufferObj *rb, streamInfo *info, outputFormatObj
     if(force_pc256) {
       qrb.data.palette.palette = palette;
       qrb.data.palette.num_entries = atoi(msGetOutputFormatOption( format, "QUANTIZE_COLORS", "256"));
-      ret = msQuantizeRasterBuffer(rb,&(qrb.data.palette.num_entries),qrb.data.palette.palette,
-                                   NULL, 0,
-                                   &qrb.data.palette.scaling_maxval);
+      if(palette_cache)
+        ret = quantizeWithPaletteCache(map, format, quantize, rb, &qrb, NULL, 0);
+      else
+        ret = quantize(rb,&(qrb.data.palette.num_entries),qrb.data.palette.palette,
+                       NULL, 0,
+                       &qrb.data.palette.scaling_maxval);
     } else {
       int colorsWanted = atoi(msGetOutputFormatOption( format, "QUANTIZE_COLORS", "0"));
       const char *palettePath = msGetOutputFormatOption( format, "PALETTE", "palette.txt");
@@ -487,14 +975,18 @@ int saveAsPNG(mapObj *map,rasterBufferObj *rb, streamInfo *info, outputFormatObj
         /* quantize the image, and mix our colours in the resulting palette */
         qrb.data.palette.palette = palette;
         qrb.data.palette.num_entries = MS_MAX(colorsWanted,numPaletteGivenEntries);
-        ret = msQuantizeRasterBuffer(rb,&(qrb.data.palette.num_entries),qrb.data.palette.palette,
-                                     paletteGiven,numPaletteGivenEntries,
-                                     &qrb.data.palette.scaling_maxval);
+        if(palette_cache)
+          ret = quantizeWithPaletteCache(map, format, quantize, rb, &qrb,
+                                         paletteGiven, numPaletteGivenEntries);
+        else
+          ret = quantize(rb,&(qrb.data.palette.num_entries),qrb.data.palette.palette,
+                         paletteGiven,numPaletteGivenEntries,
+                         &qrb.data.palette.scaling_maxval);
       }
     }
     if(ret != MS_FAILURE) {
-      ret = msClassifyRasterBuffer(rb,&qrb);
-      ret = savePalettePNG(&qrb,info,compression);
+      ret = classify(rb,&qrb);
+      ret = savePalettePNG(&qrb,info,compression,numthreads);
     }
     msFree(qrb.data.palette.pixels);
     return ret;
@@ -523,9 +1015,11 @@ int saveAsPNG(mapObj *map,rasterBufferObj *rb, streamInfo *info, outputFormatObj
       png_destroy_write_struct(&png_ptr, &info_ptr);
       return (MS_FAILURE);
     }
-    if(info->fp)
+    if(info->fp) {
       png_set_write_fn(png_ptr,info, png_write_data_to_stream, png_flush_data);
-    else
+      if(info->flush_rows > 0)
+        png_set_flush(png_ptr, info->flush_rows);
+    } else
       png_set_write_fn(png_ptr,info, png_write_data_to_buffer, png_flush_data);
 
     if(rb->data.rgba.a)
@@ -539,6 +1033,13 @@ int saveAsPNG(mapObj *map,rasterBufferObj *rb, streamInfo *info, outputFormatObj
 
     png_write_info(png_ptr, info_ptr);
 
+    if(numthreads > 1) {
+      int status = pngWriteParallelImage(png_ptr, rb, 8, rb->data.rgba.a ? 4 : 3,
+                                         compression, numthreads);
+      png_destroy_write_struct(&png_ptr, &info_ptr);
+      return status;
+    }
+
     if(!rb->data.rgba.a && rb->data.rgba.pixel_step==4)
       png_set_filler(png_ptr, 0, PNG_FILLER_AFTER);
 
@@ -714,18 +1215,36 @@ int readPNG(char *path, rasterBufferObj *rb)
 int msSaveRasterBuffer(mapObj *map, rasterBufferObj *rb, FILE *stream,
                        outputFormatObj *format)
 {
+  /*
+  ** STREAM_FLUSH_ROWS lets clients start receiving the image while the
+  ** rest of it is still being compressed, instead of only once the
+  ** encoder is done.
+  */
+  int flush_rows = MS_MAX(0, atoi(msGetOutputFormatOption( format, "STREAM_FLUSH_ROWS", "0")));
+
   if(strcasestr(format->driver,"/png")) {
     streamInfo info;
     info.fp = stream;
     info.buffer = NULL;
+    info.flush_rows = flush_rows;
 
     return saveAsPNG(map, rb,&info,format);
   } else if(strcasestr(format->driver,"/jpeg")) {
     streamInfo info;
     info.fp = stream;
     info.buffer=NULL;
+    info.flush_rows = flush_rows;
     
     return saveAsJPEG(map, rb,&info,format);
+#ifdef USE_WEBP
+  } else if(strcasestr(format->driver,"/webp")) {
+    streamInfo info;
+    info.fp = stream;
+    info.buffer = NULL;
+    info.flush_rows = flush_rows;
+
+    return saveAsWEBP(map, rb,&info,format);
+#endif
   } else {
     msSetError(MS_MISCERR,"unsupported image format\n", "msSaveRasterBuffer()");
     return MS_FAILURE;
@@ -739,12 +1258,22 @@ int msSaveRasterBufferToBuffer(rasterBufferObj *data, bufferObj *buffer,
     streamInfo info;
     info.fp = NULL;
     info.buffer = buffer;
+    info.flush_rows = 0;
     return saveAsPNG(NULL, data,&info,format);
   } else if(strcasestr(format->driver,"/jpeg")) {
     streamInfo info;
     info.fp = NULL;
     info.buffer=buffer;
+    info.flush_rows = 0;
     return saveAsJPEG(NULL, data,&info,format);
+#ifdef USE_WEBP
+  } else if(strcasestr(format->driver,"/webp")) {
+    streamInfo info;
+    info.fp = NULL;
+    info.buffer = buffer;
+    info.flush_rows = 0;
+    return saveAsWEBP(NULL, data,&info,format);
+#endif
   } else {
     msSetError(MS_MISCERR,"unsupported image format\n", "msSaveRasterBuffer()");
     return MS_FAILURE;
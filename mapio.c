@@ -31,6 +31,7 @@
 
 #include "mapserver.h"
 #include "mapthread.h"
+#include "maptime.h"
 
 #ifdef _WIN32
 #include <fcntl.h>
@@ -48,11 +49,35 @@
 static int is_msIO_initialized = MS_FALSE;
 static int is_msIO_header_enabled = MS_TRUE;
 
+/*
+** Capture buffers are allocated in power of two size classes. Blocks of
+** released buffers are kept per thread, one per class, and handed to the
+** next buffer installed on that thread so repeated multi-MB responses
+** don't go through the whole realloc ladder again.
+*/
+#define MSIO_BUFFER_MIN_CLASS 12 /* 4KB */
+#define MSIO_BUFFER_MAX_CLASS 26 /* 64MB, larger blocks are not recycled */
+
 typedef struct msIOContextGroup_t {
   msIOContext stdin_context;
   msIOContext stdout_context;
   msIOContext stderr_context;
 
+  unsigned char *buffer_pool[MSIO_BUFFER_MAX_CLASS+1];
+
+  char   **request_env; /* NAME=value list, NULL for the process environment */
+  int    (*request_cancel)(void *);
+  void    *request_cancel_data;
+  int      request_cancelled;
+  double   request_deadline; /* seconds since the epoch, 0 for none */
+  int      request_deadline_partial;
+  int      request_timed_out;
+  size_t   request_memory_limit; /* bytes, 0 for none */
+  size_t   request_memory[MS_REQUEST_MEMORY_NUMTAGS];
+  size_t   request_memory_peak[MS_REQUEST_MEMORY_NUMTAGS];
+  size_t   request_memory_total, request_memory_total_peak;
+  int      request_memory_exceeded;
+
   void*    thread_id;
   struct msIOContextGroup_t *next;
 } msIOContextGroup;
@@ -60,6 +85,7 @@ typedef struct msIOContextGroup_t {
 static msIOContextGroup default_contexts;
 static msIOContextGroup *io_context_list = NULL;
 static void msIO_Initialize( void );
+static int msIO_stdioWrite( void *cbData, void *data, int byteCount );
 
 #ifdef msIO_printf
 #  undef msIO_printf
@@ -82,7 +108,10 @@ void msIO_Cleanup()
     is_msIO_initialized = MS_FALSE;
     while( io_context_list != NULL ) {
       msIOContextGroup *last = io_context_list;
+      int i;
       io_context_list = io_context_list->next;
+      for( i = 0; i <= MSIO_BUFFER_MAX_CLASS; i++ )
+        free( last->buffer_pool[i] );
       free( last );
     }
   }
@@ -163,6 +192,294 @@ int msIO_isStdContext() {
   return MS_FALSE;
 }
 
+/************************************************************************/
+/*                         msIO_setRequestEnv()                         */
+/*                                                                      */
+/*      Sets the CGI environment of the request running in this thread  */
+/*      as a NULL terminated list of NAME=value strings, the list is    */
+/*      not copied. Pass NULL to go back to the process environment.    */
+/************************************************************************/
+
+void msIO_setRequestEnv( char **envp )
+
+{
+  msIO_GetContextGroup()->request_env = envp;
+}
+
+/************************************************************************/
+/*                            msIO_getenv()                             */
+/*                                                                      */
+/*      getenv() that looks in the request environment of this thread   */
+/*      first, see msIO_setRequestEnv(), and then in the process one.   */
+/************************************************************************/
+
+char *msIO_getenv( const char *name )
+
+{
+  msIOContextGroup *group = io_context_list;
+
+  if( group == NULL || group->thread_id != msGetThreadId() )
+    group = msIO_GetContextGroup();
+
+  if( group->request_env != NULL ) {
+    size_t len = strlen(name);
+    char **env;
+
+    for( env = group->request_env; *env != NULL; env++ ) {
+      if( strncmp(*env, name, len) == 0 && (*env)[len] == '=' )
+        return *env + len + 1;
+    }
+  }
+
+  return getenv(name);
+}
+
+/************************************************************************/
+/*                       msIO_setRequestCancel()                        */
+/*                                                                      */
+/*      Installs a callback polled by the drawing code of this thread   */
+/*      to abort the request, it returns non zero to cancel. Pass NULL  */
+/*      to remove it.                                                   */
+/************************************************************************/
+
+void msIO_setRequestCancel( int (*cancelled)(void *), void *cbData )
+
+{
+  msIOContextGroup *group = msIO_GetContextGroup();
+
+  group->request_cancel = cancelled;
+  group->request_cancel_data = cbData;
+  group->request_cancelled = MS_FALSE;
+}
+
+/************************************************************************/
+/*                      msIO_setRequestDeadline()                       */
+/*                                                                      */
+/*      Gives the request of this thread a time budget of seconds from  */
+/*      now, after which msIO_isRequestCancelled() returns true. With   */
+/*      partial set the drawing code stops but still returns what was   */
+/*      drawn, see msIO_checkRequestCancelled(). A budget <= 0 removes  */
+/*      the deadline.                                                   */
+/************************************************************************/
+
+void msIO_setRequestDeadline( double seconds, int partial )
+
+{
+  msIOContextGroup *group = msIO_GetContextGroup();
+
+  group->request_deadline = 0;
+  group->request_deadline_partial = partial;
+  group->request_timed_out = MS_FALSE;
+  if( seconds > 0 ) {
+    struct mstimeval now;
+
+    msGettimeofday( &now, NULL );
+    group->request_deadline = now.tv_sec + now.tv_usec / 1e6 + seconds;
+  }
+}
+
+/************************************************************************/
+/*                      msIO_isRequestCancelled()                       */
+/************************************************************************/
+
+int msIO_isRequestCancelled()
+
+{
+  msIOContextGroup *group = io_context_list;
+
+  if( group == NULL || group->thread_id != msGetThreadId() )
+    group = msIO_GetContextGroup();
+
+  if( !group->request_cancelled && group->request_cancel != NULL
+      && group->request_cancel( group->request_cancel_data ) )
+    group->request_cancelled = MS_TRUE;
+
+  if( !group->request_timed_out && group->request_deadline > 0 ) {
+    struct mstimeval now;
+
+    msGettimeofday( &now, NULL );
+    if( now.tv_sec + now.tv_usec / 1e6 >= group->request_deadline )
+      group->request_timed_out = MS_TRUE;
+  }
+
+  return group->request_cancelled || group->request_timed_out || group->request_memory_exceeded;
+}
+
+/************************************************************************/
+/*                     msIO_checkRequestCancelled()                     */
+/*                                                                      */
+/*      For the polling points of the drawing and query loops: returns  */
+/*      MS_TRUE if the work should stop. The error is set, unless the   */
+/*      request ran out of time and partial output was asked for, in    */
+/*      which case the caller stops quietly and returns what it has.    */
+/************************************************************************/
+
+int msIO_checkRequestCancelled( const char *routine )
+
+{
+  msIOContextGroup *group;
+
+  if( !msIO_isRequestCancelled() )
+    return MS_FALSE;
+
+  group = msIO_GetContextGroup();
+  if( group->request_cancelled )
+    msSetError( MS_MISCERR, "Request cancelled.", routine );
+  else if( group->request_memory_exceeded )
+    msIO_checkRequestMemory( routine );
+  else if( !group->request_deadline_partial )
+    msSetError( MS_MISCERR, "Request time budget exceeded.", routine );
+
+  return MS_TRUE;
+}
+
+/************************************************************************/
+/*                     msIO_isRequestOutputPartial()                    */
+/************************************************************************/
+
+int msIO_isRequestOutputPartial()
+
+{
+  msIOContextGroup *group = msIO_GetContextGroup();
+
+  return !group->request_cancelled && !group->request_memory_exceeded
+         && group->request_timed_out && group->request_deadline_partial;
+}
+
+/************************************************************************/
+/*                    msIO_setRequestMemoryLimit()                      */
+/*                                                                      */
+/*      Starts the memory accounting of the request of this thread,     */
+/*      with a cap of bytes (0 for none). The big allocations of the    */
+/*      images, result caches, label caches and layer data are added    */
+/*      up by msIO_requestMemoryAlloc(): beyond the cap the next        */
+/*      msIO_checkRequestMemory() fails and the request is cancelled,   */
+/*      as if it ran out of time.                                       */
+/************************************************************************/
+
+void msIO_setRequestMemoryLimit( size_t bytes )
+
+{
+  msIOContextGroup *group = msIO_GetContextGroup();
+
+  group->request_memory_limit = bytes;
+  memset( group->request_memory, 0, sizeof(group->request_memory) );
+  memset( group->request_memory_peak, 0, sizeof(group->request_memory_peak) );
+  group->request_memory_total = group->request_memory_total_peak = 0;
+  group->request_memory_exceeded = MS_FALSE;
+}
+
+/************************************************************************/
+/*                      msIO_requestMemoryAlloc()                       */
+/************************************************************************/
+
+void msIO_requestMemoryAlloc( int tag, size_t bytes )
+
+{
+  msIOContextGroup *group = io_context_list;
+
+  if( group == NULL || group->thread_id != msGetThreadId() )
+    group = msIO_GetContextGroup();
+
+  group->request_memory[tag] += bytes;
+  group->request_memory_total += bytes;
+  if( group->request_memory[tag] > group->request_memory_peak[tag] )
+    group->request_memory_peak[tag] = group->request_memory[tag];
+  if( group->request_memory_total > group->request_memory_total_peak )
+    group->request_memory_total_peak = group->request_memory_total;
+
+  if( group->request_memory_limit > 0 && group->request_memory_total > group->request_memory_limit )
+    group->request_memory_exceeded = MS_TRUE;
+}
+
+/************************************************************************/
+/*                       msIO_requestMemoryFree()                       */
+/*                                                                      */
+/*      Memory allocated by a previous request (a cached map) may be    */
+/*      freed by this one, the counts don't go below 0.                 */
+/************************************************************************/
+
+void msIO_requestMemoryFree( int tag, size_t bytes )
+
+{
+  msIOContextGroup *group = io_context_list;
+
+  if( group == NULL || group->thread_id != msGetThreadId() )
+    group = msIO_GetContextGroup();
+
+  bytes = MS_MIN( bytes, group->request_memory[tag] );
+  group->request_memory[tag] -= bytes;
+  group->request_memory_total -= bytes;
+}
+
+/************************************************************************/
+/*                      msIO_checkRequestMemory()                       */
+/*                                                                      */
+/*      Returns MS_FAILURE, with the error set, once the request went   */
+/*      over its memory cap.                                            */
+/************************************************************************/
+
+int msIO_checkRequestMemory( const char *routine )
+
+{
+  msIOContextGroup *group = io_context_list;
+
+  if( group == NULL || group->thread_id != msGetThreadId() )
+    group = msIO_GetContextGroup();
+
+  if( !group->request_memory_exceeded )
+    return MS_SUCCESS;
+
+  msSetError( MS_MEMERR, "Request memory limit of %lu bytes exceeded.", routine,
+              (unsigned long) group->request_memory_limit );
+  return MS_FAILURE;
+}
+
+/************************************************************************/
+/*                    msIO_getRequestMemoryPeak()                       */
+/*                                                                      */
+/*      Returns the peak of the memory accounted for the request, and   */
+/*      the peaks of each tag in tagpeaks if not NULL.                  */
+/************************************************************************/
+
+size_t msIO_getRequestMemoryPeak( size_t *tagpeaks )
+
+{
+  msIOContextGroup *group = msIO_GetContextGroup();
+
+  if( tagpeaks )
+    memcpy( tagpeaks, group->request_memory_peak, sizeof(group->request_memory_peak) );
+  return group->request_memory_total_peak;
+}
+
+/************************************************************************/
+/*                        msIO_getRequestMemory()                       */
+/*                                                                      */
+/*      Returns the memory accounted for the request of this thread     */
+/*      now, and that of each tag in tagbytes if not NULL. A worker     */
+/*      thread hands what it accounted over to the request with this.   */
+/************************************************************************/
+
+size_t msIO_getRequestMemory( size_t *tagbytes )
+
+{
+  msIOContextGroup *group = msIO_GetContextGroup();
+
+  if( tagbytes )
+    memcpy( tagbytes, group->request_memory, sizeof(group->request_memory) );
+  return group->request_memory_total;
+}
+
+/************************************************************************/
+/*                     msIO_getRequestMemoryLimit()                     */
+/************************************************************************/
+
+size_t msIO_getRequestMemoryLimit()
+
+{
+  return msIO_GetContextGroup()->request_memory_limit;
+}
+
 /************************************************************************/
 /*                          msIO_getHandler()                           */
 /************************************************************************/
@@ -479,6 +796,29 @@ int msIO_fwrite( const void *data, size_t size, size_t nmemb, FILE *fp )
     return msIO_contextWrite( context, data, size * nmemb ) / size;
 }
 
+/************************************************************************/
+/*                            msIO_fflush()                             */
+/*                                                                      */
+/*      Push whatever has been written so far on fp to the client.      */
+/*      Only stdio contexts (which includes FastCGI, whose stdio is     */
+/*      remapped by fcgi_stdio.h) are flushed; buffer contexts are      */
+/*      collecting the whole response anyway and are left untouched.    */
+/************************************************************************/
+
+int msIO_fflush( FILE *fp )
+
+{
+  msIOContext *context;
+
+  context = msIO_getHandler( fp );
+  if( context == NULL )
+    return fflush( fp );
+  else if( context->write_channel && context->readWriteFunc == msIO_stdioWrite )
+    return fflush( (FILE *) context->cbData );
+
+  return 0;
+}
+
 /************************************************************************/
 /*                            msIO_fread()                              */
 /************************************************************************/
@@ -627,6 +967,63 @@ int msIO_needBinaryStdin()
 /*      memory buffer io handling functions.                            */
 /* ==================================================================== */
 
+/************************************************************************/
+/*                         msIO_allocBuffer()                           */
+/*                                                                      */
+/*      Create an empty capture buffer, reusing the largest block       */
+/*      recycled on this thread if there is one.                        */
+/************************************************************************/
+
+static msIOBuffer *msIO_allocBuffer( msIOContextGroup *group )
+
+{
+  msIOBuffer *buf = (msIOBuffer *) calloc(sizeof(msIOBuffer),1);
+  int i;
+
+  if( buf == NULL || group == NULL )
+    return buf;
+
+  for( i = MSIO_BUFFER_MAX_CLASS; i >= MSIO_BUFFER_MIN_CLASS; i-- ) {
+    if( group->buffer_pool[i] != NULL ) {
+      buf->data = group->buffer_pool[i];
+      buf->data_len = 1 << i;
+      buf->data[0] = '\0';
+      group->buffer_pool[i] = NULL;
+      break;
+    }
+  }
+
+  return buf;
+}
+
+/************************************************************************/
+/*                        msIO_releaseBuffer()                          */
+/*                                                                      */
+/*      Free a capture buffer, keeping its block for reuse if its       */
+/*      size class slot is still free.                                  */
+/************************************************************************/
+
+static void msIO_releaseBuffer( msIOContextGroup *group, msIOBuffer *buf )
+
+{
+  if( buf->data != NULL ) {
+    unsigned char *block = buf->data - buf->data_skip;
+    int size = buf->data_len + buf->data_skip;
+    int i;
+
+    for( i = MSIO_BUFFER_MIN_CLASS; i <= MSIO_BUFFER_MAX_CLASS; i++ ) {
+      if( size == (1 << i) )
+        break;
+    }
+    if( group != NULL && i <= MSIO_BUFFER_MAX_CLASS
+        && group->buffer_pool[i] == NULL )
+      group->buffer_pool[i] = block;
+    else
+      free( block );
+  }
+  free( buf );
+}
+
 /************************************************************************/
 /*                         msIO_resetHandlers()                         */
 /************************************************************************/
@@ -639,29 +1036,14 @@ void msIO_resetHandlers()
   if( group == NULL )
     return;
 
-  if( strcmp(group->stdin_context.label,"buffer") == 0 ) {
-    msIOBuffer *buf = (msIOBuffer *) group->stdin_context.cbData;
-
-    if( buf->data != NULL )
-      free( buf->data );
-    free( buf );
-  }
-
-  if( strcmp(group->stdout_context.label,"buffer") == 0 ) {
-    msIOBuffer *buf = (msIOBuffer *) group->stdout_context.cbData;
-
-    if( buf->data != NULL )
-      free( buf->data );
-    free( buf );
-  }
+  if( strcmp(group->stdin_context.label,"buffer") == 0 )
+    msIO_releaseBuffer( group, (msIOBuffer *) group->stdin_context.cbData );
 
-  if( strcmp(group->stderr_context.label,"buffer") == 0 ) {
-    msIOBuffer *buf = (msIOBuffer *) group->stderr_context.cbData;
+  if( strcmp(group->stdout_context.label,"buffer") == 0 )
+    msIO_releaseBuffer( group, (msIOBuffer *) group->stdout_context.cbData );
 
-    if( buf->data != NULL )
-      free( buf->data );
-    free( buf );
-  }
+  if( strcmp(group->stderr_context.label,"buffer") == 0 )
+    msIO_releaseBuffer( group, (msIOBuffer *) group->stderr_context.cbData );
 
   msIO_installHandlers( NULL, NULL, NULL );
 }
@@ -679,7 +1061,7 @@ void msIO_installStdoutToBuffer()
   context.label = "buffer";
   context.write_channel = MS_TRUE;
   context.readWriteFunc = msIO_bufferWrite;
-  context.cbData = calloc(sizeof(msIOBuffer),1);
+  context.cbData = msIO_allocBuffer( group );
 
   msIO_installHandlers( &group->stdin_context,
                         &context,
@@ -720,14 +1102,11 @@ void msIO_restoreOldStdoutContext(msIOContext *context_to_restore)
 {
   msIOContextGroup *group = msIO_GetContextGroup();
   msIOContext *prev_context = &group->stdout_context;
-  msIOBuffer* buffer;
   
   /* Free memory associated to our temporary context */
   assert( strcmp(prev_context->label, "buffer") == 0 );
 
-  buffer = (msIOBuffer* )prev_context->cbData;
-  msFree(buffer->data);
-  msFree(buffer);
+  msIO_releaseBuffer( group, (msIOBuffer* )prev_context->cbData );
 
   /* Restore old context */
   msIO_installHandlers( &group->stdin_context,
@@ -833,12 +1212,13 @@ char *msIO_stripStdoutBufferContentType()
   content_type[end_of_ct-14+1] = '\0';
 
   /* -------------------------------------------------------------------- */
-  /*      Move data to front of buffer, and reset length.                 */
+  /*      Skip the headers rather than moving the (possibly large) data   */
+  /*      to the front of the buffer.                                     */
   /* -------------------------------------------------------------------- */
-  memmove( buf->data, buf->data+start_of_data,
-           buf->data_offset - start_of_data );
-  buf->data[buf->data_offset - start_of_data] = '\0';
+  buf->data += start_of_data;
+  buf->data_len -= start_of_data;
   buf->data_offset -= start_of_data;
+  buf->data_skip += start_of_data;
 
   return content_type;
 }
@@ -914,12 +1294,13 @@ void msIO_stripStdoutBufferContentHeaders()
   }
 
   /* -------------------------------------------------------------------- */
-  /*      Move data to front of buffer, and reset length.                 */
+  /*      Skip the headers rather than moving the (possibly large) data   */
+  /*      to the front of the buffer.                                     */
   /* -------------------------------------------------------------------- */
-  memmove( buf->data, buf->data+start_of_data,
-           buf->data_offset - start_of_data );
-  buf->data[buf->data_offset - start_of_data] = '\0';
+  buf->data += start_of_data;
+  buf->data_len -= start_of_data;
   buf->data_offset -= start_of_data;
+  buf->data_skip += start_of_data;
 
   return;
 }
@@ -937,19 +1318,31 @@ int msIO_bufferWrite( void *cbData, void *data, int byteCount )
   ** Grow buffer if needed (reserve one extra byte to put nul character)
   */
   if( buf->data_offset + byteCount >= buf->data_len ) {
-    buf->data_len = buf->data_len * 2 + byteCount + 100;
+    int needed = buf->data_skip + buf->data_offset + byteCount + 1;
+    int size = MS_MAX( (buf->data_len + buf->data_skip) * 2,
+                       1 << MSIO_BUFFER_MIN_CLASS );
+    unsigned char *block;
+
+    while( size < needed )
+      size *= 2;
     if( buf->data == NULL )
-      buf->data = (unsigned char *) malloc(buf->data_len);
+      block = (unsigned char *) malloc(size);
     else
-      buf->data = (unsigned char *) realloc(buf->data, buf->data_len);
+      block = (unsigned char *) realloc(buf->data - buf->data_skip, size);
 
-    if( buf->data == NULL ) {
+    if( block == NULL ) {
       msSetError( MS_MEMERR,
                   "Failed to allocate %d bytes for capture buffer.",
-                  "msIO_bufferWrite()", buf->data_len );
+                  "msIO_bufferWrite()", size );
+      free( buf->data - buf->data_skip );
+      buf->data = NULL;
       buf->data_len = 0;
+      buf->data_offset = 0;
+      buf->data_skip = 0;
       return 0;
     }
+    buf->data = block + buf->data_skip;
+    buf->data_len = size - buf->data_skip;
   }
 
   /*
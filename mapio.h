@@ -55,6 +55,7 @@ extern "C" {
   int MS_DLL_EXPORT msIO_fprintf( FILE *stream, const char *format, ... ) MS_PRINT_FUNC_FORMAT(2,3);
   int MS_DLL_EXPORT msIO_fwrite( const void *ptr, size_t size, size_t nmemb, FILE *stream );
   int MS_DLL_EXPORT msIO_fread( void *ptr, size_t size, size_t nmemb, FILE *stream );
+  int MS_DLL_EXPORT msIO_fflush( FILE *stream );
   int MS_DLL_EXPORT msIO_vfprintf( FILE *fp, const char *format, va_list ap ) MS_PRINT_FUNC_FORMAT(2,0);
 
   /*
@@ -94,6 +95,7 @@ extern "C" {
     unsigned char *data;
     int            data_len;    /* really buffer length */
     int            data_offset; /* really buffer used */
+    int            data_skip;   /* stripped header bytes allocated before data */
   } msIOBuffer;
 
   int MS_DLL_EXPORT msIO_bufferRead( void *, void *, int );
@@ -111,6 +113,27 @@ extern "C" {
 
   int MS_DLL_EXPORT msIO_isStdContext(void);
 
+  /* per thread CGI environment, for servers handling requests in threads */
+  void MS_DLL_EXPORT msIO_setRequestEnv(char **envp);
+  char MS_DLL_EXPORT *msIO_getenv(const char *name);
+  void MS_DLL_EXPORT msIO_setRequestCancel(int (*cancelled)(void *), void *cbData);
+  int MS_DLL_EXPORT msIO_isRequestCancelled(void);
+  void MS_DLL_EXPORT msIO_setRequestDeadline(double seconds, int partial);
+  int MS_DLL_EXPORT msIO_checkRequestCancelled(const char *routine);
+  int MS_DLL_EXPORT msIO_isRequestOutputPartial(void);
+
+  /* per thread request memory accounting, by the kind of data */
+  enum MS_REQUEST_MEMORY_TAG { MS_REQUEST_MEMORY_IMAGE, MS_REQUEST_MEMORY_RESULTCACHE, MS_REQUEST_MEMORY_LABELCACHE,
+                               MS_REQUEST_MEMORY_LAYERDATA, MS_REQUEST_MEMORY_NUMTAGS
+                             };
+  void MS_DLL_EXPORT msIO_setRequestMemoryLimit(size_t bytes);
+  void MS_DLL_EXPORT msIO_requestMemoryAlloc(int tag, size_t bytes);
+  void MS_DLL_EXPORT msIO_requestMemoryFree(int tag, size_t bytes);
+  int MS_DLL_EXPORT msIO_checkRequestMemory(const char *routine);
+  size_t MS_DLL_EXPORT msIO_getRequestMemoryPeak(size_t *tagpeaks);
+  size_t MS_DLL_EXPORT msIO_getRequestMemory(size_t *tagbytes);
+  size_t MS_DLL_EXPORT msIO_getRequestMemoryLimit(void);
+
 
   /* this is just for setting normal stdout's to binary mode on windows */
 
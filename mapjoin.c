@@ -28,6 +28,10 @@
  ****************************************************************************/
 
 #include "mapserver.h"
+#include "mapthread.h"
+#include "uthash.h"
+
+#include <sys/stat.h>
 
 
 
@@ -61,6 +65,8 @@ int msPOSTGRESQLJoinPrepare(joinObj *join, shapeObj *shape);
 int msPOSTGRESQLJoinNext(joinObj *join);
 int msPOSTGRESQLJoinClose(joinObj *join);
 
+int msMySQLJoinPrefetch(layerObj *layer, joinObj *join, int first);
+
 /* wrapper function for DB specific join functions */
 int msJoinConnect(layerObj *layer, joinObj *join)
 {
@@ -131,6 +137,24 @@ int msJoinNext(joinObj *join)
   return MS_FAILURE;
 }
 
+/*
+** Lets join fetch the records of the results of layer from first on in one
+** go, when it can, before msJoinPrepare() is called for them. Only MySQL
+** joins with CONFIG "MS_MYSQL_JOIN_BATCH" do, for the others it is a no-op.
+*/
+int msJoinPrefetch(layerObj *layer, joinObj *join, int first)
+{
+  switch(join->connectiontype) {
+    case(MS_DB_MYSQL):
+      return msMySQLJoinPrefetch(layer, join, first);
+      break;
+    default:
+      break;
+  }
+
+  return MS_SUCCESS;
+}
+
 int msJoinClose(joinObj *join)
 {
   switch(join->connectiontype) {
@@ -155,294 +179,423 @@ int msJoinClose(joinObj *join)
 }
 
 /*  */
-/* XBASE join functions */
+/* Process wide store of the XBase and CSV tables being joined. A table is */
+/* read once and indexed on its "to" column, finding the records joined to */
+/* a shape is then a hash lookup rather than a scan of the whole table. The */
+/* tables are shared by the joins using them (refcount) and read again once */
+/* the modification time or size of their file changes, unused ones are */
+/* dropped least recently used first when the store is full. */
 /*  */
+/* These static structures are protected by the TLOCK_JOINCACHE mutex, an */
+/* index is not modified once built so it is searched without it. */
+/*  */
+#define MS_JOIN_CACHE_MAX 16
+
 typedef struct {
-  DBFHandle hDBF;
-  int fromindex, toindex;
-  char *target;
-  int nextrecord;
-} msDBFJoinInfo;
+  char *key; /* points in the rows of the table */
+  int numrows;
+  int *rows; /* in table order */
+  UT_hash_handle hh;
+} joinKeyObj;
 
-int msDBFJoinConnect(layerObj *layer, joinObj *join)
+typedef struct joinIndexObj {
+  int column;
+  joinKeyObj *keys;
+  struct joinIndexObj *next;
+} joinIndexObj;
+
+typedef struct {
+  char *path;
+  int connectiontype;
+  time_t mtime;
+  off_t size;
+  int refcount;
+  int stale;
+  unsigned long last_used;
+
+  int numitems; /* fields of the XBase table, columns of the last CSV line */
+  char **items; /* XBase only */
+  int numrows;
+  char ***rows;
+  int *rowitems; /* values of each row */
+  joinIndexObj *indexes;
+} joinTableObj;
+
+static int joinTableCount = 0;
+static unsigned long joinTableClock = 0;
+static joinTableObj *joinTables[MS_JOIN_CACHE_MAX];
+
+static void msJoinTableFree(joinTableObj *table)
 {
   int i;
-  char szPath[MS_MAXPATHLEN];
-  msDBFJoinInfo *joininfo;
 
-  if(join->joininfo) return(MS_SUCCESS); /* already open */
+  while(table->indexes) {
+    joinIndexObj *index = table->indexes;
+    joinKeyObj *key, *tmp;
 
-  if ( msCheckParentPointer(layer->map,"map")==MS_FAILURE )
-    return MS_FAILURE;
+    UT_HASH_ITER(hh, index->keys, key, tmp) {
+      UT_HASH_DEL(index->keys, key);
+      free(key->rows);
+      free(key);
+    }
+    table->indexes = index->next;
+    free(index);
+  }
 
+  for(i=0; i<table->numrows; i++)
+    if(table->rows[i]) msFreeCharArray(table->rows[i], table->rowitems[i]);
+  free(table->rows);
+  free(table->rowitems);
+  if(table->items) msFreeCharArray(table->items, table->numitems);
+  free(table->path);
+  free(table);
+}
 
-  /* allocate a msDBFJoinInfo struct */
-  joininfo = (msDBFJoinInfo *) malloc(sizeof(msDBFJoinInfo));
-  if(!joininfo) {
-    msSetError(MS_MEMERR, "Error allocating XBase table info structure.", "msDBFJoinConnect()");
-    return(MS_FAILURE);
-  }
+static void msJoinTableRemove(int i)
+{
+  msJoinTableFree(joinTables[i]);
 
-  /* initialize any members that won't get set later on in this function */
-  joininfo->target = NULL;
-  joininfo->nextrecord = 0;
+  joinTableCount--;
+  if( i != joinTableCount )
+    joinTables[i] = joinTables[joinTableCount];
+}
 
-  join->joininfo = joininfo;
+/* read the whole XBase file at path, NULL on failure */
+static joinTableObj *msJoinTableLoadDBF(const char *path)
+{
+  DBFHandle hDBF;
+  joinTableObj *table;
+  int i;
 
-  /* open the XBase file */
-  if((joininfo->hDBF = msDBFOpen( msBuildPath3(szPath, layer->map->mappath, layer->map->shapepath, join->table), "rb" )) == NULL) {
-    if((joininfo->hDBF = msDBFOpen( msBuildPath(szPath, layer->map->mappath, join->table), "rb" )) == NULL) {
-      msSetError(MS_IOERR, "(%s)", "msDBFJoinConnect()", join->table);
-      return(MS_FAILURE);
-    }
+  if((hDBF = msDBFOpen(path, "rb")) == NULL) {
+    msSetError(MS_IOERR, "(%s)", "msDBFJoinConnect()", path);
+    return(NULL);
   }
 
-  /* get "to" item index */
-  if((joininfo->toindex = msDBFGetItemIndex(joininfo->hDBF, join->to)) == -1) {
-    msSetError(MS_DBFERR, "Item %s not found in table %s.", "msDBFJoinConnect()", join->to, join->table);
-    return(MS_FAILURE);
+  table = (joinTableObj *) msSmallCalloc(1, sizeof(joinTableObj));
+  table->numitems = msDBFGetFieldCount(hDBF);
+  table->items = msDBFGetItems(hDBF);
+  if(!table->items) {
+    msDBFClose(hDBF);
+    msJoinTableFree(table);
+    return(NULL);
   }
 
-  /* get "from" item index   */
-  for(i=0; i<layer->numitems; i++) {
-    if(strcasecmp(layer->items[i],join->from) == 0) { /* found it */
-      joininfo->fromindex = i;
-      break;
+  table->numrows = msDBFGetRecordCount(hDBF);
+  table->rows = (char ***) msSmallCalloc(table->numrows + 1, sizeof(char **));
+  table->rowitems = (int *) msSmallCalloc(table->numrows + 1, sizeof(int));
+  for(i=0; i<table->numrows; i++) {
+    if((table->rows[i] = msDBFGetValues(hDBF, i)) == NULL) {
+      msDBFClose(hDBF);
+      msJoinTableFree(table);
+      return(NULL);
     }
+    table->rowitems[i] = table->numitems;
   }
+  msDBFClose(hDBF);
 
-  if(i == layer->numitems) {
-    msSetError(MS_JOINERR, "Item %s not found in layer %s.", "msDBFJoinConnect()", join->from, layer->name);
-    return(MS_FAILURE);
-  }
-
-  /* finally store away the item names in the XBase table */
-  join->numitems =  msDBFGetFieldCount(joininfo->hDBF);
-  join->items = msDBFGetItems(joininfo->hDBF);
-  if(!join->items) return(MS_FAILURE);
-
-  return(MS_SUCCESS);
+  return(table);
 }
 
-int msDBFJoinPrepare(joinObj *join, shapeObj *shape)
+/* read the whole CSV file at path, NULL on failure */
+static joinTableObj *msJoinTableLoadCSV(const char *path)
 {
-  msDBFJoinInfo *joininfo = join->joininfo;
+  FILE *stream;
+  joinTableObj *table;
+  char buffer[MS_BUFFER_LENGTH];
+  int i;
 
-  if(!joininfo) {
-    msSetError(MS_JOINERR, "Join connection has not be created.", "msDBFJoinPrepare()");
-    return(MS_FAILURE);
+  if((stream = fopen(path, "r")) == NULL) {
+    msSetError(MS_IOERR, "(%s)", "msCSVJoinConnect()", path);
+    return(NULL);
   }
 
-  if(!shape) {
-    msSetError(MS_JOINERR, "Shape to be joined is empty.", "msDBFJoinPrepare()");
-    return(MS_FAILURE);
-  }
+  table = (joinTableObj *) msSmallCalloc(1, sizeof(joinTableObj));
 
-  if(!shape->values) {
-    msSetError(MS_JOINERR, "Shape to be joined has no attributes.", "msDBFJoinPrepare()");
-    return(MS_FAILURE);
-  }
+  /* once through to get the number of rows */
+  while(fgets(buffer, MS_BUFFER_LENGTH, stream) != NULL) table->numrows++;
+  rewind(stream);
 
-  joininfo->nextrecord = 0; /* starting with the first record */
+  table->rows = (char ***) msSmallCalloc(table->numrows + 1, sizeof(char **));
+  table->rowitems = (int *) msSmallCalloc(table->numrows + 1, sizeof(int));
 
-  if(joininfo->target) free(joininfo->target); /* clear last target */
-  joininfo->target = msStrdup(shape->values[joininfo->fromindex]);
+  /* load the rows */
+  i = 0;
+  while(i < table->numrows && fgets(buffer, MS_BUFFER_LENGTH, stream) != NULL) {
+    msStringTrimEOL(buffer);
+    table->rows[i] = msStringSplitComplex(buffer, ",", &(table->rowitems[i]), MS_ALLOWEMPTYTOKENS);
+    table->numitems = table->rowitems[i];
+    i++;
+  }
+  table->numrows = i;
+  fclose(stream);
 
-  return(MS_SUCCESS);
+  return(table);
 }
 
-int msDBFJoinNext(joinObj *join)
+/* index of table on column, built if needed: TLOCK_JOINCACHE is held */
+static joinIndexObj *msJoinTableGetIndex(joinTableObj *table, int column)
 {
-  int i, n;
-  msDBFJoinInfo *joininfo = join->joininfo;
+  joinIndexObj *index;
+  joinKeyObj *key;
+  int i;
 
-  if(!joininfo) {
-    msSetError(MS_JOINERR, "Join connection has not be created.", "msDBFJoinNext()");
-    return(MS_FAILURE);
-  }
+  for(index=table->indexes; index; index=index->next)
+    if(index->column == column) return(index);
 
-  if(!joininfo->target) {
-    msSetError(MS_JOINERR, "No target specified, run msDBFJoinPrepare() first.", "msDBFJoinNext()");
-    return(MS_FAILURE);
-  }
+  index = (joinIndexObj *) msSmallCalloc(1, sizeof(joinIndexObj));
+  index->column = column;
+  for(i=0; i<table->numrows; i++) {
+    if(column >= table->rowitems[i]) continue; /* short line */
 
-  /* clear any old data */
-  if(join->values) {
-    msFreeCharArray(join->values, join->numitems);
-    join->values = NULL;
+    UT_HASH_FIND_STR(index->keys, table->rows[i][column], key);
+    if(!key) {
+      key = (joinKeyObj *) msSmallCalloc(1, sizeof(joinKeyObj));
+      key->key = table->rows[i][column];
+      UT_HASH_ADD_KEYPTR(hh, index->keys, key->key, strlen(key->key), key);
+    }
+    key->rows = (int *) msSmallRealloc(key->rows, sizeof(int) * (key->numrows + 1));
+    key->rows[key->numrows++] = i;
   }
 
-  n = msDBFGetRecordCount(joininfo->hDBF);
+  index->next = table->indexes;
+  table->indexes = index;
+
+  return(index);
+}
 
-  for(i=joininfo->nextrecord; i<n; i++) { /* find a match */
-    if(strcmp(joininfo->target, msDBFReadStringAttribute(joininfo->hDBF, i, joininfo->toindex)) == 0) break;
+/*
+** The table of join read and indexed on column, from the store if it is
+** there and up to date. NULL on failure, the table is released with
+** msJoinTableRelease().
+*/
+static joinTableObj *msJoinTableOpen(layerObj *layer, joinObj *join, int column, joinIndexObj **index, const char *funcname)
+{
+  int i, slot = -1;
+  char szPath[MS_MAXPATHLEN];
+  const char *path;
+  struct stat sStat;
+  joinTableObj *table = NULL;
+
+  if(stat((path = msBuildPath3(szPath, layer->map->mappath, layer->map->shapepath, join->table)), &sStat) != 0 &&
+     stat((path = msBuildPath(szPath, layer->map->mappath, join->table)), &sStat) != 0) {
+    msSetError(MS_IOERR, "(%s)", funcname, join->table);
+    return(NULL);
   }
 
-  if(i == n) { /* unable to do the join */
-    if((join->values = (char **)malloc(sizeof(char *)*join->numitems)) == NULL) {
-      msSetError(MS_MEMERR, NULL, "msDBFJoinNext()");
-      return(MS_FAILURE);
+  msAcquireLock( TLOCK_JOINCACHE );
+  for( i = joinTableCount - 1; i >= 0; i-- ) {
+    if( joinTables[i]->connectiontype != join->connectiontype || strcmp(joinTables[i]->path, path) != 0 )
+      continue;
+
+    if( joinTables[i]->mtime != sStat.st_mtime || joinTables[i]->size != sStat.st_size ) {
+      /* the file has been rewritten, drop the old copy once unused */
+      if( joinTables[i]->refcount > 0 )
+        joinTables[i]->stale = MS_TRUE;
+      else
+        msJoinTableRemove(i);
+      continue;
     }
-    for(i=0; i<join->numitems; i++)
-      join->values[i] = msStrdup("\0"); /* intialize to zero length strings */
 
-    joininfo->nextrecord = n;
-    return(MS_DONE);
+    if( !joinTables[i]->stale ) {
+      table = joinTables[i];
+      break;
+    }
   }
 
-  if((join->values = msDBFGetValues(joininfo->hDBF,i)) == NULL)
-    return(MS_FAILURE);
+  if( !table ) {
+    if( join->connectiontype == MS_DB_CSV )
+      table = msJoinTableLoadCSV(path);
+    else
+      table = msJoinTableLoadDBF(path);
+
+    if( table ) {
+      table->path = msStrdup(path);
+      table->connectiontype = join->connectiontype;
+      table->mtime = sStat.st_mtime;
+      table->size = sStat.st_size;
+
+      if( joinTableCount == MS_JOIN_CACHE_MAX ) {
+        for( i = 0; i < joinTableCount; i++ ) {
+          if( joinTables[i]->refcount == 0 &&
+              (slot == -1 || joinTables[i]->last_used < joinTables[slot]->last_used) )
+            slot = i;
+        }
+        if( slot != -1 )
+          msJoinTableRemove(slot);
+      }
+      if( joinTableCount < MS_JOIN_CACHE_MAX )
+        joinTables[joinTableCount++] = table;
+      else
+        table->stale = MS_TRUE; /* all in use, this one is freed once released */
+    }
+  }
 
-  joininfo->nextrecord = i+1; /* so we know where to start looking next time through */
+  if( table ) {
+    table->refcount++;
+    table->last_used = ++joinTableClock;
+    *index = msJoinTableGetIndex(table, column);
+  }
+  msReleaseLock( TLOCK_JOINCACHE );
 
-  return(MS_SUCCESS);
+  return(table);
 }
 
-int msDBFJoinClose(joinObj *join)
+static void msJoinTableRelease(joinTableObj *table)
 {
-  msDBFJoinInfo *joininfo = join->joininfo;
-
-  if(!joininfo) return(MS_SUCCESS); /* already closed */
+  int i;
 
-  if(joininfo->hDBF) msDBFClose(joininfo->hDBF);
-  if(joininfo->target) free(joininfo->target);
-  free(joininfo);
-  joininfo = NULL;
+  msAcquireLock( TLOCK_JOINCACHE );
+  table->refcount--;
+  if( table->stale && table->refcount == 0 ) {
+    for( i = 0; i < joinTableCount; i++ ) {
+      if( joinTables[i] == table ) break;
+    }
+    if( i < joinTableCount )
+      msJoinTableRemove(i);
+    else
+      msJoinTableFree(table);
+  }
+  msReleaseLock( TLOCK_JOINCACHE );
+}
 
-  return(MS_SUCCESS);
+void msJoinCacheCleanup(void)
+{
+  msAcquireLock( TLOCK_JOINCACHE );
+  while( joinTableCount > 0 )
+    msJoinTableRemove(joinTableCount - 1);
+  msReleaseLock( TLOCK_JOINCACHE );
 }
 
 /*  */
-/* CSV (comma separated value) join functions */
+/* XBase and CSV joins, both read the table from the store above */
 /*  */
 typedef struct {
+  joinTableObj *table;
+  joinIndexObj *index;
   int fromindex, toindex;
   char *target;
-  char ***rows;
-  int numrows;
-  int nextrow;
-} msCSVJoinInfo;
+  joinKeyObj *match; /* rows of the table joined to target, NULL for none */
+  int nextmatch;
+} msTableJoinInfo;
 
-int msCSVJoinConnect(layerObj *layer, joinObj *join)
+static int msTableJoinConnect(layerObj *layer, joinObj *join, const char *funcname)
 {
   int i;
-  FILE *stream;
-  char szPath[MS_MAXPATHLEN];
-  msCSVJoinInfo *joininfo;
-  char buffer[MS_BUFFER_LENGTH];
+  msTableJoinInfo *joininfo;
 
   if(join->joininfo) return(MS_SUCCESS); /* already open */
+
   if ( msCheckParentPointer(layer->map,"map")==MS_FAILURE )
     return MS_FAILURE;
 
+  /* get "from" item index */
+  for(i=0; i<layer->numitems; i++) {
+    if(strcasecmp(layer->items[i],join->from) == 0) /* found it */
+      break;
+  }
 
-  /* allocate a msCSVJoinInfo struct */
-  if((joininfo = (msCSVJoinInfo *) malloc(sizeof(msCSVJoinInfo))) == NULL) {
-    msSetError(MS_MEMERR, "Error allocating CSV table info structure.", "msCSVJoinConnect()");
+  if(i == layer->numitems) {
+    msSetError(MS_JOINERR, "Item %s not found in layer %s.", funcname, join->from, layer->name);
     return(MS_FAILURE);
   }
 
-  /* initialize any members that won't get set later on in this function */
-  joininfo->target = NULL;
-  joininfo->nextrow = 0;
-
+  /* allocate a msTableJoinInfo struct */
+  joininfo = (msTableJoinInfo *) msSmallCalloc(1, sizeof(msTableJoinInfo));
+  joininfo->fromindex = i;
   join->joininfo = joininfo;
 
-  /* open the CSV file */
-  if((stream = fopen( msBuildPath3(szPath, layer->map->mappath, layer->map->shapepath, join->table), "r" )) == NULL) {
-    if((stream = fopen( msBuildPath(szPath, layer->map->mappath, join->table), "r" )) == NULL) {
-      msSetError(MS_IOERR, "(%s)", "msCSVJoinConnect()", join->table);
+  if(join->connectiontype == MS_DB_CSV) {
+    /* get "to" index (for now the user tells us which column, 1..n) */
+    joininfo->toindex = atoi(join->to) - 1;
+    if(joininfo->toindex < 0) {
+      msSetError(MS_JOINERR, "Invalid column index %s.", funcname, join->to);
       return(MS_FAILURE);
     }
-  }
-
-  /* once through to get the number of rows */
-  joininfo->numrows = 0;
-  while(fgets(buffer, MS_BUFFER_LENGTH, stream) != NULL) joininfo->numrows++;
-  rewind(stream);
-
-  if((joininfo->rows = (char ***) malloc(joininfo->numrows*sizeof(char **))) == NULL) {
-    fclose(stream);
-    msSetError(MS_MEMERR, "Error allocating rows.", "msCSVJoinConnect()");
-    return(MS_FAILURE);
-  }
-
-  /* load the rows */
-  i = 0;
-  while(fgets(buffer, MS_BUFFER_LENGTH, stream) != NULL) {
-    msStringTrimEOL(buffer);
-    joininfo->rows[i] = msStringSplitComplex(buffer, ",", &(join->numitems), MS_ALLOWEMPTYTOKENS);
-    i++;
-  }
-  fclose(stream);
-
-  /* get "from" item index   */
-  for(i=0; i<layer->numitems; i++) {
-    if(strcasecmp(layer->items[i],join->from) == 0) { /* found it */
-      joininfo->fromindex = i;
-      break;
+    if((joininfo->table = msJoinTableOpen(layer, join, joininfo->toindex, &joininfo->index, funcname)) == NULL)
+      return(MS_FAILURE);
+    if(joininfo->toindex > joininfo->table->numitems) {
+      msSetError(MS_JOINERR, "Invalid column index %s.", funcname, join->to);
+      return(MS_FAILURE);
     }
-  }
 
-  if(i == layer->numitems) {
-    msSetError(MS_JOINERR, "Item %s not found in layer %s.", "msCSVJoinConnect()", join->from, layer->name);
-    return(MS_FAILURE);
-  }
+    /* store away the column names (1..n) */
+    join->numitems = joininfo->table->numitems;
+    join->items = (char **) msSmallMalloc(sizeof(char *)*(join->numitems + 1));
+    for(i=0; i<join->numitems; i++) {
+      join->items[i] = (char *) msSmallMalloc(8); /* plenty of space */
+      sprintf(join->items[i], "%d", i+1);
+    }
+  } else {
+    DBFHandle hDBF;
+    char szPath[MS_MAXPATHLEN];
 
-  /* get "to" index (for now the user tells us which column, 1..n) */
-  joininfo->toindex = atoi(join->to) - 1;
-  if(joininfo->toindex < 0 || joininfo->toindex > join->numitems) {
-    msSetError(MS_JOINERR, "Invalid column index %s.", "msCSVJoinConnect()", join->to);
-    return(MS_FAILURE);
-  }
+    /* get "to" item index, from the header only */
+    if((hDBF = msDBFOpen( msBuildPath3(szPath, layer->map->mappath, layer->map->shapepath, join->table), "rb" )) == NULL) {
+      if((hDBF = msDBFOpen( msBuildPath(szPath, layer->map->mappath, join->table), "rb" )) == NULL) {
+        msSetError(MS_IOERR, "(%s)", funcname, join->table);
+        return(MS_FAILURE);
+      }
+    }
+    joininfo->toindex = msDBFGetItemIndex(hDBF, join->to);
+    msDBFClose(hDBF);
+    if(joininfo->toindex == -1) {
+      msSetError(MS_DBFERR, "Item %s not found in table %s.", funcname, join->to, join->table);
+      return(MS_FAILURE);
+    }
+    if((joininfo->table = msJoinTableOpen(layer, join, joininfo->toindex, &joininfo->index, funcname)) == NULL)
+      return(MS_FAILURE);
 
-  /* store away the column names (1..n) */
-  if((join->items = (char **) malloc(sizeof(char *)*join->numitems)) == NULL) {
-    msSetError(MS_MEMERR, "Error allocating space for join item names.", "msCSVJoinConnect()");
-    return(MS_FAILURE);
-  }
-  for(i=0; i<join->numitems; i++) {
-    join->items[i] = (char *) malloc(8); /* plenty of space */
-    sprintf(join->items[i], "%d", i+1);
+    /* finally store away the item names in the XBase table */
+    join->numitems = joininfo->table->numitems;
+    join->items = (char **) msSmallMalloc(sizeof(char *)*(join->numitems + 1));
+    for(i=0; i<join->numitems; i++)
+      join->items[i] = msStrdup(joininfo->table->items[i]);
   }
 
   return(MS_SUCCESS);
 }
 
-int msCSVJoinPrepare(joinObj *join, shapeObj *shape)
+static int msTableJoinPrepare(joinObj *join, shapeObj *shape, const char *funcname)
 {
-  msCSVJoinInfo *joininfo = join->joininfo;
+  msTableJoinInfo *joininfo = join->joininfo;
 
-  if(!joininfo) {
-    msSetError(MS_JOINERR, "Join connection has not be created.", "msCSVJoinPrepare()");
+  if(!joininfo || !joininfo->table) {
+    msSetError(MS_JOINERR, "Join connection has not be created.", funcname);
     return(MS_FAILURE);
   }
 
   if(!shape) {
-    msSetError(MS_JOINERR, "Shape to be joined is empty.", "msCSVJoinPrepare()");
+    msSetError(MS_JOINERR, "Shape to be joined is empty.", funcname);
     return(MS_FAILURE);
   }
 
   if(!shape->values) {
-    msSetError(MS_JOINERR, "Shape to be joined has no attributes.", "msCSVJoinPrepare()");
+    msSetError(MS_JOINERR, "Shape to be joined has no attributes.", funcname);
     return(MS_FAILURE);
   }
 
-  joininfo->nextrow = 0; /* starting with the first record */
-
   if(joininfo->target) free(joininfo->target); /* clear last target */
   joininfo->target = msStrdup(shape->values[joininfo->fromindex]);
 
+  UT_HASH_FIND_STR(joininfo->index->keys, joininfo->target, joininfo->match);
+  joininfo->nextmatch = 0; /* starting with the first record */
+
   return(MS_SUCCESS);
 }
 
-int msCSVJoinNext(joinObj *join)
+static int msTableJoinNext(joinObj *join, const char *funcname, const char *preparename)
 {
-  int i,j;
-  msCSVJoinInfo *joininfo = join->joininfo;
+  int i, row;
+  msTableJoinInfo *joininfo = join->joininfo;
 
-  if(!joininfo) {
-    msSetError(MS_JOINERR, "Join connection has not be created.", "msCSVJoinNext()");
+  if(!joininfo || !joininfo->table) {
+    msSetError(MS_JOINERR, "Join connection has not be created.", funcname);
+    return(MS_FAILURE);
+  }
+
+  if(!joininfo->target) {
+    msSetError(MS_JOINERR, "No target specified, run %s first.", funcname, preparename);
     return(MS_FAILURE);
   }
 
@@ -452,48 +605,81 @@ int msCSVJoinNext(joinObj *join)
     join->values = NULL;
   }
 
-  for(i=joininfo->nextrow; i<joininfo->numrows; i++) { /* find a match     */
-    if(strcmp(joininfo->target, joininfo->rows[i][joininfo->toindex]) == 0) break;
-  }
+  join->values = (char **) msSmallMalloc(sizeof(char *)*(join->numitems + 1));
 
-  if((join->values = (char ** )malloc(sizeof(char *)*join->numitems)) == NULL) {
-    msSetError(MS_MEMERR, NULL, "msCSVJoinNext()");
-    return(MS_FAILURE);
-  }
-
-  if(i == joininfo->numrows) { /* unable to do the join     */
-    for(j=0; j<join->numitems; j++)
-      join->values[j] = msStrdup("\0"); /* intialize to zero length strings */
-
-    joininfo->nextrow = joininfo->numrows;
+  if(!joininfo->match || joininfo->nextmatch >= joininfo->match->numrows) { /* unable to do the join */
+    for(i=0; i<join->numitems; i++)
+      join->values[i] = msStrdup("\0"); /* intialize to zero length strings */
     return(MS_DONE);
   }
 
-  for(j=0; j<join->numitems; j++)
-    join->values[j] = msStrdup(joininfo->rows[i][j]);
-
-  joininfo->nextrow = i+1; /* so we know where to start looking next time through */
+  row = joininfo->match->rows[joininfo->nextmatch++];
+  for(i=0; i<join->numitems; i++)
+    join->values[i] = msStrdup(i < joininfo->table->rowitems[row] ? joininfo->table->rows[row][i] : "");
 
   return(MS_SUCCESS);
 }
 
-int msCSVJoinClose(joinObj *join)
+static int msTableJoinClose(joinObj *join)
 {
-  int i;
-  msCSVJoinInfo *joininfo = join->joininfo;
+  msTableJoinInfo *joininfo = join->joininfo;
 
   if(!joininfo) return(MS_SUCCESS); /* already closed */
 
-  for(i=0; i<joininfo->numrows; i++)
-    msFreeCharArray(joininfo->rows[i], join->numitems);
-  free(joininfo->rows);
+  if(joininfo->table) msJoinTableRelease(joininfo->table);
   if(joininfo->target) free(joininfo->target);
   free(joininfo);
-  joininfo = NULL;
+  join->joininfo = NULL;
 
   return(MS_SUCCESS);
 }
 
+/*  */
+/* XBASE join functions */
+/*  */
+int msDBFJoinConnect(layerObj *layer, joinObj *join)
+{
+  return msTableJoinConnect(layer, join, "msDBFJoinConnect()");
+}
+
+int msDBFJoinPrepare(joinObj *join, shapeObj *shape)
+{
+  return msTableJoinPrepare(join, shape, "msDBFJoinPrepare()");
+}
+
+int msDBFJoinNext(joinObj *join)
+{
+  return msTableJoinNext(join, "msDBFJoinNext()", "msDBFJoinPrepare()");
+}
+
+int msDBFJoinClose(joinObj *join)
+{
+  return msTableJoinClose(join);
+}
+
+/*  */
+/* CSV (comma separated value) join functions */
+/*  */
+int msCSVJoinConnect(layerObj *layer, joinObj *join)
+{
+  return msTableJoinConnect(layer, join, "msCSVJoinConnect()");
+}
+
+int msCSVJoinPrepare(joinObj *join, shapeObj *shape)
+{
+  return msTableJoinPrepare(join, shape, "msCSVJoinPrepare()");
+}
+
+int msCSVJoinNext(joinObj *join)
+{
+  return msTableJoinNext(join, "msCSVJoinNext()", "msCSVJoinPrepare()");
+}
+
+int msCSVJoinClose(joinObj *join)
+{
+  return msTableJoinClose(join);
+}
+
 
 #ifdef USE_MYSQL
 
@@ -528,6 +714,14 @@ MYSQL_RES *msMySQLQuery(char *q, MYSQL *conn)
 /*  */
 /* mysql join functions */
 /*  */
+
+/* the record of a key fetched by msMySQLJoinPrefetch() */
+typedef struct {
+  char *key;
+  char **values; /* NULL if the table has none */
+  UT_hash_handle hh;
+} msMySQLJoinRecord;
+
 typedef struct {
   MYSQL mysql, *conn;
   MYSQL_RES *qresult;
@@ -537,7 +731,28 @@ typedef struct {
   char *tocolumn;
   char *target;
   int nextrecord;
+
+  int batchsize; /* results fetched per query, CONFIG "MS_MYSQL_JOIN_BATCH", 0 for one query per shape */
+  int batchfirst, batchend; /* results the records are for */
+  msMySQLJoinRecord *records;
+  msMySQLJoinRecord *match; /* record of target, NULL if it was not fetched */
 } msMySQLJoinInfo;
+
+static void msMySQLJoinFreeBatch(joinObj *join)
+{
+  msMySQLJoinInfo *joininfo = join->joininfo;
+  msMySQLJoinRecord *record, *tmp;
+
+  UT_HASH_ITER(hh, joininfo->records, record, tmp) {
+    UT_HASH_DEL(joininfo->records, record);
+    if(record->values) msFreeCharArray(record->values, join->numitems);
+    free(record->key);
+    free(record);
+  }
+  joininfo->records = NULL;
+  joininfo->match = NULL;
+  joininfo->batchfirst = joininfo->batchend = 0;
+}
 #endif
 
 
@@ -569,6 +784,10 @@ int msMySQLJoinConnect(layerObj *layer, joinObj *join)
   joininfo->qresult = NULL;
   joininfo->target = NULL;
   joininfo->nextrecord = 0;
+  joininfo->batchsize = 0;
+  joininfo->batchfirst = joininfo->batchend = 0;
+  joininfo->records = NULL;
+  joininfo->match = NULL;
 
   join->joininfo = joininfo;
 
@@ -677,10 +896,112 @@ int msMySQLJoinConnect(layerObj *layer, joinObj *join)
   /* finally store away the item names in the XBase table */
   if(!join->items) return(MS_FAILURE);
 
+  if(msGetConfigOption(layer->map, "MS_MYSQL_JOIN_BATCH"))
+    joininfo->batchsize = atoi(msGetConfigOption(layer->map, "MS_MYSQL_JOIN_BATCH"));
+
   return(MS_SUCCESS);
 #endif
 }
 
+/*
+** Fetches the records of the results first to first+batchsize-1 of layer
+** with a single "WHERE tocolumn IN (...)" query, msMySQLJoinNext() then
+** serves them from memory. The shapes are read for their "from" value,
+** from the batch of msLayerGetResultShape() when it has them.
+*/
+int msMySQLJoinPrefetch(layerObj *layer, joinObj *join, int first)
+{
+#ifndef USE_MYSQL
+  return(MS_SUCCESS); /* msMySQLJoinConnect() reports it */
+#else
+  int i, n, numkeys = 0, numfields, status = MS_SUCCESS;
+  char *sql;
+  shapeObj shape;
+  msMySQLJoinInfo *joininfo = join->joininfo;
+  msMySQLJoinRecord *record;
+  MYSQL_RES *qresult;
+  MYSQL_ROW row;
+
+  if(!joininfo || joininfo->batchsize <= 0 || !layer->resultcache) return(MS_SUCCESS);
+  if(first >= joininfo->batchfirst && first < joininfo->batchend) return(MS_SUCCESS); /* already there */
+
+  msMySQLJoinFreeBatch(join);
+
+  n = MS_MIN(joininfo->batchsize, layer->resultcache->numresults - first);
+
+  sql = msStringConcatenate(NULL, "SELECT *, ");
+  sql = msStringConcatenate(sql, joininfo->tocolumn);
+  sql = msStringConcatenate(sql, " FROM ");
+  sql = msStringConcatenate(sql, join->table);
+  sql = msStringConcatenate(sql, " WHERE ");
+  sql = msStringConcatenate(sql, joininfo->tocolumn);
+  sql = msStringConcatenate(sql, " IN (");
+
+  msInitShape(&shape);
+  for(i=first; i<first+n; i++) {
+    resultShapesObj *rs = layer->resultshapes;
+    const char *key;
+
+    /* read the ones the batch of msLayerGetResultShape() has in place, not to hand them out */
+    if(rs && i >= rs->first && i < rs->first + rs->numshapes && !rs->handedout[i - rs->first] &&
+       rs->numitems == layer->numitems && rs->shapes[i - rs->first].values) {
+      key = rs->shapes[i - rs->first].values[joininfo->fromindex];
+    } else {
+      msFreeShape(&shape);
+      if(msLayerGetShape(layer, &shape, &(layer->resultcache->results[i])) != MS_SUCCESS || !shape.values)
+        continue; /* will be joined by its own query */
+      key = shape.values[joininfo->fromindex];
+    }
+
+    UT_HASH_FIND_STR(joininfo->records, key, record);
+    if(!record) {
+      char *escaped = (char *) msSmallMalloc(2 * strlen(key) + 1);
+
+      record = (msMySQLJoinRecord *) msSmallCalloc(1, sizeof(msMySQLJoinRecord));
+      record->key = msStrdup(key);
+      UT_HASH_ADD_KEYPTR(hh, joininfo->records, record->key, strlen(record->key), record);
+
+      mysql_real_escape_string(joininfo->conn, escaped, key, strlen(key));
+      if(numkeys++ > 0) sql = msStringConcatenate(sql, ",");
+      sql = msStringConcatenate(sql, "'");
+      sql = msStringConcatenate(sql, escaped);
+      sql = msStringConcatenate(sql, "'");
+      free(escaped);
+    }
+  }
+  msFreeShape(&shape);
+  sql = msStringConcatenate(sql, ")");
+
+  if(numkeys > 0) {
+    MYDEBUG printf("%s<BR>\n", sql);
+    if((qresult = msMySQLQuery(sql, joininfo->conn)) == NULL) {
+      msMySQLJoinFreeBatch(join); /* msMySQLQuery() set the error */
+      status = MS_FAILURE;
+    } else {
+      numfields = mysql_num_fields(qresult);
+      while((row = mysql_fetch_row(qresult)) != NULL) {
+        if(!row[numfields-1]) continue;
+        UT_HASH_FIND_STR(joininfo->records, row[numfields-1], record);
+        if(!record || record->values) continue; /* one-to-one, first one wins */
+
+        record->values = (char **) msSmallMalloc(sizeof(char *) * join->numitems);
+        for(i=0; i<join->numitems; i++)
+          record->values[i] = msStrdup((i < numfields-1 && row[i]) ? row[i] : "");
+      }
+      mysql_free_result(qresult);
+    }
+  }
+  free(sql);
+
+  if(status == MS_SUCCESS) {
+    joininfo->batchfirst = first;
+    joininfo->batchend = first + n;
+  }
+
+  return(status);
+#endif
+}
+
 int msMySQLJoinPrepare(joinObj *join, shapeObj *shape)
 {
 #ifndef USE_MYSQL
@@ -709,6 +1030,8 @@ int msMySQLJoinPrepare(joinObj *join, shapeObj *shape)
   if(joininfo->target) free(joininfo->target); /* clear last target */
   joininfo->target = msStrdup(shape->values[joininfo->fromindex]);
 
+  UT_HASH_FIND_STR(joininfo->records, joininfo->target, joininfo->match);
+
   return(MS_SUCCESS);
 #endif
 }
@@ -739,6 +1062,18 @@ int msMySQLJoinNext(joinObj *join)
     join->values = NULL;
   }
 
+  if(joininfo->match) { /* fetched by msMySQLJoinPrefetch() */
+    if((join->values = (char **)malloc(sizeof(char *)*join->numitems)) == NULL) {
+      msSetError(MS_MEMERR, NULL, "msMySQLJoinNext()");
+      return(MS_FAILURE);
+    }
+    for(i=0; i<join->numitems; i++)
+      join->values[i] = msStrdup((joininfo->match->values && joininfo->nextrecord == 0) ? joininfo->match->values[i] : "\0");
+    if(!joininfo->match->values || joininfo->nextrecord++ > 0)
+      return(MS_DONE);
+    return(MS_SUCCESS);
+  }
+
   n = joininfo->rows;
 
   /* for(i=joininfo->nextrecord; i<n; i++) { // find a match */
@@ -814,6 +1149,7 @@ int msMySQLJoinClose(joinObj *join)
 
   if(!joininfo) return(MS_SUCCESS); /* already closed */
 
+  msMySQLJoinFreeBatch(join);
   mysql_close(joininfo->conn);
   if(joininfo->target) free(joininfo->target);
   free(joininfo);
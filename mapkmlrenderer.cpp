@@ -43,9 +43,58 @@
 
 #define  KML_MAXFEATURES_TODRAW 1000
 
+/* xmlOutputBuffer write callback appending to a msIOBuffer */
+static int kmlOutputBufferWrite(void *context, const char *buffer, int len)
+{
+  return msIO_bufferWrite(context, (void *) buffer, len);
+}
+
+/************************************************************************/
+/*                          kmlFormatCoordinate                         */
+/*                                                                      */
+/*      Same output as sprintf("%.8f"), without going through the      */
+/*      printf machinery for the values we usually get (degrees,       */
+/*      elevations). Values whose rounding is too close to call fall   */
+/*      back to sprintf().                                             */
+/************************************************************************/
+static int kmlFormatCoordinate(char *buf, double value)
+{
+  if (value > -1e4 && value < 1e4) {
+    double scaled = fabs(value) * 1e8;
+    double whole = floor(scaled);
+    double frac = scaled - whole;
+
+    if (fabs(frac - 0.5) > 1e-3) {
+      unsigned long long n = (unsigned long long) whole + (frac > 0.5 ? 1 : 0);
+      unsigned long long ip = n / 100000000ULL;
+      unsigned long fp = (unsigned long) (n % 100000000ULL);
+      char digits[24];
+      int numDigits = 0, len = 0;
+
+      if (signbit(value))
+        buf[len++] = '-';
+      do {
+        digits[numDigits++] = (char) ('0' + ip % 10);
+        ip /= 10;
+      } while (ip);
+      while (numDigits)
+        buf[len++] = digits[--numDigits];
+      buf[len++] = '.';
+      for (int i = 7; i >= 0; i--) {
+        buf[len + i] = (char) ('0' + fp % 10);
+        fp /= 10;
+      }
+      len += 8;
+      buf[len] = '\0';
+      return len;
+    }
+  }
+  return sprintf(buf, "%.8f", value);
+}
+
 KmlRenderer::KmlRenderer(int width, int height, outputFormatObj *format, colorObj* color/*=NULL*/)
   : Width(width), Height(height), MapCellsize(1.0), XmlDoc(NULL), LayerNode(NULL), GroundOverlayNode(NULL),
-    PlacemarkNode(NULL), GeomNode(NULL),
+    PlacemarkNode(NULL), GeomNode(NULL), DocOutput(NULL), FolderOutput(NULL),
     Items(NULL), NumItems(0), FirstLayer(MS_TRUE), map(NULL), currentLayer(NULL),
     mElevationFromAttribute( false ), mElevationAttributeIndex( -1 ), mCurrentElevationValue(0.0)
 
@@ -98,10 +147,26 @@ KmlRenderer::KmlRenderer(int width, int height, outputFormatObj *format, colorOb
 
   StyleHashTable = msCreateHashTable();
 
+  memset(&DocBuffer, 0, sizeof(DocBuffer));
+  memset(&FolderBuffer, 0, sizeof(FolderBuffer));
+  DocOutput = createOutputBuffer(&DocBuffer);
+  FolderOutput = createOutputBuffer(&FolderBuffer);
+  xmlOutputBufferWriteString(DocOutput, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                             "<kml xmlns=\"http://www.opengis.net/kml/2.2\">\n"
+                             "  <Document>\n");
 }
 
 KmlRenderer::~KmlRenderer()
 {
+  if (DocOutput)
+    xmlOutputBufferClose(DocOutput);
+  if (FolderOutput)
+    xmlOutputBufferClose(FolderOutput);
+  free(DocBuffer.data);
+  free(FolderBuffer.data);
+
+  if (LayerNode)
+    xmlFreeNode(LayerNode);
   if (XmlDoc)
     xmlFreeDoc(XmlDoc);
 
@@ -119,6 +184,59 @@ imageObj* KmlRenderer::createImage(int, int, outputFormatObj*, colorObj*)
   return NULL;
 }
 
+/************************************************************************/
+/*                          createOutputBuffer                          */
+/*                                                                      */
+/*      UTF-8 xmlOutputBuffer collecting serialized nodes in buffer.    */
+/************************************************************************/
+xmlOutputBufferPtr KmlRenderer::createOutputBuffer(msIOBuffer *buffer)
+{
+  return xmlOutputBufferCreateIO(kmlOutputBufferWrite, NULL, buffer,
+                                 xmlFindCharEncodingHandler("UTF-8"));
+}
+
+/************************************************************************/
+/*                            writeChildNodes                           */
+/*                                                                      */
+/*      Serialize the children of parentNode, indented as they would be */
+/*      at the given depth of the whole document, and free them.        */
+/************************************************************************/
+void KmlRenderer::writeChildNodes(xmlOutputBufferPtr output, xmlNodePtr parentNode, int level)
+{
+  while (parentNode && parentNode->children) {
+    xmlNodePtr node = parentNode->children;
+
+    xmlUnlinkNode(node);
+    for (int i=0; i<level; i++)
+      xmlOutputBufferWrite(output, 2, "  ");
+    xmlNodeDumpOutput(output, XmlDoc, node, level, 1, "UTF-8");
+    xmlOutputBufferWrite(output, 1, "\n");
+    xmlFreeNode(node);
+  }
+}
+
+/************************************************************************/
+/*                            finishDocument                            */
+/*                                                                      */
+/*      Complete the serialized document in DocBuffer.                  */
+/************************************************************************/
+int KmlRenderer::finishDocument()
+{
+  if (!DocOutput)
+    return DocBuffer.data ? MS_SUCCESS : MS_FAILURE;
+
+  writeChildNodes(DocOutput, DocNode, 2);
+  xmlOutputBufferWriteString(DocOutput, "  </Document>\n</kml>\n");
+
+  if (xmlOutputBufferClose(DocOutput) < 0 || DocBuffer.data == NULL) {
+    DocOutput = NULL;
+    msSetError(MS_MEMERR, "Failed to serialize the kml document", "KmlRenderer::finishDocument()");
+    return MS_FAILURE;
+  }
+  DocOutput = NULL;
+  return MS_SUCCESS;
+}
+
 int KmlRenderer::saveImage(imageObj *, FILE *fp, outputFormatObj *format)
 {
   /* -------------------------------------------------------------------- */
@@ -126,7 +244,7 @@ int KmlRenderer::saveImage(imageObj *, FILE *fp, outputFormatObj *format)
   /* -------------------------------------------------------------------- */
 
   int bufSize = 0;
-  xmlChar *buf = NULL;
+  unsigned char *buf = NULL;
   msIOContext *context = NULL;
   int chunkSize = 4096;
 #if defined(CPL_ZIP_API_OFFERED)
@@ -136,7 +254,10 @@ int KmlRenderer::saveImage(imageObj *, FILE *fp, outputFormatObj *format)
   if( msIO_needBinaryStdout() == MS_FAILURE )
     return MS_FAILURE;
 
-  xmlDocDumpFormatMemoryEnc(XmlDoc, &buf, &bufSize, "UTF-8", 1);
+  if (finishDocument() != MS_SUCCESS)
+    return MS_FAILURE;
+  buf = DocBuffer.data;
+  bufSize = DocBuffer.data_offset;
 
 #if defined(USE_OGR)
   if (format && format->driver && strcasecmp(format->driver, "kmz") == 0) {
@@ -145,7 +266,6 @@ int KmlRenderer::saveImage(imageObj *, FILE *fp, outputFormatObj *format)
 #else
     msSetError( MS_MISCERR, "kmz format support unavailable, perhaps you need to upgrade to GDAL/OGR 1.8?",
                 "KmlRenderer::saveImage()");
-    xmlFree(buf);
     return MS_FAILURE;
 #endif
   }
@@ -181,7 +301,6 @@ int KmlRenderer::saveImage(imageObj *, FILE *fp, outputFormatObj *format)
     }
     VSIFCloseL( fpZip );
     msFree( zip_filename);
-    xmlFree(buf);
     return(MS_SUCCESS);
   }
 #endif
@@ -202,8 +321,6 @@ int KmlRenderer::saveImage(imageObj *, FILE *fp, outputFormatObj *format)
       msIO_fwrite(buf+i, 1, size, fp);
   }
 
-  xmlFree(buf);
-
   return(MS_SUCCESS);
 }
 
@@ -437,7 +554,18 @@ int KmlRenderer::closeNewLayer(imageObj *img, layerObj *layer)
 {
   flushPlacemark();
 
-  xmlAddChild(DocNode, LayerNode);
+  /* styles first used by this layer, then the folder */
+  writeChildNodes(FolderOutput, LayerNode, 3);
+  writeChildNodes(DocOutput, DocNode, 2);
+  xmlOutputBufferWriteString(DocOutput, "    <Folder>\n");
+  xmlOutputBufferFlush(FolderOutput);
+  if (FolderBuffer.data_offset > 0)
+    xmlOutputBufferWrite(DocOutput, FolderBuffer.data_offset, (const char *) FolderBuffer.data);
+  FolderBuffer.data_offset = 0;
+  xmlOutputBufferWriteString(DocOutput, "    </Folder>\n");
+
+  xmlFreeNode(LayerNode);
+  LayerNode = NULL;
 
   if(Items) {
     msFreeCharArray(Items, NumItems);
@@ -669,26 +797,42 @@ void KmlRenderer::renderPolygon(imageObj*, shapeObj *p, colorObj *color)
 
 void KmlRenderer::addCoordsNode(xmlNodePtr parentNode, pointObj *pts, int numPts)
 {
-  char lineBuf[128];
+  /* a %.8f double is at most 327 characters */
+  char lineBuf[1024];
+  msIOBuffer coords;
+  int len;
 
-  xmlNodePtr coordsNode = xmlNewChild(parentNode, NULL, BAD_CAST "coordinates", NULL);
-  xmlNodeAddContent(coordsNode, BAD_CAST "\n");
+  memset(&coords, 0, sizeof(coords));
+  msIO_bufferWrite(&coords, (void *) "\n", 1);
 
+  /* the whole text is built before it becomes one node */
   for (int i=0; i<numPts; i++) {
+    lineBuf[0] = '\t';
+    len = 1;
+    len += kmlFormatCoordinate(lineBuf + len, pts[i].x);
+    lineBuf[len++] = ',';
+    len += kmlFormatCoordinate(lineBuf + len, pts[i].y);
     if( mElevationFromAttribute ) {
-      sprintf(lineBuf, "\t%.8f,%.8f,%.8f\n", pts[i].x, pts[i].y, mCurrentElevationValue);
+      lineBuf[len++] = ',';
+      len += kmlFormatCoordinate(lineBuf + len, mCurrentElevationValue);
     } else if (AltitudeMode == relativeToGround || AltitudeMode == absolute) {
 #ifdef USE_POINT_Z_M
-      sprintf(lineBuf, "\t%.8f,%.8f,%.8f\n", pts[i].x, pts[i].y, pts[i].z);
+      lineBuf[len++] = ',';
+      len += kmlFormatCoordinate(lineBuf + len, pts[i].z);
 #else
       msSetError(MS_MISCERR, "Z coordinates support not available  (mapserver not compiled with USE_POINT_Z_M option)", "KmlRenderer::addCoordsNode()");
 #endif
-    } else
-      sprintf(lineBuf, "\t%.8f,%.8f\n", pts[i].x, pts[i].y);
+    }
+    lineBuf[len++] = '\n';
 
-    xmlNodeAddContent(coordsNode, BAD_CAST lineBuf);
+    msIO_bufferWrite(&coords, lineBuf, len);
   }
-  xmlNodeAddContent(coordsNode, BAD_CAST "\t");
+  msIO_bufferWrite(&coords, (void *) "\t", 1);
+
+  xmlNodePtr coordsNode = xmlNewChild(parentNode, NULL, BAD_CAST "coordinates", NULL);
+  if (coords.data)
+    xmlNodeAddContentLen(coordsNode, BAD_CAST coords.data, coords.data_offset);
+  free(coords.data);
 }
 
 void KmlRenderer::renderGlyphs(imageObj *img, pointObj *labelpnt, char *text, double angle, colorObj *clr, colorObj *olcolor, int olwidth)
@@ -1184,6 +1328,12 @@ void KmlRenderer::flushPlacemark()
 
     if (GeomNode)
       xmlAddChild(PlacemarkNode, GeomNode);
+
+    /* the placemark is complete, write it out with what preceded it in the folder */
+    writeChildNodes(FolderOutput, LayerNode, 3);
+    PlacemarkNode = NULL;
+    GeomNode = NULL;
+    DescriptionNode = NULL;
   }
 }
 
@@ -67,6 +67,13 @@ protected:
   xmlNodePtr  GeomNode;
   xmlNodePtr  DescriptionNode;
 
+  // serialized output: nodes are written out and freed as soon as they are
+  // complete, only the placemark being rendered is kept as a tree
+  xmlOutputBufferPtr  DocOutput;      /*children of the Document node*/
+  msIOBuffer          DocBuffer;
+  xmlOutputBufferPtr  FolderOutput;   /*children of the current layer Folder*/
+  msIOBuffer          FolderBuffer;
+
   int         CurrentShapeIndex;
   int         CurrentDrawnShapeIndex;
   char            *CurrentShapeName;
@@ -120,6 +127,10 @@ protected:
 
   void addCoordsNode(xmlNodePtr parentNode, pointObj *pts, int numPts);
 
+  xmlOutputBufferPtr createOutputBuffer(msIOBuffer *buffer);
+  void writeChildNodes(xmlOutputBufferPtr output, xmlNodePtr parentNode, int level);
+  int finishDocument();
+
   void setupRenderingParams(hashTableObj *layerMetadata);
   void addAddRenderingSpecifications(xmlNodePtr node);
 
@@ -32,9 +32,12 @@
 */
 
 #include <float.h>
+#include <sys/stat.h>
 
 #include "mapserver.h"
 #include "fontcache.h"
+#include "mapthread.h"
+#include "uthash.h"
 
 
 
@@ -174,6 +177,234 @@ int msComputeTextPath(mapObj *map, textSymbolObj *ts) {
   return msLayoutTextSymbol(map,ts,tgret);
 }
  
+/*
+** Largest advance and glyph bounding box, in pixels, of the fonts a label may be
+** drawn with. Returns MS_FALSE if one of them can't be told.
+*/
+static int labelFontMaxExtents(mapObj *map, labelObj *label, double glyph_size, double *advance, double *width, double *height)
+{
+  char key[256];
+  const char *start = label->font, *end;
+  double px = glyph_size * 96.0 / 72.0;
+
+  *advance = *width = *height = 0;
+  do {
+    face_element *fc;
+    FT_Face face;
+    size_t len;
+
+    if(start) {
+      const char *prefix;
+      end = strchr(start, ',');
+      len = end ? (size_t)(end - start) : strlen(start);
+      prefix = memchr(start, ':', len);
+      if(prefix) { /* script prefixed fallback font, see get_face_for_run() */
+        len -= prefix + 1 - start;
+        start = prefix + 1;
+      }
+      if(len >= sizeof(key)) return MS_FALSE;
+      memcpy(key, start, len);
+      key[len] = 0;
+      fc = msGetFontFace(key, &map->fontset);
+      start = end ? end + 1 : NULL;
+    } else {
+      fc = msGetFontFace(NULL, &map->fontset);
+    }
+    if(!fc) return MS_FALSE;
+    face = fc->face;
+    if(!FT_IS_SCALABLE(face) || face->units_per_EM == 0) return MS_FALSE;
+
+    *advance = MS_MAX(*advance, face->max_advance_width * px / face->units_per_EM);
+    *width = MS_MAX(*width, (face->bbox.xMax - MS_MIN(face->bbox.xMin, 0)) * px / face->units_per_EM);
+    *height = MS_MAX(*height, (face->bbox.yMax - face->bbox.yMin) * px / face->units_per_EM);
+  } while(start);
+
+  return MS_TRUE;
+}
+
+/*
+** Cheap conservative test done before shaping: returns MS_FALSE if the text of ts
+** can't fit in the image (less the label cache gutter) whatever its position around
+** the label point, margin being the largest marker offset the text may be pushed
+** by. The text is taken as the largest glyph advance of its fonts times its
+** length, which rejects the labels of features far outside of the image, such
+** as those fetched for the buffer of a metatile.
+*/
+int msTextSymbolMayBeInImage(mapObj *map, labelCacheMemberObj *cachePtr, textSymbolObj *ts, double margin)
+{
+  labelObj *label = ts->label;
+  double glyph_size, advance, glyph_width, glyph_height, w, h, dx, dy;
+  int nchars = 0, nlines = 1, gutter = map->labelcache.gutter;
+  const char *c;
+
+  if(cachePtr->textsymbols[0]->label->partials || label->force == MS_ON) return MS_TRUE;
+
+  for(c=ts->annotext; *c; c++) {
+    /* count bytes for text that still has to go through iconv */
+    if(label->encoding || (*c & 0xC0) != 0x80) nchars++;
+    if(*c == '\n') nlines++;
+  }
+  if(label->wrap || label->maxlength > 0) nlines = MS_MAX(nlines, nchars);
+
+  /* as in msComputeTextPath() */
+  glyph_size = label->size * ts->scalefactor;
+  glyph_size = MS_MAX(glyph_size, label->minsize * ts->resolutionfactor);
+  glyph_size = MS_NINT(MS_MIN(glyph_size, label->maxsize * ts->resolutionfactor));
+
+  if(!labelFontMaxExtents(map, label, glyph_size, &advance, &glyph_width, &glyph_height)) return MS_TRUE;
+
+  w = nchars * advance + glyph_width;
+  h = nlines * ceil(glyph_size * 1.33) + glyph_height;
+  if(ts->rotation != 0) w = h = w + h; /* bounds the distance of any point of the text to its anchor */
+
+  dx = w + margin + (MS_ABS(label->offsetx) + label->buffer + label->outlinewidth) * ts->scalefactor;
+  dy = h + margin + (MS_ABS(label->offsety) + label->buffer + label->outlinewidth) * ts->scalefactor;
+
+  if(cachePtr->point.x + dx < gutter || cachePtr->point.x - dx >= map->width - gutter ||
+      cachePtr->point.y + dy < gutter || cachePtr->point.y - dy >= map->height - gutter)
+    return MS_FALSE;
+  return MS_TRUE;
+}
+
+/*
+** Text paths of the label cache computed ahead of placement, on up to numthreads
+** threads (see msComputeLabelCacheTextPaths()).
+*/
+#define MS_LABEL_THREADS_MIN_SYMBOLS 64
+
+typedef struct {
+  mapObj *map;
+  textSymbolObj **textsymbols;
+  int numtextsymbols;
+  void *threadid; /* of the thread that ran the task */
+  void *mainthreadid;
+} labelTextPathTaskObj;
+
+static void msComputeTextPathsTask(void *data)
+{
+  labelTextPathTaskObj *task = (labelTextPathTaskObj *) data;
+  int i;
+
+  task->threadid = msGetThreadId();
+  for(i=0; i<task->numtextsymbols; i++) {
+    textSymbolObj *ts = task->textsymbols[i];
+    if(msComputeTextPath(task->map, ts) != MS_SUCCESS) {
+      /* left to msDrawLabelCache(), which will report the error in the right thread */
+      freeTextPath(ts->textpath);
+      free(ts->textpath);
+      ts->textpath = NULL;
+    }
+  }
+  if(task->threadid != task->mainthreadid)
+    msResetErrorList();
+}
+
+/*
+** The glyphs of a text path shaped in another thread point into that thread's
+** font cache, look them up again in ours for rendering.
+*/
+static int rebaseTextPathGlyphs(mapObj *map, textPathObj *tp)
+{
+  int i;
+  face_element *from = NULL, *to = NULL;
+
+  for(i=0; i<tp->numglyphs; i++) {
+    glyphObj *g = &tp->glyphs[i];
+    if(!g->face) continue;
+    if(g->face != from) {
+      from = g->face;
+      to = msGetFontFace(from->font, &map->fontset);
+      if(!to) return MS_FAILURE;
+    }
+    g->face = to;
+    g->glyph = msGetGlyphByIndex(to, g->glyph->key.size, g->glyph->key.codepoint);
+    if(!g->glyph) return MS_FAILURE;
+  }
+  return MS_SUCCESS;
+}
+
+/*
+** Shapes the text of the label cache members that don't have a text path yet,
+** before collision testing, split over numthreads threads. This trades the
+** shaping that msDrawLabelCache() skips for labels that are discarded early
+** (mindistance, colliding label point) for running the rest in parallel, so it
+** is only done for caches with enough labels. Labels left without a text path
+** are handled as before by msDrawLabelCache().
+*/
+void msComputeLabelCacheTextPaths(mapObj *map, int numthreads)
+{
+  labelTextPathTaskObj *tasks;
+  textSymbolObj **textsymbols;
+  void **taskptrs;
+  int p, l, t, numtextsymbols = 0, alloctextsymbols = 0, chunk;
+
+  if(numthreads < 2) return;
+
+  for(p=0; p<MS_MAX_LABEL_PRIORITY; p++)
+    for(l=0; l<map->labelcache.slots[p].numlabels; l++)
+      alloctextsymbols += map->labelcache.slots[p].labels[l].numtextsymbols;
+  if(alloctextsymbols < MS_LABEL_THREADS_MIN_SYMBOLS) return;
+
+  textsymbols = (textSymbolObj **) msSmallMalloc(alloctextsymbols * sizeof(textSymbolObj*));
+  for(p=MS_MAX_LABEL_PRIORITY-1; p>=0; p--) {
+    labelCacheSlotObj *cacheslot = &(map->labelcache.slots[p]);
+    for(l=cacheslot->numlabels-1; l>=0; l--) {
+      labelCacheMemberObj *cachePtr = &(cacheslot->labels[l]);
+      double margin = 0;
+      if(cachePtr->markerid != -1) {
+        rectObj *mb = &(cacheslot->markers[cachePtr->markerid].bounds);
+        margin = MS_MAX(mb->maxx - mb->minx, mb->maxy - mb->miny);
+      }
+      for(t=0; t<cachePtr->numtextsymbols; t++) {
+        textSymbolObj *ts = cachePtr->textsymbols[t];
+        if(!ts->annotext || !*ts->annotext || ts->textpath)
+          continue;
+        /* label styles may push the text further, leave those to msDrawLabelCache() */
+        if(!ts->label->numstyles && !msTextSymbolMayBeInImage(map, cachePtr, ts, margin))
+          continue; /* will be rejected without being shaped */
+        textsymbols[numtextsymbols++] = ts;
+      }
+    }
+  }
+  if(numtextsymbols < MS_LABEL_THREADS_MIN_SYMBOLS) {
+    free(textsymbols);
+    return;
+  }
+
+  /* a few tasks per thread, so that threads finishing early pick up more work */
+  numthreads = MS_MIN(numthreads, numtextsymbols / (MS_LABEL_THREADS_MIN_SYMBOLS / 4));
+  chunk = (numtextsymbols + numthreads * 4 - 1) / (numthreads * 4);
+  tasks = (labelTextPathTaskObj *) msSmallCalloc(numthreads * 4, sizeof(labelTextPathTaskObj));
+  taskptrs = (void **) msSmallMalloc(numthreads * 4 * sizeof(void*));
+  for(t=0, l=0; l<numtextsymbols; t++, l+=chunk) {
+    tasks[t].map = map;
+    tasks[t].textsymbols = textsymbols + l;
+    tasks[t].numtextsymbols = MS_MIN(chunk, numtextsymbols - l);
+    tasks[t].mainthreadid = msGetThreadId();
+    taskptrs[t] = &tasks[t];
+  }
+
+  if(map->debug >= MS_DEBUGLEVEL_V)
+    msDebug("msComputeLabelCacheTextPaths(): shaping %d labels in %d threads.\n", numtextsymbols, numthreads);
+  msThreadPoolRun(msComputeTextPathsTask, taskptrs, t, numthreads);
+
+  for(p=0; p<t; p++) {
+    if(tasks[p].threadid == tasks[p].mainthreadid) continue;
+    for(l=0; l<tasks[p].numtextsymbols; l++) {
+      textSymbolObj *ts = tasks[p].textsymbols[l];
+      if(ts->textpath && rebaseTextPathGlyphs(map, ts->textpath) != MS_SUCCESS) {
+        freeTextPath(ts->textpath);
+        free(ts->textpath);
+        ts->textpath = NULL;
+      }
+    }
+  }
+
+  free(tasks);
+  free(taskptrs);
+  free(textsymbols);
+}
+
 void initTextSymbol(textSymbolObj *ts) {
   memset(ts,0,sizeof(*ts));
 }
@@ -273,6 +504,37 @@ void msPopulateTextSymbolForLabelAndString(textSymbolObj *ts, labelObj *l, char
   ts->rotation = l->angle * MS_DEG_TO_RAD;
 }
 
+/* the member arrays of a slot grow geometrically, they are kept between draws */
+static int growLabelCacheSlotLabels(labelCacheSlotObj *cacheslot) {
+  int newsize = cacheslot->cachesize ? cacheslot->cachesize * 2 : MS_LABELCACHEINITSIZE;
+  labelCacheMemberObj *labels;
+
+  if(msIO_checkRequestMemory("msAddLabel()") != MS_SUCCESS)
+    return MS_FAILURE;
+  labels = (labelCacheMemberObj *) realloc(cacheslot->labels, sizeof(labelCacheMemberObj)*newsize);
+  MS_CHECK_ALLOC(labels, sizeof(labelCacheMemberObj)*newsize, MS_FAILURE);
+  msIO_requestMemoryAlloc(MS_REQUEST_MEMORY_LABELCACHE, sizeof(labelCacheMemberObj)*(newsize - cacheslot->cachesize));
+  cacheslot->labels = labels;
+  cacheslot->cachesize = newsize;
+  return MS_SUCCESS;
+}
+
+static int growLabelCacheSlotMarkers(labelCacheSlotObj *cacheslot) {
+  int newsize = cacheslot->markercachesize ? cacheslot->markercachesize * 2 : MS_LABELCACHEINITSIZE;
+  markerCacheMemberObj *markers;
+
+  if(msIO_checkRequestMemory("msAddLabel()") != MS_SUCCESS)
+    return MS_FAILURE;
+  markers = (markerCacheMemberObj *) realloc(cacheslot->markers, sizeof(markerCacheMemberObj)*newsize);
+  MS_CHECK_ALLOC(markers, sizeof(markerCacheMemberObj)*newsize, MS_FAILURE);
+  msIO_requestMemoryAlloc(MS_REQUEST_MEMORY_LABELCACHE, sizeof(markerCacheMemberObj)*(newsize - cacheslot->markercachesize));
+  cacheslot->markers = markers;
+  cacheslot->markercachesize = newsize;
+  return MS_SUCCESS;
+}
+
+#define MS_LABELGROUP_LOCALSIZE 16
+
 int msAddLabelGroup(mapObj *map, imageObj *image, layerObj* layer, int classindex, shapeObj *shape, pointObj *point, double featuresize)
 {
   int l,s, priority;
@@ -282,6 +544,7 @@ int msAddLabelGroup(mapObj *map, imageObj *image, layerObj* layer, int classinde
   layerObj *layerPtr=NULL;
   classObj *classPtr=NULL;
   int numtextsymbols = 0;
+  textSymbolObj *localtextsymbols[MS_LABELGROUP_LOCALSIZE];
   textSymbolObj **textsymbols, *ts;
   int layerindex = layer->index;
 
@@ -324,7 +587,11 @@ int msAddLabelGroup(mapObj *map, imageObj *image, layerObj* layer, int classinde
     }
   }
   
-  textsymbols = msSmallMalloc(classPtr->numlabels * sizeof(textSymbolObj*));
+  /* collected locally, the array kept by the cache member is allocated in the label cache arena */
+  if(classPtr->numlabels <= MS_LABELGROUP_LOCALSIZE)
+    textsymbols = localtextsymbols;
+  else
+    textsymbols = msSmallMalloc(classPtr->numlabels * sizeof(textSymbolObj*));
   
   for(l=0; l<classPtr->numlabels; l++) {
     labelObj *lbl = classPtr->labels[l];
@@ -361,7 +628,8 @@ int msAddLabelGroup(mapObj *map, imageObj *image, layerObj* layer, int classinde
   }
   
   if(numtextsymbols == 0) {
-    free(textsymbols);
+    if(textsymbols != localtextsymbols)
+      free(textsymbols);
     return MS_SUCCESS;
   }
   
@@ -375,9 +643,8 @@ int msAddLabelGroup(mapObj *map, imageObj *image, layerObj* layer, int classinde
   cacheslot = &(map->labelcache.slots[priority-1]);
 
   if(cacheslot->numlabels == cacheslot->cachesize) { /* just add it to the end */
-    cacheslot->labels = (labelCacheMemberObj *) realloc(cacheslot->labels, sizeof(labelCacheMemberObj)*(cacheslot->cachesize+MS_LABELCACHEINCREMENT));
-    MS_CHECK_ALLOC(cacheslot->labels, sizeof(labelCacheMemberObj)*(cacheslot->cachesize+MS_LABELCACHEINCREMENT), MS_FAILURE);
-    cacheslot->cachesize += MS_LABELCACHEINCREMENT;
+    if(UNLIKELY(MS_FAILURE == growLabelCacheSlotLabels(cacheslot)))
+      return MS_FAILURE;
   }
 
   cachePtr = &(cacheslot->labels[cacheslot->numlabels]);
@@ -391,6 +658,9 @@ int msAddLabelGroup(mapObj *map, imageObj *image, layerObj* layer, int classinde
   cachePtr->leaderline = NULL;
   cachePtr->leaderbbox = NULL;
 
+  cachePtr->shapeindex = shape ? shape->index : -1;
+  cachePtr->tileindex = shape ? shape->tileindex : -1;
+
   cachePtr->markerid = -1;
 
   cachePtr->status = MS_FALSE;
@@ -404,9 +674,8 @@ int msAddLabelGroup(mapObj *map, imageObj *image, layerObj* layer, int classinde
       return(MS_FAILURE);
 
     if(cacheslot->nummarkers == cacheslot->markercachesize) { /* just add it to the end */
-      cacheslot->markers = (markerCacheMemberObj *) realloc(cacheslot->markers, sizeof(markerCacheMemberObj)*(cacheslot->cachesize+MS_LABELCACHEINCREMENT));
-      MS_CHECK_ALLOC(cacheslot->markers, sizeof(markerCacheMemberObj)*(cacheslot->cachesize+MS_LABELCACHEINCREMENT), MS_FAILURE);
-      cacheslot->markercachesize+=MS_LABELCACHEINCREMENT;
+      if(UNLIKELY(MS_FAILURE == growLabelCacheSlotMarkers(cacheslot)))
+        return MS_FAILURE;
     }
 
     cacheslot->markers[cacheslot->nummarkers].bounds.minx = (point->x - .5 * w);
@@ -418,8 +687,11 @@ int msAddLabelGroup(mapObj *map, imageObj *image, layerObj* layer, int classinde
     cachePtr->markerid = cacheslot->nummarkers;
     cacheslot->nummarkers++;
   }
-  cachePtr->textsymbols = textsymbols;
+  cachePtr->textsymbols = msLabelCacheAlloc(&map->labelcache, numtextsymbols * sizeof(textSymbolObj*));
+  memcpy(cachePtr->textsymbols, textsymbols, numtextsymbols * sizeof(textSymbolObj*));
   cachePtr->numtextsymbols = numtextsymbols;
+  if(textsymbols != localtextsymbols)
+    free(textsymbols);
 
   cacheslot->numlabels++;
 
@@ -558,9 +830,8 @@ int msAddLabel(mapObj *map, imageObj *image, labelObj *label, int layerindex, in
   cacheslot = &(map->labelcache.slots[label->priority-1]);
 
   if(cacheslot->numlabels == cacheslot->cachesize) { /* just add it to the end */
-    cacheslot->labels = (labelCacheMemberObj *) realloc(cacheslot->labels, sizeof(labelCacheMemberObj)*(cacheslot->cachesize+MS_LABELCACHEINCREMENT));
-    MS_CHECK_ALLOC(cacheslot->labels, sizeof(labelCacheMemberObj)*(cacheslot->cachesize+MS_LABELCACHEINCREMENT), MS_FAILURE);
-    cacheslot->cachesize += MS_LABELCACHEINCREMENT;
+    if(UNLIKELY(MS_FAILURE == growLabelCacheSlotLabels(cacheslot)))
+      return MS_FAILURE;
   }
 
   cachePtr = &(cacheslot->labels[cacheslot->numlabels]);
@@ -578,6 +849,9 @@ int msAddLabel(mapObj *map, imageObj *image, labelObj *label, int layerindex, in
   cachePtr->leaderline = NULL;
   cachePtr->leaderbbox = NULL;
 
+  cachePtr->shapeindex = shape ? shape->index : -1;
+  cachePtr->tileindex = shape ? shape->tileindex : -1;
+
   /* Store the label point or the label path (Bug #1620) */
   if ( point ) {
     cachePtr->point = *point; /* the actual label point */
@@ -589,7 +863,7 @@ int msAddLabel(mapObj *map, imageObj *image, labelObj *label, int layerindex, in
 
   /* copy the label */
   cachePtr->numtextsymbols = 1;
-  cachePtr->textsymbols = (textSymbolObj **) msSmallMalloc(sizeof(textSymbolObj*));
+  cachePtr->textsymbols = (textSymbolObj **) msLabelCacheAlloc(&map->labelcache, sizeof(textSymbolObj*));
   cachePtr->textsymbols[0] = ts;
   cachePtr->markerid = -1;
 
@@ -599,9 +873,8 @@ int msAddLabel(mapObj *map, imageObj *image, labelObj *label, int layerindex, in
     double w, h;
 
     if(cacheslot->nummarkers == cacheslot->markercachesize) { /* just add it to the end */
-      cacheslot->markers = (markerCacheMemberObj *) realloc(cacheslot->markers, sizeof(markerCacheMemberObj)*(cacheslot->cachesize+MS_LABELCACHEINCREMENT));
-      MS_CHECK_ALLOC(cacheslot->markers, sizeof(markerCacheMemberObj)*(cacheslot->cachesize+MS_LABELCACHEINCREMENT), MS_FAILURE);
-      cacheslot->markercachesize+=MS_LABELCACHEINCREMENT;
+      if(UNLIKELY(MS_FAILURE == growLabelCacheSlotMarkers(cacheslot)))
+        return MS_FAILURE;
     }
 
     i = cacheslot->nummarkers;
@@ -660,7 +933,174 @@ static int labelInImage(int width, int height, lineObj *lpoly, rectObj *bounds,
   return(MS_TRUE);
 }
 
+/*
+** Rendered labels and markers are indexed in a uniform grid of
+** MS_LABELCACHE_GRID_CELLSIZE pixel cells over the image, each item being
+** referenced by all the cells its bounds touch (bounds outside of the image
+** are clamped to the border cells). A query only visits the cells of the
+** tested bounds, and an item found in several of them is only tested in the
+** cell holding the lower corner of its intersection with the query.
+*/
+#define MS_LABELCACHE_GRID_CELLSIZE 64
+
+static int labelCacheGridCell(double v, int numcells)
+{
+  if(!(v >= 0)) return 0;
+  v /= MS_LABELCACHE_GRID_CELLSIZE;
+  if(v >= numcells) return numcells-1;
+  return (int)v;
+}
+
+static labelCacheGridObj* getLabelCacheGrid(mapObj *map)
+{
+  labelCacheGridObj *grid = map->labelcache.grid;
+  if(!grid) {
+    grid = msSmallCalloc(1, sizeof(labelCacheGridObj));
+    grid->width = MS_MAX(1, (map->width + MS_LABELCACHE_GRID_CELLSIZE - 1) / MS_LABELCACHE_GRID_CELLSIZE);
+    grid->height = MS_MAX(1, (map->height + MS_LABELCACHE_GRID_CELLSIZE - 1) / MS_LABELCACHE_GRID_CELLSIZE);
+    grid->members = msSmallCalloc(grid->width * grid->height, sizeof(labelCacheGridCellObj));
+    grid->markers = msSmallCalloc(grid->width * grid->height, sizeof(labelCacheGridCellObj));
+    map->labelcache.grid = grid;
+  }
+  return grid;
+}
+
+static void labelCacheGridInsert(labelCacheGridObj *grid, labelCacheGridCellObj *cells, const rectObj *bounds, int item)
+{
+  int x, y;
+  int x0 = labelCacheGridCell(bounds->minx, grid->width), x1 = labelCacheGridCell(bounds->maxx, grid->width);
+  int y0 = labelCacheGridCell(bounds->miny, grid->height), y1 = labelCacheGridCell(bounds->maxy, grid->height);
+
+  for(y=y0; y<=y1; y++) {
+    for(x=x0; x<=x1; x++) {
+      labelCacheGridCellObj *cell = &cells[y * grid->width + x];
+      if(cell->numitems == cell->maxitems) {
+        cell->maxitems = cell->maxitems ? cell->maxitems * 2 : 8;
+        cell->items = msSmallRealloc(cell->items, cell->maxitems * sizeof(int));
+      }
+      cell->items[cell->numitems++] = item;
+    }
+  }
+}
+
+/* is cell x,y the one where an item with the given bounds is tested against query */
+static int labelCacheGridIsReference(labelCacheGridObj *grid, const rectObj *bounds, const rectObj *query, int x, int y)
+{
+  return labelCacheGridCell(MS_MAX(bounds->minx, query->minx), grid->width) == x &&
+         labelCacheGridCell(MS_MAX(bounds->miny, query->miny), grid->height) == y;
+}
+
+/* bounds of everything a rendered label can collide with: its text, styles and leader */
+static void renderedLabelBounds(labelCacheMemberObj *cachePtr, rectObj *bounds)
+{
+  *bounds = cachePtr->bbox;
+  if(cachePtr->leaderbbox)
+    msMergeRect(bounds, cachePtr->leaderbbox);
+}
+
+/* markers are added to the cache while layers are drawn, index the ones added since the last test */
+static labelCacheGridObj* indexLabelCacheMarkers(mapObj *map)
+{
+  labelCacheGridObj *grid = getLabelCacheGrid(map);
+  int p;
+
+  for(p=0; p<MS_MAX_LABEL_PRIORITY; p++) {
+    labelCacheSlotObj *markerslot = &(map->labelcache.slots[p]);
+    for(; grid->nummarkers[p] < markerslot->nummarkers; grid->nummarkers[p]++) {
+      labelCacheGridInsert(grid, grid->markers, &markerslot->markers[grid->nummarkers[p]].bounds,
+                           grid->nummarkers[p] * MS_MAX_LABEL_PRIORITY + p);
+    }
+  }
+  return grid;
+}
+
+void msFreeLabelCacheGrid(labelCacheObj *cache)
+{
+  labelCacheGridObj *grid = cache->grid;
+  int i;
+
+  if(!grid) return;
+  for(i=0; i<grid->width * grid->height; i++) {
+    free(grid->members[i].items);
+    free(grid->markers[i].items);
+  }
+  free(grid->members);
+  free(grid->markers);
+  free(grid->stamps);
+  free(grid);
+  cache->grid = NULL;
+}
+
+#define MS_LABELCACHE_ARENA_CHUNKSIZE 65536
+#define MS_LABELCACHE_ARENA_ALIGN 16
+#define MS_LABELCACHE_ARENA_ROUND(n) (((n) + MS_LABELCACHE_ARENA_ALIGN - 1) & ~((size_t)MS_LABELCACHE_ARENA_ALIGN - 1))
+#define MS_LABELCACHE_ARENA_DATA(chunk) ((char*)(chunk) + MS_LABELCACHE_ARENA_ROUND(sizeof(labelCacheArenaChunkObj)))
+
+static labelCacheArenaChunkObj *newLabelCacheArenaChunk(size_t size) {
+  labelCacheArenaChunkObj *chunk = msSmallMalloc(MS_LABELCACHE_ARENA_ROUND(sizeof(labelCacheArenaChunkObj)) + size);
+  chunk->next = NULL;
+  chunk->size = size;
+  chunk->used = 0;
+  msIO_requestMemoryAlloc(MS_REQUEST_MEMORY_LABELCACHE, size);
+  return chunk;
+}
+
+/*
+** Memory for the label cache members that lives until the cache is reset. It
+** is never freed individually: msResetLabelCacheArena() (from msInitLabelCache)
+** rewinds it for the next draw and msFreeLabelCache() releases it.
+*/
+void *msLabelCacheAlloc(labelCacheObj *cache, size_t size) {
+  labelCacheArenaChunkObj *chunk = cache->arena;
+  void *ptr;
+
+  size = MS_LABELCACHE_ARENA_ROUND(size);
+  if(!chunk || chunk->used + size > chunk->size) {
+    size_t chunksize = chunk ? chunk->size * 2 : MS_LABELCACHE_ARENA_CHUNKSIZE;
+    chunk = newLabelCacheArenaChunk(MS_MAX(chunksize, size));
+    chunk->next = cache->arena;
+    cache->arena = chunk;
+  }
+  ptr = MS_LABELCACHE_ARENA_DATA(chunk) + chunk->used;
+  chunk->used += size;
+  return ptr;
+}
+
+void msResetLabelCacheArena(labelCacheObj *cache) {
+  labelCacheArenaChunkObj *chunk = cache->arena;
+  size_t total = 0;
+
+  if(!chunk) return;
+  if(!chunk->next) {
+    chunk->used = 0;
+    return;
+  }
+  /* merge the chunks so that a similar draw fits in a single one */
+  while(chunk) {
+    labelCacheArenaChunkObj *next = chunk->next;
+    total += chunk->size;
+    msIO_requestMemoryFree(MS_REQUEST_MEMORY_LABELCACHE, chunk->size);
+    free(chunk);
+    chunk = next;
+  }
+  cache->arena = newLabelCacheArenaChunk(total);
+}
+
+void msFreeLabelCacheArena(labelCacheObj *cache) {
+  labelCacheArenaChunkObj *chunk = cache->arena;
+
+  while(chunk) {
+    labelCacheArenaChunkObj *next = chunk->next;
+    msIO_requestMemoryFree(MS_REQUEST_MEMORY_LABELCACHE, chunk->size);
+    free(chunk);
+    chunk = next;
+  }
+  cache->arena = NULL;
+}
+
 void insertRenderedLabelMember(mapObj *map, labelCacheMemberObj *cachePtr) {
+  labelCacheGridObj *grid;
+  rectObj bounds;
   if(map->labelcache.num_rendered_members == map->labelcache.num_allocated_rendered_members) {
     if(map->labelcache.num_rendered_members == 0) {
       map->labelcache.num_allocated_rendered_members = 50;
@@ -670,6 +1110,9 @@ void insertRenderedLabelMember(mapObj *map, labelCacheMemberObj *cachePtr) {
     map->labelcache.rendered_text_symbols = msSmallRealloc(map->labelcache.rendered_text_symbols,
             map->labelcache.num_allocated_rendered_members * sizeof(labelCacheMemberObj*));
   }
+  grid = getLabelCacheGrid(map);
+  renderedLabelBounds(cachePtr, &bounds);
+  labelCacheGridInsert(grid, grid->members, &bounds, map->labelcache.num_rendered_members);
   map->labelcache.rendered_text_symbols[map->labelcache.num_rendered_members++] = cachePtr;
 }
 
@@ -713,46 +1156,232 @@ static inline int testSegmentLabelBBoxIntersection(const rectObj *leaderbbox, co
   return MS_TRUE;
 }
 
+/* does the leader segment lp1-lp2 cross the text, labelpnt styles or leader of a rendered label */
+static int leaderCollidesWithLabel(const rectObj *leaderbbox, pointObj *lp1, pointObj *lp2, labelCacheMemberObj *curCachePtr) {
+  if(msRectOverlap(leaderbbox, &(curCachePtr->bbox))) {
+  /* leaderbbox interesects with the curCachePtr's global bbox */
+    int t;
+    for(t=0; t<curCachePtr->numtextsymbols; t++) {
+      int s;
+      textSymbolObj *ts = curCachePtr->textsymbols[t];
+      /* check for intersect with textpath */
+      if(ts->textpath && testSegmentLabelBBoxIntersection(leaderbbox, lp1, lp2, &ts->textpath->bounds) == MS_FALSE) {
+        return MS_TRUE;
+      }
+      /* check for intersect with label's labelpnt styles */
+      if(ts->style_bounds) {
+        for(s=0; s<ts->label->numstyles; s++) {
+          if(ts->label->styles[s]->_geomtransform.type == MS_GEOMTRANSFORM_LABELPOINT) {
+            if(testSegmentLabelBBoxIntersection(leaderbbox, lp1,lp2, ts->style_bounds[s]) == MS_FALSE) {
+              return MS_TRUE;
+            }
+          }
+        }
+      }
+    }
+    if(curCachePtr->leaderbbox) {
+      if(msIntersectSegments(lp1,lp2,&(curCachePtr->leaderline->point[0]), &(curCachePtr->leaderline->point[1])) ==  MS_TRUE) {
+        return MS_TRUE;
+      }
+    }
+  }
+  return MS_FALSE;
+}
+
+/*
+** A leader can only collide with a label by crossing it, so when the segment
+** lies inside the grid only the cells it passes through are visited, band of
+** cell rows by band, instead of all the cells under its bounding box. Labels
+** referenced by several of these cells are stamped to be tested only once.
+*/
+static int testLeaderAlongGrid(mapObj *map, labelCacheGridObj *grid, const rectObj *leaderbbox, pointObj *lp1, pointObj *lp2) {
+  int x, y, x0, x1, y0, y1, i;
+  double dx = lp2->x - lp1->x, dy = lp2->y - lp1->y;
+
+  if(grid->numstamps < map->labelcache.num_rendered_members) {
+    grid->stamps = msSmallRealloc(grid->stamps, map->labelcache.num_allocated_rendered_members * sizeof(unsigned int));
+    memset(grid->stamps + grid->numstamps, 0, (map->labelcache.num_allocated_rendered_members - grid->numstamps) * sizeof(unsigned int));
+    grid->numstamps = map->labelcache.num_allocated_rendered_members;
+  }
+  if(++grid->stamp == 0) { /* wrapped around */
+    memset(grid->stamps, 0, grid->numstamps * sizeof(unsigned int));
+    grid->stamp = 1;
+  }
+
+  y0 = labelCacheGridCell(leaderbbox->miny, grid->height);
+  y1 = labelCacheGridCell(leaderbbox->maxy, grid->height);
+  for(y=y0; y<=y1; y++) {
+    /* horizontal extent of the part of the segment within this row of cells */
+    double ya = MS_MAX(leaderbbox->miny, y * MS_LABELCACHE_GRID_CELLSIZE);
+    double yb = MS_MIN(leaderbbox->maxy, (y+1) * MS_LABELCACHE_GRID_CELLSIZE);
+    double xa = leaderbbox->minx, xb = leaderbbox->maxx;
+    if(dy != 0) {
+      xa = lp1->x + (ya - lp1->y) * dx / dy;
+      xb = lp1->x + (yb - lp1->y) * dx / dy;
+    }
+    x0 = labelCacheGridCell(MS_MIN(xa,xb) - 1e-6, grid->width);
+    x1 = labelCacheGridCell(MS_MAX(xa,xb) + 1e-6, grid->width);
+    for(x=x0; x<=x1; x++) {
+      labelCacheGridCellObj *cell = &grid->members[y * grid->width + x];
+      for(i=0; i<cell->numitems; i++) {
+        if(grid->stamps[cell->items[i]] == grid->stamp) continue;
+        grid->stamps[cell->items[i]] = grid->stamp;
+        if(leaderCollidesWithLabel(leaderbbox, lp1, lp2, map->labelcache.rendered_text_symbols[cell->items[i]]))
+          return MS_FALSE;
+      }
+    }
+  }
+  return MS_TRUE;
+}
+
 int msTestLabelCacheLeaderCollision(mapObj *map, pointObj *lp1, pointObj *lp2) {
-  int p;
+  int x, y, x0, y0, x1, y1, i;
   rectObj leaderbbox;
+  labelCacheGridObj *grid = getLabelCacheGrid(map);
   leaderbbox.minx = MS_MIN(lp1->x,lp2->x);
   leaderbbox.maxx = MS_MAX(lp1->x,lp2->x);
   leaderbbox.miny = MS_MIN(lp1->y,lp2->y);
   leaderbbox.maxy = MS_MAX(lp1->y,lp2->y);
-  for(p=0; p<map->labelcache.num_rendered_members; p++) {
-    labelCacheMemberObj *curCachePtr= map->labelcache.rendered_text_symbols[p];
-    if(msRectOverlap(&leaderbbox, &(curCachePtr->bbox))) {
-    /* leaderbbox interesects with the curCachePtr's global bbox */
-      int t;
-      for(t=0; t<curCachePtr->numtextsymbols; t++) {
-        int s;
-        textSymbolObj *ts = curCachePtr->textsymbols[t];
-        /* check for intersect with textpath */
-        if(ts->textpath && testSegmentLabelBBoxIntersection(&leaderbbox, lp1, lp2, &ts->textpath->bounds) == MS_FALSE) {
-          return MS_FALSE;
-        }
-        /* check for intersect with label's labelpnt styles */
-        if(ts->style_bounds) {
-          for(s=0; s<ts->label->numstyles; s++) {
-            if(ts->label->styles[s]->_geomtransform.type == MS_GEOMTRANSFORM_LABELPOINT) {
-              if(testSegmentLabelBBoxIntersection(&leaderbbox, lp1,lp2, ts->style_bounds[s]) == MS_FALSE) {
-                return MS_FALSE;
-              }
-            }
-          }
-        }
-      }
-      if(curCachePtr->leaderbbox) {
-        if(msIntersectSegments(lp1,lp2,&(curCachePtr->leaderline->point[0]), &(curCachePtr->leaderline->point[1])) ==  MS_TRUE) {
+
+  if(leaderbbox.minx >= 0 && leaderbbox.miny >= 0 &&
+      leaderbbox.maxx < grid->width * MS_LABELCACHE_GRID_CELLSIZE &&
+      leaderbbox.maxy < grid->height * MS_LABELCACHE_GRID_CELLSIZE) {
+    return testLeaderAlongGrid(map, grid, &leaderbbox, lp1, lp2);
+  }
+
+  /* parts outside of the grid are clamped to its border cells, check all cells under the bounds */
+  x0 = labelCacheGridCell(leaderbbox.minx, grid->width);
+  x1 = labelCacheGridCell(leaderbbox.maxx, grid->width);
+  y0 = labelCacheGridCell(leaderbbox.miny, grid->height);
+  y1 = labelCacheGridCell(leaderbbox.maxy, grid->height);
+  for(y=y0; y<=y1; y++) {
+    for(x=x0; x<=x1; x++) {
+      labelCacheGridCellObj *cell = &grid->members[y * grid->width + x];
+      for(i=0; i<cell->numitems; i++) {
+        labelCacheMemberObj *curCachePtr= map->labelcache.rendered_text_symbols[cell->items[i]];
+        rectObj bounds;
+        renderedLabelBounds(curCachePtr, &bounds);
+        if(!labelCacheGridIsReference(grid, &bounds, &leaderbbox, x, y))
+          continue; /* tested in another cell */
+        if(leaderCollidesWithLabel(&leaderbbox, lp1, lp2, curCachePtr))
           return MS_FALSE;
-        }
       }
     }
   }
   return MS_TRUE;
 }
 
+/************************************************************************/
+/*                        Label placement cache                         */
+/*                                                                      */
+/*      Remembers the POSITION chosen for AUTO positioned labels so     */
+/*      that the neighbouring metatiles of a tiled map resolve the      */
+/*      labels they share to the same spot. Entries are keyed on the    */
+/*      map, layer, feature, label and label point in map units at a    */
+/*      given cellsize. These static structures are protected by the   */
+/*      TLOCK_LABELPLACEMENT mutex.                                     */
+/************************************************************************/
+
+#define MS_LABEL_PLACEMENT_CACHE_MAX 100000
+
+typedef struct {
+  char *key;
+  int position;
+  UT_hash_handle hh;
+} labelPlacementObj;
+
+static labelPlacementObj *labelPlacementCache = NULL;
+static int labelPlacementCacheCount = 0;
+
+int msLabelPlacementCacheEnabled(mapObj *map)
+{
+  const char *value = msLookupHashTable(&(map->web.metadata), "labelcache_placement_cache");
+  if(!value || map->gt.need_geotransform) return MS_FALSE;
+  return (strcasecmp(value, "ON") == 0 || strcasecmp(value, "TRUE") == 0 || strcasecmp(value, "YES") == 0);
+}
+
+/* build the cache key of a label, returns MS_FALSE if the label can't be cached */
+static int labelPlacementKey(mapObj *map, labelCacheMemberObj *cachePtr, int labelindex, char *key, size_t keysize)
+{
+  layerObj *layer;
+  double x, y;
+
+  if(cachePtr->shapeindex < 0 || map->cellsize <= 0) return MS_FALSE;
+  layer = GET_LAYER(map, cachePtr->layerindex);
+
+  /* the label point, in cellsize units of the map projection, is the same for all the tiles of a zoom level */
+  x = floor((map->extent.minx + cachePtr->point.x * map->cellsize) / map->cellsize + 0.5);
+  y = floor((map->extent.maxy - cachePtr->point.y * map->cellsize) / map->cellsize + 0.5);
+
+  snprintf(key, keysize, "%s\n%s\n%ld\n%d\n%d\n%.0f\n%.0f\n%.12g", map->name ? map->name : "",
+           layer->name ? layer->name : "", cachePtr->shapeindex, cachePtr->tileindex, labelindex, x, y, map->cellsize);
+  return MS_TRUE;
+}
+
+/*
+** Returns the position recorded for a label by a previous rendering, or -1.
+*/
+int msLabelPlacementCacheLookup(mapObj *map, labelCacheMemberObj *cachePtr, int labelindex)
+{
+  char key[512];
+  labelPlacementObj *entry = NULL;
+  int position = -1;
+
+  if(!labelPlacementKey(map, cachePtr, labelindex, key, sizeof(key))) return -1;
+
+  msAcquireLock( TLOCK_LABELPLACEMENT );
+  UT_HASH_FIND_STR(labelPlacementCache, key, entry);
+  if(entry) position = entry->position;
+  msReleaseLock( TLOCK_LABELPLACEMENT );
+
+  return position;
+}
+
+void msLabelPlacementCacheStore(mapObj *map, labelCacheMemberObj *cachePtr, int labelindex, int position)
+{
+  char key[512];
+  labelPlacementObj *entry = NULL;
+
+  if(!labelPlacementKey(map, cachePtr, labelindex, key, sizeof(key))) return;
+
+  msAcquireLock( TLOCK_LABELPLACEMENT );
+  UT_HASH_FIND_STR(labelPlacementCache, key, entry);
+  if(entry) {
+    entry->position = position;
+  } else {
+    if(labelPlacementCacheCount >= MS_LABEL_PLACEMENT_CACHE_MAX) {
+      /* start over rather than tracking usage, the cache refills from the tiles being rendered */
+      labelPlacementObj *tmp;
+      UT_HASH_ITER(hh, labelPlacementCache, entry, tmp) {
+        UT_HASH_DEL(labelPlacementCache, entry);
+        free(entry->key);
+        free(entry);
+      }
+      labelPlacementCacheCount = 0;
+    }
+    entry = (labelPlacementObj *) msSmallMalloc(sizeof(labelPlacementObj));
+    entry->key = msStrdup(key);
+    entry->position = position;
+    UT_HASH_ADD_KEYPTR(hh, labelPlacementCache, entry->key, strlen(entry->key), entry);
+    labelPlacementCacheCount++;
+  }
+  msReleaseLock( TLOCK_LABELPLACEMENT );
+}
+
+void msLabelPlacementCacheCleanup(void)
+{
+  labelPlacementObj *entry, *tmp;
+
+  msAcquireLock( TLOCK_LABELPLACEMENT );
+  UT_HASH_ITER(hh, labelPlacementCache, entry, tmp) {
+    UT_HASH_DEL(labelPlacementCache, entry);
+    free(entry->key);
+    free(entry);
+  }
+  labelPlacementCacheCount = 0;
+  msReleaseLock( TLOCK_LABELPLACEMENT );
+}
+
 /* msTestLabelCacheCollisions()
 **
 ** Compares label bounds (in *bounds) against labels already drawn and markers from cache and
@@ -767,7 +1396,8 @@ int msTestLabelCacheCollisions(mapObj *map, labelCacheMemberObj *cachePtr, label
         int current_priority, int current_label)
 {
   labelCacheObj *labelcache = &(map->labelcache);
-  int i, p, ll;
+  labelCacheGridObj *grid;
+  int i, p, ll, x, y, x0, y0, x1, y1;
 
   /*
    * Check against image bounds first
@@ -778,47 +1408,70 @@ int msTestLabelCacheCollisions(mapObj *map, labelCacheMemberObj *cachePtr, label
     }
   }
 
+  grid = indexLabelCacheMarkers(map);
+  x0 = labelCacheGridCell(lb->bbox.minx, grid->width);
+  x1 = labelCacheGridCell(lb->bbox.maxx, grid->width);
+  y0 = labelCacheGridCell(lb->bbox.miny, grid->height);
+  y1 = labelCacheGridCell(lb->bbox.maxy, grid->height);
+
   /* Compare against all rendered markers from this priority level and higher.
   ** Labels can overlap their own marker and markers from lower priority levels
   */
-  for (p=current_priority; p < MS_MAX_LABEL_PRIORITY; p++) {
-    labelCacheSlotObj *markerslot;
-    markerslot = &(labelcache->slots[p]);
-
-    for ( ll = 0; ll < markerslot->nummarkers; ll++ ) {
-      if ( !(p == current_priority && current_label == markerslot->markers[ll].id ) ) {  /* labels can overlap their own marker */
-        if ( intersectLabelPolygons(NULL, &markerslot->markers[ll].bounds, lb->poly, &lb->bbox ) == MS_TRUE ) {
+  for(y=y0; y<=y1; y++) {
+    for(x=x0; x<=x1; x++) {
+      labelCacheGridCellObj *cell = &grid->markers[y * grid->width + x];
+      for(i=0; i<cell->numitems; i++) {
+        markerCacheMemberObj *marker;
+        p = cell->items[i] % MS_MAX_LABEL_PRIORITY;
+        ll = cell->items[i] / MS_MAX_LABEL_PRIORITY;
+        if(p < current_priority)
+          continue;
+        marker = &(labelcache->slots[p].markers[ll]);
+        if(p == current_priority && current_label == marker->id)
+          continue; /* labels can overlap their own marker */
+        if(!labelCacheGridIsReference(grid, &marker->bounds, &lb->bbox, x, y))
+          continue; /* tested in another cell */
+        if ( intersectLabelPolygons(NULL, &marker->bounds, lb->poly, &lb->bbox ) == MS_TRUE ) {
           return MS_FALSE;
         }
       }
     }
   }
 
-  for(p=0; p<labelcache->num_rendered_members; p++) {
-    labelCacheMemberObj *curCachePtr= labelcache->rendered_text_symbols[p];
-    if(msRectOverlap(&curCachePtr->bbox,&lb->bbox)) {
-      for(i=0; i<curCachePtr->numtextsymbols; i++) {
-        int j;
-        textSymbolObj *ts = curCachePtr->textsymbols[i];
-        if(ts->textpath && intersectLabelPolygons(ts->textpath->bounds.poly, &ts->textpath->bounds.bbox, lb->poly, &lb->bbox) == MS_TRUE ) {
-          return MS_FALSE;
-        }
-        if(ts->style_bounds) {
-          for(j=0;j<ts->label->numstyles;j++) {
-            if(ts->style_bounds[j] && ts->label->styles[j]->_geomtransform.type == MS_GEOMTRANSFORM_LABELPOINT) {
-              if(intersectLabelPolygons(ts->style_bounds[j]->poly, &ts->style_bounds[j]->bbox,
-                  lb->poly, &lb->bbox)) {
-                return MS_FALSE;
+  for(y=y0; y<=y1; y++) {
+    for(x=x0; x<=x1; x++) {
+      labelCacheGridCellObj *cell = &grid->members[y * grid->width + x];
+      for(ll=0; ll<cell->numitems; ll++) {
+        labelCacheMemberObj *curCachePtr= labelcache->rendered_text_symbols[cell->items[ll]];
+        rectObj bounds;
+        renderedLabelBounds(curCachePtr, &bounds);
+        if(!labelCacheGridIsReference(grid, &bounds, &lb->bbox, x, y))
+          continue; /* tested in another cell */
+        if(msRectOverlap(&curCachePtr->bbox,&lb->bbox)) {
+          for(i=0; i<curCachePtr->numtextsymbols; i++) {
+            int j;
+            textSymbolObj *ts = curCachePtr->textsymbols[i];
+            if(ts->textpath && intersectLabelPolygons(ts->textpath->bounds.poly, &ts->textpath->bounds.bbox, lb->poly, &lb->bbox) == MS_TRUE ) {
+              return MS_FALSE;
+            }
+            if(ts->style_bounds) {
+              for(j=0;j<ts->label->numstyles;j++) {
+                if(ts->style_bounds[j] && ts->label->styles[j]->_geomtransform.type == MS_GEOMTRANSFORM_LABELPOINT) {
+                  if(intersectLabelPolygons(ts->style_bounds[j]->poly, &ts->style_bounds[j]->bbox,
+                      lb->poly, &lb->bbox)) {
+                    return MS_FALSE;
+                  }
+                }
               }
             }
           }
         }
-      }
-    }
-    if(curCachePtr->leaderline) {
-      if(testSegmentLabelBBoxIntersection(curCachePtr->leaderbbox, &curCachePtr->leaderline->point[0],
-          &curCachePtr->leaderline->point[1], lb) == MS_FALSE) {
-        return MS_FALSE;
+        if(curCachePtr->leaderline) {
+          if(testSegmentLabelBBoxIntersection(curCachePtr->leaderbbox, &curCachePtr->leaderline->point[0],
+              &curCachePtr->leaderline->point[1], lb) == MS_FALSE) {
+            return MS_FALSE;
+          }
+        }
       }
     }
   }
@@ -865,7 +1518,10 @@ int msFreeFontSet(fontSetObj *fontset)
   return( 0 );
 }
 
-int msLoadFontSet(fontSetObj *fontset, mapObj *map)
+/*
+** Reads the fontset file at szFile into fontset->fonts.
+*/
+static int msReadFontSet(fontSetObj *fontset, const char *szFile)
 {
   FILE *stream;
   char buffer[MS_BUFFER_LENGTH];
@@ -875,14 +1531,6 @@ int msLoadFontSet(fontSetObj *fontset, mapObj *map)
   int i;
   int bFullPath = 0;
 
-  if(fontset->numfonts != 0) /* already initialized */
-    return(0);
-
-  if(!fontset->filename)
-    return(0);
-
-  fontset->map = (mapObj *)map;
-
   path = msGetPath(fontset->filename);
 
   /* fontset->fonts = msCreateHashTable(); // create font hash */
@@ -891,10 +1539,11 @@ int msLoadFontSet(fontSetObj *fontset, mapObj *map)
   /* return(-1); */
   /* } */
 
-  stream = fopen( msBuildPath(szPath, fontset->map->mappath, fontset->filename), "r");
+  stream = fopen(szFile, "r");
   if(!stream) {
     msSetError(MS_IOERR, "Error opening fontset %s.", "msLoadFontset()",
                fontset->filename);
+    free(path);
     return(-1);
   }
 
@@ -945,6 +1594,122 @@ int msLoadFontSet(fontSetObj *fontset, mapObj *map)
 }
 
 
+/*
+** Per process cache of the fontset files read, by path, modification time
+** and size: the fonts of a fontset share the items of the cached hash table
+** (copy on write, see msCopyHashTable()) instead of reading the file again.
+** Files are opened when a font is first used, see msGetFontFace().
+** Protected by TLOCK_SYMBOLCACHE.
+*/
+#define MS_FONTSET_CACHE_MAX 16
+
+typedef struct {
+  char *path;
+  time_t mtime;
+  off_t size;
+  unsigned long last_used;
+  hashTableObj fonts;
+  int numfonts;
+} fontSetCacheEntryObj;
+
+static int fontSetCacheCount = 0;
+static unsigned long fontSetCacheClock = 0;
+static fontSetCacheEntryObj fontSetCache[MS_FONTSET_CACHE_MAX];
+
+static void msFontSetCacheRemove(int i)
+{
+  msFreeHashItems(&(fontSetCache[i].fonts));
+  free(fontSetCache[i].path);
+
+  fontSetCacheCount--;
+  if(i != fontSetCacheCount)
+    fontSetCache[i] = fontSetCache[fontSetCacheCount];
+}
+
+void msFontSetCacheCleanup(void)
+{
+  msAcquireLock( TLOCK_SYMBOLCACHE );
+  while(fontSetCacheCount > 0)
+    msFontSetCacheRemove(fontSetCacheCount - 1);
+  msReleaseLock( TLOCK_SYMBOLCACHE );
+}
+
+int msLoadFontSet(fontSetObj *fontset, mapObj *map)
+{
+  char szPath[MS_MAXPATHLEN];
+  fontSetObj loaded;
+  struct stat sStat;
+  int i, slot;
+
+  if(fontset->numfonts != 0) /* already initialized */
+    return(0);
+
+  if(!fontset->filename)
+    return(0);
+
+  fontset->map = (mapObj *)map;
+
+  msBuildPath(szPath, fontset->map->mappath, fontset->filename);
+  if(stat(szPath, &sStat) != 0)
+    return msReadFontSet(fontset, szPath); /* to report the error */
+
+  msAcquireLock( TLOCK_SYMBOLCACHE );
+  for(i=0; i<fontSetCacheCount; i++) {
+    if(strcmp(fontSetCache[i].path, szPath) != 0)
+      continue;
+    if(fontSetCache[i].mtime == sStat.st_mtime && fontSetCache[i].size == sStat.st_size) {
+      msCopyHashTable(&(fontset->fonts), &(fontSetCache[i].fonts));
+      fontset->numfonts = fontSetCache[i].numfonts;
+      fontSetCache[i].last_used = ++fontSetCacheClock;
+      msReleaseLock( TLOCK_SYMBOLCACHE );
+      return(0);
+    }
+    msFontSetCacheRemove(i); /* the file has been modified */
+    break;
+  }
+  msReleaseLock( TLOCK_SYMBOLCACHE );
+
+  msInitFontSet(&loaded);
+  loaded.filename = fontset->filename;
+  loaded.map = fontset->map;
+  if(msReadFontSet(&loaded, szPath) != 0) {
+    msFreeHashItems(&(loaded.fonts));
+    return(-1);
+  }
+  msCopyHashTable(&(fontset->fonts), &(loaded.fonts));
+  fontset->numfonts = loaded.numfonts;
+
+  msAcquireLock( TLOCK_SYMBOLCACHE );
+  for(i=0; i<fontSetCacheCount; i++) {
+    if(strcmp(fontSetCache[i].path, szPath) == 0)
+      break;
+  }
+  if(i < fontSetCacheCount) {
+    /* read by another thread in the meantime */
+    msFreeHashItems(&(loaded.fonts));
+  } else {
+    if(fontSetCacheCount == MS_FONTSET_CACHE_MAX) {
+      slot = 0;
+      for(i=1; i<fontSetCacheCount; i++) {
+        if(fontSetCache[i].last_used < fontSetCache[slot].last_used)
+          slot = i;
+      }
+      msFontSetCacheRemove(slot);
+    }
+    fontSetCache[fontSetCacheCount].path = msStrdup(szPath);
+    fontSetCache[fontSetCacheCount].mtime = sStat.st_mtime;
+    fontSetCache[fontSetCacheCount].size = sStat.st_size;
+    fontSetCache[fontSetCacheCount].last_used = ++fontSetCacheClock;
+    fontSetCache[fontSetCacheCount].fonts = loaded.fonts;
+    fontSetCache[fontSetCacheCount].numfonts = loaded.numfonts;
+    fontSetCacheCount++;
+  }
+  msReleaseLock( TLOCK_SYMBOLCACHE );
+
+  return(0);
+}
+
+
 int msGetTextSymbolSize(mapObj *map, textSymbolObj *ts, rectObj *r) {
   if(!ts->textpath) {
     if(UNLIKELY(MS_FAILURE == msComputeTextPath(map,ts)))
@@ -342,7 +342,7 @@ int msLayerNextShape(layerObj *layer, shapeObj *shape)
       filter_passed = msEvalExpression(layer, shape, &(layer->filter), layer->filteritemindex);
     // }
 
-    if(!filter_passed) msFreeShape(shape);
+    if(!filter_passed) msShapePoolFreeShape(layer->shapepool, shape);
   } while(!filter_passed);
 
   /* RFC89 Apply Layer GeomTransform */
@@ -356,6 +356,148 @@ int msLayerNextShape(layerObj *layer, shapeObj *shape)
   return rv;
 }
 
+/*
+** Batched version of msLayerNextShape(): fills up to maxshapes shapes (initialized
+** with msInitShape()) and sets numshapes. Encoding, FILTER and GEOMTRANSFORM are
+** applied as for msLayerNextShape(), so every shape returned has passed the filter.
+** Returns MS_SUCCESS with at least one shape, MS_DONE or MS_FAILURE.
+*/
+int msLayerNextShapes(layerObj *layer, shapeObj *shapes, int maxshapes, int *numshapes)
+{
+  int i, n, rv;
+
+  *numshapes = 0;
+
+  if ( ! layer->vtable) {
+    rv =  msInitializeVirtualTable(layer);
+    if (rv != MS_SUCCESS)
+      return rv;
+  }
+
+#ifdef USE_V8_MAPSCRIPT
+  /* we need to force the GetItems for the geomtransform attributes */
+  if(!layer->items &&
+     layer->_geomtransform.type == MS_GEOMTRANSFORM_EXPRESSION &&
+     strstr(layer->_geomtransform.string, "javascript"))
+      msLayerGetItems(layer);
+#endif
+
+  do {
+    rv = layer->vtable->LayerNextShapes(layer, shapes, maxshapes, &n);
+    if(rv != MS_SUCCESS) return rv;
+
+    for(i=0; i<n; i++) {
+      if(layer->encoding) {
+        rv = msLayerEncodeShapeAttributes(layer, &shapes[i]);
+        if(rv != MS_SUCCESS) break;
+      }
+
+      if(!msEvalExpression(layer, &shapes[i], &(layer->filter), layer->filteritemindex)) {
+        msShapePoolFreeShape(layer->shapepool, &shapes[i]);
+        continue;
+      }
+
+      if(i != *numshapes) { /* move the shape down over the rejected ones */
+        shapes[*numshapes] = shapes[i];
+        msInitShape(&shapes[i]);
+      }
+      (*numshapes)++;
+    }
+
+    if(rv != MS_SUCCESS) {
+      for(i=0; i<n; i++) msFreeShape(&shapes[i]);
+      *numshapes = 0;
+      return rv;
+    }
+  } while(*numshapes == 0);
+
+  /* RFC89 Apply Layer GeomTransform */
+  if(layer->_geomtransform.type != MS_GEOMTRANSFORM_NONE) {
+    for(i=0; i<*numshapes; i++) {
+      rv = msGeomTransformShape(layer->map, layer, &shapes[i]);
+      if(rv != MS_SUCCESS) {
+        for(i=0; i<*numshapes; i++) msFreeShape(&shapes[i]);
+        *numshapes = 0;
+        return rv;
+      }
+    }
+  }
+
+  return MS_SUCCESS;
+}
+
+void msInitShapeBatch(shapeBatchObj *batch)
+{
+  batch->shapes = NULL;
+  batch->numshapes = batch->current = 0;
+  batch->map = NULL;
+  batch->classgroup = NULL;
+  batch->numclasses = 0;
+}
+
+/*
+** Have msShapeBatchNext() set the classindex of the shapes it hands out, the
+** whole batch being classified at once (see msShapeGetClasses()).
+*/
+void msShapeBatchClassify(shapeBatchObj *batch, mapObj *map, int *classgroup, int numclasses)
+{
+  batch->map = map;
+  batch->classgroup = classgroup;
+  batch->numclasses = numclasses;
+}
+
+/*
+** Hands out the next shape of the layer like msLayerNextShape(), reading them
+** MS_LAYER_BATCH_SIZE at a time through msLayerNextShapes(). The caller owns (and
+** frees) each shape it gets, the ones not handed out yet are freed by msFreeShapeBatch().
+*/
+int msShapeBatchNext(layerObj *layer, shapeBatchObj *batch, shapeObj *shape)
+{
+  if(batch->current == batch->numshapes) {
+    int i, rv;
+    layerStatsObj *stats = msGetLayerStats(layer->map, layer);
+    double stagestart = 0;
+
+    if(!batch->shapes) {
+      batch->shapes = (shapeObj *) malloc(sizeof(shapeObj) * MS_LAYER_BATCH_SIZE);
+      MS_CHECK_ALLOC(batch->shapes, sizeof(shapeObj) * MS_LAYER_BATCH_SIZE, MS_FAILURE);
+      for(i=0; i<MS_LAYER_BATCH_SIZE; i++) msInitShape(&batch->shapes[i]);
+    }
+
+    if(stats) stagestart = msStatsNow();
+
+    batch->current = 0;
+    rv = msLayerNextShapes(layer, batch->shapes, MS_LAYER_BATCH_SIZE, &batch->numshapes);
+    if(stats) {
+      stats->seconds[MS_STATS_NEXTSHAPE] += msStatsElapsed(&stagestart);
+      stats->read += batch->numshapes;
+    }
+    if(rv != MS_SUCCESS) return rv;
+
+    if(batch->map) {
+      msShapeGetClasses(layer, batch->map, batch->shapes, batch->numshapes, batch->classgroup, batch->numclasses);
+      if(stats) stats->seconds[MS_STATS_CLASSIFY] += msStatsElapsed(&stagestart);
+    }
+  }
+
+  *shape = batch->shapes[batch->current];
+  msInitShape(&batch->shapes[batch->current]);
+  batch->current++;
+
+  return MS_SUCCESS;
+}
+
+void msFreeShapeBatch(shapeBatchObj *batch)
+{
+  int i;
+
+  for(i=batch->current; i<batch->numshapes; i++)
+    msFreeShape(&batch->shapes[i]);
+  free(batch->shapes);
+  batch->shapes = NULL;
+  batch->numshapes = batch->current = 0;
+}
+
 /*
 ** Used to retrieve a shape from a result set by index. Result sets are created by the various
 ** msQueryBy...() functions. The index is assigned by the data source.
@@ -410,6 +552,122 @@ int msLayerGetShape(layerObj *layer, shapeObj *shape, resultObj *record)
   return rv;
 }
 
+/*
+** Batched version of msLayerGetShape(): reads the shapes of numrecords records at
+** once where the driver can (PostGIS gets them with a single query), shapes[i]
+** (initialized with msInitShape()) being the shape of records[i]. A record that
+** could not be read leaves its shape of type MS_SHAPE_NULL.
+*/
+int msLayerGetShapes(layerObj *layer, shapeObj *shapes, resultObj *records, int numrecords)
+{
+  int i, rv;
+
+  if( ! layer->vtable) {
+    rv =  msInitializeVirtualTable(layer);
+    if(rv != MS_SUCCESS)
+      return rv;
+  }
+
+  rv = layer->vtable->LayerGetShapes(layer, shapes, records, numrecords);
+  if(rv != MS_SUCCESS)
+    return rv;
+
+  for(i=0; i<numrecords; i++) {
+    if(shapes[i].type == MS_SHAPE_NULL) continue;
+
+    /* RFC89 Apply Layer GeomTransform */
+    if(layer->_geomtransform.type != MS_GEOMTRANSFORM_NONE)
+      rv = msGeomTransformShape(layer->map, layer, &shapes[i]);
+    if(rv == MS_SUCCESS && layer->encoding)
+      rv = msLayerEncodeShapeAttributes(layer, &shapes[i]);
+    if(rv != MS_SUCCESS) {
+      msFreeShape(&shapes[i]);
+      shapes[i].type = MS_SHAPE_NULL;
+      rv = MS_SUCCESS;
+    }
+  }
+
+  return MS_SUCCESS;
+}
+
+void msFreeResultShapes(resultShapesObj *resultshapes)
+{
+  int i;
+
+  if(!resultshapes) return;
+  for(i=0; i<resultshapes->numshapes; i++)
+    msFreeShape(&resultshapes->shapes[i]);
+  free(resultshapes->shapes);
+  free(resultshapes->records);
+  free(resultshapes->handedout);
+  free(resultshapes);
+}
+
+/*
+** Gets the shape of result resultnum of the layer result cache, as
+** msLayerGetShape(layer, shape, &(layer->resultcache->results[resultnum])) does.
+** For drivers with a batched LayerGetShapes the results are read
+** MS_RESULT_BATCH_SIZE at a time, so that going through the result cache in
+** order costs one request per batch instead of one per result. Each shape read
+** ahead is handed out once, asking again for a result reads ahead from there
+** again, and a result that could not be read ahead falls back to
+** msLayerGetShape().
+*/
+int msLayerGetResultShape(layerObj *layer, shapeObj *shape, int resultnum)
+{
+  resultShapesObj *rs;
+  resultObj *record = &(layer->resultcache->results[resultnum]);
+  int k;
+
+  if( ! layer->vtable) {
+    int rv =  msInitializeVirtualTable(layer);
+    if(rv != MS_SUCCESS)
+      return rv;
+  }
+
+  if(layer->vtable->LayerGetShapes == LayerDefaultGetShapes)
+    return msLayerGetShape(layer, shape, record);
+
+  rs = layer->resultshapes;
+  if(!rs || resultnum < rs->first || resultnum >= rs->first + rs->numshapes || rs->numitems != layer->numitems ||
+     rs->handedout[resultnum - rs->first]) {
+    int i, n = MS_MIN(MS_RESULT_BATCH_SIZE, layer->resultcache->numresults - resultnum);
+
+    if(!rs) {
+      rs = layer->resultshapes = (resultShapesObj *) msSmallCalloc(1, sizeof(resultShapesObj));
+      rs->shapes = (shapeObj *) msSmallMalloc(sizeof(shapeObj) * MS_RESULT_BATCH_SIZE);
+      rs->records = (resultObj *) msSmallMalloc(sizeof(resultObj) * MS_RESULT_BATCH_SIZE);
+      rs->handedout = (char *) msSmallMalloc(MS_RESULT_BATCH_SIZE);
+    }
+    for(i=0; i<rs->numshapes; i++)
+      msFreeShape(&rs->shapes[i]);
+    for(i=0; i<n; i++)
+      msInitShape(&rs->shapes[i]);
+    memcpy(rs->records, record, sizeof(resultObj) * n);
+    memset(rs->handedout, 0, n);
+    rs->first = resultnum;
+    rs->numshapes = n;
+    rs->numitems = layer->numitems;
+
+    if(msLayerGetShapes(layer, rs->shapes, rs->records, n) != MS_SUCCESS) {
+      for(i=0; i<n; i++) msFreeShape(&rs->shapes[i]);
+      rs->numshapes = 0;
+      return msLayerGetShape(layer, shape, record);
+    }
+  }
+
+  k = resultnum - rs->first;
+  if(rs->shapes[k].type == MS_SHAPE_NULL ||
+     rs->records[k].shapeindex != record->shapeindex || rs->records[k].tileindex != record->tileindex ||
+     rs->records[k].resultindex != record->resultindex)
+    return msLayerGetShape(layer, shape, record);
+
+  *shape = rs->shapes[k];
+  msInitShape(&rs->shapes[k]);
+  rs->handedout[k] = 1;
+  return MS_SUCCESS;
+}
+
 /*
 ** Returns the number of shapes that match the potential filter and extent.
  * rectProjection is the projection in which rect is expressed, or can be NULL if
@@ -419,10 +677,12 @@ int msLayerGetShape(layerObj *layer, shapeObj *shape, resultObj *record)
  * limitation if layer->maxfeatures>=0, and honouring layer->startindex if
  * layer->startindex >= 1 and paging is enabled.
  * Returns -1 in case of failure.
+ * With PROCESSING "ESTIMATED_COUNT=ON" this returns msLayerEstimateShapeCount().
  */
 int msLayerGetShapeCount(layerObj *layer, rectObj rect, projectionObj *rectProjection)
 {
   int rv;
+  const char *value;
 
   if( ! layer->vtable) {
     rv = msInitializeVirtualTable(layer);
@@ -430,9 +690,36 @@ int msLayerGetShapeCount(layerObj *layer, rectObj rect, projectionObj *rectProje
       return -1;
   }
 
+  value = msLayerGetProcessingKey(layer, "ESTIMATED_COUNT");
+  if(value && strcasecmp(value, "ON") == 0)
+    return layer->vtable->LayerEstimateShapeCount(layer, rect, rectProjection);
+
   return layer->vtable->LayerGetShapeCount(layer, rect, rectProjection);
 }
 
+/*
+** Returns an estimate of msLayerGetShapeCount(), for callers that can do with an
+ * approximate count (WFS hits, "too many results" checks). This is whatever the
+ * data source can tell without reading the shapes: the spatial index for
+ * shapefiles, the planner estimate for PostGIS, the fast feature count for OGR.
+ * The estimate may count shapes whose bounds only overlap rect, and may not
+ * honour the layer filter, maxfeatures or startindex. Drivers with no such
+ * shortcut return the exact count.
+ * Returns -1 in case of failure.
+ */
+int msLayerEstimateShapeCount(layerObj *layer, rectObj rect, projectionObj *rectProjection)
+{
+  int rv;
+
+  if( ! layer->vtable) {
+    rv = msInitializeVirtualTable(layer);
+    if(rv != MS_SUCCESS)
+      return -1;
+  }
+
+  return layer->vtable->LayerEstimateShapeCount(layer, rect, rectProjection);
+}
+
 
 /*
 ** Closes resources used by a particular layer.
@@ -448,6 +735,12 @@ void msLayerClose(layerObj *layer)
     layer->items = NULL;
     layer->numitems = 0;
   }
+  msFreeClassLookup(layer->classlookup);
+  layer->classlookup = NULL;
+  msFreeBindingPlan(layer->bindingplan);
+  layer->bindingplan = NULL;
+  msFreeResultShapes(layer->resultshapes);
+  layer->resultshapes = NULL;
 
   /* clear out items used as part of expressions (bug #2702) -- what about the layer filter? */
   msFreeExpressionTokens(&(layer->filter));
@@ -721,6 +1014,9 @@ int msTokenizeExpression(expressionObj *expression, char **list, int *listsize)
           goto parse_error;
         }
 
+        /* the shape is tested against every feature, let GEOS index it once */
+        msGEOSPrepareGeometry(node->tokenval.shpval);
+
         /* todo: perhaps process optional args (e.g. projection) */
 
         if((token = msyylex()) != 41) { /* ) */
@@ -753,6 +1049,8 @@ int msTokenizeExpression(expressionObj *expression, char **list, int *listsize)
   expression->curtoken = expression->tokens; /* point at the first token */
 
   msReleaseLock(TLOCK_PARSER);
+
+  msCompileExpression(expression);
   return MS_SUCCESS;
 
 parse_error:
@@ -760,16 +1058,240 @@ parse_error:
   return MS_FAILURE;
 }
 
+#define MS_CLASS_LOOKUP_MIN 8 /* don't bother for a handful of classes */
+
+static int compareClassLookupStrings(const void *a, const void *b)
+{
+  const classLookupEntryObj *ea = a, *eb = b;
+  int cmp = strcmp(ea->string, eb->string);
+  return cmp ? cmp : (ea->iclass - eb->iclass);
+}
+
+static int compareClassLookupNumbers(const void *a, const void *b)
+{
+  const classLookupEntryObj *ea = a, *eb = b;
+  if(ea->number < eb->number) return -1;
+  if(ea->number > eb->number) return 1;
+  return ea->iclass - eb->iclass;
+}
+
+static void addClassLookupEntry(classLookupEntryObj **entries, int *numentries, int *maxentries, const char *string, double number, int iclass)
+{
+  if(*numentries == *maxentries) {
+    *maxentries = *maxentries ? *maxentries * 2 : 64;
+    *entries = (classLookupEntryObj *) msSmallRealloc(*entries, sizeof(classLookupEntryObj) * (*maxentries));
+  }
+  (*entries)[*numentries].string = string ? msStrdup(string) : NULL;
+  (*entries)[*numentries].number = number;
+  (*entries)[*numentries].iclass = iclass;
+  (*numentries)++;
+}
+
+/*
+** Works out whether a class expression is a test of one item against one
+** or more constants. Returns the item index, or -1 if the class has to be
+** evaluated. The constants are returned in *values (a comma list when
+** *islist is set) or in *number, *isnumber tells how they are compared.
+*/
+static int getClassLookupValues(layerObj *layer, expressionObj *expression, const char **values, double *number, int *islist, int *isnumber)
+{
+  tokenListNodeObjPtr t[3], node;
+  int n;
+
+  if(MS_STRING_IS_NULL_OR_EMPTY(expression->string) || expression->native_string != NULL) return -1; /* always true */
+
+  *islist = *isnumber = MS_FALSE;
+
+  switch(expression->type) {
+    case(MS_STRING):
+      if(expression->flags & MS_EXP_INSENSITIVE) return -1;
+      *values = expression->string;
+      return layer->classitemindex;
+    case(MS_LIST):
+      *values = expression->string;
+      *islist = MS_TRUE;
+      return layer->classitemindex;
+    case(MS_EXPRESSION):
+      /* [item] = constant, constant = [item] or [item] IN 'list' */
+      for(n=0, node=expression->tokens; node; node=node->next) {
+        if(n == 3) return -1;
+        t[n++] = node;
+      }
+      if(n != 3) return -1;
+
+      if(t[1]->token == MS_TOKEN_COMPARISON_EQ && (t[0]->token == MS_TOKEN_LITERAL_STRING || t[0]->token == MS_TOKEN_LITERAL_NUMBER)) {
+        node = t[0];
+        t[0] = t[2];
+        t[2] = node;
+      }
+
+      if(t[1]->token == MS_TOKEN_COMPARISON_EQ) {
+        if(t[0]->token == MS_TOKEN_BINDING_STRING && t[2]->token == MS_TOKEN_LITERAL_STRING) {
+          *values = t[2]->tokenval.strval;
+          return t[0]->tokenval.bindval.index;
+        }
+        if((t[0]->token == MS_TOKEN_BINDING_DOUBLE || t[0]->token == MS_TOKEN_BINDING_INTEGER) && t[2]->token == MS_TOKEN_LITERAL_NUMBER) {
+          *number = t[2]->tokenval.dblval;
+          *isnumber = MS_TRUE;
+          return t[0]->tokenval.bindval.index;
+        }
+      } else if((t[1]->token == MS_TOKEN_COMPARISON_IN || t[1]->token == IN) && t[2]->token == MS_TOKEN_LITERAL_STRING) {
+        *values = t[2]->tokenval.strval;
+        *islist = MS_TRUE;
+        if(t[0]->token == MS_TOKEN_BINDING_STRING)
+          return t[0]->tokenval.bindval.index;
+        if(t[0]->token == MS_TOKEN_BINDING_DOUBLE || t[0]->token == MS_TOKEN_BINDING_INTEGER) {
+          *isnumber = MS_TRUE;
+          return t[0]->tokenval.bindval.index;
+        }
+      }
+      return -1;
+    default:
+      return -1;
+  }
+}
+
+void msFreeClassLookup(classLookupObj *lookup)
+{
+  int i;
+
+  if(!lookup) return;
+  for(i=0; i<lookup->numstrings; i++)
+    free(lookup->strings[i].string);
+  free(lookup->strings);
+  free(lookup->numbers);
+  free(lookup->others);
+  free(lookup);
+}
+
+/*
+** Builds layer->classlookup for the current item list, see msLayerWhichItems().
+** The layer is left without a lookup when it wouldn't help.
+*/
+void msLayerBuildClassLookup(layerObj *layer)
+{
+  classLookupObj *lookup;
+  int i, maxstrings=0, maxnumbers=0;
+
+  msFreeClassLookup(layer->classlookup);
+  layer->classlookup = NULL;
+
+  if(layer->numclasses < MS_CLASS_LOOKUP_MIN) return;
+
+  lookup = (classLookupObj *) msSmallCalloc(1, sizeof(classLookupObj));
+  lookup->numclasses = layer->numclasses;
+  lookup->itemindex = -1;
+  lookup->others = (int *) msSmallMalloc(sizeof(int) * layer->numclasses);
+
+  for(i=0; i<layer->numclasses; i++) {
+    const char *values = NULL;
+    double number = 0;
+    int islist, isnumber, itemindex;
+    expressionObj *expression = &(layer->class[i]->expression);
+
+    itemindex = getClassLookupValues(layer, expression, &values, &number, &islist, &isnumber);
+    if(itemindex < 0 || itemindex >= layer->numitems || (lookup->itemindex != -1 && itemindex != lookup->itemindex)) {
+      lookup->others[lookup->numothers++] = i;
+      continue;
+    }
+    lookup->itemindex = itemindex;
+
+    if(!islist) {
+      if(isnumber) {
+        if(number == number) /* NaN never matches */
+          addClassLookupEntry(&lookup->numbers, &lookup->numnumbers, &maxnumbers, NULL, number, i);
+      } else
+        addClassLookupEntry(&lookup->strings, &lookup->numstrings, &maxstrings, values, 0, i);
+    } else {
+      char **list;
+      int j, n;
+
+      list = msStringSplit(values, ',', &n);
+      for(j=0; j<n; j++) {
+        if(isnumber) {
+          number = atof(list[j]);
+          if(number == number)
+            addClassLookupEntry(&lookup->numbers, &lookup->numnumbers, &maxnumbers, NULL, number, i);
+        } else
+          addClassLookupEntry(&lookup->strings, &lookup->numstrings, &maxstrings, list[j], 0, i);
+      }
+      msFreeCharArray(list, n);
+    }
+  }
+
+  if(lookup->numclasses - lookup->numothers < MS_CLASS_LOOKUP_MIN) {
+    msFreeClassLookup(lookup);
+    return;
+  }
+
+  if(lookup->numstrings > 0) qsort(lookup->strings, lookup->numstrings, sizeof(classLookupEntryObj), compareClassLookupStrings);
+  if(lookup->numnumbers > 0) qsort(lookup->numbers, lookup->numnumbers, sizeof(classLookupEntryObj), compareClassLookupNumbers);
+
+  layer->classlookup = lookup;
+}
+
+/*
+** Same scale test as msShapeGetClass(), classes failing it are never drawn.
+*/
+static int msClassInScale(classObj *c, double scaledenom)
+{
+  if(scaledenom > 0) {
+    if((c->maxscaledenom > 0) && (scaledenom > c->maxscaledenom)) return MS_FALSE;
+    if((c->minscaledenom > 0) && (scaledenom <= c->minscaledenom)) return MS_FALSE;
+  }
+  return MS_TRUE;
+}
+
+/*
+** Forget the item indexes of a class left out of the item list so nothing
+** uses indexes from a previous item list.
+*/
+static void msClassClearItems(classObj *c)
+{
+  int j, k, l;
+
+  msFreeExpressionTokens(&(c->expression));
+  msFreeExpressionTokens(&(c->text));
+  for(j=0; j<c->numstyles; j++) {
+    c->styles[j]->rangeitemindex = -1;
+    for(k=0; k<MS_STYLE_BINDING_LENGTH; k++) c->styles[j]->bindings[k].index = -1;
+    msFreeExpressionTokens(&(c->styles[j]->_geomtransform));
+  }
+  for(l=0; l<c->numlabels; l++) {
+    for(j=0; j<c->labels[l]->numstyles; j++) {
+      c->labels[l]->styles[j]->rangeitemindex = -1;
+      for(k=0; k<MS_STYLE_BINDING_LENGTH; k++) c->labels[l]->styles[j]->bindings[k].index = -1;
+      msFreeExpressionTokens(&(c->labels[l]->styles[j]->_geomtransform));
+    }
+    for(k=0; k<MS_LABEL_BINDING_LENGTH; k++) c->labels[l]->bindings[k].index = -1;
+    msFreeExpressionTokens(&(c->labels[l]->expression));
+    msFreeExpressionTokens(&(c->labels[l]->text));
+  }
+}
+
 /*
 ** This function builds a list of items necessary to draw or query a particular layer by
 ** examining the contents of the various xxxxitem parameters and expressions. That list is
 ** then used to set the iteminfo variable.
 */
 int msLayerWhichItems(layerObj *layer, int get_all, const char *metadata)
+{
+  return msLayerWhichItemsForScale(layer, get_all, metadata, -1);
+}
+
+/*
+** Same as msLayerWhichItems() but leaves out the items only used by classes that are
+** not drawn at scaledenom (see msShapeGetClass()), so that data sources don't fetch
+** them. For drawing only: the classes left out can't be evaluated until the items
+** are set again.
+*/
+int msLayerWhichItemsForScale(layerObj *layer, int get_all, const char *metadata, double scaledenom)
 {
   int i, j, k, l, rv;
   int nt=0;
 
+  if(get_all == MS_TRUE) scaledenom = -1; /* all items are fetched anyway */
+
   if (!layer->vtable) {
     rv =  msInitializeVirtualTable(layer);
     if (rv != MS_SUCCESS) return rv;
@@ -782,6 +1304,10 @@ int msLayerWhichItems(layerObj *layer, int get_all, const char *metadata)
     layer->items = NULL;
     layer->numitems = 0;
   }
+  msFreeClassLookup(layer->classlookup); /* item indexes are about to change */
+  layer->classlookup = NULL;
+  msFreeBindingPlan(layer->bindingplan);
+  layer->bindingplan = NULL;
 
   /*
   ** need a count of potential items/attributes needed
@@ -818,6 +1344,8 @@ int msLayerWhichItems(layerObj *layer, int get_all, const char *metadata)
   /* class level counts */
   for(i=0; i<layer->numclasses; i++) {
 
+    if(!msClassInScale(layer->class[i], scaledenom)) continue;
+
     for(j=0; j<layer->class[i]->numstyles; j++) {
       if(layer->class[i]->styles[j]->rangeitem) nt++;
       nt += layer->class[i]->styles[j]->numbindings;
@@ -857,7 +1385,8 @@ int msLayerWhichItems(layerObj *layer, int get_all, const char *metadata)
 
   /* always retrieve all items in some cases */
   if(layer->connectiontype == MS_INLINE || get_all == MS_TRUE ||
-      (layer->map->outputformat && layer->map->outputformat->renderer == MS_RENDER_WITH_KML)) {
+      (layer->map->outputformat && (layer->map->outputformat->renderer == MS_RENDER_WITH_KML ||
+                                    layer->map->outputformat->renderer == MS_RENDER_WITH_MVT))) {
     rv = msLayerGetItems(layer);
     if(nt > 0) /* need to realloc the array to accept the possible new items*/
       layer->items = (char **)msSmallRealloc(layer->items, sizeof(char *)*(layer->numitems + nt));
@@ -881,6 +1410,11 @@ int msLayerWhichItems(layerObj *layer, int get_all, const char *metadata)
 
   /* layer classes */
   for(i=0; i<layer->numclasses; i++) {
+
+    if(!msClassInScale(layer->class[i], scaledenom)) {
+      msClassClearItems(layer->class[i]);
+      continue;
+    }
     
     if(layer->class[i]->expression.type == MS_EXPRESSION) /* class expression */
       msTokenizeExpression(&(layer->class[i]->expression), layer->items, &(layer->numitems));
@@ -966,6 +1500,9 @@ int msLayerWhichItems(layerObj *layer, int get_all, const char *metadata)
     }
   }
 
+  msLayerBuildClassLookup(layer);
+  msLayerBuildBindingPlan(layer);
+
   /* populate the iteminfo array */
   if(layer->numitems == 0)
     return(MS_SUCCESS);
@@ -1526,11 +2063,38 @@ int LayerDefaultNextShape(layerObj *layer, shapeObj *shape)
   return MS_FAILURE;
 }
 
+/*
+** Drivers without a batched reader hand out one shape per batch, so they see
+** exactly the same call sequence as with msLayerNextShape().
+*/
+int LayerDefaultNextShapes(layerObj *layer, shapeObj *shapes, int maxshapes, int *numshapes)
+{
+  int rv = layer->vtable->LayerNextShape(layer, &shapes[0]);
+  *numshapes = (rv == MS_SUCCESS) ? 1 : 0;
+  return rv;
+}
+
 int LayerDefaultGetShape(layerObj *layer, shapeObj *shape, resultObj *record)
 {
   return MS_FAILURE;
 }
 
+/*
+** Drivers without a batched reader get the shapes one by one.
+*/
+int LayerDefaultGetShapes(layerObj *layer, shapeObj *shapes, resultObj *records, int numrecords)
+{
+  int i;
+
+  for(i=0; i<numrecords; i++) {
+    if(layer->vtable->LayerGetShape(layer, &shapes[i], &records[i]) != MS_SUCCESS) {
+      msFreeShape(&shapes[i]);
+      shapes[i].type = MS_SHAPE_NULL;
+    }
+  }
+  return MS_SUCCESS;
+}
+
 int LayerDefaultGetShapeCount(layerObj *layer, rectObj rect, projectionObj *rectProjection)
 {
   int status;
@@ -1608,6 +2172,12 @@ int LayerDefaultGetShapeCount(layerObj *layer, rectObj rect, projectionObj *rect
   return nShapeCount;
 }
 
+/* no cheaper way than counting for the drivers that do not tell */
+int LayerDefaultEstimateShapeCount(layerObj *layer, rectObj rect, projectionObj *rectProjection)
+{
+  return layer->vtable->LayerGetShapeCount(layer, rect, rectProjection);
+}
+
 int LayerDefaultClose(layerObj *layer)
 {
   return MS_SUCCESS;
@@ -1909,9 +2479,12 @@ static int populateVirtualTable(layerVTableObj *vtable)
   vtable->LayerWhichShapes = LayerDefaultWhichShapes;
 
   vtable->LayerNextShape = LayerDefaultNextShape;
+  vtable->LayerNextShapes = LayerDefaultNextShapes;
   /* vtable->LayerResultsGetShape = LayerDefaultResultsGetShape; */
   vtable->LayerGetShape = LayerDefaultGetShape;
   vtable->LayerGetShapeCount = LayerDefaultGetShapeCount;
+  vtable->LayerGetShapes = LayerDefaultGetShapes;
+  vtable->LayerEstimateShapeCount = LayerDefaultEstimateShapeCount;
   vtable->LayerClose = LayerDefaultClose;
   vtable->LayerGetItems = LayerDefaultGetItems;
   vtable->LayerGetExtent = LayerDefaultGetExtent;
@@ -1975,6 +2548,9 @@ int msInitializeVirtualTable(layerObj *layer)
       return(msINLINELayerInitializeVirtualTable(layer));
       break;
     case(MS_SHAPEFILE):
+      /* DATA naming a FlatGeobuf file is read natively, see mapflatgeobuf.c */
+      if(msFlatGeobufIsDataset(layer->data))
+        return(msFlatGeobufLayerInitializeVirtualTable(layer));
       return(msSHPLayerInitializeVirtualTable(layer));
       break;
     case(MS_TILED_SHAPEFILE):
@@ -28,6 +28,8 @@
  *****************************************************************************/
 
 #include "mapserver.h"
+#include "mapthread.h"
+#include <sys/stat.h>
 
 
 
@@ -872,3 +874,206 @@ int msEmbedLegend(mapObj *map, imageObj *img)
 
   return MS_SUCCESS;
 }
+
+/*
+** Legend cache
+**
+** Legend images and icons are requested over and over with the same
+** parameters, and each request renders and encodes them again. With a TTL
+** (the "legend_cache_ttl" web metadata, in seconds) the responses written by
+** msLegendDispatchCached() are kept in a process wide cache of
+** MS_LEGEND_CACHE_MAX entries and served while younger than the TTL. The key
+** is made of the mapfile name, modification time and size, and the request
+** parameters except MAP (layer, class, style, scale, format, size...), so
+** that editing the mapfile never returns stale images. Only successful GET
+** requests are cached. The cache is protected by TLOCK_LEGENDCACHE.
+*/
+
+#define MS_LEGEND_CACHE_MAX 64
+
+typedef struct {
+  char *key;
+  unsigned char *data;
+  int size;
+  char *mimetype;
+  time_t created;
+  unsigned long last_used;
+} legendCacheEntryObj;
+
+static int legendCacheCount = 0;
+static unsigned long legendCacheClock = 0;
+static legendCacheEntryObj legendCache[MS_LEGEND_CACHE_MAX];
+
+static void msLegendCacheRemove(int i)
+{
+  free(legendCache[i].key);
+  free(legendCache[i].data);
+  free(legendCache[i].mimetype);
+
+  legendCacheCount--;
+  if(i != legendCacheCount)
+    legendCache[i] = legendCache[legendCacheCount];
+}
+
+static int msLegendCacheFind(const char *key)
+{
+  int i;
+
+  for(i=0; i<legendCacheCount; i++) {
+    if(strcmp(legendCache[i].key, key) == 0)
+      return i;
+  }
+  return -1;
+}
+
+static void msLegendCacheInsert(const char *key, const unsigned char *data, int size, const char *mimetype)
+{
+  int i;
+
+  msAcquireLock(TLOCK_LEGENDCACHE);
+  if((i = msLegendCacheFind(key)) >= 0)
+    msLegendCacheRemove(i);
+  if(legendCacheCount == MS_LEGEND_CACHE_MAX) {
+    int slot = 0;
+
+    for(i=1; i<legendCacheCount; i++) {
+      if(legendCache[i].last_used < legendCache[slot].last_used)
+        slot = i;
+    }
+    msLegendCacheRemove(slot);
+  }
+
+  i = legendCacheCount++;
+  legendCache[i].key = msStrdup(key);
+  legendCache[i].data = (unsigned char *) msSmallMalloc(size);
+  memcpy(legendCache[i].data, data, size);
+  legendCache[i].size = size;
+  legendCache[i].mimetype = mimetype ? msStrdup(mimetype) : NULL;
+  legendCache[i].created = time(NULL);
+  legendCache[i].last_used = ++legendCacheClock;
+  msReleaseLock(TLOCK_LEGENDCACHE);
+}
+
+static int msLegendCompareStrings(const void *a, const void *b)
+{
+  return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/* the cache key of request, NULL if it can't be cached */
+static char *msLegendCacheKey(cgiRequestObj *request, const char *mapfile)
+{
+  char **params, *key;
+  struct stat sStat;
+  char stamp[64];
+  int i, n = 0;
+
+  if(!request || !mapfile || request->type != MS_GET_REQUEST)
+    return NULL;
+  if(stat(mapfile, &sStat) != 0)
+    return NULL;
+
+  snprintf(stamp, sizeof(stamp), "\n%ld\n%ld", (long) sStat.st_mtime, (long) sStat.st_size);
+  key = msStringConcatenate(msStrdup(mapfile), stamp);
+
+  /* the parameters in a canonical order, the mapfile is already known */
+  params = (char **) msSmallMalloc(sizeof(char *) * (request->NumParams + 1));
+  for(i=0; i<request->NumParams; i++) {
+    if(strcasecmp(request->ParamNames[i], "MAP") == 0)
+      continue;
+    params[n] = msStrdup(request->ParamNames[i]);
+    msStringToUpper(params[n]);
+    params[n] = msStringConcatenate(msStringConcatenate(params[n], "="), request->ParamValues[i]);
+    n++;
+  }
+  qsort(params, n, sizeof(char *), msLegendCompareStrings);
+  for(i=0; i<n; i++)
+    key = msStringConcatenate(msStringConcatenate(key, "\n"), params[i]);
+  msFreeCharArray(params, n);
+
+  return key;
+}
+
+static void msLegendWriteResponse(const unsigned char *data, int size, const char *mimetype)
+{
+  if(mimetype) {
+    msIO_setHeader("Content-Type", "%s", mimetype);
+    msIO_sendHeaders();
+  }
+  msIO_fwrite(data, 1, size, stdout);
+}
+
+/*
+** Runs func(cbdata), a legend or legend icon request writing its response to
+** stdout, through the legend cache when ttl is positive. mapfile is the file
+** map was loaded from, NULL to disable the cache. Returns the status of func,
+** MS_SUCCESS when the response came from the cache.
+*/
+int msLegendDispatchCached(mapObj *map, cgiRequestObj *request, const char *mapfile, int ttl,
+                           msLegendDispatchFunc func, void *cbdata)
+{
+  msIOContext *old_context;
+  msIOBuffer *buffer;
+  unsigned char *data = NULL;
+  char *key, *mimetype = NULL;
+  int i, size = 0, status, hit = MS_FALSE;
+
+  if(ttl <= 0 || (key = msLegendCacheKey(request, mapfile)) == NULL)
+    return func(cbdata);
+
+  msAcquireLock(TLOCK_LEGENDCACHE);
+  if((i = msLegendCacheFind(key)) >= 0) {
+    if(time(NULL) - legendCache[i].created < ttl) {
+      size = legendCache[i].size;
+      data = (unsigned char *) msSmallMalloc(size);
+      memcpy(data, legendCache[i].data, size);
+      if(legendCache[i].mimetype)
+        mimetype = msStrdup(legendCache[i].mimetype);
+      legendCache[i].last_used = ++legendCacheClock;
+      hit = MS_TRUE;
+    } else
+      msLegendCacheRemove(i);
+  }
+  msReleaseLock(TLOCK_LEGENDCACHE);
+  msMetricsCacheLookup(MS_METRICS_CACHE_LEGEND, hit);
+
+  if(hit) {
+    if(map && map->debug >= MS_DEBUGLEVEL_V)
+      msDebug("msLegendDispatchCached(): legend served from the cache.\n");
+    msLegendWriteResponse(data, size, mimetype);
+    free(data);
+    msFree(mimetype);
+    free(key);
+    return MS_SUCCESS;
+  }
+
+  /* render in a buffer to keep a copy of the response */
+  old_context = msIO_pushStdoutToBufferAndGetOldContext();
+  status = func(cbdata);
+  if(status == MS_SUCCESS)
+    mimetype = msIO_stripStdoutBufferContentType();
+  buffer = (msIOBuffer *) msIO_getHandler(stdout)->cbData;
+  size = buffer->data_offset;
+  data = (unsigned char *) msSmallMalloc(size + 1);
+  memcpy(data, buffer->data, size);
+  msIO_restoreOldStdoutContext(old_context);
+
+  msLegendWriteResponse(data, size, mimetype);
+
+  /* exceptions (XML documents) are not kept */
+  if(status == MS_SUCCESS && size > 0 && !msIO_isRequestOutputPartial() &&
+      !(mimetype && strstr(mimetype, "xml")))
+    msLegendCacheInsert(key, data, size, mimetype);
+
+  free(data);
+  msFree(mimetype);
+  free(key);
+  return status;
+}
+
+void msLegendCacheCleanup(void)
+{
+  msAcquireLock(TLOCK_LEGENDCACHE);
+  while(legendCacheCount > 0)
+    msLegendCacheRemove(legendCacheCount - 1);
+  msReleaseLock(TLOCK_LEGENDCACHE);
+}
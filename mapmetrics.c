@@ -0,0 +1,625 @@
+/******************************************************************************
+ * $Id$
+ *
+ * Project:  MapServer
+ * Purpose:  Process metrics in the Prometheus text format
+ * Author:   MapServer team.
+ *
+ ******************************************************************************
+ * Copyright (c) 1996-2016 Regents of the University of Minnesota.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies of this Software or works derived from this Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+/*
+** Process metrics, enabled by the MS_METRICS environment variable set to
+** ON: every mapserv request adds up its latency (by service and request
+** type), failure and layer timings (the map statistics, see
+** msStatsCreate()) to process local counters, so do the cache lookups and
+** the connection pool. The counters are exported in the Prometheus text
+** format:
+**
+** - by the requests with mode=metrics, served without any mapfile. With
+**   several FastCGI processes each answers for itself, the pid label tells
+**   them apart.
+** - to the file named by the MS_METRICS_FILE environment variable, "%d"
+**   being replaced by the pid, rewritten at most every
+**   MS_METRICS_FILE_INTERVAL seconds after a request (the textfile
+**   collector of a sidecar node exporter scrapes these).
+**
+** Lock waits are included when the locks are counted (MS_LOCK_STATS=ON,
+** see msThreadLockStatsReport()). The number of distinct request types and
+** layers is bounded, the ones beyond are left out.
+**
+** Slow request log, enabled by the MS_SLOW_REQUEST_LOG environment variable
+** naming a file ("%d" being replaced by the pid, "stderr" for the standard
+** error): the requests that took longer than MS_SLOW_REQUEST_THRESHOLD
+** milliseconds (1000 by default) are appended to it as lines of JSON with
+** their parameters (sorted by name), the map statistics (timings by stage,
+** features and vertices by layer, memory) and the cache lookups they made.
+** Only one slow request in MS_SLOW_REQUEST_SAMPLE (1 by default) is logged,
+** and at most MS_SLOW_REQUEST_RATE (60 by default) a minute, each entry
+** telling how many were skipped since the previous one.
+*/
+
+#include "mapserver.h"
+#include "mapthread.h"
+#include <ctype.h>
+#include <stdarg.h>
+
+#define MS_METRICS_MAX_REQUESTS 64
+#define MS_METRICS_MAX_LAYERS 256
+#define MS_METRICS_NAME_LEN 48
+#define MS_METRICS_FILE_INTERVAL 10
+#define MS_SLOWLOG_QUERY_LEN 4096
+#define MS_SLOWLOG_VALUE_LEN 256
+
+static const double latency_buckets[] = { 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10 };
+#define MS_METRICS_NUM_BUCKETS ((int)(sizeof(latency_buckets)/sizeof(latency_buckets[0])))
+
+static const char *cache_names[MS_METRICS_NUM_CACHES] = { "map", "tile", "legend", "wms", "connection_pool" };
+
+static const char *stage_names[MS_STATS_NUMSTAGES] = { "load", "open", "whichshapes", "nextshape", "classify",
+                                                        "project", "render", "labelcache", "encode"
+                                                      };
+
+typedef struct {
+  char service[MS_METRICS_NAME_LEN];
+  char request[MS_METRICS_NAME_LEN];
+  unsigned long buckets[MS_METRICS_NUM_BUCKETS]; /* not cumulative */
+  unsigned long count;
+  unsigned long failed;
+  double sum;
+} requestMetricsObj;
+
+typedef struct {
+  char map[MS_METRICS_NAME_LEN];
+  char layer[MS_METRICS_NAME_LEN];
+  double seconds[MS_STATS_NUMSTAGES]; /* render not including project */
+  double total;
+  unsigned long read, drawn, vertices;
+} layerMetricsObj;
+
+/*
+** These static structures are protected by the TLOCK_METRICS mutex.
+*/
+static requestMetricsObj request_metrics[MS_METRICS_MAX_REQUESTS];
+static int num_request_metrics = 0;
+static layerMetricsObj layer_metrics[MS_METRICS_MAX_LAYERS];
+static int num_layer_metrics = 0;
+static unsigned long cache_lookups[MS_METRICS_NUM_CACHES][2]; /* misses, hits */
+static time_t metrics_file_written = 0;
+
+static unsigned long slowlog_seen = 0; /* slow requests */
+static unsigned long slowlog_skipped = 0; /* since the last entry */
+static time_t slowlog_window = 0; /* start of the minute of the rate limit */
+static int slowlog_window_count = 0;
+
+static int metrics_enabled = MS_FALSE;
+static const char *slowlog_path = NULL;
+static double slowlog_threshold = 1.0;
+static int slowlog_sample = 1;
+static int slowlog_rate = 60;
+static msOnceObj metrics_once = MS_ONCE_INIT;
+
+/* cache lookups of the request being served */
+#if defined(MS_THREAD_LOCAL)
+static MS_THREAD_LOCAL unsigned int slowlog_cache_lookups[MS_METRICS_NUM_CACHES][2];
+#define MS_SLOWLOG_CACHE_LOOKUPS
+#elif !defined(USE_THREAD)
+static unsigned int slowlog_cache_lookups[MS_METRICS_NUM_CACHES][2];
+#define MS_SLOWLOG_CACHE_LOOKUPS
+#endif
+
+static void msMetricsInit(void)
+{
+  const char *value = getenv("MS_METRICS");
+
+  metrics_enabled = value && (strcasecmp(value, "ON") == 0 || strcmp(value, "1") == 0);
+
+  value = getenv("MS_SLOW_REQUEST_LOG");
+  if(value && *value)
+    slowlog_path = value;
+  if((value = getenv("MS_SLOW_REQUEST_THRESHOLD")) != NULL && atof(value) >= 0)
+    slowlog_threshold = atof(value) / 1000.0;
+  if((value = getenv("MS_SLOW_REQUEST_SAMPLE")) != NULL && atoi(value) > 0)
+    slowlog_sample = atoi(value);
+  if((value = getenv("MS_SLOW_REQUEST_RATE")) != NULL && atoi(value) > 0)
+    slowlog_rate = atoi(value);
+}
+
+/************************************************************************/
+/*                          msMetricsEnabled()                          */
+/************************************************************************/
+
+int msMetricsEnabled(void)
+{
+  msCallOnce(&metrics_once, msMetricsInit);
+  return metrics_enabled;
+}
+
+/************************************************************************/
+/*                        msMetricsCacheLookup()                        */
+/*                                                                      */
+/*      Counts a lookup of one of the MS_METRICS_CACHE_* caches.        */
+/************************************************************************/
+
+void msMetricsCacheLookup(int cache, int hit)
+{
+  if(cache < 0 || cache >= MS_METRICS_NUM_CACHES)
+    return;
+
+#ifdef MS_SLOWLOG_CACHE_LOOKUPS
+  if(msSlowLogEnabled())
+    slowlog_cache_lookups[cache][hit ? 1 : 0]++;
+#endif
+  if(!msMetricsEnabled())
+    return;
+
+  msAcquireLock(TLOCK_METRICS);
+  cache_lookups[cache][hit ? 1 : 0]++;
+  msReleaseLock(TLOCK_METRICS);
+}
+
+/* copies a label value, keeping it short and to the characters of names */
+static void msMetricsCopyName(char *dst, const char *src)
+{
+  int i;
+
+  for(i=0; src && src[i] && i < MS_METRICS_NAME_LEN-1; i++)
+    dst[i] = (isalnum((unsigned char)src[i]) || strchr("_-.:", src[i])) ? src[i] : '_';
+  dst[i] = '\0';
+}
+
+static layerMetricsObj *msMetricsFindLayer(const char *map, const char *layer)
+{
+  char mapname[MS_METRICS_NAME_LEN], layername[MS_METRICS_NAME_LEN];
+  int i;
+
+  msMetricsCopyName(mapname, map);
+  msMetricsCopyName(layername, layer);
+  for(i=0; i<num_layer_metrics; i++) {
+    if(strcmp(layer_metrics[i].map, mapname) == 0 && strcmp(layer_metrics[i].layer, layername) == 0)
+      return &layer_metrics[i];
+  }
+  if(num_layer_metrics == MS_METRICS_MAX_LAYERS)
+    return NULL;
+
+  strcpy(layer_metrics[num_layer_metrics].map, mapname);
+  strcpy(layer_metrics[num_layer_metrics].layer, layername);
+  return &layer_metrics[num_layer_metrics++];
+}
+
+/************************************************************************/
+/*                      msMetricsObserveRequest()                       */
+/*                                                                      */
+/*      Adds up a request of the given service and request type (eg.    */
+/*      "WMS" and "GetMap"), and the statistics of its map if any.      */
+/************************************************************************/
+
+void msMetricsObserveRequest(mapObj *map, const char *service, const char *request, double seconds, int failed)
+{
+  char servicename[MS_METRICS_NAME_LEN], requestname[MS_METRICS_NAME_LEN];
+  requestMetricsObj *rm = NULL;
+  int i, s;
+
+  if(!msMetricsEnabled())
+    return;
+
+  msMetricsCopyName(servicename, service);
+  msMetricsCopyName(requestname, request);
+
+  msAcquireLock(TLOCK_METRICS);
+
+  for(i=0; i<num_request_metrics; i++) {
+    if(strcasecmp(request_metrics[i].service, servicename) == 0 && strcasecmp(request_metrics[i].request, requestname) == 0) {
+      rm = &request_metrics[i];
+      break;
+    }
+  }
+  if(!rm && num_request_metrics < MS_METRICS_MAX_REQUESTS) {
+    rm = &request_metrics[num_request_metrics++];
+    strcpy(rm->service, servicename);
+    strcpy(rm->request, requestname);
+  }
+  if(rm) {
+    for(i=0; i<MS_METRICS_NUM_BUCKETS && seconds > latency_buckets[i]; i++) ;
+    if(i < MS_METRICS_NUM_BUCKETS)
+      rm->buckets[i]++;
+    rm->count++;
+    rm->sum += seconds;
+    if(failed)
+      rm->failed++;
+  }
+
+  if(map && map->stats) {
+    for(i=0; i<map->stats->numlayers && i<map->numlayers; i++) {
+      layerStatsObj *ls = &map->stats->layers[i];
+      layerMetricsObj *lm;
+
+      if(ls->total == 0 && ls->read == 0)
+        continue;
+      if((lm = msMetricsFindLayer(map->name, GET_LAYER(map, i)->name)) == NULL)
+        break;
+      for(s=MS_STATS_OPEN; s<=MS_STATS_RENDER; s++)
+        lm->seconds[s] += (s == MS_STATS_RENDER) ? MS_MAX(0, ls->seconds[s] - ls->seconds[MS_STATS_PROJECT]) : ls->seconds[s];
+      lm->total += ls->total;
+      lm->read += ls->read;
+      lm->drawn += ls->drawn;
+      lm->vertices += ls->vertices;
+    }
+  }
+
+  msReleaseLock(TLOCK_METRICS);
+}
+
+static void msMetricsAppend(bufferObj *buffer, const char *pszFormat, ...)
+{
+  char szBuffer[512];
+  va_list args;
+  int n;
+
+  va_start(args, pszFormat);
+  n = vsnprintf(szBuffer, sizeof(szBuffer), pszFormat, args);
+  va_end(args);
+
+  if(n > 0)
+    msBufferAppend(buffer, szBuffer, MS_MIN(n, (int)sizeof(szBuffer) - 1));
+}
+
+/************************************************************************/
+/*                          msMetricsToText()                           */
+/*                                                                      */
+/*      Returns the metrics in the Prometheus text format, to be        */
+/*      freed by the caller.                                            */
+/************************************************************************/
+
+char *msMetricsToText(void)
+{
+  bufferObj buffer;
+  int i, j, pid = (int) getpid();
+  int connections = 0, inuse = 0;
+  unsigned long cumulative;
+  char nul = '\0';
+
+  msBufferInit(&buffer);
+  msConnPoolStats(&connections, &inuse);
+
+  msAcquireLock(TLOCK_METRICS);
+
+  msMetricsAppend(&buffer, "# HELP mapserver_request_duration_seconds Request processing time, mapfile load included.\n"
+                  "# TYPE mapserver_request_duration_seconds histogram\n");
+  for(i=0; i<num_request_metrics; i++) {
+    requestMetricsObj *rm = &request_metrics[i];
+
+    cumulative = 0;
+    for(j=0; j<MS_METRICS_NUM_BUCKETS; j++) {
+      cumulative += rm->buckets[j];
+      msMetricsAppend(&buffer, "mapserver_request_duration_seconds_bucket{pid=\"%d\",service=\"%s\",request=\"%s\",le=\"%g\"} %lu\n",
+                      pid, rm->service, rm->request, latency_buckets[j], cumulative);
+    }
+    msMetricsAppend(&buffer, "mapserver_request_duration_seconds_bucket{pid=\"%d\",service=\"%s\",request=\"%s\",le=\"+Inf\"} %lu\n",
+                    pid, rm->service, rm->request, rm->count);
+    msMetricsAppend(&buffer, "mapserver_request_duration_seconds_sum{pid=\"%d\",service=\"%s\",request=\"%s\"} %.6f\n",
+                    pid, rm->service, rm->request, rm->sum);
+    msMetricsAppend(&buffer, "mapserver_request_duration_seconds_count{pid=\"%d\",service=\"%s\",request=\"%s\"} %lu\n",
+                    pid, rm->service, rm->request, rm->count);
+  }
+
+  msMetricsAppend(&buffer, "# HELP mapserver_request_failures_total Requests that ended with an error.\n"
+                  "# TYPE mapserver_request_failures_total counter\n");
+  for(i=0; i<num_request_metrics; i++)
+    msMetricsAppend(&buffer, "mapserver_request_failures_total{pid=\"%d\",service=\"%s\",request=\"%s\"} %lu\n",
+                    pid, request_metrics[i].service, request_metrics[i].request, request_metrics[i].failed);
+
+  msMetricsAppend(&buffer, "# HELP mapserver_layer_seconds_total Layer drawing time by stage (total: all of it).\n"
+                  "# TYPE mapserver_layer_seconds_total counter\n");
+  for(i=0; i<num_layer_metrics; i++) {
+    layerMetricsObj *lm = &layer_metrics[i];
+
+    msMetricsAppend(&buffer, "mapserver_layer_seconds_total{pid=\"%d\",map=\"%s\",layer=\"%s\",stage=\"total\"} %.6f\n",
+                    pid, lm->map, lm->layer, lm->total);
+    for(j=MS_STATS_OPEN; j<=MS_STATS_RENDER; j++)
+      msMetricsAppend(&buffer, "mapserver_layer_seconds_total{pid=\"%d\",map=\"%s\",layer=\"%s\",stage=\"%s\"} %.6f\n",
+                      pid, lm->map, lm->layer, stage_names[j], lm->seconds[j]);
+  }
+
+  msMetricsAppend(&buffer, "# HELP mapserver_layer_features_total Layer features read and drawn.\n"
+                  "# TYPE mapserver_layer_features_total counter\n");
+  for(i=0; i<num_layer_metrics; i++) {
+    msMetricsAppend(&buffer, "mapserver_layer_features_total{pid=\"%d\",map=\"%s\",layer=\"%s\",state=\"read\"} %lu\n",
+                    pid, layer_metrics[i].map, layer_metrics[i].layer, layer_metrics[i].read);
+    msMetricsAppend(&buffer, "mapserver_layer_features_total{pid=\"%d\",map=\"%s\",layer=\"%s\",state=\"drawn\"} %lu\n",
+                    pid, layer_metrics[i].map, layer_metrics[i].layer, layer_metrics[i].drawn);
+  }
+
+  msMetricsAppend(&buffer, "# HELP mapserver_layer_vertices_total Vertices of the layer features drawn.\n"
+                  "# TYPE mapserver_layer_vertices_total counter\n");
+  for(i=0; i<num_layer_metrics; i++)
+    msMetricsAppend(&buffer, "mapserver_layer_vertices_total{pid=\"%d\",map=\"%s\",layer=\"%s\"} %lu\n",
+                    pid, layer_metrics[i].map, layer_metrics[i].layer, layer_metrics[i].vertices);
+
+  msMetricsAppend(&buffer, "# HELP mapserver_cache_lookups_total Cache lookups by result.\n"
+                  "# TYPE mapserver_cache_lookups_total counter\n");
+  for(i=0; i<MS_METRICS_NUM_CACHES; i++) {
+    msMetricsAppend(&buffer, "mapserver_cache_lookups_total{pid=\"%d\",cache=\"%s\",result=\"hit\"} %lu\n",
+                    pid, cache_names[i], cache_lookups[i][1]);
+    msMetricsAppend(&buffer, "mapserver_cache_lookups_total{pid=\"%d\",cache=\"%s\",result=\"miss\"} %lu\n",
+                    pid, cache_names[i], cache_lookups[i][0]);
+  }
+
+  msReleaseLock(TLOCK_METRICS);
+
+  msMetricsAppend(&buffer, "# HELP mapserver_pool_connections Pooled connections, open and in use.\n"
+                  "# TYPE mapserver_pool_connections gauge\n"
+                  "mapserver_pool_connections{pid=\"%d\",state=\"open\"} %d\n"
+                  "mapserver_pool_connections{pid=\"%d\",state=\"in_use\"} %d\n",
+                  pid, connections, pid, inuse);
+
+  {
+    const char *name;
+    unsigned long acquisitions, contended;
+    double wait_total;
+    int header = MS_FALSE;
+
+    for(i=1; i<TLOCK_STATIC_MAX; i++) {
+      if(!msThreadLockStatsGet(i, &name, &acquisitions, &contended, &wait_total))
+        break;
+      if(acquisitions == 0)
+        continue;
+      if(!header) {
+        msMetricsAppend(&buffer, "# HELP mapserver_lock_wait_seconds_total Time waited for the locks, since the last reset.\n"
+                        "# TYPE mapserver_lock_wait_seconds_total counter\n");
+        header = MS_TRUE;
+      }
+      msMetricsAppend(&buffer, "mapserver_lock_wait_seconds_total{pid=\"%d\",lock=\"%s\"} %.6f\n", pid, name, wait_total);
+      msMetricsAppend(&buffer, "mapserver_lock_acquisitions_total{pid=\"%d\",lock=\"%s\",contended=\"false\"} %lu\n",
+                      pid, name, acquisitions - contended);
+      msMetricsAppend(&buffer, "mapserver_lock_acquisitions_total{pid=\"%d\",lock=\"%s\",contended=\"true\"} %lu\n",
+                      pid, name, contended);
+    }
+  }
+
+  msBufferAppend(&buffer, &nul, 1);
+  return (char *) buffer.data;
+}
+
+/************************************************************************/
+/*                         msMetricsWriteFile()                         */
+/*                                                                      */
+/*      Rewrites the MS_METRICS_FILE if it is due.                      */
+/************************************************************************/
+
+void msMetricsWriteFile(void)
+{
+  const char *pattern = getenv("MS_METRICS_FILE");
+  char path[MS_MAXPATHLEN], tmppath[MS_MAXPATHLEN+32];
+  const char *pid_pos;
+  time_t now = time(NULL);
+  char *text;
+  FILE *fp;
+  int due;
+
+  if(!msMetricsEnabled() || !pattern || !*pattern)
+    return;
+
+  msAcquireLock(TLOCK_METRICS);
+  due = (now - metrics_file_written >= MS_METRICS_FILE_INTERVAL);
+  if(due)
+    metrics_file_written = now;
+  msReleaseLock(TLOCK_METRICS);
+  if(!due)
+    return;
+
+  if((pid_pos = strstr(pattern, "%d")) != NULL)
+    snprintf(path, sizeof(path), "%.*s%d%s", (int)(pid_pos - pattern), pattern, (int) getpid(), pid_pos + 2);
+  else
+    strlcpy(path, pattern, sizeof(path));
+  snprintf(tmppath, sizeof(tmppath), "%s.%d.tmp", path, (int) getpid());
+
+  text = msMetricsToText();
+  fp = fopen(tmppath, "wb");
+  if(fp) {
+    int ok = fwrite(text, 1, strlen(text), fp) == strlen(text);
+
+    if(fclose(fp) == 0 && ok && rename(tmppath, path) == 0) {
+      msFree(text);
+      return;
+    }
+    remove(tmppath);
+  }
+  msDebug("msMetricsWriteFile(): failed to write %s.\n", path);
+  msFree(text);
+}
+
+/************************************************************************/
+/*                          msSlowLogEnabled()                          */
+/************************************************************************/
+
+int msSlowLogEnabled(void)
+{
+  msCallOnce(&metrics_once, msMetricsInit);
+  return slowlog_path != NULL;
+}
+
+/************************************************************************/
+/*                           msSlowLogStart()                           */
+/*                                                                      */
+/*      Called as a request starts, before its cache lookups.           */
+/************************************************************************/
+
+void msSlowLogStart(void)
+{
+#ifdef MS_SLOWLOG_CACHE_LOOKUPS
+  if(msSlowLogEnabled())
+    memset(slowlog_cache_lookups, 0, sizeof(slowlog_cache_lookups));
+#endif
+}
+
+typedef struct {
+  const char *name;
+  int index;
+} slowLogParamObj;
+
+static int msSlowLogCompareParams(const void *a, const void *b)
+{
+  const slowLogParamObj *pa = (const slowLogParamObj *) a, *pb = (const slowLogParamObj *) b;
+  int c = strcasecmp(pa->name, pb->name);
+
+  return c ? c : pa->index - pb->index;
+}
+
+/* a JSON string of value, cut if longer than maxlen */
+static void msSlowLogAppendString(bufferObj *buffer, const char *value, size_t maxlen)
+{
+  char *cut, *escaped;
+
+  cut = msStrdup(value ? value : "");
+  if(strlen(cut) > maxlen)
+    strlcpy(cut + maxlen - 3, "...", 4);
+  escaped = msEscapeJSonString(cut);
+  msBufferAppend(buffer, "\"", 1);
+  msBufferAppend(buffer, escaped, strlen(escaped));
+  msBufferAppend(buffer, "\"", 1);
+  msFree(escaped);
+  msFree(cut);
+}
+
+/* the parameters sorted by (uppercased) name, long values cut */
+static void msSlowLogAppendQuery(bufferObj *buffer, char **names, char **values, int numparams)
+{
+  slowLogParamObj *params;
+  bufferObj query;
+  char nul = '\0';
+  int i;
+
+  msBufferInit(&query);
+  params = (slowLogParamObj *) msSmallMalloc(MS_MAX(numparams, 1) * sizeof(slowLogParamObj));
+  for(i = 0; i < numparams; i++) {
+    params[i].name = names[i];
+    params[i].index = i;
+  }
+  qsort(params, numparams, sizeof(slowLogParamObj), msSlowLogCompareParams);
+
+  for(i = 0; i < numparams && query.size < MS_SLOWLOG_QUERY_LEN; i++) {
+    const char *value = values[params[i].index];
+    char cut[MS_SLOWLOG_VALUE_LEN], *name, *encoded;
+
+    strlcpy(cut, value ? value : "", sizeof(cut));
+    if(value && strlen(value) >= sizeof(cut))
+      strlcpy(cut + sizeof(cut) - 4, "...", 4);
+    name = msStrdup(params[i].name);
+    msStringToUpper(name);
+    encoded = msEncodeUrl(cut);
+    if(i > 0)
+      msBufferAppend(&query, "&", 1);
+    msBufferAppend(&query, name, strlen(name));
+    msBufferAppend(&query, "=", 1);
+    msBufferAppend(&query, encoded, strlen(encoded));
+    msFree(encoded);
+    msFree(name);
+  }
+  msBufferAppend(&query, &nul, 1);
+  msFree(params);
+
+  msSlowLogAppendString(buffer, (char *) query.data, MS_SLOWLOG_QUERY_LEN);
+  msBufferFree(&query);
+}
+
+/************************************************************************/
+/*                          msSlowLogRequest()                          */
+/*                                                                      */
+/*      Logs a request that took seconds if it was slow, and is         */
+/*      sampled within the rate limit. map may be NULL.                 */
+/************************************************************************/
+
+void msSlowLogRequest(mapObj *map, char **names, char **values, int numparams,
+                      const char *service, const char *request, double seconds, int failed)
+{
+  char path[MS_MAXPATHLEN], timestamp[32], *text;
+  const char *pid_pos;
+  time_t now = time(NULL);
+  unsigned long skipped;
+  bufferObj buffer;
+  int i;
+  FILE *fp;
+
+  if(!msSlowLogEnabled() || seconds < slowlog_threshold)
+    return;
+
+  msAcquireLock(TLOCK_METRICS);
+  if(now - slowlog_window >= 60) {
+    slowlog_window = now;
+    slowlog_window_count = 0;
+  }
+  if(slowlog_seen++ % slowlog_sample != 0 || slowlog_window_count >= slowlog_rate) {
+    slowlog_skipped++;
+    msReleaseLock(TLOCK_METRICS);
+    return;
+  }
+  slowlog_window_count++;
+  skipped = slowlog_skipped;
+  slowlog_skipped = 0;
+  strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+  msReleaseLock(TLOCK_METRICS);
+
+  msBufferInit(&buffer);
+  msMetricsAppend(&buffer, "{\"time\":\"%s\",\"pid\":%d,\"seconds\":%.6f,\"failed\":%s,\"skipped\":%lu,\"service\":",
+                  timestamp, (int) getpid(), seconds, failed ? "true" : "false", skipped);
+  msSlowLogAppendString(&buffer, service, MS_SLOWLOG_VALUE_LEN);
+  msBufferAppend(&buffer, ",\"request\":", 11);
+  msSlowLogAppendString(&buffer, request, MS_SLOWLOG_VALUE_LEN);
+  msBufferAppend(&buffer, ",\"map\":", 7);
+  msSlowLogAppendString(&buffer, map ? map->name : NULL, MS_SLOWLOG_VALUE_LEN);
+  msBufferAppend(&buffer, ",\"query\":", 9);
+  msSlowLogAppendQuery(&buffer, names, values, numparams);
+  msBufferAppend(&buffer, ",\"cache\":{", 10);
+#ifdef MS_SLOWLOG_CACHE_LOOKUPS
+  for(i = 0; i < MS_METRICS_NUM_CACHES; i++)
+    msMetricsAppend(&buffer, "%s\"%s\":{\"hits\":%u,\"misses\":%u}", i > 0 ? "," : "", cache_names[i],
+                    slowlog_cache_lookups[i][1], slowlog_cache_lookups[i][0]);
+#else
+  (void) i;
+#endif
+  text = map ? msStatsToJSON(map) : msStrdup("{}");
+  msBufferAppend(&buffer, "},\"stats\":", 10);
+  msBufferAppend(&buffer, text, strlen(text));
+  msBufferAppend(&buffer, "}\n", 2);
+  msFree(text);
+
+  /* one write per entry, the lines of the threads do not interleave */
+  msAcquireLock(TLOCK_METRICS);
+  if(strcasecmp(slowlog_path, "stderr") == 0) {
+    fwrite(buffer.data, 1, buffer.size, stderr);
+    fp = stderr;
+  } else {
+    if((pid_pos = strstr(slowlog_path, "%d")) != NULL)
+      snprintf(path, sizeof(path), "%.*s%d%s", (int)(pid_pos - slowlog_path), slowlog_path, (int) getpid(), pid_pos + 2);
+    else
+      strlcpy(path, slowlog_path, sizeof(path));
+    if((fp = fopen(path, "ab")) != NULL) {
+      fwrite(buffer.data, 1, buffer.size, fp);
+      fclose(fp);
+    }
+  }
+  msReleaseLock(TLOCK_METRICS);
+  if(!fp)
+    msDebug("msSlowLogRequest(): failed to write %s.\n", path);
+  msBufferFree(&buffer);
+}
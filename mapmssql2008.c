@@ -190,6 +190,16 @@ typedef struct msODBCconn_t {
   SQLHDBC     hdbc;               /* ODBC HDBC */
   SQLHSTMT    hstmt;              /* ODBC HSTMNT */
   char        errorMessage[1024]; /* Last error message if any */
+
+  /* block fetching of the statement into bound columns, see bindRowArray() */
+  int         rowArraySize;       /* rows per SQLFetch(), 0 when the columns are not bound */
+  int         numBound;
+  SQLLEN      *boundSize;         /* bytes per value of each column */
+  char        **boundData;        /* rowArraySize values of each column */
+  SQLLEN      **boundLen;         /* their lengths or indicators */
+  SQLULEN     rowsFetched;        /* rows of the current rowset */
+  SQLULEN     rowsetRow;          /* current row in it */
+  long        rowsetFirst;        /* rows of the result before the current rowset */
 } msODBCconn;
 
 typedef struct ms_MSSQL2008_layer_info_t {
@@ -207,6 +217,9 @@ typedef struct ms_MSSQL2008_layer_info_t {
   msGeometryParserInfo gpi;   /* struct for the geometry parser */
   int geometry_format;        /* Geometry format to be retrieved from the database */
   tokenListNodeObjPtr current_node; /* filter expression translation */
+  int row_array_size;         /* rows fetched at once by the draw query, PROCESSING "ROW_ARRAY_SIZE", 0 for one at a time */
+  SQLLEN row_value_size;      /* bytes bound per attribute value, PROCESSING "ROW_ARRAY_VALUE_SIZE", grows as needed */
+  SQLLEN row_geometry_size;   /* bytes bound per geometry, PROCESSING "ROW_ARRAY_GEOMETRY_SIZE", grows as needed */
 } msMSSQL2008LayerInfo;
 
 #define SQL_COLUMN_NAME_MAX_LENGTH 128
@@ -507,6 +520,9 @@ static char *strstrIgnoreCase(const char *haystack, const char *needle)
 
 static int msMSSQL2008LayerParseData(layerObj *layer, char **geom_column_name, char **geom_column_type, char **table_name, char **urid_name, char **user_srid, char **index_name, char **sort_spec, int debug);
 
+static void unbindRowArray(msODBCconn *conn);
+static void bindDrawQuery(layerObj *layer, msMSSQL2008LayerInfo *layerinfo);
+
 /* Close connection and handles */
 static void msMSSQL2008CloseConnection(void *conn_handle)
 {
@@ -516,6 +532,8 @@ static void msMSSQL2008CloseConnection(void *conn_handle)
     return;
   }
 
+  unbindRowArray(conn);
+
   if (conn->hstmt) {
     SQLFreeHandle(SQL_HANDLE_STMT, conn->hstmt);
   }
@@ -590,6 +608,8 @@ static int executeSQL(msODBCconn *conn, const char * sql)
 {
   SQLRETURN rc;
 
+  unbindRowArray(conn); /* rows are read one at a time unless bound again */
+
   SQLCloseCursor(conn->hstmt);
 
   rc = SQLExecDirect(conn->hstmt, (SQLCHAR *) sql, SQL_NTS);
@@ -602,6 +622,119 @@ static int executeSQL(msODBCconn *conn, const char * sql)
   }
 }
 
+/* Go back to reading the rows of the statement one at a time with SQLGetData() */
+static void unbindRowArray(msODBCconn *conn)
+{
+  int i;
+
+  if (conn->rowArraySize == 0)
+    return;
+
+  SQLFreeStmt(conn->hstmt, SQL_UNBIND);
+  SQLSetStmtAttr(conn->hstmt, SQL_ATTR_ROW_ARRAY_SIZE, (SQLPOINTER) 1, 0);
+  SQLSetStmtAttr(conn->hstmt, SQL_ATTR_ROWS_FETCHED_PTR, NULL, 0);
+
+  for (i = 0; i < conn->numBound; i++) {
+    msFree(conn->boundData[i]);
+    msFree(conn->boundLen[i]);
+  }
+  msFree(conn->boundData);
+  msFree(conn->boundLen);
+  msFree(conn->boundSize);
+  conn->boundData = NULL;
+  conn->boundLen = NULL;
+  conn->boundSize = NULL;
+  conn->numBound = 0;
+  conn->rowArraySize = 0;
+}
+
+/* Bind the numCols columns of the executed statement to buffers of sizes[i] bytes
+   per value, and fetch rowArraySize rows at once. Returns 0 if the driver refused,
+   the rows are then read one at a time. */
+static int bindRowArray(msODBCconn *conn, int numCols, int rowArraySize, const SQLLEN *sizes)
+{
+  SQLRETURN rc;
+  int i;
+
+  unbindRowArray(conn);
+
+  conn->boundSize = (SQLLEN *) msSmallMalloc(sizeof(SQLLEN) * numCols);
+  conn->boundData = (char **) msSmallCalloc(numCols, sizeof(char *));
+  conn->boundLen = (SQLLEN **) msSmallCalloc(numCols, sizeof(SQLLEN *));
+  conn->numBound = numCols;
+  conn->rowArraySize = rowArraySize;
+  conn->rowsFetched = 0;
+  conn->rowsetRow = 0;
+  conn->rowsetFirst = 0;
+
+  rc = SQLSetStmtAttr(conn->hstmt, SQL_ATTR_ROW_BIND_TYPE, (SQLPOINTER) SQL_BIND_BY_COLUMN, 0);
+  if (rc == SQL_SUCCESS || rc == SQL_SUCCESS_WITH_INFO)
+    rc = SQLSetStmtAttr(conn->hstmt, SQL_ATTR_ROW_ARRAY_SIZE, (SQLPOINTER) (SQLULEN) rowArraySize, 0);
+  if (rc == SQL_SUCCESS || rc == SQL_SUCCESS_WITH_INFO)
+    rc = SQLSetStmtAttr(conn->hstmt, SQL_ATTR_ROWS_FETCHED_PTR, (SQLPOINTER) &conn->rowsFetched, 0);
+
+  for (i = 0; i < numCols && (rc == SQL_SUCCESS || rc == SQL_SUCCESS_WITH_INFO); i++) {
+    conn->boundSize[i] = sizes[i];
+    conn->boundData[i] = (char *) msSmallMalloc(sizes[i] * rowArraySize);
+    conn->boundLen[i] = (SQLLEN *) msSmallMalloc(sizeof(SQLLEN) * rowArraySize);
+    rc = SQLBindCol(conn->hstmt, (SQLUSMALLINT)(i + 1), SQL_C_BINARY, conn->boundData[i], sizes[i], conn->boundLen[i]);
+  }
+
+  if (rc != SQL_SUCCESS && rc != SQL_SUCCESS_WITH_INFO) {
+    unbindRowArray(conn);
+    return 0;
+  }
+
+  return 1;
+}
+
+/* Move to the next row of the statement, from the current rowset if it has more */
+static SQLRETURN fetchRow(msODBCconn *conn)
+{
+  SQLRETURN rc;
+
+  if (conn->rowArraySize == 0)
+    return SQLFetch(conn->hstmt);
+
+  if (conn->rowsetRow + 1 < conn->rowsFetched) {
+    conn->rowsetRow++;
+    return SQL_SUCCESS;
+  }
+
+  conn->rowsetFirst += (long) conn->rowsFetched;
+  conn->rowsFetched = 0;
+  conn->rowsetRow = 0;
+
+  rc = SQLFetch(conn->hstmt);
+  if ((rc == SQL_SUCCESS || rc == SQL_SUCCESS_WITH_INFO) && conn->rowsFetched == 0)
+    rc = SQL_NO_DATA;
+
+  return rc;
+}
+
+/* Value of column col (1..n) of the current row in the bound rowset, NULL if it is
+   NULL or empty. If it did not fit *truncated is set and *len is the size needed
+   or SQL_NO_TOTAL. */
+static char *boundColumnData(msODBCconn *conn, int col, SQLLEN *len, int *truncated)
+{
+  SQLLEN ind = conn->boundLen[col - 1][conn->rowsetRow];
+
+  *truncated = 0;
+  *len = 0;
+
+  if (ind == SQL_NULL_DATA || ind == 0)
+    return NULL;
+
+  if (ind == SQL_NO_TOTAL || ind > conn->boundSize[col - 1]) {
+    *truncated = 1;
+    *len = ind;
+    return NULL;
+  }
+
+  *len = ind;
+  return conn->boundData[col - 1] + conn->boundSize[col - 1] * conn->rowsetRow;
+}
+
 /* Get columns name from query results */
 static int columnName(msODBCconn *conn, int index, char *buffer, int bufferLength, layerObj *layer, char pass_field_def)
 {
@@ -749,6 +882,17 @@ int msMSSQL2008LayerOpen(layerObj *layer)
   layerinfo->sort_spec = NULL;
   layerinfo->conn = NULL;
 
+  /* block fetching of the draw queries */
+  layerinfo->row_array_size = 0;
+  layerinfo->row_value_size = 256;
+  layerinfo->row_geometry_size = 65536;
+  if (msLayerGetProcessingKey(layer, "ROW_ARRAY_SIZE"))
+    layerinfo->row_array_size = atoi(msLayerGetProcessingKey(layer, "ROW_ARRAY_SIZE"));
+  if (msLayerGetProcessingKey(layer, "ROW_ARRAY_VALUE_SIZE") && atoi(msLayerGetProcessingKey(layer, "ROW_ARRAY_VALUE_SIZE")) > 0)
+    layerinfo->row_value_size = atoi(msLayerGetProcessingKey(layer, "ROW_ARRAY_VALUE_SIZE"));
+  if (msLayerGetProcessingKey(layer, "ROW_ARRAY_GEOMETRY_SIZE") && atoi(msLayerGetProcessingKey(layer, "ROW_ARRAY_GEOMETRY_SIZE")) > 0)
+    layerinfo->row_geometry_size = atoi(msLayerGetProcessingKey(layer, "ROW_ARRAY_GEOMETRY_SIZE"));
+
   layerinfo->conn = (msODBCconn *) msConnPoolRequest(layer);
 
   if(!layerinfo->conn) {
@@ -1133,6 +1277,8 @@ int msMSSQL2008LayerWhichShapes(layerObj *layer, rectObj rect, int isQuery)
   layerinfo->sql = query_str;
   layerinfo->row_num = 0;
 
+  bindDrawQuery(layer, layerinfo);
+
   return MS_SUCCESS;
 }
 
@@ -1158,6 +1304,8 @@ int msMSSQL2008LayerClose(layerObj *layer)
   }
 
   if(layerinfo) {
+    if(layerinfo->conn)
+      unbindRowArray(layerinfo->conn); /* the next user of the pooled statement reads it row by row */
     msConnPoolRelease(layer, layerinfo->conn);
 
     layerinfo->conn = NULL;
@@ -1644,19 +1792,123 @@ static void find_bounds(shapeObj *shape)
   }
 }
 
+/* Bind the columns of the draw query just executed, if PROCESSING "ROW_ARRAY_SIZE" is set */
+static void bindDrawQuery(layerObj *layer, msMSSQL2008LayerInfo *layerinfo)
+{
+  SQLLEN *sizes;
+  int t;
+
+  if (layerinfo->row_array_size <= 0)
+    return;
+
+  /* the attributes, the geometry and the unique id */
+  sizes = (SQLLEN *) msSmallMalloc(sizeof(SQLLEN) * (layer->numitems + 2));
+  for (t = 0; t < layer->numitems; t++)
+    sizes[t] = layerinfo->row_value_size;
+  sizes[layer->numitems] = layerinfo->row_geometry_size;
+  sizes[layer->numitems + 1] = 80; /* varchar(36) */
+
+  if (!bindRowArray(layerinfo->conn, layer->numitems + 2, layerinfo->row_array_size, sizes) && layer->debug)
+    msDebug("msMSSQL2008Layer: could not bind the columns, fetching one row at a time.\n");
+
+  msFree(sizes);
+}
+
+/* A value of column col of the current row did not fit its bound buffer, needing
+   len bytes (or SQL_NO_TOTAL). Forward only cursors cannot go back, so the draw
+   query is run again with larger buffers and read up to the same row. */
+static int refetchDrawQuery(layerObj *layer, msMSSQL2008LayerInfo *layerinfo, int col, SQLLEN len)
+{
+  msODBCconn *conn = layerinfo->conn;
+  long row = conn->rowsetFirst + (long) conn->rowsetRow, i;
+  SQLLEN size = conn->boundSize[col - 1] * 2;
+
+  if (len != SQL_NO_TOTAL && len > size)
+    size = len;
+
+  if (col == layer->numitems + 1)
+    layerinfo->row_geometry_size = size;
+  else
+    layerinfo->row_value_size = size;
+
+  if (layer->debug)
+    msDebug("msMSSQL2008Layer: column %d of row %ld needs more than %ld bytes, reading again with %ld.\n",
+            col, row, (long) conn->boundSize[col - 1], (long) size);
+
+  if (!executeSQL(conn, layerinfo->sql)) {
+    msSetError(MS_QUERYERR, "Error executing MSSQL2008 SQL statement: %s\n-%s\n", "msMSSQL2008LayerGetShape()", layerinfo->sql, conn->errorMessage);
+    return MS_FAILURE;
+  }
+  bindDrawQuery(layer, layerinfo);
+
+  for (i = 0; i <= row; i++) {
+    SQLRETURN rc = fetchRow(conn);
+    if (rc != SQL_SUCCESS && rc != SQL_SUCCESS_WITH_INFO) {
+      msSetError(MS_QUERYERR, "Rows of the MSSQL2008 SQL statement changed while reading it again: %s", "msMSSQL2008LayerGetShape()", layerinfo->sql);
+      return MS_FAILURE;
+    }
+  }
+
+  return MS_SUCCESS;
+}
+
+/* Value of column col (1..n) of the current row in a new buffer, with offset bytes
+   free before it and 2 after, NULL for NULL or empty values. *truncated is set when
+   a bound value did not fit, see refetchDrawQuery(). */
+static char *getColumnData(layerObj *layer, msODBCconn *conn, int col, int offset, SQLLEN *len, int *truncated)
+{
+  SQLRETURN rc;
+  SQLLEN needLen = 0;
+  char dummyBuffer[1];
+  char *buffer, *data;
+
+  *truncated = 0;
+  *len = 0;
+
+  if (conn->rowArraySize > 0) {
+    data = boundColumnData(conn, col, &needLen, truncated);
+    if (!data)
+      return NULL;
+    buffer = (char *) msSmallMalloc(offset + needLen + 2);
+    memcpy(buffer + offset, data, needLen);
+    *len = needLen;
+    return buffer;
+  }
+
+  /* figure out how big the buffer needs to be */
+  rc = SQLGetData(conn->hstmt, (SQLUSMALLINT) col, SQL_C_BINARY, dummyBuffer, 0, &needLen);
+  if (rc == SQL_ERROR)
+    handleSQLError(layer);
+
+  if (needLen <= 0)
+    return NULL;
+
+  buffer = (char *) msSmallMalloc(offset + needLen + 2);
+
+  /* Now grab the data */
+  rc = SQLGetData(conn->hstmt, (SQLUSMALLINT) col, SQL_C_BINARY, buffer + offset, needLen, len);
+  if (rc == SQL_ERROR || rc == SQL_SUCCESS_WITH_INFO)
+    handleSQLError(layer);
+
+  if (*len < 0 || *len > needLen)
+    *len = 0;
+
+  return buffer;
+}
+
 /* Used by NextShape() to access a shape in the query set */
 int msMSSQL2008LayerGetShapeRandom(layerObj *layer, shapeObj *shape, long *record)
 {
   msMSSQL2008LayerInfo  *layerinfo;
   int                 result;
-  SQLLEN needLen = 0;
   SQLLEN retLen = 0;
-  char dummyBuffer[1];
   char *wkbBuffer;
   char *valueBuffer;
   char oidBuffer[ 16 ];   /* assuming the OID will always be a long this should be enough */
   long record_oid;
   int t;
+  int truncated = 0;
+  int reread = 0;         /* the current row is read again, see refetchDrawQuery() */
 
   /* for coercing single types into geometry collections */
   char *wkbTemp;
@@ -1680,7 +1932,11 @@ int msMSSQL2008LayerGetShapeRandom(layerObj *layer, shapeObj *shape, long *recor
     /* SQLRETURN rc = SQLFetchScroll(layerinfo->conn->hstmt, SQL_FETCH_ABSOLUTE, (SQLLEN) (*record) + 1); */
 
     /* We only do forward fetches. the parameter 'record' is ignored, but is incremented */
-    SQLRETURN rc = SQLFetch(layerinfo->conn->hstmt);
+    SQLRETURN rc = SQL_SUCCESS;
+
+    if (!reread)
+      rc = fetchRow(layerinfo->conn);
+    reread = 0;
 
     /* Any error assume out of recordset bounds */
     if (rc != SQL_SUCCESS && rc != SQL_SUCCESS_WITH_INFO) {
@@ -1696,24 +1952,12 @@ int msMSSQL2008LayerGetShapeRandom(layerObj *layer, shapeObj *shape, long *recor
       shape->numvalues = layer->numitems;
 
       for(t=0; t < layer->numitems; t++) {
-        /* figure out how big the buffer needs to be */
-        rc = SQLGetData(layerinfo->conn->hstmt, (SQLUSMALLINT)(t + 1), SQL_C_BINARY, dummyBuffer, 0, &needLen);
-        if (rc == SQL_ERROR)
-          handleSQLError(layer);
-
-        if (needLen > 0) {
-          /* allocate the buffer - this will be a null-terminated string so alloc for the null too */
-          valueBuffer = (char*) msSmallMalloc( needLen + 2 );
-          if ( valueBuffer == NULL ) {
-            msSetError( MS_QUERYERR, "Could not allocate value buffer.", "msMSSQL2008LayerGetShapeRandom()" );
-            return MS_FAILURE;
-          }
-
-          /* Now grab the data */
-          rc = SQLGetData(layerinfo->conn->hstmt, (SQLUSMALLINT)(t + 1), SQL_C_BINARY, valueBuffer, needLen, &retLen);
-          if (rc == SQL_ERROR || rc == SQL_SUCCESS_WITH_INFO)
-            handleSQLError(layer);
+        /* null-terminated string, getColumnData() leaves room for the null */
+        valueBuffer = getColumnData(layer, layerinfo->conn, t + 1, 0, &retLen, &truncated);
+        if (truncated)
+          break;
 
+        if (valueBuffer) {
           /* Terminate the buffer */
           valueBuffer[retLen] = 0; /* null terminate it */
 
@@ -1730,30 +1974,41 @@ int msMSSQL2008LayerGetShapeRandom(layerObj *layer, shapeObj *shape, long *recor
           shape->values[t] = msStrdup("");
       }
 
+      if (truncated) {
+        msFreeCharArray(shape->values, t);
+        shape->values = NULL;
+        shape->numvalues = 0;
+        if (refetchDrawQuery(layer, layerinfo, t + 1, retLen) != MS_SUCCESS)
+          return MS_FAILURE;
+        reread = 1;
+        continue;
+      }
+
       /* Get shape geometry */
       {
-        /* Set up to request the size of the buffer needed */
-        rc = SQLGetData(layerinfo->conn->hstmt, (SQLUSMALLINT)(layer->numitems + 1), SQL_C_BINARY, dummyBuffer, 0, &needLen);
-        if (rc == SQL_ERROR)
-          handleSQLError(layer);
-
-        /* allow space for coercion to geometry collection if needed*/
-        wkbTemp = (char*)msSmallMalloc(needLen+9);
-
-        /* write data above space allocated for geometry collection coercion */
-        wkbBuffer = wkbTemp + 9;
-
-        if ( wkbBuffer == NULL ) {
-          msSetError( MS_QUERYERR, "Could not allocate value buffer.", "msMSSQL2008LayerGetShapeRandom()" );
-          return MS_FAILURE;
+        if (layerinfo->conn->rowArraySize > 0 && layerinfo->geometry_format == MSSQLGEOMETRY_NATIVE) {
+          /* parsed where it was fetched */
+          wkbTemp = NULL;
+          wkbBuffer = boundColumnData(layerinfo->conn, layer->numitems + 1, &retLen, &truncated);
+        } else {
+          /* allow space for coercion to geometry collection if needed, the data is written above it */
+          wkbTemp = getColumnData(layer, layerinfo->conn, layer->numitems + 1, 9, &retLen, &truncated);
+          wkbBuffer = wkbTemp ? wkbTemp + 9 : NULL;
         }
 
-        /* Grab the WKB */
-        rc = SQLGetData(layerinfo->conn->hstmt, (SQLUSMALLINT)(layer->numitems + 1), SQL_C_BINARY, wkbBuffer, needLen, &retLen);
-        if (rc == SQL_ERROR || rc == SQL_SUCCESS_WITH_INFO)
-          handleSQLError(layer);
+        if (truncated) {
+          msFreeCharArray(shape->values, shape->numvalues);
+          shape->values = NULL;
+          shape->numvalues = 0;
+          if (refetchDrawQuery(layer, layerinfo, layer->numitems + 1, retLen) != MS_SUCCESS)
+            return MS_FAILURE;
+          reread = 1;
+          continue;
+        }
 
-        if (layerinfo->geometry_format == MSSQLGEOMETRY_NATIVE) {
+        if (wkbBuffer == NULL) {
+          /* NULL geometry, the shape stays MS_SHAPE_NULL */
+        } else if (layerinfo->geometry_format == MSSQLGEOMETRY_NATIVE) {
           layerinfo->gpi.pszData = (unsigned char*)wkbBuffer;
           layerinfo->gpi.nLen = retLen;
 
@@ -1832,9 +2087,17 @@ int msMSSQL2008LayerGetShapeRandom(layerObj *layer, shapeObj *shape, long *recor
       }
 
       /* Next get unique id for row - since the OID shouldn't be larger than a long we'll assume billions as a limit */
-      rc = SQLGetData(layerinfo->conn->hstmt, (SQLUSMALLINT)(layer->numitems + 2), SQL_C_BINARY, oidBuffer, sizeof(oidBuffer) - 1, &retLen);
-      if (rc == SQL_ERROR || rc == SQL_SUCCESS_WITH_INFO)
-        handleSQLError(layer);
+      if (layerinfo->conn->rowArraySize > 0) {
+        char *oid = boundColumnData(layerinfo->conn, layer->numitems + 2, &retLen, &truncated);
+        if (oid && retLen < sizeof(oidBuffer))
+          memcpy(oidBuffer, oid, retLen);
+        else
+          retLen = sizeof(oidBuffer);
+      } else {
+        rc = SQLGetData(layerinfo->conn->hstmt, (SQLUSMALLINT)(layer->numitems + 2), SQL_C_BINARY, oidBuffer, sizeof(oidBuffer) - 1, &retLen);
+        if (rc == SQL_ERROR || rc == SQL_SUCCESS_WITH_INFO)
+          handleSQLError(layer);
+      }
 
       if (retLen < sizeof(oidBuffer))
 	  {
@@ -1856,6 +2119,9 @@ int msMSSQL2008LayerGetShapeRandom(layerObj *layer, shapeObj *shape, long *recor
         return MS_SUCCESS;
       } else {
         msDebug("msMSSQL2008LayerGetShapeRandom bad shape: %d\n", *record);
+        msFreeCharArray(shape->values, shape->numvalues);
+        shape->values = NULL;
+        shape->numvalues = 0;
       }
       /* if (layer->type == MS_LAYER_POINT) {return MS_DONE;} */
     }
@@ -1923,6 +2189,7 @@ int msMSSQL2008LayerGetShape(layerObj *layer, shapeObj *shape, resultObj *record
 
         return MS_FAILURE;
       }
+      bindDrawQuery(layer, layerinfo);
       layerinfo->row_num = 0;
     }
     while( layerinfo->row_num < resultindex ) {
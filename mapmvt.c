@@ -0,0 +1,666 @@
+/******************************************************************************
+ * $Id$
+ *
+ * Project:  MapServer
+ * Purpose:  Mapbox Vector Tile (MVT) output
+ * Author:   MapServer team.
+ *
+ ******************************************************************************
+ * Copyright (c) 1996-2016 Regents of the University of Minnesota.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies of this Software or works derived from this Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+/*
+** The MVT renderer does not draw anything: the clipped and transformed
+** geometry of each feature is taken when the feature is started, quantized
+** to the tile EXTENT and encoded (with the feature attributes) as a
+** vector_tile.proto v2 message. Each mapserver layer becomes a tile layer.
+** The protobuf encoding is done by hand, only the handful of messages
+** needed by the spec are written.
+*/
+
+#include "mapserver.h"
+#include "mapows.h"
+#include "uthash.h"
+
+/* vector_tile.proto field numbers */
+#define MVT_TILE_LAYERS 3
+#define MVT_LAYER_NAME 1
+#define MVT_LAYER_FEATURES 2
+#define MVT_LAYER_KEYS 3
+#define MVT_LAYER_VALUES 4
+#define MVT_LAYER_EXTENT 5
+#define MVT_LAYER_VERSION 15
+#define MVT_FEATURE_ID 1
+#define MVT_FEATURE_TAGS 2
+#define MVT_FEATURE_TYPE 3
+#define MVT_FEATURE_GEOMETRY 4
+#define MVT_VALUE_STRING 1
+
+#define MVT_GEOM_POINT 1
+#define MVT_GEOM_LINESTRING 2
+#define MVT_GEOM_POLYGON 3
+
+#define MVT_CMD_MOVETO 1
+#define MVT_CMD_LINETO 2
+#define MVT_CMD_CLOSEPATH 7
+
+#define MVT_WIRE_VARINT 0
+#define MVT_WIRE_LENGTH 2
+
+typedef struct {
+  char *value;
+  unsigned int index;
+  UT_hash_handle hh;
+} mvtValueObj;
+
+typedef struct {
+  mapObj *map;
+  layerObj *layer;
+  int extent;
+
+  bufferObj tile;      /* finished layers */
+  bufferObj features;  /* encoded features of the current layer */
+  bufferObj values;    /* encoded values of the current layer */
+  bufferObj scratch;   /* the feature being encoded */
+  bufferObj geometry;  /* packed geometry of the feature being encoded */
+  bufferObj tags;      /* packed tags of the feature being encoded */
+
+  int keys_ready;
+  int numkeys;
+  int *keyitems;       /* layer item index of each key */
+  char **keys;         /* item names, the layer items are gone by endLayer */
+  mvtValueObj *valuehash;
+  unsigned int numvalues;
+  int numfeatures;
+
+  int *ring;           /* quantized ring/line coordinates, x,y pairs */
+  int ringsize;
+  int cursor_x, cursor_y;
+} MVTRenderer;
+
+#define MVT_RENDERER(image) ((MVTRenderer*) (image)->img.plugin)
+
+static void mvtWriteVarint(bufferObj *buf, unsigned long value)
+{
+  unsigned char bytes[10];
+  int n = 0;
+  while(value >= 0x80) {
+    bytes[n++] = (unsigned char)((value & 0x7F) | 0x80);
+    value >>= 7;
+  }
+  bytes[n++] = (unsigned char)value;
+  msBufferAppend(buf, bytes, n);
+}
+
+static void mvtWriteTag(bufferObj *buf, int field, int wiretype)
+{
+  mvtWriteVarint(buf, (unsigned long)((field << 3) | wiretype));
+}
+
+static void mvtWriteBytes(bufferObj *buf, int field, void *data, size_t length)
+{
+  mvtWriteTag(buf, field, MVT_WIRE_LENGTH);
+  mvtWriteVarint(buf, (unsigned long)length);
+  if(length > 0)
+    msBufferAppend(buf, data, length);
+}
+
+static void mvtWriteUInt(bufferObj *buf, int field, unsigned long value)
+{
+  mvtWriteTag(buf, field, MVT_WIRE_VARINT);
+  mvtWriteVarint(buf, value);
+}
+
+static size_t mvtVarintSize(unsigned long value)
+{
+  size_t n = 1;
+  while(value >= 0x80) {
+    value >>= 7;
+    n++;
+  }
+  return n;
+}
+
+static unsigned long mvtZigZag(int value)
+{
+  return (unsigned long)(((unsigned int)value << 1) ^ (unsigned int)(value >> 31));
+}
+
+static void mvtResetBuffer(bufferObj *buf)
+{
+  buf->size = 0;
+}
+
+/*
+** Quantize a line to the tile extent dropping repeated points. For rings
+** the closing point is dropped too, ClosePath takes care of it. Returns
+** the number of points kept in r->ring.
+*/
+static int mvtQuantizeLine(imageObj *img, lineObj *line, int isring)
+{
+  MVTRenderer *r = MVT_RENDERER(img);
+  double sx = (double)r->extent / img->width;
+  double sy = (double)r->extent / img->height;
+  int i, n = 0;
+
+  if(line->numpoints * 2 > r->ringsize) {
+    r->ringsize = line->numpoints * 2;
+    r->ring = (int*)msSmallRealloc(r->ring, r->ringsize * sizeof(int));
+  }
+  for(i=0; i<line->numpoints; i++) {
+    int x = MS_NINT(line->point[i].x * sx);
+    int y = MS_NINT(line->point[i].y * sy);
+    if(n > 0 && x == r->ring[2*n-2] && y == r->ring[2*n-1])
+      continue;
+    r->ring[2*n] = x;
+    r->ring[2*n+1] = y;
+    n++;
+  }
+  if(isring && n > 1 && r->ring[0] == r->ring[2*n-2] && r->ring[1] == r->ring[2*n-1])
+    n--;
+  return n;
+}
+
+static void mvtWriteCommand(bufferObj *buf, int id, int count)
+{
+  mvtWriteVarint(buf, (unsigned long)((id & 0x7) | (count << 3)));
+}
+
+static void mvtWritePoint(MVTRenderer *r, int x, int y)
+{
+  mvtWriteVarint(&r->geometry, mvtZigZag(x - r->cursor_x));
+  mvtWriteVarint(&r->geometry, mvtZigZag(y - r->cursor_y));
+  r->cursor_x = x;
+  r->cursor_y = y;
+}
+
+/* write the n points of r->ring as MoveTo + LineTo, optionally reversed */
+static void mvtWritePath(MVTRenderer *r, int n, int reverse, int close)
+{
+  int i;
+  mvtWriteCommand(&r->geometry, MVT_CMD_MOVETO, 1);
+  if(reverse) {
+    mvtWritePoint(r, r->ring[2*n-2], r->ring[2*n-1]);
+    mvtWriteCommand(&r->geometry, MVT_CMD_LINETO, n-1);
+    for(i=n-2; i>=0; i--)
+      mvtWritePoint(r, r->ring[2*i], r->ring[2*i+1]);
+  } else {
+    mvtWritePoint(r, r->ring[0], r->ring[1]);
+    mvtWriteCommand(&r->geometry, MVT_CMD_LINETO, n-1);
+    for(i=1; i<n; i++)
+      mvtWritePoint(r, r->ring[2*i], r->ring[2*i+1]);
+  }
+  if(close)
+    mvtWriteCommand(&r->geometry, MVT_CMD_CLOSEPATH, 1);
+}
+
+/* twice the signed area of r->ring, positive when clockwise on screen (y down) */
+static double mvtRingArea(MVTRenderer *r, int n)
+{
+  double area = 0;
+  int i, j;
+  for(i=0, j=n-1; i<n; j=i++)
+    area += (double)r->ring[2*j] * r->ring[2*i+1] - (double)r->ring[2*i] * r->ring[2*j+1];
+  return area;
+}
+
+/*
+** Rings are written exterior first followed by its holes. The spec wants
+** exteriors with a positive and holes with a negative area in tile
+** coordinates, rings are reversed where needed.
+*/
+static int mvtEncodeRing(imageObj *img, lineObj *line, int exterior)
+{
+  MVTRenderer *r = MVT_RENDERER(img);
+  int n = mvtQuantizeLine(img, line, MS_TRUE);
+  double area;
+  if(n < 3)
+    return MS_FALSE;
+  area = mvtRingArea(r, n);
+  if(area == 0)
+    return MS_FALSE;
+  mvtWritePath(r, n, exterior ? (area < 0) : (area > 0), MS_TRUE);
+  return MS_TRUE;
+}
+
+static int mvtEncodePolygon(imageObj *img, shapeObj *shape)
+{
+  int *outerlist, *innerlist;
+  int i, j, written = 0;
+
+  outerlist = msGetOuterList(shape);
+  if(!outerlist)
+    return 0;
+  for(i=0; i<shape->numlines; i++) {
+    if(!outerlist[i])
+      continue;
+    if(!mvtEncodeRing(img, &shape->line[i], MS_TRUE))
+      continue;
+    written++;
+    innerlist = msGetInnerList(shape, i, outerlist);
+    if(innerlist) {
+      for(j=0; j<shape->numlines; j++) {
+        if(innerlist[j])
+          mvtEncodeRing(img, &shape->line[j], MS_FALSE);
+      }
+      free(innerlist);
+    }
+  }
+  free(outerlist);
+  return written;
+}
+
+static int mvtEncodeLines(imageObj *img, shapeObj *shape)
+{
+  MVTRenderer *r = MVT_RENDERER(img);
+  int i, n, written = 0;
+  for(i=0; i<shape->numlines; i++) {
+    n = mvtQuantizeLine(img, &shape->line[i], MS_FALSE);
+    if(n < 2)
+      continue;
+    mvtWritePath(r, n, MS_FALSE, MS_FALSE);
+    written++;
+  }
+  return written;
+}
+
+/*
+** Point layers hand us the shape before it is transformed, the points are
+** reprojected and transformed here as pointLayerDrawShape() does.
+*/
+static int mvtEncodePoints(imageObj *img, shapeObj *shape)
+{
+  MVTRenderer *r = MVT_RENDERER(img);
+  layerObj *layer = r->layer;
+  mapObj *map = r->map;
+  double sx = (double)r->extent / img->width;
+  double sy = (double)r->extent / img->height;
+  int i, j, n = 0, x, y;
+  pointObj point;
+
+  for(i=0; i<shape->numlines; i++) {
+    for(j=0; j<shape->line[i].numpoints; j++) {
+      point = shape->line[i].point[j];
+      if(layer->transform == MS_TRUE) {
+#ifdef USE_PROJ
+        if(layer->project)
+          msProjectPoint(&layer->projection, &map->projection, &point);
+#endif
+        if(!msPointInRect(&point, &map->extent))
+          continue;
+        msTransformPoint(&point, &map->extent, map->cellsize, img);
+      } else
+        msOffsetPointRelativeTo(&point, layer);
+      x = MS_NINT(point.x * sx);
+      y = MS_NINT(point.y * sy);
+      if(n * 2 + 2 > r->ringsize) {
+        r->ringsize = n * 2 + 64;
+        r->ring = (int*)msSmallRealloc(r->ring, r->ringsize * sizeof(int));
+      }
+      r->ring[2*n] = x;
+      r->ring[2*n+1] = y;
+      n++;
+    }
+  }
+  if(n > 0) {
+    mvtWriteCommand(&r->geometry, MVT_CMD_MOVETO, n);
+    for(i=0; i<n; i++)
+      mvtWritePoint(r, r->ring[2*i], r->ring[2*i+1]);
+  }
+  return n;
+}
+
+/*
+** The attributes written for a layer are selected with the
+** mvt_include_items / mvt_exclude_items metadata (ows_* as fallback),
+** as for the other output formats.
+*/
+static void mvtSetupKeys(MVTRenderer *r)
+{
+  layerObj *layer = r->layer;
+  const char *value;
+  char **incitems = NULL, **excitems = NULL;
+  int numinc = 0, numexc = 0, i, j, all = MS_FALSE;
+
+  r->keys_ready = MS_TRUE;
+  r->numkeys = 0;
+  if(layer->numitems <= 0)
+    return;
+
+  value = msLookupHashTable(&layer->metadata, "mvt_include_items");
+  if(!value)
+    value = msLookupHashTable(&layer->metadata, "ows_include_items");
+  if(!value)
+    return;
+  if(strcasecmp(value, "all") == 0)
+    all = MS_TRUE;
+  else
+    incitems = msStringSplit(value, ',', &numinc);
+
+  value = msLookupHashTable(&layer->metadata, "mvt_exclude_items");
+  if(!value)
+    value = msLookupHashTable(&layer->metadata, "ows_exclude_items");
+  if(value)
+    excitems = msStringSplit(value, ',', &numexc);
+
+  r->keyitems = (int*)msSmallMalloc(layer->numitems * sizeof(int));
+  r->keys = (char**)msSmallMalloc(layer->numitems * sizeof(char*));
+  for(i=0; i<layer->numitems; i++) {
+    int keep = all;
+    for(j=0; !keep && j<numinc; j++)
+      if(strcasecmp(layer->items[i], incitems[j]) == 0)
+        keep = MS_TRUE;
+    for(j=0; keep && j<numexc; j++)
+      if(strcasecmp(layer->items[i], excitems[j]) == 0)
+        keep = MS_FALSE;
+    if(keep) {
+      r->keyitems[r->numkeys] = i;
+      r->keys[r->numkeys++] = msStrdup(layer->items[i]);
+    }
+  }
+  msFreeCharArray(incitems, numinc);
+  msFreeCharArray(excitems, numexc);
+}
+
+/* index of a value in the layer values table, added on first use */
+static unsigned int mvtGetValueIndex(MVTRenderer *r, char *value)
+{
+  mvtValueObj *entry = NULL;
+  size_t len = strlen(value);
+
+  UT_HASH_FIND(hh, r->valuehash, value, len, entry);
+  if(!entry) {
+    bufferObj *buf = &r->values;
+    entry = (mvtValueObj*)msSmallMalloc(sizeof(mvtValueObj));
+    entry->value = msStrdup(value);
+    entry->index = r->numvalues++;
+    UT_HASH_ADD_KEYPTR(hh, r->valuehash, entry->value, len, entry);
+
+    /* Value message with a single string_value */
+    mvtWriteTag(buf, MVT_LAYER_VALUES, MVT_WIRE_LENGTH);
+    mvtWriteVarint(buf, (unsigned long)(1 + mvtVarintSize((unsigned long)len) + len));
+    mvtWriteBytes(buf, MVT_VALUE_STRING, value, len);
+  }
+  return entry->index;
+}
+
+static void mvtClearLayer(MVTRenderer *r)
+{
+  mvtValueObj *entry, *tmp;
+  UT_HASH_ITER(hh, r->valuehash, entry, tmp) {
+    UT_HASH_DEL(r->valuehash, entry);
+    msFree(entry->value);
+    msFree(entry);
+  }
+  r->valuehash = NULL;
+  r->numvalues = 0;
+  r->numfeatures = 0;
+  msFree(r->keyitems);
+  r->keyitems = NULL;
+  msFreeCharArray(r->keys, r->numkeys);
+  r->keys = NULL;
+  r->numkeys = 0;
+  r->keys_ready = MS_FALSE;
+  r->layer = NULL;
+  mvtResetBuffer(&r->features);
+  mvtResetBuffer(&r->values);
+}
+
+imageObj *mvtCreateImage(int width, int height, outputFormatObj *format, colorObj * bg)
+{
+  MVTRenderer *r;
+  imageObj *image;
+
+  r = (MVTRenderer*)msSmallCalloc(1, sizeof(MVTRenderer));
+  r->extent = atoi(msGetOutputFormatOption(format, "EXTENT", "4096"));
+  if(r->extent < 1) {
+    msSetError(MS_MISCERR, "Invalid EXTENT format option, must be a positive integer.", "mvtCreateImage()");
+    msFree(r);
+    return NULL;
+  }
+  msBufferInit(&r->tile);
+  msBufferInit(&r->features);
+  msBufferInit(&r->values);
+  msBufferInit(&r->scratch);
+  msBufferInit(&r->geometry);
+  msBufferInit(&r->tags);
+
+  image = (imageObj *) msSmallCalloc(1,sizeof(imageObj));
+  image->img.plugin = (void*) r;
+  return image;
+}
+
+int mvtFreeImage(imageObj *img)
+{
+  MVTRenderer *r = MVT_RENDERER(img);
+
+  mvtClearLayer(r);
+  msBufferFree(&r->tile);
+  msBufferFree(&r->features);
+  msBufferFree(&r->values);
+  msBufferFree(&r->scratch);
+  msBufferFree(&r->geometry);
+  msBufferFree(&r->tags);
+  msFree(r->ring);
+  msFree(r);
+  img->img.plugin = NULL;
+  return MS_SUCCESS;
+}
+
+int mvtStartLayer(imageObj *img, mapObj *map, layerObj *layer)
+{
+  MVTRenderer *r = MVT_RENDERER(img);
+
+  mvtClearLayer(r);
+  r->map = map;
+  r->layer = layer;
+  return MS_SUCCESS;
+}
+
+/*
+** Assemble the Layer message from the features and values collected so far
+** and append it to the tile. Layers without features are not written.
+*/
+int mvtEndLayer(imageObj *img, mapObj *map, layerObj *layer)
+{
+  MVTRenderer *r = MVT_RENDERER(img);
+  bufferObj *msg = &r->scratch;
+  char name[32];
+  const char *layername = layer->name;
+  int i;
+
+  if(!r->layer || r->numfeatures == 0) {
+    mvtClearLayer(r);
+    return MS_SUCCESS;
+  }
+  if(!layername || !*layername) {
+    snprintf(name, sizeof(name), "layer%d", layer->index);
+    layername = name;
+  }
+
+  mvtResetBuffer(msg);
+  mvtWriteUInt(msg, MVT_LAYER_VERSION, 2);
+  mvtWriteBytes(msg, MVT_LAYER_NAME, (void*)layername, strlen(layername));
+  msBufferAppend(msg, r->features.data, r->features.size);
+  for(i=0; i<r->numkeys; i++) {
+    mvtWriteBytes(msg, MVT_LAYER_KEYS, r->keys[i], strlen(r->keys[i]));
+  }
+  if(r->values.size > 0)
+    msBufferAppend(msg, r->values.data, r->values.size);
+  mvtWriteUInt(msg, MVT_LAYER_EXTENT, (unsigned long)r->extent);
+
+  mvtWriteBytes(&r->tile, MVT_TILE_LAYERS, msg->data, msg->size);
+  mvtClearLayer(r);
+  return MS_SUCCESS;
+}
+
+/*
+** Line and polygon shapes come in clipped and transformed to image
+** coordinates, so the whole feature is encoded here once whatever the
+** number of styles used to draw it.
+*/
+int mvtStartShape(imageObj *img, shapeObj *shape)
+{
+  MVTRenderer *r = MVT_RENDERER(img);
+  layerObj *layer = r->layer;
+  bufferObj *msg = &r->scratch;
+  int geomtype, written, i;
+
+  if(!layer)
+    return MS_SUCCESS;
+
+  mvtResetBuffer(&r->geometry);
+  r->cursor_x = r->cursor_y = 0;
+  switch(layer->type) {
+    case MS_LAYER_POINT:
+      geomtype = MVT_GEOM_POINT;
+      written = mvtEncodePoints(img, shape);
+      break;
+    case MS_LAYER_LINE:
+      geomtype = MVT_GEOM_LINESTRING;
+      written = mvtEncodeLines(img, shape);
+      break;
+    case MS_LAYER_POLYGON:
+      geomtype = MVT_GEOM_POLYGON;
+      written = mvtEncodePolygon(img, shape);
+      break;
+    default:
+      written = 0;
+      geomtype = 0;
+      break;
+  }
+  if(!written)
+    return MS_SUCCESS;
+
+  if(!r->keys_ready)
+    mvtSetupKeys(r);
+  mvtResetBuffer(&r->tags);
+  if(shape->values) {
+    for(i=0; i<r->numkeys; i++) {
+      char *value = shape->values[r->keyitems[i]];
+      if(!value)
+        continue;
+      mvtWriteVarint(&r->tags, (unsigned long)i);
+      mvtWriteVarint(&r->tags, (unsigned long)mvtGetValueIndex(r, value));
+    }
+  }
+
+  mvtResetBuffer(msg);
+  if(shape->index >= 0)
+    mvtWriteUInt(msg, MVT_FEATURE_ID, (unsigned long)shape->index);
+  if(r->tags.size > 0)
+    mvtWriteBytes(msg, MVT_FEATURE_TAGS, r->tags.data, r->tags.size);
+  mvtWriteUInt(msg, MVT_FEATURE_TYPE, (unsigned long)geomtype);
+  mvtWriteBytes(msg, MVT_FEATURE_GEOMETRY, r->geometry.data, r->geometry.size);
+
+  mvtWriteBytes(&r->features, MVT_LAYER_FEATURES, msg->data, msg->size);
+  r->numfeatures++;
+  return MS_SUCCESS;
+}
+
+int mvtEndShape(imageObj *img, shapeObj *shape)
+{
+  return MS_SUCCESS;
+}
+
+int mvtSaveImage(imageObj *img, mapObj *map, FILE *fp, outputFormatObj *format)
+{
+  MVTRenderer *r = MVT_RENDERER(img);
+
+  if(r->tile.size > 0 && msIO_fwrite(r->tile.data, 1, r->tile.size, fp) != r->tile.size) {
+    msSetError(MS_IOERR, "Failed to write vector tile.", "mvtSaveImage()");
+    return MS_FAILURE;
+  }
+  return MS_SUCCESS;
+}
+
+unsigned char *mvtSaveImageBuffer(imageObj *img, int *size_ptr, outputFormatObj *format)
+{
+  MVTRenderer *r = MVT_RENDERER(img);
+  unsigned char *data = (unsigned char*)msSmallMalloc(r->tile.size > 0 ? r->tile.size : 1);
+
+  if(r->tile.size > 0)
+    memcpy(data, r->tile.data, r->tile.size);
+  *size_ptr = (int)r->tile.size;
+  return data;
+}
+
+/* the actual drawing callbacks have nothing to do */
+
+int mvtRenderLine(imageObj *img, shapeObj *p, strokeStyleObj *style)
+{
+  return MS_SUCCESS;
+}
+
+int mvtRenderPolygon(imageObj *img, shapeObj *p, colorObj *color)
+{
+  return MS_SUCCESS;
+}
+
+int mvtRenderPolygonTiled(imageObj *img, shapeObj *p, imageObj *tile)
+{
+  return MS_SUCCESS;
+}
+
+int mvtRenderSymbol(imageObj *img, double x, double y, symbolObj *symbol, symbolStyleObj *style)
+{
+  return MS_SUCCESS;
+}
+
+int mvtRenderGlyphs(imageObj *img, textPathObj *tp, colorObj *c, colorObj *oc, int ow)
+{
+  return MS_SUCCESS;
+}
+
+int mvtFreeSymbol(symbolObj *symbol)
+{
+  return MS_SUCCESS;
+}
+
+int msPopulateRendererVTableMVT(rendererVTableObj *renderer)
+{
+  renderer->default_transform_mode = MS_TRANSFORM_FULLRESOLUTION;
+
+  renderer->createImage = &mvtCreateImage;
+  renderer->freeImage = &mvtFreeImage;
+  renderer->saveImage = &mvtSaveImage;
+  renderer->saveImageBuffer = &mvtSaveImageBuffer;
+
+  renderer->startLayer = &mvtStartLayer;
+  renderer->endLayer = &mvtEndLayer;
+
+  renderer->startShape = &mvtStartShape;
+  renderer->endShape = &mvtEndShape;
+
+  renderer->renderLine = &mvtRenderLine;
+  renderer->renderPolygon = &mvtRenderPolygon;
+  renderer->renderPolygonTiled = &mvtRenderPolygonTiled;
+  renderer->renderGlyphs = &mvtRenderGlyphs;
+  renderer->renderVectorSymbol = &mvtRenderSymbol;
+  renderer->renderPixmapSymbol = &mvtRenderSymbol;
+  renderer->renderEllipseSymbol = &mvtRenderSymbol;
+
+  renderer->freeSymbol = &mvtFreeSymbol;
+
+  renderer->loadImageFromFile = msLoadMSRasterBufferFromFile;
+
+  return MS_SUCCESS;
+}
@@ -28,8 +28,11 @@
  * DEALINGS IN THE SOFTWARE.
  ****************************************************************************/
 
+#include <ctype.h>
+
 #include "mapserver.h"
 #include "mapows.h"
+#include "fontcache.h"
 
 #ifdef USE_GDAL
 #  include "gdal.h"
@@ -87,6 +90,8 @@ void msFreeMap(mapObj *map)
   if(map->debug >= MS_DEBUGLEVEL_VV)
     msDebug("msFreeMap(): freeing map at %p.\n",map);
 
+  msFreeStats(map); /* logged first, the layers are still around */
+
   msCloseConnections(map);
 
   msFree(map->name);
@@ -119,6 +124,7 @@ void msFreeMap(mapObj *map)
     }
   }
   msFree(map->layers);
+  msInvalidateLayerNameIndex(map);
 
   if(map->layerorder)
     free(map->layerorder);
@@ -137,6 +143,7 @@ void msFreeMap(mapObj *map)
     msFree(map->outputformatlist);
 
   msFreeQuery(&(map->query));
+  msReleaseDecryptCache(map->decryptcache);
 
 #ifdef USE_V8_MAPSCRIPT
   if (map->v8context)
@@ -259,6 +266,134 @@ int msMapIgnoreMissingData( mapObj *map )
   return default_result;
 }
 
+/************************************************************************/
+/*                            msWarmupMap()                             */
+/*                                                                      */
+/*      Loads ahead what the first requests on a map would otherwise    */
+/*      pay for, for long running processes. CONFIG "MS_WARMUP" lists   */
+/*      the steps among FONTS, SYMBOLS, PROJECTIONS and LAYERS (open    */
+/*      the file and database layers, which fills the connection pool   */
+/*      and the spatial index caches), ON or ALL for all of them, the   */
+/*      default, or OFF. Font faces are cached per thread so this       */
+/*      should run in each thread that will draw. Failures are only     */
+/*      reported in the debug output.                                   */
+/************************************************************************/
+
+#define MS_WARMUP_FONTS       1
+#define MS_WARMUP_SYMBOLS     2
+#define MS_WARMUP_PROJECTIONS 4
+#define MS_WARMUP_LAYERS      8
+
+static int msWarmupSteps( mapObj *map )
+{
+  const char *value = msGetConfigOption( map, "MS_WARMUP" );
+  char **tokens;
+  int i, n, steps = 0;
+
+  if( value == NULL || strcasecmp(value, "ON") == 0 || strcasecmp(value, "ALL") == 0 )
+    return MS_WARMUP_FONTS | MS_WARMUP_SYMBOLS | MS_WARMUP_PROJECTIONS | MS_WARMUP_LAYERS;
+
+  tokens = msStringSplit( value, ',', &n );
+  for( i = 0; i < n; i++ ) {
+    msStringTrim( tokens[i] );
+    if( strcasecmp(tokens[i], "FONTS") == 0 )
+      steps |= MS_WARMUP_FONTS;
+    else if( strcasecmp(tokens[i], "SYMBOLS") == 0 )
+      steps |= MS_WARMUP_SYMBOLS;
+    else if( strcasecmp(tokens[i], "PROJECTIONS") == 0 )
+      steps |= MS_WARMUP_PROJECTIONS;
+    else if( strcasecmp(tokens[i], "LAYERS") == 0 )
+      steps |= MS_WARMUP_LAYERS;
+  }
+  msFreeCharArray( tokens, n );
+
+  return steps;
+}
+
+int msWarmupMap( mapObj *map )
+{
+  int steps = msWarmupSteps( map );
+  int i, failures = 0;
+
+  if( steps & MS_WARMUP_FONTS ) {
+    const char *key;
+
+    for( key = msFirstKeyFromHashTable(&(map->fontset.fonts)); key != NULL;
+         key = msNextKeyFromHashTable(&(map->fontset.fonts), key) ) {
+      if( msGetFontFace( (char *) key, &(map->fontset) ) == NULL )
+        failures++;
+    }
+  }
+
+  if( (steps & MS_WARMUP_SYMBOLS) && map->outputformat && MS_RENDERER_PLUGIN(map->outputformat) ) {
+    rendererVTableObj *renderer = MS_MAP_RENDERER(map);
+
+    for( i = 0; i < map->symbolset.numsymbols; i++ ) {
+      symbolObj *symbol = map->symbolset.symbol[i];
+
+      if( symbol->type == MS_SYMBOL_PIXMAP && symbol->full_pixmap_path ) {
+        if( msPreloadImageSymbol( renderer, symbol ) != MS_SUCCESS )
+          failures++;
+      }
+#if defined(USE_SVG_CAIRO) || defined(USE_RSVG)
+      else if( symbol->type == MS_SYMBOL_SVG && symbol->full_pixmap_path ) {
+        if( msPreloadSVGSymbol( symbol ) != MS_SUCCESS )
+          failures++;
+      }
+#endif
+    }
+  }
+
+  for( i = 0; i < map->numlayers; i++ ) {
+    layerObj *lp = GET_LAYER(map, i);
+
+    if( lp->status == MS_DELETE )
+      continue;
+
+#ifdef USE_PROJ
+    /* sets up the reprojection objects reused by the requests */
+    if( (steps & MS_WARMUP_PROJECTIONS) && lp->projection.numargs > 0 &&
+        map->projection.numargs > 0 && msProjectionsDiffer(&(map->projection), &(lp->projection)) ) {
+      rectObj rect = map->extent;
+
+      if( msProjectRect( &(map->projection), &(lp->projection), &rect ) != MS_SUCCESS )
+        failures++;
+    }
+#endif
+
+    /* remote services are left alone, they would be queried for nothing */
+    if( (steps & MS_WARMUP_LAYERS) && lp->type != MS_LAYER_RASTER &&
+        (lp->connectiontype == MS_SHAPEFILE || lp->connectiontype == MS_TILED_SHAPEFILE ||
+         lp->connectiontype == MS_OGR || lp->connectiontype == MS_POSTGIS ||
+         lp->connectiontype == MS_ORACLESPATIAL || lp->connectiontype == MS_MYSQL) ) {
+      if( msLayerOpen( lp ) == MS_SUCCESS ) {
+        rectObj rect;
+
+        /* a point query reads the spatial index headers */
+        rect.minx = rect.maxx = (map->extent.minx + map->extent.maxx) / 2;
+        rect.miny = rect.maxy = (map->extent.miny + map->extent.maxy) / 2;
+#ifdef USE_PROJ
+        lp->project = msProjectionsDiffer(&(map->projection), &(lp->projection));
+        if( lp->project )
+          msProjectRect( &(map->projection), &(lp->projection), &rect );
+#endif
+        if( msLayerWhichShapes( lp, rect, MS_FALSE ) == MS_FAILURE )
+          failures++;
+        msLayerClose( lp );
+      } else
+        failures++;
+    }
+  }
+
+  if( failures > 0 ) {
+    if( map->debug )
+      msDebug( "msWarmupMap(): %d step(s) failed.\n", failures );
+    msResetErrorList();
+  }
+
+  return MS_SUCCESS;
+}
+
 /************************************************************************/
 /*                           msMapSetExtent()                           */
 /************************************************************************/
@@ -516,6 +651,125 @@ int msMapRestoreRealExtent( mapObj *map )
   return MS_SUCCESS;
 }
 
+/************************************************************************/
+/*                      Layer name and group index                      */
+/*                                                                      */
+/*      Hash chains of the layer names and groups, built on the first   */
+/*      lookup and dropped by msInvalidateLayerNameIndex() when layers  */
+/*      are added, removed or renamed. The chains are in layer order    */
+/*      so that lookups find the layers a scan of map->layers would.    */
+/*      Small maps are scanned.                                         */
+/************************************************************************/
+#define MS_LAYER_NAME_INDEX_MIN 16
+
+struct layerNameIndexObj {
+  int numlayers;             /* map->numlayers once built */
+  unsigned int mask;         /* number of buckets - 1 */
+  int *names, *groups;       /* first layer of each bucket, -1 if none */
+  int *nextname, *nextgroup; /* next layer in the same bucket */
+};
+
+/* case insensitive so that it can serve case insensitive lookups as well */
+static unsigned int msLayerNameHash(const char *name)
+{
+  unsigned int hash = 0;
+
+  for(; *name; name++)
+    hash = hash * 31 + (unsigned char) tolower((unsigned char) *name);
+  return hash;
+}
+
+void msInvalidateLayerNameIndex(mapObj *map)
+{
+  struct layerNameIndexObj *index;
+
+  if(!map || !map->layernameindex)
+    return;
+  index = map->layernameindex;
+  msFree(index->names);
+  msFree(index->groups);
+  msFree(index->nextname);
+  msFree(index->nextgroup);
+  msFree(index);
+  map->layernameindex = NULL;
+}
+
+static struct layerNameIndexObj *msGetLayerNameIndex(mapObj *map)
+{
+  struct layerNameIndexObj *index = map->layernameindex;
+  unsigned int numbuckets, h;
+  int i;
+
+  if(index && index->numlayers == map->numlayers)
+    return index;
+  msInvalidateLayerNameIndex(map);
+  if(map->numlayers < MS_LAYER_NAME_INDEX_MIN)
+    return NULL;
+
+  for(numbuckets = 64; numbuckets < (unsigned int) map->numlayers * 2; numbuckets *= 2);
+
+  index = (struct layerNameIndexObj *) msSmallMalloc(sizeof(struct layerNameIndexObj));
+  index->numlayers = map->numlayers;
+  index->mask = numbuckets - 1;
+  index->names = (int *) msSmallMalloc(numbuckets * sizeof(int));
+  index->groups = (int *) msSmallMalloc(numbuckets * sizeof(int));
+  index->nextname = (int *) msSmallMalloc(map->numlayers * sizeof(int));
+  index->nextgroup = (int *) msSmallMalloc(map->numlayers * sizeof(int));
+  for(h=0; h<numbuckets; h++)
+    index->names[h] = index->groups[h] = -1;
+
+  for(i=map->numlayers-1; i>=0; i--) { /* pushed last first */
+    layerObj *lp = GET_LAYER(map, i);
+
+    index->nextname[i] = index->nextgroup[i] = -1;
+    if(lp->name) {
+      h = msLayerNameHash(lp->name) & index->mask;
+      index->nextname[i] = index->names[h];
+      index->names[h] = i;
+    }
+    if(lp->group) {
+      h = msLayerNameHash(lp->group) & index->mask;
+      index->nextgroup[i] = index->groups[h];
+      index->groups[h] = i;
+    }
+  }
+
+  map->layernameindex = index;
+  return index;
+}
+
+/*
+** Returns the index of the first layer after the one at index after (-1 to
+** start, else a layer returned by the previous call) whose name, or group with
+** bygroup, is name. -1 if there is none.
+*/
+int msLayerNameIndexNext(mapObj *map, const char *name, int bygroup, int after)
+{
+  struct layerNameIndexObj *index = msGetLayerNameIndex(map);
+  int i;
+
+  if(!index) {
+    for(i=after+1; i<map->numlayers; i++) {
+      const char *value = bygroup ? GET_LAYER(map, i)->group : GET_LAYER(map, i)->name;
+      if(value && strcmp(name, value) == 0)
+        return i;
+    }
+    return -1;
+  }
+
+  if(after < 0)
+    i = (bygroup ? index->groups : index->names)[msLayerNameHash(name) & index->mask];
+  else
+    i = (bygroup ? index->nextgroup : index->nextname)[after];
+  while(i != -1) {
+    const char *value = bygroup ? GET_LAYER(map, i)->group : GET_LAYER(map, i)->name;
+    if(value && strcmp(name, value) == 0)
+      return i;
+    i = (bygroup ? index->nextgroup : index->nextname)[i];
+  }
+  return -1;
+}
+
 /************************************************************************/
 /*                      msInsertLayer()                                 */
 /************************************************************************/
@@ -529,6 +783,8 @@ int msInsertLayer(mapObj *map, layerObj *layer, int nIndex)
     return -1;
   }
 
+  msInvalidateLayerNameIndex(map);
+
   /* Ensure there is room for a new layer */
   if (map->numlayers == map->maxlayers) {
     if (msGrowMapLayers(map) == NULL)
@@ -602,6 +858,7 @@ layerObj *msRemoveLayer(mapObj *map, int nIndex)
                "msRemoveLayer()", nIndex);
     return NULL;
   } else {
+    msInvalidateLayerNameIndex(map);
     layer=GET_LAYER(map, nIndex);
     /* msCopyLayer(layer, (GET_LAYER(map, nIndex))); */
 
@@ -657,6 +657,69 @@ static FilterEncodingNode* FLTGetTopBBOX(FilterEncodingNode *psNode)
   return psTopBBOX;
 }
 
+/************************************************************************/
+/*                         FLTGetTopSpatialRect                         */
+/*                                                                      */
+/*      Bounds, in the map projection, that the features matching the   */
+/*      spatial operators ANDed at the top of the filter must           */
+/*      intersect. Disjoint, DWithin and Beyond tell nothing about      */
+/*      them. Returns MS_FALSE when there is no such operator.          */
+/*      Must be called before the filter shapes are reprojected to the  */
+/*      layer by FLTGetCommonExpression().                              */
+/************************************************************************/
+static int FLTGetTopSpatialRectInternal(FilterEncodingNode *psNode, mapObj *map, rectObj *psRect, int *pbFound)
+{
+  if (psNode->eType == FILTER_NODE_TYPE_SPATIAL && psNode->pszValue &&
+      psNode->psRightNode && psNode->psRightNode->pOther &&
+      (psNode->psRightNode->eType == FILTER_NODE_TYPE_GEOMETRY_POINT ||
+       psNode->psRightNode->eType == FILTER_NODE_TYPE_GEOMETRY_LINE ||
+       psNode->psRightNode->eType == FILTER_NODE_TYPE_GEOMETRY_POLYGON) &&
+      (strncasecmp(psNode->pszValue, "Intersect", 9) == 0 ||
+       strcasecmp(psNode->pszValue, "Equals") == 0 ||
+       strcasecmp(psNode->pszValue, "Touches") == 0 ||
+       strcasecmp(psNode->pszValue, "Crosses") == 0 ||
+       strcasecmp(psNode->pszValue, "Within") == 0 ||
+       strcasecmp(psNode->pszValue, "Contains") == 0 ||
+       strcasecmp(psNode->pszValue, "Overlaps") == 0)) {
+    shapeObj *psShape = (shapeObj *) psNode->psRightNode->pOther;
+    rectObj sRect;
+
+    if (psShape->numlines == 0)
+      return MS_FALSE;
+    msComputeBounds(psShape);
+    sRect = psShape->bounds;
+
+    /* if the proj is not part of the filter, the coordinates are in the map projection */
+    if (psNode->pszSRS && map->projection.numargs > 0) {
+      projectionObj sProjTmp;
+      msInitProjection(&sProjTmp);
+      /* Use the non EPSG variant since axis swapping is done in FLTDoAxisSwappingIfNecessary */
+      if (msLoadProjectionString(&sProjTmp, psNode->pszSRS) == 0)
+        msProjectRect(&sProjTmp, &map->projection, &sRect);
+      msFreeProjection(&sProjTmp);
+    }
+
+    if (!*pbFound)
+      *psRect = sRect;
+    else if (msRectOverlap(psRect, &sRect))
+      msRectIntersect(psRect, &sRect);
+    *pbFound = MS_TRUE;
+    return MS_TRUE;
+  } else if (psNode->pszValue && strcasecmp(psNode->pszValue, "AND") == 0 &&
+             psNode->psLeftNode && psNode->psRightNode) {
+    FLTGetTopSpatialRectInternal(psNode->psLeftNode, map, psRect, pbFound);
+    FLTGetTopSpatialRectInternal(psNode->psRightNode, map, psRect, pbFound);
+  }
+
+  return *pbFound;
+}
+
+static int FLTGetTopSpatialRect(FilterEncodingNode *psNode, mapObj *map, rectObj *psRect)
+{
+  int bFound = MS_FALSE;
+  return FLTGetTopSpatialRectInternal(psNode, map, psRect, &bFound);
+}
+
 /************************************************************************/
 /*                   FLTLayerApplyPlainFilterToLayer                    */
 /*                                                                      */
@@ -668,6 +731,10 @@ int FLTLayerApplyPlainFilterToLayer(FilterEncodingNode *psNode, mapObj *map,
   char *pszExpression  =NULL;
   int status =MS_FALSE;
   layerObj* lp = GET_LAYER(map, iLayerIndex);
+  rectObj sSpatialRect;
+  int bSpatialRect;
+
+  bSpatialRect = FLTGetTopSpatialRect(psNode, map, &sSpatialRect);
 
   pszExpression = FLTGetCommonExpression(psNode,  lp);
   if (pszExpression) {
@@ -707,6 +774,12 @@ int FLTLayerApplyPlainFilterToLayer(FilterEncodingNode *psNode, mapObj *map,
       }
     }
 
+    /* Features matching the spatial operators must intersect their */
+    /* geometries: only fetch those from the layer. The expression */
+    /* still does the exact test. */
+    if( bSpatialRect && msRectOverlap(&rect, &sSpatialRect) )
+      msRectIntersect(&rect, &sSpatialRect);
+
     if(map->debug == MS_DEBUGLEVEL_VVV)
     {
       if( pszExpression )
@@ -3362,14 +3435,7 @@ int FLTParseGMLEnvelope(CPLXMLNode *psRoot, rectObj *psBbox, char **ppszSRS)
 
 static int FLTNeedSRSSwapping( const char* pszSRS )
 {
-    int bNeedSwapping = MS_FALSE;
-    projectionObj sProjTmp;
-    msInitProjection(&sProjTmp);
-    if (msLoadProjectionStringEPSG(&sProjTmp, pszSRS) == 0) {
-        bNeedSwapping = msIsAxisInvertedProj(&sProjTmp);
-    }
-    msFreeProjection(&sProjTmp);
-    return bNeedSwapping;
+    return msIsAxisInvertedSRS(pszSRS);
 }
 
 /************************************************************************/
@@ -704,14 +704,20 @@ int FLTApplyFilterToLayerCommonExpressionWithRect(mapObj *map, int iLayerIndex,
   int save_startindex;
   int save_maxfeatures;
   int save_only_cache_result_count;
+  int (*save_shapefunc)(layerObj *, shapeObj *, void *);
+  void *save_shapefuncdata;
 
   save_startindex = map->query.startindex;
   save_maxfeatures = map->query.maxfeatures;
   save_only_cache_result_count = map->query.only_cache_result_count;
+  save_shapefunc = map->query.shapefunc;
+  save_shapefuncdata = map->query.shapefuncdata;
   msInitQuery(&(map->query));
   map->query.startindex = save_startindex;
   map->query.maxfeatures = save_maxfeatures;
   map->query.only_cache_result_count = save_only_cache_result_count;
+  map->query.shapefunc = save_shapefunc;
+  map->query.shapefuncdata = save_shapefuncdata;
 
   map->query.mode = MS_QUERY_MULTIPLE;
   map->query.layer = iLayerIndex;
@@ -30,6 +30,7 @@
 #include "mapogcfilter.h"
 #include "mapserver.h"
 #include "mapows.h"
+#include "mapthread.h"
 
 #ifdef USE_OGR
 #include "cpl_string.h"
@@ -54,6 +55,257 @@ static inline void IGUR_sizet(size_t ignored) { (void)ignored; }  /* Ignore GCC
 #define SLD_MARK_SYMBOL_X "sld_mark_symbol_x"
 #define SLD_MARK_SYMBOL_X_FILLED "sld_mark_symbol_x_filled"
 
+#ifdef USE_OGR
+
+/*
+** SLD cache
+**
+** Clients tend to send the same few SLDs with every GetMap. With a
+** "sld_cache_ttl" metadata (MO namespaces, in seconds) the layers parsed out
+** of an SLD document are kept in a process wide cache of MS_SLD_CACHE_MAX
+** entries for that long, and the next requests get copies of them instead of
+** parsing the XML again. The key is the document and what the parsing reads
+** from the map (name, path, layer names and number of symbols). The symbols
+** the parsing has added to the map are kept too and added again in the same
+** order, so the styles referring to them by index stay valid. The documents
+** of SLD=<url> requests are kept the same way under their URL, saving the
+** download. The cache is protected by TLOCK_SLDCACHE.
+*/
+#define MS_SLD_CACHE_MAX 32
+
+typedef struct {
+  char *key;
+  char *sld;           /* downloaded document of an URL entry */
+  layerObj *layers;    /* parsed layers of a document entry */
+  int numlayers;
+  symbolObj **symbols; /* symbols the parsing added to the map */
+  int numsymbols;
+  time_t created;
+  unsigned long last_used;
+} sldCacheEntryObj;
+
+static int sldCacheCount = 0;
+static unsigned long sldCacheClock = 0;
+static sldCacheEntryObj sldCache[MS_SLD_CACHE_MAX];
+
+static void msSLDCacheFreeEntry(sldCacheEntryObj *entry)
+{
+  int i;
+
+  msFree(entry->key);
+  msFree(entry->sld);
+  for (i=0; i<entry->numlayers; i++)
+    freeLayer(&entry->layers[i]);
+  msFree(entry->layers);
+  for (i=0; i<entry->numsymbols; i++) {
+    if (msFreeSymbol(entry->symbols[i]) == MS_SUCCESS)
+      msFree(entry->symbols[i]);
+  }
+  msFree(entry->symbols);
+}
+
+static void msSLDCacheRemove(int i)
+{
+  msSLDCacheFreeEntry(&sldCache[i]);
+
+  sldCacheCount--;
+  if (i != sldCacheCount)
+    sldCache[i] = sldCache[sldCacheCount];
+}
+
+/* Returns the entry of key younger than ttl, -1 if there is none. */
+static int msSLDCacheFind(const char *key, int ttl)
+{
+  int i;
+
+  for (i=0; i<sldCacheCount; i++) {
+    if (strcmp(sldCache[i].key, key) != 0)
+      continue;
+    if (time(NULL) - sldCache[i].created >= ttl) {
+      msSLDCacheRemove(i);
+      return -1;
+    }
+    sldCache[i].last_used = ++sldCacheClock;
+    return i;
+  }
+  return -1;
+}
+
+/* Takes over the content of entry. */
+static void msSLDCacheInsert(sldCacheEntryObj *entry)
+{
+  int i;
+
+  msAcquireLock(TLOCK_SLDCACHE);
+  for (i=0; i<sldCacheCount; i++) {
+    if (strcmp(sldCache[i].key, entry->key) == 0) {
+      msSLDCacheRemove(i);
+      break;
+    }
+  }
+  if (sldCacheCount == MS_SLD_CACHE_MAX) {
+    int slot = 0;
+
+    for (i=1; i<sldCacheCount; i++) {
+      if (sldCache[i].last_used < sldCache[slot].last_used)
+        slot = i;
+    }
+    msSLDCacheRemove(slot);
+  }
+
+  entry->created = time(NULL);
+  entry->last_used = ++sldCacheClock;
+  sldCache[sldCacheCount++] = *entry;
+  msReleaseLock(TLOCK_SLDCACHE);
+}
+
+static int msSLDCacheTTL(mapObj *map)
+{
+  const char *pszTTL = msOWSLookupMetadata(&(map->web.metadata), "MO", "sld_cache_ttl");
+
+  if (pszTTL == NULL || atoi(pszTTL) <= 0)
+    return 0;
+  return atoi(pszTTL);
+}
+
+/* Returns a copy of the document downloaded from pszURL, NULL if not cached. */
+static char *msSLDCacheGetURL(const char *pszURL, int ttl)
+{
+  char *pszKey, *pszSLD = NULL;
+  int i;
+
+  pszKey = msStringConcatenate(msStrdup("URL\n"), pszURL);
+  msAcquireLock(TLOCK_SLDCACHE);
+  if ((i = msSLDCacheFind(pszKey, ttl)) >= 0)
+    pszSLD = msStrdup(sldCache[i].sld);
+  msReleaseLock(TLOCK_SLDCACHE);
+  msFree(pszKey);
+
+  return pszSLD;
+}
+
+static void msSLDCacheSetURL(const char *pszURL, const char *pszSLD)
+{
+  sldCacheEntryObj entry;
+
+  memset(&entry, 0, sizeof(entry));
+  entry.key = msStringConcatenate(msStrdup("URL\n"), pszURL);
+  entry.sld = msStrdup(pszSLD);
+  msSLDCacheInsert(&entry);
+}
+
+static char *msSLDCacheDocumentKey(mapObj *map, const char *psSLDXML)
+{
+  char *pszKey;
+  char szTmp[64];
+  int i;
+
+  pszKey = msStrdup("SLD\n");
+  if (map->name)
+    pszKey = msStringConcatenate(pszKey, map->name);
+  pszKey = msStringConcatenate(pszKey, "\n");
+  if (map->mappath)
+    pszKey = msStringConcatenate(pszKey, map->mappath);
+  snprintf(szTmp, sizeof(szTmp), "\n%d\n", map->symbolset.numsymbols);
+  pszKey = msStringConcatenate(pszKey, szTmp);
+  for (i=0; i<map->numlayers; i++) {
+    if (GET_LAYER(map, i)->name)
+      pszKey = msStringConcatenate(pszKey, GET_LAYER(map, i)->name);
+    pszKey = msStringConcatenate(pszKey, "\n");
+  }
+  return msStringConcatenate(pszKey, psSLDXML);
+}
+
+/************************************************************************/
+/*                           msSLDParseSLDCached                        */
+/*                                                                      */
+/*      msSLDParseSLD() going through the SLD cache when the map has    */
+/*      a sld_cache_ttl.                                                */
+/************************************************************************/
+static layerObj *msSLDParseSLDCached(mapObj *map, char *psSLDXML, int *pnLayers)
+{
+  sldCacheEntryObj entry;
+  layerObj *pasLayers = NULL;
+  int i, nTTL, nSymbols, nStatus = MS_SUCCESS;
+
+  if (map == NULL || psSLDXML == NULL || (nTTL = msSLDCacheTTL(map)) <= 0)
+    return msSLDParseSLD(map, psSLDXML, pnLayers);
+
+  memset(&entry, 0, sizeof(entry));
+  entry.key = msSLDCacheDocumentKey(map, psSLDXML);
+
+  msAcquireLock(TLOCK_SLDCACHE);
+  if ((i = msSLDCacheFind(entry.key, nTTL)) >= 0) {
+    sldCacheEntryObj *psEntry = &sldCache[i];
+    int j;
+
+    for (j=0; j<psEntry->numsymbols; j++) {
+      symbolObj *psSymbol = msGrowSymbolSet(&(map->symbolset));
+      if (psSymbol == NULL) {
+        nStatus = MS_FAILURE;
+        break;
+      }
+      msCopySymbol(psSymbol, psEntry->symbols[j], map);
+      map->symbolset.numsymbols++;
+    }
+
+    if (nStatus == MS_SUCCESS) {
+      pasLayers = (layerObj *)msSmallMalloc(sizeof(layerObj)*psEntry->numlayers);
+      for (j=0; j<psEntry->numlayers; j++) {
+        initLayer(&pasLayers[j], map);
+        msCopyLayer(&pasLayers[j], &psEntry->layers[j]);
+      }
+      if (pnLayers)
+        *pnLayers = psEntry->numlayers;
+    }
+  }
+  msReleaseLock(TLOCK_SLDCACHE);
+
+  if (pasLayers || nStatus != MS_SUCCESS) {
+    msFree(entry.key);
+    return pasLayers;
+  }
+
+  nSymbols = map->symbolset.numsymbols;
+  pasLayers = msSLDParseSLD(map, psSLDXML, &entry.numlayers);
+  if (pnLayers)
+    *pnLayers = entry.numlayers;
+  if (pasLayers == NULL || entry.numlayers <= 0) {
+    msFree(entry.key);
+    return pasLayers;
+  }
+
+  /* the cached copies are not tied to this map */
+  entry.layers = (layerObj *)msSmallMalloc(sizeof(layerObj)*entry.numlayers);
+  for (i=0; i<entry.numlayers; i++) {
+    initLayer(&entry.layers[i], NULL);
+    msCopyLayer(&entry.layers[i], &pasLayers[i]);
+  }
+  entry.numsymbols = map->symbolset.numsymbols - nSymbols;
+  if (entry.numsymbols > 0) {
+    entry.symbols = (symbolObj **)msSmallMalloc(sizeof(symbolObj *)*entry.numsymbols);
+    for (i=0; i<entry.numsymbols; i++) {
+      entry.symbols[i] = (symbolObj *)msSmallMalloc(sizeof(symbolObj));
+      msCopySymbol(entry.symbols[i], map->symbolset.symbol[nSymbols + i], NULL);
+    }
+  }
+  msSLDCacheInsert(&entry);
+
+  return pasLayers;
+}
+
+#endif /* USE_OGR */
+
+void msSLDCacheCleanup(void)
+{
+#ifdef USE_OGR
+  msAcquireLock(TLOCK_SLDCACHE);
+  while (sldCacheCount > 0)
+    msSLDCacheRemove(sldCacheCount - 1);
+  msReleaseLock(TLOCK_SLDCACHE);
+#endif
+}
+
 /************************************************************************/
 /*                             msSLDApplySLDURL                         */
 /*                                                                      */
@@ -76,6 +328,13 @@ int msSLDApplySLDURL(mapObj *map, char *szURL, int iLayer,
   int nStatus = MS_FAILURE;
 
   if (map && szURL) {
+    int nCacheTTL = msSLDCacheTTL(map);
+    if (nCacheTTL > 0 && (pszSLDbuf = msSLDCacheGetURL(szURL, nCacheTTL)) != NULL) {
+      nStatus = msSLDApplySLD(map, pszSLDbuf, iLayer, pszStyleLayerName, ppszLayerNames);
+      msFree(pszSLDbuf);
+      return nStatus;
+    }
+
     pszSLDTmpFile = msTmpFile(map, map->mappath, NULL, "sld.xml");
     if (pszSLDTmpFile == NULL) {
       pszSLDTmpFile = msTmpFile(map, NULL, NULL, "sld.xml" );
@@ -110,8 +369,11 @@ int msSLDApplySLDURL(mapObj *map, char *szURL, int iLayer,
         unlink(pszSLDTmpFile);
         msSetError(MS_WMSERR, "Could not open SLD %s and save it in a temporary file. Please make sure that the sld url is valid and that the temporary path is set. The temporary path can be defined for example by setting TMPPATH in the map file. Please check the MapServer documentation on temporary path settings.", "msSLDApplySLDURL", szURL);
       }
-      if (pszSLDbuf)
+      if (pszSLDbuf) {
+        if (nCacheTTL > 0)
+          msSLDCacheSetURL(szURL, pszSLDbuf);
         nStatus = msSLDApplySLD(map, pszSLDbuf, iLayer, pszStyleLayerName, ppszLayerNames);
+      }
     }
   }
 
@@ -163,7 +425,7 @@ int msSLDApplySLD(mapObj *map, char *psSLDXML, int iLayer, char *pszStyleLayerNa
   char *pszBuffer = NULL;
   layerObj *lp = NULL;
 
-  pasLayers = msSLDParseSLD(map, psSLDXML, &nLayers);
+  pasLayers = msSLDParseSLDCached(map, psSLDXML, &nLayers);
   if( pasLayers == NULL ) {
     errorObj* psError = msGetErrorObj();
     if( psError && psError->code != MS_NOERR )
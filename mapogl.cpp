@@ -208,7 +208,7 @@ int msGetRasterBufferCopyOgl(imageObj *img, rasterBufferObj *rb)
 
 int msGetRasterBufferHandleOgl(imageObj *img, rasterBufferObj * rb)
 {
-  getOglRenderer(img)->readRasterBuffer(rb);
+  getOglRenderer(img)->readRasterBuffer(rb, false);
   return MS_SUCCESS;
 }
 
@@ -33,6 +33,7 @@
 #include "maperror.h"
 #include "mapoglcontext.h"
 
+#include <vector>
 
 
 #define _T(x) __TEXT(x)
@@ -43,16 +44,29 @@ ms_uint32 OglContext::MAX_TEXTURE_SIZE = 0;
 ms_uint32 OglContext::MIN_TEXTURE_SIZE = 0;
 OglContext* OglContext::current = NULL;
 
+/*
+ * Creating a pbuffer is expensive, and every image needs one. The pbuffers of
+ * destroyed contexts are kept in a process wide pool of MAX_POOLED_PBUFFERS and
+ * handed to the next context of the same size; the renderer clears them.
+ */
 OglContext::OglContext(ms_uint32 width, ms_uint32 height)
   : valid(false)
 {
+#if defined(_WIN32) && !defined(__CYGWIN__)
+  hPBuffer = NULL;
+  hPBufferDC = NULL;
+  hPBufferRC = NULL;
+#else
+  pbuffer = 0;
+#endif
+
   if (!window && !initWindow()) return;
   if (!sharingContext && !initSharingContext()) return;
 
   if (!(this->width = getTextureSize(GL_TEXTURE_WIDTH, width))) return;
   if (!(this->height = getTextureSize(GL_TEXTURE_HEIGHT, height))) return;
 
-  if (!createPBuffer(this->width, this->height)) return;
+  if (!takePooledPBuffer(this->width, this->height) && !createPBuffer(this->width, this->height)) return;
   if (!makeCurrent()) return;
   valid = true;
 }
@@ -101,9 +115,55 @@ LRESULT CALLBACK WndProc(HWND hWnd,
   return(1L);
 }
 
+struct OglPooledPBuffer {
+  ms_uint32 width;
+  ms_uint32 height;
+  HPBUFFERARB pbuffer;
+  HDC dc;
+  HGLRC rc;
+};
+
+static std::vector<OglPooledPBuffer> pbufferPool;
+
 OglContext::~OglContext()
 {
-  //TODO
+  if (current == this) current = NULL;
+  releasePBuffer();
+}
+
+bool OglContext::takePooledPBuffer(ms_uint32 width, ms_uint32 height)
+{
+  for (size_t i = 0; i < pbufferPool.size(); i++) {
+    if (pbufferPool[i].width == width && pbufferPool[i].height == height) {
+      hPBuffer = pbufferPool[i].pbuffer;
+      hPBufferDC = pbufferPool[i].dc;
+      hPBufferRC = pbufferPool[i].rc;
+      pbufferPool.erase(pbufferPool.begin() + i);
+      return true;
+    }
+  }
+  return false;
+}
+
+void OglContext::releasePBuffer()
+{
+  if (!hPBuffer) return;
+  if (hPBufferDC && hPBufferRC && pbufferPool.size() < MAX_POOLED_PBUFFERS) {
+    OglPooledPBuffer pooled;
+    pooled.width = width;
+    pooled.height = height;
+    pooled.pbuffer = hPBuffer;
+    pooled.dc = hPBufferDC;
+    pooled.rc = hPBufferRC;
+    pbufferPool.push_back(pooled);
+  } else {
+    if (hPBufferRC) wglDeleteContext(hPBufferRC);
+    if (hPBufferDC) wglReleasePbufferDCARB(hPBuffer, hPBufferDC);
+    wglDestroyPbufferARB(hPBuffer);
+  }
+  hPBuffer = NULL;
+  hPBufferDC = NULL;
+  hPBufferRC = NULL;
 }
 
 bool OglContext::makeCurrent()
@@ -244,6 +304,11 @@ bool OglContext::initSharingContext()
     return FALSE;
   }
 
+  if (!(wglDestroyPbufferARB = (PFNWGLDESTROYPBUFFERARBPROC)wglGetProcAddress("wglDestroyPbufferARB"))) {
+    msSetError(MS_OGLERR, "unable to retreive wglDestroyPbufferARB method.", "OglContext::createContext()");
+    return FALSE;
+  }
+
   glGetIntegerv(GL_MAX_TEXTURE_MAX_ANISOTROPY_EXT, (GLint*) &MAX_ANISOTROPY);
   glGetIntegerv(GL_MAX_TEXTURE_SIZE, (GLint*)&MAX_TEXTURE_SIZE);
 
@@ -255,7 +320,7 @@ bool OglContext::initSharingContext()
 
 bool OglContext::createPBuffer(ms_uint32 width, ms_uint32 height)
 {
-  HPBUFFERARB hPBuffer = NULL;
+  hPBuffer = NULL;
   hPBufferDC = NULL;
   hPBufferRC = NULL;
 
@@ -315,6 +380,7 @@ PFNWGLCREATEPBUFFERARBPROC OglContext::wglCreatePbufferARB = NULL;
 PFNWGLGETPBUFFERDCARBPROC OglContext::wglGetPbufferDCARB = NULL;
 PFNWGLRELEASEPBUFFERDCARBPROC OglContext::wglReleasePbufferDCARB = NULL;
 PFNWGLMAKECONTEXTCURRENTARBPROC OglContext::wglMakeContextCurrentARB = NULL;
+PFNWGLDESTROYPBUFFERARBPROC OglContext::wglDestroyPbufferARB = NULL;
 
 #else /* UNIX */
 
@@ -322,11 +388,46 @@ Display* OglContext::window = NULL;
 GLXContext OglContext::sharingContext = NULL;
 GLXFBConfig* OglContext::configs = NULL;
 
+struct OglPooledPBuffer {
+  ms_uint32 width;
+  ms_uint32 height;
+  GLXPbuffer pbuffer;
+};
+
+static std::vector<OglPooledPBuffer> pbufferPool;
+
 OglContext::~OglContext()
 {
-  //TODO
+  if (current == this) current = NULL;
+  releasePBuffer();
+}
+
+bool OglContext::takePooledPBuffer(ms_uint32 width, ms_uint32 height)
+{
+  for (size_t i = 0; i < pbufferPool.size(); i++) {
+    if (pbufferPool[i].width == width && pbufferPool[i].height == height) {
+      pbuffer = pbufferPool[i].pbuffer;
+      pbufferPool.erase(pbufferPool.begin() + i);
+      return true;
+    }
+  }
+  return false;
 }
 
+void OglContext::releasePBuffer()
+{
+  if (!pbuffer) return;
+  if (pbufferPool.size() < MAX_POOLED_PBUFFERS) {
+    OglPooledPBuffer pooled;
+    pooled.width = width;
+    pooled.height = height;
+    pooled.pbuffer = pbuffer;
+    pbufferPool.push_back(pooled);
+  } else {
+    glXDestroyPbuffer(window, pbuffer);
+  }
+  pbuffer = 0;
+}
 
 bool OglContext::makeCurrent()
 {
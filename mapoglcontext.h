@@ -72,10 +72,12 @@ private:
   static bool initSharingContext();
   static ms_uint32 getTextureSize(GLuint dimension, ms_uint32 value);
   static GLuint NextPowerOf2(GLuint in);
+  static const size_t MAX_POOLED_PBUFFERS = 8;
 
 #if defined(_WIN32) && !defined(__CYGWIN__)
   static HDC window;
   static HGLRC sharingContext;
+  HPBUFFERARB hPBuffer;
   HDC hPBufferDC;
   HGLRC hPBufferRC;
 #else
@@ -106,6 +108,8 @@ public:
   void bindPBufferToTexture();
 private:
   bool createPBuffer(ms_uint32 width, ms_uint32 height);
+  bool takePooledPBuffer(ms_uint32 width, ms_uint32 height);
+  void releasePBuffer();
   ms_uint32 width;
   ms_uint32 height;
   bool valid;
@@ -117,6 +121,7 @@ private:
   static PFNWGLGETPBUFFERDCARBPROC wglGetPbufferDCARB;
   static PFNWGLRELEASEPBUFFERDCARBPROC wglReleasePbufferDCARB;
   static PFNWGLMAKECONTEXTCURRENTARBPROC wglMakeContextCurrentARB;
+  static PFNWGLDESTROYPBUFFERARBPROC wglDestroyPbufferARB;
 #endif
 };
 
@@ -59,7 +59,7 @@ GLvoid CALLBACK combineDataCallback(GLdouble coords[3], GLdouble* vertex_data[4]
 GLvoid CALLBACK vertexCallback(GLdouble *vertex);
 
 OglRenderer::OglRenderer(ms_uint32 width, ms_uint32 height, colorObj* color)
-  : width(width), height(height), texture(NULL), transparency(1.0), valid(false)
+  : width(width), height(height), texture(NULL), transparency(1.0), valid(false), readBuffer(NULL)
 {
   context = new OglContext(width, height);
   if (!context->isValid()) return;
@@ -127,6 +127,7 @@ OglRenderer::~OglRenderer()
   glViewport(viewportX, viewportY, viewportWidth, viewportHeight);
   glPopMatrix();
   delete context;
+  delete[] readBuffer;
 }
 
 OglCachePtr OglRenderer::getTexture()
@@ -204,10 +205,17 @@ void OglRenderer::initializeRasterBuffer(rasterBufferObj * rb, int width, int he
   rb->height = height;
 }
 
-void OglRenderer::readRasterBuffer(rasterBufferObj * rb)
+void OglRenderer::readRasterBuffer(rasterBufferObj * rb, bool copy)
 {
   makeCurrent();
-  unsigned char* buffer = new unsigned char[4 * width * height];
+  unsigned char* buffer;
+  if (copy) {
+    buffer = new unsigned char[4 * width * height];
+  } else {
+    // a handle stays owned by the renderer, read into the same buffer each time
+    if (!readBuffer) readBuffer = new unsigned char[4 * width * height];
+    buffer = readBuffer;
+  }
   glReadPixels(0, 0, width, height, GL_BGRA, GL_UNSIGNED_BYTE, buffer);
 
   rb->type =MS_BUFFER_BYTE_RGBA;
@@ -437,18 +445,22 @@ void OglRenderer::renderPolyline(shapeObj *p, colorObj *c, double width,
     double circleScale = width / SHAPE_CIRCLE_RADIUS / 2;
     glLineWidth(width);
     if (quads || (width > 1.0 && (lineCap == MS_CJC_ROUND || joinStyle == MS_CJC_ROUND))) {
+      if (!quads) {
+        // the segments in one batch, the caps and joins are drawn after them in the same color
+        glBegin(GL_LINES);
+        for (int j = 0; j < p->numlines; j++) {
+          for (int i = 0; i < p->line[j].numpoints - 1; i++) {
+            glVertex2f(p->line[j].point[i].x, p->line[j].point[i].y);
+            glVertex2f(p->line[j].point[i + 1].x,p->line[j].point[i + 1].y);
+          }
+        }
+        glEnd();
+      }
       for (int j = 0; j < p->numlines; j++) {
         for (int i = 0; i < p->line[j].numpoints; i++) {
-          if (i != p->line[j].numpoints - 1) {
-            if (quads) {
-              drawQuad(&p->line[j].point[i], &p->line[j].point[i
-                       + 1], width);
-            } else {
-              glBegin(GL_LINES);
-              glVertex2f(p->line[j].point[i].x, p->line[j].point[i].y);
-              glVertex2f(p->line[j].point[i + 1].x,p->line[j].point[i + 1].y);
-              glEnd();
-            }
+          if (quads && i != p->line[j].numpoints - 1) {
+            drawQuad(&p->line[j].point[i], &p->line[j].point[i
+                     + 1], width);
           }
           if ((lineCap == MS_CJC_ROUND && (i == 0 || i == p->line[j].numpoints - 1)) ||
               (joinStyle == MS_CJC_ROUND && (i > 0 && i < p->line[j].numpoints - 1))) {
@@ -493,7 +505,7 @@ void OglRenderer::renderPolygon(shapeObj *p, colorObj *color, colorObj *outlinec
    Reports need for a combine callback.
    */
   makeCurrent();
-  std::vector<GLdouble*> pointers;
+  std::vector<GLdouble> vertices;
   double texWidth = 0;
   double texHeight = 0;
 
@@ -503,13 +515,18 @@ void OglRenderer::renderPolygon(shapeObj *p, colorObj *color, colorObj *outlinec
     texHeight = tile->height;
   }
   setColor(color);
+
+  // all the vertices in one array, the tessellator keeps pointers into it
+  size_t numpoints = 0;
+  for (int j = 0; j < p->numlines; j++)
+    numpoints += p->line[j].numpoints;
+  vertices.resize(5 * numpoints);
+
   gluTessBeginPolygon(tess, NULL );
+  GLdouble* dbls = vertices.empty() ? NULL : &vertices[0];
   for (int j = 0; j < p->numlines; j++) {
     gluTessBeginContour(tess);
-    for (int i = 0; i < p->line[j].numpoints; i++) {
-      // create temp array and place
-      GLdouble* dbls = new GLdouble[5];
-      pointers.push_back(dbls);
+    for (int i = 0; i < p->line[j].numpoints; i++, dbls += 5) {
       dbls[0] = p->line[j].point[i].x;
       dbls[1] = p->line[j].point[i].y;
       dbls[2] = 0.0;
@@ -522,12 +539,6 @@ void OglRenderer::renderPolygon(shapeObj *p, colorObj *color, colorObj *outlinec
   }
   gluTessEndPolygon(tess);
 
-  // destroy temp arrays
-  for (std::vector<GLdouble*>::iterator iter = pointers.begin(); iter
-       != pointers.end(); iter++) {
-    delete[] *iter;
-  }
-
   glBindTexture(GL_TEXTURE_2D, 0); // Select Our Texture
 
   if (outlinecolor != NULL && MS_VALID_COLOR(*outlinecolor) && outlinewidth > 0) {
@@ -735,6 +746,9 @@ GLvoid CALLBACK vertexCallback(GLdouble *vertex)
 
 void OglRenderer::createShapes()
 {
+  // display lists are shared by all the contexts, create them once
+  if (!shapes.empty()) return;
+
   double da = MS_MIN(OGL_PI / 2, OGL_PI / SHAPE_CIRCLE_RES);
   GLuint circle = glGenLists(1);
   glNewList(circle, GL_COMPILE);
@@ -75,7 +75,7 @@ public:
   static bool getStringBBox(char *font, double size, char *string, rectObj *rect, double** advances);
   void setTransparency(double transparency);
 
-  void readRasterBuffer(rasterBufferObj * rb);
+  void readRasterBuffer(rasterBufferObj * rb, bool copy = true);
   void drawRasterBuffer(rasterBufferObj *overlay, double opacity, int srcX, int srcY, int dstX, int dstY, int width, int height);
   static void initializeRasterBuffer(rasterBufferObj * rb, int width, int height, bool useAlpha);
 
@@ -96,6 +96,7 @@ protected:
   ms_uint32 height;
   double transparency;
   bool valid;
+  unsigned char* readBuffer;
 
   GLint viewportX;
   GLint viewportY;
@@ -48,6 +48,13 @@
 
 // GDAL 1.x API
 #include "ogr_api.h"
+#include "uthash.h"
+
+#if GDAL_VERSION_NUM >= 3060000
+/* OGR_L_GetArrowStream() and the Arrow C data interface (ogr_recordbatch.h) */
+#define MSOGR_ARROW_STREAM
+#include "ogr_recordbatch.h"
+#endif
 
 typedef struct ms_ogr_file_info_t {
   char        *pszFname;
@@ -74,6 +81,24 @@ typedef struct ms_ogr_file_info_t {
 
   int   bPaging;
 
+  /* Tiles of a tileindex opened ahead, PROCESSING "TILE_PREFETCH=n" */
+  struct ms_ogr_tile_prefetch_t **papsPrefetch; /* in tileindex order */
+  int   nPrefetch;
+  int   bTileIndexDone;                 /* no tile left to prefetch */
+
+#ifdef MSOGR_ARROW_STREAM
+  /* Draw rows read as Arrow batches, PROCESSING "ARROW_STREAM=ON" */
+  int   bArrowActive;                   /* sStream and sSchema are set */
+  struct ArrowArrayStream sStream;
+  struct ArrowSchema sSchema;
+  struct ArrowArray sBatch;             /* current batch, release is NULL if none */
+  GIntBig nBatchRow;                    /* next row of sBatch */
+  int   nGeomChild;                     /* column of the WKB geometry */
+  int   nFidChild;                      /* column of the FID, -1 if none */
+  int  *panItemChild;                   /* column of each item of the layer */
+  int  *panItemPrecision;               /* decimals of real items with a width, -1 otherwise */
+#endif
+
 } msOGRFileInfo;
 
 static int msOGRLayerIsOpen(layerObj *layer);
@@ -81,6 +106,10 @@ static int msOGRLayerInitItemInfo(layerObj *layer);
 static int msOGRLayerGetAutoStyle(mapObj *map, layerObj *layer, classObj *c,
                                   shapeObj* shape);
 static void msOGRCloseConnection( void *conn_handle );
+#ifdef MSOGR_ARROW_STREAM
+static void msOGRArrowClose(msOGRFileInfo *psInfo);
+#endif
+static void msOGRTilePrefetchDiscard(layerObj *layer, msOGRFileInfo *psInfo);
 
 /* ==================================================================
  * Geometry conversion functions
@@ -1080,6 +1109,100 @@ void msOGRInitialize(void)
 
 #ifdef USE_OGR
 
+/* ------------------------------------------------------------------
+ * Pooled datasources.  With CLOSE_CONNECTION=DEFER an OGR datasource
+ * stays open across requests (and up to CONNECTION_POOL_IDLE seconds
+ * unused).  The modification time and size of a local file or directory
+ * datasource are noted when it is opened, and msOGRConnectionAlive()
+ * has the pool drop it once they change, so a GeoPackage or directory
+ * replaced on disk is opened again.  /vsi paths are not checked, a stat
+ * of a remote file may cost as much as the open saved.
+ * ------------------------------------------------------------------ */
+typedef struct {
+  OGRDataSourceH hDS;
+  char *pszName;
+  time_t mtime;
+  GIntBig size;
+  UT_hash_handle hh;
+} msOGRDataSourceStamp;
+
+static msOGRDataSourceStamp *ogr_stamps = NULL; /* protected by TLOCK_OGR */
+
+static int msOGRStatDataSource(const char *pszName, time_t *mtime, GIntBig *size)
+{
+  VSIStatBufL sStat;
+
+  if( pszName == NULL || EQUALN(pszName, "/vsi", 4) )
+    return MS_FALSE;
+  if( VSIStatL(pszName, &sStat) != 0 )
+    return MS_FALSE; /* not a file, e.g. PG: or WFS: */
+
+  *mtime = sStat.st_mtime;
+  *size = (GIntBig) sStat.st_size;
+  return MS_TRUE;
+}
+
+/* notes the stamp of a datasource just opened, called with the OGR lock held */
+static void msOGRNoteDataSource(OGRDataSourceH hDS)
+{
+  msOGRDataSourceStamp *stamp;
+  const char *pszName = OGR_DS_GetName(hDS);
+  time_t mtime;
+  GIntBig size;
+
+  if( !msOGRStatDataSource(pszName, &mtime, &size) )
+    return;
+
+  stamp = (msOGRDataSourceStamp *) msSmallCalloc(1, sizeof(msOGRDataSourceStamp));
+  stamp->hDS = hDS;
+  stamp->pszName = msStrdup(pszName);
+  stamp->mtime = mtime;
+  stamp->size = size;
+  UT_HASH_ADD_PTR(ogr_stamps, hDS, stamp);
+}
+
+/* forgets the stamp of a datasource being closed, called with the OGR lock held */
+static void msOGRForgetDataSource(OGRDataSourceH hDS)
+{
+  msOGRDataSourceStamp *stamp;
+
+  UT_HASH_FIND_PTR(ogr_stamps, &hDS, stamp);
+  if( stamp ) {
+    UT_HASH_DEL(ogr_stamps, stamp);
+    msFree(stamp->pszName);
+    msFree(stamp);
+  }
+}
+
+/************************************************************************/
+/*                        msOGRConnectionAlive()                        */
+/*                                                                      */
+/*      Callback for the pool before an idle datasource is reused:      */
+/*      false once the file it was opened from changed.                 */
+/************************************************************************/
+
+static int msOGRConnectionAlive( void *conn_handle )
+
+{
+  OGRDataSourceH hDS = (OGRDataSourceH) conn_handle;
+  msOGRDataSourceStamp *stamp;
+  int alive = MS_TRUE;
+  time_t mtime;
+  GIntBig size;
+
+  ACQUIRE_OGR_LOCK;
+  UT_HASH_FIND_PTR(ogr_stamps, &hDS, stamp);
+  if( stamp && (!msOGRStatDataSource(stamp->pszName, &mtime, &size) ||
+                mtime != stamp->mtime || size != stamp->size) ) {
+    if( msGetGlobalDebugLevel() >= MS_DEBUGLEVEL_DEBUG )
+      msDebug("msOGRConnectionAlive(): %s changed, opening it again.\n", stamp->pszName);
+    alive = MS_FALSE;
+  }
+  RELEASE_OGR_LOCK;
+
+  return alive;
+}
+
 /**********************************************************************
  *                     msOGRFileOpen()
  *
@@ -1172,8 +1295,17 @@ msOGRFileOpen(layerObj *layer, const char *connection )
     if( layer->debug )
       msDebug("OGROPen(%s)\n", pszDSSelectedName);
 
+#if GDAL_VERSION_MAJOR >= 2
+    /* GDAL opens distinct datasets concurrently, don't hold up the other
+       layers (and the tiles opened ahead) while this one is opened */
+    hDS = OGROpen( pszDSSelectedName, MS_FALSE, NULL );
+    ACQUIRE_OGR_LOCK;
+#else
     ACQUIRE_OGR_LOCK;
     hDS = OGROpen( pszDSSelectedName, MS_FALSE, NULL );
+#endif
+    if( hDS != NULL )
+      msOGRNoteDataSource( hDS );
     RELEASE_OGR_LOCK;
 
     if( hDS == NULL ) {
@@ -1194,7 +1326,7 @@ msOGRFileOpen(layerObj *layer, const char *connection )
       return NULL;
     }
 
-    msConnPoolRegister( layer, hDS, msOGRCloseConnection );
+    msConnPoolRegisterEx( layer, hDS, msOGRCloseConnection, msOGRConnectionAlive );
   }
 
   CPLFree( pszDSName );
@@ -1477,6 +1609,7 @@ static void msOGRCloseConnection( void *conn_handle )
   OGRDataSourceH hDS = (OGRDataSourceH) conn_handle;
 
   ACQUIRE_OGR_LOCK;
+  msOGRForgetDataSource( hDS );
   OGR_DS_Destroy( hDS );
   RELEASE_OGR_LOCK;
 }
@@ -1497,12 +1630,19 @@ static int msOGRFileClose(layerObj *layer, msOGRFileInfo *psInfo )
   CPLFree(psInfo->pszLayerDef);
 
   ACQUIRE_OGR_LOCK;
+#ifdef MSOGR_ARROW_STREAM
+  msOGRArrowClose(psInfo);
+#endif
   if (psInfo->hLastFeature)
     OGR_F_Destroy( psInfo->hLastFeature );
 
   /* If nLayerIndex == -1 then the layer is an SQL result ... free it */
   if( psInfo->nLayerIndex == -1 )
     OGR_DS_ReleaseResultSet( psInfo->hDS, psInfo->hLayer );
+#if GDAL_VERSION_NUM >= 1800
+  else if( psInfo->hLayer != NULL )
+    OGR_L_SetIgnoredFields( psInfo->hLayer, NULL ); /* the datasource may be pooled */
+#endif
 
   // Release (potentially close) the datasource connection.
   // Make sure we aren't holding the lock when the callback may need it.
@@ -1512,6 +1652,7 @@ static int msOGRFileClose(layerObj *layer, msOGRFileInfo *psInfo )
   // Free current tile if there is one.
   if( psInfo->poCurTile != NULL )
     msOGRFileClose( layer, psInfo->poCurTile );
+  msOGRTilePrefetchDiscard( layer, psInfo );
   
   msFree(psInfo->pszSelect);
   msFree(psInfo->pszSpatialFilterTableName);
@@ -1853,6 +1994,16 @@ static int msOGRFileWhichShapes(layerObj *layer, rectObj rect, msOGRFileInfo *ps
         return(MS_FAILURE);
     }
 
+    msOGRTilePrefetchDiscard(layer, psInfo); /* opened for the previous selection */
+
+#ifdef MSOGR_ARROW_STREAM
+    if (psInfo->bArrowActive) {
+        ACQUIRE_OGR_LOCK;
+        msOGRArrowClose(psInfo);
+        RELEASE_OGR_LOCK;
+    }
+#endif
+
     char *select = (psInfo->pszSelect) ? msStrdup(psInfo->pszSelect) : NULL;
 
     // we'll go strictly two possible ways: 
@@ -2061,6 +2212,12 @@ static int msOGRFileWhichShapes(layerObj *layer, rectObj rect, msOGRFileInfo *ps
         {
           OGR_DS_ReleaseResultSet( psInfo->hDS, psInfo->hLayer );
         }
+#if GDAL_VERSION_NUM >= 1800
+        else if( psInfo->hLayer != NULL )
+        {
+          OGR_L_SetIgnoredFields( psInfo->hLayer, NULL ); /* the SQL may use any field */
+        }
+#endif
         psInfo->hLayer = OGR_DS_ExecuteSQL( psInfo->hDS, select, NULL, NULL );
         psInfo->nLayerIndex = -1;
 
@@ -2316,6 +2473,343 @@ static char **msOGRFileGetItems(layerObj *layer, msOGRFileInfo *psInfo )
   return items;
 }
 
+#ifdef MSOGR_ARROW_STREAM
+/**********************************************************************
+ *                     msOGRArrowClose()
+ *
+ * Releases the Arrow stream of the layer, if any, for its features to
+ * be read again from the start. Called with the OGR lock held.
+ **********************************************************************/
+static void msOGRArrowClose(msOGRFileInfo *psInfo)
+{
+  if (!psInfo->bArrowActive)
+    return;
+
+  if (psInfo->sBatch.release)
+    psInfo->sBatch.release(&psInfo->sBatch);
+  if (psInfo->sSchema.release)
+    psInfo->sSchema.release(&psInfo->sSchema);
+  if (psInfo->sStream.release)
+    psInfo->sStream.release(&psInfo->sStream);
+  msFree(psInfo->panItemChild);
+  psInfo->panItemChild = NULL;
+  msFree(psInfo->panItemPrecision);
+  psInfo->panItemPrecision = NULL;
+  psInfo->bArrowActive = MS_FALSE;
+
+  OGR_L_ResetReading( psInfo->hLayer );
+  psInfo->last_record_index_read = -1;
+}
+
+/* Arrow formats of the columns read as items: booleans, integers, reals and strings */
+static int msOGRArrowFormatSupported(const char *format)
+{
+  return format[0] != '\0' && format[1] == '\0' && strchr("bcCsSiIlLfguU", format[0]) != NULL;
+}
+
+/**********************************************************************
+ *                     msOGRArrowOpen()
+ *
+ * Called once the filters of a draw are set: with PROCESSING
+ * "ARROW_STREAM=ON" msOGRFileNextShape() then reads the rows from
+ * OGR_L_GetArrowStream() batches, the WKB geometry and the typed
+ * attribute columns taken directly instead of through an OGRFeature.
+ * Layers whose items can't all be read that way (OGR style string
+ * attributes, STYLEITEM "AUTO", dates, lists...) keep reading features.
+ **********************************************************************/
+static void msOGRArrowOpen(layerObj *layer, msOGRFileInfo *psInfo)
+{
+  const char *pszArrow = msLayerGetProcessingKey(layer, "ARROW_STREAM");
+  int *itemindexes = (int*)layer->iteminfo;
+  char **papszOptions = NULL;
+  const char *pszGeomColumn, *pszFidColumn;
+  OGRFeatureDefnH hDefn;
+  int i, j, bOK = MS_TRUE;
+
+  if (pszArrow == NULL || !EQUAL(pszArrow, "ON"))
+    return;
+  if (layer->styleitem && EQUAL(layer->styleitem, "AUTO"))
+    return; /* needs the style string of the features */
+  if (layer->numitems > 0 && itemindexes == NULL)
+    return;
+  for (i = 0; i < layer->numitems; i++) {
+    if (itemindexes[i] < 0)
+      return; /* attribute of the style string */
+  }
+
+  ACQUIRE_OGR_LOCK;
+
+  memset(&psInfo->sStream, 0, sizeof(psInfo->sStream));
+  memset(&psInfo->sSchema, 0, sizeof(psInfo->sSchema));
+  memset(&psInfo->sBatch, 0, sizeof(psInfo->sBatch));
+
+  papszOptions = CSLAddString(papszOptions, "INCLUDE_FID=YES");
+  if (!OGR_L_GetArrowStream(psInfo->hLayer, &psInfo->sStream, papszOptions)) {
+    CSLDestroy(papszOptions);
+    OGR_L_ResetReading( psInfo->hLayer );
+    RELEASE_OGR_LOCK;
+    if (layer->debug)
+      msDebug("msOGRArrowOpen(): No Arrow stream for layer %s, reading features.\n", layer->name?layer->name:"(null)");
+    return;
+  }
+  CSLDestroy(papszOptions);
+  psInfo->bArrowActive = MS_TRUE;
+
+  if (psInfo->sStream.get_schema(&psInfo->sStream, &psInfo->sSchema) != 0) {
+    msOGRArrowClose(psInfo);
+    RELEASE_OGR_LOCK;
+    return;
+  }
+
+  /* the columns are named after the fields, the geometry and FID ones as OGR_L_GetArrowStream() does */
+  pszGeomColumn = OGR_L_GetGeometryColumn(psInfo->hLayer);
+  if (pszGeomColumn == NULL || pszGeomColumn[0] == '\0')
+    pszGeomColumn = "wkb_geometry";
+  pszFidColumn = OGR_L_GetFIDColumn(psInfo->hLayer);
+  if (pszFidColumn == NULL || pszFidColumn[0] == '\0')
+    pszFidColumn = "OGC_FID";
+
+  psInfo->nGeomChild = -1;
+  psInfo->nFidChild = -1;
+  for (j = 0; j < psInfo->sSchema.n_children; j++) {
+    const struct ArrowSchema *child = psInfo->sSchema.children[j];
+    if (psInfo->nGeomChild < 0 && strcmp(child->name, pszGeomColumn) == 0 &&
+        (strcmp(child->format, "z") == 0 || strcmp(child->format, "Z") == 0))
+      psInfo->nGeomChild = j;
+    else if (psInfo->nFidChild < 0 && strcmp(child->name, pszFidColumn) == 0 && strcmp(child->format, "l") == 0)
+      psInfo->nFidChild = j;
+  }
+  if (psInfo->nGeomChild < 0)
+    bOK = MS_FALSE;
+
+  hDefn = OGR_L_GetLayerDefn(psInfo->hLayer);
+  psInfo->panItemChild = (int *) msSmallMalloc(sizeof(int) * MS_MAX(layer->numitems, 1));
+  psInfo->panItemPrecision = (int *) msSmallMalloc(sizeof(int) * MS_MAX(layer->numitems, 1));
+  for (i = 0; i < layer->numitems && bOK; i++) {
+    OGRFieldDefnH hField = OGR_FD_GetFieldDefn(hDefn, itemindexes[i]);
+    const char *pszName = OGR_Fld_GetNameRef(hField);
+
+    psInfo->panItemChild[i] = -1;
+    for (j = 0; j < psInfo->sSchema.n_children; j++) {
+      if (strcmp(psInfo->sSchema.children[j]->name, pszName) == 0) {
+        psInfo->panItemChild[i] = j;
+        break;
+      }
+    }
+    if (psInfo->panItemChild[i] < 0 ||
+        !msOGRArrowFormatSupported(psInfo->sSchema.children[psInfo->panItemChild[i]]->format))
+      bOK = MS_FALSE;
+
+    /* as OGR_F_GetFieldAsString() formats reals */
+    psInfo->panItemPrecision[i] = -1;
+    if (OGR_Fld_GetType(hField) == OFTReal && OGR_Fld_GetWidth(hField) > 0)
+      psInfo->panItemPrecision[i] = OGR_Fld_GetPrecision(hField);
+  }
+
+  if (!bOK) {
+    if (layer->debug)
+      msDebug("msOGRArrowOpen(): Columns of layer %s not readable from Arrow, reading features.\n", layer->name?layer->name:"(null)");
+    msOGRArrowClose(psInfo);
+  } else {
+    psInfo->nBatchRow = 0;
+    psInfo->last_record_index_read = -1;
+    if (layer->debug)
+      msDebug("msOGRArrowOpen(): Reading layer %s from an Arrow stream.\n", layer->name?layer->name:"(null)");
+  }
+
+  RELEASE_OGR_LOCK;
+}
+
+/* value i (offsets included) of a column is null */
+static int msOGRArrowIsNull(const struct ArrowArray *array, GIntBig i)
+{
+  const unsigned char *validity = (const unsigned char *) array->buffers[0];
+
+  if (array->null_count == 0 || validity == NULL)
+    return MS_FALSE;
+  return !(validity[i / 8] & (1 << (i % 8)));
+}
+
+/* value i of a binary ("z", "Z") or string ("u", "U") column */
+static const char *msOGRArrowGetBinary(const struct ArrowSchema *schema, const struct ArrowArray *array,
+                                       GIntBig i, size_t *length)
+{
+  const char *data = (const char *) array->buffers[2];
+
+  if (schema->format[0] == 'Z' || schema->format[0] == 'U') {
+    const GIntBig *offsets = (const GIntBig *) array->buffers[1];
+    *length = (size_t) (offsets[i+1] - offsets[i]);
+    return data + offsets[i];
+  } else {
+    const int *offsets = (const int *) array->buffers[1];
+    *length = (size_t) (offsets[i+1] - offsets[i]);
+    return data + offsets[i];
+  }
+}
+
+/* value i of a column of msOGRArrowFormatSupported() as MapServer item text */
+static char *msOGRArrowGetString(const struct ArrowSchema *schema, const struct ArrowArray *array,
+                                 GIntBig i, int precision)
+{
+  char szValue[64];
+  const void *values = array->buffers[1];
+  double dfValue;
+
+  if (msOGRArrowIsNull(array, i))
+    return msStrdup(""); /* as an unset field */
+
+  switch (schema->format[0]) {
+    case 'b':
+      return msStrdup((((const unsigned char *) values)[i / 8] & (1 << (i % 8))) ? "1" : "0");
+    case 'c':
+      snprintf(szValue, sizeof(szValue), "%d", (int) ((const signed char *) values)[i]);
+      return msStrdup(szValue);
+    case 'C':
+      snprintf(szValue, sizeof(szValue), "%d", (int) ((const unsigned char *) values)[i]);
+      return msStrdup(szValue);
+    case 's':
+      snprintf(szValue, sizeof(szValue), "%d", (int) ((const short *) values)[i]);
+      return msStrdup(szValue);
+    case 'S':
+      snprintf(szValue, sizeof(szValue), "%d", (int) ((const unsigned short *) values)[i]);
+      return msStrdup(szValue);
+    case 'i':
+      snprintf(szValue, sizeof(szValue), "%d", ((const int *) values)[i]);
+      return msStrdup(szValue);
+    case 'I':
+      snprintf(szValue, sizeof(szValue), "%u", ((const unsigned int *) values)[i]);
+      return msStrdup(szValue);
+    case 'l':
+      snprintf(szValue, sizeof(szValue), CPL_FRMT_GIB, ((const GIntBig *) values)[i]);
+      return msStrdup(szValue);
+    case 'L':
+      snprintf(szValue, sizeof(szValue), CPL_FRMT_GUIB, ((const GUIntBig *) values)[i]);
+      return msStrdup(szValue);
+    case 'f':
+    case 'g':
+      dfValue = (schema->format[0] == 'f') ? ((const float *) values)[i] : ((const double *) values)[i];
+      if (precision >= 0)
+        snprintf(szValue, sizeof(szValue), "%.*f", precision, dfValue);
+      else
+        snprintf(szValue, sizeof(szValue), "%.15g", dfValue);
+      return msStrdup(szValue);
+    default: { /* 'u', 'U' */
+      size_t length;
+      const char *data = msOGRArrowGetBinary(schema, array, i, &length);
+      char *pszValue = (char *) msSmallMalloc(length + 1);
+      memcpy(pszValue, data, length);
+      pszValue[length] = '\0';
+      return pszValue;
+    }
+  }
+}
+
+/**********************************************************************
+ *                     msOGRArrowNextShape()
+ *
+ * msOGRFileNextShape() for a layer reading an Arrow stream.
+ **********************************************************************/
+static int msOGRArrowNextShape(layerObj *layer, shapeObj *shape, msOGRFileInfo *psInfo)
+{
+  struct ArrowArray *batch = &psInfo->sBatch;
+  GIntBig row = 0;
+  int i;
+
+  msFreeShape(shape);
+  shape->type = MS_SHAPE_NULL;
+
+  ACQUIRE_OGR_LOCK;
+  while (shape->type == MS_SHAPE_NULL) {
+    const struct ArrowArray *geom;
+    GIntBig idx;
+
+    if (batch->release == NULL || psInfo->nBatchRow >= batch->length) {
+      if (batch->release)
+        batch->release(batch);
+      memset(batch, 0, sizeof(*batch));
+      if (psInfo->sStream.get_next(&psInfo->sStream, batch) != 0) {
+        const char *pszError = psInfo->sStream.get_last_error(&psInfo->sStream);
+        msSetError(MS_OGRERR, "%s", "msOGRFileNextShape()", pszError ? pszError : "Reading the Arrow stream failed.");
+        RELEASE_OGR_LOCK;
+        return MS_FAILURE;
+      }
+      if (batch->release == NULL) {
+        psInfo->last_record_index_read = -1;
+        RELEASE_OGR_LOCK;
+        if (layer->debug >= MS_DEBUGLEVEL_VV)
+          msDebug("msOGRFileNextShape: Returning MS_DONE (no more shapes)\n" );
+        return MS_DONE;  // No more batches to read
+      }
+      psInfo->nBatchRow = 0;
+      continue;
+    }
+
+    row = psInfo->nBatchRow++;
+    psInfo->last_record_index_read++;
+
+    geom = batch->children[psInfo->nGeomChild];
+    idx = batch->offset + row + geom->offset;
+    if (!msOGRArrowIsNull(geom, idx)) {
+      OGRGeometryH hGeom = NULL;
+      size_t length;
+      const char *wkb = msOGRArrowGetBinary(psInfo->sSchema.children[psInfo->nGeomChild], geom, idx, &length);
+
+      if (OGR_G_CreateFromWkb((unsigned char *) wkb, NULL, &hGeom, (int) length) == OGRERR_NONE && hGeom != NULL) {
+        int status;
+
+        hGeom = OGR_G_ForceTo(hGeom, OGR_GT_GetLinear(OGR_G_GetGeometryType(hGeom)), NULL);
+        status = ogrConvertGeometry(hGeom, shape, layer->type);
+        OGR_G_DestroyGeometry(hGeom);
+        if (status != MS_SUCCESS) {
+          msFreeShape(shape);
+          RELEASE_OGR_LOCK;
+          return MS_FAILURE; // Error message already produced.
+        }
+      }
+    }
+
+    if (shape->type == MS_SHAPE_NULL) {
+      // Feature rejected... free shape to clear its parts.
+      msFreeShape(shape);
+      shape->type = MS_SHAPE_NULL;
+    }
+  }
+
+  if (layer->numitems > 0) {
+    shape->values = (char **) msSmallMalloc(sizeof(char *) * layer->numitems);
+    shape->numvalues = layer->numitems;
+    for (i = 0; i < layer->numitems; i++) {
+      int child = psInfo->panItemChild[i];
+      const struct ArrowArray *column = batch->children[child];
+      shape->values[i] = msOGRArrowGetString(psInfo->sSchema.children[child], column,
+                                             batch->offset + row + column->offset, psInfo->panItemPrecision[i]);
+    }
+  }
+
+  if (psInfo->nFidChild >= 0) {
+    const struct ArrowArray *fid = batch->children[psInfo->nFidChild];
+    shape->index = (long) ((const GIntBig *) fid->buffers[1])[batch->offset + row + fid->offset];
+  } else
+    shape->index = psInfo->last_record_index_read;
+  shape->resultindex = psInfo->last_record_index_read;
+  shape->tileindex = psInfo->nTileId;
+
+  if (layer->debug >= MS_DEBUGLEVEL_VVV)
+    msDebug("msOGRFileNextShape: Returning shape=%ld, tile=%d\n",
+            shape->index, shape->tileindex );
+
+  // No feature to keep for style info.
+  if (psInfo->hLastFeature) {
+    OGR_F_Destroy( psInfo->hLastFeature );
+    psInfo->hLastFeature = NULL;
+  }
+
+  RELEASE_OGR_LOCK;
+
+  return MS_SUCCESS;
+}
+#endif /* MSOGR_ARROW_STREAM */
+
 /**********************************************************************
  *                     msOGRFileNextShape()
  *
@@ -2336,6 +2830,11 @@ msOGRFileNextShape(layerObj *layer, shapeObj *shape,
     return(MS_FAILURE);
   }
 
+#ifdef MSOGR_ARROW_STREAM
+  if (psInfo->bArrowActive)
+    return msOGRArrowNextShape(layer, shape, psInfo);
+#endif
+
   /* ------------------------------------------------------------------
    * Read until we find a feature that matches attribute filter and
    * whose geometry is compatible with current layer type.
@@ -2443,6 +2942,14 @@ msOGRFileGetShape(layerObj *layer, shapeObj *shape, long record,
   msFreeShape(shape);
   shape->type = MS_SHAPE_NULL;
 
+#ifdef MSOGR_ARROW_STREAM
+  if (psInfo->bArrowActive) { /* the layer can't be read by features while streaming */
+    ACQUIRE_OGR_LOCK;
+    msOGRArrowClose(psInfo);
+    RELEASE_OGR_LOCK;
+  }
+#endif
+
   /* -------------------------------------------------------------------- */
   /*      Support reading feature by fid.                                 */
   /* -------------------------------------------------------------------- */
@@ -2543,6 +3050,168 @@ msOGRFileGetShape(layerObj *layer, shapeObj *shape, long record,
 /*      the current rectangle.                                          */
 /************************************************************************/
 
+/************************************************************************/
+/*                          Tile prefetch                               */
+/*                                                                      */
+/*      With PROCESSING "TILE_PREFETCH=n" on a tileindex layer, the     */
+/*      next n tiles of the index are opened by pool workers while      */
+/*      the features of the current one are read, so that tiles on      */
+/*      remote storage don't cost a round trip each in turn. The tiles  */
+/*      are still read one after the other, in the index order; their   */
+/*      spatial filter is set when they become the current tile.        */
+/************************************************************************/
+
+typedef struct ms_ogr_tile_prefetch_t {
+  layerObj *layer;
+  char *connection;
+  int nTileId;
+  msOGRFileInfo *psTileInfo; /* NULL if the open failed */
+  msThreadTaskObj *thread; /* NULL once waited for */
+  void *threadid; /* of the thread reading the layer */
+  char *errormsg;
+} msOGRTilePrefetch;
+
+static void msOGRTilePrefetchTask(void *data)
+{
+  msOGRTilePrefetch *prefetch = (msOGRTilePrefetch *) data;
+
+  prefetch->psTileInfo = msOGRFileOpen( prefetch->layer, prefetch->connection );
+
+  /* errors stay with the thread reading the layer */
+  if( msGetThreadId() != prefetch->threadid ) {
+    if( prefetch->psTileInfo == NULL )
+      prefetch->errormsg = msGetErrorString((char *) "\n");
+    msResetErrorList();
+  }
+}
+
+static void msOGRTilePrefetchWait(msOGRTilePrefetch *prefetch)
+{
+  if( prefetch->thread ) {
+    msThreadTaskWait( prefetch->thread );
+    prefetch->thread = NULL;
+  }
+}
+
+static void msOGRTilePrefetchFree(msOGRTilePrefetch *prefetch)
+{
+  msFree( prefetch->connection );
+  msFree( prefetch->errormsg );
+  msFree( prefetch );
+}
+
+/* closes the tiles opened ahead that were not read */
+static void msOGRTilePrefetchDiscard(layerObj *layer, msOGRFileInfo *psInfo)
+{
+  int i;
+
+  for( i = 0; i < psInfo->nPrefetch; i++ ) {
+    msOGRTilePrefetchWait( psInfo->papsPrefetch[i] );
+    if( psInfo->papsPrefetch[i]->psTileInfo )
+      msOGRFileClose( layer, psInfo->papsPrefetch[i]->psTileInfo );
+    msOGRTilePrefetchFree( psInfo->papsPrefetch[i] );
+  }
+  msFree( psInfo->papsPrefetch );
+  psInfo->papsPrefetch = NULL;
+  psInfo->nPrefetch = 0;
+  psInfo->bTileIndexDone = MS_FALSE;
+}
+
+/************************************************************************/
+/*                     msOGRFileReadPrefetchedTile()                    */
+/*                                                                      */
+/*      msOGRFileReadTile() of the next tile with nPrefetchTiles        */
+/*      tiles kept being opened ahead.                                  */
+/************************************************************************/
+
+static int msOGRFileReadPrefetchedTile( layerObj *layer, msOGRFileInfo *psInfo, int nPrefetchTiles )
+
+{
+  msOGRFileInfo *psTileInfo = NULL;
+  msOGRTilePrefetch *prefetch;
+  int status;
+
+  while( psTileInfo == NULL ) {
+    /* -------------------------------------------------------------------- */
+    /*      Start opening tiles up to nPrefetchTiles ahead.                 */
+    /* -------------------------------------------------------------------- */
+    if( psInfo->papsPrefetch == NULL )
+      psInfo->papsPrefetch = (msOGRTilePrefetch **) msSmallCalloc( nPrefetchTiles, sizeof(msOGRTilePrefetch *) );
+
+    while( !psInfo->bTileIndexDone && psInfo->nPrefetch < nPrefetchTiles ) {
+      OGRFeatureH hFeature;
+
+      ACQUIRE_OGR_LOCK;
+      hFeature = OGR_L_GetNextFeature( psInfo->hLayer );
+      if( hFeature == NULL ) {
+        RELEASE_OGR_LOCK;
+        psInfo->bTileIndexDone = MS_TRUE;
+        break;
+      }
+
+      prefetch = (msOGRTilePrefetch *) msSmallCalloc( 1, sizeof(msOGRTilePrefetch) );
+      prefetch->layer = layer;
+      prefetch->connection = msStrdup( OGR_F_GetFieldAsString( hFeature, layer->tileitemindex ) );
+      prefetch->nTileId = (int)OGR_F_GetFID( hFeature ); // FIXME? GetFID() is a 64bit integer in GDAL 2.0
+      prefetch->threadid = msGetThreadId();
+      OGR_F_Destroy( hFeature );
+      RELEASE_OGR_LOCK;
+
+      prefetch->thread = msThreadTaskStart( msOGRTilePrefetchTask, prefetch );
+      if( prefetch->thread == NULL ) /* no workers, open it now */
+        msOGRTilePrefetchTask( prefetch );
+      psInfo->papsPrefetch[psInfo->nPrefetch++] = prefetch;
+
+      if( layer->debug >= MS_DEBUGLEVEL_V )
+        msDebug("msOGRFileReadTile(): prefetching tile %d (%s).\n", prefetch->nTileId, prefetch->connection );
+    }
+
+    if( psInfo->nPrefetch == 0 )
+      return MS_DONE;
+
+    /* -------------------------------------------------------------------- */
+    /*      Take the first one.                                             */
+    /* -------------------------------------------------------------------- */
+    prefetch = psInfo->papsPrefetch[0];
+    memmove( psInfo->papsPrefetch, psInfo->papsPrefetch + 1, sizeof(msOGRTilePrefetch *) * (psInfo->nPrefetch - 1) );
+    psInfo->nPrefetch--;
+
+    msOGRTilePrefetchWait( prefetch );
+    psTileInfo = prefetch->psTileInfo;
+    if( psTileInfo != NULL )
+      psTileInfo->nTileId = prefetch->nTileId;
+    else if( prefetch->errormsg )
+      msSetError( MS_OGRERR, "%s", "msOGRFileReadTile()", prefetch->errormsg );
+    msOGRTilePrefetchFree( prefetch );
+
+#ifdef IGNORE_MISSING_DATA
+    if( psTileInfo == NULL )
+      return MS_FAILURE;
+#endif
+  }
+
+  /* -------------------------------------------------------------------- */
+  /*      Initialize the spatial query on this file.                      */
+  /* -------------------------------------------------------------------- */
+  if( psInfo->rect.minx != 0 || psInfo->rect.maxx != 0 ) {
+    status = msOGRFileWhichShapes( layer, psInfo->rect, psTileInfo );
+    if( status != MS_SUCCESS ) {
+      msOGRFileClose( layer, psTileInfo );
+      return status;
+    }
+  }
+
+  psInfo->poCurTile = psTileInfo;
+
+  /* -------------------------------------------------------------------- */
+  /*      Update the iteminfo in case this layer has a different field    */
+  /*      list.                                                           */
+  /* -------------------------------------------------------------------- */
+  msOGRLayerInitItemInfo( layer );
+
+  return MS_SUCCESS;
+}
+
 int msOGRFileReadTile( layerObj *layer, msOGRFileInfo *psInfo,
                        int targetTile = -1 )
 
@@ -2557,6 +3226,16 @@ int msOGRFileReadTile( layerObj *layer, msOGRFileInfo *psInfo,
     psInfo->poCurTile = NULL;
   }
 
+  /* -------------------------------------------------------------------- */
+  /*      Reading the tiles in order, possibly opened ahead.              */
+  /* -------------------------------------------------------------------- */
+  if( targetTile == -1 ) {
+    const char *pszPrefetch = msLayerGetProcessingKey( layer, "TILE_PREFETCH" );
+    if( pszPrefetch && atoi(pszPrefetch) > 0 )
+      return msOGRFileReadPrefetchedTile( layer, psInfo, atoi(pszPrefetch) );
+  } else
+    msOGRTilePrefetchDiscard( layer, psInfo );
+
   /* -------------------------------------------------------------------- */
   /*      If -2 is passed, then seek reset reading of the tileindex.      */
   /*      We want to start from the beginning even if this file is        */
@@ -3047,7 +3726,7 @@ int msOGRLayerWhichShapes(layerObj *layer, rectObj rect, int isQuery)
 {
 #ifdef USE_OGR
   msOGRFileInfo *psInfo =(msOGRFileInfo*)layer->layerinfo;
-  int   status;
+  int   status, span;
 
   if (psInfo == NULL || psInfo->hLayer == NULL) {
     msSetError(MS_MISCERR, "Assertion failed: OGR layer not opened!!!",
@@ -3055,7 +3734,16 @@ int msOGRLayerWhichShapes(layerObj *layer, rectObj rect, int isQuery)
     return(MS_FAILURE);
   }
 
+  span = msTraceSpanBegin("msOGRLayerWhichShapes", MS_TRACE_CLIENT);
+  msTraceSpanAttribute(span, "mapserver.layer", layer->name);
   status = msOGRFileWhichShapes( layer, rect, psInfo );
+  msTraceSpanEnd(span, status);
+
+#ifdef MSOGR_ARROW_STREAM
+  /* queries are read again by resultindex, from the features */
+  if( status == MS_SUCCESS && layer->tileindex == NULL && !isQuery )
+    msOGRArrowOpen( layer, psInfo );
+#endif
 
   if( status != MS_SUCCESS || layer->tileindex == NULL )
     return status;
@@ -3077,6 +3765,63 @@ int msOGRLayerWhichShapes(layerObj *layer, rectObj rect, int isQuery)
 #endif /* USE_OGR */
 }
 
+/**********************************************************************
+ *                     msOGRLayerEstimateShapeCount()
+ *
+ * Feature count of the driver with the spatial and attribute filters
+ * of rect set, when it can tell it without reading the features (the
+ * spatial filter may only be checked against the feature bounds).
+ * Otherwise, or with a tile index, the shapes are counted.
+ **********************************************************************/
+int msOGRLayerEstimateShapeCount(layerObj *layer, rectObj rect, projectionObj *rectProjection)
+{
+#ifdef USE_OGR
+  msOGRFileInfo *psInfo =(msOGRFileInfo*)layer->layerinfo;
+  rectObj searchrect = rect;
+  GIntBig nCount;
+  int   status;
+
+  if (psInfo == NULL || psInfo->hLayer == NULL || layer->tileindex != NULL)
+    return LayerDefaultGetShapeCount(layer, rect, rectProjection);
+
+#ifdef USE_PROJ
+  if( rectProjection != NULL && layer->project &&
+      msProjectionsDiffer(&(layer->projection), rectProjection) )
+    msProjectRect(rectProjection, &(layer->projection), &searchrect); /* project the searchrect to source coords */
+#endif
+
+  status = msOGRFileWhichShapes( layer, searchrect, psInfo );
+  if( status == MS_DONE )
+    return 0;
+  if( status != MS_SUCCESS )
+    return -1;
+
+  ACQUIRE_OGR_LOCK;
+  nCount = OGR_L_GetFeatureCount( psInfo->hLayer, FALSE );
+  RELEASE_OGR_LOCK;
+
+  if( nCount < 0 ) { /* no fast count */
+    if( layer->debug )
+      msDebug("msOGRLayerEstimateShapeCount(): no fast feature count, counting.\n");
+    return LayerDefaultGetShapeCount(layer, rect, rectProjection);
+  }
+  if( layer->maxfeatures > 0 && nCount > layer->maxfeatures )
+    nCount = layer->maxfeatures;
+
+  return (int) nCount;
+
+#else
+  /* ------------------------------------------------------------------
+   * OGR Support not included...
+   * ------------------------------------------------------------------ */
+
+  msSetError(MS_MISCERR, "OGR support is not available.",
+             "msOGRLayerEstimateShapeCount()");
+  return -1;
+
+#endif /* USE_OGR */
+}
+
 /**********************************************************************
  *                     msOGRLayerGetItems()
  *
@@ -3238,6 +3983,33 @@ static int msOGRLayerInitItemInfo(layerObj *layer)
     }
   }
 
+#if GDAL_VERSION_NUM >= 1800
+  /* -------------------------------------------------------------------- */
+  /*      Let the driver skip the fields we don't use. Not for SQL        */
+  /*      results or when a native filter or sort may refer to them.      */
+  /* -------------------------------------------------------------------- */
+  if( psInfo->nLayerIndex != -1 && layer->filter.native_string == NULL &&
+      layer->sortBy.nProperties == 0 &&
+      msLayerGetProcessingKey(layer, "NATIVE_FILTER") == NULL ) {
+    char **papszIgnored = NULL;
+    int nFieldCount = OGR_FD_GetFieldCount( hDefn );
+    char *pabyUsed = (char *) msSmallCalloc(nFieldCount > 0 ? nFieldCount : 1, 1);
+
+    for(i=0; i<layer->numitems; i++) {
+      if(itemindexes[i] >= 0 && itemindexes[i] < nFieldCount)
+        pabyUsed[itemindexes[i]] = 1;
+    }
+    for(i=0; i<nFieldCount; i++) {
+      if(!pabyUsed[i])
+        papszIgnored = CSLAddString(papszIgnored, OGR_Fld_GetNameRef(OGR_FD_GetFieldDefn(hDefn, i)));
+    }
+    OGR_L_SetIgnoredFields( psInfo->hLayer, (const char **) papszIgnored );
+
+    CSLDestroy(papszIgnored);
+    msFree(pabyUsed);
+  }
+#endif /* GDAL_VERSION_NUM >= 1800 */
+
   return(MS_SUCCESS);
 #else
   /* ------------------------------------------------------------------
@@ -4270,7 +5042,14 @@ void msOGRCleanup( void )
 
 {
 #if defined(USE_OGR)
+  msOGRDataSourceStamp *stamp, *tmp;
+
   ACQUIRE_OGR_LOCK;
+  UT_HASH_ITER(hh, ogr_stamps, stamp, tmp) {
+    UT_HASH_DEL(ogr_stamps, stamp);
+    msFree(stamp->pszName);
+    msFree(stamp);
+  }
   if( bOGRDriversRegistered == MS_TRUE ) {
     CPLPopErrorHandler();
     OGRCleanupAll();
@@ -4383,6 +5162,7 @@ int msOGRLayerInitializeVirtualTable(layerObj *layer)
   layer->vtable->LayerNextShape = msOGRLayerNextShape;
   layer->vtable->LayerGetShape = msOGRLayerGetShape;
   /* layer->vtable->LayerGetShapeCount, use default */
+  layer->vtable->LayerEstimateShapeCount = msOGRLayerEstimateShapeCount;
   layer->vtable->LayerClose = msOGRLayerClose;
   layer->vtable->LayerGetItems = msOGRLayerGetItems;
   layer->vtable->LayerGetExtent = msOGRLayerGetExtent;
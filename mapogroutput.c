@@ -543,6 +543,8 @@ static int msOGRWriteShape( layerObj *map_layer, OGRLayerH hOGRLayer,
 
 #if defined(GDAL_COMPUTE_VERSION)
 #if GDAL_VERSION_NUM >= GDAL_COMPUTE_VERSION(2,0,0)
+#define MS_OGR_STDOUT_REDIRECTION
+
 /************************************************************************/
 /*                        msOGRStdoutWriteFunction()                    */
 /************************************************************************/
@@ -668,6 +670,340 @@ static char** msOGROutputGetAdditonalFiles( mapObj *map )
     return papszFiles;
 }
 
+/************************************************************************/
+/*                        msOGRGetCreationOptions()                     */
+/*                                                                      */
+/*      The format options starting with prefix (LCO: or DSCO:),        */
+/*      without it. Result to be freed with CSLDestroy().               */
+/************************************************************************/
+static char **msOGRGetCreationOptions( outputFormatObj *format, const char *prefix )
+{
+  char **options = NULL;
+  int i, len = strlen(prefix);
+
+  for( i=0; i < format->numformatoptions; i++ ) {
+    if( strncasecmp(format->formatoptions[i],prefix,len) == 0 )
+      options = CSLAddString( options, format->formatoptions[i] + len );
+  }
+
+  return options;
+}
+
+/************************************************************************/
+/*                      msOGRAddStreamLayerOptions()                    */
+/*                                                                      */
+/*      Layer creation options needed to write to /vsistdout/.          */
+/************************************************************************/
+static char **msOGRAddStreamLayerOptions( outputFormatObj *format,
+                                          char **layer_options )
+{
+  /* FlatGeobuf writes its spatial index before the features, and needs */
+  /* to seek for that */
+  if( EQUAL(format->driver+4,"FlatGeobuf") &&
+      CSLFetchNameValue( layer_options, "SPATIAL_INDEX" ) == NULL )
+    layer_options = CSLSetNameValue( layer_options, "SPATIAL_INDEX", "NO" );
+
+  return layer_options;
+}
+
+/************************************************************************/
+/*                        msOGRIsSequentialOutput()                     */
+/*                                                                      */
+/*      Whether the driver of format writes a single file as the        */
+/*      features come, so that it can be streamed to the client         */
+/*      instead of going through a temporary datasource.                */
+/************************************************************************/
+static int msOGRIsSequentialOutput( outputFormatObj *format )
+{
+  const char *driver = format->driver+4;
+
+  if( !EQUAL(msGetOutputFormatOption( format, "FORM", "" ),"simple") )
+    return MS_FALSE;
+
+  if( EQUAL(driver,"GeoJSON") || EQUAL(driver,"GeoJSONSeq") || EQUAL(driver,"CSV") )
+    return MS_TRUE;
+
+  if( EQUAL(driver,"FlatGeobuf") ) {
+    const char *value = msGetOutputFormatOption( format, "LCO:SPATIAL_INDEX", "NO" );
+    return EQUAL(value,"NO") || EQUAL(value,"FALSE") || EQUAL(value,"OFF");
+  }
+
+  return MS_FALSE;
+}
+
+/************************************************************************/
+/*                         msOGROutputLayerObj                          */
+/*                                                                      */
+/*      The OGR layer the features of a mapserver layer go to.          */
+/************************************************************************/
+typedef struct {
+  OGRLayerH hOGRLayer;
+  gmlItemListObj *item_list;
+  int nFirstOGRFieldIndex;
+  const char *pszFeatureid;
+} msOGROutputLayerObj;
+
+/************************************************************************/
+/*                        msOGRCreateOutputLayer()                      */
+/*                                                                      */
+/*      Create the OGR layer and fields for the features of layer,      */
+/*      whose items must be known.                                      */
+/************************************************************************/
+static int msOGRCreateOutputLayer( mapObj *map, layerObj *layer, OGRDataSourceH hDS,
+                                   outputFormatObj *format, char **layer_options,
+                                   int bUseFeatureId, msOGROutputLayerObj *out )
+{
+  int status, i;
+  OGRLayerH hOGRLayer;
+  OGRwkbGeometryType eGeomType;
+  OGRSpatialReferenceH srs = NULL;
+  gmlItemListObj *item_list = NULL;
+  const char *value;
+  char *pszWKT;
+  int  nFirstOGRFieldIndex = -1;
+  const char *pszFeatureid = NULL;
+
+  /* -------------------------------------------------------------------- */
+  /*      Will we need to reproject?                                      */
+  /* -------------------------------------------------------------------- */
+  if(layer->transform == MS_TRUE)
+      layer->project = msProjectionsDiffer(&(layer->projection),
+                             &(layer->map->projection));
+
+  /* -------------------------------------------------------------------- */
+  /*      Establish the geometry type to use for the created layer.       */
+  /*      First we consult the wfs_geomtype field and fallback to         */
+  /*      deriving something from the type of the mapserver layer.        */
+  /* -------------------------------------------------------------------- */
+  value = msOWSLookupMetadata(&(layer->metadata), "FOG", "geomtype");
+  if( value == NULL ) {
+    if( layer->type == MS_LAYER_POINT )
+      value = "Point";
+    else if( layer->type == MS_LAYER_LINE )
+      value = "LineString";
+    else if( layer->type == MS_LAYER_POLYGON )
+      value = "Polygon";
+    else
+      value = "Geometry";
+  }
+
+  if(bUseFeatureId)
+    pszFeatureid = msOWSLookupMetadata(&(layer->metadata), "FOG", "featureid");
+
+  if( strcasecmp(value,"Point") == 0 )
+    eGeomType = wkbPoint;
+  else if( strcasecmp(value,"LineString") == 0 )
+    eGeomType = wkbLineString;
+  else if( strcasecmp(value,"Polygon") == 0 )
+    eGeomType = wkbPolygon;
+  else if( strcasecmp(value,"MultiPoint") == 0 )
+    eGeomType = wkbMultiPoint;
+  else if( strcasecmp(value,"MultiLineString") == 0 )
+    eGeomType = wkbMultiLineString;
+  else if( strcasecmp(value,"MultiPolygon") == 0 )
+    eGeomType = wkbMultiPolygon;
+  else if( strcasecmp(value,"GeometryCollection") == 0 )
+    eGeomType = wkbGeometryCollection;
+  else if( strcasecmp(value,"Point25D") == 0 )
+    eGeomType = wkbPoint25D;
+  else if( strcasecmp(value,"LineString25D") == 0 )
+    eGeomType = wkbLineString25D;
+  else if( strcasecmp(value,"Polygon25D") == 0 )
+    eGeomType = wkbPolygon25D;
+  else if( strcasecmp(value,"MultiPoint25D") == 0 )
+    eGeomType = wkbMultiPoint25D;
+  else if( strcasecmp(value,"MultiLineString25D") == 0 )
+    eGeomType = wkbMultiLineString25D;
+  else if( strcasecmp(value,"MultiPolygon25D") == 0 )
+    eGeomType = wkbMultiPolygon25D;
+  else if( strcasecmp(value,"GeometryCollection25D") == 0 )
+    eGeomType = wkbGeometryCollection25D;
+  else if( strcasecmp(value,"Unknown") == 0
+           || strcasecmp(value,"Geometry") == 0 )
+    eGeomType = wkbUnknown;
+  else if( strcasecmp(value,"None") == 0 )
+    eGeomType = wkbNone;
+  else
+    eGeomType = wkbUnknown;
+
+  /* -------------------------------------------------------------------- */
+  /*      Create a spatial reference.                                     */
+  /* -------------------------------------------------------------------- */
+  pszWKT = msProjectionObj2OGCWKT( &(map->projection) );
+  if( pszWKT != NULL ) {
+    srs = OSRNewSpatialReference( pszWKT );
+    msFree( pszWKT );
+  }
+
+  /* -------------------------------------------------------------------- */
+  /*      Create the corresponding OGR Layer.                             */
+  /* -------------------------------------------------------------------- */
+  hOGRLayer = OGR_DS_CreateLayer( hDS, layer->name, srs, eGeomType,
+                                  layer_options );
+  if( hOGRLayer == NULL ) {
+    if( srs != NULL )
+      OSRRelease( srs );
+    msSetError( MS_MISCERR,
+                "OGR OGR_DS_CreateLayer failed for layer '%s' with driver '%s'.",
+                "msOGRWriteFromQuery()",
+                layer->name,
+                format->driver+4 );
+    return MS_FAILURE;
+  }
+
+  if( srs != NULL )
+    OSRRelease( srs );
+
+  /* -------------------------------------------------------------------- */
+  /*      Create appropriate attributes on this layer.                    */
+  /* -------------------------------------------------------------------- */
+  item_list = msGMLGetItems( layer, "G" );
+  assert( item_list->numitems == layer->numitems );
+
+  for( i = 0; i < layer->numitems; i++ ) {
+    OGRFieldDefnH hFldDefn;
+    OGRErr eErr;
+    const char *name;
+    gmlItemObj *item = item_list->items + i;
+    OGRFieldType eType;
+
+    if( !item->visible )
+      continue;
+
+    if( item->alias )
+      name = item->alias;
+    else
+      name = item->name;
+
+    if( item->type == NULL )
+      eType = OFTString;
+    else if( EQUAL(item->type,"Integer") )
+      eType = OFTInteger;
+    else if( EQUAL(item->type,"Long") )
+#if GDAL_VERSION_MAJOR >= 2
+      eType = OFTInteger64;
+#else
+      eType = OFTReal;
+#endif
+    else if( EQUAL(item->type,"Real") )
+      eType = OFTReal;
+    else if( EQUAL(item->type,"Character") )
+      eType = OFTString;
+    else if( EQUAL(item->type,"Date") )
+      eType = OFTDateTime;
+    else if( EQUAL(item->type,"Boolean") )
+      eType = OFTInteger;
+    else
+      eType = OFTString;
+
+    hFldDefn = OGR_Fld_Create( name, eType );
+
+    if( item->width != 0 )
+      OGR_Fld_SetWidth( hFldDefn, item->width );
+    if( item->precision != 0 )
+      OGR_Fld_SetPrecision( hFldDefn, item->precision );
+
+    eErr = OGR_L_CreateField( hOGRLayer, hFldDefn, TRUE );
+    OGR_Fld_Destroy( hFldDefn );
+
+    if( eErr != OGRERR_NONE ) {
+      msSetError( MS_OGRERR,
+                  "Failed to create field '%s' in output feature schema:\n%s",
+                  "msOGRWriteFromQuery()",
+                  layer->items[i],
+                  CPLGetLastErrorMsg() );
+
+      msGMLFreeItems(item_list);
+      return MS_FAILURE;
+    }
+
+    /* The index of the first field we create is not necessarily 0 */
+    if( nFirstOGRFieldIndex < 0 )
+        nFirstOGRFieldIndex = OGR_FD_GetFieldCount(
+                                      OGR_L_GetLayerDefn( hOGRLayer ) ) - 1;
+  }
+
+  /* -------------------------------------------------------------------- */
+  /*      Setup joins if needed.  This is likely untested.                */
+  /* -------------------------------------------------------------------- */
+  if(layer->numjoins > 0) {
+    int j;
+    for(j=0; j<layer->numjoins; j++) {
+      status = msJoinConnect(layer, &(layer->joins[j]));
+      if(status != MS_SUCCESS) {
+        msGMLFreeItems(item_list);
+        return status;
+      }
+    }
+  }
+
+  out->hOGRLayer = hOGRLayer;
+  out->item_list = item_list;
+  out->nFirstOGRFieldIndex = nFirstOGRFieldIndex;
+  out->pszFeatureid = pszFeatureid;
+
+  return MS_SUCCESS;
+}
+
+/************************************************************************/
+/*                        msOGRWriteOutputShape()                       */
+/*                                                                      */
+/*      Classify shape and write it, iResult being its index in the     */
+/*      result cache of layer (-1 if it does not come from there, then  */
+/*      no join is done). The shape is reprojected to the map if        */
+/*      bProject is set.                                                */
+/************************************************************************/
+static int msOGRWriteOutputShape( mapObj *map, layerObj *layer, msOGROutputLayerObj *out,
+                                  shapeObj *shape, int iResult, int bProject )
+{
+  int status = MS_SUCCESS;
+
+  /*
+  ** Perform classification, and some annotation related magic.
+  */
+  shape->classindex =
+    msShapeGetClass(layer, map, shape, NULL, -1);
+
+  if( shape->classindex >= 0
+      && (layer->class[shape->classindex]->text.string
+          || layer->labelitem)
+      && layer->class[shape->classindex]->numlabels > 0
+      && layer->class[shape->classindex]->labels[0]->size != -1 ) {
+    shape->text = msShapeGetLabelAnnotation(layer,shape,layer->class[shape->classindex]->labels[0]);
+  }
+
+  /*
+  ** prepare any necessary JOINs here (one-to-one only)
+  */
+  if( layer->numjoins > 0 && iResult >= 0 ) {
+    int j;
+
+    for(j=0; j < layer->numjoins; j++) {
+      if(layer->joins[j].type == MS_JOIN_ONE_TO_ONE) {
+        msJoinPrefetch(layer, &(layer->joins[j]), iResult);
+        msJoinPrepare(&(layer->joins[j]), shape);
+        msJoinNext(&(layer->joins[j])); /* fetch the first row */
+      }
+    }
+  }
+
+  if( bProject && layer->project ) {
+    status =
+      msProjectShape(&layer->projection, &layer->map->projection,
+                     shape);
+  }
+
+  /*
+  ** Write out the feature to OGR.
+  */
+
+  if( status == MS_SUCCESS )
+    status = msOGRWriteShape( layer, out->hOGRLayer, shape, out->item_list,
+                              out->nFirstOGRFieldIndex, out->pszFeatureid );
+
+  return status;
+}
+
 #endif /* def USE_OGR */
 
 /************************************************************************/
@@ -690,6 +1026,7 @@ int msOGRWriteFromQuery( mapObj *map, outputFormatObj *format, int sendheaders )
   const char *storage;
   const char *fo_filename;
   const char *form;
+  const char *jsonp = NULL;
   char datasource_name[MS_MAXPATHLEN];
   char base_dir[MS_MAXPATHLEN];
   char *request_dir = NULL;
@@ -715,14 +1052,8 @@ int msOGRWriteFromQuery( mapObj *map, outputFormatObj *format, int sendheaders )
   /* -------------------------------------------------------------------- */
   /*      Capture datasource and layer creation options.                  */
   /* -------------------------------------------------------------------- */
-  for( i=0; i < format->numformatoptions; i++ ) {
-    if( strncasecmp(format->formatoptions[i],"LCO:",4) == 0 )
-      layer_options = CSLAddString( layer_options,
-                                    format->formatoptions[i] + 4 );
-    if( strncasecmp(format->formatoptions[i],"DSCO:",5) == 0 )
-      ds_options = CSLAddString( ds_options,
-                                 format->formatoptions[i] + 5 );
-  }
+  layer_options = msOGRGetCreationOptions( format, "LCO:" );
+  ds_options = msOGRGetCreationOptions( format, "DSCO:" );
   if(!strcasecmp("true",msGetOutputFormatOption(format,"USE_FEATUREID","false"))) {
     bUseFeatureId = MS_TRUE;
   }
@@ -730,21 +1061,24 @@ int msOGRWriteFromQuery( mapObj *map, outputFormatObj *format, int sendheaders )
   /* ==================================================================== */
   /*      Determine the output datasource name to use.                    */
   /* ==================================================================== */
-  storage = msGetOutputFormatOption( format, "STORAGE", "filesystem" );
+  /* single file formats written sequentially are streamed by default */
+  storage = msGetOutputFormatOption( format, "STORAGE", NULL );
+  if( storage == NULL )
+    storage = msOGRIsSequentialOutput( format ) ? "stream" : "filesystem";
   if( EQUAL(storage,"stream") && !msIO_isStdContext() ) {
-#if defined(GDAL_COMPUTE_VERSION)
-#if GDAL_VERSION_NUM >= GDAL_COMPUTE_VERSION(2,0,0)
+#ifdef MS_OGR_STDOUT_REDIRECTION
     msIOContext *ioctx = msIO_getHandler (stdout);
     if( ioctx != NULL )
         VSIStdoutSetRedirection( msOGRStdoutWriteFunction, (FILE*)ioctx );
     else
-#endif
 #endif
     /* bug #4858, streaming output won't work if standard output has been
      * redirected, we switch to memory output in this case
      */
     storage = "memory";
   }
+  if( EQUAL(storage,"stream") )
+    layer_options = msOGRAddStreamLayerOptions( format, layer_options );
 
   /* -------------------------------------------------------------------- */
   /*      Where are we putting stuff?                                     */
@@ -847,11 +1181,18 @@ int msOGRWriteFromQuery( mapObj *map, outputFormatObj *format, int sendheaders )
   /*      Emit content type headers for stream output now.                */
   /* -------------------------------------------------------------------- */
   if( EQUAL(storage,"stream") ) {
+    if( EQUAL(form,"simple") )
+      jsonp = msGetOutputFormatOption( format, "JSONP", NULL );
     if( sendheaders && format->mimetype ) {
+      if( EQUAL(form,"simple") && !jsonp )
+        msIO_setHeader("Content-Disposition","attachment; filename=%s",
+                       fo_filename );
       msIO_setHeader("Content-Type","%s",format->mimetype);
       msIO_sendHeaders();
     } else
       msIO_fprintf( stdout, "%c", 10 );
+
+    if( jsonp != NULL ) msIO_fprintf( stdout, "%s(", jsonp );
   }
 
   /* ==================================================================== */
@@ -877,194 +1218,17 @@ int msOGRWriteFromQuery( mapObj *map, outputFormatObj *format, int sendheaders )
     int status;
     layerObj *layer = GET_LAYER(map, iLayer);
     shapeObj resultshape;
-    OGRLayerH hOGRLayer;
-    OGRwkbGeometryType eGeomType;
-    OGRSpatialReferenceH srs = NULL;
-    gmlItemListObj *item_list = NULL;
-    const char *value;
-    char *pszWKT;
-    int  nFirstOGRFieldIndex = -1;
-    const char *pszFeatureid = NULL;
+    msOGROutputLayerObj out;
 
     if( !layer->resultcache )
       continue;
 
-    /* -------------------------------------------------------------------- */
-    /*      Will we need to reproject?                                      */
-    /* -------------------------------------------------------------------- */
-    if(layer->transform == MS_TRUE)
-        layer->project = msProjectionsDiffer(&(layer->projection),
-                               &(layer->map->projection));
-
-    /* -------------------------------------------------------------------- */
-    /*      Establish the geometry type to use for the created layer.       */
-    /*      First we consult the wfs_geomtype field and fallback to         */
-    /*      deriving something from the type of the mapserver layer.        */
-    /* -------------------------------------------------------------------- */
-    value = msOWSLookupMetadata(&(layer->metadata), "FOG", "geomtype");
-    if( value == NULL ) {
-      if( layer->type == MS_LAYER_POINT )
-        value = "Point";
-      else if( layer->type == MS_LAYER_LINE )
-        value = "LineString";
-      else if( layer->type == MS_LAYER_POLYGON )
-        value = "Polygon";
-      else
-        value = "Geometry";
-    }
-
-    if(bUseFeatureId)
-      pszFeatureid = msOWSLookupMetadata(&(layer->metadata), "FOG", "featureid");
-
-    if( strcasecmp(value,"Point") == 0 )
-      eGeomType = wkbPoint;
-    else if( strcasecmp(value,"LineString") == 0 )
-      eGeomType = wkbLineString;
-    else if( strcasecmp(value,"Polygon") == 0 )
-      eGeomType = wkbPolygon;
-    else if( strcasecmp(value,"MultiPoint") == 0 )
-      eGeomType = wkbMultiPoint;
-    else if( strcasecmp(value,"MultiLineString") == 0 )
-      eGeomType = wkbMultiLineString;
-    else if( strcasecmp(value,"MultiPolygon") == 0 )
-      eGeomType = wkbMultiPolygon;
-    else if( strcasecmp(value,"GeometryCollection") == 0 )
-      eGeomType = wkbGeometryCollection;
-    else if( strcasecmp(value,"Point25D") == 0 )
-      eGeomType = wkbPoint25D;
-    else if( strcasecmp(value,"LineString25D") == 0 )
-      eGeomType = wkbLineString25D;
-    else if( strcasecmp(value,"Polygon25D") == 0 )
-      eGeomType = wkbPolygon25D;
-    else if( strcasecmp(value,"MultiPoint25D") == 0 )
-      eGeomType = wkbMultiPoint25D;
-    else if( strcasecmp(value,"MultiLineString25D") == 0 )
-      eGeomType = wkbMultiLineString25D;
-    else if( strcasecmp(value,"MultiPolygon25D") == 0 )
-      eGeomType = wkbMultiPolygon25D;
-    else if( strcasecmp(value,"GeometryCollection25D") == 0 )
-      eGeomType = wkbGeometryCollection25D;
-    else if( strcasecmp(value,"Unknown") == 0
-             || strcasecmp(value,"Geometry") == 0 )
-      eGeomType = wkbUnknown;
-    else if( strcasecmp(value,"None") == 0 )
-      eGeomType = wkbNone;
-    else
-      eGeomType = wkbUnknown;
-
-    /* -------------------------------------------------------------------- */
-    /*      Create a spatial reference.                                     */
-    /* -------------------------------------------------------------------- */
-    pszWKT = msProjectionObj2OGCWKT( &(map->projection) );
-    if( pszWKT != NULL ) {
-      srs = OSRNewSpatialReference( pszWKT );
-      msFree( pszWKT );
-    }
-
-    /* -------------------------------------------------------------------- */
-    /*      Create the corresponding OGR Layer.                             */
-    /* -------------------------------------------------------------------- */
-    hOGRLayer = OGR_DS_CreateLayer( hDS, layer->name, srs, eGeomType,
-                                    layer_options );
-    if( hOGRLayer == NULL ) {
+    status = msOGRCreateOutputLayer( map, layer, hDS, format, layer_options,
+                                     bUseFeatureId, &out );
+    if( status != MS_SUCCESS ) {
       OGR_DS_Destroy( hDS );
       msOGRCleanupDS( datasource_name );
-      msSetError( MS_MISCERR,
-                  "OGR OGR_DS_CreateLayer failed for layer '%s' with driver '%s'.",
-                  "msOGRWriteFromQuery()",
-                  layer->name,
-                  format->driver+4 );
-      return MS_FAILURE;
-    }
-
-    if( srs != NULL )
-      OSRRelease( srs );
-
-    /* -------------------------------------------------------------------- */
-    /*      Create appropriate attributes on this layer.                    */
-    /* -------------------------------------------------------------------- */
-    item_list = msGMLGetItems( layer, "G" );
-    assert( item_list->numitems == layer->numitems );
-
-    for( i = 0; i < layer->numitems; i++ ) {
-      OGRFieldDefnH hFldDefn;
-      OGRErr eErr;
-      const char *name;
-      gmlItemObj *item = item_list->items + i;
-      OGRFieldType eType;
-
-      if( !item->visible )
-        continue;
-
-      if( item->alias )
-        name = item->alias;
-      else
-        name = item->name;
-
-      if( item->type == NULL )
-        eType = OFTString;
-      else if( EQUAL(item->type,"Integer") )
-        eType = OFTInteger;
-      else if( EQUAL(item->type,"Long") )
-#if GDAL_VERSION_MAJOR >= 2
-        eType = OFTInteger64;
-#else
-        eType = OFTReal;
-#endif
-      else if( EQUAL(item->type,"Real") )
-        eType = OFTReal;
-      else if( EQUAL(item->type,"Character") )
-        eType = OFTString;
-      else if( EQUAL(item->type,"Date") )
-        eType = OFTDateTime;
-      else if( EQUAL(item->type,"Boolean") )
-        eType = OFTInteger;
-      else
-        eType = OFTString;
-
-      hFldDefn = OGR_Fld_Create( name, eType );
-
-      if( item->width != 0 )
-        OGR_Fld_SetWidth( hFldDefn, item->width );
-      if( item->precision != 0 )
-        OGR_Fld_SetPrecision( hFldDefn, item->precision );
-
-      eErr = OGR_L_CreateField( hOGRLayer, hFldDefn, TRUE );
-      OGR_Fld_Destroy( hFldDefn );
-
-      if( eErr != OGRERR_NONE ) {
-        msSetError( MS_OGRERR,
-                    "Failed to create field '%s' in output feature schema:\n%s",
-                    "msOGRWriteFromQuery()",
-                    layer->items[i],
-                    CPLGetLastErrorMsg() );
-
-        OGR_DS_Destroy( hDS );
-        msOGRCleanupDS( datasource_name );
-        msGMLFreeItems(item_list);
-        return MS_FAILURE;
-      }
-
-      /* The index of the first field we create is not necessarily 0 */
-      if( nFirstOGRFieldIndex < 0 )
-          nFirstOGRFieldIndex = OGR_FD_GetFieldCount(
-                                        OGR_L_GetLayerDefn( hOGRLayer ) ) - 1;
-    }
-
-    /* -------------------------------------------------------------------- */
-    /*      Setup joins if needed.  This is likely untested.                */
-    /* -------------------------------------------------------------------- */
-    if(layer->numjoins > 0) {
-      int j;
-      for(j=0; j<layer->numjoins; j++) {
-        status = msJoinConnect(layer, &(layer->joins[j]));
-        if(status != MS_SUCCESS) {
-          OGR_DS_Destroy( hDS );
-          msOGRCleanupDS( datasource_name );
-          msGMLFreeItems(item_list);
-          return status;
-        }
-      }
+      return status;
     }
 
     msInitShape( &resultshape );
@@ -1079,67 +1243,21 @@ int msOGRWriteFromQuery( mapObj *map, outputFormatObj *format, int sendheaders )
       /*
       ** Read the shape.
       */
-      status = msLayerGetShape(layer, &resultshape, &(layer->resultcache->results[i]));
-      if(status != MS_SUCCESS) {
-        OGR_DS_Destroy( hDS );
-        msOGRCleanupDS( datasource_name );
-        msGMLFreeItems(item_list);
-        msFreeShape(&resultshape);
-        return status;
-      }
-
-      /*
-      ** Perform classification, and some annotation related magic.
-      */
-      resultshape.classindex =
-        msShapeGetClass(layer, map, &resultshape, NULL, -1);
-
-      if( resultshape.classindex >= 0
-          && (layer->class[resultshape.classindex]->text.string
-              || layer->labelitem)
-          && layer->class[resultshape.classindex]->numlabels > 0
-          && layer->class[resultshape.classindex]->labels[0]->size != -1 ) {
-        resultshape.text = msShapeGetLabelAnnotation(layer,&resultshape,layer->class[resultshape.classindex]->labels[0]);
-      }
-
-      /*
-      ** prepare any necessary JOINs here (one-to-one only)
-      */
-      if( layer->numjoins > 0) {
-        int j;
-
-        for(j=0; j < layer->numjoins; j++) {
-          if(layer->joins[j].type == MS_JOIN_ONE_TO_ONE) {
-            msJoinPrepare(&(layer->joins[j]), &resultshape);
-            msJoinNext(&(layer->joins[j])); /* fetch the first row */
-          }
-        }
-      }
-
-      if( layer->project ) {
-        status =
-          msProjectShape(&layer->projection, &layer->map->projection,
-                         &resultshape);
-      }
-
-      /*
-      ** Write out the feature to OGR.
-      */
+      status = msLayerGetResultShape(layer, &resultshape, i);
 
       if( status == MS_SUCCESS )
-        status = msOGRWriteShape( layer, hOGRLayer, &resultshape,
-                                  item_list, nFirstOGRFieldIndex, pszFeatureid );
+        status = msOGRWriteOutputShape( map, layer, &out, &resultshape, i, MS_TRUE );
 
       if(status != MS_SUCCESS) {
         OGR_DS_Destroy( hDS );
         msOGRCleanupDS( datasource_name );
-        msGMLFreeItems(item_list);
+        msGMLFreeItems(out.item_list);
         msFreeShape(&resultshape);
         return status;
       }
     }
 
-    msGMLFreeItems(item_list);
+    msGMLFreeItems(out.item_list);
     msFreeShape(&resultshape); /* init too */
   }
 
@@ -1172,6 +1290,7 @@ int msOGRWriteFromQuery( mapObj *map, outputFormatObj *format, int sendheaders )
   /* -------------------------------------------------------------------- */
   if( EQUAL(storage,"stream") ) {
     /* already done */
+    if (jsonp != NULL) msIO_fprintf( stdout, ");\n" );
   }
 
   /* -------------------------------------------------------------------- */
@@ -1181,7 +1300,6 @@ int msOGRWriteFromQuery( mapObj *map, outputFormatObj *format, int sendheaders )
     char buffer[1024];
     int  bytes_read;
     FILE *fp;
-    const char *jsonp;
 
     jsonp = msGetOutputFormatOption( format, "JSONP", NULL );
     if( sendheaders ) {
@@ -1356,6 +1474,213 @@ int msOGRWriteFromQuery( mapObj *map, outputFormatObj *format, int sendheaders )
 #endif /* def USE_OGR */
 }
 
+/************************************************************************/
+/*                          msOGRCanStreamQuery()                       */
+/*                                                                      */
+/*      Whether the results of a query can be written to the client     */
+/*      as they are read with msOGRBeginStreamQuery() and friends,      */
+/*      without a result cache.                                         */
+/************************************************************************/
+
+int msOGRCanStreamQuery( mapObj *map, outputFormatObj *format )
+{
+#ifndef USE_OGR
+  return MS_FALSE;
+#else
+  const char *storage;
+  int i;
+
+  if( format == NULL || !MS_RENDERER_OGR(format) ||
+      !msOGRIsSequentialOutput( format ) )
+    return MS_FALSE;
+
+  storage = msGetOutputFormatOption( format, "STORAGE", "stream" );
+  if( !EQUAL(storage,"stream") )
+    return MS_FALSE;
+
+#ifndef MS_OGR_STDOUT_REDIRECTION
+  if( !msIO_isStdContext() )
+    return MS_FALSE;
+#else
+  if( !msIO_isStdContext() && msIO_getHandler( stdout ) == NULL )
+    return MS_FALSE;
+#endif
+
+  /* joins are read per result, from the result cache */
+  for( i = 0; i < map->numlayers; i++ ) {
+    if( GET_LAYER(map, i)->numjoins > 0 )
+      return MS_FALSE;
+  }
+
+  return MS_TRUE;
+#endif /* def USE_OGR */
+}
+
+#ifdef USE_OGR
+typedef struct {
+  mapObj *map;
+  outputFormatObj *format;
+  OGRDataSourceH hDS;
+  char **layer_options;
+  int bUseFeatureId;
+  const char *jsonp;
+  int maxfeatures;
+  int numfeatures;
+  layerObj *layer;       /* layer of out, NULL before the first shape */
+  msOGROutputLayerObj out;
+} msOGRStreamWriterObj;
+#endif
+
+/************************************************************************/
+/*                         msOGRBeginStreamQuery()                      */
+/*                                                                      */
+/*      Emits the headers and opens a datasource on /vsistdout/ the     */
+/*      shapes given to msOGRWriteStreamShape() are written to, as      */
+/*      msOGRWriteFromQuery() does with FORM=simple and STORAGE=stream. */
+/*      The shapes are expected in the map projection. At most         */
+/*      maxfeatures are written, -1 for no limit. Returns the writer    */
+/*      to pass to msOGREndStreamQuery(), NULL on failure.              */
+/************************************************************************/
+
+void *msOGRBeginStreamQuery( mapObj *map, outputFormatObj *format,
+                             int sendheaders, int maxfeatures )
+{
+#ifndef USE_OGR
+  msSetError(MS_OGRERR, "OGR support is not available.",
+             "msOGRBeginStreamQuery()");
+  return NULL;
+#else
+  OGRSFDriverH hDriver;
+  char **ds_options;
+  msOGRStreamWriterObj *writer;
+
+  msOGRInitialize();
+
+  hDriver = OGRGetDriverByName( format->driver+4 );
+  if( hDriver == NULL ) {
+    msSetError( MS_MISCERR, "No OGR driver named `%s' available.",
+                "msOGRBeginStreamQuery()", format->driver+4 );
+    return NULL;
+  }
+
+  writer = (msOGRStreamWriterObj *) msSmallCalloc(1, sizeof(msOGRStreamWriterObj));
+  writer->map = map;
+  writer->format = format;
+  writer->maxfeatures = maxfeatures;
+  writer->layer_options = msOGRAddStreamLayerOptions( format,
+                          msOGRGetCreationOptions( format, "LCO:" ) );
+  if(!strcasecmp("true",msGetOutputFormatOption(format,"USE_FEATUREID","false")))
+    writer->bUseFeatureId = MS_TRUE;
+
+#ifdef MS_OGR_STDOUT_REDIRECTION
+  if( !msIO_isStdContext() )
+    VSIStdoutSetRedirection( msOGRStdoutWriteFunction,
+                             (FILE*) msIO_getHandler( stdout ) );
+#endif
+
+  writer->jsonp = msGetOutputFormatOption( format, "JSONP", NULL );
+  if( sendheaders && format->mimetype ) {
+    if( !writer->jsonp )
+      msIO_setHeader("Content-Disposition","attachment; filename=%s",
+                     msGetOutputFormatOption( format, "FILENAME", "result.dat" ) );
+    msIO_setHeader("Content-Type","%s",format->mimetype);
+    msIO_sendHeaders();
+  } else
+    msIO_fprintf( stdout, "%c", 10 );
+
+  if( writer->jsonp != NULL ) msIO_fprintf( stdout, "%s(", writer->jsonp );
+
+  ds_options = msOGRGetCreationOptions( format, "DSCO:" );
+  writer->hDS = OGR_Dr_CreateDataSource( hDriver, "/vsistdout/", ds_options );
+  CSLDestroy( ds_options );
+
+  if( writer->hDS == NULL ) {
+    msSetError( MS_MISCERR,
+                "OGR CreateDataSource failed for '/vsistdout/' with driver '%s'.",
+                "msOGRBeginStreamQuery()",
+                format->driver+4 );
+    CSLDestroy( writer->layer_options );
+    msFree( writer );
+    return NULL;
+  }
+
+  return writer;
+#endif /* def USE_OGR */
+}
+
+/************************************************************************/
+/*                         msOGRWriteStreamShape()                      */
+/*                                                                      */
+/*      Query shape callback (see queryObj.shapefunc) writing shape     */
+/*      of layer to the datasource of msOGRBeginStreamQuery(). The      */
+/*      OGR layer is created with the first shape of each map layer.    */
+/************************************************************************/
+
+int msOGRWriteStreamShape( layerObj *layer, shapeObj *shape, void *data )
+{
+#ifndef USE_OGR
+  msSetError(MS_OGRERR, "OGR support is not available.",
+             "msOGRWriteStreamShape()");
+  return MS_FAILURE;
+#else
+  msOGRStreamWriterObj *writer = (msOGRStreamWriterObj *) data;
+
+  if( writer->maxfeatures >= 0 && writer->numfeatures >= writer->maxfeatures )
+    return MS_SUCCESS;
+
+  if( writer->layer != layer ) {
+    if( writer->layer != NULL ) {
+      msGMLFreeItems( writer->out.item_list );
+      writer->layer = NULL;
+    }
+    if( msOGRCreateOutputLayer( writer->map, layer, writer->hDS, writer->format,
+                                writer->layer_options, writer->bUseFeatureId,
+                                &writer->out ) != MS_SUCCESS )
+      return MS_FAILURE;
+    writer->layer = layer;
+  }
+
+  if( msOGRWriteOutputShape( writer->map, layer, &writer->out, shape, -1,
+                             MS_FALSE ) != MS_SUCCESS )
+    return MS_FAILURE;
+
+  writer->numfeatures++;
+  return MS_SUCCESS;
+#endif /* def USE_OGR */
+}
+
+/************************************************************************/
+/*                          msOGREndStreamQuery()                       */
+/*                                                                      */
+/*      Closes the datasource of msOGRBeginStreamQuery(), which         */
+/*      flushes what the driver has left to the client.                 */
+/************************************************************************/
+
+int msOGREndStreamQuery( void *data )
+{
+#ifndef USE_OGR
+  msSetError(MS_OGRERR, "OGR support is not available.",
+             "msOGREndStreamQuery()");
+  return MS_FAILURE;
+#else
+  msOGRStreamWriterObj *writer = (msOGRStreamWriterObj *) data;
+
+  if( writer == NULL )
+    return MS_FAILURE;
+
+  if( writer->layer != NULL )
+    msGMLFreeItems( writer->out.item_list );
+
+  OGR_DS_Destroy( writer->hDS );
+  if( writer->jsonp != NULL ) msIO_fprintf( stdout, ");\n" );
+
+  CSLDestroy( writer->layer_options );
+  msFree( writer );
+
+  return MS_SUCCESS;
+#endif /* def USE_OGR */
+}
+
 /************************************************************************/
 /*                     msPopulateRenderVTableOGR()                      */
 /************************************************************************/
@@ -38,6 +38,7 @@
 
 #include "mapserver.h"
 #include "maptime.h" 
+#include "mapwkb.h"
 #include <assert.h>
 
 
@@ -145,6 +146,13 @@ struct {
   SDOGeometryObj *obj[ARRAY_SIZE]; /* spatial object buffer */
   SDOGeometryInd *ind[ARRAY_SIZE]; /* object indicator (null) buffer */
 
+  /* geometries fetched as WKB instead of spatial objects, see msOracleSpatialLayerWhichShapes() */
+  int wkb;
+  OCILobLocator *lobs[ARRAY_SIZE]; /* WKB locator buffer, allocated on first use */
+  sb2 lobs_ind[ARRAY_SIZE]; /* WKB indicator (null) buffer */
+  ub1 *wkb_buffer; /* WKB of the current row */
+  oraub8 wkb_size;
+
   int uniqueidindex; /*allows to keep whic attribute id index is used as unique id*/
 
 
@@ -166,6 +174,8 @@ struct {
   msOracleSpatialStatement *orastmt2;
   /* Driver handling of pagination, enabled by default */
   int paging;
+  /* Draw and query geometries as WKB, PROCESSING "WKB" */
+  int wkb;
 
 } msOracleSpatialLayerInfo;
 
@@ -210,6 +220,8 @@ static void osRectangle(msOracleSpatialHandler *hand, shapeObj *shape, SDOGeomet
 static void osCircle(msOracleSpatialHandler *hand, shapeObj *shape, SDOGeometryObj *obj, int start, int end, lineObj points, pointObj *pnt, int data3d, int data4d);
 static void osArcPolygon(msOracleSpatialHandler *hand, shapeObj *shape, SDOGeometryObj *obj, int start, int end, lineObj arcpoints,int elem_type,int data3d, int data4d);
 static int osGetOrdinates(msOracleSpatialDataHandler *dthand, msOracleSpatialHandler *hand, shapeObj *shape, SDOGeometryObj *obj, SDOGeometryInd *ind);
+static int osGetWKB(msOracleSpatialHandler *hand, msOracleSpatialStatement *sthand, shapeObj *shape);
+static int osGetRowGeometry(msOracleSpatialDataHandler *dthand, msOracleSpatialHandler *hand, msOracleSpatialStatement *sthand, shapeObj *shape);
 static int osCheck2DGtype(int pIntGtype);
 static int osCheck3DGtype(int pIntGtype);
 static int osCheck4DGtype(int pIntGtype);
@@ -593,6 +605,8 @@ static int msOCIOpenStatement( msOracleSpatialHandler *hand, msOracleSpatialStat
 /* create statement handle from database connection */
 static void msOCIFinishStatement( msOracleSpatialStatement *sthand )
 {
+  int i;
+
   if(sthand != NULL) {
     /* fprintf(stderr, "Freeing statement handle at %p\n", sthand->stmthp); */
 
@@ -602,6 +616,9 @@ static void msOCIFinishStatement( msOracleSpatialStatement *sthand )
       free( sthand->items );
     if (sthand->items_query != NULL)
       free( sthand->items_query );
+    for (i = 0; i < ARRAY_SIZE && sthand->lobs[i] != NULL; i++)
+      OCIDescriptorFree( (dvoid *)sthand->lobs[i], (ub4)OCI_DTYPE_LOB );
+    msFree( sthand->wkb_buffer );
     memset(sthand, 0, sizeof( msOracleSpatialStatement ) );
     free(sthand);
   }
@@ -1712,6 +1729,64 @@ static int osGetOrdinates(msOracleSpatialDataHandler *dthand, msOracleSpatialHan
   return MS_SUCCESS;
 }
 
+/* decode the WKB of the current row, see PROCESSING "WKB" */
+static int osGetWKB(msOracleSpatialHandler *hand, msOracleSpatialStatement *sthand, shapeObj *shape)
+{
+  OCILobLocator *lob = sthand->lobs[ sthand->row ];
+  oraub8 length = 0, amount;
+  wkbObj w;
+  int i;
+
+  if (sthand->lobs_ind[ sthand->row ] == OCI_IND_NULL)
+    return MS_SUCCESS; /* null geometry, the shape stays MS_SHAPE_NULL */
+
+  if (!TRY( hand, OCILobGetLength2( hand->svchp, hand->errhp, lob, &length ) ))
+    return MS_FAILURE;
+  if (length == 0)
+    return MS_SUCCESS;
+
+  if (length > sthand->wkb_size) {
+    msFree( sthand->wkb_buffer );
+    sthand->wkb_buffer = (ub1 *)msSmallMalloc( (size_t)length );
+    sthand->wkb_size = length;
+  }
+
+  /* served from the prefetched LOB data when it fits, no round trip */
+  amount = length;
+  if (!TRY( hand, OCILobRead2( hand->svchp, hand->errhp, lob, &amount, (oraub8 *)0, (oraub8)1, (dvoid *)sthand->wkb_buffer, length, (ub1)OCI_ONE_PIECE, (dvoid *)0, (OCICallbackLobRead2)0, (ub2)0, (ub1)SQLCS_IMPLICIT ) ))
+    return MS_FAILURE;
+
+  /* SDO_UTIL.TO_WKBGEOMETRY() returns big endian WKB */
+  if (wkbToNativeByteOrder( (char *)sthand->wkb_buffer, (size_t)amount ) != MS_SUCCESS)
+    return MS_FAILURE;
+
+  w.wkb = (char *)sthand->wkb_buffer;
+  w.ptr = w.wkb;
+  w.size = (size_t)amount;
+  w.typemap = wkb_postgis20;
+
+  if (wkbFindBestType( &w, shape ) != MS_SUCCESS) {
+    /* not a type MapServer can draw, skip it like a null geometry */
+    for (i = 0; i < shape->numlines; i++)
+      free( shape->line[i].point );
+    free( shape->line );
+    shape->line = NULL;
+    shape->numlines = 0;
+    shape->type = MS_SHAPE_NULL;
+  }
+
+  return MS_SUCCESS;
+}
+
+/* fetch the geometry of the current row of a statement set up by *WhichShapes() */
+static int osGetRowGeometry(msOracleSpatialDataHandler *dthand, msOracleSpatialHandler *hand, msOracleSpatialStatement *sthand, shapeObj *shape)
+{
+  if (sthand->wkb)
+    return osGetWKB( hand, sthand, shape );
+
+  return osGetOrdinates( dthand, hand, shape, sthand->obj[ sthand->row ], sthand->ind[ sthand->row ] );
+}
+
 static void msOCICloseConnection( void *hand )
 {
   msOCICloseHandlers( (msOracleSpatialHandler *)hand );
@@ -1759,6 +1834,9 @@ int msOracleSpatialLayerOpen( layerObj *layer )
   memset( sthand2, 0, sizeof(msOracleSpatialStatement) );
   memset( layerinfo, 0, sizeof(msOracleSpatialLayerInfo) );
   layerinfo->paging = MS_TRUE;
+  if (msLayerGetProcessingKey( layer, "WKB" ) &&
+      strcasecmp(msLayerGetProcessingKey( layer, "WKB" ), "ON") == 0)
+    layerinfo->wkb = MS_TRUE;
 
   msSplitLogin( layer->connection, layer->map, &username, &password, &dblink );
 
@@ -2027,7 +2105,12 @@ int msOracleSpatialLayerWhichShapes( layerObj *layer, rectObj rect, int isQuery)
   snprintf( query_str + strlen(query_str), sizeof(query_str)-strlen(query_str), "%s, ", "rownum");
 
 
-  snprintf( query_str + strlen(query_str), sizeof(query_str)-strlen(query_str), "%s FROM %s", geom_column_name, table_name );
+  /* WKB is read straight into shapes, without the object navigation of the ordinates */
+  sthand->wkb = layerinfo->wkb;
+  if (sthand->wkb)
+    snprintf( query_str + strlen(query_str), sizeof(query_str)-strlen(query_str), "SDO_UTIL.TO_WKBGEOMETRY(%s) FROM %s", geom_column_name, table_name );
+  else
+    snprintf( query_str + strlen(query_str), sizeof(query_str)-strlen(query_str), "%s FROM %s", geom_column_name, table_name );
 
   osFilteritem(layer, function, query_str, sizeof(query_str), 1);
 
@@ -2161,17 +2244,39 @@ int msOracleSpatialLayerWhichShapes( layerObj *layer, rectObj rect, int isQuery)
   }
 
 
-  if (success) {
-    int cursor_type = OCI_DEFAULT;
-    if(isQuery) cursor_type =OCI_STMT_SCROLLABLE_READONLY;
+  if (success && sthand->wkb) {
+#ifdef OCI_ATTR_LOBPREFETCH_SIZE
+    ub4 prefetch_size = 65536;
+    boolean prefetch_length = TRUE;
+#endif
 
+    for (i = 0; i < ARRAY_SIZE && success; i++)
+      if (sthand->lobs[i] == NULL)
+        success = TRY( hand, OCIDescriptorAlloc( (dvoid *)hand->envhp, (dvoid **)&sthand->lobs[i], (ub4)OCI_DTYPE_LOB, (size_t)0, (dvoid **)0 ) );
+
+    success = success && TRY( hand,
+                   /* define WKB position as an array of BLOB locators */
+                   OCIDefineByPos( sthand->stmthp, &adtp, hand->errhp, (ub4)numitemsinselect+1, (dvoid *)sthand->lobs, (sb4)sizeof(OCILobLocator *), SQLT_BLOB, (dvoid *)sthand->lobs_ind, (ub2 *)0, (ub2 *)0, (ub4)OCI_DEFAULT) );
+#ifdef OCI_ATTR_LOBPREFETCH_SIZE
+    /* have the WKB come with the rows instead of one round trip per geometry */
+    success = success
+              && TRY( hand, OCIAttrSet( (dvoid *)adtp, (ub4)OCI_HTYPE_DEFINE, (dvoid *)&prefetch_size, (ub4)0, (ub4)OCI_ATTR_LOBPREFETCH_SIZE, hand->errhp ) )
+              && TRY( hand, OCIAttrSet( (dvoid *)adtp, (ub4)OCI_HTYPE_DEFINE, (dvoid *)&prefetch_length, (ub4)0, (ub4)OCI_ATTR_LOBPREFETCH_LENGTH, hand->errhp ) );
+#endif
+  } else if (success) {
     success = TRY( hand,
                    /* define spatial position adtp ADT object */
                    OCIDefineByPos( sthand->stmthp, &adtp, hand->errhp, (ub4)numitemsinselect+1, (dvoid *)0, (sb4)0, SQLT_NTY, (dvoid *)0, (ub2 *)0, (ub2 *)0, (ub4)OCI_DEFAULT) )
               && TRY( hand,
                       /* define object tdo from adtp */
-                      OCIDefineObject( adtp, hand->errhp, dthand->tdo, (dvoid **)sthand->obj, (ub4 *)0, (dvoid **)sthand->ind, (ub4 *)0 ) )
-              && TRY(hand,
+                      OCIDefineObject( adtp, hand->errhp, dthand->tdo, (dvoid **)sthand->obj, (ub4 *)0, (dvoid **)sthand->ind, (ub4 *)0 ) );
+  }
+
+  if (success) {
+    int cursor_type = OCI_DEFAULT;
+    if(isQuery) cursor_type =OCI_STMT_SCROLLABLE_READONLY;
+
+    success = TRY(hand,
                      /* execute */
                      OCIStmtExecute( hand->svchp, sthand->stmthp, hand->errhp, (ub4)ARRAY_SIZE, (ub4)0, (OCISnapshot *)NULL, (OCISnapshot *)NULL, (ub4)cursor_type ) )
               &&  TRY( hand,
@@ -2219,8 +2324,6 @@ int msOracleSpatialLayerWhichShapes( layerObj *layer, rectObj rect, int isQuery)
 /* fetch next shape from previous SELECT stmt (see *WhichShape()) */
 int msOracleSpatialLayerNextShape( layerObj *layer, shapeObj *shape )
 {
-  SDOGeometryObj *obj;
-  SDOGeometryInd *ind;
   int success, /*lIntSuccessFree,*/ i;
 
   /* get layerinfo */
@@ -2265,10 +2368,6 @@ int msOracleSpatialLayerNextShape( layerObj *layer, shapeObj *shape )
       sthand->row = 0; /* reset buffer row index */
     }
 
-    /* set obj & ind for current row */
-    obj = sthand->obj[ sthand->row ];
-    ind = sthand->ind[ sthand->row ];
-
     /* get the items for the shape */
     shape->index = atol( (char *)(sthand->items[sthand->uniqueidindex][ sthand->row ])); /* Primary Key */
     shape->resultindex = sthand->row_num;
@@ -2292,7 +2391,7 @@ int msOracleSpatialLayerNextShape( layerObj *layer, shapeObj *shape )
     }
 
     /* fetch a layer->type object */
-    success = osGetOrdinates(dthand, hand, shape, obj, ind);
+    success = osGetRowGeometry(dthand, hand, sthand, shape);
 
     /* increment for next row */
     sthand->row_num++;
@@ -2311,8 +2410,6 @@ int msOracleSpatialLayerNextShape( layerObj *layer, shapeObj *shape )
 int msOracleSpatialLayerGetShape( layerObj *layer, shapeObj *shape, resultObj *record)
 {
   int success, i;
-  SDOGeometryObj *obj;
-  SDOGeometryInd *ind;
   msOracleSpatialDataHandler *dthand = NULL;
   msOracleSpatialHandler *hand = NULL;
   msOracleSpatialLayerInfo *layerinfo;
@@ -2387,10 +2484,6 @@ int msOracleSpatialLayerGetShape( layerObj *layer, shapeObj *shape, resultObj *r
       }
     }
 
-    /* set obj & ind for current row */
-    obj = sthand->obj[ sthand->row ];
-    ind = sthand->ind[ sthand->row ];
-
     /* get the items for the shape */
     shape->index = shapeindex; /* By definition this is what we asked for */
     shape->numvalues = layer->numitems;
@@ -2413,7 +2506,7 @@ int msOracleSpatialLayerGetShape( layerObj *layer, shapeObj *shape, resultObj *r
     }
 
     /* fetch a layer->type object */
-    success = osGetOrdinates(dthand, hand, shape, obj, ind);
+    success = osGetRowGeometry(dthand, hand, sthand, shape);
 
     if (success != MS_SUCCESS) {
       msSetError( MS_ORACLESPATIALERR, "Call to osGetOrdinates failed.", "msOracleSpatialLayerGetShape()" );
@@ -2617,9 +2710,6 @@ int msOracleSpatialLayerGetShape( layerObj *layer, shapeObj *shape, resultObj *r
       return (MS_DONE);
     }
 
-    obj = sthand->obj[ sthand->row ];
-    ind = sthand->ind[ sthand->row ];
-
     /* get the items for the shape */
     shape->numvalues = layer->numitems;
     shape->values = (char **) malloc(sizeof(char *) * layer->numitems);
@@ -2672,12 +2762,13 @@ int msOracleSpatialLayerGetShape( layerObj *layer, shapeObj *shape, resultObj *r
       }
     }
 
+    /* fetch a layer->type object, of the row just read */
+    success = osGetRowGeometry(dthand, hand, sthand, shape);
+
     /* increment for next row */
     sthand->row_num++;
     sthand->row++;
 
-    /* fetch a layer->type object */
-    success = osGetOrdinates(dthand, hand, shape, obj, ind);
     if (success != MS_SUCCESS) {
       msSetError( MS_ORACLESPATIALERR, "Cannot execute query", "msOracleSpatialLayerGetShape()" );
 
@@ -104,6 +104,9 @@ struct defaultOutputFormatEntry defaultoutputformats[] = {
   {"png24","AGG/PNG","image/png; mode=24bit"},
   {"jpegpng", "AGG/MIXED", "image/vnd.jpeg-png"},
   {"jpegpng8", "AGG/MIXED", "image/vnd.jpeg-png8"},
+#ifdef USE_WEBP
+  {"webp","AGG/WEBP","image/webp"},
+#endif
 #ifdef USE_CAIRO
   {"pdf","CAIRO/PDF","application/x-pdf"},
   {"svg","CAIRO/SVG","image/svg+xml"},
@@ -117,6 +120,7 @@ struct defaultOutputFormatEntry defaultoutputformats[] = {
   {"kmz","KMZ","application/vnd.google-earth.kmz"},
 #endif
   {"json","UTFGrid","application/json"},
+  {"mvt","MVT","application/vnd.mapbox-vector-tile"},
   {NULL,NULL,NULL}
 };
 
@@ -176,6 +180,15 @@ outputFormatObj *msCreateDefaultOutputFormat( mapObj *map,
     format->renderer = MS_RENDER_WITH_UTFGRID;
   }
 
+  else if( strcasecmp(driver,"MVT") == 0 ) {
+    if(!name) name="mvt";
+    format = msAllocOutputFormat( map, name, driver );
+    format->mimetype = msStrdup("application/vnd.mapbox-vector-tile");
+    format->imagemode = MS_IMAGEMODE_RGB;
+    format->extension = msStrdup("mvt");
+    format->renderer = MS_RENDER_WITH_MVT;
+  }
+
   else if( strcasecmp(driver,"AGG/PNG") == 0 ) {
     if(!name) name="png24";
     format = msAllocOutputFormat( map, name, driver );
@@ -205,6 +218,17 @@ outputFormatObj *msCreateDefaultOutputFormat( mapObj *map,
     format->renderer = MS_RENDER_WITH_AGG;
   }
 
+#ifdef USE_WEBP
+  else if( strcasecmp(driver,"AGG/WEBP") == 0 ) {
+    if(!name) name="webp";
+    format = msAllocOutputFormat( map, name, driver );
+    format->mimetype = msStrdup("image/webp");
+    format->imagemode = MS_IMAGEMODE_RGB;
+    format->extension = msStrdup("webp");
+    format->renderer = MS_RENDER_WITH_AGG;
+  }
+#endif
+
   else if( strcasecmp(driver,"AGG/MIXED") == 0 &&
            name != NULL && strcasecmp(name,"jpegpng") == 0 ) {
     format = msAllocOutputFormat( map, name, driver );
@@ -1080,6 +1104,8 @@ int msInitializeRendererVTable(outputFormatObj *format)
       return msPopulateRendererVTableAGG(format->vtable);
     case MS_RENDER_WITH_UTFGRID:
       return msPopulateRendererVTableUTFGrid(format->vtable);
+    case MS_RENDER_WITH_MVT:
+      return msPopulateRendererVTableMVT(format->vtable);
 #ifdef USE_CAIRO
     case MS_RENDER_WITH_CAIRO_RASTER:
       return msPopulateRendererVTableCairoRaster(format->vtable);
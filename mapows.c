@@ -43,6 +43,7 @@
 #include <ctype.h> /* isalnum() */
 #include <stdarg.h>
 #include <assert.h>
+#include <sys/stat.h>
 
 
 
@@ -59,6 +60,7 @@ static void msOWSInitRequestObj(owsRequestObj *ows_request)
   ows_request->version = NULL;
   ows_request->request = NULL;
   ows_request->document = NULL;
+  ows_request->mapfile = NULL;
 }
 
 /*
@@ -241,10 +243,12 @@ static int msOWSPreParseRequest(cgiRequestObj *request,
 ** - If force_ows_mode is false and this does not appear to be a valid OWS
 **   request then MS_DONE is returned and MapServer is expected to process
 **   this as a regular MapServer (traditional CGI) request.
+** - mapfile is the file map was loaded from, NULL if unknown, see
+**   msOWSDispatchCached().
 */
-int msOWSDispatch(mapObj *map, cgiRequestObj *request, int ows_mode)
+static int msOWSDispatchMapFile(mapObj *map, cgiRequestObj *request, int ows_mode, const char *mapfile)
 {
-  int status = MS_DONE, force_ows_mode = 0;
+  int status = MS_DONE, force_ows_mode = 0, span;
   owsRequestObj ows_request;
 
   if (!request) {
@@ -253,15 +257,20 @@ int msOWSDispatch(mapObj *map, cgiRequestObj *request, int ows_mode)
 
   force_ows_mode = (ows_mode == OWS || ows_mode == WFS);
 
+  span = msTraceSpanBegin("msOWSDispatch", MS_TRACE_INTERNAL);
   msOWSInitRequestObj(&ows_request);
+  ows_request.mapfile = mapfile;
   switch(msOWSPreParseRequest(request, &ows_request)) {
     case MS_FAILURE: /* a severe error occurred */
+      msTraceSpanEnd(span, MS_FAILURE);
       return MS_FAILURE;
     case MS_DONE:
       /* OWS Service could not be determined              */
       /* continue for now                                 */
       status = MS_DONE;
   }
+  msTraceSpanAttribute(span, "ows.service", ows_request.service);
+  msTraceSpanAttribute(span, "ows.request", ows_request.request);
 
   if (ows_request.service == NULL) {
 
@@ -321,9 +330,378 @@ int msOWSDispatch(mapObj *map, cgiRequestObj *request, int ows_mode)
   }
 
   msOWSClearRequestObj(&ows_request);
+  msTraceSpanEnd(span, status);
   return status;
 }
 
+int msOWSDispatch(mapObj *map, cgiRequestObj *request, int ows_mode)
+{
+  return msOWSDispatchMapFile(map, request, ows_mode, NULL);
+}
+
+/*
+** Capabilities cache
+**
+** Generating the capabilities of a large map can take seconds. With a
+** "capabilities_cache_ttl" metadata (MO, FO, CO or SO namespaces, in
+** seconds) the GetCapabilities responses of msOWSDispatchCached() are kept
+** in a process wide cache of MS_OWS_CAPABILITIES_CACHE_MAX entries and
+** served while younger than the TTL. The key is made of the mapfile name,
+** modification time and size, the online resource and the request
+** parameters except MAP (SERVICE, VERSION, LANGUAGE, SECTIONS...), so that
+** editing the mapfile or using another host name never returns stale
+** documents. Exceptions are not cached. The cache is protected by
+** TLOCK_OWSCAPS.
+*/
+#if defined(USE_WMS_SVR) || defined (USE_WFS_SVR) || defined (USE_WCS_SVR) || defined(USE_SOS_SVR)
+
+#define MS_OWS_CAPABILITIES_CACHE_MAX 32
+
+typedef struct {
+  char *key;
+  unsigned char *data;
+  int size;
+  char *mimetype;
+  time_t created;
+  unsigned long last_used;
+} owsCapabilitiesCacheEntryObj;
+
+static int owsCapabilitiesCacheCount = 0;
+static unsigned long owsCapabilitiesCacheClock = 0;
+static owsCapabilitiesCacheEntryObj owsCapabilitiesCache[MS_OWS_CAPABILITIES_CACHE_MAX];
+
+static void msOWSCapabilitiesCacheRemove(int i)
+{
+  free(owsCapabilitiesCache[i].key);
+  free(owsCapabilitiesCache[i].data);
+  free(owsCapabilitiesCache[i].mimetype);
+
+  owsCapabilitiesCacheCount--;
+  if( i != owsCapabilitiesCacheCount )
+    owsCapabilitiesCache[i] = owsCapabilitiesCache[owsCapabilitiesCacheCount];
+}
+
+static int msOWSCapabilitiesCacheFind(const char *key)
+{
+  int i;
+
+  for( i = 0; i < owsCapabilitiesCacheCount; i++ ) {
+    if( strcmp(owsCapabilitiesCache[i].key, key) == 0 )
+      return i;
+  }
+  return -1;
+}
+
+static void msOWSCapabilitiesCacheInsert(const char *key, const unsigned char *data, int size,
+    const char *mimetype)
+{
+  int i;
+
+  msAcquireLock( TLOCK_OWSCAPS );
+  if( (i = msOWSCapabilitiesCacheFind(key)) >= 0 )
+    msOWSCapabilitiesCacheRemove(i);
+  if( owsCapabilitiesCacheCount == MS_OWS_CAPABILITIES_CACHE_MAX ) {
+    int slot = 0;
+
+    for( i = 1; i < owsCapabilitiesCacheCount; i++ ) {
+      if( owsCapabilitiesCache[i].last_used < owsCapabilitiesCache[slot].last_used )
+        slot = i;
+    }
+    msOWSCapabilitiesCacheRemove(slot);
+  }
+
+  i = owsCapabilitiesCacheCount++;
+  owsCapabilitiesCache[i].key = msStrdup(key);
+  owsCapabilitiesCache[i].data = (unsigned char *) msSmallMalloc(size);
+  memcpy(owsCapabilitiesCache[i].data, data, size);
+  owsCapabilitiesCache[i].size = size;
+  owsCapabilitiesCache[i].mimetype = mimetype ? msStrdup(mimetype) : NULL;
+  owsCapabilitiesCache[i].created = time(NULL);
+  owsCapabilitiesCache[i].last_used = ++owsCapabilitiesCacheClock;
+  msReleaseLock( TLOCK_OWSCAPS );
+}
+
+static int msOWSCompareStrings(const void *a, const void *b)
+{
+  return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/*
+** Returns the cache key of a cacheable GetCapabilities request, NULL
+** otherwise, and the TTL that applies to it.
+*/
+static char *msOWSCapabilitiesCacheKey(mapObj *map, cgiRequestObj *request,
+                                       const char *mapfile, int *ttl)
+{
+  const char *service = NULL, *req = NULL, *namespaces, *value;
+  char **params, *online_resource, *key;
+  struct stat sStat;
+  char stamp[64];
+  int i, n = 0;
+
+  if( !map || !mapfile || request->type != MS_GET_REQUEST )
+    return NULL;
+
+  for( i = 0; i < request->NumParams; i++ ) {
+    if( strcasecmp(request->ParamNames[i], "SERVICE") == 0 )
+      service = request->ParamValues[i];
+    else if( strcasecmp(request->ParamNames[i], "REQUEST") == 0 )
+      req = request->ParamValues[i];
+  }
+  if( !service || !req || strcasecmp(req, "GetCapabilities") != 0 )
+    return NULL;
+
+  if( strcasecmp(service, "WMS") == 0 )
+    namespaces = "MO";
+  else if( strcasecmp(service, "WFS") == 0 )
+    namespaces = "FO";
+  else if( strcasecmp(service, "WCS") == 0 )
+    namespaces = "CO";
+  else if( strcasecmp(service, "SOS") == 0 )
+    namespaces = "SO";
+  else
+    return NULL;
+
+  value = msOWSLookupMetadata(&(map->web.metadata), namespaces, "capabilities_cache_ttl");
+  if( !value || (*ttl = atoi(value)) <= 0 )
+    return NULL;
+
+  if( stat(mapfile, &sStat) != 0 )
+    return NULL;
+
+  /* the URL the document points back to, from the request if not set */
+  online_resource = msOWSGetOnlineResource(map, namespaces, "onlineresource", request);
+  if( !online_resource ) {
+    msResetErrorList();
+    return NULL;
+  }
+
+  snprintf(stamp, sizeof(stamp), "\n%ld\n%ld\n", (long) sStat.st_mtime, (long) sStat.st_size);
+  key = msStringConcatenate(msStringConcatenate(msStrdup(mapfile), stamp), online_resource);
+  msFree(online_resource);
+
+  /* the parameters in a canonical order, the mapfile is already known */
+  params = (char **) msSmallMalloc(sizeof(char *) * (request->NumParams + 1));
+  for( i = 0; i < request->NumParams; i++ ) {
+    if( strcasecmp(request->ParamNames[i], "MAP") == 0 )
+      continue;
+    params[n] = msStrdup(request->ParamNames[i]);
+    msStringToUpper(params[n]);
+    params[n] = msStringConcatenate(msStringConcatenate(params[n], "="), request->ParamValues[i]);
+    n++;
+  }
+  qsort(params, n, sizeof(char *), msOWSCompareStrings);
+  for( i = 0; i < n; i++ )
+    key = msStringConcatenate(msStringConcatenate(key, "\n"), params[i]);
+  msFreeCharArray(params, n);
+
+  return key;
+}
+
+static void msOWSWriteCachedCapabilities(const unsigned char *data, int size, const char *mimetype)
+{
+  if( mimetype ) {
+    msIO_setHeader("Content-Type", "%s", mimetype);
+    msIO_sendHeaders();
+  }
+  msIO_fwrite(data, 1, size, stdout);
+}
+
+typedef struct {
+  mapObj *map;
+  cgiRequestObj *request;
+  int ows_mode;
+  const char *mapfile;
+} owsDispatchArgsObj;
+
+/* msLegendDispatchCached() callback of GetLegendGraphic */
+static int msOWSDispatchFunc(void *cbdata)
+{
+  owsDispatchArgsObj *args = (owsDispatchArgsObj *) cbdata;
+  return msOWSDispatchMapFile(args->map, args->request, args->ows_mode, args->mapfile);
+}
+
+/*
+** The "legend_cache_ttl" metadata (MO namespace) of WMS GetLegendGraphic
+** requests, 0 for other requests.
+*/
+static int msOWSLegendCacheTTL(mapObj *map, cgiRequestObj *request)
+{
+  const char *service = NULL, *req = NULL, *value;
+  int i;
+
+  if( !map )
+    return 0;
+  for( i = 0; i < request->NumParams; i++ ) {
+    if( strcasecmp(request->ParamNames[i], "SERVICE") == 0 )
+      service = request->ParamValues[i];
+    else if( strcasecmp(request->ParamNames[i], "REQUEST") == 0 )
+      req = request->ParamValues[i];
+  }
+  if( !service || !req || strcasecmp(service, "WMS") != 0 || strcasecmp(req, "GetLegendGraphic") != 0 )
+    return 0;
+
+  value = msOWSLookupMetadata(&(map->web.metadata), "MO", "legend_cache_ttl");
+  return value ? atoi(value) : 0;
+}
+
+#endif /* USE_WMS_SVR || USE_WFS_SVR || USE_WCS_SVR || USE_SOS_SVR */
+
+/*
+** msOWSDispatchCached()
+**
+** msOWSDispatch() serving the GetCapabilities requests from the cache when
+** the map has a "capabilities_cache_ttl" metadata, and the WMS
+** GetLegendGraphic requests from the legend cache (msLegendDispatchCached())
+** with a "legend_cache_ttl" metadata. mapfile is the file map
+** was loaded from, NULL to disable the cache.
+*/
+int msOWSDispatchCached(mapObj *map, cgiRequestObj *request, int ows_mode, const char *mapfile)
+{
+#if defined(USE_WMS_SVR) || defined (USE_WFS_SVR) || defined (USE_WCS_SVR) || defined(USE_SOS_SVR)
+  msIOContext *old_context;
+  msIOBuffer *buffer;
+  unsigned char *data = NULL;
+  char *key, *mimetype = NULL;
+  int i, size = 0, ttl = 0, status, hit = MS_FALSE;
+
+  if( request && mapfile && (ttl = msOWSLegendCacheTTL(map, request)) > 0 ) {
+    owsDispatchArgsObj args;
+    args.map = map;
+    args.request = request;
+    args.ows_mode = ows_mode;
+    args.mapfile = mapfile;
+    return msLegendDispatchCached(map, request, mapfile, ttl, msOWSDispatchFunc, &args);
+  }
+
+  if( !request || (key = msOWSCapabilitiesCacheKey(map, request, mapfile, &ttl)) == NULL )
+    return msOWSDispatchMapFile(map, request, ows_mode, mapfile);
+
+  msAcquireLock( TLOCK_OWSCAPS );
+  if( (i = msOWSCapabilitiesCacheFind(key)) >= 0 ) {
+    if( time(NULL) - owsCapabilitiesCache[i].created < ttl ) {
+      size = owsCapabilitiesCache[i].size;
+      data = (unsigned char *) msSmallMalloc(size);
+      memcpy(data, owsCapabilitiesCache[i].data, size);
+      if( owsCapabilitiesCache[i].mimetype )
+        mimetype = msStrdup(owsCapabilitiesCache[i].mimetype);
+      owsCapabilitiesCache[i].last_used = ++owsCapabilitiesCacheClock;
+      hit = MS_TRUE;
+    } else
+      msOWSCapabilitiesCacheRemove(i);
+  }
+  msReleaseLock( TLOCK_OWSCAPS );
+
+  if( hit ) {
+    if( map->debug >= MS_DEBUGLEVEL_V )
+      msDebug("msOWSDispatchCached(): capabilities served from the cache.\n");
+    msOWSWriteCachedCapabilities(data, size, mimetype);
+    free(data);
+    msFree(mimetype);
+    free(key);
+    return MS_SUCCESS;
+  }
+
+  /* generate the document in a buffer to keep a copy of it */
+  old_context = msIO_pushStdoutToBufferAndGetOldContext();
+  status = msOWSDispatchMapFile(map, request, ows_mode, mapfile);
+  if( status != MS_DONE )
+    mimetype = msIO_stripStdoutBufferContentType();
+  buffer = (msIOBuffer *) msIO_getHandler(stdout)->cbData;
+  size = buffer->data_offset;
+  data = (unsigned char *) msSmallMalloc(size + 1);
+  memcpy(data, buffer->data, size);
+  data[size] = '\0';
+  msIO_restoreOldStdoutContext(old_context);
+
+  msOWSWriteCachedCapabilities(data, size, mimetype);
+
+  /* anything but an XML document, like an exception, is not kept */
+  if( status == MS_SUCCESS && size > 0 && data[0] == '<' && !msIO_isRequestOutputPartial() &&
+      strstr((char *) data, "ExceptionReport") == NULL )
+    msOWSCapabilitiesCacheInsert(key, data, size, mimetype);
+
+  free(data);
+  msFree(mimetype);
+  free(key);
+  return status;
+#else
+  return msOWSDispatchMapFile(map, request, ows_mode, mapfile);
+#endif
+}
+
+/*
+** msOWSPrecomputeCapabilities()
+**
+** Fills the capabilities cache ahead of the requests, for long running
+** processes. The "ows_capabilities_precompute" metadata lists (comma
+** separated) the SERVICE or SERVICE/VERSION documents to generate, as
+** requested without and with a VERSION parameter. The online resource
+** can usually only be known from a request, so the
+** "onlineresource" metadata of the services needs to be set. map may be
+** modified by the requests, a copy should be passed.
+*/
+int msOWSPrecomputeCapabilities(mapObj *map, const char *mapfile)
+{
+#if defined(USE_WMS_SVR) || defined (USE_WFS_SVR) || defined (USE_WCS_SVR) || defined(USE_SOS_SVR)
+  const char *value = msOWSLookupMetadata(&(map->web.metadata), "O", "capabilities_precompute");
+  char **tokens;
+  int i, n, failures = 0;
+
+  if( !value || !mapfile )
+    return MS_SUCCESS;
+
+  tokens = msStringSplit(value, ',', &n);
+  for( i = 0; i < n; i++ ) {
+    cgiRequestObj *request;
+    msIOContext *old_context;
+    char *version;
+
+    msStringTrim(tokens[i]);
+    if( !*tokens[i] )
+      continue;
+
+    request = msAllocCgiObj();
+    if( (version = strchr(tokens[i], '/')) != NULL )
+      *version++ = '\0';
+    request->ParamNames[request->NumParams] = msStrdup("SERVICE");
+    request->ParamValues[request->NumParams++] = msStrdup(tokens[i]);
+    request->ParamNames[request->NumParams] = msStrdup("REQUEST");
+    request->ParamValues[request->NumParams++] = msStrdup("GetCapabilities");
+    if( version ) {
+      request->ParamNames[request->NumParams] = msStrdup("VERSION");
+      request->ParamValues[request->NumParams++] = msStrdup(version);
+    }
+
+    /* the output of the request is discarded */
+    old_context = msIO_pushStdoutToBufferAndGetOldContext();
+    if( msOWSDispatchCached(map, request, OWS, mapfile) != MS_SUCCESS )
+      failures++;
+    msIO_restoreOldStdoutContext(old_context);
+    msFreeCgiObj(request);
+  }
+  msFreeCharArray(tokens, n);
+
+  if( failures > 0 ) {
+    if( map->debug )
+      msDebug("msOWSPrecomputeCapabilities(): %d document(s) could not be generated.\n", failures);
+    msResetErrorList();
+  }
+#endif
+
+  return MS_SUCCESS;
+}
+
+void msOWSCapabilitiesCacheCleanup(void)
+{
+#if defined(USE_WMS_SVR) || defined (USE_WFS_SVR) || defined (USE_WCS_SVR) || defined(USE_SOS_SVR)
+  msAcquireLock( TLOCK_OWSCAPS );
+  while( owsCapabilitiesCacheCount > 0 )
+    msOWSCapabilitiesCacheRemove(owsCapabilitiesCacheCount - 1);
+  msReleaseLock( TLOCK_OWSCAPS );
+#endif
+}
+
 /*
 ** msOWSIpParse()
 **
@@ -581,7 +959,7 @@ int msOWSRequestIsEnabled(mapObj *map, layerObj *layer,
   if (request == NULL)
     return MS_FALSE;
 
-  remote_ip = getenv("REMOTE_ADDR");
+  remote_ip = msIO_getenv("REMOTE_ADDR");
 
   /* First, we check in the layer metadata */
   if (layer && check_all_layers == MS_FALSE) {
@@ -689,7 +1067,7 @@ void msOWSRequestLayersEnabled(mapObj *map, const char *namespaces,
   if (request == NULL || (map == NULL) || (map->numlayers <= 0))
     return;
 
-  remote_ip = getenv("REMOTE_ADDR");
+  remote_ip = msIO_getenv("REMOTE_ADDR");
 
   enable_request = msOWSLookupMetadata(&map->web.metadata, namespaces, "enable_request");
   globally_enabled = msOWSParseRequestMetadata(enable_request, request, &disabled);
@@ -1012,6 +1390,7 @@ static int msRenameLayer(layerObj *lp, int count)
   sprintf(newname, "%s_%2.2d", lp->name, count);
   free(lp->name);
   lp->name = newname;
+  msInvalidateLayerNameIndex(lp->map);
 
   return MS_SUCCESS;
 }
@@ -2340,6 +2719,15 @@ int msOWSExecuteRequests(httpRequestObj *pasReqInfo, int numRequests,
 {
   int nStatus, iReq;
 
+  /* Serve what we can from the cascaded WMS/WFS cache */
+  for(iReq=0; iReq<numRequests; iReq++) {
+    if (pasReqInfo[iReq].nLayerId >= 0 &&
+        pasReqInfo[iReq].nLayerId < map->numlayers &&
+        (GET_LAYER(map, pasReqInfo[iReq].nLayerId)->connectiontype == MS_WMS ||
+         GET_LAYER(map, pasReqInfo[iReq].nLayerId)->connectiontype == MS_WFS))
+      msWMSCacheGet(map, &(pasReqInfo[iReq]));
+  }
+
   /* Execute requests */
 #if defined(USE_CURL)
   nStatus = msHTTPExecuteRequests(pasReqInfo, numRequests, bCheckLocalCache);
@@ -2358,6 +2746,8 @@ int msOWSExecuteRequests(httpRequestObj *pasReqInfo, int numRequests,
 
       lp = GET_LAYER(map, pasReqInfo[iReq].nLayerId);
 
+      if (lp->connectiontype == MS_WFS || lp->connectiontype == MS_WMS)
+        msWMSCachePut(map, &(pasReqInfo[iReq]));
       if (lp->connectiontype == MS_WFS)
         msWFSUpdateRequestInfo(lp, &(pasReqInfo[iReq]));
     }
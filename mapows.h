@@ -70,6 +70,7 @@ typedef struct {
   char *pszResultType;
   char *pszPropertyName;
   int nStartIndex;
+  char *pszStartKey; /* STARTKEY vendor parameter, keyset paging continuation token */
   char *pszAcceptVersions;
   char *pszSections;
   char *pszSortBy; /* Not implemented yet */
@@ -128,9 +129,13 @@ typedef struct {
   char *version;
   char *request;
   void *document; /* xmlDocPtr or CPLXMLNode* */
+  const char *mapfile; /* the map was loaded from, NULL if unknown */
 } owsRequestObj;
 
 MS_DLL_EXPORT int msOWSDispatch(mapObj *map, cgiRequestObj *request, int ows_mode);
+MS_DLL_EXPORT int msOWSDispatchCached(mapObj *map, cgiRequestObj *request, int ows_mode, const char *mapfile);
+MS_DLL_EXPORT int msOWSPrecomputeCapabilities(mapObj *map, const char *mapfile);
+void msOWSCapabilitiesCacheCleanup(void);
 
 MS_DLL_EXPORT const char * msOWSLookupMetadata(hashTableObj *metadata,
     const char *namespaces, const char *name);
@@ -423,6 +428,13 @@ void msGMLWriteWFSBounds(mapObj *map, FILE *stream, const char *tab,
 MS_DLL_EXPORT int msGMLWriteWFSQuery(mapObj *map, FILE *stream, const char *wfs_namespace,
                                      OWSGMLVersion outputformat, int nWFSVersion, int bUseURN,
                                      int bGetPropertyValueRequest);
+
+typedef struct gmlWFSWriterObj gmlWFSWriterObj;
+MS_DLL_EXPORT gmlWFSWriterObj *msGMLBeginWFSStream(mapObj *map, FILE *stream, const char *wfs_namespace,
+                                                   OWSGMLVersion outputformat, int nWFSVersion, int bUseURN,
+                                                   int maxfeatures);
+MS_DLL_EXPORT int msGMLWriteWFSStreamShape(layerObj *lp, shapeObj *shape, void *data);
+MS_DLL_EXPORT int msGMLEndWFSStream(gmlWFSWriterObj *writer);
 #endif
 
 
@@ -459,6 +471,9 @@ MS_DLL_EXPORT char *msWMSGetFeatureInfoURL(mapObj *map, layerObj *lp,
     const char *pszInfoFormat);
 int msWMSLayerExecuteRequest(mapObj *map, int nOWSLayers, int nClickX, int nClickY,
                              int nFeatureCount, const char *pszInfoFormat, int type);
+int msWMSCacheGet(mapObj *map, httpRequestObj *psReq);
+void msWMSCachePut(mapObj *map, httpRequestObj *psReq);
+void msWMSCacheCleanup(void);
 
 /*====================================================================
  *   mapwfs.c
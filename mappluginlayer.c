@@ -180,6 +180,9 @@ copyVirtualTable(layerVTableObj *dest,
   dest->LayerEscapeSQLParam = src->LayerEscapeSQLParam ? src->LayerEscapeSQLParam: dest->LayerEscapeSQLParam;
   dest->LayerEnablePaging = src->LayerEnablePaging ? src->LayerEnablePaging: dest->LayerEnablePaging;
   dest->LayerGetPaging = src->LayerGetPaging ? src->LayerGetPaging: dest->LayerGetPaging;
+  dest->LayerNextShapes = src->LayerNextShapes ? src->LayerNextShapes: dest->LayerNextShapes;
+  dest->LayerGetShapes = src->LayerGetShapes ? src->LayerGetShapes: dest->LayerGetShapes;
+  dest->LayerEstimateShapeCount = src->LayerEstimateShapeCount ? src->LayerEstimateShapeCount: dest->LayerEstimateShapeCount;
 }
 
 int
@@ -187,22 +190,28 @@ msPluginLayerInitializeVirtualTable(layerObj *layer)
 {
   VTFactoryItemObj *pVTFI;
 
-  msAcquireLock(TLOCK_LAYER_VTABLE);
-
+  /* the plugin is normally loaded already, only look it up */
+  msAcquireReadLock(TLOCK_LAYER_VTABLE);
   pVTFI = lookupVTFItem(&gVirtualTableFactory, layer->plugin_library);
+  msReleaseReadLock(TLOCK_LAYER_VTABLE);
+
   if ( ! pVTFI) {
-    pVTFI = loadCustomLayerDLL(layer, layer->plugin_library);
+    msAcquireWriteLock(TLOCK_LAYER_VTABLE);
+    pVTFI = lookupVTFItem(&gVirtualTableFactory, layer->plugin_library);
     if ( ! pVTFI) {
-      msReleaseLock(TLOCK_LAYER_VTABLE);
-      return MS_FAILURE;
-    }
-    if (insertNewVTFItem(&gVirtualTableFactory, pVTFI) != MS_SUCCESS) {
-      destroyVTFItem(&pVTFI);
-      msReleaseLock(TLOCK_LAYER_VTABLE);
-      return MS_FAILURE;
+      pVTFI = loadCustomLayerDLL(layer, layer->plugin_library);
+      if ( ! pVTFI) {
+        msReleaseWriteLock(TLOCK_LAYER_VTABLE);
+        return MS_FAILURE;
+      }
+      if (insertNewVTFItem(&gVirtualTableFactory, pVTFI) != MS_SUCCESS) {
+        destroyVTFItem(&pVTFI);
+        msReleaseWriteLock(TLOCK_LAYER_VTABLE);
+        return MS_FAILURE;
+      }
     }
+    msReleaseWriteLock(TLOCK_LAYER_VTABLE);
   }
-  msReleaseLock(TLOCK_LAYER_VTABLE);
 
   copyVirtualTable(layer->vtable, &pVTFI->vtable);
   return MS_SUCCESS;
@@ -215,7 +224,7 @@ void
 msPluginFreeVirtualTableFactory()
 {
   int i;
-  msAcquireLock(TLOCK_LAYER_VTABLE);
+  msAcquireWriteLock(TLOCK_LAYER_VTABLE);
 
   for (i=0; i<gVirtualTableFactory.size; i++) {
     if (gVirtualTableFactory.vtItems[i])
@@ -226,5 +235,5 @@ msPluginFreeVirtualTableFactory()
   gVirtualTableFactory.size = 0;
   gVirtualTableFactory.first_free = 0;
 
-  msReleaseLock(TLOCK_LAYER_VTABLE);
+  msReleaseWriteLock(TLOCK_LAYER_VTABLE);
 }
@@ -129,10 +129,35 @@ o The connection pooling API will let a connection be used/referenced multiple
   between different threads concurrently.  But if a connection is released
   by one thread, it is available for use by another thread.
 
+Pool Sizing and Health Checks
+-----------------------------
+
+Connections are grouped per connection type and connection string in a
+hash table, so lookups don't scan the whole pool. A few more PROCESSING
+options on the layers tune the pool of their connection string:
+
+o CONNECTION_POOL_MAX=n bounds the number of connections (in use, idle or
+  being opened) kept for the connection string. When it is reached
+  msConnPoolRequest() waits for one to be released, at most
+  CONNECTION_POOL_TIMEOUT seconds (30 by default), after which it lets the
+  caller open an extra one. A miss reserves a slot for the calling thread
+  until it registers its new connection, so that a burst of requests
+  doesn't open more than n connections at once.
+
+o CONNECTION_POOL_IDLE=n, with CLOSE_CONNECTION=DEFER, closes connections
+  unused for n seconds instead of keeping them forever.
+
+o Drivers can register their connections with msConnPoolRegisterEx() and
+  a liveness callback, called before an idle connection is handed out.
+  If it returns false the connection is closed and another one is
+  looked for (or opened by the caller).
+
  ****************************************************************************/
 
 #include "mapserver.h"
 #include "mapthread.h"
+#include "uthash.h"
+#include <ctype.h>
 
 
 
@@ -143,7 +168,12 @@ o The connection pooling API will let a connection be used/referenced multiple
 #define MS_LIFE_ZEROREF       -2
 #define MS_LIFE_SINGLE        -3
 
-typedef struct {
+#define MS_POOL_TIMEOUT_DEFAULT 30
+#define MS_POOL_RESERVATION_STALE 60 /* seconds, a miss that never registered */
+
+struct poolKeyObj;
+
+typedef struct connectionObj {
   enum MS_CONNECTION_TYPE connectiontype;
   char *connection;
 
@@ -154,32 +184,163 @@ typedef struct {
 
   time_t last_used;
 
-  void  *conn_handle;
+  void  *conn_handle; /* NULL for a slot reserved by a thread opening one */
 
   void  (*close)( void * );
+  int   (*alive)( void * );
+
+  struct poolKeyObj *pool;
+  struct connectionObj *next;
 } connectionObj;
 
+typedef struct poolKeyObj {
+  char *key; /* connection type and lower cased connection string */
+  connectionObj *connections;
+  int count; /* including the reserved slots */
+  UT_hash_handle hh;
+} poolKeyObj;
+
 /*
 ** These static structures are protected by the TLOCK_POOL mutex.
 */
 
 static int connectionCount = 0;
-static int connectionMax = 0;
-static connectionObj *connections = NULL;
+static poolKeyObj *pools = NULL;
+static time_t lastIdleSweep = 0;
+
+/* ==================================================================== */
+/*      Waiting for a connection to be released, only with pthreads.    */
+/*      The generation counter is bumped after every release, under     */
+/*      pool_wait_lock which is always taken after TLOCK_POOL.          */
+/* ==================================================================== */
+#if defined(USE_THREAD) && !defined(_WIN32)
+#include <pthread.h>
+#include <errno.h>
+#include <sys/time.h>
+
+static pthread_mutex_t pool_wait_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_released = PTHREAD_COND_INITIALIZER;
+static unsigned long pool_generation = 0;
+
+static void msConnPoolSignalRelease( void )
+
+{
+  pthread_mutex_lock( &pool_wait_lock );
+  pool_generation++;
+  pthread_cond_broadcast( &pool_released );
+  pthread_mutex_unlock( &pool_wait_lock );
+}
+
+/* called with TLOCK_POOL held, returns with it held again, MS_FALSE if deadline passed */
+static int msConnPoolWait( time_t deadline )
+
+{
+  struct timespec ts;
+  unsigned long generation;
+  int timedout = MS_FALSE;
+
+  pthread_mutex_lock( &pool_wait_lock );
+  generation = pool_generation;
+  msReleaseLock( TLOCK_POOL );
+
+  ts.tv_sec = deadline;
+  ts.tv_nsec = 0;
+  while( generation == pool_generation && !timedout ) {
+    if( pthread_cond_timedwait( &pool_released, &pool_wait_lock, &ts ) == ETIMEDOUT )
+      timedout = MS_TRUE;
+  }
+  pthread_mutex_unlock( &pool_wait_lock );
+
+  msAcquireLock( TLOCK_POOL );
+  return !timedout || time(NULL) < deadline;
+}
+#else
+static void msConnPoolSignalRelease( void ) {}
+static int msConnPoolWait( time_t deadline )
+{
+  return MS_FALSE; /* nobody else can release a connection */
+}
+#endif
 
 /************************************************************************/
-/*                         msConnPoolRegister()                         */
+/*                         msConnPoolGetKey()                           */
+/************************************************************************/
+
+static char *msConnPoolGetKey( enum MS_CONNECTION_TYPE connectiontype, const char *connection )
+
+{
+  char prefix[32];
+  char *key, *c;
+
+  snprintf( prefix, sizeof(prefix), "%d|", (int) connectiontype );
+  key = msStringConcatenate( msStrdup(prefix), connection );
+  for( c = key; *c; c++ )
+    *c = tolower( (unsigned char) *c );
+
+  return key;
+}
+
+/* the key of the layer connection, kept by the layer until its connection changes */
+static const char *msConnPoolLayerKey( layerObj *layer )
+
+{
+  char prefix[32];
+  int len;
+
+  if( layer->connpoolkey ) {
+    len = snprintf( prefix, sizeof(prefix), "%d|", (int) layer->connectiontype );
+    if( strncmp( layer->connpoolkey, prefix, len ) == 0 &&
+        strcasecmp( layer->connpoolkey + len, layer->connection ) == 0 )
+      return layer->connpoolkey;
+    msFree( layer->connpoolkey );
+  }
+  layer->connpoolkey = msConnPoolGetKey( layer->connectiontype, layer->connection );
+
+  return layer->connpoolkey;
+}
+
+static poolKeyObj *msConnPoolFindKey( layerObj *layer, int create )
+
+{
+  poolKeyObj *pool;
+  const char *key = msConnPoolLayerKey( layer );
+
+  UT_HASH_FIND_STR( pools, key, pool );
+  if( pool == NULL && create ) {
+    pool = (poolKeyObj *) msSmallCalloc( 1, sizeof(poolKeyObj) );
+    pool->key = msStrdup( key );
+    UT_HASH_ADD_KEYPTR( hh, pools, pool->key, strlen(pool->key), pool );
+  }
+
+  return pool;
+}
+
+static int msConnPoolLayerOption( layerObj *layer, const char *name, int default_value )
+
+{
+  const char *value = msLayerGetProcessingKey( layer, name );
+
+  return value ? atoi(value) : default_value;
+}
+
+/************************************************************************/
+/*                         msConnPoolRegisterEx()                       */
 /*                                                                      */
-/*      Register a new connection with the connection pool tracker.     */
+/*      Register a new connection with the connection pool tracker,     */
+/*      with an optional callback telling whether an idle connection    */
+/*      is still usable.                                                */
 /************************************************************************/
 
-void msConnPoolRegister( layerObj *layer,
-                         void *conn_handle,
-                         void (*close_func)( void * ) )
+void msConnPoolRegisterEx( layerObj *layer,
+                           void *conn_handle,
+                           void (*close_func)( void * ),
+                           int (*alive_func)( void * ) )
 
 {
   const char *close_connection = NULL;
   connectionObj *conn = NULL;
+  poolKeyObj *pool;
+  void *thread_id = msGetThreadId();
 
   if( layer->debug )
     msDebug( "msConnPoolRegister(%s,%s,%p)\n",
@@ -206,35 +367,35 @@ void msConnPoolRegister( layerObj *layer,
     return;
   }
 
-  /* -------------------------------------------------------------------- */
-  /*      Grow the array of connection information objects if needed.     */
-  /* -------------------------------------------------------------------- */
   msAcquireLock( TLOCK_POOL );
 
-  if( connectionCount == connectionMax ) {
-    connectionMax += 10;
-    connections = (connectionObj *)
-                  realloc(connections,
-                          sizeof(connectionObj) * connectionMax );
-    if( connections == NULL ) {
-      msSetError(MS_MEMERR, NULL, "msConnPoolRegister()");
-      msReleaseLock( TLOCK_POOL );
-      return;
-    }
+  /* -------------------------------------------------------------------- */
+  /*      Use the slot reserved by this thread on its miss, if any.       */
+  /* -------------------------------------------------------------------- */
+  pool = msConnPoolFindKey( layer, MS_TRUE );
+  for( conn = pool->connections; conn != NULL; conn = conn->next ) {
+    if( conn->conn_handle == NULL && conn->thread_id == thread_id )
+      break;
+  }
+  if( conn == NULL ) {
+    conn = (connectionObj *) msSmallCalloc( 1, sizeof(connectionObj) );
+    conn->pool = pool;
+    conn->next = pool->connections;
+    pool->connections = conn;
+    pool->count++;
+    connectionCount++;
   }
 
   /* -------------------------------------------------------------------- */
   /*      Set the new connection information.                             */
   /* -------------------------------------------------------------------- */
-  conn = connections + connectionCount;
-
-  connectionCount++;
-
   conn->connectiontype = layer->connectiontype;
+  msFree( conn->connection );
   conn->connection = msStrdup( layer->connection );
   conn->close = close_func;
+  conn->alive = alive_func;
   conn->ref_count = 1;
-  conn->thread_id = msGetThreadId();
+  conn->thread_id = thread_id;
   conn->last_used = time(NULL);
   conn->conn_handle = conn_handle;
   conn->debug = layer->debug;
@@ -250,9 +411,10 @@ void msConnPoolRegister( layerObj *layer,
 
   if( strcasecmp(close_connection,"NORMAL") == 0 )
     conn->lifespan = MS_LIFE_ZEROREF;
-  else if( strcasecmp(close_connection,"DEFER") == 0 )
-    conn->lifespan = MS_LIFE_FOREVER;
-  else if( strcasecmp(close_connection,"ALWAYS") == 0 )
+  else if( strcasecmp(close_connection,"DEFER") == 0 ) {
+    int idle = msConnPoolLayerOption( layer, "CONNECTION_POOL_IDLE", 0 );
+    conn->lifespan = (idle > 0) ? idle : MS_LIFE_FOREVER;
+  } else if( strcasecmp(close_connection,"ALWAYS") == 0 )
     conn->lifespan = MS_LIFE_SINGLE;
   else {
     msDebug("msConnPoolRegister(): "
@@ -268,53 +430,101 @@ void msConnPoolRegister( layerObj *layer,
   msReleaseLock( TLOCK_POOL );
 }
 
+/************************************************************************/
+/*                         msConnPoolRegister()                         */
+/*                                                                      */
+/*      Register a new connection with the connection pool tracker.     */
+/************************************************************************/
+
+void msConnPoolRegister( layerObj *layer,
+                         void *conn_handle,
+                         void (*close_func)( void * ) )
+
+{
+  msConnPoolRegisterEx( layer, conn_handle, close_func, NULL );
+}
+
 /************************************************************************/
 /*                          msConnPoolClose()                           */
 /*                                                                      */
-/*      Close the indicated connection.  The index in the connection    */
-/*      table is passed.  Remove the connection from the table as       */
-/*      well.                                                           */
+/*      Close the indicated connection, or drop a reserved slot, and    */
+/*      remove it from its pool.  TLOCK_POOL is held by the caller.     */
 /************************************************************************/
 
-static void msConnPoolClose( int conn_index )
+static void msConnPoolClose( connectionObj *conn )
 
 {
-  connectionObj *conn = connections + conn_index;
+  poolKeyObj *pool = conn->pool;
+  connectionObj **link;
+
+  if( conn->conn_handle != NULL ) {
+    if( conn->ref_count > 0 ) {
+      if( conn->debug )
+        msDebug( "msConnPoolClose(): "
+                 "Closing connection %s even though ref_count=%d.\n",
+                 conn->connection, conn->ref_count );
+
+      msSetError( MS_MISCERR,
+                  "Closing connection %s even though ref_count=%d.",
+                  "msConnPoolClose()",
+                  conn->connection,
+                  conn->ref_count );
+    }
 
-  if( conn->ref_count > 0 ) {
     if( conn->debug )
-      msDebug( "msConnPoolClose(): "
-               "Closing connection %s even though ref_count=%d.\n",
-               conn->connection, conn->ref_count );
-
-    msSetError( MS_MISCERR,
-                "Closing connection %s even though ref_count=%d.",
-                "msConnPoolClose()",
-                conn->connection,
-                conn->ref_count );
-  }
+      msDebug( "msConnPoolClose(%s,%p)\n",
+               conn->connection, conn->conn_handle );
 
-  if( conn->debug )
-    msDebug( "msConnPoolClose(%s,%p)\n",
-             conn->connection, conn->conn_handle );
+    if( conn->close != NULL )
+      conn->close( conn->conn_handle );
+  }
 
-  if( conn->close != NULL )
-    conn->close( conn->conn_handle );
+  for( link = &(pool->connections); *link != NULL; link = &((*link)->next) ) {
+    if( *link == conn ) {
+      *link = conn->next;
+      break;
+    }
+  }
+  pool->count--;
+  connectionCount--;
 
   /* free malloced() stuff in this connection */
   free( conn->connection );
+  free( conn );
 
-  connectionCount--;
-  if( connectionCount == 0 ) {
-    /* if there are no connections left we will "cleanup".  */
-    connectionMax = 0;
-    free( connections );
-    connections = NULL;
-  } else {
-    /* move the last connection in place of our now closed one */
-    memcpy( connections + conn_index,
-            connections + connectionCount,
-            sizeof(connectionObj) );
+  if( pool->connections == NULL ) {
+    UT_HASH_DEL( pools, pool );
+    free( pool->key );
+    free( pool );
+  }
+}
+
+/************************************************************************/
+/*                       msConnPoolCloseIdle()                          */
+/*                                                                      */
+/*      Close the connections unused for longer than their lifespan     */
+/*      (CONNECTION_POOL_IDLE), at most once per second.                */
+/************************************************************************/
+
+static void msConnPoolCloseIdle( time_t now )
+
+{
+  poolKeyObj *pool, *tmp;
+
+  if( now == lastIdleSweep )
+    return;
+  lastIdleSweep = now;
+
+  UT_HASH_ITER( hh, pools, pool, tmp ) {
+    connectionObj *conn = pool->connections, *next;
+
+    /* closing the last connection frees the pool */
+    for( ; conn != NULL; conn = next ) {
+      next = conn->next;
+      if( conn->conn_handle != NULL && conn->ref_count == 0 && conn->lifespan > 0
+          && now - conn->last_used >= conn->lifespan )
+        msConnPoolClose( conn );
+    }
   }
 }
 
@@ -324,14 +534,17 @@ static void msConnPoolClose( int conn_index )
 /*      Ask for a connection from the connection pool for use with      */
 /*      the current layer.  If found (CONNECTION and CONNECTIONTYPE     */
 /*      match) then return it and up the ref count.  Otherwise          */
-/*      return NULL.                                                    */
+/*      return NULL, after waiting for a release if the pool of this    */
+/*      connection string is full.                                      */
 /************************************************************************/
 
 void *msConnPoolRequest( layerObj *layer )
 
 {
-  int  i;
   const char* close_connection;
+  void *thread_id = msGetThreadId();
+  int max, timeout;
+  time_t deadline = 0;
 
   if( layer->connection == NULL )
     return NULL;
@@ -341,34 +554,109 @@ void *msConnPoolRequest( layerObj *layer )
   if( close_connection && strcasecmp(close_connection,"ALWAYS") == 0 )
     return NULL;
 
+  max = msConnPoolLayerOption( layer, "CONNECTION_POOL_MAX", 0 );
+  timeout = msConnPoolLayerOption( layer, "CONNECTION_POOL_TIMEOUT", MS_POOL_TIMEOUT_DEFAULT );
+
   msAcquireLock( TLOCK_POOL );
-  for( i = 0; i < connectionCount; i++ ) {
-    connectionObj *conn = connections + i;
+  for( ;; ) {
+    poolKeyObj *pool;
+    connectionObj *conn, *next, *reserved = NULL;
+    time_t now = time(NULL);
+
+    msConnPoolCloseIdle( now );
+
+    pool = msConnPoolFindKey( layer, MS_FALSE );
+    for( conn = pool ? pool->connections : NULL; conn != NULL; conn = next ) {
+      void *conn_handle;
+
+      next = conn->next;
+      if( conn->conn_handle == NULL ) {
+        if( conn->thread_id == thread_id )
+          reserved = conn; /* our previous miss never registered */
+        else if( now - conn->last_used > MS_POOL_RESERVATION_STALE )
+          msConnPoolClose( conn );
+        continue;
+      }
 
-    if( layer->connectiontype == conn->connectiontype
-        && strcasecmp( layer->connection, conn->connection ) == 0
-        && (conn->ref_count == 0 || conn->thread_id == msGetThreadId())
-        && conn->lifespan != MS_LIFE_SINGLE) {
-      void *conn_handle = NULL;
+      if( !(conn->ref_count == 0 || conn->thread_id == thread_id)
+          || conn->lifespan == MS_LIFE_SINGLE )
+        continue;
+
+      conn_handle = conn->conn_handle;
+
+      if( conn->ref_count == 0 && conn->alive != NULL ) {
+        int alive;
+
+        /* claim it while checking outside of the lock, it may reconnect */
+        conn->ref_count = 1;
+        conn->thread_id = thread_id;
+        msReleaseLock( TLOCK_POOL );
+        alive = conn->alive( conn_handle );
+        msAcquireLock( TLOCK_POOL );
+        if( !alive ) {
+          if( conn->debug )
+            msDebug( "msConnPoolRequest(%s): dropping dead connection %p\n",
+                     layer->connection, conn_handle );
+          conn->ref_count = 0;
+          msConnPoolClose( conn );
+          break; /* the list may have changed meanwhile, look again */
+        }
+        conn->ref_count = 0;
+      }
 
       conn->ref_count++;
-      conn->thread_id = msGetThreadId();
+      conn->thread_id = thread_id;
       conn->last_used = time(NULL);
 
       if( layer->debug ) {
         msDebug( "msConnPoolRequest(%s,%s) -> got %p\n",
-                 layer->name, layer->connection, conn->conn_handle );
+                 layer->name, layer->connection, conn_handle );
         conn->debug = layer->debug;
       }
 
-      conn_handle = conn->conn_handle;
-
       msReleaseLock( TLOCK_POOL );
+      msMetricsCacheLookup( MS_METRICS_CACHE_POOL, MS_TRUE );
       return conn_handle;
     }
-  }
+    if( conn != NULL )
+      continue; /* a dead connection was dropped */
+
+    /* -------------------------------------------------------------------- */
+    /*      Nothing usable: reserve a slot for the connection the caller    */
+    /*      is going to open, or wait for a release if the pool is full.    */
+    /* -------------------------------------------------------------------- */
+    if( reserved ) {
+      reserved->last_used = now;
+      break;
+    }
+    pool = msConnPoolFindKey( layer, MS_FALSE ); /* stale slots may have freed it */
+    if( max <= 0 || pool == NULL || pool->count < max ) {
+      pool = msConnPoolFindKey( layer, MS_TRUE );
+      conn = (connectionObj *) msSmallCalloc( 1, sizeof(connectionObj) );
+      conn->connectiontype = layer->connectiontype;
+      conn->connection = msStrdup( layer->connection );
+      conn->thread_id = thread_id;
+      conn->last_used = now;
+      conn->lifespan = MS_LIFE_ZEROREF;
+      conn->pool = pool;
+      conn->next = pool->connections;
+      pool->connections = conn;
+      pool->count++;
+      connectionCount++;
+      break;
+    }
 
+    if( deadline == 0 )
+      deadline = now + timeout;
+    if( !msConnPoolWait( deadline ) ) {
+      if( layer->debug )
+        msDebug( "msConnPoolRequest(%s,%s): pool of %d connections exhausted for %ds, opening another one.\n",
+                 layer->name, layer->connection, max, timeout );
+      break;
+    }
+  }
   msReleaseLock( TLOCK_POOL );
+  msMetricsCacheLookup( MS_METRICS_CACHE_POOL, MS_FALSE );
 
   return NULL;
 }
@@ -378,14 +666,14 @@ void *msConnPoolRequest( layerObj *layer )
 /*                                                                      */
 /*      Release the passed connection for the given layer.              */
 /*      Internally the reference count is dropped, and the              */
-/*      connection may be closed.  We assume the caller has already     */
-/*      acquired the pool lock.                                         */
+/*      connection may be closed.                                       */
 /************************************************************************/
 
 void msConnPoolRelease( layerObj *layer, void *conn_handle )
 
 {
-  int  i;
+  poolKeyObj *pool;
+  connectionObj *conn;
 
   if( layer->debug )
     msDebug( "msConnPoolRelease(%s,%s,%p)\n",
@@ -395,12 +683,9 @@ void msConnPoolRelease( layerObj *layer, void *conn_handle )
     return;
 
   msAcquireLock( TLOCK_POOL );
-  for( i = 0; i < connectionCount; i++ ) {
-    connectionObj *conn = connections + i;
-
-    if( layer->connectiontype == conn->connectiontype
-        && strcasecmp( layer->connection, conn->connection ) == 0
-        && conn->conn_handle == conn_handle ) {
+  pool = msConnPoolFindKey( layer, MS_FALSE );
+  for( conn = pool ? pool->connections : NULL; conn != NULL; conn = conn->next ) {
+    if( conn->conn_handle == conn_handle && conn_handle != NULL ) {
       conn->ref_count--;
       conn->last_used = time(NULL);
 
@@ -408,9 +693,11 @@ void msConnPoolRelease( layerObj *layer, void *conn_handle )
         conn->thread_id = 0;
 
       if( conn->ref_count == 0 && (conn->lifespan == MS_LIFE_ZEROREF || conn->lifespan == MS_LIFE_SINGLE) )
-        msConnPoolClose( i );
+        msConnPoolClose( conn );
 
+      msConnPoolCloseIdle( time(NULL) );
       msReleaseLock( TLOCK_POOL );
+      msConnPoolSignalRelease();
       return;
     }
   }
@@ -436,19 +723,47 @@ void msConnPoolRelease( layerObj *layer, void *conn_handle )
 void msConnPoolCloseUnreferenced()
 
 {
-  int  i;
+  poolKeyObj *pool, *tmp;
 
   /* this really needs to be commented out before commiting.  */
   /* msDebug( "msConnPoolCloseUnreferenced()\n" ); */
 
   msAcquireLock( TLOCK_POOL );
-  for( i = connectionCount - 1; i >= 0; i-- ) {
-    connectionObj *conn = connections + i;
+  UT_HASH_ITER( hh, pools, pool, tmp ) {
+    connectionObj *conn, *next;
+
+    for( conn = pool->connections; conn != NULL; conn = next ) {
+      next = conn->next;
+      if( conn->ref_count == 0 && conn->conn_handle != NULL )
+        msConnPoolClose( conn );
+    }
+  }
+  msReleaseLock( TLOCK_POOL );
+  msConnPoolSignalRelease();
+}
+
+/************************************************************************/
+/*                          msConnPoolStats()                           */
+/*                                                                      */
+/*      Number of pooled connections open, and of those in use.         */
+/************************************************************************/
+
+void msConnPoolStats( int *connections, int *inuse )
 
-    if( conn->ref_count == 0 ) {
-      /* for now we don't assume the locks are re-entrant, so release */
-      /* it so msConnPoolClose() can get it.  */
-      msConnPoolClose( i );
+{
+  poolKeyObj *pool, *tmp;
+  connectionObj *conn;
+
+  *connections = *inuse = 0;
+
+  msAcquireLock( TLOCK_POOL );
+  UT_HASH_ITER( hh, pools, pool, tmp ) {
+    for( conn = pool->connections; conn != NULL; conn = conn->next ) {
+      if( conn->conn_handle == NULL )
+        continue; /* reserved slot */
+      (*connections)++;
+      if( conn->ref_count > 0 )
+        (*inuse)++;
     }
   }
   msReleaseLock( TLOCK_POOL );
@@ -468,7 +783,8 @@ void msConnPoolFinalCleanup()
   /* msDebug( "msConnPoolFinalCleanup()\n" ); */
 
   msAcquireLock( TLOCK_POOL );
-  while( connectionCount > 0 )
-    msConnPoolClose( 0 );
+  while( pools != NULL )
+    msConnPoolClose( pools->connections );
+  lastIdleSweep = 0;
   msReleaseLock( TLOCK_POOL );
 }
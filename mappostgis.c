@@ -51,6 +51,59 @@
 ** msPostGISNextShape reads a row, increments layerinfo->rownum, and returns
 ** MS_SUCCESS, until rownum reaches ntuples, and it returns MS_DONE instead.
 **
+** With PROCESSING "FETCH_SIZE=n" the rows of a draw (not a query, whose
+** results are read again by resultindex) come from a cursor instead:
+** msPostGISLayerWhichShapes declares it and fetches the first n rows, and
+** msPostGISNextShape fetches the next n each time it reaches the end of
+** the batch in layerinfo->pgresult. The cursor needs a transaction, one is
+** begun if the connection had none and ended when the cursor is closed; a
+** connection already in a transaction (shared with a layer streaming its
+** own rows) gets the plain query.
+**
+** With PROCESSING "PREPARED_STATEMENTS=ON" the boxes of the draw query are
+** bound as parameters instead of being written in the SQL, and the query
+** is prepared the first time a pooled connection runs it. The statements
+** of each connection are kept by SQL text, so a layer whose SQL only
+** differs by its box is planned once per connection.
+**
+** With PROCESSING "TWKB=ON" (PostGIS 2.2+) the geometries of a draw come as
+** ST_AsTWKB() rounded to a tenth of a pixel of the request, decoded by
+** twkbConvGeometryToShape(), instead of full precision WKB.
+**
+** With PROCESSING "SIMPLIFY=SNAPTOGRID|SIMPLIFY|REMOVEREPEATEDPOINTS" the
+** line and polygon geometries of a draw go through ST_SnapToGrid(),
+** ST_Simplify() or ST_RemoveRepeatedPoints() (the latter two PostGIS 2.2+)
+** with a tolerance of PROCESSING "SIMPLIFY_TOLERANCE" pixels of the request
+** (0.5 by default), so vertices that would end up on the same pixel are
+** dropped by the server instead of msTransformShapeSimplify().
+**
+** With PROCESSING "CACHE_TTL=seconds" the extent and the feature counts of
+** the layer are kept that long by the process, for every layer with the same
+** connection and SQL. PROCESSING "ESTIMATED_EXTENT=ON" takes the extent of a
+** plain table from its statistics (ST_EstimatedExtent(), falling back to
+** ST_Extent() without statistics) and "ESTIMATED_COUNT=ON" takes the counts
+** from the row estimate of the planner instead of running count(*), as
+** msLayerEstimateShapeCount() always does.
+**
+** With PROCESSING "PUSHDOWN_CLASSES=ON" a draw query only selects the rows
+** that one of the classes in scale (and in the class group) may match: the
+** class expressions, translated as the layer FILTER is, are ORed in its
+** WHERE clause. The classes are still evaluated for the rows returned, so a
+** class whose expression has no SQL translation (or no expression) just
+** leaves the query as it was.
+**
+** With map CONFIG "MS_POSTGIS_PIPELINE" "ON" (and libpq 14+) msDrawMap()
+** selects the shapes of its PostGIS layers before drawing any of them:
+** msPostGISLayerWhichShapes() only builds the query of each layer, and
+** msPostGISPipelineFlush() sends them all in one libpq pipeline per
+** connection, so a map of many layers waits for one round trip instead of
+** one per layer. The rows of all these layers are then held at once.
+**
+** With PROCESSING "KEYSET_PAGING=ON" (and no SORTBY) a paged query is
+** ordered by the unique key, and PROCESSING "KEYSET_AFTER=key" (set by WFS
+** from a STARTKEY continuation token) makes it start after that key
+** instead of skipping STARTINDEX rows with OFFSET.
+**
 */
 
 /* GNU needs this for strcasestr */
@@ -65,21 +118,9 @@
 #include "maptime.h"
 #include "mappostgis.h"
 #include "mapows.h"
-
-#define FP_EPSILON 1e-12
-#define FP_EQ(a, b) (fabs((a)-(b)) < FP_EPSILON)
-#define FP_LEFT -1
-#define FP_RIGHT 1
-#define FP_COLINEAR 0
-
-#define SEGMENT_ANGLE 10.0
-#define SEGMENT_MINPOINTS 10
-
-#define WKBZOFFSET_NONISO 0x80000000
-#define WKBMOFFSET_NONISO 0x40000000
-
-#define HAS_Z   0x1
-#define HAS_M   0x2
+#include "mapthread.h"
+#include "mapparser.h"
+#include "uthash.h"
 
 #if TRANSFER_ENCODING == 256
 #define RESULTSET_TYPE 1
@@ -89,972 +130,712 @@
 
 #ifdef USE_POSTGIS
 
-
-
 /*
-** msPostGISCloseConnection()
-**
-** Handler registered witih msConnPoolRegister so that Mapserver
-** can clean up open connections during a shutdown.
+** Prepared statements, by connection and SQL text. The list of connections
+** is shared under TLOCK_PGSTATEMENTS, the statements of a connection are
+** only added by the thread the pool gave the connection to. Statements
+** belong to a backend: those of a connection whose backend changed (reset)
+** are forgotten.
 */
-void msPostGISCloseConnection(void *pgconn)
+#define MS_POSTGIS_MAX_STATEMENTS 256 /* per connection, further queries are not prepared */
+
+typedef struct {
+  char *sql;
+  char name[32];
+  UT_hash_handle hh;
+} msPostGISStatementObj;
+
+typedef struct {
+  PGconn *conn;
+  int backendpid;
+  int numstatements, nextid;
+  msPostGISStatementObj *statements;
+  UT_hash_handle hh;
+} msPostGISConnStatementsObj;
+
+static msPostGISConnStatementsObj *pg_statements = NULL;
+
+/* TLOCK_PGSTATEMENTS is held */
+static void msPostGISFreeStatements(msPostGISConnStatementsObj *connstmts)
 {
-  PQfinish((PGconn*)pgconn);
-}
+  msPostGISStatementObj *stmt, *tmp;
 
-/*
-** msPostGISCreateLayerInfo()
-*/
-msPostGISLayerInfo *msPostGISCreateLayerInfo(void)
-{
-  msPostGISLayerInfo *layerinfo = msSmallMalloc(sizeof(msPostGISLayerInfo));
-  layerinfo->sql = NULL;
-  layerinfo->srid = NULL;
-  layerinfo->uid = NULL;
-  layerinfo->pgconn = NULL;
-  layerinfo->pgresult = NULL;
-  layerinfo->geomcolumn = NULL;
-  layerinfo->fromsource = NULL;
-  layerinfo->endian = 0;
-  layerinfo->rownum = 0;
-  layerinfo->version = 0;
-  layerinfo->paging = MS_TRUE;
-#ifdef USE_POINT_Z_M
-  layerinfo->force2d = MS_FALSE;
-#else
-  layerinfo->force2d = MS_TRUE;
-#endif
-  return layerinfo;
-}
-
-/*
-** msPostGISFreeLayerInfo()
-*/
-void msPostGISFreeLayerInfo(layerObj *layer)
-{
-  msPostGISLayerInfo *layerinfo = NULL;
-  layerinfo = (msPostGISLayerInfo*)layer->layerinfo;
-  if ( layerinfo->sql ) free(layerinfo->sql);
-  if ( layerinfo->uid ) free(layerinfo->uid);
-  if ( layerinfo->srid ) free(layerinfo->srid);
-  if ( layerinfo->geomcolumn ) free(layerinfo->geomcolumn);
-  if ( layerinfo->fromsource ) free(layerinfo->fromsource);
-  if ( layerinfo->pgresult ) PQclear(layerinfo->pgresult);
-  if ( layerinfo->pgconn ) msConnPoolRelease(layer, layerinfo->pgconn);
-  free(layerinfo);
-  layer->layerinfo = NULL;
+  UT_HASH_ITER(hh, connstmts->statements, stmt, tmp) {
+    UT_HASH_DEL(connstmts->statements, stmt);
+    free(stmt->sql);
+    free(stmt);
+  }
+  connstmts->numstatements = 0;
 }
 
-
 /*
-** postgresqlNoticeHandler()
+** msPostGISForgetStatements()
 **
-** Propagate messages from the database to the Mapserver log,
-** set in PQsetNoticeProcessor during layer open.
+** The server side statements of conn are gone (closed, or failed to run).
 */
-void postresqlNoticeHandler(void *arg, const char *message)
+static void msPostGISForgetStatements(PGconn *conn)
 {
-  layerObj *lp;
-  lp = (layerObj*)arg;
+  msPostGISConnStatementsObj *connstmts;
 
-  if (lp->debug) {
-    msDebug("%s\n", message);
+  msAcquireLock(TLOCK_PGSTATEMENTS);
+  UT_HASH_FIND_PTR(pg_statements, &conn, connstmts);
+  if (connstmts) {
+    UT_HASH_DEL(pg_statements, connstmts);
+    msPostGISFreeStatements(connstmts);
+    free(connstmts);
   }
+  msReleaseLock(TLOCK_PGSTATEMENTS);
 }
 
-
 /*
-** Expandable pointObj array. The lineObj unfortunately
-** is not useful for this purpose, so we have this one.
+** msPostGISPrepareStatement()
+**
+** Puts in name the statement running sql with nparams parameters on conn,
+** preparing it if that was not done yet. Returns MS_FAILURE if it could
+** not be prepared, the caller then runs the SQL unprepared.
 */
-pointArrayObj*
-pointArrayNew(int maxpoints)
+static int msPostGISPrepareStatement(layerObj *layer, PGconn *conn, const char *sql, int nparams, char *name, size_t namesize)
 {
-  pointArrayObj *d = msSmallMalloc(sizeof(pointArrayObj));
-  if ( maxpoints < 1 ) maxpoints = 1; /* Avoid a degenerate case */
-  d->maxpoints = maxpoints;
-  d->data = msSmallMalloc(maxpoints * sizeof(pointObj));
-  d->npoints = 0;
-  return d;
-}
+  msPostGISConnStatementsObj *connstmts;
+  msPostGISStatementObj *stmt;
+  PGresult *pgresult;
+  int backendpid = PQbackendPID(conn);
+
+  msAcquireLock(TLOCK_PGSTATEMENTS);
+  UT_HASH_FIND_PTR(pg_statements, &conn, connstmts);
+  if (!connstmts) {
+    connstmts = (msPostGISConnStatementsObj*)msSmallCalloc(1, sizeof(msPostGISConnStatementsObj));
+    connstmts->conn = conn;
+    connstmts->backendpid = backendpid;
+    UT_HASH_ADD_PTR(pg_statements, conn, connstmts);
+  } else if (connstmts->backendpid != backendpid) {
+    msPostGISFreeStatements(connstmts);
+    connstmts->backendpid = backendpid;
+  }
+
+  UT_HASH_FIND_STR(connstmts->statements, sql, stmt);
+  if (stmt) {
+    strlcpy(name, stmt->name, namesize);
+    msReleaseLock(TLOCK_PGSTATEMENTS);
+    return MS_SUCCESS;
+  }
+  if (connstmts->numstatements >= MS_POSTGIS_MAX_STATEMENTS) {
+    msReleaseLock(TLOCK_PGSTATEMENTS);
+    return MS_FAILURE;
+  }
+  snprintf(name, namesize, "msstmt_%d", connstmts->nextid++);
+  msReleaseLock(TLOCK_PGSTATEMENTS);
 
-/*
-** Utility function to creal up the pointArrayObj
-*/
-void
-pointArrayFree(pointArrayObj *d)
-{
-  if ( ! d ) return;
-  if ( d->data ) free(d->data);
-  free(d);
-}
+  pgresult = PQprepare(conn, name, sql, nparams, NULL);
+  if (!pgresult || PQresultStatus(pgresult) != PGRES_COMMAND_OK) {
+    msDebug("msPostGISPrepareStatement(): Error (%s) preparing: %s\n", PQerrorMessage(conn), sql);
+    if (pgresult) PQclear(pgresult);
+    return MS_FAILURE;
+  }
+  PQclear(pgresult);
 
-/*
-** Add a pointObj to the pointObjArray, allocating
-** extra storage space if we've used up our existing
-** buffer.
-*/
-static int
-pointArrayAddPoint(pointArrayObj *d, const pointObj *p)
-{
-  if ( !p || !d ) return MS_FAILURE;
-  /* Avoid overwriting memory buffer */
-  if ( d->maxpoints - d->npoints == 0 ) {
-    d->maxpoints *= 2;
-    d->data = realloc(d->data, d->maxpoints * sizeof(pointObj));
-  }
-  d->data[d->npoints] = *p;
-  d->npoints++;
-  return MS_SUCCESS;
-}
+  if (layer->debug) {
+    msDebug("msPostGISPrepareStatement: prepared %s.\n", name);
+  }
 
-/*
-** Pass an input type number through the PostGIS version
-** type map array to handle the pre-2.0 incorrect WKB types
-*/
+  stmt = (msPostGISStatementObj*)msSmallMalloc(sizeof(msPostGISStatementObj));
+  stmt->sql = msStrdup(sql);
+  strlcpy(stmt->name, name, sizeof(stmt->name));
 
-static int
-wkbTypeMap(wkbObj *w, int type, int* pnZMFlag)
-{
-  *pnZMFlag = 0;
-  /* PostGIS >= 2 : ISO SQL/MM style Z types ? */
-  if( type >= 1000 && type < 2000 )
-  {
-    type -= 1000;
-    *pnZMFlag = HAS_Z;
-  }
-  /* PostGIS >= 2 : ISO SQL/MM style M types ? */
-  else if( type >= 2000 && type < 3000 )
-  {
-    type -= 2000;
-    *pnZMFlag = HAS_M;
-  }
-  /* PostGIS >= 2 : ISO SQL/MM style ZM types ? */
-  else if( type >= 3000 && type < 4000 )
-  {
-    type -= 3000;
-    *pnZMFlag = HAS_Z | HAS_M;
+  msAcquireLock(TLOCK_PGSTATEMENTS);
+  UT_HASH_FIND_PTR(pg_statements, &conn, connstmts);
+  if (connstmts) {
+    UT_HASH_ADD_KEYPTR(hh, connstmts->statements, stmt->sql, strlen(stmt->sql), stmt);
+    connstmts->numstatements++;
+    stmt = NULL;
   }
-  /* PostGIS 1.X EWKB : Extended WKB Z or ZM ? */
-  else if( (type & WKBZOFFSET_NONISO) != 0 )
-  {
-    if( (type & WKBMOFFSET_NONISO) != 0 )
-        *pnZMFlag = HAS_Z | HAS_M;
-    else
-        *pnZMFlag = HAS_Z;
-    type &= 0x00FFFFFF;
-  }
-  /* PostGIS 1.X EWKB: Extended WKB M ? */
-  else if( (type & WKBMOFFSET_NONISO) != 0 )
-  {
-    *pnZMFlag = HAS_M;
-    type &= 0x00FFFFFF;
+  msReleaseLock(TLOCK_PGSTATEMENTS);
+  if (stmt) { /* forgotten meanwhile */
+    free(stmt->sql);
+    free(stmt);
   }
-  if ( type >= 0 && type < WKB_TYPE_COUNT )
-    return w->typemap[type];
-  else
-    return 0;
-}
 
-/*
-** Read the WKB type number from a wkbObj without
-** advancing the read pointer.
-*/
-static int
-wkbType(wkbObj *w, int* pnZMFlag)
-{
-  int t;
-  memcpy(&t, (w->ptr + 1), sizeof(int));
-  return wkbTypeMap(w,t, pnZMFlag);
+  return MS_SUCCESS;
 }
 
 /*
-** Read the type number of the first element of a
-** collection without advancing the read pointer.
+** Extents and feature counts, see CACHE_TTL at the top of the file. Keyed by
+** connection and SQL text (followed by the bind values), shared under
+** TLOCK_PGCACHE.
 */
-static int
-wkbCollectionSubType(wkbObj *w, int* pnZMFlag)
-{
-  int t;
-  memcpy(&t, (w->ptr + 1 + 4 + 4 + 1), sizeof(int));
-  return wkbTypeMap(w,t, pnZMFlag);
-}
+#define MS_POSTGIS_MAX_CACHED 1024
 
-/*
-** Read one byte from the WKB and advance the read pointer
-*/
-static char
-wkbReadChar(wkbObj *w)
+typedef struct {
+  char *key;
+  time_t expires;
+  rectObj extent;
+  int count;
+  UT_hash_handle hh;
+} msPostGISCachedObj;
+
+static msPostGISCachedObj *pg_cache = NULL;
+
+/* TLOCK_PGCACHE is held */
+static void msPostGISFreeCached(msPostGISCachedObj *cached)
 {
-  char c;
-  memcpy(&c, w->ptr, sizeof(char));
-  w->ptr += sizeof(char);
-  return c;
+  UT_HASH_DEL(pg_cache, cached);
+  free(cached->key);
+  free(cached);
 }
 
-/*
-** Read one integer from the WKB and advance the read pointer.
-** We assume the endianess of the WKB is the same as this machine.
-*/
-static inline int
-wkbReadInt(wkbObj *w)
+static char *msPostGISCacheKey(layerObj *layer, const char *sql, char **values, int numvalues)
 {
+  char *key = msStrdup(layer->connection ? layer->connection : "");
   int i;
-  memcpy(&i, w->ptr, sizeof(int));
-  w->ptr += sizeof(int);
-  return i;
-}
 
-/*
-** Read one double from the WKB and advance the read pointer.
-** We assume the endianess of the WKB is the same as this machine.
-*/
-static inline double
-wkbReadDouble(wkbObj *w)
-{
-  double d;
-  memcpy(&d, w->ptr, sizeof(double));
-  w->ptr += sizeof(double);
-  return d;
+  key = msStringConcatenate(key, "\n");
+  key = msStringConcatenate(key, sql);
+  for (i = 0; i < numvalues; i++) {
+    key = msStringConcatenate(key, "\n");
+    key = msStringConcatenate(key, values[i]);
+  }
+  return key;
 }
 
 /*
-** Read one pointObj (two doubles) from the WKB and advance the read pointer.
-** We assume the endianess of the WKB is the same as this machine.
+** msPostGISCacheGet()
+**
+** Returns MS_SUCCESS with the extent and count cached under key, if they
+** have not expired.
 */
-static inline void
-wkbReadPointP(wkbObj *w, pointObj *p, int nZMFlag)
+static int msPostGISCacheGet(const char *key, rectObj *extent, int *count)
 {
-  memcpy(&(p->x), w->ptr, sizeof(double));
-  w->ptr += sizeof(double);
-  memcpy(&(p->y), w->ptr, sizeof(double));
-  w->ptr += sizeof(double);
-  if( nZMFlag & HAS_Z )
-  {
-#ifdef USE_POINT_Z_M
-      memcpy(&(p->z), w->ptr, sizeof(double));
-      if( !(nZMFlag & HAS_M) )
-          p->m = 0.0;
-#endif
-      w->ptr += sizeof(double);
-  }
-  if( nZMFlag & HAS_M )
-  {
-#ifdef USE_POINT_Z_M
-      if( !(nZMFlag & HAS_Z) )
-          p->z = 0.0;
-      memcpy(&(p->m), w->ptr, sizeof(double));
-#endif
-      w->ptr += sizeof(double);
+  msPostGISCachedObj *cached;
+  int status = MS_FAILURE;
+
+  msAcquireLock(TLOCK_PGCACHE);
+  UT_HASH_FIND_STR(pg_cache, key, cached);
+  if (cached) {
+    if (cached->expires > time(NULL)) {
+      if (extent) *extent = cached->extent;
+      if (count) *count = cached->count;
+      status = MS_SUCCESS;
+    } else {
+      msPostGISFreeCached(cached);
+    }
   }
-
+  msReleaseLock(TLOCK_PGCACHE);
+  return status;
 }
 
-/*
-** Read one pointObj (two doubles) from the WKB and advance the read pointer.
-** We assume the endianess of the WKB is the same as this machine.
-*/
-static inline pointObj
-wkbReadPoint(wkbObj *w, int nZMFlag)
+static void msPostGISCachePut(layerObj *layer, const char *key, const rectObj *extent, int count)
 {
-  pointObj p;
-  wkbReadPointP(w, &p, nZMFlag);
-  return p;
+  msPostGISLayerInfo *layerinfo = (msPostGISLayerInfo*)layer->layerinfo;
+  msPostGISCachedObj *cached, *tmp;
+  time_t now = time(NULL);
+
+  msAcquireLock(TLOCK_PGCACHE);
+  UT_HASH_FIND_STR(pg_cache, key, cached);
+  if (!cached) {
+    if (UT_HASH_COUNT(pg_cache) >= MS_POSTGIS_MAX_CACHED) {
+      UT_HASH_ITER(hh, pg_cache, cached, tmp) {
+        if (cached->expires <= now) msPostGISFreeCached(cached);
+      }
+      if (UT_HASH_COUNT(pg_cache) >= MS_POSTGIS_MAX_CACHED) { /* no room, forget the oldest */
+        cached = pg_cache;
+        msPostGISFreeCached(cached);
+      }
+    }
+    cached = (msPostGISCachedObj*)msSmallCalloc(1, sizeof(msPostGISCachedObj));
+    cached->key = msStrdup(key);
+    UT_HASH_ADD_KEYPTR(hh, pg_cache, cached->key, strlen(cached->key), cached);
+  }
+  cached->expires = now + layerinfo->cachettl;
+  if (extent) cached->extent = *extent;
+  cached->count = count;
+  msReleaseLock(TLOCK_PGCACHE);
 }
+#endif /* USE_POSTGIS */
 
-/*
-** Read a "point array" and return an allocated lineObj.
-** A point array is a WKB fragment that starts with a
-** point count, which is followed by that number of doubles * 2.
-** Linestrings, circular strings, polygon rings, all show this
-** form.
-*/
-static void
-wkbReadLine(wkbObj *w, lineObj *line, int nZMFlag)
+void msPostGISCacheCleanup(void)
 {
-  int i;
-  pointObj p;
-  int npoints = wkbReadInt(w);
+#ifdef USE_POSTGIS
+  msPostGISCachedObj *cached, *tmp;
 
-  line->numpoints = npoints;
-  line->point = msSmallMalloc(npoints * sizeof(pointObj));
-  for ( i = 0; i < npoints; i++ ) {
-    wkbReadPointP(w, &p, nZMFlag);
-    line->point[i] = p;
+  msAcquireLock(TLOCK_PGCACHE);
+  UT_HASH_ITER(hh, pg_cache, cached, tmp) {
+    msPostGISFreeCached(cached);
   }
+  msReleaseLock(TLOCK_PGCACHE);
+#endif
 }
 
+#ifdef USE_POSTGIS
 /*
-** Advance the read pointer past a geometry without returning any
-** values. Used for skipping un-drawable elements in a collection.
+** msPostGISCloseConnection()
+**
+** Handler registered witih msConnPoolRegister so that Mapserver
+** can clean up open connections during a shutdown.
 */
-static void
-wkbSkipGeometry(wkbObj *w)
+void msPostGISCloseConnection(void *pgconn)
 {
-  int type, npoints, nrings, ngeoms, i;
-  int nZMFlag;
-  int nCoordDim;
-  /*endian = */wkbReadChar(w);
-  type = wkbTypeMap(w,wkbReadInt(w), &nZMFlag);
-  nCoordDim = 2 + (((nZMFlag & HAS_Z) != 0) ? 1 : 0) + (((nZMFlag & HAS_M) != 0) ? 1 : 0);
-  switch(type) {
-    case WKB_POINT:
-      w->ptr += nCoordDim * sizeof(double);
-      break;
-    case WKB_CIRCULARSTRING:
-    case WKB_LINESTRING:
-      npoints = wkbReadInt(w);
-      w->ptr += npoints * nCoordDim * sizeof(double);
-      break;
-    case WKB_POLYGON:
-      nrings = wkbReadInt(w);
-      for ( i = 0; i < nrings; i++ ) {
-        npoints = wkbReadInt(w);
-        w->ptr += npoints * nCoordDim * sizeof(double);
-      }
-      break;
-    case WKB_MULTIPOINT:
-    case WKB_MULTILINESTRING:
-    case WKB_MULTIPOLYGON:
-    case WKB_GEOMETRYCOLLECTION:
-    case WKB_COMPOUNDCURVE:
-    case WKB_CURVEPOLYGON:
-    case WKB_MULTICURVE:
-    case WKB_MULTISURFACE:
-      ngeoms = wkbReadInt(w);
-      for ( i = 0; i < ngeoms; i++ ) {
-        wkbSkipGeometry(w);
-      }
-  }
+  msPostGISForgetStatements((PGconn*)pgconn);
+  PQfinish((PGconn*)pgconn);
 }
 
 /*
-** Convert a WKB point to a shapeObj, advancing the read pointer as we go.
+** msPostGISConnectionAlive()
+**
+** Handler registered with msConnPoolRegisterEx so that the pool doesn't
+** hand out a connection the server has dropped while it was idle.
+** PQconsumeInput() notices a closed socket, a broken connection is given
+** one chance to reset.
 */
-static int
-wkbConvPointToShape(wkbObj *w, shapeObj *shape)
+int msPostGISConnectionAlive(void *pgconn)
 {
-  int type;
-  lineObj line;
-  int nZMFlag;
+  PGconn *conn = (PGconn*)pgconn;
 
-  /*endian = */wkbReadChar(w);
-  type = wkbTypeMap(w,wkbReadInt(w),&nZMFlag);
+  if( PQstatus(conn) == CONNECTION_OK )
+    PQconsumeInput(conn);
+  if( PQstatus(conn) != CONNECTION_OK )
+    PQreset(conn);
 
-  if( type != WKB_POINT ) return MS_FAILURE;
-
-  if( ! (shape->type == MS_SHAPE_POINT) ) return MS_FAILURE;
-  line.numpoints = 1;
-  line.point = msSmallMalloc(sizeof(pointObj));
-  line.point[0] = wkbReadPoint(w, nZMFlag);
-  msAddLineDirectly(shape, &line);
-  return MS_SUCCESS;
+  return PQstatus(conn) == CONNECTION_OK;
 }
 
 /*
-** Convert a WKB line string to a shapeObj, advancing the read pointer as we go.
+** msPostGISCreateLayerInfo()
 */
-static int
-wkbConvLineStringToShape(wkbObj *w, shapeObj *shape)
+msPostGISLayerInfo *msPostGISCreateLayerInfo(void)
 {
-  int type;
-  lineObj line;
-  int nZMFlag;
-
-  /*endian = */wkbReadChar(w);
-  type = wkbTypeMap(w,wkbReadInt(w), &nZMFlag);
-
-  if( type != WKB_LINESTRING ) return MS_FAILURE;
-
-  wkbReadLine(w,&line, nZMFlag);
-  msAddLineDirectly(shape, &line);
-
-  return MS_SUCCESS;
+  msPostGISLayerInfo *layerinfo = msSmallMalloc(sizeof(msPostGISLayerInfo));
+  layerinfo->sql = NULL;
+  layerinfo->srid = NULL;
+  layerinfo->uid = NULL;
+  layerinfo->pgconn = NULL;
+  layerinfo->pgresult = NULL;
+  layerinfo->pgresultsize = 0;
+  layerinfo->geomcolumn = NULL;
+  layerinfo->fromsource = NULL;
+  layerinfo->endian = 0;
+  layerinfo->rownum = 0;
+  layerinfo->version = 0;
+  layerinfo->paging = MS_TRUE;
+  layerinfo->fetchsize = 0;
+  layerinfo->cursor = NULL;
+  layerinfo->cursordone = MS_FALSE;
+  layerinfo->owntransaction = MS_FALSE;
+  layerinfo->rowoffset = 0;
+  layerinfo->prepare = MS_FALSE;
+  layerinfo->collectboxparams = MS_FALSE;
+  layerinfo->boxparambase = 0;
+  layerinfo->numboxparams = 0;
+  layerinfo->boxparams = NULL;
+  layerinfo->twkb = MS_FALSE;
+  layerinfo->twkbquery = MS_FALSE;
+  layerinfo->twkbprecision = 0;
+  layerinfo->twkbresult = MS_FALSE;
+  layerinfo->simplify = MS_POSTGIS_SIMPLIFY_NONE;
+  layerinfo->simplifytolerance = 0.5;
+  layerinfo->simplifyquery = 0;
+  layerinfo->cachettl = 0;
+  layerinfo->estimatedextent = MS_FALSE;
+  layerinfo->pushclasses = MS_FALSE;
+  layerinfo->keyset = MS_FALSE;
+  layerinfo->classfilter = NULL;
+  layerinfo->uidparam = 0;
+  layerinfo->pipeline = MS_FALSE;
+  layerinfo->pending = MS_FALSE;
+  layerinfo->pendingstatement = NULL;
+  layerinfo->numpendingvalues = 0;
+  layerinfo->pendingvalues = NULL;
+#ifdef USE_POINT_Z_M
+  layerinfo->force2d = MS_FALSE;
+#else
+  layerinfo->force2d = MS_TRUE;
+#endif
+  return layerinfo;
 }
 
 /*
-** Convert a WKB polygon to a shapeObj, advancing the read pointer as we go.
+** msPostGISFreeBoxParams()
 */
-static int
-wkbConvPolygonToShape(wkbObj *w, shapeObj *shape)
+static void msPostGISFreeBoxParams(msPostGISLayerInfo *layerinfo)
 {
-  int type;
-  int i, nrings;
-  lineObj line;
-  int nZMFlag;
-
-  /*endian = */wkbReadChar(w);
-  type = wkbTypeMap(w,wkbReadInt(w), &nZMFlag);
-
-  if( type != WKB_POLYGON ) return MS_FAILURE;
-
-  /* How many rings? */
-  nrings = wkbReadInt(w);
-
-  /* Add each ring to the shape */
-  for( i = 0; i < nrings; i++ ) {
-    wkbReadLine(w,&line, nZMFlag);
-    msAddLineDirectly(shape, &line);
-  }
-
-  return MS_SUCCESS;
+  msFreeCharArray(layerinfo->boxparams, layerinfo->numboxparams);
+  layerinfo->boxparams = NULL;
+  layerinfo->numboxparams = 0;
 }
 
 /*
-** Convert a WKB curve polygon to a shapeObj, advancing the read pointer as we go.
-** The arc portions of the rings will be stroked to linestrings as they
-** are read by the underlying circular string handling.
+** msPostGISFreePendingQuery()
 */
-static int
-wkbConvCurvePolygonToShape(wkbObj *w, shapeObj *shape)
+static void msPostGISFreePendingQuery(msPostGISLayerInfo *layerinfo)
 {
-  int type, i, ncomponents;
-  int failures = 0;
-  int was_poly = ( shape->type == MS_SHAPE_POLYGON );
-  int nZMFlag;
-
-  /*endian = */wkbReadChar(w);
-  type = wkbTypeMap(w,wkbReadInt(w), &nZMFlag);
-  ncomponents = wkbReadInt(w);
-
-  if( type != WKB_CURVEPOLYGON ) return MS_FAILURE;
-
-  /* Lower the allowed dimensionality so we can
-  *  catch the linear ring components */
-  shape->type = MS_SHAPE_LINE;
-
-  for ( i = 0; i < ncomponents; i++ ) {
-    if ( wkbConvGeometryToShape(w, shape) == MS_FAILURE ) {
-      wkbSkipGeometry(w);
-      failures++;
-    }
-  }
-
-  /* Go back to expected dimensionality */
-  if ( was_poly) shape->type = MS_SHAPE_POLYGON;
-
-  if ( failures == ncomponents )
-    return MS_FAILURE;
-  else
-    return MS_SUCCESS;
+  msFreeCharArray(layerinfo->pendingvalues, layerinfo->numpendingvalues);
+  layerinfo->pendingvalues = NULL;
+  layerinfo->numpendingvalues = 0;
+  msFree(layerinfo->pendingstatement);
+  layerinfo->pendingstatement = NULL;
+  layerinfo->pending = MS_FALSE;
 }
 
 /*
-** Convert a WKB circular string to a shapeObj, advancing the read pointer as we go.
-** Arcs will be stroked to linestrings.
+** msPostGISCloseCursor()
+**
+** Closes the cursor rows are fetched from, if any, and ends the
+** transaction begun for it. The current batch stays in pgresult.
 */
-static int
-wkbConvCircularStringToShape(wkbObj *w, shapeObj *shape)
+static void msPostGISCloseCursor(layerObj *layer)
 {
-  int type;
-  int nZMFlag;
-  lineObj line = {0, NULL};
+  msPostGISLayerInfo *layerinfo = (msPostGISLayerInfo*)layer->layerinfo;
+  PGresult *pgresult;
+  char sql[64];
 
-  /*endian = */wkbReadChar(w);
-  type = wkbTypeMap(w,wkbReadInt(w), &nZMFlag);
+  if ( ! layerinfo->cursor ) return;
 
-  if( type != WKB_CIRCULARSTRING ) return MS_FAILURE;
-
-  /* Stroke the string into a point array */
-  if ( arcStrokeCircularString(w, SEGMENT_ANGLE, &line, nZMFlag) == MS_FAILURE ) {
-    if(line.point) free(line.point);
-    return MS_FAILURE;
+  if ( PQtransactionStatus(layerinfo->pgconn) == PQTRANS_INTRANS ) {
+    snprintf(sql, sizeof(sql), "CLOSE %s", layerinfo->cursor);
+    pgresult = PQexec(layerinfo->pgconn, sql);
+    if (pgresult) PQclear(pgresult);
   }
-
-  /* Fill in the lineObj */
-  if ( line.numpoints > 0 ) {
-    msAddLine(shape, &line);
-    if(line.point) free(line.point);
+  if ( layerinfo->owntransaction ) {
+    /* rolls back instead if the transaction failed */
+    pgresult = PQexec(layerinfo->pgconn, "COMMIT");
+    if (pgresult) PQclear(pgresult);
+    layerinfo->owntransaction = MS_FALSE;
+  }
+  if (layer->debug) {
+    msDebug("msPostGISCloseCursor: closed %s after %ld rows.\n", layerinfo->cursor,
+            layerinfo->rowoffset + (layerinfo->pgresult ? PQntuples(layerinfo->pgresult) : 0));
   }
 
-  return MS_SUCCESS;
+  free(layerinfo->cursor);
+  layerinfo->cursor = NULL;
 }
 
 /*
-** Compound curves need special handling. First we load
-** each component of the curve on the a lineObj in a shape.
-** Then we merge those lineObjs into a single lineObj. This
-** allows compound curves to serve as closed rings in
-** curve polygons.
+** msPostGISSetResult()
+**
+** Replaces pgresult (NULL to just clear it), keeping the request memory
+** accounting of the layer data up to date.
 */
-static int
-wkbConvCompoundCurveToShape(wkbObj *w, shapeObj *shape)
+static void msPostGISSetResult(msPostGISLayerInfo *layerinfo, PGresult *pgresult)
 {
-  int npoints = 0;
-  int type, ncomponents, i, j;
-  lineObj line;
-  shapeObj shapebuf;
-  int nZMFlag;
-
-  /*endian = */wkbReadChar(w);
-  type = wkbTypeMap(w,wkbReadInt(w), &nZMFlag);
-
-  /* Init our shape buffer */
-  msInitShape(&shapebuf);
-
-  if( type != WKB_COMPOUNDCURVE ) return MS_FAILURE;
-
-  /* How many components in the compound curve? */
-  ncomponents = wkbReadInt(w);
-
-  /* We'll load each component onto a line in a shape */
-  for( i = 0; i < ncomponents; i++ )
-    wkbConvGeometryToShape(w, &shapebuf);
-
-  /* Do nothing on empty */
-  if ( shapebuf.numlines == 0 )
-    return MS_FAILURE;
-
-  /* Count the total number of points */
-  for( i = 0; i < shapebuf.numlines; i++ )
-    npoints += shapebuf.line[i].numpoints;
-
-  /* Do nothing on empty */
-  if ( npoints == 0 )
-    return MS_FAILURE;
-
-  line.numpoints = npoints;
-  line.point = msSmallMalloc(sizeof(pointObj) * npoints);
-
-  /* Copy in the points */
-  npoints = 0;
-  for ( i = 0; i < shapebuf.numlines; i++ ) {
-    for ( j = 0; j < shapebuf.line[i].numpoints; j++ ) {
-      /* Don't add a start point that duplicates an endpoint */
-      if( j == 0 && i > 0 &&
-          memcmp(&(line.point[npoints - 1]),&(shapebuf.line[i].point[j]),sizeof(pointObj)) == 0 ) {
-        continue;
-      }
-      line.point[npoints++] = shapebuf.line[i].point[j];
-    }
+  if ( layerinfo->pgresult ) {
+    msIO_requestMemoryFree(MS_REQUEST_MEMORY_LAYERDATA, layerinfo->pgresultsize);
+    PQclear(layerinfo->pgresult);
   }
-  line.numpoints = npoints;
-
-  /* Clean up */
-  msFreeShape(&shapebuf);
-
-  /* Fill in the lineObj */
-  msAddLineDirectly(shape, &line);
+  layerinfo->pgresult = pgresult;
+  layerinfo->pgresultsize = 0;
+  if ( pgresult ) {
+#ifdef LIBPQ_HAS_PIPELINING
+    layerinfo->pgresultsize = PQresultMemorySize(pgresult); /* libpq 12 and later, older than pipelining */
+#else
+    int row, field, numrows = PQntuples(pgresult), numfields = PQnfields(pgresult);
 
-  return MS_SUCCESS;
+    for ( row = 0; row < numrows; row++ )
+      for ( field = 0; field < numfields; field++ )
+        layerinfo->pgresultsize += PQgetlength(pgresult, row, field) + 1;
+#endif
+    msIO_requestMemoryAlloc(MS_REQUEST_MEMORY_LAYERDATA, layerinfo->pgresultsize);
+  }
 }
 
 /*
-** Convert a WKB collection string to a shapeObj, advancing the read pointer as we go.
-** Many WKB types (MultiPoint, MultiLineString, MultiPolygon, MultiSurface,
-** MultiCurve, GeometryCollection) can be treated identically as collections
-** (they start with endian, type number and count of sub-elements, then provide the
-** subelements as WKB) so are handled with this one function.
+** msPostGISFetchRows()
+**
+** Replaces pgresult with the next batch of rows of the cursor.
 */
-static int
-wkbConvCollectionToShape(wkbObj *w, shapeObj *shape)
+static int msPostGISFetchRows(layerObj *layer)
 {
-  int i, ncomponents;
-  int failures = 0;
-  int nZMFlag;
+  msPostGISLayerInfo *layerinfo = (msPostGISLayerInfo*)layer->layerinfo;
+  PGresult *pgresult;
+  char sql[96];
+  int span;
+
+  snprintf(sql, sizeof(sql), "FETCH FORWARD %d FROM %s", layerinfo->fetchsize, layerinfo->cursor);
+  span = msTraceSpanBegin("msPostGISFetchRows", MS_TRACE_CLIENT);
+  msTraceSpanAttribute(span, "mapserver.layer", layer->name);
+  msTraceSpanAttribute(span, "db.system", "postgresql");
+  msTraceSpanAttribute(span, "db.statement", sql);
+  pgresult = PQexecParams(layerinfo->pgconn, sql, 0, NULL, NULL, NULL, NULL, RESULTSET_TYPE);
+  if ( !pgresult || PQresultStatus(pgresult) != PGRES_TUPLES_OK ) {
+    msDebug("msPostGISFetchRows(): Error (%s) fetching from %s\n", PQerrorMessage(layerinfo->pgconn), layerinfo->cursor);
+    msSetError(MS_QUERYERR, "Error fetching rows. Check server logs", "msPostGISFetchRows()");
+    msTraceSpanEnd(span, MS_FAILURE);
+    if (pgresult) PQclear(pgresult);
+    return MS_FAILURE;
+  }
+  msTraceSpanEnd(span, MS_SUCCESS);
 
-  /*endian = */wkbReadChar(w);
-  /*type = */wkbTypeMap(w,wkbReadInt(w), &nZMFlag);
-  ncomponents = wkbReadInt(w);
+  if ( layerinfo->pgresult )
+    layerinfo->rowoffset += PQntuples(layerinfo->pgresult);
+  msPostGISSetResult(layerinfo, pgresult);
+  layerinfo->rownum = 0;
+  if ( PQntuples(pgresult) < layerinfo->fetchsize )
+    layerinfo->cursordone = MS_TRUE;
 
-  /*
-  * If we can draw any portion of the collection, we will,
-  * but if all the components fail, we will draw nothing.
-  */
-  for ( i = 0; i < ncomponents; i++ ) {
-    if ( wkbConvGeometryToShape(w, shape) == MS_FAILURE ) {
-      wkbSkipGeometry(w);
-      failures++;
-    }
+  if ( layer->debug > 1 ) {
+    msDebug("msPostGISFetchRows got %d records from %s.\n", PQntuples(pgresult), layerinfo->cursor);
   }
-  if ( failures == ncomponents || ncomponents == 0)
-    return MS_FAILURE;
-  else
-    return MS_SUCCESS;
-}
 
-/*
-** Generic handler to switch to the appropriate function for the WKB type.
-** Note that we also handle switching here to avoid processing shapes
-** we will be unable to draw. Example: we can't draw point features as
-** a MS_SHAPE_LINE layer, so if the type is WKB_POINT and the layer is
-** MS_SHAPE_LINE, we exit before converting.
-*/
-int
-wkbConvGeometryToShape(wkbObj *w, shapeObj *shape)
-{
-  int nZMFlag;
-  int wkbtype = wkbType(w, &nZMFlag); /* Peak at the type number */
-
-  switch(wkbtype) {
-      /* Recurse into anonymous collections */
-    case WKB_GEOMETRYCOLLECTION:
-      return wkbConvCollectionToShape(w, shape);
-      /* Handle area types */
-    case WKB_POLYGON:
-      return wkbConvPolygonToShape(w, shape);
-    case WKB_MULTIPOLYGON:
-      return wkbConvCollectionToShape(w, shape);
-    case WKB_CURVEPOLYGON:
-      return wkbConvCurvePolygonToShape(w, shape);
-    case WKB_MULTISURFACE:
-      return wkbConvCollectionToShape(w, shape);
-  }
-
-  /* We can't convert any of the following types into polygons */
-  if ( shape->type == MS_SHAPE_POLYGON ) return MS_FAILURE;
-
-  /* Handle linear types */
-  switch(wkbtype) {
-    case WKB_LINESTRING:
-      return wkbConvLineStringToShape(w, shape);
-    case WKB_CIRCULARSTRING:
-      return wkbConvCircularStringToShape(w, shape);
-    case WKB_COMPOUNDCURVE:
-      return wkbConvCompoundCurveToShape(w, shape);
-    case WKB_MULTILINESTRING:
-      return wkbConvCollectionToShape(w, shape);
-    case WKB_MULTICURVE:
-      return wkbConvCollectionToShape(w, shape);
-  }
-
-  /* We can't convert any of the following types into lines */
-  if ( shape->type == MS_SHAPE_LINE ) return MS_FAILURE;
-
-  /* Handle point types */
-  switch(wkbtype) {
-    case WKB_POINT:
-      return wkbConvPointToShape(w, shape);
-    case WKB_MULTIPOINT:
-      return wkbConvCollectionToShape(w, shape);
-  }
-
-  /* This is a WKB type we don't know about! */
-  return MS_FAILURE;
+  return MS_SUCCESS;
 }
 
-
 /*
-** Calculate determinant of a 3x3 matrix. Handy for
-** the circle center calculation.
+** msPostGISFreeLayerInfo()
 */
-static inline double
-arcDeterminant3x3(double *m)
+void msPostGISFreeLayerInfo(layerObj *layer)
 {
-  /* This had better be a 3x3 matrix or we'll fall to bits */
-  return m[0] * ( m[4] * m[8] - m[7] * m[5] ) -
-         m[3] * ( m[1] * m[8] - m[7] * m[2] ) +
-         m[6] * ( m[1] * m[5] - m[4] * m[2] );
+  msPostGISLayerInfo *layerinfo = NULL;
+  layerinfo = (msPostGISLayerInfo*)layer->layerinfo;
+  msPostGISCloseCursor(layer);
+  msPostGISFreePendingQuery(layerinfo);
+  if ( layerinfo->sql ) free(layerinfo->sql);
+  if ( layerinfo->uid ) free(layerinfo->uid);
+  if ( layerinfo->srid ) free(layerinfo->srid);
+  if ( layerinfo->geomcolumn ) free(layerinfo->geomcolumn);
+  if ( layerinfo->fromsource ) free(layerinfo->fromsource);
+  msPostGISSetResult(layerinfo, NULL);
+  if ( layerinfo->pgconn ) msConnPoolRelease(layer, layerinfo->pgconn);
+  free(layerinfo);
+  layer->layerinfo = NULL;
 }
 
-/*
-** What side of p1->p2 is q on?
-*/
-static inline int
-arcSegmentSide(const pointObj *p1, const pointObj *p2, const pointObj *q)
-{
-  double side = ( (q->x - p1->x) * (p2->y - p1->y) - (p2->x - p1->x) * (q->y - p1->y) );
-  if ( FP_EQ(side,0.0) ) {
-    return FP_COLINEAR;
-  } else {
-    if ( side < 0.0 )
-      return FP_LEFT;
-    else
-      return FP_RIGHT;
-  }
-}
 
 /*
-** Calculate the center of the circle defined by three points.
-** Using matrix approach from http://mathforum.org/library/drmath/view/55239.html
+** postgresqlNoticeHandler()
+**
+** Propagate messages from the database to the Mapserver log,
+** set in PQsetNoticeProcessor during layer open.
 */
-int
-arcCircleCenter(const pointObj *p1, const pointObj *p2, const pointObj *p3, pointObj *center, double *radius)
+void postresqlNoticeHandler(void *arg, const char *message)
 {
-  pointObj c;
-  double r;
-
-  /* Components of the matrices. */
-  double x1sq = p1->x * p1->x;
-  double x2sq = p2->x * p2->x;
-  double x3sq = p3->x * p3->x;
-  double y1sq = p1->y * p1->y;
-  double y2sq = p2->y * p2->y;
-  double y3sq = p3->y * p3->y;
-  double matrix_num_x[9];
-  double matrix_num_y[9];
-  double matrix_denom[9];
-
-  /* Intialize matrix_num_x */
-  matrix_num_x[0] = x1sq+y1sq;
-  matrix_num_x[1] = p1->y;
-  matrix_num_x[2] = 1.0;
-  matrix_num_x[3] = x2sq+y2sq;
-  matrix_num_x[4] = p2->y;
-  matrix_num_x[5] = 1.0;
-  matrix_num_x[6] = x3sq+y3sq;
-  matrix_num_x[7] = p3->y;
-  matrix_num_x[8] = 1.0;
-
-  /* Intialize matrix_num_y */
-  matrix_num_y[0] = p1->x;
-  matrix_num_y[1] = x1sq+y1sq;
-  matrix_num_y[2] = 1.0;
-  matrix_num_y[3] = p2->x;
-  matrix_num_y[4] = x2sq+y2sq;
-  matrix_num_y[5] = 1.0;
-  matrix_num_y[6] = p3->x;
-  matrix_num_y[7] = x3sq+y3sq;
-  matrix_num_y[8] = 1.0;
-
-  /* Intialize matrix_denom */
-  matrix_denom[0] = p1->x;
-  matrix_denom[1] = p1->y;
-  matrix_denom[2] = 1.0;
-  matrix_denom[3] = p2->x;
-  matrix_denom[4] = p2->y;
-  matrix_denom[5] = 1.0;
-  matrix_denom[6] = p3->x;
-  matrix_denom[7] = p3->y;
-  matrix_denom[8] = 1.0;
-
-  /* Circle is closed, so p2 must be opposite p1 & p3. */
-  if ( FP_EQ(p1->x,p3->x) && FP_EQ(p1->y,p3->y) ) {
-    c.x = (p1->x + p2->x) / 2.0;
-    c.y = (p1->y + p2->y) / 2.0;
-    r = sqrt( (p1->x - p2->x) * (p1->x - p2->x) + (p1->y - p2->y) * (p1->y - p2->y) ) / 2.0;
-  }
-  /* There is no circle here, the points are actually co-linear */
-  else if ( arcSegmentSide(p1, p3, p2) == FP_COLINEAR ) {
-    return MS_FAILURE;
-  }
-  /* Calculate the center and radius. */
-  else {
-    double denom = 2.0 * arcDeterminant3x3(matrix_denom);
-    /* Center components */
-    c.x = arcDeterminant3x3(matrix_num_x) / denom;
-    c.y = arcDeterminant3x3(matrix_num_y) / denom;
+  layerObj *lp;
+  lp = (layerObj*)arg;
 
-    /* Radius */
-    r = sqrt((p1->x-c.x) * (p1->x-c.x) + (p1->y-c.y) * (p1->y-c.y));
+  if (lp->debug) {
+    msDebug("%s\n", message);
   }
-
-  if ( radius ) *radius = r;
-  if ( center ) *center = c;
-
-  return MS_SUCCESS;
 }
 
+
 /*
-** Write a stroked version of the circle defined by three points into a
-** point buffer. The segment_angle (degrees) is the coverage of each stroke segment,
-** and depending on whether this is the first arc in a circularstring,
-** you might want to include_first
+** TWKB reader. The coordinates are varints of the difference to the
+** previous point of the geometry, scaled by 10^precision. Unlike the WKB
+** readers above, all reads are checked against the end of the buffer.
 */
-int
-arcStrokeCircle(const pointObj *p1, const pointObj *p2, const pointObj *p3,
-                double segment_angle, int include_first, pointArrayObj *pa)
+#define TWKB_POINT 1
+#define TWKB_LINESTRING 2
+#define TWKB_POLYGON 3
+#define TWKB_MULTIPOINT 4
+#define TWKB_MULTILINESTRING 5
+#define TWKB_MULTIPOLYGON 6
+#define TWKB_COLLECTION 7
+
+typedef struct {
+  const unsigned char *ptr; /* Current read point */
+  const unsigned char *end;
+  int error; /* Set once a read went past the end */
+  int ndims; /* Of the geometry being read */
+  int hasz, hasm;
+  double scale[4]; /* Divisors of x, y, z, m */
+  long long last[4]; /* Previous point, as integers */
+} twkbObj;
+
+/* Read an unsigned varint and advance the read pointer. */
+static unsigned long long
+twkbReadUVarint(twkbObj *t)
 {
-  pointObj center; /* Center of our circular arc */
-  double radius; /* Radius of our circular arc */
-  double sweep_angle_r; /* Total angular size of our circular arc in radians */
-  double segment_angle_r; /* Segment angle in radians */
-  double a1, /*a2,*/ a3; /* Angles represented by p1, p2, p3 relative to center */
-  int side = arcSegmentSide(p1, p3, p2); /* What side of p1,p3 is the middle point? */
-  int num_edges; /* How many edges we will be generating */
-  double current_angle_r; /* What angle are we generating now (radians)? */
-  int i; /* Counter */
-  pointObj p; /* Temporary point */
-  int is_closed = MS_FALSE;
-
-  /* We need to know if we're dealing with a circle early */
-  if ( FP_EQ(p1->x, p3->x) && FP_EQ(p1->y, p3->y) )
-    is_closed = MS_TRUE;
-
-  /* Check if the "arc" is actually straight */
-  if ( ! is_closed && side == FP_COLINEAR ) {
-    /* We just need to write in the end points */
-    if ( include_first )
-      pointArrayAddPoint(pa, p1);
-    pointArrayAddPoint(pa, p3);
-    return MS_SUCCESS;
-  }
-
-  /* We should always be able to find the center of a non-linear arc */
-  if ( arcCircleCenter(p1, p2, p3, &center, &radius) == MS_FAILURE )
-    return MS_FAILURE;
-
-  /* Calculate the angles that our three points represent */
-  a1 = atan2(p1->y - center.y, p1->x - center.x);
-  /* UNUSED
-  a2 = atan2(p2->y - center.y, p2->x - center.x);
-   */
-  a3 = atan2(p3->y - center.y, p3->x - center.x);
-  segment_angle_r = M_PI * segment_angle / 180.0;
-
-  /* Closed-circle case, we sweep the whole circle! */
-  if ( is_closed ) {
-    sweep_angle_r = 2.0 * M_PI;
-  }
-  /* Clockwise sweep direction */
-  else if ( side == FP_LEFT ) {
-    if ( a3 > a1 ) /* Wrapping past 180? */
-      sweep_angle_r = a1 + (2.0 * M_PI - a3);
-    else
-      sweep_angle_r = a1 - a3;
-  }
-  /* Counter-clockwise sweep direction */
-  else if ( side == FP_RIGHT ) {
-    if ( a3 > a1 ) /* Wrapping past 180? */
-      sweep_angle_r = a3 - a1;
-    else
-      sweep_angle_r = a3 + (2.0 * M_PI - a1);
-  } else
-    sweep_angle_r = 0.0;
+  unsigned long long value = 0;
+  int shift = 0;
 
-  /* We don't have enough resolution, let's invert our strategy. */
-  if ( (sweep_angle_r / segment_angle_r) < SEGMENT_MINPOINTS ) {
-    segment_angle_r = sweep_angle_r / (SEGMENT_MINPOINTS + 1);
+  while ( t->ptr < t->end && shift < 64 ) {
+    unsigned char byte = *(t->ptr++);
+    value |= (unsigned long long)(byte & 0x7f) << shift;
+    if ( ! (byte & 0x80) ) return value;
+    shift += 7;
   }
+  t->error = MS_TRUE;
+  return 0;
+}
 
-  /* We don't have enough resolution to stroke this arc,
-  *  so just join the start to the end. */
-  if ( sweep_angle_r < segment_angle_r ) {
-    if ( include_first )
-      pointArrayAddPoint(pa, p1);
-    pointArrayAddPoint(pa, p3);
-    return MS_SUCCESS;
-  }
-
-  /* How many edges to generate (we add the final edge
-  *  by sticking on the last point */
-  num_edges = floor(sweep_angle_r / fabs(segment_angle_r));
-
-  /* Go backwards (negative angular steps) if we are stroking clockwise */
-  if ( side == FP_LEFT )
-    segment_angle_r *= -1;
+/* Read a zigzag encoded signed varint and advance the read pointer. */
+static long long
+twkbReadVarint(twkbObj *t)
+{
+  unsigned long long value = twkbReadUVarint(t);
+  return (long long)(value >> 1) ^ -(long long)(value & 1);
+}
 
-  /* What point should we start with? */
-  if( include_first ) {
-    current_angle_r = a1;
-  } else {
-    current_angle_r = a1 + segment_angle_r;
-    num_edges--;
-  }
+/* Read a count of points, rings or parts, each taking at least size bytes. */
+static int
+twkbReadCount(twkbObj *t, int size)
+{
+  unsigned long long n = twkbReadUVarint(t);
 
-  /* For each edge, increment or decrement by our segment angle */
-  for( i = 0; i < num_edges; i++ ) {
-    if (segment_angle_r > 0.0 && current_angle_r > M_PI)
-      current_angle_r -= 2*M_PI;
-    if (segment_angle_r < 0.0 && current_angle_r < -1*M_PI)
-      current_angle_r -= 2*M_PI;
-    p.x = center.x + radius*cos(current_angle_r);
-    p.y = center.y + radius*sin(current_angle_r);
-    pointArrayAddPoint(pa, &p);
-    current_angle_r += segment_angle_r;
+  if ( t->error || n > (unsigned long long)(t->end - t->ptr) / size ) {
+    t->error = MS_TRUE;
+    return 0;
   }
-
-  /* Add the last point */
-  pointArrayAddPoint(pa, p3);
-  return MS_SUCCESS;
+  return (int)n;
 }
 
-/*
-** This function does not actually take WKB as input, it takes the
-** WKB starting from the numpoints integer. Each three-point edge
-** is stroked into a linestring and appended into the lineObj
-** argument.
-*/
-int
-arcStrokeCircularString(wkbObj *w, double segment_angle, lineObj *line, int nZMFlag)
+/* Read npoints points into a new lineObj. */
+static int
+twkbReadPoints(twkbObj *t, lineObj *line, int npoints)
 {
-  pointObj p1, p2, p3;
-  int npoints, nedges;
-  int edge = 0;
-  pointArrayObj *pa;
-
-  if ( ! w || ! line ) return MS_FAILURE;
-
-  npoints = wkbReadInt(w);
-  nedges = npoints / 2;
+  int i, d;
 
-  /* All CircularStrings have an odd number of points */
-  if ( npoints < 3 || npoints % 2 != 1 )
-    return MS_FAILURE;
-
-  /* Make a large guess at how much space we'll need */
-  pa = pointArrayNew(nedges * 180 / segment_angle);
-
-  wkbReadPointP(w,&p3,nZMFlag);
+  line->numpoints = 0;
+  line->point = msSmallMalloc(MS_MAX(npoints, 1) * sizeof(pointObj));
+  for ( i = 0; i < npoints; i++ ) {
+    pointObj *p = &(line->point[i]);
 
-  /* Fill out the point array with stroked arcs */
-  while( edge < nedges ) {
-    p1 = p3;
-    wkbReadPointP(w,&p2,nZMFlag);
-    wkbReadPointP(w,&p3,nZMFlag);
-    if ( arcStrokeCircle(&p1, &p2, &p3, segment_angle, edge ? 0 : 1, pa) == MS_FAILURE ) {
-      pointArrayFree(pa);
+    for ( d = 0; d < t->ndims; d++ )
+      t->last[d] += twkbReadVarint(t);
+    if ( t->error ) {
+      free(line->point);
+      line->point = NULL;
       return MS_FAILURE;
     }
-    edge++;
+    p->x = t->last[0] / t->scale[0];
+    p->y = t->last[1] / t->scale[1];
+#ifdef USE_POINT_Z_M
+    p->z = t->hasz ? t->last[2] / t->scale[2] : 0.0;
+    p->m = t->hasm ? t->last[2 + t->hasz] / t->scale[2 + t->hasz] : 0.0;
+#endif
   }
+  line->numpoints = npoints;
+  return MS_SUCCESS;
+}
 
-  /* Copy the point array into the line */
-  line->numpoints = pa->npoints;
-  line->point = msSmallMalloc(line->numpoints * sizeof(pointObj));
-  memcpy(line->point, pa->data, line->numpoints * sizeof(pointObj));
-
-  /* Clean up */
-  pointArrayFree(pa);
+/* Read a point array (count, then points) and add it to the shape. */
+static int
+twkbReadLine(twkbObj *t, shapeObj *shape)
+{
+  lineObj line;
+  int npoints = twkbReadCount(t, t->ndims);
 
+  if ( t->error || twkbReadPoints(t, &line, npoints) != MS_SUCCESS )
+    return MS_FAILURE;
+  msAddLineDirectly(shape, &line);
   return MS_SUCCESS;
 }
 
+/* Read the rings of a polygon and add them to the shape. */
+static int
+twkbReadPolygon(twkbObj *t, shapeObj *shape)
+{
+  int i, nrings = twkbReadCount(t, 1);
+
+  for ( i = 0; i < nrings && ! t->error; i++ )
+    twkbReadLine(t, shape);
+  return t->error ? MS_FAILURE : MS_SUCCESS;
+}
 
 /*
-** For LAYER types that are not the usual ones (charts,
-** annotations, etc) we will convert to a shape type
-** that "makes sense" given the WKB input. We do this
-** by peaking at the type number of the first collection
-** sub-element.
+** Convert a TWKB geometry to a shapeObj, advancing the read pointer as we
+** go. Like wkbConvGeometryToShape(), polygons may go to line layers as
+** their rings, but not lines to polygon layers nor points to either.
 */
 static int
-msPostGISFindBestType(wkbObj *w, shapeObj *shape)
+twkbConvGeometryToShape(twkbObj *t, shapeObj *shape)
 {
-  int wkbtype;
-  int nZMFlag;
-
-  /* What kind of geometry is this? */
-  wkbtype = wkbType(w, &nZMFlag);
+  int type, precision, zprecision = 0, mprecision = 0, metadata;
+  int i, ngeoms, failures = 0;
+  unsigned char header;
+  const unsigned char *start = t->ptr;
 
-  /* Generic collection, we need to look a little deeper. */
-  if ( wkbtype == WKB_GEOMETRYCOLLECTION )
-    wkbtype = wkbCollectionSubType(w, &nZMFlag);
+  if ( t->end - t->ptr < 2 ) {
+    t->error = MS_TRUE;
+    return MS_FAILURE;
+  }
+  header = *(t->ptr++);
+  type = header & 0x0f;
+  precision = (header >> 5) ^ -((header >> 4) & 1); /* zigzag, 4 bits */
+  metadata = *(t->ptr++);
 
-  switch ( wkbtype ) {
-    case WKB_POLYGON:
-    case WKB_CURVEPOLYGON:
-    case WKB_MULTIPOLYGON:
-      shape->type = MS_SHAPE_POLYGON;
-      break;
-    case WKB_LINESTRING:
-    case WKB_CIRCULARSTRING:
-    case WKB_COMPOUNDCURVE:
-    case WKB_MULTICURVE:
-    case WKB_MULTILINESTRING:
-      shape->type = MS_SHAPE_LINE;
-      break;
-    case WKB_POINT:
-    case WKB_MULTIPOINT:
-      shape->type = MS_SHAPE_POINT;
-      break;
-    default:
+  t->hasz = t->hasm = 0;
+  if ( metadata & 0x08 ) { /* extended dimensions */
+    unsigned char ext;
+    if ( t->ptr >= t->end ) {
+      t->error = MS_TRUE;
       return MS_FAILURE;
+    }
+    ext = *(t->ptr++);
+    t->hasz = (ext & 0x01) != 0;
+    t->hasm = (ext & 0x02) != 0;
+    zprecision = (ext >> 2) & 0x07;
+    mprecision = (ext >> 5) & 0x07;
+  }
+  t->ndims = 2 + t->hasz + t->hasm;
+  t->scale[0] = t->scale[1] = pow(10.0, precision);
+  t->scale[2] = pow(10.0, t->hasz ? zprecision : mprecision);
+  t->scale[3] = pow(10.0, mprecision);
+  t->last[0] = t->last[1] = t->last[2] = t->last[3] = 0;
+
+  if ( metadata & 0x02 ) twkbReadUVarint(t); /* size */
+  if ( metadata & 0x01 ) { /* bounding box */
+    for ( i = 0; i < 2 * t->ndims; i++ ) twkbReadVarint(t);
+  }
+  if ( t->error || (metadata & 0x10) ) return MS_FAILURE; /* nothing more to read if empty */
+
+  /* What can't be drawn is still read, to get past it in a collection */
+  if ( (shape->type == MS_SHAPE_POLYGON && type != TWKB_POLYGON && type != TWKB_MULTIPOLYGON && type != TWKB_COLLECTION) ||
+       (shape->type == MS_SHAPE_LINE && (type == TWKB_POINT || type == TWKB_MULTIPOINT)) ) {
+    shapeObj skipped;
+    msInitShape(&skipped);
+    skipped.type = MS_SHAPE_POINT;
+    t->ptr = start; /* from the header again */
+    twkbConvGeometryToShape(t, &skipped);
+    msFreeShape(&skipped);
+    return MS_FAILURE;
+  }
+
+  switch ( type ) {
+    case TWKB_POINT: {
+      lineObj line;
+      if ( twkbReadPoints(t, &line, 1) != MS_SUCCESS ) return MS_FAILURE;
+      msAddLineDirectly(shape, &line);
+      return MS_SUCCESS;
+    }
+    case TWKB_LINESTRING:
+      return twkbReadLine(t, shape);
+    case TWKB_POLYGON:
+      return twkbReadPolygon(t, shape);
+    case TWKB_MULTIPOINT:
+    case TWKB_MULTILINESTRING:
+    case TWKB_MULTIPOLYGON:
+      ngeoms = twkbReadCount(t, 1);
+      if ( metadata & 0x04 ) { /* id list */
+        for ( i = 0; i < ngeoms; i++ ) twkbReadVarint(t);
+      }
+      for ( i = 0; i < ngeoms && ! t->error; i++ ) {
+        if ( type == TWKB_MULTIPOINT ) {
+          lineObj line;
+          if ( twkbReadPoints(t, &line, 1) == MS_SUCCESS ) msAddLineDirectly(shape, &line);
+        } else if ( type == TWKB_MULTILINESTRING ) {
+          twkbReadLine(t, shape);
+        } else {
+          twkbReadPolygon(t, shape);
+        }
+      }
+      return ( t->error || ngeoms == 0 ) ? MS_FAILURE : MS_SUCCESS;
+    case TWKB_COLLECTION:
+      /* Each part has its own header, draw what can be drawn */
+      ngeoms = twkbReadCount(t, 2);
+      if ( metadata & 0x04 ) {
+        for ( i = 0; i < ngeoms; i++ ) twkbReadVarint(t);
+      }
+      for ( i = 0; i < ngeoms && ! t->error; i++ ) {
+        if ( twkbConvGeometryToShape(t, shape) == MS_FAILURE )
+          failures++;
+      }
+      return ( t->error || failures == ngeoms ) ? MS_FAILURE : MS_SUCCESS;
   }
 
-  return wkbConvGeometryToShape(w, shape);
+  /* This is a TWKB type we don't know about! */
+  return MS_FAILURE;
 }
 
+
 /*
 ** Recent versions of PgSQL provide the version as an int in a
 ** simple call to the connection handle. For earlier ones we have
@@ -1654,6 +1435,35 @@ char *msPostGISBuildSQLBox(layerObj *layer, rectObj *rect, char *strSRID)
     msDebug("msPostGISBuildSQLBox called.\n");
   }
 
+  if ( layer->layerinfo && ((msPostGISLayerInfo*)layer->layerinfo)->collectboxparams ) {
+    /* The box as parameters of a prepared query, see the top of the file. */
+    msPostGISLayerInfo *layerinfo = (msPostGISLayerInfo*)layer->layerinfo;
+    int first = layerinfo->boxparambase + layerinfo->numboxparams + 1;
+    double coords[4];
+    int i;
+
+    coords[0] = rect->minx;
+    coords[1] = rect->miny;
+    coords[2] = rect->maxx;
+    coords[3] = rect->maxy;
+    layerinfo->boxparams = (char**)msSmallRealloc(layerinfo->boxparams, sizeof(char*) * (layerinfo->numboxparams + 4));
+    for (i = 0; i < 4; i++) {
+      char value[32];
+      snprintf(value, sizeof(value), "%.15g", coords[i]);
+      layerinfo->boxparams[layerinfo->numboxparams++] = msStrdup(value);
+    }
+
+    sz = 4 * 16 + (strSRID ? strlen(strSRID) : 0) + 64;
+    strBox = (char*)msSmallMalloc(sz);
+    if ( strSRID )
+      snprintf(strBox, sz, "ST_MakeEnvelope($%d::float8,$%d::float8,$%d::float8,$%d::float8,%s)",
+               first, first+1, first+2, first+3, strSRID);
+    else
+      snprintf(strBox, sz, "ST_MakeEnvelope($%d::float8,$%d::float8,$%d::float8,$%d::float8)",
+               first, first+1, first+2, first+3);
+    return strBox;
+  }
+
   if ( strSRID ) {
     static char *strBoxTemplate = "ST_GeomFromText('POLYGON((%.15g %.15g,%.15g %.15g,%.15g %.15g,%.15g %.15g,%.15g %.15g))',%s)";
     /* 10 doubles + 1 integer + template characters */
@@ -1690,6 +1500,62 @@ char *msPostGISBuildSQLBox(layerObj *layer, rectObj *rect, char *strSRID)
 }
 
 
+/*
+** msPostGISBuildSQLGeometry()
+**
+** The geometry column as selected by msPostGISBuildSQLItems(), through
+** force2d (a function name or "") and the simplification of the draw, see
+** the top of the file.
+**
+** Returns malloc'ed char* that must be freed by caller.
+*/
+static char *msPostGISBuildSQLGeometry(layerObj *layer, const char *force2d)
+{
+  msPostGISLayerInfo *layerinfo = (msPostGISLayerInfo *)layer->layerinfo;
+  char strTolerance[64];
+  char *strGeom;
+  size_t sz;
+
+  sz = strlen(force2d) + strlen(layerinfo->geomcolumn) + 5;
+  strGeom = (char*)msSmallMalloc(sz);
+  snprintf(strGeom, sz, "%s(\"%s\")", force2d, layerinfo->geomcolumn);
+
+  if ( layerinfo->simplifyquery <= 0 || layerinfo->simplify == MS_POSTGIS_SIMPLIFY_NONE )
+    return strGeom;
+
+  if ( layerinfo->collectboxparams ) {
+    /* A parameter like the boxes, the tolerance changes with every scale */
+    char value[32];
+    snprintf(value, sizeof(value), "%.15g", layerinfo->simplifyquery);
+    layerinfo->boxparams = (char**)msSmallRealloc(layerinfo->boxparams, sizeof(char*) * (layerinfo->numboxparams + 1));
+    layerinfo->boxparams[layerinfo->numboxparams++] = msStrdup(value);
+    snprintf(strTolerance, sizeof(strTolerance), "$%d::float8", layerinfo->boxparambase + layerinfo->numboxparams);
+  } else {
+    snprintf(strTolerance, sizeof(strTolerance), "%.15g", layerinfo->simplifyquery);
+  }
+
+  {
+    const char *strTemplate;
+    char *strSimplified;
+    switch ( layerinfo->simplify ) {
+      case MS_POSTGIS_SIMPLIFY_SIMPLIFY:
+        strTemplate = "ST_Simplify(%s,%s,true)"; /* keeping collapsed geometries as a point */
+        break;
+      case MS_POSTGIS_SIMPLIFY_REMOVEREPEATEDPOINTS:
+        strTemplate = "ST_RemoveRepeatedPoints(%s,%s)";
+        break;
+      default:
+        strTemplate = "ST_SnapToGrid(%s,%s)";
+        break;
+    }
+    sz = strlen(strTemplate) + strlen(strGeom) + strlen(strTolerance) + 1;
+    strSimplified = (char*)msSmallMalloc(sz);
+    snprintf(strSimplified, sz, strTemplate, strGeom, strTolerance);
+    free(strGeom);
+    return strSimplified;
+  }
+}
+
 /*
 ** msPostGISBuildSQLItems()
 **
@@ -1700,6 +1566,7 @@ char *msPostGISBuildSQLItems(layerObj *layer)
 
   char *strEndian = NULL;
   char *strGeom = NULL;
+  char *strGeomExpr = NULL;
   char *strItems = NULL;
   msPostGISLayerInfo *layerinfo = NULL;
 
@@ -1736,11 +1603,11 @@ char *msPostGISBuildSQLItems(layerObj *layer)
     */
     char *force2d = "";
 #if TRANSFER_ENCODING == 64
-    const char *strGeomTemplate = "encode(ST_AsBinary(%s(\"%s\"),'%s'),'base64') as geom,\"%s\"";
+    const char *strGeomTemplate = "encode(ST_AsBinary(%s,'%s'),'base64') as geom,\"%s\"";
 #elif TRANSFER_ENCODING == 256
-    const char *strGeomTemplate = "ST_AsBinary(%s(\"%s\"),'%s') as geom,\"%s\"::text";
+    const char *strGeomTemplate = "ST_AsBinary(%s,'%s') as geom,\"%s\"::text";
 #else
-    const char *strGeomTemplate = "encode(ST_AsBinary(%s(\"%s\"),'%s'),'hex') as geom,\"%s\"";
+    const char *strGeomTemplate = "encode(ST_AsBinary(%s,'%s'),'hex') as geom,\"%s\"";
 #endif
     if( layerinfo->force2d ) {
       if( layerinfo->version >= 20100 )
@@ -1752,15 +1619,34 @@ char *msPostGISBuildSQLItems(layerObj *layer)
     {
         /* Use AsEWKB() to get 3D */
 #if TRANSFER_ENCODING == 64
-        strGeomTemplate = "encode(AsEWKB(%s(\"%s\"),'%s'),'base64') as geom,\"%s\"";
+        strGeomTemplate = "encode(AsEWKB(%s,'%s'),'base64') as geom,\"%s\"";
+#elif TRANSFER_ENCODING == 256
+        strGeomTemplate = "AsEWKB(%s,'%s') as geom,\"%s\"::text";
+#else
+        strGeomTemplate = "encode(AsEWKB(%s,'%s'),'hex') as geom,\"%s\"";
+#endif
+    }
+    if( layerinfo->twkbquery ) {
+      /* Rounded to the request, see the top of the file. The precision goes where the endian was. */
+      char strPrecision[8];
+#if TRANSFER_ENCODING == 64
+      strGeomTemplate = "encode(ST_AsTWKB(%s,%s),'base64') as geom,\"%s\"";
 #elif TRANSFER_ENCODING == 256
-        strGeomTemplate = "AsEWKB(%s(\"%s\"),'%s') as geom,\"%s\"::text";
+      strGeomTemplate = "ST_AsTWKB(%s,%s) as geom,\"%s\"::text";
 #else
-        strGeomTemplate = "encode(AsEWKB(%s(\"%s\"),'%s'),'hex') as geom,\"%s\"";
+      strGeomTemplate = "encode(ST_AsTWKB(%s,%s),'hex') as geom,\"%s\"";
 #endif
+      snprintf(strPrecision, sizeof(strPrecision), "%d", layerinfo->twkbprecision);
+      strEndian = strPrecision;
+      strGeomExpr = msPostGISBuildSQLGeometry(layer, force2d);
+      strGeom = (char*)msSmallMalloc(strlen(strGeomTemplate) + strlen(strGeomExpr) + strlen(strEndian) + strlen(layerinfo->uid) + 1);
+      sprintf(strGeom, strGeomTemplate, strGeomExpr, strEndian, layerinfo->uid);
+    } else {
+      strGeomExpr = msPostGISBuildSQLGeometry(layer, force2d);
+      strGeom = (char*)msSmallMalloc(strlen(strGeomTemplate) + strlen(strGeomExpr) + strlen(strEndian) + strlen(layerinfo->uid) + 1);
+      sprintf(strGeom, strGeomTemplate, strGeomExpr, strEndian, layerinfo->uid);
     }
-    strGeom = (char*)msSmallMalloc(strlen(strGeomTemplate) + strlen(force2d) + strlen(strEndian) + strlen(layerinfo->geomcolumn) + strlen(layerinfo->uid) + 1);
-    sprintf(strGeom, strGeomTemplate, force2d, layerinfo->geomcolumn, strEndian, layerinfo->uid);
+    free(strGeomExpr);
   }
 
   if( layer->debug > 1 ) {
@@ -1988,20 +1874,23 @@ char *msPostGISBuildSQLFrom(layerObj *layer, rectObj *rect)
 char *msPostGISBuildSQLWhere(layerObj *layer, rectObj *rect, long *uid, rectObj *rectInOtherSRID, int otherSRID)
 {
   char *strRect = 0;
-  char *strFilter1=0, *strFilter2=0;
+  char *strFilter1=0, *strFilter2=0, *strFilter3=0;
   char *strUid = 0;
+  char *strKeyset = 0;
   char *strWhere = 0;
   char *strOrderBy = 0;
   char *strLimit = 0;
   char *strOffset = 0;
   size_t strRectLength = 0;
-  size_t strFilterLength1=0, strFilterLength2=0;
+  size_t strFilterLength1=0, strFilterLength2=0, strFilterLength3=0;
   size_t strUidLength = 0;
+  size_t strKeysetLength = 0;
   size_t strOrderByLength = 0;
   size_t strLimitLength = 0;
   size_t strOffsetLength = 0;
   size_t bufferSize = 0;
   int insert_and = 0;
+  int keyset = MS_FALSE;
   msPostGISLayerInfo *layerinfo;
 
   if (layer->debug) {
@@ -2017,6 +1906,25 @@ char *msPostGISBuildSQLWhere(layerObj *layer, rectObj *rect, long *uid, rectObj
     return NULL;
   }
 
+  /* Keyset paging: order by the unique key, start after KEYSET_AFTER. */
+  if ( layerinfo->paging && layerinfo->keyset && layer->sortBy.nProperties == 0 &&
+       !uid && layerinfo->uidparam == 0 ) {
+    const char *after = msLayerGetProcessingKey(layer, "KEYSET_AFTER");
+    keyset = MS_TRUE;
+    if ( after && *after ) {
+      static char *strKeysetTemplate = "\"%s\" > %ld";
+      char *end = NULL;
+      long key = strtol(after, &end, 10);
+      if ( *end != '\0' ) {
+        msSetError(MS_MISCERR, "Invalid KEYSET_AFTER value '%s'.", "msPostGISBuildSQLWhere()", after);
+        return NULL;
+      }
+      strKeyset = (char*)msSmallMalloc(strlen(strKeysetTemplate) + strlen(layerinfo->uid) + 64);
+      sprintf(strKeyset, strKeysetTemplate, layerinfo->uid, key);
+      strKeysetLength = strlen(strKeyset);
+    }
+  }
+
   /* Populate strLimit, if necessary. */
   if ( layerinfo->paging && layer->maxfeatures >= 0 ) {
     static char *strLimitTemplate = " limit %d";
@@ -2026,7 +1934,7 @@ char *msPostGISBuildSQLWhere(layerObj *layer, rectObj *rect, long *uid, rectObj
   }
 
   /* Populate strOffset, if necessary. */
-  if ( layerinfo->paging && layer->startindex > 0 ) {
+  if ( layerinfo->paging && layer->startindex > 0 && !strKeyset ) {
     static char *strOffsetTemplate = " offset %d";
     strOffset = msSmallMalloc(strlen(strOffsetTemplate) + 12);
     sprintf(strOffset, strOffsetTemplate, layer->startindex-1);
@@ -2158,12 +2066,25 @@ char *msPostGISBuildSQLWhere(layerObj *layer, rectObj *rect, long *uid, rectObj
     strFilterLength2 = strlen(strFilter2);
   }
 
+  /* Handle the class expressions of a draw (PUSHDOWN_CLASSES). */
+  if ( layerinfo->classfilter ) {
+    static char *strFilterTemplate = "(%s)";
+    strFilter3 = (char *) msSmallMalloc(strlen(strFilterTemplate) + strlen(layerinfo->classfilter)+1);
+    sprintf(strFilter3, strFilterTemplate, layerinfo->classfilter);
+    strFilterLength3 = strlen(strFilter3);
+  }
+
   /* Populate strUid, if necessary. */
   if ( uid ) {
     static char *strUidTemplate = "\"%s\" = %ld";
     strUid = (char*)msSmallMalloc(strlen(strUidTemplate) + strlen(layerinfo->uid) + 64);
     sprintf(strUid, strUidTemplate, layerinfo->uid, *uid);
     strUidLength = strlen(strUid);
+  } else if ( layerinfo->uidparam > 0 ) {
+    static char *strUidTemplate = "\"%s\" = ANY($%d)";
+    strUid = (char*)msSmallMalloc(strlen(strUidTemplate) + strlen(layerinfo->uid) + 16);
+    sprintf(strUid, strUidTemplate, layerinfo->uid, layerinfo->uidparam);
+    strUidLength = strlen(strUid);
   }
 
   /* Populate strOrderBy, if necessary */
@@ -2173,10 +2094,15 @@ char *msPostGISBuildSQLWhere(layerObj *layer, rectObj *rect, long *uid, rectObj
     strOrderBy = msStringConcatenate(strOrderBy, pszTmp);
     msFree(pszTmp);
     strOrderByLength = strlen(strOrderBy);
+  } else if( keyset ) {
+    strOrderBy = msStringConcatenate(strOrderBy, " ORDER BY \"");
+    strOrderBy = msStringConcatenate(strOrderBy, layerinfo->uid);
+    strOrderBy = msStringConcatenate(strOrderBy, "\"");
+    strOrderByLength = strlen(strOrderBy);
   }
 
-  bufferSize = strRectLength + 5 + (strFilterLength1 + 5) + (strFilterLength2 + 5) + strUidLength
-               + strLimitLength + strOffsetLength + strOrderByLength + 1;
+  bufferSize = strRectLength + 5 + (strFilterLength1 + 5) + (strFilterLength2 + 5) + (strFilterLength3 + 5) + strUidLength
+               + (strKeysetLength + 5) + strLimitLength + strOffsetLength + strOrderByLength + 1;
   strWhere = (char*)msSmallMalloc(bufferSize);
   *strWhere = '\0';
   if ( strRect ) {
@@ -2200,6 +2126,14 @@ char *msPostGISBuildSQLWhere(layerObj *layer, rectObj *rect, long *uid, rectObj
     free(strFilter2);
     insert_and++;
   }
+  if ( strFilter3 ) {
+    if ( insert_and ) {
+      strlcat(strWhere, " and ", bufferSize);
+    }
+    strlcat(strWhere, strFilter3, bufferSize);
+    free(strFilter3);
+    insert_and++;
+  }
   if ( strUid ) {
     if ( insert_and ) {
       strlcat(strWhere, " and ", bufferSize);
@@ -2208,6 +2142,14 @@ char *msPostGISBuildSQLWhere(layerObj *layer, rectObj *rect, long *uid, rectObj
     free(strUid);
     insert_and++;
   }
+  if ( strKeyset ) {
+    if ( insert_and ) {
+      strlcat(strWhere, " and ", bufferSize);
+    }
+    strlcat(strWhere, strKeyset, bufferSize);
+    free(strKeyset);
+    insert_and++;
+  }
 
   if ( strOrderBy ) {
     strlcat(strWhere, strOrderBy, bufferSize);
@@ -2304,6 +2246,7 @@ int msPostGISReadShape(layerObj *layer, shapeObj *shape)
   unsigned char wkbstatic[wkbstaticsize];
   unsigned char *wkb = NULL;
   wkbObj w;
+  twkbObj t;
   msPostGISLayerInfo *layerinfo = NULL;
   int result = 0;
   int wkbstrlen = 0;
@@ -2372,26 +2315,31 @@ int msPostGISReadShape(layerObj *layer, shapeObj *shape)
     }
   }
 
+  /* Or TWKB, see the top of the file. */
+  t.ptr = wkb;
+  t.end = wkb + w.size;
+  t.error = MS_FALSE;
+
   switch (layer->type) {
 
     case MS_LAYER_POINT:
       shape->type = MS_SHAPE_POINT;
-      result = wkbConvGeometryToShape(&w, shape);
+      result = layerinfo->twkbresult ? twkbConvGeometryToShape(&t, shape) : wkbConvGeometryToShape(&w, shape);
       break;
 
     case MS_LAYER_LINE:
       shape->type = MS_SHAPE_LINE;
-      result = wkbConvGeometryToShape(&w, shape);
+      result = layerinfo->twkbresult ? twkbConvGeometryToShape(&t, shape) : wkbConvGeometryToShape(&w, shape);
       break;
 
     case MS_LAYER_POLYGON:
       shape->type = MS_SHAPE_POLYGON;
-      result = wkbConvGeometryToShape(&w, shape);
+      result = layerinfo->twkbresult ? twkbConvGeometryToShape(&t, shape) : wkbConvGeometryToShape(&w, shape);
       break;
 
     case MS_LAYER_QUERY:
     case MS_LAYER_CHART:
-      result = msPostGISFindBestType(&w, shape);
+      result = wkbFindBestType(&w, shape);
       break;
 
     case MS_LAYER_RASTER:
@@ -2449,7 +2397,7 @@ int msPostGISReadShape(layerObj *layer, shapeObj *shape)
       msDebug("msPostGISReadShape: Setting shape->resultindex = %ld\n", layerinfo->rownum);
     }
     shape->index = uid;
-    shape->resultindex = layerinfo->rownum;
+    shape->resultindex = layerinfo->rowoffset + layerinfo->rownum;
 
     if( layer->debug > 2 ) {
       msDebug("msPostGISReadShape: [index] %ld\n",  shape->index);
@@ -2459,6 +2407,7 @@ int msPostGISReadShape(layerObj *layer, shapeObj *shape)
 
     msComputeBounds(shape);
   } else {
+     msFreeShape(shape); /* with what a failed read added */
      shape->type = MS_SHAPE_NULL;
   }
 
@@ -2576,7 +2525,7 @@ int msPostGISLayerOpen(layerObj *layer)
     PQsetNoticeProcessor(layerinfo->pgconn, postresqlNoticeHandler, (void *) layer);
 
     /* Save this connection in the pool for later. */
-    msConnPoolRegister(layer, layerinfo->pgconn, msPostGISCloseConnection);
+    msConnPoolRegisterEx(layer, layerinfo->pgconn, msPostGISCloseConnection, msPostGISConnectionAlive);
   } else {
     /* Connection in the pool should be tested to see if backend is alive. */
     if( PQstatus(layerinfo->pgconn) != CONNECTION_OK ) {
@@ -2606,6 +2555,54 @@ int msPostGISLayerOpen(layerObj *layer)
   if (layer->debug)
     msDebug("msPostGISLayerOpen: Got PostGIS version %d.\n", layerinfo->version);
 
+  if( msLayerGetProcessingKey( layer, "PREPARED_STATEMENTS" ) &&
+      strcasecmp(msLayerGetProcessingKey( layer, "PREPARED_STATEMENTS" ), "ON") == 0 )
+    layerinfo->prepare = MS_TRUE;
+
+  if( msLayerGetProcessingKey( layer, "CACHE_TTL" ) )
+    layerinfo->cachettl = MS_MAX(0, atoi(msLayerGetProcessingKey( layer, "CACHE_TTL" )));
+  if( msLayerGetProcessingKey( layer, "ESTIMATED_EXTENT" ) &&
+      strcasecmp(msLayerGetProcessingKey( layer, "ESTIMATED_EXTENT" ), "ON") == 0 )
+    layerinfo->estimatedextent = MS_TRUE;
+
+  if( msLayerGetProcessingKey( layer, "PUSHDOWN_CLASSES" ) &&
+      strcasecmp(msLayerGetProcessingKey( layer, "PUSHDOWN_CLASSES" ), "ON") == 0 )
+    layerinfo->pushclasses = MS_TRUE;
+
+  if( msLayerGetProcessingKey( layer, "KEYSET_PAGING" ) &&
+      strcasecmp(msLayerGetProcessingKey( layer, "KEYSET_PAGING" ), "ON") == 0 )
+    layerinfo->keyset = MS_TRUE;
+
+  if( msLayerGetProcessingKey( layer, "TWKB" ) &&
+      strcasecmp(msLayerGetProcessingKey( layer, "TWKB" ), "ON") == 0 ) {
+    if( layerinfo->version >= 20200 )
+      layerinfo->twkb = MS_TRUE;
+    else if (layer->debug)
+      msDebug("msPostGISLayerOpen: TWKB needs PostGIS 2.2, using WKB.\n");
+  }
+
+  if( msLayerGetProcessingKey( layer, "SIMPLIFY" ) ) {
+    const char *simplify = msLayerGetProcessingKey( layer, "SIMPLIFY" );
+    if( strcasecmp(simplify, "SNAPTOGRID") == 0 )
+      layerinfo->simplify = MS_POSTGIS_SIMPLIFY_SNAPTOGRID;
+    else if( strcasecmp(simplify, "SIMPLIFY") == 0 )
+      layerinfo->simplify = MS_POSTGIS_SIMPLIFY_SIMPLIFY;
+    else if( strcasecmp(simplify, "REMOVEREPEATEDPOINTS") == 0 )
+      layerinfo->simplify = MS_POSTGIS_SIMPLIFY_REMOVEREPEATEDPOINTS;
+    else if( strcasecmp(simplify, "OFF") != 0 && layer->debug )
+      msDebug("msPostGISLayerOpen: Unknown SIMPLIFY '%s', not simplifying.\n", simplify);
+    if( layerinfo->simplify > MS_POSTGIS_SIMPLIFY_SNAPTOGRID && layerinfo->version < 20200 ) {
+      if (layer->debug)
+        msDebug("msPostGISLayerOpen: SIMPLIFY=%s needs PostGIS 2.2, not simplifying.\n", simplify);
+      layerinfo->simplify = MS_POSTGIS_SIMPLIFY_NONE;
+    }
+  }
+  if( msLayerGetProcessingKey( layer, "SIMPLIFY_TOLERANCE" ) )
+    layerinfo->simplifytolerance = atof(msLayerGetProcessingKey( layer, "SIMPLIFY_TOLERANCE" ));
+
+  if( msLayerGetProcessingKey( layer, "FETCH_SIZE" ) )
+    layerinfo->fetchsize = MS_MAX(0, atoi(msLayerGetProcessingKey( layer, "FETCH_SIZE" )));
+
   force2d_processing = msLayerGetProcessingKey( layer, "FORCE2D" );
   if(force2d_processing && !strcasecmp(force2d_processing,"no")) {
     layerinfo->force2d = MS_FALSE;
@@ -2744,6 +2741,133 @@ int msPostGISLayerInitItemInfo(layerObj *layer)
 #endif
 }
 
+#ifdef USE_POSTGIS
+static int msPostGISTranslateExpression(layerObj *layer, expressionObj *filter, char *filteritem, char **native);
+
+/*
+** msPostGISBuildClassFilter()
+**
+** The OR of the expressions of the classes a draw may use, see
+** PUSHDOWN_CLASSES at the top of the file. NULL if some row could match a
+** class without it.
+**
+** Returns malloc'ed char* that must be freed by caller.
+*/
+static char *msPostGISBuildClassFilter(layerObj *layer)
+{
+  mapObj *map = layer->map;
+  char *strFilter = NULL;
+  int *classgroup;
+  int i, numclasses = 0;
+
+  if ( layer->numclasses <= 0 )
+    return NULL;
+
+  classgroup = msAllocateValidClassGroups(layer, &numclasses);
+  if ( !classgroup )
+    numclasses = layer->numclasses;
+
+  for ( i = 0; i < numclasses; i++ ) {
+    classObj *c = layer->class[classgroup ? classgroup[i] : i];
+    char *native = NULL;
+
+    /* as msShapeCheckClass() */
+    if ( c->status == MS_DELETE )
+      continue;
+    if ( map && map->scaledenom > 0 &&
+         ((c->maxscaledenom > 0 && map->scaledenom > c->maxscaledenom) ||
+          (c->minscaledenom > 0 && map->scaledenom <= c->minscaledenom)) )
+      continue;
+
+    if ( MS_STRING_IS_NULL_OR_EMPTY(c->expression.string) ||
+         msPostGISTranslateExpression(layer, &(c->expression), layer->classitem, &native) != MS_SUCCESS || !native ) {
+      if (layer->debug) {
+        msDebug("msPostGISBuildClassFilter: class %d matches rows without SQL, not filtering.\n", classgroup ? classgroup[i] : i);
+      }
+      msFree(native);
+      msFree(strFilter);
+      msFree(classgroup);
+      return NULL;
+    }
+
+    strFilter = msStringConcatenate(strFilter, strFilter ? " or (" : "(");
+    strFilter = msStringConcatenate(strFilter, native);
+    strFilter = msStringConcatenate(strFilter, ")");
+    msFree(native);
+  }
+
+  msFree(classgroup);
+  return strFilter;
+}
+#endif
+
+#ifdef USE_POSTGIS
+/*
+** msPostGISTakeResult()
+**
+** Makes pgresult, the result of the query in sql, the rows to read.
+*/
+static int msPostGISTakeResult(layerObj *layer, PGresult *pgresult)
+{
+  msPostGISLayerInfo *layerinfo = (msPostGISLayerInfo*)layer->layerinfo;
+
+  if ( layer->debug > 1 ) {
+    msDebug("msPostGISLayerWhichShapes query status: %s (%d)\n", PQresStatus(PQresultStatus(pgresult)), PQresultStatus(pgresult));
+  }
+
+  /* Something went wrong. */
+  if (!pgresult || PQresultStatus(pgresult) != PGRES_TUPLES_OK) {
+    msDebug("msPostGISLayerWhichShapes(): Error (%s) executing query: %s\n", PQerrorMessage(layerinfo->pgconn), layerinfo->sql);
+    msSetError(MS_QUERYERR, "Error executing query. Check server logs","msPostGISLayerWhichShapes()");
+    if (pgresult) {
+      PQclear(pgresult);
+    }
+    return MS_FAILURE;
+  }
+
+  if ( layer->debug ) {
+    msDebug("msPostGISLayerWhichShapes got %d records in result.\n", PQntuples(pgresult));
+  }
+
+  /* Clean any existing pgresult before storing current one. */
+  msPostGISSetResult(layerinfo, pgresult);
+  layerinfo->rownum = 0;
+
+  return msIO_checkRequestMemory("msPostGISLayerWhichShapes()");
+}
+
+/*
+** msPostGISRunPendingQuery()
+**
+** Runs the query msPostGISLayerWhichShapes() left pending and takes its result.
+*/
+static int msPostGISRunPendingQuery(layerObj *layer)
+{
+  msPostGISLayerInfo *layerinfo = (msPostGISLayerInfo*)layer->layerinfo;
+  PGresult *pgresult;
+  int span, status;
+
+  span = msTraceSpanBegin("msPostGISQuery", MS_TRACE_CLIENT);
+  msTraceSpanAttribute(span, "mapserver.layer", layer->name);
+  msTraceSpanAttribute(span, "db.system", "postgresql");
+  msTraceSpanAttribute(span, "db.statement", layerinfo->sql);
+  if(layerinfo->pendingstatement) {
+    pgresult = PQexecPrepared(layerinfo->pgconn, layerinfo->pendingstatement, layerinfo->numpendingvalues,
+                              (const char**)layerinfo->pendingvalues, NULL, NULL, RESULTSET_TYPE);
+    if (!pgresult || PQresultStatus(pgresult) != PGRES_TUPLES_OK)
+      msPostGISForgetStatements(layerinfo->pgconn); /* prepared again next time, in case the server dropped them */
+  } else {
+    pgresult = PQexecParams(layerinfo->pgconn, layerinfo->sql, layerinfo->numpendingvalues, NULL,
+                            (const char**)layerinfo->pendingvalues, NULL, NULL, RESULTSET_TYPE);
+  }
+  msPostGISFreePendingQuery(layerinfo);
+
+  status = msPostGISTakeResult(layer, pgresult);
+  msTraceSpanEnd(span, status);
+  return status;
+}
+#endif /* USE_POSTGIS */
+
 /*
 ** msPostGISLayerWhichShapes()
 **
@@ -2794,59 +2918,154 @@ int msPostGISLayerWhichShapes(layerObj *layer, rectObj rect, int isQuery)
   */
   layerinfo = (msPostGISLayerInfo*) layer->layerinfo;
 
+  /* Geometries of a draw as TWKB rounded to a tenth of a pixel (rect is in the layer SRS). */
+  layerinfo->twkbquery = MS_FALSE;
+  if ( layerinfo->twkb && !isQuery && layer->map && layer->map->width > 0 &&
+       (layer->type == MS_LAYER_POINT || layer->type == MS_LAYER_LINE || layer->type == MS_LAYER_POLYGON) ) {
+    double resolution = (rect.maxx - rect.minx) / layer->map->width * 0.1;
+    if ( resolution > 0 && resolution < 1e7 ) {
+      layerinfo->twkbprecision = MS_MAX(-7, MS_MIN(7, (int)ceil(-log10(resolution))));
+      layerinfo->twkbquery = MS_TRUE;
+    }
+  }
+
+  /* Line and polygon geometries of a draw simplified to the pixels of the request. */
+  layerinfo->simplifyquery = 0;
+  if ( layerinfo->simplify != MS_POSTGIS_SIMPLIFY_NONE && !isQuery && layer->map && layer->map->width > 0 &&
+       (layer->type == MS_LAYER_LINE || layer->type == MS_LAYER_POLYGON) ) {
+    layerinfo->simplifyquery = (rect.maxx - rect.minx) / layer->map->width * layerinfo->simplifytolerance;
+  }
+
+  /* Only the rows some class of the draw matches. */
+  if ( layerinfo->pushclasses && !isQuery )
+    layerinfo->classfilter = msPostGISBuildClassFilter(layer);
+
   /* Build a SQL query based on our current state. */
+  layerinfo->collectboxparams = layerinfo->prepare;
+  layerinfo->boxparambase = num_bind_values;
   strSQL = msPostGISBuildSQL(layer, &rect, NULL, NULL, -1);
+  layerinfo->collectboxparams = MS_FALSE;
+  layerinfo->twkbresult = layerinfo->twkbquery;
+  layerinfo->twkbquery = MS_FALSE;
+  layerinfo->simplifyquery = 0;
+  msFree(layerinfo->classfilter);
+  layerinfo->classfilter = NULL;
   if ( ! strSQL ) {
+    msPostGISFreeBoxParams(layerinfo);
     msSetError(MS_QUERYERR, "Failed to build query SQL.", "msPostGISLayerWhichShapes()");
     return MS_FAILURE;
   }
 
+  /* The box parameters come after the bind values. */
+  if ( layerinfo->numboxparams > 0 ) {
+    int i;
+    layer_bind_values = (char**)msSmallRealloc(layer_bind_values, sizeof(char*) * (num_bind_values + layerinfo->numboxparams));
+    for ( i = 0; i < layerinfo->numboxparams; i++ )
+      layer_bind_values[num_bind_values++] = layerinfo->boxparams[i];
+  }
+
   if (layer->debug) {
     msDebug("msPostGISLayerWhichShapes query: %s\n", strSQL);
   }
 
   // fprintf(stderr, "SQL: %s\n", strSQL);
 
-  if(num_bind_values > 0) {
-    pgresult = PQexecParams(layerinfo->pgconn, strSQL, num_bind_values, NULL, (const char**)layer_bind_values, NULL, NULL, RESULTSET_TYPE);
-  } else {
-    pgresult = PQexecParams(layerinfo->pgconn, strSQL,0, NULL, NULL, NULL, NULL, RESULTSET_TYPE);
-  }
+  /* Done with the rows of any earlier selection. */
+  msPostGISCloseCursor(layer);
+  msPostGISFreePendingQuery(layerinfo);
+  layerinfo->rowoffset = 0;
+  layerinfo->cursordone = MS_FALSE;
+
+  if(layerinfo->fetchsize > 0 && !isQuery && PQtransactionStatus(layerinfo->pgconn) == PQTRANS_IDLE) {
+    /* Stream the rows through a cursor, see the top of the file. */
+    char cursor[64];
+    char *strDeclare;
+
+    pgresult = PQexec(layerinfo->pgconn, "BEGIN");
+    if (pgresult && PQresultStatus(pgresult) == PGRES_COMMAND_OK) {
+      layerinfo->owntransaction = MS_TRUE;
+      snprintf(cursor, sizeof(cursor), "mscursor_%lx", (unsigned long)(size_t)layerinfo);
+      layerinfo->cursor = msStrdup(cursor);
+    }
+    if (pgresult) PQclear(pgresult);
+    pgresult = NULL;
+
+    if (layerinfo->cursor) {
+      strDeclare = (char*)msSmallMalloc(strlen(strSQL) + strlen(cursor) + 32);
+      sprintf(strDeclare, "DECLARE %s NO SCROLL CURSOR FOR %s", cursor, strSQL);
+      pgresult = PQexecParams(layerinfo->pgconn, strDeclare, num_bind_values, NULL, (const char**)layer_bind_values, NULL, NULL, RESULTSET_TYPE);
+      free(strDeclare);
+      if (pgresult && PQresultStatus(pgresult) == PGRES_COMMAND_OK) {
+        PQclear(pgresult);
+        pgresult = NULL;
+        msPostGISSetResult(layerinfo, NULL);
+        if (msPostGISFetchRows(layer) == MS_SUCCESS)
+          pgresult = layerinfo->pgresult;
+        else
+          msDebug("msPostGISLayerWhichShapes(): Error fetching from cursor for query: %s\n", strSQL);
+      } else {
+        msDebug("msPostGISLayerWhichShapes(): Error (%s) declaring cursor for query: %s\n", PQerrorMessage(layerinfo->pgconn), strSQL);
+        if (pgresult) PQclear(pgresult);
+        pgresult = NULL;
+      }
+    }
 
-  /* free bind values */
-  free(bind_key);
-  free(layer_bind_values);
+    free(bind_key);
+    free(layer_bind_values);
+    msPostGISFreeBoxParams(layerinfo);
 
-  if ( layer->debug > 1 ) {
-    msDebug("msPostGISLayerWhichShapes query status: %s (%d)\n", PQresStatus(PQresultStatus(pgresult)), PQresultStatus(pgresult));
-  }
+    if (!pgresult) {
+      msPostGISCloseCursor(layer);
+      msSetError(MS_QUERYERR, "Error executing query. Check server logs","msPostGISLayerWhichShapes()");
+      free(strSQL);
+      return MS_FAILURE;
+    }
 
-  /* Something went wrong. */
-  if (!pgresult || PQresultStatus(pgresult) != PGRES_TUPLES_OK) {
-    msDebug("msPostGISLayerWhichShapes(): Error (%s) executing query: %s\n", PQerrorMessage(layerinfo->pgconn), strSQL);
-    msSetError(MS_QUERYERR, "Error executing query. Check server logs","msPostGISLayerWhichShapes()");
-    free(strSQL);
-    if (pgresult) {
-      PQclear(pgresult);
+    if ( layer->debug ) {
+      msDebug("msPostGISLayerWhichShapes fetching %d records at a time from %s.\n", layerinfo->fetchsize, layerinfo->cursor);
     }
-    return MS_FAILURE;
+
+    if(layerinfo->sql) free(layerinfo->sql);
+    layerinfo->sql = strSQL;
+
+    return MS_SUCCESS;
   }
 
-  if ( layer->debug ) {
-    msDebug("msPostGISLayerWhichShapes got %d records in result.\n", PQntuples(pgresult));
+  /* The query is kept as pending, and run right away unless the layer is in a pipeline. */
+  if(layerinfo->prepare) {
+    char name[32];
+
+    if(msPostGISPrepareStatement(layer, layerinfo->pgconn, strSQL, num_bind_values, name, sizeof(name)) == MS_SUCCESS)
+      layerinfo->pendingstatement = msStrdup(name);
+  }
+  if(num_bind_values > 0) {
+    int i;
+    layerinfo->pendingvalues = (char**)msSmallMalloc(sizeof(char*) * num_bind_values);
+    for(i = 0; i < num_bind_values; i++)
+      layerinfo->pendingvalues[i] = msStrdup(layer_bind_values[i]);
+    layerinfo->numpendingvalues = num_bind_values;
   }
+  layerinfo->pending = MS_TRUE;
 
-  /* Clean any existing pgresult before storing current one. */
-  if(layerinfo->pgresult) PQclear(layerinfo->pgresult);
-  layerinfo->pgresult = pgresult;
+  /* free bind values */
+  free(bind_key);
+  free(layer_bind_values);
+  msPostGISFreeBoxParams(layerinfo);
 
-  /* Clean any existing SQL before storing current. */
+  /* Clean any existing SQL and result before storing current. */
   if(layerinfo->sql) free(layerinfo->sql);
   layerinfo->sql = strSQL;
-
+  msPostGISSetResult(layerinfo, NULL);
   layerinfo->rownum = 0;
 
-  return MS_SUCCESS;
+  if(layerinfo->pipeline && !isQuery) {
+    if ( layer->debug ) {
+      msDebug("msPostGISLayerWhichShapes query waits for the pipeline.\n");
+    }
+    return MS_SUCCESS;
+  }
+
+  return msPostGISRunPendingQuery(layer);
 #else
   msSetError( MS_MISCERR,
               "PostGIS support is not available.",
@@ -2874,12 +3093,25 @@ int msPostGISLayerNextShape(layerObj *layer, shapeObj *shape)
 
   layerinfo = (msPostGISLayerInfo*) layer->layerinfo;
 
+  /* A query of a pipeline msPostGISPipelineFlush() did not run. */
+  if (layerinfo->pending && msPostGISRunPendingQuery(layer) != MS_SUCCESS)
+    return MS_FAILURE;
+
   shape->type = MS_SHAPE_NULL;
 
   /*
   ** Roll through pgresult until we hit non-null shape (usually right away).
   */
   while (shape->type == MS_SHAPE_NULL) {
+    if (layerinfo->rownum >= PQntuples(layerinfo->pgresult) && layerinfo->cursor) {
+      /* End of the batch, on to the next one. */
+      if (layerinfo->cursordone) {
+        msPostGISCloseCursor(layer);
+        return MS_DONE;
+      }
+      if (msPostGISFetchRows(layer) != MS_SUCCESS)
+        return MS_FAILURE;
+    }
     if (layerinfo->rownum < PQntuples(layerinfo->pgresult)) {
       /* Retrieve this shape, cursor access mode. */
       msPostGISReadShape(layer, shape);
@@ -2906,16 +3138,57 @@ int msPostGISLayerNextShape(layerObj *layer, shapeObj *shape)
 #endif
 }
 
+#ifdef USE_POSTGIS
 /*
-** msPostGISLayerGetShape()
+** msPostGISEstimatedCount()
 **
- */
-int msPostGISLayerGetShapeCount(layerObj *layer, rectObj rect, projectionObj *rectProjection)
+** Rows the planner expects sql to return, see ESTIMATED_COUNT at the top
+** of the file. Returns -1 if there is no estimate.
+*/
+static int msPostGISEstimatedCount(layerObj *layer, const char *sql, char **values, int numvalues)
+{
+  msPostGISLayerInfo *layerinfo = (msPostGISLayerInfo *)layer->layerinfo;
+  char *strSQL;
+  const char *rows;
+  PGresult *pgresult;
+  int nCount = -1;
+
+  /* An error would abort a transaction in progress */
+  if ( PQtransactionStatus(layerinfo->pgconn) != PQTRANS_IDLE )
+    return -1;
+
+  strSQL = msStringConcatenate(msStrdup("EXPLAIN "), sql);
+  if (layer->debug) {
+    msDebug("msPostGISLayerGetShapeCount query: %s\n", strSQL);
+  }
+  pgresult = PQexecParams(layerinfo->pgconn, strSQL, numvalues, NULL, (const char**)values, NULL, NULL, 0);
+  /* the first line of the plan is its top node, "... (cost=a..b rows=n width=w)" */
+  if ( pgresult && PQresultStatus(pgresult) == PGRES_TUPLES_OK && PQntuples(pgresult) > 0 &&
+       (rows = strstr(PQgetvalue(pgresult, 0, 0), " rows=")) != NULL ) {
+    nCount = atoi(rows + 6);
+  } else if (layer->debug) {
+    msDebug("msPostGISLayerGetShapeCount: no estimate (%s), counting.\n", PQerrorMessage(layerinfo->pgconn));
+  }
+  if (pgresult)
+    PQclear(pgresult);
+  free(strSQL);
+  return nCount;
+}
+#endif
+
+/*
+** msPostGISLayerCount()
+**
+** Runs count(*) on the rows of rect, or with estimate takes the row estimate
+** of the planner (falling back to count(*) if there is none).
+*/
+static int msPostGISLayerCount(layerObj *layer, rectObj rect, projectionObj *rectProjection, int estimate)
 {
 #ifdef USE_POSTGIS
   msPostGISLayerInfo *layerinfo = NULL;
   char *strSQL = NULL;
   char *strSQLCount = NULL;
+  char *strCacheKey = NULL;
   PGresult *pgresult = NULL;
   char** layer_bind_values = NULL;
   char* bind_value;
@@ -2998,6 +3271,37 @@ int msPostGISLayerGetShapeCount(layerObj *layer, rectObj rect, projectionObj *re
   strSQLCount = msStringConcatenate(strSQLCount, strSQL);
   strSQLCount = msStringConcatenate(strSQLCount, ") msQuery");
 
+  if ( layerinfo->cachettl > 0 ) {
+    /* estimates and exact counts are cached apart */
+    char *strSQLKey = msStringConcatenate(msStrdup(estimate ? "EXPLAIN " : ""), strSQLCount);
+    strCacheKey = msPostGISCacheKey(layer, strSQLKey, layer_bind_values, num_bind_values);
+    msFree(strSQLKey);
+    if ( msPostGISCacheGet(strCacheKey, NULL, &nCount) == MS_SUCCESS ) {
+      if ( layer->debug ) {
+        msDebug("msPostGISLayerGetShapeCount: cached count %d.\n", nCount);
+      }
+      msFree(strSQL);
+      msFree(strSQLCount);
+      msFree(strCacheKey);
+      free(bind_key);
+      free(layer_bind_values);
+      return nCount;
+    }
+  }
+
+  if ( estimate ) {
+    nCount = msPostGISEstimatedCount(layer, strSQL, layer_bind_values, num_bind_values);
+    if ( nCount >= 0 ) {
+      if ( strCacheKey ) msPostGISCachePut(layer, strCacheKey, NULL, nCount);
+      msFree(strSQL);
+      msFree(strSQLCount);
+      msFree(strCacheKey);
+      free(bind_key);
+      free(layer_bind_values);
+      return nCount;
+    }
+  }
+
   msFree(strSQL);
 
   if (layer->debug) {
@@ -3025,6 +3329,7 @@ int msPostGISLayerGetShapeCount(layerObj *layer, rectObj rect, projectionObj *re
             "Falling back to client-side evaluation\n",
             PQerrorMessage(layerinfo->pgconn), strSQLCount);
     msFree(strSQLCount);
+    msFree(strCacheKey);
     if (pgresult) {
       PQclear(pgresult);
     }
@@ -3033,6 +3338,10 @@ int msPostGISLayerGetShapeCount(layerObj *layer, rectObj rect, projectionObj *re
 
   msFree(strSQLCount);
   nCount = atoi(PQgetvalue(pgresult, 0, 0 ));
+  if ( strCacheKey ) {
+    msPostGISCachePut(layer, strCacheKey, NULL, nCount);
+    msFree(strCacheKey);
+  }
 
   if ( layer->debug ) {
     msDebug("msPostGISLayerWhichShapes return: %d.\n", nCount);
@@ -3048,6 +3357,25 @@ int msPostGISLayerGetShapeCount(layerObj *layer, rectObj rect, projectionObj *re
 #endif
 }
 
+/*
+** msPostGISLayerGetShapeCount()
+**
+*/
+int msPostGISLayerGetShapeCount(layerObj *layer, rectObj rect, projectionObj *rectProjection)
+{
+  return msPostGISLayerCount(layer, rect, rectProjection, MS_FALSE);
+}
+
+/*
+** msPostGISLayerEstimateShapeCount()
+**
+** Row estimate of the planner, see ESTIMATED_COUNT at the top of the file.
+*/
+int msPostGISLayerEstimateShapeCount(layerObj *layer, rectObj rect, projectionObj *rectProjection)
+{
+  return msPostGISLayerCount(layer, rect, rectProjection, MS_TRUE);
+}
+
 
 /*
 ** msPostGISLayerGetShape()
@@ -3080,6 +3408,12 @@ int msPostGISLayerGetShape(layerObj *layer, shapeObj *shape, resultObj *record)
 
     /* Check the validity of the open result. */
     pgresult = layerinfo->pgresult;
+    if ( layerinfo->cursor || layerinfo->rowoffset > 0 ) {
+      msSetError( MS_MISCERR,
+                  "PostgreSQL result set is streamed from a cursor, only queries can get shapes by result index.",
+                  "msPostGISLayerGetShape()");
+      return MS_FAILURE;
+    }
     if ( ! pgresult ) {
       msSetError( MS_MISCERR,
                   "PostgreSQL result set is null.",
@@ -3157,8 +3491,10 @@ int msPostGISLayerGetShape(layerObj *layer, shapeObj *shape, resultObj *record)
     }
 
     /* Clean any existing pgresult before storing current one. */
-    if(layerinfo->pgresult) PQclear(layerinfo->pgresult);
-    layerinfo->pgresult = pgresult;
+    msPostGISCloseCursor(layer);
+    msPostGISSetResult(layerinfo, pgresult);
+    layerinfo->rowoffset = 0;
+    layerinfo->twkbresult = MS_FALSE;
 
     /* Clean any existing SQL before storing current. */
     if(layerinfo->sql) free(layerinfo->sql);
@@ -3189,6 +3525,185 @@ int msPostGISLayerGetShape(layerObj *layer, shapeObj *shape, resultObj *record)
 #endif
 }
 
+#ifdef USE_POSTGIS
+typedef struct {
+  long uid;
+  int record;
+} msPostGISUidRecord;
+
+static int msPostGISCompareUidRecords(const void *a, const void *b)
+{
+  long ua = ((const msPostGISUidRecord*)a)->uid, ub = ((const msPostGISUidRecord*)b)->uid;
+  return (ua > ub) - (ua < ub);
+}
+#endif
+
+/*
+** msPostGISLayerGetShapes()
+**
+** Registered vtable->LayerGetShapes function. Records with a resultindex are
+** read from the open result set as by msPostGISLayerGetShape(), the others
+** are fetched together with a single "uid = ANY($n)" query, read without
+** disturbing the open result set.
+*/
+int msPostGISLayerGetShapes(layerObj *layer, shapeObj *shapes, resultObj *records, int numrecords)
+{
+#ifdef USE_POSTGIS
+  msPostGISLayerInfo *layerinfo = NULL;
+  msPostGISUidRecord *uids = NULL;
+  PGresult *pgresult = NULL;
+  PGresult *openresult;
+  long openrownum, openrowoffset;
+  int opentwkbresult, paging;
+  char **layer_bind_values = NULL;
+  char *bind_value;
+  char bind_key[16];
+  int num_bind_values = 0;
+  char *strSQL = NULL;
+  char *strUids = NULL;
+  size_t pos = 0;
+  int i, numuids = 0, num_tuples;
+
+  assert(layer != NULL);
+  assert(layer->layerinfo != NULL);
+
+  if (layer->debug) {
+    msDebug("msPostGISLayerGetShapes called for %d records\n", numrecords);
+  }
+
+  uids = (msPostGISUidRecord*)msSmallMalloc(sizeof(msPostGISUidRecord) * MS_MAX(1, numrecords));
+  for ( i = 0; i < numrecords; i++ ) {
+    if ( records[i].resultindex >= 0 ) {
+      if ( msPostGISLayerGetShape(layer, &shapes[i], &records[i]) != MS_SUCCESS ) {
+        msFreeShape(&shapes[i]);
+        shapes[i].type = MS_SHAPE_NULL;
+      }
+    } else {
+      uids[numuids].uid = records[i].shapeindex;
+      uids[numuids].record = i;
+      numuids++;
+    }
+  }
+  if ( numuids == 0 ) {
+    free(uids);
+    return MS_SUCCESS;
+  }
+  qsort(uids, numuids, sizeof(msPostGISUidRecord), msPostGISCompareUidRecords);
+
+  /* Fill out layerinfo with our current DATA state. */
+  if ( msPostGISParseData(layer) != MS_SUCCESS) {
+    free(uids);
+    return MS_FAILURE;
+  }
+  layerinfo = (msPostGISLayerInfo*) layer->layerinfo;
+
+  /* The uids as a text array, after the layer bind values. */
+  strUids = (char*)msSmallMalloc(numuids * 21 + 3);
+  strUids[pos++] = '{';
+  for ( i = 0; i < numuids; i++ )
+    pos += sprintf(strUids + pos, i ? ",%ld" : "%ld", uids[i].uid);
+  strUids[pos++] = '}';
+  strUids[pos] = '\0';
+
+  layer_bind_values = (char**)msSmallMalloc(sizeof(char*) * 1000);
+  bind_value = msLookupHashTable(&layer->bindvals, "1");
+  while(bind_value != NULL && num_bind_values < 999) {
+    layer_bind_values[num_bind_values++] = bind_value;
+    sprintf(bind_key, "%d", num_bind_values+1);
+    bind_value = msLookupHashTable(&layer->bindvals, bind_key);
+  }
+  layer_bind_values[num_bind_values] = strUids;
+
+  /* Build the SQL, without the limit and offset of a page of results. */
+  paging = layerinfo->paging;
+  layerinfo->paging = MS_FALSE;
+  layerinfo->uidparam = num_bind_values + 1;
+  strSQL = msPostGISBuildSQL(layer, NULL, NULL, NULL, -1);
+  layerinfo->uidparam = 0;
+  layerinfo->paging = paging;
+  if ( ! strSQL ) {
+    free(uids);
+    free(strUids);
+    free(layer_bind_values);
+    msSetError(MS_QUERYERR, "Failed to build query SQL.", "msPostGISLayerGetShapes()");
+    return MS_FAILURE;
+  }
+
+  if (layer->debug) {
+    msDebug("msPostGISLayerGetShapes query: %s\n", strSQL);
+  }
+
+  pgresult = PQexecParams(layerinfo->pgconn, strSQL, num_bind_values + 1, NULL, (const char**)layer_bind_values, NULL, NULL, RESULTSET_TYPE);
+  free(strUids);
+  free(layer_bind_values);
+
+  /* Something went wrong. */
+  if ( (!pgresult) || (PQresultStatus(pgresult) != PGRES_TUPLES_OK) ) {
+    msDebug("msPostGISLayerGetShapes(): Error (%s) executing SQL: %s\n", PQerrorMessage(layerinfo->pgconn), strSQL );
+    msSetError(MS_QUERYERR, "Error executing SQL. Check server logs.","msPostGISLayerGetShapes()");
+    if (pgresult) {
+      PQclear(pgresult);
+    }
+    free(strSQL);
+    free(uids);
+    return MS_FAILURE;
+  }
+  free(strSQL);
+
+  /* Read the rows through layerinfo, keeping the open result set aside. */
+  openresult = layerinfo->pgresult;
+  openrownum = layerinfo->rownum;
+  openrowoffset = layerinfo->rowoffset;
+  opentwkbresult = layerinfo->twkbresult;
+  layerinfo->pgresult = pgresult;
+  layerinfo->rowoffset = 0;
+  layerinfo->twkbresult = MS_FALSE;
+
+  num_tuples = PQntuples(pgresult);
+  if (layer->debug) {
+    msDebug("msPostGISLayerGetShapes number of records: %d\n", num_tuples);
+  }
+  for ( layerinfo->rownum = 0; layerinfo->rownum < num_tuples; layerinfo->rownum++ ) {
+    msPostGISUidRecord key, *found;
+    shapeObj shape;
+
+    msInitShape(&shape);
+    msPostGISReadShape(layer, &shape);
+    if ( shape.type == MS_SHAPE_NULL )
+      continue;
+
+    key.uid = shape.index;
+    found = (msPostGISUidRecord*)bsearch(&key, uids, numuids, sizeof(msPostGISUidRecord), msPostGISCompareUidRecords);
+    if ( found ) {
+      while ( found > uids && (found - 1)->uid == key.uid ) found--;
+      shape.resultindex = -1;
+      for ( ; found < uids + numuids && found->uid == key.uid; found++ ) {
+        /* each record gets the first row with its uid, like msPostGISLayerGetShape() */
+        if ( shapes[found->record].type == MS_SHAPE_NULL ) {
+          msFreeShape(&shapes[found->record]);
+          msCopyShape(&shape, &shapes[found->record]);
+        }
+      }
+    }
+    msFreeShape(&shape);
+  }
+
+  layerinfo->pgresult = openresult;
+  layerinfo->rownum = openrownum;
+  layerinfo->rowoffset = openrowoffset;
+  layerinfo->twkbresult = opentwkbresult;
+  PQclear(pgresult);
+  free(uids);
+
+  return MS_SUCCESS;
+#else
+  msSetError( MS_MISCERR,
+              "PostGIS support is not available.",
+              "msPostGISLayerGetShapes()");
+  return MS_FAILURE;
+#endif
+}
+
 /**********************************************************************
  *                     msPostGISPassThroughFieldDefinitions()
  *
@@ -3426,6 +3941,67 @@ int msPostGISLayerGetItems(layerObj *layer)
 #endif
 }
 
+#ifdef USE_POSTGIS
+/*
+** msPostGISEstimatedExtent()
+**
+** Extent of table from its statistics, see ESTIMATED_EXTENT at the top
+** of the file. Returns MS_FAILURE (without error) if there is none, or if
+** the source is not a plain table.
+*/
+static int msPostGISEstimatedExtent(layerObj *layer, const char *table, rectObj *extent)
+{
+  msPostGISLayerInfo *layerinfo = (msPostGISLayerInfo *)layer->layerinfo;
+  const char *values[3];
+  char *name, *dot, *src, *dst;
+  char strSQL[64];
+  PGresult *pgresult;
+  int nvalues, status = MS_FAILURE;
+
+  /* An error would abort a transaction in progress */
+  if ( strpbrk(table, "() \t\n") || PQtransactionStatus(layerinfo->pgconn) != PQTRANS_IDLE )
+    return MS_FAILURE;
+
+  name = msStrdup(table);
+  for ( src = dst = name; *src; src++ ) { /* unquoted */
+    if ( *src != '"' ) *dst++ = *src;
+  }
+  *dst = '\0';
+  dot = strchr(name, '.');
+  if ( dot ) {
+    *dot = '\0';
+    values[0] = name;
+    values[1] = dot + 1;
+    values[2] = layerinfo->geomcolumn;
+    nvalues = 3;
+  } else {
+    values[0] = name;
+    values[1] = layerinfo->geomcolumn;
+    nvalues = 2;
+  }
+  snprintf(strSQL, sizeof(strSQL), "SELECT %s(%s)::text",
+           layerinfo->version >= 20100 ? "ST_EstimatedExtent" : "ST_Estimated_Extent",
+           nvalues == 3 ? "$1,$2,$3" : "$1,$2");
+
+  if (layer->debug) {
+    msDebug("msPostGISLayerGetExtent executing SQL: %s\n", strSQL);
+  }
+  pgresult = PQexecParams(layerinfo->pgconn, strSQL, nvalues, NULL, values, NULL, NULL, 0);
+  if ( pgresult && PQresultStatus(pgresult) == PGRES_TUPLES_OK && PQntuples(pgresult) > 0 &&
+       !PQgetisnull(pgresult, 0, 0) &&
+       sscanf(PQgetvalue(pgresult, 0, 0), "BOX(%lf %lf,%lf %lf)",
+              &extent->minx, &extent->miny, &extent->maxx, &extent->maxy) == 4 ) {
+    status = MS_SUCCESS;
+  } else if (layer->debug) {
+    msDebug("msPostGISLayerGetExtent: no estimated extent (%s), using ST_Extent().\n", PQerrorMessage(layerinfo->pgconn));
+  }
+  if (pgresult)
+    PQclear(pgresult);
+  free(name);
+  return status;
+}
+#endif
+
 /*
 ** msPostGISLayerGetExtent()
 **
@@ -3437,6 +4013,7 @@ int msPostGISLayerGetExtent(layerObj *layer, rectObj *extent)
 #ifdef USE_POSTGIS
   msPostGISLayerInfo *layerinfo = NULL;
   char *strSQL = NULL;
+  char *strCacheKey = NULL;
   char *f_table_name;
   static char *sqlExtentTemplate = "SELECT ST_Extent(%s) FROM %s";
   size_t buffer_len;
@@ -3468,6 +4045,27 @@ int msPostGISLayerGetExtent(layerObj *layer, rectObj *extent)
   buffer_len = strlen(layerinfo->geomcolumn) + strlen(f_table_name) + strlen(sqlExtentTemplate);
   strSQL = (char*)msSmallMalloc(buffer_len+1); /* add space for terminating NULL */
   snprintf(strSQL, buffer_len, sqlExtentTemplate, layerinfo->geomcolumn, f_table_name);  
+
+  if ( layerinfo->cachettl > 0 ) {
+    strCacheKey = msPostGISCacheKey(layer, strSQL, NULL, 0);
+    if ( msPostGISCacheGet(strCacheKey, extent, NULL) == MS_SUCCESS ) {
+      if (layer->debug) {
+        msDebug("msPostGISLayerGetExtent: cached extent.\n");
+      }
+      msFree(f_table_name);
+      msFree(strSQL);
+      msFree(strCacheKey);
+      return MS_SUCCESS;
+    }
+  }
+
+  if ( layerinfo->estimatedextent && msPostGISEstimatedExtent(layer, f_table_name, extent) == MS_SUCCESS ) {
+    if ( strCacheKey ) msPostGISCachePut(layer, strCacheKey, extent, 0);
+    msFree(f_table_name);
+    msFree(strSQL);
+    msFree(strCacheKey);
+    return MS_SUCCESS;
+  }
   msFree(f_table_name);
 
   if (layer->debug) {
@@ -3484,6 +4082,7 @@ int msPostGISLayerGetExtent(layerObj *layer, rectObj *extent)
     msSetError(MS_MISCERR, "Error executing SQL. Check server logs.","msPostGISLayerGetExtent()");
     if (pgresult)
       PQclear(pgresult);
+    msFree(strCacheKey);
 
     return MS_FAILURE;
   }
@@ -3493,6 +4092,7 @@ int msPostGISLayerGetExtent(layerObj *layer, rectObj *extent)
     msSetError(MS_MISCERR, "msPostGISLayerGetExtent: No results found.", 
         "msPostGISLayerGetExtent()");
     PQclear(pgresult);
+    msFree(strCacheKey);
     return MS_FAILURE;
   }
   
@@ -3500,6 +4100,7 @@ int msPostGISLayerGetExtent(layerObj *layer, rectObj *extent)
     msSetError(MS_MISCERR, "msPostGISLayerGetExtent: Null result returned.", 
         "msPostGISLayerGetExtent()");
     PQclear(pgresult);
+    msFree(strCacheKey);
     return MS_FAILURE;
   }
 
@@ -3507,11 +4108,16 @@ int msPostGISLayerGetExtent(layerObj *layer, rectObj *extent)
          &extent->minx, &extent->miny, &extent->maxx, &extent->maxy) != 4) {
     msSetError(MS_MISCERR, "Failed to process result data.", "msPostGISLayerGetExtent()");
     PQclear(pgresult);
+    msFree(strCacheKey);
     return MS_FAILURE;
   }
 
   /* cleanup */
   PQclear(pgresult);
+  if ( strCacheKey ) {
+    msPostGISCachePut(layer, strCacheKey, extent, 0);
+    msFree(strCacheKey);
+  }
 
   return MS_SUCCESS;
 #else
@@ -3812,6 +4418,115 @@ int msPostGISGetPaging(layerObj *layer)
 #endif
 }
 
+/*
+** msPostGISLayerEnablePipeline()
+**
+** With value MS_TRUE the draw queries of the (open) layer are only built by
+** msPostGISLayerWhichShapes(), to be sent by msPostGISPipelineFlush(). Does
+** nothing if libpq has no pipeline mode (before PostgreSQL 14).
+*/
+void msPostGISLayerEnablePipeline(layerObj *layer, int value)
+{
+#if defined(USE_POSTGIS) && defined(LIBPQ_HAS_PIPELINING)
+  msPostGISLayerInfo *layerinfo;
+
+  if(layer->connectiontype != MS_POSTGIS || !msPostGISLayerIsOpen(layer))
+    return;
+
+  layerinfo = (msPostGISLayerInfo *)layer->layerinfo;
+  layerinfo->pipeline = value;
+#endif
+}
+
+/*
+** msPostGISPipelineFlush()
+**
+** Sends the pending queries of the layers in one pipeline per connection,
+** the queries of all connections before waiting for any result, and takes
+** the results in the order of the layers. A query that fails or is aborted
+** stays pending, to be run again on its own when its rows are first read.
+*/
+void msPostGISPipelineFlush(layerObj **layers, int numlayers)
+{
+#if defined(USE_POSTGIS) && defined(LIBPQ_HAS_PIPELINING)
+  PGconn **conns;
+  PGresult *pgresult;
+  int *sent;
+  int i, j, numconns = 0;
+
+  if(numlayers <= 0) return;
+
+  conns = (PGconn**)msSmallMalloc(sizeof(PGconn*) * numlayers);
+  sent = (int*)msSmallCalloc(numlayers, sizeof(int));
+
+  for(i = 0; i < numlayers; i++) {
+    msPostGISLayerInfo *layerinfo;
+    PGconn *pgconn;
+
+    if(layers[i]->connectiontype != MS_POSTGIS || !layers[i]->layerinfo || sent[i]) continue;
+    layerinfo = (msPostGISLayerInfo *)layers[i]->layerinfo;
+    if(!layerinfo->pending) continue;
+
+    pgconn = layerinfo->pgconn;
+    if(PQpipelineStatus(pgconn) != PQ_PIPELINE_OFF || !PQenterPipelineMode(pgconn)) continue;
+
+    for(j = i; j < numlayers; j++) {
+      msPostGISLayerInfo *li;
+      int status;
+
+      if(layers[j]->connectiontype != MS_POSTGIS || !layers[j]->layerinfo) continue;
+      li = (msPostGISLayerInfo *)layers[j]->layerinfo;
+      if(!li->pending || li->pgconn != pgconn) continue;
+
+      if(li->pendingstatement)
+        status = PQsendQueryPrepared(pgconn, li->pendingstatement, li->numpendingvalues,
+                                     (const char**)li->pendingvalues, NULL, NULL, RESULTSET_TYPE);
+      else
+        status = PQsendQueryParams(pgconn, li->sql, li->numpendingvalues, NULL,
+                                   (const char**)li->pendingvalues, NULL, NULL, RESULTSET_TYPE);
+      if(!status) {
+        msDebug("msPostGISPipelineFlush(): Error (%s) queuing query: %s\n", PQerrorMessage(pgconn), li->sql);
+        break;
+      }
+      sent[j] = MS_TRUE;
+    }
+    if(!PQpipelineSync(pgconn))
+      msDebug("msPostGISPipelineFlush(): Error (%s) sending the pipeline.\n", PQerrorMessage(pgconn));
+    conns[numconns++] = pgconn;
+  }
+
+  for(i = 0; i < numconns; i++) {
+    for(j = 0; j < numlayers; j++) {
+      msPostGISLayerInfo *li;
+
+      if(!sent[j]) continue;
+      li = (msPostGISLayerInfo *)layers[j]->layerinfo;
+      if(li->pgconn != conns[i]) continue;
+
+      pgresult = PQgetResult(conns[i]);
+      if(pgresult && PQresultStatus(pgresult) == PGRES_TUPLES_OK) {
+        msPostGISFreePendingQuery(li);
+        msPostGISTakeResult(layers[j], pgresult);
+      } else {
+        if(layers[j]->debug)
+          msDebug("msPostGISPipelineFlush(): Query of layer %s failed in the pipeline (%s), it runs again alone.\n",
+                  layers[j]->name ? layers[j]->name : "(null)", pgresult ? PQresStatus(PQresultStatus(pgresult)) : PQerrorMessage(conns[i]));
+        if(pgresult) PQclear(pgresult);
+      }
+      while((pgresult = PQgetResult(conns[i])) != NULL) /* end of the results of the query */
+        PQclear(pgresult);
+    }
+
+    /* the PGRES_PIPELINE_SYNC result */
+    while(!PQexitPipelineMode(conns[i]) && (pgresult = PQgetResult(conns[i])) != NULL)
+      PQclear(pgresult);
+  }
+
+  free(sent);
+  free(conns);
+#endif
+}
+
 /*
 ** Look ahead to find the next node of a specific type.
 */
@@ -3824,14 +4539,17 @@ tokenListNodeObjPtr findNextTokenByType(tokenListNodeObjPtr node, int type) {
   return NULL; /* not found */
 }
 
+#ifdef USE_POSTGIS
 /*
-** msPostGISLayerTranslateFilter()
+** msPostGISTranslateExpression()
 **
-** Registered vtable->LayerTranslateFilter function.
+** Puts in *native (malloc'ed, NULL if there is nothing to translate) the
+** SQL for filter, compared with filteritem for string, regex and list
+** expressions. Returns MS_FAILURE, without setting an error, if the
+** expression uses something that has no SQL translation.
 */
-int msPostGISLayerTranslateFilter(layerObj *layer, expressionObj *filter, char *filteritem)
+static int msPostGISTranslateExpression(layerObj *layer, expressionObj *filter, char *filteritem, char **native)
 {
-#ifdef USE_POSTGIS
   tokenListNodeObjPtr node = NULL;
 
   char *snippet = NULL;
@@ -3841,9 +4559,11 @@ int msPostGISLayerTranslateFilter(layerObj *layer, expressionObj *filter, char *
 
   int comparisonToken = -1;
   int bindingToken = -1;
+  int lastBindingToken = -1;
 
   msPostGISLayerInfo *layerinfo = layer->layerinfo;
 
+  *native = NULL;
   if(!filter->string) return MS_SUCCESS; /* not an error, just nothing to do */
 
   // fprintf(stderr, "input: %s, %s, %d\n", filter->string, filteritem, filter->type);
@@ -3891,6 +4611,21 @@ int msPostGISLayerTranslateFilter(layerObj *layer, expressionObj *filter, char *
     native_string = msStringConcatenate(native_string, snippet);
     msFree(snippet);
     msFree(stresc);
+  } else if(filter->type == MS_LIST && filter->string && filteritem) { /* item/list pair */
+
+    stresc = msLayerEscapePropertyName(layer, filteritem);
+    native_string = msStringConcatenate(native_string, stresc);
+    native_string = msStringConcatenate(native_string, "::text = ANY(string_to_array(");
+    msFree(stresc);
+
+    strtmpl = "'%s'";
+    stresc = msPostGISEscapeSQLParam(layer, filter->string);
+    snippet = (char *) msSmallMalloc(strlen(strtmpl) + strlen(stresc));
+    sprintf(snippet, strtmpl, stresc);
+    native_string = msStringConcatenate(native_string, snippet);
+    native_string = msStringConcatenate(native_string, ",','))");
+    msFree(snippet);
+    msFree(stresc);
   } else if(filter->type == MS_EXPRESSION) {
     if(msPostGISParseData(layer) != MS_SUCCESS) return MS_FAILURE;
 
@@ -3940,7 +4675,10 @@ int msPostGISLayerTranslateFilter(layerObj *layer, expressionObj *filter, char *
         case MS_TOKEN_LITERAL_TIME: {
 	  snippet = (char *) msSmallMalloc(512);
 
-          if(comparisonToken == MS_TOKEN_COMPARISON_EQ) { // TODO: support !=
+          if(comparisonToken == MS_TOKEN_COMPARISON_EQ) {
+            createPostgresTimeCompareEquals(node->tokensrc, snippet, 512);
+          } else if(comparisonToken == MS_TOKEN_COMPARISON_NE) {
+            native_string = msStringConcatenate(native_string, " not");
             createPostgresTimeCompareEquals(node->tokensrc, snippet, 512);
           } else if(comparisonToken == MS_TOKEN_COMPARISON_GT || comparisonToken == MS_TOKEN_COMPARISON_GE) {
             createPostgresTimeCompareGreaterThan(node->tokensrc, snippet, 512);
@@ -3975,10 +4713,13 @@ int msPostGISLayerTranslateFilter(layerObj *layer, expressionObj *filter, char *
         case MS_TOKEN_BINDING_DOUBLE:
         case MS_TOKEN_BINDING_INTEGER:
         case MS_TOKEN_BINDING_STRING:
-          if(node->token == MS_TOKEN_BINDING_STRING || node->next->token == MS_TOKEN_COMPARISON_RE || node->next->token == MS_TOKEN_COMPARISON_IRE)
+          if(node->token == MS_TOKEN_BINDING_STRING ||
+             (node->next && (node->next->token == MS_TOKEN_COMPARISON_RE || node->next->token == MS_TOKEN_COMPARISON_IRE ||
+                             node->next->token == MS_TOKEN_COMPARISON_IEQ)))
             strtmpl = "%s::text"; /* explicit cast necessary for certain operators */
           else
             strtmpl = "%s";
+          lastBindingToken = node->token;
           stresc = msLayerEscapePropertyName(layer, node->tokenval.bindval.item);
           snippet = (char *) msSmallMalloc(strlen(strtmpl) + strlen(stresc));
           sprintf(snippet, strtmpl, stresc);
@@ -3990,6 +4731,7 @@ int msPostGISLayerTranslateFilter(layerObj *layer, expressionObj *filter, char *
           native_string = msStringConcatenate(native_string, layerinfo->geomcolumn);
           break;
         case MS_TOKEN_BINDING_MAP_CELLSIZE:
+          if(!layer->map) goto cleanup;
           strtmpl = "%lf";
           snippet = (char *) msSmallMalloc(strlen(strtmpl) + 16);
           sprintf(snippet, strtmpl, layer->map->cellsize);
@@ -4007,7 +4749,7 @@ int msPostGISLayerTranslateFilter(layerObj *layer, expressionObj *filter, char *
         case MS_TOKEN_COMPARISON_CONTAINS:
         case MS_TOKEN_COMPARISON_EQUALS:
         case MS_TOKEN_COMPARISON_DWITHIN:
-          if(node->next->token != '(') goto cleanup;
+          if(!node->next || node->next->token != '(') goto cleanup;
           native_string = msStringConcatenate(native_string, "st_");
           native_string = msStringConcatenate(native_string, msExpressionTokenToString(node->token));
           break;
@@ -4020,22 +4762,74 @@ int msPostGISLayerTranslateFilter(layerObj *layer, expressionObj *filter, char *
           native_string = msStringConcatenate(native_string, "st_");
           native_string = msStringConcatenate(native_string, msExpressionTokenToString(node->token));
           break;
+        case MS_TOKEN_FUNCTION_UPPER:
+          native_string = msStringConcatenate(native_string, "upper");
+          break;
+        case MS_TOKEN_FUNCTION_LOWER:
+          native_string = msStringConcatenate(native_string, "lower");
+          break;
+        case MS_TOKEN_FUNCTION_INITCAP:
+          native_string = msStringConcatenate(native_string, "initcap");
+          break;
+
+        /* comparisons taking the literal that follows */
+        case MS_TOKEN_COMPARISON_IN:
+        case IN: /* the lexer hands out the parser token for this one */
+          /* [item] IN "a,b,c": numbers are compared as numbers, as msEvalExpression() does */
+          if(!node->next || node->next->token != MS_TOKEN_LITERAL_STRING) goto cleanup;
+          node = node->next;
+          stresc = msPostGISEscapeSQLParam(layer, node->tokenval.strval);
+          native_string = msStringConcatenate(native_string, " = ANY(string_to_array('");
+          native_string = msStringConcatenate(native_string, stresc);
+          if(lastBindingToken == MS_TOKEN_BINDING_DOUBLE || lastBindingToken == MS_TOKEN_BINDING_INTEGER)
+            native_string = msStringConcatenate(native_string, "',',')::float8[])");
+          else
+            native_string = msStringConcatenate(native_string, "',','))");
+          msFree(stresc);
+          break;
+        case MS_TOKEN_COMPARISON_IEQ: {
+          /* a =* "b" as ILIKE with the pattern characters of b escaped */
+          const char *c;
+          char *pattern, *p;
+          if(!node->next || node->next->token != MS_TOKEN_LITERAL_STRING) goto cleanup;
+          node = node->next;
+          pattern = p = (char *) msSmallMalloc(2 * strlen(node->tokenval.strval) + 1);
+          for(c = node->tokenval.strval; *c; c++) {
+            if(*c == '%' || *c == '_' || *c == '\\') *p++ = '\\';
+            *p++ = *c;
+          }
+          *p = '\0';
+          stresc = msPostGISEscapeSQLParam(layer, pattern);
+          native_string = msStringConcatenate(native_string, " ILIKE '");
+          native_string = msStringConcatenate(native_string, stresc);
+          native_string = msStringConcatenate(native_string, "'");
+          msFree(stresc);
+          msFree(pattern);
+          break;
+        }
 
 	/* unsupported tokens */ 
-	case MS_TOKEN_COMPARISON_IEQ:
         case MS_TOKEN_COMPARISON_BEYOND:
+        case MS_TOKEN_COMPARISON_LIKE:
 	case MS_TOKEN_FUNCTION_TOSTRING:
+	case MS_TOKEN_FUNCTION_COMMIFY:
 	case MS_TOKEN_FUNCTION_ROUND:
+	case MS_TOKEN_FUNCTION_FROMTEXT:
 	case MS_TOKEN_FUNCTION_SIMPLIFY:
         case MS_TOKEN_FUNCTION_SIMPLIFYPT:        
         case MS_TOKEN_FUNCTION_GENERALIZE:
+        case MS_TOKEN_FUNCTION_SMOOTHSIA:
+        case MS_TOKEN_FUNCTION_JAVASCRIPT:
+        case MS_TOKEN_FUNCTION_FIRSTCAP: /* initcap() would capitalize every word */
+        case MS_TOKEN_BINDING_DATA_CELLSIZE:
           goto cleanup;
           break;
 
         default:
           /* by default accept the general token to string conversion */
 
-          if(node->token == MS_TOKEN_COMPARISON_EQ && node->next != NULL && node->next->token == MS_TOKEN_LITERAL_TIME) break; /* skip, handled with the next token */
+          if((node->token == MS_TOKEN_COMPARISON_EQ || node->token == MS_TOKEN_COMPARISON_NE) &&
+             node->next != NULL && node->next->token == MS_TOKEN_LITERAL_TIME) break; /* skip, handled with the next token */
           if(bindingToken == MS_TOKEN_BINDING_TIME && (node->token == MS_TOKEN_COMPARISON_EQ || node->token == MS_TOKEN_COMPARISON_NE)) break; /* skip, handled elsewhere */
 
           native_string = msStringConcatenate(native_string, msExpressionTokenToString(node->token));
@@ -4046,17 +4840,37 @@ int msPostGISLayerTranslateFilter(layerObj *layer, expressionObj *filter, char *
     }
   }
 
-  filter->native_string = msStrdup(native_string);    
-  msFree(native_string);
+  *native = native_string;
 
-  // fprintf(stderr, "output: %s\n", filter->native_string); 
+  // fprintf(stderr, "output: %s\n", *native); 
 
   return MS_SUCCESS;
 
 cleanup:
-  msSetError(MS_MISCERR, "Translation to native SQL failed.", "msPostGISLayerTranslateFilter()");
   msFree(native_string);
   return MS_FAILURE;
+}
+#endif
+
+/*
+** msPostGISLayerTranslateFilter()
+**
+** Registered vtable->LayerTranslateFilter function.
+*/
+int msPostGISLayerTranslateFilter(layerObj *layer, expressionObj *filter, char *filteritem)
+{
+#ifdef USE_POSTGIS
+  char *native_string = NULL;
+
+  if(msPostGISTranslateExpression(layer, filter, filteritem, &native_string) != MS_SUCCESS) {
+    msSetError(MS_MISCERR, "Translation to native SQL failed.", "msPostGISLayerTranslateFilter()");
+    return MS_FAILURE;
+  }
+  if(!native_string) return MS_SUCCESS; /* not an error, just nothing to do */
+
+  filter->native_string = native_string;
+
+  return MS_SUCCESS;
 #else
   msSetError(MS_MISCERR, "PostGIS support is not available.", "msPostGISLayerTranslateFilter()");
   return MS_FAILURE;
@@ -4077,7 +4891,9 @@ int msPostGISLayerInitializeVirtualTable(layerObj *layer)
   layer->vtable->LayerWhichShapes = msPostGISLayerWhichShapes;
   layer->vtable->LayerNextShape = msPostGISLayerNextShape;
   layer->vtable->LayerGetShape = msPostGISLayerGetShape;
+  layer->vtable->LayerGetShapes = msPostGISLayerGetShapes;
   layer->vtable->LayerGetShapeCount = msPostGISLayerGetShapeCount;
+  layer->vtable->LayerEstimateShapeCount = msPostGISLayerEstimateShapeCount;
   layer->vtable->LayerClose = msPostGISLayerClose;
   layer->vtable->LayerGetItems = msPostGISLayerGetItems;
   layer->vtable->LayerGetExtent = msPostGISLayerGetExtent;
@@ -32,6 +32,7 @@
 #ifdef USE_POSTGIS
 
 #include "libpq-fe.h"
+#include "mapwkb.h"
 
 #ifndef LITTLE_ENDIAN
 #define LITTLE_ENDIAN 1
@@ -57,6 +58,7 @@ typedef struct {
   PGconn      *pgconn;     /* Connection to database */
   long        rownum;      /* What row is the next to be read (for random access) */
   PGresult    *pgresult;   /* For fetching rows from the database */
+  size_t      pgresultsize; /* Bytes of pgresult in the request memory accounting */
   char        *uid;        /* Name of user-specified unique identifier, if set */
   char        *srid;       /* Name of user-specified SRID: zero-length => calculate; non-zero => use this value! */
   char        *geomcolumn; /* Specified geometry column, eg "THEGEOM from thetable" */
@@ -65,96 +67,43 @@ typedef struct {
   int         version;     /* PostGIS version of the database */
   int         paging;      /* Driver handling of pagination, enabled by default */
   int         force2d;     /* Pass geometry through ST_Force2D */
+  int         fetchsize;   /* Rows per FETCH when drawing from a cursor, PROCESSING "FETCH_SIZE", 0 to read all at once */
+  char        *cursor;     /* Name of the open cursor pgresult is a batch of, NULL if pgresult holds all rows */
+  int         cursordone;  /* The cursor has no rows left after pgresult */
+  int         owntransaction; /* The transaction of the cursor was begun by this layer */
+  long        rowoffset;   /* Rows of the cursor read before pgresult */
+  int         prepare;     /* Bind the box and prepare the draw query once per connection, PROCESSING "PREPARED_STATEMENTS" */
+  int         collectboxparams; /* While the SQL of a prepared query is built: boxes become parameters */
+  int         boxparambase; /* Parameters before the first box one (the layer bind values) */
+  int         numboxparams;
+  char        **boxparams; /* Values of the box parameters, as text */
+  int         twkb;        /* Draw queries get TWKB geometries, PROCESSING "TWKB" */
+  int         twkbquery;   /* While the SQL of a draw query is built: geometries as TWKB of twkbprecision decimal digits */
+  int         twkbprecision;
+  int         twkbresult;  /* The geometries of pgresult are TWKB */
+  int         simplify;    /* Draw queries simplify line and polygon geometries, PROCESSING "SIMPLIFY": MS_POSTGIS_SIMPLIFY_* */
+  double      simplifytolerance; /* In pixels, PROCESSING "SIMPLIFY_TOLERANCE" */
+  double      simplifyquery; /* While the SQL of a draw query is built: tolerance in layer units, 0 for none */
+  int         cachettl;    /* Seconds extents and counts are cached, PROCESSING "CACHE_TTL", 0 for none */
+  int         estimatedextent; /* Extent from the planner statistics, PROCESSING "ESTIMATED_EXTENT" */
+  int         pushclasses; /* Draw queries only get rows some class matches, PROCESSING "PUSHDOWN_CLASSES" */
+  int         keyset;      /* Paged queries are ordered by uid and start after PROCESSING "KEYSET_AFTER", PROCESSING "KEYSET_PAGING" */
+  char        *classfilter; /* While the SQL of a draw query is built: OR of the class expressions, NULL for none */
+  int         uidparam;    /* While the SQL of msPostGISLayerGetShapes() is built: parameter holding the uid array, 0 for none */
+  int         pipeline;    /* Draw queries wait for msPostGISPipelineFlush(), see msPostGISLayerEnablePipeline() */
+  int         pending;     /* The query in sql has not been run yet */
+  char        *pendingstatement; /* Prepared statement to run it with, NULL for none */
+  int         numpendingvalues;
+  char        **pendingvalues; /* Parameter values to run it with */
 }
 msPostGISLayerInfo;
 
 
-/*
-** Utility structure for handling the WKB returned by the database while
-** reading.
-*/
-typedef struct {
-  char *wkb; /* Pointer to front of WKB */
-  char *ptr; /* Pointer to current write point */
-  size_t size; /* Size of allocated space */
-  int *typemap; /* Look-up array to valid OGC types */
-} wkbObj;
-
-/*
-** Utility structure used when building up stroked lines while
-** handling curved feature types.
-*/
-typedef struct {
-  pointObj *data; /* Re-sizeable point buffer */
-  int npoints;  /* How many points are we currently storing */
-  int maxpoints; /* How big is our point buffer */
-} pointArrayObj;
-
-/*
-** All the WKB type numbers from the OGC
-*/
-typedef enum {
-  WKB_POINT=1,
-  WKB_LINESTRING=2,
-  WKB_POLYGON=3,
-  WKB_MULTIPOINT=4,
-  WKB_MULTILINESTRING=5,
-  WKB_MULTIPOLYGON=6,
-  WKB_GEOMETRYCOLLECTION=7,
-  WKB_CIRCULARSTRING=8,
-  WKB_COMPOUNDCURVE=9,
-  WKB_CURVEPOLYGON=10,
-  WKB_MULTICURVE=11,
-  WKB_MULTISURFACE=12
-} wkb_typenum;
-
-/*
-** See below.
-*/
-#define WKB_TYPE_COUNT 16
-
-/*
-** Map the WKB type numbers returned by PostGIS < 2.0 to the
-** valid OGC numbers
-*/
-static int wkb_postgis15[WKB_TYPE_COUNT] = {
-  0,
-  WKB_POINT,
-  WKB_LINESTRING,
-  WKB_POLYGON,
-  WKB_MULTIPOINT,
-  WKB_MULTILINESTRING,
-  WKB_MULTIPOLYGON,
-  WKB_GEOMETRYCOLLECTION,
-  WKB_CIRCULARSTRING,
-  WKB_COMPOUNDCURVE,
-  0,0,0,
-  WKB_CURVEPOLYGON,
-  WKB_MULTICURVE,
-  WKB_MULTISURFACE
-};
-
-/*
-** Map the WKB type numbers returned by PostGIS >= 2.0 to the
-** valid OGC numbers
-*/
-static int wkb_postgis20[WKB_TYPE_COUNT] = {
-  0,
-  WKB_POINT,
-  WKB_LINESTRING,
-  WKB_POLYGON,
-  WKB_MULTIPOINT,
-  WKB_MULTILINESTRING,
-  WKB_MULTIPOLYGON,
-  WKB_GEOMETRYCOLLECTION,
-  WKB_CIRCULARSTRING,
-  WKB_COMPOUNDCURVE,
-  WKB_CURVEPOLYGON,
-  WKB_MULTICURVE,
-  WKB_MULTISURFACE,
-  0,0,0
-};
-
+/* Server side simplification of draw queries */
+#define MS_POSTGIS_SIMPLIFY_NONE 0
+#define MS_POSTGIS_SIMPLIFY_SNAPTOGRID 1
+#define MS_POSTGIS_SIMPLIFY_SIMPLIFY 2
+#define MS_POSTGIS_SIMPLIFY_REMOVEREPEATEDPOINTS 3
 
 /*
 ** Prototypes
@@ -163,10 +112,6 @@ void msPostGISFreeLayerInfo(layerObj *layer);
 msPostGISLayerInfo *msPostGISCreateLayerInfo(void);
 char *msPostGISBuildSQL(layerObj *layer, rectObj *rect, long *uid, rectObj *rectInOtherSRID, int rectOtherSRID);
 int msPostGISParseData(layerObj *layer);
-int arcStrokeCircularString(wkbObj *w, double segment_angle, lineObj *line, int pnZMFlag);
-int wkbConvGeometryToShape(wkbObj *w, shapeObj *shape);
-pointArrayObj* pointArrayNew(int maxpoints);
-void pointArrayFree(pointArrayObj *d);
 
 #endif /* USE_POSTGIS */
 
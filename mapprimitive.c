@@ -101,6 +101,7 @@ void msInitShape(shapeObj *shape)
   shape->numvalues = 0;
 
   shape->geometry = NULL;
+  shape->prepared_geometry = NULL;
   shape->renderer_cache = NULL;
 
   /* annotation component */
@@ -144,6 +145,7 @@ int msCopyShape(shapeObj *from, shapeObj *to)
   }
 
   to->geometry = NULL; /* GEOS code will build automatically if necessary */
+  to->prepared_geometry = NULL;
   to->scratch = from->scratch;
 
   return(0);
@@ -169,6 +171,134 @@ void msFreeShape(shapeObj *shape)
   msInitShape(shape); /* now reset */
 }
 
+/*
+** Shape pools. While a layer is drawn with CONFIG "MS_SHAPE_POOL" ON, the
+** point, line and value arrays of the shapes it is done with are kept in
+** power of two size classes and handed to the next shapes read, clipped or
+** transformed, instead of going back to the allocator for each feature.
+** The blocks are plain malloc()ed memory: whatever may free or realloc()
+** the arrays of a shape still may, the pool only gets back what is given
+** to it by msShapePoolFreeShape(). Everything left is released at once by
+** msFreeShapePool() when the layer is done.
+*/
+#define MS_SHAPEPOOL_MIN_CLASS 4  /* 16 bytes, room for the free list link */
+#define MS_SHAPEPOOL_MAX_CLASS 20 /* 1MB, larger blocks are not recycled */
+
+/*
+** What the allocator really handed out, so that a block allocated for a
+** class goes back to that class and not to the one below it.
+*/
+#if defined(__GLIBC__)
+#include <malloc.h>
+#define MS_SHAPEPOOL_BLOCKSIZE(block, size) malloc_usable_size(block)
+#elif defined(_WIN32)
+#define MS_SHAPEPOOL_BLOCKSIZE(block, size) _msize(block)
+#else
+#define MS_SHAPEPOOL_BLOCKSIZE(block, size) (size)
+#endif
+
+struct shapePoolObj {
+  void *blocks[MS_SHAPEPOOL_MAX_CLASS+1]; /* free blocks of at least 1<<class bytes, linked through their first bytes */
+  long allocated, recycled;
+};
+
+shapePoolObj *msCreateShapePool(void)
+{
+  return (shapePoolObj *) msSmallCalloc(1, sizeof(shapePoolObj));
+}
+
+void msFreeShapePool(shapePoolObj *pool)
+{
+  int i;
+
+  if(!pool) return;
+  for(i=MS_SHAPEPOOL_MIN_CLASS; i<=MS_SHAPEPOOL_MAX_CLASS; i++) {
+    while(pool->blocks[i]) {
+      void *next = *(void **) pool->blocks[i];
+      free(pool->blocks[i]);
+      pool->blocks[i] = next;
+    }
+  }
+  free(pool);
+}
+
+/* a block of at least size bytes, to be released by free() or msShapePoolFree() */
+void *msShapePoolAlloc(shapePoolObj *pool, size_t size)
+{
+  int i = MS_SHAPEPOOL_MIN_CLASS;
+  void *block;
+
+  if(!pool)
+    return msSmallMalloc(size);
+
+  while(i <= MS_SHAPEPOOL_MAX_CLASS && ((size_t) 1 << i) < size)
+    i++;
+  if(i > MS_SHAPEPOOL_MAX_CLASS)
+    return msSmallMalloc(size);
+
+  if((block = pool->blocks[i]) != NULL) {
+    pool->blocks[i] = *(void **) block;
+    pool->recycled++;
+    return block;
+  }
+  pool->allocated++;
+  return msSmallMalloc((size_t) 1 << i);
+}
+
+/* give back a block known to hold at least size bytes */
+void msShapePoolFree(shapePoolObj *pool, void *block, size_t size)
+{
+  int i = MS_SHAPEPOOL_MAX_CLASS;
+
+  if(!block) return;
+  if(pool)
+    size = MS_SHAPEPOOL_BLOCKSIZE(block, size);
+  if(!pool || size < ((size_t) 1 << MS_SHAPEPOOL_MIN_CLASS) || size >= ((size_t) 2 << MS_SHAPEPOOL_MAX_CLASS)) {
+    free(block);
+    return;
+  }
+
+  while(((size_t) 1 << i) > size)
+    i--;
+  *(void **) block = pool->blocks[i];
+  pool->blocks[i] = block;
+}
+
+/* msFreeShape(), the arrays of the shape going to the pool */
+void msShapePoolFreeShape(shapePoolObj *pool, shapeObj *shape)
+{
+  int c;
+
+  if(!shape) return;
+  if(!pool) {
+    msFreeShape(shape);
+    return;
+  }
+
+  for (c= 0; c < shape->numlines; c++)
+    msShapePoolFree(pool, shape->line[c].point, sizeof(pointObj) * shape->line[c].numpoints);
+  msShapePoolFree(pool, shape->line, sizeof(lineObj) * shape->numlines);
+  if(shape->values) {
+    for (c= 0; c < shape->numvalues; c++)
+      free(shape->values[c]);
+    msShapePoolFree(pool, shape->values, sizeof(char *) * shape->numvalues);
+  }
+  if(shape->text) free(shape->text);
+
+#ifdef USE_GEOS
+  msGEOSFreeGeometry(shape);
+#endif
+
+  msInitShape(shape); /* now reset */
+}
+
+void msShapePoolDebug(shapePoolObj *pool, layerObj *layer)
+{
+  if(pool && layer->debug >= MS_DEBUGLEVEL_V)
+    msDebug("Shape pool of layer %s: %ld blocks allocated, %ld recycled.\n",
+            layer->name ? layer->name : "", pool->allocated, pool->recycled);
+}
+
 void msFreeLabelPathObj(labelPathObj *path)
 {
   msFreeShape(&(path->bounds));
@@ -552,17 +682,216 @@ void msClipPolylineRect(shapeObj *shape, rectObj rect)
 }
 
 /*
-** Slightly modified version of the Liang-Barsky polygon clipping algorithm
+** Scratch points for the clipping, kept per thread and grown as needed so
+** that clipping a feature does not allocate for its worst case every time.
+** A threaded build without thread local storage allocates them per call,
+** and buffers grown past CLIP_SCRATCH_KEEP points are not kept.
 */
-void msClipPolygonRect(shapeObj *shape, rectObj rect)
+#define CLIP_SCRATCH_KEEP 65536
+
+typedef struct {
+  pointObj *point;
+  int size;
+} clipScratchObj;
+
+#if defined(MS_THREAD_LOCAL)
+static MS_THREAD_LOCAL clipScratchObj clip_scratch[2];
+#define CLIP_SCRATCH_KEPT
+#elif !defined(USE_THREAD)
+static clipScratchObj clip_scratch[2];
+#define CLIP_SCRATCH_KEPT
+#endif
+
+/* the which-th (0 or 1) scratch buffer, of at least numpoints, own holds the buffers when they are not kept */
+static pointObj *clipScratchGet(clipScratchObj *own, int which, int numpoints)
 {
-  int i, j;
+#ifdef CLIP_SCRATCH_KEPT
+  clipScratchObj *scratch = &clip_scratch[which];
+#else
+  clipScratchObj *scratch = &own[which];
+#endif
+
+  if(scratch->size < numpoints) {
+    free(scratch->point);
+    scratch->size = MS_MAX(numpoints, 2*scratch->size);
+    scratch->point = (pointObj *) msSmallMalloc(sizeof(pointObj)*scratch->size);
+  }
+  return scratch->point;
+}
+
+static void clipScratchRelease(clipScratchObj *own)
+{
+  int i;
+
+  for(i=0; i<2; i++) {
+#ifdef CLIP_SCRATCH_KEPT
+    clipScratchObj *scratch = &clip_scratch[i];
+    if(scratch->size <= CLIP_SCRATCH_KEEP)
+      continue;
+#else
+    clipScratchObj *scratch = &own[i];
+#endif
+    free(scratch->point);
+    scratch->point = NULL;
+    scratch->size = 0;
+  }
+}
+
+/* where a ring is with respect to the clip rect, from its bounds */
+#define CLIP_RING_INSIDE 0
+#define CLIP_RING_OUTSIDE 1
+#define CLIP_RING_CROSSING 2
+
+static int clipRingPosition(const lineObj *ring, rectObj rect)
+{
+  double minx, miny, maxx, maxy;
+  int i;
+
+  if(ring->numpoints == 0)
+    return CLIP_RING_OUTSIDE;
+
+  minx = maxx = ring->point[0].x;
+  miny = maxy = ring->point[0].y;
+  for(i=1; i<ring->numpoints; i++) {
+    if(ring->point[i].x < minx) minx = ring->point[i].x;
+    else if(ring->point[i].x > maxx) maxx = ring->point[i].x;
+    if(ring->point[i].y < miny) miny = ring->point[i].y;
+    else if(ring->point[i].y > maxy) maxy = ring->point[i].y;
+  }
+
+  if(minx >= rect.minx && maxx <= rect.maxx && miny >= rect.miny && maxy <= rect.maxy)
+    return CLIP_RING_INSIDE;
+  /* the clipped ring would run along the rect boundary, with no area */
+  if(minx > rect.maxx || maxx < rect.minx || miny > rect.maxy || maxy < rect.miny)
+    return CLIP_RING_OUTSIDE;
+  return CLIP_RING_CROSSING;
+}
+
+/*
+** Slightly modified version of the Liang-Barsky polygon clipping algorithm.
+** Clips a single ring into out, which must hold 3*numpoints+1 points (the
+** worst case: a corner, an entry and an exit point per segment, +1 allows
+** us to duplicate the 1st and last point), and returns the number of points
+** written including the forced closure.
+*/
+static int clipPolygonRing(const lineObj *ring, rectObj rect, pointObj *out)
+{
+  int i, n = 0;
   double deltax, deltay, xin,xout,  yin,yout;
   double tinx,tiny,  toutx,touty,  tin1, tin2,  tout;
   double x1,y1, x2,y2;
 
+  for (i = 0; i < ring->numpoints-1; i++) {
+
+    x1 = ring->point[i].x;
+    y1 = ring->point[i].y;
+    x2 = ring->point[i+1].x;
+    y2 = ring->point[i+1].y;
+
+    deltax = x2-x1;
+    if (deltax == 0) { /* bump off of the vertical */
+      deltax = (x1 > rect.minx) ? -NEARZERO : NEARZERO ;
+    }
+    deltay = y2-y1;
+    if (deltay == 0) { /* bump off of the horizontal */
+      deltay = (y1 > rect.miny) ? -NEARZERO : NEARZERO ;
+    }
+
+    if (deltax > 0) { /*  points to right */
+      xin = rect.minx;
+      xout = rect.maxx;
+    } else {
+      xin = rect.maxx;
+      xout = rect.minx;
+    }
+    if (deltay > 0) { /*  points up */
+      yin = rect.miny;
+      yout = rect.maxy;
+    } else {
+      yin = rect.maxy;
+      yout = rect.miny;
+    }
+
+    tinx = (xin - x1)/deltax;
+    tiny = (yin - y1)/deltay;
+
+    if (tinx < tiny) { /* hits x first */
+      tin1 = tinx;
+      tin2 = tiny;
+    } else {            /* hits y first */
+      tin1 = tiny;
+      tin2 = tinx;
+    }
+
+    if (1 >= tin1) {
+      if (0 < tin1) {
+        out[n].x = xin;
+        out[n].y = yin;
+        n++;
+      }
+      if (1 >= tin2) {
+        toutx = (xout - x1)/deltax;
+        touty = (yout - y1)/deltay;
+
+        tout = (toutx < touty) ? toutx : touty ;
+
+        if (0 < tin2 || 0 < tout) {
+          if (tin2 <= tout) {
+            if (0 < tin2) {
+              if (tinx > tiny) {
+                out[n].x = xin;
+                out[n].y = y1 + tinx*deltay;
+                n++;
+              } else {
+                out[n].x = x1 + tiny*deltax;
+                out[n].y = yin;
+                n++;
+              }
+            }
+            if (1 > tout) {
+              if (toutx < touty) {
+                out[n].x = xout;
+                out[n].y = y1 + toutx*deltay;
+                n++;
+              } else {
+                out[n].x = x1 + touty*deltax;
+                out[n].y = yout;
+                n++;
+              }
+            } else {
+              out[n].x = x2;
+              out[n].y = y2;
+              n++;
+            }
+          } else {
+            if (tinx > tiny) {
+              out[n].x = xin;
+              out[n].y = yout;
+              n++;
+            } else {
+              out[n].x = xout;
+              out[n].y = yin;
+              n++;
+            }
+          }
+        }
+      }
+    }
+  }
+
+  if(n > 0) {
+    out[n] = out[0]; /* force closure */
+    n++;
+  }
+  return n;
+}
+
+void msClipPolygonRect(shapeObj *shape, rectObj rect)
+{
+  int i, j;
   shapeObj tmp;
   lineObj line= {0,NULL};
+  clipScratchObj own[2] = {{NULL, 0}, {NULL, 0}};
 
   msInitShape(&tmp);
 
@@ -583,122 +912,42 @@ void msClipPolygonRect(shapeObj *shape, rectObj rect)
     return;
   }
 
-  for(j=0; j<shape->numlines; j++) {
-
-    line.point = (pointObj *)msSmallMalloc(sizeof(pointObj)*2*shape->line[j].numpoints+1); /* worst case scenario, +1 allows us to duplicate the 1st and last point */
-    line.numpoints = 0;
-
-    for (i = 0; i < shape->line[j].numpoints-1; i++) {
-
-      x1 = shape->line[j].point[i].x;
-      y1 = shape->line[j].point[i].y;
-      x2 = shape->line[j].point[i+1].x;
-      y2 = shape->line[j].point[i+1].y;
-
-      deltax = x2-x1;
-      if (deltax == 0) { /* bump off of the vertical */
-        deltax = (x1 > rect.minx) ? -NEARZERO : NEARZERO ;
-      }
-      deltay = y2-y1;
-      if (deltay == 0) { /* bump off of the horizontal */
-        deltay = (y1 > rect.miny) ? -NEARZERO : NEARZERO ;
-      }
-
-      if (deltax > 0) { /*  points to right */
-        xin = rect.minx;
-        xout = rect.maxx;
-      } else {
-        xin = rect.maxx;
-        xout = rect.minx;
-      }
-      if (deltay > 0) { /*  points up */
-        yin = rect.miny;
-        yout = rect.maxy;
-      } else {
-        yin = rect.maxy;
-        yout = rect.miny;
-      }
-
-      tinx = (xin - x1)/deltax;
-      tiny = (yin - y1)/deltay;
+  /* there are at most as many clipped rings, set them directly rather than growing the array for each */
+  tmp.line = (lineObj *) msSmallMalloc(sizeof(lineObj)*shape->numlines);
 
-      if (tinx < tiny) { /* hits x first */
-        tin1 = tinx;
-        tin2 = tiny;
-      } else {            /* hits y first */
-        tin1 = tiny;
-        tin2 = tinx;
-      }
-
-      if (1 >= tin1) {
-        if (0 < tin1) {
-          line.point[line.numpoints].x = xin;
-          line.point[line.numpoints].y = yin;
-          line.numpoints++;
-        }
-        if (1 >= tin2) {
-          toutx = (xout - x1)/deltax;
-          touty = (yout - y1)/deltay;
-
-          tout = (toutx < touty) ? toutx : touty ;
-
-          if (0 < tin2 || 0 < tout) {
-            if (tin2 <= tout) {
-              if (0 < tin2) {
-                if (tinx > tiny) {
-                  line.point[line.numpoints].x = xin;
-                  line.point[line.numpoints].y = y1 + tinx*deltay;
-                  line.numpoints++;
-                } else {
-                  line.point[line.numpoints].x = x1 + tiny*deltax;
-                  line.point[line.numpoints].y = yin;
-                  line.numpoints++;
-                }
-              }
-              if (1 > tout) {
-                if (toutx < touty) {
-                  line.point[line.numpoints].x = xout;
-                  line.point[line.numpoints].y = y1 + toutx*deltay;
-                  line.numpoints++;
-                } else {
-                  line.point[line.numpoints].x = x1 + touty*deltax;
-                  line.point[line.numpoints].y = yout;
-                  line.numpoints++;
-                }
-              } else {
-                line.point[line.numpoints].x = x2;
-                line.point[line.numpoints].y = y2;
-                line.numpoints++;
-              }
-            } else {
-              if (tinx > tiny) {
-                line.point[line.numpoints].x = xin;
-                line.point[line.numpoints].y = yout;
-                line.numpoints++;
-              } else {
-                line.point[line.numpoints].x = xout;
-                line.point[line.numpoints].y = yin;
-                line.numpoints++;
-              }
-            }
-          }
-        }
-      }
+  for(j=0; j<shape->numlines; j++) {
+    lineObj *ring = &shape->line[j];
+
+    /* the same test per ring: those within are kept as they are, those outside dropped */
+    switch(clipRingPosition(ring, rect)) {
+      case CLIP_RING_INSIDE:
+        tmp.line[tmp.numlines++] = *ring;
+        ring->point = NULL;
+        ring->numpoints = 0;
+        continue;
+      case CLIP_RING_OUTSIDE:
+        continue;
     }
 
+    line.point = clipScratchGet(own, 0, 3*ring->numpoints+1);
+    line.numpoints = clipPolygonRing(ring, rect, line.point);
+
     if(line.numpoints > 0) {
-      line.point[line.numpoints].x = line.point[0].x; /* force closure */
-      line.point[line.numpoints].y = line.point[0].y;
-      line.numpoints++;
-      msAddLineDirectly(&tmp, &line);
-    } else {
-      free(line.point);
+      tmp.line[tmp.numlines].numpoints = line.numpoints;
+      tmp.line[tmp.numlines].point = (pointObj *) msSmallMalloc(sizeof(pointObj)*line.numpoints);
+      memcpy(tmp.line[tmp.numlines].point, line.point, sizeof(pointObj)*line.numpoints);
+      tmp.numlines++;
     }
   } /* next line */
+  clipScratchRelease(own);
 
   for (i=0; i<shape->numlines; i++) free(shape->line[i].point);
   free(shape->line);
 
+  if(tmp.numlines == 0) {
+    free(tmp.line);
+    tmp.line = NULL;
+  }
   shape->line = tmp.line;
   shape->numlines = tmp.numlines;
   msComputeBounds(shape);
@@ -946,6 +1195,219 @@ void msTransformShapeSimplify(shapeObj *shape, rectObj extent, double cellsize)
 /**
  * Generic function to transorm the shape coordinates to output coordinates
  */
+/*
+** Streaming form of msTransformShapeSimplify(), used by msClipTransformShape()
+** to transform and decimate the clipped vertices as they are produced. Points
+** are pushed in map coordinates, and the kept pixel coordinates are appended
+** to out following exactly the rules of msTransformShapeSimplify(): the first
+** point (first two for polygons) is always kept, the last one (last two for
+** polygons) is decided once the part ends, and the ones in between are kept
+** when they fall more than a pixel away from the last kept point.
+*/
+typedef struct {
+  int polygon;
+  double minx, maxy, inv_cs;
+  int numin, numpending, numout;
+  pointObj pending[2];
+  pointObj *out;
+} simplifyStreamObj;
+
+static void simplifyStreamStart(simplifyStreamObj *s, pointObj *out)
+{
+  s->numin = s->numpending = s->numout = 0;
+  s->out = out;
+}
+
+static void simplifyStreamKeep(simplifyStreamObj *s, const pointObj *p)
+{
+  s->out[s->numout].x = p->x;
+  s->out[s->numout].y = p->y;
+  s->numout++;
+}
+
+static void simplifyStreamMiddle(simplifyStreamObj *s, const pointObj *p)
+{
+  double dx = p->x - s->out[s->numout-1].x;
+  double dy = p->y - s->out[s->numout-1].y;
+  if(dx*dx+dy*dy>1)
+    simplifyStreamKeep(s, p);
+}
+
+static void simplifyStreamPush(simplifyStreamObj *s, double x, double y)
+{
+  int numheld = s->polygon ? 2 : 1; /* points held back until the part ends */
+  pointObj p;
+
+  p.x = MS_MAP2IMAGE_X_IC_DBL(x, s->minx, s->inv_cs);
+  p.y = MS_MAP2IMAGE_Y_IC_DBL(y, s->maxy, s->inv_cs);
+
+  if(++s->numin <= numheld) {
+    simplifyStreamKeep(s, &p);
+  } else if(s->numpending == numheld) {
+    simplifyStreamMiddle(s, &s->pending[0]);
+    if(numheld == 2) s->pending[0] = s->pending[1];
+    s->pending[numheld-1] = p;
+  } else {
+    s->pending[s->numpending++] = p;
+  }
+}
+
+/* returns the number of points of the simplified part, 0 if it is degenerate */
+static int simplifyStreamEnd(simplifyStreamObj *s)
+{
+  if(s->polygon) {
+    if(s->numin < 4) return 0;
+    simplifyStreamKeep(s, &s->pending[0]);
+    simplifyStreamKeep(s, &s->pending[1]);
+    return s->numout;
+  }
+
+  if(s->numin < 2) return 0;
+  /* discard last point if equal to the one before it */
+  if(s->pending[0].x != s->out[s->numout-1].x || s->pending[0].y != s->out[s->numout-1].y)
+    simplifyStreamKeep(s, &s->pending[0]);
+  return (s->numout < 2) ? 0 : s->numout;
+}
+
+/* copies the part accumulated in the stream onto the end of shape */
+static int simplifyStreamFlush(simplifyStreamObj *s, shapeObj *shape)
+{
+  lineObj line;
+
+  line.numpoints = simplifyStreamEnd(s);
+  line.point = (pointObj *) msSmallMalloc(sizeof(pointObj)*MS_MAX(line.numpoints,1));
+  memcpy(line.point, s->out, sizeof(pointObj)*line.numpoints);
+  msAddLineDirectly(shape, &line);
+  simplifyStreamStart(s, s->out);
+
+  return shape->line[shape->numlines-1].numpoints > 0;
+}
+
+/*
+** Clips a line or polygon shape to cliprect (in map coordinates) and
+** transforms it to image coordinates in a single pass over the vertices.
+** For renderers using MS_TRANSFORM_SIMPLIFY the clipped vertices are
+** transformed and decimated as they are produced, into a scratch buffer
+** that is reused for each part, instead of materializing the clipped shape
+** and then walking it again in msTransformShape(). The result is the same
+** as msClipPolygonRect()/msClipPolylineRect() followed by msTransformShape().
+** As with msTransformShape(), the shape bounds are left for the caller to
+** recompute.
+*/
+void msClipTransformShape(shapeObj *shape, rectObj cliprect, rectObj extent, double cellsize, imageObj *image)
+{
+  int i, j, ok = 0;
+  int maxpoints = 0;
+  double x1, y1, x2, y2;
+  pointObj *scratch = NULL, *clipped = NULL;
+  clipScratchObj own[2] = {{NULL, 0}, {NULL, 0}};
+  simplifyStreamObj s;
+  shapeObj tmp;
+
+  if(image == NULL || !MS_RENDERER_PLUGIN(image->format) ||
+      MS_IMAGE_RENDERER(image)->transform_mode != MS_TRANSFORM_SIMPLIFY ||
+      (shape->type != MS_SHAPE_LINE && shape->type != MS_SHAPE_POLYGON)) {
+    if(shape->type == MS_SHAPE_POLYGON)
+      msClipPolygonRect(shape, cliprect);
+    else
+      msClipPolylineRect(shape, cliprect);
+    msTransformShape(shape, extent, cellsize, image);
+    return;
+  }
+
+  if(shape->numlines == 0) /* nothing to clip */
+    return;
+
+  /* shapes completely within the clip rectangle only need to be transformed */
+  if( shape->bounds.maxx <= cliprect.maxx
+      && shape->bounds.minx >= cliprect.minx
+      && shape->bounds.maxy <= cliprect.maxy
+      && shape->bounds.miny >= cliprect.miny ) {
+    msTransformShapeSimplify(shape, extent, cellsize);
+    return;
+  }
+
+  s.polygon = (shape->type == MS_SHAPE_POLYGON);
+  s.minx = extent.minx;
+  s.maxy = extent.maxy;
+  s.inv_cs = 1.0 / cellsize; /* invert and multiply much faster */
+
+  for(i=0; i<shape->numlines; i++) {
+    if(shape->line[i].numpoints > maxpoints) {
+      maxpoints = shape->line[i].numpoints;
+    }
+  }
+  /* a clipped ring has at most 3 points per input segment, plus its closure */
+  scratch = clipScratchGet(own, 0, 3*maxpoints+1);
+  if(s.polygon)
+    clipped = clipScratchGet(own, 1, 3*maxpoints+1);
+
+  msInitShape(&tmp);
+
+  for(i=0; i<shape->numlines; i++) {
+    lineObj *line = &shape->line[i];
+
+    simplifyStreamStart(&s, scratch);
+
+    if(s.polygon) {
+      int numclipped;
+
+      /* rings are kept, dropped or clipped as in msClipPolygonRect() */
+      switch(clipRingPosition(line, cliprect)) {
+        case CLIP_RING_INSIDE:
+          for(j=0; j<line->numpoints; j++)
+            simplifyStreamPush(&s, line->point[j].x, line->point[j].y);
+          ok |= simplifyStreamFlush(&s, &tmp);
+          continue;
+        case CLIP_RING_OUTSIDE:
+          continue;
+      }
+      numclipped = clipPolygonRing(line, cliprect, clipped);
+      if(numclipped == 0) continue;
+      for(j=0; j<numclipped; j++)
+        simplifyStreamPush(&s, clipped[j].x, clipped[j].y);
+      ok |= simplifyStreamFlush(&s, &tmp);
+      continue;
+    }
+
+    /* same splitting as msClipPolylineRect(): a part ends where a segment leaves the rect */
+    x1 = line->point[0].x;
+    y1 = line->point[0].y;
+    for(j=1; j<line->numpoints; j++) {
+      x2 = line->point[j].x;
+      y2 = line->point[j].y;
+
+      if(clipLine(&x1,&y1,&x2,&y2,cliprect) == MS_TRUE) {
+        if(s.numin == 0) /* first segment, add both points */
+          simplifyStreamPush(&s, x1, y1);
+        simplifyStreamPush(&s, x2, y2);
+
+        if((x2 != line->point[j].x) || (y2 != line->point[j].y))
+          ok |= simplifyStreamFlush(&s, &tmp);
+      }
+
+      x1 = line->point[j].x;
+      y1 = line->point[j].y;
+    }
+    if(s.numin > 0)
+      ok |= simplifyStreamFlush(&s, &tmp);
+  }
+
+  clipScratchRelease(own);
+
+  for (i=0; i<shape->numlines; i++) free(shape->line[i].point);
+  free(shape->line);
+
+  if(!ok) { /* all parts are degenerate */
+    for (i=0; i<tmp.numlines; i++) free(tmp.line[i].point);
+    free(tmp.line);
+    tmp.line = NULL;
+    tmp.numlines = 0;
+  }
+  shape->line = tmp.line;
+  shape->numlines = tmp.numlines;
+}
+
 void  msTransformShape(shapeObj *shape, rectObj extent, double cellsize, imageObj *image)
 {
   if (image != NULL && MS_RENDERER_PLUGIN(image->format)) {
@@ -1542,9 +2004,186 @@ int msPolygonLabelPoint(shapeObj *p, pointObj *lp, double min_dimension)
     return(MS_FAILURE);
 }
 
+/*
+** Pole of inaccessibility label points: the polygon's bounds are covered by
+** square cells that are refined, most promising first, until no cell can
+** hold a point farther from the edges than the best one found by more than
+** precision. The number of cells probed is bounded by the size of the
+** polygon so that complex shapes don't cost unbounded time.
+*/
+#define MS_POLE_INITIAL_CELLS 256
+#define MS_POLE_MIN_PROBES 64
+#define MS_POLE_SEGMENT_BUDGET 1000000
+#define MS_POLE_SQRT2 1.41421356237309504880
+
+typedef struct {
+  double x, y; /* center */
+  double h; /* half the cell width */
+  double d; /* signed distance of the center to the polygon, negative outside */
+  double max; /* largest distance a point of the cell can have */
+} poleCellObj;
+
+static double poleDistance(shapeObj *p, double x, double y)
+{
+  int i, j, inside = MS_FALSE;
+  double min_dist2 = -1;
+
+  for(j=0; j<p->numlines; j++) {
+    lineObj *line = &(p->line[j]);
+    for(i=0; i<line->numpoints; i++) {
+      pointObj *a = &(line->point[i]);
+      pointObj *b = &(line->point[i==0 ? line->numpoints-1 : i-1]);
+      double dx = b->x - a->x, dy = b->y - a->y, px = a->x, py = a->y, d2;
+
+      if((a->y > y) != (b->y > y) && x < dx * (y - a->y) / dy + a->x)
+        inside = !inside;
+      if(dx != 0 || dy != 0) {
+        double t = ((x - a->x) * dx + (y - a->y) * dy) / (dx * dx + dy * dy);
+        if(t > 1) {
+          px = b->x;
+          py = b->y;
+        } else if(t > 0) {
+          px += dx * t;
+          py += dy * t;
+        }
+      }
+      d2 = (x - px) * (x - px) + (y - py) * (y - py);
+      if(min_dist2 < 0 || d2 < min_dist2) min_dist2 = d2;
+    }
+  }
+  if(min_dist2 < 0) return 0;
+  return (inside ? 1 : -1) * sqrt(min_dist2);
+}
+
+static void poleInitCell(poleCellObj *cell, shapeObj *p, double x, double y, double h)
+{
+  cell->x = x;
+  cell->y = y;
+  cell->h = h;
+  cell->d = poleDistance(p, x, y);
+  cell->max = cell->d + h * MS_POLE_SQRT2;
+}
+
+/* max-heap on poleCellObj.max */
+static void polePushCell(poleCellObj *heap, int *n, poleCellObj *cell)
+{
+  int i = (*n)++;
+  while(i > 0) {
+    int parent = (i - 1) / 2;
+    if(heap[parent].max >= cell->max) break;
+    heap[i] = heap[parent];
+    i = parent;
+  }
+  heap[i] = *cell;
+}
+
+static void polePopCell(poleCellObj *heap, int *n, poleCellObj *cell)
+{
+  int i = 0;
+  poleCellObj last;
+
+  *cell = heap[0];
+  last = heap[--(*n)];
+  while(2 * i + 1 < *n) {
+    int child = 2 * i + 1;
+    if(child + 1 < *n && heap[child+1].max > heap[child].max) child++;
+    if(heap[child].max <= last.max) break;
+    heap[i] = heap[child];
+    i = child;
+  }
+  heap[i] = last;
+}
+
+/*
+** Points within precision of the farthest one found are equally good, the one
+** closest to the center of the polygon is kept so that labels don't end up in
+** a corner of shapes (like rings or strips) whose width is the same all along.
+*/
+static void poleKeepBest(poleCellObj *best, double *maxd, const poleCellObj *cell, const pointObj *center, double precision)
+{
+  if(cell->d > *maxd) *maxd = cell->d;
+  if(cell->d < *maxd - precision) return;
+  if(best->d < *maxd - precision ||
+      (cell->x - center->x) * (cell->x - center->x) + (cell->y - center->y) * (cell->y - center->y) <
+      (best->x - center->x) * (best->x - center->x) + (best->y - center->y) * (best->y - center->y))
+    *best = *cell;
+}
+
+int msPolygonPoleOfInaccessibility(shapeObj *p, pointObj *lp, double precision, double min_dimension)
+{
+  double width, height, cellsize, x, y, maxd;
+  int i, numpoints = 0, maxprobes, probes = 0, numcells = 0, maxcells;
+  poleCellObj *heap, best, cell;
+  pointObj center;
+
+  msComputeBounds(p);
+  width = p->bounds.maxx - p->bounds.minx;
+  height = p->bounds.maxy - p->bounds.miny;
+  if(min_dimension > 0)
+    if(MS_MIN(width,height) < min_dimension) return(MS_FAILURE);
+
+  cellsize = MS_MIN(width, height);
+  if(cellsize <= 0) return(MS_FAILURE);
+  if((width / cellsize) * (height / cellsize) > MS_POLE_INITIAL_CELLS)
+    cellsize = sqrt(width * height / MS_POLE_INITIAL_CELLS);
+
+  for(i=0; i<p->numlines; i++)
+    numpoints += p->line[i].numpoints;
+  maxprobes = MS_MAX(MS_POLE_MIN_PROBES, MS_POLE_SEGMENT_BUDGET / MS_MAX(numpoints,1));
+  if(precision <= 0) precision = 1;
+
+  /* every probe but the initial ones adds at most 3 cells to the queue */
+  maxcells = (int)((ceil(width / cellsize) + 1) * (ceil(height / cellsize) + 1)) + 3 * maxprobes + 4;
+  heap = (poleCellObj *) malloc(maxcells * sizeof(poleCellObj));
+  MS_CHECK_ALLOC(heap, maxcells * sizeof(poleCellObj), MS_FAILURE);
+
+  /* start from the center of gravity, or the center of the bounds */
+  if(getPolygonCenterOfGravity(p, &center) != MS_SUCCESS) {
+    center.x = (p->bounds.minx + p->bounds.maxx) / 2;
+    center.y = (p->bounds.miny + p->bounds.maxy) / 2;
+  }
+  poleInitCell(&best, p, center.x, center.y, 0);
+  maxd = best.d;
+
+  for(x = p->bounds.minx; x < p->bounds.maxx; x += cellsize) {
+    for(y = p->bounds.miny; y < p->bounds.maxy; y += cellsize) {
+      poleInitCell(&cell, p, x + cellsize / 2, y + cellsize / 2, cellsize / 2);
+      polePushCell(heap, &numcells, &cell);
+      probes++;
+    }
+  }
+
+  while(numcells > 0 && probes < maxprobes) {
+    double h;
+    polePopCell(heap, &numcells, &cell);
+    poleKeepBest(&best, &maxd, &cell, &center, precision);
+    if(cell.max - maxd <= precision) continue; /* no better point in this cell */
+
+    h = cell.h / 2;
+    for(i=0; i<4; i++) {
+      poleCellObj sub;
+      poleInitCell(&sub, p, cell.x + ((i & 1) ? h : -h), cell.y + ((i & 2) ? h : -h), h);
+      if(sub.max > maxd) polePushCell(heap, &numcells, &sub);
+      probes++;
+    }
+  }
+  while(numcells > 0) { /* the budget ran out, queued cells may still hold a better center */
+    polePopCell(heap, &numcells, &cell);
+    poleKeepBest(&best, &maxd, &cell, &center, precision);
+  }
+  free(heap);
+
+  if(best.d <= 0) return(MS_FAILURE); /* no point found inside the polygon */
+
+  lp->x = best.x;
+  lp->y = best.y;
+  return(MS_SUCCESS);
+}
+
 /* Compute all the lineString/segment lengths and determine the longest lineString of a multiLineString
  * shape: in paramater, the multiLineString to compute.
- * struct polyline_lengths pll: out parameter, all line and segment lengths
+ * struct polyline_lengths pll: out parameter, all line and segment lengths, to be freed with
+ * msPolylineFreeLineSegments(). They can be shared by all the labels of the shape.
 */
 void msPolylineComputeLineSegments(shapeObj *shape, struct polyline_lengths *pll)
 {
@@ -1560,17 +2199,24 @@ void msPolylineComputeLineSegments(shapeObj *shape, struct polyline_lengths *pll
     struct line_lengths *ll = &pll->ll[i];
     double max_subline_segment_length = 0;
     
-    if(shape->line[i].numpoints > 1) {
-      ll->segment_lengths = (double*) msSmallMalloc(sizeof(double) * (shape->line[i].numpoints - 1));
+    int n = shape->line[i].numpoints;
+
+    if(n > 1) {
+      /* one block for the segment lengths and the lengths to each end of the line */
+      ll->segment_lengths = (double*) msSmallMalloc(sizeof(double) * (3 * n - 1));
+      ll->cumulative_lengths = ll->segment_lengths + n - 1;
+      ll->reverse_lengths = ll->cumulative_lengths + n;
+      ll->cumulative_lengths[0] = 0;
     } else {
-      ll->segment_lengths = NULL;
+      ll->segment_lengths = ll->cumulative_lengths = ll->reverse_lengths = NULL;
     }
     ll->total_length = 0;
     
-    for(j=1; j<shape->line[i].numpoints; j++) {
+    for(j=1; j<n; j++) {
       segment_length = sqrt((((shape->line[i].point[j].x-shape->line[i].point[j-1].x)*(shape->line[i].point[j].x-shape->line[i].point[j-1].x)) + ((shape->line[i].point[j].y-shape->line[i].point[j-1].y)*(shape->line[i].point[j].y-shape->line[i].point[j-1].y))));
       ll->total_length += segment_length;
       ll->segment_lengths[j-1] = segment_length;
+      ll->cumulative_lengths[j] = ll->total_length;
       if(segment_length > max_subline_segment_length) {
         max_subline_segment_length = segment_length;
         ll->longest_segment_index = j;
@@ -1581,6 +2227,12 @@ void msPolylineComputeLineSegments(shapeObj *shape, struct polyline_lengths *pll
         pll->longest_segment_point_index = j;
       }
     }
+    if(n > 1) {
+      /* summed from the end, as walking the line backwards from its last point would */
+      ll->reverse_lengths[n-1] = 0;
+      for(j=n-2; j>=0; j--)
+        ll->reverse_lengths[j] = ll->reverse_lengths[j+1] + ll->segment_lengths[j];
+    }
     pll->total_length += ll->total_length;
 
     if(ll->total_length > max_line_length) {
@@ -1590,11 +2242,59 @@ void msPolylineComputeLineSegments(shapeObj *shape, struct polyline_lengths *pll
   }
 }
 
+void msPolylineFreeLineSegments(shapeObj *shape, struct polyline_lengths *pll)
+{
+  int i;
+
+  for(i=0; i<shape->numlines; i++)
+    free(pll->ll[i].segment_lengths);
+  free(pll->ll);
+  pll->ll = NULL;
+}
+
+/*
+** Index of the first point at least position away from the start of the line,
+** i.e. where stepping forward segment by segment reaches position.
+*/
+static int lineLengthsForwardIndex(const struct line_lengths *ll, int numpoints, double position)
+{
+  int lo = 0, hi = numpoints - 1;
+
+  if(ll->cumulative_lengths[hi] < position) return hi;
+  while(lo < hi) {
+    int mid = (lo + hi) / 2;
+    if(ll->cumulative_lengths[mid] >= position)
+      hi = mid;
+    else
+      lo = mid + 1;
+  }
+  return lo;
+}
+
+/*
+** Index of the last point at least position away from the end of the line,
+** i.e. where stepping backward segment by segment reaches position.
+*/
+static int lineLengthsReverseIndex(const struct line_lengths *ll, int numpoints, double position)
+{
+  int lo = 0, hi = numpoints - 1;
+
+  if(ll->reverse_lengths[0] < position) return 0;
+  while(lo < hi) {
+    int mid = (lo + hi + 1) / 2;
+    if(ll->reverse_lengths[mid] >= position)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  return lo;
+}
+
 /*
 ** If no repeatdistance, find center of longest segment in polyline p. The polyline must have been converted
 ** to image coordinates before calling this function.
 */
-int msPolylineLabelPoint(mapObj *map, shapeObj *p, textSymbolObj *ts, labelObj *label, struct label_auto_result *lar, double resolutionfactor)
+int msPolylineLabelPoint(mapObj *map, shapeObj *p, struct polyline_lengths *shared_pll, textSymbolObj *ts, labelObj *label, struct label_auto_result *lar, double resolutionfactor)
 {
   struct polyline_lengths pll;
   int i, ret = MS_SUCCESS;
@@ -1619,7 +2319,10 @@ int msPolylineLabelPoint(mapObj *map, shapeObj *p, textSymbolObj *ts, labelObj *
     - check that each line is longer than the text length if using minfeaturesize auto
     - check that each line is long enough if using minfeaturesize
    */
-  msPolylineComputeLineSegments(p, &pll);
+  if(shared_pll)
+    pll = *shared_pll;
+  else
+    msPolylineComputeLineSegments(p, &pll);
 
   if(label && label->repeatdistance > 0) {
     for(i=0; i<p->numlines; i++) {
@@ -1634,11 +2337,8 @@ int msPolylineLabelPoint(mapObj *map, shapeObj *p, textSymbolObj *ts, labelObj *
     }
   }
 
-  /* freeing memory: allocated by msPolylineComputeLineSegments */
-  for ( i = 0; i < p->numlines; i++ ) {
-    free(pll.ll[i].segment_lengths);
-  }
-  free(pll.ll);
+  if(!shared_pll)
+    msPolylineFreeLineSegments(p, &pll);
   
   return ret;
 }
@@ -1695,11 +2395,8 @@ int msLineLabelPoint(mapObj *map, lineObj *p, textSymbolObj *ts, struct line_len
         lar->label_points[lar->num_label_points].x = (p->point[j-1].x + p->point[j].x)/2.0;
         lar->label_points[lar->num_label_points].y = (p->point[j-1].y + p->point[j].y)/2.0;
       } else {
-        j=0;
-        fwd_length = 0;
-        while (fwd_length < point_position) {
-          fwd_length += ll->segment_lengths[j++];
-        }
+        j = lineLengthsForwardIndex(ll, p->numpoints, point_position);
+        fwd_length = ll->cumulative_lengths[j];
         assert(j>0);
 
         t = 1 - (fwd_length - point_position) / ll->segment_lengths[j-1];
@@ -1741,7 +2438,7 @@ int msLineLabelPoint(mapObj *map, lineObj *p, textSymbolObj *ts, struct line_len
 
 
 /* Calculate the labelpath for each line if repeatdistance is enabled, else the labelpath of the longest line segment */
-int msPolylineLabelPath(mapObj *map, imageObj *image, shapeObj *p, textSymbolObj *ts, labelObj *label, struct label_follow_result *lfr)
+int msPolylineLabelPath(mapObj *map, imageObj *image, shapeObj *p, struct polyline_lengths *shared_pll, textSymbolObj *ts, labelObj *label, struct label_follow_result *lfr)
 {
   struct polyline_lengths pll;
   int i,ret = MS_SUCCESS;
@@ -1770,6 +2467,7 @@ int msPolylineLabelPath(mapObj *map, imageObj *image, shapeObj *p, textSymbolObj
     }
     p = msOffsetPolyline(p,offset, MS_STYLE_SINGLE_SIDED_OFFSET);
     if(!p) return MS_FAILURE;
+    shared_pll = NULL; /* the lengths are those of the original line */
   }
 
   /* compute line lengths, in order to:
@@ -1777,7 +2475,10 @@ int msPolylineLabelPath(mapObj *map, imageObj *image, shapeObj *p, textSymbolObj
     - check that each line is longer than the text length if using minfeaturesize auto
     - check that each line is long enough if using minfeaturesize
    */
-  msPolylineComputeLineSegments(p, &pll);
+  if(shared_pll)
+    pll = *shared_pll;
+  else
+    msPolylineComputeLineSegments(p, &pll);
  
   if(label->autominfeaturesize) {
     if(!ts->textpath) {
@@ -1803,11 +2504,8 @@ int msPolylineLabelPath(mapObj *map, imageObj *image, shapeObj *p, textSymbolObj
     }
   }
 
-  /* freeing memory: allocated by msPolylineComputeLineSegments */
-  for ( i = 0; i < p->numlines; i++ ) {
-    free(pll.ll[i].segment_lengths);
-  }
-  free(pll.ll);
+  if(!shared_pll)
+    msPolylineFreeLineSegments(p, &pll);
   
   if(IS_PERPENDICULAR_OFFSET(label->offsety) && label->offsetx != 0) {
      msFreeShape(p);
@@ -2008,19 +2706,16 @@ int msLineLabelPath(mapObj *map, imageObj *img, lineObj *p, textSymbolObj *ts, s
       j = 0;
       fwd_line_length = 0;
       if(text_start_length >= 0.0) {
-        while ( fwd_line_length < text_start_length )
-          fwd_line_length += ll->segment_lengths[j++];
-        
+        j = lineLengthsForwardIndex(ll, p->numpoints, text_start_length);
+        fwd_line_length = ll->cumulative_lengths[j];
         j--;
       }
       final_j = p->numpoints - 1;
       rev_line_length = 0;
       if(text_start_length+text_length <= ll->total_length) {
         text_end_length = ll->total_length - (text_start_length + text_length);
-        while(rev_line_length < text_end_length) {
-          rev_line_length += ll->segment_lengths[final_j - 1];
-          final_j--;
-        }
+        final_j = lineLengthsReverseIndex(ll, p->numpoints, text_end_length);
+        rev_line_length = ll->reverse_lengths[final_j];
         final_j++;
       }
       
@@ -74,6 +74,7 @@ typedef struct {
   lineObj *line;
   char **values;
   void *geometry;
+  void *prepared_geometry;
   void *renderer_cache;
 #endif
 
@@ -94,6 +95,11 @@ typedef struct {
 
 typedef lineObj multipointObj;
 
+#ifndef SWIG
+/* recycled shape arrays, see msCreateShapePool() */
+typedef struct shapePoolObj shapePoolObj;
+#endif
+
 #ifndef SWIG
 /* attribute primatives */
 typedef struct {
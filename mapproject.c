@@ -30,6 +30,7 @@
 #include "mapserver.h"
 #include "mapproject.h"
 #include "mapthread.h"
+#include "uthash.h"
 #include <assert.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -38,7 +39,8 @@
 
 
 #ifdef USE_PROJ
-static int msTestNeedWrap( pointObj pt1, pointObj pt2, pointObj pt2_geo,
+static int msTestNeedWrap( pointObj pt1, pointObj pt1_geo,
+                           pointObj pt2, pointObj pt2_proj, pointObj pt2_geo,
                            projectionObj *src_proj,
                            projectionObj *dst_proj );
 #endif
@@ -108,7 +110,7 @@ int msProjectPoint(projectionObj *in, projectionObj *out, pointObj *point)
 #if PJ_VERSION < 480
     msAcquireLock( TLOCK_PROJ );
 #endif
-    error = pj_transform( in->proj, out->proj, 1, 0,
+    error = pj_transform( msGetThreadProjection(in, out), msGetThreadProjection(out, in), 1, 0,
                           &(point->x), &(point->y), &z );
 #if PJ_VERSION < 480
     msReleaseLock( TLOCK_PROJ );
@@ -144,15 +146,15 @@ int msProjectPoint(projectionObj *in, projectionObj *out, pointObj *point)
     if(in==NULL || in->proj==NULL) { /* input coordinates are lat/lon */
       p.u *= DEG_TO_RAD; /* convert to radians */
       p.v *= DEG_TO_RAD;
-      p = pj_fwd(p, out->proj);
+      p = pj_fwd(p, msGetThreadProjection(out, NULL));
     } else {
       if(out==NULL || out->proj==NULL) { /* output coordinates are lat/lon */
-        p = pj_inv(p, in->proj);
+        p = pj_inv(p, msGetThreadProjection(in, NULL));
         p.u *= RAD_TO_DEG; /* convert to decimal degrees */
         p.v *= RAD_TO_DEG;
       } else { /* need to go from one projection to another */
-        p = pj_inv(p, in->proj);
-        p = pj_fwd(p, out->proj);
+        p = pj_inv(p, msGetThreadProjection(in, out));
+        p = pj_fwd(p, msGetThreadProjection(out, in));
       }
     }
 
@@ -307,6 +309,8 @@ msProjectShapeLine(projectionObj *in, projectionObj *out,
   int numpoints_in = line->numpoints;
   int line_alloc = numpoints_in;
   int wrap_test;
+  pointObj  thisProjPoint, lastProjPoint; /* as projected, before any wrap */
+  int last_err = MS_FAILURE;
 
 #ifdef USE_PROJ_FASTPATHS
 #define MAXEXTENT 20037508.34
@@ -351,6 +355,7 @@ msProjectShapeLine(projectionObj *in, projectionObj *out,
   line->numpoints = 0;
 
   memset( &lastPoint, 0, sizeof(lastPoint) );
+  memset( &lastProjPoint, 0, sizeof(lastProjPoint) );
 
   /* -------------------------------------------------------------------- */
   /*      Loop over all input points in linestring.                       */
@@ -360,9 +365,12 @@ msProjectShapeLine(projectionObj *in, projectionObj *out,
     wrkPoint = thisPoint = line->point[i];
 
     ms_err = msProjectPoint(in, out, &wrkPoint );
+    thisProjPoint = wrkPoint;
 
     /* -------------------------------------------------------------------- */
-    /*      Apply wrap logic.                                               */
+    /*      Apply wrap logic.  The geographic positions of both ends of     */
+    /*      the segment are already known, so only a jump of more than      */
+    /*      180 degrees costs another transform (of the segment middle).    */
     /* -------------------------------------------------------------------- */
     if( wrap_test && i > 0 && ms_err != MS_FAILURE ) {
       double dist;
@@ -374,9 +382,9 @@ msProjectShapeLine(projectionObj *in, projectionObj *out,
         pt1Geo = wrkPoint; /* this is a cop out */
 
       dist = wrkPoint.x - pt1Geo.x;
-      if( fabs(dist) > 180.0
-          && msTestNeedWrap( thisPoint, lastPoint,
-                             pt1Geo, in, out ) ) {
+      if( fabs(dist) > 180.0 && last_err != MS_FAILURE
+          && msTestNeedWrap( thisPoint, thisProjPoint, lastPoint,
+                             lastProjPoint, pt1Geo, in, out ) ) {
         if( dist > 0.0 )
           wrkPoint.x -= 360.0;
         else if( dist < 0.0 )
@@ -480,6 +488,8 @@ msProjectShapeLine(projectionObj *in, projectionObj *out,
     }
 
     lastPoint = thisPoint;
+    lastProjPoint = thisProjPoint;
+    last_err = ms_err;
   }
 
   /* -------------------------------------------------------------------- */
@@ -499,13 +509,131 @@ msProjectShapeLine(projectionObj *in, projectionObj *out,
 }
 #endif
 
+/************************************************************************/
+/*                         msProjectLinesBulk()                         */
+/*                                                                      */
+/*      Projects the points of numlines lines with a single call to     */
+/*      pj_transform() on coordinate arrays, instead of one call per    */
+/*      point. Only the plain case is handled: if any point fails to    */
+/*      project, or if wrap_test is set and two consecutive points      */
+/*      end up over 180 degrees apart, the lines are left untouched     */
+/*      and MS_FAILURE is returned so that the point by point code,     */
+/*      which deals with the horizon and the dateline, is used.         */
+/************************************************************************/
+
+#ifdef USE_PROJ
+static int msProjectLinesBulk(projectionObj *in, projectionObj *out,
+                              lineObj *lines, int numlines, int wrap_test)
+{
+  int i, j, k, numpoints = 0, error;
+  double *x, *y, *z;
+
+  if( in == NULL || in->proj == NULL || out == NULL || out->proj == NULL )
+    return MS_FAILURE;
+  if( in->numargs == 1 && out->numargs == 1
+      && strcmp(in->args[0],out->args[0]) == 0 )
+    return MS_FAILURE;
+
+  for( i = 0; i < numlines; i++ )
+    numpoints += lines[i].numpoints;
+  if( numpoints < 2 )
+    return MS_FAILURE;
+
+  x = (double *) msSmallMalloc(sizeof(double) * numpoints * 3);
+  y = x + numpoints;
+  z = y + numpoints;
+
+  for( i = 0, k = 0; i < numlines; i++ ) {
+    for( j = 0; j < lines[i].numpoints; j++, k++ ) {
+      x[k] = lines[i].point[j].x;
+      y[k] = lines[i].point[j].y;
+    }
+  }
+  memset( z, 0, sizeof(double) * numpoints );
+
+  if( in->gt.need_geotransform ) {
+    const double *gt = in->gt.geotransform;
+    for( k = 0; k < numpoints; k++ ) {
+      double x_out = gt[0] + gt[1] * x[k] + gt[2] * y[k];
+      y[k] = gt[3] + gt[4] * x[k] + gt[5] * y[k];
+      x[k] = x_out;
+    }
+  }
+
+  if( pj_is_latlong(in->proj) ) {
+    for( k = 0; k < numpoints; k++ ) {
+      x[k] *= DEG_TO_RAD;
+      y[k] *= DEG_TO_RAD;
+    }
+  }
+
+#if PJ_VERSION < 480
+  msAcquireLock( TLOCK_PROJ );
+#endif
+  error = pj_transform( msGetThreadProjection(in, out), msGetThreadProjection(out, in),
+                        numpoints, 1, x, y, z );
+#if PJ_VERSION < 480
+  msReleaseLock( TLOCK_PROJ );
+#endif
+
+  for( k = 0; k < numpoints && !error; k++ ) {
+    if( x[k] == HUGE_VAL || y[k] == HUGE_VAL )
+      error = 1;
+  }
+  if( error ) {
+    free( x );
+    return MS_FAILURE;
+  }
+
+  if( pj_is_latlong(out->proj) ) {
+    for( k = 0; k < numpoints; k++ ) {
+      x[k] *= RAD_TO_DEG;
+      y[k] *= RAD_TO_DEG;
+    }
+  }
+
+  if( out->gt.need_geotransform ) {
+    const double *gt = out->gt.invgeotransform;
+    for( k = 0; k < numpoints; k++ ) {
+      double x_out = gt[0] + gt[1] * x[k] + gt[2] * y[k];
+      y[k] = gt[3] + gt[4] * x[k] + gt[5] * y[k];
+      x[k] = x_out;
+    }
+  }
+
+  /* a line that crosses the dateline needs the wrap logic of msProjectShapeLine() */
+  if( wrap_test ) {
+    for( i = 0, k = 0; i < numlines; i++ ) {
+      int jump = 0;
+      for( j = 1; j < lines[i].numpoints; j++ )
+        jump |= fabs(x[k+j] - x[k+j-1]) > 180.0;
+      if( jump ) {
+        free( x );
+        return MS_FAILURE;
+      }
+      k += lines[i].numpoints;
+    }
+  }
+
+  for( i = 0, k = 0; i < numlines; i++ ) {
+    for( j = 0; j < lines[i].numpoints; j++, k++ ) {
+      lines[i].point[j].x = x[k];
+      lines[i].point[j].y = y[k];
+    }
+  }
+
+  free( x );
+  return MS_SUCCESS;
+}
+#endif
+
 /************************************************************************/
 /*                           msProjectShape()                           */
 /************************************************************************/
 int msProjectShape(projectionObj *in, projectionObj *out, shapeObj *shape)
 {
 #ifdef USE_PROJ
-  int i;
+  int i, wrap_test;
 #ifdef USE_PROJ_FASTPATHS
   int j;
 
@@ -545,7 +673,24 @@ int msProjectShape(projectionObj *in, projectionObj *out, shapeObj *shape)
 #undef p_y
 #endif
 
-
+  /* try all the points at once first, msProjectLine() wraps points differently */
+  wrap_test = out != NULL && out->proj != NULL && pj_is_latlong(out->proj)
+              && in != NULL && in->proj != NULL && !pj_is_latlong(in->proj);
+  if( (!wrap_test || shape->type == MS_SHAPE_LINE || shape->type == MS_SHAPE_POLYGON)
+      && msProjectLinesBulk( in, out, shape->line, shape->numlines, wrap_test ) == MS_SUCCESS ) {
+    /* same as msProjectShapeLine() */
+    for( i = 0; i < shape->numlines && shape->type == MS_SHAPE_POLYGON; i++ ) {
+      lineObj *line = shape->line + i;
+      if( line->numpoints > 2
+          && (line->point[0].x != line->point[line->numpoints-1].x
+              || line->point[0].y != line->point[line->numpoints-1].y) ) {
+        pointObj sFirstPoint = line->point[0];
+        msAddPointToLine( line, &sFirstPoint );
+      }
+    }
+    msComputeBounds( shape );
+    return(MS_SUCCESS);
+  }
 
   for( i = shape->numlines-1; i >= 0; i-- ) {
     if( shape->type == MS_SHAPE_LINE || shape->type == MS_SHAPE_POLYGON ) {
@@ -588,6 +733,7 @@ int msProjectLine(projectionObj *in, projectionObj *out, lineObj *line)
 
   if( be_careful ) {
     pointObj  startPoint, thisPoint; /* locations in projected space */
+    int start_err = MS_FAILURE, ms_err;
 
     startPoint = line->point[0];
 
@@ -600,12 +746,14 @@ int msProjectLine(projectionObj *in, projectionObj *out, lineObj *line)
       ** Read comments before msTestNeedWrap() to better understand
       ** this dateline wrapping logic.
       */
-      msProjectPoint(in, out, &(line->point[i]));
-      if( i > 0 ) {
+      ms_err = msProjectPoint(in, out, &(line->point[i]));
+      if( i == 0 )
+        start_err = ms_err;
+      else if( ms_err != MS_FAILURE && start_err != MS_FAILURE ) {
         dist = line->point[i].x - line->point[0].x;
         if( fabs(dist) > 180.0 ) {
-          if( msTestNeedWrap( thisPoint, startPoint,
-                              line->point[0], in, out ) ) {
+          if( msTestNeedWrap( thisPoint, line->point[i], startPoint,
+                              line->point[0], line->point[0], in, out ) ) {
             if( dist > 0.0 ) {
               line->point[i].x -= 360.0;
             } else if( dist < 0.0 ) {
@@ -617,6 +765,9 @@ int msProjectLine(projectionObj *in, projectionObj *out, lineObj *line)
       }
     }
   } else {
+    if( msProjectLinesBulk( in, out, line, 1, MS_FALSE ) == MS_SUCCESS )
+      return(MS_SUCCESS);
+
     for(i=0; i<line->numpoints; i++) {
       if( msProjectPoint(in, out, &(line->point[i])) == MS_FAILURE )
         return MS_FAILURE;
@@ -630,6 +781,237 @@ int msProjectLine(projectionObj *in, projectionObj *out, lineObj *line)
 #endif
 }
 
+/************************************************************************/
+/*                         msCreateProjApprox()                         */
+/*                                                                      */
+/*      Sets up a grid of nx by ny cells over extent (in the source     */
+/*      projection) for msProjectShapeApprox(). Like the approximate    */
+/*      transformer used to warp rasters, vertices are interpolated     */
+/*      from exactly projected points, but here bilinearly within a     */
+/*      grid cell so that any vertex can be handled. A cell is only     */
+/*      interpolated if the error at its center is below maxerror;      */
+/*      nodes and cells are evaluated the first time a vertex falls     */
+/*      in them. Returns NULL if the grid would not help.               */
+/************************************************************************/
+
+projApproxObj *msCreateProjApprox(projectionObj *in, projectionObj *out, rectObj *extent,
+                                  int nx, int ny, double maxerror)
+{
+#ifdef USE_PROJ
+  projApproxObj *approx;
+  int numnodes;
+
+  if( in == NULL || in->proj == NULL || out == NULL || out->proj == NULL
+      || nx < 1 || ny < 1 || !(maxerror > 0) )
+    return NULL;
+
+  if( !(extent->maxx > extent->minx) || !(extent->maxy > extent->miny) )
+    return NULL;
+
+  /* dateline wrapping decisions need every vertex projected */
+  if( pj_is_latlong(out->proj) && !pj_is_latlong(in->proj) )
+    return NULL;
+
+#ifdef USE_PROJ_FASTPATHS
+  if( in->wellknownprojection != wkp_none && out->wellknownprojection != wkp_none )
+    return NULL;
+#endif
+
+  numnodes = (nx+1) * (ny+1);
+
+  approx = (projApproxObj *) msSmallCalloc(1, sizeof(projApproxObj));
+  approx->extent = *extent;
+  approx->nx = nx;
+  approx->ny = ny;
+  approx->cellx = (extent->maxx - extent->minx) / nx;
+  approx->celly = (extent->maxy - extent->miny) / ny;
+  approx->maxerror = maxerror;
+  approx->nodex = (double *) msSmallMalloc(sizeof(double) * numnodes);
+  approx->nodey = (double *) msSmallMalloc(sizeof(double) * numnodes);
+  approx->nodestate = (char *) msSmallCalloc(numnodes, sizeof(char));
+  approx->cellstate = (char *) msSmallCalloc(nx * ny, sizeof(char));
+
+  return approx;
+#else
+  return NULL;
+#endif
+}
+
+/************************************************************************/
+/*                          msFreeProjApprox()                          */
+/************************************************************************/
+
+void msFreeProjApprox(projApproxObj *approx)
+{
+  if( approx == NULL )
+    return;
+
+  free( approx->nodex );
+  free( approx->nodey );
+  free( approx->nodestate );
+  free( approx->cellstate );
+  free( approx );
+}
+
+#ifdef USE_PROJ
+/************************************************************************/
+/*                         msProjApproxNode()                           */
+/************************************************************************/
+
+static int msProjApproxNode(projectionObj *in, projectionObj *out,
+                            projApproxObj *approx, int node)
+{
+  if( approx->nodestate[node] == 0 ) {
+    pointObj pt;
+
+    memset( &pt, 0, sizeof(pt) );
+    pt.x = approx->extent.minx + (node % (approx->nx+1)) * approx->cellx;
+    pt.y = approx->extent.miny + (node / (approx->nx+1)) * approx->celly;
+
+    if( msProjectPoint(in, out, &pt) == MS_SUCCESS ) {
+      approx->nodex[node] = pt.x;
+      approx->nodey[node] = pt.y;
+      approx->nodestate[node] = 1;
+    } else {
+      approx->nodestate[node] = 2;
+    }
+  }
+
+  return approx->nodestate[node] == 1;
+}
+
+/************************************************************************/
+/*                         msProjApproxCell()                           */
+/*                                                                      */
+/*      Projects the corners and the center of a cell, and tells if     */
+/*      the center is close enough to what interpolating the corners    */
+/*      gives.                                                          */
+/************************************************************************/
+
+static int msProjApproxCell(projectionObj *in, projectionObj *out,
+                            projApproxObj *approx, int cx, int cy)
+{
+  char *state = approx->cellstate + cy * approx->nx + cx;
+
+  if( *state == 0 ) {
+    int n00 = cy * (approx->nx+1) + cx, n01 = n00 + approx->nx + 1;
+    pointObj center;
+
+    *state = 2;
+
+    if( !msProjApproxNode(in, out, approx, n00) || !msProjApproxNode(in, out, approx, n00+1)
+        || !msProjApproxNode(in, out, approx, n01) || !msProjApproxNode(in, out, approx, n01+1) )
+      return MS_FALSE;
+
+    memset( &center, 0, sizeof(center) );
+    center.x = approx->extent.minx + (cx + 0.5) * approx->cellx;
+    center.y = approx->extent.miny + (cy + 0.5) * approx->celly;
+    if( msProjectPoint(in, out, &center) != MS_SUCCESS )
+      return MS_FALSE;
+
+    if( fabs((approx->nodex[n00] + approx->nodex[n00+1] + approx->nodex[n01] + approx->nodex[n01+1]) / 4 - center.x)
+        + fabs((approx->nodey[n00] + approx->nodey[n00+1] + approx->nodey[n01] + approx->nodey[n01+1]) / 4 - center.y)
+        <= approx->maxerror )
+      *state = 1;
+  }
+
+  return *state == 1;
+}
+
+/************************************************************************/
+/*                         msProjApproxPoint()                          */
+/************************************************************************/
+
+static int msProjApproxPoint(projectionObj *in, projectionObj *out,
+                             projApproxObj *approx, pointObj *point)
+{
+  double fx = (point->x - approx->extent.minx) / approx->cellx;
+  double fy = (point->y - approx->extent.miny) / approx->celly;
+  int cx, cy, n00, n01;
+
+  /* written so that NaN coordinates are projected exactly too */
+  if( !(fx >= 0 && fx < approx->nx && fy >= 0 && fy < approx->ny) ) {
+    approx->numexact++;
+    return msProjectPoint(in, out, point);
+  }
+
+  cx = (int) fx;
+  cy = (int) fy;
+  if( !msProjApproxCell(in, out, approx, cx, cy) ) {
+    approx->numexact++;
+    return msProjectPoint(in, out, point);
+  }
+
+  fx -= cx;
+  fy -= cy;
+  n00 = cy * (approx->nx+1) + cx;
+  n01 = n00 + approx->nx + 1;
+
+  point->x = (1-fy) * ((1-fx) * approx->nodex[n00] + fx * approx->nodex[n00+1])
+             + fy * ((1-fx) * approx->nodex[n01] + fx * approx->nodex[n01+1]);
+  point->y = (1-fy) * ((1-fx) * approx->nodey[n00] + fx * approx->nodey[n00+1])
+             + fy * ((1-fx) * approx->nodey[n01] + fx * approx->nodey[n01+1]);
+  approx->numinterpolated++;
+
+  return MS_SUCCESS;
+}
+#endif
+
+/************************************************************************/
+/*                        msProjectShapeApprox()                        */
+/*                                                                      */
+/*      Same as msProjectShape(), using the approximation grid when     */
+/*      one is given. A line is projected in a scratch copy first: if   */
+/*      any of its vertices fails it is handed untouched to the exact   */
+/*      code, which knows how to deal with the horizon.                 */
+/************************************************************************/
+
+int msProjectShapeApprox(projectionObj *in, projectionObj *out,
+                         projApproxObj *approx, shapeObj *shape)
+{
+#ifdef USE_PROJ
+  int i, j, maxpoints = 0;
+  pointObj *points;
+
+  if( approx == NULL )
+    return msProjectShape( in, out, shape );
+
+  for( i = 0; i < shape->numlines; i++ )
+    maxpoints = MS_MAX(maxpoints, shape->line[i].numpoints);
+  points = (pointObj *) msSmallMalloc(sizeof(pointObj) * MS_MAX(maxpoints, 1));
+
+  for( i = shape->numlines-1; i >= 0; i-- ) {
+    lineObj *line = shape->line + i;
+    int status = MS_SUCCESS;
+
+    memcpy( points, line->point, sizeof(pointObj) * line->numpoints );
+    for( j = 0; j < line->numpoints && status == MS_SUCCESS; j++ )
+      status = msProjApproxPoint( in, out, approx, points + j );
+
+    if( status == MS_SUCCESS ) {
+      memcpy( line->point, points, sizeof(pointObj) * line->numpoints );
+    } else if( shape->type == MS_SHAPE_LINE || shape->type == MS_SHAPE_POLYGON ) {
+      if( msProjectShapeLine( in, out, shape, i ) == MS_FAILURE )
+        msShapeDeleteLine( shape, i );
+    } else if( msProjectLine(in, out, shape->line+i ) == MS_FAILURE ) {
+      msShapeDeleteLine( shape, i );
+    }
+  }
+
+  free( points );
+
+  if( shape->numlines == 0 ) {
+    msFreeShape( shape );
+    return MS_FAILURE;
+  } else {
+    msComputeBounds( shape );
+    return(MS_SUCCESS);
+  }
+#else
+  return msProjectShape( in, out, shape );
+#endif
+}
+
 /************************************************************************/
 /*                           msProjectRectGrid()                        */
 /************************************************************************/
@@ -942,6 +1324,78 @@ msProjectRectAsPolygon(projectionObj *in, projectionObj *out,
 #endif
 }
 
+#ifdef USE_PROJ
+/************************************************************************/
+/*                         Projected rect cache                         */
+/*                                                                      */
+/*      msProjectRect() samples and projects many points, and sets up   */
+/*      two "+over" copies of the projections to do so. The same layer  */
+/*      extents, BBOXes and tile grids come back again and again, so    */
+/*      the results are kept in a small LRU keyed on both projections   */
+/*      (arguments and geotransform) and the rect.                      */
+/************************************************************************/
+
+#define MS_PROJ_RECT_CACHE_MAX 256
+
+typedef struct {
+  char *key;
+  rectObj rect;
+  UT_hash_handle hh;
+} projRectCacheObj;
+
+static projRectCacheObj *projRectCache = NULL;
+static int projRectCacheCount = 0;
+
+static size_t msProjRectCacheKeyPart(char *key, projectionObj *p)
+{
+  size_t len = 0;
+  int i;
+
+  if(p == NULL)
+    return key ? sprintf(key, "-\x1f") : 3;
+
+  for(i=0; i<p->numargs; i++) {
+    if(key) len += sprintf(key + len, "%s ", p->args[i]);
+    else len += strlen(p->args[i]) + 1;
+  }
+  if(p->gt.need_geotransform) {
+    for(i=0; i<6; i++) {
+      if(key) len += sprintf(key + len, "%.17g,", p->gt.geotransform[i]);
+      else len += 26;
+    }
+  }
+  if(key) len += sprintf(key + len, "\x1f");
+  else len += 2;
+  return len;
+}
+
+static char *msProjRectCacheKey(projectionObj *in, projectionObj *out, rectObj *rect)
+{
+  char *key = (char *) msSmallMalloc(msProjRectCacheKeyPart(NULL, in) + msProjRectCacheKeyPart(NULL, out) + 4 * 26 + 1);
+  size_t len = msProjRectCacheKeyPart(key, in);
+
+  len += msProjRectCacheKeyPart(key + len, out);
+  sprintf(key + len, "%.17g %.17g %.17g %.17g", rect->minx, rect->miny, rect->maxx, rect->maxy);
+  return key;
+}
+
+static void msProjRectCacheFree(projRectCacheObj *entry)
+{
+  UT_HASH_DEL(projRectCache, entry);
+  free(entry->key);
+  free(entry);
+  projRectCacheCount--;
+}
+
+void msProjectRectCacheCleanup(void)
+{
+  msAcquireLock( TLOCK_PROJRECT );
+  while(projRectCache)
+    msProjRectCacheFree(projRectCache);
+  msReleaseLock( TLOCK_PROJRECT );
+}
+#endif
+
 /************************************************************************/
 /*                           msProjectRect()                            */
 /************************************************************************/
@@ -954,6 +1408,23 @@ int msProjectRect(projectionObj *in, projectionObj *out, rectObj *rect)
   char *over = "+over";
   int ret;
   projectionObj in_over,out_over,*inp,*outp;
+#ifdef USE_PROJ
+  projRectCacheObj *entry = NULL;
+  char *key = msProjRectCacheKey(in, out, rect);
+
+  msAcquireLock( TLOCK_PROJRECT );
+  UT_HASH_FIND_STR(projRectCache, key, entry);
+  if(entry) {
+    /* most recently used last */
+    UT_HASH_DEL(projRectCache, entry);
+    UT_HASH_ADD_KEYPTR(hh, projRectCache, entry->key, strlen(entry->key), entry);
+    *rect = entry->rect;
+    msReleaseLock( TLOCK_PROJRECT );
+    free(key);
+    return MS_SUCCESS;
+  }
+  msReleaseLock( TLOCK_PROJRECT );
+#endif
   /* 
    * Issue #4892: When projecting a rectangle we do not want proj to wrap resulting
    * coordinates around the dateline, as in practice a requested bounding box of
@@ -982,6 +1453,25 @@ int msProjectRect(projectionObj *in, projectionObj *out, rectObj *rect)
     msFreeProjection(&in_over);
   if(out)
     msFreeProjection(&out_over);
+
+#ifdef USE_PROJ
+  if(ret == MS_SUCCESS) {
+    msAcquireLock( TLOCK_PROJRECT );
+    UT_HASH_FIND_STR(projRectCache, key, entry);
+    if(!entry) {
+      if(projRectCacheCount >= MS_PROJ_RECT_CACHE_MAX)
+        msProjRectCacheFree(projRectCache); /* the least recently used */
+      entry = (projRectCacheObj *) msSmallMalloc(sizeof(projRectCacheObj));
+      entry->key = key;
+      entry->rect = *rect;
+      UT_HASH_ADD_KEYPTR(hh, projRectCache, entry->key, strlen(entry->key), entry);
+      projRectCacheCount++;
+      key = NULL;
+    }
+    msReleaseLock( TLOCK_PROJRECT );
+  }
+  free(key);
+#endif
   return ret;
 #endif
 }
@@ -1188,7 +1678,15 @@ reprojected to geographic space.  However, it does not:
 */
 
 #ifdef USE_PROJ
-static int msTestNeedWrap( pointObj pt1, pointObj pt2, pointObj pt2_geo,
+/*
+ * pt1 and pt2 are the segment ends in the source projection, pt1_geo and
+ * pt2_proj their already transformed (not wrapped) positions, and pt2_geo
+ * where pt2 ended up in the output line.  Callers only get here when the
+ * transformed ends are more than 180 degrees apart, and only the middle
+ * of the segment still has to be transformed.
+ */
+static int msTestNeedWrap( pointObj pt1, pointObj pt1_geo,
+                           pointObj pt2, pointObj pt2_proj, pointObj pt2_geo,
                            projectionObj *in,
                            projectionObj *out )
 
@@ -1198,16 +1696,14 @@ static int msTestNeedWrap( pointObj pt1, pointObj pt2, pointObj pt2_geo,
   middle.x = (pt1.x + pt2.x) * 0.5;
   middle.y = (pt1.y + pt2.y) * 0.5;
 
-  if( msProjectPoint( in, out, &pt1 ) == MS_FAILURE
-      || msProjectPoint( in, out, &pt2 ) == MS_FAILURE
-      || msProjectPoint( in, out, &middle ) == MS_FAILURE )
+  if( msProjectPoint( in, out, &middle ) == MS_FAILURE )
     return 0;
 
   /*
    * If the last point was moved, then we are considered due for a
    * move to.
    */
-  if( fabs(pt2_geo.x-pt2.x) > 180.0 )
+  if( fabs(pt2_geo.x-pt2_proj.x) > 180.0 )
     return 1;
 
   /*
@@ -1215,8 +1711,8 @@ static int msTestNeedWrap( pointObj pt1, pointObj pt2, pointObj pt2_geo,
    * to be between the end points. If yes, no wrapping is needed.
    * Otherwise wrapping is needed.
    */
-  if( (middle.x < pt1.x && middle.x < pt2_geo.x)
-      || (middle.x > pt1.x && middle.x > pt2_geo.x) )
+  if( (middle.x < pt1_geo.x && middle.x < pt2_geo.x)
+      || (middle.x > pt1_geo.x && middle.x > pt2_geo.x) )
     return 1;
   else
     return 0;
@@ -1270,6 +1766,7 @@ void msSetPROJ_LIB( const char *proj_lib, const char *pszRelToPath )
 #ifdef USE_PROJ
   static int finder_installed = 0;
   char *extended_path = NULL;
+  int changed;
 
   /* Handle relative path if applicable */
   if( proj_lib && pszRelToPath
@@ -1300,6 +1797,9 @@ void msSetPROJ_LIB( const char *proj_lib, const char *pszRelToPath )
 
   if (proj_lib == NULL) pj_set_finder(NULL);
 
+  changed = (proj_lib == NULL) != (ms_proj_lib == NULL)
+            || (proj_lib != NULL && strcmp(proj_lib, ms_proj_lib) != 0);
+
   if( ms_proj_lib != NULL ) {
     free( ms_proj_lib );
     ms_proj_lib = NULL;
@@ -1315,11 +1815,290 @@ void msSetPROJ_LIB( const char *proj_lib, const char *pszRelToPath )
 
   msReleaseLock( TLOCK_PROJ );
 
+  /* the definitions rects were projected with may have changed */
+  if( changed )
+    msProjectRectCacheCleanup();
+
   if ( extended_path )
     msFree( extended_path );
 #endif
 }
 
+#ifdef USE_PROJ
+/************************************************************************/
+/*                      Projection definition cache                     */
+/*                                                                      */
+/*      PROJECTION arguments as expanded by PROJ, init= file entries    */
+/*      and proj_def.dat defaults included, so that maps loaded again   */
+/*      and again (FastCGI) initialize their projections without going  */
+/*      through the init files. Every projectionObj still gets its own  */
+/*      projPJ and context. Keyed on the PROJ_LIB in use and the        */
+/*      arguments, protected by TLOCK_PROJ which the callers hold.      */
+/************************************************************************/
+
+#define MS_PROJ_DEF_CACHE_MAX 256
+
+typedef struct {
+  char *key;
+  char **args;
+  int numargs;
+  UT_hash_handle hh;
+} projDefCacheObj;
+
+static projDefCacheObj *projDefCache = NULL;
+static int projDefCacheCount = 0;
+
+static char *msProjDefCacheKey(projectionObj *p)
+{
+  int i;
+  size_t len = (ms_proj_lib ? strlen(ms_proj_lib) : 0) + 2;
+  char *key;
+
+  for(i=0; i<p->numargs; i++)
+    len += strlen(p->args[i]) + 1;
+  key = (char *) msSmallMalloc(len);
+  strcpy(key, ms_proj_lib ? ms_proj_lib : "");
+  strcat(key, "\n");
+  for(i=0; i<p->numargs; i++) {
+    if(i) strcat(key, " ");
+    strcat(key, p->args[i]);
+  }
+  return key;
+}
+
+static void msProjDefCacheFree(projDefCacheObj *def)
+{
+  UT_HASH_DEL(projDefCache, def);
+  msFreeCharArray(def->args, def->numargs);
+  free(def->key);
+  free(def);
+  projDefCacheCount--;
+}
+
+/*
+** Returns the expanded arguments previously cached for the arguments of p,
+** MS_FALSE if there are none. TLOCK_PROJ must be held while they are used.
+*/
+int msGetCachedProjectionArgs(projectionObj *p, char ***args, int *numargs)
+{
+  projDefCacheObj *def = NULL;
+  char *key = msProjDefCacheKey(p);
+
+  UT_HASH_FIND_STR(projDefCache, key, def);
+  free(key);
+  if(!def) return MS_FALSE;
+  *args = def->args;
+  *numargs = def->numargs;
+  return MS_TRUE;
+}
+
+/*
+** Caches the definition of the freshly initialized p->proj for its arguments.
+** TLOCK_PROJ must be held.
+*/
+void msCacheProjectionArgs(projectionObj *p)
+{
+  projDefCacheObj *def = NULL;
+  char *key, *expanded, **tokens;
+  int i, numtokens;
+
+  key = msProjDefCacheKey(p);
+  UT_HASH_FIND_STR(projDefCache, key, def);
+  expanded = def ? NULL : pj_get_def(p->proj, 0);
+  if(!expanded) { /* cached meanwhile, or no definition */
+    free(key);
+    return;
+  }
+  tokens = msStringSplit(expanded, '+', &numtokens);
+  pj_dalloc(expanded);
+
+  def = (projDefCacheObj *) msSmallCalloc(1, sizeof(projDefCacheObj));
+  def->args = (char **) msSmallMalloc((numtokens + 1) * sizeof(char *));
+  for(i=0; i<numtokens; i++) {
+    char *token = tokens[i];
+    size_t len = strlen(token);
+    while(len > 0 && token[len-1] == ' ') token[--len] = '\0';
+    /* the init files and defaults have been expanded already */
+    if(len == 0 || strcmp(token, "no_defs") == 0 || strncmp(token, "init=", 5) == 0) {
+      free(token);
+      continue;
+    }
+    def->args[def->numargs++] = token;
+  }
+  free(tokens);
+  def->args[def->numargs++] = msStrdup("no_defs");
+
+  if(projDefCacheCount >= MS_PROJ_DEF_CACHE_MAX)
+    msProjDefCacheFree(projDefCache); /* the oldest one */
+  def->key = key;
+  UT_HASH_ADD_KEYPTR(hh, projDefCache, def->key, strlen(def->key), def);
+  projDefCacheCount++;
+}
+
+/************************************************************************/
+/*                        Per thread PROJ objects                       */
+/*                                                                      */
+/*      A projPJ and its context must not be used by two threads at     */
+/*      once. The thread that initialized a projectionObj uses its      */
+/*      proj directly, any other thread (layers drawn in threads, a     */
+/*      map shared by mapscript threads) gets its own copy with its     */
+/*      own context, made from the PROJ definition the first time and   */
+/*      kept for the life of the process. Where the compiler has        */
+/*      thread local storage only making a copy takes TLOCK_PROJ, so    */
+/*      transforms don't contend on it.                                 */
+/************************************************************************/
+
+static long projSerial = 0;
+
+#if defined(USE_THREAD) && PJ_VERSION >= 480
+#define MS_PROJ_THREAD_COPIES_MAX 64
+
+typedef struct {
+  long serial; /* proj_serial of the projectionObj copied */
+  projCtx ctx;
+  projPJ proj;
+  UT_hash_handle hh;
+} projThreadCopyObj;
+
+typedef struct projThreadCacheObj projThreadCacheObj;
+struct projThreadCacheObj {
+  void *thread_id;
+  projThreadCopyObj *copies; /* only used by that thread */
+  int numcopies;
+  projThreadCacheObj *next;
+};
+
+static projThreadCacheObj *projThreadCaches = NULL; /* of all the threads, TLOCK_PROJ */
+
+#ifdef MS_THREAD_LOCAL
+/*
+** The cache of each thread is also kept in thread local storage, so that
+** finding it takes no lock. msProjectionCacheCleanup() bumps the generation
+** to tell the freed ones.
+*/
+static MS_THREAD_LOCAL projThreadCacheObj *projThreadCache = NULL;
+static MS_THREAD_LOCAL int projThreadCacheGeneration = -1;
+static int projCacheGeneration = 0;
+#endif
+
+static void msFreeProjThreadCopy(projThreadCacheObj *cache, projThreadCopyObj *copy)
+{
+  UT_HASH_DEL(cache->copies, copy);
+  pj_free(copy->proj);
+  pj_ctx_free(copy->ctx);
+  free(copy);
+  cache->numcopies--;
+}
+#endif
+
+/*
+** Records the calling thread as the owner of the freshly initialized p->proj.
+** TLOCK_PROJ must be held.
+*/
+void msSetProjectionThread(projectionObj *p)
+{
+  p->proj_thread = msGetThreadId();
+  p->proj_serial = ++projSerial;
+}
+
+/*
+** Returns the projPJ of p the calling thread may use. other is the projection
+** the caller transforms from or to, whose copy must be kept if an old one has
+** to be dropped to make room. Falls back to p->proj if no copy can be made.
+*/
+projPJ msGetThreadProjection(projectionObj *p, projectionObj *other)
+{
+#if defined(USE_THREAD) && PJ_VERSION >= 480
+  void *thread_id;
+  projThreadCacheObj *cache;
+  projThreadCopyObj *copy = NULL;
+  char *def;
+
+  if( p == NULL || p->proj == NULL || p->proj_serial == 0 )
+    return p ? p->proj : NULL;
+
+  thread_id = msGetThreadId();
+  if( p->proj_thread == thread_id )
+    return p->proj;
+
+#ifdef MS_THREAD_LOCAL
+  cache = (projThreadCacheGeneration == projCacheGeneration) ? projThreadCache : NULL;
+#else
+  msAcquireLock( TLOCK_PROJ );
+  for( cache = projThreadCaches; cache && cache->thread_id != thread_id; cache = cache->next );
+  msReleaseLock( TLOCK_PROJ );
+#endif
+  if( cache ) {
+    UT_HASH_FIND(hh, cache->copies, &(p->proj_serial), sizeof(long), copy);
+    if( copy )
+      return copy->proj;
+  }
+
+  msAcquireLock( TLOCK_PROJ );
+  if( !cache ) {
+    cache = (projThreadCacheObj *) msSmallCalloc(1, sizeof(projThreadCacheObj));
+    cache->thread_id = thread_id;
+    cache->next = projThreadCaches;
+    projThreadCaches = cache;
+#ifdef MS_THREAD_LOCAL
+    projThreadCache = cache;
+    projThreadCacheGeneration = projCacheGeneration;
+#endif
+  }
+
+  if( cache->numcopies >= MS_PROJ_THREAD_COPIES_MAX ) {
+    copy = cache->copies; /* the oldest one */
+    if( other && copy->serial == other->proj_serial )
+      copy = (projThreadCopyObj *) copy->hh.next;
+    if( copy )
+      msFreeProjThreadCopy(cache, copy);
+  }
+
+  copy = (projThreadCopyObj *) msSmallCalloc(1, sizeof(projThreadCopyObj));
+  copy->serial = p->proj_serial;
+  copy->ctx = pj_ctx_alloc();
+  def = pj_get_def(p->proj, 0);
+  if( def ) {
+    copy->proj = pj_init_plus_ctx(copy->ctx, def);
+    pj_dalloc(def);
+  }
+  msReleaseLock( TLOCK_PROJ );
+
+  if( !copy->proj ) {
+    pj_ctx_free(copy->ctx);
+    free(copy);
+    return p->proj;
+  }
+
+  UT_HASH_ADD(hh, cache->copies, serial, sizeof(long), copy);
+  cache->numcopies++;
+  return copy->proj;
+#else
+  return p ? p->proj : NULL;
+#endif
+}
+
+void msProjectionCacheCleanup(void)
+{
+  msAcquireLock( TLOCK_PROJ );
+  while(projDefCache)
+    msProjDefCacheFree(projDefCache);
+#if defined(USE_THREAD) && PJ_VERSION >= 480
+  while(projThreadCaches) {
+    projThreadCacheObj *next = projThreadCaches->next;
+    while(projThreadCaches->copies)
+      msFreeProjThreadCopy(projThreadCaches, projThreadCaches->copies);
+    free(projThreadCaches);
+    projThreadCaches = next;
+  }
+#ifdef MS_THREAD_LOCAL
+  projCacheGeneration++;
+#endif
+#endif
+  msReleaseLock( TLOCK_PROJ );
+}
+#endif /* def USE_PROJ */
+
 /************************************************************************/
 /*                       msGetProjectionString()                        */
 /*                                                                      */
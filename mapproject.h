@@ -65,6 +65,8 @@ extern "C" {
 #if PJ_VERSION >= 480
     projCtx proj_ctx;
 #endif
+    void *proj_thread; /* thread that initialized proj, see msGetThreadProjection() */
+    long proj_serial; /* identifies proj among all the ones initialized */
 #else
     void *proj;
 #endif
@@ -75,10 +77,25 @@ extern "C" {
 
 #ifndef SWIG
 
+  /* grid of exactly projected nodes vertices are interpolated from, see msProjectShapeApprox() */
+  typedef struct {
+    rectObj extent; /* grid extent, in the source projection */
+    int nx, ny; /* number of cells along each axis */
+    double cellx, celly;
+    double maxerror; /* largest interpolation error allowed, in destination units */
+    double *nodex, *nodey; /* (nx+1)*(ny+1) projected nodes, filled on demand */
+    char *nodestate; /* 0: not projected yet, 1: projected, 2: projection failed */
+    char *cellstate; /* 0: not tested yet, 1: interpolated, 2: projected exactly */
+    long numinterpolated, numexact; /* vertex counters */
+  } projApproxObj;
+
   MS_DLL_EXPORT int msIsAxisInverted(int epsg_code);
   MS_DLL_EXPORT int msProjectPoint(projectionObj *in, projectionObj *out, pointObj *point);
   MS_DLL_EXPORT int msProjectShape(projectionObj *in, projectionObj *out, shapeObj *shape);
   MS_DLL_EXPORT int msProjectLine(projectionObj *in, projectionObj *out, lineObj *line);
+  MS_DLL_EXPORT projApproxObj *msCreateProjApprox(projectionObj *in, projectionObj *out, rectObj *extent, int nx, int ny, double maxerror);
+  MS_DLL_EXPORT void msFreeProjApprox(projApproxObj *approx);
+  MS_DLL_EXPORT int msProjectShapeApprox(projectionObj *in, projectionObj *out, projApproxObj *approx, shapeObj *shape);
   MS_DLL_EXPORT int msProjectRect(projectionObj *in, projectionObj *out, rectObj *rect);
   MS_DLL_EXPORT int msProjectionsDiffer(projectionObj *, projectionObj *);
   MS_DLL_EXPORT int msOGCWKT2ProjectionObj( const char *pszWKT, projectionObj *proj, int
@@ -92,6 +109,7 @@ extern "C" {
   MS_DLL_EXPORT int msLoadProjectionStringEPSG(projectionObj *p, const char *value);
   MS_DLL_EXPORT char *msGetProjectionString(projectionObj *proj);
   int msIsAxisInvertedProj( projectionObj *proj );
+  MS_DLL_EXPORT int msIsAxisInvertedSRS(const char *value);
   void msAxisSwapShape(shapeObj *shape);
   MS_DLL_EXPORT void msAxisNormalizePoints( projectionObj *proj, int count,
       double *x, double *y );
@@ -100,6 +118,14 @@ extern "C" {
 
   MS_DLL_EXPORT void msSetPROJ_LIB( const char *, const char * );
   MS_DLL_EXPORT void msProjLibInitFromEnv();
+#ifdef USE_PROJ
+  void msSetProjectionThread(projectionObj *p);
+  MS_DLL_EXPORT projPJ msGetThreadProjection(projectionObj *p, projectionObj *other);
+  int msGetCachedProjectionArgs(projectionObj *p, char ***args, int *numargs);
+  void msCacheProjectionArgs(projectionObj *p);
+  MS_DLL_EXPORT void msProjectionCacheCleanup(void);
+  MS_DLL_EXPORT void msProjectRectCacheCleanup(void);
+#endif
 
   /* Provides compatiblity with PROJ.4 4.4.2 */
 #ifndef PJ_VERSION
@@ -46,6 +46,8 @@
 
 #include "mapserver.h"
 #include <stdlib.h>
+#include <float.h>
+#include <limits.h>
 
 #define PAM_GETR(p) ((p).r)
 #define PAM_GETG(p) ((p).g)
@@ -195,6 +197,135 @@ int msQuantizeRasterBuffer(rasterBufferObj *rb,
 }
 
 
+/*
+ * Number of bins of the k-means histogram: 4 bits per rgba component.
+ * Each bin keeps the sum of the pixels it received, so the colors it
+ * contributes are the exact averages, not the bin centers.
+ */
+#define KMEANS_BINS 65536
+#define KMEANS_ITERATIONS 4
+#define KMEANS_BIN(p) ( ((p).r >> 4) << 12 | ((p).g >> 4) << 8 | ((p).b >> 4) << 4 | ((p).a >> 4) )
+
+/**
+ * Compute a palette for the given RGBA rasterBuffer with a fixed budget of
+ * k-means iterations (FORMATOPTION "QUANTIZE_METHOD=KMEANS"). Parameters are
+ * the same as msQuantizeRasterBuffer(), but the image depth is never reduced
+ * so palette_scaling_maxval is always set to 255.
+ * - the histogram is a fixed array of KMEANS_BINS bins instead of a hash of
+ *   the exact colors;
+ * - the median cut of those bins seeds the palette;
+ * - KMEANS_ITERATIONS rounds of assigning each bin to its nearest palette
+ *   entry and moving entries to the mean of their pixels refine it.
+ */
+int msQuantizeRasterBufferKMeans(rasterBufferObj *rb,
+                                 unsigned int *reqcolors, rgbaPixel *palette,
+                                 rgbaPixel *forced_palette, int num_forced_palette_entries,
+                                 unsigned int *palette_scaling_maxval)
+{
+  unsigned int *count;
+  double *sums; /* r,g,b,a sums of each bin */
+  int *used; /* indexes of the non empty bins */
+  acolorhist_vector achv, acolormap;
+  int nused = 0, newcolors, row, col, i, k, iter;
+  double *centers, *csums;
+
+  assert(rb->type == MS_BUFFER_BYTE_RGBA);
+
+  *palette_scaling_maxval = 255;
+
+  count = (unsigned int*)msSmallCalloc(KMEANS_BINS, sizeof(unsigned int));
+  sums = (double*)msSmallCalloc(KMEANS_BINS * 4, sizeof(double));
+
+  for(row=0; row<rb->height; row++) {
+    rgbaPixel *pP = (rgbaPixel*)(&(rb->data.rgba.pixels[row * rb->data.rgba.row_step]));
+    for(col=0; col<rb->width; col++, pP++) {
+      int bin = KMEANS_BIN(*pP);
+      double *sum = sums + bin * 4;
+      count[bin]++;
+      sum[0] += pP->r;
+      sum[1] += pP->g;
+      sum[2] += pP->b;
+      sum[3] += pP->a;
+    }
+  }
+
+  used = (int*)msSmallMalloc(KMEANS_BINS * sizeof(int));
+  achv = (acolorhist_vector)msSmallMalloc(KMEANS_BINS * sizeof(struct acolorhist_item));
+  for(i=0; i<KMEANS_BINS; i++) {
+    if(count[i]) {
+      double *sum = sums + i * 4;
+      PAM_ASSIGN(achv[nused].acolor,
+                 (unsigned char)(sum[0] / count[i] + 0.5), (unsigned char)(sum[1] / count[i] + 0.5),
+                 (unsigned char)(sum[2] / count[i] + 0.5), (unsigned char)(sum[3] / count[i] + 0.5));
+      achv[nused].value = count[i];
+      used[nused++] = i;
+    }
+  }
+
+  newcolors = MS_MIN(nused, *reqcolors);
+  /* mediancut() reorders achv, the bin means are kept in sums/count */
+  acolormap = mediancut(achv, nused, rb->width*rb->height, 255, newcolors);
+  free(achv);
+
+  centers = (double*)msSmallMalloc(newcolors * 4 * sizeof(double));
+  csums = (double*)msSmallMalloc(newcolors * 5 * sizeof(double));
+  for(k=0; k<newcolors; k++) {
+    centers[k*4] = acolormap[k].acolor.r;
+    centers[k*4+1] = acolormap[k].acolor.g;
+    centers[k*4+2] = acolormap[k].acolor.b;
+    centers[k*4+3] = acolormap[k].acolor.a;
+  }
+  free(acolormap);
+
+  for(iter=0; iter<KMEANS_ITERATIONS && newcolors > 1; iter++) {
+    memset(csums, 0, newcolors * 5 * sizeof(double));
+    for(i=0; i<nused; i++) {
+      int bin = used[i], best = 0;
+      double *sum = sums + bin * 4, n = count[bin];
+      double r = sum[0] / n, g = sum[1] / n, b = sum[2] / n, a = sum[3] / n;
+      double bestdist = DBL_MAX;
+      for(k=0; k<newcolors; k++) {
+        double *c = centers + k * 4;
+        double dist = (r-c[0])*(r-c[0]) + (g-c[1])*(g-c[1]) + (b-c[2])*(b-c[2]) + (a-c[3])*(a-c[3]);
+        if(dist < bestdist) {
+          bestdist = dist;
+          best = k;
+        }
+      }
+      csums[best*5] += sum[0];
+      csums[best*5+1] += sum[1];
+      csums[best*5+2] += sum[2];
+      csums[best*5+3] += sum[3];
+      csums[best*5+4] += n;
+    }
+    for(k=0; k<newcolors; k++) {
+      double n = csums[k*5+4];
+      if(n > 0) { /* empty entries keep their previous color */
+        centers[k*4] = csums[k*5] / n;
+        centers[k*4+1] = csums[k*5+1] / n;
+        centers[k*4+2] = csums[k*5+2] / n;
+        centers[k*4+3] = csums[k*5+3] / n;
+      }
+    }
+  }
+
+  *reqcolors = newcolors;
+  for(k=0; k<newcolors; k++) {
+    palette[k].r = (unsigned char)(centers[k*4] + 0.5);
+    palette[k].g = (unsigned char)(centers[k*4+1] + 0.5);
+    palette[k].b = (unsigned char)(centers[k*4+2] + 0.5);
+    palette[k].a = (unsigned char)(centers[k*4+3] + 0.5);
+  }
+
+  free(centers);
+  free(csums);
+  free(used);
+  free(sums);
+  free(count);
+  return MS_SUCCESS;
+}
+
+
 int msClassifyRasterBuffer(rasterBufferObj *rb, rasterBufferObj *qrb)
 {
   register int ind;
@@ -202,6 +333,8 @@ int msClassifyRasterBuffer(rasterBufferObj *rb, rasterBufferObj *qrb)
   register rgbaPixel *pP;
   acolorhash_table acht;
   int usehash, row, col;
+  rgbaPixel prev;
+  int prevind = -1;
   /*
    ** Step 4: map the colors in the image to their closest match in the
    ** new colormap, and write 'em out.
@@ -215,6 +348,14 @@ int msClassifyRasterBuffer(rasterBufferObj *rb, rasterBufferObj *qrb)
     pP = (rgbaPixel*)(&(rb->data.rgba.pixels[row * rb->data.rgba.row_step]));;
     pQ = outrow;
     do {
+      /* Same color as the previous pixel? */
+      if ( prevind != -1 && PAM_EQUAL( prev, *pP ) ) {
+        *pQ = (unsigned char)prevind;
+        ++col;
+        ++pP;
+        ++pQ;
+        continue;
+      }
       /* Check hash table to see if we have already matched this color. */
       ind = pam_lookupacolor( acht, pP );
       if ( ind == -1 ) {
@@ -240,6 +381,8 @@ int msClassifyRasterBuffer(rasterBufferObj *rb, rasterBufferObj *qrb)
           if ( newdist < dist ) {
             ind = i;
             dist = newdist;
+            if ( dist == 0 )
+              break;
           }
         }
         if ( usehash ) {
@@ -251,6 +394,8 @@ int msClassifyRasterBuffer(rasterBufferObj *rb, rasterBufferObj *qrb)
 
       /*          *pP = acolormap[ind].acolor;  */
       *pQ = (unsigned char)ind;
+      prev = *pP;
+      prevind = ind;
 
       ++col;
       ++pP;
@@ -264,6 +409,61 @@ int msClassifyRasterBuffer(rasterBufferObj *rb, rasterBufferObj *qrb)
 }
 
 
+/*
+ * msClassifyRasterBuffer() for palettes from msQuantizeRasterBufferKMeans():
+ * the nearest palette entry is looked up once per bin of 5 bits per color
+ * component and 4 bits of alpha, from the center of the bin, instead of once
+ * per distinct color, as the image depth is not reduced. Fully opaque and
+ * fully transparent pixels get bins of their own.
+ */
+#define CLASSIFY_BINS (1<<20)
+#define CLASSIFY_ALPHA(a) ( (a) == 255 ? 17 : (a) == 0 ? 16 : (a) >> 4 )
+#define CLASSIFY_BIN(p) ( ((p).r >> 3) << 15 | ((p).g >> 3) << 10 | ((p).b >> 3) << 5 | CLASSIFY_ALPHA((p).a) )
+
+int msClassifyRasterBufferKMeans(rasterBufferObj *rb, rasterBufferObj *qrb)
+{
+  short *lut = (short*)msSmallMalloc(CLASSIFY_BINS * sizeof(short));
+  int npal = qrb->data.palette.num_entries, row, col, i;
+  int pr[256], pg[256], pb[256], pa[256];
+
+  for(i=0; i<npal; i++) {
+    pr[i] = qrb->data.palette.palette[i].r;
+    pg[i] = qrb->data.palette.palette[i].g;
+    pb[i] = qrb->data.palette.palette[i].b;
+    pa[i] = qrb->data.palette.palette[i].a;
+  }
+  for(i=0; i<CLASSIFY_BINS; i++)
+    lut[i] = -1;
+
+  for(row=0; row<qrb->height; row++) {
+    rgbaPixel *pP = (rgbaPixel*)(&(rb->data.rgba.pixels[row * rb->data.rgba.row_step]));
+    unsigned char *pQ = &(qrb->data.palette.pixels[row*qrb->width]);
+    for(col=0; col<qrb->width; col++, pP++, pQ++) {
+      int bin = CLASSIFY_BIN(*pP);
+      if(lut[bin] == -1) {
+        int r = (pP->r & 0xf8) | 4, g = (pP->g & 0xf8) | 4, b = (pP->b & 0xf8) | 4, a = (pP->a & 0xf0) | 8;
+        int best = 0, dist, bestdist = INT_MAX;
+        if(pP->a == 255 || pP->a == 0)
+          a = pP->a;
+        if(pP->a == 0) /* premultiplied */
+          r = g = b = 0;
+        for(i=0; i<npal; i++) {
+          dist = (r-pr[i])*(r-pr[i]) + (g-pg[i])*(g-pg[i]) + (b-pb[i])*(b-pb[i]) + (a-pa[i])*(a-pa[i]);
+          if(dist < bestdist) {
+            bestdist = dist;
+            best = i;
+          }
+        }
+        lut[bin] = best;
+      }
+      *pQ = (unsigned char)lut[bin];
+    }
+  }
+  free(lut);
+  return MS_SUCCESS;
+}
+
+
 
 /*
  ** Here is the fun part, the median-cut colormap generator.  This is based
@@ -616,7 +816,7 @@ int* acolorsP;
 {
   acolorhash_table acht;
   register rgbaPixel* pP;
-  acolorhist_list achl;
+  acolorhist_list achl, prev = 0;
   int col, row, hash;
 
   acht = pam_allocacolorhash( );
@@ -625,6 +825,11 @@ int* acolorsP;
   /* Go through the entire image, building a hash table of colors. */
   for ( row = 0; row < rows; ++row )
     for ( col = 0, pP = apixels[row]; col < cols; ++col, ++pP ) {
+      /* runs of a same color are frequent in maps, skip the lookup */
+      if ( prev != (acolorhist_list) 0 && PAM_EQUAL( prev->ch.acolor, *pP ) ) {
+        ++(prev->ch.value);
+        continue;
+      }
       hash = pam_hashapixel( *pP );
       for ( achl = acht[hash]; achl != (acolorhist_list) 0; achl = achl->next )
         if ( PAM_EQUAL( achl->ch.acolor, *pP ) )
@@ -646,6 +851,7 @@ int* acolorsP;
         achl->next = acht[hash];
         acht[hash] = achl;
       }
+      prev = achl;
     }
 
   return acht;
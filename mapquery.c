@@ -29,6 +29,12 @@
 
 #include "mapserver.h"
 #include "mapows.h"
+#include "mapthread.h"
+#include <sys/stat.h>
+
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#endif
 
 int msInitQuery(queryObj *query) {
   if(!query) return MS_FAILURE;
@@ -53,6 +59,8 @@ int msInitQuery(queryObj *query) {
   query->maxfeatures = -1;
   query->startindex = -1;
   query->only_cache_result_count = 0;
+  query->shapefunc = NULL;
+  query->shapefuncdata = NULL;
   
   query->filteritem = NULL;
   msInitExpression(&query->filter);
@@ -133,80 +141,330 @@ int msIsLayerQueryable(layerObj *lp)
   return MS_FALSE;
 }
 
-static int addResult(resultCacheObj *cache, shapeObj *shape)
+/*
+** A query results file loaded with msLoadQuery(): mapped, or read in one go where
+** mmap() isn't available. The result caches of the layers point into it, each holds
+** a reference.
+*/
+struct queryFileMapObj {
+  char *data;
+  size_t size;
+  int mapped;
+  int refcount;
+};
+
+static void releaseQueryFileMap(struct queryFileMapObj *qfmap)
+{
+  if(--qfmap->refcount > 0) return;
+
+#ifdef HAVE_MMAP
+  if(qfmap->mapped)
+    munmap(qfmap->data, qfmap->size);
+  else
+#endif
+    free(qfmap->data);
+  free(qfmap);
+}
+
+void msFreeResultCache(resultCacheObj *resultcache)
+{
+  if(!resultcache) return;
+
+  if(resultcache->mapping)
+    releaseQueryFileMap(resultcache->mapping);
+  else {
+    msIO_requestMemoryFree(MS_REQUEST_MEMORY_RESULTCACHE, sizeof(resultObj)*resultcache->cachesize);
+    free(resultcache->results);
+  }
+  free(resultcache);
+}
+
+/* gives cache its own copy of the results it shared with a query file */
+static int detachResultCache(resultCacheObj *cache)
+{
+  int cachesize = cache->numresults + MS_RESULTCACHEINCREMENT;
+  resultObj *results = (resultObj *) malloc(sizeof(resultObj)*cachesize);
+
+  if(!results) {
+    msSetError(MS_MEMERR, "Out of memory allocating %u bytes.", "detachResultCache()", (unsigned int)(sizeof(resultObj)*cachesize));
+    return(MS_FAILURE);
+  }
+  if(cache->numresults > 0)
+    memcpy(results, cache->results, sizeof(resultObj)*cache->numresults);
+
+  releaseQueryFileMap(cache->mapping);
+  cache->mapping = NULL;
+  cache->results = results;
+  cache->cachesize = cachesize;
+  msIO_requestMemoryAlloc(MS_REQUEST_MEMORY_RESULTCACHE, sizeof(resultObj)*cachesize);
+
+  return(MS_SUCCESS);
+}
+
+static int addResultRecord(resultCacheObj *cache, resultObj *record, rectObj *bounds)
 {
   int i;
 
+  if(cache->mapping && detachResultCache(cache) != MS_SUCCESS) /* results loaded from a query file are read-only */
+    return(MS_FAILURE);
+
   if(cache->numresults == cache->cachesize) { /* just add it to the end */
-    if(cache->cachesize == 0)
-      cache->results = (resultObj *) malloc(sizeof(resultObj)*MS_RESULTCACHEINCREMENT);
-    else
-      cache->results = (resultObj *) realloc(cache->results, sizeof(resultObj)*(cache->cachesize+MS_RESULTCACHEINCREMENT));
-    if(!cache->results) {
+    /* grow by half, large result sets would be copied over and over otherwise */
+    int newsize = cache->cachesize + MS_MAX(MS_RESULTCACHEINCREMENT, cache->cachesize/2);
+    resultObj *results;
+
+    if(msIO_checkRequestMemory("addResult()") != MS_SUCCESS)
+      return(MS_FAILURE);
+    results = (resultObj *) realloc(cache->results, sizeof(resultObj)*newsize);
+    if(!results) {
       msSetError(MS_MEMERR, "Realloc() error.", "addResult()");
       return(MS_FAILURE);
     }
-    cache->cachesize += MS_RESULTCACHEINCREMENT;
+    msIO_requestMemoryAlloc(MS_REQUEST_MEMORY_RESULTCACHE, sizeof(resultObj)*(newsize - cache->cachesize));
+    cache->results = results;
+    cache->cachesize = newsize;
   }
 
   i = cache->numresults;
 
-  cache->results[i].classindex = shape->classindex;
-  cache->results[i].tileindex = shape->tileindex;
-  cache->results[i].shapeindex = shape->index;
-  cache->results[i].resultindex = shape->resultindex;
+  cache->results[i] = *record;
   cache->numresults++;
 
   cache->previousBounds = cache->bounds;
   if(cache->numresults == 1)
-    cache->bounds = shape->bounds;
+    cache->bounds = *bounds;
   else
-    msMergeRect(&(cache->bounds), &(shape->bounds));
+    msMergeRect(&(cache->bounds), bounds);
 
   return(MS_SUCCESS);
 }
 
+static int addResult(resultCacheObj *cache, shapeObj *shape)
+{
+  resultObj record;
+
+  record.classindex = shape->classindex;
+  record.tileindex = shape->tileindex;
+  record.shapeindex = shape->index;
+  record.resultindex = shape->resultindex;
+
+  return addResultRecord(cache, &record, &(shape->bounds));
+}
+
+/*
+** Query results files, version MS_QUERY_RESULTS_VERSION: the magic string line padded
+** to MS_QUERY_FILE_MAGIC_SIZE bytes, a queryFileHeaderObj, a queryFileLayerObj for each
+** layer with results and then the results of those layers, in the same order, as
+** plain resultObj arrays. The file is mapped when loaded and the result caches point
+** straight at the arrays, so nothing is parsed. It is meant to be read back by the
+** same build: the byte order and the size of resultObj are checked.
+*/
+#define MS_QUERY_FILE_MAGIC_SIZE 32
+#define MS_QUERY_FILE_BYTEORDER 0x01020304
+
+typedef struct {
+  int version;
+  int byteorder;  /* MS_QUERY_FILE_BYTEORDER */
+  int resultsize; /* sizeof(resultObj) */
+  int numlayers;
+} queryFileHeaderObj;
+
+typedef struct {
+  int layerindex;
+  int numresults;
+  int tiled;      /* the tile indexes were kept */
+  int reserved;
+  rectObj bounds;
+} queryFileLayerObj;
+
 /*
 ** Serialize a query result set to disk.
 */
 static int saveQueryResults(mapObj *map, char *filename)
 {
   FILE *stream;
-  int i, j, n=0;
+  char magic[MS_QUERY_FILE_MAGIC_SIZE];
+  queryFileHeaderObj header;
+  queryFileLayerObj entry;
+  resultObj buffer[MS_RESULTCACHEINCREMENT];
+  int i, j, n, status = MS_SUCCESS;
 
   if(!filename) {
     msSetError(MS_MISCERR, "No filename provided to save query results to.", "saveQueryResults()");
     return MS_FAILURE;
   }
 
-  stream = fopen(filename, "w");
+  stream = fopen(filename, "wb");
   if(!stream) {
     msSetError(MS_IOERR, "(%s)", "saveQueryResults()", filename);
     return MS_FAILURE;
   }
 
-  fprintf(stream, "%s - Generated by msSaveQuery()\n", MS_QUERY_RESULTS_MAGIC_STRING);
+  memset(magic, 0, sizeof(magic));
+  snprintf(magic, sizeof(magic), "%s\n", MS_QUERY_RESULTS_BINARY_MAGIC_STRING);
 
-  /* count the number of layers with results */
-  for(i=0; i<map->numlayers; i++)
-    if(GET_LAYER(map, i)->resultcache) n++;
-  fwrite(&n, sizeof(int), 1, stream);
+  memset(&header, 0, sizeof(header));
+  header.version = MS_QUERY_RESULTS_VERSION;
+  header.byteorder = MS_QUERY_FILE_BYTEORDER;
+  header.resultsize = sizeof(resultObj);
+  for(i=0; i<map->numlayers; i++) /* count the number of layers with results */
+    if(GET_LAYER(map, i)->resultcache) header.numlayers++;
 
-  /* now write the result set for each layer */
-  for(i=0; i<map->numlayers; i++) {
-    if(GET_LAYER(map, i)->resultcache) {
-      fwrite(&i, sizeof(int), 1, stream); /* layer index */
-      fwrite(&(GET_LAYER(map, i)->resultcache->numresults), sizeof(int), 1, stream); /* number of results */
-      fwrite(&(GET_LAYER(map, i)->resultcache->bounds), sizeof(rectObj), 1, stream); /* bounding box */
-      for(j=0; j<GET_LAYER(map, i)->resultcache->numresults; j++)
-        fwrite(&(GET_LAYER(map, i)->resultcache->results[j]), sizeof(resultObj), 1, stream); /* each result */
+  if(fwrite(magic, sizeof(magic), 1, stream) != 1 || fwrite(&header, sizeof(header), 1, stream) != 1)
+    status = MS_FAILURE;
+
+  /* the layer directory */
+  for(i=0; i<map->numlayers && status == MS_SUCCESS; i++) {
+    layerObj *lp = GET_LAYER(map, i);
+    if(!lp->resultcache) continue;
+
+    memset(&entry, 0, sizeof(entry));
+    entry.layerindex = i;
+    entry.numresults = lp->resultcache->numresults;
+    entry.tiled = (lp->tileindex != NULL);
+    entry.bounds = lp->resultcache->bounds;
+    if(fwrite(&entry, sizeof(entry), 1, stream) != 1)
+      status = MS_FAILURE;
+  }
+
+  /* now write the result set for each layer, as loaded: without the result (set) index */
+  for(i=0; i<map->numlayers && status == MS_SUCCESS; i++) {
+    layerObj *lp = GET_LAYER(map, i);
+    if(!lp->resultcache) continue;
+
+    for(j=0; j<lp->resultcache->numresults && status == MS_SUCCESS; j+=n) {
+      int k;
+
+      n = MS_MIN(MS_RESULTCACHEINCREMENT, lp->resultcache->numresults - j);
+      memset(buffer, 0, sizeof(resultObj)*n); /* no stray padding bytes in the file */
+      for(k=0; k<n; k++) {
+        buffer[k].shapeindex = lp->resultcache->results[j+k].shapeindex;
+        buffer[k].tileindex = lp->tileindex ? lp->resultcache->results[j+k].tileindex : -1;
+        buffer[k].resultindex = -1;
+        buffer[k].classindex = lp->resultcache->results[j+k].classindex;
+      }
+      if(fwrite(buffer, sizeof(resultObj), n, stream) != (size_t) n)
+        status = MS_FAILURE;
     }
   }
 
+  if(fclose(stream) != 0)
+    status = MS_FAILURE;
+  if(status != MS_SUCCESS)
+    msSetError(MS_IOERR, "Failed writing query results to %s.", "saveQueryResults()", filename);
+
+  return status;
+}
+
+/*
+** Loads a query results file written by saveQueryResults(), see above.
+*/
+static int loadQueryResultsFile(mapObj *map, char *filename)
+{
+  FILE *stream;
+  struct stat st;
+  struct queryFileMapObj *qfmap;
+  queryFileHeaderObj header;
+  size_t offset;
+  int i, status = MS_SUCCESS;
+
+  stream = fopen(filename, "rb");
+  if(!stream) {
+    msSetError(MS_IOERR, "(%s)", "loadQueryResultsFile()", filename);
+    return MS_FAILURE;
+  }
+  if(fstat(fileno(stream), &st) != 0 || st.st_size < (off_t) (MS_QUERY_FILE_MAGIC_SIZE + sizeof(queryFileHeaderObj))) {
+    msSetError(MS_MISCERR, "Query results file %s is truncated.", "loadQueryResultsFile()", filename);
+    fclose(stream);
+    return MS_FAILURE;
+  }
+
+  qfmap = (struct queryFileMapObj *) msSmallMalloc(sizeof(struct queryFileMapObj));
+  qfmap->size = (size_t) st.st_size;
+  qfmap->mapped = MS_FALSE;
+  qfmap->refcount = 1; /* ours, until the layers hold theirs */
+
+#ifdef HAVE_MMAP
+  qfmap->data = (char *) mmap(NULL, qfmap->size, PROT_READ, MAP_SHARED, fileno(stream), 0);
+  if(qfmap->data != (char *) MAP_FAILED)
+    qfmap->mapped = MS_TRUE;
+  else
+#endif
+  {
+    qfmap->data = (char *) malloc(qfmap->size);
+    if(!qfmap->data || fread(qfmap->data, 1, qfmap->size, stream) != qfmap->size) {
+      msSetError(MS_IOERR, "Failed reading query results from %s.", "loadQueryResultsFile()", filename);
+      free(qfmap->data);
+      free(qfmap);
+      fclose(stream);
+      return MS_FAILURE;
+    }
+  }
   fclose(stream);
-  return MS_SUCCESS;
+
+  memcpy(&header, qfmap->data + MS_QUERY_FILE_MAGIC_SIZE, sizeof(header));
+  offset = MS_QUERY_FILE_MAGIC_SIZE + sizeof(header);
+  if(header.version != MS_QUERY_RESULTS_VERSION || header.byteorder != MS_QUERY_FILE_BYTEORDER || header.resultsize != (int) sizeof(resultObj)) {
+    msSetError(MS_MISCERR, "Query results file %s was written by another version or build of MapServer.", "loadQueryResultsFile()", filename);
+    status = MS_FAILURE;
+  } else if(header.numlayers < 0 || header.numlayers > map->numlayers || (qfmap->size - offset)/sizeof(queryFileLayerObj) < (size_t) header.numlayers) {
+    msSetError(MS_MISCERR, "Invalid layer count in query results file %s.", "loadQueryResultsFile()", filename);
+    status = MS_FAILURE;
+  }
+
+  if(status == MS_SUCCESS) {
+    queryFileLayerObj *entries = (queryFileLayerObj *) (qfmap->data + offset);
+    offset += header.numlayers * sizeof(queryFileLayerObj);
+
+    for(i=0; i<header.numlayers; i++) {
+      layerObj *lp;
+      resultCacheObj *cache;
+
+      if(entries[i].layerindex < 0 || entries[i].layerindex >= map->numlayers) {
+        msSetError(MS_MISCERR, "Invalid layer index loaded from query file.", "loadQueryResultsFile()");
+        status = MS_FAILURE;
+        break;
+      }
+      if(entries[i].numresults < 0 || (qfmap->size - offset)/sizeof(resultObj) < (size_t) entries[i].numresults) {
+        msSetError(MS_MISCERR, "Query results file %s is truncated.", "loadQueryResultsFile()", filename);
+        status = MS_FAILURE;
+        break;
+      }
+
+      lp = GET_LAYER(map, entries[i].layerindex);
+      msFreeResultCache(lp->resultcache);
+      cache = lp->resultcache = (resultCacheObj *) msSmallMalloc(sizeof(resultCacheObj));
+      initResultCache(cache);
+      cache->numresults = cache->cachesize = entries[i].numresults;
+      cache->bounds = cache->previousBounds = entries[i].bounds;
+
+      if(cache->numresults > 0) {
+        cache->results = (resultObj *) (qfmap->data + offset);
+        cache->mapping = qfmap;
+        qfmap->refcount++;
+
+        if(entries[i].tiled && !lp->tileindex) { /* reset the tile index for non-tiled layers */
+          int k;
+          if(detachResultCache(cache) != MS_SUCCESS) {
+            status = MS_FAILURE;
+            break;
+          }
+          for(k=0; k<cache->numresults; k++)
+            cache->results[k].tileindex = -1;
+        }
+      }
+      offset += entries[i].numresults * sizeof(resultObj);
+    }
+  }
+
+  releaseQueryFileMap(qfmap);
+  return status;
 }
 
+/*
+** Loads query results saved before MS_QUERY_RESULTS_VERSION, one fwrite()'d record
+** at a time.
+*/
 static int loadQueryResults(mapObj *map, FILE *stream)
 {
   int i, j, k, n=0;
@@ -231,6 +489,7 @@ static int loadQueryResults(mapObj *map, FILE *stream)
     /* inialize the results for this layer */
     GET_LAYER(map, j)->resultcache = (resultCacheObj *)malloc(sizeof(resultCacheObj)); /* allocate and initialize the result cache */
     MS_CHECK_ALLOC(GET_LAYER(map, j)->resultcache, sizeof(resultCacheObj), MS_FAILURE);
+    initResultCache(GET_LAYER(map, j)->resultcache);
 
     if(1 != fread(&(GET_LAYER(map, j)->resultcache->numresults), sizeof(int), 1, stream) || (GET_LAYER(map, j)->resultcache->numresults < 0)) { /* number of results */
       msSetError(MS_MISCERR,"failed to read number of results from query file stream", "loadQueryResults()");
@@ -255,12 +514,12 @@ static int loadQueryResults(mapObj *map, FILE *stream)
       GET_LAYER(map, j)->resultcache = NULL;
       return MS_FAILURE;
     }
+    msIO_requestMemoryAlloc(MS_REQUEST_MEMORY_RESULTCACHE, sizeof(resultObj)*GET_LAYER(map, j)->resultcache->numresults);
 
     for(k=0; k<GET_LAYER(map, j)->resultcache->numresults; k++) {
       if(1 != fread(&(GET_LAYER(map, j)->resultcache->results[k]), sizeof(resultObj), 1, stream)) { /* each result */
         msSetError(MS_MISCERR,"failed to read result %d from query file stream", "loadQueryResults()", k);
-        free(GET_LAYER(map, j)->resultcache->results);
-        free(GET_LAYER(map, j)->resultcache);
+        msFreeResultCache(GET_LAYER(map, j)->resultcache);
         GET_LAYER(map, j)->resultcache = NULL;
         return MS_FAILURE;
       }
@@ -272,6 +531,27 @@ static int loadQueryResults(mapObj *map, FILE *stream)
   return MS_SUCCESS;
 }
 
+/*
+** Opens the layers with loaded results the way a query leaves them, drawing them and
+** the query templates read the result shapes right away.
+*/
+static int openQueryResultLayers(mapObj *map)
+{
+  int i;
+
+  for(i=0; i<map->numlayers; i++) {
+    layerObj *lp = GET_LAYER(map, i);
+    if(!lp->resultcache || lp->resultcache->numresults == 0) continue;
+
+    msLayerClose(lp); /* reset */
+    if(msLayerOpen(lp) != MS_SUCCESS) return MS_FAILURE;
+    msLayerEnablePaging(lp, MS_FALSE);
+    if(msLayerWhichItems(lp, MS_TRUE, NULL) != MS_SUCCESS) return MS_FAILURE; /* we want *all* items */
+  }
+
+  return MS_SUCCESS;
+}
+
 /*
 ** Serialize the parameters necessary to duplicate a query to disk. (TODO: add filter query...)
 */
@@ -403,7 +683,7 @@ parse_error:
 /*
 ** Save (serialize) a query to disk. There are two methods, one saves the query parameters and the other saves
 ** all the shape indexes. Note the latter can be very slow against certain data sources but has a certain usefulness
-** on occation.
+** on occation. Saved results load without being parsed or queried again, see saveQueryResults().
 */
 int msSaveQuery(mapObj *map, char *filename, int results)
 {
@@ -448,8 +728,12 @@ int msLoadQuery(mapObj *map, char *filename)
     /*
     ** Call correct reader based on the magic string.
     */
-    if(strncasecmp(buffer, MS_QUERY_RESULTS_MAGIC_STRING, strlen(MS_QUERY_RESULTS_MAGIC_STRING)) == 0) {
+    if(strncasecmp(buffer, MS_QUERY_RESULTS_BINARY_MAGIC_STRING, strlen(MS_QUERY_RESULTS_BINARY_MAGIC_STRING)) == 0) {
+      retval = loadQueryResultsFile(map, filename);
+      if(retval == MS_SUCCESS) retval = openQueryResultLayers(map);
+    } else if(strncasecmp(buffer, MS_QUERY_RESULTS_MAGIC_STRING, strlen(MS_QUERY_RESULTS_MAGIC_STRING)) == 0) {
       retval = loadQueryResults(map, stream);
+      if(retval == MS_SUCCESS) retval = openQueryResultLayers(map);
     } else if(strncasecmp(buffer, MS_QUERY_PARAMS_MAGIC_STRING, strlen(MS_QUERY_PARAMS_MAGIC_STRING)) == 0) {
       retval = loadQueryParams(map, stream);
     } else {
@@ -494,8 +778,7 @@ int msQueryByIndex(mapObj *map)
 
   if(map->query.clear_resultcache) {
     if(lp->resultcache) {
-      if(lp->resultcache->results) free(lp->resultcache->results);
-      free(lp->resultcache);
+      msFreeResultCache(lp->resultcache);
       lp->resultcache = NULL;
     }
   }
@@ -568,12 +851,12 @@ int msQueryByIndex(mapObj *map)
     return(MS_FAILURE);
   }
   
-  addResult(lp->resultcache, &shape);
+  status = addResult(lp->resultcache, &shape);
 
   msFreeShape(&shape);
   /* msLayerClose(lp); */
 
-  return(MS_SUCCESS);
+  return(status);
 }
 
 static char *filterTranslateToLogical(expressionObj *filter, char *filteritem) {
@@ -639,46 +922,258 @@ static expressionObj mergeFilters(expressionObj *filter1, char *filteritem1, exp
 /*
 ** Query using common expression syntax.
 */
-int msQueryByFilter(mapObj *map)
+/*
+** Layer tests shared by the query modes: drops the previous results of lp and tells
+** if it is to be queried at all.
+*/
+static int msQueryLayerPrepare(mapObj *map, layerObj *lp)
 {
-  int l;
-  int start, stop=0;
+  /* conditions may have changed since this layer last drawn, so set
+     layer->project true to recheck projection needs (Bug #673) */
+  lp->project = MS_TRUE;
 
-  layerObj *lp;
+  /* free any previous search results, do it now in case one of the next few tests fail */
+  if(lp->resultcache) {
+    msFreeResultCache(lp->resultcache);
+    lp->resultcache = NULL;
+  }
 
-  char status;
+  if(!msIsLayerQueryable(lp)) return MS_FALSE;
+  if(lp->status == MS_OFF) return MS_FALSE;
 
-  char *old_filteritem=NULL;
-  expressionObj old_filter;
+  if(map->scaledenom > 0) {
+    if((lp->maxscaledenom > 0) && (map->scaledenom > lp->maxscaledenom)) return MS_FALSE;
+    if((lp->minscaledenom > 0) && (map->scaledenom <= lp->minscaledenom)) return MS_FALSE;
+  }
 
-  rectObj search_rect;
+  if (lp->maxscaledenom <= 0 && lp->minscaledenom <= 0) {
+    if((lp->maxgeowidth > 0) && ((map->extent.maxx - map->extent.minx) > lp->maxgeowidth)) return MS_FALSE;
+    if((lp->mingeowidth > 0) && ((map->extent.maxx - map->extent.minx) < lp->mingeowidth)) return MS_FALSE;
+  }
 
-  shapeObj shape;
+  return MS_TRUE;
+}
 
-  int nclasses = 0;
-  int *classgroup = NULL;
-  double minfeaturesize = -1;
+/*
+** Queries one layer, the tests of msQueryLayerPrepare() passed. Returns MS_SUCCESS,
+** MS_FAILURE, or MS_DONE if the layers left need not be searched. Results that count
+** against the query maxfeatures are added to *numfound.
+*/
+typedef int (*queryLayerFunc)(mapObj *map, layerObj *lp, int *numfound);
 
-  if(map->query.type != MS_QUERY_BY_FILTER) {
-    msSetError(MS_QUERYERR, "The query is not properly defined.", "msQueryByFilter()");
-    return(MS_FAILURE);
+/*
+** Threaded queries (map CONFIG "MS_QUERY_THREADS" "n"): when msQueryByRect(),
+** msQueryByPoint() or msQueryByFilter() search all the layers, the local vector and
+** database layers are queried up to n at a time on the thread pool, each into its
+** own result cache. Layers of the same database connection may share a pooled
+** connection handle, so they are queried one after the other by the same task.
+** The outcomes are then taken in layer order: the other layers are queried at that
+** point, and the first layer that failed fails the query, as if the layers had
+** been queried one by one. Queries where a layer depends on the ones queried
+** before (query maxfeatures or startindex, shapefunc, single result over all the
+** layers) are not threaded.
+*/
+typedef struct {
+  mapObj *map;
+  queryLayerFunc func;
+  int *layers;     /* indexes of the layers, queried in this order */
+  int numlayers;
+  int *status;     /* of each map layer */
+  int *numfound;   /* of each map layer */
+  double *starts, *ends; /* of the query of each map layer, for its trace span */
+  void *threadid;  /* of the thread running the query */
+  size_t memorylimit; /* what the request has left, 0 for no cap */
+  size_t memory[MS_REQUEST_MEMORY_NUMTAGS]; /* accounted in another thread, for the request */
+  char *errormsg;
+} queryLayerTaskObj;
+
+static void msQueryLayerTask(void *data)
+{
+  queryLayerTaskObj *task = (queryLayerTaskObj *) data;
+  int i, inthread = (msGetThreadId() != task->threadid);
+
+  /* the memory of the layers queried in another thread is accounted there, then handed over */
+  if(inthread)
+    msIO_setRequestMemoryLimit(task->memorylimit);
+
+  for(i=0; i<task->numlayers; i++) {
+    int l = task->layers[i];
+
+    task->starts[l] = msStatsNow();
+    task->status[l] = task->func(task->map, GET_LAYER(task->map, l), &task->numfound[l]);
+    task->ends[l] = msStatsNow();
+    if(task->status[l] == MS_FAILURE || msIO_checkRequestMemory("msQueryLayers()") != MS_SUCCESS) {
+      task->status[l] = MS_FAILURE;
+      break;
+    }
   }
-  if(!map->query.filter.string) {
-    msSetError(MS_QUERYERR, "Filter is not set.", "msQueryByFilter()");
-    return(MS_FAILURE);
+
+  /* errors stay with the thread running the query */
+  if(inthread) {
+    if(i < task->numlayers)
+      task->errormsg = msGetErrorString("\n");
+    msResetErrorList();
+    msIO_getRequestMemory(task->memory);
+    msIO_setRequestMemoryLimit(0);
   }
+}
 
-  // fprintf(stderr, "in msQueryByFilter: filter=%s, filteritem=%s\n", map->query.filter.string, map->query.filteritem);
+/* a layer whose query only touches its own state: local vector or database data */
+static int msLayerCanQueryInThread(mapObj *map, layerObj *lp)
+{
+  if(lp->type != MS_LAYER_POINT && lp->type != MS_LAYER_LINE && lp->type != MS_LAYER_POLYGON) return MS_FALSE;
 
-  msInitShape(&shape);
+  switch(lp->connectiontype) {
+    case MS_SHAPEFILE:
+    case MS_TILED_SHAPEFILE:
+      if(lp->tileindex && msGetLayerIndex(map, lp->tileindex) != -1) return MS_FALSE; /* tile index layer shared with others */
+      break;
+    case MS_INLINE:
+      break;
+    case MS_POSTGIS:
+    case MS_OGR:
+      if(lp->tileindex) return MS_FALSE;
+      break;
+    default:
+      return MS_FALSE;
+  }
 
-  if(map->query.layer < 0 || map->query.layer >= map->numlayers)
-    start = map->numlayers-1;
-  else
-    start = stop = map->query.layer;
+  if(msLayerGetProcessingKey(lp, "PROJECTED_DATA")) return MS_FALSE;
+
+  return MS_TRUE;
+}
+
+static int msQueryLayersInThreads(mapObj *map, int start, int stop, queryLayerFunc func, int numthreads)
+{
+  queryLayerTaskObj *tasks;
+  void **taskptrs;
+  int *layertask, *layerstatus, *numfound;
+  double *starts, *ends;
+  size_t memorylimit = msIO_getRequestMemoryLimit();
+  int i, t, l, span, numtasks = 0, status = MS_SUCCESS;
+
+  tasks = (queryLayerTaskObj *) msSmallCalloc(map->numlayers, sizeof(queryLayerTaskObj));
+  taskptrs = (void **) msSmallMalloc(map->numlayers * sizeof(void *));
+  layertask = (int *) msSmallMalloc(map->numlayers * sizeof(int)); /* -2 not queried, -1 queried here */
+  layerstatus = (int *) msSmallMalloc(map->numlayers * sizeof(int));
+  numfound = (int *) msSmallCalloc(map->numlayers, sizeof(int));
+  starts = (double *) msSmallCalloc(map->numlayers, sizeof(double));
+  ends = (double *) msSmallCalloc(map->numlayers, sizeof(double));
+
+  if(memorylimit > 0) {
+    size_t used = msIO_getRequestMemory(NULL);
+    memorylimit = (memorylimit > used) ? memorylimit - used : 1;
+  }
 
   for(l=start; l>=stop; l--) {
-    lp = (GET_LAYER(map, l));
+    layerObj *lp = GET_LAYER(map, l);
+
+    layerstatus[l] = MS_FAILURE; /* until queried */
+    layertask[l] = -2;
+    if(!msQueryLayerPrepare(map, lp)) continue;
+    layertask[l] = -1;
+    if(!msLayerCanQueryInThread(map, lp)) continue;
+
+    for(i=0; i<numtasks; i++) {
+      layerObj *first = GET_LAYER(map, tasks[i].layers[0]);
+      if(lp->connectiontype != MS_SHAPEFILE && lp->connectiontype != MS_TILED_SHAPEFILE && lp->connectiontype != MS_INLINE &&
+          lp->connection && first->connection && lp->connectiontype == first->connectiontype &&
+          strcmp(lp->connection, first->connection) == 0)
+        break;
+    }
+    if(i == numtasks) {
+      tasks[i].map = map;
+      tasks[i].func = func;
+      tasks[i].layers = (int *) msSmallMalloc(map->numlayers * sizeof(int));
+      tasks[i].status = layerstatus;
+      tasks[i].numfound = numfound;
+      tasks[i].starts = starts;
+      tasks[i].ends = ends;
+      tasks[i].threadid = msGetThreadId();
+      tasks[i].memorylimit = memorylimit;
+      taskptrs[i] = &tasks[i];
+      numtasks++;
+    }
+    tasks[i].layers[tasks[i].numlayers++] = l;
+    layertask[l] = i;
+  }
+
+  if(numtasks >= 2) {
+    if(map->debug >= MS_DEBUGLEVEL_V)
+      msDebug("msQueryLayersInThreads(): querying %d layer groups in %d threads.\n", numtasks, MS_MIN(numtasks, numthreads));
+    msThreadPoolRun(msQueryLayerTask, taskptrs, numtasks, numthreads);
+    for(i=0; i<numtasks; i++) {
+      for(t=0; t<MS_REQUEST_MEMORY_NUMTAGS; t++)
+        if(tasks[i].memory[t] > 0) msIO_requestMemoryAlloc(t, tasks[i].memory[t]);
+    }
+  } else {
+    for(l=start; l>=stop; l--)
+      if(layertask[l] >= 0) layertask[l] = -1;
+  }
+
+  /* in layer order */
+  for(l=start; l>=stop; l--) {
+    if(layertask[l] == -2) continue;
+
+    span = msTraceSpanBegin("msQueryLayer", MS_TRACE_INTERNAL);
+    msTraceSpanAttribute(span, "mapserver.layer", GET_LAYER(map, l)->name);
+    if(layertask[l] == -1)
+      layerstatus[l] = func(map, GET_LAYER(map, l), &numfound[l]);
+    else {
+      if(ends[l] > 0)
+        msTraceSpanSetTimes(span, starts[l], ends[l]);
+      if(layerstatus[l] == MS_FAILURE && tasks[layertask[l]].errormsg)
+        msSetError(MS_QUERYERR, "%s", "msQueryLayersInThreads()", tasks[layertask[l]].errormsg);
+    }
+    msTraceSpanEnd(span, layerstatus[l]);
+
+    map->query.maxfeatures -= numfound[l];
+    if(layerstatus[l] == MS_FAILURE || msIO_checkRequestMemory("msQueryLayers()") != MS_SUCCESS) {
+      status = MS_FAILURE;
+      break;
+    }
+    if(layerstatus[l] == MS_DONE)
+      break;
+  }
+
+  for(i=0; i<numtasks; i++) {
+    msFree(tasks[i].layers);
+    msFree(tasks[i].errormsg);
+  }
+  msFree(tasks);
+  msFree(taskptrs);
+  msFree(layertask);
+  msFree(layerstatus);
+  msFree(numfound);
+  msFree(starts);
+  msFree(ends);
+
+  return status;
+}
+
+/*
+** Queries the layers from start down to stop with func, see queryLayerFunc. Returns
+** MS_FAILURE as soon as one fails.
+*/
+static int msQueryLayers(mapObj *map, int start, int stop, queryLayerFunc func)
+{
+  int l, status, span, numthreads = 0;
+
+  if(start != stop && msGetConfigOption(map, "MS_QUERY_THREADS") && map->query.maxfeatures < 0 &&
+      map->query.startindex <= 1 && !map->query.shapefunc &&
+      !(map->query.type == MS_QUERY_BY_POINT && map->query.mode == MS_QUERY_SINGLE && map->query.maxresults == 0)) {
+    numthreads = atoi(msGetConfigOption(map, "MS_QUERY_THREADS"));
+    for(l=start; l>=stop; l--)
+      if(GET_LAYER(map, l)->startindex > 1) numthreads = 0;
+  }
+  if(numthreads > 1)
+    return msQueryLayersInThreads(map, start, stop, func, numthreads);
+
+  for(l=start; l>=stop; l--) {
+    layerObj *lp = GET_LAYER(map, l);
+    int numfound = 0;
+
+    /* Set the global maxfeatures */
     if (map->query.maxfeatures == 0)
       break; /* nothing else to do */
     else if (map->query.maxfeatures > 0)
@@ -687,207 +1182,253 @@ int msQueryByFilter(mapObj *map)
     /* using mapscript, the map->query.startindex will be unset... */
     if (lp->startindex > 1 && map->query.startindex < 0)
       map->query.startindex = lp->startindex;
-    
-    /* conditions may have changed since this layer last drawn, so set
-       layer->project true to recheck projection needs (Bug #673) */
-    lp->project = MS_TRUE;
-
-    /* free any previous search results, do it now in case one of the next few tests fail */
-    if(lp->resultcache) {
-      if(lp->resultcache->results) free(lp->resultcache->results);
-      free(lp->resultcache);
-      lp->resultcache = NULL;
-    }
 
-    if(!msIsLayerQueryable(lp)) continue;
-    if(lp->status == MS_OFF) continue;
-    if(lp->type == MS_LAYER_RASTER) continue; /* ok to skip? */
+    if(!msQueryLayerPrepare(map, lp)) continue;
 
-    if(map->scaledenom > 0) {
-      if((lp->maxscaledenom > 0) && (map->scaledenom > lp->maxscaledenom)) continue;
-      if((lp->minscaledenom > 0) && (map->scaledenom <= lp->minscaledenom)) continue;
-    }
+    span = msTraceSpanBegin("msQueryLayer", MS_TRACE_INTERNAL);
+    msTraceSpanAttribute(span, "mapserver.layer", lp->name);
+    status = func(map, lp, &numfound);
+    msTraceSpanEnd(span, status);
+    map->query.maxfeatures -= numfound;
+    if(status == MS_FAILURE || msIO_checkRequestMemory("msQueryLayers()") != MS_SUCCESS)
+      return MS_FAILURE;
+    if(status == MS_DONE)
+      break; /* no need to search any further */
+  }
 
-    if (lp->maxscaledenom <= 0 && lp->minscaledenom <= 0) {
-      if((lp->maxgeowidth > 0) && ((map->extent.maxx - map->extent.minx) > lp->maxgeowidth)) continue;
-      if((lp->mingeowidth > 0) && ((map->extent.maxx - map->extent.minx) < lp->mingeowidth)) continue;
-    }
+  return MS_SUCCESS;
+}
 
-    msLayerClose(lp); /* reset */
-    status = msLayerOpen(lp);
-    if(status != MS_SUCCESS) goto query_error;
+/*
+** Queries layer lp for msQueryByFilter(), see msQueryLayers().
+*/
+static int msQueryLayerByFilter(mapObj *map, layerObj *lp, int *numfound)
+{
+  char status;
 
-    /* disable driver paging */
-    msLayerEnablePaging(lp, MS_FALSE);
-        
-    old_filteritem = lp->filteritem; /* cache the existing filter/filteritem */
-    msInitExpression(&old_filter);
-    msCopyExpression(&old_filter, &lp->filter);
-        
-    /*
-    ** Set the lp->filter and lp->filteritem (may need to merge). Remember filters are *always* MapServer syntax.
-    */
-    lp->filteritem = map->query.filteritem; /* re-point lp->filteritem */
-    if(old_filter.string != NULL) { /* need to merge filters to create one logical expression */
-      lp->filter = mergeFilters(&map->query.filter, map->query.filteritem, &old_filter, old_filteritem);      
-      if(!lp->filter.string) {
-	msSetError(MS_MISCERR, "Filter merge failed, able to process query.", "msQueryByFilter()");
-        goto query_error;
-      }      
-    } else {
-      msCopyExpression(&lp->filter, &map->query.filter); /* apply new filter */
-    }
+  char *old_filteritem=NULL;
+  expressionObj old_filter;
 
-    /* build item list, we want *all* items, note this *also* build tokens for the layer filter */
-    status = msLayerWhichItems(lp, MS_TRUE, NULL);
-    if(status != MS_SUCCESS) goto query_error;
+  rectObj search_rect;
 
-    search_rect = map->query.rect;
+  shapeObj shape;
 
-    /* If only result count is needed, we can use msLayerGetShapeCount() */
-    /* that has optimizations to avoid retrieving individual features */
-    if( map->query.only_cache_result_count &&
-        lp->template != NULL && /* always TRUE for WFS case */
-        lp->minfeaturesize <= 0 )
-    {
-      int bUseLayerSRS = MS_FALSE;
-      int numFeatures = -1;
+  int nclasses = 0;
+  int *classgroup = NULL;
+  double minfeaturesize = -1;
 
-#if defined(USE_PROJ) && (defined(USE_WMS_SVR) || defined (USE_WFS_SVR) || defined (USE_WCS_SVR) || defined(USE_SOS_SVR) || defined(USE_WMS_LYR) || defined(USE_WFS_LYR))
-      /* Optimization to detect the case where a WFS query uses in fact the */
-      /* whole layer extent, but expressed in a map SRS different from the layer SRS */
-      /* In the case, we can directly request against the layer extent in its native SRS */
-      if( lp->project &&
-          msProjectionsDiffer(&(lp->projection), &(map->projection)) )
-      {
-        rectObj layerExtent;
-        if ( msOWSGetLayerExtent(map, lp, "FO", &layerExtent) == MS_SUCCESS)
-        {
-            rectObj ext = layerExtent;
-            ext.minx -= 1e-5;
-            ext.miny -= 1e-5;
-            ext.maxx += 1e-5;
-            ext.maxy += 1e-5;
-            msProjectRect(&(lp->projection), &(map->projection), &ext);
-            if( fabs(ext.minx - search_rect.minx) <= 2e-5 &&
-                fabs(ext.miny - search_rect.miny) <= 2e-5 &&
-                fabs(ext.maxx - search_rect.maxx) <= 2e-5 &&
-                fabs(ext.maxy - search_rect.maxy) <= 2e-5 )
-            {
-              bUseLayerSRS = MS_TRUE;
-              numFeatures = msLayerGetShapeCount(lp, layerExtent, &(lp->projection));
-            }
-        }
-      }
-#endif
+  if(lp->type == MS_LAYER_RASTER) return MS_SUCCESS; /* ok to skip? */
 
-      if( !bUseLayerSRS )
-          numFeatures = msLayerGetShapeCount(lp, search_rect, &(map->projection));
-      if( numFeatures >= 0 )
-      {
-        lp->resultcache = (resultCacheObj *)malloc(sizeof(resultCacheObj)); /* allocate and initialize the result cache */
-        MS_CHECK_ALLOC(lp->resultcache, sizeof(resultCacheObj), MS_FAILURE);
-        initResultCache( lp->resultcache);
-        lp->resultcache->numresults = numFeatures;
-        if (!msLayerGetPaging(lp) && map->query.startindex > 1) {
-           lp->resultcache->numresults -= (map->query.startindex-1);
-        }
+  msInitShape(&shape);
 
-        lp->filteritem = old_filteritem; /* point back to original value */
-        msCopyExpression(&lp->filter, &old_filter); /* restore old filter */
-        msFreeExpression(&old_filter);
+  msLayerClose(lp); /* reset */
+  status = msLayerOpen(lp);
+  if(status != MS_SUCCESS) return MS_FAILURE;
 
-        continue;
-      }
-      // Fallback in case of error (should not happen normally)
-    }
+  /* disable driver paging */
+  msLayerEnablePaging(lp, MS_FALSE);
+      
+  old_filteritem = lp->filteritem; /* cache the existing filter/filteritem */
+  msInitExpression(&old_filter);
+  msCopyExpression(&old_filter, &lp->filter);
+      
+  /*
+  ** Set the lp->filter and lp->filteritem (may need to merge). Remember filters are *always* MapServer syntax.
+  */
+  lp->filteritem = map->query.filteritem; /* re-point lp->filteritem */
+  if(old_filter.string != NULL) { /* need to merge filters to create one logical expression */
+    lp->filter = mergeFilters(&map->query.filter, map->query.filteritem, &old_filter, old_filteritem);      
+    if(!lp->filter.string) {
+	msSetError(MS_MISCERR, "Filter merge failed, able to process query.", "msQueryByFilter()");
+      return MS_FAILURE;
+    }      
+  } else {
+    msCopyExpression(&lp->filter, &map->query.filter); /* apply new filter */
+  }
 
-#ifdef USE_PROJ
-    lp->project = msProjectionsDiffer(&(lp->projection), &(map->projection));
-    if(lp->project)
-      msProjectRect(&(map->projection), &(lp->projection), &search_rect); /* project the searchrect to source coords */
+  /* build item list, we want *all* items, note this *also* build tokens for the layer filter */
+  status = msLayerWhichItems(lp, MS_TRUE, NULL);
+  if(status != MS_SUCCESS) return MS_FAILURE;
+
+  search_rect = map->query.rect;
+
+  /* If only result count is needed, we can use msLayerGetShapeCount() */
+  /* that has optimizations to avoid retrieving individual features */
+  if( map->query.only_cache_result_count && !map->query.shapefunc &&
+      lp->template != NULL && /* always TRUE for WFS case */
+      lp->minfeaturesize <= 0 )
+  {
+    int bUseLayerSRS = MS_FALSE;
+    int numFeatures = -1;
+
+#if defined(USE_PROJ) && (defined(USE_WMS_SVR) || defined (USE_WFS_SVR) || defined (USE_WCS_SVR) || defined(USE_SOS_SVR) || defined(USE_WMS_LYR) || defined(USE_WFS_LYR))
+    /* Optimization to detect the case where a WFS query uses in fact the */
+    /* whole layer extent, but expressed in a map SRS different from the layer SRS */
+    /* In the case, we can directly request against the layer extent in its native SRS */
+    if( lp->project &&
+        msProjectionsDiffer(&(lp->projection), &(map->projection)) )
+    {
+      rectObj layerExtent;
+      if ( msOWSGetLayerExtent(map, lp, "FO", &layerExtent) == MS_SUCCESS)
+      {
+          rectObj ext = layerExtent;
+          ext.minx -= 1e-5;
+          ext.miny -= 1e-5;
+          ext.maxx += 1e-5;
+          ext.maxy += 1e-5;
+          msProjectRect(&(lp->projection), &(map->projection), &ext);
+          if( fabs(ext.minx - search_rect.minx) <= 2e-5 &&
+              fabs(ext.miny - search_rect.miny) <= 2e-5 &&
+              fabs(ext.maxx - search_rect.maxx) <= 2e-5 &&
+              fabs(ext.maxy - search_rect.maxy) <= 2e-5 )
+          {
+            bUseLayerSRS = MS_TRUE;
+            numFeatures = msLayerGetShapeCount(lp, layerExtent, &(lp->projection));
+          }
+      }
+    }
 #endif
 
-    status = msLayerWhichShapes(lp, search_rect, MS_TRUE);
-    if(status == MS_DONE) { /* no overlap */
-      msLayerClose(lp);
-      continue;
-    } else if(status != MS_SUCCESS) goto query_error;
+    if( !bUseLayerSRS )
+        numFeatures = msLayerGetShapeCount(lp, search_rect, &(map->projection));
+    if( numFeatures >= 0 )
+    {
+      lp->resultcache = (resultCacheObj *)malloc(sizeof(resultCacheObj)); /* allocate and initialize the result cache */
+      MS_CHECK_ALLOC(lp->resultcache, sizeof(resultCacheObj), MS_FAILURE);
+      initResultCache( lp->resultcache);
+      lp->resultcache->numresults = numFeatures;
+      if (!msLayerGetPaging(lp) && map->query.startindex > 1) {
+         lp->resultcache->numresults -= (map->query.startindex-1);
+      }
 
-    lp->resultcache = (resultCacheObj *)malloc(sizeof(resultCacheObj)); /* allocate and initialize the result cache */
-    initResultCache( lp->resultcache);
+      lp->filteritem = old_filteritem; /* point back to original value */
+      msCopyExpression(&lp->filter, &old_filter); /* restore old filter */
+      msFreeExpression(&old_filter);
 
-    nclasses = 0;
-    classgroup = NULL;
-    if (lp->classgroup && lp->numclasses > 0)
-      classgroup = msAllocateValidClassGroups(lp, &nclasses);
+      return MS_SUCCESS;
+    }
+    // Fallback in case of error (should not happen normally)
+  }
 
-    if (lp->minfeaturesize > 0)
-      minfeaturesize = Pix2LayerGeoref(map, lp, lp->minfeaturesize);
+#ifdef USE_PROJ
+  lp->project = msProjectionsDiffer(&(lp->projection), &(map->projection));
+  if(lp->project)
+    msProjectRect(&(map->projection), &(lp->projection), &search_rect); /* project the searchrect to source coords */
+#endif
 
-    while((status = msLayerNextShape(lp, &shape)) == MS_SUCCESS) { /* step through the shapes - if necessary the filter is applied in msLayerNextShape(...) */
+  status = msLayerWhichShapes(lp, search_rect, MS_TRUE);
+  if(status == MS_DONE) { /* no overlap */
+    msLayerClose(lp);
+    return MS_SUCCESS;
+  } else if(status != MS_SUCCESS) return MS_FAILURE;
 
-       /* Check if the shape size is ok to be drawn */
-      if ( (shape.type == MS_SHAPE_LINE || shape.type == MS_SHAPE_POLYGON) && (minfeaturesize > 0) ) {
-        if (msShapeCheckSize(&shape, minfeaturesize) == MS_FALSE) {
-          if( lp->debug >= MS_DEBUGLEVEL_V )
-            msDebug("msQueryByFilter(): Skipping shape (%ld) because LAYER::MINFEATURESIZE is bigger than shape size\n", shape.index);
-          msFreeShape(&shape);
-          continue;
-        }
-      }
+  lp->resultcache = (resultCacheObj *)malloc(sizeof(resultCacheObj)); /* allocate and initialize the result cache */
+  initResultCache( lp->resultcache);
 
-      shape.classindex = msShapeGetClass(lp, map, &shape, classgroup, nclasses);
-      if(!(lp->template) && ((shape.classindex == -1) || (lp->class[shape.classindex]->status == MS_OFF))) { /* not a valid shape */
-        msFreeShape(&shape);
-        continue;
-      }
+  nclasses = 0;
+  classgroup = NULL;
+  if (lp->classgroup && lp->numclasses > 0)
+    classgroup = msAllocateValidClassGroups(lp, &nclasses);
 
-      if(!(lp->template) && !(lp->class[shape.classindex]->template)) { /* no valid template */
+  if (lp->minfeaturesize > 0)
+    minfeaturesize = Pix2LayerGeoref(map, lp, lp->minfeaturesize);
+
+  while((status = msLayerNextShape(lp, &shape)) == MS_SUCCESS) { /* step through the shapes - if necessary the filter is applied in msLayerNextShape(...) */
+
+     /* Check if the shape size is ok to be drawn */
+    if ( (shape.type == MS_SHAPE_LINE || shape.type == MS_SHAPE_POLYGON) && (minfeaturesize > 0) ) {
+      if (msShapeCheckSize(&shape, minfeaturesize) == MS_FALSE) {
+        if( lp->debug >= MS_DEBUGLEVEL_V )
+          msDebug("msQueryByFilter(): Skipping shape (%ld) because LAYER::MINFEATURESIZE is bigger than shape size\n", shape.index);
         msFreeShape(&shape);
         continue;
       }
+    }
+
+    shape.classindex = msShapeGetClass(lp, map, &shape, classgroup, nclasses);
+    if(!(lp->template) && ((shape.classindex == -1) || (lp->class[shape.classindex]->status == MS_OFF))) { /* not a valid shape */
+      msFreeShape(&shape);
+      continue;
+    }
+
+    if(!(lp->template) && !(lp->class[shape.classindex]->template)) { /* no valid template */
+      msFreeShape(&shape);
+      continue;
+    }
 
 #ifdef USE_PROJ
-      if(lp->project)
-        msProjectShape(&(lp->projection), &(map->projection), &shape);
+    if(lp->project)
+      msProjectShape(&(lp->projection), &(map->projection), &shape);
 #endif
 
-      /* Should we skip this feature? */
-      if (!msLayerGetPaging(lp) && map->query.startindex > 1) {
-        --map->query.startindex;
+    /* Should we skip this feature? */
+    if (!msLayerGetPaging(lp) && map->query.startindex > 1) {
+      --map->query.startindex;
+      msFreeShape(&shape);
+      continue;
+    }
+  
+    if( map->query.shapefunc ) {
+      lp->resultcache->numresults ++;
+      if( map->query.shapefunc(lp, &shape, map->query.shapefuncdata) != MS_SUCCESS ) {
         msFreeShape(&shape);
-        continue;
+        status = MS_FAILURE;
+        break;
       }
-    
-      if( map->query.only_cache_result_count )
-        lp->resultcache->numresults ++;
-      else
-        addResult(lp->resultcache, &shape);
-      msFreeShape(&shape);
+    } else if( map->query.only_cache_result_count )
+      lp->resultcache->numresults ++;
+    else
+      addResult(lp->resultcache, &shape);
+    msFreeShape(&shape);
 
-      if(map->query.mode == MS_QUERY_SINGLE) { /* no need to look any further */
+    if(map->query.mode == MS_QUERY_SINGLE) { /* no need to look any further */
 	status = MS_DONE;
 	break;
-      }
+    }
 
-      /* check shape count */
-      if(lp->maxfeatures > 0 && lp->maxfeatures == lp->resultcache->numresults) {
-        status = MS_DONE;
-        break;
-      }
-    } /* next shape */
+    /* check shape count */
+    if(lp->maxfeatures > 0 && lp->maxfeatures == lp->resultcache->numresults) {
+      status = MS_DONE;
+      break;
+    }
+  } /* next shape */
 
-    if(classgroup) msFree(classgroup);
+  if(classgroup) msFree(classgroup);
 
-    lp->filteritem = old_filteritem; /* point back to original value */
-    msCopyExpression(&lp->filter, &old_filter); /* restore old filter */
-    msFreeExpression(&old_filter);
+  lp->filteritem = old_filteritem; /* point back to original value */
+  msCopyExpression(&lp->filter, &old_filter); /* restore old filter */
+  msFreeExpression(&old_filter);
 
-    if(status != MS_DONE) goto query_error;
-    if(!map->query.only_cache_result_count && lp->resultcache->numresults == 0) 
-      msLayerClose(lp); /* no need to keep the layer open */
-  } /* next layer */
+  if(status != MS_DONE) return MS_FAILURE;
+  if(!map->query.only_cache_result_count && lp->resultcache->numresults == 0) 
+    msLayerClose(lp); /* no need to keep the layer open */
+
+  return MS_SUCCESS;
+}
+
+int msQueryByFilter(mapObj *map)
+{
+  int l;
+  int start, stop=0;
+
+  if(map->query.type != MS_QUERY_BY_FILTER) {
+    msSetError(MS_QUERYERR, "The query is not properly defined.", "msQueryByFilter()");
+    return(MS_FAILURE);
+  }
+  if(!map->query.filter.string) {
+    msSetError(MS_QUERYERR, "Filter is not set.", "msQueryByFilter()");
+    return(MS_FAILURE);
+  }
+
+  // fprintf(stderr, "in msQueryByFilter: filter=%s, filteritem=%s\n", map->query.filter.string, map->query.filteritem);
+
+  if(map->query.layer < 0 || map->query.layer >= map->numlayers)
+    start = map->numlayers-1;
+  else
+    start = stop = map->query.layer;
+
+  if(msQueryLayers(map, start, stop, msQueryLayerByFilter) != MS_SUCCESS)
+    return MS_FAILURE;
 
   /* was anything found? */
   for(l=start; l>=stop; l--) {
@@ -897,25 +1438,19 @@ int msQueryByFilter(mapObj *map)
 
   msSetError(MS_NOTFOUND, "No matching record(s) found.", "msQueryByFilter()");
   return MS_FAILURE;
-
-query_error:
-  // msFree(lp->filteritem);
-  // lp->filteritem = old_filteritem;
-  // msCopyExpression(&lp->filter, &old_filter); /* restore old filter */
-  // msFreeExpression(&old_filter);
-  // msLayerClose(lp);
-  return MS_FAILURE;
 }
 
-int msQueryByRect(mapObj *map)
+/*
+** Queries layer lp for msQueryByRect(), see msQueryLayers(). The results found
+** count against the query maxfeatures.
+*/
+static int msQueryLayerByRect(mapObj *map, layerObj *lp, int *numfound)
 {
-  int l; /* counters */
-  int start, stop=0;
-
-  layerObj *lp;
+  int scanned; /* counters */
 
   char status;
   shapeObj shape, searchshape;
+  shapeBatchObj batch;
   rectObj searchrect, searchrectInMapProj;
   double layer_tolerance = 0, tolerance = 0;
 
@@ -924,281 +1459,420 @@ int msQueryByRect(mapObj *map)
   int *classgroup = NULL;
   double minfeaturesize = -1;
 
-  if(map->query.type != MS_QUERY_BY_RECT) {
-    msSetError(MS_QUERYERR, "The query is not properly defined.", "msQueryByRect()");
-    return(MS_FAILURE);
-  }
-
   msInitShape(&shape);
   msInitShape(&searchshape);
 
-  if(map->query.layer < 0 || map->query.layer >= map->numlayers)
-    start = map->numlayers-1;
-  else
-    start = stop = map->query.layer;
+  searchrect = map->query.rect;
+  if(lp->tolerance > 0) {
+    layer_tolerance = lp->tolerance;
 
-  for(l=start; l>=stop; l--) {
-    lp = (GET_LAYER(map, l));
-    /* Set the global maxfeatures */
-    if (map->query.maxfeatures == 0)
-      break; /* nothing else to do */
-    else if (map->query.maxfeatures > 0)
-      lp->maxfeatures = map->query.maxfeatures;
+    if(lp->toleranceunits == MS_PIXELS)
+      tolerance = layer_tolerance * msAdjustExtent(&(map->extent), map->width, map->height);
+    else
+      tolerance = layer_tolerance * (msInchesPerUnit(lp->toleranceunits,0)/msInchesPerUnit(map->units,0));
 
-    /* using mapscript, the map->query.startindex will be unset... */
-    if (lp->startindex > 1 && map->query.startindex < 0)
-      map->query.startindex = lp->startindex;
-    
-    /* conditions may have changed since this layer last drawn, so set
-       layer->project true to recheck projection needs (Bug #673) */
-    lp->project = MS_TRUE;
+    searchrect.minx -= tolerance;
+    searchrect.maxx += tolerance;
+    searchrect.miny -= tolerance;
+    searchrect.maxy += tolerance;
+  }
+  searchrectInMapProj = searchrect;
 
-    /* free any previous search results, do it now in case one of the next few tests fail */
-    if(lp->resultcache) {
-      if(lp->resultcache->results) free(lp->resultcache->results);
-      free(lp->resultcache);
-      lp->resultcache = NULL;
+  msRectToPolygon(searchrect, &searchshape);
+
+  /* Raster layers are handled specially. */
+  if( lp->type == MS_LAYER_RASTER ) {
+    if( msRasterQueryByRect( map, lp, searchrect ) == MS_FAILURE) {
+      msFreeShape(&searchshape);
+      return MS_FAILURE;
     }
 
-    if(!msIsLayerQueryable(lp)) continue;
-    if(lp->status == MS_OFF) continue;
+    msFreeShape(&searchshape);
+    return MS_SUCCESS;
+  }
 
-    if(map->scaledenom > 0) {
-      if((lp->maxscaledenom > 0) && (map->scaledenom > lp->maxscaledenom)) continue;
-      if((lp->minscaledenom > 0) && (map->scaledenom <= lp->minscaledenom)) continue;
+  /* Paging could have been disabled before */
+  paging = msLayerGetPaging(lp);
+  msLayerClose(lp); /* reset */
+  status = msLayerOpen(lp);
+  if(status != MS_SUCCESS) {
+    msFreeShape(&searchshape);
+    return(MS_FAILURE);
+  }
+  msLayerEnablePaging(lp, paging);
+
+  /* build item list, we want *all* items */
+  status = msLayerWhichItems(lp, MS_TRUE, NULL);
+  if(status != MS_SUCCESS) {
+    msFreeShape(&searchshape);
+    return(MS_FAILURE);
+  }
+
+  /* If only result count is needed, we can use msLayerGetShapeCount() */
+  /* that has optimizations to avoid retrieving individual features */
+  if( map->query.only_cache_result_count && !map->query.shapefunc &&
+      lp->template != NULL && /* always TRUE for WFS case */
+      lp->minfeaturesize <= 0 )
+  {
+    int bUseLayerSRS = MS_FALSE;
+    int numFeatures = -1;
+
+#if defined(USE_PROJ) && (defined(USE_WMS_SVR) || defined (USE_WFS_SVR) || defined (USE_WCS_SVR) || defined(USE_SOS_SVR) || defined(USE_WMS_LYR) || defined(USE_WFS_LYR))
+    /* Optimization to detect the case where a WFS query uses in fact the */
+    /* whole layer extent, but expressed in a map SRS different from the layer SRS */
+    /* In the case, we can directly request against the layer extent in its native SRS */
+    if( lp->project &&
+        msProjectionsDiffer(&(lp->projection), &(map->projection)) )
+    {
+      rectObj layerExtent;
+      if ( msOWSGetLayerExtent(map, lp, "FO", &layerExtent) == MS_SUCCESS)
+      {
+          rectObj ext = layerExtent;
+          ext.minx -= 1e-5;
+          ext.miny -= 1e-5;
+          ext.maxx += 1e-5;
+          ext.maxy += 1e-5;
+          msProjectRect(&(lp->projection), &(map->projection), &ext);
+          if( fabs(ext.minx - searchrect.minx) <= 2e-5 &&
+              fabs(ext.miny - searchrect.miny) <= 2e-5 &&
+              fabs(ext.maxx - searchrect.maxx) <= 2e-5 &&
+              fabs(ext.maxy - searchrect.maxy) <= 2e-5 )
+          {
+            bUseLayerSRS = MS_TRUE;
+            numFeatures = msLayerGetShapeCount(lp, layerExtent, &(lp->projection));
+          }
+      }
     }
+#endif
 
-    if (lp->maxscaledenom <= 0 && lp->minscaledenom <= 0) {
-      if((lp->maxgeowidth > 0) && ((map->extent.maxx - map->extent.minx) > lp->maxgeowidth)) continue;
-      if((lp->mingeowidth > 0) && ((map->extent.maxx - map->extent.minx) < lp->mingeowidth)) continue;
+    if( !bUseLayerSRS )
+        numFeatures = msLayerGetShapeCount(lp, searchrect, &(map->projection));
+    if( numFeatures >= 0 )
+    {
+      lp->resultcache = (resultCacheObj *)malloc(sizeof(resultCacheObj)); /* allocate and initialize the result cache */
+      MS_CHECK_ALLOC(lp->resultcache, sizeof(resultCacheObj), MS_FAILURE);
+      initResultCache( lp->resultcache);
+      lp->resultcache->numresults = numFeatures;
+      if (!paging && map->query.startindex > 1) {
+         lp->resultcache->numresults -= (map->query.startindex-1);
+      }
+      msFreeShape(&searchshape);
+      return MS_SUCCESS;
     }
+    // Fallback in case of error (should not happen normally)
+  }
 
-    searchrect = map->query.rect;
-    if(lp->tolerance > 0) {
-      layer_tolerance = lp->tolerance;
+#ifdef USE_PROJ
+  lp->project = msProjectionsDiffer(&(lp->projection), &(map->projection));
+  if(lp->project)
+    msProjectRect(&(map->projection), &(lp->projection), &searchrect); /* project the searchrect to source coords */
+#endif
 
-      if(lp->toleranceunits == MS_PIXELS)
-        tolerance = layer_tolerance * msAdjustExtent(&(map->extent), map->width, map->height);
-      else
-        tolerance = layer_tolerance * (msInchesPerUnit(lp->toleranceunits,0)/msInchesPerUnit(map->units,0));
+  status = msLayerWhichShapes(lp, searchrect, MS_TRUE);
+  if(status == MS_DONE) { /* no overlap */
+    msLayerClose(lp);
+    msFreeShape(&searchshape);
+    return MS_SUCCESS;
+  } else if(status != MS_SUCCESS) {
+    msLayerClose(lp);
+    msFreeShape(&searchshape);
+    return(MS_FAILURE);
+  }
 
-      searchrect.minx -= tolerance;
-      searchrect.maxx += tolerance;
-      searchrect.miny -= tolerance;
-      searchrect.maxy += tolerance;
-    }
-    searchrectInMapProj = searchrect;
+  lp->resultcache = (resultCacheObj *)malloc(sizeof(resultCacheObj)); /* allocate and initialize the result cache */
+  MS_CHECK_ALLOC(lp->resultcache, sizeof(resultCacheObj), MS_FAILURE);
+  initResultCache( lp->resultcache);
 
-    msRectToPolygon(searchrect, &searchshape);
+  nclasses = 0;
+  classgroup = NULL;
+  if (lp->classgroup && lp->numclasses > 0)
+    classgroup = msAllocateValidClassGroups(lp, &nclasses);
 
-    /* Raster layers are handled specially. */
-    if( lp->type == MS_LAYER_RASTER ) {
-      if( msRasterQueryByRect( map, lp, searchrect ) == MS_FAILURE)
-        return MS_FAILURE;
+  if (lp->minfeaturesize > 0)
+    minfeaturesize = Pix2LayerGeoref(map, lp, lp->minfeaturesize);
 
-      continue;
+  scanned = 0;
+  msInitShapeBatch(&batch);
+  while((status = msShapeBatchNext(lp, &batch, &shape)) == MS_SUCCESS) { /* step through the shapes */
+
+    /* poll the request cancellation and time budget now and then */
+    if((++scanned & 1023) == 0 && msIO_checkRequestCancelled("msQueryByRect()")) {
+      msFreeShape(&shape);
+      status = msIO_isRequestOutputPartial() ? MS_DONE : MS_FAILURE;
+      break;
     }
 
-    /* Paging could have been disabled before */
-    paging = msLayerGetPaging(lp);
-    msLayerClose(lp); /* reset */
-    status = msLayerOpen(lp);
-    if(status != MS_SUCCESS) {
-      msFreeShape(&searchshape);
-      return(MS_FAILURE);
+    /* Check if the shape size is ok to be drawn */
+    if ( (shape.type == MS_SHAPE_LINE || shape.type == MS_SHAPE_POLYGON) && (minfeaturesize > 0) ) {
+      if (msShapeCheckSize(&shape, minfeaturesize) == MS_FALSE) {
+        if( lp->debug >= MS_DEBUGLEVEL_V )
+          msDebug("msQueryByRect(): Skipping shape (%ld) because LAYER::MINFEATURESIZE is bigger than shape size\n", shape.index);
+        msFreeShape(&shape);
+        continue;
+      }
     }
-    msLayerEnablePaging(lp, paging);
 
-    /* build item list, we want *all* items */
-    status = msLayerWhichItems(lp, MS_TRUE, NULL);
-    if(status != MS_SUCCESS) {
-      msFreeShape(&searchshape);
-      return(MS_FAILURE);
+    shape.classindex = msShapeGetClass(lp, map, &shape, classgroup, nclasses);
+    if(!(lp->template) && ((shape.classindex == -1) || (lp->class[shape.classindex]->status == MS_OFF))) { /* not a valid shape */
+      msFreeShape(&shape);
+      continue;
     }
 
-    /* If only result count is needed, we can use msLayerGetShapeCount() */
-    /* that has optimizations to avoid retrieving individual features */
-    if( map->query.only_cache_result_count &&
-        lp->template != NULL && /* always TRUE for WFS case */
-        lp->minfeaturesize <= 0 )
-    {
-      int bUseLayerSRS = MS_FALSE;
-      int numFeatures = -1;
+    if(!(lp->template) && !(lp->class[shape.classindex]->template)) { /* no valid template */
+      msFreeShape(&shape);
+      continue;
+    }
 
-#if defined(USE_PROJ) && (defined(USE_WMS_SVR) || defined (USE_WFS_SVR) || defined (USE_WCS_SVR) || defined(USE_SOS_SVR) || defined(USE_WMS_LYR) || defined(USE_WFS_LYR))
-      /* Optimization to detect the case where a WFS query uses in fact the */
-      /* whole layer extent, but expressed in a map SRS different from the layer SRS */
-      /* In the case, we can directly request against the layer extent in its native SRS */
-      if( lp->project &&
-          msProjectionsDiffer(&(lp->projection), &(map->projection)) )
-      {
-        rectObj layerExtent;
-        if ( msOWSGetLayerExtent(map, lp, "FO", &layerExtent) == MS_SUCCESS)
-        {
-            rectObj ext = layerExtent;
-            ext.minx -= 1e-5;
-            ext.miny -= 1e-5;
-            ext.maxx += 1e-5;
-            ext.maxy += 1e-5;
-            msProjectRect(&(lp->projection), &(map->projection), &ext);
-            if( fabs(ext.minx - searchrect.minx) <= 2e-5 &&
-                fabs(ext.miny - searchrect.miny) <= 2e-5 &&
-                fabs(ext.maxx - searchrect.maxx) <= 2e-5 &&
-                fabs(ext.maxy - searchrect.maxy) <= 2e-5 )
-            {
-              bUseLayerSRS = MS_TRUE;
-              numFeatures = msLayerGetShapeCount(lp, layerExtent, &(lp->projection));
-            }
-        }
-      }
+#ifdef USE_PROJ
+    if(lp->project)
+      msProjectShape(&(lp->projection), &(map->projection), &shape);
 #endif
 
-      if( !bUseLayerSRS )
-          numFeatures = msLayerGetShapeCount(lp, searchrect, &(map->projection));
-      if( numFeatures >= 0 )
-      {
-        lp->resultcache = (resultCacheObj *)malloc(sizeof(resultCacheObj)); /* allocate and initialize the result cache */
-        MS_CHECK_ALLOC(lp->resultcache, sizeof(resultCacheObj), MS_FAILURE);
-        initResultCache( lp->resultcache);
-        lp->resultcache->numresults = numFeatures;
-        if (!paging && map->query.startindex > 1) {
-           lp->resultcache->numresults -= (map->query.startindex-1);
-        }
-        msFreeShape(&searchshape);
+    if(msRectContained(&shape.bounds, &searchrectInMapProj) == MS_TRUE) { /* if the whole shape is in, don't intersect */
+      status = MS_TRUE;
+    } else {
+      switch(shape.type) { /* make sure shape actually intersects the qrect (ADD FUNCTIONS SPECIFIC TO RECTOBJ) */
+        case MS_SHAPE_POINT:
+          status = msIntersectMultipointPolygon(&shape, &searchshape);
+          break;
+        case MS_SHAPE_LINE:
+          status = msIntersectPolylinePolygon(&shape, &searchshape);
+          break;
+        case MS_SHAPE_POLYGON:
+          status = msIntersectPolygons(&shape, &searchshape);
+          break;
+        default:
+          break;
+      }
+    }
+
+    if(status == MS_TRUE) {
+      /* Should we skip this feature? */
+      if (!paging && map->query.startindex > 1) {
+        --map->query.startindex;
+        msFreeShape(&shape);
         continue;
       }
-      // Fallback in case of error (should not happen normally)
+      if( map->query.shapefunc ) {
+          lp->resultcache->numresults ++;
+          if( map->query.shapefunc(lp, &shape, map->query.shapefuncdata) != MS_SUCCESS ) {
+              msFreeShape(&shape);
+              status = MS_FAILURE;
+              break;
+          }
+      } else if( map->query.only_cache_result_count )
+          lp->resultcache->numresults ++;
+      else
+          addResult(lp->resultcache, &shape);
+      (*numfound)++;
     }
+    msFreeShape(&shape);
 
-#ifdef USE_PROJ
-    lp->project = msProjectionsDiffer(&(lp->projection), &(map->projection));
-    if(lp->project)
-      msProjectRect(&(map->projection), &(lp->projection), &searchrect); /* project the searchrect to source coords */
-#endif
+    /* check shape count */
+    if(lp->maxfeatures > 0 && lp->maxfeatures == lp->resultcache->numresults) {
+      status = MS_DONE;
+      break;
+    }
+    
+  } /* next shape */
+  msFreeShapeBatch(&batch);
 
-    status = msLayerWhichShapes(lp, searchrect, MS_TRUE);
-    if(status == MS_DONE) { /* no overlap */
-      msLayerClose(lp);
-      continue;
-    } else if(status != MS_SUCCESS) {
-      msLayerClose(lp);
+  if (classgroup)
+    msFree(classgroup);
+
+  if(status != MS_DONE) {
       msFreeShape(&searchshape);
       return(MS_FAILURE);
-    }
+  }
 
-    lp->resultcache = (resultCacheObj *)malloc(sizeof(resultCacheObj)); /* allocate and initialize the result cache */
-    MS_CHECK_ALLOC(lp->resultcache, sizeof(resultCacheObj), MS_FAILURE);
-    initResultCache( lp->resultcache);
+  if( !map->query.only_cache_result_count &&
+      lp->resultcache->numresults == 0) msLayerClose(lp); /* no need to keep the layer open */
 
-    nclasses = 0;
-    classgroup = NULL;
-    if (lp->classgroup && lp->numclasses > 0)
-      classgroup = msAllocateValidClassGroups(lp, &nclasses);
+  msFreeShape(&searchshape);
+  return MS_SUCCESS;
+}
 
-    if (lp->minfeaturesize > 0)
-      minfeaturesize = Pix2LayerGeoref(map, lp, lp->minfeaturesize);
+int msQueryByRect(mapObj *map)
+{
+  int l;
+  int start, stop=0;
 
-    while((status = msLayerNextShape(lp, &shape)) == MS_SUCCESS) { /* step through the shapes */
+  if(map->query.type != MS_QUERY_BY_RECT) {
+    msSetError(MS_QUERYERR, "The query is not properly defined.", "msQueryByRect()");
+    return(MS_FAILURE);
+  }
 
-      /* Check if the shape size is ok to be drawn */
-      if ( (shape.type == MS_SHAPE_LINE || shape.type == MS_SHAPE_POLYGON) && (minfeaturesize > 0) ) {
-        if (msShapeCheckSize(&shape, minfeaturesize) == MS_FALSE) {
-          if( lp->debug >= MS_DEBUGLEVEL_V )
-            msDebug("msQueryByRect(): Skipping shape (%ld) because LAYER::MINFEATURESIZE is bigger than shape size\n", shape.index);
-          msFreeShape(&shape);
-          continue;
-        }
-      }
+  if(map->query.layer < 0 || map->query.layer >= map->numlayers)
+    start = map->numlayers-1;
+  else
+    start = stop = map->query.layer;
 
-      shape.classindex = msShapeGetClass(lp, map, &shape, classgroup, nclasses);
-      if(!(lp->template) && ((shape.classindex == -1) || (lp->class[shape.classindex]->status == MS_OFF))) { /* not a valid shape */
-        msFreeShape(&shape);
-        continue;
-      }
+  if(msQueryLayers(map, start, stop, msQueryLayerByRect) != MS_SUCCESS)
+    return(MS_FAILURE);
 
-      if(!(lp->template) && !(lp->class[shape.classindex]->template)) { /* no valid template */
-        msFreeShape(&shape);
-        continue;
-      }
+  /* was anything found? */
+  for(l=start; l>=stop; l--) {
+    if(GET_LAYER(map, l)->resultcache && GET_LAYER(map, l)->resultcache->numresults > 0)
+      return(MS_SUCCESS);
+  }
 
-#ifdef USE_PROJ
-      if(lp->project)
-        msProjectShape(&(lp->projection), &(map->projection), &shape);
-#endif
+  msSetError(MS_NOTFOUND, "No matching record(s) found.", "msQueryByRect()");
+  return(MS_FAILURE);
+}
 
-      if(msRectContained(&shape.bounds, &searchrectInMapProj) == MS_TRUE) { /* if the whole shape is in, don't intersect */
-        status = MS_TRUE;
-      } else {
-        switch(shape.type) { /* make sure shape actually intersects the qrect (ADD FUNCTIONS SPECIFIC TO RECTOBJ) */
-          case MS_SHAPE_POINT:
-            status = msIntersectMultipointPolygon(&shape, &searchshape);
-            break;
-          case MS_SHAPE_LINE:
-            status = msIntersectPolylinePolygon(&shape, &searchshape);
-            break;
-          case MS_SHAPE_POLYGON:
-            status = msIntersectPolygons(&shape, &searchshape);
-            break;
-          default:
-            break;
-        }
-      }
+/*
+** Tells if shape is a match of a query by shape or by features: within tolerance of
+** selectshape or, with no tolerance, intersecting it. Returns MS_TRUE or MS_FALSE.
+*/
+static int msShapeMatchesSelection(shapeObj *selectshape, int prepared, shapeObj *shape, double tolerance)
+{
+  int status = MS_FALSE;
+  double distance;
 
-      if(status == MS_TRUE) {
-        /* Should we skip this feature? */
-        if (!paging && map->query.startindex > 1) {
-          --map->query.startindex;
-          msFreeShape(&shape);
-          continue;
-        }
-        if( map->query.only_cache_result_count )
-            lp->resultcache->numresults ++;
-        else
-            addResult(lp->resultcache, &shape);
-        --map->query.maxfeatures;
-      }
-      msFreeShape(&shape);
+  if(prepared && tolerance == 0) { /* against the prepared geometry, see msQueryPrepareSelection() */
+    status = msGEOSIntersects(shape, selectshape);
+    if(status != -1) return status;
+    status = MS_FALSE; /* the test below then */
+  }
 
-      /* check shape count */
-      if(lp->maxfeatures > 0 && lp->maxfeatures == lp->resultcache->numresults) {
-        status = MS_DONE;
-        break;
+  switch(selectshape->type) { /* may eventually support types other than polygon or line */
+    case MS_SHAPE_POLYGON:
+      switch(shape->type) { /* make sure shape actually intersects the selectshape */
+        case MS_SHAPE_POINT:
+          if(tolerance == 0) /* just test for intersection */
+            status = msIntersectMultipointPolygon(shape, selectshape);
+          else { /* check distance, distance=0 means they intersect */
+            distance = msDistanceShapeToShape(selectshape, shape);
+            if(distance < tolerance) status = MS_TRUE;
+          }
+          break;
+        case MS_SHAPE_LINE:
+          if(tolerance == 0) { /* just test for intersection */
+            status = msIntersectPolylinePolygon(shape, selectshape);
+          } else { /* check distance, distance=0 means they intersect */
+            distance = msDistanceShapeToShape(selectshape, shape);
+            if(distance < tolerance) status = MS_TRUE;
+          }
+          break;
+        case MS_SHAPE_POLYGON:
+          if(tolerance == 0) /* just test for intersection */
+            status = msIntersectPolygons(shape, selectshape);
+          else { /* check distance, distance=0 means they intersect */
+            distance = msDistanceShapeToShape(selectshape, shape);
+            if(distance < tolerance) status = MS_TRUE;
+          }
+          break;
+        default:
+          break;
       }
-      
-    } /* next shape */
+      break;
+    case MS_SHAPE_LINE:
+      switch(shape->type) { /* make sure shape actually intersects the selectshape */
+        case MS_SHAPE_POINT:
+          if(tolerance == 0) { /* just test for intersection */
+            distance = msDistanceShapeToShape(selectshape, shape);
+            if(distance == 0) status = MS_TRUE;
+          } else {
+            distance = msDistanceShapeToShape(selectshape, shape);
+            if(distance < tolerance) status = MS_TRUE;
+          }
+          break;
+        case MS_SHAPE_LINE:
+          if(tolerance == 0) { /* just test for intersection */
+            status = msIntersectPolylines(shape, selectshape);
+          } else { /* check distance, distance=0 means they intersect */
+            distance = msDistanceShapeToShape(selectshape, shape);
+            if(distance < tolerance) status = MS_TRUE;
+          }
+          break;
+        case MS_SHAPE_POLYGON:
+          if(tolerance == 0) /* just test for intersection */
+            status = msIntersectPolylinePolygon(selectshape, shape);
+          else { /* check distance, distance=0 means they intersect */
+            distance = msDistanceShapeToShape(selectshape, shape);
+            if(distance < tolerance) status = MS_TRUE;
+          }
+          break;
+        default:
+          status = MS_FALSE;
+          break;
+      }
+      break;
+    case MS_SHAPE_POINT:
+      distance = msDistanceShapeToShape(selectshape, shape);
+      status = MS_FALSE;
+      if(tolerance == 0 && distance == 0) status = MS_TRUE; /* shapes intersect */
+      else if(distance < tolerance) status = MS_TRUE; /* shapes are close enough */
+      break;
+    default:
+      break; /* should never get here as we test for selection shape type explicitly earlier */
+  }
+
+  return status;
+}
+
+/*
+** With map CONFIG "MS_QUERY_GEOS" "ON" and GEOS support, the selection lines and
+** polygons of queries by shape and by features get a GEOS prepared geometry once, and
+** the candidates are tested for intersection against it rather than walking all the
+** segments of the selection for each one. Returns MS_TRUE if selectshape was prepared.
+*/
+static int msQueryPrepareSelection(mapObj *map, shapeObj *selectshape)
+{
+  const char *value = msGetConfigOption(map, "MS_QUERY_GEOS");
 
-    if (classgroup)
-      msFree(classgroup);
+  if(!value || strcasecmp(value, "ON") != 0) return MS_FALSE;
+  if(selectshape->type != MS_SHAPE_POLYGON && selectshape->type != MS_SHAPE_LINE) return MS_FALSE;
 
-    if(status != MS_DONE) {
-        msFreeShape(&searchshape);
-        return(MS_FAILURE);
-    }
+  if(selectshape->geometry) msGEOSFreeGeometry(selectshape); /* it may have been edited since */
+  return (msGEOSPrepareGeometry(selectshape) == MS_SUCCESS);
+}
 
-    if( !map->query.only_cache_result_count &&
-        lp->resultcache->numresults == 0) msLayerClose(lp); /* no need to keep the layer open */
-  } /* next layer */
+/*
+** Hash index of the results of a cache by shapeindex and tileindex, so the duplicate
+** checks of msQueryByFeatures() do not scan the whole cache for every shape.
+*/
+typedef struct {
+  int *slots; /* result number + 1 in each slot, 0 for none */
+  int size; /* a power of 2, at least twice the number of results */
+} resultIndexObj;
 
-  msFreeShape(&searchshape);
+static int findResultSlot(resultIndexObj *index, resultCacheObj *resultcache, long shapeindex, int tileindex)
+{
+  unsigned long hash = ((unsigned long) shapeindex * 2654435761UL) ^ ((unsigned long) tileindex * 40503UL);
+  int i = (int) ((hash ^ (hash >> 16)) & (index->size - 1));
 
-  /* was anything found? */
-  for(l=start; l>=stop; l--) {
-    if(GET_LAYER(map, l)->resultcache && GET_LAYER(map, l)->resultcache->numresults > 0)
-      return(MS_SUCCESS);
+  while(index->slots[i]) { /* open addressing, the index is never full */
+    resultObj *result = &(resultcache->results[index->slots[i]-1]);
+    if(result->shapeindex == shapeindex && result->tileindex == tileindex) break;
+    i = (i+1) & (index->size - 1);
   }
 
-  msSetError(MS_NOTFOUND, "No matching record(s) found.", "msQueryByRect()");
-  return(MS_FAILURE);
+  return i;
 }
 
-static int is_duplicate(resultCacheObj *resultcache, int shapeindex, int tileindex)
+/* adds the last result of the cache to the index */
+static void indexLastResult(resultIndexObj *index, resultCacheObj *resultcache)
 {
   int i;
 
-  for(i=0; i<resultcache->numresults; i++)
-    if(resultcache->results[i].shapeindex == shapeindex && resultcache->results[i].tileindex == tileindex) return(MS_TRUE);
+  if(resultcache->numresults*2 > index->size) { /* grow and rebuild */
+    msFree(index->slots);
+    index->size = index->size ? index->size*2 : 64;
+    index->slots = (int *) msSmallCalloc(index->size, sizeof(int));
+    for(i=0; i<resultcache->numresults; i++)
+      index->slots[findResultSlot(index, resultcache, resultcache->results[i].shapeindex, resultcache->results[i].tileindex)] = i+1;
+  } else {
+    i = resultcache->numresults-1;
+    index->slots[findResultSlot(index, resultcache, resultcache->results[i].shapeindex, resultcache->results[i].tileindex)] = i+1;
+  }
+}
+
+static int is_duplicate(resultIndexObj *index, resultCacheObj *resultcache, long shapeindex, int tileindex)
+{
+  if(!index->slots) return(MS_FALSE);
 
-  return(MS_FALSE);
+  return(index->slots[findResultSlot(index, resultcache, shapeindex, tileindex)] != 0);
 }
 
 int msQueryByFeatures(mapObj *map)
@@ -1208,13 +1882,15 @@ int msQueryByFeatures(mapObj *map)
   layerObj *lp, *slp;
   char status;
 
-  double distance, tolerance, layer_tolerance;
+  double tolerance, layer_tolerance;
+  int prepared;
 
   rectObj searchrect;
   shapeObj shape, selectshape;
   int nclasses = 0;
   int *classgroup = NULL;
   double minfeaturesize = -1;
+  resultIndexObj resultindex;
 
   if(map->debug) msDebug("in msQueryByFeatures()\n");
 
@@ -1264,8 +1940,7 @@ int msQueryByFeatures(mapObj *map)
 
     /* free any previous search results, do it now in case one of the next few tests fail */
     if(lp->resultcache) {
-      if(lp->resultcache->results) free(lp->resultcache->results);
-      free(lp->resultcache);
+      msFreeResultCache(lp->resultcache);
       lp->resultcache = NULL;
     }
 
@@ -1305,13 +1980,17 @@ int msQueryByFeatures(mapObj *map)
     status = msLayerWhichItems(lp, MS_TRUE, NULL);
     if(status != MS_SUCCESS) return(MS_FAILURE);
 
+    resultindex.slots = NULL;
+    resultindex.size = 0;
+
     /* for each selection shape */
     for(i=0; i<slp->resultcache->numresults; i++) {
 
-      status = msLayerGetShape(slp, &selectshape, &(slp->resultcache->results[i]));
+      status = msLayerGetResultShape(slp, &selectshape, i);
       if(status != MS_SUCCESS) {
         msLayerClose(lp);
         msLayerClose(slp);
+        msFree(resultindex.slots);
         return(MS_FAILURE);
       }
 
@@ -1319,6 +1998,7 @@ int msQueryByFeatures(mapObj *map)
         msLayerClose(lp);
         msLayerClose(slp);
         msSetError(MS_QUERYERR, "Selection features MUST be polygons or lines.", "msQueryByFeatures()");
+        msFree(resultindex.slots);
         return(MS_FAILURE);
       }
 
@@ -1326,6 +2006,7 @@ int msQueryByFeatures(mapObj *map)
       if(slp->project)
         msProjectShape(&(slp->projection), &(map->projection), &selectshape);
 #endif
+      prepared = msQueryPrepareSelection(map, &selectshape);
 
       /* identify target shapes */
       searchrect = selectshape.bounds;
@@ -1347,6 +2028,7 @@ int msQueryByFeatures(mapObj *map)
       } else if(status != MS_SUCCESS) {
         msLayerClose(lp);
         msLayerClose(slp);
+        msFree(resultindex.slots);
         return(MS_FAILURE);
       }
 
@@ -1368,7 +2050,10 @@ int msQueryByFeatures(mapObj *map)
       while((status = msLayerNextShape(lp, &shape)) == MS_SUCCESS) { /* step through the shapes */
 
         /* check for dups when there are multiple selection shapes */
-        if(i > 0 && is_duplicate(lp->resultcache, shape.index, shape.tileindex)) continue;
+        if(i > 0 && is_duplicate(&resultindex, lp->resultcache, shape.index, shape.tileindex)) {
+          msFreeShape(&shape);
+          continue;
+        }
 
 
         /* Check if the shape size is ok to be drawn */
@@ -1397,73 +2082,7 @@ int msQueryByFeatures(mapObj *map)
           msProjectShape(&(lp->projection), &(map->projection), &shape);
 #endif
 
-        switch(selectshape.type) { /* may eventually support types other than polygon on line */
-          case MS_SHAPE_POLYGON:
-            switch(shape.type) { /* make sure shape actually intersects the selectshape */
-              case MS_SHAPE_POINT:
-                if(tolerance == 0) /* just test for intersection */
-                  status = msIntersectMultipointPolygon(&shape, &selectshape);
-                else { /* check distance, distance=0 means they intersect */
-                  distance = msDistanceShapeToShape(&selectshape, &shape);
-                  if(distance < tolerance) status = MS_TRUE;
-                }
-                break;
-              case MS_SHAPE_LINE:
-                if(tolerance == 0) { /* just test for intersection */
-                  status = msIntersectPolylinePolygon(&shape, &selectshape);
-                } else { /* check distance, distance=0 means they intersect */
-                  distance = msDistanceShapeToShape(&selectshape, &shape);
-                  if(distance < tolerance) status = MS_TRUE;
-                }
-                break;
-              case MS_SHAPE_POLYGON:
-                if(tolerance == 0) /* just test for intersection */
-                  status = msIntersectPolygons(&shape, &selectshape);
-                else { /* check distance, distance=0 means they intersect */
-                  distance = msDistanceShapeToShape(&selectshape, &shape);
-                  if(distance < tolerance) status = MS_TRUE;
-                }
-                break;
-              default:
-                status = MS_FALSE;
-                break;
-            }
-            break;
-          case MS_SHAPE_LINE:
-            switch(shape.type) { /* make sure shape actually intersects the selectshape */
-              case MS_SHAPE_POINT:
-                if(tolerance == 0) { /* just test for intersection */
-                  distance = msDistanceShapeToShape(&selectshape, &shape);
-                  if(distance == 0) status = MS_TRUE;
-                } else {
-                  distance = msDistanceShapeToShape(&selectshape, &shape);
-                  if(distance < tolerance) status = MS_TRUE;
-                }
-                break;
-              case MS_SHAPE_LINE:
-                if(tolerance == 0) { /* just test for intersection */
-                  status = msIntersectPolylines(&shape, &selectshape);
-                } else { /* check distance, distance=0 means they intersect */
-                  distance = msDistanceShapeToShape(&selectshape, &shape);
-                  if(distance < tolerance) status = MS_TRUE;
-                }
-                break;
-              case MS_SHAPE_POLYGON:
-                if(tolerance == 0) /* just test for intersection */
-                  status = msIntersectPolylinePolygon(&selectshape, &shape);
-                else { /* check distance, distance=0 means they intersect */
-                  distance = msDistanceShapeToShape(&selectshape, &shape);
-                  if(distance < tolerance) status = MS_TRUE;
-                }
-                break;
-              default:
-                status = MS_FALSE;
-                break;
-            }
-            break;
-          default:
-            break; /* should never get here as we test for selection shape type explicitly earlier */
-        }
+        status = msShapeMatchesSelection(&selectshape, prepared, &shape, tolerance);
 
         if(status == MS_TRUE) {
           /* Should we skip this feature? */
@@ -1473,6 +2092,7 @@ int msQueryByFeatures(mapObj *map)
             continue;
           }
           addResult(lp->resultcache, &shape);
+          if(slp->resultcache->numresults > 1) indexLastResult(&resultindex, lp->resultcache);
         }
         msFreeShape(&shape);
 
@@ -1486,14 +2106,22 @@ int msQueryByFeatures(mapObj *map)
       if (classgroup)
         msFree(classgroup);
 
-      if(status != MS_DONE) return(MS_FAILURE);
+      if(status != MS_DONE) {
+        msFree(resultindex.slots);
+        return(MS_FAILURE);
+      }
 
       msFreeShape(&selectshape);
     } /* next selection shape */
 
+    msFree(resultindex.slots);
+
     if(lp->resultcache->numresults == 0) msLayerClose(lp); /* no need to keep the layer open */
   } /* next layer */
 
+  if(msIO_checkRequestMemory("msQueryByFeatures()") != MS_SUCCESS)
+    return(MS_FAILURE);
+
   /* was anything found? */
   for(l=start; l>=stop; l--) {
     if(l == map->query.slayer) continue; /* skip the selection layer */
@@ -1516,172 +2144,264 @@ int msQueryByFeatures(mapObj *map)
  *   Set maxresults = 0 to have an unlimited number of results.
  *   Set maxresults > 0 to limit the number of results per layer (the shapes
  *     returned are the first ones found in each layer and are not necessarily
- *     the closest ones).
+ *     the closest ones, unless the map CONFIG "MS_QUERY_NEAREST" is "ON": they
+ *     are then the maxresults closest ones of each layer, closest first).
+ *
+ * The closest shapes of unprojected shapefile layers with a spatial index are
+ * found by a nearest neighbour search of the index, which reads the shapes from
+ * the closest on and stops at the first one that cannot be closer, rather than
+ * reading every shape within the tolerance.
  */
-int msQueryByPoint(mapObj *map)
-{
-  int l;
-  int start, stop=0;
-
-  double d, t;
-  double layer_tolerance;
 
-  layerObj *lp;
+/* the closest shapes found so far, closest first */
+typedef struct {
+  resultObj *results;
+  rectObj *bounds;
+  double *distances;
+  int numresults;
+  int maxresults;
+} nearestResultsObj;
 
-  int paging;
-  char status;
-  rectObj rect, searchrect;
-  shapeObj shape;
-  int nclasses = 0;
-  int *classgroup = NULL;
-  double minfeaturesize = -1;
+/*
+** The tolerance left for the shapes to come. Past the last distance by a rounding
+** slack, so that the shapes tied with it are still measured (squared distances do
+** not round trip through sqrt()) and nearestResultsAdd() decides the tie.
+*/
+static double nearestLimit(nearestResultsObj *nearest, double tolerance)
+{
+  return (nearest->numresults < nearest->maxresults) ? tolerance : nearest->distances[nearest->numresults-1] * (1 + 1e-9);
+}
 
-  if(map->query.type != MS_QUERY_BY_POINT) {
-    msSetError(MS_QUERYERR, "The query is not properly defined.", "msQueryByPoint()");
-    return(MS_FAILURE);
+static void nearestResultsAdd(nearestResultsObj *nearest, shapeObj *shape, double distance)
+{
+  int i, j;
+
+  /* at equal distances the shape read last wins, as in the plain MS_QUERY_SINGLE scan */
+  for(i=0; i<nearest->numresults; i++)
+    if(distance < nearest->distances[i] || (distance == nearest->distances[i] && shape->index > nearest->results[i].shapeindex)) break;
+  if(i == nearest->maxresults) return;
+
+  j = MS_MIN(nearest->numresults, nearest->maxresults-1);
+  for(; j>i; j--) {
+    nearest->results[j] = nearest->results[j-1];
+    nearest->bounds[j] = nearest->bounds[j-1];
+    nearest->distances[j] = nearest->distances[j-1];
   }
+  nearest->results[i].shapeindex = shape->index;
+  nearest->results[i].tileindex = shape->tileindex;
+  nearest->results[i].resultindex = shape->resultindex;
+  nearest->results[i].classindex = shape->classindex;
+  nearest->bounds[i] = shape->bounds;
+  nearest->distances[i] = distance;
+  if(nearest->numresults < nearest->maxresults) nearest->numresults++;
+}
 
-  msInitShape(&shape);
+/*
+** Tests a shape of lp against the query point: returns its distance, -1 if it is
+** farther than limit or not a valid result. Projects it to the map projection.
+*/
+static double pointQueryDistance(mapObj *map, layerObj *lp, shapeObj *shape, double limit, int *classgroup, int nclasses, double minfeaturesize)
+{
+  double d = -1;
 
-  if(map->query.layer < 0 || map->query.layer >= map->numlayers)
-    start = map->numlayers-1;
-  else
-    start = stop = map->query.layer;
+  /* Check if the shape size is ok to be drawn */
+  if ( (shape->type == MS_SHAPE_LINE || shape->type == MS_SHAPE_POLYGON) && (minfeaturesize > 0) ) {
+    if (msShapeCheckSize(shape, minfeaturesize) == MS_FALSE) {
+      if( lp->debug >= MS_DEBUGLEVEL_V )
+        msDebug("msQueryByPoint(): Skipping shape (%ld) because LAYER::MINFEATURESIZE is bigger than shape size\n", shape->index);
+      return -1;
+    }
+  }
 
-  for(l=start; l>=stop; l--) {
-    lp = (GET_LAYER(map, l));
-    if (map->query.maxfeatures == 0)
-      break; /* nothing else to do */
-    else if (map->query.maxfeatures > 0)
-      lp->maxfeatures = map->query.maxfeatures;
+  /* without reprojection the cheaper distance test goes first */
+  if(!lp->project) {
+    d = msDistancePointToShapeWithin(&(map->query.point), shape, limit);
+    if(d < 0) return -1;
+  }
 
-    /* using mapscript, the map->query.startindex will be unset... */
-    if (lp->startindex > 1 && map->query.startindex < 0)
-      map->query.startindex = lp->startindex;
-    
-    /* conditions may have changed since this layer last drawn, so set
-       layer->project true to recheck projection needs (Bug #673) */
-    lp->project = MS_TRUE;
+  shape->classindex = msShapeGetClass(lp, map, shape, classgroup, nclasses);
+  if(!(lp->template) && ((shape->classindex == -1) || (lp->class[shape->classindex]->status == MS_OFF))) /* not a valid shape */
+    return -1;
 
-    /* free any previous search results, do it now in case one of the next few tests fail */
-    if(lp->resultcache) {
-      if(lp->resultcache->results) free(lp->resultcache->results);
-      free(lp->resultcache);
-      lp->resultcache = NULL;
-    }
+  if(!(lp->template) && !(lp->class[shape->classindex]->template)) /* no valid template */
+    return -1;
 
-    if(!msIsLayerQueryable(lp)) continue;
-    if(lp->status == MS_OFF) continue;
+  if(lp->project) {
+#ifdef USE_PROJ
+    msProjectShape(&(lp->projection), &(map->projection), shape);
+#endif
+    d = msDistancePointToShapeWithin(&(map->query.point), shape, limit);
+  }
 
-    if(map->scaledenom > 0) {
-      if((lp->maxscaledenom > 0) && (map->scaledenom > lp->maxscaledenom)) continue;
-      if((lp->minscaledenom > 0) && (map->scaledenom <= lp->minscaledenom)) continue;
-    }
+  return d;
+}
 
-    if (lp->maxscaledenom <= 0 && lp->minscaledenom <= 0) {
-      if((lp->maxgeowidth > 0) && ((map->extent.maxx - map->extent.minx) > lp->maxgeowidth)) continue;
-      if((lp->mingeowidth > 0) && ((map->extent.maxx - map->extent.minx) < lp->mingeowidth)) continue;
+/*
+** Nearest neighbour search of the spatial index of a shapefile layer, lp is open and
+** in the map projection. Returns MS_DONE if the layer has no index.
+*/
+static int nearestIndexedShapes(mapObj *map, layerObj *lp, double tolerance, nearestResultsObj *nearest, int *classgroup, int nclasses, double minfeaturesize)
+{
+  treeNearestObj *tree;
+  char *filename;
+  shapeObj shape;
+  resultObj record;
+  double bound, d;
+  int id, status;
+
+  filename = msShapefileIndexFilename((shapefileObj *) lp->layerinfo);
+  tree = msSearchDiskTreeNearest(filename, map->query.point, lp->debug);
+  free(filename);
+  if(!tree) return MS_DONE;
+
+  while((status = msTreeNearestNext(tree, &id, &bound)) == MS_SUCCESS) {
+    if(bound > nearestLimit(nearest, tolerance)) break; /* none of the shapes left can be closer */
+
+    msInitShape(&shape);
+    record.shapeindex = id;
+    record.tileindex = -1;
+    record.resultindex = -1;
+    record.classindex = -1;
+    if(msLayerGetShape(lp, &shape, &record) != MS_SUCCESS) {
+      msFreeShape(&shape);
+      status = MS_FAILURE;
+      break;
     }
 
-    /* Raster layers are handled specially.  */
-    if( lp->type == MS_LAYER_RASTER ) {
-      if( msRasterQueryByPoint( map, lp, map->query.mode, map->query.point, map->query.buffer, map->query.maxresults ) == MS_FAILURE )
-        return MS_FAILURE;
-      continue;
+    if(msEvalExpression(lp, &shape, &(lp->filter), lp->filteritemindex)) {
+      d = pointQueryDistance(map, lp, &shape, nearestLimit(nearest, tolerance), classgroup, nclasses, minfeaturesize);
+      if(d >= 0) nearestResultsAdd(nearest, &shape, d);
     }
+    msFreeShape(&shape);
+  }
 
-    /* Get the layer tolerance default is 3 for point and line layers, 0 for others */
-    if(lp->tolerance == -1) {
-      if(lp->type == MS_LAYER_POINT || lp->type == MS_LAYER_LINE)
-        layer_tolerance = 3;
-      else
-        layer_tolerance = 0;
-    } else
-      layer_tolerance = lp->tolerance;
-
-    if(map->query.buffer <= 0) { /* use layer tolerance */
-      if(lp->toleranceunits == MS_PIXELS)
-        t = layer_tolerance * MS_MAX(MS_CELLSIZE(map->extent.minx, map->extent.maxx, map->width),
-                                     MS_CELLSIZE(map->extent.miny, map->extent.maxy, map->height));
-      else
-        t = layer_tolerance * (msInchesPerUnit(lp->toleranceunits,0)/msInchesPerUnit(map->units,0));
-    } else /* use buffer distance */
-      t = map->query.buffer;
+  msTreeNearestFree(tree);
 
-    rect.minx = map->query.point.x - t;
-    rect.maxx = map->query.point.x + t;
-    rect.miny = map->query.point.y - t;
-    rect.maxy = map->query.point.y + t;
+  if(lp->debug >= MS_DEBUGLEVEL_V)
+    msDebug("msQueryByPoint(): nearest neighbour search of the index of layer %s.\n", lp->name);
 
-    /* Paging could have been disabled before */
-    paging = msLayerGetPaging(lp);
-    msLayerClose(lp); /* reset */
-    status = msLayerOpen(lp);
-    if(status != MS_SUCCESS) return(MS_FAILURE);
-    msLayerEnablePaging(lp, paging);
+  return (status == MS_FAILURE) ? MS_FAILURE : MS_SUCCESS;
+}
 
-    /* build item list, we want *all* items */
-    status = msLayerWhichItems(lp, MS_TRUE, NULL);
-    if(status != MS_SUCCESS) return(MS_FAILURE);
+/*
+** Queries layer lp for msQueryByPoint(), see msQueryLayers(). Returns MS_DONE when
+** the layers left need not be searched.
+*/
+static int msQueryLayerByPoint(mapObj *map, layerObj *lp, int *numfound)
+{
+  double d, t;
+  double layer_tolerance;
 
-    /* identify target shapes */
-    searchrect = rect;
-#ifdef USE_PROJ
-    lp->project = msProjectionsDiffer(&(lp->projection), &(map->projection));
-    if(lp->project)
-      msProjectRect(&(map->projection), &(lp->projection), &searchrect); /* project the searchrect to source coords */
-#endif
-    status = msLayerWhichShapes(lp, searchrect, MS_TRUE);
-    if(status == MS_DONE) { /* no overlap */
-      msLayerClose(lp);
-      continue;
-    } else if(status != MS_SUCCESS) {
-      msLayerClose(lp);
-      return(MS_FAILURE);
-    }
+  int paging;
+  char status;
+  rectObj rect, searchrect;
+  shapeObj shape;
+  int nclasses = 0;
+  int *classgroup = NULL;
+  double minfeaturesize = -1;
+  nearestResultsObj nearest;
+  int i, indexed;
 
-    lp->resultcache = (resultCacheObj *)malloc(sizeof(resultCacheObj)); /* allocate and initialize the result cache */
-    MS_CHECK_ALLOC(lp->resultcache, sizeof(resultCacheObj), MS_FAILURE);
-    initResultCache( lp->resultcache);
+  msInitShape(&shape);
 
-    nclasses = 0;
-    classgroup = NULL;
-    if (lp->classgroup && lp->numclasses > 0)
-      classgroup = msAllocateValidClassGroups(lp, &nclasses);
+  /* Raster layers are handled specially.  */
+  if( lp->type == MS_LAYER_RASTER ) {
+    if( msRasterQueryByPoint( map, lp, map->query.mode, map->query.point, map->query.buffer, map->query.maxresults ) == MS_FAILURE )
+      return MS_FAILURE;
+    return MS_SUCCESS;
+  }
 
-    if (lp->minfeaturesize > 0)
-      minfeaturesize = Pix2LayerGeoref(map, lp, lp->minfeaturesize);
+  /* Get the layer tolerance default is 3 for point and line layers, 0 for others */
+  if(lp->tolerance == -1) {
+    if(lp->type == MS_LAYER_POINT || lp->type == MS_LAYER_LINE)
+      layer_tolerance = 3;
+    else
+      layer_tolerance = 0;
+  } else
+    layer_tolerance = lp->tolerance;
 
-    while((status = msLayerNextShape(lp, &shape)) == MS_SUCCESS) { /* step through the shapes */
+  if(map->query.buffer <= 0) { /* use layer tolerance */
+    if(lp->toleranceunits == MS_PIXELS)
+      t = layer_tolerance * MS_MAX(MS_CELLSIZE(map->extent.minx, map->extent.maxx, map->width),
+                                   MS_CELLSIZE(map->extent.miny, map->extent.maxy, map->height));
+    else
+      t = layer_tolerance * (msInchesPerUnit(lp->toleranceunits,0)/msInchesPerUnit(map->units,0));
+  } else /* use buffer distance */
+    t = map->query.buffer;
 
-      /* Check if the shape size is ok to be drawn */
-      if ( (shape.type == MS_SHAPE_LINE || shape.type == MS_SHAPE_POLYGON) && (minfeaturesize > 0) ) {
-        if (msShapeCheckSize(&shape, minfeaturesize) == MS_FALSE) {
-          if( lp->debug >= MS_DEBUGLEVEL_V )
-            msDebug("msQueryByPoint(): Skipping shape (%ld) because LAYER::MINFEATURESIZE is bigger than shape size\n", shape.index);
-          msFreeShape(&shape);
-          continue;
-        }
-      }
+  rect.minx = map->query.point.x - t;
+  rect.maxx = map->query.point.x + t;
+  rect.miny = map->query.point.y - t;
+  rect.maxy = map->query.point.y + t;
 
-      shape.classindex = msShapeGetClass(lp, map, &shape, classgroup, nclasses);
-      if(!(lp->template) && ((shape.classindex == -1) || (lp->class[shape.classindex]->status == MS_OFF))) { /* not a valid shape */
-        msFreeShape(&shape);
-        continue;
-      }
+  /* Paging could have been disabled before */
+  paging = msLayerGetPaging(lp);
+  msLayerClose(lp); /* reset */
+  status = msLayerOpen(lp);
+  if(status != MS_SUCCESS) return(MS_FAILURE);
+  msLayerEnablePaging(lp, paging);
 
-      if(!(lp->template) && !(lp->class[shape.classindex]->template)) { /* no valid template */
-        msFreeShape(&shape);
-        continue;
-      }
+  /* build item list, we want *all* items */
+  status = msLayerWhichItems(lp, MS_TRUE, NULL);
+  if(status != MS_SUCCESS) return(MS_FAILURE);
 
+  /* identify target shapes */
+  searchrect = rect;
 #ifdef USE_PROJ
-      if(lp->project)
-        msProjectShape(&(lp->projection), &(map->projection), &shape);
+  lp->project = msProjectionsDiffer(&(lp->projection), &(map->projection));
+  if(lp->project)
+    msProjectRect(&(map->projection), &(lp->projection), &searchrect); /* project the searchrect to source coords */
 #endif
+  status = msLayerWhichShapes(lp, searchrect, MS_TRUE);
+  if(status == MS_DONE) { /* no overlap */
+    msLayerClose(lp);
+    return MS_SUCCESS;
+  } else if(status != MS_SUCCESS) {
+    msLayerClose(lp);
+    return(MS_FAILURE);
+  }
+
+  lp->resultcache = (resultCacheObj *)malloc(sizeof(resultCacheObj)); /* allocate and initialize the result cache */
+  MS_CHECK_ALLOC(lp->resultcache, sizeof(resultCacheObj), MS_FAILURE);
+  initResultCache( lp->resultcache);
+
+  nclasses = 0;
+  classgroup = NULL;
+  if (lp->classgroup && lp->numclasses > 0)
+    classgroup = msAllocateValidClassGroups(lp, &nclasses);
+
+  if (lp->minfeaturesize > 0)
+    minfeaturesize = Pix2LayerGeoref(map, lp, lp->minfeaturesize);
+
+  /* a shapefile in the map projection, its index can be searched for the nearest shapes */
+  indexed = (lp->connectiontype == MS_SHAPEFILE && map->query.startindex <= 1 && !msProjectionsDiffer(&(lp->projection), &(map->projection)));
+
+  /* the closest shapes are kept aside in the nearest modes (see above) */
+  nearest.maxresults = 0;
+  if(map->query.mode == MS_QUERY_MULTIPLE && map->query.maxresults > 0 &&
+      msGetConfigOption(map, "MS_QUERY_NEAREST") && strcasecmp(msGetConfigOption(map, "MS_QUERY_NEAREST"), "ON") == 0) {
+    nearest.maxresults = map->query.maxresults;
+    if(lp->maxfeatures > 0) nearest.maxresults = MS_MIN(nearest.maxresults, lp->maxfeatures);
+  } else if(map->query.mode == MS_QUERY_SINGLE && indexed) {
+    nearest.maxresults = 1;
+  }
+  nearest.numresults = 0;
+  if(nearest.maxresults > 0) {
+    nearest.results = (resultObj *) msSmallMalloc(nearest.maxresults * sizeof(resultObj));
+    nearest.bounds = (rectObj *) msSmallMalloc(nearest.maxresults * sizeof(rectObj));
+    nearest.distances = (double *) msSmallMalloc(nearest.maxresults * sizeof(double));
+  }
 
-      d = msDistancePointToShape(&(map->query.point), &shape);
-      if( d <= t ) { /* found one */
+  status = MS_DONE; /* no index search */
+  if(nearest.maxresults > 0 && indexed)
+    status = nearestIndexedShapes(map, lp, t, &nearest, classgroup, nclasses, minfeaturesize);
+  if(status == MS_SUCCESS)
+    status = MS_DONE; /* the scan below is not needed */
+  else if(status == MS_DONE) {
+    while((status = msLayerNextShape(lp, &shape)) == MS_SUCCESS) { /* step through the shapes */
+
+      d = pointQueryDistance(map, lp, &shape, (nearest.maxresults > 0) ? nearestLimit(&nearest, t) : t, classgroup, nclasses, minfeaturesize);
+      if( d >= 0 ) { /* found one */
 
         /* Should we skip this feature? */
         if (!paging && map->query.startindex > 1) {
@@ -1690,7 +2410,9 @@ int msQueryByPoint(mapObj *map)
           continue;
         }
 
-        if(map->query.mode == MS_QUERY_SINGLE) {
+        if(nearest.maxresults > 0) {
+          nearestResultsAdd(&nearest, &shape, d);
+        } else if(map->query.mode == MS_QUERY_SINGLE) {
           lp->resultcache->numresults = 0;
           addResult(lp->resultcache, &shape);
           t = d; /* next one must be closer */
@@ -1712,17 +2434,46 @@ int msQueryByPoint(mapObj *map)
         break;
       }
     } /* next shape */
+  }
+
+  if (classgroup)
+    msFree(classgroup);
 
-    if (classgroup)
-      msFree(classgroup);
+  if(nearest.maxresults > 0) {
+    for(i=0; i<nearest.numresults; i++)
+      addResultRecord(lp->resultcache, &(nearest.results[i]), &(nearest.bounds[i]));
+    msFree(nearest.results);
+    msFree(nearest.bounds);
+    msFree(nearest.distances);
+  }
 
-    if(status != MS_DONE) return(MS_FAILURE);
+  if(status != MS_DONE) return(MS_FAILURE);
 
-    if(lp->resultcache->numresults == 0) msLayerClose(lp); /* no need to keep the layer open */
+  if(lp->resultcache->numresults == 0) msLayerClose(lp); /* no need to keep the layer open */
 
-    if((lp->resultcache->numresults > 0) && (map->query.mode == MS_QUERY_SINGLE) && (map->query.maxresults == 0))
-      break;   /* no need to search any further */
-  } /* next layer */
+  if((lp->resultcache->numresults > 0) && (map->query.mode == MS_QUERY_SINGLE) && (map->query.maxresults == 0))
+    return MS_DONE;   /* no need to search any further */
+
+  return MS_SUCCESS;
+}
+
+int msQueryByPoint(mapObj *map)
+{
+  int l;
+  int start, stop=0;
+
+  if(map->query.type != MS_QUERY_BY_POINT) {
+    msSetError(MS_QUERYERR, "The query is not properly defined.", "msQueryByPoint()");
+    return(MS_FAILURE);
+  }
+
+  if(map->query.layer < 0 || map->query.layer >= map->numlayers)
+    start = map->numlayers-1;
+  else
+    start = stop = map->query.layer;
+
+  if(msQueryLayers(map, start, stop, msQueryLayerByPoint) != MS_SUCCESS)
+    return(MS_FAILURE);
 
   /* was anything found? */
   for(l=start; l>=stop; l--) {
@@ -1740,7 +2491,8 @@ int msQueryByShape(mapObj *map)
   shapeObj shape, *qshape=NULL;
   layerObj *lp;
   char status;
-  double distance, tolerance, layer_tolerance;
+  int prepared;
+  double tolerance, layer_tolerance;
   rectObj searchrect;
 
   int nclasses = 0;
@@ -1770,6 +2522,7 @@ int msQueryByShape(mapObj *map)
     start = stop = map->query.layer;
 
   msComputeBounds(qshape); /* make sure an accurate extent exists */
+  prepared = msQueryPrepareSelection(map, qshape);
 
   for(l=start; l>=stop; l--) { /* each layer */
     lp = (GET_LAYER(map, l));
@@ -1788,8 +2541,7 @@ int msQueryByShape(mapObj *map)
 
     /* free any previous search results, do it now in case one of the next few tests fail */
     if(lp->resultcache) {
-      if(lp->resultcache->results) free(lp->resultcache->results);
-      free(lp->resultcache);
+      msFreeResultCache(lp->resultcache);
       lp->resultcache = NULL;
     }
 
@@ -1899,78 +2651,7 @@ int msQueryByShape(mapObj *map)
         msProjectShape(&(lp->projection), &(map->projection), &shape);
 #endif
 
-      switch(qshape->type) { /* may eventually support types other than polygon or line */
-        case MS_SHAPE_POLYGON:
-          switch(shape.type) { /* make sure shape actually intersects the shape */
-            case MS_SHAPE_POINT:
-              if(tolerance == 0) /* just test for intersection */
-                status = msIntersectMultipointPolygon(&shape, qshape);
-              else { /* check distance, distance=0 means they intersect */
-                distance = msDistanceShapeToShape(qshape, &shape);
-                if(distance < tolerance) status = MS_TRUE;
-              }
-              break;
-            case MS_SHAPE_LINE:
-              if(tolerance == 0) { /* just test for intersection */
-                status = msIntersectPolylinePolygon(&shape, qshape);
-              } else { /* check distance, distance=0 means they intersect */
-                distance = msDistanceShapeToShape(qshape, &shape);
-                if(distance < tolerance) status = MS_TRUE;
-              }
-              break;
-            case MS_SHAPE_POLYGON:
-              if(tolerance == 0) /* just test for intersection */
-                status = msIntersectPolygons(&shape, qshape);
-              else { /* check distance, distance=0 means they intersect */
-                distance = msDistanceShapeToShape(qshape, &shape);
-                if(distance < tolerance) status = MS_TRUE;
-              }
-              break;
-            default:
-              break;
-          }
-          break;
-        case MS_SHAPE_LINE:
-          switch(shape.type) { /* make sure shape actually intersects the selectshape */
-            case MS_SHAPE_POINT:
-              if(tolerance == 0) { /* just test for intersection */
-                distance = msDistanceShapeToShape(qshape, &shape);
-                if(distance == 0) status = MS_TRUE;
-              } else {
-                distance = msDistanceShapeToShape(qshape, &shape);
-                if(distance < tolerance) status = MS_TRUE;
-              }
-              break;
-            case MS_SHAPE_LINE:
-              if(tolerance == 0) { /* just test for intersection */
-                status = msIntersectPolylines(&shape, qshape);
-              } else { /* check distance, distance=0 means they intersect */
-                distance = msDistanceShapeToShape(qshape, &shape);
-                if(distance < tolerance) status = MS_TRUE;
-              }
-              break;
-            case MS_SHAPE_POLYGON:
-              if(tolerance == 0) /* just test for intersection */
-                status = msIntersectPolylinePolygon(qshape, &shape);
-              else { /* check distance, distance=0 means they intersect */
-                distance = msDistanceShapeToShape(qshape, &shape);
-                if(distance < tolerance) status = MS_TRUE;
-              }
-              break;
-            default:
-              status = MS_FALSE;
-              break;
-          }
-          break;
-        case MS_SHAPE_POINT:
-          distance = msDistanceShapeToShape(qshape, &shape);
-          status = MS_FALSE;
-          if(tolerance == 0 && distance == 0) status = MS_TRUE; /* shapes intersect */
-          else if(distance < tolerance) status = MS_TRUE; /* shapes are close enough */
-          break;
-        default:
-          break; /* should never get here as we test for selection shape type explicitly earlier */
-      }
+      status = msShapeMatchesSelection(qshape, prepared, &shape, tolerance);
 
       if(status == MS_TRUE) {
         /* Should we skip this feature? */
@@ -2000,6 +2681,9 @@ int msQueryByShape(mapObj *map)
     classgroup = NULL;
   } /* next layer */
 
+  if(msIO_checkRequestMemory("msQueryByShape()") != MS_SUCCESS)
+    return(MS_FAILURE);
+
   /* was anything found? */
   for(l=start; l>=stop; l--) {
     if(GET_LAYER(map, l)->resultcache && GET_LAYER(map, l)->resultcache->numresults > 0)
@@ -2063,9 +2747,7 @@ void msQueryFree(mapObj *map, int qlayer)
     lp = (GET_LAYER(map, l));
 
     if(lp->resultcache) {
-      if(lp->resultcache->results)
-        free(lp->resultcache->results);
-      free(lp->resultcache);
+      msFreeResultCache(lp->resultcache);
       lp->resultcache = NULL;
     }
   }
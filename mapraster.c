@@ -38,7 +38,6 @@
 
 
 extern int msyylex_destroy(void);
-extern int yyparse(parseObj *);
 
 extern parseResultObj yypresult; /* result of parsing, true/false */
 
@@ -152,7 +151,7 @@ static int msGetClass_String( layerObj *layer, colorObj *color, const char *pixe
         p.expr->curtoken = p.expr->tokens; /* reset */
         p.type = MS_PARSE_TYPE_BOOLEAN;
 
-        status = yyparse(&p);
+        status = msEvalParsedExpression(&p);
 
         if (status != 0) {
           msSetError(MS_PARSEERR, "Failed to parse expression: %s", "msGetClass_FloatRGB", expression->string);
@@ -203,6 +202,143 @@ int msGetClass_FloatRGB(layerObj *layer, float fValue, int red, int green, int b
   return msGetClass_String( layer, &color, pixel_value );
 }
 
+/************************************************************************/
+/*                       getRasterClassSignature()                      */
+/*                                                                      */
+/*      Everything the colors of a raster class table depend on: the    */
+/*      class group, and the expression and first style of each class.  */
+/*      Colors that come from a color range are left out since they     */
+/*      are recomputed for each bucket.                                 */
+/************************************************************************/
+
+static char *getRasterClassSignature(layerObj *layer)
+{
+  char *signature = NULL, buf[256];
+  int i, s;
+
+  signature = msStringConcatenate(signature, layer->classgroup ? layer->classgroup : "");
+
+  for(i=0; i<layer->numclasses; i++) {
+    classObj *c = layer->class[i];
+
+    snprintf(buf, sizeof(buf), "\n%d:%d:%d:", c->expression.type, c->expression.flags, c->numstyles);
+    signature = msStringConcatenate(signature, buf);
+    signature = msStringConcatenate(signature, c->group ? c->group : "");
+    signature = msStringConcatenate(signature, "\t");
+    signature = msStringConcatenate(signature, c->expression.string ? c->expression.string : "");
+
+    for(s=0; s<c->numstyles; s++) {
+      styleObj *style = c->styles[s];
+
+      if(MS_VALID_COLOR(style->mincolor) && MS_VALID_COLOR(style->maxcolor)) {
+        snprintf(buf, sizeof(buf), "\t%d,%d,%d,%d-%d,%d,%d,%d:%.17g-%.17g:%d",
+                 style->mincolor.red, style->mincolor.green, style->mincolor.blue, style->mincolor.alpha,
+                 style->maxcolor.red, style->maxcolor.green, style->maxcolor.blue, style->maxcolor.alpha,
+                 style->minvalue, style->maxvalue, style->opacity);
+      } else if(s == 0) {
+        snprintf(buf, sizeof(buf), "\t%d,%d,%d,%d:%d",
+                 style->color.red, style->color.green, style->color.blue, style->color.alpha, style->opacity);
+      } else {
+        continue; /* not used */
+      }
+      signature = msStringConcatenate(signature, buf);
+    }
+  }
+
+  return signature;
+}
+
+/************************************************************************/
+/*                       msFreeRasterClassTable()                       */
+/************************************************************************/
+
+void msFreeRasterClassTable(rasterClassTableObj *table)
+{
+  if(!table) return;
+  msFree(table->signature);
+  msFree(table->rgba);
+  msFree(table);
+}
+
+/************************************************************************/
+/*                       msGetRasterClassTable()                        */
+/*                                                                      */
+/*      Returns the colors of the numbuckets buckets a pixel value is   */
+/*      scaled to, bucket i holding the values around (i+0.5) /         */
+/*      scaleratio + scalemin. The table is owned by the layer and is   */
+/*      reused by the following draws as long as the buckets and the    */
+/*      classes stay the same.                                          */
+/************************************************************************/
+
+rasterClassTableObj *msGetRasterClassTable(layerObj *layer, int numbuckets, double scalemin, double scaleratio)
+{
+  rasterClassTableObj *table = layer->rasterclasstable;
+  char *signature;
+  char pixel_value[100], last_value[100];
+  colorObj color;
+  int i, c = -1;
+
+  signature = getRasterClassSignature(layer);
+
+  if(table && table->numbuckets == numbuckets && table->scalemin == scalemin &&
+      table->scaleratio == scaleratio && strcmp(table->signature, signature) == 0) {
+    msFree(signature);
+    return table;
+  }
+
+  if(layer->debug >= MS_DEBUGLEVEL_VV)
+    msDebug("msGetRasterClassTable(%s): computing %d buckets.\n", layer->name, numbuckets);
+
+  msFreeRasterClassTable(table);
+  table = (rasterClassTableObj *) msSmallMalloc(sizeof(rasterClassTableObj));
+  table->signature = signature;
+  table->numbuckets = numbuckets;
+  table->scalemin = scalemin;
+  table->scaleratio = scaleratio;
+  table->rgba = (unsigned char *) msSmallCalloc(4, numbuckets);
+  layer->rasterclasstable = table;
+
+  color.red = color.green = color.blue = -1;
+  last_value[0] = '\0';
+
+  for(i=0; i<numbuckets; i++) {
+    double dfOriginalValue = (i+0.5) / scaleratio + scalemin;
+    unsigned char *rgba = table->rgba + 4*i;
+    styleObj *style;
+    int s;
+
+    /* neighbouring buckets often print the same, and so classify the same */
+    snprintf(pixel_value, sizeof(pixel_value), "%18g", (float) dfOriginalValue);
+    if(i == 0 || strcmp(pixel_value, last_value) != 0) {
+      c = msGetClass_String(layer, &color, pixel_value);
+      strcpy(last_value, pixel_value);
+    }
+
+    if(c == -1 || layer->class[c]->numstyles == 0)
+      continue;
+
+    /* change colour based on colour range? */
+    for(s=0; s<layer->class[c]->numstyles; s++) {
+      style = layer->class[c]->styles[s];
+      if(MS_VALID_COLOR(style->mincolor) && MS_VALID_COLOR(style->maxcolor))
+        msValueToRange(style, dfOriginalValue, MS_COLORSPACE_RGB);
+    }
+
+    style = layer->class[c]->styles[0];
+    if(MS_TRANSPARENT_COLOR(style->color)) {
+      /* leave it transparent */
+    } else if(MS_VALID_COLOR(style->color)) {
+      /* use class color */
+      rgba[0] = style->color.red;
+      rgba[1] = style->color.green;
+      rgba[2] = style->color.blue;
+      rgba[3] = (255*style->opacity / 100);
+    }
+  }
+
+  return table;
+}
+
 #if defined(USE_GDAL)
 
 /************************************************************************/
@@ -443,11 +579,10 @@ int msDrawRasterBuildRasterPath(mapObj *map, layerObj *layer,
 /*      Return the CPL error message, and filter out sensitive info.    */
 /************************************************************************/
 
-const char* msDrawRasterGetCPLErrorMsg(const char* decrypted_path,
-                                       const char* szPath)
+static const char* msDrawRasterFilterCPLErrorMsg(const char* cpl_error_msg,
+                                                 const char* decrypted_path,
+                                                 const char* szPath)
 {
-      const char *cpl_error_msg = CPLGetLastErrorMsg();
-
       /* we wish to avoid reporting decrypted paths */
       if( cpl_error_msg != NULL
           && strstr(cpl_error_msg,decrypted_path) != NULL
@@ -466,6 +601,13 @@ const char* msDrawRasterGetCPLErrorMsg(const char* decrypted_path,
       return cpl_error_msg;
 }
 
+const char* msDrawRasterGetCPLErrorMsg(const char* decrypted_path,
+                                       const char* szPath)
+{
+      return msDrawRasterFilterCPLErrorMsg(CPLGetLastErrorMsg(),
+                                           decrypted_path, szPath);
+}
+
 /************************************************************************/
 /*                   msDrawRasterLoadProjection()                       */
 /*                                                                      */
@@ -540,6 +682,126 @@ int msDrawRasterLoadProjection(layerObj *layer,
 
     return MS_SUCCESS;
 }
+
+/************************************************************************/
+/*                     msDrawRasterCloseDataset()                       */
+/*                                                                      */
+/*      Done with a dataset of msDrawRasterLayerLow().  Files go back   */
+/*      to the dataset pool, to stay open for later requests unless     */
+/*      PROCESSING "CLOSE_CONNECTION" says otherwise or drawing failed. */
+/************************************************************************/
+
+static void msDrawRasterCloseDataset(layerObj *layer, GDALDatasetH hDS, int success)
+{
+  const char *close_connection = msLayerGetProcessingKey( layer,
+                                 "CLOSE_CONNECTION" );
+  int keep_open = success && (close_connection == NULL
+                              || strcasecmp(close_connection,"DEFER") == 0);
+
+  if( layer->connectiontype == MS_KERNELDENSITY ) {
+    /* not a file, msCleanupKernelDensityDataset() takes care of it */
+    msAcquireLock( TLOCK_GDAL );
+    if( keep_open )
+      GDALDereferenceDataset( hDS );
+    else
+      GDALClose( hDS );
+    msReleaseLock( TLOCK_GDAL );
+  } else
+    msGDALPoolRelease( hDS, keep_open );
+}
+
+/************************************************************************/
+/*                      msDrawRasterPrefetchTiles()                     */
+/*                                                                      */
+/*      With PROCESSING "TILE_READ_THREADS=n", the next n tiles of a    */
+/*      tileindex are opened together on worker threads, so that slow   */
+/*      (network) storage makes us wait once per batch rather than      */
+/*      once per tile.  They are still drawn one by one, in tileindex   */
+/*      order.  Returns MS_DONE once the tileindex is exhausted.        */
+/************************************************************************/
+
+typedef struct {
+  char tilename[MS_MAXPATHLEN];
+  char tilesrsname[1024];
+  char szPath[MS_MAXPATHLEN];
+  char *decrypted_path;
+  GDALDatasetH hDS;
+  char *cpl_error_msg; /* of a failed open, CPL errors are per thread */
+} rasterTileObj;
+
+static void msDrawRasterOpenTileTask(void *task)
+{
+  rasterTileObj *tile = (rasterTileObj *) task;
+
+  tile->hDS = msGDALPoolOpen( tile->decrypted_path );
+  if( tile->hDS == NULL )
+    tile->cpl_error_msg = msStrdup( CPLGetLastErrorMsg() );
+}
+
+static void msDrawRasterFreeTiles(layerObj *layer, rasterTileObj *tiles, int numtiles)
+{
+  int i;
+
+  for(i=0; i<numtiles; i++) {
+    if(tiles[i].hDS)
+      msDrawRasterCloseDataset(layer, tiles[i].hDS, MS_TRUE);
+    msFree(tiles[i].decrypted_path);
+    msFree(tiles[i].cpl_error_msg);
+    tiles[i].hDS = NULL;
+    tiles[i].decrypted_path = tiles[i].cpl_error_msg = NULL;
+  }
+}
+
+static int msDrawRasterPrefetchTiles(mapObj *map, layerObj *layer,
+                                     layerObj *tlp, shapeObj *ptshp,
+                                     int tileitemindex, int tilesrsindex,
+                                     rasterTileObj *tiles, int maxtiles,
+                                     int *pnumtiles /* output */)
+{
+  void **tasks;
+  int status = MS_SUCCESS;
+
+  msDrawRasterFreeTiles(layer, tiles, *pnumtiles);
+  *pnumtiles = 0;
+
+  while(*pnumtiles < maxtiles) {
+    rasterTileObj *tile = &tiles[*pnumtiles];
+
+    status = msDrawRasterIterateTileIndex(layer, tlp, ptshp,
+                                          tileitemindex, tilesrsindex,
+                                          tile->tilename, sizeof(tile->tilename),
+                                          tile->tilesrsname, sizeof(tile->tilesrsname));
+    if(status != MS_SUCCESS)
+      break;
+    if(strlen(tile->tilename) == 0) continue;
+
+    if(layer->debug == MS_TRUE)
+      msDebug( "msDrawRasterLayerLow(%s): Filename is: %s\n", layer->name, tile->tilename);
+
+    msDrawRasterBuildRasterPath(map, layer, tile->tilename, tile->szPath);
+    if(layer->debug == MS_TRUE)
+      msDebug("msDrawRasterLayerLow(%s): Path is: %s\n", layer->name, tile->szPath);
+
+    tile->decrypted_path = msDecryptStringTokens( map, tile->szPath );
+    if( tile->decrypted_path == NULL ) {
+      status = MS_FAILURE;
+      break;
+    }
+    (*pnumtiles)++;
+  }
+
+  if(*pnumtiles > 0) {
+    int i;
+
+    tasks = (void **) msSmallMalloc(sizeof(void *) * (*pnumtiles));
+    for(i=0; i<*pnumtiles; i++)
+      tasks[i] = &tiles[i];
+    msThreadPoolRun(msDrawRasterOpenTileTask, tasks, *pnumtiles, *pnumtiles);
+    free(tasks);
+  }
+
+  return status;
+}
 #endif // defined(USE_GDAL)
 
 /************************************************************************/
@@ -578,9 +840,11 @@ int msDrawRasterLayerLow(mapObj *map, layerObj *layer, imageObj *image,
   rectObj searchrect;
   GDALDatasetH  hDS;
   double  adfGeoTransform[6];
-  const char *close_connection;
   void *kernel_density_cleanup_ptr = NULL;
 
+  rasterTileObj *tiles = NULL, *tile = NULL;
+  int numtiles = 0, nexttile = 0, maxtiles = 0, tiles_done = MS_FALSE;
+
   msGDALInitialize();
 
   if(layer->debug > 0 || map->debug > 1)
@@ -645,12 +909,36 @@ int msDrawRasterLayerLow(mapObj *map, layerObj *layer, imageObj *image,
         final_status = status;
       goto cleanup;
     }
+
+    if(layer->connectiontype != MS_KERNELDENSITY &&
+        msLayerGetProcessingKey(layer, "TILE_READ_THREADS") &&
+        atoi(msLayerGetProcessingKey(layer, "TILE_READ_THREADS")) > 1) {
+      maxtiles = atoi(msLayerGetProcessingKey(layer, "TILE_READ_THREADS"));
+      tiles = (rasterTileObj *) msSmallCalloc(maxtiles, sizeof(rasterTileObj));
+    }
   }
 
   done = MS_FALSE;
   while(done != MS_TRUE) {
 
-    if(layer->tileindex) {
+    if(tiles) {
+      if(nexttile == numtiles) {
+        if(tiles_done) break; /* no more tiles/images */
+        status = msDrawRasterPrefetchTiles(map, layer, tlp, &tshp,
+                                           tileitemindex, tilesrsindex,
+                                           tiles, maxtiles, &numtiles);
+        nexttile = 0;
+        if(status == MS_FAILURE) {
+          final_status = MS_FAILURE;
+          break;
+        }
+        if(status == MS_DONE) tiles_done = MS_TRUE;
+        if(numtiles == 0) break;
+      }
+      tile = &tiles[nexttile++];
+      filename = tile->tilename;
+      strlcpy(tilesrsname, tile->tilesrsname, sizeof(tilesrsname));
+    } else if(layer->tileindex) {
       status = msDrawRasterIterateTileIndex(layer, tlp, &tshp,
                                             tileitemindex, tilesrsindex,
                                             tilename, sizeof(tilename),
@@ -667,7 +955,14 @@ int msDrawRasterLayerLow(mapObj *map, layerObj *layer, imageObj *image,
       done = MS_TRUE; /* only one image so we're done after this */
     }
 
-    if(layer->connectiontype != MS_KERNELDENSITY) {
+    if(tile) {
+      /* already opened by msDrawRasterPrefetchTiles() */
+      strlcpy(szPath, tile->szPath, sizeof(szPath));
+      decrypted_path = tile->decrypted_path;
+      hDS = tile->hDS;
+      tile->decrypted_path = NULL;
+      tile->hDS = NULL;
+    } else if(layer->connectiontype != MS_KERNELDENSITY) {
       if(strlen(filename) == 0) continue;
 
       if(layer->debug == MS_TRUE)
@@ -688,8 +983,7 @@ int msDrawRasterLayerLow(mapObj *map, layerObj *layer, imageObj *image,
       if( decrypted_path == NULL )
         return MS_FAILURE;
 
-      msAcquireLock( TLOCK_GDAL );
-      hDS = GDALOpenShared( decrypted_path, GA_ReadOnly );
+      hDS = msGDALPoolOpen( decrypted_path );
     } else {
       status = msComputeKernelDensityDataset(map, image, layer, &hDS, &kernel_density_cleanup_ptr);
       if(status != MS_SUCCESS) {
@@ -716,16 +1010,17 @@ int msDrawRasterLayerLow(mapObj *map, layerObj *layer, imageObj *image,
     */
     if(hDS == NULL) {
       int ignore_missing = msMapIgnoreMissingData(map);
-      const char *cpl_error_msg = msDrawRasterGetCPLErrorMsg(decrypted_path, szPath);
+      const char *cpl_error_msg = tile ?
+                                  msDrawRasterFilterCPLErrorMsg(tile->cpl_error_msg, decrypted_path, szPath) :
+                                  msDrawRasterGetCPLErrorMsg(decrypted_path, szPath);
 
       msFree( decrypted_path );
       decrypted_path = NULL;
 
-      msReleaseLock( TLOCK_GDAL );
-
       if(ignore_missing == MS_MISSING_DATA_FAIL) {
         msSetError(MS_IOERR, "Corrupt, empty or missing file '%s' for layer '%s'. %s", "msDrawRasterLayerLow()", szPath, layer->name, cpl_error_msg );
-        return(MS_FAILURE);
+        final_status = MS_FAILURE;
+        break; /* release the tile layer and any prefetched tiles */
       } else if( ignore_missing == MS_MISSING_DATA_LOG ) {
         if( layer->debug || layer->map->debug ) {
           msDebug( "Corrupt, empty or missing file '%s' for layer '%s' ... ignoring this missing data.  %s\n", szPath, layer->name, cpl_error_msg );
@@ -736,7 +1031,8 @@ int msDrawRasterLayerLow(mapObj *map, layerObj *layer, imageObj *image,
       } else {
         /* never get here */
         msSetError(MS_IOERR, "msIgnoreMissingData returned unexpected value.", "msDrawRasterLayerLow()");
-        return(MS_FAILURE);
+        final_status = MS_FAILURE;
+        break;
       }
     }
 
@@ -745,7 +1041,7 @@ int msDrawRasterLayerLow(mapObj *map, layerObj *layer, imageObj *image,
 
     if( msDrawRasterLoadProjection(layer, hDS, filename, tilesrsindex, tilesrsname) != MS_SUCCESS )
     {
-        msReleaseLock( TLOCK_GDAL );
+        msDrawRasterCloseDataset( layer, hDS, MS_FALSE );
         final_status = MS_FAILURE;
         break;
     }
@@ -781,34 +1077,19 @@ int msDrawRasterLayerLow(mapObj *map, layerObj *layer, imageObj *image,
     }
 
     if( status == -1 ) {
-      GDALClose( hDS );
-      msReleaseLock( TLOCK_GDAL );
+      msDrawRasterCloseDataset( layer, hDS, MS_FALSE );
       final_status = MS_FAILURE;
       break;
     }
 
-    /*
-    ** Should we keep this file open for future use?
-    ** default to keeping open for single data files, and
-    ** to closing for tile indexes
-    */
-
-    close_connection = msLayerGetProcessingKey( layer,
-                       "CLOSE_CONNECTION" );
-
-    if( close_connection == NULL && layer->tileindex == NULL )
-      close_connection = "DEFER";
-
-    if( close_connection != NULL
-        && strcasecmp(close_connection,"DEFER") == 0 ) {
-      GDALDereferenceDataset( hDS );
-    } else {
-      GDALClose( hDS );
-    }
-    msReleaseLock( TLOCK_GDAL );
+    msDrawRasterCloseDataset( layer, hDS, MS_TRUE );
   } /* next tile */
 
 cleanup:
+  if(tiles) {
+    msDrawRasterFreeTiles(layer, tiles, numtiles);
+    free(tiles);
+  }
   if(layer->tileindex) { /* tiling clean-up */
     msDrawRasterCleanupTileLayer(tlp, tilelayerindex);
   }
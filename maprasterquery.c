@@ -53,6 +53,11 @@ typedef struct {
   int raster_query_mode;
   int band_count;
 
+  /* sampling: every query_stride'th pixel/line, or the single pixel */
+  /* nearest the center of the query rectangle. */
+  int query_stride;
+  int query_center_only;
+
   int refcount;
 
   rectObj which_rect;
@@ -104,15 +109,20 @@ static int addResult(resultCacheObj *cache, int classindex, int shapeindex, int
   int i;
 
   if(cache->numresults == cache->cachesize) { /* just add it to the end */
-    if(cache->cachesize == 0)
-      cache->results = (resultObj *) malloc(sizeof(resultObj)*MS_RESULTCACHEINCREMENT);
-    else
-      cache->results = (resultObj *) realloc(cache->results, sizeof(resultObj)*(cache->cachesize+MS_RESULTCACHEINCREMENT));
-    if(!cache->results) {
+    /* grow by half, large result sets would be copied over and over otherwise */
+    int newsize = cache->cachesize + MS_MAX(MS_RESULTCACHEINCREMENT, cache->cachesize/2);
+    resultObj *results;
+
+    if(msIO_checkRequestMemory("addResult()") != MS_SUCCESS)
+      return(MS_FAILURE);
+    results = (resultObj *) realloc(cache->results, sizeof(resultObj)*newsize);
+    if(!results) {
       msSetError(MS_MEMERR, "Realloc() error.", "addResult()");
       return(MS_FAILURE);
     }
-    cache->cachesize += MS_RESULTCACHEINCREMENT;
+    msIO_requestMemoryAlloc(MS_REQUEST_MEMORY_RESULTCACHE, sizeof(resultObj)*(newsize - cache->cachesize));
+    cache->results = results;
+    cache->cachesize = newsize;
   }
 
   i = cache->numresults;
@@ -203,6 +213,14 @@ static void msRasterLayerInfoInitialize( layerObj *layer )
     rlinfo->query_result_hard_max =
       atoi(CSLFetchNameValue( layer->processing, "RASTER_QUERY_MAX_RESULT" ));
   }
+
+  rlinfo->query_stride = 1;
+  if( CSLFetchNameValue( layer->processing, "RASTER_QUERY_STRIDE" ) != NULL )
+    rlinfo->query_stride = MS_MAX(1,
+      atoi(CSLFetchNameValue( layer->processing, "RASTER_QUERY_STRIDE" )));
+
+  rlinfo->query_center_only =
+    CSLFetchBoolean( layer->processing, "RASTER_QUERY_CENTER_ONLY", FALSE );
 }
 
 /************************************************************************/
@@ -471,6 +489,28 @@ msRasterQueryByRectLow(mapObj *map, layerObj *layer, GDALDatasetH hDS,
   dfYMin = MS_MIN(dfYMin,dfY);
   dfYMax = MS_MAX(dfYMax,dfY);
 
+  /* -------------------------------------------------------------------- */
+  /*      In center only mode we just want the pixel under the center     */
+  /*      of the query rectangle, if it falls on this file.               */
+  /* -------------------------------------------------------------------- */
+  if( rlinfo->query_center_only && rlinfo->range_mode < 0 ) {
+    pointObj sCenter;
+
+    sCenter.x = (queryRect.minx + queryRect.maxx) / 2.0;
+    sCenter.y = (queryRect.miny + queryRect.maxy) / 2.0;
+#ifdef USE_PROJ
+    if(layer->project)
+      msProjectPoint(&(map->projection), &(layer->projection), &sCenter);
+#endif
+
+    dfX = GEO_TRANS(adfInvGeoTransform  , sCenter.x, sCenter.y);
+    dfY = GEO_TRANS(adfInvGeoTransform+3, sCenter.x, sCenter.y);
+    dfXMin = floor(dfX);
+    dfXMax = dfXMin + 1;
+    dfYMin = floor(dfY);
+    dfYMax = dfYMin + 1;
+  }
+
   /* -------------------------------------------------------------------- */
   /*      Trim the rectangle to the area of the file itself, but out      */
   /*      to the edges of the touched edge pixels.                        */
@@ -505,30 +545,19 @@ msRasterQueryByRectLow(mapObj *map, layerObj *layer, GDALDatasetH hDS,
     return -1;
   }
 
+  if( nWinXSize <= 0 || nWinYSize <= 0 ) {
+    free( panBandMap );
+    return MS_SUCCESS;
+  }
+
   /* -------------------------------------------------------------------- */
-  /*      Try to load the raster data.  For now we just load the first    */
-  /*      band in the file.  Later we will deal with the various band     */
-  /*      selection criteria.                                             */
+  /*      The raster data is read one sampled scanline at a time so       */
+  /*      memory use depends on the window width only, not on the         */
+  /*      area of the query.                                              */
   /* -------------------------------------------------------------------- */
   pafRaster = (float *)
-              calloc(sizeof(float),nWinXSize*nWinYSize*nBandCount);
-  MS_CHECK_ALLOC(pafRaster, sizeof(float)*nWinXSize*nWinYSize*nBandCount, -1);
-
-  eErr = GDALDatasetRasterIO( hDS, GF_Read,
-                              nWinXOff, nWinYOff, nWinXSize, nWinYSize,
-                              pafRaster, nWinXSize, nWinYSize, GDT_Float32,
-                              nBandCount, panBandMap,
-                              4 * nBandCount,
-                              4 * nBandCount * nWinXSize,
-                              4 );
-
-  if( eErr != CE_None ) {
-    msSetError( MS_IOERR, "GDALDatasetRasterIO() failed: %s",
-                "msRasterQueryByRectLow()", CPLGetLastErrorMsg() );
-
-    free( pafRaster );
-    return -1;
-  }
+              calloc(sizeof(float),nWinXSize*nBandCount);
+  MS_CHECK_ALLOC(pafRaster, sizeof(float)*nWinXSize*nBandCount, -1);
 
   /* -------------------------------------------------------------------- */
   /*      Fetch color table for intepreting colors if needed.             */
@@ -536,8 +565,6 @@ msRasterQueryByRectLow(mapObj *map, layerObj *layer, GDALDatasetH hDS,
   rlinfo->hCT = GDALGetRasterColorTable(
                   GDALGetRasterBand( hDS, panBandMap[0] ) );
 
-  free( panBandMap );
-
   /* -------------------------------------------------------------------- */
   /*      When computing whether pixels are within range we do it         */
   /*      based on the center of the pixel to the target point but        */
@@ -555,10 +582,31 @@ msRasterQueryByRectLow(mapObj *map, layerObj *layer, GDALDatasetH hDS,
   dfAdjustedRange = dfAdjustedRange * dfAdjustedRange;
 
   /* -------------------------------------------------------------------- */
-  /*      Loop over all pixels determining which are "in".                */
+  /*      Loop over all (sampled) pixels determining which are "in".      */
   /* -------------------------------------------------------------------- */
-  for( iLine = 0; iLine < nWinYSize; iLine++ ) {
-    for( iPixel = 0; iPixel < nWinXSize; iPixel++ ) {
+  for( iLine = 0; iLine < nWinYSize; iLine += rlinfo->query_stride ) {
+
+    if( rlinfo->query_results == rlinfo->query_result_hard_max )
+      break;
+
+    eErr = GDALDatasetRasterIO( hDS, GF_Read,
+                                nWinXOff, nWinYOff + iLine, nWinXSize, 1,
+                                pafRaster, nWinXSize, 1, GDT_Float32,
+                                nBandCount, panBandMap,
+                                4 * nBandCount,
+                                4 * nBandCount * nWinXSize,
+                                4 );
+
+    if( eErr != CE_None ) {
+      msSetError( MS_IOERR, "GDALDatasetRasterIO() failed: %s",
+                  "msRasterQueryByRectLow()", CPLGetLastErrorMsg() );
+
+      free( panBandMap );
+      free( pafRaster );
+      return -1;
+    }
+
+    for( iPixel = 0; iPixel < nWinXSize; iPixel += rlinfo->query_stride ) {
       pointObj  sPixelLocation,sReprojectedPixelLocation;
 
       if( rlinfo->query_results == rlinfo->query_result_hard_max )
@@ -622,20 +670,21 @@ msRasterQueryByRectLow(mapObj *map, layerObj *layer, GDALDatasetH hDS,
         if( rlinfo->range_mode == MS_QUERY_SINGLE ) {
           rlinfo->range_dist = dist;
           rlinfo->query_results = 0;
+          layer->resultcache->numresults = 0;
         }
       }
 
       msRasterQueryAddPixel( layer,
 			                       &sPixelLocation, // return coords in layer SRS
                              &sReprojectedPixelLocation,
-                             pafRaster
-                             + (iLine*nWinXSize + iPixel) * nBandCount );
+                             pafRaster + iPixel * nBandCount );
     }
   }
 
   /* -------------------------------------------------------------------- */
   /*      Cleanup.                                                        */
   /* -------------------------------------------------------------------- */
+  free( panBandMap );
   free( pafRaster );
 
   return MS_SUCCESS;
@@ -683,8 +732,7 @@ int msRasterQueryByRect(mapObj *map, layerObj *layer, rectObj queryRect)
   /*      Clear old results cache.                                        */
   /* -------------------------------------------------------------------- */
   if(layer->resultcache) {
-    if(layer->resultcache->results) free(layer->resultcache->results);
-    free(layer->resultcache);
+    msFreeResultCache(layer->resultcache);
     layer->resultcache = NULL;
   }
 
@@ -693,6 +741,7 @@ int msRasterQueryByRect(mapObj *map, layerObj *layer, rectObj queryRect)
   /* -------------------------------------------------------------------- */
   layer->resultcache = (resultCacheObj *)msSmallMalloc(sizeof(resultCacheObj));
   layer->resultcache->results = NULL;
+  layer->resultcache->mapping = NULL;
   layer->resultcache->numresults = layer->resultcache->cachesize = 0;
   layer->resultcache->bounds.minx =
     layer->resultcache->bounds.miny =
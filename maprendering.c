@@ -86,21 +86,80 @@ void computeSymbolStyle(symbolStyleObj *s, styleObj *src, symbolObj *symbol, dou
     ((a).blue==(b).blue) && \
     ((a).alpha==(b).alpha))
 
+#define MS_TILECACHE_COLOR 1
+#define MS_TILECACHE_OUTLINECOLOR 2
+#define MS_TILECACHE_BACKGROUNDCOLOR 4
+
+static int tileCacheColorFlags(symbolStyleObj *s)
+{
+  return (s->color ? MS_TILECACHE_COLOR : 0) |
+         (s->outlinecolor ? MS_TILECACHE_OUTLINECOLOR : 0) |
+         (s->backgroundcolor ? MS_TILECACHE_BACKGROUNDCOLOR : 0);
+}
+
+#define TILECACHE_HASH_INT(h,v) ((h) = (h) * 31 + (unsigned int)(v))
+#define TILECACHE_HASH_COLOR(h,c) {TILECACHE_HASH_INT(h,(c)->red); TILECACHE_HASH_INT(h,(c)->green); \
+    TILECACHE_HASH_INT(h,(c)->blue); TILECACHE_HASH_INT(h,(c)->alpha);}
+
+/* hash of everything a tile is looked up by, the renderer is implied by the image */
+static unsigned int tileCacheHash(symbolObj *symbol, symbolStyleObj *s, int width, int height)
+{
+  unsigned int h = (unsigned int)(((size_t)symbol) >> 4);
+  TILECACHE_HASH_INT(h, width);
+  TILECACHE_HASH_INT(h, height);
+  TILECACHE_HASH_INT(h, MS_NINT(s->scale * 1000));
+  TILECACHE_HASH_INT(h, MS_NINT(s->rotation * 1000));
+  TILECACHE_HASH_INT(h, MS_NINT(s->outlinewidth * 1000));
+  if(s->color) TILECACHE_HASH_COLOR(h, s->color);
+  if(s->outlinecolor) TILECACHE_HASH_COLOR(h, s->outlinecolor);
+  if(s->backgroundcolor) TILECACHE_HASH_COLOR(h, s->backgroundcolor);
+  return h;
+}
+
+/* move a cached tile to the front of the image's least recently used list */
+static void touchTileCache(imageObj *img, tileCacheObj *tile)
+{
+  tileCacheObj *head = img->tilecache;
+  if(tile == head) return;
+
+  /* unlink, tile is not the head so its prev is a real predecessor */
+  tile->prev->next = tile->next;
+  if(tile->next)
+    tile->next->prev = tile->prev;
+  else
+    head->prev = tile->prev; /* tile was the tail */
+
+  tile->next = head;
+  tile->prev = head->prev;
+  head->prev = tile;
+  img->tilecache = tile;
+}
+
 tileCacheObj *searchTileCache(imageObj *img, symbolObj *symbol, symbolStyleObj *s, int width, int height)
 {
-  tileCacheObj *cur = img->tilecache;
-  while(cur != NULL) {
-    if( cur->width == width
+  tileCacheObj *cur;
+  unsigned int hash;
+  int colorflags;
+
+  if(!img->tilehash) return NULL;
+
+  hash = tileCacheHash(symbol,s,width,height);
+  colorflags = tileCacheColorFlags(s);
+  for(cur = img->tilehash[hash % MS_TILECACHE_HASHSIZE]; cur; cur = cur->hashnext) {
+    if( cur->hash == hash
+        && cur->width == width
         && cur->height == height
         && cur->symbol == symbol
         && cur->outlinewidth == s->outlinewidth
         && cur->rotation == s->rotation
         && cur->scale == s->scale
+        && cur->colorflags == colorflags
         && (!s->color || COMPARE_COLORS(cur->color,*s->color))
         && (!s->backgroundcolor || COMPARE_COLORS(cur->backgroundcolor,*s->backgroundcolor))
-        && (!s->outlinecolor || COMPARE_COLORS(cur->outlinecolor,*s->outlinecolor)))
+        && (!s->outlinecolor || COMPARE_COLORS(cur->outlinecolor,*s->outlinecolor))) {
+      touchTileCache(img,cur);
       return cur;
-    cur = cur->next;
+    }
   }
   return NULL;
 }
@@ -134,50 +193,71 @@ int preloadSymbol(symbolSetObj *symbolset, symbolObj *symbol, rendererVTableObj
   return MS_SUCCESS;
 }
 
-/* add a cached tile to the current image's cache */
+/* add a cached tile to the current image's cache, dropping the least recently used one when full */
 tileCacheObj *addTileCache(imageObj *img,
                            imageObj *tile, symbolObj *symbol, symbolStyleObj *style, int width, int height)
 {
-  tileCacheObj *cachep;
+  tileCacheObj *cachep, **bucket;
+  int maxtiles = MS_IMAGECACHESIZE;
+  const char *value = img->map ? msGetConfigOption(img->map, "MS_SYMBOL_TILE_CACHE_SIZE") : NULL;
 
-  if(img->ntiles >= MS_IMAGECACHESIZE) { /* remove last element, size stays the same */
-    cachep = img->tilecache;
+  if(value) maxtiles = MS_MAX(1, atoi(value));
 
-    /*go to the before last cache object*/
-    while(cachep->next && cachep->next->next) cachep = cachep->next;
+  if(!img->tilehash) {
+    img->tilehash = (tileCacheObj**)msSmallCalloc(MS_TILECACHE_HASHSIZE, sizeof(tileCacheObj*));
+  }
 
-    /*free the last tile's data*/
-    msFreeImage(cachep->next->image);
-
-    /*reuse the last tile object*/
-    /* make the cache point to the start of the list*/
-    cachep->next->next = img->tilecache;
-    /* point the global cache to the new first */
-    img->tilecache = cachep->next;
-    /* the before last cache is now last, so it has no successor*/
-    cachep->next = NULL;
+  if(img->ntiles >= maxtiles) { /* reuse the tail, size stays the same */
+    cachep = img->tilecache->prev;
+
+    /* remove it from its hash bucket */
+    for(bucket = &img->tilehash[cachep->hash % MS_TILECACHE_HASHSIZE]; *bucket != cachep; bucket = &(*bucket)->hashnext);
+    *bucket = cachep->hashnext;
+
+    /* and from the list */
+    if(cachep == img->tilecache) {
+      img->tilecache = NULL;
+    } else {
+      cachep->prev->next = NULL;
+      img->tilecache->prev = cachep->prev;
+    }
 
+    /*free the last tile's data*/
+    msFreeImage(cachep->image);
   } else {
     img->ntiles += 1;
     cachep = (tileCacheObj*)malloc(sizeof(tileCacheObj));
     MS_CHECK_ALLOC(cachep, sizeof(tileCacheObj), NULL);
-    cachep->next = img->tilecache;
-    img->tilecache = cachep;
   }
 
-  cachep = img->tilecache;
-
   cachep->image = tile;
   cachep->outlinewidth = style->outlinewidth;
   cachep->scale = style->scale;
   cachep->rotation = style->rotation;
-  cachep->outlinewidth = style->outlinewidth;
+  cachep->colorflags = tileCacheColorFlags(style);
   if(style->color) MS_COPYCOLOR(&cachep->color,style->color);
   if(style->outlinecolor) MS_COPYCOLOR(&cachep->outlinecolor,style->outlinecolor);
   if(style->backgroundcolor) MS_COPYCOLOR(&cachep->backgroundcolor,style->backgroundcolor);
   cachep->width = width;
   cachep->height = height;
   cachep->symbol = symbol;
+  cachep->hash = tileCacheHash(symbol,style,width,height);
+
+  /* the new tile is the most recently used one */
+  if(img->tilecache) {
+    cachep->next = img->tilecache;
+    cachep->prev = img->tilecache->prev;
+    img->tilecache->prev = cachep;
+  } else {
+    cachep->next = NULL;
+    cachep->prev = cachep;
+  }
+  img->tilecache = cachep;
+
+  bucket = &img->tilehash[cachep->hash % MS_TILECACHE_HASHSIZE];
+  cachep->hashnext = *bucket;
+  *bucket = cachep;
+
   return(cachep);
 }
 
@@ -363,6 +443,40 @@ imageObj *getTile(imageObj *img, symbolObj *symbol,  symbolStyleObj *s, int widt
   return tile->image;
 }
 
+/* markers collected by msImagePolylineMarkers() for the renderer's batched symbol calls */
+typedef struct {
+  int numpoints, maxpoints;
+  pointObj *points;
+  double *rotations;
+} markerBatchObj;
+
+static void addMarkerToBatch(markerBatchObj *batch, pointObj *point, double rotation)
+{
+  if(batch->numpoints == batch->maxpoints) {
+    batch->maxpoints = MS_MAX(64, batch->maxpoints * 2);
+    batch->points = (pointObj*)msSmallRealloc(batch->points, batch->maxpoints * sizeof(pointObj));
+    batch->rotations = (double*)msSmallRealloc(batch->rotations, batch->maxpoints * sizeof(double));
+  }
+  batch->points[batch->numpoints] = *point;
+  batch->rotations[batch->numpoints] = rotation;
+  batch->numpoints++;
+}
+
+static int flushMarkerBatch(imageObj *image, markerBatchObj *batch, symbolObj *symbol, symbolStyleObj *style)
+{
+  rendererVTableObj *renderer = MS_IMAGE_RENDERER(image);
+  int ret = MS_SUCCESS;
+  if(batch->numpoints > 0) {
+    if(symbol->type == MS_SYMBOL_PIXMAP)
+      ret = renderer->renderPixmapSymbols(image, batch->numpoints, batch->points, batch->rotations, symbol, style);
+    else
+      ret = renderer->renderVectorSymbols(image, batch->numpoints, batch->points, batch->rotations, symbol, style);
+  }
+  msFree(batch->points);
+  msFree(batch->rotations);
+  return ret;
+}
+
 int msImagePolylineMarkers(imageObj *image, shapeObj *p, symbolObj *symbol,
                            symbolStyleObj *style, double spacing,
                            double initialgap, int auto_angle)
@@ -375,6 +489,13 @@ int msImagePolylineMarkers(imageObj *image, shapeObj *p, symbolObj *symbol,
   glyph_element *glyphc = NULL;
   face_element *face = NULL;
   int ret = MS_SUCCESS;
+  markerBatchObj batch = {0, 0, NULL, NULL}, *batchp = NULL;
+
+  /* vector and pixmap markers are handed to the renderer all at once when it can draw them so */
+  if((symbol->type == MS_SYMBOL_VECTOR && renderer->renderVectorSymbols) ||
+      (symbol->type == MS_SYMBOL_PIXMAP && renderer->renderPixmapSymbols))
+    batchp = &batch;
+
   if(symbol->type != MS_SYMBOL_TRUETYPE) {
     symbol_width = MS_MAX(1,symbol->sizex*style->scale);
     symbol_height = MS_MAX(1,symbol->sizey*style->scale);
@@ -446,13 +567,19 @@ int msImagePolylineMarkers(imageObj *image, shapeObj *p, symbolObj *symbol,
           
         switch (symbol->type) {
           case MS_SYMBOL_PIXMAP:
-            ret = renderer->renderPixmapSymbol(image, point.x, point.y, symbol, style);
+            if(batchp)
+              addMarkerToBatch(batchp, &point, style->rotation);
+            else
+              ret = renderer->renderPixmapSymbol(image, point.x, point.y, symbol, style);
             break;
           case MS_SYMBOL_ELLIPSE:
             ret = renderer->renderEllipseSymbol(image, point.x, point.y, symbol, style);
             break;
           case MS_SYMBOL_VECTOR:
-            ret = renderer->renderVectorSymbol(image, point.x, point.y, symbol, style);
+            if(batchp)
+              addMarkerToBatch(batchp, &point, style->rotation);
+            else
+              ret = renderer->renderVectorSymbol(image, point.x, point.y, symbol, style);
             break;
           case MS_SYMBOL_TRUETYPE:
             ret = drawGlyphMarker(image, face, glyphc, point.x, point.y, style->scale, style->rotation,
@@ -517,13 +644,19 @@ int msImagePolylineMarkers(imageObj *image, shapeObj *p, symbolObj *symbol,
           point.y = p->line[i].point[j - 1].y + offset * ry;
           switch (symbol->type) {
             case MS_SYMBOL_PIXMAP:
-              ret = renderer->renderPixmapSymbol(image, point.x, point.y, symbol, style);
+              if(batchp)
+                addMarkerToBatch(batchp, &point, style->rotation);
+              else
+                ret = renderer->renderPixmapSymbol(image, point.x, point.y, symbol, style);
               break;
             case MS_SYMBOL_ELLIPSE:
               ret = renderer->renderEllipseSymbol(image, point.x, point.y, symbol, style);
               break;
             case MS_SYMBOL_VECTOR:
-              ret = renderer->renderVectorSymbol(image, point.x, point.y, symbol, style);
+              if(batchp)
+                addMarkerToBatch(batchp, &point, style->rotation);
+              else
+                ret = renderer->renderVectorSymbol(image, point.x, point.y, symbol, style);
               break;
             case MS_SYMBOL_TRUETYPE:
               ret = drawGlyphMarker(image, face, glyphc, point.x, point.y, style->scale, style->rotation,
@@ -549,6 +682,8 @@ int msImagePolylineMarkers(imageObj *image, shapeObj *p, symbolObj *symbol,
     }
 
   }
+  if(batchp)
+    ret = flushMarkerBatch(image, batchp, symbol, style);
   return ret;
 }
 
@@ -83,14 +83,15 @@ msNearestRasterResampler( imageObj *psSrcImage, rasterBufferObj *src_rb,
                           imageObj *psDstImage, rasterBufferObj *dst_rb,
                           int *panCMap,
                           SimpleTransformer pfnTransform, void *pCBData,
-                          int debug, rasterBufferObj *mask_rb )
+                          rasterBufferObj *mask_rb,
+                          int nDstYMin, int nDstYMax,
+                          int *pnFailedPoints, int *pnSetPoints )
 
 {
   double  *x, *y;
   int   nDstX, nDstY;
   int         *panSuccess;
   int   nDstXSize = psDstImage->width;
-  int   nDstYSize = psDstImage->height;
   int   nSrcXSize = psSrcImage->width;
   int   nSrcYSize = psSrcImage->height;
   int   nFailedPoints = 0, nSetPoints = 0;
@@ -101,7 +102,7 @@ msNearestRasterResampler( imageObj *psSrcImage, rasterBufferObj *src_rb,
   y = (double *) msSmallMalloc( sizeof(double) * nDstXSize );
   panSuccess = (int *) msSmallMalloc( sizeof(int) * nDstXSize );
 
-  for( nDstY = 0; nDstY < nDstYSize; nDstY++ ) {
+  for( nDstY = nDstYMin; nDstY < nDstYMax; nDstY++ ) {
     for( nDstX = 0; nDstX < nDstXSize; nDstX++ ) {
       x[nDstX] = nDstX + 0.5;
       y[nDstX] = nDstY + 0.5;
@@ -213,20 +214,48 @@ msNearestRasterResampler( imageObj *psSrcImage, rasterBufferObj *src_rb,
   free( panSuccess );
   free( x );
   free( y );
-  msFree(mask_rb);
 
-  /* -------------------------------------------------------------------- */
-  /*      Some debugging output.                                          */
-  /* -------------------------------------------------------------------- */
-  if( nFailedPoints > 0 && debug ) {
-    msDebug( "msNearestRasterResampler: "
-             "%d failed to transform, %d actually set.\n",
-             nFailedPoints, nSetPoints );
-  }
+  *pnFailedPoints = nFailedPoints;
+  *pnSetPoints = nSetPoints;
 
   return 0;
 }
 
+/************************************************************************/
+/*                          msSourceSampleRGBA()                        */
+/*                                                                      */
+/*      The 8 bit RGBA case of msSourceSample(), on its own so that     */
+/*      the bilinear resampler can call it without testing the          */
+/*      image format on each of the four samples of each pixel.         */
+/************************************************************************/
+
+/* a / 255.0 for every alpha value a, computed by the compiler */
+#define ALPHA01_4(a) (a)/255.0, (a+1)/255.0, (a+2)/255.0, (a+3)/255.0
+#define ALPHA01_16(a) ALPHA01_4(a), ALPHA01_4(a+4), ALPHA01_4(a+8), ALPHA01_4(a+12)
+#define ALPHA01_64(a) ALPHA01_16(a), ALPHA01_16(a+16), ALPHA01_16(a+32), ALPHA01_16(a+48)
+static const double adfAlpha01[256] = {
+  ALPHA01_64(0), ALPHA01_64(64), ALPHA01_64(128), ALPHA01_64(192)
+};
+
+static void msSourceSampleRGBA( const rgbaArrayObj *rgba,
+                                int iSrcX, int iSrcY, double *padfPixelSum,
+                                double dfWeight, double *pdfWeightSum )
+
+{
+  int rb_off = iSrcX * rgba->pixel_step + iSrcY * rgba->row_step;
+
+  if( rgba->a == NULL || rgba->a[rb_off] > 1 ) {
+    padfPixelSum[0] += rgba->r[rb_off] * dfWeight;
+    padfPixelSum[1] += rgba->g[rb_off] * dfWeight;
+    padfPixelSum[2] += rgba->b[rb_off] * dfWeight;
+
+    if( rgba->a == NULL )
+      *pdfWeightSum += dfWeight;
+    else
+      *pdfWeightSum += dfWeight * adfAlpha01[rgba->a[rb_off]];
+  }
+}
+
 /************************************************************************/
 /*                            msSourceSample()                          */
 /************************************************************************/
@@ -237,22 +266,9 @@ static void msSourceSample( imageObj *psSrcImage, rasterBufferObj *rb,
 
 {
   if( MS_RENDERER_PLUGIN(psSrcImage->format) ) {
-    rgbaArrayObj *rgba;
-    int rb_off;
     assert(rb && rb->type == MS_BUFFER_BYTE_RGBA);
-    rgba = &(rb->data.rgba);
-    rb_off = iSrcX * rgba->pixel_step + iSrcY * rgba->row_step;
-
-    if( rgba->a == NULL || rgba->a[rb_off] > 1 ) {
-      padfPixelSum[0] += rgba->r[rb_off] * dfWeight;
-      padfPixelSum[1] += rgba->g[rb_off] * dfWeight;
-      padfPixelSum[2] += rgba->b[rb_off] * dfWeight;
-
-      if( rgba->a == NULL )
-        *pdfWeightSum += dfWeight;
-      else
-        *pdfWeightSum += dfWeight * (rgba->a[rb_off] / 255.0);
-    }
+    msSourceSampleRGBA( &(rb->data.rgba), iSrcX, iSrcY, padfPixelSum,
+                        dfWeight, pdfWeightSum );
   } else if( MS_RENDERER_RAWDATA(psSrcImage->format) ) {
     int band;
     int src_off;
@@ -302,19 +318,22 @@ msBilinearRasterResampler( imageObj *psSrcImage, rasterBufferObj *src_rb,
                            imageObj *psDstImage, rasterBufferObj *dst_rb,
                            int *panCMap,
                            SimpleTransformer pfnTransform, void *pCBData,
-                           int debug, rasterBufferObj *mask_rb )
+                           rasterBufferObj *mask_rb,
+                           int nDstYMin, int nDstYMax,
+                           int *pnFailedPoints, int *pnSetPoints )
 
 {
   double  *x, *y;
   int   nDstX, nDstY, i;
   int         *panSuccess;
   int   nDstXSize = psDstImage->width;
-  int   nDstYSize = psDstImage->height;
   int   nSrcXSize = psSrcImage->width;
   int   nSrcYSize = psSrcImage->height;
   int   nFailedPoints = 0, nSetPoints = 0;
   double     *padfPixelSum;
   int         bandCount = MS_MAX(4,psSrcImage->format->bands);
+  int         bRGBA = MS_RENDERER_PLUGIN(psSrcImage->format);
+  const rgbaArrayObj *src_rgba = bRGBA ? &(src_rb->data.rgba) : NULL;
 
   padfPixelSum = (double *) msSmallMalloc(sizeof(double) * bandCount);
 
@@ -324,7 +343,7 @@ msBilinearRasterResampler( imageObj *psSrcImage, rasterBufferObj *src_rb,
   y = (double *) msSmallMalloc( sizeof(double) * nDstXSize );
   panSuccess = (int *) msSmallMalloc( sizeof(int) * nDstXSize );
 
-  for( nDstY = 0; nDstY < nDstYSize; nDstY++ ) {
+  for( nDstY = nDstYMin; nDstY < nDstYMax; nDstY++ ) {
     for( nDstX = 0; nDstX < nDstXSize; nDstX++ ) {
       x[nDstX] = nDstX + 0.5;
       y[nDstX] = nDstY + 0.5;
@@ -349,8 +368,11 @@ msBilinearRasterResampler( imageObj *psSrcImage, rasterBufferObj *src_rb,
       x[nDstX] -= 0.5;
       y[nDstX] -= 0.5;
 
-      nSrcX = (int) floor(x[nDstX]);
-      nSrcY = (int) floor(y[nDstX]);
+      /* floor() without the libm call, the bounds are checked below */
+      nSrcX = (int) x[nDstX];
+      nSrcY = (int) y[nDstX];
+      if( x[nDstX] < nSrcX ) nSrcX--;
+      if( y[nDstX] < nSrcY ) nSrcY--;
 
       nSrcX2 = nSrcX+1;
       nSrcY2 = nSrcY+1;
@@ -369,23 +391,39 @@ msBilinearRasterResampler( imageObj *psSrcImage, rasterBufferObj *src_rb,
       nSrcX2 = MS_MIN(nSrcX2,nSrcXSize-1);
       nSrcY2 = MS_MIN(nSrcY2,nSrcYSize-1);
 
-      memset( padfPixelSum, 0, sizeof(double) * bandCount);
+      if( bRGBA ) {
+        padfPixelSum[0] = padfPixelSum[1] = padfPixelSum[2] = 0.0;
+        msSourceSampleRGBA( src_rgba, nSrcX, nSrcY, padfPixelSum,
+                            (1.0 - dfRatioX2) * (1.0 - dfRatioY2),
+                            &dfWeightSum );
+        msSourceSampleRGBA( src_rgba, nSrcX2, nSrcY, padfPixelSum,
+                            (dfRatioX2) * (1.0 - dfRatioY2),
+                            &dfWeightSum );
+        msSourceSampleRGBA( src_rgba, nSrcX, nSrcY2, padfPixelSum,
+                            (1.0 - dfRatioX2) * (dfRatioY2),
+                            &dfWeightSum );
+        msSourceSampleRGBA( src_rgba, nSrcX2, nSrcY2, padfPixelSum,
+                            (dfRatioX2) * (dfRatioY2),
+                            &dfWeightSum );
+      } else {
+        memset( padfPixelSum, 0, sizeof(double) * bandCount);
 
-      msSourceSample( psSrcImage, src_rb, nSrcX, nSrcY, padfPixelSum,
-                      (1.0 - dfRatioX2) * (1.0 - dfRatioY2),
-                      &dfWeightSum );
+        msSourceSample( psSrcImage, src_rb, nSrcX, nSrcY, padfPixelSum,
+                        (1.0 - dfRatioX2) * (1.0 - dfRatioY2),
+                        &dfWeightSum );
 
-      msSourceSample( psSrcImage, src_rb, nSrcX2, nSrcY, padfPixelSum,
-                      (dfRatioX2) * (1.0 - dfRatioY2),
-                      &dfWeightSum );
+        msSourceSample( psSrcImage, src_rb, nSrcX2, nSrcY, padfPixelSum,
+                        (dfRatioX2) * (1.0 - dfRatioY2),
+                        &dfWeightSum );
 
-      msSourceSample( psSrcImage, src_rb, nSrcX, nSrcY2, padfPixelSum,
-                      (1.0 - dfRatioX2) * (dfRatioY2),
-                      &dfWeightSum );
+        msSourceSample( psSrcImage, src_rb, nSrcX, nSrcY2, padfPixelSum,
+                        (1.0 - dfRatioX2) * (dfRatioY2),
+                        &dfWeightSum );
 
-      msSourceSample( psSrcImage, src_rb, nSrcX2, nSrcY2, padfPixelSum,
-                      (dfRatioX2) * (dfRatioY2),
-                      &dfWeightSum );
+        msSourceSample( psSrcImage, src_rb, nSrcX2, nSrcY2, padfPixelSum,
+                        (dfRatioX2) * (dfRatioY2),
+                        &dfWeightSum );
+      }
 
       if( dfWeightSum == 0.0 )
         continue;
@@ -444,17 +482,9 @@ msBilinearRasterResampler( imageObj *psSrcImage, rasterBufferObj *src_rb,
   free( panSuccess );
   free( x );
   free( y );
-  msFree(mask_rb);
 
-  /* -------------------------------------------------------------------- */
-  /*      Some debugging output.                                          */
-  /* -------------------------------------------------------------------- */
-  if( nFailedPoints > 0 && debug )
-  {
-    msDebug( "msBilinearRasterResampler: "
-             "%d failed to transform, %d actually set.\n",
-             nFailedPoints, nSetPoints );
-  }
+  *pnFailedPoints = nFailedPoints;
+  *pnSetPoints = nSetPoints;
 
   return 0;
 }
@@ -521,14 +551,15 @@ msAverageRasterResampler( imageObj *psSrcImage, rasterBufferObj *src_rb,
                           imageObj *psDstImage, rasterBufferObj *dst_rb,
                           int *panCMap,
                           SimpleTransformer pfnTransform, void *pCBData,
-                          int debug, rasterBufferObj *mask_rb )
+                          rasterBufferObj *mask_rb,
+                          int nDstYMin, int nDstYMax,
+                          int *pnFailedPoints, int *pnSetPoints )
 
 {
   double  *x1, *y1, *x2, *y2;
   int   nDstX, nDstY;
   int         *panSuccess1, *panSuccess2;
   int   nDstXSize = psDstImage->width;
-  int   nDstYSize = psDstImage->height;
   int   nFailedPoints = 0, nSetPoints = 0;
   double     *padfPixelSum;
 
@@ -545,7 +576,7 @@ msAverageRasterResampler( imageObj *psSrcImage, rasterBufferObj *src_rb,
   panSuccess1 = (int *) msSmallMalloc( sizeof(int) * (nDstXSize+1) );
   panSuccess2 = (int *) msSmallMalloc( sizeof(int) * (nDstXSize+1) );
 
-  for( nDstY = 0; nDstY < nDstYSize; nDstY++ ) {
+  for( nDstY = nDstYMin; nDstY < nDstYMax; nDstY++ ) {
     for( nDstX = 0; nDstX <= nDstXSize; nDstX++ ) {
       x1[nDstX] = nDstX;
       y1[nDstX] = nDstY;
@@ -642,17 +673,9 @@ msAverageRasterResampler( imageObj *psSrcImage, rasterBufferObj *src_rb,
   free( panSuccess2 );
   free( x2 );
   free( y2 );
-  msFree(mask_rb);
 
-  /* -------------------------------------------------------------------- */
-  /*      Some debugging output.                                          */
-  /* -------------------------------------------------------------------- */
-  if( nFailedPoints > 0 && debug )
-  {
-    msDebug( "msAverageRasterResampler: "
-             "%d failed to transform, %d actually set.\n",
-             nFailedPoints, nSetPoints );
-  }
+  *pnFailedPoints = nFailedPoints;
+  *pnSetPoints = nSetPoints;
 
   return 0;
 }
@@ -665,12 +688,10 @@ msAverageRasterResampler( imageObj *psSrcImage, rasterBufferObj *src_rb,
 
 typedef struct {
   projectionObj *psSrcProjObj;
-  projPJ psSrcProj;
   int bSrcIsGeographic;
   double adfInvSrcGeoTransform[6];
 
   projectionObj *psDstProjObj;
-  projPJ psDstProj;
   int bDstIsGeographic;
   double adfDstGeoTransform[6];
 
@@ -704,7 +725,7 @@ void *msInitProjTransformer( projectionObj *psSrc,
   /*      transformation for more convenient inverse application in       */
   /*      the transformer.                                                */
   /* -------------------------------------------------------------------- */
-  psPTInfo->psSrcProj = psSrc->proj;
+  psPTInfo->psSrcProjObj = psSrc;
   if( psPTInfo->bUseProj )
     psPTInfo->bSrcIsGeographic = pj_is_latlong(psSrc->proj);
   else
@@ -719,7 +740,7 @@ void *msInitProjTransformer( projectionObj *psSrc,
   /* -------------------------------------------------------------------- */
   /*      Record destination image information.                           */
   /* -------------------------------------------------------------------- */
-  psPTInfo->psDstProj = psDst->proj;
+  psPTInfo->psDstProjObj = psDst;
   if( psPTInfo->bUseProj )
     psPTInfo->bDstIsGeographic = pj_is_latlong(psDst->proj);
   else
@@ -786,10 +807,15 @@ int msProjTransformer( void *pCBData, int nPoints,
 
     z = (double *) msSmallCalloc(sizeof(double),nPoints);
 
+#if PJ_VERSION < 480
     msAcquireLock( TLOCK_PROJ );
-    tr_result = pj_transform( psPTInfo->psDstProj, psPTInfo->psSrcProj,
+#endif
+    tr_result = pj_transform( msGetThreadProjection(psPTInfo->psDstProjObj, psPTInfo->psSrcProjObj),
+                              msGetThreadProjection(psPTInfo->psSrcProjObj, psPTInfo->psDstProjObj),
                               nPoints, 1, x, y,  z);
+#if PJ_VERSION < 480
     msReleaseLock( TLOCK_PROJ );
+#endif
 
     if( tr_result != 0 ) {
       free( z );
@@ -969,6 +995,134 @@ static int msApproxTransformer( void *pCBData, int nPoints,
   return 1;
 }
 
+/************************************************************************/
+/* ==================================================================== */
+/*      Resampling of bands of output rows in several threads.          */
+/* ==================================================================== */
+/************************************************************************/
+
+typedef int (*RasterResampler)( imageObj *psSrcImage, rasterBufferObj *src_rb,
+                                imageObj *psDstImage, rasterBufferObj *dst_rb,
+                                int *panCMap,
+                                SimpleTransformer pfnTransform, void *pCBData,
+                                rasterBufferObj *mask_rb,
+                                int nDstYMin, int nDstYMax,
+                                int *pnFailedPoints, int *pnSetPoints );
+
+typedef struct {
+  RasterResampler pfnResampler;
+  imageObj *psSrcImage, *psDstImage;
+  rasterBufferObj *src_rb, *dst_rb, *mask_rb;
+  int *panCMap;
+  void *pTCBData, *pACBData; /* the transformers of this band */
+  int nDstYMin, nDstYMax;
+  int nFailedPoints, nSetPoints;
+} msResampleTaskObj;
+
+static void msResampleTask( void *pTask )
+
+{
+  msResampleTaskObj *psTask = (msResampleTaskObj *) pTask;
+
+  psTask->pfnResampler( psTask->psSrcImage, psTask->src_rb,
+                        psTask->psDstImage, psTask->dst_rb,
+                        psTask->panCMap,
+                        msApproxTransformer, psTask->pACBData,
+                        psTask->mask_rb,
+                        psTask->nDstYMin, psTask->nDstYMax,
+                        &(psTask->nFailedPoints), &(psTask->nSetPoints) );
+}
+
+/************************************************************************/
+/*                        msResampleRasterRows()                        */
+/*                                                                      */
+/*      Runs pfnResampler over all the rows of psDstImage.  With more   */
+/*      than one thread the rows are cut in bands, each with its own    */
+/*      transformers since the approximate one is not reentrant.        */
+/*      Bands start on multiples of 8 rows so that no two of them       */
+/*      share a byte of the raw data img_mask.  pACBData is used for    */
+/*      the first band.                                                 */
+/************************************************************************/
+
+#define RESAMPLE_BAND_ROWS_MIN 8
+
+static int msResampleRasterRows( const char *pszName, RasterResampler pfnResampler,
+                                 imageObj *psSrcImage, rasterBufferObj *src_rb,
+                                 imageObj *psDstImage, rasterBufferObj *dst_rb,
+                                 int *panCMap, void *pACBData,
+                                 projectionObj *psSrcProj, double *padfSrcGeoTransform,
+                                 projectionObj *psDstProj, double *padfDstGeoTransform,
+                                 int nThreads, int debug, rasterBufferObj *mask_rb )
+
+{
+  msResampleTaskObj *pasTasks;
+  void **papTasks;
+  int nBlocks, nTasks, i, nFailedPoints = 0, nSetPoints = 0;
+
+  nBlocks = (psDstImage->height + RESAMPLE_BAND_ROWS_MIN - 1) / RESAMPLE_BAND_ROWS_MIN;
+  nTasks = MS_MAX(1, MS_MIN(nThreads * 4, nBlocks));
+  if( nThreads <= 1 )
+    nTasks = 1;
+
+  pasTasks = (msResampleTaskObj *) msSmallCalloc(nTasks, sizeof(msResampleTaskObj));
+  papTasks = (void **) msSmallMalloc(nTasks * sizeof(void *));
+
+  for( i = 0; i < nTasks; i++ ) {
+    msResampleTaskObj *psTask = pasTasks + i;
+
+    psTask->pfnResampler = pfnResampler;
+    psTask->psSrcImage = psSrcImage;
+    psTask->src_rb = src_rb;
+    psTask->psDstImage = psDstImage;
+    psTask->dst_rb = dst_rb;
+    psTask->mask_rb = mask_rb;
+    psTask->panCMap = panCMap;
+    psTask->nDstYMin = MS_MIN(psDstImage->height,
+                              (int) ((long) nBlocks * i / nTasks) * RESAMPLE_BAND_ROWS_MIN);
+    psTask->nDstYMax = MS_MIN(psDstImage->height,
+                              (int) ((long) nBlocks * (i+1) / nTasks) * RESAMPLE_BAND_ROWS_MIN);
+
+    if( i == 0 )
+      psTask->pACBData = pACBData;
+    else {
+      /* the first transformer could be set up with the same arguments */
+      psTask->pTCBData = msInitProjTransformer( psSrcProj, padfSrcGeoTransform,
+                                                psDstProj, padfDstGeoTransform );
+      psTask->pACBData = msInitApproxTransformer( msProjTransformer, psTask->pTCBData, 0.333 );
+    }
+    papTasks[i] = psTask;
+  }
+
+  if( nTasks > 1 && debug >= MS_DEBUGLEVEL_V )
+    msDebug( "%s: resampling %d rows in %d bands, %d threads.\n",
+             pszName, psDstImage->height, nTasks, nThreads );
+
+  msThreadPoolRun( msResampleTask, papTasks, nTasks, nThreads );
+
+  for( i = 0; i < nTasks; i++ ) {
+    nFailedPoints += pasTasks[i].nFailedPoints;
+    nSetPoints += pasTasks[i].nSetPoints;
+    if( pasTasks[i].pTCBData ) {
+      msFreeApproxTransformer( pasTasks[i].pACBData );
+      msFreeProjTransformer( pasTasks[i].pTCBData );
+    }
+  }
+  free( pasTasks );
+  free( papTasks );
+  msFree( mask_rb );
+
+  /* -------------------------------------------------------------------- */
+  /*      Some debugging output.                                          */
+  /* -------------------------------------------------------------------- */
+  if( nFailedPoints > 0 && debug ) {
+    msDebug( "%s: "
+             "%d failed to transform, %d actually set.\n",
+             pszName, nFailedPoints, nSetPoints );
+  }
+
+  return 0;
+}
+
 /************************************************************************/
 /*                       msTransformMapToSource()                       */
 /*                                                                      */
@@ -1059,10 +1213,15 @@ static int msTransformMapToSource( int nDstXSize, int nDstYSize,
       }
     }
 
+#if PJ_VERSION < 480
     msAcquireLock( TLOCK_PROJ );
-    tr_result = pj_transform( psDstProj->proj, psSrcProj->proj,
+#endif
+    tr_result = pj_transform( msGetThreadProjection(psDstProj, psSrcProj),
+                              msGetThreadProjection(psSrcProj, psDstProj),
                               nSamples, 1, x, y, z );
+#if PJ_VERSION < 480
     msReleaseLock( TLOCK_PROJ );
+#endif
 
     if( tr_result != 0 )
       return MS_FALSE;
@@ -1148,6 +1307,41 @@ static int msTransformMapToSource( int nDstXSize, int nDstYSize,
 #endif /* def USE_PROJ */
 
 #ifdef USE_GDAL
+/************************************************************************/
+/*                     msResampleChooseOverview()                       */
+/*                                                                      */
+/*      Return the decimation factor of the coarsest overview of the    */
+/*      first band that is still at least as fine as the requested      */
+/*      one, or 1.0 if the full resolution data should be read.         */
+/************************************************************************/
+
+static double msResampleChooseOverview( GDALDatasetH hDS,
+                                        double dfDecimation )
+
+{
+  GDALRasterBandH hBand;
+  double dfBestFactor = 1.0;
+  int iOverview, nSrcXSize = GDALGetRasterXSize( hDS );
+
+  if( GDALGetRasterCount( hDS ) < 1 || dfDecimation <= 1.0 )
+    return 1.0;
+
+  hBand = GDALGetRasterBand( hDS, 1 );
+  for( iOverview = 0; iOverview < GDALGetOverviewCount( hBand ); iOverview++ ) {
+    GDALRasterBandH hOverview = GDALGetOverview( hBand, iOverview );
+    double dfFactor;
+
+    if( hOverview == NULL || GDALGetRasterBandXSize( hOverview ) < 1 )
+      continue;
+
+    dfFactor = (double) nSrcXSize / GDALGetRasterBandXSize( hOverview );
+    if( dfFactor <= dfDecimation * 1.001 && dfFactor > dfBestFactor )
+      dfBestFactor = dfFactor;
+  }
+
+  return dfBestFactor;
+}
+
 /************************************************************************/
 /*                        msResampleGDALToMap()                         */
 /************************************************************************/
@@ -1181,6 +1375,7 @@ int msResampleGDALToMap( mapObj *map, layerObj *layer, imageObj *image,
   double      dfOversampleRatio;
   rasterBufferObj src_rb, *psrc_rb = NULL, *mask_rb = NULL;
   int         bAddPixelMargin = MS_TRUE;
+  int         nThreads = 1;
 
 
   const char *resampleMode = CSLFetchNameValue( layer->processing,
@@ -1378,6 +1573,25 @@ int msResampleGDALToMap( mapObj *map, layerObj *layer, imageObj *image,
   else
     sDummyMap.cellsize = dfNominalCellSize;
 
+  /*
+  ** Pick the overview level ourselves from the scale of the map: when an
+  ** overview is coarser than the oversampled resolution but still at least
+  ** as fine as the map, load the window 1:1 from it rather than having
+  ** GDAL read a finer level and decimate it to our buffer.
+  */
+  if( sDummyMap.cellsize > dfNominalCellSize ) {
+    double dfOverviewFactor =
+      msResampleChooseOverview( hDS, dfOversampleRatio
+                                * sDummyMap.cellsize / dfNominalCellSize );
+
+    if( dfOverviewFactor * dfNominalCellSize > sDummyMap.cellsize ) {
+      if( layer->debug )
+        msDebug( "msResampleGDALToMap(): reading overview with decimation factor %g\n",
+                 dfOverviewFactor );
+      sDummyMap.cellsize = dfNominalCellSize * dfOverviewFactor;
+    }
+  }
+
   nLoadImgXSize = MS_MAX(1, (int) (sSrcExtent.maxx - sSrcExtent.minx)
                       * (dfNominalCellSize / sDummyMap.cellsize));
   nLoadImgYSize = MS_MAX(1, (int) (sSrcExtent.maxy - sSrcExtent.miny)
@@ -1529,23 +1743,33 @@ int msResampleGDALToMap( mapObj *map, layerObj *layer, imageObj *image,
   pACBData = msInitApproxTransformer( msProjTransformer, pTCBData, 0.333 );
 
   /* -------------------------------------------------------------------- */
-  /*      Perform the resampling.                                         */
+  /*      Perform the resampling, in several threads if map CONFIG        */
+  /*      "MS_DRAW_THREADS" allows it.                                    */
   /* -------------------------------------------------------------------- */
+  if( msGetConfigOption(map, "MS_DRAW_THREADS") )
+    nThreads = atoi(msGetConfigOption(map, "MS_DRAW_THREADS"));
+
   if( EQUAL(resampleMode,"AVERAGE") )
     result =
-      msAverageRasterResampler( srcImage, psrc_rb, image, rb,
-                                anCMap, msApproxTransformer, pACBData,
-                                layer->debug, mask_rb );
+      msResampleRasterRows( "msAverageRasterResampler", msAverageRasterResampler,
+                            srcImage, psrc_rb, image, rb, anCMap, pACBData,
+                            &(layer->projection), adfSrcGeoTransform,
+                            &(map->projection), adfDstGeoTransform,
+                            nThreads, layer->debug, mask_rb );
   else if( EQUAL(resampleMode,"BILINEAR") )
     result =
-      msBilinearRasterResampler( srcImage, psrc_rb, image, rb,
-                                 anCMap, msApproxTransformer, pACBData,
-                                 layer->debug, mask_rb );
+      msResampleRasterRows( "msBilinearRasterResampler", msBilinearRasterResampler,
+                            srcImage, psrc_rb, image, rb, anCMap, pACBData,
+                            &(layer->projection), adfSrcGeoTransform,
+                            &(map->projection), adfDstGeoTransform,
+                            nThreads, layer->debug, mask_rb );
   else
     result =
-      msNearestRasterResampler( srcImage, psrc_rb, image, rb,
-                                anCMap, msApproxTransformer, pACBData,
-                                layer->debug, mask_rb );
+      msResampleRasterRows( "msNearestRasterResampler", msNearestRasterResampler,
+                            srcImage, psrc_rb, image, rb, anCMap, pACBData,
+                            &(layer->projection), adfSrcGeoTransform,
+                            &(map->projection), adfDstGeoTransform,
+                            nThreads, layer->debug, mask_rb );
 
   /* -------------------------------------------------------------------- */
   /*      cleanup                                                         */
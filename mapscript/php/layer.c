@@ -412,6 +412,8 @@ PHP_METHOD(layerObj, __set)
                                                                                   } else {
                                                                                     mapscript_throw_exception("Property '%s' does not exist in this object." TSRMLS_CC, property);
                                                                                   }
+  if (php_layer->layer->map && (STRING_EQUAL("name", property) || STRING_EQUAL("group", property)))
+    msInvalidateLayerNameIndex(php_layer->layer->map);
 }
 
 /* {{{ proto int draw(imageObj image)
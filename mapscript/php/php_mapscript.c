@@ -714,13 +714,13 @@ PHP_FUNCTION(ms_ioGetStdoutBufferBytes)
   gdBuf.size = buf->data_offset;
   gdBuf.owns_data = MS_FALSE;
 
-  /* we are seizing ownership of the buffer contents */
-  buf->data_offset = 0;
-  buf->data_len = 0;
-  buf->data = NULL;
-
   php_write(gdBuf.data, gdBuf.size TSRMLS_CC);
 
+  /* empty the buffer, its memory is kept for reuse by msIO */
+  buf->data_offset = 0;
+  if( buf->data != NULL )
+    buf->data[0] = '\0';
+
   /* return the gdBuf.size, which is the "really used length" of the msIOBuffer */
   RETURN_LONG(gdBuf.size);
 }
@@ -446,3 +446,198 @@ def fromstring(data, mappath=None):
 }
 
 }
+
+/******************************************************************************
+ * Zero-copy views on point arrays and pixels
+ *
+ * The views are ctypes arrays laid over the MapServer memory, which numpy
+ * wraps without a copy (numpy.ctypeslib.as_array() or numpy.frombuffer()).
+ * A view keeps its owner alive but is only valid as long as the memory is
+ * not reallocated, i.e. until points are added to the line or the image is
+ * drawn to again.
+ *****************************************************************************/
+
+%extend lineObj {
+
+    /* address of the point array, number of points and doubles per point */
+    PyObject *_pointsAddress() {
+        return Py_BuildValue("(Nii)", PyLong_FromVoidPtr(self->point), self->numpoints,
+                             (int)(sizeof(pointObj)/sizeof(double)));
+    }
+
+%pythoncode {
+
+    def pointsBuffer(self):
+        """Returns a (numpoints, n) ctypes array of doubles over the points
+        of the line, the first two columns being x and y (the others m, or
+        z and m, as built). Changes to the array are changes to the line.
+
+        >>> import numpy
+        >>> xy = numpy.ctypeslib.as_array(line.pointsBuffer())[:, :2]
+        """
+        import ctypes
+        address, numpoints, ndoubles = self._pointsAddress()
+        t = ctypes.c_double * ndoubles * numpoints
+        if numpoints:
+            a = t.from_address(address)
+        else:
+            a = t()
+        a._owner = self
+        return a
+}
+
+}
+
+%extend imageObj {
+
+    /* address, width, height, row step, pixel step and r, g, b, a offsets
+       of the RGBA buffer of the image */
+    PyObject *_rasterBufferAddress() {
+        rasterBufferObj rb;
+
+        if (!MS_RENDERER_PLUGIN(self->format) || !self->format->vtable->supports_pixel_buffer) {
+            msSetError(MS_IMGERR, "Image renderer has no pixel buffer", "getRasterBuffer()");
+            return NULL;
+        }
+        if (self->format->vtable->getRasterBufferHandle(self, &rb) != MS_SUCCESS) {
+            msSetError(MS_IMGERR, "Failed to get the pixel buffer of the image", "getRasterBuffer()");
+            return NULL;
+        }
+        if (rb.type != MS_BUFFER_BYTE_RGBA) {
+            msSetError(MS_IMGERR, "Pixel buffer of the image is not RGBA", "getRasterBuffer()");
+            return NULL;
+        }
+        return Py_BuildValue("(Niiiiiiii)", PyLong_FromVoidPtr(rb.data.rgba.pixels),
+                             (int)rb.width, (int)rb.height,
+                             (int)rb.data.rgba.row_step, (int)rb.data.rgba.pixel_step,
+                             (int)(rb.data.rgba.r - rb.data.rgba.pixels),
+                             (int)(rb.data.rgba.g - rb.data.rgba.pixels),
+                             (int)(rb.data.rgba.b - rb.data.rgba.pixels),
+                             rb.data.rgba.a ? (int)(rb.data.rgba.a - rb.data.rgba.pixels) : -1);
+    }
+
+%pythoncode {
+
+    def getRasterBuffer(self):
+        """Returns a (height, width, pixel_step) ctypes array of unsigned
+        bytes over the pixels of the image, or (height, row_step) if rows
+        are padded. The channels attribute of the array maps 'r', 'g', 'b'
+        and 'a' to their byte offsets in a pixel ('a' absent if the image
+        has no alpha). AGG pixels are premultiplied by their alpha.
+
+        >>> import numpy
+        >>> buf = img.getRasterBuffer()
+        >>> red = numpy.ctypeslib.as_array(buf)[:, :, buf.channels['r']]
+        """
+        import ctypes
+        address, width, height, row_step, pixel_step, r, g, b, a = self._rasterBufferAddress()
+        if row_step == width * pixel_step:
+            t = ctypes.c_ubyte * pixel_step * width * height
+        else:
+            t = ctypes.c_ubyte * row_step * height
+        buf = t.from_address(address)
+        buf._owner = self
+        buf.channels = {'r': r, 'g': g, 'b': b}
+        if a >= 0:
+            buf.channels['a'] = a
+        return buf
+}
+
+}
+
+%extend layerObj {
+
+    /* Fetches up to maxshapes shapes of the current whichShapes() and packs
+       them: x and y doubles, first point of each ring (int32, plus the end),
+       first ring of each shape (int32, plus the end) and shape indexes
+       (C long, as shapeObj.index). Returns None when there are no more shapes. */
+    PyObject *_nextShapes(int maxshapes) {
+        shapeObj *shapes;
+        PyObject *xy, *ringstart, *shapestart, *index;
+        double *xyp;
+        ms_int32 *rsp, *ssp;
+        long *idxp;
+        int i, j, k, numshapes = 0, numrings = 0, numpoints = 0, status;
+
+        if (maxshapes < 1) maxshapes = MS_LAYER_BATCH_SIZE;
+
+        shapes = (shapeObj *) msSmallMalloc(sizeof(shapeObj) * maxshapes);
+        for (i = 0; i < maxshapes; i++) msInitShape(&shapes[i]);
+
+        status = msLayerNextShapes(self, shapes, maxshapes, &numshapes);
+        if (status != MS_SUCCESS) {
+            for (i = 0; i < maxshapes; i++) msFreeShape(&shapes[i]);
+            free(shapes);
+            if (status == MS_DONE) Py_RETURN_NONE;
+            return NULL;
+        }
+
+        for (i = 0; i < numshapes; i++) {
+            numrings += shapes[i].numlines;
+            for (j = 0; j < shapes[i].numlines; j++)
+                numpoints += shapes[i].line[j].numpoints;
+        }
+
+        xy = PyByteArray_FromStringAndSize(NULL, (Py_ssize_t)numpoints * 2 * sizeof(double));
+        ringstart = PyByteArray_FromStringAndSize(NULL, (Py_ssize_t)(numrings + 1) * sizeof(ms_int32));
+        shapestart = PyByteArray_FromStringAndSize(NULL, (Py_ssize_t)(numshapes + 1) * sizeof(ms_int32));
+        index = PyByteArray_FromStringAndSize(NULL, (Py_ssize_t)numshapes * sizeof(long));
+
+        if (xy && ringstart && shapestart && index) {
+            xyp = (double *) PyByteArray_AS_STRING(xy);
+            rsp = (ms_int32 *) PyByteArray_AS_STRING(ringstart);
+            ssp = (ms_int32 *) PyByteArray_AS_STRING(shapestart);
+            idxp = (long *) PyByteArray_AS_STRING(index);
+            numrings = numpoints = 0;
+            for (i = 0; i < numshapes; i++) {
+                ssp[i] = numrings;
+                idxp[i] = shapes[i].index;
+                for (j = 0; j < shapes[i].numlines; j++) {
+                    lineObj *line = &shapes[i].line[j];
+                    rsp[numrings++] = numpoints;
+                    for (k = 0; k < line->numpoints; k++) {
+                        *xyp++ = line->point[k].x;
+                        *xyp++ = line->point[k].y;
+                    }
+                    numpoints += line->numpoints;
+                }
+            }
+            ssp[numshapes] = numrings;
+            rsp[numrings] = numpoints;
+        }
+
+        for (i = 0; i < maxshapes; i++) msFreeShape(&shapes[i]);
+        free(shapes);
+
+        if (!xy || !ringstart || !shapestart || !index) {
+            Py_XDECREF(xy);
+            Py_XDECREF(ringstart);
+            Py_XDECREF(shapestart);
+            Py_XDECREF(index);
+            msSetError(MS_MEMERR, "Failed to allocate the shape arrays", "nextShapesArrays()");
+            return NULL;
+        }
+        return Py_BuildValue("(NNNN)", xy, ringstart, shapestart, index);
+    }
+
+%pythoncode {
+
+    def nextShapesArrays(self, maxshapes=64):
+        """Fetches up to maxshapes shapes of the current whichShapes() in
+        one layer call and returns them as flat arrays, or None once all
+        the shapes were read:
+
+        xy : bytearray of float64 pairs, the points of all the rings
+        ringstart : bytearray of int32, first point of each ring, then numpoints
+        shapestart : bytearray of int32, first ring of each shape, then numrings
+        index : bytearray of C long (numpy dtype 'l'), index of each shape
+
+        >>> import numpy
+        >>> xy, rings, parts, index = layer.nextShapesArrays()
+        >>> xy = numpy.frombuffer(xy, dtype=numpy.float64).reshape(-1, 2)
+        >>> rings = numpy.frombuffer(rings, dtype=numpy.int32)
+        """
+        return self._nextShapes(maxshapes)
+}
+
+}
@@ -135,6 +135,17 @@ class ImageObjTestCase(unittest.TestCase):
         assert imgobj.width == 439
         imgobj.save('testConstructorUrlStream.jpg')
 
+class ImageRasterBufferTestCase(MapTestCase):
+
+    def testGetRasterBuffer(self):
+        """the raster buffer of a PNG24 image spans all its pixels"""
+        self.map.selectOutputFormat('PNG24')
+        msimg = self.map.draw()
+        buf = msimg.getRasterBuffer()
+        assert len(buf) == msimg.height
+        assert len(buf[0]) == msimg.width
+        assert 'r' in buf.channels and 'g' in buf.channels and 'b' in buf.channels
+
 class ImageWriteTestCase(MapTestCase):
 
     def testImageWrite(self):
@@ -70,5 +70,13 @@ class LineObjTestCase(MapPrimitivesTestCase):
         """numpoints is immutable, this should raise error"""
         self.assertRaises(AttributeError, setattr, self.line, 'numpoints', 3)
 
+    def testPointsBuffer(self):
+        """the points buffer is a view on the points of the line"""
+        buf = self.line.pointsBuffer()
+        assert len(buf) == 2
+        assert (buf[1][0], buf[1][1]) == (2.0, 3.0)
+        buf[0][0] = 10.0
+        assert self.getPointFromLine(self.line, 0).x == 10.0
+
 if __name__ == '__main__':
     unittest.main()
@@ -131,6 +131,7 @@
   layerObj *getLayerByName(char *name) {
     int i;
 
+    msInvalidateLayerNameIndex(self); /* layer names may have been set from script */
     i = msGetLayerIndex(self, name);
 
     if(i != -1) {
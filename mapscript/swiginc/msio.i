@@ -88,6 +88,14 @@ gdBuffer msIO_getStdoutBufferBytes() {
 
     buf = (msIOBuffer *) ctx->cbData;
 
+    /* the caller will free() the data, so it must start its allocation */
+    if( buf->data_skip > 0 ) {
+        memmove( buf->data - buf->data_skip, buf->data, buf->data_offset );
+        buf->data -= buf->data_skip;
+        buf->data_len += buf->data_skip;
+        buf->data_skip = 0;
+    }
+
     gdBuf.data = buf->data;
     gdBuf.size = buf->data_offset;
     gdBuf.owns_data = MS_TRUE;
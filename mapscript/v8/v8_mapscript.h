@@ -66,6 +66,31 @@ public:
 
 #define V8CONTEXT(map) ((V8Context*) (map)->v8context)
 
+/* A compiled script not bound to a context, with the modification time of
+   its file when compiled. */
+class V8CachedScript
+{
+public:
+  V8CachedScript()
+    : mtime(0) {}
+  time_t mtime;
+  Persistent<Script> script;
+};
+
+/* Data of an isolate (Isolate::SetData()), it lives as long as the isolate
+   so the scripts compiled stay available to the contexts of the maps that
+   come next. */
+class V8IsolateData
+{
+public:
+  V8IsolateData()
+    : context(NULL) {}
+  V8Context *context; /* context created or used last, used in geomtransform */
+  map<string, V8CachedScript> scripts; /* by full path */
+};
+
+#define V8ISOLATEDATA(isolate) ((V8IsolateData*) (isolate)->GetData())
+
 inline void NODE_SET_PROTOTYPE_METHOD(v8::Handle<v8::FunctionTemplate> recv,
                                       const char* name,
                                       v8::FunctionCallback callback) {
@@ -281,6 +281,50 @@ int msIntersectPolylinePolygon(shapeObj *line, shapeObj *poly)
   return(MS_FALSE);
 }
 
+/*
+** Does the rectangle touch the polygon? Used to test bounding boxes against a
+** search area.
+*/
+int msIntersectRectPolygon(rectObj *rect, shapeObj *poly)
+{
+  int i, j;
+  pointObj corners[5];
+
+  if(msRectOverlap(rect, &(poly->bounds)) != MS_TRUE)
+    return(MS_FALSE);
+
+  /* STEP 1: a vertex of the polygon is in the rectangle */
+  for(i=0; i<poly->numlines; i++) {
+    for(j=0; j<poly->line[i].numpoints; j++) {
+      pointObj *p = &(poly->line[i].point[j]);
+      if(p->x >= rect->minx && p->x <= rect->maxx && p->y >= rect->miny && p->y <= rect->maxy)
+        return(MS_TRUE);
+    }
+  }
+
+  /* STEP 2: the rectangle is in the polygon (only need to check one point) */
+  memset(corners, 0, sizeof(corners));
+  corners[0].x = corners[3].x = corners[4].x = rect->minx;
+  corners[1].x = corners[2].x = rect->maxx;
+  corners[0].y = corners[1].y = corners[4].y = rect->miny;
+  corners[2].y = corners[3].y = rect->maxy;
+  if(msIntersectPointPolygon(&corners[0], poly) == MS_TRUE)
+    return(MS_TRUE);
+
+  /* STEP 3: look for intersecting edges */
+  for(i=0; i<poly->numlines; i++) {
+    for(j=1; j<poly->line[i].numpoints; j++) {
+      int k;
+      for(k=1; k<5; k++) {
+        if(msIntersectSegments(&(poly->line[i].point[j-1]), &(poly->line[i].point[j]), &corners[k-1], &corners[k]) == MS_TRUE)
+          return(MS_TRUE);
+      }
+    }
+  }
+
+  return(MS_FALSE);
+}
+
 int msIntersectPolygons(shapeObj *p1, shapeObj *p2)
 {
   int i;
@@ -519,6 +563,67 @@ double msSquareDistancePointToShape(pointObj *point, shapeObj *shape)
   return(minDist);
 }
 
+/*
+** As msDistancePointToShape() for the shapes within tolerance of the point,
+** returns -1 for the others. Used by point queries: segments (and points)
+** whose bounding box is farther than the closest distance found so far are
+** skipped without computing their distance, so that large shapes near the
+** point only cost a comparison per vertex.
+*/
+double msDistancePointToShapeWithin(pointObj *point, shapeObj *shape, double tolerance)
+{
+  int i, j;
+  double dist, minDist = tolerance*tolerance, limit = tolerance;
+  int found = MS_FALSE;
+
+  if(tolerance < 0)
+    return(-1);
+
+  switch(shape->type) {
+    case(MS_SHAPE_POINT):
+      for(j=0; j<shape->numlines; j++) {
+        for(i=0; i<shape->line[j].numpoints; i++) {
+          pointObj *p = &(shape->line[j].point[i]);
+          if(fabs(p->x - point->x) > limit || fabs(p->y - point->y) > limit)
+            continue;
+          dist = msSquareDistancePointToPoint(point, p);
+          if(dist <= minDist) {
+            minDist = dist;
+            limit = sqrt(dist);
+            found = MS_TRUE;
+          }
+        }
+      }
+      break;
+    case(MS_SHAPE_POLYGON):
+      if(msIntersectPointPolygon(point, shape))
+        return(0); /* point is IN the shape */
+      /* fall through - the shape is then treated just like a line */
+    case(MS_SHAPE_LINE):
+      for(j=0; j<shape->numlines; j++) {
+        for(i=1; i<shape->line[j].numpoints; i++) {
+          pointObj *a = &(shape->line[j].point[i-1]), *b = &(shape->line[j].point[i]);
+          if((a->x < point->x - limit && b->x < point->x - limit) ||
+              (a->x > point->x + limit && b->x > point->x + limit) ||
+              (a->y < point->y - limit && b->y < point->y - limit) ||
+              (a->y > point->y + limit && b->y > point->y + limit))
+            continue;
+          dist = msSquareDistancePointToSegment(point, a, b);
+          if(dist <= minDist) {
+            minDist = dist;
+            limit = sqrt(dist);
+            found = MS_TRUE;
+          }
+        }
+      }
+      break;
+    default:
+      break;
+  }
+
+  return(found ? sqrt(minDist) : -1);
+}
+
 double msDistanceShapeToShape(shapeObj *shape1, shapeObj *shape2)
 {
   int i,j,k,l;
@@ -130,6 +130,375 @@ static int msIO_installFastCGIRedirect()
 }
 
 #endif
+
+/************************************************************************/
+/*                       msProcessRequestParam()                        */
+/*                                                                      */
+/*      Returns the value of the named request parameter, or NULL.      */
+/************************************************************************/
+static const char *msProcessRequestParam(mapservObj *mapserv, const char *name)
+{
+  int i;
+
+  for(i=0; i<mapserv->request->NumParams; i++) {
+    if(strcasecmp(mapserv->request->ParamNames[i], name) == 0)
+      return mapserv->request->ParamValues[i];
+  }
+  return NULL;
+}
+
+/************************************************************************/
+/*                       msProcessRequestMetrics()                      */
+/*                                                                      */
+/*      Adds up the request to the process metrics (see mapmetrics.c)   */
+/*      and logs it if it was slow.                                     */
+/************************************************************************/
+static void msProcessRequestMetrics(mapservObj *mapserv, double start, int failed)
+{
+  const char *service, *request;
+  double seconds = msStatsElapsed(&start);
+
+  if((service = msProcessRequestParam(mapserv, "SERVICE")) != NULL) {
+    if((request = msProcessRequestParam(mapserv, "REQUEST")) == NULL)
+      request = "unknown";
+  } else {
+    service = "mapserv";
+    if((request = msProcessRequestParam(mapserv, "MODE")) == NULL)
+      request = "browse";
+  }
+
+  if(msMetricsEnabled()) {
+    msMetricsObserveRequest(mapserv->map, service, request, seconds, failed);
+    msMetricsWriteFile();
+  }
+  msSlowLogRequest(mapserv->map, mapserv->request->ParamNames, mapserv->request->ParamValues,
+                   MS_MAX(mapserv->request->NumParams, 0), service, request, seconds, failed);
+}
+
+/************************************************************************/
+/*                          msProcessRequest()                          */
+/*                                                                      */
+/*      Handles one request, reading its parameters through the msIO    */
+/*      handlers and request environment of the calling thread.         */
+/************************************************************************/
+static void msProcessRequest( int sendheaders )
+{
+  struct mstimeval requeststarttime, requestendtime;
+  mapservObj* mapserv = NULL;
+  double loadstart;
+  int failed = MS_TRUE, span;
+
+  mapserv = msAllocMapServObj();
+  mapserv->sendheaders = sendheaders; /* override the default if necessary (via command line -nh switch) */
+  loadstart = msStatsNow();
+  msTraceStart(msIO_getenv("HTTP_TRACEPARENT"), "mapserv");
+  msSlowLogStart();
+
+  mapserv->request->NumParams = loadParams(mapserv->request, NULL, NULL, 0, NULL);
+  if( mapserv->request->NumParams == -1 ) {
+    msCGIWriteError(mapserv);
+    goto end_request;
+  }
+
+  if(msMetricsEnabled()) {
+    const char *mode = msProcessRequestParam(mapserv, "MODE");
+
+    if(mode && strcasecmp(mode, "metrics") == 0) {
+      char *text = msMetricsToText();
+      msIO_setHeader("Content-Type", "text/plain; version=0.0.4");
+      msIO_sendHeaders();
+      msIO_printf("%s", text);
+      msFree(text);
+      msFreeMapServObj(mapserv);
+      msIO_setRequestDeadline(0, MS_FALSE);
+      msTraceEnd(MS_SUCCESS);
+      return;
+    }
+  }
+
+  span = msTraceSpanBegin("msCGILoadMap", MS_TRACE_INTERNAL);
+  mapserv->map = msCGILoadMap(mapserv);
+  msTraceSpanEnd(span, mapserv->map ? MS_SUCCESS : MS_FAILURE);
+  if(!mapserv->map) {
+    msCGIWriteError(mapserv);
+    goto end_request;
+  }
+  msStatsCreate(mapserv->map, loadstart);
+
+  if( mapserv->map->debug >= MS_DEBUGLEVEL_TUNING)
+    msGettimeofday(&requeststarttime, NULL);
+
+#ifdef USE_FASTCGI
+  if( mapserv->map->debug ) {
+    static int nRequestCounter = 1;
+
+    msDebug( "CGI Request %d on process %d\n", nRequestCounter, getpid() );
+    nRequestCounter++;
+  }
+#endif
+
+  span = msTraceSpanBegin("msCGIDispatchRequest", MS_TRACE_INTERNAL);
+  if(msCGIDispatchRequest(mapserv) != MS_SUCCESS) {
+    msTraceSpanEnd(span, MS_FAILURE);
+    msCGIWriteError(mapserv);
+    goto end_request;
+  }
+  msTraceSpanEnd(span, MS_SUCCESS);
+  failed = MS_FALSE;
+
+end_request:
+  if(mapserv->map && mapserv->map->debug >= MS_DEBUGLEVEL_TUNING) {
+    msGettimeofday(&requestendtime, NULL);
+    msDebug("mapserv request processing time (msLoadMap not incl.): %.3fs\n",
+            (requestendtime.tv_sec+requestendtime.tv_usec/1.0e6)-
+            (requeststarttime.tv_sec+requeststarttime.tv_usec/1.0e6) );
+    msDebug("mapserv request memory peak: %.1fMB\n", msIO_getRequestMemoryPeak(NULL) / (1024.0 * 1024.0));
+  }
+  msCGIWriteLog(mapserv,MS_FALSE);
+  if(msMetricsEnabled() || msSlowLogEnabled())
+    msProcessRequestMetrics(mapserv, loadstart, failed);
+  msFreeMapServObj(mapserv);
+  msIO_setRequestDeadline(0, MS_FALSE);
+  msIO_setRequestMemoryLimit(0);
+  msTraceEnd(failed ? MS_FAILURE : MS_SUCCESS);
+}
+
+#if defined(USE_FASTCGI) && defined(USE_THREAD) && !defined(_WIN32)
+#include <pthread.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+/************************************************************************/
+/*                         Threaded FastCGI                             */
+/*                                                                      */
+/*      With MS_FCGI_THREADS set, requests are accepted by a number of   */
+/*      worker threads through the reentrant FCGX_ API instead of the   */
+/*      fcgi_stdio loop, so that fonts, projections, connection pools   */
+/*      and cached maps (MS_MAP_CACHE) are shared by all of them. Each  */
+/*      thread redirects its msIO handlers and request environment to   */
+/*      the FCGX_Request it is serving.                                 */
+/************************************************************************/
+
+#define MS_FCGI_THREADS_MAX 256
+
+static pthread_mutex_t fcgi_accept_lock = PTHREAD_MUTEX_INITIALIZER;
+static int fcgi_sendheaders = MS_TRUE;
+
+static int msIO_fcgxRead( void *cbData, void *data, int byteCount )
+
+{
+  return FCGX_GetStr( (char *) data, byteCount, (FCGX_Stream *) cbData );
+}
+
+static int msIO_fcgxWrite( void *cbData, void *data, int byteCount )
+
+{
+  return FCGX_PutStr( (const char *) data, byteCount, (FCGX_Stream *) cbData );
+}
+
+/* cancel callback: the web server closed the connection, the client went away */
+static int msFCGIClientGone( void *cbData )
+
+{
+  FCGX_Request *request = (FCGX_Request *) cbData;
+  struct pollfd pfd;
+  char c;
+
+  pfd.fd = request->ipcFd;
+  pfd.events = POLLIN;
+  pfd.revents = 0;
+  if( poll( &pfd, 1, 0 ) <= 0 )
+    return MS_FALSE;
+  if( pfd.revents & (POLLHUP | POLLERR) )
+    return MS_TRUE;
+  return (pfd.revents & POLLIN) && recv( request->ipcFd, &c, 1, MSG_PEEK ) == 0;
+}
+
+static void *msFCGIThreadMain( void *unused )
+
+{
+  FCGX_Request request;
+  msIOContext stdin_ctx, stdout_ctx, stderr_ctx;
+
+  if( FCGX_InitRequest( &request, 0, 0 ) != 0 )
+    return NULL;
+
+  stdin_ctx.label = "fcgi";
+  stdin_ctx.write_channel = MS_FALSE;
+  stdin_ctx.readWriteFunc = msIO_fcgxRead;
+
+  stdout_ctx.label = "fcgi";
+  stdout_ctx.write_channel = MS_TRUE;
+  stdout_ctx.readWriteFunc = msIO_fcgxWrite;
+
+  stderr_ctx.label = "fcgi";
+  stderr_ctx.write_channel = MS_TRUE;
+  stderr_ctx.readWriteFunc = msIO_fcgxWrite;
+
+  /* font faces are cached per thread */
+  msCGIWarmup();
+
+  for( ;; ) {
+    int rc;
+
+    /* some platforms need accept() serialized between threads */
+    pthread_mutex_lock( &fcgi_accept_lock );
+    rc = FCGX_Accept_r( &request );
+    pthread_mutex_unlock( &fcgi_accept_lock );
+    if( rc < 0 )
+      break;
+
+    stdin_ctx.cbData = (void *) request.in;
+    stdout_ctx.cbData = (void *) request.out;
+    stderr_ctx.cbData = (void *) request.err;
+    msIO_installHandlers( &stdin_ctx, &stdout_ctx, &stderr_ctx );
+    msIO_setRequestEnv( request.envp );
+    msIO_setRequestCancel( msFCGIClientGone, &request );
+
+    msProcessRequest( fcgi_sendheaders );
+    msResetErrorList();
+
+    msIO_setRequestCancel( NULL, NULL );
+    msIO_setRequestEnv( NULL );
+    FCGX_Finish_r( &request );
+  }
+
+  msIO_installHandlers( NULL, NULL, NULL );
+  FCGX_Free( &request, 1 );
+
+  return NULL;
+}
+
+/************************************************************************/
+/*                          msFCGIRunThreads()                          */
+/*                                                                      */
+/*      Serves requests on numthreads threads until accepting fails.    */
+/************************************************************************/
+
+static void msFCGIRunThreads( int numthreads, int sendheaders )
+
+{
+  pthread_t threads[MS_FCGI_THREADS_MAX];
+  int i, started = 0;
+
+  if( FCGX_Init() != 0 ) {
+    msIO_fprintf( stderr, "FCGX_Init() failed.\n" );
+    return;
+  }
+
+  fcgi_sendheaders = sendheaders;
+  numthreads = MS_MIN( numthreads, MS_FCGI_THREADS_MAX );
+
+  for( i = 0; i < numthreads; i++ ) {
+    if( pthread_create( &threads[started], NULL, msFCGIThreadMain, NULL ) != 0 )
+      break;
+    started++;
+  }
+
+  for( i = 0; i < started; i++ )
+    pthread_join( threads[i], NULL );
+}
+#endif
+
+#if defined(USE_FASTCGI) && !defined(WIN32)
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <errno.h>
+
+/************************************************************************/
+/*                            msFCGIPrefork()                           */
+/*                                                                      */
+/*      With MS_FCGI_PROCESSES set, this process warms up and then      */
+/*      forks the workers accepting on the inherited FastCGI socket,    */
+/*      which share what was loaded (cached maps with MS_MAP_CACHE,     */
+/*      preloaded shapefiles, in memory indexes, fonts, symbols)        */
+/*      copy-on-write instead of each building its own. The master      */
+/*      replaces the workers that exit and passes SIGTERM on to them.   */
+/*      Only returns in the workers.                                    */
+/************************************************************************/
+
+#define MS_FCGI_PROCESSES_MAX 1024
+
+static volatile sig_atomic_t fcgi_master_stop = 0;
+static int fcgi_preforked = MS_FALSE;
+
+static void msFCGIMasterSignal( int nInData )
+
+{
+  fcgi_master_stop = 1;
+}
+
+static void msFCGIPrefork( int numprocs )
+
+{
+  pid_t workers[MS_FCGI_PROCESSES_MAX];
+  time_t started[MS_FCGI_PROCESSES_MAX];
+  struct sigaction action;
+  int i;
+
+  numprocs = MS_MIN( numprocs, MS_FCGI_PROCESSES_MAX );
+
+  msCGIWarmup();
+  msPrepareFork();
+
+  /* no SA_RESTART, so that wait() returns on a signal */
+  memset( &action, 0, sizeof(action) );
+  action.sa_handler = msFCGIMasterSignal;
+  sigemptyset( &action.sa_mask );
+  sigaction( SIGTERM, &action, NULL );
+  sigaction( SIGUSR1, &action, NULL );
+
+  for( i = 0; i < numprocs; i++ )
+    workers[i] = 0;
+
+  while( !fcgi_master_stop ) {
+    pid_t pid;
+
+    for( i = 0; i < numprocs && !fcgi_master_stop; i++ ) {
+      if( workers[i] > 0 )
+        continue;
+      pid = fork();
+      if( pid == 0 ) {
+        signal( SIGUSR1, msCleanupOnSignal );
+        signal( SIGTERM, msCleanupOnSignal );
+        fcgi_preforked = MS_TRUE;
+        return;
+      }
+      if( pid < 0 ) {
+        msIO_fprintf( stderr, "msFCGIPrefork(): fork() failed.\n" );
+        break;
+      }
+      workers[i] = pid;
+      started[i] = time( NULL );
+    }
+
+    pid = wait( NULL );
+    if( pid < 0 ) {
+      if( errno != EINTR )
+        sleep( 1 ); /* no worker could be started */
+      continue;
+    }
+    for( i = 0; i < numprocs; i++ ) {
+      if( workers[i] == pid ) {
+        workers[i] = 0;
+        if( time( NULL ) - started[i] < 1 )
+          sleep( 1 ); /* don't spin on a worker that dies at startup */
+      }
+    }
+  }
+
+  for( i = 0; i < numprocs; i++ ) {
+    if( workers[i] > 0 )
+      kill( workers[i], SIGTERM );
+  }
+  while( wait( NULL ) > 0 || errno == EINTR )
+    ;
+
+  msCleanup();
+  exit( 0 );
+}
+#endif
+
 /************************************************************************/
 /*                                main()                                */
 /************************************************************************/
@@ -138,7 +507,6 @@ int main(int argc, char *argv[])
   int iArg;
   int sendheaders = MS_TRUE;
   struct mstimeval execstarttime, execendtime;
-  struct mstimeval requeststarttime, requestendtime;
   mapservObj* mapserv = NULL;
 
   /* -------------------------------------------------------------------- */
@@ -231,67 +599,36 @@ int main(int argc, char *argv[])
   signal( SIGTERM, msCleanupOnSignal );
 #endif
 
+#if defined(USE_FASTCGI) && !defined(WIN32)
+  /* MS_FCGI_PROCESSES=n forks n workers sharing what this process loads */
+  if( getenv("MS_FCGI_PROCESSES") && atoi(getenv("MS_FCGI_PROCESSES")) > 1 && !FCGX_IsCGI() )
+    msFCGIPrefork( atoi(getenv("MS_FCGI_PROCESSES")) );
+#endif
+
+#if defined(USE_FASTCGI) && defined(USE_THREAD) && !defined(_WIN32)
+  /* MS_FCGI_THREADS=n serves requests from n threads sharing this process */
+  if( getenv("MS_FCGI_THREADS") && atoi(getenv("MS_FCGI_THREADS")) > 1 ) {
+    msFCGIRunThreads( atoi(getenv("MS_FCGI_THREADS")), sendheaders );
+    msCleanup();
+    exit( 0 );
+  }
+#endif
+
 #ifdef USE_FASTCGI
   msIO_installFastCGIRedirect();
+#ifndef WIN32
+  if( !fcgi_preforked )
+#endif
+    msCGIWarmup();
 
   /* In FastCGI case we loop accepting multiple requests.  In normal CGI */
   /* use we only accept and process one request.  */
   while( FCGI_Accept() >= 0 ) {
-#endif /* def USE_FASTCGI */
-
-    /* -------------------------------------------------------------------- */
-    /*      Process a request.                                              */
-    /* -------------------------------------------------------------------- */
-    mapserv = msAllocMapServObj();
-    mapserv->sendheaders = sendheaders; /* override the default if necessary (via command line -nh switch) */
-
-    mapserv->request->NumParams = loadParams(mapserv->request, NULL, NULL, 0, NULL);
-    if( mapserv->request->NumParams == -1 ) {
-      msCGIWriteError(mapserv);
-      goto end_request;
-    }
-
-    mapserv->map = msCGILoadMap(mapserv);
-    if(!mapserv->map) {
-      msCGIWriteError(mapserv);
-      goto end_request;
-    }
-
-    if( mapserv->map->debug >= MS_DEBUGLEVEL_TUNING)
-      msGettimeofday(&requeststarttime, NULL);
-
-#ifdef USE_FASTCGI
-    if( mapserv->map->debug ) {
-      static int nRequestCounter = 1;
-
-      msDebug( "CGI Request %d on process %d\n", nRequestCounter, getpid() );
-      nRequestCounter++;
-    }
-#endif
-
-
-
-
-    if(msCGIDispatchRequest(mapserv) != MS_SUCCESS) {
-      msCGIWriteError(mapserv);
-      goto end_request;
-    }
-
-
-end_request:
-    if(mapserv->map && mapserv->map->debug >= MS_DEBUGLEVEL_TUNING) {
-      msGettimeofday(&requestendtime, NULL);
-      msDebug("mapserv request processing time (msLoadMap not incl.): %.3fs\n",
-              (requestendtime.tv_sec+requestendtime.tv_usec/1.0e6)-
-              (requeststarttime.tv_sec+requeststarttime.tv_usec/1.0e6) );
-    }
-    msCGIWriteLog(mapserv,MS_FALSE);
-    msFreeMapServObj(mapserv);
-#ifdef USE_FASTCGI
-    /* FCGI_ --- return to top of loop */
+    msProcessRequest( sendheaders );
     msResetErrorList();
-    continue;
   } /* end fastcgi loop */
+#else
+  msProcessRequest( sendheaders );
 #endif
 
   /* normal case, processing is complete */
@@ -55,6 +55,7 @@
 MS_DLL_EXPORT int msCGIWriteLog(mapservObj *mapserv, int show_error);
 MS_DLL_EXPORT void msCGIWriteError(mapservObj *mapserv);
 MS_DLL_EXPORT mapObj *msCGILoadMap(mapservObj *mapserv);
+MS_DLL_EXPORT void msCGIWarmup(void);
 int msCGISetMode(mapservObj *mapserv);
 int msCGILoadForm(mapservObj *mapserv);
 int msCGIDispatchBrowseRequest(mapservObj *mapserv);
@@ -28,6 +28,34 @@ classObj* umnms_new_class(layerObj *layer);
 styleObj* umnms_new_style(classObj *theclass);
 labelObj* umnms_new_label(classObj *theclass);
 
+/*
+** Request handling for servers embedding mapserver. The request context
+** carries everything about the request, so calls on different threads
+** don't share any state. The response is the CGI output of mapserv,
+** headers included.
+*/
+typedef int (*umnms_write_func)(void *user_data, const void *data, int length); /* returns length, or -1 to abort */
+typedef int (*umnms_cancel_func)(void *user_data); /* returns non zero to abort */
+
+typedef struct umnms_request {
+  /* input */
+  const char *query_string;  /* GET parameters, or the query string of a POST */
+  const char *post_body;     /* POST body, NULL for a GET request */
+  unsigned int post_length;
+  const char *content_type;  /* of the POST body */
+  char **envp;               /* optional NULL terminated NAME=value CGI environment (SERVER_NAME, MS_MAPFILE, ...) */
+
+  umnms_write_func write;    /* output sink, the response is returned in body when NULL */
+  umnms_cancel_func cancel;  /* polled while drawing, may be NULL */
+  void *user_data;           /* passed to write and cancel */
+
+  /* output, body is to be released with free() */
+  void *body;
+  unsigned int body_length;
+} umnms_request;
+
+int umnms_handle_request(umnms_request *request);
+
 
 
 
@@ -237,11 +237,17 @@ extern "C" {
 #define MS_TEMPLATE_EXPR "\\.(xml|wml|html|htm|svg|kml|gml|js|tmpl)$"
 
 #define MS_INDEX_EXTENSION ".qix"
+#define MS_ATTRIBUTE_INDEX_EXTENSION ".aix"
 
 #define MS_QUERY_RESULTS_MAGIC_STRING "MapServer Query Results"
+#define MS_QUERY_RESULTS_BINARY_MAGIC_STRING "MapServer Binary Query Results"
+#define MS_QUERY_RESULTS_VERSION 1
 #define MS_QUERY_PARAMS_MAGIC_STRING "MapServer Query Params"
 #define MS_QUERY_EXTENSION ".qy"
 
+#define MS_COMPILED_MAP_MAGIC_STRING "MapServer Compiled Mapfile"
+#define MS_COMPILED_MAP_VERSION 1
+
 #define MS_DEG_TO_RAD .0174532925199432958
 #define MS_RAD_TO_DEG   57.29577951
 
@@ -396,6 +402,7 @@ extern "C" {
 #define MS_RENDER_WITH_AGG 105
 #define MS_RENDER_WITH_KML 106
 #define MS_RENDER_WITH_UTFGRID 107
+#define MS_RENDER_WITH_MVT 108
 
 #ifndef SWIG
 
@@ -741,6 +748,9 @@ extern "C" {
 
   typedef tokenListNodeObj * tokenListNodeObjPtr;
 
+  typedef struct expressionProgramObj expressionProgramObj; /* see mapexpression.c */
+  typedef struct regexMemoObj regexMemoObj; /* see maputil.c */
+
   typedef struct {
     char *string;
     int type;
@@ -751,10 +761,12 @@ extern "C" {
     /* logical expression options */
     tokenListNodeObjPtr tokens;
     tokenListNodeObjPtr curtoken;
+    expressionProgramObj *program; /* tokens compiled for msEvalParsedExpression(), NULL to use yyparse() */
 
     /* regular expression options */
     ms_regex_t regex; /* compiled regular expression to be matched */
     int compiled;
+    regexMemoObj *regexmemo; /* match results of the values seen so far, see msEvalExpression() */
 
     char *native_string; /* RFC 91 */
   } expressionObj;
@@ -768,6 +780,14 @@ extern "C" {
     int type; /* type of parse: boolean, string/text or shape/geometry */
     parseResultObj result; /* parse result */
   } parseObj;
+
+  /* see msEvalExpressionBatch() */
+  typedef struct {
+    shapeObj *shapes;
+    int numshapes;
+    double **numbers; /* numeric item values per item index, converted on demand */
+    int numitems;
+  } expressionBatchObj;
 #endif
 
   /* MS RFC 69*/
@@ -875,6 +895,12 @@ extern "C" {
     int  maxfeatures; /* global maxfeatures */    
     int  startindex;
     int  only_cache_result_count; /* set to 1 sometimes by WFS 2.0 GetFeature request */
+
+    /* when set, msQueryByRect() and msQueryByFilter() only count the results and */
+    /* pass each matching shape (in the map projection) to shapefunc instead of caching it, */
+    /* an error it returns ends the query (used to stream WFS GetFeature responses) */
+    int (*shapefunc)(struct layerObj *layer, shapeObj *shape, void *data);
+    void *shapefuncdata;
     
     expressionObj filter; /* by filter */
     char *filteritem;
@@ -1258,6 +1284,9 @@ extern "C" {
     int markerid; /* corresponding marker (POINT layers only) */
     lineObj *leaderline;
     rectObj *leaderbbox;
+
+    long shapeindex; /* source feature, -1 if unknown. Used to key the label placement cache */
+    int tileindex;
   } labelCacheMemberObj;
 
   /************************************************************************/
@@ -1280,6 +1309,72 @@ extern "C" {
     int markercachesize;
   } labelCacheSlotObj;
 
+#ifndef SWIG
+  /************************************************************************/
+  /*                          labelCacheGridObj                           */
+  /************************************************************************/
+  /* uniform grid over the image indexing rendered labels and markers, so  */
+  /* that collision tests only look at the ones nearby (see maplabel.c)    */
+  typedef struct {
+    int *items;
+    int numitems;
+    int maxitems;
+  } labelCacheGridCellObj;
+
+  typedef struct {
+    int width, height; /* in cells */
+    labelCacheGridCellObj *members; /* indexes in rendered_text_symbols */
+    labelCacheGridCellObj *markers; /* marker index * MS_MAX_LABEL_PRIORITY + priority */
+    int nummarkers[MS_MAX_LABEL_PRIORITY]; /* markers of each slot already indexed */
+    unsigned int *stamps; /* last leader query that tested each rendered label */
+    int numstamps;
+    unsigned int stamp;
+  } labelCacheGridObj;
+
+  /* bump allocator for the memory owned by the label cache members (their */
+  /* textsymbol arrays and leader lines), released in one go between draws */
+  typedef struct labelCacheArenaChunkObj {
+    struct labelCacheArenaChunkObj *next;
+    size_t size; /* usable bytes following the header */
+    size_t used;
+  } labelCacheArenaChunkObj;
+
+  /* per layer label engine counters and timings, gathered by msDrawLabelCache() */
+  /* at MS_DEBUGLEVEL_TUNING and reported through msDebug()                      */
+  typedef struct {
+    int candidates; /* label cache members */
+    int placed;
+    int collided; /* rejected by collision tests (marker, label point, text) */
+    int mindistance; /* rejected by msCheckLabelMinDistance() */
+    int leadertests; /* offsetAndTest() calls */
+    int leaderplaced;
+    double shaping, placement, rendering; /* seconds */
+  } labelCacheStatsObj;
+
+  /* stages timed by the map statistics, see msStatsCreate() */
+  enum MS_STATS_STAGE { MS_STATS_LOAD, MS_STATS_OPEN, MS_STATS_WHICHSHAPES, MS_STATS_NEXTSHAPE, MS_STATS_CLASSIFY,
+                        MS_STATS_PROJECT, MS_STATS_RENDER, MS_STATS_LABELCACHE, MS_STATS_ENCODE, MS_STATS_NUMSTAGES
+                      };
+
+  enum MS_STATS_OUTPUT { MS_STATS_LOG=1, MS_STATS_HEADER=2 };
+
+  /* per layer timings (seconds) and counters */
+  typedef struct {
+    double seconds[MS_STATS_NUMSTAGES];
+    double total; /* msDrawLayer() and msDrawQueryLayer() calls, all stages included */
+    int read; /* features read from the data source */
+    int drawn;
+    long vertices; /* of the features drawn */
+  } layerStatsObj;
+
+  typedef struct {
+    int output; /* MS_STATS_LOG and/or MS_STATS_HEADER */
+    double seconds[MS_STATS_NUMSTAGES]; /* stages of the whole map: load, label cache and encode */
+    int numlayers;
+    layerStatsObj *layers; /* by layer index */
+  } mapStatsObj;
+#endif /* SWIG */
+
   /************************************************************************/
   /*                            labelCacheObj                             */
   /************************************************************************/
@@ -1290,6 +1385,11 @@ extern "C" {
     labelCacheMemberObj **rendered_text_symbols;
     int num_allocated_rendered_members;
     int num_rendered_members;
+#ifndef SWIG
+    labelCacheGridObj *grid; /* built as labels are rendered */
+    labelCacheArenaChunkObj *arena; /* newest chunk first */
+    labelCacheStatsObj *stats; /* one per layer, only while msDrawLabelCache() runs with tuning debug */
+#endif /* SWIG */
   } labelCacheObj;
 
   /************************************************************************/
@@ -1323,6 +1423,7 @@ extern "C" {
     rectObj bounds;
 #ifndef SWIG
     rectObj previousBounds; /* bounds at previous iteration */
+    struct queryFileMapObj *mapping; /* query file the results point into, NULL if they are allocated */
 #endif
 #ifdef SWIG
     %mutable;
@@ -1355,6 +1456,7 @@ extern "C" {
     struct mapObj *map;
     fontSetObj *fontset; /* a pointer to the main mapObj version */
     struct imageCacheObj *imagecache;
+    struct symbolFileObj *file; /* cached parse of filename the symbols were copied from, see loadSymbolSet() */
 #endif /* not SWIG */
   } symbolSetObj;
 
@@ -1470,6 +1572,11 @@ extern "C" {
     lineObj   *pboundinglines;
     pointObj  *pboundingpoints;
     char    *labelformat;
+    int     bproject;        /* the grid is in another projection than the map */
+    int     bmapcoords;      /* PROCESSING GRID_CACHE: the shapes are returned in the map projection */
+    int     bintersections;  /* msGraticuleLayerGetIntersectionPoints() needs the shapes in the layer projection */
+    struct graticuleArcsObj *parcs; /* arcs in the map projection, cached or being built */
+    int     iarc;
   } graticuleObj;
 
   typedef struct {
@@ -1491,6 +1598,32 @@ extern "C" {
   struct layerVTable;
   typedef struct layerVTable layerVTableObj;
 
+#define MS_LAYER_BATCH_SIZE 64 /* shapes fetched at once by msShapeBatchNext() */
+
+  /* shapes fetched with msLayerNextShapes() and handed out one at a time */
+  typedef struct {
+    shapeObj *shapes;
+    int numshapes;
+    int current; /* next shape to hand out */
+
+    /* classification of the shapes as they are read, see msShapeBatchClassify() */
+    mapObj *map;
+    int *classgroup;
+    int numclasses;
+  } shapeBatchObj;
+
+#define MS_RESULT_BATCH_SIZE 256 /* results read at once by msLayerGetResultShape() */
+
+  /* shapes of query results read ahead with msLayerGetShapes() */
+  typedef struct {
+    shapeObj *shapes;
+    resultObj *records; /* the results they are the shapes of */
+    char *handedout; /* the shape has been handed out, asking again reads ahead again */
+    int first; /* index in the result cache of the first one */
+    int numshapes;
+    int numitems; /* of the layer when they were read */
+  } resultShapesObj;
+
 #endif /*SWIG*/
 
   /************************************************************************/
@@ -1511,6 +1644,7 @@ extern "C" {
     outputFormatObj *format;
 #ifndef SWIG
     tileCacheObj *tilecache;
+    tileCacheObj **tilehash; /* MS_TILECACHE_HASHSIZE buckets, allocated on first use */
     int ntiles;
 #endif
 #ifdef SWIG
@@ -1582,13 +1716,110 @@ extern "C" {
   } originalScaleTokenStrings;
 #endif
 
+#ifndef SWIG
+  /*
+  ** Class lookup: when many classes of a layer are plain equality (or list)
+  ** tests on the same item, e.g. EXPRESSION "motorway" with a CLASSITEM or
+  ** EXPRESSION ([type] = 12), msShapeGetClass() finds the matching ones with a
+  ** binary search of the shape value instead of evaluating every class in
+  ** turn. Other classes are still evaluated and the first match wins as before.
+  */
+  typedef struct {
+    char *string;
+    double number;
+    int iclass;
+  } classLookupEntryObj;
+
+  typedef struct {
+    int numclasses; /* layer->numclasses when the lookup was built */
+    int itemindex;
+
+    classLookupEntryObj *strings; /* sorted by value then class */
+    int numstrings;
+    classLookupEntryObj *numbers;
+    int numnumbers;
+
+    int *others; /* classes that have to be evaluated, in order */
+    int numothers;
+  } classLookupObj;
+
+  /*
+  ** Binding plan: the attribute bindings of the styles and labels of a layer,
+  ** flattened in the order msBindLayerToShape() applies them so that styles and
+  ** labels without bindings are not visited for every shape. Targets are kept
+  ** as class/label/style indexes and looked up again when the plan is run.
+  */
+  typedef struct {
+    int iclass;
+    int ilabel; /* -1 for the styles of the class */
+    int istyle; /* -1 for the label itself */
+    int binding; /* MS_STYLE_BINDING_* or MS_LABEL_BINDING_*, -1 for the opacity fixup of a style */
+    int index; /* item index */
+  } bindingPlanEntryObj;
+
+  typedef struct {
+    int numclasses; /* layer->numclasses when the plan was built */
+
+    bindingPlanEntryObj *entries;
+    int numentries;
+
+    /* numeric values parsed for the current shape, valid where stamps[i] is +/-stamp (- for an empty value) */
+    double *numbers;
+    int *stamps;
+    int numitems;
+    int stamp;
+  } bindingPlanObj;
+
+  /*
+  ** Raster class table: the color every scaling bucket of a classified non
+  ** 8 bit raster maps to. It is kept on the layer between draws and only
+  ** computed again when the buckets or the classes and styles it was built
+  ** from (see the signature) change.
+  */
+  typedef struct {
+    char *signature;
+    int numbuckets;
+    double scalemin, scaleratio;
+    unsigned char *rgba; /* red, green, blue and alpha of each bucket, alpha 0 if unclassified */
+  } rasterClassTableObj;
+
+  /*
+  ** Polygon label points placed with PROCESSING "LABEL_POINT=POLE", in map
+  ** coordinates by feature. They are kept on the layer between draws at the
+  ** same scale and projection, so that the tiles of a metatile share the
+  ** placement and don't compute it again.
+  */
+  typedef struct labelPointCacheEntryObj labelPointCacheEntryObj;
+  typedef struct {
+    int enabled; /* set up for the current draw of the layer */
+    double precision; /* of the placement, in pixels */
+    char *signature; /* what the entries were computed for, see msPrepareLabelPointCache() */
+    labelPointCacheEntryObj *entries;
+    int numentries;
+  } labelPointCacheObj;
+#endif
+
+#ifndef SWIG
+  struct layerPrefetchObj; /* private to mapdraw.c */
+#endif
+
   struct layerObj {
 
     char *classitem; /* .DBF item to be used for symbol lookup */
 
 #ifndef SWIG
     int classitemindex;
+    classLookupObj *classlookup; /* built by msLayerWhichItems(), see msShapeGetClass() */
+    bindingPlanObj *bindingplan; /* built by msLayerWhichItems(), see msBindLayerToShape() */
+    rasterClassTableObj *rasterclasstable; /* see msGetRasterClassTable() */
+    labelPointCacheObj *labelpointcache; /* see msPrepareLabelPointCache() */
+    projApproxObj *projapprox; /* see msPrepareProjApprox() */
+    shapeObj *searchshape; /* exact search area in the layer projection during msLayerWhichShapes(), may be NULL */
+    struct layerPrefetchObj *prefetch; /* shapes selected ahead of the draw of the layer, see msDrawMap() */
+    shapePoolObj *shapepool; /* recycled shape arrays while the layer is drawn, see msCreateShapePool() */
+    resultShapesObj *resultshapes; /* read ahead by msLayerGetResultShape() */
     resultCacheObj *resultcache; /* holds the results of a query against this layer */
+    char *connpoolkey; /* connection pool key of the connection, see msConnPoolFindKey() */
     double scalefactor; /* computed, not set */
 #ifndef __cplusplus
     classObj **class; /* always at least 1 class */
@@ -1924,8 +2155,13 @@ void msPopulateTextSymbolForLabelAndString(textSymbolObj *ts, labelObj *l, char
     /* Private encryption key information - see mapcrypto.c */
     int encryption_key_loaded;        /* MS_TRUE once key has been loaded */
     unsigned char encryption_key[MS_ENCRYPTION_KEY_SIZE]; /* 128bits encryption key */
+    struct decryptCacheObj *decryptcache; /* shared with the copies of the map, see msDecryptStringTokens() */
 
     queryObj query;
+
+    struct layerNameIndexObj *layernameindex; /* see msGetLayerIndex() */
+
+    mapStatsObj *stats; /* only with CONFIG "MS_STATS", see msStatsCreate() */
 #endif
 
 #ifdef USE_V8_MAPSCRIPT
@@ -1966,6 +2202,9 @@ void msPopulateTextSymbolForLabelAndString(textSymbolObj *ts, labelObj *l, char
     char* (*LayerEscapePropertyName)(layerObj *layer, const char* pszString);
     void (*LayerEnablePaging)(layerObj *layer, int value);
     int (*LayerGetPaging)(layerObj *layer);
+    int (*LayerNextShapes)(layerObj *layer, shapeObj *shapes, int maxshapes, int *numshapes);
+    int (*LayerGetShapes)(layerObj *layer, shapeObj *shapes, resultObj *records, int numrecords);
+    int (*LayerEstimateShapeCount)(layerObj *layer, rectObj rect, projectionObj *rectProjection);
   };
 #endif /*SWIG*/
 
@@ -1974,6 +2213,9 @@ void msPopulateTextSymbolForLabelAndString(textSymbolObj *ts, labelObj *l, char
   MS_DLL_EXPORT void msFreeImage(imageObj *img);
   MS_DLL_EXPORT int msSetup(void);
   MS_DLL_EXPORT void msCleanup(void);
+  MS_DLL_EXPORT void msThreadPoolSetSize(int numthreads);
+  MS_DLL_EXPORT int msThreadPoolGetSize(void);
+  MS_DLL_EXPORT void msPrepareFork(void);
   MS_DLL_EXPORT mapObj *msLoadMapFromString(char *buffer, char *new_mappath);
 
   /* Function prototypes, not wrapable */
@@ -2022,6 +2264,7 @@ void msPopulateTextSymbolForLabelAndString(textSymbolObj *ts, labelObj *l, char
   MS_DLL_EXPORT void initWeb(webObj *web);
   MS_DLL_EXPORT void freeWeb(webObj *web);
   MS_DLL_EXPORT void initResultCache(resultCacheObj *resultcache);
+  MS_DLL_EXPORT void msFreeResultCache(resultCacheObj *resultcache);
   MS_DLL_EXPORT int initLayerCompositer(LayerCompositer *compositer);
   MS_DLL_EXPORT void initLeader(labelLeaderObj *leader);
   MS_DLL_EXPORT void freeGrid( graticuleObj *pGraticule);
@@ -2058,6 +2301,41 @@ void msPopulateTextSymbolForLabelAndString(textSymbolObj *ts, labelObj *l, char
 
   MS_DLL_EXPORT void msFreeMap(mapObj *map);
   MS_DLL_EXPORT mapObj *msNewMapObj(void);
+
+#ifndef SWIG
+  /* mapdebug.c */
+  MS_DLL_EXPORT void msStatsCreate(mapObj *map, double loadstart);
+  MS_DLL_EXPORT void msFreeStats(mapObj *map);
+  MS_DLL_EXPORT void msStatsReset(mapObj *map);
+  MS_DLL_EXPORT layerStatsObj *msGetLayerStats(mapObj *map, layerObj *layer);
+  MS_DLL_EXPORT double msStatsNow(void);
+  MS_DLL_EXPORT double msStatsElapsed(double *start);
+  MS_DLL_EXPORT char *msStatsToJSON(mapObj *map);
+
+  /* mapmetrics.c */
+  enum MS_METRICS_CACHE { MS_METRICS_CACHE_MAP, MS_METRICS_CACHE_TILE, MS_METRICS_CACHE_LEGEND, MS_METRICS_CACHE_WMS,
+                          MS_METRICS_CACHE_POOL, MS_METRICS_NUM_CACHES
+                        };
+  MS_DLL_EXPORT int msMetricsEnabled(void);
+  MS_DLL_EXPORT void msMetricsCacheLookup(int cache, int hit);
+  MS_DLL_EXPORT void msMetricsObserveRequest(mapObj *map, const char *service, const char *request, double seconds, int failed);
+  MS_DLL_EXPORT char *msMetricsToText(void);
+  MS_DLL_EXPORT void msMetricsWriteFile(void);
+  MS_DLL_EXPORT int msSlowLogEnabled(void);
+  MS_DLL_EXPORT void msSlowLogStart(void);
+  MS_DLL_EXPORT void msSlowLogRequest(mapObj *map, char **names, char **values, int numparams,
+                                      const char *service, const char *request, double seconds, int failed);
+
+  /* maptrace.c, the span kinds have the OTLP values */
+  enum MS_TRACE_SPAN_KIND { MS_TRACE_INTERNAL = 1, MS_TRACE_SERVER = 2, MS_TRACE_CLIENT = 3 };
+  MS_DLL_EXPORT void msTraceStart(const char *traceparent, const char *name);
+  MS_DLL_EXPORT void msTraceEnd(int status);
+  MS_DLL_EXPORT int msTraceSpanBegin(const char *name, int kind);
+  MS_DLL_EXPORT void msTraceSpanAttribute(int span, const char *key, const char *value);
+  MS_DLL_EXPORT void msTraceSpanEnd(int span, int status);
+  MS_DLL_EXPORT void msTraceSpanSetTimes(int span, double start, double end);
+  MS_DLL_EXPORT int msTraceGetParent(char *traceparent, size_t size);
+#endif
   MS_DLL_EXPORT const char *msGetConfigOption( mapObj *map, const char *key);
   MS_DLL_EXPORT int msSetConfigOption( mapObj *map, const char *key, const char *value);
   MS_DLL_EXPORT int msTestConfigOption( mapObj *map, const char *key,
@@ -2082,6 +2360,7 @@ void msPopulateTextSymbolForLabelAndString(textSymbolObj *ts, labelObj *l, char
   MS_DLL_EXPORT int msMapLoadOWSParameters( mapObj *map, cgiRequestObj *request,
       const char *wmtver_string );
   MS_DLL_EXPORT int msMapIgnoreMissingData( mapObj *map );
+  MS_DLL_EXPORT int msWarmupMap( mapObj *map );
 
   /* mapfile.c */
 
@@ -2089,6 +2368,12 @@ void msPopulateTextSymbolForLabelAndString(textSymbolObj *ts, labelObj *l, char
   MS_DLL_EXPORT int msGetLayerIndex(mapObj *map, const char *name);
   MS_DLL_EXPORT int msGetSymbolIndex(symbolSetObj *set, char *name, int try_addimage_if_notfound);
   MS_DLL_EXPORT mapObj  *msLoadMap(char *filename, char *new_mappath);
+  MS_DLL_EXPORT mapObj  *msLoadMapCached(char *filename);
+  MS_DLL_EXPORT int msSaveCompiledMap(char *filename, char *outfile);
+  MS_DLL_EXPORT void msMapCacheCleanup(void);
+  MS_DLL_EXPORT mapObj  *msLoadMapLayers(char *filename, char **names, int numnames);
+  MS_DLL_EXPORT void msLayerIndexCacheCleanup(void);
+  MS_DLL_EXPORT void msTileCacheCleanup(void);
   MS_DLL_EXPORT int msTransformXmlMapfile(const char *stylesheet, const char *xmlMapfile, FILE *tmpfile);
   MS_DLL_EXPORT int msSaveMap(mapObj *map, char *filename);
   MS_DLL_EXPORT void msFreeCharArray(char **array, int num_items);
@@ -2130,6 +2415,9 @@ void msPopulateTextSymbolForLabelAndString(textSymbolObj *ts, labelObj *l, char
   MS_DLL_EXPORT void msOGRCleanup(void);
   MS_DLL_EXPORT void msGDALCleanup(void);
   MS_DLL_EXPORT void msGDALInitialize(void);
+  MS_DLL_EXPORT void *msGDALPoolOpen(const char *path);
+  MS_DLL_EXPORT void msGDALPoolRelease(void *hDS, int keep_open);
+  MS_DLL_EXPORT void msGDALPoolCloseUnused(void);
 
   MS_DLL_EXPORT imageObj *msDrawScalebar(mapObj *map); /* in mapscale.c */
   MS_DLL_EXPORT int msCalculateScale(rectObj extent, int units, int width, int height, double resolution, double *scaledenom);
@@ -2157,6 +2445,7 @@ void msPopulateTextSymbolForLabelAndString(textSymbolObj *ts, labelObj *l, char
   MS_DLL_EXPORT double msSquareDistancePointToSegment(pointObj *p, pointObj *a, pointObj *b);
   MS_DLL_EXPORT double msDistancePointToShape(pointObj *p, shapeObj *shape);
   MS_DLL_EXPORT double msSquareDistancePointToShape(pointObj *p, shapeObj *shape);
+  MS_DLL_EXPORT double msDistancePointToShapeWithin(pointObj *p, shapeObj *shape, double tolerance);
   MS_DLL_EXPORT double msDistanceSegmentToSegment(pointObj *pa, pointObj *pb, pointObj *pc, pointObj *pd);
   MS_DLL_EXPORT double msDistanceShapeToShape(shapeObj *shape1, shapeObj *shape2);
   MS_DLL_EXPORT int msIntersectSegments(const pointObj *a, const pointObj *b, const pointObj *c, const pointObj *d);
@@ -2166,6 +2455,7 @@ void msPopulateTextSymbolForLabelAndString(textSymbolObj *ts, labelObj *l, char
   MS_DLL_EXPORT int msIntersectPolylinePolygon(shapeObj *line, shapeObj *poly);
   MS_DLL_EXPORT int msIntersectPolygons(shapeObj *p1, shapeObj *p2);
   MS_DLL_EXPORT int msIntersectPolylines(shapeObj *line1, shapeObj *line2);
+  MS_DLL_EXPORT int msIntersectRectPolygon(rectObj *rect, shapeObj *poly);
 
   MS_DLL_EXPORT int msInitQuery(queryObj *query); /* in mapquery.c */
   MS_DLL_EXPORT void msFreeQuery(queryObj *query);
@@ -2281,6 +2571,8 @@ void msPopulateTextSymbolForLabelAndString(textSymbolObj *ts, labelObj *l, char
   MS_DLL_EXPORT symbolObj *msGrowSymbolSet( symbolSetObj *symbolset );
   MS_DLL_EXPORT int msAddImageSymbol(symbolSetObj *symbolset, char *filename);
   MS_DLL_EXPORT int msFreeSymbolSet(symbolSetObj *symbolset);
+  MS_DLL_EXPORT int msSymbolFileLookup(symbolSetObj *symbols, const char *name);
+  MS_DLL_EXPORT void msSymbolFileCacheCleanup(void);
   MS_DLL_EXPORT int msFreeSymbol(symbolObj *symbol);
   MS_DLL_EXPORT int msAddNewSymbol(mapObj *map, char *name);
   MS_DLL_EXPORT int msAppendSymbol(symbolSetObj *symbolset, symbolObj *symbol);
@@ -2303,10 +2595,15 @@ void msPopulateTextSymbolForLabelAndString(textSymbolObj *ts, labelObj *l, char
   MS_DLL_EXPORT int WARN_UNUSED msEmbedLegend(mapObj *map, imageObj *img);
   MS_DLL_EXPORT int WARN_UNUSED msDrawLegendIcon(mapObj* map, layerObj* lp, classObj* myClass, int width, int height, imageObj *img, int dstX, int dstY, int scale_independant, class_hittest *hittest);
   MS_DLL_EXPORT imageObj WARN_UNUSED *msCreateLegendIcon(mapObj* map, layerObj* lp, classObj* myClass, int width, int height, int scale_independant);
+  typedef int (*msLegendDispatchFunc)(void *cbdata);
+  MS_DLL_EXPORT int msLegendDispatchCached(mapObj *map, cgiRequestObj *request, const char *mapfile, int ttl,
+                                           msLegendDispatchFunc func, void *cbdata);
+  MS_DLL_EXPORT void msLegendCacheCleanup(void);
 
   MS_DLL_EXPORT int msLoadFontSet(fontSetObj *fontSet, mapObj *map); /* in maplabel.c */
   MS_DLL_EXPORT int msInitFontSet(fontSetObj *fontset);
   MS_DLL_EXPORT int msFreeFontSet(fontSetObj *fontset);
+  MS_DLL_EXPORT void msFontSetCacheCleanup(void);
 
   MS_DLL_EXPORT int WARN_UNUSED msGetTextSymbolSize(mapObj *map, textSymbolObj *ts, rectObj *r);
   MS_DLL_EXPORT int WARN_UNUSED msGetStringSize(mapObj *map, labelObj *label, int size, char *string, rectObj *r);
@@ -2314,11 +2611,27 @@ void msPopulateTextSymbolForLabelAndString(textSymbolObj *ts, labelObj *l, char
   MS_DLL_EXPORT int WARN_UNUSED msAddLabel(mapObj *map, imageObj *image, labelObj *label, int layerindex, int classindex, shapeObj *shape, pointObj *point, double featuresize, textSymbolObj *ts);
   MS_DLL_EXPORT int WARN_UNUSED msAddLabelGroup(mapObj *map, imageObj *image, layerObj *layer, int classindex, shapeObj *shape, pointObj *point, double featuresize);
   MS_DLL_EXPORT void insertRenderedLabelMember(mapObj *map, labelCacheMemberObj *cachePtr);
+  MS_DLL_EXPORT void msFreeLabelCacheGrid(labelCacheObj *cache);
+  MS_DLL_EXPORT void *msLabelCacheAlloc(labelCacheObj *cache, size_t size);
+  MS_DLL_EXPORT void msResetLabelCacheArena(labelCacheObj *cache);
+  MS_DLL_EXPORT void msFreeLabelCacheArena(labelCacheObj *cache);
   MS_DLL_EXPORT int msTestLabelCacheCollisions(mapObj *map, labelCacheMemberObj *cachePtr, label_bounds *lb, int current_priority, int current_label);
   MS_DLL_EXPORT int msTestLabelCacheLeaderCollision(mapObj *map, pointObj *lp1, pointObj *lp2);
+  MS_DLL_EXPORT void msComputeLabelCacheTextPaths(mapObj *map, int numthreads);
+  MS_DLL_EXPORT int msTextSymbolMayBeInImage(mapObj *map, labelCacheMemberObj *cachePtr, textSymbolObj *ts, double margin);
+  MS_DLL_EXPORT int msLabelPlacementCacheEnabled(mapObj *map);
+  MS_DLL_EXPORT int msLabelPlacementCacheLookup(mapObj *map, labelCacheMemberObj *cachePtr, int labelindex);
+  MS_DLL_EXPORT void msLabelPlacementCacheStore(mapObj *map, labelCacheMemberObj *cachePtr, int labelindex, int position);
+  MS_DLL_EXPORT void msLabelPlacementCacheCleanup(void);
   MS_DLL_EXPORT labelCacheMemberObj *msGetLabelCacheMember(labelCacheObj *labelcache, int i);
 
   MS_DLL_EXPORT void msFreeShape(shapeObj *shape); /* in mapprimitive.c */
+  MS_DLL_EXPORT shapePoolObj *msCreateShapePool(void);
+  MS_DLL_EXPORT void msFreeShapePool(shapePoolObj *pool);
+  MS_DLL_EXPORT void *msShapePoolAlloc(shapePoolObj *pool, size_t size);
+  MS_DLL_EXPORT void msShapePoolFree(shapePoolObj *pool, void *block, size_t size);
+  MS_DLL_EXPORT void msShapePoolFreeShape(shapePoolObj *pool, shapeObj *shape);
+  MS_DLL_EXPORT void msShapePoolDebug(shapePoolObj *pool, layerObj *layer);
   MS_DLL_EXPORT void msFreeLabelPathObj(labelPathObj *path);
   MS_DLL_EXPORT shapeObj *msShapeFromWKT(const char *string);
   MS_DLL_EXPORT char *msShapeToWKT(shapeObj *shape);
@@ -2333,6 +2646,7 @@ void msPopulateTextSymbolForLabelAndString(textSymbolObj *ts, labelObj *l, char
   MS_DLL_EXPORT void msClipPolylineRect(shapeObj *shape, rectObj rect);
   MS_DLL_EXPORT void msClipPolygonRect(shapeObj *shape, rectObj rect);
   MS_DLL_EXPORT void msTransformShape(shapeObj *shape, rectObj extent, double cellsize, imageObj *image);
+  MS_DLL_EXPORT void msClipTransformShape(shapeObj *shape, rectObj cliprect, rectObj extent, double cellsize, imageObj *image);
   MS_DLL_EXPORT void msTransformPoint(pointObj *point, rectObj *extent, double cellsize, imageObj *image);
 
   MS_DLL_EXPORT void msOffsetPointRelativeTo(pointObj *point, layerObj *layer);
@@ -2346,6 +2660,8 @@ void msPopulateTextSymbolForLabelAndString(textSymbolObj *ts, labelObj *l, char
 
   struct line_lengths {
     double *segment_lengths;
+    double *cumulative_lengths; /* from the first point to each point, in the segment_lengths block */
+    double *reverse_lengths; /* from each point to the last point, in the segment_lengths block */
     double total_length;
     int longest_segment_index;
   };
@@ -2373,11 +2689,13 @@ void msPopulateTextSymbolForLabelAndString(textSymbolObj *ts, labelObj *l, char
 
   MS_DLL_EXPORT void msTransformPixelToShape(shapeObj *shape, rectObj extent, double cellsize);
   MS_DLL_EXPORT void msPolylineComputeLineSegments(shapeObj *shape, struct polyline_lengths *pll);
-  MS_DLL_EXPORT int msPolylineLabelPath(mapObj *map, imageObj *image, shapeObj *p, textSymbolObj *ts, labelObj *label, struct label_follow_result *lfr);
-  MS_DLL_EXPORT int WARN_UNUSED msPolylineLabelPoint(mapObj *map, shapeObj *p, textSymbolObj *ts, labelObj *label, struct label_auto_result *lar, double resolutionfactor);
+  MS_DLL_EXPORT void msPolylineFreeLineSegments(shapeObj *shape, struct polyline_lengths *pll);
+  MS_DLL_EXPORT int msPolylineLabelPath(mapObj *map, imageObj *image, shapeObj *p, struct polyline_lengths *pll, textSymbolObj *ts, labelObj *label, struct label_follow_result *lfr);
+  MS_DLL_EXPORT int WARN_UNUSED msPolylineLabelPoint(mapObj *map, shapeObj *p, struct polyline_lengths *pll, textSymbolObj *ts, labelObj *label, struct label_auto_result *lar, double resolutionfactor);
   MS_DLL_EXPORT int WARN_UNUSED msLineLabelPath(mapObj *map, imageObj *img, lineObj *p, textSymbolObj *ts, struct line_lengths *ll, struct label_follow_result *lfr, labelObj *lbl);
   MS_DLL_EXPORT int WARN_UNUSED msLineLabelPoint(mapObj *map, lineObj *p, textSymbolObj *ts, struct line_lengths *ll, struct label_auto_result *lar, labelObj *lbl, double resolutionfactor);
   MS_DLL_EXPORT int msPolygonLabelPoint(shapeObj *p, pointObj *lp, double min_dimension);
+  MS_DLL_EXPORT int msPolygonPoleOfInaccessibility(shapeObj *p, pointObj *lp, double precision, double min_dimension);
   MS_DLL_EXPORT int msAddLine(shapeObj *p, lineObj *new_line);
   MS_DLL_EXPORT int msAddLineDirectly(shapeObj *p, lineObj *new_line);
   MS_DLL_EXPORT int msAddPointToLine(lineObj *line, pointObj *point );
@@ -2417,11 +2735,21 @@ void msPopulateTextSymbolForLabelAndString(textSymbolObj *ts, labelObj *l, char
   MS_DLL_EXPORT int msLayerWhichShapes(layerObj *layer, rectObj rect, int isQuery);
   MS_DLL_EXPORT int msLayerGetItemIndex(layerObj *layer, char *item);
   MS_DLL_EXPORT int msLayerWhichItems(layerObj *layer, int get_all, const char *metadata);
+  MS_DLL_EXPORT int msLayerWhichItemsForScale(layerObj *layer, int get_all, const char *metadata, double scaledenom);
   MS_DLL_EXPORT int msLayerNextShape(layerObj *layer, shapeObj *shape);
+  MS_DLL_EXPORT int msLayerNextShapes(layerObj *layer, shapeObj *shapes, int maxshapes, int *numshapes);
+  MS_DLL_EXPORT void msInitShapeBatch(shapeBatchObj *batch);
+  MS_DLL_EXPORT int msShapeBatchNext(layerObj *layer, shapeBatchObj *batch, shapeObj *shape);
+  MS_DLL_EXPORT void msShapeBatchClassify(shapeBatchObj *batch, mapObj *map, int *classgroup, int numclasses);
+  MS_DLL_EXPORT void msFreeShapeBatch(shapeBatchObj *batch);
   MS_DLL_EXPORT int msLayerGetItems(layerObj *layer);
   MS_DLL_EXPORT int msLayerSetItems(layerObj *layer, char **items, int numitems);
   MS_DLL_EXPORT int msLayerGetShape(layerObj *layer, shapeObj *shape, resultObj *record);
+  MS_DLL_EXPORT int msLayerGetShapes(layerObj *layer, shapeObj *shapes, resultObj *records, int numrecords);
+  MS_DLL_EXPORT int msLayerGetResultShape(layerObj *layer, shapeObj *shape, int resultnum);
+  MS_DLL_EXPORT void msFreeResultShapes(resultShapesObj *resultshapes);
   MS_DLL_EXPORT int msLayerGetShapeCount(layerObj *layer, rectObj rect, projectionObj *rectProjection);
+  MS_DLL_EXPORT int msLayerEstimateShapeCount(layerObj *layer, rectObj rect, projectionObj *rectProjection);
   MS_DLL_EXPORT int msLayerGetExtent(layerObj *layer, rectObj *extent);
   MS_DLL_EXPORT int msLayerSetExtent( layerObj *layer, double minx, double miny, double maxx, double maxy);
   MS_DLL_EXPORT int msLayerGetAutoStyle(mapObj *map, layerObj *layer, classObj *c, shapeObj* shape);
@@ -2440,6 +2768,14 @@ void msPopulateTextSymbolForLabelAndString(textSymbolObj *ts, labelObj *l, char
   MS_DLL_EXPORT const char *msExpressionTokenToString(int token);
   MS_DLL_EXPORT int msTokenizeExpression(expressionObj *expression, char **list, int *listsize);
 
+  MS_DLL_EXPORT void msCompileExpression(expressionObj *expression); /* in mapexpression.c */
+  MS_DLL_EXPORT void msFreeExpressionProgram(expressionProgramObj *program);
+  MS_DLL_EXPORT int msEvalParsedExpression(parseObj *p);
+  MS_DLL_EXPORT char *msEvalTextTemplate(expressionObj *expression, shapeObj *shape, int bJSonEscape);
+  MS_DLL_EXPORT void msInitExpressionBatch(expressionBatchObj *batch, shapeObj *shapes, int numshapes);
+  MS_DLL_EXPORT void msFreeExpressionBatch(expressionBatchObj *batch);
+  MS_DLL_EXPORT int msEvalExpressionBatch(expressionBatchObj *batch, expressionObj *expression, const int *lanes, int numlanes, int *results);
+
   MS_DLL_EXPORT int msLayerSetTimeFilter(layerObj *lp, const char *timestring, const char *timefield);
   MS_DLL_EXPORT int msLayerMakeBackticsTimeFilter(layerObj *lp, const char *timestring, const char *timefield);
   MS_DLL_EXPORT int msLayerMakePlainTimeFilter(layerObj *lp, const char *timestring, const char *timefield);
@@ -2485,17 +2821,26 @@ void msPopulateTextSymbolForLabelAndString(textSymbolObj *ts, labelObj *l, char
   MS_DLL_EXPORT int msTiledSHPLayerInitializeVirtualTable(layerObj *layer);
   MS_DLL_EXPORT int msOGRLayerInitializeVirtualTable(layerObj *layer);
   MS_DLL_EXPORT int msPostGISLayerInitializeVirtualTable(layerObj *layer);
+  MS_DLL_EXPORT void msPostGISCacheCleanup(void);
+  MS_DLL_EXPORT void msPostGISLayerEnablePipeline(layerObj *layer, int value);
+  MS_DLL_EXPORT void msPostGISPipelineFlush(layerObj **layers, int numlayers);
   MS_DLL_EXPORT int msOracleSpatialLayerInitializeVirtualTable(layerObj *layer);
   MS_DLL_EXPORT int msWFSLayerInitializeVirtualTable(layerObj *layer);
   MS_DLL_EXPORT int msGraticuleLayerInitializeVirtualTable(layerObj *layer);
   MS_DLL_EXPORT int msRASTERLayerInitializeVirtualTable(layerObj *layer);
   MS_DLL_EXPORT int msUVRASTERLayerInitializeVirtualTable(layerObj *layer);
   MS_DLL_EXPORT int msContourLayerInitializeVirtualTable(layerObj *layer);  
+  MS_DLL_EXPORT int msFlatGeobufLayerInitializeVirtualTable(layerObj *layer);
+  MS_DLL_EXPORT int msFlatGeobufIsDataset(const char *data);
+  MS_DLL_EXPORT void msContourCacheCleanup(void);
   MS_DLL_EXPORT int msPluginLayerInitializeVirtualTable(layerObj *layer);
   MS_DLL_EXPORT int msUnionLayerInitializeVirtualTable(layerObj *layer);
   MS_DLL_EXPORT void msPluginFreeVirtualTableFactory(void);
 
   int LayerDefaultGetShapeCount(layerObj *layer, rectObj rect, projectionObj *rectProjection);
+  int LayerDefaultGetShapes(layerObj *layer, shapeObj *shapes, resultObj *records, int numrecords);
+  int LayerDefaultEstimateShapeCount(layerObj *layer, rectObj rect, projectionObj *rectProjection);
+  int LayerDefaultNextShapes(layerObj *layer, shapeObj *shapes, int maxshapes, int *numshapes);
 
   /* ==================================================================== */
   /*      Prototypes for functions in mapdraw.c                           */
@@ -2507,6 +2852,9 @@ void msPopulateTextSymbolForLabelAndString(textSymbolObj *ts, labelObj *l, char
   MS_DLL_EXPORT int msDrawLayer(mapObj *map, layerObj *layer, imageObj *image);
   MS_DLL_EXPORT int msDrawVectorLayer(mapObj *map, layerObj *layer, imageObj *image);
   MS_DLL_EXPORT int msDrawQueryLayer(mapObj *map, layerObj *layer, imageObj *image);
+  MS_DLL_EXPORT void msPrepareLabelPointCache(mapObj *map, layerObj *layer);
+  MS_DLL_EXPORT void msFreeLabelPointCache(labelPointCacheObj *cache);
+  MS_DLL_EXPORT void msPrepareProjApprox(mapObj *map, layerObj *layer, rectObj *searchrect);
   MS_DLL_EXPORT int msDrawWMSLayer(mapObj *map, layerObj *layer, imageObj *image);
   MS_DLL_EXPORT int msDrawWFSLayer(mapObj *map, layerObj *layer, imageObj *image);
   
@@ -2586,13 +2934,17 @@ void msPopulateTextSymbolForLabelAndString(textSymbolObj *ts, labelObj *l, char
   MS_DLL_EXPORT int msJoinConnect(layerObj *layer, joinObj *join);
   MS_DLL_EXPORT int msJoinPrepare(joinObj *join, shapeObj *shape);
   MS_DLL_EXPORT int msJoinNext(joinObj *join);
+  MS_DLL_EXPORT int msJoinPrefetch(layerObj *layer, joinObj *join, int first);
   MS_DLL_EXPORT int msJoinClose(joinObj *join);
+  MS_DLL_EXPORT void msJoinCacheCleanup(void);
 
   /*in mapraster.c */
   MS_DLL_EXPORT int msDrawRasterLayerLow(mapObj *map, layerObj *layer, imageObj *image, rasterBufferObj *rb );
   MS_DLL_EXPORT int msGetClass(layerObj *layer, colorObj *color, int colormap_index);
   MS_DLL_EXPORT int msGetClass_FloatRGB(layerObj *layer, float fValue,
                                         int red, int green, int blue );
+  MS_DLL_EXPORT rasterClassTableObj *msGetRasterClassTable(layerObj *layer, int numbuckets, double scalemin, double scaleratio);
+  MS_DLL_EXPORT void msFreeRasterClassTable(rasterClassTableObj *table);
 
   /* in mapdrawgdal.c */
   MS_DLL_EXPORT int msDrawRasterLayerGDAL(mapObj *map, layerObj *layer, imageObj *image, rasterBufferObj *rb, void *hDSVoid );
@@ -2603,6 +2955,7 @@ void msPopulateTextSymbolForLabelAndString(textSymbolObj *ts, labelObj *l, char
   /* in interpolation.c */
   MS_DLL_EXPORT int msComputeKernelDensityDataset(mapObj *map, imageObj *image, layerObj *layer, void **hDSvoid, void **cleanup_ptr);
   MS_DLL_EXPORT int msCleanupKernelDensityDataset(mapObj *map, imageObj *image, layerObj *layer, void *cleanup_ptr);
+  MS_DLL_EXPORT void msKernelDensityCacheCleanup(void);
 
   /* in mapchart.c */
   MS_DLL_EXPORT int msDrawChartLayer(mapObj *map, layerObj *layer, imageObj *image);
@@ -2628,10 +2981,16 @@ void msPopulateTextSymbolForLabelAndString(textSymbolObj *ts, labelObj *l, char
   MS_DLL_EXPORT int getRgbColor(mapObj *map,int i,int *r,int *g,int *b); /* maputil.c */
 
   MS_DLL_EXPORT int msBindLayerToShape(layerObj *layer, shapeObj *shape, int querymapMode);
+  MS_DLL_EXPORT void msLayerBuildBindingPlan(layerObj *layer);
+  MS_DLL_EXPORT void msFreeBindingPlan(bindingPlanObj *plan);
   MS_DLL_EXPORT int msValidateContexts(mapObj *map);
   MS_DLL_EXPORT int msEvalContext(mapObj *map, layerObj *layer, char *context);
   MS_DLL_EXPORT int msEvalExpression(layerObj *layer, shapeObj *shape, expressionObj *expression, int itemindex);
+  MS_DLL_EXPORT void msFreeRegexMemo(regexMemoObj *memo);
   MS_DLL_EXPORT int msShapeGetClass(layerObj *layer, mapObj *map, shapeObj *shape, int *classgroup, int numclasses);
+  MS_DLL_EXPORT void msShapeGetClasses(layerObj *layer, mapObj *map, shapeObj *shapes, int numshapes, int *classgroup, int numclasses);
+  MS_DLL_EXPORT void msLayerBuildClassLookup(layerObj *layer);
+  MS_DLL_EXPORT void msFreeClassLookup(classLookupObj *lookup);
   MS_DLL_EXPORT int msShapeCheckSize(shapeObj *shape, double minfeaturesize);
   MS_DLL_EXPORT char* msShapeGetLabelAnnotation(layerObj *layer, shapeObj *shape, labelObj *lbl);
   MS_DLL_EXPORT int msGetLabelStatus(mapObj *map, layerObj *layer, shapeObj *shape, labelObj *lbl);
@@ -2642,6 +3001,19 @@ void msPopulateTextSymbolForLabelAndString(textSymbolObj *ts, labelObj *l, char
   MS_DLL_EXPORT int msConstrainExtent(rectObj *bounds, rectObj *rect, double overlay);
   MS_DLL_EXPORT int *msGetLayersIndexByGroup(mapObj *map, char *groupname, int *nCount);
   MS_DLL_EXPORT unsigned char *msSaveImageBuffer(imageObj* image, int *size_ptr, outputFormatObj *format);
+  MS_DLL_EXPORT int msSaveImageCapture(mapObj *map, imageObj *img, unsigned char **data, int *size);
+
+  /* in mapcoalesce.c */
+  typedef struct msCoalesceObj msCoalesceObj;
+  MS_DLL_EXPORT msCoalesceObj *msCoalesceBegin(mapObj *map, const char *mapfile, char **names, char **values, int numentries);
+  MS_DLL_EXPORT const char *msCoalesceGetMimeType(msCoalesceObj *c);
+  MS_DLL_EXPORT void msCoalesceSetImage(msCoalesceObj *c, const unsigned char *data, int size, const char *mimetype);
+  MS_DLL_EXPORT int msCoalesceWrite(msCoalesceObj *c);
+  MS_DLL_EXPORT void msCoalesceEnd(msCoalesceObj *c);
+  MS_DLL_EXPORT char *msBuildRequestKey(mapObj *map, const char *mapfile, char **names, char **values, int numentries);
+  MS_DLL_EXPORT void msHashRequestKey(const char *key, char *hash);
+  MS_DLL_EXPORT int msReadKeyedFile(const char *path, const char *key, unsigned char **data, int *size, char **mimetype);
+  MS_DLL_EXPORT int msWriteKeyedFile(const char *path, const char *key, const unsigned char *data, int size, const char *mimetype);
   MS_DLL_EXPORT shapeObj* msOffsetPolyline(shapeObj* shape, double offsetx, double offsety);
   MS_DLL_EXPORT int msMapSetLayerProjections(mapObj* map);
   
@@ -2652,6 +3024,8 @@ void msPopulateTextSymbolForLabelAndString(textSymbolObj *ts, labelObj *l, char
   MS_DLL_EXPORT int msSetLayersdrawingOrder(mapObj *self, int *panIndexes);
   MS_DLL_EXPORT int msInsertLayer(mapObj *map, layerObj *layer, int nIndex);
   MS_DLL_EXPORT layerObj *msRemoveLayer(mapObj *map, int nIndex);
+  MS_DLL_EXPORT void msInvalidateLayerNameIndex(mapObj *map);
+  MS_DLL_EXPORT int msLayerNameIndexNext(mapObj *map, const char *name, int bygroup, int after);
 
   /* Defined in layerobject.c */
   MS_DLL_EXPORT int msInsertClass(layerObj *layer,classObj *classobj,int nIndex);
@@ -2688,6 +3062,7 @@ void msPopulateTextSymbolForLabelAndString(textSymbolObj *ts, labelObj *l, char
 
 
   MS_DLL_EXPORT imageObj *msImageCreate(int width, int height, outputFormatObj *format, char *imagepath, char *imageurl, double resolution, double defresolution, colorObj *bg);
+  MS_DLL_EXPORT size_t msImageMemorySize(int width, int height, outputFormatObj *format);
 
   MS_DLL_EXPORT void msAlphaBlend(
     unsigned char red_src, unsigned char green_src,
@@ -2749,6 +3124,9 @@ void msPopulateTextSymbolForLabelAndString(textSymbolObj *ts, labelObj *l, char
   /*      prototypes for functions in mapgdal.c                           */
   /* ==================================================================== */
   MS_DLL_EXPORT int msSaveImageGDAL( mapObj *map, imageObj *image, char *filename );
+  MS_DLL_EXPORT void *msGDALBeginStripes( mapObj *map, outputFormatObj *format, int width, int height, int stripe_rows );
+  MS_DLL_EXPORT int msGDALWriteStripe( void *hDS, imageObj *image, int first_row, int skip_rows );
+  MS_DLL_EXPORT void msGDALEndStripes( void *hDS );
   MS_DLL_EXPORT int msInitDefaultGDALOutputFormat( outputFormatObj *format );
 
   /* ==================================================================== */
@@ -2757,6 +3135,11 @@ void msPopulateTextSymbolForLabelAndString(textSymbolObj *ts, labelObj *l, char
   MS_DLL_EXPORT int msInitDefaultOGROutputFormat( outputFormatObj *format );
   MS_DLL_EXPORT int msOGRWriteFromQuery( mapObj *map, outputFormatObj *format,
                                          int sendheaders );
+  MS_DLL_EXPORT int msOGRCanStreamQuery( mapObj *map, outputFormatObj *format );
+  MS_DLL_EXPORT void *msOGRBeginStreamQuery( mapObj *map, outputFormatObj *format,
+      int sendheaders, int maxfeatures );
+  MS_DLL_EXPORT int msOGRWriteStreamShape( layerObj *layer, shapeObj *shape, void *data );
+  MS_DLL_EXPORT int msOGREndStreamQuery( void *data );
 
   /* ==================================================================== */
   /*      Public prototype for mapogr.cpp functions.                      */
@@ -2803,8 +3186,13 @@ void msPopulateTextSymbolForLabelAndString(textSymbolObj *ts, labelObj *l, char
   MS_DLL_EXPORT void msConnPoolRegister( layerObj *layer,
                                          void *conn_handle,
                                          void (*close)( void * ) );
+  MS_DLL_EXPORT void msConnPoolRegisterEx( layerObj *layer,
+      void *conn_handle,
+      void (*close)( void * ),
+      int (*alive)( void * ) );
   MS_DLL_EXPORT void msConnPoolCloseUnreferenced( void );
   MS_DLL_EXPORT void msConnPoolFinalCleanup( void );
+  MS_DLL_EXPORT void msConnPoolStats( int *connections, int *inuse );
 
   /* ==================================================================== */
   /*      prototypes for functions in mapcpl.c                            */
@@ -2819,6 +3207,7 @@ void msPopulateTextSymbolForLabelAndString(textSymbolObj *ts, labelObj *l, char
   MS_DLL_EXPORT void msGEOSSetup(void);
   MS_DLL_EXPORT void msGEOSCleanup(void);
   MS_DLL_EXPORT void msGEOSFreeGeometry(shapeObj *shape);
+  MS_DLL_EXPORT int msGEOSPrepareGeometry(shapeObj *shape);
 
   MS_DLL_EXPORT shapeObj *msGEOSShapeFromWKT(const char *string);
   MS_DLL_EXPORT char *msGEOSShapeToWKT(shapeObj *shape);
@@ -2857,6 +3246,8 @@ void msPopulateTextSymbolForLabelAndString(textSymbolObj *ts, labelObj *l, char
   MS_DLL_EXPORT void msEncryptStringWithKey(const unsigned char *key, const char *in, char *out);
   MS_DLL_EXPORT void msDecryptStringWithKey(const unsigned char *key, const char *in, char *out);
   MS_DLL_EXPORT char *msDecryptStringTokens(mapObj *map, const char *in);
+  MS_DLL_EXPORT void msShareDecryptCache(mapObj *dst, mapObj *src);
+  MS_DLL_EXPORT void msReleaseDecryptCache(struct decryptCacheObj *cache);
   MS_DLL_EXPORT void msHexEncode(const unsigned char *in, char *out, int numbytes);
   MS_DLL_EXPORT int msHexDecode(const char *in, unsigned char *out, int numchars);
 
@@ -2899,6 +3290,8 @@ void msPopulateTextSymbolForLabelAndString(textSymbolObj *ts, labelObj *l, char
   /* ==================================================================== */
   MS_DLL_EXPORT graticuleIntersectionObj *msGraticuleLayerGetIntersectionPoints(mapObj *map, layerObj *layer);
   MS_DLL_EXPORT void msGraticuleLayerFreeIntersectionPoints( graticuleIntersectionObj *psValue);
+  MS_DLL_EXPORT void msGraticuleCacheCleanup(void);
+  MS_DLL_EXPORT void msGraticuleReleaseArcs(struct graticuleArcsObj *arcs);
 
   /* ==================================================================== */
   /*      end of prototypes for functions in mapgraticule.c               */
@@ -2991,9 +3384,13 @@ void msPopulateTextSymbolForLabelAndString(textSymbolObj *ts, labelObj *l, char
     int width;
     int height;
     colorObj color, outlinecolor, backgroundcolor;
+    int colorflags; /* which of the colors above were set, see MS_TILECACHE_* */
     double outlinewidth, rotation,scale;
     imageObj *image;
-    tileCacheObj *next;
+    unsigned int hash;
+    tileCacheObj *next; /* most to least recently used, the head's prev is the tail */
+    tileCacheObj *prev;
+    tileCacheObj *hashnext; /* next tile in the same hash bucket */
   };
 
 
@@ -3024,6 +3421,7 @@ void msPopulateTextSymbolForLabelAndString(textSymbolObj *ts, labelObj *l, char
   MS_DLL_EXPORT int msPopulateRendererVTableOGL( rendererVTableObj *renderer );
   MS_DLL_EXPORT int msPopulateRendererVTableAGG( rendererVTableObj *renderer );
   MS_DLL_EXPORT int msPopulateRendererVTableUTFGrid( rendererVTableObj *renderer );
+  MS_DLL_EXPORT int msPopulateRendererVTableMVT( rendererVTableObj *renderer );
   MS_DLL_EXPORT int msPopulateRendererVTableKML( rendererVTableObj *renderer );
   MS_DLL_EXPORT int msPopulateRendererVTableOGR( rendererVTableObj *renderer );
   MS_DLL_EXPORT int msPopulateRendererVTableOGR( rendererVTableObj *renderer );
@@ -3047,7 +3445,12 @@ void msPopulateTextSymbolForLabelAndString(textSymbolObj *ts, labelObj *l, char
   int msQuantizeRasterBuffer(rasterBufferObj *rb, unsigned int *reqcolors, rgbaPixel *palette,
                              rgbaPixel *forced_palette, int num_forced_palette_entries,
                              unsigned int *palette_scaling_maxval);
+  int msQuantizeRasterBufferKMeans(rasterBufferObj *rb, unsigned int *reqcolors, rgbaPixel *palette,
+                                   rgbaPixel *forced_palette, int num_forced_palette_entries,
+                                   unsigned int *palette_scaling_maxval);
   int msClassifyRasterBuffer(rasterBufferObj *rb, rasterBufferObj *qrb);
+  int msClassifyRasterBufferKMeans(rasterBufferObj *rb, rasterBufferObj *qrb);
+  void msPNGPaletteCacheCleanup(void);
   int msSaveRasterBuffer(mapObj *map, rasterBufferObj *data, FILE *stream, outputFormatObj *format);
   int msSaveRasterBufferToBuffer(rasterBufferObj *data, bufferObj *buffer, outputFormatObj *format);
   int msLoadMSRasterBufferFromFile(char *path, rasterBufferObj *rb);
@@ -3056,6 +3459,8 @@ void msPopulateTextSymbolForLabelAndString(textSymbolObj *ts, labelObj *l, char
   void msApplyBlurringCompositingFilter(rasterBufferObj *rb, unsigned int radius);
   
   int WARN_UNUSED msApplyCompositingFilter(mapObj *map, rasterBufferObj *rb, CompositingFilter *filter);
+  void msBlendRasterBufferSrcOver(rasterBufferObj *dst, rasterBufferObj *src, unsigned int cover);
+  void msBlendRasterBufferMultiply(rasterBufferObj *dst, rasterBufferObj *src, unsigned int cover);
 
   void msBufferInit(bufferObj *buffer);
   void msBufferResize(bufferObj *buffer, size_t target_size);
@@ -3092,6 +3497,13 @@ void msPopulateTextSymbolForLabelAndString(textSymbolObj *ts, labelObj *l, char
     int WARN_UNUSED (*renderPixmapSymbol)(imageObj *img, double x, double y,
                               symbolObj *symbol, symbolStyleObj *style);
 
+    /* optional: draw the same symbol at numpoints points with the given rotations (style->rotation is ignored) */
+    int WARN_UNUSED (*renderVectorSymbols)(imageObj *img, int numpoints, pointObj *points, double *rotations,
+                              symbolObj *symbol, symbolStyleObj *style);
+
+    int WARN_UNUSED (*renderPixmapSymbols)(imageObj *img, int numpoints, pointObj *points, double *rotations,
+                              symbolObj *symbol, symbolStyleObj *style);
+
     int WARN_UNUSED (*renderEllipseSymbol)(imageObj *image, double x, double y,
                                symbolObj *symbol, symbolStyleObj *style);
 
@@ -66,8 +66,8 @@ int msCGIWriteLog(mapservObj *mapserv, int show_error)
   fprintf(stream,"%s,",msStringChop(ctime(&t)));
   fprintf(stream,"%d,",(int)getpid());
 
-  if(getenv("REMOTE_ADDR") != NULL)
-    fprintf(stream,"%s,",getenv("REMOTE_ADDR"));
+  if(msIO_getenv("REMOTE_ADDR") != NULL)
+    fprintf(stream,"%s,",msIO_getenv("REMOTE_ADDR"));
   else
     fprintf(stream,"NULL,");
 
@@ -190,6 +190,136 @@ static void setClassGroup(layerObj *layer, char *classgroup)
   }
 }
 
+static int msCGIIsEnabled(const char *name)
+{
+  const char *value = msIO_getenv(name);
+
+  return value && (strcasecmp(value, "ON") == 0 || strcasecmp(value, "YES") == 0 ||
+                   strcasecmp(value, "TRUE") == 0);
+}
+
+/*
+** The layers the request names in LAYERS, LAYER, QUERY_LAYERS, qlayer or
+** slayer, to load only these with MS_MAP_LAZY_LAYERS. MS_FALSE if the whole
+** map is needed: layers=all, or the map modified by the request (map_/map.
+** variables, SLD, context).
+*/
+static int msCGIGetRequestLayers(mapservObj *mapserv, char ***names, int *numnames)
+{
+  int i, j, n;
+
+  *names = NULL;
+  *numnames = 0;
+  if(!mapserv || !mapserv->request)
+    return MS_FALSE;
+
+  for(i=0; i<mapserv->request->NumParams; i++) {
+    const char *param = mapserv->request->ParamNames[i];
+    char *value = mapserv->request->ParamValues[i];
+    char **values;
+
+    if(strncasecmp(param, "map_", 4) == 0 || strncasecmp(param, "map.", 4) == 0 ||
+        strcasecmp(param, "sld") == 0 || strcasecmp(param, "sld_body") == 0 || strcasecmp(param, "context") == 0)
+      break;
+    if(strcasecmp(param, "layers") != 0 && strcasecmp(param, "layer") != 0 && strcasecmp(param, "query_layers") != 0 &&
+        strcasecmp(param, "qlayer") != 0 && strcasecmp(param, "slayer") != 0)
+      continue;
+    if(!value || strcasecmp(value, "all") == 0)
+      break;
+
+    values = msStringSplitComplex(value, ", ", &n, 0); /* empty names dropped */
+    for(j=0; j<n; j++) {
+      *names = (char **) msSmallRealloc(*names, sizeof(char *) * (*numnames + 1));
+      (*names)[(*numnames)++] = values[j];
+    }
+    msFree(values);
+  }
+
+  if(i < mapserv->request->NumParams || *numnames == 0) {
+    msFreeCharArray(*names, *numnames);
+    *names = NULL;
+    *numnames = 0;
+    return MS_FALSE;
+  }
+  return MS_TRUE;
+}
+
+/*
+** With MS_MAP_LAZY_LAYERS=ON in the environment only the layers the request
+** names are loaded, see msLoadMapLayers(). Otherwise with MS_MAP_CACHE=ON the
+** parsed mapfile is kept for the whole process and each request works on a
+** copy, see msLoadMapCached().
+*/
+static mapObj *msCGIReadMapFile(mapservObj *mapserv, char *filename)
+{
+  if(msCGIIsEnabled("MS_MAP_LAZY_LAYERS")) {
+    char **names;
+    int numnames;
+    mapObj *map;
+
+    msCGIGetRequestLayers(mapserv, &names, &numnames);
+    map = msLoadMapLayers(filename, names, numnames);
+    msFreeCharArray(names, numnames);
+    return map;
+  }
+  if(msCGIIsEnabled("MS_MAP_CACHE"))
+    return msLoadMapCached(filename);
+  return msLoadMap(filename, NULL);
+}
+
+static mapObj *msCGILoadMapFile(mapservObj *mapserv, char *filename)
+{
+  msFree(mapserv->MapFile);
+  mapserv->MapFile = msStrdup(filename);
+
+  return msCGIReadMapFile(mapserv, filename);
+}
+
+/*
+** Warm up for long running processes, called before accepting requests:
+** the mapfiles listed (comma separated) in the MS_WARMUP_MAPFILES
+** environment variable are loaded, through the map cache if enabled, and
+** handed to msWarmupMap() which honours their CONFIG "MS_WARMUP". The
+** capabilities listed in their "ows_capabilities_precompute" metadata are
+** then cached, see msOWSPrecomputeCapabilities().
+*/
+void msCGIWarmup(void)
+{
+  const char *list = getenv("MS_WARMUP_MAPFILES");
+  struct mstimeval starttime, endtime;
+  char **files;
+  int i, n;
+
+  if(!list || !*list)
+    return;
+
+  msGettimeofday(&starttime, NULL);
+  files = msStringSplit(list, ',', &n);
+  for(i=0; i<n; i++) {
+    mapObj *map;
+
+    msStringTrim(files[i]);
+    if(!*files[i])
+      continue;
+    map = msCGIReadMapFile(NULL, files[i]);
+    if(!map) {
+      msDebug("msCGIWarmup(): failed to load %s.\n", files[i]);
+      msResetErrorList();
+      continue;
+    }
+    msWarmupMap(map);
+    msOWSPrecomputeCapabilities(map, files[i]);
+    msFreeMap(map);
+  }
+  msFreeCharArray(files, n);
+
+  if(msGetGlobalDebugLevel() >= MS_DEBUGLEVEL_TUNING) {
+    msGettimeofday(&endtime, NULL);
+    msDebug("msCGIWarmup(): %.3fs\n", (endtime.tv_sec+endtime.tv_usec/1.0e6)-
+            (starttime.tv_sec+starttime.tv_usec/1.0e6));
+  }
+}
+
 /*
 ** Extract Map File name from params and load it.
 ** Returns map object or NULL on error.
@@ -198,41 +328,51 @@ mapObj *msCGILoadMap(mapservObj *mapserv)
 {
   int i, j;
   mapObj *map = NULL;
+  const char *value, *partial;
 
   for(i=0; i<mapserv->request->NumParams; i++) /* find the mapfile parameter first */
     if(strcasecmp(mapserv->request->ParamNames[i], "map") == 0) break;
 
   if(i == mapserv->request->NumParams) {
-    char *ms_mapfile = getenv("MS_MAPFILE");
+    char *ms_mapfile = msIO_getenv("MS_MAPFILE");
     if(ms_mapfile) {
-      map = msLoadMap(ms_mapfile,NULL);
+      map = msCGILoadMapFile(mapserv, ms_mapfile);
     } else {
       msSetError(MS_WEBERR, "CGI variable \"map\" is not set.", "msCGILoadMap()"); /* no default, outta here */
       return NULL;
     }
   } else {
-    if(getenv(mapserv->request->ParamValues[i])) /* an environment variable references the actual file to use */
-      map = msLoadMap(getenv(mapserv->request->ParamValues[i]), NULL);
+    if(msIO_getenv(mapserv->request->ParamValues[i])) /* an environment variable references the actual file to use */
+      map = msCGILoadMapFile(mapserv, msIO_getenv(mapserv->request->ParamValues[i]));
     else {
       /* by here we know the request isn't for something in an environment variable */
-      if(getenv("MS_MAP_NO_PATH")) {
+      if(msIO_getenv("MS_MAP_NO_PATH")) {
         msSetError(MS_WEBERR, "Mapfile not found in environment variables and this server is not configured for full paths.", "msCGILoadMap()");
         return NULL;
       }
 
-      if(getenv("MS_MAP_PATTERN") && msEvalRegex(getenv("MS_MAP_PATTERN"), mapserv->request->ParamValues[i]) != MS_TRUE) {
+      if(msIO_getenv("MS_MAP_PATTERN") && msEvalRegex(msIO_getenv("MS_MAP_PATTERN"), mapserv->request->ParamValues[i]) != MS_TRUE) {
         msSetError(MS_WEBERR, "Parameter 'map' value fails to validate.", "msCGILoadMap()");
         return NULL;
       }
 
       /* ok to try to load now */
-      map = msLoadMap(mapserv->request->ParamValues[i], NULL);
+      map = msCGILoadMapFile(mapserv, mapserv->request->ParamValues[i]);
     }
   }
   
 
   if(!map) return NULL;
 
+  /* time budget of the request, polled by the drawing and query loops */
+  value = msGetConfigOption(map, "MS_REQUEST_TIMEOUT");
+  partial = msGetConfigOption(map, "MS_REQUEST_TIMEOUT_PARTIAL");
+  msIO_setRequestDeadline(value ? atof(value) : 0, partial && strcasecmp(partial, "ON") == 0);
+
+  /* memory cap of the request, in megabytes, see msIO_setRequestMemoryLimit() */
+  value = msGetConfigOption(map, "MS_REQUEST_MEMORY_LIMIT");
+  msIO_setRequestMemoryLimit(value ? (size_t) (atof(value) * 1024 * 1024) : 0);
+
   if(!msLookupHashTable(&(map->web.validation), "immutable")) {
     /* check for any %variable% substitutions here, also do any map_ changes, we do this here so WMS/WFS  */
     /* services can take advantage of these "vendor specific" extensions */
@@ -309,7 +449,7 @@ int msCGISetMode(mapservObj *mapserv)
   int i, j;
 
 
-  mode = getenv("MS_MODE");
+  mode = msIO_getenv("MS_MODE");
   for( i=0; i<mapserv->request->NumParams; i++ ) {
     if(strcasecmp(mapserv->request->ParamNames[i], "mode") == 0) {
       mode = mapserv->request->ParamValues[i];
@@ -1487,8 +1627,10 @@ int msCGIDispatchQueryRequest(mapservObj *mapserv)
   if(msReturnTemplateQuery(mapserv, mapserv->map->web.queryformat, NULL) != MS_SUCCESS) return MS_FAILURE;
 
   if(mapserv->savequery) {
+    /* CONFIG "MS_QUERYFILE_RESULTS" "ON" saves the results, follow-up requests then load them instead of querying again */
+    const char *results = msGetConfigOption(mapserv->map, "MS_QUERYFILE_RESULTS");
     snprintf(buffer, sizeof(buffer), "%s%s%s%s", mapserv->map->web.imagepath, mapserv->map->name, mapserv->Id, MS_QUERY_EXTENSION);
-    if((status = msSaveQuery(mapserv->map, buffer, MS_FALSE)) != MS_SUCCESS) return status;
+    if((status = msSaveQuery(mapserv->map, buffer, results && strcasecmp(results, "ON") == 0)) != MS_SUCCESS) return status;
   }
   return MS_SUCCESS;
 }
@@ -1497,6 +1639,43 @@ int msCGIDispatchImageRequest(mapservObj *mapserv)
 {
   int status;
   imageObj *img = NULL;
+  msCoalesceObj *coalesce = NULL;
+  const char *mimetype;
+  unsigned char *data = NULL;
+  int size = 0, tilecached = MS_FALSE;
+  char *cachedtype = NULL;
+
+  /* tiles may be in the tile cache, identical concurrent map and tile requests are rendered once */
+  if(mapserv->Mode == TILE)
+    tilecached = msTileCacheGet(mapserv, &data, &size, &cachedtype);
+  if(!tilecached && ((mapserv->Mode == MAP && !mapserv->QueryFile) || mapserv->Mode == TILE))
+    coalesce = msCoalesceBegin(mapserv->map, mapserv->MapFile, mapserv->request->ParamNames,
+                               mapserv->request->ParamValues, mapserv->request->NumParams);
+
+  if(tilecached || msCoalesceGetMimeType(coalesce)) {
+    if(mapserv->sendheaders) {
+      const char *attachment = msGetOutputFormatOption(mapserv->map->outputformat, "ATTACHMENT", NULL );
+      if(msLookupHashTable(&(mapserv->map->web.metadata), "http_max_age"))
+        msIO_setHeader("Cache-Control","max-age=%s", msLookupHashTable(&(mapserv->map->web.metadata), "http_max_age"));
+      if(attachment)
+        msIO_setHeader("Content-disposition","attachment; filename=%s", attachment);
+      msIO_setHeader("Content-Type","%s", tilecached ? cachedtype : msCoalesceGetMimeType(coalesce));
+      msIO_sendHeaders();
+    }
+    if(tilecached) {
+      if(msIO_needBinaryStdout() == MS_FAILURE || msIO_fwrite(data, 1, size, stdout) != size)
+        status = MS_FAILURE;
+      else
+        status = MS_SUCCESS;
+      msFree(data);
+      msFree(cachedtype);
+    } else {
+      status = msCoalesceWrite(coalesce);
+      msCoalesceEnd(coalesce);
+    }
+    return status;
+  }
+
   switch(mapserv->Mode) {
     case MAP:
       if(mapserv->QueryFile) {
@@ -1526,7 +1705,10 @@ int msCGIDispatchImageRequest(mapservObj *mapserv)
       break;
   }
 
-  if(!img) return MS_FAILURE;
+  if(!img) {
+    msCoalesceEnd(coalesce);
+    return MS_FAILURE;
+  }
 
   /*
    ** Set the Cache control headers if the option is set.
@@ -1535,23 +1717,40 @@ int msCGIDispatchImageRequest(mapservObj *mapserv)
     msIO_setHeader("Cache-Control","max-age=%s", msLookupHashTable(&(mapserv->map->web.metadata), "http_max_age"));
   }
 
+  if(!strcmp(MS_IMAGE_MIME_TYPE(mapserv->map->outputformat), "application/json"))
+    mimetype = "application/json; charset=utf-8";
+  else
+    mimetype = MS_IMAGE_MIME_TYPE(mapserv->map->outputformat);
+
   if(mapserv->sendheaders)  {
     const char *attachment = msGetOutputFormatOption(mapserv->map->outputformat, "ATTACHMENT", NULL );
     if(attachment)
       msIO_setHeader("Content-disposition","attachment; filename=%s", attachment);
 
-    if(!strcmp(MS_IMAGE_MIME_TYPE(mapserv->map->outputformat), "application/json")) {
-      msIO_setHeader("Content-Type","application/json; charset=utf-8");
-    } else {
-      msIO_setHeader("Content-Type","%s", MS_IMAGE_MIME_TYPE(mapserv->map->outputformat));
+    if(mapserv->map->stats && (mapserv->map->stats->output & MS_STATS_HEADER)) {
+      char *stats = msStatsToJSON(mapserv->map);
+      msIO_setHeader("X-MapServer-Stats","%s", stats);
+      msFree(stats);
     }
+
+    msIO_setHeader("Content-Type","%s", mimetype);
     msIO_sendHeaders();
   }
 
-  if( mapserv->Mode == MAP || mapserv->Mode == TILE )
+  if( coalesce || (mapserv->Mode == TILE && msTileCacheEnabled(mapserv->map)) ) {
+    /* keep the encoded image for the waiting requests and the tile cache */
+    status = msSaveImageCapture(mapserv->map, img, &data, &size);
+    if(status == MS_SUCCESS) {
+      msCoalesceSetImage(coalesce, data, size, mimetype);
+      if(mapserv->Mode == TILE && !msIO_isRequestOutputPartial())
+        msTileCachePut(mapserv, data, size, mimetype);
+    }
+    msFree(data);
+  } else if( mapserv->Mode == MAP || mapserv->Mode == TILE )
     status = msSaveImage(mapserv->map, img, NULL);
   else
     status = msSaveImage(NULL,img, NULL);
+  msCoalesceEnd(coalesce);
 
   if(status != MS_SUCCESS) return MS_FAILURE;
 
@@ -1691,6 +1890,16 @@ li_cleanup:
   return status;
 }
 
+/* msLegendDispatchCached() callback of the legend modes */
+static int msCGIDispatchLegendFunc(void *cbdata)
+{
+  mapservObj *mapserv = (mapservObj *) cbdata;
+
+  if(mapserv->Mode == LEGEND || mapserv->Mode == MAPLEGEND)
+    return msCGIDispatchLegendRequest(mapserv);
+  return msCGIDispatchLegendIconRequest(mapserv);
+}
+
 int msCGIDispatchRequest(mapservObj *mapserv)
 {
   int i;
@@ -1709,8 +1918,8 @@ int msCGIDispatchRequest(mapservObj *mapserv)
    ** process this as a regular MapServer request.
    */
   if((mapserv->Mode == -1 || mapserv->Mode == OWS || mapserv->Mode == WFS) &&
-      (status = msOWSDispatch(mapserv->map, mapserv->request,
-                              mapserv->Mode)) != MS_DONE  )  {
+      (status = msOWSDispatchCached(mapserv->map, mapserv->request,
+                                    mapserv->Mode, mapserv->MapFile)) != MS_DONE  )  {
     /*
      ** OWSDispatch returned either MS_SUCCESS or MS_FAILURE
      */
@@ -1792,10 +2001,15 @@ int msCGIDispatchRequest(mapservObj *mapserv)
     if(setExtent(mapserv) != MS_SUCCESS) return MS_FAILURE;
     if(checkWebScale(mapserv) != MS_SUCCESS) return MS_FAILURE;
     return msCGIDispatchImageRequest(mapserv);
-  } else if(mapserv->Mode == LEGEND || mapserv->Mode == MAPLEGEND) {
-    return msCGIDispatchLegendRequest(mapserv);
-  } else if(mapserv->Mode == LEGENDICON || mapserv->Mode == MAPLEGENDICON) {
-    return msCGIDispatchLegendIconRequest(mapserv);
+  } else if(mapserv->Mode == LEGEND || mapserv->Mode == MAPLEGEND ||
+            mapserv->Mode == LEGENDICON || mapserv->Mode == MAPLEGENDICON) {
+    const char *ttl = msLookupHashTable(&(mapserv->map->web.metadata), "legend_cache_ttl");
+
+    /* HTML legends point to images written for the request, they are not cached */
+    if(mapserv->map->legend.template && (mapserv->Mode == LEGEND || mapserv->Mode == MAPLEGEND))
+      ttl = NULL;
+    return msLegendDispatchCached(mapserv->map, mapserv->request, mapserv->MapFile, ttl ? atoi(ttl) : 0,
+                                  msCGIDispatchLegendFunc, mapserv);
   } else if(mapserv->Mode >= QUERY) {
     return msCGIDispatchQueryRequest(mapserv);
   } else if(mapserv->Mode == COORDINATE) {
@@ -1914,3 +2128,143 @@ end_request:
 
   return 0;
 }
+
+/*
+** State of one umnms_handle_request() call, handed to the msIO and
+** loadParams() callbacks.
+*/
+typedef struct {
+  umnms_request *request;
+  int aborted; /* the write callback failed */
+} umnmsCallObj;
+
+static int umnmsWrite(void *cbData, void *data, int byteCount)
+{
+  umnmsCallObj *call = (umnmsCallObj *) cbData;
+
+  if(call->aborted)
+    return -1;
+  if(call->request->write(call->request->user_data, data, byteCount) < 0) {
+    call->aborted = MS_TRUE;
+    return -1;
+  }
+  return byteCount;
+}
+
+static int umnmsCancelled(void *cbData)
+{
+  umnmsCallObj *call = (umnmsCallObj *) cbData;
+
+  if(call->aborted)
+    return MS_TRUE;
+  return call->request->cancel && call->request->cancel(call->request->user_data);
+}
+
+static char *umnmsGetEnv(const char *name, void *thread_context)
+{
+  umnms_request *request = ((umnmsCallObj *) thread_context)->request;
+
+  if(strcmp(name, "REQUEST_METHOD") == 0)
+    return request->post_body ? "POST" : "GET";
+  if(strcmp(name, "QUERY_STRING") == 0 && request->query_string)
+    return (char *) request->query_string;
+  if(strcmp(name, "CONTENT_TYPE") == 0 && request->content_type)
+    return (char *) request->content_type;
+  return msIO_getenv(name);
+}
+
+/*
+** Handles a request for an embedding server. Unlike msCGIHandler() the
+** response is written to the request's sink or handed over in
+** request->body, and the msIO handlers of the calling thread are left as
+** they were. Returns MS_SUCCESS, or MS_FAILURE if the request failed or
+** was cancelled, in which case the response holds the error report.
+*/
+int umnms_handle_request(umnms_request *request)
+{
+  umnmsCallObj call;
+  mapservObj *mapserv;
+  msIOContext saved_stdin, saved_stdout, saved_stderr, out;
+  msIOBuffer *buf = NULL;
+  char *post_data = NULL;
+  int status = MS_FAILURE;
+
+  call.request = request;
+  call.aborted = MS_FALSE;
+  request->body = NULL;
+  request->body_length = 0;
+
+  saved_stdin = *msIO_getHandler(stdin);
+  saved_stdout = *msIO_getHandler(stdout);
+  saved_stderr = *msIO_getHandler(stderr);
+
+  out.label = "umnms";
+  out.write_channel = MS_TRUE;
+  if(request->write) {
+    out.readWriteFunc = umnmsWrite;
+    out.cbData = &call;
+  } else {
+    out.label = "buffer";
+    out.readWriteFunc = msIO_bufferWrite;
+    out.cbData = buf = (msIOBuffer *) msSmallCalloc(sizeof(msIOBuffer), 1);
+  }
+  msIO_installHandlers(&saved_stdin, &out, &saved_stderr);
+  msIO_setRequestEnv(request->envp);
+  msIO_setRequestCancel(umnmsCancelled, &call);
+
+  mapserv = msAllocMapServObj();
+
+  if(request->post_body) {
+    /* loadParams() wants a nul terminated copy */
+    post_data = (char *) msSmallMalloc(request->post_length + 1);
+    memcpy(post_data, request->post_body, request->post_length);
+    post_data[request->post_length] = '\0';
+  }
+
+  mapserv->request->NumParams = loadParams(mapserv->request, umnmsGetEnv, post_data, request->post_length, &call);
+  if(mapserv->request->NumParams == -1) {
+    msCGIWriteError(mapserv);
+    goto end_request;
+  }
+
+  mapserv->map = msCGILoadMap(mapserv);
+  if(!mapserv->map) {
+    msCGIWriteError(mapserv);
+    goto end_request;
+  }
+
+  if(msCGIDispatchRequest(mapserv) != MS_SUCCESS) {
+    if(!call.aborted)
+      msCGIWriteError(mapserv);
+    goto end_request;
+  }
+
+  if(!msIO_isRequestCancelled() || msIO_isRequestOutputPartial())
+    status = MS_SUCCESS;
+
+end_request:
+  msCGIWriteLog(mapserv, MS_FALSE);
+  msFreeMapServObj(mapserv);
+  msFree(post_data);
+  msResetErrorList();
+
+  msIO_setRequestCancel(NULL, NULL);
+  msIO_setRequestDeadline(0, MS_FALSE);
+  msIO_setRequestEnv(NULL);
+  msIO_installHandlers(&saved_stdin, &saved_stdout, &saved_stderr);
+
+  if(buf) {
+    /* hand the capture block over to the caller */
+    if(buf->data) {
+      unsigned char *block = buf->data - buf->data_skip;
+
+      if(buf->data_skip)
+        memmove(block, buf->data, buf->data_offset);
+      request->body = block;
+      request->body_length = buf->data_offset;
+    }
+    free(buf);
+  }
+
+  return status;
+}
@@ -34,10 +34,17 @@
  * DEALINGS IN THE SOFTWARE.
  ****************************************************************************/
 
+#include <ctype.h>
 #include <limits.h>
 #include <assert.h>
 #include "mapserver.h"
 #include "mapows.h"
+#include "mapthread.h"
+#include <sys/stat.h>
+
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#endif
 
 #if defined(USE_GDAL) || defined(USE_OGR)
 #include <cpl_conv.h>
@@ -230,6 +237,12 @@ SHPHandle msSHPOpen( const char * pszLayer, const char * pszAccess )
   psSHP->panParts = NULL;
   psSHP->nBufSize = psSHP->nPartMax = 0;
 
+  psSHP->pabySHPMap = psSHP->pabySHXMap = NULL;
+  psSHP->nSHPMapSize = psSHP->nSHXMapSize = 0;
+
+  psSHP->pabyReadAhead = NULL;
+  psSHP->nReadAheadOffset = psSHP->nReadAheadSize = psSHP->nReadAheadMax = 0;
+
   /* -------------------------------------------------------------------- */
   /*  Compute the base (layer) name.  If there is any extension     */
   /*  on the passed in filename we will strip it off.         */
@@ -422,6 +435,14 @@ void msSHPClose(SHPHandle psSHP )
 
   free(psSHP->pabyRec);
   free(psSHP->panParts);
+  free(psSHP->pabyReadAhead);
+
+#ifdef HAVE_MMAP
+  if( psSHP->pabySHPMap )
+    munmap( psSHP->pabySHPMap, psSHP->nSHPMapSize );
+  if( psSHP->pabySHXMap )
+    munmap( psSHP->pabySHXMap, psSHP->nSHXMapSize );
+#endif
 
   fclose( psSHP->fpSHX );
   fclose( psSHP->fpSHP );
@@ -429,6 +450,58 @@ void msSHPClose(SHPHandle psSHP )
   free( psSHP );
 }
 
+#ifdef HAVE_MMAP
+/*
+** Map a whole file read-only, returns NULL if that isn't possible.
+*/
+static uchar *msSHPMapFile( FILE *fp, size_t *pnSize )
+{
+  struct stat sStat;
+  void *pMap;
+
+  if( fstat( fileno(fp), &sStat ) != 0 || sStat.st_size <= 0 )
+    return NULL;
+
+  pMap = mmap( NULL, (size_t) sStat.st_size, PROT_READ, MAP_SHARED, fileno(fp), 0 );
+  if( pMap == MAP_FAILED )
+    return NULL;
+
+  *pnSize = (size_t) sStat.st_size;
+  return (uchar *) pMap;
+}
+#endif
+
+/************************************************************************/
+/*                            msSHPMapFiles()                           */
+/*                                                                      */
+/*      Map the .shp and .shx files of a read-only handle into memory.  */
+/*      Records are then decoded straight from the page cache instead   */
+/*      of going through fseek()/fread() and the record buffer. If      */
+/*      mapping isn't supported (or fails) MS_FAILURE is returned       */
+/*      without setting an error and the stdio path keeps being used.   */
+/************************************************************************/
+int msSHPMapFiles( SHPHandle psSHP )
+{
+#ifdef HAVE_MMAP
+  if( psSHP->bUpdated )
+    return MS_FAILURE;
+
+  if( psSHP->pabySHPMap == NULL )
+    psSHP->pabySHPMap = msSHPMapFile( psSHP->fpSHP, &psSHP->nSHPMapSize );
+  if( psSHP->pabySHPMap == NULL )
+    return MS_FAILURE;
+
+  /* the .shx is optional here, offsets can still be paged in with msSHXLoadPage() */
+  if( psSHP->pabySHXMap == NULL )
+    psSHP->pabySHXMap = msSHPMapFile( psSHP->fpSHX, &psSHP->nSHXMapSize );
+
+  return MS_SUCCESS;
+#else
+  (void) psSHP;
+  return MS_FAILURE;
+#endif
+}
+
 /************************************************************************/
 /*                             msSHPGetInfo()                           */
 /*                                                                      */
@@ -1043,12 +1116,109 @@ static int msSHPReadAllocateBuffer( SHPHandle psSHP, int hEntity, const char* ps
   return MS_SUCCESS;
 }
 
+/*
+** msSHPReadRecord() - Return a pointer to the nEntitySize bytes of a record,
+** either directly in the mapped .shp file or read into the record buffer.
+*/
+static uchar *msSHPReadRecord( SHPHandle psSHP, int hEntity, int nEntitySize, const char* pszCallingFunction)
+{
+  int nOffset = msSHXReadOffset( psSHP, hEntity);
+
+  if( psSHP->pabySHPMap ) {
+    if( nOffset < 0 || (size_t) nOffset + nEntitySize > psSHP->nSHPMapSize ) {
+      msSetError(MS_SHPERR, "Corrupted feature encountered.  hEntity=%d, nEntitySize=%d", pszCallingFunction,
+                 hEntity, nEntitySize);
+      return NULL;
+    }
+    return psSHP->pabySHPMap + nOffset;
+  }
+
+  if( psSHP->nReadAheadSize > 0 && nOffset >= psSHP->nReadAheadOffset &&
+      nOffset + nEntitySize <= psSHP->nReadAheadOffset + psSHP->nReadAheadSize )
+    return psSHP->pabyReadAhead + (nOffset - psSHP->nReadAheadOffset);
+
+  if (msSHPReadAllocateBuffer(psSHP, hEntity, pszCallingFunction) == MS_FAILURE) {
+    return NULL;
+  }
+
+  if( 0 != fseek( psSHP->fpSHP, nOffset, 0 )) {
+    msSetError(MS_IOERR, "failed to seek offset", pszCallingFunction);
+    return NULL;
+  }
+  if( 1 != fread( psSHP->pabyRec, nEntitySize, 1, psSHP->fpSHP )) {
+    msSetError(MS_IOERR, "failed to fread record", pszCallingFunction);
+    return NULL;
+  }
+
+  return psSHP->pabyRec;
+}
+
+#define MS_SHP_READAHEAD_MAX 262144 /* largest run of records read at once */
+#define MS_SHP_READAHEAD_GAP 4096 /* largest hole allowed between two records of a run */
+
+/*
+** msSHPReadAhead() - Read the records of the leading entities of panEntities
+** (ascending) that lie close together in the .shp file with a single fread,
+** later record reads are then served from memory until the next call.
+** Returns the number of entities covered, 0 if nothing was read ahead.
+*/
+int msSHPReadAhead( SHPHandle psSHP, const int *panEntities, int nEntities )
+{
+  int i, nStart = 0, nEnd = 0, nCount = 0;
+
+  psSHP->nReadAheadSize = 0;
+
+  if( psSHP->pabySHPMap || nEntities < 2 )
+    return 0; /* nothing to gain */
+
+  for( i=0; i<nEntities; i++ ) {
+    int nOffset, nSize;
+
+    if( panEntities[i] < 0 || panEntities[i] >= psSHP->nRecords )
+      break;
+
+    nOffset = msSHXReadOffset( psSHP, panEntities[i] );
+    nSize = msSHXReadSize( psSHP, panEntities[i] ) + 8;
+    if( nOffset < 0 || nSize < 8 || nSize > MS_SHP_READAHEAD_MAX )
+      break;
+
+    if( i > 0 && (nOffset < nEnd || nOffset - nEnd > MS_SHP_READAHEAD_GAP ||
+                  nOffset + nSize - nStart > MS_SHP_READAHEAD_MAX) )
+      break;
+
+    if( i == 0 ) nStart = nOffset;
+    nEnd = nOffset + nSize;
+    nCount++;
+  }
+
+  if( nCount < 2 )
+    return 0;
+
+  if( nEnd - nStart > psSHP->nReadAheadMax ) {
+    uchar *pabyReadAhead = (uchar *) realloc( psSHP->pabyReadAhead, nEnd - nStart );
+    if( pabyReadAhead == NULL )
+      return 0; /* records will be read one by one */
+    psSHP->pabyReadAhead = pabyReadAhead;
+    psSHP->nReadAheadMax = nEnd - nStart;
+  }
+
+  if( 0 != fseek( psSHP->fpSHP, nStart, 0 ) ||
+      1 != fread( psSHP->pabyReadAhead, nEnd - nStart, 1, psSHP->fpSHP ) )
+    return 0; /* let the single record reads report the error */
+
+  psSHP->nReadAheadOffset = nStart;
+  psSHP->nReadAheadSize = nEnd - nStart;
+
+  return nCount;
+}
+
 /*
 ** msSHPReadPoint() - Reads a single point from a POINT shape file.
 */
 int msSHPReadPoint( SHPHandle psSHP, int hEntity, pointObj *point )
 {
   int nEntitySize;
+  const uchar *pabyRec;
 
   /* -------------------------------------------------------------------- */
   /*      Only valid for point shapefiles                                 */
@@ -1077,25 +1247,15 @@ int msSHPReadPoint( SHPHandle psSHP, int hEntity, pointObj *point )
     return(MS_FAILURE);
   }
 
-  if (msSHPReadAllocateBuffer(psSHP, hEntity, "msSHPReadPoint()") == MS_FAILURE) {
-    return MS_FAILURE;
-  }
-
   /* -------------------------------------------------------------------- */
   /*      Read the record.                                                */
   /* -------------------------------------------------------------------- */
-  if( 0 != fseek( psSHP->fpSHP, msSHXReadOffset( psSHP, hEntity), 0 )) {
-    msSetError(MS_IOERR, "failed to seek offset", "msSHPReadPoint()");
-    return(MS_FAILURE);
-  }
-  if( 1 != fread( psSHP->pabyRec, nEntitySize, 1, psSHP->fpSHP )) {
-    msSetError(MS_IOERR, "failed to fread record", "msSHPReadPoint()");
+  pabyRec = msSHPReadRecord( psSHP, hEntity, nEntitySize, "msSHPReadPoint()" );
+  if( pabyRec == NULL )
     return(MS_FAILURE);
-  }
-
 
-  memcpy( &(point->x), psSHP->pabyRec + 12, 8 );
-  memcpy( &(point->y), psSHP->pabyRec + 20, 8 );
+  memcpy( &(point->x), pabyRec + 12, 8 );
+  memcpy( &(point->y), pabyRec + 20, 8 );
 
   if( bBigEndian ) {
     SwapWord( 8, &(point->x));
@@ -1203,6 +1363,25 @@ int msSHXLoadAll( SHPHandle psSHP )
 
 }
 
+/*
+** msSHXReadMapped() - Read one of the two words of a SHX record from the
+** mapped .shx file, returned in bytes. Returns -1 if the record isn't mapped.
+*/
+static int msSHXReadMapped( SHPHandle psSHP, int hEntity, int iWord )
+{
+  ms_int32 nValue;
+  size_t nOffset = 100 + (size_t) hEntity * 8 + iWord * 4;
+
+  if( psSHP->pabySHXMap == NULL || nOffset + 4 > psSHP->nSHXMapSize )
+    return -1;
+
+  memcpy( &nValue, psSHP->pabySHXMap + nOffset, 4 );
+  if( !bBigEndian )
+    nValue = SWAP_FOUR_BYTES( nValue );
+
+  return nValue * 2;
+}
+
 int msSHXReadOffset( SHPHandle psSHP, int hEntity )
 {
 
@@ -1212,6 +1391,12 @@ int msSHXReadOffset( SHPHandle psSHP, int hEntity )
   if( hEntity < 0 || hEntity >= psSHP->nRecords )
     return(MS_FAILURE);
 
+  if( psSHP->pabySHXMap ) {
+    int nOffset = msSHXReadMapped( psSHP, hEntity, 0 );
+    if( nOffset >= 0 )
+      return nOffset;
+  }
+
   if( ! (psSHP->panRecAllLoaded || msGetBit(psSHP->panRecLoaded, shxBufferPage)) ) {
     msSHXLoadPage( psSHP, shxBufferPage );
   }
@@ -1229,6 +1414,12 @@ int msSHXReadSize( SHPHandle psSHP, int hEntity )
   if( hEntity < 0 || hEntity >= psSHP->nRecords )
     return(MS_FAILURE);
 
+  if( psSHP->pabySHXMap ) {
+    int nSize = msSHXReadMapped( psSHP, hEntity, 1 );
+    if( nSize >= 0 )
+      return nSize;
+  }
+
   if( ! (psSHP->panRecAllLoaded || msGetBit(psSHP->panRecLoaded, shxBufferPage)) ) {
     msSHXLoadPage( psSHP, shxBufferPage );
   }
@@ -1238,15 +1429,17 @@ int msSHXReadSize( SHPHandle psSHP, int hEntity )
 }
 
 /*
-** msSHPReadShape() - Reads the vertices for one shape from a shape file.
+** msSHPReadShapePooled() - Reads the vertices for one shape from a shape file,
+** the point and line arrays coming from pool if there is one.
 */
-void msSHPReadShape( SHPHandle psSHP, int hEntity, shapeObj *shape )
+void msSHPReadShapePooled( SHPHandle psSHP, int hEntity, shapeObj *shape, shapePoolObj *pool )
 {
   int i, j, k;
 #ifdef USE_POINT_Z_M
   int nOffset = 0;
 #endif
   int nEntitySize, nRequiredSize;
+  const uchar *pabyRec;
 
   msInitShape(shape); /* initialize the shape */
 
@@ -1262,21 +1455,12 @@ void msSHPReadShape( SHPHandle psSHP, int hEntity, shapeObj *shape )
   }
 
   nEntitySize = msSHXReadSize(psSHP, hEntity) + 8;
-  if (msSHPReadAllocateBuffer(psSHP, hEntity, "msSHPReadShape()") == MS_FAILURE) {
-    shape->type = MS_SHAPE_NULL;
-    return;
-  }
 
   /* -------------------------------------------------------------------- */
   /*      Read the record.                                                */
   /* -------------------------------------------------------------------- */
-  if( 0 != fseek( psSHP->fpSHP, msSHXReadOffset( psSHP, hEntity), 0 )) {
-    msSetError(MS_IOERR, "failed to seek offset", "msSHPReadShape()");
-    shape->type = MS_SHAPE_NULL;
-    return;
-  }
-  if( 1 != fread( psSHP->pabyRec, nEntitySize, 1, psSHP->fpSHP )) {
-    msSetError(MS_IOERR, "failed to fread record", "msSHPReadPoint()");
+  pabyRec = msSHPReadRecord( psSHP, hEntity, nEntitySize, "msSHPReadShape()" );
+  if( pabyRec == NULL ) {
     shape->type = MS_SHAPE_NULL;
     return;
   }
@@ -1297,10 +1481,10 @@ void msSHPReadShape( SHPHandle psSHP, int hEntity, shapeObj *shape )
     }
 
     /* copy the bounding box */
-    memcpy( &shape->bounds.minx, psSHP->pabyRec + 8 + 4, 8 );
-    memcpy( &shape->bounds.miny, psSHP->pabyRec + 8 + 12, 8 );
-    memcpy( &shape->bounds.maxx, psSHP->pabyRec + 8 + 20, 8 );
-    memcpy( &shape->bounds.maxy, psSHP->pabyRec + 8 + 28, 8 );
+    memcpy( &shape->bounds.minx, pabyRec + 8 + 4, 8 );
+    memcpy( &shape->bounds.miny, pabyRec + 8 + 12, 8 );
+    memcpy( &shape->bounds.maxx, pabyRec + 8 + 20, 8 );
+    memcpy( &shape->bounds.maxy, pabyRec + 8 + 28, 8 );
 
     if( bBigEndian ) {
       SwapWord( 8, &shape->bounds.minx);
@@ -1309,8 +1493,8 @@ void msSHPReadShape( SHPHandle psSHP, int hEntity, shapeObj *shape )
       SwapWord( 8, &shape->bounds.maxy);
     }
 
-    memcpy( &nPoints, psSHP->pabyRec + 40 + 8, 4 );
-    memcpy( &nParts, psSHP->pabyRec + 36 + 8, 4 );
+    memcpy( &nPoints, pabyRec + 40 + 8, 4 );
+    memcpy( &nParts, pabyRec + 36 + 8, 4 );
 
     if( bBigEndian ) {
       nPoints = SWAP_FOUR_BYTES(nPoints);
@@ -1357,7 +1541,7 @@ void msSHPReadShape( SHPHandle psSHP, int hEntity, shapeObj *shape )
       return;
     }
 
-    memcpy( psSHP->panParts, psSHP->pabyRec + 44 + 8, 4 * nParts );
+    memcpy( psSHP->panParts, pabyRec + 44 + 8, 4 * nParts );
     if( bBigEndian ) {
       for( i = 0; i < nParts; i++ ) {
         *(psSHP->panParts+i) = SWAP_FOUR_BYTES(*(psSHP->panParts+i));
@@ -1367,7 +1551,7 @@ void msSHPReadShape( SHPHandle psSHP, int hEntity, shapeObj *shape )
     /* -------------------------------------------------------------------- */
     /*      Fill the shape structure.                                       */
     /* -------------------------------------------------------------------- */
-    shape->line = (lineObj *)malloc(sizeof(lineObj)*nParts);
+    shape->line = (lineObj *)msShapePoolAlloc(pool, sizeof(lineObj)*nParts);
     MS_CHECK_ALLOC_NO_RET(shape->line, sizeof(lineObj)*nParts);
 
     shape->numlines = nParts;
@@ -1390,7 +1574,7 @@ void msSHPReadShape( SHPHandle psSHP, int hEntity, shapeObj *shape )
         return;
       }
 
-      if( (shape->line[i].point = (pointObj *)malloc(sizeof(pointObj)*shape->line[i].numpoints)) == NULL ) {
+      if( (shape->line[i].point = (pointObj *)msShapePoolAlloc(pool, sizeof(pointObj)*shape->line[i].numpoints)) == NULL ) {
         while(--i >= 0)
           free(shape->line[i].point);
         free(shape->line);
@@ -1400,10 +1584,19 @@ void msSHPReadShape( SHPHandle psSHP, int hEntity, shapeObj *shape )
         return;
       }
 
+#ifndef USE_POINT_Z_M
+      /* pointObj is laid out exactly like the on-disk x/y pairs, copy the whole part at once */
+      if( !bBigEndian ) {
+        memcpy(shape->line[i].point, pabyRec + 44 + 4*nParts + 8 + k * 16, 16 * shape->line[i].numpoints );
+        k += shape->line[i].numpoints;
+        continue;
+      }
+#endif
+
       /* nOffset = 44 + 8 + 4*nParts; */
       for( j = 0; j < shape->line[i].numpoints; j++ ) {
-        memcpy(&(shape->line[i].point[j].x), psSHP->pabyRec + 44 + 4*nParts + 8 + k * 16, 8 );
-        memcpy(&(shape->line[i].point[j].y), psSHP->pabyRec + 44 + 4*nParts + 8 + k * 16 + 8, 8 );
+        memcpy(&(shape->line[i].point[j].x), pabyRec + 44 + 4*nParts + 8 + k * 16, 8 );
+        memcpy(&(shape->line[i].point[j].y), pabyRec + 44 + 4*nParts + 8 + k * 16 + 8, 8 );
 
         if( bBigEndian ) {
           SwapWord( 8, &(shape->line[i].point[j].x) );
@@ -1418,7 +1611,7 @@ void msSHPReadShape( SHPHandle psSHP, int hEntity, shapeObj *shape )
         if (psSHP->nShapeType == SHP_POLYGONZ || psSHP->nShapeType == SHP_ARCZ) {
           nOffset = 44 + 8 + (4*nParts) + (16*nPoints) ;
           if( nEntitySize >= nOffset + 16 + 8*nPoints ) {
-            memcpy(&(shape->line[i].point[j].z), psSHP->pabyRec + nOffset + 16 + k*8, 8 );
+            memcpy(&(shape->line[i].point[j].z), pabyRec + nOffset + 16 + k*8, 8 );
             if( bBigEndian ) SwapWord( 8, &(shape->line[i].point[j].z) );
           }
         }
@@ -1430,7 +1623,7 @@ void msSHPReadShape( SHPHandle psSHP, int hEntity, shapeObj *shape )
         if (psSHP->nShapeType == SHP_POLYGONM || psSHP->nShapeType == SHP_ARCM) {
           nOffset = 44 + 8 + (4*nParts) + (16*nPoints) ;
           if( nEntitySize >= nOffset + 16 + 8*nPoints ) {
-            memcpy(&(shape->line[i].point[j].m), psSHP->pabyRec + nOffset + 16 + k*8, 8 );
+            memcpy(&(shape->line[i].point[j].m), pabyRec + nOffset + 16 + k*8, 8 );
             if( bBigEndian ) SwapWord( 8, &(shape->line[i].point[j].m) );
           }
         }
@@ -1463,10 +1656,10 @@ void msSHPReadShape( SHPHandle psSHP, int hEntity, shapeObj *shape )
     }
 
     /* copy the bounding box */
-    memcpy( &shape->bounds.minx, psSHP->pabyRec + 8 + 4, 8 );
-    memcpy( &shape->bounds.miny, psSHP->pabyRec + 8 + 12, 8 );
-    memcpy( &shape->bounds.maxx, psSHP->pabyRec + 8 + 20, 8 );
-    memcpy( &shape->bounds.maxy, psSHP->pabyRec + 8 + 28, 8 );
+    memcpy( &shape->bounds.minx, pabyRec + 8 + 4, 8 );
+    memcpy( &shape->bounds.miny, pabyRec + 8 + 12, 8 );
+    memcpy( &shape->bounds.maxx, pabyRec + 8 + 20, 8 );
+    memcpy( &shape->bounds.maxy, pabyRec + 8 + 28, 8 );
 
     if( bBigEndian ) {
       SwapWord( 8, &shape->bounds.minx);
@@ -1475,13 +1668,13 @@ void msSHPReadShape( SHPHandle psSHP, int hEntity, shapeObj *shape )
       SwapWord( 8, &shape->bounds.maxy);
     }
 
-    memcpy( &nPoints, psSHP->pabyRec + 44, 4 );
+    memcpy( &nPoints, pabyRec + 44, 4 );
     if( bBigEndian ) nPoints = SWAP_FOUR_BYTES(nPoints);
 
     /* -------------------------------------------------------------------- */
     /*      Fill the shape structure.                                       */
     /* -------------------------------------------------------------------- */
-    if( (shape->line = (lineObj *)malloc(sizeof(lineObj))) == NULL ) {
+    if( (shape->line = (lineObj *)msShapePoolAlloc(pool, sizeof(lineObj))) == NULL ) {
       shape->type = MS_SHAPE_NULL;
       msSetError(MS_MEMERR, "Out of memory", "msSHPReadShape()");
       return;
@@ -1508,7 +1701,7 @@ void msSHPReadShape( SHPHandle psSHP, int hEntity, shapeObj *shape )
 
     shape->numlines = 1;
     shape->line[0].numpoints = nPoints;
-    shape->line[0].point = (pointObj *) malloc( nPoints * sizeof(pointObj) );
+    shape->line[0].point = (pointObj *) msShapePoolAlloc(pool, nPoints * sizeof(pointObj) );
     if (shape->line[0].point == NULL) {
       free(shape->line);
       shape->numlines = 0;
@@ -1518,8 +1711,8 @@ void msSHPReadShape( SHPHandle psSHP, int hEntity, shapeObj *shape )
     }
 
     for( i = 0; i < nPoints; i++ ) {
-      memcpy(&(shape->line[0].point[i].x), psSHP->pabyRec + 48 + 16 * i, 8 );
-      memcpy(&(shape->line[0].point[i].y), psSHP->pabyRec + 48 + 16 * i + 8, 8 );
+      memcpy(&(shape->line[0].point[i].x), pabyRec + 48 + 16 * i, 8 );
+      memcpy(&(shape->line[0].point[i].y), pabyRec + 48 + 16 * i + 8, 8 );
 
       if( bBigEndian ) {
         SwapWord( 8, &(shape->line[0].point[i].x) );
@@ -1533,7 +1726,7 @@ void msSHPReadShape( SHPHandle psSHP, int hEntity, shapeObj *shape )
       shape->line[0].point[i].z = 0; /* initialize */
       if (psSHP->nShapeType == SHP_MULTIPOINTZ) {
         nOffset = 48 + 16*nPoints;
-        memcpy(&(shape->line[0].point[i].z), psSHP->pabyRec + nOffset + 16 + i*8, 8 );
+        memcpy(&(shape->line[0].point[i].z), pabyRec + nOffset + 16 + i*8, 8 );
         if( bBigEndian ) SwapWord( 8, &(shape->line[0].point[i].z));
       }
 
@@ -1543,7 +1736,7 @@ void msSHPReadShape( SHPHandle psSHP, int hEntity, shapeObj *shape )
       shape->line[0].point[i].m = 0; /* initialize */
       if (psSHP->nShapeType == SHP_MULTIPOINTM) {
         nOffset = 48 + 16*nPoints;
-        memcpy(&(shape->line[0].point[i].m), psSHP->pabyRec + nOffset + 16 + i*8, 8 );
+        memcpy(&(shape->line[0].point[i].m), pabyRec + nOffset + 16 + i*8, 8 );
         if( bBigEndian ) SwapWord( 8, &(shape->line[0].point[i].m));
       }
 #endif /* USE_POINT_Z_M */
@@ -1568,15 +1761,15 @@ void msSHPReadShape( SHPHandle psSHP, int hEntity, shapeObj *shape )
     /* -------------------------------------------------------------------- */
     /*      Fill the shape structure.                                       */
     /* -------------------------------------------------------------------- */
-    shape->line = (lineObj *)malloc(sizeof(lineObj));
+    shape->line = (lineObj *)msShapePoolAlloc(pool, sizeof(lineObj));
     MS_CHECK_ALLOC_NO_RET(shape->line, sizeof(lineObj));
 
     shape->numlines = 1;
     shape->line[0].numpoints = 1;
-    shape->line[0].point = (pointObj *) msSmallMalloc(sizeof(pointObj));
+    shape->line[0].point = (pointObj *) msShapePoolAlloc(pool, sizeof(pointObj));
 
-    memcpy( &(shape->line[0].point[0].x), psSHP->pabyRec + 12, 8 );
-    memcpy( &(shape->line[0].point[0].y), psSHP->pabyRec + 20, 8 );
+    memcpy( &(shape->line[0].point[0].x), pabyRec + 12, 8 );
+    memcpy( &(shape->line[0].point[0].y), pabyRec + 20, 8 );
 
     if( bBigEndian ) {
       SwapWord( 8, &(shape->line[0].point[0].x));
@@ -1591,7 +1784,7 @@ void msSHPReadShape( SHPHandle psSHP, int hEntity, shapeObj *shape )
     if (psSHP->nShapeType == SHP_POINTZ) {
       nOffset = 20 + 8;
       if( nEntitySize >= nOffset + 8 ) {
-        memcpy(&(shape->line[0].point[0].z), psSHP->pabyRec + nOffset, 8 );
+        memcpy(&(shape->line[0].point[0].z), pabyRec + nOffset, 8 );
         if( bBigEndian ) SwapWord( 8, &(shape->line[0].point[0].z));
       }
     }
@@ -1603,7 +1796,7 @@ void msSHPReadShape( SHPHandle psSHP, int hEntity, shapeObj *shape )
     if (psSHP->nShapeType == SHP_POINTM) {
       nOffset = 20 + 8;
       if( nEntitySize >= nOffset + 8 ) {
-        memcpy(&(shape->line[0].point[0].m), psSHP->pabyRec + nOffset, 8 );
+        memcpy(&(shape->line[0].point[0].m), pabyRec + nOffset, 8 );
         if( bBigEndian ) SwapWord( 8, &(shape->line[0].point[0].m));
       }
     }
@@ -1621,6 +1814,14 @@ void msSHPReadShape( SHPHandle psSHP, int hEntity, shapeObj *shape )
   return;
 }
 
+/*
+** msSHPReadShape() - Reads the vertices for one shape from a shape file.
+*/
+void msSHPReadShape( SHPHandle psSHP, int hEntity, shapeObj *shape )
+{
+  msSHPReadShapePooled(psSHP, hEntity, shape, NULL);
+}
+
 int msSHPReadBounds( SHPHandle psSHP, int hEntity, rectObj *padBounds)
 {
   /* -------------------------------------------------------------------- */
@@ -1647,13 +1848,20 @@ int msSHPReadBounds( SHPHandle psSHP, int hEntity, rectObj *padBounds)
     }
 
     if( psSHP->nShapeType != SHP_POINT && psSHP->nShapeType != SHP_POINTZ && psSHP->nShapeType != SHP_POINTM) {
-      if( 0 != fseek( psSHP->fpSHP, msSHXReadOffset( psSHP, hEntity) + 12, 0 )) {
-        msSetError(MS_IOERR, "failed to seek offset", "msSHPReadBounds()");
-        return(MS_FAILURE);
-      }
-      if( 1 != fread( padBounds, sizeof(double)*4, 1, psSHP->fpSHP )) {
-        msSetError(MS_IOERR, "failed to fread record", "msSHPReadBounds()");
-        return(MS_FAILURE);
+      if( psSHP->pabySHPMap ) {
+        const uchar *pabyRec = msSHPReadRecord( psSHP, hEntity, 12 + sizeof(double)*4, "msSHPReadBounds()" );
+        if( pabyRec == NULL )
+          return(MS_FAILURE);
+        memcpy( padBounds, pabyRec + 12, sizeof(double)*4 );
+      } else {
+        if( 0 != fseek( psSHP->fpSHP, msSHXReadOffset( psSHP, hEntity) + 12, 0 )) {
+          msSetError(MS_IOERR, "failed to seek offset", "msSHPReadBounds()");
+          return(MS_FAILURE);
+        }
+        if( 1 != fread( padBounds, sizeof(double)*4, 1, psSHP->fpSHP )) {
+          msSetError(MS_IOERR, "failed to fread record", "msSHPReadBounds()");
+          return(MS_FAILURE);
+        }
       }
 
       if( bBigEndian ) {
@@ -1673,13 +1881,20 @@ int msSHPReadBounds( SHPHandle psSHP, int hEntity, rectObj *padBounds)
       /*      minimum and maximum bound.                                      */
       /* -------------------------------------------------------------------- */
 
-      if( 0 != fseek( psSHP->fpSHP, msSHXReadOffset( psSHP, hEntity) + 12, 0 )) {
-        msSetError(MS_IOERR, "failed to seek offset", "msSHPReadBounds()");
-        return(MS_FAILURE);
-      }
-      if( 1 != fread( padBounds, sizeof(double)*2, 1, psSHP->fpSHP )) {
-        msSetError(MS_IOERR, "failed to fread record", "msSHPReadBounds()");
-        return(MS_FAILURE);
+      if( psSHP->pabySHPMap ) {
+        const uchar *pabyRec = msSHPReadRecord( psSHP, hEntity, 12 + sizeof(double)*2, "msSHPReadBounds()" );
+        if( pabyRec == NULL )
+          return(MS_FAILURE);
+        memcpy( padBounds, pabyRec + 12, sizeof(double)*2 );
+      } else {
+        if( 0 != fseek( psSHP->fpSHP, msSHXReadOffset( psSHP, hEntity) + 12, 0 )) {
+          msSetError(MS_IOERR, "failed to seek offset", "msSHPReadBounds()");
+          return(MS_FAILURE);
+        }
+        if( 1 != fread( padBounds, sizeof(double)*2, 1, psSHP->fpSHP )) {
+          msSetError(MS_IOERR, "failed to fread record", "msSHPReadBounds()");
+          return(MS_FAILURE);
+        }
       }
 
       if( bBigEndian ) {
@@ -1709,8 +1924,15 @@ int msShapefileOpen(shapefileObj *shpfile, const char *mode, const char *filenam
 
   /* initialize a few things */
   shpfile->status = NULL;
+  shpfile->statusids = NULL;
+  shpfile->numstatusids = 0;
+  shpfile->nextstatusid = 0;
   shpfile->lastshape = -1;
   shpfile->isopen = MS_FALSE;
+  shpfile->dbfcache = NULL;
+  shpfile->hSHPGeneralized = NULL;
+  shpfile->generalizedband = 0;
+  shpfile->preload = NULL;
 
   /* open the shapefile file (appending ok) and get basic info */
   if(!mode)
@@ -1785,34 +2007,80 @@ int msShapefileCreate(shapefileObj *shpfile, char *filename, int type)
 
   /* initialize a few other things */
   shpfile->status = NULL;
+  shpfile->statusids = NULL;
+  shpfile->numstatusids = 0;
+  shpfile->nextstatusid = 0;
   shpfile->lastshape = -1;
   shpfile->isopen = MS_TRUE;
 
   shpfile->hDBF = NULL; /* XBase file is NOT created here... */
+  shpfile->dbfcache = NULL;
+  shpfile->hSHPGeneralized = NULL;
+  shpfile->generalizedband = 0;
+  shpfile->preload = NULL;
   return(0);
 }
 
+static void msSHPPreloadRelease(shpPreloadObj *preload);
+
 void msShapefileClose(shapefileObj *shpfile)
 {
   if (shpfile && shpfile->isopen == MS_TRUE) { /* Silently return if called with NULL shpfile by freeLayer() */
+    if(shpfile->preload) msSHPPreloadRelease(shpfile->preload);
+    shpfile->preload = NULL;
     if(shpfile->hSHP) msSHPClose(shpfile->hSHP);
+    if(shpfile->hSHPGeneralized) msSHPClose(shpfile->hSHPGeneralized);
+    shpfile->hSHPGeneralized = NULL;
+    shpfile->generalizedband = 0;
+    if(shpfile->dbfcache) msDBFColumnCacheRelease(shpfile->dbfcache);
+    shpfile->dbfcache = NULL;
     if(shpfile->hDBF) msDBFClose(shpfile->hDBF);
     free(shpfile->status);
+    free(shpfile->statusids);
+    shpfile->statusids = NULL;
     shpfile->isopen = MS_FALSE;
   }
 }
 
-/* status array lives in the shpfile, can return MS_SUCCESS/MS_FAILURE/MS_DONE */
+/* status array (or id list) lives in the shpfile, can return MS_SUCCESS/MS_FAILURE/MS_DONE */
+/*
+** Name of the .qix spatial index of a shapefile, to be freed by the caller.
+*/
+char *msShapefileIndexFilename(shapefileObj *shpfile)
+{
+  char *filename;
+  char *s = 0; /* pointer to start of '.shp' in source string */
+
+  /* deal with case where sourcename is of the form 'file.shp' */
+  filename = (char *) msSmallMalloc(strlen(shpfile->source)+strlen(MS_INDEX_EXTENSION)+1);
+  strcpy(filename, shpfile->source);
+  s = strstr(filename, ".shp");
+  if( s )
+    *s = '\0';
+  else {
+    s = strstr(filename, ".SHP");
+    if( s )
+      *s = '\0';
+  }
+
+  strcat(filename, MS_INDEX_EXTENSION);
+
+  return filename;
+}
+
 int msShapefileWhichShapes(shapefileObj *shpfile, rectObj rect, int debug)
 {
-  int i;
+  int i, bounds_checked;
   rectObj shaperect;
   char *filename;
-  char *sourcename = 0; /* shape file source string from map file */
-  char *s = 0; /* pointer to start of '.shp' in source string */
+  treeHitsObj hits;
 
   free(shpfile->status);
   shpfile->status = NULL;
+  free(shpfile->statusids);
+  shpfile->statusids = NULL;
+  shpfile->numstatusids = 0;
+  shpfile->nextstatusid = 0;
 
   shpfile->statusbounds = rect; /* save the search extent */
 
@@ -1828,29 +2096,23 @@ int msShapefileWhichShapes(shapefileObj *shpfile, rectObj rect, int debug)
     }
     msSetAllBits(shpfile->status, shpfile->numshapes, 1);
   } else {
+    filename = msShapefileIndexFilename(shpfile);
 
-    /* deal with case where sourcename is of the form 'file.shp' */
-    sourcename = msStrdup(shpfile->source);
-    s = strstr(sourcename, ".shp");
-    if( s )
-      *s = '\0';
-    else {
-      s = strstr(sourcename, ".SHP");
-      if( s )
-        *s = '\0';
-    }
-
-    filename = (char *)malloc(strlen(sourcename)+strlen(MS_INDEX_EXTENSION)+1);
-    MS_CHECK_ALLOC(filename, strlen(sourcename)+strlen(MS_INDEX_EXTENSION)+1, MS_FAILURE);
-
-    sprintf(filename, "%s%s", sourcename, MS_INDEX_EXTENSION);
-
-    shpfile->status = msSearchDiskTree(filename, rect, debug);
+    hits.maxids = 0; /* let the search pick the id list or the bit array */
+    i = msSearchDiskTreeHits(filename, rect, debug, &hits, &bounds_checked);
     free(filename);
-    free(sourcename);
 
-    if(shpfile->status) { /* index  */
-      msFilterTreeSearch(shpfile, shpfile->status, rect);
+    if(i == MS_SUCCESS && hits.status) { /* index, dense result */
+      shpfile->status = hits.status;
+      if(!bounds_checked)
+        msFilterTreeSearch(shpfile, shpfile->status, rect);
+    } else if(i == MS_SUCCESS) { /* index, sparse result */
+      shpfile->statusids = hits.ids;
+      shpfile->numstatusids = hits.numids;
+      if(!bounds_checked)
+        msFilterTreeSearchIds(shpfile, shpfile->statusids, &shpfile->numstatusids, rect);
+      if(shpfile->statusids == NULL) /* no hits */
+        shpfile->statusids = (int *) msSmallMalloc(sizeof(int));
     } else { /* no index  */
       shpfile->status = msAllocBitArray(shpfile->numshapes);
       if(!shpfile->status) {
@@ -1870,6 +2132,54 @@ int msShapefileWhichShapes(shapefileObj *shpfile, rectObj rect, int debug)
   return(MS_SUCCESS); /* success */
 }
 
+/*
+** Return the first shape at or after start selected by the last
+** msShapefileWhichShapes() call, or -1 if there are none left.
+*/
+int msShapefileNextSelected(shapefileObj *shpfile, int start)
+{
+  int lo, hi;
+
+  if(!shpfile->statusids) {
+    if(!shpfile->status) return(-1);
+    return(msGetNextBit(shpfile->status, start, shpfile->numshapes));
+  }
+
+  /* usually called in sequence, otherwise binary search the list */
+  lo = shpfile->nextstatusid;
+  if(lo > shpfile->numstatusids || (lo > 0 && shpfile->statusids[lo-1] >= start))
+    lo = 0;
+  if(lo < shpfile->numstatusids && shpfile->statusids[lo] < start) {
+    hi = shpfile->numstatusids;
+    while(lo < hi) {
+      int mid = lo + (hi - lo) / 2;
+      if(shpfile->statusids[mid] < start)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+  }
+
+  if(lo >= shpfile->numstatusids) {
+    shpfile->nextstatusid = shpfile->numstatusids;
+    return(-1);
+  }
+  shpfile->nextstatusid = lo + 1;
+  return(shpfile->statusids[lo]);
+}
+
+/*
+** Is shape i selected by the last msShapefileWhichShapes() call?
+*/
+int msShapefileIsSelected(shapefileObj *shpfile, int i)
+{
+  if(!shpfile->statusids) {
+    if(!shpfile->status || i < 0 || i >= shpfile->numshapes) return(MS_FALSE);
+    return(msGetBit(shpfile->status, i));
+  }
+  return(msShapefileNextSelected(shpfile, i) == i);
+}
+
 /* Return the absolute path to the given layer's tileindex file's directory */
 void msTileIndexAbsoluteDir(char *tiFileAbsDir, layerObj *layer)
 {
@@ -1882,6 +2192,196 @@ void msTileIndexAbsoluteDir(char *tiFileAbsDir, layerObj *layer)
   free(tiFileAbsDirTmp);
 }
 
+/* -------------------------------------------------------------------- */
+/*      Process wide cache of open tile shapefiles, enabled with the    */
+/*      MS_SHAPEFILE_TILE_CACHE config option, so that tiled layers     */
+/*      don't reopen (and re-read the headers of) the same tiles on     */
+/*      every request. Entries are keyed on the path the tile was       */
+/*      opened with and are invalidated when the .shp modification      */
+/*      time or size changes. A tile is only used by one layer at a     */
+/*      time (in_use), idle ones are closed least recently used first.  */
+/*                                                                      */
+/*      These static structures are protected by the TLOCK_TILECACHE    */
+/*      mutex.                                                          */
+/* -------------------------------------------------------------------- */
+#define MS_TILE_CACHE_MAX 64
+
+typedef struct {
+  char *path;
+  time_t mtime;
+  off_t size;
+  int in_use;
+  int stale;
+  unsigned long last_used;
+  shapefileObj tile; /* open handles, never has a status array */
+} tileShapefileCacheObj;
+
+static int tileShapefileCacheCount = 0;
+static unsigned long tileShapefileCacheClock = 0;
+static tileShapefileCacheObj tileShapefileCache[MS_TILE_CACHE_MAX];
+
+static void tileShapefileCacheRemove(int i)
+{
+  msShapefileClose(&tileShapefileCache[i].tile);
+  free(tileShapefileCache[i].path);
+
+  tileShapefileCacheCount--;
+  if( i != tileShapefileCacheCount )
+    tileShapefileCache[i] = tileShapefileCache[tileShapefileCacheCount];
+}
+
+/*
+** stat() the .shp file msSHPOpen() would open for path.
+*/
+static int shapefileStat(const char *path, struct stat *sStat)
+{
+  char *shpFilename;
+  int i, status;
+
+  shpFilename = (char *) msSmallMalloc(strlen(path) + 5);
+  strcpy(shpFilename, path);
+  for( i = strlen(shpFilename) - 1;
+       i > 0 && shpFilename[i] != '.' && shpFilename[i] != '/' && shpFilename[i] != '\\';
+       i-- ) {}
+  if( shpFilename[i] == '.' )
+    shpFilename[i] = '\0';
+
+  i = strlen(shpFilename);
+  strcpy(shpFilename + i, ".shp");
+  status = stat(shpFilename, sStat);
+  if( status != 0 ) {
+    strcpy(shpFilename + i, ".SHP");
+    status = stat(shpFilename, sStat);
+  }
+  free(shpFilename);
+
+  return (status == 0) ? MS_SUCCESS : MS_FAILURE;
+}
+
+/*
+** Open a tile, taking an idle one from the cache if possible. Same return
+** values as msShapefileOpen().
+*/
+static int msTiledSHPOpenTile(shapefileObj *shpfile, layerObj *layer, const char *path, int log_failures)
+{
+  int i, slot = -1;
+  struct stat sStat;
+
+  if( !msTestConfigOption(layer->map, "MS_SHAPEFILE_TILE_CACHE", MS_FALSE) ||
+      shapefileStat(path, &sStat) != MS_SUCCESS ) {
+    if( msShapefileOpen(shpfile, "rb", path, log_failures) == -1 )
+      return(-1);
+    if( msTestConfigOption(layer->map, "MS_SHAPEFILE_MMAP", MS_FALSE) )
+      msSHPMapFiles(shpfile->hSHP);
+    return(0);
+  }
+
+  msAcquireLock( TLOCK_TILECACHE );
+  for( i = tileShapefileCacheCount - 1; i >= 0; i-- ) {
+    tileShapefileCacheObj *entry = tileShapefileCache + i;
+
+    if( strcmp(entry->path, path) != 0 )
+      continue;
+
+    if( entry->mtime != sStat.st_mtime || entry->size != sStat.st_size ) {
+      /* the tile has been rewritten, drop the old handle(s) */
+      if( entry->in_use )
+        entry->stale = MS_TRUE;
+      else
+        tileShapefileCacheRemove(i);
+      continue;
+    }
+
+    if( !entry->in_use && !entry->stale ) {
+      entry->in_use = MS_TRUE;
+      entry->last_used = ++tileShapefileCacheClock;
+      *shpfile = entry->tile;
+      msReleaseLock( TLOCK_TILECACHE );
+      return(0);
+    }
+  }
+  msReleaseLock( TLOCK_TILECACHE );
+
+  if( msShapefileOpen(shpfile, "rb", path, log_failures) == -1 )
+    return(-1);
+  if( msTestConfigOption(layer->map, "MS_SHAPEFILE_MMAP", MS_FALSE) )
+    msSHPMapFiles(shpfile->hSHP);
+
+  /* -------------------------------------------------------------------- */
+  /*      Register the new tile, evicting the least recently used idle    */
+  /*      one if the cache is full.                                       */
+  /* -------------------------------------------------------------------- */
+  msAcquireLock( TLOCK_TILECACHE );
+  if( tileShapefileCacheCount == MS_TILE_CACHE_MAX ) {
+    for( i = 0; i < tileShapefileCacheCount; i++ ) {
+      if( !tileShapefileCache[i].in_use &&
+          (slot == -1 || tileShapefileCache[i].last_used < tileShapefileCache[slot].last_used) )
+        slot = i;
+    }
+    if( slot != -1 )
+      tileShapefileCacheRemove(slot);
+  }
+  if( tileShapefileCacheCount < MS_TILE_CACHE_MAX ) {
+    tileShapefileCacheObj *entry = tileShapefileCache + tileShapefileCacheCount++;
+    entry->path = msStrdup(path);
+    entry->mtime = sStat.st_mtime;
+    entry->size = sStat.st_size;
+    entry->in_use = MS_TRUE;
+    entry->stale = MS_FALSE;
+    entry->last_used = ++tileShapefileCacheClock;
+    entry->tile = *shpfile;
+  }
+  msReleaseLock( TLOCK_TILECACHE );
+
+  return(0);
+}
+
+/*
+** Close a tile opened by msTiledSHPOpenTile(), giving it back to the cache
+** if it came from there.
+*/
+static void msTiledSHPCloseTile(shapefileObj *shpfile)
+{
+  int i;
+
+  if( !shpfile || shpfile->isopen != MS_TRUE )
+    return;
+
+  msAcquireLock( TLOCK_TILECACHE );
+  for( i = 0; i < tileShapefileCacheCount; i++ ) {
+    if( tileShapefileCache[i].tile.hSHP == shpfile->hSHP ) {
+      tileShapefileCache[i].in_use = MS_FALSE;
+      if( tileShapefileCache[i].stale )
+        tileShapefileCacheRemove(i);
+      msReleaseLock( TLOCK_TILECACHE );
+
+      /* the handles now belong to the cache again, only free our selection */
+      free(shpfile->status);
+      shpfile->status = NULL;
+      free(shpfile->statusids);
+      shpfile->statusids = NULL;
+      shpfile->isopen = MS_FALSE;
+      return;
+    }
+  }
+  msReleaseLock( TLOCK_TILECACHE );
+
+  msShapefileClose(shpfile);
+}
+
+/************************************************************************/
+/*                      msTiledSHPTileCacheCleanup()                    */
+/*                                                                      */
+/*      Close all cached tile shapefiles, called from msCleanup().      */
+/************************************************************************/
+void msTiledSHPTileCacheCleanup()
+{
+  msAcquireLock( TLOCK_TILECACHE );
+  while( tileShapefileCacheCount > 0 )
+    tileShapefileCacheRemove(0);
+  msReleaseLock( TLOCK_TILECACHE );
+}
+
 /*
 ** Build possible paths we might find the tile file at:
 **   map dir + shape path + filename?
@@ -1902,9 +2402,9 @@ int msTiledSHPTryOpen(shapefileObj *shpfile, layerObj *layer, char *tiFileAbsDir
   if( ignore_missing == MS_MISSING_DATA_IGNORE )
     log_failures = MS_FALSE;
 
-  if(msShapefileOpen(shpfile, "rb", msBuildPath3(szPath, layer->map->mappath, layer->map->shapepath, filename), log_failures) == -1) {
-    if(msShapefileOpen(shpfile, "rb", msBuildPath3(szPath, tiFileAbsDir, layer->map->shapepath, filename), log_failures) == -1) {
-      if(msShapefileOpen(shpfile, "rb", msBuildPath(szPath, layer->map->mappath, filename), log_failures) == -1) {
+  if(msTiledSHPOpenTile(shpfile, layer, msBuildPath3(szPath, layer->map->mappath, layer->map->shapepath, filename), log_failures) == -1) {
+    if(msTiledSHPOpenTile(shpfile, layer, msBuildPath3(szPath, tiFileAbsDir, layer->map->shapepath, filename), log_failures) == -1) {
+      if(msTiledSHPOpenTile(shpfile, layer, msBuildPath(szPath, layer->map->mappath, filename), log_failures) == -1) {
         if(ignore_missing == MS_MISSING_DATA_FAIL) {
           msSetError(MS_IOERR, "Unable to open shapefile '%s' for layer '%s' ... fatal error.", "msTiledSHPTryOpen()", filename, layer->name);
           return(MS_FAILURE);
@@ -1923,6 +2423,7 @@ int msTiledSHPTryOpen(shapefileObj *shpfile, layerObj *layer, char *tiFileAbsDir
       }
     }
   }
+
   return(MS_SUCCESS);
 }
 
@@ -2048,7 +2549,7 @@ int msTiledSHPWhichShapes(layerObj *layer, rectObj rect, int isQuery)
     return(MS_FAILURE);
   }
 
-  msShapefileClose(tSHP->shpfile); /* close previously opened files */
+  msTiledSHPCloseTile(tSHP->shpfile); /* close previously opened files */
 
   if(tSHP->tilelayerindex != -1) {  /* does the tileindex reference another layer */
     layerObj *tlp;
@@ -2083,10 +2584,10 @@ int msTiledSHPWhichShapes(layerObj *layer, rectObj rect, int isQuery)
       status = msShapefileWhichShapes(tSHP->shpfile, rect, layer->debug);
       if(status == MS_DONE) {
         /* Close and continue to next tile */
-        msShapefileClose(tSHP->shpfile);
+        msTiledSHPCloseTile(tSHP->shpfile);
         continue;
       } else if(status != MS_SUCCESS) {
-        msShapefileClose(tSHP->shpfile);
+        msTiledSHPCloseTile(tSHP->shpfile);
         return(MS_FAILURE);
       }
 
@@ -2106,7 +2607,7 @@ int msTiledSHPWhichShapes(layerObj *layer, rectObj rect, int isQuery)
 
     /* position the source at the FIRST shapefile */
     for(i=0; i<tSHP->tileshpfile->numshapes; i++) {
-      if(msGetBit(tSHP->tileshpfile->status,i)) {
+      if(msShapefileIsSelected(tSHP->tileshpfile,i)) {
         if(!layer->data) /* assume whole filename is in attribute field */
           filename = (char *) msDBFReadStringAttribute(tSHP->tileshpfile->hDBF, i, layer->tileitemindex);
         else {
@@ -2125,10 +2626,10 @@ int msTiledSHPWhichShapes(layerObj *layer, rectObj rect, int isQuery)
         status = msShapefileWhichShapes(tSHP->shpfile, rect, layer->debug);
         if(status == MS_DONE) {
           /* Close and continue to next tile */
-          msShapefileClose(tSHP->shpfile);
+          msTiledSHPCloseTile(tSHP->shpfile);
           continue;
         } else if(status != MS_SUCCESS) {
-          msShapefileClose(tSHP->shpfile);
+          msTiledSHPCloseTile(tSHP->shpfile);
           return(MS_FAILURE);
         }
 
@@ -2167,10 +2668,11 @@ int msTiledSHPNextShape(layerObj *layer, shapeObj *shape)
 
   do {
     i = tSHP->shpfile->lastshape + 1;
-    while(i<tSHP->shpfile->numshapes && !msGetBit(tSHP->shpfile->status,i)) i++; /* next "in" shape */
+    i = msShapefileNextSelected(tSHP->shpfile, i); /* next "in" shape */
+    if(i == -1) i = tSHP->shpfile->numshapes;
 
     if(i == tSHP->shpfile->numshapes) { /* done with this tile, need a new one */
-      msShapefileClose(tSHP->shpfile); /* clean up */
+      msTiledSHPCloseTile(tSHP->shpfile); /* clean up */
 
       /* position the source to the NEXT shapefile based on the tileindex */
       if(tSHP->tilelayerindex != -1) { /* does the tileindex reference another layer */
@@ -2202,10 +2704,10 @@ int msTiledSHPNextShape(layerObj *layer, shapeObj *shape)
           status = msShapefileWhichShapes(tSHP->shpfile, tSHP->tileshpfile->statusbounds, layer->debug);
           if(status == MS_DONE) {
             /* Close and continue to next tile */
-            msShapefileClose(tSHP->shpfile);
+            msTiledSHPCloseTile(tSHP->shpfile);
             continue;
           } else if(status != MS_SUCCESS) {
-            msShapefileClose(tSHP->shpfile);
+            msTiledSHPCloseTile(tSHP->shpfile);
             return(MS_FAILURE);
           }
 
@@ -2223,7 +2725,7 @@ int msTiledSHPNextShape(layerObj *layer, shapeObj *shape)
       } else { /* or reference a shapefile directly   */
 
         for(i=(tSHP->tileshpfile->lastshape + 1); i<tSHP->tileshpfile->numshapes; i++) {
-          if(msGetBit(tSHP->tileshpfile->status,i)) {
+          if(msShapefileIsSelected(tSHP->tileshpfile,i)) {
             int try_open;
 
             if(!layer->data) /* assume whole filename is in attribute field */
@@ -2244,10 +2746,10 @@ int msTiledSHPNextShape(layerObj *layer, shapeObj *shape)
             status = msShapefileWhichShapes(tSHP->shpfile, tSHP->tileshpfile->statusbounds, layer->debug);
             if(status == MS_DONE) {
               /* Close and continue to next tile */
-              msShapefileClose(tSHP->shpfile);
+              msTiledSHPCloseTile(tSHP->shpfile);
               continue;
             } else if(status != MS_SUCCESS) {
-              msShapefileClose(tSHP->shpfile);
+              msTiledSHPCloseTile(tSHP->shpfile);
               return(MS_FAILURE);
             }
 
@@ -2263,7 +2765,7 @@ int msTiledSHPNextShape(layerObj *layer, shapeObj *shape)
 
     tSHP->shpfile->lastshape = i;
 
-    msSHPReadShape(tSHP->shpfile->hSHP, i, shape);
+    msSHPReadShapePooled(tSHP->shpfile->hSHP, i, shape, layer->shapepool);
     if(shape->type == MS_SHAPE_NULL) {
       msFreeShape(shape);
       continue; /* skip NULL shapes */
@@ -2307,7 +2809,7 @@ int msTiledSHPGetShape(layerObj *layer, shapeObj *shape, resultObj *record)
   if((tileindex < 0) || (tileindex >= tSHP->tileshpfile->numshapes)) return(MS_FAILURE); /* invalid tile id */
 
   if(tileindex != tSHP->tileshpfile->lastshape) { /* correct tile is not currenly open so open the correct tile */
-    msShapefileClose(tSHP->shpfile); /* close current tile */
+    msTiledSHPCloseTile(tSHP->shpfile); /* close current tile */
 
     if(!layer->data) /* assume whole filename is in attribute field */
       filename = (char*) msDBFReadStringAttribute(tSHP->tileshpfile->hDBF, tileindex, layer->tileitemindex);
@@ -2318,9 +2820,9 @@ int msTiledSHPGetShape(layerObj *layer, shapeObj *shape, resultObj *record)
 
     /* open the shapefile, since a specific tile was request an error should be generated if that tile does not exist */
     if(strlen(filename) == 0) return(MS_FAILURE);
-    if(msShapefileOpen(tSHP->shpfile, "rb", msBuildPath3(szPath, tiFileAbsDir, layer->map->shapepath, filename), MS_TRUE) == -1) {
-      if(msShapefileOpen(tSHP->shpfile, "rb", msBuildPath3(szPath, layer->map->mappath, layer->map->shapepath, filename), MS_TRUE) == -1) {
-        if(msShapefileOpen(tSHP->shpfile, "rb", msBuildPath(szPath, layer->map->mappath, filename), MS_TRUE) == -1) {
+    if(msTiledSHPOpenTile(tSHP->shpfile, layer, msBuildPath3(szPath, tiFileAbsDir, layer->map->shapepath, filename), MS_TRUE) == -1) {
+      if(msTiledSHPOpenTile(tSHP->shpfile, layer, msBuildPath3(szPath, layer->map->mappath, layer->map->shapepath, filename), MS_TRUE) == -1) {
+        if(msTiledSHPOpenTile(tSHP->shpfile, layer, msBuildPath(szPath, layer->map->mappath, filename), MS_TRUE) == -1) {
           return(MS_FAILURE);
         }
       }
@@ -2350,7 +2852,7 @@ void msTiledSHPClose(layerObj *layer)
 
   tSHP = layer->layerinfo;
   if(tSHP) {
-    msShapefileClose(tSHP->shpfile);
+    msTiledSHPCloseTile(tSHP->shpfile);
     free(tSHP->shpfile);
 
     if(tSHP->tilelayerindex != -1) {
@@ -2403,6 +2905,49 @@ int msTiledSHPLayerInitItemInfo(layerObj *layer)
   return MS_SUCCESS;
 }
 
+static void msSHPPassThroughFieldDefinition( layerObj *layer, const char *item, DBFFieldType eType, int nWidth, int nPrecision )
+{
+  char md_item_name[64];
+  char gml_width[32], gml_precision[32];
+  const char *gml_type = NULL;
+
+  gml_width[0] = '\0';
+  gml_precision[0] = '\0';
+
+  switch( eType ) {
+    case FTInteger:
+      gml_type = "Integer";
+      sprintf( gml_width, "%d", nWidth );
+      break;
+
+    case FTDouble:
+      gml_type = "Real";
+      sprintf( gml_width, "%d", nWidth );
+      sprintf( gml_precision, "%d", nPrecision );
+      break;
+
+    case FTString:
+    default:
+      gml_type = "Character";
+      sprintf( gml_width, "%d", nWidth );
+      break;
+  }
+
+  snprintf( md_item_name, sizeof(md_item_name), "gml_%s_type", item );
+  if( msOWSLookupMetadata(&(layer->metadata), "G", "type") == NULL )
+    msInsertHashTable(&(layer->metadata), md_item_name, gml_type );
+
+  snprintf( md_item_name, sizeof(md_item_name), "gml_%s_width", item );
+  if( strlen(gml_width) > 0
+      && msOWSLookupMetadata(&(layer->metadata), "G", "width") == NULL )
+    msInsertHashTable(&(layer->metadata), md_item_name, gml_width );
+
+  snprintf( md_item_name, sizeof(md_item_name), "gml_%s_precision",item );
+  if( strlen(gml_precision) > 0
+      && msOWSLookupMetadata(&(layer->metadata), "G", "precision")==NULL )
+    msInsertHashTable(&(layer->metadata), md_item_name, gml_precision );
+}
+
 static void msSHPPassThroughFieldDefinitions( layerObj *layer, DBFHandle hDBF )
 {
   int numitems, i;
@@ -2412,55 +2957,17 @@ static void msSHPPassThroughFieldDefinitions( layerObj *layer, DBFHandle hDBF )
   for(i=0; i<numitems; i++) {
     char item[16];
     int  nWidth=0, nPrecision=0;
-    char md_item_name[64];
-    char gml_width[32], gml_precision[32];
     DBFFieldType eType;
-    const char *gml_type = NULL;
 
     eType = msDBFGetFieldInfo( hDBF, i, item, &nWidth, &nPrecision );
+    msSHPPassThroughFieldDefinition( layer, item, eType, nWidth, nPrecision );
+  }
+}
 
-    gml_width[0] = '\0';
-    gml_precision[0] = '\0';
-
-    switch( eType ) {
-      case FTInteger:
-        gml_type = "Integer";
-        sprintf( gml_width, "%d", nWidth );
-        break;
-
-      case FTDouble:
-        gml_type = "Real";
-        sprintf( gml_width, "%d", nWidth );
-        sprintf( gml_precision, "%d", nPrecision );
-        break;
-
-      case FTString:
-      default:
-        gml_type = "Character";
-        sprintf( gml_width, "%d", nWidth );
-        break;
-    }
-
-    snprintf( md_item_name, sizeof(md_item_name), "gml_%s_type", item );
-    if( msOWSLookupMetadata(&(layer->metadata), "G", "type") == NULL )
-      msInsertHashTable(&(layer->metadata), md_item_name, gml_type );
-
-    snprintf( md_item_name, sizeof(md_item_name), "gml_%s_width", item );
-    if( strlen(gml_width) > 0
-        && msOWSLookupMetadata(&(layer->metadata), "G", "width") == NULL )
-      msInsertHashTable(&(layer->metadata), md_item_name, gml_width );
-
-    snprintf( md_item_name, sizeof(md_item_name), "gml_%s_precision",item );
-    if( strlen(gml_precision) > 0
-        && msOWSLookupMetadata(&(layer->metadata), "G", "precision")==NULL )
-      msInsertHashTable(&(layer->metadata), md_item_name, gml_precision );
-  }
-}
-
-int msTiledSHPLayerGetItems(layerObj *layer)
-{
-  msTiledSHPLayerInfo *tSHP=NULL;
-  const char *value;
+int msTiledSHPLayerGetItems(layerObj *layer)
+{
+  msTiledSHPLayerInfo *tSHP=NULL;
+  const char *value;
 
   tSHP = layer->layerinfo;
   if(!tSHP) {
@@ -2538,10 +3045,317 @@ int msTiledSHPLayerInitializeVirtualTable(layerObj *layer)
   return MS_SUCCESS;
 }
 
+/* -------------------------------------------------------------------- */
+/*      Process wide store of shapefiles loaded in memory, for layers   */
+/*      with PROCESSING "PRELOAD=ON". The geometry, the attributes and  */
+/*      a quadtree are read once, later requests never touch the files  */
+/*      again until the .shp modification time or size changes. Entries */
+/*      are shared by all the layers using them (refcount), unused ones */
+/*      are dropped least recently used first when the store is full.   */
+/*                                                                      */
+/*      These static structures are protected by the TLOCK_SHPPRELOAD   */
+/*      mutex.                                                          */
+/* -------------------------------------------------------------------- */
+#define MS_SHP_PRELOAD_MAX 16
+
+struct shpPreloadObj {
+  char *path;
+  time_t mtime;
+  off_t size;
+  int refcount;
+  int stale;
+  unsigned long last_used;
+
+  int type;
+  int numshapes;
+  rectObj bounds;
+  shapeObj *shapes; /* geometry only */
+  treeObj *tree;
+
+  int numfields;
+  char **items;
+  DBFFieldType *fieldtypes;
+  int *fieldwidths;
+  int *fielddecimals;
+  char ***values; /* all the attributes of each record */
+};
+
+static int shpPreloadCount = 0;
+static unsigned long shpPreloadClock = 0;
+static shpPreloadObj *shpPreload[MS_SHP_PRELOAD_MAX];
+
+static void msSHPPreloadFree(shpPreloadObj *preload)
+{
+  int i;
+
+  for(i=0; i<preload->numshapes; i++) {
+    msFreeShape(&preload->shapes[i]);
+    if(preload->values[i]) msFreeCharArray(preload->values[i], preload->numfields);
+  }
+  free(preload->shapes);
+  free(preload->values);
+  if(preload->tree) msDestroyTree(preload->tree);
+  if(preload->items) msFreeCharArray(preload->items, preload->numfields);
+  free(preload->fieldtypes);
+  free(preload->fieldwidths);
+  free(preload->fielddecimals);
+  free(preload->path);
+  free(preload);
+}
+
+static void msSHPPreloadRemove(int i)
+{
+  msSHPPreloadFree(shpPreload[i]);
+
+  shpPreloadCount--;
+  if( i != shpPreloadCount )
+    shpPreload[i] = shpPreload[shpPreloadCount];
+}
+
+/*
+** Read the whole shapefile at path in memory, NULL on failure.
+*/
+static shpPreloadObj *msSHPPreloadLoad(const char *path, const struct stat *sStat)
+{
+  shapefileObj shpfile;
+  shpPreloadObj *preload;
+  int i;
+
+  if(msShapefileOpen(&shpfile, "rb", path, MS_FALSE) == -1)
+    return NULL;
+
+  preload = (shpPreloadObj *) msSmallCalloc(1, sizeof(shpPreloadObj));
+  preload->path = msStrdup(path);
+  preload->mtime = sStat->st_mtime;
+  preload->size = sStat->st_size;
+  preload->type = shpfile.type;
+  preload->numshapes = shpfile.numshapes;
+  preload->bounds = shpfile.bounds;
+
+  preload->numfields = msDBFGetFieldCount(shpfile.hDBF);
+  preload->fieldtypes = (DBFFieldType *) msSmallMalloc(sizeof(DBFFieldType) * (preload->numfields + 1));
+  preload->fieldwidths = (int *) msSmallMalloc(sizeof(int) * (preload->numfields + 1));
+  preload->fielddecimals = (int *) msSmallMalloc(sizeof(int) * (preload->numfields + 1));
+  if(preload->numfields > 0) {
+    preload->items = msDBFGetItems(shpfile.hDBF);
+    if(!preload->items) {
+      preload->numfields = 0;
+      msSHPPreloadFree(preload);
+      msShapefileClose(&shpfile);
+      return NULL;
+    }
+  }
+  for(i=0; i<preload->numfields; i++) {
+    char item[16];
+    preload->fieldtypes[i] = msDBFGetFieldInfo(shpfile.hDBF, i, item, &preload->fieldwidths[i], &preload->fielddecimals[i]);
+  }
+
+  preload->shapes = (shapeObj *) msSmallMalloc(sizeof(shapeObj) * (preload->numshapes + 1));
+  preload->values = (char ***) msSmallCalloc(preload->numshapes + 1, sizeof(char **));
+  for(i=0; i<preload->numshapes; i++) {
+    msInitShape(&preload->shapes[i]);
+    msSHPReadShape(shpfile.hSHP, i, &preload->shapes[i]);
+    if(preload->numfields > 0) {
+      preload->values[i] = msDBFGetValues(shpfile.hDBF, i);
+      if(!preload->values[i]) {
+        preload->numshapes = i+1;
+        msSHPPreloadFree(preload);
+        msShapefileClose(&shpfile);
+        return NULL;
+      }
+    }
+  }
+
+  preload->tree = msCreateTree(&shpfile, 0);
+  msShapefileClose(&shpfile);
+
+  if(!preload->tree) {
+    msSHPPreloadFree(preload);
+    return NULL;
+  }
+
+  return preload;
+}
+
+/*
+** Open shpfile on the preloaded copy of path, loading it if needed. Same
+** return values as msShapefileOpen(), on failure the caller should open the
+** files as usual.
+*/
+static int msSHPPreloadOpen(shapefileObj *shpfile, const char *path)
+{
+  int i, slot = -1;
+  struct stat sStat;
+  shpPreloadObj *preload = NULL;
+
+  if( shapefileStat(path, &sStat) != MS_SUCCESS )
+    return(-1);
+
+  msAcquireLock( TLOCK_SHPPRELOAD );
+  for( i = shpPreloadCount - 1; i >= 0; i-- ) {
+    if( strcmp(shpPreload[i]->path, path) != 0 )
+      continue;
+
+    if( shpPreload[i]->mtime != sStat.st_mtime || shpPreload[i]->size != sStat.st_size ) {
+      /* the file has been rewritten, drop the old copy once unused */
+      if( shpPreload[i]->refcount > 0 )
+        shpPreload[i]->stale = MS_TRUE;
+      else
+        msSHPPreloadRemove(i);
+      continue;
+    }
+
+    if( !shpPreload[i]->stale ) {
+      preload = shpPreload[i];
+      break;
+    }
+  }
+
+  if( !preload ) {
+    if( shpPreloadCount == MS_SHP_PRELOAD_MAX ) {
+      for( i = 0; i < shpPreloadCount; i++ ) {
+        if( shpPreload[i]->refcount == 0 &&
+            (slot == -1 || shpPreload[i]->last_used < shpPreload[slot]->last_used) )
+          slot = i;
+      }
+      if( slot != -1 )
+        msSHPPreloadRemove(slot);
+    }
+    if( shpPreloadCount < MS_SHP_PRELOAD_MAX ) {
+      preload = msSHPPreloadLoad(path, &sStat);
+      if( preload )
+        shpPreload[shpPreloadCount++] = preload;
+    }
+  }
+
+  if( preload ) {
+    preload->refcount++;
+    preload->last_used = ++shpPreloadClock;
+  }
+  msReleaseLock( TLOCK_SHPPRELOAD );
+
+  if( !preload )
+    return(-1);
+
+  shpfile->status = NULL;
+  shpfile->statusids = NULL;
+  shpfile->numstatusids = 0;
+  shpfile->nextstatusid = 0;
+  shpfile->lastshape = -1;
+  shpfile->hSHP = NULL;
+  shpfile->hDBF = NULL;
+  shpfile->dbfcache = NULL;
+  shpfile->hSHPGeneralized = NULL;
+  shpfile->generalizedband = 0;
+  shpfile->preload = preload;
+  strlcpy(shpfile->source, path, sizeof(shpfile->source));
+  shpfile->type = preload->type;
+  shpfile->numshapes = preload->numshapes;
+  shpfile->bounds = preload->bounds;
+  shpfile->isopen = MS_TRUE;
+
+  return(0);
+}
+
+static void msSHPPreloadRelease(shpPreloadObj *preload)
+{
+  int i;
+
+  msAcquireLock( TLOCK_SHPPRELOAD );
+  preload->refcount--;
+  if( preload->stale && preload->refcount == 0 ) {
+    for( i = 0; i < shpPreloadCount; i++ ) {
+      if( shpPreload[i] == preload ) {
+        msSHPPreloadRemove(i);
+        break;
+      }
+    }
+  }
+  msReleaseLock( TLOCK_SHPPRELOAD );
+}
+
+void msSHPPreloadCleanup(void)
+{
+  msAcquireLock( TLOCK_SHPPRELOAD );
+  while( shpPreloadCount > 0 )
+    msSHPPreloadRemove(shpPreloadCount - 1);
+  msReleaseLock( TLOCK_SHPPRELOAD );
+}
+
+/* in memory version of msShapefileWhichShapes() */
+static int msSHPPreloadWhichShapes(shapefileObj *shpfile, rectObj rect)
+{
+  shpPreloadObj *preload = shpfile->preload;
+  int i;
+
+  free(shpfile->status);
+  shpfile->status = NULL;
+  free(shpfile->statusids);
+  shpfile->statusids = NULL;
+  shpfile->numstatusids = 0;
+  shpfile->nextstatusid = 0;
+
+  shpfile->statusbounds = rect; /* save the search extent */
+  shpfile->lastshape = -1;
+
+  /* rect and shapefile DON'T overlap... */
+  if(msRectOverlap(&shpfile->bounds, &rect) != MS_TRUE)
+    return(MS_DONE);
+
+  if(msRectContained(&shpfile->bounds, &rect) == MS_TRUE) {
+    shpfile->status = msAllocBitArray(shpfile->numshapes);
+    if(!shpfile->status) {
+      msSetError(MS_MEMERR, NULL, "msSHPPreloadWhichShapes()");
+      return(MS_FAILURE);
+    }
+    msSetAllBits(shpfile->status, shpfile->numshapes, 1);
+    return(MS_SUCCESS);
+  }
+
+  shpfile->status = msSearchTree(preload->tree, rect);
+  if(!shpfile->status)
+    return(MS_FAILURE);
+
+  for(i = msGetNextBit(shpfile->status, 0, shpfile->numshapes); i != -1;
+      i = msGetNextBit(shpfile->status, i+1, shpfile->numshapes)) {
+    if(msRectOverlap(&preload->shapes[i].bounds, &rect) != MS_TRUE)
+      msSetBit(shpfile->status, i, 0);
+  }
+
+  return(MS_SUCCESS);
+}
+
+static int *msSHPPreloadGetItemIndexes(shpPreloadObj *preload, char **items, int numitems)
+{
+  int *itemindexes, i, j;
+
+  if(numitems == 0) return(NULL);
+
+  itemindexes = (int *) msSmallMalloc(sizeof(int)*numitems);
+  for(i=0; i<numitems; i++) {
+    for(j=0; j<preload->numfields; j++) {
+      if(strcasecmp(items[i], preload->items[j]) == 0) break;
+    }
+    if(j == preload->numfields) {
+      msSetError(MS_DBFERR, "Item '%s' not found.", "msSHPPreloadGetItemIndexes()", items[i]);
+      free(itemindexes);
+      return(NULL);
+    }
+    itemindexes[i] = j;
+  }
+
+  return(itemindexes);
+}
+
 /* SHAPEFILE Layer virtual table functions */
 
 void msSHPLayerFreeItemInfo(layerObj *layer)
 {
+  shapefileObj *shpfile = layer->layerinfo;
+  if(shpfile && shpfile->dbfcache) {
+    msDBFColumnCacheRelease(shpfile->dbfcache);
+    shpfile->dbfcache = NULL;
+  }
   if(layer->iteminfo) {
     free(layer->iteminfo);
     layer->iteminfo = NULL;
@@ -2558,11 +3372,22 @@ int msSHPLayerInitItemInfo(layerObj *layer)
 
   /* iteminfo needs to be a bit more complex, a list of indexes plus the length of the list */
   msSHPLayerFreeItemInfo(layer);
+  if( shpfile->preload ) {
+    layer->iteminfo = msSHPPreloadGetItemIndexes(shpfile->preload, layer->items, layer->numitems);
+    return layer->iteminfo ? MS_SUCCESS : MS_FAILURE;
+  }
   layer->iteminfo = (int *) msDBFGetItemIndexes(shpfile->hDBF, layer->items, layer->numitems);
   if( ! layer->iteminfo) {
     return MS_FAILURE;
   }
 
+  /* serve the attributes from the shared column cache if enabled, falls back to the file on failure */
+  if( msTestConfigOption(layer->map, "MS_DBF_CACHE", MS_FALSE) ) {
+    shpfile->dbfcache = msDBFColumnCacheAcquire(shpfile->hDBF, layer->iteminfo, layer->numitems);
+    if( !shpfile->dbfcache && layer->debug )
+      msDebug("msSHPLayerInitItemInfo(): attributes of layer %s can't be cached, reading them from the file.\n", layer->name);
+  }
+
   return MS_SUCCESS;
 }
 
@@ -2570,6 +3395,7 @@ int msSHPLayerOpen(layerObj *layer)
 {
   char szPath[MS_MAXPATHLEN];
   shapefileObj *shpfile;
+  const char *value;
 
   if(layer->layerinfo) return MS_SUCCESS; /* layer already open */
 
@@ -2579,18 +3405,33 @@ int msSHPLayerOpen(layerObj *layer)
   /* allocate space for a shapefileObj using layer->layerinfo  */
   shpfile = (shapefileObj *) malloc(sizeof(shapefileObj));
   MS_CHECK_ALLOC(shpfile, sizeof(shapefileObj), MS_FAILURE);
-
+  shpfile->preload = NULL;
 
   layer->layerinfo = shpfile;
 
-  if(msShapefileOpen(shpfile, "rb", msBuildPath3(szPath, layer->map->mappath, layer->map->shapepath, layer->data), MS_TRUE) == -1) {
-    if(msShapefileOpen(shpfile, "rb", msBuildPath(szPath, layer->map->mappath, layer->data), MS_TRUE) == -1) {
-      layer->layerinfo = NULL;
-      free(shpfile);
-      return MS_FAILURE;
+  /* serve the layer from memory if asked to, falls back to the files on failure */
+  value = msLayerGetProcessingKey(layer, "PRELOAD");
+  if(value && strcasecmp(value, "ON") == 0) {
+    if(msSHPPreloadOpen(shpfile, msBuildPath3(szPath, layer->map->mappath, layer->map->shapepath, layer->data)) == -1 &&
+        msSHPPreloadOpen(shpfile, msBuildPath(szPath, layer->map->mappath, layer->data)) == -1) {
+      if(layer->debug)
+        msDebug("msSHPLayerOpen(): layer %s can't be preloaded, reading it from the files.\n", layer->name);
     }
   }
-  
+
+  if(!shpfile->preload) {
+    if(msShapefileOpen(shpfile, "rb", msBuildPath3(szPath, layer->map->mappath, layer->map->shapepath, layer->data), MS_TRUE) == -1) {
+      if(msShapefileOpen(shpfile, "rb", msBuildPath(szPath, layer->map->mappath, layer->data), MS_TRUE) == -1) {
+        layer->layerinfo = NULL;
+        free(shpfile);
+        return MS_FAILURE;
+      }
+    }
+
+    if(msTestConfigOption(layer->map, "MS_SHAPEFILE_MMAP", MS_FALSE))
+      msSHPMapFiles(shpfile->hSHP);
+  }
+
   if (layer->projection.numargs > 0 &&
       EQUAL(layer->projection.args[0], "auto"))
   {
@@ -2651,6 +3492,480 @@ int msSHPLayerIsOpen(layerObj *layer)
     return MS_FALSE;
 }
 
+/*
+** Name of the shapefile (without extension) holding generalized geometry
+** band "band" of filename, as written by shpgen.
+*/
+char *msSHPGeneralizedFilename(const char *filename, int band)
+{
+  char *pszBasename;
+  int i;
+
+  pszBasename = (char *) msSmallMalloc(strlen(filename)+16);
+  strcpy( pszBasename, filename );
+  for( i = strlen(pszBasename)-1;
+       i > 0 && pszBasename[i] != '.' && pszBasename[i] != '/' && pszBasename[i] != '\\';
+       i-- ) {}
+
+  if( pszBasename[i] == '.' )
+    pszBasename[i] = '\0';
+
+  sprintf(pszBasename + strlen(pszBasename), "_g%d", band);
+  return pszBasename;
+}
+
+/*
+** Select the generalized geometry band (built with shpgen) to draw with. The
+** GENERALIZED_GEOMETRY processing key lists the tolerances the bands were
+** built with, the coarsest one not larger than the map cellsize is used.
+** Queries always use the original geometry.
+*/
+static void msSHPLayerSelectGeneralized(layerObj *layer, shapefileObj *shpfile, int isQuery)
+{
+  const char *value = msLayerGetProcessingKey(layer, "GENERALIZED_GEOMETRY");
+  char **tokens, *filename;
+  int i, n, band = 0;
+  double tolerance, best = 0;
+  SHPHandle hSHP;
+
+  if(value && !isQuery && layer->map->cellsize > 0) {
+    tokens = msStringSplit(value, ',', &n);
+    for(i=0; i<n; i++) {
+      tolerance = atof(tokens[i]);
+      if(tolerance > best && tolerance <= layer->map->cellsize) {
+        best = tolerance;
+        band = i+1;
+      }
+    }
+    msFreeCharArray(tokens, n);
+  }
+
+  if(band == shpfile->generalizedband)
+    return;
+
+  if(shpfile->hSHPGeneralized) msSHPClose(shpfile->hSHPGeneralized);
+  shpfile->hSHPGeneralized = NULL;
+  shpfile->generalizedband = 0;
+  if(band == 0)
+    return;
+
+  filename = msSHPGeneralizedFilename(shpfile->source, band);
+  hSHP = msSHPOpen(filename, "rb");
+  if(hSHP && hSHP->nRecords != shpfile->numshapes) {
+    msSHPClose(hSHP);
+    hSHP = NULL;
+  }
+  if(!hSHP) {
+    if(layer->debug)
+      msDebug("msSHPLayerWhichShapes(): generalized geometry %s of layer %s is missing or doesn't match, using the original geometry.\n", filename, layer->name);
+    free(filename);
+    return;
+  }
+  free(filename);
+
+  if(msTestConfigOption(layer->map, "MS_SHAPEFILE_MMAP", MS_FALSE))
+    msSHPMapFiles(hSHP);
+
+  shpfile->hSHPGeneralized = hSHP;
+  shpfile->generalizedband = band;
+}
+
+/*
+** Drops the shapes selected by the last msShapefileWhichShapes() call whose
+** bounds don't touch searchshape, a polygon tighter than the search rect.
+*/
+void msShapefileFilterSelection(shapefileObj *shpfile, shapeObj *searchshape)
+{
+  rectObj shaperect;
+  int i, n;
+
+  if(shpfile->statusids) {
+    for(i=0, n=0; i<shpfile->numstatusids; i++) {
+      int id = shpfile->statusids[i];
+      if(shpfile->preload)
+        shaperect = shpfile->preload->shapes[id].bounds;
+      else if(msSHPReadBounds(shpfile->hSHP, id, &shaperect) != MS_SUCCESS)
+        continue;
+      if(msIntersectRectPolygon(&shaperect, searchshape) == MS_TRUE)
+        shpfile->statusids[n++] = id;
+    }
+    shpfile->numstatusids = n;
+    shpfile->nextstatusid = 0;
+  } else if(shpfile->status) {
+    for(i=msGetNextBit(shpfile->status, 0, shpfile->numshapes); i>=0; i=msGetNextBit(shpfile->status, i+1, shpfile->numshapes)) {
+      if(shpfile->preload)
+        shaperect = shpfile->preload->shapes[i].bounds;
+      else if(msSHPReadBounds(shpfile->hSHP, i, &shaperect) != MS_SUCCESS)
+        continue;
+      if(msIntersectRectPolygon(&shaperect, searchshape) != MS_TRUE)
+        msSetBit(shpfile->status, i, 0);
+    }
+  }
+}
+
+/*
+** Attribute indexes (built with shpattrindex) list, for every value of one
+** DBF field, the records holding it:
+**
+**   "SAIX" version numrecords numvalues
+**   numvalues times: length value[length] numids id[numids]
+**
+** all integers being 32 bit LSB, values sorted and ids ascending. A layer
+** FILTER testing that field for equality only reads the records it lists.
+*/
+#define MS_ATTRIBUTE_INDEX_MAGIC "SAIX"
+#define MS_ATTRIBUTE_INDEX_VERSION 1
+
+typedef struct {
+  const char *value;
+  int id;
+} attributeIndexEntryObj;
+
+/* filename with its extension, if any, replaced by extension */
+static char *msSHPReplaceExtension(const char *filename, const char *extension)
+{
+  char *pszFilename;
+  int i;
+
+  pszFilename = (char *) msSmallMalloc(strlen(filename) + strlen(extension) + 1);
+  strcpy( pszFilename, filename );
+  for( i = strlen(pszFilename)-1;
+       i > 0 && pszFilename[i] != '.' && pszFilename[i] != '/' && pszFilename[i] != '\\';
+       i-- ) {}
+
+  if( pszFilename[i] == '.' )
+    pszFilename[i] = '\0';
+
+  strcat( pszFilename, extension );
+  return pszFilename;
+}
+
+/*
+** Name of the attribute index of field item of filename, as written by
+** shpattrindex: the extension is replaced by .<lowercased item>.aix
+*/
+char *msSHPAttributeIndexFilename(const char *filename, const char *item)
+{
+  char *pszExtension, *pszFilename;
+  int i;
+
+  pszExtension = (char *) msSmallMalloc(strlen(item) + strlen(MS_ATTRIBUTE_INDEX_EXTENSION) + 2);
+  pszExtension[0] = '.';
+  for( i = 0; item[i] != '\0'; i++ )
+    pszExtension[i+1] = tolower(item[i]);
+  strcpy( pszExtension + i + 1, MS_ATTRIBUTE_INDEX_EXTENSION );
+
+  pszFilename = msSHPReplaceExtension(filename, pszExtension);
+  free(pszExtension);
+  return pszFilename;
+}
+
+static int msAIXWriteInt(FILE *fp, int value)
+{
+  uchar buf[4];
+
+  buf[0] = value & 0xff;
+  buf[1] = (value >> 8) & 0xff;
+  buf[2] = (value >> 16) & 0xff;
+  buf[3] = (value >> 24) & 0xff;
+  return fwrite(buf, 4, 1, fp) == 1 ? MS_SUCCESS : MS_FAILURE;
+}
+
+static int msAIXReadInt(FILE *fp, int *value)
+{
+  uchar buf[4];
+
+  if(fread(buf, 4, 1, fp) != 1)
+    return MS_FAILURE;
+  *value = (int) ((ms_uint32) buf[0] | ((ms_uint32) buf[1] << 8) | ((ms_uint32) buf[2] << 16) | ((ms_uint32) buf[3] << 24));
+  return MS_SUCCESS;
+}
+
+static int compareAttributeIndexEntries(const void *a, const void *b)
+{
+  const attributeIndexEntryObj *ea = (const attributeIndexEntryObj *) a, *eb = (const attributeIndexEntryObj *) b;
+  int cmp = strcmp(ea->value, eb->value);
+
+  if(cmp != 0)
+    return cmp;
+  return ea->id - eb->id;
+}
+
+/*
+** Writes the attribute index of field item of shpfile to filename.
+*/
+int msSHPWriteAttributeIndex(shapefileObj *shpfile, const char *item, const char *filename)
+{
+  attributeIndexEntryObj *entries;
+  char *itemname = msStrdup(item);
+  int field, numrecords, numvalues, i, j, status = MS_SUCCESS;
+  FILE *fp;
+
+  field = msDBFGetItemIndex(shpfile->hDBF, itemname);
+  free(itemname);
+  if(field < 0)
+    return MS_FAILURE;
+
+  numrecords = msDBFGetRecordCount(shpfile->hDBF);
+  entries = (attributeIndexEntryObj *) msSmallMalloc(sizeof(attributeIndexEntryObj) * MS_MAX(numrecords, 1));
+  for(i=0; i<numrecords; i++) {
+    const char *value = msDBFReadStringAttribute(shpfile->hDBF, i, field);
+    entries[i].value = msStrdup(value ? value : "");
+    entries[i].id = i;
+  }
+  qsort(entries, numrecords, sizeof(attributeIndexEntryObj), compareAttributeIndexEntries);
+
+  for(i=0, numvalues=0; i<numrecords; i++) {
+    if(i == 0 || strcmp(entries[i].value, entries[i-1].value) != 0)
+      numvalues++;
+  }
+
+  if((fp = fopen(filename, "wb")) == NULL) {
+    msSetError(MS_IOERR, "Unable to open %s for writing.", "msSHPWriteAttributeIndex()", filename);
+    status = MS_FAILURE;
+  } else {
+    if(fwrite(MS_ATTRIBUTE_INDEX_MAGIC, 4, 1, fp) != 1 ||
+        msAIXWriteInt(fp, MS_ATTRIBUTE_INDEX_VERSION) != MS_SUCCESS ||
+        msAIXWriteInt(fp, numrecords) != MS_SUCCESS ||
+        msAIXWriteInt(fp, numvalues) != MS_SUCCESS)
+      status = MS_FAILURE;
+
+    for(i=0; i<numrecords && status == MS_SUCCESS; i=j) {
+      int length = strlen(entries[i].value);
+
+      for(j=i+1; j<numrecords && strcmp(entries[j].value, entries[i].value) == 0; j++) {}
+
+      if(msAIXWriteInt(fp, length) != MS_SUCCESS ||
+          (length > 0 && fwrite(entries[i].value, length, 1, fp) != 1) ||
+          msAIXWriteInt(fp, j - i) != MS_SUCCESS) {
+        status = MS_FAILURE;
+        break;
+      }
+      while(i < j && status == MS_SUCCESS)
+        status = msAIXWriteInt(fp, entries[i++].id);
+    }
+
+    if(fclose(fp) != 0)
+      status = MS_FAILURE;
+    if(status != MS_SUCCESS) {
+      msSetError(MS_IOERR, "Failed writing %s.", "msSHPWriteAttributeIndex()", filename);
+      unlink(filename);
+    }
+  }
+
+  for(i=0; i<numrecords; i++)
+    free((char *) entries[i].value);
+  free(entries);
+
+  return status;
+}
+
+static int compareInts(const void *a, const void *b)
+{
+  int ia = *(const int *) a, ib = *(const int *) b;
+  return ia < ib ? -1 : (ia > ib ? 1 : 0);
+}
+
+/*
+** Ascending ids of the records the attribute index in filename lists for
+** value (or, if isnumber, for the values equal to number). Returns NULL
+** without setting an error if the index can't be used.
+*/
+static int *msSHPReadAttributeIndex(const char *filename, int numrecords, const char *value,
+                                    int isnumber, double number, int *numids)
+{
+  FILE *fp;
+  char magic[4], *buffer = NULL;
+  int version, records, numvalues, length, count, i, j, sorted = MS_TRUE;
+  int *ids = NULL;
+
+  *numids = 0;
+  if((fp = fopen(filename, "rb")) == NULL)
+    return NULL;
+
+  if(fread(magic, 4, 1, fp) != 1 || memcmp(magic, MS_ATTRIBUTE_INDEX_MAGIC, 4) != 0 ||
+      msAIXReadInt(fp, &version) != MS_SUCCESS || version != MS_ATTRIBUTE_INDEX_VERSION ||
+      msAIXReadInt(fp, &records) != MS_SUCCESS || records != numrecords ||
+      msAIXReadInt(fp, &numvalues) != MS_SUCCESS) {
+    fclose(fp);
+    return NULL;
+  }
+
+  ids = (int *) msSmallMalloc(sizeof(int));
+  for(i=0; i<numvalues; i++) {
+    int match;
+
+    if(msAIXReadInt(fp, &length) != MS_SUCCESS || length < 0 || length > 65535)
+      break;
+    buffer = (char *) msSmallRealloc(buffer, length + 1);
+    if(length > 0 && fread(buffer, length, 1, fp) != 1)
+      break;
+    buffer[length] = '\0';
+    if(msAIXReadInt(fp, &count) != MS_SUCCESS || count < 0 || count > numrecords - *numids)
+      break;
+
+    /* blank and NULL values compare as 0, as atof() makes them in the expression evaluator */
+    match = isnumber ? atof(buffer) == number : strcmp(buffer, value) == 0;
+    if(!match) {
+      if(fseek(fp, (long) count * 4, SEEK_CUR) != 0)
+        break;
+      continue;
+    }
+
+    if(*numids > 0)
+      sorted = MS_FALSE; /* several values match the number */
+    ids = (int *) msSmallRealloc(ids, sizeof(int) * (*numids + count + 1));
+    for(j=0; j<count; j++) {
+      if(msAIXReadInt(fp, &ids[*numids]) != MS_SUCCESS || ids[*numids] < 0 || ids[*numids] >= numrecords)
+        break;
+      (*numids)++;
+    }
+    if(j < count)
+      break;
+    if(!isnumber) {
+      i = numvalues; /* values are unique */
+      break;
+    }
+  }
+  fclose(fp);
+  free(buffer);
+
+  if(i < numvalues) { /* truncated or corrupt */
+    free(ids);
+    *numids = 0;
+    return NULL;
+  }
+  if(!sorted)
+    qsort(ids, *numids, sizeof(int), compareInts);
+
+  return ids;
+}
+
+/*
+** Works out whether the layer FILTER is an equality test of one item the
+** attribute index can answer: a FILTERITEM with a string FILTER, or an
+** ([item] = constant) expression.
+*/
+static const char *msSHPLayerGetIndexableFilter(layerObj *layer, const char **value, double *number, int *isnumber)
+{
+  expressionObj *filter = &(layer->filter);
+  tokenListNodeObjPtr t[3], node;
+  int n;
+
+  if(MS_STRING_IS_NULL_OR_EMPTY(filter->string) || filter->native_string != NULL)
+    return NULL;
+
+  *isnumber = MS_FALSE;
+  switch(filter->type) {
+    case(MS_STRING):
+      if((filter->flags & MS_EXP_INSENSITIVE) || !layer->filteritem)
+        return NULL;
+      *value = filter->string;
+      return layer->filteritem;
+    case(MS_EXPRESSION):
+      for(n=0, node=filter->tokens; node; node=node->next) {
+        if(n == 3) return NULL;
+        t[n++] = node;
+      }
+      if(n != 3 || t[1]->token != MS_TOKEN_COMPARISON_EQ)
+        return NULL;
+      if(t[0]->token == MS_TOKEN_LITERAL_STRING || t[0]->token == MS_TOKEN_LITERAL_NUMBER) {
+        node = t[0];
+        t[0] = t[2];
+        t[2] = node;
+      }
+      if(t[0]->token == MS_TOKEN_BINDING_STRING && t[2]->token == MS_TOKEN_LITERAL_STRING) {
+        *value = t[2]->tokenval.strval;
+        return t[0]->tokenval.bindval.item;
+      }
+      if((t[0]->token == MS_TOKEN_BINDING_DOUBLE || t[0]->token == MS_TOKEN_BINDING_INTEGER) &&
+          t[2]->token == MS_TOKEN_LITERAL_NUMBER) {
+        *value = NULL;
+        *number = t[2]->tokenval.dblval;
+        *isnumber = MS_TRUE;
+        return t[0]->tokenval.bindval.item;
+      }
+      return NULL;
+    default:
+      return NULL;
+  }
+}
+
+/*
+** Restricts the shapes selected by the last msShapefileWhichShapes() call to
+** those the attribute index of the FILTER item lists for its value, if there
+** is an up to date one.
+*/
+static void msSHPLayerApplyAttributeIndex(layerObj *layer, shapefileObj *shpfile)
+{
+  const char *item, *value = NULL;
+  char *filename, *dbffilename;
+  double number = 0;
+  int isnumber, numids, *ids, i, n;
+  struct stat indexstat, dbfstat;
+
+  if(!shpfile->status && !shpfile->statusids)
+    return;
+  if((item = msSHPLayerGetIndexableFilter(layer, &value, &number, &isnumber)) == NULL)
+    return;
+
+  filename = msSHPAttributeIndexFilename(shpfile->source, item);
+  if(stat(filename, &indexstat) != 0) {
+    free(filename);
+    return;
+  }
+
+  /* an index older than the table is ignored */
+  dbffilename = msSHPReplaceExtension(shpfile->source, ".dbf");
+  if(stat(dbffilename, &dbfstat) == 0 && dbfstat.st_mtime > indexstat.st_mtime) {
+    if(layer->debug)
+      msDebug("msSHPLayerWhichShapes(): attribute index %s is older than %s, ignored.\n", filename, dbffilename);
+    free(filename);
+    free(dbffilename);
+    return;
+  }
+  free(dbffilename);
+
+  ids = msSHPReadAttributeIndex(filename, shpfile->numshapes, value, isnumber, number, &numids);
+  if(!ids) {
+    if(layer->debug)
+      msDebug("msSHPLayerWhichShapes(): attribute index %s can't be used, ignored.\n", filename);
+    free(filename);
+    return;
+  }
+
+  /* AND both selections, the result is kept as an id list */
+  if(shpfile->statusids) {
+    int j = 0;
+    for(i=0, n=0; i<shpfile->numstatusids && j<numids; ) {
+      if(shpfile->statusids[i] < ids[j])
+        i++;
+      else if(shpfile->statusids[i] > ids[j])
+        j++;
+      else {
+        ids[n++] = ids[j++];
+        i++;
+      }
+    }
+  } else {
+    for(i=0, n=0; i<numids; i++) {
+      if(msGetBit(shpfile->status, ids[i]))
+        ids[n++] = ids[i];
+    }
+  }
+
+  if(layer->debug)
+    msDebug("msSHPLayerWhichShapes(): attribute index %s selected %d of %d records.\n", filename, n, numids);
+
+  free(shpfile->status);
+  shpfile->status = NULL;
+  free(shpfile->statusids);
+  shpfile->statusids = ids;
+  shpfile->numstatusids = n;
+  shpfile->nextstatusid = 0;
+  free(filename);
+}
+
 int msSHPLayerWhichShapes(layerObj *layer, rectObj rect, int isQuery)
 {
   int status;
@@ -2663,14 +3978,52 @@ int msSHPLayerWhichShapes(layerObj *layer, rectObj rect, int isQuery)
     return MS_FAILURE;
   }
 
-  status = msShapefileWhichShapes(shpfile, rect, layer->debug);
+  if(shpfile->preload) {
+    status = msSHPPreloadWhichShapes(shpfile, rect);
+  } else {
+    msSHPLayerSelectGeneralized(layer, shpfile, isQuery);
+    status = msShapefileWhichShapes(shpfile, rect, layer->debug);
+  }
   if(status != MS_SUCCESS) {
     return status;
   }
 
+  if(layer->searchshape)
+    msShapefileFilterSelection(shpfile, layer->searchshape);
+
+  if(!shpfile->preload)
+    msSHPLayerApplyAttributeIndex(layer, shpfile);
+
   return MS_SUCCESS;
 }
 
+static void msSHPLayerReadShape(layerObj *layer, shapefileObj *shpfile, SHPHandle hSHP, int i, shapeObj *shape)
+{
+  if(shpfile->preload)
+    msCopyShape(&shpfile->preload->shapes[i], shape);
+  else
+    msSHPReadShapePooled(hSHP, i, shape, layer->shapepool);
+}
+
+static void msSHPLayerReadValues(layerObj *layer, shapefileObj *shpfile, shapeObj *shape, int i)
+{
+  shape->numvalues = layer->numitems;
+  if(shpfile->preload) {
+    int j;
+    if(layer->numitems == 0 || !layer->iteminfo) {
+      shape->values = NULL;
+    } else {
+      shape->values = (char **) msSmallMalloc(sizeof(char *) * layer->numitems);
+      for(j=0; j<layer->numitems; j++)
+        shape->values[j] = msStrdup(shpfile->preload->values[i][((int *) layer->iteminfo)[j]]);
+    }
+  } else if(shpfile->dbfcache)
+    shape->values = msDBFColumnCacheGetValueList(shpfile->dbfcache, i, layer->iteminfo, layer->numitems);
+  else
+    shape->values = msDBFGetValueList(shpfile->hDBF, i, layer->iteminfo, layer->numitems);
+  if(!shape->values) shape->numvalues = 0;
+}
+
 int msSHPLayerNextShape(layerObj *layer, shapeObj *shape)
 {
   int i;
@@ -2683,18 +4036,68 @@ int msSHPLayerNextShape(layerObj *layer, shapeObj *shape)
     return MS_FAILURE;
   }
 
-  i = msGetNextBit(shpfile->status, shpfile->lastshape + 1, shpfile->numshapes);
+  i = msShapefileNextSelected(shpfile, shpfile->lastshape + 1);
   shpfile->lastshape = i;
   if(i == -1) return(MS_DONE); /* nothing else to read */
 
-  msSHPReadShape(shpfile->hSHP, i, shape);
+  msSHPLayerReadShape(layer, shpfile, shpfile->hSHPGeneralized ? shpfile->hSHPGeneralized : shpfile->hSHP, i, shape);
   if(shape->type == MS_SHAPE_NULL) {
-    msFreeShape(shape);
+    msShapePoolFreeShape(layer->shapepool, shape);
     return msSHPLayerNextShape(layer, shape); /* skip NULL shapes */
   }
-  shape->numvalues = layer->numitems;
-  shape->values = msDBFGetValueList(shpfile->hDBF, i, layer->iteminfo, layer->numitems);
-  if(!shape->values) shape->numvalues = 0;
+  msSHPLayerReadValues(layer, shpfile, shape, i);
+
+  return MS_SUCCESS;
+}
+
+/*
+** Batched version of msSHPLayerNextShape(), the records of the batch that are
+** stored close together in the .shp file are fetched with a single read.
+*/
+int msSHPLayerNextShapes(layerObj *layer, shapeObj *shapes, int maxshapes, int *numshapes)
+{
+  int i, j, n, run;
+  int ids[MS_LAYER_BATCH_SIZE];
+  shapefileObj *shpfile;
+  SHPHandle hSHP;
+
+  shpfile = layer->layerinfo;
+  *numshapes = 0;
+
+  if(!shpfile) {
+    msSetError(MS_SHPERR, "Shapefile layer has not been opened.", "msSHPLayerNextShapes()");
+    return MS_FAILURE;
+  }
+
+  if(maxshapes > MS_LAYER_BATCH_SIZE) maxshapes = MS_LAYER_BATCH_SIZE;
+  hSHP = shpfile->hSHPGeneralized ? shpfile->hSHPGeneralized : shpfile->hSHP;
+
+  while(*numshapes == 0) { /* a batch may be made of NULL shapes only */
+    for(n=0; n<maxshapes; n++) {
+      i = msShapefileNextSelected(shpfile, shpfile->lastshape + 1);
+      if(i == -1) break;
+      ids[n] = shpfile->lastshape = i;
+    }
+    if(n == 0) {
+      shpfile->lastshape = -1;
+      return(MS_DONE); /* nothing else to read */
+    }
+
+    for(i=0; i<n; i+=run) {
+      run = shpfile->preload ? n : MS_MAX(msSHPReadAhead(hSHP, ids + i, n - i), 1);
+      for(j=i; j<i+run; j++) {
+        shapeObj *shape = &shapes[*numshapes];
+
+        msSHPLayerReadShape(layer, shpfile, hSHP, ids[j], shape);
+        if(shape->type == MS_SHAPE_NULL) {
+          msShapePoolFreeShape(layer->shapepool, shape); /* skip NULL shapes */
+          continue;
+        }
+        msSHPLayerReadValues(layer, shpfile, shape, ids[j]);
+        (*numshapes)++;
+      }
+    }
+  }
 
   return MS_SUCCESS;
 }
@@ -2719,10 +4122,9 @@ int msSHPLayerGetShape(layerObj *layer, shapeObj *shape, resultObj *record)
     return MS_FAILURE;
   }
 
-  msSHPReadShape(shpfile->hSHP, shapeindex, shape);
+  msSHPLayerReadShape(layer, shpfile, shpfile->hSHP, shapeindex, shape);
   if(layer->numitems > 0 && layer->iteminfo) {
-    shape->numvalues = layer->numitems;
-    shape->values = msDBFGetValueList(shpfile->hDBF, shapeindex, layer->iteminfo, layer->numitems);
+    msSHPLayerReadValues(layer, shpfile, shape, shapeindex);
     if(!shape->values) return MS_FAILURE;
   }
 
@@ -2756,6 +4158,26 @@ int msSHPLayerGetItems(layerObj *layer)
     return MS_FAILURE;
   }
 
+  if(shpfile->preload) {
+    shpPreloadObj *preload = shpfile->preload;
+    int i;
+
+    layer->numitems = preload->numfields;
+    if(layer->numitems == 0) return MS_SUCCESS;
+    layer->items = (char **) msSmallMalloc(sizeof(char *) * preload->numfields);
+    for(i=0; i<preload->numfields; i++)
+      layer->items[i] = msStrdup(preload->items[i]);
+
+    if((value = msOWSLookupMetadata(&(layer->metadata), "G", "types")) != NULL
+        && strcasecmp(value,"auto") == 0 ) {
+      for(i=0; i<preload->numfields; i++)
+        msSHPPassThroughFieldDefinition( layer, preload->items[i], preload->fieldtypes[i],
+                                         preload->fieldwidths[i], preload->fielddecimals[i] );
+    }
+
+    return msLayerInitItemInfo(layer);
+  }
+
   layer->numitems = msDBFGetFieldCount(shpfile->hDBF);
   layer->items = msDBFGetItems(shpfile->hDBF);
   if(layer->numitems == 0) return MS_SUCCESS; /* No items is a valid case (#3147) */
@@ -2782,6 +4204,43 @@ int msSHPLayerSupportsCommonFilters(layerObj *layer)
   return MS_TRUE;
 }
 
+/*
+** Counts the shapes found in the .qix for rect, without reading them: the shapes
+** whose bounds (packed index) or index node (quadtree) overlap rect, whatever the
+** filter. Without an index the shapes are counted.
+*/
+int msSHPLayerEstimateShapeCount(layerObj *layer, rectObj rect, projectionObj *rectProjection)
+{
+  shapefileObj *shpfile;
+  char *filename;
+  int count;
+
+  shpfile = layer->layerinfo;
+  if(!shpfile || shpfile->preload)
+    return LayerDefaultGetShapeCount(layer, rect, rectProjection);
+
+#ifdef USE_PROJ
+  if(rectProjection != NULL && layer->project && msProjectionsDiffer(&(layer->projection), rectProjection))
+    msProjectRect(rectProjection, &(layer->projection), &rect); /* project the rect to source coords */
+#endif
+
+  if(msRectOverlap(&shpfile->bounds, &rect) != MS_TRUE)
+    return 0;
+  if(msRectContained(&shpfile->bounds, &rect) == MS_TRUE)
+    return shpfile->numshapes;
+
+  filename = msShapefileIndexFilename(shpfile);
+  count = msCountDiskTreeHits(filename, rect, layer->debug);
+  free(filename);
+
+  if(count < 0) /* no index */
+    return LayerDefaultGetShapeCount(layer, rect, rectProjection);
+  if(layer->maxfeatures > 0 && count > layer->maxfeatures)
+    count = layer->maxfeatures;
+
+  return count;
+}
+
 int msSHPLayerInitializeVirtualTable(layerObj *layer)
 {
   assert(layer != NULL);
@@ -2794,8 +4253,10 @@ int msSHPLayerInitializeVirtualTable(layerObj *layer)
   layer->vtable->LayerIsOpen = msSHPLayerIsOpen;
   layer->vtable->LayerWhichShapes = msSHPLayerWhichShapes;
   layer->vtable->LayerNextShape = msSHPLayerNextShape;
+  layer->vtable->LayerNextShapes = msSHPLayerNextShapes;
   layer->vtable->LayerGetShape = msSHPLayerGetShape;
   /* layer->vtable->LayerGetShapeCount, use default */
+  layer->vtable->LayerEstimateShapeCount = msSHPLayerEstimateShapeCount;
   layer->vtable->LayerClose = msSHPLayerClose;
   layer->vtable->LayerGetItems = msSHPLayerGetItems;
   layer->vtable->LayerGetExtent = msSHPLayerGetExtent;
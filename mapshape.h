@@ -102,6 +102,16 @@ extern "C" {
     int   nPartMax;
     int   *panParts;
 
+    uchar   *pabySHPMap; /* read-only mappings of the .shp/.shx files, see msSHPMapFiles() */
+    uchar   *pabySHXMap;
+    size_t  nSHPMapSize;
+    size_t  nSHXMapSize;
+
+    uchar   *pabyReadAhead; /* a run of nearby .shp records read at once, see msSHPReadAhead() */
+    int   nReadAheadOffset;
+    int   nReadAheadSize;
+    int   nReadAheadMax;
+
   } SHPInfo;
   typedef SHPInfo * SHPHandle;
 #endif
@@ -135,12 +145,24 @@ extern "C" {
 
     char  *pszStringField;
     int   nStringFieldLen;
+
+#ifndef SWIG
+    char  *pszFilename; /* path the file was opened with, keys the column cache */
+#endif
 #ifdef SWIG
     %mutable;
 #endif
   } DBFInfo;
   typedef DBFInfo * DBFHandle;
 
+#ifndef SWIG
+  /* shared in-memory copy of some columns of a .dbf, see msDBFColumnCacheAcquire() */
+  typedef struct dbfColumnCacheObj dbfColumnCacheObj;
+
+  /* shared in-memory copy of a whole shapefile, see PROCESSING "PRELOAD=ON" */
+  typedef struct shpPreloadObj shpPreloadObj;
+#endif
+
   typedef enum {FTString, FTInteger, FTDouble, FTInvalid} DBFFieldType;
 
   /* Shapefile object, no write access via scripts */
@@ -160,6 +182,12 @@ extern "C" {
 
 #ifndef SWIG
     DBFHandle hDBF; /* DBF file pointer */
+    dbfColumnCacheObj *dbfcache; /* cached attribute columns, may be NULL */
+
+    SHPHandle hSHPGeneralized; /* simplified geometry drawn instead of hSHP, see msSHPLayerWhichShapes() */
+    int generalizedband;
+
+    shpPreloadObj *preload; /* if set, hSHP and hDBF are NULL and everything is read from memory */
 #endif
 
     int lastshape;
@@ -167,6 +195,12 @@ extern "C" {
     ms_bitarray status;
     rectObj statusbounds; /* holds extent associated with the status vector */
 
+#ifndef SWIG
+    int *statusids; /* sorted ids of the selected shapes, used instead of status when few are selected */
+    int numstatusids;
+    int nextstatusid; /* position in statusids of the shape following lastshape */
+#endif
+
     int isopen;
 #ifdef SWIG
     %mutable;
@@ -186,15 +220,27 @@ extern "C" {
   MS_DLL_EXPORT int msShapefileCreate(shapefileObj *shpfile, char *filename, int type);
   MS_DLL_EXPORT void msShapefileClose(shapefileObj *shpfile);
   MS_DLL_EXPORT int msShapefileWhichShapes(shapefileObj *shpfile, rectObj rect, int debug);
+  MS_DLL_EXPORT char *msShapefileIndexFilename(shapefileObj *shpfile);
+  MS_DLL_EXPORT int msShapefileNextSelected(shapefileObj *shpfile, int start);
+  MS_DLL_EXPORT int msShapefileIsSelected(shapefileObj *shpfile, int i);
+  MS_DLL_EXPORT void msShapefileFilterSelection(shapefileObj *shpfile, shapeObj *searchshape);
+  MS_DLL_EXPORT void msTiledSHPTileCacheCleanup(void);
+  MS_DLL_EXPORT void msSHPPreloadCleanup(void);
+  MS_DLL_EXPORT char *msSHPGeneralizedFilename(const char *filename, int band);
+  MS_DLL_EXPORT char *msSHPAttributeIndexFilename(const char *filename, const char *item);
+  MS_DLL_EXPORT int msSHPWriteAttributeIndex(shapefileObj *shpfile, const char *item, const char *filename);
 
   /* SHP/SHX function prototypes */
   MS_DLL_EXPORT SHPHandle msSHPOpen( const char * pszShapeFile, const char * pszAccess );
   MS_DLL_EXPORT SHPHandle msSHPCreate( const char * pszShapeFile, int nShapeType );
   MS_DLL_EXPORT void msSHPClose( SHPHandle hSHP );
+  MS_DLL_EXPORT int msSHPMapFiles( SHPHandle hSHP );
   MS_DLL_EXPORT void msSHPGetInfo( SHPHandle hSHP, int * pnEntities, int * pnShapeType );
   MS_DLL_EXPORT int msSHPReadBounds( SHPHandle psSHP, int hEntity, rectObj *padBounds );
   MS_DLL_EXPORT void msSHPReadShape( SHPHandle psSHP, int hEntity, shapeObj *shape );
+  MS_DLL_EXPORT void msSHPReadShapePooled( SHPHandle psSHP, int hEntity, shapeObj *shape, shapePoolObj *pool );
   MS_DLL_EXPORT int msSHPReadPoint(SHPHandle psSHP, int hEntity, pointObj *point );
+  MS_DLL_EXPORT int msSHPReadAhead( SHPHandle psSHP, const int *panEntities, int nEntities );
   MS_DLL_EXPORT int msSHPWriteShape( SHPHandle psSHP, shapeObj *shape );
   MS_DLL_EXPORT int msSHPWritePoint(SHPHandle psSHP, pointObj *point );
   /* SHX reading */
@@ -231,6 +277,13 @@ extern "C" {
   MS_DLL_EXPORT int *msDBFGetItemIndexes(DBFHandle dbffile, char **items, int numitems);
   MS_DLL_EXPORT int msDBFGetItemIndex(DBFHandle dbffile, char *name);
 
+  MS_DLL_EXPORT dbfColumnCacheObj *msDBFColumnCacheAcquire(DBFHandle dbffile, int *itemindexes, int numitems);
+  MS_DLL_EXPORT void msDBFColumnCacheRelease(dbfColumnCacheObj *cache);
+  MS_DLL_EXPORT char **msDBFColumnCacheGetValueList(dbfColumnCacheObj *cache, int record, int *itemindexes, int numitems);
+  MS_DLL_EXPORT const char *msDBFColumnCacheReadString(dbfColumnCacheObj *cache, int record, int field);
+  MS_DLL_EXPORT int msDBFColumnCacheReadDouble(dbfColumnCacheObj *cache, int record, int field, double *value);
+  MS_DLL_EXPORT void msDBFColumnCacheCleanup(void);
+
 #endif
 
 #ifdef __cplusplus
@@ -30,68 +30,51 @@
 
 #include "mapserver.h"
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define MS_SMOOTHING_SSE2
+#endif
+
 #define FP_EPSILON 1e-12
 #define FP_EQ(a, b) (fabs((a)-(b)) < FP_EPSILON)
 
-/* Internal Use, represent a line window (points) */
-typedef struct {
-  int pos; /* current point position in line */
-  int size;
-  int index; /* index of the current point in points array */
-  lineObj *line;
-  int lineIsRing; /* closed ring? */  
-  pointObj **points;
-} lineWindow;
-
-static void initLineWindow(lineWindow *lw, lineObj *line, int size)
-{ 
-  lw->pos = -1;
-  lw->lineIsRing = MS_FALSE;
-  lw->size = size;
-  lw->line = line;
-  lw->index = floor(lw->size/2); /* index of current position in points array */
-  lw->points = (pointObj**)msSmallMalloc(sizeof(pointObj*)*size);
-  
-  if ( (line->numpoints >= 2) &&
-       ((FP_EQ(line->point[0].x,
-               line->point[line->numpoints-1].x)) &&
-        (FP_EQ(line->point[0].y,
-               line->point[line->numpoints-1].y))) ) {
-    lw->lineIsRing = 1; 
-  }
-}
+/*
+** The kernels below work on the point arrays of the lines directly: a window of
+** points around a position is a run of point indexes, and each output line is
+** allocated once with its final (or largest) size.
+*/
 
-static void freeLineWindow(lineWindow *lw)
-{  
-  free(lw->points);
+static int lineIsRing(const pointObj *points, int numpoints)
+{
+  return (numpoints >= 2) &&
+         FP_EQ(points[0].x, points[numpoints-1].x) &&
+         FP_EQ(points[0].y, points[numpoints-1].y);
 }
 
-static int nextLineWindow(lineWindow *lw)
+/* Sets the indexes of the 2*half+1 points around pos, wrapping around rings.
+   Returns MS_FALSE if the window does not fit in the line. */
+static int getLineWindow(int numpoints, int isRing, int pos, int half, int *window)
 {
   int i;
 
-  if (++lw->pos >= lw->line->numpoints)
-    return MS_DONE;
-
-  lw->points[lw->index] = &lw->line->point[lw->pos];
-
-  for (i=0;i<lw->index;++i) {
+  window[half] = pos;
+  for (i=0; i<half; ++i) {
     int r, l;
-    r = lw->pos-(i+1);
-    l = lw->pos+(i+1);
+    r = pos-(i+1);
+    l = pos+(i+1);
 
     /* adjust values */
-    if ((r < 0) && lw->lineIsRing)
-      r = lw->line->numpoints-(i+2);
-    if ((l >= lw->line->numpoints) && lw->lineIsRing)
-      l = 1+(l-lw->line->numpoints);
-    
-    /* return if the window in not valid.. */
-    if (r<0 || l>=lw->line->numpoints)
+    if ((r < 0) && isRing)
+      r = numpoints-(i+2);
+    if ((l >= numpoints) && isRing)
+      l = 1+(l-numpoints);
+
+    /* the window in not valid.. */
+    if (r<0 || l>=numpoints)
       return MS_FALSE;
-    
-    lw->points[lw->index-(i+1)] = &lw->line->point[r];
-    lw->points[lw->index+(i+1)] = &lw->line->point[l];
+
+    window[half-(i+1)] = r;
+    window[half+(i+1)] = l;
   }
 
   return MS_TRUE;
@@ -99,100 +82,126 @@ static int nextLineWindow(lineWindow *lw)
 
 /* Calculates the distance ratio between the total distance of a path and the distance
    between the first and last point (to detect a loop). */
-static double computePathDistanceRatio(pointObj **points, int len)
+static double computePathDistanceRatio(pointObj *points, int *window, int len)
 {
   double sum;
   int i;
 
   for (sum=0,i=1;i<len;++i) {
-    sum += msDistancePointToPoint(points[i-1], points[i]);
+    sum += msDistancePointToPoint(&points[window[i-1]], &points[window[i]]);
   }
 
-  return sum/msDistancePointToPoint(points[0], points[len-1]);
+  return sum/msDistancePointToPoint(&points[window[0]], &points[window[len-1]]);
 }
 
 /* Pre-Processing of a shape. It modifies the shape by adding intermediate
    points where a loop is detected to improve the smoothing result. */
 static int processShapePathDistance(shapeObj *shape, int force)
 {
-  shapeObj initialShape, *newShape;
+  const int windowSize = 5, half = 2;
+  int window[5];
   int i;
-  
-  /* initial shape to process */
-  msInitShape(&initialShape);    
-  msCopyShape(shape, &initialShape);
-
-  newShape = shape; /* we modify the shape object directly */
-  shape = &initialShape;
-  
-  /* Clean our shape object */
-  for (i= 0; i < newShape->numlines; i++)
-    free(newShape->line[i].point);
-  newShape->numlines = 0;
-  if (newShape->line) free(newShape->line);
-  
+
   for (i=0;i<shape->numlines;++i) {
-    const int windowSize = 5;
-    int res;
-    lineWindow lw;
-    lineObj line = {0, NULL};
+    lineObj *line = &shape->line[i];
+    int isRing = lineIsRing(line->point, line->numpoints);
+    pointObj *out;
+    int pos, n = 0;
 
-    initLineWindow(&lw, &shape->line[i], windowSize);
-    msAddLine(newShape, &line);
+    /* at most three points for each one */
+    out = (pointObj*) msSmallMalloc(sizeof(pointObj)*MS_MAX(1, 3*line->numpoints));
 
-    while ((res = nextLineWindow(&lw)) != MS_DONE) {
+    for (pos=0; pos<line->numpoints; ++pos) {
       double ratio = 0;
-      pointObj point;
 
-      if (lw.lineIsRing && lw.pos==lw.line->numpoints-1) {
-        point = newShape->line[i].point[0];
-        msAddPointToLine(&newShape->line[i],
-                         &point);
+      if (isRing && pos==line->numpoints-1) {
+        out[n++] = out[0];
         continue;
       }
 
-      if (res == MS_FALSE) { /* invalid window */
-        msAddPointToLine(&newShape->line[i],
-                         lw.points[lw.index]);
+      if (!getLineWindow(line->numpoints, isRing, pos, half, window)) { /* invalid window */
+        out[n++] = line->point[pos];
         continue;
       }
 
       if (!force)
-        ratio = computePathDistanceRatio(lw.points, windowSize);
-                      
+        ratio = computePathDistanceRatio(line->point, window, windowSize);
+
       if (force || (ratio > 1.3)) {
-        point.x = (lw.line->point[lw.pos].x + lw.points[lw.index-1]->x)/2;
-        point.y = (lw.line->point[lw.pos].y + lw.points[lw.index-1]->y)/2;
-        msAddPointToLine(&newShape->line[i],
-                         &point);
+        out[n] = line->point[pos];
+        out[n].x = (line->point[pos].x + line->point[window[half-1]].x)/2;
+        out[n].y = (line->point[pos].y + line->point[window[half-1]].y)/2;
+        n++;
       }
-      
-      point = lw.line->point[lw.pos];
-      msAddPointToLine(&newShape->line[i],
-                       &point);
-      
+
+      out[n++] = line->point[pos];
+
       if (force || (ratio > 1.3)) {
-        point.x = (lw.line->point[lw.pos].x + lw.points[lw.index+1]->x)/2;
-        point.y = (lw.line->point[lw.pos].y + lw.points[lw.index+1]->y)/2;
-        msAddPointToLine(&newShape->line[i],
-                         &point);
+        out[n] = line->point[pos];
+        out[n].x = (line->point[pos].x + line->point[window[half+1]].x)/2;
+        out[n].y = (line->point[pos].y + line->point[window[half+1]].y)/2;
+        n++;
       }
-      
     }
-       
-    freeLineWindow(&lw);
+
+    free(line->point);
+    line->point = (pointObj*) msSmallRealloc(out, sizeof(pointObj)*MS_MAX(1, n));
+    line->numpoints = n;
   }
-    
-  msFreeShape(shape);
-  
+
   return MS_SUCCESS;
 }
 
+/* Weighted average of the ws points of the window, window is NULL for the ws
+   points from from. The sums are done in the same order by both versions. */
+static void smoothWindow(const pointObj *from, const int *window, int ws, const double *coeff, double sum, pointObj *point)
+{
+  int k;
+#ifdef MS_SMOOTHING_SSE2
+  __m128d acc = _mm_setzero_pd();
+
+  for (k=0; k<ws; ++k) {
+    const pointObj *p = window ? &from[window[k]] : &from[k];
+    acc = _mm_add_pd(acc, _mm_mul_pd(_mm_loadu_pd(&p->x), _mm_set1_pd(coeff[k])));
+  }
+  acc = _mm_div_pd(acc, _mm_set1_pd(sum));
+  _mm_storel_pd(&point->x, acc);
+  _mm_storeh_pd(&point->y, acc);
+#else
+  double sum_x=0, sum_y=0;
+
+  for (k=0; k<ws; ++k) {
+    const pointObj *p = window ? &from[window[k]] : &from[k];
+    sum_x += p->x * coeff[k];
+    sum_y += p->y * coeff[k];
+  }
+  point->x = sum_x/sum;
+  point->y = sum_y/sum;
+#endif
+}
+
+/* One smoothing pass of the numpoints points of in into out. */
+static void smoothLine(const pointObj *in, int numpoints, int isRing, int ws, const double *coeff, double sum, int *window, pointObj *out)
+{
+  int half = ws/2, pos;
+
+  for (pos=0; pos<numpoints; ++pos) {
+    out[pos] = in[pos];
+    if (pos >= half && pos+half < numpoints)
+      smoothWindow(&in[pos-half], NULL, ws, coeff, sum, &out[pos]);
+    else if (getLineWindow(numpoints, isRing, pos, half, window))
+      smoothWindow(in, window, ws, coeff, sum, &out[pos]);
+    /* else invalid window, the point is kept */
+  }
+}
+
 shapeObj* msSmoothShapeSIA(shapeObj *shape, int ss, int si, char *preprocessing)
 {
   int i, j;
-  pointObj *p;
   double *coeff;
+  int *window;
+  pointObj *tmp;
+  int maxpoints = 0, passes;
   shapeObj *newShape;
 
   newShape = (shapeObj *) msSmallMalloc(sizeof (shapeObj));
@@ -200,10 +209,13 @@ shapeObj* msSmoothShapeSIA(shapeObj *shape, int ss, int si, char *preprocessing)
 
   if (ss < 3)
     ss = 3;
-  
+
   if (si < 1)
     si = 1;
 
+  /* the second iteration has always started over from the initial shape */
+  passes = (si > 1) ? si-1 : 1;
+
   /* Apply preprocessing */
   if (preprocessing)
   {
@@ -212,99 +224,69 @@ shapeObj* msSmoothShapeSIA(shapeObj *shape, int ss, int si, char *preprocessing)
     else if (strcasecmp(preprocessing, "angle") == 0)
       processShapePathDistance(shape, MS_FALSE);
   }
-  
-  p = (pointObj *) msSmallMalloc(ss*sizeof(pointObj));
-  coeff = (double *) msSmallMalloc(ss*sizeof (double));        
-  
-  for (i=0;i<si;++i) {
-    shapeObj initialShape;
-    
-    if (si > 1 && i>0) {
-      msInitShape(&initialShape);    
-      msCopyShape(shape, &initialShape);
-      
-      /* Clean our shape object */
-      for (j=0; j < newShape->numlines; ++j)
-        free(newShape->line[j].point);
-      newShape->numlines = 0;
-      if (newShape->line) {
-        free(newShape->line);
-        newShape->line = NULL;
-      }
 
-      shape = &initialShape;
-    }
-    
-    for (j=0;j<shape->numlines;++j) {
-      int k, ws, res;      
-      lineObj newLine = {0,NULL};
-      lineWindow lw;
-
-      /* determine if we can use the ss for this line */
-      ws = ss;      
-      if (ws >= shape->line[j].numpoints) {
-        ws = shape->line[j].numpoints-1;
-      }
+  if (shape->numlines == 0)
+    return newShape;
 
-      if (ws%2==0)
-        ws-=1;  
+  coeff = (double *) msSmallMalloc(ss*sizeof (double));
+  window = (int *) msSmallMalloc(ss*sizeof (int));
+  for (j=0;j<shape->numlines;++j)
+    maxpoints = MS_MAX(maxpoints, shape->line[j].numpoints);
+  tmp = (pointObj *) msSmallMalloc(MS_MAX(1, maxpoints)*sizeof(pointObj));
 
-      initLineWindow(&lw, &shape->line[j], ws);
-      msAddLine(newShape, &newLine);
+  newShape->line = (lineObj *) msSmallMalloc(shape->numlines*sizeof(lineObj));
+  newShape->numlines = shape->numlines;
 
-      coeff[lw.index] = 1;
-      for (k=0;k<lw.index;++k) {
-        coeff[lw.index+(k+1)] = coeff[lw.index-k]/2;
-        coeff[lw.index-(k+1)] = coeff[lw.index+k]/2;    
-      }
-      
-      
-      while ((res = nextLineWindow(&lw)) != MS_DONE) {
-        double sum_x=0, sum_y=0, sum = 0;
-        pointObj point;
-        int k = 0;        
-
-        if (res == MS_FALSE) { /* invalid window */
-          msAddPointToLine(&newShape->line[j],
-                           lw.points[lw.index]);
-          continue;
-        }
-
-        /* Apply Coefficient */
-        p[lw.index] = *lw.points[lw.index];
-        for (k=0; k<lw.index; ++k) {
-          p[lw.index-(k+1)] = *lw.points[lw.index-(k+1)];
-          p[lw.index-(k+1)].x *= coeff[lw.index-(k+1)];
-          p[lw.index-(k+1)].y *= coeff[lw.index-(k+1)];
-          p[lw.index+(k+1)] = *lw.points[lw.index+(k+1)];
-          p[lw.index+(k+1)].x *= coeff[lw.index+(k+1)];
-          p[lw.index+(k+1)].y *= coeff[lw.index+(k+1)];
-        }
-        
-        for (k=0; k<lw.size; ++k) {
-          sum += coeff[k];
-          sum_x += p[k].x;
-          sum_y += p[k].y;          
-        }
-      
-        point.x = sum_x/sum;
-        point.y = sum_y/sum;
-        msAddPointToLine(&newShape->line[j],
-                         &point);
-      }
+  for (j=0;j<shape->numlines;++j) {
+    lineObj *line = &shape->line[j];
+    lineObj *newLine = &newShape->line[j];
+    int k, ws, half;
+    double sum;
+
+    newLine->numpoints = line->numpoints;
+    newLine->point = (pointObj *) msSmallMalloc(MS_MAX(1, line->numpoints)*sizeof(pointObj));
 
-      freeLineWindow(&lw);      
+    /* determine if we can use the ss for this line */
+    ws = ss;
+    if (ws >= line->numpoints) {
+      ws = line->numpoints-1;
     }
-    
-    if (i>0) {
-      msFreeShape(shape);
-      shape = newShape;
+
+    if (ws%2==0)
+      ws-=1;
+
+    if (ws < 1) { /* too few points to smooth */
+      if (line->numpoints > 0)
+        memcpy(newLine->point, line->point, line->numpoints*sizeof(pointObj));
+      continue;
+    }
+
+    half = ws/2;
+    coeff[half] = 1;
+    for (k=0;k<half;++k) {
+      coeff[half+(k+1)] = coeff[half-k]/2;
+      coeff[half-(k+1)] = coeff[half+k]/2;
+    }
+    for (sum=0,k=0; k<ws; ++k)
+      sum += coeff[k];
+
+    /* the passes alternate between the new line and tmp, ending in the new line */
+    for (i=0;i<passes;++i) {
+      const pointObj *in;
+      pointObj *out;
+
+      if (i == 0)
+        in = line->point;
+      else
+        in = ((passes-i)%2 == 0) ? newLine->point : tmp;
+      out = ((passes-i)%2 == 1) ? newLine->point : tmp;
+      smoothLine(in, line->numpoints, lineIsRing(in, line->numpoints), ws, coeff, sum, window, out);
     }
-    
   }
-  
-  free(p);
+
+  free(tmp);
+  free(window);
   free(coeff);
-  
+
   return newShape;
 }
@@ -29,6 +29,8 @@
 
 #include <stdarg.h> /* variable number of function arguments support */
 #include <time.h> /* since the parser handles time/date we need this */
+#include <ctype.h>
+#include <sys/stat.h>
 
 #include "mapserver.h"
 #include "mapfile.h"
@@ -47,6 +49,9 @@ extern int msyylineno;
 extern FILE *msyyin;
 
 extern int msyystate;
+extern mapTokenStreamObj *msyytokens;
+
+static void msReleaseSymbolFile(struct symbolFileObj *file);
 
 static const unsigned char PNGsig[8] = {137, 80, 78, 71, 13, 10, 26, 10}; /* 89 50 4E 47 0D 0A 1A 0A hex */
 static const unsigned char JPEGsig[3] = {255, 216, 255}; /* FF D8 FF hex */
@@ -420,6 +425,8 @@ int msFreeSymbolSet(symbolSetObj *symbolset)
   int i;
 
   freeImageCache(symbolset->imagecache);
+  msReleaseSymbolFile(symbolset->file);
+  symbolset->file = NULL;
   for(i=0; i<symbolset->numsymbols; i++) {
     if (symbolset->symbol[i]!=NULL) {
       if ( msFreeSymbol((symbolset->symbol[i])) == MS_SUCCESS ) {
@@ -443,6 +450,7 @@ void msInitSymbolSet(symbolSetObj *symbolset)
 
   symbolset->fontset = NULL;
   symbolset->map = NULL;
+  symbolset->file = NULL;
 
   symbolset->numsymbols = 0;
   symbolset->maxsymbols = 0;
@@ -543,28 +551,24 @@ int msLoadSymbolSet(symbolSetObj *symbolset, mapObj *map)
   return retval;
 }
 
-int loadSymbolSet(symbolSetObj *symbolset, mapObj *map)
+/*
+** Parses the symbol file at szPath (filename in messages) into symbolset.
+*/
+static int loadSymbolFile(symbolSetObj *symbolset, char *szPath, const char *filename)
 {
   int status=1;
-  char szPath[MS_MAXPATHLEN], *pszSymbolPath=NULL;
+  char *pszSymbolPath=NULL;
 
   int foundSymbolSetToken=MS_FALSE;
   int token;
 
-  if(!symbolset) {
-    msSetError(MS_SYMERR, "Symbol structure unallocated.", "loadSymbolSet()");
-    return(-1);
-  }
-
-  symbolset->map = (mapObj *)map;
-
-  if(!symbolset->filename) return(0);
-
   /*
-  ** Open the file
+  ** Open the file, unless its tokens come with a compiled mapfile
   */
-  if((msyyin = fopen(msBuildPath(szPath, symbolset->map->mappath, symbolset->filename), "r")) == NULL) {
-    msSetError(MS_IOERR, "(%s)", "loadSymbolSet()", symbolset->filename);
+  if(msyytokens && msyytokens->replay)
+    msyyin = NULL;
+  else if((msyyin = fopen(szPath, "r")) == NULL) {
+    msSetError(MS_IOERR, "(%s)", "loadSymbolSet()", filename);
     return(-1);
   }
 
@@ -574,7 +578,8 @@ int loadSymbolSet(symbolSetObj *symbolset, mapObj *map)
   msyylex(); /* sets things up, but doesn't process any tokens */
 
   msyylineno = 0; /* reset line counter */
-  msyyrestart(msyyin); /* flush the scanner - there's a better way but this works for now */
+  if(msyyin)
+    msyyrestart(msyyin); /* flush the scanner - there's a better way but this works for now */
 
   /*
   ** Read the symbol file
@@ -584,7 +589,8 @@ int loadSymbolSet(symbolSetObj *symbolset, mapObj *map)
 
     if(!foundSymbolSetToken && token != SYMBOLSET) {
       msSetError(MS_IDENTERR, "First token must be SYMBOLSET, this doesn't look like a symbol file.", "msLoadSymbolSet()");
-      return(-1);
+      status = -1;
+      break;
     }
 
     switch(token) {
@@ -612,12 +618,227 @@ int loadSymbolSet(symbolSetObj *symbolset, mapObj *map)
     if(status != 1) break;
   } /* end for */
 
-  fclose(msyyin);
+  if(msyyin)
+    fclose(msyyin);
   msyyin = NULL;
   free(pszSymbolPath);
   return(status);
 }
 
+/*
+** Per process cache of parsed symbol files: a map load copies the symbols of
+** its SYMBOLSET from the cache instead of parsing the file, which is parsed
+** again when its modification time or size changes. The symbol names are
+** indexed for msGetSymbolIndex(), see msSymbolFileLookup(). Pixmap and SVG
+** symbols are still decoded on their first use, see preloadSymbol(). The
+** cache is protected by TLOCK_SYMBOLCACHE, the entries are reference counted
+** and shared with the symbolsets copied from them.
+*/
+#define MS_SYMBOL_FILE_CACHE_MAX 16
+
+struct symbolFileObj {
+  int refcount;
+  char *path;
+  time_t mtime;
+  off_t size;
+  unsigned long last_used;
+  symbolSetObj symbolset; /* symbol 0 included, as in the copies */
+  unsigned int mask;      /* number of slots - 1 */
+  int *slots;             /* symbol of each name slot, -1 if none */
+};
+
+static int symbolFileCacheCount = 0;
+static unsigned long symbolFileCacheClock = 0;
+static struct symbolFileObj *symbolFileCache[MS_SYMBOL_FILE_CACHE_MAX];
+
+static unsigned int symbolNameHash(const char *name)
+{
+  unsigned int hashval = 2166136261U;
+
+  for(; *name; name++)
+    hashval = (hashval ^ (unsigned char) tolower((unsigned char) *name)) * 16777619U;
+  return hashval;
+}
+
+static void msReleaseSymbolFile(struct symbolFileObj *file)
+{
+  if(!file || MS_REFCNT_DECR_IS_NOT_ZERO(file))
+    return;
+  msFreeSymbolSet(&file->symbolset);
+  msFree(file->path);
+  msFree(file->slots);
+  msFree(file);
+}
+
+static void msSymbolFileCacheRemove(int i)
+{
+  msReleaseSymbolFile(symbolFileCache[i]);
+
+  symbolFileCacheCount--;
+  if(i != symbolFileCacheCount)
+    symbolFileCache[i] = symbolFileCache[symbolFileCacheCount];
+}
+
+void msSymbolFileCacheCleanup(void)
+{
+  msAcquireLock( TLOCK_SYMBOLCACHE );
+  while(symbolFileCacheCount > 0)
+    msSymbolFileCacheRemove(symbolFileCacheCount - 1);
+  msReleaseLock( TLOCK_SYMBOLCACHE );
+}
+
+/* the slots of the names, the first symbol of a name taking it as msGetSymbolIndex() does */
+static void msIndexSymbolFile(struct symbolFileObj *file)
+{
+  symbolSetObj *set = &file->symbolset;
+  unsigned int numslots, h;
+  int i;
+
+  for(numslots = 16; numslots < (unsigned int) set->numsymbols * 2; numslots *= 2);
+  file->mask = numslots - 1;
+  file->slots = (int *) msSmallMalloc(numslots * sizeof(int));
+  for(h=0; h<numslots; h++)
+    file->slots[h] = -1;
+
+  for(i=1; i<set->numsymbols; i++) { /* symbol 0 has no name */
+    if(!set->symbol[i]->name)
+      continue;
+    for(h=symbolNameHash(set->symbol[i]->name) & file->mask; file->slots[h] >= 0; h=(h+1) & file->mask) {
+      if(strcasecmp(set->symbol[file->slots[h]]->name, set->symbol[i]->name) == 0)
+        break;
+    }
+    if(file->slots[h] < 0)
+      file->slots[h] = i;
+  }
+}
+
+/*
+** Index of the symbol named name in symbols through the index of the symbol
+** file they were copied from, -1 if not found or if symbols changed since.
+*/
+int msSymbolFileLookup(symbolSetObj *symbols, const char *name)
+{
+  struct symbolFileObj *file = symbols->file;
+  unsigned int h;
+
+  if(!file || symbols->numsymbols != file->symbolset.numsymbols)
+    return -1;
+
+  for(h=symbolNameHash(name) & file->mask; file->slots[h] >= 0; h=(h+1) & file->mask) {
+    int i = file->slots[h];
+    if(strcasecmp(file->symbolset.symbol[i]->name, name) == 0) {
+      /* unless renamed in the copy */
+      if(symbols->symbol[i]->name && strcasecmp(symbols->symbol[i]->name, name) == 0)
+        return i;
+      return -1;
+    }
+  }
+  return -1;
+}
+
+/* the parsed symbol file at szPath, with a reference for the caller */
+static struct symbolFileObj *msGetSymbolFile(char *szPath, const char *filename, struct stat *st)
+{
+  struct symbolFileObj *file;
+  int i, slot;
+
+  msAcquireLock( TLOCK_SYMBOLCACHE );
+  for(i=0; i<symbolFileCacheCount; i++) {
+    file = symbolFileCache[i];
+    if(strcmp(file->path, szPath) != 0)
+      continue;
+    if(file->mtime == st->st_mtime && file->size == st->st_size) {
+      MS_REFCNT_INCR(file);
+      file->last_used = ++symbolFileCacheClock;
+      msReleaseLock( TLOCK_SYMBOLCACHE );
+      return file;
+    }
+    msSymbolFileCacheRemove(i); /* the file has been modified */
+    break;
+  }
+  msReleaseLock( TLOCK_SYMBOLCACHE );
+
+  file = (struct symbolFileObj *) msSmallCalloc(1, sizeof(struct symbolFileObj));
+  MS_REFCNT_INIT(file);
+  file->path = msStrdup(szPath);
+  file->mtime = st->st_mtime;
+  file->size = st->st_size;
+  msInitSymbolSet(&file->symbolset);
+  if(loadSymbolFile(&file->symbolset, szPath, filename) == -1) {
+    msReleaseSymbolFile(file);
+    return NULL;
+  }
+  msIndexSymbolFile(file);
+
+  msAcquireLock( TLOCK_SYMBOLCACHE );
+  for(i=0; i<symbolFileCacheCount; i++) {
+    if(strcmp(symbolFileCache[i]->path, szPath) == 0)
+      break;
+  }
+  if(i == symbolFileCacheCount) { /* unless parsed by another thread in the meantime */
+    if(symbolFileCacheCount == MS_SYMBOL_FILE_CACHE_MAX) {
+      slot = 0;
+      for(i=1; i<symbolFileCacheCount; i++) {
+        if(symbolFileCache[i]->last_used < symbolFileCache[slot]->last_used)
+          slot = i;
+      }
+      msSymbolFileCacheRemove(slot);
+    }
+    file->last_used = ++symbolFileCacheClock;
+    MS_REFCNT_INCR(file);
+    symbolFileCache[symbolFileCacheCount++] = file;
+  }
+  msReleaseLock( TLOCK_SYMBOLCACHE );
+
+  return file;
+}
+
+int loadSymbolSet(symbolSetObj *symbolset, mapObj *map)
+{
+  char szPath[MS_MAXPATHLEN];
+  struct symbolFileObj *file;
+  struct stat st;
+  int i, first;
+
+  if(!symbolset) {
+    msSetError(MS_SYMERR, "Symbol structure unallocated.", "loadSymbolSet()");
+    return(-1);
+  }
+
+  symbolset->map = (mapObj *)map;
+
+  if(!symbolset->filename) return(0);
+
+  msBuildPath(szPath, symbolset->map->mappath, symbolset->filename);
+
+  /* tokens to record or replay, or a file fopen() will report */
+  if(msyytokens || stat(szPath, &st) != 0)
+    return loadSymbolFile(symbolset, szPath, symbolset->filename);
+
+  file = msGetSymbolFile(szPath, symbolset->filename, &st);
+  if(!file)
+    return(-1);
+
+  first = symbolset->numsymbols;
+  for(i=1; i<file->symbolset.numsymbols; i++) {
+    if(msGrowSymbolSet(symbolset) == NULL) {
+      msReleaseSymbolFile(file);
+      return(-1);
+    }
+    msCopySymbol(symbolset->symbol[symbolset->numsymbols], file->symbolset.symbol[i], map);
+    symbolset->numsymbols++;
+  }
+
+  msReleaseSymbolFile(symbolset->file);
+  symbolset->file = NULL;
+  if(first == 1) /* same symbols as the file */
+    symbolset->file = file;
+  else
+    msReleaseSymbolFile(file);
+
+  return(0);
+}
+
 int msGetCharacterSize(mapObj *map, char* font, int size, char *character, rectObj *r) {
   unsigned int unicode, codepoint;
   glyph_element *glyph;
@@ -933,6 +1154,13 @@ int msCopySymbol(symbolObj *dst, symbolObj *src, mapObj *map)
   MS_COPYSTRING(dst->font, src->font);
   MS_COPYSTRING(dst->full_pixmap_path,src->full_pixmap_path);
 
+  /* keep a decoded pixmap, copies of cached or warmed up maps don't reload it */
+  if(src->pixmap_buffer && src->pixmap_buffer->type == MS_BUFFER_BYTE_RGBA) {
+    dst->pixmap_buffer = (rasterBufferObj*)msSmallCalloc(1,sizeof(rasterBufferObj));
+    msCopyRasterBuffer(dst->pixmap_buffer, src->pixmap_buffer);
+    dst->renderer = src->renderer;
+  }
+
   return(MS_SUCCESS);
 }
 
@@ -963,6 +1191,11 @@ int msCopySymbolSet(symbolSetObj *dst, symbolSetObj *src, mapObj *map)
     dst->numsymbols++;
   }
 
+  if(src->file && dst->numsymbols == src->numsymbols) { /* share the name index */
+    MS_REFCNT_INCR(src->file);
+    dst->file = src->file;
+  }
+
   /* MS_COPYSTELEM(imagecachesize); */
 
   /* I have a feeling that the code below is not quite right - Sean */
@@ -39,7 +39,8 @@ enum MS_SYMBOL_TYPE {MS_SYMBOL_SIMPLE=1000, MS_SYMBOL_VECTOR, MS_SYMBOL_ELLIPSE,
 #define MS_MAXVECTORPOINTS 100      /* shade, marker and line symbol parameters */
 #define MS_MAXPATTERNLENGTH 10
 
-#define MS_IMAGECACHESIZE 6
+#define MS_IMAGECACHESIZE 32       /* default number of symbol tiles cached per image, see MS_SYMBOL_TILE_CACHE_SIZE */
+#define MS_TILECACHE_HASHSIZE 64    /* number of hash buckets of the symbol tile cache */
 
 /* COLOR OBJECT */
 typedef struct {
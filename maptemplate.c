@@ -79,6 +79,11 @@ static char *olLayerWMSTag = \
 
 static char *processLine(mapservObj *mapserv, char *instr, FILE *stream, int mode);
 
+typedef struct compiledTemplateObj compiledTemplateObj;
+static compiledTemplateObj *compileTemplate(mapservObj *mapserv, layerObj *layer, const char *text, int multiline);
+static int renderCompiledTemplate(mapservObj *mapserv, compiledTemplateObj *compiled, msIOBuffer *out);
+static void freeCompiledTemplate(compiledTemplateObj *compiled);
+
 static int isValidTemplate(FILE *stream, const char *filename)
 {
   char buffer[MS_BUFFER_LENGTH];
@@ -851,12 +856,15 @@ static int processFeatureTag(mapservObj *mapserv, char **line, layerObj *layer)
   char *preTag, *postTag; /* text before and after the tag */
 
   char *argValue;
-  char *tag, *tagInstance, *tagStart;
+  char *tag, *tagStart;
   hashTableObj *tagArgs=NULL;
 
   int limit=-1;
   char *trimLast=NULL;
 
+  compiledTemplateObj *compiled, *compiledLast=NULL;
+  msIOBuffer features = {NULL, 0, 0, 0};
+
   int i, j, status;
 
   if(!*line) {
@@ -926,9 +934,32 @@ static int processFeatureTag(mapservObj *mapserv, char **line, layerObj *layer)
   else
     limit = MS_MIN(limit, layer->resultcache->numresults);
 
+  /* the tag is compiled once for all the features, the last one may be trimmed */
+  compiled = compileTemplate(mapserv, layer, tag, MS_TRUE);
+  if(compiled && trimLast && limit > 0) {
+    char *ptr;
+    if((ptr = strrstr(tag, trimLast)) != NULL) {
+      *ptr = '\0';
+      compiledLast = compileTemplate(mapserv, layer, tag, MS_TRUE);
+      if(!compiledLast) {
+        freeCompiledTemplate(compiled);
+        compiled = NULL;
+      }
+    }
+  }
+  if(!compiled) {
+    msFreeHashTable(tagArgs);
+    msFree(postTag);
+    msFree(tag);
+    return MS_FAILURE;
+  }
+
   for(i=0; i<limit; i++) {
     status = msLayerGetShape(layer, &(mapserv->resultshape), &(layer->resultcache->results[i]));
     if(status != MS_SUCCESS) {
+      freeCompiledTemplate(compiled);
+      freeCompiledTemplate(compiledLast);
+      free(features.data);
       msFreeHashTable(tagArgs);
       msFree(postTag);
       msFree(tag);
@@ -941,27 +972,25 @@ static int processFeatureTag(mapservObj *mapserv, char **line, layerObj *layer)
     if(layer->numjoins > 0) {
       for(j=0; j<layer->numjoins; j++) {
         if(layer->joins[j].type == MS_JOIN_ONE_TO_ONE) {
+          msJoinPrefetch(layer, &(layer->joins[j]), i);
           msJoinPrepare(&(layer->joins[j]), &(mapserv->resultshape));
           msJoinNext(&(layer->joins[j])); /* fetch the first row */
         }
       }
     }
 
-    /*
-    ** if necessary trim a few characters off the end of the tag
-    */
-    if(trimLast && (i == limit-1)) {
-      char *ptr;
-      if((ptr = strrstr(tag, trimLast)) != NULL)
-        *ptr = '\0';
-    }
-
-    /* process the tag */
-    tagInstance = processLine(mapserv, tag, NULL, QUERY); /* do substitutions */
-    *line = msStringConcatenate(*line, tagInstance); /* grow the line */
-
-    free(tagInstance);
+    /* process the tag, trimmed for the last feature if necessary */
+    status = renderCompiledTemplate(mapserv, (compiledLast && i == limit-1) ? compiledLast : compiled, &features);
     msFreeShape(&(mapserv->resultshape)); /* init too */
+    if(status != MS_SUCCESS) {
+      freeCompiledTemplate(compiled);
+      freeCompiledTemplate(compiledLast);
+      free(features.data);
+      msFreeHashTable(tagArgs);
+      msFree(postTag);
+      msFree(tag);
+      return status;
+    }
 
     mapserv->RN++; /* increment counters */
     mapserv->LRN++;
@@ -970,11 +999,16 @@ static int processFeatureTag(mapservObj *mapserv, char **line, layerObj *layer)
   /* msLayerClose(layer); */
   mapserv->resultlayer = NULL; /* necessary? */
 
+  if(features.data)
+    *line = msStringConcatenate(*line, (char *) features.data); /* grow the line */
   *line = msStringConcatenate(*line, postTag);
 
   /*
   ** clean up
   */
+  freeCompiledTemplate(compiled);
+  freeCompiledTemplate(compiledLast);
+  free(features.data);
   free(postTag);
   free(tag);
   msFreeHashTable(tagArgs);
@@ -1186,127 +1220,194 @@ static int processIncludeTag(mapservObj *mapserv, char **line, FILE *stream, int
 */
 enum ITEM_ESCAPING {ESCAPE_HTML, ESCAPE_URL, ESCAPE_JSON, ESCAPE_NONE};
 
-static int processItemTag(layerObj *layer, char **line, shapeObj *shape)
+/*
+** Arguments of an [item ...] tag, with the index of the item in the layer item list.
+*/
+typedef struct {
+  char *name, *pattern;
+  char *format, *nullFormat;
+  int precision;
+  int uc, lc, commify;
+  int escape;
+  int item;
+} itemTagObj;
+
+static void freeItemTag(itemTagObj *itemTag)
 {
-  int i, j;
+  msFree(itemTag->name);
+  msFree(itemTag->pattern);
+  msFree(itemTag->format);
+  msFree(itemTag->nullFormat);
+}
 
-  char *tag, *tagStart, *tagEnd;
+/*
+** Parse the [item ...] tag at tagStart, once for all the shapes of layer.
+*/
+static int parseItemTag(layerObj *layer, char *tagStart, itemTagObj *itemTag)
+{
+  int i;
   hashTableObj *tagArgs=NULL;
-  int tagLength;
-  char *encodedTagValue=NULL, *tagValue=NULL;
-
   char *argValue=NULL;
-
   char *name=NULL, *pattern=NULL;
-  char *format=NULL, *nullFormat=NULL;
-  int precision;
-  int uc, lc, commify;
-  int escape;
+  char *format="$value", *nullFormat="";
 
-  if(!*line) {
-    msSetError(MS_WEBERR, "Invalid line pointer.", "processItemTag()");
-    return(MS_FAILURE);
-  }
+  itemTag->name = itemTag->pattern = itemTag->format = itemTag->nullFormat = NULL;
+  itemTag->precision=-1;
+  itemTag->uc = itemTag->lc = itemTag->commify = MS_FALSE;
+  itemTag->escape=ESCAPE_HTML;
 
-  tagStart = findTag(*line, "item");
+  /* check for any tag arguments */
+  if(getTagArgs("item", tagStart, &tagArgs) != MS_SUCCESS) return(MS_FAILURE);
+  if(tagArgs) {
+    argValue = msLookupHashTable(tagArgs, "name");
+    if(argValue) name = argValue;
 
-  if(!tagStart) return(MS_SUCCESS); /* OK, just return; */
+    argValue = msLookupHashTable(tagArgs, "pattern");
+    if(argValue) pattern = argValue;
 
-  while (tagStart) {
-    format = "$value"; /* initialize the tag arguments */
-    nullFormat = "";
-    precision=-1;
-    name = pattern = NULL;
-    uc = lc = commify = MS_FALSE;
-    escape=ESCAPE_HTML;
+    argValue = msLookupHashTable(tagArgs, "precision");
+    if(argValue) itemTag->precision = atoi(argValue);
 
-    /* check for any tag arguments */
-    if(getTagArgs("item", tagStart, &tagArgs) != MS_SUCCESS) return(MS_FAILURE);
-    if(tagArgs) {
-      argValue = msLookupHashTable(tagArgs, "name");
-      if(argValue) name = argValue;
+    argValue = msLookupHashTable(tagArgs, "format");
+    if(argValue) format = argValue;
 
-      argValue = msLookupHashTable(tagArgs, "pattern");
-      if(argValue) pattern = argValue;
+    argValue = msLookupHashTable(tagArgs, "nullformat");
+    if(argValue) nullFormat = argValue;
 
-      argValue = msLookupHashTable(tagArgs, "precision");
-      if(argValue) precision = atoi(argValue);
+    argValue = msLookupHashTable(tagArgs, "uc");
+    if(argValue && strcasecmp(argValue, "true") == 0) itemTag->uc = MS_TRUE;
 
-      argValue = msLookupHashTable(tagArgs, "format");
-      if(argValue) format = argValue;
+    argValue = msLookupHashTable(tagArgs, "lc");
+    if(argValue && strcasecmp(argValue, "true") == 0) itemTag->lc = MS_TRUE;
 
-      argValue = msLookupHashTable(tagArgs, "nullformat");
-      if(argValue) nullFormat = argValue;
+    argValue = msLookupHashTable(tagArgs, "commify");
+    if(argValue && strcasecmp(argValue, "true") == 0) itemTag->commify = MS_TRUE;
 
-      argValue = msLookupHashTable(tagArgs, "uc");
-      if(argValue && strcasecmp(argValue, "true") == 0) uc = MS_TRUE;
+    argValue = msLookupHashTable(tagArgs, "escape");
+    if(argValue && strcasecmp(argValue, "url") == 0) itemTag->escape = ESCAPE_URL;
+    else if(argValue && strcasecmp(argValue, "none") == 0) itemTag->escape = ESCAPE_NONE;
+    else if(argValue && strcasecmp(argValue, "json") == 0) itemTag->escape = ESCAPE_JSON;
 
-      argValue = msLookupHashTable(tagArgs, "lc");
-      if(argValue && strcasecmp(argValue, "true") == 0) lc = MS_TRUE;
+    /* TODO: deal with sub strings */
+  }
 
-      argValue = msLookupHashTable(tagArgs, "commify");
-      if(argValue && strcasecmp(argValue, "true") == 0) commify = MS_TRUE;
+  if(!name) {
+    msSetError(MS_WEBERR, "Item tag contains no name attribute.", "processItemTag()");
+    msFreeHashTable(tagArgs);
+    return(MS_FAILURE);
+  }
 
-      argValue = msLookupHashTable(tagArgs, "escape");
-      if(argValue && strcasecmp(argValue, "url") == 0) escape = ESCAPE_URL;
-      else if(argValue && strcasecmp(argValue, "none") == 0) escape = ESCAPE_NONE;
-      else if(argValue && strcasecmp(argValue, "json") == 0) escape = ESCAPE_JSON;
+  for(i=0; i<layer->numitems; i++)
+    if(strcasecmp(name, layer->items[i]) == 0) break;
 
-      /* TODO: deal with sub strings */
-    }
+  if(i == layer->numitems) {
+    msSetError(MS_WEBERR, "Item name (%s) not found in layer item list.", "processItemTag()", name);
+    msFreeHashTable(tagArgs);
+    return(MS_FAILURE);
+  }
 
-    if(!name) {
-      msSetError(MS_WEBERR, "Item tag contains no name attribute.", "processItemTag()");
-      return(MS_FAILURE);
-    }
+  itemTag->item = i;
+  itemTag->name = msStrdup(name);
+  if(pattern) itemTag->pattern = msStrdup(pattern);
+  itemTag->format = msStrdup(format);
+  itemTag->nullFormat = msStrdup(nullFormat);
 
-    for(i=0; i<layer->numitems; i++)
-      if(strcasecmp(name, layer->items[i]) == 0) break;
+  msFreeHashTable(tagArgs);
 
-    if(i == layer->numitems) {
-      msSetError(MS_WEBERR, "Item name (%s) not found in layer item list.", "processItemTag()", name);
-      return(MS_FAILURE);
+  return(MS_SUCCESS);
+}
+
+/*
+** Build the (escaped) text of a parsed [item ...] tag for shape. Returns NULL on error.
+*/
+static char *getItemTagValue(itemTagObj *itemTag, shapeObj *shape)
+{
+  int i = itemTag->item, j;
+  char *encodedTagValue=NULL, *tagValue=NULL;
+
+  if(shape->values[i] && strlen(shape->values[i]) > 0) {
+    char *itemValue=NULL;
+
+    /* set tag text depending on pattern (if necessary), nullFormat can contain $value (#3637) */
+    if(itemTag->pattern && msEvalRegex(itemTag->pattern, shape->values[i]) != MS_TRUE)
+      tagValue = msStrdup(itemTag->nullFormat);
+    else
+      tagValue = msStrdup(itemTag->format);
+
+    if(itemTag->precision != -1) {
+      char numberFormat[16];
+
+      itemValue = (char *) msSmallMalloc(64); /* plenty big */
+      snprintf(numberFormat, sizeof(numberFormat), "%%.%dlf", itemTag->precision);
+      snprintf(itemValue, 64, numberFormat, atof(shape->values[i]));
+    } else
+      itemValue = msStrdup(shape->values[i]);
+
+    if(itemTag->commify == MS_TRUE)
+      itemValue = msCommifyString(itemValue);
+
+    /* apply other effects */
+    if(itemTag->uc == MS_TRUE)
+      for(j=0; j<strlen(itemValue); j++) itemValue[j] = toupper(itemValue[j]);
+    if(itemTag->lc == MS_TRUE)
+      for(j=0; j<strlen(itemValue); j++) itemValue[j] = tolower(itemValue[j]);
+
+    tagValue = msReplaceSubstring(tagValue, "$value", itemValue);
+    msFree(itemValue);
+
+    if(!tagValue) {
+      msSetError(MS_WEBERR, "Error applying item format.", "processItemTag()");
+      return(NULL); /* todo leaking... */
     }
+  } else {
+    tagValue = msStrdup(itemTag->nullFormat); /* attribute value is NULL or empty */
+  }
 
-    /*
-    ** now we know which item so build the tagValue
-    */
-    if(shape->values[i] && strlen(shape->values[i]) > 0) {
-      char *itemValue=NULL;
+  switch(itemTag->escape) {
+    case ESCAPE_HTML:
+      encodedTagValue = msEncodeHTMLEntities(tagValue);
+      break;
+    case ESCAPE_JSON:
+      encodedTagValue = msEscapeJSonString(tagValue);
+      break;
+    case ESCAPE_URL:
+      encodedTagValue = msEncodeUrl(tagValue);
+      break;
+    default:
+      return(tagValue);
+  }
+  msFree(tagValue);
 
-      /* set tag text depending on pattern (if necessary), nullFormat can contain $value (#3637) */
-      if(pattern && msEvalRegex(pattern, shape->values[i]) != MS_TRUE)
-        tagValue = msStrdup(nullFormat);
-      else
-        tagValue = msStrdup(format);
+  return(encodedTagValue);
+}
 
-      if(precision != -1) {
-        char numberFormat[16];
+static int processItemTag(layerObj *layer, char **line, shapeObj *shape)
+{
+  char *tag, *tagStart, *tagEnd;
+  itemTagObj itemTag;
+  int tagLength;
+  char *tagValue=NULL;
 
-        itemValue = (char *) msSmallMalloc(64); /* plenty big */
-        snprintf(numberFormat, sizeof(numberFormat), "%%.%dlf", precision);
-        snprintf(itemValue, 64, numberFormat, atof(shape->values[i]));
-      } else
-        itemValue = msStrdup(shape->values[i]);
+  if(!*line) {
+    msSetError(MS_WEBERR, "Invalid line pointer.", "processItemTag()");
+    return(MS_FAILURE);
+  }
 
-      if(commify == MS_TRUE)
-        itemValue = msCommifyString(itemValue);
+  tagStart = findTag(*line, "item");
 
-      /* apply other effects */
-      if(uc == MS_TRUE)
-        for(j=0; j<strlen(itemValue); j++) itemValue[j] = toupper(itemValue[j]);
-      if(lc == MS_TRUE)
-        for(j=0; j<strlen(itemValue); j++) itemValue[j] = tolower(itemValue[j]);
+  if(!tagStart) return(MS_SUCCESS); /* OK, just return; */
 
-      tagValue = msReplaceSubstring(tagValue, "$value", itemValue);
-      msFree(itemValue);
+  while (tagStart) {
+    if(parseItemTag(layer, tagStart, &itemTag) != MS_SUCCESS)
+      return(MS_FAILURE);
 
-      if(!tagValue) {
-        msSetError(MS_WEBERR, "Error applying item format.", "processItemTag()");
-        return(MS_FAILURE); /* todo leaking... */
-      }
-    } else {
-      tagValue = msStrdup(nullFormat); /* attribute value is NULL or empty */
+    /*
+    ** now we know which item so build the tagValue
+    */
+    tagValue = getItemTagValue(&itemTag, shape);
+    if(!tagValue) {
+      freeItemTag(&itemTag);
+      return(MS_FAILURE);
     }
 
     /* find the end of the tag */
@@ -1319,35 +1420,14 @@ static int processItemTag(layerObj *layer, char **line, shapeObj *shape)
     strlcpy(tag, tagStart, tagLength+1);
 
     /* do the replacement */
-    switch(escape) {
-      case ESCAPE_HTML:
-        encodedTagValue = msEncodeHTMLEntities(tagValue);
-        *line = msReplaceSubstring(*line, tag, encodedTagValue);
-        break;
-      case ESCAPE_JSON:
-        encodedTagValue = msEscapeJSonString(tagValue);
-        *line = msReplaceSubstring(*line, tag, encodedTagValue);
-        break;
-      case ESCAPE_URL:
-        encodedTagValue = msEncodeUrl(tagValue);
-        *line = msReplaceSubstring(*line, tag, encodedTagValue);
-        break;
-      case ESCAPE_NONE:
-        *line = msReplaceSubstring(*line, tag, tagValue);
-        break;
-      default:
-        break;
-    }
+    *line = msReplaceSubstring(*line, tag, tagValue);
 
     /* clean up */
     free(tag);
     tag = NULL;
-    msFreeHashTable(tagArgs);
-    tagArgs=NULL;
+    freeItemTag(&itemTag);
     msFree(tagValue);
     tagValue=NULL;
-    msFree(encodedTagValue);
-    encodedTagValue=NULL;
 
     tagStart = findTag(*line, "item");
   }
@@ -1640,7 +1720,7 @@ static int processShplabelTag(layerObj *layer, char **line, shapeObj *origshape)
       if(shape->numlines > 0) {
         struct label_auto_result lar;
         memset(&lar,0,sizeof(struct label_auto_result));
-        if(UNLIKELY(MS_FAILURE == msPolylineLabelPoint(layer->map, shape, NULL, NULL, &lar, 0))) {
+        if(UNLIKELY(MS_FAILURE == msPolylineLabelPoint(layer->map, shape, NULL, NULL, NULL, &lar, 0))) {
           free(lar.angles);
           free(lar.label_points);
           return MS_FAILURE;
@@ -2277,6 +2357,413 @@ static int processShpxyTag(layerObj *layer, char **line, shapeObj *shape)
   return(MS_SUCCESS);
 }
 
+/*
+** Compiled query templates. The text output for every result is split once into literal
+** runs and tags, item and counter tags being resolved beforehand, so that the results are
+** not searched for each tag processLine() knows. Other tags still go through processLine(),
+** one at a time.
+*/
+enum TEMPLATE_SEGMENT_TYPE {SEGMENT_TEXT, SEGMENT_ITEM, SEGMENT_VALUE, SEGMENT_RESULT, SEGMENT_SHPXY, SEGMENT_SHPLABEL, SEGMENT_TAG};
+
+/* counters and shape values, the SEGMENT_RESULT tags */
+static const char *templateResultValues[] = {"rn", "lrn", "nlr", "nr", "nl", "shpidx", "shpclass", "tileidx", "values",
+                                             "shpmid", "shpmidx", "shpmidy", "shpminx", "shpminy", "shpmaxx", "shpmaxy", NULL};
+enum TEMPLATE_RESULT_VALUE {RESULT_RN, RESULT_LRN, RESULT_NLR, RESULT_NR, RESULT_NL, RESULT_SHPIDX, RESULT_SHPCLASS, RESULT_TILEIDX, RESULT_VALUES,
+                            RESULT_SHPMID, RESULT_SHPMIDX, RESULT_SHPMIDY, RESULT_SHPMINX, RESULT_SHPMINY, RESULT_SHPMAXX, RESULT_SHPMAXY};
+
+/* tags processLine() substitutes differently for each call */
+static const char *templateVolatileTags[] = {"include", "errmsg", "errmsg_esc", "date", "resultset", "feature", NULL};
+
+/* result tags processLine() substitutes before the [item] ones */
+static const char *templateResultTags[] = {"rn", "lrn", "nlr", "cl", "items", "values", "shpmid", "shpmidx", "shpmidy", "shpminx", "shpminy", "shpmaxx", "shpmaxy",
+                                           "shpidx", "shpclass", "tileidx", "shpext", "shpext_esc", "shpxy", "shplabel", NULL};
+
+typedef struct {
+  int type;
+  char *text; /* literal text, or the tag */
+  int length;
+  int index; /* item of a SEGMENT_VALUE, TEMPLATE_RESULT_VALUE of a SEGMENT_RESULT */
+  int escape; /* of a SEGMENT_VALUE */
+  itemTagObj itemTag; /* of a SEGMENT_ITEM */
+} templateSegmentObj;
+
+struct compiledTemplateObj {
+  templateSegmentObj *segments;
+  int numsegments;
+  int maxsegments;
+};
+
+static templateSegmentObj *addTemplateSegment(compiledTemplateObj *compiled, int type, const char *text, int length)
+{
+  templateSegmentObj *segment;
+
+  if(compiled->numsegments == compiled->maxsegments) {
+    compiled->maxsegments = MS_MAX(16, compiled->maxsegments*2);
+    compiled->segments = (templateSegmentObj *) msSmallRealloc(compiled->segments, compiled->maxsegments*sizeof(templateSegmentObj));
+  }
+
+  segment = &(compiled->segments[compiled->numsegments++]);
+  segment->type = type;
+  segment->text = (char *) msSmallMalloc(length + 1);
+  strlcpy(segment->text, text, length + 1);
+  segment->length = length;
+  segment->index = -1;
+  segment->escape = ESCAPE_NONE;
+
+  return segment;
+}
+
+/*
+** End of the tag starting at the '[' of pszTag, as findTagEnd() finds it. NULL if the
+** bracket opens no tag (JSON arrays...), nested set if the quoted arguments contain tags
+** (xh="[" is no tag).
+*/
+static const char *findTemplateTagEnd(const char *pszTag, int multiline, int *nested)
+{
+  const char *pszTmp = pszTag+1, *pszQuote;
+
+  *nested = MS_FALSE;
+
+  if(*pszTmp == '\0' || *pszTmp == '"' || *pszTmp == '[' || *pszTmp == '{' || *pszTmp == ']' || isspace((unsigned char) *pszTmp))
+    return NULL;
+
+  while(*pszTmp != '\0') {
+    if(*pszTmp == '"') {
+      if((pszQuote = strchr(pszTmp+1, '"')) == NULL)
+        return NULL;
+      for(; pszTmp < pszQuote; pszTmp++) {
+        if(*pszTmp == '[' && memchr(pszTmp, ']', pszQuote - pszTmp) != NULL) *nested = MS_TRUE;
+        else if(*pszTmp == '\n' && !multiline) return NULL;
+      }
+    } else if(*pszTmp == ']')
+      return pszTmp;
+    else if(*pszTmp == '[' || (*pszTmp == '\n' && !multiline))
+      return NULL;
+    pszTmp++;
+  }
+
+  return NULL;
+}
+
+/*
+** Index of the layer item the [name], [name_esc] or [name_raw] tag refers to, -1 if none.
+*/
+static int getTemplateItem(layerObj *layer, const char *name, int length, int *escape)
+{
+  int i, n;
+
+  for(i=0; i<layer->numitems; i++) {
+    n = strlen(layer->items[i]);
+    if(n > length || strncmp(name, layer->items[i], n) != 0) continue;
+
+    if(n == length) *escape = ESCAPE_HTML;
+    else if(n+4 == length && strncmp(name+n, "_esc", 4) == 0) *escape = ESCAPE_URL;
+    else if(n+4 == length && strncmp(name+n, "_raw", 4) == 0) *escape = ESCAPE_NONE;
+    else continue;
+
+    return i;
+  }
+
+  return -1;
+}
+
+static int isTemplateTagName(const char **names, const char *name, int length)
+{
+  int i;
+
+  for(i=0; names[i] != NULL; i++)
+    if(strlen(names[i]) == length && strncmp(name, names[i], length) == 0) return MS_TRUE;
+
+  return MS_FALSE;
+}
+
+/*
+** Whether processLine() may substitute the tag differently for each result of layer.
+*/
+static int isResultTemplateTag(layerObj *layer, const char *name, int length)
+{
+  int i, n, escape;
+
+  if(isTemplateTagName(templateResultTags, name, length) || isTemplateTagName(templateVolatileTags, name, length))
+    return MS_TRUE;
+  if(getTemplateItem(layer, name, length, &escape) >= 0)
+    return MS_TRUE;
+
+  for(i=0; i<layer->numjoins; i++) {
+    n = strlen(layer->joins[i].name);
+    if(length > n && name[n] == '_' && strncmp(name, layer->joins[i].name, n) == 0) return MS_TRUE;
+    if(length == n+5 && strncmp(name, "join_", 5) == 0 && strncmp(name+5, layer->joins[i].name, n) == 0) return MS_TRUE;
+  }
+
+  return MS_FALSE;
+}
+
+/*
+** Substitutions of processLine() to tag that do not depend on the result, the request
+** parameters left out if hideParameters is set.
+*/
+static char *probeTemplateTag(mapservObj *mapserv, char *tag, int hideParameters)
+{
+  int numParams = mapserv->request->NumParams;
+  char *probe;
+
+  if(hideParameters) mapserv->request->NumParams = 0;
+  probe = processLine(mapserv, tag, NULL, BROWSE);
+  mapserv->request->NumParams = numParams;
+
+  return probe;
+}
+
+static int addTemplateTag(mapservObj *mapserv, layerObj *layer, compiledTemplateObj *compiled, const char *tag, int length, int nested)
+{
+  templateSegmentObj *segment;
+  const char *name = tag + 1;
+  char *probe;
+  int i, nameLength, hasArgs, item=-1, escape=ESCAPE_NONE;
+
+  segment = addTemplateSegment(compiled, SEGMENT_TAG, tag, length);
+  if(nested) return MS_SUCCESS; /* arguments need substitutions first */
+
+  nameLength = strcspn(name, " ]");
+  hasArgs = (name[nameLength] == ' ');
+
+  if(hasArgs && nameLength == 4 && strncmp(name, "item", 4) == 0) {
+    if(parseItemTag(layer, segment->text, &(segment->itemTag)) != MS_SUCCESS) {
+      segment->type = SEGMENT_TEXT; /* nothing to free */
+      return MS_FAILURE;
+    }
+    segment->type = SEGMENT_ITEM;
+    return MS_SUCCESS;
+  }
+  if(nameLength == 5 && strncmp(name, "shpxy", 5) == 0) {
+    segment->type = SEGMENT_SHPXY;
+    return MS_SUCCESS;
+  }
+  if(nameLength == 8 && strncmp(name, "shplabel", 8) == 0) {
+    segment->type = SEGMENT_SHPLABEL;
+    return MS_SUCCESS;
+  }
+  if(!hasArgs) {
+    for(i=0; templateResultValues[i] != NULL; i++) {
+      if(strlen(templateResultValues[i]) == nameLength && strncmp(name, templateResultValues[i], nameLength) == 0) {
+        segment->type = SEGMENT_RESULT;
+        segment->index = i;
+        return MS_SUCCESS;
+      }
+    }
+  }
+  if(isTemplateTagName(templateVolatileTags, name, nameLength))
+    return MS_SUCCESS;
+
+  /* items are substituted before the request parameters, after the map tags */
+  if(!hasArgs && !isTemplateTagName(templateResultTags, name, nameLength))
+    item = getTemplateItem(layer, name, nameLength, &escape);
+
+  probe = probeTemplateTag(mapserv, segment->text, item >= 0);
+  if(!probe) return MS_FAILURE;
+
+  if(strcmp(probe, segment->text) != 0 || (item < 0 && !isResultTemplateTag(layer, name, nameLength))) {
+    /* same for every result */
+    free(segment->text);
+    segment->text = probe;
+    segment->length = strlen(probe);
+    segment->type = SEGMENT_TEXT;
+    return MS_SUCCESS;
+  }
+  free(probe);
+
+  if(item >= 0) {
+    segment->type = SEGMENT_VALUE;
+    segment->index = item;
+    segment->escape = escape;
+  }
+
+  return MS_SUCCESS;
+}
+
+/*
+** Compile text for the results of layer. Tags may span lines if multiline is set, as in
+** [feature] tags, while template files are processed line by line.
+*/
+static compiledTemplateObj *compileTemplate(mapservObj *mapserv, layerObj *layer, const char *text, int multiline)
+{
+  compiledTemplateObj *compiled;
+  const char *textStart, *tagEnd, *ptr;
+  int nested;
+
+  compiled = (compiledTemplateObj *) msSmallCalloc(1, sizeof(compiledTemplateObj));
+
+  ptr = textStart = text;
+  while(*ptr != '\0') {
+    if(*ptr == '[' && (tagEnd = findTemplateTagEnd(ptr, multiline, &nested)) != NULL) {
+      if(ptr > textStart)
+        addTemplateSegment(compiled, SEGMENT_TEXT, textStart, ptr - textStart);
+      if(addTemplateTag(mapserv, layer, compiled, ptr, tagEnd - ptr + 1, nested) != MS_SUCCESS) {
+        freeCompiledTemplate(compiled);
+        return NULL;
+      }
+      ptr = textStart = tagEnd + 1;
+    } else
+      ptr++;
+  }
+  if(ptr > textStart)
+    addTemplateSegment(compiled, SEGMENT_TEXT, textStart, ptr - textStart);
+
+  return compiled;
+}
+
+/*
+** Output the current result (mapserv->resultlayer and resultshape) to out.
+*/
+static int renderCompiledTemplate(mapservObj *mapserv, compiledTemplateObj *compiled, msIOBuffer *out)
+{
+  int i, status;
+  char number[64];
+  char *value;
+  templateSegmentObj *segment;
+  shapeObj *shape = &(mapserv->resultshape);
+
+  for(i=0; i<compiled->numsegments; i++) {
+    segment = &(compiled->segments[i]);
+    value = NULL;
+
+    switch(segment->type) {
+      case SEGMENT_TEXT:
+        msIO_bufferWrite(out, segment->text, segment->length);
+        continue;
+      case SEGMENT_ITEM:
+        value = getItemTagValue(&(segment->itemTag), shape);
+        if(!value) return MS_FAILURE;
+        break;
+      case SEGMENT_VALUE:
+        if(!shape->values[segment->index]) continue;
+        if(segment->escape == ESCAPE_HTML)
+          value = msEncodeHTMLEntities(shape->values[segment->index]);
+        else if(segment->escape == ESCAPE_URL)
+          value = msEncodeUrl(shape->values[segment->index]);
+        else
+          value = msStrdup(shape->values[segment->index]);
+        break;
+      case SEGMENT_RESULT:
+        switch(segment->index) {
+          case RESULT_RN: snprintf(number, sizeof(number), "%d", mapserv->RN); break;
+          case RESULT_LRN: snprintf(number, sizeof(number), "%d", mapserv->LRN); break;
+          case RESULT_NLR: snprintf(number, sizeof(number), "%d", mapserv->NLR); break;
+          case RESULT_NR: snprintf(number, sizeof(number), "%d", mapserv->NR); break;
+          case RESULT_NL: snprintf(number, sizeof(number), "%d", mapserv->NL); break;
+          case RESULT_SHPIDX: snprintf(number, sizeof(number), "%ld", shape->index); break;
+          case RESULT_SHPCLASS: snprintf(number, sizeof(number), "%d", shape->classindex); break;
+          case RESULT_TILEIDX: snprintf(number, sizeof(number), "%d", shape->tileindex); break;
+          case RESULT_VALUES:
+            value = msJoinStrings(shape->values, mapserv->resultlayer->numitems, ",");
+            break;
+          case RESULT_SHPMID: snprintf(number, sizeof(number), "%f %f", (shape->bounds.maxx + shape->bounds.minx)/2, (shape->bounds.maxy + shape->bounds.miny)/2); break;
+          case RESULT_SHPMIDX: snprintf(number, sizeof(number), "%f", (shape->bounds.maxx + shape->bounds.minx)/2); break;
+          case RESULT_SHPMIDY: snprintf(number, sizeof(number), "%f", (shape->bounds.maxy + shape->bounds.miny)/2); break;
+          case RESULT_SHPMINX: snprintf(number, sizeof(number), "%f", shape->bounds.minx); break;
+          case RESULT_SHPMINY: snprintf(number, sizeof(number), "%f", shape->bounds.miny); break;
+          case RESULT_SHPMAXX: snprintf(number, sizeof(number), "%f", shape->bounds.maxx); break;
+          default: snprintf(number, sizeof(number), "%f", shape->bounds.maxy); break;
+        }
+        if(!value) {
+          msIO_bufferWrite(out, number, strlen(number));
+          continue;
+        }
+        break;
+      case SEGMENT_SHPXY:
+      case SEGMENT_SHPLABEL:
+        value = msStrdup(segment->text);
+        if(segment->type == SEGMENT_SHPXY)
+          status = processShpxyTag(mapserv->resultlayer, &value, shape);
+        else
+          status = processShplabelTag(mapserv->resultlayer, &value, shape);
+        if(status != MS_SUCCESS) {
+          msFree(value);
+          return MS_FAILURE;
+        }
+        break;
+      default:
+        value = processLine(mapserv, segment->text, NULL, QUERY);
+        if(!value) return MS_FAILURE;
+        break;
+    }
+
+    if(value) {
+      msIO_bufferWrite(out, value, strlen(value));
+      free(value);
+    }
+  }
+
+  return MS_SUCCESS;
+}
+
+static void freeCompiledTemplate(compiledTemplateObj *compiled)
+{
+  int i;
+
+  if(!compiled) return;
+
+  for(i=0; i<compiled->numsegments; i++) {
+    if(compiled->segments[i].type == SEGMENT_ITEM)
+      freeItemTag(&(compiled->segments[i].itemTag));
+    free(compiled->segments[i].text);
+  }
+  free(compiled->segments);
+  free(compiled);
+}
+
+/*
+** Read and compile the template file html (of a layer or class) for the results of layer.
+*/
+static compiledTemplateObj *loadCompiledTemplate(mapservObj *mapserv, layerObj *layer, char *html)
+{
+  FILE *stream;
+  char buffer[MS_BUFFER_LENGTH], szPath[MS_MAXPATHLEN];
+  char *text=NULL;
+  size_t n;
+  msIOBuffer content = {NULL, 0, 0, 0};
+  compiledTemplateObj *compiled;
+
+  ms_regex_t re; /* compiled regular expression to be matched */
+
+  if(!html) {
+    msSetError(MS_WEBERR, "No template specified", "loadCompiledTemplate()");
+    return NULL;
+  }
+
+  if(ms_regcomp(&re, MS_TEMPLATE_EXPR, MS_REG_EXTENDED|MS_REG_NOSUB|MS_REG_ICASE) != 0) {
+    msSetError(MS_REGEXERR, NULL, "loadCompiledTemplate()");
+    return NULL;
+  }
+
+  if(ms_regexec(&re, html, 0, NULL, 0) != 0) { /* no match */
+    ms_regfree(&re);
+    msSetError(MS_WEBERR, "Malformed template name (%s).", "loadCompiledTemplate()", html);
+    return NULL;
+  }
+  ms_regfree(&re);
+
+  if((stream = fopen(msBuildPath(szPath, mapserv->map->mappath, html), "r")) == NULL) {
+    msSetError(MS_IOERR, "%s", "loadCompiledTemplate()", html);
+    return NULL;
+  }
+
+  if(isValidTemplate(stream, html) != MS_TRUE) {
+    fclose(stream);
+    return NULL;
+  }
+
+  while((n = fread(buffer, 1, sizeof(buffer), stream)) > 0)
+    msIO_bufferWrite(&content, buffer, n);
+  fclose(stream);
+
+  text = content.data ? (char *) content.data : "";
+  compiled = compileTemplate(mapserv, layer, text, MS_FALSE);
+  free(content.data);
+
+  return compiled;
+}
+
 /*!
  * this function process all metadata
  * in pszInstr. ht mus contain all corresponding
@@ -2999,11 +3486,11 @@ char *generateLegendTemplate(mapservObj *mapserv)
     if(strcasecmp(mapserv->request->ParamNames[i], "map") == 0) break;
 
   if(i == mapserv->request->NumParams) {
-    if( getenv("MS_MAPFILE"))
-      pszMapFname = msStringConcatenate(pszMapFname, getenv("MS_MAPFILE"));
+    if( msIO_getenv("MS_MAPFILE"))
+      pszMapFname = msStringConcatenate(pszMapFname, msIO_getenv("MS_MAPFILE"));
   } else {
-    if(getenv(mapserv->request->ParamValues[i])) /* an environment references the actual file to use */
-      pszMapFname = msStringConcatenate(pszMapFname, getenv(mapserv->request->ParamValues[i]));
+    if(msIO_getenv(mapserv->request->ParamValues[i])) /* an environment references the actual file to use */
+      pszMapFname = msStringConcatenate(pszMapFname, msIO_getenv(mapserv->request->ParamValues[i]));
     else
       pszMapFname = msStringConcatenate(pszMapFname, mapserv->request->ParamValues[i]);
   }
@@ -3582,7 +4069,7 @@ static char *processLine(mapservObj *mapserv, char *instr, FILE *stream, int mod
   int i, j;
 #define PROCESSLINE_BUFLEN 5120
   char repstr[PROCESSLINE_BUFLEN], substr[PROCESSLINE_BUFLEN], *outstr; /* repstr = replace string, substr = sub string */
-  struct hashObj *tp=NULL;
+  const char *key, *value;
   char *encodedstr;
 
 #ifdef USE_PROJ
@@ -3651,12 +4138,12 @@ static char *processLine(mapservObj *mapserv, char *instr, FILE *stream, int mod
     msFree(ol);
   }
 
-  if(getenv("HTTP_HOST")) {
-    snprintf(repstr, PROCESSLINE_BUFLEN, "%s", getenv("HTTP_HOST"));
+  if(msIO_getenv("HTTP_HOST")) {
+    snprintf(repstr, PROCESSLINE_BUFLEN, "%s", msIO_getenv("HTTP_HOST"));
     outstr = msReplaceSubstring(outstr, "[host]", repstr);
   }
-  if(getenv("SERVER_PORT")) {
-    snprintf(repstr, PROCESSLINE_BUFLEN, "%s", getenv("SERVER_PORT"));
+  if(msIO_getenv("SERVER_PORT")) {
+    snprintf(repstr, PROCESSLINE_BUFLEN, "%s", msIO_getenv("SERVER_PORT"));
     outstr = msReplaceSubstring(outstr, "[port]", repstr);
   }
 
@@ -3755,41 +4242,38 @@ static char *processLine(mapservObj *mapserv, char *instr, FILE *stream, int mod
    */
 
   if(&(mapserv->map->web.metadata) && strstr(outstr, "web_")) {
-    for (j=0; j<MS_HASHSIZE; j++) {
-      if(mapserv->map->web.metadata.items[j] != NULL) {
-        for(tp=mapserv->map->web.metadata.items[j]; tp!=NULL; tp=tp->next) {
-          snprintf(substr, PROCESSLINE_BUFLEN, "[web_%s]", tp->key);
-          outstr = msReplaceSubstring(outstr, substr, tp->data);
-          snprintf(substr, PROCESSLINE_BUFLEN, "[web_%s_esc]", tp->key);
-
-          encodedstr = msEncodeUrl(tp->data);
-          outstr = msReplaceSubstring(outstr, substr, encodedstr);
-          free(encodedstr);
-        }
-      }
+    for(key=msFirstKeyFromHashTable(&(mapserv->map->web.metadata)); key!=NULL;
+        key=msNextKeyFromHashTable(&(mapserv->map->web.metadata), key)) {
+      value = msLookupHashTable(&(mapserv->map->web.metadata), key);
+      snprintf(substr, PROCESSLINE_BUFLEN, "[web_%s]", key);
+      outstr = msReplaceSubstring(outstr, substr, value);
+      snprintf(substr, PROCESSLINE_BUFLEN, "[web_%s_esc]", key);
+
+      encodedstr = msEncodeUrl(value);
+      outstr = msReplaceSubstring(outstr, substr, encodedstr);
+      free(encodedstr);
     }
   }
 
   /* allow layer metadata access in template */
   for(i=0; i<mapserv->map->numlayers; i++) {
     if(&(GET_LAYER(mapserv->map, i)->metadata) && GET_LAYER(mapserv->map, i)->name && strstr(outstr, GET_LAYER(mapserv->map, i)->name)) {
-      for(j=0; j<MS_HASHSIZE; j++) {
-        if(GET_LAYER(mapserv->map, i)->metadata.items[j] != NULL) {
-          for(tp=GET_LAYER(mapserv->map, i)->metadata.items[j]; tp!=NULL; tp=tp->next) {
-            snprintf(substr, PROCESSLINE_BUFLEN, "[%s_%s]", GET_LAYER(mapserv->map, i)->name, tp->key);
-            if(GET_LAYER(mapserv->map, i)->status == MS_ON)
-              outstr = msReplaceSubstring(outstr, substr, tp->data);
-            else
-              outstr = msReplaceSubstring(outstr, substr, "");
-            snprintf(substr, PROCESSLINE_BUFLEN, "[%s_%s_esc]", GET_LAYER(mapserv->map, i)->name, tp->key);
-            if(GET_LAYER(mapserv->map, i)->status == MS_ON) {
-              encodedstr = msEncodeUrl(tp->data);
-              outstr = msReplaceSubstring(outstr, substr, encodedstr);
-              free(encodedstr);
-            } else
-              outstr = msReplaceSubstring(outstr, substr, "");
-          }
-        }
+      hashTableObj *metadata = &(GET_LAYER(mapserv->map, i)->metadata);
+
+      for(key=msFirstKeyFromHashTable(metadata); key!=NULL; key=msNextKeyFromHashTable(metadata, key)) {
+        value = msLookupHashTable(metadata, key);
+        snprintf(substr, PROCESSLINE_BUFLEN, "[%s_%s]", GET_LAYER(mapserv->map, i)->name, key);
+        if(GET_LAYER(mapserv->map, i)->status == MS_ON)
+          outstr = msReplaceSubstring(outstr, substr, value);
+        else
+          outstr = msReplaceSubstring(outstr, substr, "");
+        snprintf(substr, PROCESSLINE_BUFLEN, "[%s_%s_esc]", GET_LAYER(mapserv->map, i)->name, key);
+        if(GET_LAYER(mapserv->map, i)->status == MS_ON) {
+          encodedstr = msEncodeUrl(value);
+          outstr = msReplaceSubstring(outstr, substr, encodedstr);
+          free(encodedstr);
+        } else
+          outstr = msReplaceSubstring(outstr, substr, "");
       }
     }
   }
@@ -3933,18 +4417,17 @@ static char *processLine(mapservObj *mapserv, char *instr, FILE *stream, int mod
 
     /* allow layer metadata access when there is a current result layer (implicitly a query template) */
     if(&(mapserv->resultlayer->metadata) && strstr(outstr, "[metadata_")) {
-      for(i=0; i<MS_HASHSIZE; i++) {
-        if(mapserv->resultlayer->metadata.items[i] != NULL) {
-          for(tp=mapserv->resultlayer->metadata.items[i]; tp!=NULL; tp=tp->next) {
-            snprintf(substr, PROCESSLINE_BUFLEN, "[metadata_%s]", tp->key);
-            outstr = msReplaceSubstring(outstr, substr, tp->data);
-
-            snprintf(substr, PROCESSLINE_BUFLEN, "[metadata_%s_esc]", tp->key);
-            encodedstr = msEncodeUrl(tp->data);
-            outstr = msReplaceSubstring(outstr, substr, encodedstr);
-            free(encodedstr);
-          }
-        }
+      hashTableObj *metadata = &(mapserv->resultlayer->metadata);
+
+      for(key=msFirstKeyFromHashTable(metadata); key!=NULL; key=msNextKeyFromHashTable(metadata, key)) {
+        value = msLookupHashTable(metadata, key);
+        snprintf(substr, PROCESSLINE_BUFLEN, "[metadata_%s]", key);
+        outstr = msReplaceSubstring(outstr, substr, value);
+
+        snprintf(substr, PROCESSLINE_BUFLEN, "[metadata_%s_esc]", key);
+        encodedstr = msEncodeUrl(value);
+        outstr = msReplaceSubstring(outstr, substr, encodedstr);
+        free(encodedstr);
       }
     }
   }
@@ -4328,6 +4811,10 @@ int msReturnNestedTemplateQuery(mapservObj* mapserv, char* pszMimeType, char **p
 
   mapserv->RN = 1; /* overall result number */
   for(i=0; i<mapserv->map->numlayers; i++) {
+    compiledTemplateObj **compiled; /* of the class templates, then of the layer one */
+    msIOBuffer result = {NULL, 0, 0, 0};
+    int t;
+
     mapserv->resultlayer = lp = (GET_LAYER(mapserv->map, mapserv->map->layerorder[i]));
 
     if(!lp->resultcache) continue;
@@ -4354,37 +4841,69 @@ int msReturnNestedTemplateQuery(mapservObj* mapserv, char* pszMimeType, char **p
       if(msReturnPage(mapserv, lp->header, BROWSE, papszBuffer) != MS_SUCCESS) return MS_FAILURE;
     }
 
+    /* the templates are compiled once for all the results of the layer */
+    compiled = (compiledTemplateObj **) msSmallCalloc(lp->numclasses+1, sizeof(compiledTemplateObj *));
+
     mapserv->LRN = 1; /* layer result number */
     for(j=0; j<lp->resultcache->numresults; j++) {
-      status = msLayerGetShape(lp, &(mapserv->resultshape), &(lp->resultcache->results[j]));
-      if(status != MS_SUCCESS) return status;
+      status = msLayerGetResultShape(lp, &(mapserv->resultshape), j);
+      if(status != MS_SUCCESS) {
+        for(t=0; t<=lp->numclasses; t++) freeCompiledTemplate(compiled[t]);
+        free(compiled);
+        free(result.data);
+        return status;
+      }
 
       /* prepare any necessary JOINs here (one-to-one only) */
       if(lp->numjoins > 0) {
         for(k=0; k<lp->numjoins; k++) {
           if(lp->joins[k].type == MS_JOIN_ONE_TO_ONE) {
+            msJoinPrefetch(lp, &(lp->joins[k]), j);
             msJoinPrepare(&(lp->joins[k]), &(mapserv->resultshape));
             msJoinNext(&(lp->joins[k])); /* fetch the first row */
           }
         }
       }
 
-      if(lp->resultcache->results[j].classindex >= 0 && lp->class[(int)(lp->resultcache->results[j].classindex)]->template)
-        template = lp->class[(int)(lp->resultcache->results[j].classindex)]->template;
-      else
+      if(lp->resultcache->results[j].classindex >= 0 && lp->class[(int)(lp->resultcache->results[j].classindex)]->template) {
+        t = lp->resultcache->results[j].classindex;
+        template = lp->class[t]->template;
+      } else {
+        t = lp->numclasses;
         template = lp->template;
+      }
+
+      if(!compiled[t])
+        compiled[t] = loadCompiledTemplate(mapserv, lp, template);
 
-      if(msReturnPage(mapserv, template, QUERY, papszBuffer) != MS_SUCCESS) {
+      result.data_offset = 0;
+      if(!compiled[t] || renderCompiledTemplate(mapserv, compiled[t], &result) != MS_SUCCESS) {
         msFreeShape(&(mapserv->resultshape));
+        for(t=0; t<=lp->numclasses; t++) freeCompiledTemplate(compiled[t]);
+        free(compiled);
+        free(result.data);
         return MS_FAILURE;
       }
 
+      if(result.data_offset > 0) {
+        if(papszBuffer)
+          (*papszBuffer) = msStringConcatenate((*papszBuffer), (char *) result.data);
+        else {
+          msIO_fwrite(result.data, result.data_offset, 1, stdout);
+          fflush(stdout);
+        }
+      }
+
       msFreeShape(&(mapserv->resultshape)); /* init too */
 
       mapserv->RN++; /* increment counters */
       mapserv->LRN++;
     }
 
+    for(t=0; t<=lp->numclasses; t++) freeCompiledTemplate(compiled[t]);
+    free(compiled);
+    free(result.data);
+
     if(lp->footer) {
       if(msReturnPage(mapserv, lp->footer, BROWSE, papszBuffer) != MS_SUCCESS) return MS_FAILURE;
     }
@@ -4544,6 +5063,10 @@ mapservObj *msAllocMapServObj()
   mapserv->QueryCoordSource=NONE;
   mapserv->ZoomSize=0; /* zoom absolute magnitude (i.e. > 0) */
 
+  mapserv->TileMode=TILE_GMAP;
+  mapserv->TileCoords=NULL;
+  mapserv->MapFile=NULL;
+
   mapserv->hittest = NULL;
 
   return mapserv;
@@ -4579,6 +5102,8 @@ void msFreeMapServObj(mapservObj* mapserv)
     msFree(mapserv->QueryLayer);
     msFree(mapserv->SelectLayer);
     msFree(mapserv->QueryFile);
+    msFree(mapserv->TileCoords);
+    msFree(mapserv->MapFile);
 
     msFree(mapserv);
   }
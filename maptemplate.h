@@ -92,6 +92,8 @@ typedef struct {
   int TileMode; /* can be GMAP, VE */
   char *TileCoords; /* for GMAP: 0 0 1; for VE: 013021023 */
 
+  char *MapFile; /* mapfile loaded by msCGILoadMap() */
+
   char Id[IDSIZE]; /* big enough for time + pid */
 
   int CoordSource;
@@ -63,6 +63,52 @@ It is incredibly important to ensure that any mutex that is acquired is
 released as soon as possible.  Any flow of control that could result in a
 mutex not being release is going to be a disaster.
 
+  void msAcquireReadLock(int), msReleaseReadLock(int):
+  void msAcquireWriteLock(int), msReleaseWriteLock(int):
+        Reader/writer variants for structures that are mostly read: any
+        number of threads may hold the read lock of an id at once, the write
+        lock is exclusive.  They use a lock separate from the msAcquireLock()
+        mutex of the same id, and the write lock must not be taken while
+        holding the read lock.  On Win32 both map to the plain mutex.
+
+  void msAcquireShardLock(int, unsigned int hash), msReleaseShardLock(...):
+        Each id also has MS_LOCK_SHARDS mutexes, hash % MS_LOCK_SHARDS
+        picks one.  Structures split in as many parts (eg. one list per
+        shard, indexed the same way) then only contend for the same part.
+        The same hash must be passed to the release.
+
+  void msCallOnce(msOnceObj *once, void (*func)(void)):
+        Calls func the first time it is called for once (a static msOnceObj
+        initialized to MS_ONCE_INIT), other callers wait for it to be done.
+        With pthreads later calls take no lock.
+
+  void msThreadLockStatsReport(void):
+        If the MS_LOCK_STATS environment variable is set to ON when the
+        locks are initialized, msAcquireLock() counts the acquisitions of
+        every lock, and how many of them had to wait and for how long.  The
+        uncontended path is a trylock, only waits are timed.  This reports
+        the counts with msDebug() and resets them, msCleanup() calls it.
+
+  int msThreadLockStatsGet(int, const char **name, ...):
+        The counts of one lock since the last report, for the metrics
+        (see mapmetrics.c).  MS_FALSE if the locks are not counted.
+
+  void msThreadPoolRun(func, void **tasks, int numtasks, int numthreads):
+  msThreadTaskGroupObj *msThreadTaskGroupCreate(int numthreads), ...:
+        Runs tasks on the process wide pool of worker threads.  A task group
+        gets tasks one at a time with msThreadTaskGroupAdd(), uses up to
+        numthreads threads at once and msThreadTaskGroupWait() runs what is
+        left in the calling thread and waits for the rest.  Tasks may create
+        groups of their own, these take no more threads than the pool has.
+        msThreadTaskGroupCancel() drops the tasks not started yet, eg. once
+        one of them failed.  msThreadPoolRun() is a group of all tasks.
+
+  void msThreadPoolSetSize(int numthreads), int msThreadPoolGetSize(void):
+        By default the pool grows to the numthreads-1 workers asked for,
+        the MS_THREADPOOL_SIZE environment variable or msThreadPoolSetSize()
+        (available to mapscript) fix the number instead, 0 to run all tasks
+        in the waiting threads.
+
 The mutex numbers are defined in mapthread.h with the TLOCK_* codes.  If you
 need a new mutex, add a #define in mapthread.h for it.  Currently there is
 no "dynamic" mutex allocation, but this could be added.
@@ -87,7 +133,8 @@ Currently a mutex is used for the entire map file parsing operation
 variables.
 
 It is also done with pj_init() from PROJ.4 since this does not appear to be
-thread safe.  It isn't yet clear if pj_transform() is thread safe.
+thread safe.  With PROJ 4.8 and later pj_transform() is called without the
+lock: each thread uses its own projPJ and context (see msGetThreadProjection()).
 
 It is expected that mutexes will need to be employed in a variety of other
 places to ensure serialized access to risky functionality.  This may apply
@@ -136,6 +183,7 @@ files instead.
 #include <assert.h>
 #include "mapserver.h"
 #include "mapthread.h"
+#include "maptime.h"
 
 
 
@@ -144,8 +192,91 @@ static int thread_debug = 0;
 
 static char *lock_names[] = {
   NULL, "PARSER", "GDAL", "ERROROBJ", "PROJ", "TTF", "POOL", "SDE",
-  "ORACLE", "OWS", "LAYER_VTABLE", "IOCONTEXT", "TMPFILE", "DEBUGOBJ", "OGR", "TIME", "FRIBIDI", "WXS", "GEOS", NULL
+  "ORACLE", "OWS", "LAYER_VTABLE", "IOCONTEXT", "TMPFILE", "DEBUGOBJ", "OGR", "TIME", "FRIBIDI", "WXS", "GEOS", "QIXCACHE", "DBFCACHE", "TILECACHE", "SHPPRELOAD", "LABELPLACEMENT", "PROJRECT", "GDALPOOL", "CONTOUR", "KERNELDENSITY", "PALETTECACHE", "MAPCACHE", "TILEIMAGES", "ONCE", "CURLSHARE", "WMSCACHE", "PGSTATEMENTS", "PGCACHE", "JOINCACHE", "OWSCAPS", "SLDCACHE", "SYMBOLCACHE", "LEGENDCACHE", "GRIDCACHE", "DECRYPTCACHE", "METRICS", "TRACE", NULL
 };
+
+/* updated by the thread holding the lock, so they need no protection */
+typedef struct {
+  unsigned long acquisitions;
+  unsigned long contended;
+  double wait_total;
+  double wait_max;
+} lockStatsObj;
+
+static int lock_stats = MS_FALSE;
+static lockStatsObj lock_stats_table[TLOCK_STATIC_MAX];
+
+static void msLockStatsInit( void )
+{
+  const char *value = getenv( "MS_LOCK_STATS" );
+
+  lock_stats = value && (strcasecmp(value, "ON") == 0 || strcmp(value, "1") == 0);
+}
+
+/* records a wait that started at start, the lock being held now */
+static void msLockStatsWaited( int nLockId, struct mstimeval *start )
+{
+  struct mstimeval end;
+  double wait;
+
+  msGettimeofday( &end, NULL );
+  wait = (end.tv_sec - start->tv_sec) + (end.tv_usec - start->tv_usec) / 1000000.0;
+  lock_stats_table[nLockId].contended++;
+  lock_stats_table[nLockId].wait_total += wait;
+  if( wait > lock_stats_table[nLockId].wait_max )
+    lock_stats_table[nLockId].wait_max = wait;
+}
+
+/************************************************************************/
+/*                      msThreadLockStatsReport()                       */
+/************************************************************************/
+
+void msThreadLockStatsReport()
+
+{
+  int i;
+
+  if( !lock_stats )
+    return;
+
+  /* the counts are read while other threads may still update them */
+  for( i = 1; i < TLOCK_STATIC_MAX; i++ ) {
+    lockStatsObj st = lock_stats_table[i];
+
+    if( st.acquisitions == 0 )
+      continue;
+
+    msDebug( "msThreadLockStatsReport(): %s: %lu acquisitions, %lu contended, "
+             "waited %.6fs in total, %.6fs at most\n",
+             lock_names[i], st.acquisitions, st.contended,
+             st.wait_total, st.wait_max );
+  }
+  memset( lock_stats_table, 0, sizeof(lock_stats_table) );
+}
+
+/************************************************************************/
+/*                        msThreadLockStatsGet()                        */
+/*                                                                      */
+/*      Copies the counts of a lock since the last report, MS_FALSE     */
+/*      if the locks are not counted.                                   */
+/************************************************************************/
+
+int msThreadLockStatsGet( int nLockId, const char **name, unsigned long *acquisitions,
+                          unsigned long *contended, double *wait_total )
+
+{
+  lockStatsObj st;
+
+  if( !lock_stats || nLockId < 1 || nLockId >= TLOCK_STATIC_MAX )
+    return MS_FALSE;
+
+  st = lock_stats_table[nLockId];
+  *name = lock_names[nLockId];
+  *acquisitions = st.acquisitions;
+  *contended = st.contended;
+  *wait_total = st.wait_total;
+  return MS_TRUE;
+}
 #endif
 
 /************************************************************************/
@@ -160,6 +291,24 @@ static char *lock_names[] = {
 
 static int mutexes_initialized = 0;
 static pthread_mutex_t mutex_locks[TLOCK_MAX];
+static pthread_rwlock_t rw_locks[TLOCK_STATIC_MAX];
+static pthread_mutex_t shard_locks[TLOCK_STATIC_MAX][MS_LOCK_SHARDS];
+static pthread_once_t locks_once = PTHREAD_ONCE_INIT;
+
+static void msThreadInitLocks()
+{
+  int i, j;
+
+  for( i = 0; i < TLOCK_STATIC_MAX; i++ ) {
+    pthread_mutex_init( mutex_locks + i, NULL );
+    pthread_rwlock_init( rw_locks + i, NULL );
+    for( j = 0; j < MS_LOCK_SHARDS; j++ )
+      pthread_mutex_init( &shard_locks[i][j], NULL );
+  }
+
+  msLockStatsInit();
+  mutexes_initialized = TLOCK_STATIC_MAX;
+}
 
 /************************************************************************/
 /*                            msThreadInit()                            */
@@ -168,17 +317,10 @@ static pthread_mutex_t mutex_locks[TLOCK_MAX];
 void msThreadInit()
 
 {
-  static pthread_mutex_t core_lock = PTHREAD_MUTEX_INITIALIZER;
-
   if( thread_debug )
     fprintf( stderr, "msThreadInit() (posix)\n" );
 
-  pthread_mutex_lock( &core_lock );
-
-  for( ; mutexes_initialized < TLOCK_STATIC_MAX; mutexes_initialized++ )
-    pthread_mutex_init( mutex_locks + mutexes_initialized, NULL );
-
-  pthread_mutex_unlock( &core_lock );
+  pthread_once( &locks_once, msThreadInitLocks );
 }
 
 /************************************************************************/
@@ -207,6 +349,18 @@ void msAcquireLock( int nLockId )
     fprintf( stderr, "msAcquireLock(%d/%s) (posix)\n",
              nLockId, lock_names[nLockId] );
 
+  if( lock_stats && nLockId < TLOCK_STATIC_MAX ) {
+    if( pthread_mutex_trylock( mutex_locks + nLockId ) != 0 ) {
+      struct mstimeval start;
+
+      msGettimeofday( &start, NULL );
+      pthread_mutex_lock( mutex_locks + nLockId );
+      msLockStatsWaited( nLockId, &start );
+    }
+    lock_stats_table[nLockId].acquisitions++;
+    return;
+  }
+
   pthread_mutex_lock( mutex_locks + nLockId );
 }
 
@@ -227,6 +381,447 @@ void msReleaseLock( int nLockId )
   pthread_mutex_unlock( mutex_locks + nLockId );
 }
 
+/************************************************************************/
+/*                 msAcquireReadLock()/msAcquireWriteLock()             */
+/************************************************************************/
+
+void msAcquireReadLock( int nLockId )
+
+{
+  if( mutexes_initialized == 0 )
+    msThreadInit();
+
+  assert( nLockId >= 0 && nLockId < mutexes_initialized );
+
+  if( thread_debug )
+    fprintf( stderr, "msAcquireReadLock(%d/%s) (posix)\n",
+             nLockId, lock_names[nLockId] );
+
+  pthread_rwlock_rdlock( rw_locks + nLockId );
+}
+
+void msReleaseReadLock( int nLockId )
+
+{
+  assert( mutexes_initialized > 0 );
+  assert( nLockId >= 0 && nLockId < mutexes_initialized );
+
+  pthread_rwlock_unlock( rw_locks + nLockId );
+}
+
+void msAcquireWriteLock( int nLockId )
+
+{
+  if( mutexes_initialized == 0 )
+    msThreadInit();
+
+  assert( nLockId >= 0 && nLockId < mutexes_initialized );
+
+  if( thread_debug )
+    fprintf( stderr, "msAcquireWriteLock(%d/%s) (posix)\n",
+             nLockId, lock_names[nLockId] );
+
+  pthread_rwlock_wrlock( rw_locks + nLockId );
+}
+
+void msReleaseWriteLock( int nLockId )
+
+{
+  assert( mutexes_initialized > 0 );
+  assert( nLockId >= 0 && nLockId < mutexes_initialized );
+
+  pthread_rwlock_unlock( rw_locks + nLockId );
+}
+
+/************************************************************************/
+/*                         msAcquireShardLock()                         */
+/************************************************************************/
+
+#define msLockShard(hash) ((hash) % MS_LOCK_SHARDS)
+
+void msAcquireShardLock( int nLockId, unsigned int hash )
+
+{
+  if( mutexes_initialized == 0 )
+    msThreadInit();
+
+  assert( nLockId >= 0 && nLockId < mutexes_initialized );
+
+  if( thread_debug )
+    fprintf( stderr, "msAcquireShardLock(%d/%s,%u) (posix)\n",
+             nLockId, lock_names[nLockId], msLockShard(hash) );
+
+  pthread_mutex_lock( &shard_locks[nLockId][msLockShard(hash)] );
+}
+
+void msReleaseShardLock( int nLockId, unsigned int hash )
+
+{
+  assert( mutexes_initialized > 0 );
+  assert( nLockId >= 0 && nLockId < mutexes_initialized );
+
+  pthread_mutex_unlock( &shard_locks[nLockId][msLockShard(hash)] );
+}
+
+/************************************************************************/
+/*                            msCallOnce()                              */
+/************************************************************************/
+
+void msCallOnce( msOnceObj *once, void (*func)(void) )
+
+{
+  pthread_once( once, func );
+}
+
+/************************************************************************/
+/*                           Thread pool                                */
+/*                                                                      */
+/*      One set of worker threads is shared by everything that runs     */
+/*      tasks in parallel. Tasks are added to task groups, a group      */
+/*      with tasks left to start is on pool_groups, the most recent     */
+/*      first. Idle workers take the next task of the first group that  */
+/*      is below its thread budget, so that the groups of tasks run by  */
+/*      other tasks (nested parallelism) are served first and finish    */
+/*      what their callers wait on. The thread waiting on a group runs  */
+/*      its tasks too: a group always completes even when all workers   */
+/*      are busy, and nested groups never start more threads than the   */
+/*      pool has. The workers are started on first use and kept until   */
+/*      msThreadPoolCleanup(), so that per thread state (font caches,   */
+/*      error lists) is not recreated for every call.                   */
+/************************************************************************/
+
+#define MS_THREADPOOL_MAX 64
+
+struct msThreadTaskGroupObj {
+  int maxrunning; /* threads the tasks may run in at once, the waiting one included */
+  int numtasks, maxtasks, nexttask, running, cancelled;
+  msThreadTaskFunc *funcs;
+  void **tasks;
+  struct msThreadTaskGroupObj *prev, *next; /* on pool_groups while tasks are left to start */
+  int queued;
+};
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_done = PTHREAD_COND_INITIALIZER;
+static pthread_t pool_threads[MS_THREADPOOL_MAX];
+static int pool_numthreads = 0, pool_shutdown = 0;
+static int pool_size = -1; /* fixed number of workers, -1 to start them as groups ask */
+static int pool_size_read = 0;
+static msThreadTaskGroupObj *pool_groups = NULL;
+
+static void *msThreadPoolMain(void *unused);
+
+/* pool_lock is held by the following static functions */
+
+static void msThreadPoolDequeue(msThreadTaskGroupObj *group)
+{
+  if(!group->queued) return;
+  if(group->prev) group->prev->next = group->next;
+  else pool_groups = group->next;
+  if(group->next) group->next->prev = group->prev;
+  group->prev = group->next = NULL;
+  group->queued = 0;
+}
+
+/* starts the workers a group of numthreads threads may use */
+static void msThreadPoolGrow(int numthreads)
+{
+  int wanted;
+
+  if(!pool_size_read) {
+    /* the process wide size, or msThreadPoolSetSize() */
+    if(pool_size < 0 && getenv("MS_THREADPOOL_SIZE"))
+      pool_size = MS_MAX(0, MS_MIN(atoi(getenv("MS_THREADPOOL_SIZE")), MS_THREADPOOL_MAX));
+    pool_size_read = 1;
+  }
+
+  wanted = (pool_size >= 0) ? pool_size : MS_MIN(numthreads-1, MS_THREADPOOL_MAX);
+  while(!pool_shutdown && pool_numthreads < wanted) {
+    if(pthread_create(&pool_threads[pool_numthreads], NULL, msThreadPoolMain, NULL) != 0)
+      break;
+    pool_numthreads++;
+  }
+}
+
+/* runs the next task of group if it may, returns MS_FALSE if it could not */
+static int msThreadPoolRunOne(msThreadTaskGroupObj *group)
+{
+  msThreadTaskFunc func;
+  void *task;
+
+  if(group->cancelled || group->nexttask >= group->numtasks || group->running >= group->maxrunning)
+    return MS_FALSE;
+
+  func = group->funcs[group->nexttask];
+  task = group->tasks[group->nexttask];
+  if(++group->nexttask >= group->numtasks)
+    msThreadPoolDequeue(group);
+
+  group->running++;
+  pthread_mutex_unlock(&pool_lock);
+  func(task);
+  pthread_mutex_lock(&pool_lock);
+  group->running--;
+
+  pthread_cond_broadcast(&pool_done);
+  return MS_TRUE;
+}
+
+static void *msThreadPoolMain(void *unused)
+{
+  pthread_mutex_lock(&pool_lock);
+  while(!pool_shutdown) {
+    msThreadTaskGroupObj *group;
+
+    for(group = pool_groups; group; group = group->next)
+      if(group->running < group->maxrunning) break;
+
+    if(!group || !msThreadPoolRunOne(group))
+      pthread_cond_wait(&pool_work, &pool_lock);
+  }
+  pthread_mutex_unlock(&pool_lock);
+
+  return NULL;
+}
+
+/************************************************************************/
+/*                       msThreadTaskGroupCreate()                      */
+/*                                                                      */
+/*      A group of tasks run on up to numthreads threads at once, the   */
+/*      one calling msThreadTaskGroupWait() included.                    */
+/************************************************************************/
+
+msThreadTaskGroupObj *msThreadTaskGroupCreate(int numthreads)
+{
+  msThreadTaskGroupObj *group = (msThreadTaskGroupObj *) msSmallCalloc(1, sizeof(msThreadTaskGroupObj));
+
+  group->maxrunning = MS_MAX(1, numthreads);
+  if(numthreads > 1) {
+    pthread_mutex_lock(&pool_lock);
+    msThreadPoolGrow(numthreads);
+    pthread_mutex_unlock(&pool_lock);
+  }
+
+  return group;
+}
+
+/************************************************************************/
+/*                        msThreadTaskGroupAdd()                        */
+/*                                                                      */
+/*      func(task) may be called in any thread from now on, and has     */
+/*      been once msThreadTaskGroupWait() returns unless the group was  */
+/*      cancelled before it started.                                    */
+/************************************************************************/
+
+void msThreadTaskGroupAdd(msThreadTaskGroupObj *group, msThreadTaskFunc func, void *task)
+{
+  pthread_mutex_lock(&pool_lock);
+  if(group->numtasks == group->maxtasks) {
+    group->maxtasks = MS_MAX(8, group->maxtasks*2);
+    group->funcs = (msThreadTaskFunc *) msSmallRealloc(group->funcs, group->maxtasks * sizeof(msThreadTaskFunc));
+    group->tasks = (void **) msSmallRealloc(group->tasks, group->maxtasks * sizeof(void *));
+  }
+  group->funcs[group->numtasks] = func;
+  group->tasks[group->numtasks] = task;
+  group->numtasks++;
+
+  if(group->maxrunning > 1 && !group->queued && !group->cancelled) {
+    group->next = pool_groups;
+    if(pool_groups) pool_groups->prev = group;
+    pool_groups = group;
+    group->queued = 1;
+  }
+  if(group->queued)
+    pthread_cond_signal(&pool_work);
+  pthread_mutex_unlock(&pool_lock);
+}
+
+/************************************************************************/
+/*                      msThreadTaskGroupCancel()                       */
+/*                                                                      */
+/*      Tasks of the group that have not started yet will not be run.   */
+/*      May be called from any thread, tasks of the group included.     */
+/************************************************************************/
+
+void msThreadTaskGroupCancel(msThreadTaskGroupObj *group)
+{
+  pthread_mutex_lock(&pool_lock);
+  group->cancelled = MS_TRUE;
+  msThreadPoolDequeue(group);
+  pthread_mutex_unlock(&pool_lock);
+}
+
+int msThreadTaskGroupIsCancelled(msThreadTaskGroupObj *group)
+{
+  int cancelled;
+
+  pthread_mutex_lock(&pool_lock);
+  cancelled = group->cancelled;
+  pthread_mutex_unlock(&pool_lock);
+
+  return cancelled;
+}
+
+/************************************************************************/
+/*                       msThreadTaskGroupWait()                        */
+/*                                                                      */
+/*      Runs the tasks left in the calling thread, waits for those      */
+/*      running elsewhere and frees group. Returns MS_FAILURE if the    */
+/*      group was cancelled.                                            */
+/************************************************************************/
+
+int msThreadTaskGroupWait(msThreadTaskGroupObj *group)
+{
+  int status;
+
+  pthread_mutex_lock(&pool_lock);
+  while(group->running > 0 || (!group->cancelled && group->nexttask < group->numtasks)) {
+    if(!msThreadPoolRunOne(group))
+      pthread_cond_wait(&pool_done, &pool_lock);
+  }
+  msThreadPoolDequeue(group);
+  status = group->cancelled ? MS_FAILURE : MS_SUCCESS;
+  pthread_mutex_unlock(&pool_lock);
+
+  free(group->funcs);
+  free(group->tasks);
+  free(group);
+
+  return status;
+}
+
+/************************************************************************/
+/*                          msThreadPoolRun()                           */
+/*                                                                      */
+/*      Calls func for each of the numtasks tasks on up to numthreads   */
+/*      threads, the calling one included, and returns once they are    */
+/*      all done.                                                       */
+/************************************************************************/
+
+void msThreadPoolRun(msThreadTaskFunc func, void **tasks, int numtasks, int numthreads)
+{
+  msThreadTaskGroupObj *group;
+  int i;
+
+  if(numthreads <= 1 || numtasks <= 1) {
+    for(i=0; i<numtasks; i++)
+      func(tasks[i]);
+    return;
+  }
+
+  group = msThreadTaskGroupCreate(numthreads);
+  for(i=0; i<numtasks; i++)
+    msThreadTaskGroupAdd(group, func, tasks[i]);
+  msThreadTaskGroupWait(group);
+}
+
+/************************************************************************/
+/*                         msThreadPoolSetSize()                        */
+/*                                                                      */
+/*      Fixes the number of worker threads, for embedders with their    */
+/*      own core budget. 0 runs all tasks in the threads waiting on     */
+/*      them, -1 goes back to starting as many as the groups ask for    */
+/*      (the default, unless the MS_THREADPOOL_SIZE environment         */
+/*      variable is set). Workers beyond the new size are stopped.     */
+/************************************************************************/
+
+void msThreadPoolSetSize(int numthreads)
+{
+  int stop;
+
+  pthread_mutex_lock(&pool_lock);
+  pool_size = (numthreads < 0) ? -1 : MS_MIN(numthreads, MS_THREADPOOL_MAX);
+  pool_size_read = 1;
+  stop = (pool_size >= 0 && pool_numthreads > pool_size);
+  pthread_mutex_unlock(&pool_lock);
+
+  /* simplest is to stop them all, the ones needed start again on next use */
+  if(stop)
+    msThreadPoolCleanup();
+}
+
+int msThreadPoolGetSize()
+{
+  int numthreads;
+
+  pthread_mutex_lock(&pool_lock);
+  numthreads = pool_numthreads;
+  pthread_mutex_unlock(&pool_lock);
+
+  return numthreads;
+}
+
+/************************************************************************/
+/*                        msThreadPoolCleanup()                         */
+/************************************************************************/
+
+void msThreadPoolCleanup()
+{
+  int i;
+
+  pthread_mutex_lock(&pool_lock);
+  pool_shutdown = 1;
+  pthread_cond_broadcast(&pool_work);
+  pthread_mutex_unlock(&pool_lock);
+
+  for(i=0; i<pool_numthreads; i++)
+    pthread_join(pool_threads[i], NULL);
+
+  pthread_mutex_lock(&pool_lock);
+  pool_numthreads = 0;
+  pool_shutdown = 0;
+  pthread_mutex_unlock(&pool_lock);
+}
+
+/************************************************************************/
+/*                         msThreadTaskStart()                          */
+/*                                                                      */
+/*      Starts func(task) on a pool worker and returns at once, the     */
+/*      caller must then call msThreadTaskWait(), which runs it itself  */
+/*      if no worker got to it. Returns NULL if the pool has no         */
+/*      workers, func has not been called then.                        */
+/************************************************************************/
+
+struct msThreadTaskObj {
+  msThreadTaskGroupObj *group;
+};
+
+msThreadTaskObj *msThreadTaskStart(msThreadTaskFunc func, void *task)
+{
+  msThreadTaskObj *thread;
+  msThreadTaskGroupObj *group = msThreadTaskGroupCreate(2);
+  int numthreads;
+
+  pthread_mutex_lock(&pool_lock);
+  numthreads = pool_numthreads;
+  pthread_mutex_unlock(&pool_lock);
+  if(numthreads == 0) {
+    msThreadTaskGroupWait(group);
+    return NULL;
+  }
+
+  thread = (msThreadTaskObj *) msSmallMalloc(sizeof(msThreadTaskObj));
+  thread->group = group;
+  msThreadTaskGroupAdd(group, func, task);
+
+  return thread;
+}
+
+/************************************************************************/
+/*                          msThreadTaskWait()                          */
+/*                                                                      */
+/*      Waits for the task to be done and frees thread.                 */
+/************************************************************************/
+
+void msThreadTaskWait(msThreadTaskObj *thread)
+{
+  if(thread) {
+    msThreadTaskGroupWait(thread->group);
+    free(thread);
+  }
+}
+
 #endif /* defined(USE_THREAD) && !defined(_WIN32) */
 
 /************************************************************************/
@@ -263,6 +858,7 @@ void msThreadInit()
   else
     WaitForSingleObject( core_lock, INFINITE );
 
+  msLockStatsInit();
   for( ; mutexes_initialized < TLOCK_STATIC_MAX; mutexes_initialized++ )
     mutex_locks[mutexes_initialized] = CreateMutex( NULL, FALSE, NULL );
 
@@ -295,6 +891,18 @@ void msAcquireLock( int nLockId )
     fprintf( stderr, "msAcquireLock(%d/%s) (win32)\n",
              nLockId, lock_names[nLockId] );
 
+  if( lock_stats && nLockId < TLOCK_STATIC_MAX ) {
+    if( WaitForSingleObject( mutex_locks[nLockId], 0 ) == WAIT_TIMEOUT ) {
+      struct mstimeval start;
+
+      msGettimeofday( &start, NULL );
+      WaitForSingleObject( mutex_locks[nLockId], INFINITE );
+      msLockStatsWaited( nLockId, &start );
+    }
+    lock_stats_table[nLockId].acquisitions++;
+    return;
+  }
+
   WaitForSingleObject( mutex_locks[nLockId], INFINITE );
 }
 
@@ -315,4 +923,133 @@ void msReleaseLock( int nLockId )
   ReleaseMutex( mutex_locks[nLockId] );
 }
 
+/************************************************************************/
+/*      Reader/writer and sharded locks, plain mutexes on Win32.        */
+/************************************************************************/
+
+void msAcquireReadLock( int nLockId )
+{
+  msAcquireLock( nLockId );
+}
+
+void msReleaseReadLock( int nLockId )
+{
+  msReleaseLock( nLockId );
+}
+
+void msAcquireWriteLock( int nLockId )
+{
+  msAcquireLock( nLockId );
+}
+
+void msReleaseWriteLock( int nLockId )
+{
+  msReleaseLock( nLockId );
+}
+
+void msAcquireShardLock( int nLockId, unsigned int hash )
+{
+  msAcquireLock( nLockId );
+}
+
+void msReleaseShardLock( int nLockId, unsigned int hash )
+{
+  msReleaseLock( nLockId );
+}
+
 #endif /* defined(USE_THREAD) && defined(_WIN32) */
+
+/************************************************************************/
+/*               msCallOnce() without pthreads, under a lock.           */
+/************************************************************************/
+
+#if !defined(USE_THREAD) || defined(_WIN32)
+
+void msCallOnce( msOnceObj *once, void (*func)(void) )
+
+{
+  msAcquireLock( TLOCK_ONCE );
+  if( !*once ) {
+    func();
+    *once = 1;
+  }
+  msReleaseLock( TLOCK_ONCE );
+}
+
+#endif
+
+/************************************************************************/
+/* ==================================================================== */
+/*                     NO THREAD POOL AVAILABLE                         */
+/* ==================================================================== */
+/************************************************************************/
+
+#if !defined(USE_THREAD) || defined(_WIN32)
+
+/* tasks are run one after the other in the calling thread */
+void msThreadPoolRun(msThreadTaskFunc func, void **tasks, int numtasks, int numthreads)
+{
+  int i;
+
+  for(i=0; i<numtasks; i++)
+    func(tasks[i]);
+}
+
+void msThreadPoolCleanup()
+{
+}
+
+void msThreadPoolSetSize(int numthreads)
+{
+}
+
+int msThreadPoolGetSize()
+{
+  return 0;
+}
+
+/* the tasks of a group are run as they are added */
+struct msThreadTaskGroupObj {
+  int cancelled;
+};
+
+msThreadTaskGroupObj *msThreadTaskGroupCreate(int numthreads)
+{
+  return (msThreadTaskGroupObj *) msSmallCalloc(1, sizeof(msThreadTaskGroupObj));
+}
+
+void msThreadTaskGroupAdd(msThreadTaskGroupObj *group, msThreadTaskFunc func, void *task)
+{
+  if(!group->cancelled)
+    func(task);
+}
+
+void msThreadTaskGroupCancel(msThreadTaskGroupObj *group)
+{
+  group->cancelled = MS_TRUE;
+}
+
+int msThreadTaskGroupIsCancelled(msThreadTaskGroupObj *group)
+{
+  return group->cancelled;
+}
+
+int msThreadTaskGroupWait(msThreadTaskGroupObj *group)
+{
+  int status = group->cancelled ? MS_FAILURE : MS_SUCCESS;
+
+  free(group);
+  return status;
+}
+
+/* no asynchronous tasks, callers do the work themselves */
+msThreadTaskObj *msThreadTaskStart(msThreadTaskFunc func, void *task)
+{
+  return NULL;
+}
+
+void msThreadTaskWait(msThreadTaskObj *thread)
+{
+}
+
+#endif /* !defined(USE_THREAD) || defined(_WIN32) */
@@ -34,18 +34,78 @@
 extern "C" {
 #endif
 
+  /* number of mutexes behind each sharded lock id */
+#define MS_LOCK_SHARDS 16
+
 #ifdef USE_THREAD
   void msThreadInit(void);
   void* msGetThreadId(void);
   void msAcquireLock(int);
   void msReleaseLock(int);
+  void msAcquireReadLock(int);
+  void msReleaseReadLock(int);
+  void msAcquireWriteLock(int);
+  void msReleaseWriteLock(int);
+  void msAcquireShardLock(int, unsigned int);
+  void msReleaseShardLock(int, unsigned int);
+  void msThreadLockStatsReport(void);
+  int msThreadLockStatsGet(int nLockId, const char **name, unsigned long *acquisitions,
+                           unsigned long *contended, double *wait_total);
 #else
 #define msThreadInit()
 #define msGetThreadId() (0)
 #define msAcquireLock(x)
 #define msReleaseLock(x)
+#define msAcquireReadLock(x)
+#define msReleaseReadLock(x)
+#define msAcquireWriteLock(x)
+#define msReleaseWriteLock(x)
+#define msAcquireShardLock(x,h)
+#define msReleaseShardLock(x,h)
+#define msThreadLockStatsReport()
+#define msThreadLockStatsGet(id,name,acquisitions,contended,wait_total) (MS_FALSE)
+#endif
+
+  /* storage class of per thread variables, left undefined if the compiler has none */
+#if defined(USE_THREAD)
+#  if defined(HAVE_C11_THREAD_LOCAL)
+#    define MS_THREAD_LOCAL _Thread_local
+#  elif defined(HAVE_GNU_THREAD_LOCAL)
+#    define MS_THREAD_LOCAL __thread
+#  elif defined(_MSC_VER)
+#    define MS_THREAD_LOCAL __declspec(thread)
+#  endif
 #endif
 
+  /* one time initialization, see msCallOnce() in mapthread.c */
+#if defined(USE_THREAD) && !defined(_WIN32)
+#include <pthread.h>
+  typedef pthread_once_t msOnceObj;
+#define MS_ONCE_INIT PTHREAD_ONCE_INIT
+#else
+  typedef int msOnceObj;
+#define MS_ONCE_INIT 0
+#endif
+  void msCallOnce(msOnceObj *once, void (*func)(void));
+
+  /* thread pool, see mapthread.c */
+  typedef void (*msThreadTaskFunc)(void *task);
+  void msThreadPoolRun(msThreadTaskFunc func, void **tasks, int numtasks, int numthreads);
+  void msThreadPoolCleanup(void);
+
+  /* tasks added one at a time and waited for together, see msThreadTaskGroupCreate() in mapthread.c */
+  typedef struct msThreadTaskGroupObj msThreadTaskGroupObj;
+  msThreadTaskGroupObj *msThreadTaskGroupCreate(int numthreads);
+  void msThreadTaskGroupAdd(msThreadTaskGroupObj *group, msThreadTaskFunc func, void *task);
+  void msThreadTaskGroupCancel(msThreadTaskGroupObj *group);
+  int msThreadTaskGroupIsCancelled(msThreadTaskGroupObj *group);
+  int msThreadTaskGroupWait(msThreadTaskGroupObj *group);
+
+  /* a task run in another thread, see msThreadTaskStart() in mapthread.c */
+  typedef struct msThreadTaskObj msThreadTaskObj;
+  msThreadTaskObj *msThreadTaskStart(msThreadTaskFunc func, void *task);
+  void msThreadTaskWait(msThreadTaskObj *thread);
+
   /*
   ** lock ids - note there is a corresponding lock_names[] array in
   ** mapthread.c that needs to be extended when new ids are added.
@@ -69,8 +129,34 @@ extern "C" {
 #define TLOCK_FRIBIDI   16
 #define TLOCK_WxS       17
 #define TLOCK_GEOS       18
-
-#define TLOCK_STATIC_MAX 20
+#define TLOCK_QIXCACHE  19
+#define TLOCK_DBFCACHE  20
+#define TLOCK_TILECACHE 21
+#define TLOCK_SHPPRELOAD 22
+#define TLOCK_LABELPLACEMENT 23
+#define TLOCK_PROJRECT  24
+#define TLOCK_GDALPOOL  25
+#define TLOCK_CONTOUR   26
+#define TLOCK_KERNELDENSITY 27
+#define TLOCK_PALETTECACHE 28
+#define TLOCK_MAPCACHE  29
+#define TLOCK_TILEIMAGES 30
+#define TLOCK_ONCE      31
+#define TLOCK_CURLSHARE 32
+#define TLOCK_WMSCACHE  33
+#define TLOCK_PGSTATEMENTS 34
+#define TLOCK_PGCACHE   35
+#define TLOCK_JOINCACHE 36
+#define TLOCK_OWSCAPS   37
+#define TLOCK_SLDCACHE  38
+#define TLOCK_SYMBOLCACHE 39
+#define TLOCK_LEGENDCACHE 40
+#define TLOCK_GRIDCACHE 41
+#define TLOCK_DECRYPTCACHE 42
+#define TLOCK_METRICS   43
+#define TLOCK_TRACE     44
+
+#define TLOCK_STATIC_MAX 45
 #define TLOCK_MAX       100
 
 #ifdef __cplusplus
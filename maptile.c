@@ -29,6 +29,14 @@
 
 #include "maptile.h"
 #include "mapproject.h"
+#include "mapthread.h"
+#include "uthash.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+static int msTileGetSubTileCoords(const mapservObj *msObj, int metatile_level, int n, char *coords, size_t size);
+static void msTileCacheMetatile(mapservObj *msObj, const imageObj *img, int metatile_level);
 
 #ifdef USE_TILE_API
 static void msTileResetMetatileLevel(mapObj *map)
@@ -120,7 +128,7 @@ static void msTileGetParams(mapObj *map, tileParams *params)
  *                            msTileExtractSubTile                      *
  *                                                                      *
  ************************************************************************/
-static imageObj* msTileExtractSubTile(const mapservObj *msObj, const imageObj *img)
+static imageObj* msTileExtractSubTile(const mapservObj *msObj, const imageObj *img, const char *coords)
 {
 
   int width, mini, minj;
@@ -158,8 +166,8 @@ static imageObj* msTileExtractSubTile(const mapservObj *msObj, const imageObj *i
   if( msObj->TileMode == TILE_GMAP ) {
     int x, y, zoom;
 
-    if( msObj->TileCoords ) {
-      if( msTileGetGMapCoords(msObj->TileCoords, &x, &y, &zoom) == MS_FAILURE )
+    if( coords ) {
+      if( msTileGetGMapCoords(coords, &x, &y, &zoom) == MS_FAILURE )
         return NULL;
     } else {
       msSetError(MS_WEBERR, "Tile parameter not set.", "msTileSetup()");
@@ -187,7 +195,7 @@ static imageObj* msTileExtractSubTile(const mapservObj *msObj, const imageObj *i
     int i = 0;
     char j = 0;
 
-    if( (int)strlen( msObj->TileCoords ) - params.metatile_level < 0 ) {
+    if( (int)strlen( coords ) - params.metatile_level < 0 ) {
       return(NULL);
     }
 
@@ -195,10 +203,10 @@ static imageObj* msTileExtractSubTile(const mapservObj *msObj, const imageObj *i
     ** Process the last elements of the VE coordinate string to place the
     ** requested tile in the context of the metatile
     */
-    for( i = strlen( msObj->TileCoords ) - params.metatile_level;
-         i < strlen( msObj->TileCoords );
+    for( i = strlen( coords ) - params.metatile_level;
+         i < strlen( coords );
          i++ ) {
-      j = msObj->TileCoords[i];
+      j = coords[i];
       tsize = width / zoom;
       if( j == '1' || j == '3' ) mini += tsize;
       if( j == '2' || j == '3' ) minj += tsize;
@@ -522,7 +530,10 @@ imageObj* msTileDraw(mapservObj *msObj)
   if( img == NULL )
     return NULL;
   if( params.metatile_level > 0 || params.map_edge_buffer > 0 ) {
-    imageObj *tmp = msTileExtractSubTile(msObj, img);
+    imageObj *tmp = msTileExtractSubTile(msObj, img, msObj->TileCoords);
+    /* the other subtiles of the metatile come for free, keep them */
+    if( tmp && params.metatile_level > 0 && msTileCacheEnabled(msObj->map) && !msIO_isRequestOutputPartial() )
+      msTileCacheMetatile(msObj, img, params.metatile_level);
     msFreeImage(img);
     if( tmp == NULL )
       return NULL;
@@ -531,3 +542,405 @@ imageObj* msTileDraw(mapservObj *msObj)
   return img;
 }
 
+
+
+/************************************************************************
+ *                          msTileDrawMetatile                          *
+ *                                                                      *
+ *   Draw the metatile of the requested tile once and call func for     *
+ *   each of its subtiles (the tile itself when not metatiling), eg.    *
+ *   to seed a cache. Stops at the first subtile func fails on.         *
+ *   As for msTileDraw(), call msTileSetExtent() first.                 *
+ ************************************************************************/
+
+int msTileDrawMetatile(mapservObj *msObj, msTileSubTileFunc func, void *data)
+{
+  imageObj *img;
+  tileParams params;
+  char coords[64];
+  int n, count, status = MS_SUCCESS;
+
+  if( !msObj->TileCoords ) {
+    msSetError(MS_WEBERR, "Tile parameter not set.", "msTileDrawMetatile()");
+    return MS_FAILURE;
+  }
+
+  msTileGetParams(msObj->map, &params);
+  img = msDrawMap(msObj->map, MS_FALSE);
+  if( img == NULL )
+    return MS_FAILURE;
+
+  if( params.metatile_level == 0 && params.map_edge_buffer == 0 ) {
+    status = func(data, msObj->TileCoords, img);
+    msFreeImage(img);
+    return status;
+  }
+
+  count = 1 << (2 * params.metatile_level);
+  for(n=0; n<count && status == MS_SUCCESS; n++) {
+    imageObj *sub;
+
+    if( msTileGetSubTileCoords(msObj, params.metatile_level, n, coords, sizeof(coords)) != MS_SUCCESS ) {
+      status = MS_FAILURE;
+      break;
+    }
+    sub = msTileExtractSubTile(msObj, img, coords);
+    if( !sub ) {
+      status = MS_FAILURE;
+      break;
+    }
+    status = func(data, coords, sub);
+    msFreeImage(sub);
+  }
+  msFreeImage(img);
+
+  return status;
+}
+
+
+
+/************************************************************************
+ *                            Tile cache                                *
+ *                                                                      *
+ *   With CONFIG "MS_TILECACHE_MEMORY" (MB) and/or "MS_TILECACHE_DIR"   *
+ *   the encoded tiles are kept in a process wide LRU and/or on disk,   *
+ *   keyed on the map and the request parameters (layers, tile,         *
+ *   format...). A tile is served while it is younger than              *
+ *   MS_TILECACHE_TTL seconds (0, the default, for no limit) and newer  *
+ *   than the mapfile and the data files of the layers that are on.     *
+ ************************************************************************/
+
+typedef struct renderedTileObj {
+  char *key;
+  unsigned char *data;
+  int size;
+  char *mimetype;
+  time_t created;
+  struct renderedTileObj *prev, *next; /* LRU list, most recent first */
+  UT_hash_handle hh;
+} renderedTileObj;
+
+/* protected by TLOCK_TILEIMAGES */
+static renderedTileObj *rendered_tiles = NULL;
+static renderedTileObj *rendered_head = NULL, *rendered_tail = NULL;
+static size_t rendered_bytes = 0;
+
+static void msTileCacheUnlink(renderedTileObj *tile)
+{
+  if(tile->prev) tile->prev->next = tile->next;
+  else rendered_head = tile->next;
+  if(tile->next) tile->next->prev = tile->prev;
+  else rendered_tail = tile->prev;
+  tile->prev = tile->next = NULL;
+}
+
+static void msTileCacheLinkFront(renderedTileObj *tile)
+{
+  tile->prev = NULL;
+  tile->next = rendered_head;
+  if(rendered_head) rendered_head->prev = tile;
+  rendered_head = tile;
+  if(!rendered_tail) rendered_tail = tile;
+}
+
+static void msTileCacheRemove(renderedTileObj *tile)
+{
+  UT_HASH_DEL(rendered_tiles, tile);
+  msTileCacheUnlink(tile);
+  rendered_bytes -= tile->size;
+  free(tile->key);
+  free(tile->data);
+  free(tile->mimetype);
+  free(tile);
+}
+
+static void msTileCacheInsert(const char *key, const unsigned char *data, int size,
+                              const char *mimetype, time_t created, size_t limit)
+{
+  renderedTileObj *tile;
+
+  if((size_t) size > limit)
+    return;
+
+  msAcquireLock(TLOCK_TILEIMAGES);
+  UT_HASH_FIND_STR(rendered_tiles, key, tile);
+  if(tile)
+    msTileCacheRemove(tile);
+  while(rendered_tail && rendered_bytes + size > limit)
+    msTileCacheRemove(rendered_tail);
+
+  tile = (renderedTileObj *) msSmallCalloc(1, sizeof(renderedTileObj));
+  tile->key = msStrdup(key);
+  tile->data = (unsigned char *) msSmallMalloc(size);
+  memcpy(tile->data, data, size);
+  tile->size = size;
+  tile->mimetype = msStrdup(mimetype);
+  tile->created = created;
+  UT_HASH_ADD_KEYPTR(hh, rendered_tiles, tile->key, strlen(tile->key), tile);
+  msTileCacheLinkFront(tile);
+  rendered_bytes += size;
+  msReleaseLock(TLOCK_TILEIMAGES);
+}
+
+/* modification time of the mapfile and of the file data sources of the layers to draw */
+static time_t msTileCacheSourcesTime(mapservObj *msObj)
+{
+  mapObj *map = msObj->map;
+  char szPath[MS_MAXPATHLEN];
+  struct stat st;
+  time_t newest = 0;
+  int i, j;
+
+  if(msObj->MapFile && stat(msObj->MapFile, &st) == 0)
+    newest = st.st_mtime;
+
+  for(i=0; i<map->numlayers; i++) {
+    layerObj *lp = GET_LAYER(map, i);
+    const char *files[2];
+
+    if(lp->status == MS_OFF)
+      continue;
+    if(lp->connectiontype != MS_SHAPEFILE && lp->connectiontype != MS_TILED_SHAPEFILE &&
+        lp->connectiontype != MS_RASTER && lp->connectiontype != MS_OGR)
+      continue; /* databases and remote services only expire with the TTL */
+
+    files[0] = (lp->connectiontype == MS_OGR) ? lp->connection : lp->data;
+    files[1] = lp->tileindex;
+    for(j=0; j<2; j++) {
+      if(!files[j] || !*files[j])
+        continue;
+      msBuildPath3(szPath, map->mappath, map->shapepath, files[j]);
+      if(stat(szPath, &st) != 0) {
+        strlcat(szPath, ".shp", sizeof(szPath));
+        if(stat(szPath, &st) != 0)
+          continue;
+      }
+      if(st.st_mtime > newest)
+        newest = st.st_mtime;
+    }
+  }
+
+  return newest;
+}
+
+static char *msTileCacheFile(const char *dir, const char *key)
+{
+  char hash[17];
+
+  msHashRequestKey(key, hash);
+  return msStringConcatenate(msStringConcatenate(msStringConcatenate(msStrdup(dir), "/"), hash), ".tile");
+}
+
+/* cache key of the request with its tile parameter replaced by coords */
+static char *msTileCacheKey(mapservObj *msObj, const char *coords)
+{
+  cgiRequestObj *request = msObj->request;
+  char **values;
+  char *key;
+  int i;
+
+  values = (char **) msSmallMalloc(sizeof(char *) * (request->NumParams + 1));
+  for(i=0; i<request->NumParams; i++)
+    values[i] = (strcasecmp(request->ParamNames[i], "tile") == 0) ? (char *) coords : request->ParamValues[i];
+  key = msBuildRequestKey(msObj->map, msObj->MapFile, request->ParamNames, values, request->NumParams);
+  free(values);
+
+  return key;
+}
+
+static void msTileCacheStore(mapservObj *msObj, const char *coords, const unsigned char *data, int size, const char *mimetype)
+{
+  mapObj *map = msObj->map;
+  const char *memory = msGetConfigOption(map, "MS_TILECACHE_MEMORY");
+  const char *dir = msGetConfigOption(map, "MS_TILECACHE_DIR");
+  size_t limit = memory ? (size_t) (atof(memory) * 1024 * 1024) : 0;
+  char *key;
+
+  if((limit == 0 && !(dir && *dir)) || size <= 0)
+    return;
+
+  key = msTileCacheKey(msObj, coords);
+  if(limit > 0)
+    msTileCacheInsert(key, data, size, mimetype, time(NULL), limit);
+  if(dir && *dir) {
+    char *path = msTileCacheFile(dir, key);
+
+    if(msWriteKeyedFile(path, key, data, size, mimetype) != MS_SUCCESS && map->debug)
+      msDebug("msTileCacheStore(): failed to write %s.\n", path);
+    free(path);
+  }
+  free(key);
+}
+
+/* the coordinates of the n-th subtile of the metatile of msObj->TileCoords */
+static int msTileGetSubTileCoords(const mapservObj *msObj, int metatile_level, int n, char *coords, size_t size)
+{
+  if( msObj->TileMode == TILE_GMAP ) {
+    int x, y, zoom, mask = (1 << metatile_level) - 1;
+
+    if( msTileGetGMapCoords(msObj->TileCoords, &x, &y, &zoom) == MS_FAILURE )
+      return MS_FAILURE;
+    snprintf(coords, size, "%d %d %d", (x & ~mask) + (n & mask), (y & ~mask) + (n >> metatile_level), zoom);
+  } else if( msObj->TileMode == TILE_VE ) {
+    int len = strlen(msObj->TileCoords), i;
+
+    if( len >= size || len < metatile_level ) {
+      msSetError(MS_WEBERR, "Invalid tile name %s.", "msTileGetSubTileCoords()", msObj->TileCoords);
+      return MS_FAILURE;
+    }
+    strcpy(coords, msObj->TileCoords);
+    /* each quadkey digit below the metatile picks one of 4 quadrants */
+    for(i=0; i<metatile_level; i++)
+      coords[len - metatile_level + i] = '0' + ((n >> (2 * (metatile_level - 1 - i))) & 3);
+  } else
+    return MS_FAILURE;
+
+  return MS_SUCCESS;
+}
+
+/* extract, encode and cache the subtiles of a metatile other than the requested one */
+static void msTileCacheMetatile(mapservObj *msObj, const imageObj *img, int metatile_level)
+{
+  const char *mimetype = MS_IMAGE_MIME_TYPE(msObj->map->outputformat);
+  int count = 1 << (2 * metatile_level);
+  char coords[64];
+  int n, stored = 0;
+
+  if( !msObj->TileCoords )
+    return;
+
+  for(n=0; n<count; n++) {
+    imageObj *sub;
+    unsigned char *data;
+    int size;
+
+    if( msTileGetSubTileCoords(msObj, metatile_level, n, coords, sizeof(coords)) != MS_SUCCESS )
+      return;
+
+    if( strcmp(coords, msObj->TileCoords) == 0 )
+      continue; /* the requested tile is cached by the caller */
+
+    sub = msTileExtractSubTile(msObj, img, coords);
+    if( !sub ) {
+      msResetErrorList();
+      return;
+    }
+    data = msSaveImageBuffer(sub, &size, msObj->map->outputformat);
+    msFreeImage(sub);
+    if( !data ) {
+      msResetErrorList();
+      return;
+    }
+    msTileCacheStore(msObj, coords, data, size, mimetype);
+    msFree(data);
+    stored++;
+  }
+
+  if(msObj->map->debug)
+    msDebug("msTileCacheMetatile(): cached %d subtiles of the metatile of %s.\n", stored, msObj->TileCoords);
+}
+
+/************************************************************************
+ *                          msTileCacheEnabled                          *
+ ************************************************************************/
+
+int msTileCacheEnabled(mapObj *map)
+{
+  const char *memory = msGetConfigOption(map, "MS_TILECACHE_MEMORY");
+  const char *dir = msGetConfigOption(map, "MS_TILECACHE_DIR");
+
+  return (memory && atof(memory) > 0) || (dir && *dir);
+}
+
+/************************************************************************
+ *                            msTileCacheGet                            *
+ *                                                                      *
+ *   Returns MS_TRUE and a copy of the encoded tile (to be released     *
+ *   with msFree()) if a valid one is cached.                           *
+ ************************************************************************/
+
+int msTileCacheGet(mapservObj *msObj, unsigned char **data, int *size, char **mimetype)
+{
+  mapObj *map = msObj->map;
+  const char *memory = msGetConfigOption(map, "MS_TILECACHE_MEMORY");
+  const char *dir = msGetConfigOption(map, "MS_TILECACHE_DIR");
+  const char *value = msGetConfigOption(map, "MS_TILECACHE_TTL");
+  size_t limit = memory ? (size_t) (atof(memory) * 1024 * 1024) : 0;
+  int ttl = value ? atoi(value) : 0;
+  time_t now, sources;
+  char *key;
+  int hit = MS_FALSE;
+
+  *data = NULL;
+  *size = 0;
+  *mimetype = NULL;
+
+  if(limit == 0 && !(dir && *dir))
+    return MS_FALSE;
+
+  key = msTileCacheKey(msObj, msObj->TileCoords);
+  sources = msTileCacheSourcesTime(msObj);
+  now = time(NULL);
+
+  if(limit > 0) {
+    renderedTileObj *tile;
+
+    msAcquireLock(TLOCK_TILEIMAGES);
+    UT_HASH_FIND_STR(rendered_tiles, key, tile);
+    if(tile) {
+      if((ttl <= 0 || now - tile->created < ttl) && tile->created > sources) {
+        *data = (unsigned char *) msSmallMalloc(tile->size);
+        memcpy(*data, tile->data, tile->size);
+        *size = tile->size;
+        *mimetype = msStrdup(tile->mimetype);
+        msTileCacheUnlink(tile);
+        msTileCacheLinkFront(tile);
+        hit = MS_TRUE;
+      } else
+        msTileCacheRemove(tile);
+    }
+    msReleaseLock(TLOCK_TILEIMAGES);
+  }
+
+  if(!hit && dir && *dir) {
+    char *path = msTileCacheFile(dir, key);
+    struct stat st;
+
+    if(stat(path, &st) == 0 && (ttl <= 0 || now - st.st_mtime < ttl) && st.st_mtime > sources &&
+        msReadKeyedFile(path, key, data, size, mimetype) == MS_SUCCESS) {
+      hit = MS_TRUE;
+      if(limit > 0)
+        msTileCacheInsert(key, *data, *size, *mimetype, st.st_mtime, limit);
+    }
+    free(path);
+  }
+
+  msMetricsCacheLookup(MS_METRICS_CACHE_TILE, hit);
+  if(hit && map->debug >= MS_DEBUGLEVEL_V)
+    msDebug("msTileCacheGet(): serving tile %s from the cache.\n", msObj->TileCoords ? msObj->TileCoords : "");
+
+  free(key);
+  return hit;
+}
+
+/************************************************************************
+ *                            msTileCachePut                            *
+ ************************************************************************/
+
+void msTileCachePut(mapservObj *msObj, const unsigned char *data, int size, const char *mimetype)
+{
+  if(msObj->TileCoords)
+    msTileCacheStore(msObj, msObj->TileCoords, data, size, mimetype);
+}
+
+/************************************************************************
+ *                          msTileCacheCleanup                          *
+ ************************************************************************/
+
+void msTileCacheCleanup(void)
+{
+  msAcquireLock(TLOCK_TILEIMAGES);
+  while(rendered_head)
+    msTileCacheRemove(rendered_head);
+  msReleaseLock(TLOCK_TILEIMAGES);
+}
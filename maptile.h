@@ -44,6 +44,12 @@ MS_DLL_EXPORT int msTileSetup(mapservObj *msObj);
 MS_DLL_EXPORT int msTileSetExtent(mapservObj *msObj);
 MS_DLL_EXPORT int msTileSetProjections(mapObj *map);
 MS_DLL_EXPORT imageObj* msTileDraw(mapservObj *msObj);
+/* called for each subtile of a metatile with its tile coordinates, see msTileDrawMetatile() */
+typedef int (*msTileSubTileFunc)(void *data, const char *coords, imageObj *img);
+MS_DLL_EXPORT int msTileDrawMetatile(mapservObj *msObj, msTileSubTileFunc func, void *data);
+MS_DLL_EXPORT int msTileCacheEnabled(mapObj *map);
+MS_DLL_EXPORT int msTileCacheGet(mapservObj *msObj, unsigned char **data, int *size, char **mimetype);
+MS_DLL_EXPORT void msTileCachePut(mapservObj *msObj, const unsigned char *data, int size, const char *mimetype);
 
 typedef struct {
   int metatile_level; /* In zoom levels above tile request: best bet is 0, 1 or 2 */
@@ -0,0 +1,495 @@
+/******************************************************************************
+ * $Id$
+ *
+ * Project:  MapServer
+ * Purpose:  Request tracing spans with W3C trace context propagation
+ * Author:   MapServer team.
+ *
+ ******************************************************************************
+ * Copyright (c) 1996-2016 Regents of the University of Minnesota.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies of this Software or works derived from this Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+/*
+** Request tracing, enabled by the MS_TRACE_FILE environment variable: each
+** mapserv request is a trace made of nested spans (the dispatch, the layers
+** drawn and queried, the database queries, the cascaded HTTP requests and
+** the image encoding). When the request is done its spans are appended to
+** MS_TRACE_FILE ("%d" being replaced by the pid, "stderr" for the standard
+** error) as one line of OTLP JSON, the format read by the file receiver of
+** an OpenTelemetry collector.
+**
+** The trace context follows the W3C Trace Context recommendation: a request
+** with a traceparent header joins the trace of the caller, and is recorded
+** only if the caller sampled it. The cascaded WMS/WFS requests are sent a
+** traceparent naming the span they were made from (msTraceGetParent()).
+**
+** The spans are kept per thread, those of the draw worker threads
+** (MS_DRAW_THREADS) are not recorded. The layers queried in worker threads
+** (MS_QUERY_THREADS) are recorded afterwards by the thread running the query,
+** with the times measured in the workers (msTraceSpanSetTimes()). Without
+** thread local storage in a threaded build there is no tracing.
+*/
+
+#include "mapserver.h"
+#include "mapthread.h"
+#include "maptime.h"
+#include <ctype.h>
+#include <stdarg.h>
+
+#define MS_TRACE_MAX_DEPTH 32
+#define MS_TRACE_MAX_SPANS 1024
+#define MS_TRACE_MAX_ATTRIBUTES 4
+#define MS_TRACE_KEY_LEN 32
+#define MS_TRACE_VALUE_LEN 256
+
+typedef struct {
+  char id[17];
+  const char *name; /* a literal */
+  int kind;
+  struct mstimeval start;
+  struct mstimeval end; /* tv_sec 0 to end when the span is ended */
+  int numattributes;
+  char keys[MS_TRACE_MAX_ATTRIBUTES][MS_TRACE_KEY_LEN];
+  char values[MS_TRACE_MAX_ATTRIBUTES][MS_TRACE_VALUE_LEN];
+} traceSpanObj;
+
+typedef struct {
+  int active; /* between msTraceStart() and msTraceEnd() */
+  int sampled;
+  char traceid[33];
+  char parentid[17]; /* span of the caller, "" if none */
+  traceSpanObj spans[MS_TRACE_MAX_DEPTH]; /* the open spans, outermost first */
+  int depth;
+  int numspans; /* ended, in buffer */
+  int dropped;
+  bufferObj buffer;
+  unsigned int seed;
+} traceStateObj;
+
+#if defined(MS_THREAD_LOCAL)
+static MS_THREAD_LOCAL traceStateObj *trace_state = NULL;
+#define MS_TRACE_SUPPORTED
+#elif !defined(USE_THREAD)
+static traceStateObj *trace_state = NULL;
+#define MS_TRACE_SUPPORTED
+#endif
+
+#ifdef MS_TRACE_SUPPORTED
+
+static void msTraceAppend(bufferObj *buffer, const char *pszFormat, ...)
+{
+  char line[1024];
+  va_list args;
+  int n;
+
+  va_start(args, pszFormat);
+  n = vsnprintf(line, sizeof(line), pszFormat, args);
+  va_end(args);
+  if(n < 0)
+    return;
+  if(n >= (int) sizeof(line))
+    n = sizeof(line) - 1;
+  msBufferAppend(buffer, line, n);
+}
+
+/* xorshift, seeded per thread, the ids need not be cryptographically random */
+static unsigned int msTraceRandom(traceStateObj *state)
+{
+  unsigned int x = state->seed;
+
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  state->seed = x;
+  return x;
+}
+
+static void msTraceRandomId(traceStateObj *state, char *id, int numchars)
+{
+  int i;
+
+  do {
+    for(i = 0; i < numchars; i += 8)
+      snprintf(id + i, 9, "%08x", msTraceRandom(state));
+    id[numchars] = '\0';
+  } while(strspn(id, "0") == (size_t) numchars); /* all zeros is invalid */
+}
+
+/* numchars lowercase hex digits */
+static int msTraceIsHex(const char *s, int numchars)
+{
+  int i;
+
+  for(i = 0; i < numchars; i++) {
+    if(!isxdigit((unsigned char) s[i]) || isupper((unsigned char) s[i]))
+      return MS_FALSE;
+  }
+  return MS_TRUE;
+}
+
+/* version-traceid-parentid-flags, as 00-<32 hex>-<16 hex>-<2 hex> */
+static int msTraceParseParent(traceStateObj *state, const char *traceparent)
+{
+  unsigned int flags;
+
+  if(!traceparent || strlen(traceparent) < 55 || !msTraceIsHex(traceparent, 2) || strncmp(traceparent, "ff", 2) == 0)
+    return MS_FALSE;
+  if(traceparent[2] != '-' || traceparent[35] != '-' || traceparent[52] != '-')
+    return MS_FALSE;
+  /* version 00 has nothing after the flags, later ones may */
+  if(traceparent[55] != '\0' && (strncmp(traceparent, "00", 2) == 0 || traceparent[55] != '-'))
+    return MS_FALSE;
+  if(!msTraceIsHex(traceparent + 3, 32) || strspn(traceparent + 3, "0") >= 32 ||
+      !msTraceIsHex(traceparent + 36, 16) || strspn(traceparent + 36, "0") >= 16 ||
+      !msTraceIsHex(traceparent + 53, 2))
+    return MS_FALSE;
+
+  memcpy(state->traceid, traceparent + 3, 32);
+  state->traceid[32] = '\0';
+  memcpy(state->parentid, traceparent + 36, 16);
+  state->parentid[16] = '\0';
+  sscanf(traceparent + 53, "%2x", &flags);
+  state->sampled = (flags & 1) ? MS_TRUE : MS_FALSE;
+  return MS_TRUE;
+}
+
+static void msTraceAppendString(bufferObj *buffer, const char *value)
+{
+  char *escaped = msEscapeJSonString(value);
+
+  msBufferAppend(buffer, "\"", 1);
+  msBufferAppend(buffer, escaped, strlen(escaped));
+  msBufferAppend(buffer, "\"", 1);
+  msFree(escaped);
+}
+
+/* dumps the innermost open span to the buffer as OTLP JSON */
+static void msTraceFlushSpan(traceStateObj *state, int status)
+{
+  traceSpanObj *span = &(state->spans[state->depth - 1]);
+  const char *parentid = state->depth > 1 ? state->spans[state->depth - 2].id : state->parentid;
+  struct mstimeval now;
+  int i;
+
+  state->depth--;
+  if(state->numspans >= MS_TRACE_MAX_SPANS) {
+    state->dropped++;
+    return;
+  }
+
+  if(span->end.tv_sec != 0)
+    now = span->end;
+  else
+    msGettimeofday(&now, NULL);
+  if(state->numspans++ > 0)
+    msBufferAppend(&(state->buffer), ",", 1);
+  msTraceAppend(&(state->buffer), "{\"traceId\":\"%s\",\"spanId\":\"%s\",", state->traceid, span->id);
+  if(*parentid)
+    msTraceAppend(&(state->buffer), "\"parentSpanId\":\"%s\",", parentid);
+  msTraceAppend(&(state->buffer), "\"name\":\"%s\",\"kind\":%d,\"startTimeUnixNano\":\"%ld%06ld000\",\"endTimeUnixNano\":\"%ld%06ld000\",\"attributes\":[",
+                span->name, span->kind, (long) span->start.tv_sec, (long) span->start.tv_usec,
+                (long) now.tv_sec, (long) now.tv_usec);
+  for(i = 0; i < span->numattributes; i++) {
+    msTraceAppend(&(state->buffer), "%s{\"key\":\"%s\",\"value\":{\"stringValue\":", i > 0 ? "," : "", span->keys[i]);
+    msTraceAppendString(&(state->buffer), span->values[i]);
+    msBufferAppend(&(state->buffer), "}}", 2);
+  }
+  msBufferAppend(&(state->buffer), "],", 2);
+
+  if(status == MS_FAILURE) {
+    errorObj *error = msGetErrorObj();
+
+    msTraceAppend(&(state->buffer), "\"status\":{\"code\":2,\"message\":");
+    msTraceAppendString(&(state->buffer), error && error->code != MS_NOERR ? error->message : "");
+    msBufferAppend(&(state->buffer), "}}", 2);
+  } else
+    msBufferAppend(&(state->buffer), "\"status\":{}}", 12);
+}
+
+static void msTraceWrite(traceStateObj *state)
+{
+  const char *pattern = getenv("MS_TRACE_FILE");
+  char path[MS_MAXPATHLEN];
+  const char *pid_pos;
+  bufferObj line;
+  FILE *fp;
+
+  if(!pattern || !*pattern || state->numspans == 0)
+    return;
+
+  msBufferInit(&line);
+  msTraceAppend(&line, "{\"resourceSpans\":[{\"resource\":{\"attributes\":["
+                "{\"key\":\"service.name\",\"value\":{\"stringValue\":\"mapserver\"}},"
+                "{\"key\":\"process.pid\",\"value\":{\"intValue\":\"%d\"}}]},"
+                "\"scopeSpans\":[{\"scope\":{\"name\":\"mapserver\",\"version\":\"%s\"},\"spans\":[",
+                (int) getpid(), MS_VERSION);
+  msBufferAppend(&line, state->buffer.data, state->buffer.size);
+  msBufferAppend(&line, "]}]}]}\n", 7);
+
+  if(strcasecmp(pattern, "stderr") == 0) {
+    msAcquireLock(TLOCK_TRACE);
+    fwrite(line.data, 1, line.size, stderr);
+    msReleaseLock(TLOCK_TRACE);
+  } else {
+    if((pid_pos = strstr(pattern, "%d")) != NULL)
+      snprintf(path, sizeof(path), "%.*s%d%s", (int)(pid_pos - pattern), pattern, (int) getpid(), pid_pos + 2);
+    else
+      strlcpy(path, pattern, sizeof(path));
+
+    /* one write per request, the lines of the threads do not interleave */
+    msAcquireLock(TLOCK_TRACE);
+    fp = fopen(path, "ab");
+    if(fp) {
+      fwrite(line.data, 1, line.size, fp);
+      fclose(fp);
+    }
+    msReleaseLock(TLOCK_TRACE);
+    if(!fp)
+      msDebug("msTraceEnd(): failed to write %s.\n", path);
+  }
+  msBufferFree(&line);
+}
+
+#endif /* MS_TRACE_SUPPORTED */
+
+/************************************************************************/
+/*                            msTraceStart()                            */
+/*                                                                      */
+/*      Starts the trace of a request, with a root span named name.     */
+/*      traceparent is the header of the caller, or NULL.               */
+/************************************************************************/
+
+void msTraceStart(const char *traceparent, const char *name)
+{
+#ifdef MS_TRACE_SUPPORTED
+  const char *pattern = getenv("MS_TRACE_FILE");
+  traceStateObj *state;
+
+  if(!pattern || !*pattern)
+    return;
+
+  if(!trace_state) {
+    struct mstimeval now;
+
+    trace_state = (traceStateObj *) msSmallCalloc(1, sizeof(traceStateObj));
+    msBufferInit(&(trace_state->buffer));
+    msGettimeofday(&now, NULL);
+    trace_state->seed = (unsigned int) now.tv_sec ^ ((unsigned int) now.tv_usec << 12) ^
+                        ((unsigned int) getpid() << 20) ^ (unsigned int)(size_t) trace_state;
+    if(trace_state->seed == 0)
+      trace_state->seed = 2463534242U;
+  }
+  state = trace_state;
+
+  state->depth = 0;
+  state->numspans = 0;
+  state->dropped = 0;
+  state->buffer.size = 0;
+  if(!msTraceParseParent(state, traceparent)) {
+    msTraceRandomId(state, state->traceid, 32);
+    state->parentid[0] = '\0';
+    state->sampled = MS_TRUE;
+  }
+  state->active = MS_TRUE;
+
+  msTraceSpanBegin(name, MS_TRACE_SERVER);
+#else
+  (void) traceparent;
+  (void) name;
+#endif
+}
+
+/************************************************************************/
+/*                             msTraceEnd()                             */
+/*                                                                      */
+/*      Ends the root span with status and writes out the trace.        */
+/************************************************************************/
+
+void msTraceEnd(int status)
+{
+#ifdef MS_TRACE_SUPPORTED
+  traceStateObj *state = trace_state;
+
+  if(!state || !state->active)
+    return;
+
+  if(state->depth > 0)
+    msTraceSpanEnd(0, status);
+  if(state->sampled) {
+    if(state->dropped > 0)
+      msDebug("msTraceEnd(): %d spans over the limit of %d were dropped.\n", state->dropped, MS_TRACE_MAX_SPANS);
+    msTraceWrite(state);
+  }
+  state->active = MS_FALSE;
+
+  /* don't keep the buffer of a large trace around */
+  if(state->buffer.size > 65536) {
+    msBufferFree(&(state->buffer));
+    msBufferInit(&(state->buffer));
+  }
+#else
+  (void) status;
+#endif
+}
+
+/************************************************************************/
+/*                          msTraceSpanBegin()                          */
+/*                                                                      */
+/*      Opens a span named name (a literal) within the current one.     */
+/*      Returns the span to pass to msTraceSpanEnd(), -1 if the         */
+/*      request is not traced.                                          */
+/************************************************************************/
+
+int msTraceSpanBegin(const char *name, int kind)
+{
+#ifdef MS_TRACE_SUPPORTED
+  traceStateObj *state = trace_state;
+  traceSpanObj *span;
+
+  if(!state || !state->active || !state->sampled || state->depth >= MS_TRACE_MAX_DEPTH)
+    return -1;
+
+  span = &(state->spans[state->depth]);
+  msTraceRandomId(state, span->id, 16);
+  span->name = name;
+  span->kind = kind;
+  span->numattributes = 0;
+  msGettimeofday(&(span->start), NULL);
+  span->end.tv_sec = 0;
+  return state->depth++;
+#else
+  (void) name;
+  (void) kind;
+  return -1;
+#endif
+}
+
+/************************************************************************/
+/*                        msTraceSpanAttribute()                        */
+/*                                                                      */
+/*      Sets a string attribute of span, truncated if long.             */
+/************************************************************************/
+
+void msTraceSpanAttribute(int span, const char *key, const char *value)
+{
+#ifdef MS_TRACE_SUPPORTED
+  traceStateObj *state = trace_state;
+  traceSpanObj *psSpan;
+
+  if(span < 0 || !state || span >= state->depth || !value)
+    return;
+
+  psSpan = &(state->spans[span]);
+  if(psSpan->numattributes >= MS_TRACE_MAX_ATTRIBUTES)
+    return;
+  strlcpy(psSpan->keys[psSpan->numattributes], key, MS_TRACE_KEY_LEN);
+  strlcpy(psSpan->values[psSpan->numattributes], value, MS_TRACE_VALUE_LEN);
+  psSpan->numattributes++;
+#else
+  (void) span;
+  (void) key;
+  (void) value;
+#endif
+}
+
+/************************************************************************/
+/*                           msTraceSpanEnd()                           */
+/*                                                                      */
+/*      Ends span with status (MS_FAILURE marks it as an error), and    */
+/*      the spans within it left open by an early return, if any.       */
+/************************************************************************/
+
+void msTraceSpanEnd(int span, int status)
+{
+#ifdef MS_TRACE_SUPPORTED
+  traceStateObj *state = trace_state;
+
+  if(span < 0 || !state || !state->active)
+    return;
+
+  while(state->depth > span + 1)
+    msTraceFlushSpan(state, MS_SUCCESS);
+  if(state->depth == span + 1)
+    msTraceFlushSpan(state, status);
+#else
+  (void) span;
+  (void) status;
+#endif
+}
+
+/************************************************************************/
+/*                         msTraceSpanSetTimes()                        */
+/*                                                                      */
+/*      Sets the start and end (seconds since the epoch, as given by    */
+/*      msStatsNow()) of an open span, for work timed in another        */
+/*      thread. The span is still to be ended with msTraceSpanEnd().    */
+/************************************************************************/
+
+void msTraceSpanSetTimes(int span, double start, double end)
+{
+#ifdef MS_TRACE_SUPPORTED
+  traceStateObj *state = trace_state;
+  traceSpanObj *psSpan;
+
+  if(span < 0 || !state || span >= state->depth)
+    return;
+
+  psSpan = &(state->spans[span]);
+  psSpan->start.tv_sec = (long) start;
+  psSpan->start.tv_usec = (long) ((start - (long) start) * 1.0e6);
+  psSpan->end.tv_sec = (long) end;
+  psSpan->end.tv_usec = (long) ((end - (long) end) * 1.0e6);
+#else
+  (void) span;
+  (void) start;
+  (void) end;
+#endif
+}
+
+/************************************************************************/
+/*                          msTraceGetParent()                          */
+/*                                                                      */
+/*      Formats the traceparent header value to send along with the     */
+/*      requests made from the current span. Returns MS_FALSE if the    */
+/*      request is not traced.                                          */
+/************************************************************************/
+
+int msTraceGetParent(char *traceparent, size_t size)
+{
+#ifdef MS_TRACE_SUPPORTED
+  traceStateObj *state = trace_state;
+  const char *parentid;
+
+  if(!state || !state->active)
+    return MS_FALSE;
+
+  /* not sampled, the caller's span is passed on */
+  parentid = state->depth > 0 ? state->spans[state->depth - 1].id : state->parentid;
+  if(!*parentid)
+    return MS_FALSE;
+  snprintf(traceparent, size, "00-%s-%s-%02x", state->traceid, parentid, state->sampled ? 1 : 0);
+  return MS_TRUE;
+#else
+  (void) traceparent;
+  (void) size;
+  return MS_FALSE;
+#endif
+}
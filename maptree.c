@@ -30,6 +30,9 @@
 
 #include "mapserver.h"
 #include "maptree.h"
+#include "mapthread.h"
+
+#include <sys/stat.h>
 
 
 
@@ -104,6 +107,9 @@ SHPTreeHandle msSHPDiskTreeOpen(const char * pszTree, int debug)
   /*  Initialize the info structure.              */
   /* -------------------------------------------------------------------- */
   psTree = (SHPTreeHandle) msSmallMalloc(sizeof(SHPTreeInfo));
+  psTree->pabyData = NULL;
+  psTree->nDataSize = psTree->nDataOffset = 0;
+  psTree->nNodeSize = psTree->nNodes = 0;
 
   /* -------------------------------------------------------------------- */
   /*  Compute the base (layer) name.  If there is any extension     */
@@ -140,6 +146,7 @@ SHPTreeHandle msSHPDiskTreeOpen(const char * pszTree, int debug)
   }
 
   if( fread( pabyBuf, 8, 1, psTree->fp ) != 1 ) {
+    fclose(psTree->fp);
     msFree(psTree);
     return( NULL );
   }
@@ -180,6 +187,7 @@ SHPTreeHandle msSHPDiskTreeOpen(const char * pszTree, int debug)
 
     if( fread( pabyBuf, 8, 1, psTree->fp ) != 1 )
     {
+      fclose(psTree->fp);
       msFree(psTree);
       return( NULL );
     }
@@ -191,6 +199,33 @@ SHPTreeHandle msSHPDiskTreeOpen(const char * pszTree, int debug)
   if( psTree->needswap ) SwapWord( 4, pabyBuf+4 );
   memcpy( &psTree->nDepth, pabyBuf+4, 4 );
 
+  /* -------------------------------------------------------------------- */
+  /*      Packed R-trees carry the node size and count as well.           */
+  /* -------------------------------------------------------------------- */
+  if( psTree->version >= MS_PACKED_TREE_VERSION ) {
+    if( fread( pabyBuf, 8, 1, psTree->fp ) != 1 ) {
+      fclose(psTree->fp);
+      msFree(psTree);
+      return( NULL );
+    }
+
+    if( psTree->needswap ) SwapWord( 4, pabyBuf );
+    memcpy( &psTree->nNodeSize, pabyBuf, 4 );
+
+    if( psTree->needswap ) SwapWord( 4, pabyBuf+4 );
+    memcpy( &psTree->nNodes, pabyBuf+4, 4 );
+
+    if( psTree->nNodeSize < 2 || psTree->nNodeSize > 1024 || psTree->nNodes < 1 ||
+        psTree->nDepth < 1 || psTree->nDepth > 64 ) {
+      msSetError(MS_IOERR, "Corrupted packed spatial index %s.", "msSHPDiskTreeOpen()", pszTree);
+      fclose(psTree->fp);
+      msFree(psTree);
+      return( NULL );
+    }
+  }
+
+  psTree->nRootOffset = ftell( psTree->fp );
+
   return( psTree );
 }
 
@@ -198,9 +233,240 @@ SHPTreeHandle msSHPDiskTreeOpen(const char * pszTree, int debug)
 void msSHPDiskTreeClose(SHPTreeHandle disktree)
 {
   fclose( disktree->fp );
+  free( disktree->pabyData );
   free( disktree );
 }
 
+/* -------------------------------------------------------------------- */
+/*      Process wide cache of open .qix handles, used by                */
+/*      msSearchDiskTree() so that FastCGI processes don't have to      */
+/*      open/read/close the index of busy layers on every request.      */
+/*      Entries are keyed on the index filename and are invalidated     */
+/*      when the file modification time or size changes. A handle is    */
+/*      only used by one search at a time (in_use), indexes small       */
+/*      enough are held entirely in memory.                             */
+/*                                                                      */
+/*      These static structures are protected by the TLOCK_QIXCACHE     */
+/*      mutex.                                                          */
+/* -------------------------------------------------------------------- */
+#define MS_QIX_CACHE_MAX      64
+#define MS_QIX_CACHE_INMEMORY (1024*1024)
+
+typedef struct {
+  char *filename;
+  time_t mtime;
+  off_t size;
+  int in_use;
+  int stale;
+  unsigned long last_used;
+  SHPTreeHandle disktree;
+} diskTreeCacheObj;
+
+static int diskTreeCacheCount = 0;
+static unsigned long diskTreeCacheClock = 0;
+static diskTreeCacheObj diskTreeCache[MS_QIX_CACHE_MAX];
+
+static void diskTreeCacheRemove(int i)
+{
+  msSHPDiskTreeClose(diskTreeCache[i].disktree);
+  free(diskTreeCache[i].filename);
+
+  diskTreeCacheCount--;
+  if( i != diskTreeCacheCount )
+    diskTreeCache[i] = diskTreeCache[diskTreeCacheCount];
+}
+
+/*
+** Load the nodes of a small index into memory so that searching it doesn't
+** require any further I/O.
+*/
+static void diskTreeLoadInMemory(SHPTreeHandle disktree, off_t size)
+{
+  long nDataSize = (long) size - disktree->nRootOffset;
+
+  if( nDataSize <= 0 || nDataSize > MS_QIX_CACHE_INMEMORY )
+    return;
+
+  disktree->pabyData = (uchar *) malloc(nDataSize);
+  if( disktree->pabyData == NULL )
+    return;
+
+  if( fseek(disktree->fp, disktree->nRootOffset, SEEK_SET) != 0 ||
+      fread(disktree->pabyData, nDataSize, 1, disktree->fp) != 1 ) {
+    free(disktree->pabyData);
+    disktree->pabyData = NULL;
+    return;
+  }
+  disktree->nDataSize = nDataSize;
+}
+
+/*
+** Return a handle positioned at the root node of the given index, either
+** from the cache or freshly opened. Must be given back with
+** msSHPDiskTreeCacheRelease().
+*/
+static SHPTreeHandle msSHPDiskTreeCacheRequest(const char *filename, int debug)
+{
+  int i, slot = -1;
+  struct stat sStat;
+  SHPTreeHandle disktree;
+
+  if( stat(filename, &sStat) != 0 ) /* e.g. an upper case .QIX, don't cache */
+    return msSHPDiskTreeOpen(filename, debug);
+
+  msAcquireLock( TLOCK_QIXCACHE );
+  for( i = diskTreeCacheCount - 1; i >= 0; i-- ) {
+    diskTreeCacheObj *entry = diskTreeCache + i;
+
+    if( strcmp(entry->filename, filename) != 0 )
+      continue;
+
+    if( entry->mtime != sStat.st_mtime || entry->size != sStat.st_size ) {
+      /* the index has been rebuilt, drop the old handle(s) */
+      if( entry->in_use )
+        entry->stale = MS_TRUE;
+      else
+        diskTreeCacheRemove(i);
+      continue;
+    }
+
+    if( !entry->in_use && !entry->stale ) {
+      entry->in_use = MS_TRUE;
+      entry->last_used = ++diskTreeCacheClock;
+      disktree = entry->disktree;
+      msReleaseLock( TLOCK_QIXCACHE );
+
+      if( disktree->pabyData )
+        disktree->nDataOffset = 0;
+      else
+        fseek(disktree->fp, disktree->nRootOffset, SEEK_SET);
+      return disktree;
+    }
+  }
+  msReleaseLock( TLOCK_QIXCACHE );
+
+  disktree = msSHPDiskTreeOpen(filename, debug);
+  if( !disktree )
+    return NULL;
+
+  diskTreeLoadInMemory(disktree, sStat.st_size);
+  if( disktree->pabyData == NULL )
+    fseek(disktree->fp, disktree->nRootOffset, SEEK_SET);
+
+  /* -------------------------------------------------------------------- */
+  /*      Register the new handle, evicting the least recently used       */
+  /*      idle one if the cache is full.                                  */
+  /* -------------------------------------------------------------------- */
+  msAcquireLock( TLOCK_QIXCACHE );
+  if( diskTreeCacheCount == MS_QIX_CACHE_MAX ) {
+    for( i = 0; i < diskTreeCacheCount; i++ ) {
+      if( !diskTreeCache[i].in_use &&
+          (slot == -1 || diskTreeCache[i].last_used < diskTreeCache[slot].last_used) )
+        slot = i;
+    }
+    if( slot != -1 )
+      diskTreeCacheRemove(slot);
+  }
+  if( diskTreeCacheCount < MS_QIX_CACHE_MAX ) {
+    diskTreeCacheObj *entry = diskTreeCache + diskTreeCacheCount++;
+    entry->filename = msStrdup(filename);
+    entry->mtime = sStat.st_mtime;
+    entry->size = sStat.st_size;
+    entry->in_use = MS_TRUE;
+    entry->stale = MS_FALSE;
+    entry->last_used = ++diskTreeCacheClock;
+    entry->disktree = disktree;
+  }
+  msReleaseLock( TLOCK_QIXCACHE );
+
+  return disktree;
+}
+
+static void msSHPDiskTreeCacheRelease(SHPTreeHandle disktree)
+{
+  int i;
+
+  msAcquireLock( TLOCK_QIXCACHE );
+  for( i = 0; i < diskTreeCacheCount; i++ ) {
+    if( diskTreeCache[i].disktree == disktree ) {
+      diskTreeCache[i].in_use = MS_FALSE;
+      if( diskTreeCache[i].stale )
+        diskTreeCacheRemove(i);
+      msReleaseLock( TLOCK_QIXCACHE );
+      return;
+    }
+  }
+  msReleaseLock( TLOCK_QIXCACHE );
+
+  /* not cached (cache full or uncacheable filename) */
+  msSHPDiskTreeClose(disktree);
+}
+
+/************************************************************************/
+/*                     msSHPDiskTreeCacheCleanup()                      */
+/*                                                                      */
+/*      Close all cached .qix handles, called from msCleanup().         */
+/************************************************************************/
+void msSHPDiskTreeCacheCleanup()
+{
+  msAcquireLock( TLOCK_QIXCACHE );
+  while( diskTreeCacheCount > 0 )
+    diskTreeCacheRemove(0);
+  msReleaseLock( TLOCK_QIXCACHE );
+}
+
+/************************************************************************/
+/*                    msSHPDiskTreeCacheCloseFiles()                    */
+/*                                                                      */
+/*      Close the idle cached handles that still read from their file,  */
+/*      before forking: a FILE shared with child processes would have   */
+/*      its offset moved under them. Indexes loaded in memory stay.     */
+/************************************************************************/
+void msSHPDiskTreeCacheCloseFiles()
+{
+  int i;
+
+  msAcquireLock( TLOCK_QIXCACHE );
+  for( i = diskTreeCacheCount - 1; i >= 0; i-- ) {
+    if( !diskTreeCache[i].in_use && diskTreeCache[i].disktree->pabyData == NULL )
+      diskTreeCacheRemove(i);
+  }
+  msReleaseLock( TLOCK_QIXCACHE );
+}
+
+/*
+** I/O helpers used by the disk tree search, reading either from the
+** in-memory image of the index or from the file.
+*/
+static int diskTreeRead(SHPTreeHandle disktree, void *buf, long size)
+{
+  if( disktree->pabyData ) {
+    if( disktree->nDataOffset + size > disktree->nDataSize )
+      return 0;
+    memcpy(buf, disktree->pabyData + disktree->nDataOffset, size);
+    disktree->nDataOffset += size;
+    return 1;
+  }
+  return (int) fread(buf, size, 1, disktree->fp);
+}
+
+static void diskTreeSkip(SHPTreeHandle disktree, long size)
+{
+  if( disktree->pabyData )
+    disktree->nDataOffset += size;
+  else
+    fseek(disktree->fp, size, SEEK_CUR);
+}
+
+/* offset is relative to the root node */
+static void diskTreeSeek(SHPTreeHandle disktree, long offset)
+{
+  if( disktree->pabyData )
+    disktree->nDataOffset = offset;
+  else
+    fseek(disktree->fp, disktree->nRootOffset + offset, SEEK_SET);
+}
+
 
 treeObj *msCreateTree(shapefileObj *shapefile, int maxdepth)
 {
@@ -467,7 +733,51 @@ void msTreeTrim(treeObj *tree)
   treeNodeTrim(tree->root);
 }
 
-static void searchDiskTreeNode(SHPTreeHandle disktree, rectObj aoi, ms_bitarray status)
+/*
+** Add a shape id to a search result, switching from the sorted list to the
+** bit array once the hits get dense (if the bit array can't be allocated
+** the list simply keeps growing).
+*/
+static void treeHitsAdd(treeHitsObj *hits, int id)
+{
+  int i;
+
+  if( id < 0 || id >= hits->numshapes )
+    return;
+
+  if( hits->countonly ) {
+    hits->numids++;
+    return;
+  }
+
+  if( hits->status ) {
+    msSetBit(hits->status, id, 1);
+    return;
+  }
+
+  if( hits->numids == hits->maxids ) {
+    if( hits->maxids >= hits->numshapes / MS_TREE_HITS_DENSITY &&
+        (hits->status = msAllocBitArray(hits->numshapes)) != NULL ) {
+      for( i = 0; i < hits->numids; i++ )
+        msSetBit(hits->status, hits->ids[i], 1);
+      msSetBit(hits->status, id, 1);
+      free(hits->ids);
+      hits->ids = NULL;
+      hits->numids = hits->maxids = 0;
+      return;
+    }
+    hits->maxids = MS_MAX(64, hits->maxids * 2);
+    hits->ids = (int *) msSmallRealloc(hits->ids, sizeof(int) * hits->maxids);
+  }
+  hits->ids[hits->numids++] = id;
+}
+
+static int treeHitsCompare(const void *a, const void *b)
+{
+  return *(const int *)a - *(const int *)b;
+}
+
+static void searchDiskTreeNode(SHPTreeHandle disktree, rectObj aoi, treeHitsObj *hits)
 {
   int i;
   ms_int32 offset;
@@ -476,49 +786,52 @@ static void searchDiskTreeNode(SHPTreeHandle disktree, rectObj aoi, ms_bitarray
 
   int *ids=NULL;
 
-  if( fread( &offset, 4, 1, disktree->fp ) != 1 )
+  if( diskTreeRead( disktree, &offset, 4 ) != 1 )
     goto error;
   if ( disktree->needswap ) SwapWord ( 4, &offset );
 
-  if( fread( &rect, sizeof(rectObj), 1, disktree->fp ) != 1 )
+  if( diskTreeRead( disktree, &rect, sizeof(rectObj) ) != 1 )
     goto error;
   if ( disktree->needswap ) SwapWord ( 8, &rect.minx );
   if ( disktree->needswap ) SwapWord ( 8, &rect.miny );
   if ( disktree->needswap ) SwapWord ( 8, &rect.maxx );
   if ( disktree->needswap ) SwapWord ( 8, &rect.maxy );
 
-  if( fread( &numshapes, 4, 1, disktree->fp ) != 1 )
+  if( diskTreeRead( disktree, &numshapes, 4 ) != 1 )
     goto error;
   if ( disktree->needswap ) SwapWord ( 4, &numshapes );
 
   if(!msRectOverlap(&rect, &aoi)) { /* skip rest of this node and sub-nodes */
     offset += numshapes*sizeof(ms_int32) + sizeof(ms_int32);
-    fseek(disktree->fp, offset, SEEK_CUR);
+    diskTreeSkip(disktree, offset);
     return;
   }
-  if(numshapes > 0) {
+  if(numshapes > 0 && hits->countonly) {
+    hits->numids += numshapes; /* a shape is stored in a single node */
+    diskTreeSkip(disktree, numshapes*sizeof(ms_int32));
+  } else if(numshapes > 0) {
     ids = (int *)msSmallMalloc(numshapes*sizeof(ms_int32));
 
-    if( fread( ids, numshapes*sizeof(ms_int32), 1, disktree->fp ) != 1 )
+    if( diskTreeRead( disktree, ids, numshapes*sizeof(ms_int32) ) != 1 )
       goto error;
     if (disktree->needswap ) {
       for( i=0; i<numshapes; i++ ) {
         SwapWord( 4, &ids[i] );
-        msSetBit(status, ids[i], 1);
+        treeHitsAdd(hits, ids[i]);
       }
     } else {
       for(i=0; i<numshapes; i++)
-        msSetBit(status, ids[i], 1);
+        treeHitsAdd(hits, ids[i]);
     }
     free(ids);
   }
 
-  if( fread( &numsubnodes, 4, 1, disktree->fp ) != 1 )
+  if( diskTreeRead( disktree, &numsubnodes, 4 ) != 1 )
     goto error;
   if ( disktree->needswap ) SwapWord ( 4, &numsubnodes );
 
   for(i=0; i<numsubnodes; i++)
-    searchDiskTreeNode(disktree, aoi, status);
+    searchDiskTreeNode(disktree, aoi, hits);
 
   return;
   
@@ -527,31 +840,450 @@ error:
   return;
 }
 
+/* -------------------------------------------------------------------- */
+/*      Packed R-tree on disk format (version 2), all nodes have the    */
+/*      same size and are stored level by level starting at the root:   */
+/*      int       numentries      4 bytes                               */
+/*      int       level           4 bytes (0 for leaves)               */
+/*      entry     entries[nodesize]                                     */
+/*   with each entry being                                              */
+/*      rectObj   rect            4 * 8 bytes                           */
+/*      int       id              4 bytes (shape id or child node)      */
+/* -------------------------------------------------------------------- */
+#define PACKED_TREE_ENTRY_SIZE (sizeof(rectObj) + 4)
+#define PACKED_TREE_NODE_BYTES(nodesize) (8 + (nodesize) * PACKED_TREE_ENTRY_SIZE)
+
+static int searchPackedTreeNode(SHPTreeHandle disktree, ms_int32 node, int depth, rectObj aoi, treeHitsObj *hits, uchar *pabyBuf)
+{
+  int i;
+  ms_int32 numentries, level;
+  long nodebytes = PACKED_TREE_NODE_BYTES(disktree->nNodeSize);
+  uchar *pabyNode = pabyBuf + depth * nodebytes;
+
+  if( node < 0 || node >= disktree->nNodes || depth >= disktree->nDepth )
+    return MS_FAILURE;
+
+  diskTreeSeek(disktree, node * nodebytes);
+  if( diskTreeRead(disktree, pabyNode, nodebytes) != 1 )
+    return MS_FAILURE;
+
+  memcpy( &numentries, pabyNode, 4 );
+  if ( disktree->needswap ) SwapWord ( 4, &numentries );
+  memcpy( &level, pabyNode + 4, 4 );
+  if ( disktree->needswap ) SwapWord ( 4, &level );
+
+  if( numentries < 0 || numentries > disktree->nNodeSize )
+    return MS_FAILURE;
+
+  for( i = 0; i < numentries; i++ ) {
+    uchar *pabyEntry = pabyNode + 8 + i * PACKED_TREE_ENTRY_SIZE;
+    rectObj rect;
+    ms_int32 id;
+
+    memcpy( &rect, pabyEntry, sizeof(rectObj) );
+    if ( disktree->needswap ) {
+      SwapWord ( 8, &rect.minx );
+      SwapWord ( 8, &rect.miny );
+      SwapWord ( 8, &rect.maxx );
+      SwapWord ( 8, &rect.maxy );
+    }
+
+    if(!msRectOverlap(&rect, &aoi))
+      continue;
+
+    memcpy( &id, pabyEntry + sizeof(rectObj), 4 );
+    if ( disktree->needswap ) SwapWord ( 4, &id );
+
+    if( level == 0 ) {
+      if( id < 0 || id >= disktree->nShapes )
+        return MS_FAILURE;
+      treeHitsAdd(hits, id);
+    } else if( searchPackedTreeNode(disktree, id, depth + 1, aoi, hits, pabyBuf) != MS_SUCCESS ) {
+      return MS_FAILURE;
+    }
+  }
+
+  return MS_SUCCESS;
+}
+
+static void searchPackedTree(SHPTreeHandle disktree, rectObj aoi, treeHitsObj *hits)
+{
+  /* one node buffer per level, the recursion never goes deeper than nDepth */
+  uchar *pabyBuf = (uchar *) msSmallMalloc(disktree->nDepth * PACKED_TREE_NODE_BYTES(disktree->nNodeSize));
+
+  if( searchPackedTreeNode(disktree, 0, 0, aoi, hits, pabyBuf) != MS_SUCCESS )
+    msSetError(MS_IOERR, "Corrupted packed spatial index.", "searchPackedTree()");
+
+  free(pabyBuf);
+}
+
 ms_bitarray msSearchDiskTree(const char *filename, rectObj aoi, int debug)
+{
+  return msSearchDiskTreeEx(filename, aoi, debug, NULL);
+}
+
+/*
+** Same as msSearchDiskTree(), but also reports whether the returned shapes
+** have already been checked against their own bounds (packed R-trees store
+** the shape bounds in their leaves), in which case msFilterTreeSearch() is
+** not needed.
+*/
+ms_bitarray msSearchDiskTreeEx(const char *filename, rectObj aoi, int debug, int *bounds_checked)
+{
+  treeHitsObj hits;
+
+  hits.maxids = -1; /* always collect into the bit array */
+  if( msSearchDiskTreeHits(filename, aoi, debug, &hits, bounds_checked) != MS_SUCCESS )
+    return(NULL);
+
+  return(hits.status);
+}
+
+static int searchDiskTreeHits(const char *filename, rectObj aoi, int debug, treeHitsObj *hits, int *bounds_checked, int countonly)
 {
   SHPTreeHandle disktree;
-  ms_bitarray status=NULL;
+  int i, n, dense = (hits->maxids < 0 && !countonly);
 
-  disktree = msSHPDiskTreeOpen (filename, debug);
+  hits->status = NULL;
+  hits->ids = NULL;
+  hits->numids = hits->maxids = 0;
+  hits->countonly = countonly;
+
+  if( bounds_checked )
+    *bounds_checked = MS_FALSE;
+
+  disktree = msSHPDiskTreeCacheRequest (filename, debug);
   if(!disktree) {
 
     /* only set this error IF debugging is turned on, gets annoying otherwise */
     if(debug) msSetError(MS_NOTFOUND, "Unable to open spatial index for %s. In most cases you can safely ignore this message, otherwise check file names and permissions.", "msSearchDiskTree()", filename);
 
-    return(NULL);
+    return(MS_FAILURE);
   }
 
-  status = msAllocBitArray(disktree->nShapes);
-  if(!status) {
-    msSetError(MS_MEMERR, NULL, "msSearchDiskTree()");
-    msSHPDiskTreeClose( disktree );
-    return(NULL);
+  hits->numshapes = disktree->nShapes;
+  if( dense ) {
+    hits->status = msAllocBitArray(disktree->nShapes);
+    if(!hits->status) {
+      msSetError(MS_MEMERR, NULL, "msSearchDiskTree()");
+      msSHPDiskTreeCacheRelease( disktree );
+      return(MS_FAILURE);
+    }
   }
 
-  searchDiskTreeNode(disktree, aoi, status);
+  if( disktree->version >= MS_PACKED_TREE_VERSION ) {
+    searchPackedTree(disktree, aoi, hits);
+    if( bounds_checked )
+      *bounds_checked = MS_TRUE;
+  } else {
+    searchDiskTreeNode(disktree, aoi, hits);
+  }
 
-  msSHPDiskTreeClose( disktree );
-  return(status);
+  msSHPDiskTreeCacheRelease( disktree );
+
+  if( hits->ids ) {
+    /* quadtree nodes aren't in id order, also drop duplicates */
+    qsort(hits->ids, hits->numids, sizeof(int), treeHitsCompare);
+    for( i = 1, n = 1; i < hits->numids; i++ ) {
+      if( hits->ids[i] != hits->ids[n-1] )
+        hits->ids[n++] = hits->ids[i];
+    }
+    hits->numids = n;
+  }
+
+  return(MS_SUCCESS);
+}
+
+/*
+** Search a .qix file and return the overlapping shape ids in hits, either as
+** a sorted list of ids (hits->ids, hits->numids) when they are sparse or as a
+** bit array (hits->status). The caller must free() both. Returns MS_FAILURE
+** if there is no usable index. A negative hits->maxids on input asks for the
+** bit array only, as msSearchDiskTreeEx() does.
+*/
+int msSearchDiskTreeHits(const char *filename, rectObj aoi, int debug, treeHitsObj *hits, int *bounds_checked)
+{
+  return searchDiskTreeHits(filename, aoi, debug, hits, bounds_checked, MS_FALSE);
+}
+
+/*
+** Number of shapes msSearchDiskTree() would return, without collecting them.
+** The index only knows the bounds of the shapes (packed R-trees) or of the
+** nodes holding them (quadtrees), so this is an upper bound of the shapes
+** that overlap aoi. Returns -1 if there is no usable index.
+*/
+int msCountDiskTreeHits(const char *filename, rectObj aoi, int debug)
+{
+  treeHitsObj hits;
+
+  hits.maxids = 0;
+  if( searchDiskTreeHits(filename, aoi, debug, &hits, NULL, MS_TRUE) != MS_SUCCESS )
+    return -1;
+
+  return hits.numids;
+}
+
+/* -------------------------------------------------------------------- */
+/*      Nearest neighbour search: best-first traversal of the index,    */
+/*      the nodes and shapes met are kept in a heap ordered by the      */
+/*      distance from the point to their rectangle. Quadtree shapes     */
+/*      have no rectangle of their own, the one of the node holding     */
+/*      them (which contains them) stands for it.                       */
+/* -------------------------------------------------------------------- */
+#define TREE_NEAREST_QUADNODE   0
+#define TREE_NEAREST_PACKEDNODE 1
+#define TREE_NEAREST_SHAPE      2
+
+typedef struct {
+  double distance; /* squared */
+  long ref; /* quadtree node offset, packed node number or shape id */
+  int type;
+} treeNearestEntryObj;
+
+struct treeNearestObj {
+  SHPTreeHandle disktree;
+  pointObj point;
+  treeNearestEntryObj *heap;
+  int numentries;
+  int maxentries;
+  uchar *pabyNode; /* packed R-tree node buffer */
+};
+
+static double treeNearestRectDistance(pointObj *point, rectObj *rect)
+{
+  double dx = 0, dy = 0;
+
+  if( point->x < rect->minx ) dx = rect->minx - point->x;
+  else if( point->x > rect->maxx ) dx = point->x - rect->maxx;
+  if( point->y < rect->miny ) dy = rect->miny - point->y;
+  else if( point->y > rect->maxy ) dy = point->y - rect->maxy;
+
+  return dx*dx + dy*dy;
+}
+
+static void treeNearestPush(treeNearestObj *nearest, double distance, long ref, int type)
+{
+  int i;
+
+  if( nearest->numentries == nearest->maxentries ) {
+    nearest->maxentries = MS_MAX(64, nearest->maxentries * 2);
+    nearest->heap = (treeNearestEntryObj *) msSmallRealloc(nearest->heap, sizeof(treeNearestEntryObj) * nearest->maxentries);
+  }
+
+  /* sift up */
+  for( i = nearest->numentries++; i > 0 && nearest->heap[(i-1)/2].distance > distance; i = (i-1)/2 )
+    nearest->heap[i] = nearest->heap[(i-1)/2];
+  nearest->heap[i].distance = distance;
+  nearest->heap[i].ref = ref;
+  nearest->heap[i].type = type;
+}
+
+static treeNearestEntryObj treeNearestPop(treeNearestObj *nearest)
+{
+  treeNearestEntryObj top = nearest->heap[0], last = nearest->heap[--nearest->numentries];
+  int i = 0, child;
+
+  /* sift down */
+  while( (child = 2*i + 1) < nearest->numentries ) {
+    if( child + 1 < nearest->numentries && nearest->heap[child+1].distance < nearest->heap[child].distance )
+      child++;
+    if( last.distance <= nearest->heap[child].distance )
+      break;
+    nearest->heap[i] = nearest->heap[child];
+    i = child;
+  }
+  nearest->heap[i] = last;
+
+  return top;
+}
+
+static long diskTreeTell(SHPTreeHandle disktree)
+{
+  if( disktree->pabyData )
+    return disktree->nDataOffset;
+  return ftell(disktree->fp) - disktree->nRootOffset;
+}
+
+/* reads the header of the quadtree node at the current position, leaves it at its shape ids */
+static int readQuadNodeHeader(SHPTreeHandle disktree, ms_int32 *offset, rectObj *rect, ms_int32 *numshapes)
+{
+  if( diskTreeRead(disktree, offset, 4) != 1 ||
+      diskTreeRead(disktree, rect, sizeof(rectObj)) != 1 ||
+      diskTreeRead(disktree, numshapes, 4) != 1 )
+    return MS_FAILURE;
+
+  if ( disktree->needswap ) {
+    SwapWord ( 4, offset );
+    SwapWord ( 8, &rect->minx );
+    SwapWord ( 8, &rect->miny );
+    SwapWord ( 8, &rect->maxx );
+    SwapWord ( 8, &rect->maxy );
+    SwapWord ( 4, numshapes );
+  }
+
+  return (*numshapes >= 0) ? MS_SUCCESS : MS_FAILURE;
+}
+
+static int expandQuadNode(treeNearestObj *nearest, long node)
+{
+  SHPTreeHandle disktree = nearest->disktree;
+  ms_int32 offset, numshapes, numsubnodes, id;
+  rectObj rect;
+  double distance;
+  int i;
+
+  diskTreeSeek(disktree, node);
+  if( readQuadNodeHeader(disktree, &offset, &rect, &numshapes) != MS_SUCCESS )
+    return MS_FAILURE;
+
+  distance = treeNearestRectDistance(&(nearest->point), &rect);
+  for( i = 0; i < numshapes; i++ ) {
+    if( diskTreeRead(disktree, &id, 4) != 1 )
+      return MS_FAILURE;
+    if ( disktree->needswap ) SwapWord ( 4, &id );
+    if( id >= 0 && id < disktree->nShapes )
+      treeNearestPush(nearest, distance, id, TREE_NEAREST_SHAPE);
+  }
+
+  if( diskTreeRead(disktree, &numsubnodes, 4) != 1 )
+    return MS_FAILURE;
+  if ( disktree->needswap ) SwapWord ( 4, &numsubnodes );
+
+  /* the sub-nodes follow one another, offset is the size of what comes after their shape ids */
+  for( i = 0; i < numsubnodes; i++ ) {
+    long subnode = diskTreeTell(disktree);
+
+    if( readQuadNodeHeader(disktree, &offset, &rect, &numshapes) != MS_SUCCESS )
+      return MS_FAILURE;
+    treeNearestPush(nearest, treeNearestRectDistance(&(nearest->point), &rect), subnode, TREE_NEAREST_QUADNODE);
+    diskTreeSkip(disktree, offset + numshapes*sizeof(ms_int32) + sizeof(ms_int32));
+  }
+
+  return MS_SUCCESS;
+}
+
+static int expandPackedNode(treeNearestObj *nearest, long node)
+{
+  SHPTreeHandle disktree = nearest->disktree;
+  long nodebytes = PACKED_TREE_NODE_BYTES(disktree->nNodeSize);
+  ms_int32 numentries, level;
+  int i;
+
+  if( node < 0 || node >= disktree->nNodes )
+    return MS_FAILURE;
+
+  diskTreeSeek(disktree, node * nodebytes);
+  if( diskTreeRead(disktree, nearest->pabyNode, nodebytes) != 1 )
+    return MS_FAILURE;
+
+  memcpy( &numentries, nearest->pabyNode, 4 );
+  if ( disktree->needswap ) SwapWord ( 4, &numentries );
+  memcpy( &level, nearest->pabyNode + 4, 4 );
+  if ( disktree->needswap ) SwapWord ( 4, &level );
+
+  if( numentries < 0 || numentries > disktree->nNodeSize )
+    return MS_FAILURE;
+
+  for( i = 0; i < numentries; i++ ) {
+    uchar *pabyEntry = nearest->pabyNode + 8 + i * PACKED_TREE_ENTRY_SIZE;
+    rectObj rect;
+    ms_int32 id;
+
+    memcpy( &rect, pabyEntry, sizeof(rectObj) );
+    memcpy( &id, pabyEntry + sizeof(rectObj), 4 );
+    if ( disktree->needswap ) {
+      SwapWord ( 8, &rect.minx );
+      SwapWord ( 8, &rect.miny );
+      SwapWord ( 8, &rect.maxx );
+      SwapWord ( 8, &rect.maxy );
+      SwapWord ( 4, &id );
+    }
+
+    if( level == 0 ) {
+      if( id < 0 || id >= disktree->nShapes )
+        return MS_FAILURE;
+      treeNearestPush(nearest, treeNearestRectDistance(&(nearest->point), &rect), id, TREE_NEAREST_SHAPE);
+    } else {
+      /* children are stored after their parent, so the traversal cannot loop */
+      if( id <= node )
+        return MS_FAILURE;
+      treeNearestPush(nearest, treeNearestRectDistance(&(nearest->point), &rect), id, TREE_NEAREST_PACKEDNODE);
+    }
+  }
+
+  return MS_SUCCESS;
+}
+
+/*
+** Opens a nearest neighbour search of point in a .qix file, see
+** msTreeNearestNext(). Returns NULL if there is no usable index. The search
+** holds the index until msTreeNearestFree().
+*/
+treeNearestObj *msSearchDiskTreeNearest(const char *filename, pointObj point, int debug)
+{
+  treeNearestObj *nearest;
+  SHPTreeHandle disktree;
+
+  disktree = msSHPDiskTreeCacheRequest(filename, debug);
+  if( !disktree )
+    return NULL;
+
+  nearest = (treeNearestObj *) msSmallCalloc(1, sizeof(treeNearestObj));
+  nearest->disktree = disktree;
+  nearest->point = point;
+
+  if( disktree->version >= MS_PACKED_TREE_VERSION ) {
+    nearest->pabyNode = (uchar *) msSmallMalloc(PACKED_TREE_NODE_BYTES(disktree->nNodeSize));
+    treeNearestPush(nearest, 0, 0, TREE_NEAREST_PACKEDNODE);
+  } else {
+    treeNearestPush(nearest, 0, 0, TREE_NEAREST_QUADNODE);
+  }
+
+  return nearest;
+}
+
+/*
+** Gives the next shape id of a nearest neighbour search, in increasing order
+** of distance, with a lower bound of its distance to the point (the distance
+** to its bounds for packed R-trees, to its quadtree node else). Returns
+** MS_SUCCESS, MS_DONE when all the shapes have been given or MS_FAILURE.
+*/
+int msTreeNearestNext(treeNearestObj *nearest, int *id, double *distance)
+{
+  while( nearest->numentries > 0 ) {
+    treeNearestEntryObj entry = treeNearestPop(nearest);
+    int status = MS_SUCCESS;
+
+    if( entry.type == TREE_NEAREST_SHAPE ) {
+      *id = (int) entry.ref;
+      *distance = sqrt(entry.distance);
+      return MS_SUCCESS;
+    }
+
+    if( entry.type == TREE_NEAREST_PACKEDNODE )
+      status = expandPackedNode(nearest, entry.ref);
+    else
+      status = expandQuadNode(nearest, entry.ref);
+
+    if( status != MS_SUCCESS ) {
+      msSetError(MS_IOERR, "Corrupted spatial index.", "msTreeNearestNext()");
+      nearest->numentries = 0;
+      return MS_FAILURE;
+    }
+  }
+
+  return MS_DONE;
+}
+
+void msTreeNearestFree(treeNearestObj *nearest)
+{
+  if( !nearest )
+    return;
+
+  msSHPDiskTreeCacheRelease(nearest->disktree);
+  free(nearest->heap);
+  free(nearest->pabyNode);
+  free(nearest);
 }
 
 treeNodeObj *readTreeNode( SHPTreeHandle disktree )
@@ -560,6 +1292,10 @@ treeNodeObj *readTreeNode( SHPTreeHandle disktree )
   ms_int32 offset;
   treeNodeObj *node;
 
+  /* packed R-trees have no quadtree nodes */
+  if( disktree->version >= MS_PACKED_TREE_VERSION )
+    return NULL;
+
   node = (treeNodeObj *) msSmallMalloc(sizeof(treeNodeObj));
   node->ids = NULL;
 
@@ -626,6 +1362,12 @@ treeObj *msReadTree(char *filename, int debug)
     return(NULL);
   }
 
+  if( disktree->version >= MS_PACKED_TREE_VERSION ) {
+    msSetError(MS_IOERR, "%s is a packed R-tree, not a quadtree.", "msReadTree()", filename);
+    msSHPDiskTreeClose( disktree );
+    return(NULL);
+  }
+
   tree = (treeObj *) malloc(sizeof(treeObj));
   MS_CHECK_ALLOC(tree, sizeof(treeObj), NULL);
 
@@ -717,6 +1459,7 @@ int msWriteTree(treeObj *tree, char *filename, int B_order)
 
   disktree = (SHPTreeHandle) malloc(sizeof(SHPTreeInfo));
   MS_CHECK_ALLOC(disktree, sizeof(SHPTreeInfo), MS_FALSE);
+  disktree->pabyData = NULL;
 
   /* -------------------------------------------------------------------- */
   /*  Compute the base (layer) name.  If there is any extension     */
@@ -805,6 +1548,230 @@ int msWriteTree(treeObj *tree, char *filename, int B_order)
   return(MS_TRUE);
 }
 
+/* -------------------------------------------------------------------- */
+/*      Packed R-tree creation. The tree is bulk loaded bottom-up       */
+/*      using the Sort-Tile-Recursive (STR) algorithm: entries are      */
+/*      sorted on their center x, cut into vertical slices, sorted on   */
+/*      their center y within each slice and packed nodesize at a time. */
+/* -------------------------------------------------------------------- */
+typedef struct {
+  rectObj rect;
+  ms_int32 id;
+} packedTreeEntryObj;
+
+static int packedTreeCompareX(const void *a, const void *b)
+{
+  const rectObj *ra = &((const packedTreeEntryObj *) a)->rect;
+  const rectObj *rb = &((const packedTreeEntryObj *) b)->rect;
+  double ca = ra->minx + ra->maxx, cb = rb->minx + rb->maxx;
+  return (ca < cb) ? -1 : ((ca > cb) ? 1 : 0);
+}
+
+static int packedTreeCompareY(const void *a, const void *b)
+{
+  const rectObj *ra = &((const packedTreeEntryObj *) a)->rect;
+  const rectObj *rb = &((const packedTreeEntryObj *) b)->rect;
+  double ca = ra->miny + ra->maxy, cb = rb->miny + rb->maxy;
+  return (ca < cb) ? -1 : ((ca > cb) ? 1 : 0);
+}
+
+static void packedTreeSTRSort(packedTreeEntryObj *entries, int numentries, int node_size)
+{
+  int numnodes = (numentries + node_size - 1) / node_size;
+  int numslices = (int) ceil(sqrt((double) numnodes));
+  int slicesize = numslices * node_size;
+  int i;
+
+  qsort(entries, numentries, sizeof(packedTreeEntryObj), packedTreeCompareX);
+  for( i = 0; i < numentries; i += slicesize )
+    qsort(entries + i, MS_MIN(slicesize, numentries - i), sizeof(packedTreeEntryObj), packedTreeCompareY);
+}
+
+static void writePackedTreeNode(FILE *fp, int needswap, int node_size, int level,
+                                packedTreeEntryObj *entries, int numentries, ms_int32 id_offset)
+{
+  int i, j;
+  uchar *pabyRec = (uchar *) msSmallCalloc(1, PACKED_TREE_NODE_BYTES(node_size));
+  ms_int32 i32;
+
+  i32 = numentries;
+  memcpy( pabyRec, &i32, 4 );
+  if( needswap ) SwapWord( 4, pabyRec );
+  i32 = level;
+  memcpy( pabyRec+4, &i32, 4 );
+  if( needswap ) SwapWord( 4, pabyRec+4 );
+
+  for( i = 0; i < numentries; i++ ) {
+    uchar *pabyEntry = pabyRec + 8 + i * PACKED_TREE_ENTRY_SIZE;
+
+    memcpy( pabyEntry, &entries[i].rect, sizeof(rectObj) );
+    for( j = 0; j < 4; j++ )
+      if( needswap ) SwapWord( 8, pabyEntry+(8*j) );
+
+    i32 = entries[i].id + id_offset;
+    memcpy( pabyEntry + sizeof(rectObj), &i32, 4 );
+    if( needswap ) SwapWord( 4, pabyEntry + sizeof(rectObj) );
+  }
+
+  fwrite( pabyRec, PACKED_TREE_NODE_BYTES(node_size), 1, fp );
+  free( pabyRec );
+}
+
+/*
+** msWritePackedTree() - Build a packed R-tree of the given shapefile and
+** write it in .qix format version 2 (MS_PACKED_TREE_VERSION). B_order must
+** be one of the new format byte orders. Returns MS_TRUE/MS_FALSE like
+** msWriteTree().
+*/
+int msWritePackedTree(shapefileObj *shapefile, char *filename, int B_order, int node_size)
+{
+  char signature[3] = "SQT";
+  char version = MS_PACKED_TREE_VERSION;
+  char reserved[3] = {0,0,0};
+  char pabyBuf[32];
+  char mtBigEndian;
+  int needswap, i, l, status = MS_TRUE;
+  int numlevels = 0, numnodes = 0, maxlevels = 64;
+  int numentries = 0;
+  FILE *fp;
+  rectObj bounds;
+
+  packedTreeEntryObj **levels;  /* node entries of each level, leaves first */
+  int *levelcounts;             /* number of entries of each level */
+  ms_int32 *levelstarts;        /* index of the first node of each level on disk */
+
+  if( !shapefile ) return MS_FALSE;
+
+  if( B_order != MS_NEW_LSB_ORDER && B_order != MS_NEW_MSB_ORDER ) {
+    msSetError(MS_MISCERR, "Packed trees require one of the new format byte orders.", "msWritePackedTree()");
+    return MS_FALSE;
+  }
+
+  if( node_size <= 0 )
+    node_size = MS_PACKED_TREE_NODE_SIZE;
+  if( node_size < 2 || node_size > 1024 ) {
+    msSetError(MS_MISCERR, "Invalid node size %d, must be between 2 and 1024.", "msWritePackedTree()", node_size);
+    return MS_FALSE;
+  }
+
+  i = 1;
+  if( *((uchar *) &i) == 1 )
+    mtBigEndian = MS_FALSE;
+  else
+    mtBigEndian = MS_TRUE;
+  needswap = (mtBigEndian != (B_order == MS_NEW_MSB_ORDER));
+
+  levels = (packedTreeEntryObj **) msSmallCalloc(maxlevels, sizeof(packedTreeEntryObj *));
+  levelcounts = (int *) msSmallCalloc(maxlevels, sizeof(int));
+  levelstarts = (ms_int32 *) msSmallCalloc(maxlevels, sizeof(ms_int32));
+
+  /* -------------------------------------------------------------------- */
+  /*      Collect the shape bounds, null and empty shapes are skipped.    */
+  /* -------------------------------------------------------------------- */
+  levels[0] = (packedTreeEntryObj *) msSmallMalloc(sizeof(packedTreeEntryObj) * MS_MAX(shapefile->numshapes, 1));
+  for( i = 0; i < shapefile->numshapes; i++ ) {
+    if(msSHPReadBounds(shapefile->hSHP, i, &bounds) == MS_SUCCESS) {
+      levels[0][numentries].rect = bounds;
+      levels[0][numentries].id = i;
+      numentries++;
+    }
+  }
+  levelcounts[0] = numentries;
+
+  /* -------------------------------------------------------------------- */
+  /*      Build the levels bottom-up. The entries of level l+1 are the    */
+  /*      nodes of level l, their ids being node positions in level l.    */
+  /* -------------------------------------------------------------------- */
+  numlevels = 1;
+  while( 1 ) {
+    int count = levelcounts[numlevels-1];
+    int nodes = MS_MAX((count + node_size - 1) / node_size, 1);
+    packedTreeEntryObj *cur = levels[numlevels-1], *next;
+
+    packedTreeSTRSort(cur, count, node_size);
+    if( nodes == 1 )
+      break;
+
+    if( numlevels == maxlevels ) {
+      msSetError(MS_MISCERR, "Packed tree too deep.", "msWritePackedTree()");
+      status = MS_FALSE;
+      goto cleanup;
+    }
+
+    next = (packedTreeEntryObj *) msSmallMalloc(sizeof(packedTreeEntryObj) * nodes);
+    for( i = 0; i < nodes; i++ ) {
+      int j, first = i * node_size, last = MS_MIN(first + node_size, count);
+
+      next[i].rect = cur[first].rect;
+      for( j = first + 1; j < last; j++ )
+        msMergeRect(&next[i].rect, &cur[j].rect);
+      next[i].id = i;
+    }
+    levels[numlevels] = next;
+    levelcounts[numlevels] = nodes;
+    numlevels++;
+  }
+
+  /* nodes are written root first, compute where each level starts */
+  for( l = numlevels - 1; l >= 0; l-- ) {
+    levelstarts[l] = numnodes;
+    numnodes += MS_MAX((levelcounts[l] + node_size - 1) / node_size, 1);
+  }
+
+  fp = fopen(filename, "wb");
+  if( !fp ) {
+    msSetError(MS_IOERR, "(%s)", "msWritePackedTree()", filename);
+    status = MS_FALSE;
+    goto cleanup;
+  }
+
+  /* -------------------------------------------------------------------- */
+  /*      Write the header.                                               */
+  /* -------------------------------------------------------------------- */
+  memcpy( pabyBuf, &signature, 3 );
+  pabyBuf[3] = B_order;
+  memcpy( pabyBuf+4, &version, 1);
+  memcpy( pabyBuf+5, &reserved, 3);
+
+  memcpy( pabyBuf+8, &shapefile->numshapes, 4 );
+  if( needswap ) SwapWord( 4, pabyBuf+8 );
+  memcpy( pabyBuf+12, &numlevels, 4 );
+  if( needswap ) SwapWord( 4, pabyBuf+12 );
+  memcpy( pabyBuf+16, &node_size, 4 );
+  if( needswap ) SwapWord( 4, pabyBuf+16 );
+  memcpy( pabyBuf+20, &numnodes, 4 );
+  if( needswap ) SwapWord( 4, pabyBuf+20 );
+
+  fwrite( pabyBuf, 24, 1, fp );
+
+  /* -------------------------------------------------------------------- */
+  /*      Write the nodes, root level first.                              */
+  /* -------------------------------------------------------------------- */
+  for( l = numlevels - 1; l >= 0; l-- ) {
+    int count = levelcounts[l];
+    ms_int32 id_offset = (l == 0) ? 0 : levelstarts[l-1];
+
+    if( count == 0 )
+      writePackedTreeNode(fp, needswap, node_size, l, NULL, 0, 0);
+    for( i = 0; i < count; i += node_size )
+      writePackedTreeNode(fp, needswap, node_size, l, levels[l] + i, MS_MIN(node_size, count - i), id_offset);
+  }
+
+  if( fclose(fp) != 0 ) {
+    msSetError(MS_IOERR, "Failed to write %s.", "msWritePackedTree()", filename);
+    status = MS_FALSE;
+  }
+
+cleanup:
+  for( l = 0; l < maxlevels; l++ )
+    free(levels[l]);
+  free(levels);
+  free(levelcounts);
+  free(levelstarts);
+
+  return status;
+}
+
 /* Function to filter search results further against feature bboxes */
 void msFilterTreeSearch(shapefileObj *shp, ms_bitarray status, rectObj search_rect)
 {
@@ -822,3 +1789,21 @@ void msFilterTreeSearch(shapefileObj *shp, ms_bitarray status, rectObj search_re
   }
 
 }
+
+/*
+** Sparse version of msFilterTreeSearch(), compacts the id list in place.
+*/
+void msFilterTreeSearchIds(shapefileObj *shp, int *ids, int *numids, rectObj search_rect)
+{
+  int i, n = 0;
+  rectObj shape_rect;
+
+  for(i=0; i<*numids; i++) {
+    if(msSHPReadBounds(shp->hSHP, ids[i], &shape_rect) == MS_SUCCESS) {
+      if(msRectOverlap(&shape_rect, &search_rect) != MS_TRUE)
+        continue;
+    }
+    ids[n++] = ids[i];
+  }
+  *numids = n;
+}
@@ -66,6 +66,14 @@ extern "C" {
 
     ms_int32        nShapes;
     ms_int32        nDepth;
+
+    ms_int32        nNodeSize; /* packed R-tree only: entries per node and node count */
+    ms_int32        nNodes;
+
+    long        nRootOffset; /* file offset of the root node */
+    uchar       *pabyData;   /* in-memory image of the nodes, or NULL (see msSearchDiskTree()) */
+    long        nDataSize;
+    long        nDataOffset;
   } SHPTreeInfo;
   typedef SHPTreeInfo * SHPTreeHandle;
 
@@ -75,9 +83,35 @@ extern "C" {
 #define MS_NEW_LSB_ORDER 1
 #define MS_NEW_MSB_ORDER 2
 
+  /* index versions stored in the header of new format files */
+#define MS_QUADTREE_VERSION 1
+#define MS_PACKED_TREE_VERSION 2
+
+  /* default number of entries per node of a packed R-tree */
+#define MS_PACKED_TREE_NODE_SIZE 16
+
+  /* result of a spatial index search (see msSearchDiskTreeHits()), the shape
+     ids are kept in a sorted list while there are few of them and switch to
+     a bit array once they get more than 1/MS_TREE_HITS_DENSITY of the shapes */
+#define MS_TREE_HITS_DENSITY 32
+
+  typedef struct {
+    int numshapes;
+    ms_bitarray status; /* dense result, NULL while sparse */
+    int *ids;           /* sparse result */
+    int numids;
+    int maxids;
+    int countonly;      /* only count the hits in numids, see msCountDiskTreeHits() */
+  } treeHitsObj;
+
+  /* nearest neighbour search state, see msSearchDiskTreeNearest() */
+  typedef struct treeNearestObj treeNearestObj;
+
 
   MS_DLL_EXPORT SHPTreeHandle msSHPDiskTreeOpen(const char * pszTree, int debug);
   MS_DLL_EXPORT void msSHPDiskTreeClose(SHPTreeHandle disktree);
+  MS_DLL_EXPORT void msSHPDiskTreeCacheCleanup(void);
+  MS_DLL_EXPORT void msSHPDiskTreeCacheCloseFiles(void);
   MS_DLL_EXPORT treeNodeObj *readTreeNode( SHPTreeHandle disktree );
 
   MS_DLL_EXPORT treeObj *msCreateTree(shapefileObj *shapefile, int maxdepth);
@@ -86,11 +120,19 @@ extern "C" {
 
   MS_DLL_EXPORT ms_bitarray msSearchTree(const treeObj *tree, rectObj aoi);
   MS_DLL_EXPORT ms_bitarray msSearchDiskTree(const char *filename, rectObj aoi, int debug);
+  MS_DLL_EXPORT ms_bitarray msSearchDiskTreeEx(const char *filename, rectObj aoi, int debug, int *bounds_checked);
+  MS_DLL_EXPORT int msSearchDiskTreeHits(const char *filename, rectObj aoi, int debug, treeHitsObj *hits, int *bounds_checked);
+  MS_DLL_EXPORT int msCountDiskTreeHits(const char *filename, rectObj aoi, int debug);
+  MS_DLL_EXPORT treeNearestObj *msSearchDiskTreeNearest(const char *filename, pointObj point, int debug);
+  MS_DLL_EXPORT int msTreeNearestNext(treeNearestObj *nearest, int *id, double *distance);
+  MS_DLL_EXPORT void msTreeNearestFree(treeNearestObj *nearest);
 
   MS_DLL_EXPORT treeObj *msReadTree(char *filename, int debug);
   MS_DLL_EXPORT int msWriteTree(treeObj *tree, char *filename, int LSB_order);
+  MS_DLL_EXPORT int msWritePackedTree(shapefileObj *shapefile, char *filename, int B_order, int node_size);
 
   MS_DLL_EXPORT void msFilterTreeSearch(shapefileObj *shp, ms_bitarray status, rectObj search_rect);
+  MS_DLL_EXPORT void msFilterTreeSearchIds(shapefileObj *shp, int *ids, int *numids, rectObj search_rect);
 
 #ifdef __cplusplus
 }
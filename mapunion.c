@@ -32,6 +32,7 @@
 /* $Id$ */
 #include <assert.h>
 #include "mapserver.h"
+#include "mapthread.h"
 
 
 
@@ -52,8 +53,103 @@ typedef struct {
   int *status;     /* the layer status */
   int *classgroup; /* current array of the valid classes */
   int nclasses;  /* number of the valid classes */
+  int concurrent;  /* open and query the sources on worker threads (UNION_CONCURRENT) */
 } msUnionLayerInfo;
 
+/* the sources one worker thread opens or queries, one after the other */
+typedef struct {
+  msUnionLayerInfo* layerinfo;
+  int *sources;    /* indexes of the source layers */
+  int numsources;
+  int open;        /* msLayerOpen() the sources, msLayerWhichShapes() otherwise */
+  rectObj *rects;  /* search rectangle of each source layer */
+  int isQuery;
+  void *threadid;  /* of the thread running the union layer */
+  char *errormsg;
+} msUnionSourceTask;
+
+static void msUnionSourceTaskRun(void *data)
+{
+  msUnionSourceTask *task = (msUnionSourceTask*)data;
+  msUnionLayerInfo* layerinfo = task->layerinfo;
+  int i, j;
+
+  for (i = 0; i < task->numsources; i++) {
+    j = task->sources[i];
+    if (task->open)
+      layerinfo->status[j] = msLayerOpen(&layerinfo->layers[j]);
+    else
+      layerinfo->status[j] = msLayerWhichShapes(&layerinfo->layers[j], task->rects[j], task->isQuery);
+    if (layerinfo->status[j] == MS_FAILURE)
+      break;
+  }
+
+  /* errors stay with the thread running the union layer */
+  if (msGetThreadId() != task->threadid) {
+    if (i < task->numsources)
+      task->errormsg = msGetErrorString("\n");
+    msResetErrorList();
+  }
+}
+
+/* Open (or query) the sources flagged in pending concurrently. Sources of the
+   same connection may share a pooled connection handle so they are handled
+   by the same thread. */
+static int msUnionLayerRunSources(layerObj *layer, int *pending, int open, rectObj *rects, int isQuery)
+{
+  msUnionLayerInfo* layerinfo = (msUnionLayerInfo*)layer->layerinfo;
+  msUnionSourceTask *tasks;
+  void **taskptrs;
+  int i, j, numtasks = 0, status = MS_SUCCESS;
+
+  tasks = (msUnionSourceTask*)msSmallCalloc(layerinfo->layerCount, sizeof(msUnionSourceTask));
+  taskptrs = (void**)msSmallMalloc(layerinfo->layerCount * sizeof(void*));
+
+  for (i = 0; i < layerinfo->layerCount; i++) {
+    layerObj* srclayer = &layerinfo->layers[i];
+
+    if (!pending[i])
+      continue;
+
+    for (j = 0; j < numtasks; j++) {
+      layerObj* first = &layerinfo->layers[tasks[j].sources[0]];
+      if (srclayer->connection && first->connection && srclayer->connectiontype == first->connectiontype &&
+          strcmp(srclayer->connection, first->connection) == 0)
+        break;
+    }
+    if (j == numtasks) {
+      tasks[j].layerinfo = layerinfo;
+      tasks[j].sources = (int*)msSmallMalloc(layerinfo->layerCount * sizeof(int));
+      tasks[j].open = open;
+      tasks[j].rects = rects;
+      tasks[j].isQuery = isQuery;
+      tasks[j].threadid = msGetThreadId();
+      taskptrs[j] = &tasks[j];
+      numtasks++;
+    }
+    tasks[j].sources[tasks[j].numsources++] = i;
+  }
+
+  if (layer->debug >= MS_DEBUGLEVEL_V)
+    msDebug("msUnionLayerRunSources(%s): %s the sources on %d threads.\n", layer->name, open ? "opening" : "querying", numtasks);
+
+  msThreadPoolRun(msUnionSourceTaskRun, taskptrs, numtasks, numtasks);
+
+  for (j = 0; j < numtasks; j++) {
+    for (i = 0; i < tasks[j].numsources; i++)
+      if (layerinfo->status[tasks[j].sources[i]] == MS_FAILURE)
+        status = MS_FAILURE;
+    if (tasks[j].errormsg && status == MS_FAILURE)
+      msSetError(MS_MISCERR, "%s", "msUnionLayerRunSources()", tasks[j].errormsg);
+    msFree(tasks[j].errormsg);
+    msFree(tasks[j].sources);
+  }
+  msFree(tasks);
+  msFree(taskptrs);
+
+  return status;
+}
+
 /* Close the the combined layer */
 int msUnionLayerClose(layerObj *layer)
 {
@@ -157,6 +253,12 @@ int msUnionLayerOpen(layerObj *layer)
 
   layerinfo->classText = NULL;
 
+  pkey = msLayerGetProcessingKey(layer, "UNION_CONCURRENT");
+  if(pkey && strcasecmp(pkey, "true") == 0)
+    layerinfo->concurrent = MS_TRUE;
+  else
+    layerinfo->concurrent = MS_FALSE;
+
   pkey = msLayerGetProcessingKey(layer, "UNION_STATUS_CHECK");
   if(pkey && strcasecmp(pkey, "true") == 0)
     status_check = MS_TRUE;
@@ -236,6 +338,12 @@ int msUnionLayerOpen(layerObj *layer)
         continue;
       }
 
+      if (layerinfo->concurrent) {
+        /* opened all together below */
+        layerinfo->status[i] = MS_SUCCESS;
+        continue;
+      }
+
       layerinfo->status[i] = msLayerOpen(&layerinfo->layers[i]);
       if (layerinfo->status[i] != MS_SUCCESS) {
         if(layerNames)
@@ -255,6 +363,20 @@ int msUnionLayerOpen(layerObj *layer)
   if(layerNames)
     msFreeCharArray(layerNames, layerinfo->layerCount);
 
+  if (layerinfo->concurrent) {
+    int *pending = (int*)msSmallMalloc(layerCount * sizeof(int));
+    int status;
+
+    for (i = 0; i < layerCount; i++)
+      pending[i] = (layerinfo->status[i] == MS_SUCCESS);
+    status = msUnionLayerRunSources(layer, pending, MS_TRUE, NULL, MS_FALSE);
+    msFree(pending);
+    if (status != MS_SUCCESS) {
+      msUnionLayerClose(layer);
+      return MS_FAILURE;
+    }
+  }
+
   return MS_SUCCESS;
 }
 
@@ -381,11 +503,18 @@ int msUnionLayerWhichShapes(layerObj *layer, rectObj rect, int isQuery)
   int i;
   layerObj* srclayer;
   rectObj srcRect;
+  rectObj *rects = NULL;
+  int *pending = NULL;
   msUnionLayerInfo* layerinfo = (msUnionLayerInfo*)layer->layerinfo;
 
   if (!layerinfo || !layer->map)
     return MS_FAILURE;
 
+  if (layerinfo->concurrent) {
+    rects = (rectObj*)msSmallMalloc(layerinfo->layerCount * sizeof(rectObj));
+    pending = (int*)msSmallCalloc(layerinfo->layerCount, sizeof(int));
+  }
+
   for (i = 0; i < layerinfo->layerCount; i++) {
     layerObj* srclayer = &layerinfo->layers[i];
 
@@ -397,8 +526,11 @@ int msUnionLayerWhichShapes(layerObj *layer, rectObj rect, int isQuery)
       msUnionLayerFreeExpressionTokens(srclayer);
 
       /* get only the required items */
-      if (msLayerWhichItems(srclayer, MS_FALSE, NULL) != MS_SUCCESS)
+      if (msLayerWhichItems(srclayer, MS_FALSE, NULL) != MS_SUCCESS) {
+        msFree(rects);
+        msFree(pending);
         return MS_FAILURE;
+      }
     }
 
     srcRect = rect;
@@ -406,11 +538,26 @@ int msUnionLayerWhichShapes(layerObj *layer, rectObj rect, int isQuery)
     if(srclayer->transform == MS_TRUE && srclayer->project && layer->transform == MS_TRUE && layer->project &&msProjectionsDiffer(&(srclayer->projection), &(layer->projection)))
       msProjectRect(&layer->projection, &srclayer->projection, &srcRect); /* project the searchrect to source coords */
 #endif
+    if (layerinfo->concurrent) {
+      /* queried all together below */
+      rects[i] = srcRect;
+      pending[i] = MS_TRUE;
+      continue;
+    }
+
     layerinfo->status[i] = msLayerWhichShapes(srclayer, srcRect, isQuery);
     if (layerinfo->status[i] == MS_FAILURE)
       return MS_FAILURE;
   }
 
+  if (layerinfo->concurrent) {
+    int status = msUnionLayerRunSources(layer, pending, MS_FALSE, rects, isQuery);
+    msFree(rects);
+    msFree(pending);
+    if (status != MS_SUCCESS)
+      return MS_FAILURE;
+  }
+
   layerinfo->layerIndex = 0;
   srclayer = &layerinfo->layers[0];
 
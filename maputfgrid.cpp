@@ -31,6 +31,7 @@
 #include "mapserver.h"
 #include "maputfgrid.h"
 #include "mapagg.h"
+#include "uthash.h"
 #include "renderers/agg/include/agg_rasterizer_scanline_aa.h"
 #include "renderers/agg/include/agg_basics.h"
 #include "renderers/agg/include/agg_renderer_scanline.h"
@@ -58,6 +59,16 @@ struct shapeData
   int serialid;
 };
 
+/*
+ * Index of the UTFITEM values already in the table, to find duplicates.
+ */
+struct itemIndex
+{
+  char *itemvalue; /* owned by the table entry */
+  band_type utfvalue;
+  UT_hash_handle hh;
+};
+
 class lookupTable {
 public:
   lookupTable()
@@ -69,12 +80,14 @@ public:
     table->serialid = 0;
     size = 1;
     counter = 0;
+    items = NULL;
   }
 
   ~lookupTable()
   {
     int i;
 
+    clearItems();
     for(i=0; i<size; i++)
     {
       if(table[i].datavalues)
@@ -85,9 +98,19 @@ public:
     msFree(table);
   }
 
+  void clearItems()
+  {
+    itemIndex *item, *tmp;
+    UT_HASH_ITER(hh, items, item, tmp) {
+      UT_HASH_DEL(items, item);
+      msFree(item);
+    }
+  }
+
   shapeData  *table;
   int size;
   int counter;
+  itemIndex *items;
 };
 
 /*
@@ -264,14 +287,11 @@ band_type addToTable(UTFGridRenderer *r, shapeObj *p)
 
   /* Looks for duplicates. */
   if(r->duplicates==0 && r->useutfitem==1) {
-    int i;
-    for(i=0; i<r->data->counter; i++) {
-      if(!strcmp(p->values[r->utflayer->utfitemindex],r->data->table[i].itemvalue)) {
-        /* Found a copy of the values in the table. */
-        utfvalue = r->data->table[i].utfvalue;
-
-        return utfvalue;
-      }
+    itemIndex *item;
+    UT_HASH_FIND_STR(r->data->items, p->values[r->utflayer->utfitemindex], item);
+    if(item) {
+      /* Found a copy of the values in the table. */
+      return item->utfvalue;
     }
   }
 
@@ -295,6 +315,13 @@ band_type addToTable(UTFGridRenderer *r, shapeObj *p)
 
   r->data->table[r->data->counter].utfvalue = utfvalue;
 
+  if(r->duplicates==0 && r->useutfitem==1) {
+    itemIndex *item = (itemIndex*) msSmallMalloc(sizeof(itemIndex));
+    item->itemvalue = r->data->table[r->data->counter].itemvalue;
+    item->utfvalue = utfvalue;
+    UT_HASH_ADD_KEYPTR(hh, r->data->items, item->itemvalue, strlen(item->itemvalue), item);
+  }
+
   r->data->counter++;
 
   return utfvalue;
@@ -378,69 +405,41 @@ int utfgridFreeImage(imageObj *img)
 }
 
 /*
- * Update a character in the utfgrid.
-*/
-
-int utfgridUpdateChar(imageObj *img, band_type oldChar, band_type newChar)
-{
-  UTFGridRenderer *r = UTFGRID_RENDERER(img);
-  int i,bufferLength;
-
-  bufferLength = (img->height/r->utfresolution) * (img->width/r->utfresolution);
-
-  for(i=0;i<bufferLength;i++){
-    if(r->buffer[i] == oldChar)
-      r->buffer[i] = newChar;
-  }
-
-  return MS_SUCCESS;
-}
-
-/*
- * Remove unnecessary data that didn't made it to the final grid.
+ * Remove unnecessary data that didn't made it to the final grid, and renumber
+ * the remaining entries. The grid is scanned once to find the used values and
+ * once more to remap them, values being looked up directly by their encoding.
  */
 
 int utfgridCleanData(imageObj *img)
 {
   UTFGridRenderer *r = UTFGRID_RENDERER(img);
-  unsigned char* usedChar;
-  int i,bufferLength,itemFound,dataCounter;
+  band_type *remap;
+  int i,bufferLength,dataCounter,maxValue;
   shapeData* updatedData;
-  band_type utfvalue;
 
   bufferLength = (img->height/r->utfresolution) * (img->width/r->utfresolution);
 
-  usedChar =(unsigned char*) msSmallMalloc(r->data->counter*sizeof(unsigned char));
+  /* the hashed values are renumbered or freed below */
+  r->data->clearItems();
 
-  for(i=0;i<r->data->counter;i++){
-    usedChar[i]=0;
-  }
-
-  itemFound=0;
+  /* remap[v] is the new value of grid value v, 0 while v is unused */
+  maxValue = encodeForRendering(r->data->counter);
+  remap = (band_type*) msSmallCalloc(maxValue+1, sizeof(band_type));
 
   for(i=0;i<bufferLength;i++)
-  {
-    if(decodeRendered(r->buffer[i]) != 0 && usedChar[decodeRendered(r->buffer[i])-1]==0)
-    {
-      itemFound++;
-      usedChar[decodeRendered(r->buffer[i])-1] = 1;
-    }
-  }
+    remap[r->buffer[i]] = 1;
+  remap[UTF_WATER.v] = UTF_WATER.v;
 
-  updatedData = (shapeData*) msSmallMalloc(itemFound * sizeof(shapeData));
+  updatedData = (shapeData*) msSmallMalloc((r->data->counter ? r->data->counter : 1) * sizeof(shapeData));
   dataCounter = 0;
 
   for(i=0; i< r->data->counter; i++){
-    if(usedChar[decodeRendered(r->data->table[i].utfvalue)-1]==1){
-        updatedData[dataCounter] = r->data->table[i];
-
-        updatedData[dataCounter].serialid=dataCounter+1;
-
-        utfvalue=encodeForRendering(dataCounter+1);
-
-        utfgridUpdateChar(img,updatedData[dataCounter].utfvalue,utfvalue);
-        updatedData[dataCounter].utfvalue = utfvalue;
-
+    band_type oldvalue = r->data->table[i].utfvalue;
+    if(remap[oldvalue]){
+      updatedData[dataCounter] = r->data->table[i];
+      updatedData[dataCounter].serialid=dataCounter+1;
+      updatedData[dataCounter].utfvalue = encodeForRendering(dataCounter+1);
+      remap[oldvalue] = updatedData[dataCounter].utfvalue;
       dataCounter++;
     }
     else {
@@ -451,7 +450,10 @@ int utfgridCleanData(imageObj *img)
     }
   }
 
-  msFree(usedChar);
+  for(i=0;i<bufferLength;i++)
+    r->buffer[i] = remap[r->buffer[i]];
+
+  msFree(remap);
 
   msFree(r->data->table);
 
@@ -462,6 +464,31 @@ int utfgridCleanData(imageObj *img)
   return MS_SUCCESS;
 }
 
+/*
+ * Write the UTF-8 encoding of a grid value, returns the number of bytes used.
+ */
+static int utfgridEncodeUTF8(band_type value, char *out)
+{
+  if(value < 0x80) {
+    out[0] = value;
+    return 1;
+  } else if(value < 0x800) {
+    out[0] = 0xC0 | (value >> 6);
+    out[1] = 0x80 | (value & 0x3F);
+    return 2;
+  } else if(value < 0x10000) {
+    out[0] = 0xE0 | (value >> 12);
+    out[1] = 0x80 | ((value >> 6) & 0x3F);
+    out[2] = 0x80 | (value & 0x3F);
+    return 3;
+  }
+  out[0] = 0xF0 | (value >> 18);
+  out[1] = 0x80 | ((value >> 12) & 0x3F);
+  out[2] = 0x80 | ((value >> 6) & 0x3F);
+  out[3] = 0x80 | (value & 0x3F);
+  return 4;
+}
+
 /*
  * Print the renderer data as JSON.
  */
@@ -470,6 +497,7 @@ int utfgridSaveImage(imageObj *img, mapObj *map, FILE *fp, outputFormatObj *form
   int row, col, i, imgheight, imgwidth;
   band_type pixelid;
   char* pszEscaped;
+  char* rowstring;
 
   utfgridCleanData(img);
 
@@ -483,33 +511,24 @@ int utfgridSaveImage(imageObj *img, mapObj *map, FILE *fp, outputFormatObj *form
 
   msIO_fprintf(fp,"{\"grid\":[");
 
-  /* Print the buffer */
+  /* Print the buffer, one UTF-8 encoded string per row */
+  rowstring = (char*) msSmallMalloc(imgwidth * 4 + 3);
   for(row=0; row<imgheight; row++) {
+    char *stringptr = rowstring;
 
-    wchar_t *string = (wchar_t*) msSmallMalloc ((imgwidth + 1) * sizeof(wchar_t));
-    wchar_t *stringptr;
-    stringptr = string;
     /* Need a comma between each line but JSON must not start with a comma. */
     if(row!=0)
-      msIO_fprintf(fp,",");
-    msIO_fprintf(fp,"\"");
-    for(col=0; col<img->width/renderer->utfresolution; col++) {
+      *(stringptr++) = ',';
+    *(stringptr++) = '"';
+    for(col=0; col<imgwidth; col++) {
       /* Get the data from buffer. */
       pixelid = renderer->buffer[(row*imgwidth)+col];
-
-      *stringptr = pixelid;
-      stringptr++;
+      stringptr += utfgridEncodeUTF8(pixelid, stringptr);
     }
-
-    /* Conversion to UTF-8 encoding */
-    *stringptr = '\0';
-    char * utf8;
-    utf8 = msConvertWideStringToUTF8 (string, "UCS-4LE");
-    msIO_fprintf(fp,"%s", utf8);
-    msFree(utf8);
-    msFree(string);
-    msIO_fprintf(fp,"\"");
+    *(stringptr++) = '"';
+    msIO_fwrite(rowstring, 1, stringptr - rowstring, fp);
   }
+  msFree(rowstring);
 
   msIO_fprintf(fp,"],\"keys\":[\"\"");
 
@@ -38,6 +38,7 @@
 #include "mapthread.h"
 #include "mapcopy.h"
 #include "mapows.h"
+#include "mapogcsld.h"
 
 #if defined(_WIN32) && !defined(__CYGWIN__)
 # include <windows.h>
@@ -71,20 +72,6 @@ int msScaleInBounds(double scale, double minscale, double maxscale)
 /*
 ** Helper functions to convert from strings to other types or objects.
 */
-static int bindIntegerAttribute(int *attribute, char *value)
-{
-  if(!value || strlen(value) == 0) return MS_FAILURE;
-  *attribute = MS_NINT(atof(value)); /*use atof instead of atoi as a fix for bug 2394*/
-  return MS_SUCCESS;
-}
-
-static int bindDoubleAttribute(double *attribute, char *value)
-{
-  if(!value || strlen(value) == 0) return MS_FAILURE;
-  *attribute = atof(value);
-  return MS_SUCCESS;
-}
-
 static int bindColorAttribute(colorObj *attribute, char *value)
 {
   int len;
@@ -109,20 +96,23 @@ static int bindColorAttribute(colorObj *attribute, char *value)
       attribute->alpha = msHexToInt(hex);
     }
     return MS_SUCCESS;
-  } else { /* try a space delimited string */
-    char **tokens=NULL;
-    int numtokens=0;
-
-    tokens = msStringSplit(value, ' ', &numtokens);
-    if(tokens==NULL || numtokens != 3) {
-      msFreeCharArray(tokens, numtokens);
-      return MS_FAILURE; /* punt */
+  } else { /* try a space delimited string, runs of spaces count as one as in msStringSplit() */
+    char *tokens[3];
+    int i, j, numtokens=1;
+
+    tokens[0] = (value[0] == ' ') ? value+len : value; /* a leading space makes an empty first token */
+    for(i=0; i<len; i++) {
+      if(value[i] == ' ' && (i == 0 || value[i-1] != ' ')) {
+        if(numtokens == 3) return MS_FAILURE; /* punt */
+        for(j=i; value[j] == ' '; j++);
+        tokens[numtokens++] = value+j;
+      }
     }
+    if(numtokens != 3) return MS_FAILURE; /* punt */
 
     attribute->red = atoi(tokens[0]);
     attribute->green = atoi(tokens[1]);
     attribute->blue = atoi(tokens[2]);
-    msFreeCharArray(tokens, numtokens);
 
     return MS_SUCCESS;
   }
@@ -130,133 +120,157 @@ static int bindColorAttribute(colorObj *attribute, char *value)
   return MS_FAILURE; /* shouldn't get here */
 }
 
-static void bindStyle(layerObj *layer, shapeObj *shape, styleObj *style, int drawmode)
+/*
+** Order in which the bindings of a style and of a label are applied.
+*/
+static const int styleBindingOrder[] = { MS_STYLE_BINDING_SYMBOL, MS_STYLE_BINDING_ANGLE, MS_STYLE_BINDING_SIZE, MS_STYLE_BINDING_WIDTH, MS_STYLE_BINDING_COLOR, MS_STYLE_BINDING_OUTLINECOLOR, MS_STYLE_BINDING_OUTLINEWIDTH, MS_STYLE_BINDING_OPACITY, MS_STYLE_BINDING_OFFSET_X, MS_STYLE_BINDING_OFFSET_Y, MS_STYLE_BINDING_POLAROFFSET_PIXEL, MS_STYLE_BINDING_POLAROFFSET_ANGLE };
+static const int labelBindingOrder[] = { MS_LABEL_BINDING_ANGLE, MS_LABEL_BINDING_SIZE, MS_LABEL_BINDING_COLOR, MS_LABEL_BINDING_OUTLINECOLOR, MS_LABEL_BINDING_FONT, MS_LABEL_BINDING_PRIORITY, MS_LABEL_BINDING_SHADOWSIZEX, MS_LABEL_BINDING_SHADOWSIZEY, MS_LABEL_BINDING_POSITION };
+
+/*
+** Numeric value of a shape attribute, parsed once per shape when a binding plan is
+** given. Returns MS_FAILURE for an empty value.
+*/
+static int getBindingNumber(bindingPlanObj *plan, shapeObj *shape, int index, double *number)
 {
-  assert(MS_DRAW_FEATURES(drawmode));
-  if(style->numbindings > 0) {
-    if(style->bindings[MS_STYLE_BINDING_SYMBOL].index != -1) {
-      style->symbol = msGetSymbolIndex(&(layer->map->symbolset), shape->values[style->bindings[MS_STYLE_BINDING_SYMBOL].index], MS_TRUE);
-      if(style->symbol == -1) style->symbol = 0; /* a reasonable default (perhaps should throw an error?) */
+  char *value = shape->values[index];
+
+  if(plan && index < plan->numitems) {
+    if(plan->stamps[index] == plan->stamp) {
+      *number = plan->numbers[index];
+      return MS_SUCCESS;
     }
-    if(style->bindings[MS_STYLE_BINDING_ANGLE].index != -1) {
-      style->angle = 360.0;
-      bindDoubleAttribute(&style->angle, shape->values[style->bindings[MS_STYLE_BINDING_ANGLE].index]);
+    if(plan->stamps[index] == -plan->stamp) return MS_FAILURE;
+
+    if(!value || *value == '\0') {
+      plan->stamps[index] = -plan->stamp;
+      return MS_FAILURE;
     }
-    if(style->bindings[MS_STYLE_BINDING_SIZE].index != -1) {
+    plan->numbers[index] = *number = atof(value);
+    plan->stamps[index] = plan->stamp;
+    return MS_SUCCESS;
+  }
+
+  if(!value || *value == '\0') return MS_FAILURE;
+  *number = atof(value);
+  return MS_SUCCESS;
+}
+
+static void bindStyleAttribute(layerObj *layer, shapeObj *shape, styleObj *style, int binding, int index, int drawmode, bindingPlanObj *plan)
+{
+  double number;
+
+  switch(binding) {
+    case MS_STYLE_BINDING_SYMBOL:
+      style->symbol = msGetSymbolIndex(&(layer->map->symbolset), shape->values[index], MS_TRUE);
+      if(style->symbol == -1) style->symbol = 0; /* a reasonable default (perhaps should throw an error?) */
+      break;
+    case MS_STYLE_BINDING_ANGLE:
+      style->angle = 360.0;
+      if(getBindingNumber(plan, shape, index, &number) == MS_SUCCESS) style->angle = number;
+      break;
+    case MS_STYLE_BINDING_SIZE:
       style->size = 1;
-      bindDoubleAttribute(&style->size, shape->values[style->bindings[MS_STYLE_BINDING_SIZE].index]);
-    }
-    if(style->bindings[MS_STYLE_BINDING_WIDTH].index != -1) {
+      if(getBindingNumber(plan, shape, index, &number) == MS_SUCCESS) style->size = number;
+      break;
+    case MS_STYLE_BINDING_WIDTH:
       style->width = 1;
-      bindDoubleAttribute(&style->width, shape->values[style->bindings[MS_STYLE_BINDING_WIDTH].index]);
-    }
-    if(style->bindings[MS_STYLE_BINDING_COLOR].index != -1 && !MS_DRAW_QUERY(drawmode)) {
-      MS_INIT_COLOR(style->color, -1,-1,-1,255);
-      bindColorAttribute(&style->color, shape->values[style->bindings[MS_STYLE_BINDING_COLOR].index]);
-    }
-    if(style->bindings[MS_STYLE_BINDING_OUTLINECOLOR].index != -1 && !MS_DRAW_QUERY(drawmode)) {
-      MS_INIT_COLOR(style->outlinecolor, -1,-1,-1,255);
-      bindColorAttribute(&style->outlinecolor, shape->values[style->bindings[MS_STYLE_BINDING_OUTLINECOLOR].index]);
-    }
-    if(style->bindings[MS_STYLE_BINDING_OUTLINEWIDTH].index != -1) {
+      if(getBindingNumber(plan, shape, index, &number) == MS_SUCCESS) style->width = number;
+      break;
+    case MS_STYLE_BINDING_COLOR:
+      if(!MS_DRAW_QUERY(drawmode)) {
+        MS_INIT_COLOR(style->color, -1,-1,-1,255);
+        bindColorAttribute(&style->color, shape->values[index]);
+      }
+      break;
+    case MS_STYLE_BINDING_OUTLINECOLOR:
+      if(!MS_DRAW_QUERY(drawmode)) {
+        MS_INIT_COLOR(style->outlinecolor, -1,-1,-1,255);
+        bindColorAttribute(&style->outlinecolor, shape->values[index]);
+      }
+      break;
+    case MS_STYLE_BINDING_OUTLINEWIDTH:
       style->outlinewidth = 1;
-      bindDoubleAttribute(&style->outlinewidth, shape->values[style->bindings[MS_STYLE_BINDING_OUTLINEWIDTH].index]);
-    }
-    if(style->bindings[MS_STYLE_BINDING_OPACITY].index != -1) {
+      if(getBindingNumber(plan, shape, index, &number) == MS_SUCCESS) style->outlinewidth = number;
+      break;
+    case MS_STYLE_BINDING_OPACITY:
       style->opacity = 100;
-      bindIntegerAttribute(&style->opacity, shape->values[style->bindings[MS_STYLE_BINDING_OPACITY].index]);
-    }
-    if(style->bindings[MS_STYLE_BINDING_OFFSET_X].index != -1) {
+      if(getBindingNumber(plan, shape, index, &number) == MS_SUCCESS) style->opacity = MS_NINT(number); /*use atof instead of atoi as a fix for bug 2394*/
+      break;
+    case MS_STYLE_BINDING_OFFSET_X:
       style->offsetx = 0;
-      bindDoubleAttribute(&style->offsetx, shape->values[style->bindings[MS_STYLE_BINDING_OFFSET_X].index]);
-    }
-    if(style->bindings[MS_STYLE_BINDING_OFFSET_Y].index != -1) {
+      if(getBindingNumber(plan, shape, index, &number) == MS_SUCCESS) style->offsetx = number;
+      break;
+    case MS_STYLE_BINDING_OFFSET_Y:
       style->offsety = 0;
-      bindDoubleAttribute(&style->offsety, shape->values[style->bindings[MS_STYLE_BINDING_OFFSET_Y].index]);
-    }
-    if(style->bindings[MS_STYLE_BINDING_POLAROFFSET_PIXEL].index != -1) {
+      if(getBindingNumber(plan, shape, index, &number) == MS_SUCCESS) style->offsety = number;
+      break;
+    case MS_STYLE_BINDING_POLAROFFSET_PIXEL:
       style->polaroffsetpixel = 0;
-      bindDoubleAttribute(&style->polaroffsetpixel, shape->values[style->bindings[MS_STYLE_BINDING_POLAROFFSET_PIXEL].index]);
-    }
-    if(style->bindings[MS_STYLE_BINDING_POLAROFFSET_ANGLE].index != -1) {
+      if(getBindingNumber(plan, shape, index, &number) == MS_SUCCESS) style->polaroffsetpixel = number;
+      break;
+    case MS_STYLE_BINDING_POLAROFFSET_ANGLE:
       style->polaroffsetangle = 0;
-      bindDoubleAttribute(&style->polaroffsetangle, shape->values[style->bindings[MS_STYLE_BINDING_POLAROFFSET_ANGLE].index]);
-    }
-    if(style->bindings[MS_STYLE_BINDING_OUTLINEWIDTH].index != -1) {
-      style->outlinewidth = 1;
-      bindDoubleAttribute(&style->outlinewidth, shape->values[style->bindings[MS_STYLE_BINDING_OUTLINEWIDTH].index]);
-    }
-    if(style->opacity < 100 || style->color.alpha != 255 ) {
-      int alpha;
-      alpha = MS_NINT(style->opacity*2.55);
-      style->color.alpha = alpha;
-      style->outlinecolor.alpha = alpha;
-      style->backgroundcolor.alpha = alpha;
-      style->mincolor.alpha = alpha;
-      style->maxcolor.alpha = alpha;
-    }
+      if(getBindingNumber(plan, shape, index, &number) == MS_SUCCESS) style->polaroffsetangle = number;
+      break;
+    default: /* done with the bindings, propagate the opacity */
+      if(style->opacity < 100 || style->color.alpha != 255 ) {
+        int alpha;
+        alpha = MS_NINT(style->opacity*2.55);
+        style->color.alpha = alpha;
+        style->outlinecolor.alpha = alpha;
+        style->backgroundcolor.alpha = alpha;
+        style->mincolor.alpha = alpha;
+        style->maxcolor.alpha = alpha;
+      }
+      break;
   }
 }
 
-static void bindLabel(layerObj *layer, shapeObj *shape, labelObj *label, int drawmode)
+static void bindLabelAttribute(shapeObj *shape, labelObj *label, int binding, int index, bindingPlanObj *plan)
 {
-  int i;
-  assert(MS_DRAW_LABELS(drawmode));
-
-  /* check the label styleObj's (TODO: do we need to use querymapMode here? */
-  for(i=0; i<label->numstyles; i++) {
-    /* force MS_DRAWMODE_FEATURES for label styles */
-    bindStyle(layer, shape, label->styles[i], drawmode|MS_DRAWMODE_FEATURES);
-  }
+  double number;
 
-  if(label->numbindings > 0) {
-    if(label->bindings[MS_LABEL_BINDING_ANGLE].index != -1) {
+  switch(binding) {
+    case MS_LABEL_BINDING_ANGLE:
       label->angle = 0.0;
-      bindDoubleAttribute(&label->angle, shape->values[label->bindings[MS_LABEL_BINDING_ANGLE].index]);
-    }
-
-    if(label->bindings[MS_LABEL_BINDING_SIZE].index != -1) {
+      if(getBindingNumber(plan, shape, index, &number) == MS_SUCCESS) label->angle = number;
+      break;
+    case MS_LABEL_BINDING_SIZE:
       label->size = 1;
-      bindIntegerAttribute(&label->size, shape->values[label->bindings[MS_LABEL_BINDING_SIZE].index]);
-    }
-
-    if(label->bindings[MS_LABEL_BINDING_COLOR].index != -1) {
+      if(getBindingNumber(plan, shape, index, &number) == MS_SUCCESS) label->size = MS_NINT(number);
+      break;
+    case MS_LABEL_BINDING_COLOR:
       MS_INIT_COLOR(label->color, -1,-1,-1,255);
-      bindColorAttribute(&label->color, shape->values[label->bindings[MS_LABEL_BINDING_COLOR].index]);
-    }
-
-    if(label->bindings[MS_LABEL_BINDING_OUTLINECOLOR].index != -1) {
+      bindColorAttribute(&label->color, shape->values[index]);
+      break;
+    case MS_LABEL_BINDING_OUTLINECOLOR:
       MS_INIT_COLOR(label->outlinecolor, -1,-1,-1,255);
-      bindColorAttribute(&label->outlinecolor, shape->values[label->bindings[MS_LABEL_BINDING_OUTLINECOLOR].index]);
-    }
-
-    if(label->bindings[MS_LABEL_BINDING_FONT].index != -1) {
+      bindColorAttribute(&label->outlinecolor, shape->values[index]);
+      break;
+    case MS_LABEL_BINDING_FONT:
       msFree(label->font);
-      label->font = msStrdup(shape->values[label->bindings[MS_LABEL_BINDING_FONT].index]);
-    }
-
-    if(label->bindings[MS_LABEL_BINDING_PRIORITY].index != -1) {
+      label->font = msStrdup(shape->values[index]);
+      break;
+    case MS_LABEL_BINDING_PRIORITY:
       label->priority = MS_DEFAULT_LABEL_PRIORITY;
-      bindIntegerAttribute(&label->priority, shape->values[label->bindings[MS_LABEL_BINDING_PRIORITY].index]);
-    }
-
-    if(label->bindings[MS_LABEL_BINDING_SHADOWSIZEX].index != -1) {
+      if(getBindingNumber(plan, shape, index, &number) == MS_SUCCESS) label->priority = MS_NINT(number);
+      break;
+    case MS_LABEL_BINDING_SHADOWSIZEX:
       label->shadowsizex = 1;
-      bindIntegerAttribute(&label->shadowsizex, shape->values[label->bindings[MS_LABEL_BINDING_SHADOWSIZEX].index]);
-    }
-    if(label->bindings[MS_LABEL_BINDING_SHADOWSIZEY].index != -1) {
+      if(getBindingNumber(plan, shape, index, &number) == MS_SUCCESS) label->shadowsizex = MS_NINT(number);
+      break;
+    case MS_LABEL_BINDING_SHADOWSIZEY:
       label->shadowsizey = 1;
-      bindIntegerAttribute(&label->shadowsizey, shape->values[label->bindings[MS_LABEL_BINDING_SHADOWSIZEY].index]);
-    }
-
-    if(label->bindings[MS_LABEL_BINDING_POSITION].index != -1) {
+      if(getBindingNumber(plan, shape, index, &number) == MS_SUCCESS) label->shadowsizey = MS_NINT(number);
+      break;
+    case MS_LABEL_BINDING_POSITION: {
       int tmpPosition = 0;
-      bindIntegerAttribute(&tmpPosition, shape->values[label->bindings[MS_LABEL_BINDING_POSITION].index]);
+      if(getBindingNumber(plan, shape, index, &number) == MS_SUCCESS) tmpPosition = MS_NINT(number);
       if(tmpPosition != 0) { /* is this test sufficient? */
         label->position = tmpPosition;
       } else { /* Integer binding failed, look for strings like cc, ul, lr, etc... */
-        if(strlen(shape->values[label->bindings[MS_LABEL_BINDING_POSITION].index]) == 2) {
-          char *vp = shape->values[label->bindings[MS_LABEL_BINDING_POSITION].index];
+        if(strlen(shape->values[index]) == 2) {
+          char *vp = shape->values[index];
           if(!strncasecmp(vp,"ul",2))
             label->position = MS_UL;
           else if(!strncasecmp(vp,"lr",2))
@@ -277,6 +291,159 @@ static void bindLabel(layerObj *layer, shapeObj *shape, labelObj *label, int dra
             label->position = MS_CC;
         }
       }
+      break;
+    }
+  }
+}
+
+static void bindStyle(layerObj *layer, shapeObj *shape, styleObj *style, int drawmode)
+{
+  int i;
+
+  assert(MS_DRAW_FEATURES(drawmode));
+  if(style->numbindings > 0) {
+    for(i=0; i<MS_STYLE_BINDING_LENGTH; i++) {
+      if(style->bindings[styleBindingOrder[i]].index != -1)
+        bindStyleAttribute(layer, shape, style, styleBindingOrder[i], style->bindings[styleBindingOrder[i]].index, drawmode, NULL);
+    }
+    bindStyleAttribute(layer, shape, style, -1, -1, drawmode, NULL);
+  }
+}
+
+static void bindLabel(layerObj *layer, shapeObj *shape, labelObj *label, int drawmode)
+{
+  int i;
+  assert(MS_DRAW_LABELS(drawmode));
+
+  /* check the label styleObj's (TODO: do we need to use querymapMode here? */
+  for(i=0; i<label->numstyles; i++) {
+    /* force MS_DRAWMODE_FEATURES for label styles */
+    bindStyle(layer, shape, label->styles[i], drawmode|MS_DRAWMODE_FEATURES);
+  }
+
+  if(label->numbindings > 0) {
+    for(i=0; i<MS_LABEL_BINDING_LENGTH; i++) {
+      if(label->bindings[labelBindingOrder[i]].index != -1)
+        bindLabelAttribute(shape, label, labelBindingOrder[i], label->bindings[labelBindingOrder[i]].index, NULL);
+    }
+  }
+}
+
+static void addBindingPlanEntry(bindingPlanObj *plan, int *maxentries, int iclass, int ilabel, int istyle, int binding, int index)
+{
+  bindingPlanEntryObj *entry;
+
+  if(plan->numentries == *maxentries) {
+    *maxentries = MS_MAX(16, 2*(*maxentries));
+    plan->entries = (bindingPlanEntryObj *) msSmallRealloc(plan->entries, sizeof(bindingPlanEntryObj) * (*maxentries));
+  }
+  entry = &(plan->entries[plan->numentries++]);
+  entry->iclass = iclass;
+  entry->ilabel = ilabel;
+  entry->istyle = istyle;
+  entry->binding = binding;
+  entry->index = index;
+}
+
+static void addStyleToBindingPlan(bindingPlanObj *plan, int *maxentries, styleObj *style, int iclass, int ilabel, int istyle)
+{
+  int i;
+
+  if(style->numbindings <= 0) return;
+  for(i=0; i<MS_STYLE_BINDING_LENGTH; i++) {
+    if(style->bindings[styleBindingOrder[i]].index != -1)
+      addBindingPlanEntry(plan, maxentries, iclass, ilabel, istyle, styleBindingOrder[i], style->bindings[styleBindingOrder[i]].index);
+  }
+  addBindingPlanEntry(plan, maxentries, iclass, ilabel, istyle, -1, -1);
+}
+
+void msFreeBindingPlan(bindingPlanObj *plan)
+{
+  if(!plan) return;
+  msFree(plan->entries);
+  msFree(plan->numbers);
+  msFree(plan->stamps);
+  msFree(plan);
+}
+
+/*
+** Builds layer->bindingplan from the binding item indexes set by msLayerWhichItems().
+*/
+void msLayerBuildBindingPlan(layerObj *layer)
+{
+  int i, j, k, maxentries = 0;
+  bindingPlanObj *plan;
+
+  msFreeBindingPlan(layer->bindingplan);
+  layer->bindingplan = NULL;
+
+  plan = (bindingPlanObj *) msSmallCalloc(1, sizeof(bindingPlanObj));
+  plan->numclasses = layer->numclasses;
+
+  for(i=0; i<layer->numclasses; i++) {
+    classObj *c = layer->class[i];
+
+    for(j=0; j<c->numstyles; j++)
+      addStyleToBindingPlan(plan, &maxentries, c->styles[j], i, -1, j);
+
+    for(j=0; j<c->numlabels; j++) {
+      labelObj *label = c->labels[j];
+
+      for(k=0; k<label->numstyles; k++)
+        addStyleToBindingPlan(plan, &maxentries, label->styles[k], i, j, k);
+
+      if(label->numbindings <= 0) continue;
+      for(k=0; k<MS_LABEL_BINDING_LENGTH; k++) {
+        if(label->bindings[labelBindingOrder[k]].index != -1)
+          addBindingPlanEntry(plan, &maxentries, i, j, -1, labelBindingOrder[k], label->bindings[labelBindingOrder[k]].index);
+      }
+    }
+  }
+
+  if(layer->numitems > 0) {
+    plan->numitems = layer->numitems;
+    plan->numbers = (double *) msSmallMalloc(sizeof(double) * plan->numitems);
+    plan->stamps = (int *) msSmallCalloc(plan->numitems, sizeof(int));
+  }
+
+  layer->bindingplan = plan;
+}
+
+/*
+** Runs the binding plan of a layer, see msBindLayerToShape().
+*/
+static void bindLayerPlanToShape(layerObj *layer, bindingPlanObj *plan, shapeObj *shape, int drawmode)
+{
+  int i;
+
+  if(plan->stamp == INT_MAX) {
+    memset(plan->stamps, 0, sizeof(int) * plan->numitems);
+    plan->stamp = 0;
+  }
+  plan->stamp++;
+
+  for(i=0; i<plan->numentries; i++) {
+    bindingPlanEntryObj *entry = &(plan->entries[i]);
+    classObj *c = layer->class[entry->iclass];
+    labelObj *label = NULL;
+    styleObj *style;
+
+    if(entry->index >= shape->numvalues) continue;
+
+    if(entry->ilabel == -1) { /* a class style */
+      if(!MS_DRAW_FEATURES(drawmode) || entry->istyle >= c->numstyles) continue;
+      bindStyleAttribute(layer, shape, c->styles[entry->istyle], entry->binding, entry->index, drawmode, plan);
+      continue;
+    }
+
+    if(!MS_DRAW_LABELS(drawmode) || entry->ilabel >= c->numlabels) continue;
+    label = c->labels[entry->ilabel];
+    if(entry->istyle == -1) {
+      bindLabelAttribute(shape, label, entry->binding, entry->index, plan);
+    } else if(entry->istyle < label->numstyles) {
+      style = label->styles[entry->istyle];
+      /* force MS_DRAWMODE_FEATURES for label styles */
+      bindStyleAttribute(layer, shape, style, entry->binding, entry->index, drawmode|MS_DRAWMODE_FEATURES, plan);
     }
   }
 }
@@ -290,6 +457,11 @@ int msBindLayerToShape(layerObj *layer, shapeObj *shape, int drawmode)
 
   if(!layer || !shape) return MS_FAILURE;
 
+  if(layer->bindingplan && layer->bindingplan->numclasses == layer->numclasses) {
+    bindLayerPlanToShape(layer, layer->bindingplan, shape, drawmode);
+    return MS_SUCCESS;
+  }
+
   for(i=0; i<layer->numclasses; i++) {
     /* check the styleObj's */
     if(MS_DRAW_FEATURES(drawmode)) {
@@ -445,6 +617,65 @@ int msEvalContext(mapObj *map, layerObj *layer, char *context)
   return p.result.intval;
 }
 
+/*
+** Regex memo: regular expressions are mostly run against columns with few
+** distinct values (road types, land use codes...), so the match result of
+** each value is kept with the compiled expression. The memo is a small open
+** addressing table that stops taking values once it is 3/4 full, the values
+** of high cardinality columns are then simply matched every time.
+*/
+#define MS_REGEX_MEMO_SIZE 64 /* power of 2 */
+#define MS_REGEX_MEMO_MAXVALUES 48
+#define MS_REGEX_MEMO_MAXLENGTH 64
+
+struct regexMemoObj {
+  int numvalues;
+  char *values[MS_REGEX_MEMO_SIZE];
+  char matches[MS_REGEX_MEMO_SIZE];
+};
+
+void msFreeRegexMemo(regexMemoObj *memo)
+{
+  int i;
+
+  if(!memo) return;
+  for(i=0; i<MS_REGEX_MEMO_SIZE; i++)
+    msFree(memo->values[i]);
+  msFree(memo);
+}
+
+static int evalRegex(expressionObj *expression, const char *value)
+{
+  regexMemoObj *memo = expression->regexmemo;
+  unsigned int hash = 5381;
+  const char *c;
+  int slot, match;
+
+  for(c=value; *c && c-value < MS_REGEX_MEMO_MAXLENGTH; c++)
+    hash = hash*33 + (unsigned char) *c;
+
+  if(*c) /* too long to be worth keeping */
+    return (ms_regexec(&(expression->regex), value, 0, NULL, 0) == 0);
+
+  if(!memo)
+    memo = expression->regexmemo = (regexMemoObj *) msSmallCalloc(1, sizeof(regexMemoObj));
+
+  for(slot = hash & (MS_REGEX_MEMO_SIZE-1); memo->values[slot]; slot = (slot+1) & (MS_REGEX_MEMO_SIZE-1)) {
+    if(strcmp(memo->values[slot], value) == 0)
+      return memo->matches[slot];
+  }
+
+  match = (ms_regexec(&(expression->regex), value, 0, NULL, 0) == 0);
+
+  if(memo->numvalues < MS_REGEX_MEMO_MAXVALUES) {
+    memo->values[slot] = msStrdup(value);
+    memo->matches[slot] = match;
+    memo->numvalues++;
+  }
+
+  return match;
+}
+
 /* msEvalExpression()
  *
  * Evaluates a mapserver expression for a given set of attribute values and
@@ -503,7 +734,7 @@ int msEvalExpression(layerObj *layer, shapeObj *shape, expressionObj *expression
       p.expr->curtoken = p.expr->tokens; /* reset */
       p.type = MS_PARSE_TYPE_BOOLEAN;
 
-      status = yyparse(&p);
+      status = msEvalParsedExpression(&p);
 
       if (status != 0) {
         msSetError(MS_PARSEERR, "Failed to parse expression: %s", "msEvalExpression", expression->string);
@@ -540,7 +771,7 @@ int msEvalExpression(layerObj *layer, shapeObj *shape, expressionObj *expression
         expression->compiled = MS_TRUE;
       }
 
-      if(ms_regexec(&(expression->regex), shape->values[itemindex], 0, NULL, 0) == 0) return MS_TRUE; /* got a match */
+      if(evalRegex(expression, shape->values[itemindex])) return MS_TRUE; /* got a match */
       break;
   }
 
@@ -576,11 +807,96 @@ int *msAllocateValidClassGroups(layerObj *lp, int *nclasses)
 
 }
 
+/* index of the first entry equal to value, n if there is none */
+static int findClassLookupString(classLookupEntryObj *entries, int n, const char *value)
+{
+  int lo=0, hi=n;
+
+  while(lo < hi) {
+    int mid = (lo + hi) / 2;
+    if(strcmp(entries[mid].string, value) < 0) lo = mid + 1;
+    else hi = mid;
+  }
+  return (lo < n && strcmp(entries[lo].string, value) == 0) ? lo : n;
+}
+
+static int findClassLookupNumber(classLookupEntryObj *entries, int n, double value)
+{
+  int lo=0, hi=n;
+
+  while(lo < hi) {
+    int mid = (lo + hi) / 2;
+    if(entries[mid].number < value) lo = mid + 1;
+    else hi = mid;
+  }
+  return (lo < n && entries[lo].number == value) ? lo : n;
+}
+
+/* the class tests other than the expression */
+static int msShapeCheckClass(layerObj *layer, mapObj *map, shapeObj *shape, int iclass)
+{
+  if(map->scaledenom > 0) { /* verify scaledenom here  */
+    if((layer->class[iclass]->maxscaledenom > 0) && (map->scaledenom > layer->class[iclass]->maxscaledenom))
+      return MS_FALSE; /* can skip this one, next class */
+    if((layer->class[iclass]->minscaledenom > 0) && (map->scaledenom <= layer->class[iclass]->minscaledenom))
+      return MS_FALSE; /* can skip this one, next class */
+  }
+
+  /* verify the minfeaturesize */
+  if ((shape->type == MS_SHAPE_LINE || shape->type == MS_SHAPE_POLYGON) && (layer->class[iclass]->minfeaturesize > 0)) {
+    double minfeaturesize = Pix2LayerGeoref(map, layer,
+                                            layer->class[iclass]->minfeaturesize);
+    if (msShapeCheckSize(shape, minfeaturesize) == MS_FALSE)
+      return MS_FALSE; /* skip this one, next class */
+  }
+
+  return (layer->class[iclass]->status != MS_DELETE);
+}
+
+static int msShapeGetClassFromLookup(layerObj *layer, mapObj *map, shapeObj *shape)
+{
+  classLookupObj *lookup = layer->classlookup;
+  const char *value = shape->values[lookup->itemindex];
+  double number;
+  int s, n, o, iclass;
+
+  s = findClassLookupString(lookup->strings, lookup->numstrings, value);
+  number = atof(value);
+  n = findClassLookupNumber(lookup->numbers, lookup->numnumbers, number);
+
+  /* merge the matching entries with the classes to evaluate, in class order */
+  for(o=0;;) {
+    int is = (s < lookup->numstrings && strcmp(lookup->strings[s].string, value) == 0) ? lookup->strings[s].iclass : INT_MAX;
+    int in = (n < lookup->numnumbers && lookup->numbers[n].number == number) ? lookup->numbers[n].iclass : INT_MAX;
+    int io = (o < lookup->numothers) ? lookup->others[o] : INT_MAX;
+
+    iclass = MS_MIN(is, MS_MIN(in, io));
+    if(iclass == INT_MAX) break;
+
+    if(iclass == io) {
+      o++;
+      if(msShapeCheckClass(layer, map, shape, iclass) && msEvalExpression(layer, shape, &(layer->class[iclass]->expression), layer->classitemindex) == MS_TRUE)
+        return(iclass);
+    } else {
+      if(iclass == is) s++;
+      if(iclass == in) n++;
+      if(msShapeCheckClass(layer, map, shape, iclass))
+        return(iclass);
+    }
+  }
+
+  return(-1); /* no match */
+}
+
 int msShapeGetClass(layerObj *layer, mapObj *map, shapeObj *shape, int *classgroup, int numclasses)
 {
   int i, iclass;
 
   if (layer->numclasses > 0) {
+    if (classgroup == NULL && layer->classlookup && layer->classlookup->numclasses == layer->numclasses &&
+        layer->classlookup->itemindex < shape->numvalues)
+      return msShapeGetClassFromLookup(layer, map, shape);
+
     if (classgroup == NULL || numclasses <=0)
       numclasses = layer->numclasses;
 
@@ -593,22 +909,7 @@ int msShapeGetClass(layerObj *layer, mapObj *map, shapeObj *shape, int *classgro
       if (iclass < 0 || iclass >= layer->numclasses)
         continue; /* this should never happen but just in case */
 
-      if(map->scaledenom > 0) { /* verify scaledenom here  */
-        if((layer->class[iclass]->maxscaledenom > 0) && (map->scaledenom > layer->class[iclass]->maxscaledenom))
-          continue; /* can skip this one, next class */
-        if((layer->class[iclass]->minscaledenom > 0) && (map->scaledenom <= layer->class[iclass]->minscaledenom))
-          continue; /* can skip this one, next class */
-      }
-
-      /* verify the minfeaturesize */
-      if ((shape->type == MS_SHAPE_LINE || shape->type == MS_SHAPE_POLYGON) && (layer->class[iclass]->minfeaturesize > 0)) {
-        double minfeaturesize = Pix2LayerGeoref(map, layer,
-                                                layer->class[iclass]->minfeaturesize);
-        if (msShapeCheckSize(shape, minfeaturesize) == MS_FALSE)
-          continue; /* skip this one, next class */
-      }
-
-      if(layer->class[iclass]->status != MS_DELETE && msEvalExpression(layer, shape, &(layer->class[iclass]->expression), layer->classitemindex) == MS_TRUE)
+      if(msShapeCheckClass(layer, map, shape, iclass) && msEvalExpression(layer, shape, &(layer->class[iclass]->expression), layer->classitemindex) == MS_TRUE)
         return(iclass);
     }
   }
@@ -616,6 +917,94 @@ int msShapeGetClass(layerObj *layer, mapObj *map, shapeObj *shape, int *classgro
   return(-1); /* no match */
 }
 
+/*
+** Classify a set of shapes at once, setting shapes[i].classindex to what
+** msShapeGetClass() would return for each of them. Each class is tested
+** against all shapes still unclassified, compiled expressions being evaluated
+** column by column by msEvalExpressionBatch().
+*/
+void msShapeGetClasses(layerObj *layer, mapObj *map, shapeObj *shapes, int numshapes, int *classgroup, int numclasses)
+{
+  int i, j, k, iclass, numpending, numlanes;
+  int *pending, *lanes, *results;
+  expressionBatchObj batch;
+
+  if (layer->numclasses <= 0 || numshapes <= 0 ||
+      (classgroup == NULL && layer->classlookup && layer->classlookup->numclasses == layer->numclasses)) {
+    /* nothing to batch, or the class lookup does it already */
+    for(i=0; i<numshapes; i++)
+      shapes[i].classindex = msShapeGetClass(layer, map, &shapes[i], classgroup, numclasses);
+    return;
+  }
+
+  if (classgroup == NULL || numclasses <=0)
+    numclasses = layer->numclasses;
+
+  pending = (int *) msSmallMalloc(sizeof(int) * numshapes * 3);
+  lanes = pending + numshapes;
+  results = lanes + numshapes;
+
+  for(i=0; i<numshapes; i++) {
+    shapes[i].classindex = -1;
+    pending[i] = i;
+  }
+  numpending = numshapes;
+
+  msInitExpressionBatch(&batch, shapes, numshapes);
+
+  for(i=0; i<numclasses && numpending > 0; i++) {
+    classObj *c;
+    double minfeaturesize = -1;
+
+    if (classgroup)
+      iclass = classgroup[i];
+    else
+      iclass = i;
+
+    if (iclass < 0 || iclass >= layer->numclasses)
+      continue; /* this should never happen but just in case */
+    c = layer->class[iclass];
+
+    if(map->scaledenom > 0) { /* verify scaledenom here  */
+      if((c->maxscaledenom > 0) && (map->scaledenom > c->maxscaledenom))
+        continue; /* can skip this one, next class */
+      if((c->minscaledenom > 0) && (map->scaledenom <= c->minscaledenom))
+        continue; /* can skip this one, next class */
+    }
+    if(c->status == MS_DELETE) continue;
+
+    /* shapes this class could match */
+    if(c->minfeaturesize > 0)
+      minfeaturesize = Pix2LayerGeoref(map, layer, c->minfeaturesize);
+    for(j=0, numlanes=0; j<numpending; j++) {
+      shapeObj *shape = &shapes[pending[j]];
+      if ((shape->type == MS_SHAPE_LINE || shape->type == MS_SHAPE_POLYGON) && minfeaturesize > 0 &&
+          msShapeCheckSize(shape, minfeaturesize) == MS_FALSE)
+        continue;
+      lanes[numlanes++] = pending[j];
+    }
+
+    if(c->expression.type != MS_EXPRESSION || MS_STRING_IS_NULL_OR_EMPTY(c->expression.string) || c->expression.native_string != NULL ||
+       msEvalExpressionBatch(&batch, &(c->expression), lanes, numlanes, results) != MS_SUCCESS) {
+      for(k=0; k<numlanes; k++)
+        results[k] = msEvalExpression(layer, &shapes[lanes[k]], &(c->expression), layer->classitemindex);
+    }
+
+    for(k=0; k<numlanes; k++) {
+      if(results[k] == MS_TRUE) shapes[lanes[k]].classindex = iclass;
+    }
+
+    /* drop the shapes that found their class, keeping the order */
+    for(j=0, k=0; j<numpending; j++) {
+      if(shapes[pending[j]].classindex == -1) pending[k++] = pending[j];
+    }
+    numpending = k;
+  }
+
+  msFreeExpressionBatch(&batch);
+  free(pending);
+}
+
 static
 char *msEvalTextExpressionInternal(expressionObj *expr, shapeObj *shape, int bJSonEscape)
 {
@@ -630,6 +1019,11 @@ char *msEvalTextExpressionInternal(expressionObj *expr, shapeObj *shape, int bJS
       tokenListNodeObjPtr node=NULL;
       tokenListNodeObjPtr nextNode=NULL;
 
+      if(expr->program) { /* compiled template, see msTokenizeExpression() */
+        result = msEvalTextTemplate(expr, shape, bJSonEscape);
+        break;
+      }
+
       result = msStrdup(expr->string);
 
       node = expr->tokens;
@@ -665,7 +1059,7 @@ char *msEvalTextExpressionInternal(expressionObj *expr, shapeObj *shape, int bJS
       p.expr->curtoken = p.expr->tokens; /* reset */
       p.type = MS_PARSE_TYPE_STRING;
 
-      status = yyparse(&p);
+      status = msEvalParsedExpression(&p);
 
       if (status != 0) {
         msSetError(MS_PARSEERR, "Failed to process text expression: %s", "msEvalTextExpression", expr->string);
@@ -831,10 +1225,16 @@ int msSaveImage(mapObj *map, imageObj *img, char *filename)
   int nReturnVal = MS_FAILURE;
   char szPath[MS_MAXPATHLEN];
   struct mstimeval starttime, endtime;
+  double encodestart = 0;
+  int span;
 
   if(map && map->debug >= MS_DEBUGLEVEL_TUNING) {
     msGettimeofday(&starttime, NULL);
   }
+  if(map && map->stats) encodestart = msStatsNow();
+  span = msTraceSpanBegin("msSaveImage", MS_TRACE_INTERNAL);
+  if(img && img->format)
+    msTraceSpanAttribute(span, "mapserver.format", img->format->name);
 
   if (img) {
 #ifdef USE_GDAL
@@ -892,6 +1292,9 @@ int msSaveImage(mapObj *map, imageObj *img, char *filename)
                    "msSaveImage()");
   }
 
+  if(map && map->stats) map->stats->seconds[MS_STATS_ENCODE] += msStatsElapsed(&encodestart);
+  msTraceSpanEnd(span, nReturnVal);
+
   if(map && map->debug >= MS_DEBUGLEVEL_TUNING) {
     msGettimeofday(&endtime, NULL);
     msDebug("msSaveImage(%s) total time: %.3fs\n",
@@ -904,16 +1307,38 @@ int msSaveImage(mapObj *map, imageObj *img, char *filename)
 }
 
 /*
-** Generic function to save an image to a byte array.
-** - the return value is the pointer to the byte array
-** - size_ptr contains the number of bytes returned
-** - format: the desired output format
-**
-** The caller is responsible to free the returned array
-** The function returns NULL if the output format is not supported.
+** msSaveImage() to stdout that also returns a copy of the bytes written,
+** for the response caches. *data is to be released with msFree().
 */
+int msSaveImageCapture(mapObj *map, imageObj *img, unsigned char **data, int *size)
+{
+  msIOContext *old_context;
+  msIOBuffer *buf;
+  int status;
+
+  *data = NULL;
+  *size = 0;
+
+  old_context = msIO_pushStdoutToBufferAndGetOldContext();
+  status = msSaveImage(map, img, NULL);
+  buf = (msIOBuffer *) msIO_getHandler(stdout)->cbData;
+  if(status == MS_SUCCESS && buf->data_offset > 0) {
+    if(msIO_contextWrite(old_context, buf->data, buf->data_offset) != buf->data_offset) {
+      msSetError(MS_IOERR, "Failed to write image.", "msSaveImageCapture()");
+      status = MS_FAILURE;
+    } else {
+      *data = (unsigned char *) msSmallMalloc(buf->data_offset);
+      memcpy(*data, buf->data, buf->data_offset);
+      *size = buf->data_offset;
+    }
+  }
+  msIO_restoreOldStdoutContext(old_context);
 
-unsigned char *msSaveImageBuffer(imageObj* image, int *size_ptr, outputFormatObj *format)
+  return status;
+}
+
+/* msSaveImageBuffer(), without the tracing span */
+static unsigned char *msSaveImageBufferEncode(imageObj* image, int *size_ptr, outputFormatObj *format)
 {
   int status = MS_SUCCESS;
   *size_ptr = 0;
@@ -944,12 +1369,35 @@ unsigned char *msSaveImageBuffer(imageObj* image, int *size_ptr, outputFormatObj
   return NULL;
 }
 
+/*
+** Generic function to save an image to a byte array.
+** - the return value is the pointer to the byte array
+** - size_ptr contains the number of bytes returned
+** - format: the desired output format
+**
+** The caller is responsible to free the returned array
+** The function returns NULL if the output format is not supported.
+*/
+
+unsigned char *msSaveImageBuffer(imageObj* image, int *size_ptr, outputFormatObj *format)
+{
+  int span = msTraceSpanBegin("msSaveImageBuffer", MS_TRACE_INTERNAL);
+  unsigned char *data;
+
+  if(format)
+    msTraceSpanAttribute(span, "mapserver.format", format->name);
+  data = msSaveImageBufferEncode(image, size_ptr, format);
+  msTraceSpanEnd(span, data ? MS_SUCCESS : MS_FAILURE);
+  return data;
+}
+
 /**
  * Generic function to free the imageObj
  */
 void msFreeImage(imageObj *image)
 {
   if (image) {
+    msIO_requestMemoryFree(MS_REQUEST_MEMORY_IMAGE, msImageMemorySize(image->width, image->height, image->format));
     if(MS_RENDERER_PLUGIN(image->format)) {
       rendererVTableObj *renderer = image->format->vtable;
       tileCacheObj *next,*cur = image->tilecache;
@@ -959,6 +1407,7 @@ void msFreeImage(imageObj *image)
         free(cur);
         cur = next;
       }
+      msFree(image->tilehash);
       image->ntiles = 0;
       renderer->freeImage(image);
     } else if( MS_RENDERER_IMAGEMAP(image->format) )
@@ -1005,13 +1454,9 @@ int *msGetLayersIndexByGroup(mapObj *map, char *groupname, int *pnCount)
 
   aiIndex = (int *)msSmallMalloc(sizeof(int) * map->numlayers);
 
-  for(i=0; i<map->numlayers; i++) {
-    if(!GET_LAYER(map, i)->group) /* skip it */
-      continue;
-    if(strcmp(groupname, GET_LAYER(map, i)->group) == 0) {
-      aiIndex[iLayer] = i;
-      iLayer++;
-    }
+  for(i=msLayerNameIndexNext(map, groupname, MS_TRUE, -1); i != -1; i=msLayerNameIndexNext(map, groupname, MS_TRUE, i)) {
+    aiIndex[iLayer] = i;
+    iLayer++;
   }
 
   if (iLayer == 0) {
@@ -1511,6 +1956,25 @@ char *msTmpFilename(const char *ext)
   return fullFname;
 }
 
+/**
+ *  Estimated bytes taken by the pixels of an image, for the request memory
+ *  accounting (see msIO_setRequestMemoryLimit()): 0 for the formats that
+ *  don't hold a raster.
+ */
+size_t msImageMemorySize(int width, int height, outputFormatObj *format)
+{
+  if(!format || width <= 0 || height <= 0)
+    return 0;
+  if(MS_RENDERER_RAWDATA(format)) {
+    size_t pixelsize = (format->imagemode == MS_IMAGEMODE_INT16) ? sizeof(short) :
+                       (format->imagemode == MS_IMAGEMODE_FLOAT32) ? sizeof(float) : 1;
+    return (size_t) width * height * format->bands * pixelsize;
+  }
+  if(MS_RENDERER_PLUGIN(format) && format->vtable && format->vtable->supports_pixel_buffer)
+    return (size_t) width * height * 4;
+  return 0;
+}
+
 /**
  *  Generic function to Initalize an image object.
  */
@@ -1519,11 +1983,20 @@ imageObj *msImageCreate(int width, int height, outputFormatObj *format,
                         double defresolution, colorObj *bg)
 {
   imageObj *image = NULL;
+  size_t memorysize = msImageMemorySize(width, height, format);
+
+  msIO_requestMemoryAlloc(MS_REQUEST_MEMORY_IMAGE, memorysize);
+  if(msIO_checkRequestMemory("msImageCreate()") != MS_SUCCESS) {
+    msIO_requestMemoryFree(MS_REQUEST_MEMORY_IMAGE, memorysize);
+    return NULL;
+  }
+
   if(MS_RENDERER_PLUGIN(format)) {
 
     image = format->vtable->createImage(width,height,format,bg);
     if (image == NULL) {
       msSetError(MS_MEMERR, "Unable to create new image object.", "msImageCreate()");
+      msIO_requestMemoryFree(MS_REQUEST_MEMORY_IMAGE, memorysize);
       return NULL;
     }
 
@@ -1535,6 +2008,7 @@ imageObj *msImageCreate(int width, int height, outputFormatObj *format,
     image->imagepath = NULL;
     image->imageurl = NULL;
     image->tilecache = NULL;
+    image->tilehash = NULL;
     image->ntiles = 0;
     image->resolution = resolution;
     image->resolutionfactor = resolution/defresolution;
@@ -1550,12 +2024,14 @@ imageObj *msImageCreate(int width, int height, outputFormatObj *format,
       msSetError(MS_IMGERR,
                  "Attempt to use illegal imagemode with rawdata renderer.",
                  "msImageCreate()" );
+      msIO_requestMemoryFree(MS_REQUEST_MEMORY_IMAGE, memorysize);
       return NULL;
     }
 
     image = (imageObj *)calloc(1,sizeof(imageObj));
     if (image == NULL) {
       msSetError(MS_MEMERR, "Unable to create new image object.", "msImageCreate()");
+      msIO_requestMemoryFree(MS_REQUEST_MEMORY_IMAGE, memorysize);
       return NULL;
     }
 
@@ -1571,6 +2047,7 @@ imageObj *msImageCreate(int width, int height, outputFormatObj *format,
 
     if( image->img.raw_16bit == NULL ) {
       msFree( image );
+      msIO_requestMemoryFree(MS_REQUEST_MEMORY_IMAGE, memorysize);
       msSetError(MS_IMGERR,
                  "Attempt to allocate raw image failed, out of memory.",
                  "msImageCreate()" );
@@ -1919,6 +2396,22 @@ int msSetup()
   return MS_SUCCESS;
 }
 
+/* Before forking worker processes that inherit the caches of this one: close
+   the file and connection handles, which must not be shared, and keep what
+   lives in memory (cached maps, preloaded shapefiles, in memory indexes, font
+   faces, tiles...) for the children to share copy-on-write. */
+void msPrepareFork()
+{
+  msConnPoolCloseUnreferenced();
+  msSHPDiskTreeCacheCloseFiles();
+  msTiledSHPTileCacheCleanup();
+  msGDALPoolCloseUnused();
+#if defined(USE_CURL)
+  msHTTPCleanup(); /* no upstream connections shared by the processes */
+#endif
+  msThreadPoolCleanup(); /* workers do not survive fork(), they start again on use */
+}
+
 /* This is intended to be a function to cleanup anything that "hangs around"
    when all maps are destroyed, like Registered GDAL drivers, and so forth. */
 #ifndef NDEBUG
@@ -1928,8 +2421,30 @@ int msSetup()
 #endif
 void msCleanup()
 {
+  msThreadLockStatsReport(); /* while debug output is still there */
   msForceTmpFileBase( NULL );
   msConnPoolFinalCleanup();
+  msSHPDiskTreeCacheCleanup();
+  msDBFColumnCacheCleanup();
+  msTiledSHPTileCacheCleanup();
+  msSHPPreloadCleanup();
+  msJoinCacheCleanup();
+  msLabelPlacementCacheCleanup();
+  msContourCacheCleanup();
+  msKernelDensityCacheCleanup();
+  msPNGPaletteCacheCleanup();
+  msMapCacheCleanup();
+  msLayerIndexCacheCleanup();
+  msSymbolFileCacheCleanup();
+  msFontSetCacheCleanup();
+  msLegendCacheCleanup();
+  msGraticuleCacheCleanup();
+  msTileCacheCleanup();
+  msWMSCacheCleanup();
+  msOWSCapabilitiesCacheCleanup();
+  msSLDCacheCleanup();
+  msPostGISCacheCleanup();
+  msThreadPoolCleanup();
   /* Lexer string parsing variable */
   if (msyystring_buffer != NULL) {
     msFree(msyystring_buffer);
@@ -1944,6 +2459,8 @@ void msCleanup()
   msGDALCleanup();
 #endif
 #ifdef USE_PROJ
+  msProjectionCacheCleanup();
+  msProjectRectCacheCleanup();
 #  if PJ_VERSION >= 480
   pj_clear_initcache();
 #  endif
@@ -2374,9 +2891,9 @@ char *msBuildOnlineResource(mapObj *map, cgiRequestObj *req)
   char **hostname_array = NULL;
   int mapparam_len = 0, hostname_array_len = 0;
 
-  hostname = getenv("HTTP_X_FORWARDED_HOST");
+  hostname = msIO_getenv("HTTP_X_FORWARDED_HOST");
   if(!hostname)
-    hostname = getenv("SERVER_NAME");
+    hostname = msIO_getenv("SERVER_NAME");
   else {
     if(strchr(hostname,',')) {
       hostname_array = msStringSplit(hostname,',', &hostname_array_len);
@@ -2384,19 +2901,19 @@ char *msBuildOnlineResource(mapObj *map, cgiRequestObj *req)
     }
   }
 
-  port = getenv("HTTP_X_FORWARDED_PORT");
+  port = msIO_getenv("HTTP_X_FORWARDED_PORT");
   if(!port)
-    port = getenv("SERVER_PORT");
+    port = msIO_getenv("SERVER_PORT");
   
-  script = getenv("SCRIPT_NAME");
+  script = msIO_getenv("SCRIPT_NAME");
 
   /* HTTPS is set by Apache to "on" in an HTTPS server ... if not set */
   /* then check SERVER_PORT: 443 is the default https port. */
-  if ( ((value=getenv("HTTPS")) && strcasecmp(value, "on") == 0) ||
-       ((value=getenv("SERVER_PORT")) && atoi(value) == 443) ) {
+  if ( ((value=msIO_getenv("HTTPS")) && strcasecmp(value, "on") == 0) ||
+       ((value=msIO_getenv("SERVER_PORT")) && atoi(value) == 443) ) {
     protocol = "https";
   }
-  if ( (value=getenv("HTTP_X_FORWARDED_PROTO")) ) {
+  if ( (value=msIO_getenv("HTTP_X_FORWARDED_PROTO")) ) {
     protocol = value;
   }
 
@@ -2563,57 +3080,52 @@ void msMapSetLanguageSpecificConnection(mapObj* map, const char* validated_langu
    Ref: http://trac.osgeo.org/gdal/ticket/966 */
 shapeObj* msGeneralize(shapeObj *shape, double tolerance)
 {
-  shapeObj *newShape;
-  lineObj newLine = {0,NULL};
+  shapeObj *newShape, attributes;
+  lineObj *line;
   double sqTolerance = tolerance*tolerance;
-  
+
   double dX0, dY0, dX1, dY1, dX, dY, dSqDist;
-  int i;
+  int i, n = 0;
 
+  /* copy all but the lines, the points kept are added below */
+  attributes = *shape;
+  attributes.numlines = 0;
   newShape = (shapeObj*)msSmallMalloc(sizeof(shapeObj));
   msInitShape(newShape);
-  msCopyShape(shape, newShape);
+  msCopyShape(&attributes, newShape);
 
   if (shape->numlines<1)
     return newShape;
-  
-  /* Clean shape */
-  for (i=0; i < newShape->numlines; i++)
-    free(newShape->line[i].point);
-  newShape->numlines = 0;
-  if (newShape->line) free(newShape->line);
-    
-  msAddLine(newShape, &newLine);
-  
-  if (shape->line[0].numpoints>0) {
-    msAddPointToLine(&newShape->line[0],
-                     &shape->line[0].point[0]);              
-    dX0 = shape->line[0].point[0].x;
-    dY0 = shape->line[0].point[0].y;    
+
+  line = &shape->line[0];
+  newShape->line = (lineObj*)msSmallMalloc(sizeof(lineObj));
+  newShape->numlines = 1;
+  newShape->line[0].point = (pointObj*)msSmallMalloc(sizeof(pointObj)*MS_MAX(1, line->numpoints));
+
+  if (line->numpoints>0) {
+    newShape->line[0].point[n++] = line->point[0];
+    dX0 = line->point[0].x;
+    dY0 = line->point[0].y;
   }
-  
-  for(i=1; i<shape->line[0].numpoints; i++)
+
+  for(i=1; i<line->numpoints; i++)
   {
-      dX1 = shape->line[0].point[i].x;
-      dY1 = shape->line[0].point[i].y;
-     
+      dX1 = line->point[i].x;
+      dY1 = line->point[i].y;
+
       dX = dX1-dX0;
       dY = dY1-dY0;
       dSqDist = dX*dX + dY*dY;
-      if (i == shape->line[0].numpoints-1 || dSqDist >= sqTolerance)
+      if (i == line->numpoints-1 || dSqDist >= sqTolerance)
       {
-          pointObj p;
-          p.x = dX1;
-          p.y = dY1;
-          
           /* Keep this point (always keep the last point) */
-          msAddPointToLine(&newShape->line[0],
-                           &p);          
+          newShape->line[0].point[n++] = line->point[i];
           dX0 = dX1;
           dY0 = dY1;
         }
     }
-   
+  newShape->line[0].numpoints = n;
+
   return newShape;
 }
 
@@ -76,8 +76,10 @@ typedef struct {
 
   /* double   shape_tolerance; */
 
-  float **u; /* u values */
-  float **v; /* v values */
+  float *u; /* u values, column after column */
+  float *v; /* v values */
+  int *offsets; /* in u and v, of the query_results non null vectors */
+  float size_scale; /* PROCESSING "UV_SIZE_SCALE" */
   int width;
   int height;
   rectObj extent;
@@ -164,6 +166,7 @@ static void msUVRasterLayerInfoInitialize(layerObj *layer)
   /* uvlinfo->shape_tolerance = 0.0; */
   uvlinfo->u = NULL;
   uvlinfo->v = NULL;
+  uvlinfo->offsets = NULL;
   uvlinfo->width = 0;
   uvlinfo->height = 0;
 
@@ -181,24 +184,13 @@ static void msUVRasterLayerInfoFree( layerObj *layer )
 
 {
   uvRasterLayerInfo *uvlinfo = (uvRasterLayerInfo *) layer->layerinfo;
-  int i;
 
   if( uvlinfo == NULL )
     return;
 
-  if (uvlinfo->u) {
-    for (i=0; i<uvlinfo->width; ++i) {
-      free(uvlinfo->u[i]);
-    }
-    free(uvlinfo->u);
-  }
-
-  if (uvlinfo->v) {
-    for (i=0; i<uvlinfo->width; ++i) {
-      free(uvlinfo->v[i]);
-    }
-    free(uvlinfo->v);
-  }
+  free(uvlinfo->u);
+  free(uvlinfo->v);
+  free(uvlinfo->offsets);
 
   free( uvlinfo );
 
@@ -270,10 +262,12 @@ int msUVRASTERLayerGetItems(layerObj *layer)
  **********************************************************************/
 static char **msUVRASTERGetValues(layerObj *layer, float *u, float *v)
 {
+  uvRasterLayerInfo *uvlinfo = (uvRasterLayerInfo *) layer->layerinfo;
   char **values;
   int i = 0;
   char tmp[100];
-  float size_scale;
+  float size_scale = uvlinfo->size_scale;
+  double angle = 0;
   int *itemindexes = (int*)layer->iteminfo;
 
   if(layer->numitems == 0)
@@ -290,22 +284,22 @@ static char **msUVRASTERGetValues(layerObj *layer, float *u, float *v)
     return(NULL);
   }
 
-  /* -------------------------------------------------------------------- */
-  /*    Determine desired size_scale.  Default to 1 if not otherwise set  */
-  /* -------------------------------------------------------------------- */
-  size_scale = 1;
-  if( CSLFetchNameValue( layer->processing, "UV_SIZE_SCALE" ) != NULL ) {
-    size_scale =
-      atof(CSLFetchNameValue( layer->processing, "UV_SIZE_SCALE" ));
+  /* both angles come from the same atan2() */
+  for(i=0; i<layer->numitems; i++) {
+    if (itemindexes[i] == MSUVRASTER_ANGLEINDEX
+        || itemindexes[i] == MSUVRASTER_MINUSANGLEINDEX) {
+      angle = atan2((double)*v, (double)*u) * 180 / MS_PI;
+      break;
+    }
   }
 
   for(i=0; i<layer->numitems; i++) {
     if (itemindexes[i] == MSUVRASTER_ANGLEINDEX) {
-      snprintf(tmp, 100, "%f", (atan2((double)*v, (double)*u) * 180 / MS_PI));
+      snprintf(tmp, 100, "%f", angle);
       values[i] = msStrdup(tmp);
     } else if (itemindexes[i] == MSUVRASTER_MINUSANGLEINDEX) {
       double minus_angle;
-      minus_angle = (atan2((double)*v, (double)*u) * 180 / MS_PI)+180;
+      minus_angle = angle+180;
       if (minus_angle >= 360)
         minus_angle -= 360;
       snprintf(tmp, 100, "%f", minus_angle);
@@ -481,45 +475,43 @@ int msUVRASTERLayerWhichShapes(layerObj *layer, rectObj rect, int isQuery)
   }
 
   /* free old query arrays */
-  if (uvlinfo->u) {
-    for (i=0; i<uvlinfo->width; ++i) {
-      free(uvlinfo->u[i]);
-    }
-    free(uvlinfo->u);
-  }
-
-  if (uvlinfo->v) {
-    for (i=0; i<uvlinfo->width; ++i) {
-      free(uvlinfo->v[i]);
-    }
-    free(uvlinfo->v);
-  }
+  free(uvlinfo->u);
+  free(uvlinfo->v);
+  free(uvlinfo->offsets);
 
   /* Update our uv layer structure */
   uvlinfo->width = width;
   uvlinfo->height = height;
-  uvlinfo->query_results = width*height;
+  uvlinfo->query_results = 0;
 
-  uvlinfo->u = (float **)msSmallMalloc(sizeof(float *)*width);
-  uvlinfo->v = (float **)msSmallMalloc(sizeof(float *)*width);
+  uvlinfo->u = (float *)msSmallMalloc(sizeof(float)*width*height);
+  uvlinfo->v = (float *)msSmallMalloc(sizeof(float)*width*height);
+  uvlinfo->offsets = (int *)msSmallMalloc(sizeof(int)*width*height);
 
   for (x = 0; x < width; ++x) {
-    uvlinfo->u[x] = (float *)msSmallMalloc(height * sizeof(float));
-    uvlinfo->v[x] = (float *)msSmallMalloc(height * sizeof(float));
-
     for (y = 0; y < height; ++y) {
+      i = x * height + y;
       u_src_off = v_src_off = x + y * width;
       v_src_off += width*height;
 
-      uvlinfo->u[x][y] = image_tmp->img.raw_float[u_src_off];
-      uvlinfo->v[x][y] = image_tmp->img.raw_float[v_src_off];
+      uvlinfo->u[i] = image_tmp->img.raw_float[u_src_off];
+      uvlinfo->v[i] = image_tmp->img.raw_float[v_src_off];
 
-      /* null vector? update the number of results  */
-      if (uvlinfo->u[x][y] == 0 && uvlinfo->v[x][y] == 0)
-        --uvlinfo->query_results;
+      /* null vectors are not returned */
+      if (uvlinfo->u[i] != 0 || uvlinfo->v[i] != 0)
+        uvlinfo->offsets[uvlinfo->query_results++] = i;
     }
   }
 
+  /* -------------------------------------------------------------------- */
+  /*    Determine desired size_scale.  Default to 1 if not otherwise set  */
+  /* -------------------------------------------------------------------- */
+  uvlinfo->size_scale = 1;
+  if( CSLFetchNameValue( layer->processing, "UV_SIZE_SCALE" ) != NULL ) {
+    uvlinfo->size_scale =
+      atof(CSLFetchNameValue( layer->processing, "UV_SIZE_SCALE" ));
+  }
+
   msFreeImage(image_tmp); /* we do not need the imageObj anymore */
   msFreeMap(map_tmp);
 
@@ -533,7 +525,7 @@ int msUVRASTERLayerGetShape(layerObj *layer, shapeObj *shape, resultObj *record)
   uvRasterLayerInfo *uvlinfo = (uvRasterLayerInfo *) layer->layerinfo;
   lineObj line ;
   pointObj point;
-  int i, j, k, x=0, y=0;
+  int offset, x, y;
   long shapeindex = record->shapeindex;
 
   msFreeShape(shape);
@@ -548,14 +540,9 @@ int msUVRASTERLayerGetShape(layerObj *layer, shapeObj *shape, resultObj *record)
     return MS_FAILURE;
   }
 
-  /* loop to the next non null vector */
-  k = 0;
-  for (i=0, x=-1; i<uvlinfo->width && k<=shapeindex; ++i, ++x) {
-    for (j=0, y=-1; j<uvlinfo->height && k<=shapeindex; ++j, ++k, ++y) {
-      if (uvlinfo->u[i][j] == 0 && uvlinfo->v[i][j] == 0)
-        --k;
-    }
-  }
+  offset = uvlinfo->offsets[shapeindex];
+  x = offset / uvlinfo->height;
+  y = offset % uvlinfo->height;
 
   point.x = Pix2Georef(x, 0, uvlinfo->width-1,
                        uvlinfo->extent.minx, uvlinfo->extent.maxx, MS_FALSE);
@@ -576,7 +563,7 @@ int msUVRASTERLayerGetShape(layerObj *layer, shapeObj *shape, resultObj *record)
   msComputeBounds( shape );
 
   shape->numvalues = layer->numitems;
-  shape->values = msUVRASTERGetValues(layer, &uvlinfo->u[x][y], &uvlinfo->v[x][y]);
+  shape->values = msUVRASTERGetValues(layer, &uvlinfo->u[offset], &uvlinfo->v[offset]);
 
   return MS_SUCCESS;
 
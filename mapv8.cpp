@@ -31,6 +31,7 @@
 
 #include "mapserver.h"
 #include "v8_mapscript.h"
+#include <sys/stat.h>
 
 /* This file could be refactored in the future to encapsulate the global
    functions and internal use functions in a class. */
@@ -106,7 +107,7 @@ static Handle<Value> msV8ReadFile(V8Context *v8context, const char *path)
   return result;
 }
 
-/* Returns a compiled javascript script. */
+/* Returns a compiled javascript script, not bound to a context. */
 static Handle<Script> msV8CompileScript(Handle<String> source, Handle<String> script_name)
 {
   TryCatch try_catch;
@@ -116,7 +117,7 @@ static Handle<Script> msV8CompileScript(Handle<String> source, Handle<String> sc
     return Handle<Script>();
   }
 
-  Handle<Script> script = Script::Compile(source, script_name);
+  Handle<Script> script = Script::New(source, script_name);
   if (script.IsEmpty() && try_catch.HasCaught()) {
     msV8ReportException(&try_catch);
   }
@@ -142,13 +143,44 @@ static Handle<Value> msV8RunScript(Handle<Script> script)
   return result;
 }
 
+/* Returns the compiled script of a javascript file. The scripts are kept
+   along the isolate, this one is compiled again if the file was modified
+   since. */
+static Handle<Script> msV8GetScript(Isolate *isolate, const char *fullpath, const char *path)
+{
+  V8IsolateData *isolatedata = V8ISOLATEDATA(isolate);
+  map<string, V8CachedScript>::iterator it;
+  struct stat stat_buf;
+  time_t mtime = 0;
+
+  if (stat(fullpath, &stat_buf) == 0)
+    mtime = stat_buf.st_mtime;
+
+  it = isolatedata->scripts.find(fullpath);
+  if (it != isolatedata->scripts.end() && mtime != 0 && (*it).second.mtime == mtime)
+    return Local<Script>::New(isolate, (*it).second.script);
+
+  Handle<Value> source = msV8ReadFile(isolatedata->context, fullpath);
+  Handle<String> script_name = String::New(msStripPath((char*)path));
+  Handle<Script> script = msV8CompileScript(source->ToString(), script_name);
+  if (script.IsEmpty())
+    return script;
+
+  V8CachedScript &cached = isolatedata->scripts[fullpath];
+  cached.script.Dispose();
+  cached.script.Reset(isolate, script);
+  cached.mtime = mtime;
+
+  return script;
+}
+
 /* Execute a javascript file */
 static Handle<Value> msV8ExecuteScript(const char *path, int throw_exception = MS_FALSE)
 {
   char fullpath[MS_MAXPATHLEN];
   map<string, Persistent<Script> >::iterator it;
   Isolate *isolate = Isolate::GetCurrent();
-  V8Context *v8context = (V8Context*)isolate->GetData();
+  V8Context *v8context = V8ISOLATEDATA(isolate)->context;
 
   /* construct the path */
   msBuildPath(fullpath, v8context->paths.top().c_str(), path);
@@ -159,14 +191,13 @@ static Handle<Value> msV8ExecuteScript(const char *path, int throw_exception = M
   Handle<Script> script;
   it = v8context->scripts.find(fullpath);
   if (it == v8context->scripts.end()) {
-    Handle<Value> source = msV8ReadFile(v8context, fullpath);
-    Handle<String> script_name = String::New(msStripPath((char*)path));
-    script = msV8CompileScript(source->ToString(), script_name);
+    script = msV8GetScript(isolate, fullpath, path);
     if (script.IsEmpty()) {
       v8context->paths.pop();
       if (throw_exception) {
         return ThrowException(String::New("Error compiling script"));
       }
+      return Handle<Value>();
     }
     /* cache the compiled script */
     Persistent<Script> pscript;
@@ -246,9 +277,16 @@ void msV8CreateContext(mapObj *map)
   Line::Initialize(global);
 
   v8context->paths.push(map->mappath);
-  v8context->isolate->SetData(v8context);
   v8context->layer = NULL;
 
+  /* the compiled scripts outlive the context, see msV8GetScript() */
+  V8IsolateData *isolatedata = V8ISOLATEDATA(isolate);
+  if (!isolatedata) {
+    isolatedata = new V8IsolateData();
+    isolate->SetData(isolatedata);
+  }
+  isolatedata->context = v8context;
+
   map->v8context = (void*)v8context;
 }
 
@@ -276,6 +314,9 @@ static void msV8FreeContextScripts(V8Context *v8context)
 void msV8FreeContext(mapObj *map)
 {
   V8Context* v8context = V8CONTEXT(map);
+  V8IsolateData *isolatedata = V8ISOLATEDATA(v8context->isolate);
+  if (isolatedata && isolatedata->context == v8context)
+    isolatedata->context = NULL;
   Shape::Dispose();
   Point::Dispose();
   Line::Dispose();
@@ -299,6 +340,7 @@ char* msV8GetFeatureStyle(mapObj *map, const char *filename, layerObj *layer, sh
 
   Isolate::Scope isolate_scope(v8context->isolate);
   HandleScope handle_scope(v8context->isolate);
+  V8ISOLATEDATA(v8context->isolate)->context = v8context;
 
   /* execution context */
   Local<Context> context = Local<Context>::New(v8context->isolate, v8context->context);
@@ -337,7 +379,7 @@ shapeObj *msV8TransformShape(shapeObj *shape, const char* filename)
 {
   TryCatch try_catch;
   Isolate *isolate = Isolate::GetCurrent();
-  V8Context *v8context = (V8Context*)isolate->GetData();
+  V8Context *v8context = V8ISOLATEDATA(isolate)->context;
 
   HandleScope handle_scope(v8context->isolate);
 
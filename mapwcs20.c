@@ -4047,6 +4047,124 @@ static int msWCSSetFormatParams20(outputFormatObj* format, char** format_options
   return MS_SUCCESS;
 }
 
+/************************************************************************/
+/*                   msWCSGetCoverage20_StripeRows()                    */
+/*                                                                      */
+/*      Returns the number of rows of the stripes the coverage is       */
+/*      drawn and streamed in, 0 to draw it at once. Only GTiff raw     */
+/*      data output, uncompressed and not multipart, can be striped,    */
+/*      when larger than the "wcs_stripe_memory" metadata (in MB).      */
+/************************************************************************/
+
+static int msWCSGetCoverage20_StripeRows(mapObj *map, layerObj *layer,
+    wcs20ParamsObjPtr params)
+{
+  outputFormatObj *format = map->outputformat;
+  const char *value = msOWSLookupMetadata(&(map->web.metadata), "CO", "stripe_memory");
+  const char *compress;
+  double budget, row_bytes;
+  int pixel_size, rows;
+
+#if GDAL_VERSION_MAJOR < 2
+  return 0;
+#endif
+  if(value == NULL || (budget = atof(value) * 1024 * 1024) <= 0)
+    return 0;
+  if(params->multipart == MS_TRUE || layer->mask || map->height < 2
+      || format == NULL || !MS_RENDERER_RAWDATA(format)
+      || !EQUAL(format->driver, "GDAL/GTiff"))
+    return 0;
+  compress = msGetOutputFormatOption(format, "COMPRESS", NULL);
+  if((compress && !EQUAL(compress, "NONE"))
+      || CSLTestBoolean(msGetOutputFormatOption(format, "TILED", "NO")))
+    return 0;
+
+  if(format->imagemode == MS_IMAGEMODE_INT16)
+    pixel_size = 2;
+  else if(format->imagemode == MS_IMAGEMODE_FLOAT32)
+    pixel_size = 4;
+  else
+    pixel_size = 1;
+
+  /* each stripe is held by the image and by the GDAL block cache */
+  row_bytes = 2.0 * map->width * format->bands * pixel_size;
+  if(row_bytes * map->height <= budget)
+    return 0;
+
+  rows = (int) (budget / row_bytes);
+  return MS_MAX(rows, 2);
+}
+
+/************************************************************************/
+/*                   msWCSGetCoverage20_DrawStripes()                   */
+/*                                                                      */
+/*      Draws the coverage stripe by stripe, each one streamed to the   */
+/*      client before the next is drawn, so that memory does not grow   */
+/*      with the size of the output.                                    */
+/************************************************************************/
+
+static int msWCSGetCoverage20_DrawStripes(mapObj *map, layerObj *layer,
+    int stripe_rows)
+{
+  rectObj extent = map->extent;
+  int width = map->width, height = map->height;
+  /* pixel center to pixel center extent */
+  double cellheight = (extent.maxy - extent.miny) / (height - 1);
+  const char *fo_filename = msGetOutputFormatOption(map->outputformat, "FILENAME", NULL);
+  void *hDS;
+  int row, status = MS_SUCCESS;
+
+  msIO_setHeader("Content-Type","%s",MS_IMAGE_MIME_TYPE(map->outputformat));
+  msIO_setHeader("Content-Description","coverage data");
+  msIO_setHeader("Content-Transfer-Encoding","binary");
+  if( fo_filename != NULL ) {
+    msIO_setHeader("Content-ID","coverage/%s",fo_filename);
+    msIO_setHeader("Content-Disposition","INLINE; filename=%s",fo_filename);
+  } else {
+    msIO_setHeader("Content-ID","coverage/wcs.%s",MS_IMAGE_EXTENSION(map->outputformat));
+    msIO_setHeader("Content-Disposition","INLINE");
+  }
+  msIO_sendHeaders();
+
+  hDS = msGDALBeginStripes(map, map->outputformat, width, height, stripe_rows);
+  if(hDS == NULL)
+    return MS_FAILURE;
+
+  for(row = 0; row < height && status == MS_SUCCESS; row += stripe_rows) {
+    int rows = MS_MIN(stripe_rows, height - row);
+    int skip = 0;
+    imageObj *image;
+
+    /* a single row has no cell height, it is drawn with the one above */
+    if(rows == 1)
+      skip = 1;
+
+    map->height = rows + skip;
+    map->extent.maxy = extent.maxy - (row - skip) * cellheight;
+    map->extent.miny = extent.maxy - (row + rows - 1) * cellheight;
+    msMapComputeGeotransform(map);
+
+    image = msImageCreate(width, map->height, map->outputformat,
+                          map->web.imagepath, map->web.imageurl, map->resolution,
+                          map->defresolution, &map->imagecolor);
+    if(image == NULL) {
+      status = MS_FAILURE;
+      break;
+    }
+    status = msDrawRasterLayerLow(map, layer, image, NULL);
+    if(status == MS_SUCCESS)
+      status = msGDALWriteStripe(hDS, image, row, skip);
+    msFreeImage(image);
+  }
+  msGDALEndStripes(hDS);
+
+  map->extent = extent;
+  map->height = height;
+  msMapComputeGeotransform(map);
+
+  return status;
+}
+
 /************************************************************************/
 /*                   msWCSGetCoverage20()                               */
 /*                                                                      */
@@ -4066,7 +4184,7 @@ int msWCSGetCoverage20(mapObj *map, cgiRequestObj *request,
   rectObj subsets, bbox;
   projectionObj imageProj;
 
-  int status, i;
+  int status, i, stripe_rows;
   double x_1, x_2, y_1, y_2;
   char *coverageName, *bandlist=NULL, numbands[8];
 
@@ -4346,8 +4464,10 @@ this request. Check wcs/ows_enable_request settings.", "msWCSGetCoverage20()", p
   map->width = params->width;
   map->height = params->height;
 
-  /* Are we exceeding the MAXSIZE limit on result size? */
-  if(map->width > map->maxsize || map->height > map->maxsize ) {
+  /* Are we exceeding the MAXSIZE limit on result size? The height of */
+  /* striped output is checked once the output format is known.       */
+  if(map->width > map->maxsize ||
+      (map->height > map->maxsize && !msOWSLookupMetadata(&(map->web.metadata), "CO", "stripe_memory"))) {
     msWCSClearCoverageMetadata20(&cm);
     msSetError(MS_WCSERR, "Raster size out of range, width and height of "
                "resulting coverage must be no more than MAXSIZE=%d.",
@@ -4461,6 +4581,25 @@ this request. Check wcs/ows_enable_request settings.", "msWCSGetCoverage20()", p
     msLayerSetProcessingKey(layer, "CLOSE_CONNECTION", "NORMAL");
   }
 
+  /* large enough outputs are drawn and streamed in stripes */
+  stripe_rows = msWCSGetCoverage20_StripeRows(map, layer, params);
+  if(stripe_rows == 0 && map->height > map->maxsize) {
+    msFree(bandlist);
+    msWCSClearCoverageMetadata20(&cm);
+    msSetError(MS_WCSERR, "Raster size out of range, width and height of "
+               "resulting coverage must be no more than MAXSIZE=%d.",
+               "msWCSGetCoverage20()", map->maxsize);
+    return msWCSException(map, "InvalidParameterValue",
+                          "size", params->version);
+  }
+  if(stripe_rows > 0) {
+    msDebug("msWCSGetCoverage20(): drawing the coverage in stripes of %d rows.\n", stripe_rows);
+    status = msWCSGetCoverage20_DrawStripes(map, layer, stripe_rows);
+    msFree(bandlist);
+    msWCSClearCoverageMetadata20(&cm);
+    return status;
+  }
+
   /* create the image object  */
   if (!map->outputformat) {
     msWCSClearCoverageMetadata20(&cm);
@@ -1592,6 +1592,7 @@ typedef struct {
   char       *script_url, *script_url_encoded;
   const char *output_mime_type;
   const char *output_schema_format;
+  char       *next_start_key; /* key of the next link STARTKEY, NULL for a STARTINDEX one */
 } WFSGMLInfo;
 
 
@@ -1664,6 +1665,7 @@ static void msWFSGetFeature_PrintBasePrevNextURI(cgiRequestObj *req,
             if (req->ParamNames[i] && req->ParamValues[i] &&
                 strcasecmp(req->ParamNames[i], "MAP") != 0 &&
                 strcasecmp(req->ParamNames[i], "STARTINDEX") != 0 &&
+                strcasecmp(req->ParamNames[i], "STARTKEY") != 0 &&
                 strcasecmp(req->ParamNames[i], "RESULTTYPE") != 0) {
                 if( !bFirstArg )
                     msIO_printf("&amp;");
@@ -1855,7 +1857,9 @@ static int msWFSGetFeature_GMLPreamble( mapObj *map,
             if( iResultTypeHits != 1 )
                 nNextStartIndex += iNumberOfFeatures;
 
-            if( nNextStartIndex > 0 )
+            if( gmlinfo->next_start_key != NULL && iResultTypeHits != 1 )
+                msIO_printf("&amp;STARTKEY=%d.%s", nNextStartIndex, gmlinfo->next_start_key);
+            else if( nNextStartIndex > 0 )
                 msIO_printf("&amp;STARTINDEX=%d", nNextStartIndex);
             msIO_printf("\"");
         }
@@ -2751,6 +2755,7 @@ static void msWFSCleanupGMLInfo(WFSGMLInfo* pgmlinfo)
   free(pgmlinfo->script_url);
   free(pgmlinfo->script_url_encoded);
   msFree(pgmlinfo->user_namespace_uri_encoded);
+  msFree(pgmlinfo->next_start_key);
 }
 
 static int msWFSGetGMLOutputFormat(mapObj *map, wfsParamsObj *paramsObj,
@@ -3118,8 +3123,7 @@ static int msWFSComputeMatchingFeatures(mapObj *map,
             for(j=0; j<map->numlayers; j++) {
                 layerObj* lp = GET_LAYER(map, j);
                 if(lp->resultcache) {
-                    if(lp->resultcache->results) free(lp->resultcache->results);
-                    free(lp->resultcache);
+                    msFreeResultCache(lp->resultcache);
                     lp->resultcache = NULL;
                 }
                 lp->resultcache = saveResultCache[j];
@@ -3324,6 +3328,116 @@ static int msWFSApplySortBy(mapObj* map, wfsParamsObj *paramsObj, layerObj* lp,
     return MS_SUCCESS;
 }
 
+/*
+** msWFSGetKeysetPagingLayer()
+**
+** The layer queried by GetFeature when its driver pages by key rather than
+** by offset (PostGIS PROCESSING "KEYSET_PAGING=ON", no SORTBY): its next
+** links then carry STARTKEY=startindex.key, the key of the last feature of
+** the page, and a request with that token starts after that key. NULL when
+** several layers are queried or unless the layer pages itself.
+*/
+static layerObj *msWFSGetKeysetPagingLayer(mapObj *map)
+{
+  layerObj *lpKeyset = NULL;
+  const char *value;
+  int i;
+
+  for(i=0; i<map->numlayers; i++) {
+    layerObj *lp = GET_LAYER(map, i);
+    if( lp->status != MS_ON )
+      continue;
+    if( lpKeyset != NULL )
+      return NULL;
+    lpKeyset = lp;
+  }
+
+  if( lpKeyset == NULL || lpKeyset->connectiontype != MS_POSTGIS ||
+      lpKeyset->sortBy.nProperties > 0 || !msLayerGetPaging(lpKeyset) )
+    return NULL;
+
+  value = msLayerGetProcessingKey(lpKeyset, "KEYSET_PAGING");
+  if( value == NULL || strcasecmp(value, "ON") != 0 )
+    return NULL;
+
+  return lpKeyset;
+}
+
+/*
+** msWFSParseStartKey()
+**
+** Splits a STARTKEY=startindex.key token into its start index and the
+** (integer) key, a pointer into pszStartKey.
+*/
+static int msWFSParseStartKey(const char *pszStartKey, int *pnStartIndex, const char **ppszKey)
+{
+  char *end = NULL;
+  long startindex = strtol(pszStartKey, &end, 10);
+
+  if( end == pszStartKey || *end != '.' || startindex < 0 || startindex > INT_MAX )
+    return MS_FAILURE;
+
+  *ppszKey = end + 1;
+  (void) strtol(*ppszKey, &end, 10);
+  if( end == *ppszKey || *end != '\0' )
+    return MS_FAILURE;
+
+  *pnStartIndex = (int) startindex;
+  return MS_SUCCESS;
+}
+
+/*
+** msWFSIsStreamingGetFeature()
+**
+** Whether GetFeature writes the features while the layers are scanned
+** (wfs_streaming metadata) rather than querying them first into the result
+** caches and fetching every result again. Only GML output is streamed, and
+** not when WFS 2.0 would need one FeatureCollection per feature type.
+*/
+static int msWFSIsStreamingGetFeature(mapObj *map, wfsParamsObj *paramsObj,
+                                      outputFormatObj *psFormat, int iResultTypeHits,
+                                      int maxfeatures, int numlayers, int nWFSVersion)
+{
+  const char *value = msOWSLookupMetadata(&(map->web.metadata), "F", "streaming");
+
+  if( value == NULL || strcasecmp(value, "true") != 0 )
+    return MS_FALSE;
+
+  if( psFormat != NULL || iResultTypeHits == 1 || maxfeatures == 0 )
+    return MS_FALSE;
+
+  /* the single GetFeatureById response is rewritten once complete */
+  if( paramsObj->countGetFeatureById == 1 )
+    return MS_FALSE;
+
+  if( nWFSVersion >= OWS_2_0_0 && (numlayers > 1 || paramsObj->pszFeatureId != NULL) )
+    return MS_FALSE;
+
+  return MS_TRUE;
+}
+
+/*
+** msWFSIsStreamingOGRGetFeature()
+**
+** Whether GetFeature with wfs_streaming writes the features to an OGR
+** output format as the layers are scanned. Only drivers writing a single
+** file sequentially (GeoJSON, CSV, FlatGeobuf...) can be, see
+** msOGRCanStreamQuery().
+*/
+static int msWFSIsStreamingOGRGetFeature(mapObj *map, outputFormatObj *psFormat,
+                                         int iResultTypeHits, int maxfeatures)
+{
+  const char *value = msOWSLookupMetadata(&(map->web.metadata), "F", "streaming");
+
+  if( value == NULL || strcasecmp(value, "true") != 0 )
+    return MS_FALSE;
+
+  if( psFormat == NULL || iResultTypeHits == 1 || maxfeatures == 0 )
+    return MS_FALSE;
+
+  return msOGRCanStreamQuery(map, psFormat);
+}
+
 /*
 ** msWFSGetFeature()
 */
@@ -3349,6 +3463,10 @@ int msWFSGetFeature(mapObj *map, wfsParamsObj *paramsObj, cgiRequestObj *req,
   int iResultTypeHits = 0;
   int nMatchingFeatures = -1;
   int bHasNextFeatures = MS_FALSE;
+  int bStreaming = MS_FALSE;
+  int *panPaging = NULL;
+  const char *pszStartKey = NULL;
+  layerObj *lpKeyset = NULL;
 
   char** papszGMLGroups = NULL;
   char** papszGMLIncludeItems = NULL;
@@ -3754,9 +3872,34 @@ int msWFSGetFeature(mapObj *map, wfsParamsObj *paramsObj, cgiRequestObj *req,
     outputformat = (OWSGMLVersion) status;
   }
   
+  /* STARTKEY=startindex.key of a keyset paging next link stands for */
+  /* STARTINDEX=startindex, the key only helping a layer that pages by key */
+  if( paramsObj->pszStartKey != NULL )
+  {
+      if( msWFSParseStartKey(paramsObj->pszStartKey, &(paramsObj->nStartIndex),
+                             &pszStartKey) != MS_SUCCESS )
+      {
+          msSetError(MS_WFSERR, "Invalid STARTKEY '%s'.", "msWFSGetFeature()",
+                     paramsObj->pszStartKey);
+          msFreeCharArray(layers, numlayers);
+          msFreeCharArray(papszGMLGroups, map->numlayers);
+          msFreeCharArray(papszGMLIncludeItems, map->numlayers);
+          msFreeCharArray(papszGMLGeometries, map->numlayers);
+          return msWFSException(map, "startkey", MS_OWS_ERROR_INVALID_PARAMETER_VALUE,
+                                paramsObj->pszVersion);
+      }
+  }
+
   msWFSAnalyzeStartIndexAndFeatureCount(map, paramsObj, iResultTypeHits,
                                         &maxfeatures, &startindex);
 
+  if( nWFSVersion >= OWS_2_0_0 )
+  {
+      lpKeyset = msWFSGetKeysetPagingLayer(map);
+      if( lpKeyset != NULL )
+          msLayerSetProcessingKey(lpKeyset, "KEYSET_AFTER", pszStartKey);
+  }
+
   status = msWFSAnalyzeBBOX(map, paramsObj, &bbox, &sBBoxSrs);
   if( status != 0 )
   {
@@ -3772,6 +3915,69 @@ int msWFSGetFeature(mapObj *map, wfsParamsObj *paramsObj, cgiRequestObj *req,
       map->query.only_cache_result_count = MS_TRUE;
   }
 
+  /* A streamed response first only counts the features, for the preamble. */
+  /* Driver paging is disabled meanwhile to get the count past STARTINDEX */
+  /* whichever way it is computed */
+  bStreaming = msWFSIsStreamingGetFeature(map, paramsObj, psFormat, iResultTypeHits,
+                                          maxfeatures, numlayers, nWFSVersion);
+  if( bStreaming )
+  {
+      int i;
+
+      map->query.only_cache_result_count = MS_TRUE;
+      panPaging = (int *) msSmallMalloc(map->numlayers * sizeof(int));
+      for(i=0; i<map->numlayers; i++) {
+        panPaging[i] = msLayerGetPaging(GET_LAYER(map, i));
+        msLayerEnablePaging(GET_LAYER(map, i), MS_FALSE);
+      }
+  }
+
+  /* OGR output needs no count first: the features are written as found */
+  if( msWFSIsStreamingOGRGetFeature(map, psFormat, iResultTypeHits, maxfeatures) )
+  {
+      void *writer;
+
+      writer = msOGRBeginStreamQuery(map, psFormat, MS_TRUE, maxfeatures);
+      if( writer == NULL )
+        status = MS_FAILURE;
+      else
+      {
+        map->query.shapefunc = msOGRWriteStreamShape;
+        map->query.shapefuncdata = writer;
+
+        status = msWFSRetrieveFeatures(map,
+                                       ows_request,
+                                       paramsObj,
+                                       &gmlinfo,
+                                       paramsObj->pszFilter,
+                                       paramsObj->pszBbox != NULL,
+                                       sBBoxSrs,
+                                       bbox,
+                                       paramsObj->pszFeatureId,
+                                       layers,
+                                       numlayers,
+                                       maxfeatures,
+                                       nWFSVersion,
+                                       &iNumberOfFeatures,
+                                       NULL);
+
+        map->query.shapefunc = NULL;
+        map->query.shapefuncdata = NULL;
+        if( msOGREndStreamQuery(writer) != MS_SUCCESS )
+          status = MS_FAILURE;
+      }
+
+      msFreeCharArray(layers, numlayers);
+      msFree(sBBoxSrs);
+      msFreeCharArray(papszGMLGroups, map->numlayers);
+      msFreeCharArray(papszGMLIncludeItems, map->numlayers);
+      msFreeCharArray(papszGMLGeometries, map->numlayers);
+      msWFSCleanupGMLInfo(&gmlinfo);
+      if( status != MS_SUCCESS )
+        return msWFSException(map, "mapserv", MS_OWS_ERROR_NO_APPLICABLE_CODE,
+                              paramsObj->pszVersion );
+      return MS_SUCCESS;
+  }
 
   status = msWFSRetrieveFeatures(map,
                                  ows_request,
@@ -3792,12 +3998,32 @@ int msWFSGetFeature(mapObj *map, wfsParamsObj *paramsObj, cgiRequestObj *req,
   {
       msFreeCharArray(layers, numlayers);
       msFree(sBBoxSrs);
+      msFree(panPaging);
       msFreeCharArray(papszGMLGroups, map->numlayers);
       msFreeCharArray(papszGMLIncludeItems, map->numlayers);
       msFreeCharArray(papszGMLGeometries, map->numlayers);
       return status;
   }
 
+  /* Counts are not limited to the extra feature that tells whether there */
+  /* is a next page */
+  if( bStreaming && maxfeatures >= 0 && iNumberOfFeatures > maxfeatures )
+  {
+      iNumberOfFeatures = maxfeatures;
+      bHasNextFeatures = MS_TRUE;
+  }
+
+  /* The next page of a keyset paging layer starts after its last feature */
+  if( lpKeyset != NULL && !bStreaming && iResultTypeHits == 0 &&
+      lpKeyset->resultcache && lpKeyset->resultcache->numresults > 0 &&
+      lpKeyset->resultcache->results != NULL )
+  {
+      char szKey[32];
+      snprintf(szKey, sizeof(szKey), "%ld",
+               lpKeyset->resultcache->results[lpKeyset->resultcache->numresults-1].shapeindex);
+      gmlinfo.next_start_key = msStrdup(szKey);
+  }
+
   /* ----------------------------------------- */
   /* Now compute nMatchingFeatures for WFS 2.0 */
   /* ----------------------------------------- */
@@ -3812,11 +4038,6 @@ int msWFSGetFeature(mapObj *map, wfsParamsObj *paramsObj, cgiRequestObj *req,
                                                    numlayers,
                                                    nWFSVersion);
 
-  msFreeCharArray(layers, numlayers);
-
-  msFree(sBBoxSrs);
-  sBBoxSrs = NULL;
-
   /*
   ** GML Header generation.
   */
@@ -3852,6 +4073,9 @@ int msWFSGetFeature(mapObj *map, wfsParamsObj *paramsObj, cgiRequestObj *req,
       if( old_context != NULL )
           msIO_restoreOldStdoutContext(old_context);
       msWFSCleanupGMLInfo(&gmlinfo);
+      msFreeCharArray(layers, numlayers);
+      msFree(sBBoxSrs);
+      msFree(panPaging);
       msFreeCharArray(papszGMLGroups, map->numlayers);
       msFreeCharArray(papszGMLIncludeItems, map->numlayers);
       msFreeCharArray(papszGMLGeometries, map->numlayers);
@@ -3956,7 +4180,48 @@ int msWFSGetFeature(mapObj *map, wfsParamsObj *paramsObj, cgiRequestObj *req,
          }
       }
 
-      if( !bWFS2MultipleFeatureCollection )
+      if( bStreaming )
+      {
+        gmlWFSWriterObj *writer;
+        int iStreamedFeatures = 0;
+
+        /* Run the query again, now writing the features as they are found */
+        for(i=0; i<map->numlayers; i++)
+          msLayerEnablePaging(GET_LAYER(map, i), panPaging[i]);
+        msWFSAnalyzeStartIndexAndFeatureCount(map, paramsObj, iResultTypeHits,
+                                              &maxfeatures, &startindex);
+
+        writer = msGMLBeginWFSStream(map, stdout,
+                                     gmlinfo.user_namespace_prefix,
+                                     outputformat,
+                                     nWFSVersion,
+                                     bUseURN,
+                                     iNumberOfFeatures);
+        map->query.shapefunc = msGMLWriteWFSStreamShape;
+        map->query.shapefuncdata = writer;
+
+        status = msWFSRetrieveFeatures(map,
+                                       ows_request,
+                                       paramsObj,
+                                       &gmlinfo,
+                                       paramsObj->pszFilter,
+                                       paramsObj->pszBbox != NULL,
+                                       sBBoxSrs,
+                                       bbox,
+                                       paramsObj->pszFeatureId,
+                                       layers,
+                                       numlayers,
+                                       maxfeatures,
+                                       nWFSVersion,
+                                       &iStreamedFeatures,
+                                       NULL);
+
+        map->query.shapefunc = NULL;
+        map->query.shapefuncdata = NULL;
+        if( msGMLEndWFSStream(writer) != iNumberOfFeatures )
+          msIO_fprintf(stdout, "<!-- WARNING: The number of features changed while the response was written. -->\n");
+      }
+      else if( !bWFS2MultipleFeatureCollection )
       {
         msGMLWriteWFSQuery(map, stdout,
                                     gmlinfo.user_namespace_prefix,
@@ -3986,6 +4251,8 @@ int msWFSGetFeature(mapObj *map, wfsParamsObj *paramsObj, cgiRequestObj *req,
     msFreeMapServObj( mapserv );
 
     if( status != MS_SUCCESS ) {
+      msFreeCharArray(layers, numlayers);
+      msFree(sBBoxSrs);
       msFreeCharArray(papszGMLGroups, map->numlayers);
       msFreeCharArray(papszGMLIncludeItems, map->numlayers);
       msFreeCharArray(papszGMLGeometries, map->numlayers);
@@ -3994,6 +4261,9 @@ int msWFSGetFeature(mapObj *map, wfsParamsObj *paramsObj, cgiRequestObj *req,
     }
   }
 
+  msFreeCharArray(layers, numlayers);
+  msFree(sBBoxSrs);
+  msFree(panPaging);
   msFreeCharArray(papszGMLGroups, map->numlayers);
   msFreeCharArray(papszGMLIncludeItems, map->numlayers);
   msFreeCharArray(papszGMLGeometries, map->numlayers);
@@ -4646,6 +4916,7 @@ void msWFSFreeParamsObj(wfsParamsObj *wfsparams)
     free(wfsparams->pszLanguage);
     free(wfsparams->pszValueReference);
     free(wfsparams->pszStoredQueryId);
+    free(wfsparams->pszStartKey);
 
     free(wfsparams);
   }
@@ -5064,6 +5335,10 @@ int msWFSParseRequest(mapObj *map, cgiRequestObj *request, owsRequestObj *ows_re
         else if (strcasecmp(request->ParamNames[i], "STARTINDEX") == 0)
           wfsparams->nStartIndex = atoi(request->ParamValues[i]);
 
+        /* vendor parameter, see msWFSGetKeysetPagingLayer() */
+        else if( msWFSSetParam(&(wfsparams->pszStartKey), request, i, "STARTKEY") )
+            ;
+
         else if( msWFSSetParam(&(wfsparams->pszBbox), request, i, "BBOX") )
             ;
 
@@ -644,9 +644,14 @@ int msPrepareWFSLayerRequest(int nLayerId, mapObj *map, layerObj *lp,
   /* We'll store the remote server's response to a tmp file. */
   pasReqInfo[(*numRequests)].pszOutputFile = msTmpFile(map, map->mappath, NULL, "tmp.gml");
 
-  /* TODO: Implement Caching of GML responses. There was an older caching
-   * method, but it suffered from a race condition. See #3137.
+  /* wfs_cache_ttl is the number of seconds the response may be served
+   * from the cascaded WMS/WFS cache (see msWMSCacheGet()), which copies
+   * it to this tmp file rather than sharing one file. See #3137.
    */
+  if ((pszTmp = msOWSLookupMetadata(&(lp->metadata),
+                                    "FO", "cache_ttl")) != NULL) {
+    pasReqInfo[(*numRequests)].nCacheTTL = MS_MAX(atoi(pszTmp), 0);
+  }
 
   pasReqInfo[(*numRequests)].pszHTTPCookieData = pszHTTPCookieData;
   pszHTTPCookieData = NULL;
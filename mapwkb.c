@@ -0,0 +1,1101 @@
+/******************************************************************************
+ * $Id$
+ *
+ * Project:  MapServer
+ * Purpose:  WKB geometry reader shared by the database drivers.
+ * Author:   Paul Ramsey <pramsey@cleverelephant.ca>
+ *
+ ******************************************************************************
+ * Copyright (c) 2010 Paul Ramsey
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies of this Software or works derived from this Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ ****************************************************************************/
+
+
+
+/* required for MSVC */
+#define _USE_MATH_DEFINES
+
+#include <string.h>
+#include <math.h>
+#include "mapserver.h"
+#include "mapwkb.h"
+
+#define FP_EPSILON 1e-12
+#define FP_EQ(a, b) (fabs((a)-(b)) < FP_EPSILON)
+#define FP_LEFT -1
+#define FP_RIGHT 1
+#define FP_COLINEAR 0
+
+#define SEGMENT_ANGLE 10.0
+#define SEGMENT_MINPOINTS 10
+
+#define WKBZOFFSET_NONISO 0x80000000
+#define WKBMOFFSET_NONISO 0x40000000
+
+#define HAS_Z   0x1
+#define HAS_M   0x2
+
+
+/*
+** Map the WKB type numbers returned by PostGIS < 2.0 to the
+** valid OGC numbers
+*/
+int wkb_postgis15[WKB_TYPE_COUNT] = {
+  0,
+  WKB_POINT,
+  WKB_LINESTRING,
+  WKB_POLYGON,
+  WKB_MULTIPOINT,
+  WKB_MULTILINESTRING,
+  WKB_MULTIPOLYGON,
+  WKB_GEOMETRYCOLLECTION,
+  WKB_CIRCULARSTRING,
+  WKB_COMPOUNDCURVE,
+  0,0,0,
+  WKB_CURVEPOLYGON,
+  WKB_MULTICURVE,
+  WKB_MULTISURFACE
+};
+
+/*
+** Map the WKB type numbers returned by PostGIS >= 2.0 to the
+** valid OGC numbers
+*/
+int wkb_postgis20[WKB_TYPE_COUNT] = {
+  0,
+  WKB_POINT,
+  WKB_LINESTRING,
+  WKB_POLYGON,
+  WKB_MULTIPOINT,
+  WKB_MULTILINESTRING,
+  WKB_MULTIPOLYGON,
+  WKB_GEOMETRYCOLLECTION,
+  WKB_CIRCULARSTRING,
+  WKB_COMPOUNDCURVE,
+  WKB_CURVEPOLYGON,
+  WKB_MULTICURVE,
+  WKB_MULTISURFACE,
+  0,0,0
+};
+
+/*
+** Expandable pointObj array. The lineObj unfortunately
+** is not useful for this purpose, so we have this one.
+*/
+pointArrayObj*
+pointArrayNew(int maxpoints)
+{
+  pointArrayObj *d = msSmallMalloc(sizeof(pointArrayObj));
+  if ( maxpoints < 1 ) maxpoints = 1; /* Avoid a degenerate case */
+  d->maxpoints = maxpoints;
+  d->data = msSmallMalloc(maxpoints * sizeof(pointObj));
+  d->npoints = 0;
+  return d;
+}
+
+/*
+** Utility function to creal up the pointArrayObj
+*/
+void
+pointArrayFree(pointArrayObj *d)
+{
+  if ( ! d ) return;
+  if ( d->data ) free(d->data);
+  free(d);
+}
+
+/*
+** Add a pointObj to the pointObjArray, allocating
+** extra storage space if we've used up our existing
+** buffer.
+*/
+static int
+pointArrayAddPoint(pointArrayObj *d, const pointObj *p)
+{
+  if ( !p || !d ) return MS_FAILURE;
+  /* Avoid overwriting memory buffer */
+  if ( d->maxpoints - d->npoints == 0 ) {
+    d->maxpoints *= 2;
+    d->data = realloc(d->data, d->maxpoints * sizeof(pointObj));
+  }
+  d->data[d->npoints] = *p;
+  d->npoints++;
+  return MS_SUCCESS;
+}
+
+/*
+** Pass an input type number through the PostGIS version
+** type map array to handle the pre-2.0 incorrect WKB types
+*/
+
+static int
+wkbTypeMap(wkbObj *w, int type, int* pnZMFlag)
+{
+  *pnZMFlag = 0;
+  /* PostGIS >= 2 : ISO SQL/MM style Z types ? */
+  if( type >= 1000 && type < 2000 )
+  {
+    type -= 1000;
+    *pnZMFlag = HAS_Z;
+  }
+  /* PostGIS >= 2 : ISO SQL/MM style M types ? */
+  else if( type >= 2000 && type < 3000 )
+  {
+    type -= 2000;
+    *pnZMFlag = HAS_M;
+  }
+  /* PostGIS >= 2 : ISO SQL/MM style ZM types ? */
+  else if( type >= 3000 && type < 4000 )
+  {
+    type -= 3000;
+    *pnZMFlag = HAS_Z | HAS_M;
+  }
+  /* PostGIS 1.X EWKB : Extended WKB Z or ZM ? */
+  else if( (type & WKBZOFFSET_NONISO) != 0 )
+  {
+    if( (type & WKBMOFFSET_NONISO) != 0 )
+        *pnZMFlag = HAS_Z | HAS_M;
+    else
+        *pnZMFlag = HAS_Z;
+    type &= 0x00FFFFFF;
+  }
+  /* PostGIS 1.X EWKB: Extended WKB M ? */
+  else if( (type & WKBMOFFSET_NONISO) != 0 )
+  {
+    *pnZMFlag = HAS_M;
+    type &= 0x00FFFFFF;
+  }
+  if ( type >= 0 && type < WKB_TYPE_COUNT )
+    return w->typemap[type];
+  else
+    return 0;
+}
+
+/*
+** Read the WKB type number from a wkbObj without
+** advancing the read pointer.
+*/
+static int
+wkbType(wkbObj *w, int* pnZMFlag)
+{
+  int t;
+  memcpy(&t, (w->ptr + 1), sizeof(int));
+  return wkbTypeMap(w,t, pnZMFlag);
+}
+
+/*
+** Read the type number of the first element of a
+** collection without advancing the read pointer.
+*/
+static int
+wkbCollectionSubType(wkbObj *w, int* pnZMFlag)
+{
+  int t;
+  memcpy(&t, (w->ptr + 1 + 4 + 4 + 1), sizeof(int));
+  return wkbTypeMap(w,t, pnZMFlag);
+}
+
+/*
+** Read one byte from the WKB and advance the read pointer
+*/
+static char
+wkbReadChar(wkbObj *w)
+{
+  char c;
+  memcpy(&c, w->ptr, sizeof(char));
+  w->ptr += sizeof(char);
+  return c;
+}
+
+/*
+** Read one integer from the WKB and advance the read pointer.
+** We assume the endianess of the WKB is the same as this machine.
+*/
+static inline int
+wkbReadInt(wkbObj *w)
+{
+  int i;
+  memcpy(&i, w->ptr, sizeof(int));
+  w->ptr += sizeof(int);
+  return i;
+}
+
+/*
+** Read one double from the WKB and advance the read pointer.
+** We assume the endianess of the WKB is the same as this machine.
+*/
+static inline double
+wkbReadDouble(wkbObj *w)
+{
+  double d;
+  memcpy(&d, w->ptr, sizeof(double));
+  w->ptr += sizeof(double);
+  return d;
+}
+
+/*
+** Read one pointObj (two doubles) from the WKB and advance the read pointer.
+** We assume the endianess of the WKB is the same as this machine.
+*/
+static inline void
+wkbReadPointP(wkbObj *w, pointObj *p, int nZMFlag)
+{
+  memcpy(&(p->x), w->ptr, sizeof(double));
+  w->ptr += sizeof(double);
+  memcpy(&(p->y), w->ptr, sizeof(double));
+  w->ptr += sizeof(double);
+  if( nZMFlag & HAS_Z )
+  {
+#ifdef USE_POINT_Z_M
+      memcpy(&(p->z), w->ptr, sizeof(double));
+      if( !(nZMFlag & HAS_M) )
+          p->m = 0.0;
+#endif
+      w->ptr += sizeof(double);
+  }
+  if( nZMFlag & HAS_M )
+  {
+#ifdef USE_POINT_Z_M
+      if( !(nZMFlag & HAS_Z) )
+          p->z = 0.0;
+      memcpy(&(p->m), w->ptr, sizeof(double));
+#endif
+      w->ptr += sizeof(double);
+  }
+
+}
+
+/*
+** Read one pointObj (two doubles) from the WKB and advance the read pointer.
+** We assume the endianess of the WKB is the same as this machine.
+*/
+static inline pointObj
+wkbReadPoint(wkbObj *w, int nZMFlag)
+{
+  pointObj p;
+  wkbReadPointP(w, &p, nZMFlag);
+  return p;
+}
+
+/*
+** Read a "point array" and return an allocated lineObj.
+** A point array is a WKB fragment that starts with a
+** point count, which is followed by that number of doubles * 2.
+** Linestrings, circular strings, polygon rings, all show this
+** form.
+*/
+static void
+wkbReadLine(wkbObj *w, lineObj *line, int nZMFlag)
+{
+  int i;
+  pointObj p;
+  int npoints = wkbReadInt(w);
+
+  line->numpoints = npoints;
+  line->point = msSmallMalloc(npoints * sizeof(pointObj));
+  for ( i = 0; i < npoints; i++ ) {
+    wkbReadPointP(w, &p, nZMFlag);
+    line->point[i] = p;
+  }
+}
+
+/*
+** Advance the read pointer past a geometry without returning any
+** values. Used for skipping un-drawable elements in a collection.
+*/
+static void
+wkbSkipGeometry(wkbObj *w)
+{
+  int type, npoints, nrings, ngeoms, i;
+  int nZMFlag;
+  int nCoordDim;
+  /*endian = */wkbReadChar(w);
+  type = wkbTypeMap(w,wkbReadInt(w), &nZMFlag);
+  nCoordDim = 2 + (((nZMFlag & HAS_Z) != 0) ? 1 : 0) + (((nZMFlag & HAS_M) != 0) ? 1 : 0);
+  switch(type) {
+    case WKB_POINT:
+      w->ptr += nCoordDim * sizeof(double);
+      break;
+    case WKB_CIRCULARSTRING:
+    case WKB_LINESTRING:
+      npoints = wkbReadInt(w);
+      w->ptr += npoints * nCoordDim * sizeof(double);
+      break;
+    case WKB_POLYGON:
+      nrings = wkbReadInt(w);
+      for ( i = 0; i < nrings; i++ ) {
+        npoints = wkbReadInt(w);
+        w->ptr += npoints * nCoordDim * sizeof(double);
+      }
+      break;
+    case WKB_MULTIPOINT:
+    case WKB_MULTILINESTRING:
+    case WKB_MULTIPOLYGON:
+    case WKB_GEOMETRYCOLLECTION:
+    case WKB_COMPOUNDCURVE:
+    case WKB_CURVEPOLYGON:
+    case WKB_MULTICURVE:
+    case WKB_MULTISURFACE:
+      ngeoms = wkbReadInt(w);
+      for ( i = 0; i < ngeoms; i++ ) {
+        wkbSkipGeometry(w);
+      }
+  }
+}
+
+/*
+** Convert a WKB point to a shapeObj, advancing the read pointer as we go.
+*/
+static int
+wkbConvPointToShape(wkbObj *w, shapeObj *shape)
+{
+  int type;
+  lineObj line;
+  int nZMFlag;
+
+  /*endian = */wkbReadChar(w);
+  type = wkbTypeMap(w,wkbReadInt(w),&nZMFlag);
+
+  if( type != WKB_POINT ) return MS_FAILURE;
+
+  if( ! (shape->type == MS_SHAPE_POINT) ) return MS_FAILURE;
+  line.numpoints = 1;
+  line.point = msSmallMalloc(sizeof(pointObj));
+  line.point[0] = wkbReadPoint(w, nZMFlag);
+  msAddLineDirectly(shape, &line);
+  return MS_SUCCESS;
+}
+
+/*
+** Convert a WKB line string to a shapeObj, advancing the read pointer as we go.
+*/
+static int
+wkbConvLineStringToShape(wkbObj *w, shapeObj *shape)
+{
+  int type;
+  lineObj line;
+  int nZMFlag;
+
+  /*endian = */wkbReadChar(w);
+  type = wkbTypeMap(w,wkbReadInt(w), &nZMFlag);
+
+  if( type != WKB_LINESTRING ) return MS_FAILURE;
+
+  wkbReadLine(w,&line, nZMFlag);
+  msAddLineDirectly(shape, &line);
+
+  return MS_SUCCESS;
+}
+
+/*
+** Convert a WKB polygon to a shapeObj, advancing the read pointer as we go.
+*/
+static int
+wkbConvPolygonToShape(wkbObj *w, shapeObj *shape)
+{
+  int type;
+  int i, nrings;
+  lineObj line;
+  int nZMFlag;
+
+  /*endian = */wkbReadChar(w);
+  type = wkbTypeMap(w,wkbReadInt(w), &nZMFlag);
+
+  if( type != WKB_POLYGON ) return MS_FAILURE;
+
+  /* How many rings? */
+  nrings = wkbReadInt(w);
+
+  /* Add each ring to the shape */
+  for( i = 0; i < nrings; i++ ) {
+    wkbReadLine(w,&line, nZMFlag);
+    msAddLineDirectly(shape, &line);
+  }
+
+  return MS_SUCCESS;
+}
+
+/*
+** Convert a WKB curve polygon to a shapeObj, advancing the read pointer as we go.
+** The arc portions of the rings will be stroked to linestrings as they
+** are read by the underlying circular string handling.
+*/
+static int
+wkbConvCurvePolygonToShape(wkbObj *w, shapeObj *shape)
+{
+  int type, i, ncomponents;
+  int failures = 0;
+  int was_poly = ( shape->type == MS_SHAPE_POLYGON );
+  int nZMFlag;
+
+  /*endian = */wkbReadChar(w);
+  type = wkbTypeMap(w,wkbReadInt(w), &nZMFlag);
+  ncomponents = wkbReadInt(w);
+
+  if( type != WKB_CURVEPOLYGON ) return MS_FAILURE;
+
+  /* Lower the allowed dimensionality so we can
+  *  catch the linear ring components */
+  shape->type = MS_SHAPE_LINE;
+
+  for ( i = 0; i < ncomponents; i++ ) {
+    if ( wkbConvGeometryToShape(w, shape) == MS_FAILURE ) {
+      wkbSkipGeometry(w);
+      failures++;
+    }
+  }
+
+  /* Go back to expected dimensionality */
+  if ( was_poly) shape->type = MS_SHAPE_POLYGON;
+
+  if ( failures == ncomponents )
+    return MS_FAILURE;
+  else
+    return MS_SUCCESS;
+}
+
+/*
+** Convert a WKB circular string to a shapeObj, advancing the read pointer as we go.
+** Arcs will be stroked to linestrings.
+*/
+static int
+wkbConvCircularStringToShape(wkbObj *w, shapeObj *shape)
+{
+  int type;
+  int nZMFlag;
+  lineObj line = {0, NULL};
+
+  /*endian = */wkbReadChar(w);
+  type = wkbTypeMap(w,wkbReadInt(w), &nZMFlag);
+
+  if( type != WKB_CIRCULARSTRING ) return MS_FAILURE;
+
+  /* Stroke the string into a point array */
+  if ( arcStrokeCircularString(w, SEGMENT_ANGLE, &line, nZMFlag) == MS_FAILURE ) {
+    if(line.point) free(line.point);
+    return MS_FAILURE;
+  }
+
+  /* Fill in the lineObj */
+  if ( line.numpoints > 0 ) {
+    msAddLine(shape, &line);
+    if(line.point) free(line.point);
+  }
+
+  return MS_SUCCESS;
+}
+
+/*
+** Compound curves need special handling. First we load
+** each component of the curve on the a lineObj in a shape.
+** Then we merge those lineObjs into a single lineObj. This
+** allows compound curves to serve as closed rings in
+** curve polygons.
+*/
+static int
+wkbConvCompoundCurveToShape(wkbObj *w, shapeObj *shape)
+{
+  int npoints = 0;
+  int type, ncomponents, i, j;
+  lineObj line;
+  shapeObj shapebuf;
+  int nZMFlag;
+
+  /*endian = */wkbReadChar(w);
+  type = wkbTypeMap(w,wkbReadInt(w), &nZMFlag);
+
+  /* Init our shape buffer */
+  msInitShape(&shapebuf);
+
+  if( type != WKB_COMPOUNDCURVE ) return MS_FAILURE;
+
+  /* How many components in the compound curve? */
+  ncomponents = wkbReadInt(w);
+
+  /* We'll load each component onto a line in a shape */
+  for( i = 0; i < ncomponents; i++ )
+    wkbConvGeometryToShape(w, &shapebuf);
+
+  /* Do nothing on empty */
+  if ( shapebuf.numlines == 0 )
+    return MS_FAILURE;
+
+  /* Count the total number of points */
+  for( i = 0; i < shapebuf.numlines; i++ )
+    npoints += shapebuf.line[i].numpoints;
+
+  /* Do nothing on empty */
+  if ( npoints == 0 )
+    return MS_FAILURE;
+
+  line.numpoints = npoints;
+  line.point = msSmallMalloc(sizeof(pointObj) * npoints);
+
+  /* Copy in the points */
+  npoints = 0;
+  for ( i = 0; i < shapebuf.numlines; i++ ) {
+    for ( j = 0; j < shapebuf.line[i].numpoints; j++ ) {
+      /* Don't add a start point that duplicates an endpoint */
+      if( j == 0 && i > 0 &&
+          memcmp(&(line.point[npoints - 1]),&(shapebuf.line[i].point[j]),sizeof(pointObj)) == 0 ) {
+        continue;
+      }
+      line.point[npoints++] = shapebuf.line[i].point[j];
+    }
+  }
+  line.numpoints = npoints;
+
+  /* Clean up */
+  msFreeShape(&shapebuf);
+
+  /* Fill in the lineObj */
+  msAddLineDirectly(shape, &line);
+
+  return MS_SUCCESS;
+}
+
+/*
+** Convert a WKB collection string to a shapeObj, advancing the read pointer as we go.
+** Many WKB types (MultiPoint, MultiLineString, MultiPolygon, MultiSurface,
+** MultiCurve, GeometryCollection) can be treated identically as collections
+** (they start with endian, type number and count of sub-elements, then provide the
+** subelements as WKB) so are handled with this one function.
+*/
+static int
+wkbConvCollectionToShape(wkbObj *w, shapeObj *shape)
+{
+  int i, ncomponents;
+  int failures = 0;
+  int nZMFlag;
+
+  /*endian = */wkbReadChar(w);
+  /*type = */wkbTypeMap(w,wkbReadInt(w), &nZMFlag);
+  ncomponents = wkbReadInt(w);
+
+  /*
+  * If we can draw any portion of the collection, we will,
+  * but if all the components fail, we will draw nothing.
+  */
+  for ( i = 0; i < ncomponents; i++ ) {
+    if ( wkbConvGeometryToShape(w, shape) == MS_FAILURE ) {
+      wkbSkipGeometry(w);
+      failures++;
+    }
+  }
+  if ( failures == ncomponents || ncomponents == 0)
+    return MS_FAILURE;
+  else
+    return MS_SUCCESS;
+}
+
+/*
+** Generic handler to switch to the appropriate function for the WKB type.
+** Note that we also handle switching here to avoid processing shapes
+** we will be unable to draw. Example: we can't draw point features as
+** a MS_SHAPE_LINE layer, so if the type is WKB_POINT and the layer is
+** MS_SHAPE_LINE, we exit before converting.
+*/
+int
+wkbConvGeometryToShape(wkbObj *w, shapeObj *shape)
+{
+  int nZMFlag;
+  int wkbtype = wkbType(w, &nZMFlag); /* Peak at the type number */
+
+  switch(wkbtype) {
+      /* Recurse into anonymous collections */
+    case WKB_GEOMETRYCOLLECTION:
+      return wkbConvCollectionToShape(w, shape);
+      /* Handle area types */
+    case WKB_POLYGON:
+      return wkbConvPolygonToShape(w, shape);
+    case WKB_MULTIPOLYGON:
+      return wkbConvCollectionToShape(w, shape);
+    case WKB_CURVEPOLYGON:
+      return wkbConvCurvePolygonToShape(w, shape);
+    case WKB_MULTISURFACE:
+      return wkbConvCollectionToShape(w, shape);
+  }
+
+  /* We can't convert any of the following types into polygons */
+  if ( shape->type == MS_SHAPE_POLYGON ) return MS_FAILURE;
+
+  /* Handle linear types */
+  switch(wkbtype) {
+    case WKB_LINESTRING:
+      return wkbConvLineStringToShape(w, shape);
+    case WKB_CIRCULARSTRING:
+      return wkbConvCircularStringToShape(w, shape);
+    case WKB_COMPOUNDCURVE:
+      return wkbConvCompoundCurveToShape(w, shape);
+    case WKB_MULTILINESTRING:
+      return wkbConvCollectionToShape(w, shape);
+    case WKB_MULTICURVE:
+      return wkbConvCollectionToShape(w, shape);
+  }
+
+  /* We can't convert any of the following types into lines */
+  if ( shape->type == MS_SHAPE_LINE ) return MS_FAILURE;
+
+  /* Handle point types */
+  switch(wkbtype) {
+    case WKB_POINT:
+      return wkbConvPointToShape(w, shape);
+    case WKB_MULTIPOINT:
+      return wkbConvCollectionToShape(w, shape);
+  }
+
+  /* This is a WKB type we don't know about! */
+  return MS_FAILURE;
+}
+
+/*
+** Calculate determinant of a 3x3 matrix. Handy for
+** the circle center calculation.
+*/
+static inline double
+arcDeterminant3x3(double *m)
+{
+  /* This had better be a 3x3 matrix or we'll fall to bits */
+  return m[0] * ( m[4] * m[8] - m[7] * m[5] ) -
+         m[3] * ( m[1] * m[8] - m[7] * m[2] ) +
+         m[6] * ( m[1] * m[5] - m[4] * m[2] );
+}
+
+/*
+** What side of p1->p2 is q on?
+*/
+static inline int
+arcSegmentSide(const pointObj *p1, const pointObj *p2, const pointObj *q)
+{
+  double side = ( (q->x - p1->x) * (p2->y - p1->y) - (p2->x - p1->x) * (q->y - p1->y) );
+  if ( FP_EQ(side,0.0) ) {
+    return FP_COLINEAR;
+  } else {
+    if ( side < 0.0 )
+      return FP_LEFT;
+    else
+      return FP_RIGHT;
+  }
+}
+
+/*
+** Calculate the center of the circle defined by three points.
+** Using matrix approach from http://mathforum.org/library/drmath/view/55239.html
+*/
+int
+arcCircleCenter(const pointObj *p1, const pointObj *p2, const pointObj *p3, pointObj *center, double *radius)
+{
+  pointObj c;
+  double r;
+
+  /* Components of the matrices. */
+  double x1sq = p1->x * p1->x;
+  double x2sq = p2->x * p2->x;
+  double x3sq = p3->x * p3->x;
+  double y1sq = p1->y * p1->y;
+  double y2sq = p2->y * p2->y;
+  double y3sq = p3->y * p3->y;
+  double matrix_num_x[9];
+  double matrix_num_y[9];
+  double matrix_denom[9];
+
+  /* Intialize matrix_num_x */
+  matrix_num_x[0] = x1sq+y1sq;
+  matrix_num_x[1] = p1->y;
+  matrix_num_x[2] = 1.0;
+  matrix_num_x[3] = x2sq+y2sq;
+  matrix_num_x[4] = p2->y;
+  matrix_num_x[5] = 1.0;
+  matrix_num_x[6] = x3sq+y3sq;
+  matrix_num_x[7] = p3->y;
+  matrix_num_x[8] = 1.0;
+
+  /* Intialize matrix_num_y */
+  matrix_num_y[0] = p1->x;
+  matrix_num_y[1] = x1sq+y1sq;
+  matrix_num_y[2] = 1.0;
+  matrix_num_y[3] = p2->x;
+  matrix_num_y[4] = x2sq+y2sq;
+  matrix_num_y[5] = 1.0;
+  matrix_num_y[6] = p3->x;
+  matrix_num_y[7] = x3sq+y3sq;
+  matrix_num_y[8] = 1.0;
+
+  /* Intialize matrix_denom */
+  matrix_denom[0] = p1->x;
+  matrix_denom[1] = p1->y;
+  matrix_denom[2] = 1.0;
+  matrix_denom[3] = p2->x;
+  matrix_denom[4] = p2->y;
+  matrix_denom[5] = 1.0;
+  matrix_denom[6] = p3->x;
+  matrix_denom[7] = p3->y;
+  matrix_denom[8] = 1.0;
+
+  /* Circle is closed, so p2 must be opposite p1 & p3. */
+  if ( FP_EQ(p1->x,p3->x) && FP_EQ(p1->y,p3->y) ) {
+    c.x = (p1->x + p2->x) / 2.0;
+    c.y = (p1->y + p2->y) / 2.0;
+    r = sqrt( (p1->x - p2->x) * (p1->x - p2->x) + (p1->y - p2->y) * (p1->y - p2->y) ) / 2.0;
+  }
+  /* There is no circle here, the points are actually co-linear */
+  else if ( arcSegmentSide(p1, p3, p2) == FP_COLINEAR ) {
+    return MS_FAILURE;
+  }
+  /* Calculate the center and radius. */
+  else {
+    double denom = 2.0 * arcDeterminant3x3(matrix_denom);
+    /* Center components */
+    c.x = arcDeterminant3x3(matrix_num_x) / denom;
+    c.y = arcDeterminant3x3(matrix_num_y) / denom;
+
+    /* Radius */
+    r = sqrt((p1->x-c.x) * (p1->x-c.x) + (p1->y-c.y) * (p1->y-c.y));
+  }
+
+  if ( radius ) *radius = r;
+  if ( center ) *center = c;
+
+  return MS_SUCCESS;
+}
+
+/*
+** Write a stroked version of the circle defined by three points into a
+** point buffer. The segment_angle (degrees) is the coverage of each stroke segment,
+** and depending on whether this is the first arc in a circularstring,
+** you might want to include_first
+*/
+int
+arcStrokeCircle(const pointObj *p1, const pointObj *p2, const pointObj *p3,
+                double segment_angle, int include_first, pointArrayObj *pa)
+{
+  pointObj center; /* Center of our circular arc */
+  double radius; /* Radius of our circular arc */
+  double sweep_angle_r; /* Total angular size of our circular arc in radians */
+  double segment_angle_r; /* Segment angle in radians */
+  double a1, /*a2,*/ a3; /* Angles represented by p1, p2, p3 relative to center */
+  int side = arcSegmentSide(p1, p3, p2); /* What side of p1,p3 is the middle point? */
+  int num_edges; /* How many edges we will be generating */
+  double current_angle_r; /* What angle are we generating now (radians)? */
+  int i; /* Counter */
+  pointObj p; /* Temporary point */
+  int is_closed = MS_FALSE;
+
+  /* We need to know if we're dealing with a circle early */
+  if ( FP_EQ(p1->x, p3->x) && FP_EQ(p1->y, p3->y) )
+    is_closed = MS_TRUE;
+
+  /* Check if the "arc" is actually straight */
+  if ( ! is_closed && side == FP_COLINEAR ) {
+    /* We just need to write in the end points */
+    if ( include_first )
+      pointArrayAddPoint(pa, p1);
+    pointArrayAddPoint(pa, p3);
+    return MS_SUCCESS;
+  }
+
+  /* We should always be able to find the center of a non-linear arc */
+  if ( arcCircleCenter(p1, p2, p3, &center, &radius) == MS_FAILURE )
+    return MS_FAILURE;
+
+  /* Calculate the angles that our three points represent */
+  a1 = atan2(p1->y - center.y, p1->x - center.x);
+  /* UNUSED
+  a2 = atan2(p2->y - center.y, p2->x - center.x);
+   */
+  a3 = atan2(p3->y - center.y, p3->x - center.x);
+  segment_angle_r = M_PI * segment_angle / 180.0;
+
+  /* Closed-circle case, we sweep the whole circle! */
+  if ( is_closed ) {
+    sweep_angle_r = 2.0 * M_PI;
+  }
+  /* Clockwise sweep direction */
+  else if ( side == FP_LEFT ) {
+    if ( a3 > a1 ) /* Wrapping past 180? */
+      sweep_angle_r = a1 + (2.0 * M_PI - a3);
+    else
+      sweep_angle_r = a1 - a3;
+  }
+  /* Counter-clockwise sweep direction */
+  else if ( side == FP_RIGHT ) {
+    if ( a3 > a1 ) /* Wrapping past 180? */
+      sweep_angle_r = a3 - a1;
+    else
+      sweep_angle_r = a3 + (2.0 * M_PI - a1);
+  } else
+    sweep_angle_r = 0.0;
+
+  /* We don't have enough resolution, let's invert our strategy. */
+  if ( (sweep_angle_r / segment_angle_r) < SEGMENT_MINPOINTS ) {
+    segment_angle_r = sweep_angle_r / (SEGMENT_MINPOINTS + 1);
+  }
+
+  /* We don't have enough resolution to stroke this arc,
+  *  so just join the start to the end. */
+  if ( sweep_angle_r < segment_angle_r ) {
+    if ( include_first )
+      pointArrayAddPoint(pa, p1);
+    pointArrayAddPoint(pa, p3);
+    return MS_SUCCESS;
+  }
+
+  /* How many edges to generate (we add the final edge
+  *  by sticking on the last point */
+  num_edges = floor(sweep_angle_r / fabs(segment_angle_r));
+
+  /* Go backwards (negative angular steps) if we are stroking clockwise */
+  if ( side == FP_LEFT )
+    segment_angle_r *= -1;
+
+  /* What point should we start with? */
+  if( include_first ) {
+    current_angle_r = a1;
+  } else {
+    current_angle_r = a1 + segment_angle_r;
+    num_edges--;
+  }
+
+  /* For each edge, increment or decrement by our segment angle */
+  for( i = 0; i < num_edges; i++ ) {
+    if (segment_angle_r > 0.0 && current_angle_r > M_PI)
+      current_angle_r -= 2*M_PI;
+    if (segment_angle_r < 0.0 && current_angle_r < -1*M_PI)
+      current_angle_r -= 2*M_PI;
+    p.x = center.x + radius*cos(current_angle_r);
+    p.y = center.y + radius*sin(current_angle_r);
+    pointArrayAddPoint(pa, &p);
+    current_angle_r += segment_angle_r;
+  }
+
+  /* Add the last point */
+  pointArrayAddPoint(pa, p3);
+  return MS_SUCCESS;
+}
+
+/*
+** This function does not actually take WKB as input, it takes the
+** WKB starting from the numpoints integer. Each three-point edge
+** is stroked into a linestring and appended into the lineObj
+** argument.
+*/
+int
+arcStrokeCircularString(wkbObj *w, double segment_angle, lineObj *line, int nZMFlag)
+{
+  pointObj p1, p2, p3;
+  int npoints, nedges;
+  int edge = 0;
+  pointArrayObj *pa;
+
+  if ( ! w || ! line ) return MS_FAILURE;
+
+  npoints = wkbReadInt(w);
+  nedges = npoints / 2;
+
+  /* All CircularStrings have an odd number of points */
+  if ( npoints < 3 || npoints % 2 != 1 )
+    return MS_FAILURE;
+
+  /* Make a large guess at how much space we'll need */
+  pa = pointArrayNew(nedges * 180 / segment_angle);
+
+  wkbReadPointP(w,&p3,nZMFlag);
+
+  /* Fill out the point array with stroked arcs */
+  while( edge < nedges ) {
+    p1 = p3;
+    wkbReadPointP(w,&p2,nZMFlag);
+    wkbReadPointP(w,&p3,nZMFlag);
+    if ( arcStrokeCircle(&p1, &p2, &p3, segment_angle, edge ? 0 : 1, pa) == MS_FAILURE ) {
+      pointArrayFree(pa);
+      return MS_FAILURE;
+    }
+    edge++;
+  }
+
+  /* Copy the point array into the line */
+  line->numpoints = pa->npoints;
+  line->point = msSmallMalloc(line->numpoints * sizeof(pointObj));
+  memcpy(line->point, pa->data, line->numpoints * sizeof(pointObj));
+
+  /* Clean up */
+  pointArrayFree(pa);
+
+  return MS_SUCCESS;
+}
+
+
+/*
+** For LAYER types that are not the usual ones (charts,
+** annotations, etc) we will convert to a shape type
+** that "makes sense" given the WKB input. We do this
+** by peaking at the type number of the first collection
+** sub-element.
+*/
+int
+wkbFindBestType(wkbObj *w, shapeObj *shape)
+{
+  int wkbtype;
+  int nZMFlag;
+
+  /* What kind of geometry is this? */
+  wkbtype = wkbType(w, &nZMFlag);
+
+  /* Generic collection, we need to look a little deeper. */
+  if ( wkbtype == WKB_GEOMETRYCOLLECTION )
+    wkbtype = wkbCollectionSubType(w, &nZMFlag);
+
+  switch ( wkbtype ) {
+    case WKB_POLYGON:
+    case WKB_CURVEPOLYGON:
+    case WKB_MULTIPOLYGON:
+      shape->type = MS_SHAPE_POLYGON;
+      break;
+    case WKB_LINESTRING:
+    case WKB_CIRCULARSTRING:
+    case WKB_COMPOUNDCURVE:
+    case WKB_MULTICURVE:
+    case WKB_MULTILINESTRING:
+      shape->type = MS_SHAPE_LINE;
+      break;
+    case WKB_POINT:
+    case WKB_MULTIPOINT:
+      shape->type = MS_SHAPE_POINT;
+      break;
+    default:
+      return MS_FAILURE;
+  }
+
+  return wkbConvGeometryToShape(w, shape);
+}
+
+/*
+** Swap a 4 or 8 byte word of the WKB in place.
+*/
+static void
+wkbSwapBytes(unsigned char *p, int n)
+{
+  int i;
+  unsigned char c;
+  for ( i = 0; i < n / 2; i++ ) {
+    c = p[i];
+    p[i] = p[n - 1 - i];
+    p[n - 1 - i] = c;
+  }
+}
+
+/*
+** Read a WKB integer in the given byte order, write it back in the byte
+** order of this machine and advance the pointer.
+*/
+static unsigned int
+wkbNativeInt(unsigned char **p, int swap)
+{
+  unsigned int i;
+  if ( swap ) wkbSwapBytes(*p, 4);
+  memcpy(&i, *p, 4);
+  *p += 4;
+  return i;
+}
+
+static int
+wkbNativeGeometry(unsigned char **p, const unsigned char *end, unsigned char order, int depth)
+{
+  unsigned int type, n, i, j, nrings;
+  int swap, ndims = 2;
+
+  if ( depth > 32 || end - *p < 5 ) return MS_FAILURE;
+  swap = ( (*p)[0] != order );
+  (*p)[0] = order;
+  (*p)++;
+  type = wkbNativeInt(p, swap);
+
+  /* ISO SQL/MM or extended WKB dimensions, as in wkbTypeMap() */
+  if ( type >= 1000 && type < 4000 ) {
+    ndims += ( type >= 3000 ) ? 2 : 1;
+    type %= 1000;
+  } else {
+    if ( type & WKBZOFFSET_NONISO ) ndims++;
+    if ( type & WKBMOFFSET_NONISO ) ndims++;
+    type &= 0x00FFFFFF;
+  }
+
+  switch ( type ) {
+    case WKB_POINT:
+      if ( end - *p < 8 * ndims ) return MS_FAILURE;
+      for ( j = 0; j < (unsigned int)ndims; j++, *p += 8 )
+        if ( swap ) wkbSwapBytes(*p, 8);
+      return MS_SUCCESS;
+    case WKB_LINESTRING:
+    case WKB_CIRCULARSTRING:
+    case WKB_POLYGON:
+      nrings = 1;
+      if ( type == WKB_POLYGON ) {
+        if ( end - *p < 4 ) return MS_FAILURE;
+        nrings = wkbNativeInt(p, swap);
+      }
+      for ( i = 0; i < nrings; i++ ) {
+        if ( end - *p < 4 ) return MS_FAILURE;
+        n = wkbNativeInt(p, swap);
+        if ( n > (size_t)(end - *p) / (8 * ndims) ) return MS_FAILURE;
+        for ( j = 0; j < n * ndims; j++, *p += 8 )
+          if ( swap ) wkbSwapBytes(*p, 8);
+      }
+      return MS_SUCCESS;
+    case WKB_MULTIPOINT:
+    case WKB_MULTILINESTRING:
+    case WKB_MULTIPOLYGON:
+    case WKB_GEOMETRYCOLLECTION:
+    case WKB_COMPOUNDCURVE:
+    case WKB_CURVEPOLYGON:
+    case WKB_MULTICURVE:
+    case WKB_MULTISURFACE:
+      if ( end - *p < 4 ) return MS_FAILURE;
+      n = wkbNativeInt(p, swap);
+      for ( i = 0; i < n; i++ )
+        if ( wkbNativeGeometry(p, end, order, depth + 1) != MS_SUCCESS )
+          return MS_FAILURE;
+      return MS_SUCCESS;
+  }
+
+  /* This is a WKB type we don't know about! */
+  return MS_FAILURE;
+}
+
+/*
+** The readers above assume the WKB is in the byte order of this machine,
+** which PostGIS can be asked for but other databases (Oracle) do not
+** offer. Rewrite a WKB geometry of the given size in place to that byte
+** order, checking it along the way: a geometry which passes can be read
+** without going past its end.
+*/
+int
+wkbToNativeByteOrder(char *wkb, size_t size)
+{
+  int one = 1;
+  unsigned char *p = (unsigned char *)wkb;
+  unsigned char order = ( *((char *)&one) == 1 ) ? 1 : 0; /* NDR : XDR */
+
+  if ( wkbNativeGeometry(&p, p + size, order, 0) != MS_SUCCESS ) {
+    msSetError(MS_MISCERR, "Invalid or truncated WKB geometry.", "wkbToNativeByteOrder()");
+    return MS_FAILURE;
+  }
+  return MS_SUCCESS;
+}
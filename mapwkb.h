@@ -0,0 +1,103 @@
+/******************************************************************************
+ * $Id$
+ *
+ * Project:  MapServer
+ * Purpose:  WKB geometry reader shared by the database drivers.
+ * Author:   Paul Ramsey <pramsey@cleverelephant.ca>
+ *
+ ******************************************************************************
+ * Copyright (c) 2010 Paul Ramsey
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies of this Software or works derived from this Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ ****************************************************************************/
+
+#ifndef MAPWKB_H
+#define MAPWKB_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+** Utility structure for handling the WKB returned by the database while
+** reading.
+*/
+typedef struct {
+  char *wkb; /* Pointer to front of WKB */
+  char *ptr; /* Pointer to current write point */
+  size_t size; /* Size of allocated space */
+  int *typemap; /* Look-up array to valid OGC types */
+} wkbObj;
+
+/*
+** Utility structure used when building up stroked lines while
+** handling curved feature types.
+*/
+typedef struct {
+  pointObj *data; /* Re-sizeable point buffer */
+  int npoints;  /* How many points are we currently storing */
+  int maxpoints; /* How big is our point buffer */
+} pointArrayObj;
+
+/*
+** All the WKB type numbers from the OGC
+*/
+typedef enum {
+  WKB_POINT=1,
+  WKB_LINESTRING=2,
+  WKB_POLYGON=3,
+  WKB_MULTIPOINT=4,
+  WKB_MULTILINESTRING=5,
+  WKB_MULTIPOLYGON=6,
+  WKB_GEOMETRYCOLLECTION=7,
+  WKB_CIRCULARSTRING=8,
+  WKB_COMPOUNDCURVE=9,
+  WKB_CURVEPOLYGON=10,
+  WKB_MULTICURVE=11,
+  WKB_MULTISURFACE=12
+} wkb_typenum;
+
+/*
+** Size of the type maps below.
+*/
+#define WKB_TYPE_COUNT 16
+
+/*
+** Map the WKB type numbers returned by PostGIS < 2.0 and >= 2.0
+** to the valid OGC numbers, see mapwkb.c
+*/
+extern int wkb_postgis15[WKB_TYPE_COUNT];
+extern int wkb_postgis20[WKB_TYPE_COUNT];
+
+
+/*
+** Prototypes
+*/
+int arcStrokeCircularString(wkbObj *w, double segment_angle, lineObj *line, int pnZMFlag);
+int wkbConvGeometryToShape(wkbObj *w, shapeObj *shape);
+int wkbFindBestType(wkbObj *w, shapeObj *shape);
+int wkbToNativeByteOrder(char *wkb, size_t size);
+pointArrayObj* pointArrayNew(int maxpoints);
+void pointArrayFree(pointArrayObj *d);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MAPWKB_H */
@@ -1094,6 +1094,7 @@ int msWMSLoadGetMapParams(mapObj *map, int nVersion,
                strncasecmp(format->driver, "GDAL/", 5) != 0 &&
                strncasecmp(format->driver, "AGG/", 4) != 0 &&
                strncasecmp(format->driver, "UTFGRID", 7) != 0 &&
+               strncasecmp(format->driver, "MVT", 3) != 0 &&
                strncasecmp(format->driver, "CAIRO/", 6) != 0 &&
                strncasecmp(format->driver, "OGL/", 4) != 0 &&
                strncasecmp(format->driver, "KML", 3) != 0 &&
@@ -3611,6 +3612,7 @@ int msWMSGetMap(mapObj *map, int nVersion, char **names, char **values, int nume
   int i = 0;
   int sldrequested = MS_FALSE,  sldspatialfilter = MS_FALSE;
   const char *http_max_age;
+  msCoalesceObj *coalesce = NULL;
 
   /* __TODO__ msDrawMap() will try to adjust the extent of the map */
   /* to match the width/height image ratio. */
@@ -3644,6 +3646,21 @@ int msWMSGetMap(mapObj *map, int nVersion, char **names, char **values, int nume
     if (!msIntegerInArray(GET_LAYER(map, i)->index, ows_request->enabled_layers, ows_request->numlayers))
       GET_LAYER(map, i)->status = MS_OFF;
 
+  /* identical concurrent GetMap requests are rendered once */
+  if (strcasecmp(map->imagetype, "application/openlayers")!=0) {
+    coalesce = msCoalesceBegin(map, ows_request->mapfile, names, values, numentries);
+    if (msCoalesceGetMimeType(coalesce)) {
+      if( (http_max_age = msOWSLookupMetadata(&(map->web.metadata), "MO", "http_max_age")) ) {
+        msIO_setHeader("Cache-Control","max-age=%s", http_max_age);
+      }
+      msIO_setHeader("Content-Type", "%s", msCoalesceGetMimeType(coalesce));
+      msIO_sendHeaders();
+      i = msCoalesceWrite(coalesce);
+      msCoalesceEnd(coalesce);
+      return i;
+    }
+  }
+
   if (sldrequested && sldspatialfilter) {
     /* set the quermap style so that only selected features will be retruned */
     map->querymap.status = MS_ON;
@@ -3680,8 +3697,10 @@ int msWMSGetMap(mapObj *map, int nVersion, char **names, char **values, int nume
 
   } else
     img = msDrawMap(map, MS_FALSE);
-  if (img == NULL)
+  if (img == NULL) {
+    msCoalesceEnd(coalesce);
     return msWMSException(map, nVersion, NULL, wms_exception_format);
+  }
 
   /* Set the HTTP Cache-control headers if they are defined
      in the map object */
@@ -3691,17 +3710,29 @@ int msWMSGetMap(mapObj *map, int nVersion, char **names, char **values, int nume
   }
 
   if (strcasecmp(map->imagetype, "application/openlayers")!=0) {
+    const char *mimetype;
     if(!strcmp(MS_IMAGE_MIME_TYPE(map->outputformat), "application/json")) {
-      msIO_setHeader("Content-Type","application/json; charset=utf-8");
+      mimetype = "application/json; charset=utf-8";
     } else {
       msOutputFormatResolveFromImage( map, img );
-      msIO_setHeader("Content-Type", "%s", MS_IMAGE_MIME_TYPE(map->outputformat));
+      mimetype = MS_IMAGE_MIME_TYPE(map->outputformat);
     }
+    msIO_setHeader("Content-Type", "%s", mimetype);
     msIO_sendHeaders();
-    if (msSaveImage(map, img, NULL) != MS_SUCCESS) {
+    if (coalesce) {
+      unsigned char *data;
+      int size;
+      i = msSaveImageCapture(map, img, &data, &size);
+      msCoalesceSetImage(coalesce, data, size, mimetype);
+      msFree(data);
+    } else
+      i = msSaveImage(map, img, NULL);
+    if (i != MS_SUCCESS) {
+      msCoalesceEnd(coalesce);
       msFreeImage(img);
       return msWMSException(map, nVersion, NULL, wms_exception_format);
     }
+    msCoalesceEnd(coalesce);
   }
   msFreeImage(img);
 
@@ -3780,7 +3811,7 @@ int msDumpResult(mapObj *map, int bFormatHtml, int nVersion, char *wms_exception
       shapeObj shape;
 
       msInitShape(&shape);
-      if (msLayerGetShape(lp, &shape, &(lp->resultcache->results[j])) != MS_SUCCESS) {
+      if (msLayerGetResultShape(lp, &shape, j) != MS_SUCCESS) {
         if (tag != NULL) msFree(tag);
         msFree(itemvisible);
         return msWMSException(map, nVersion, NULL, wms_exception_format);
@@ -31,9 +31,14 @@
 #include "maperror.h"
 #include "mapogcsld.h"
 #include "mapows.h"
+#include "mapthread.h"
+#include "uthash.h"
 
 #include <time.h>
 #include <ctype.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 
 #if defined(_WIN32) && !defined(__CYGWIN__)
 #include <process.h>
@@ -710,6 +715,54 @@ msBuildWMSLayerURL(mapObj *map, layerObj *lp, int nRequestType,
     msFree(ows_srs);
   }
 
+  /* -------------------------------------------------------------------- */
+  /*      With wms_cache_grid "size [originx originy]" (in the layer      */
+  /*      SRS) expand the BBOX to the grid so that nearby views send      */
+  /*      the same request to the remote server, and hit the cache.      */
+  /* -------------------------------------------------------------------- */
+  if( nRequestType == WMS_GETMAP && bbox_width != 0 && bbox_height != 0 &&
+      msOWSLookupMetadata(&(lp->metadata), "MO", "cache_grid") != NULL ) {
+    const char *pszGrid = msOWSLookupMetadata(&(lp->metadata), "MO", "cache_grid");
+    char **tokens;
+    int n;
+
+    tokens = msStringSplit(pszGrid, ' ', &n);
+    if( tokens && (n == 1 || n == 3) && atof(tokens[0]) > 0 ) {
+      double size = atof(tokens[0]);
+      double originx = (n == 3) ? atof(tokens[1]) : 0;
+      double originy = (n == 3) ? atof(tokens[2]) : 0;
+      double cellsize_x = (bbox.maxx-bbox.minx) / bbox_width;
+      double cellsize_y = (bbox.maxy-bbox.miny) / bbox_height;
+      rectObj snapped;
+      int snapped_width, snapped_height;
+
+      snapped.minx = originx + floor((bbox.minx - originx) / size) * size;
+      snapped.miny = originy + floor((bbox.miny - originy) / size) * size;
+      snapped.maxx = originx + ceil((bbox.maxx - originx) / size) * size;
+      snapped.maxy = originy + ceil((bbox.maxy - originy) / size) * size;
+      snapped_width = MS_NINT((snapped.maxx - snapped.minx) / cellsize_x);
+      snapped_height = MS_NINT((snapped.maxy - snapped.miny) / cellsize_y);
+
+      if( snapped_width > 0 && snapped_height > 0 &&
+          snapped_width <= map->maxsize && snapped_height <= map->maxsize ) {
+        if (lp->debug)
+          msDebug("wms_cache_grid: BBOX snapped to %.15g,%.15g,%.15g,%.15g (%dx%d).\n",
+                  snapped.minx, snapped.miny, snapped.maxx, snapped.maxy,
+                  snapped_width, snapped_height);
+        bbox = snapped;
+        bbox_width = snapped_width;
+        bbox_height = snapped_height;
+
+        /* the response covers more than the map, like a clipped one (#4931) */
+        if(msLayerGetProcessingKey(lp, "RESAMPLE") == NULL) {
+          msLayerSetProcessingKey(lp, "RESAMPLE", "nearest");
+        }
+      }
+    } else if (lp->debug)
+      msDebug("Invalid wms_cache_grid metadata '%s', ignored.\n", pszGrid);
+    msFreeCharArray(tokens, n);
+  }
+
   /* -------------------------------------------------------------------- */
   /*      Potentially return the bbox.                                    */
   /* -------------------------------------------------------------------- */
@@ -904,7 +957,7 @@ int msPrepareWMSLayerRequest(int nLayerId, mapObj *map, layerObj *lp,
   const char *pszTmp;
   rectObj bbox;
   int bbox_width, bbox_height;
-  int nTimeout, bOkToMerge, bForceSeparateRequest, bCacheToDisk;
+  int nTimeout, bOkToMerge, bForceSeparateRequest, bCacheToDisk, nCacheTTL;
   wmsParamsObj sThisWMSParams;
 
   if (lp->connectiontype != MS_WMS)
@@ -1002,6 +1055,16 @@ int msPrepareWMSLayerRequest(int nLayerId, mapObj *map, layerObj *lp,
     nTimeout = atoi(pszTmp);
   }
 
+  /* ------------------------------------------------------------------
+   * wms_cache_ttl is the number of seconds the GetMap response may be
+   * served from the cascaded WMS cache (see msWMSCacheGet()).
+   * ------------------------------------------------------------------ */
+  nCacheTTL = 0;
+  if (nRequestType == WMS_GETMAP &&
+      (pszTmp = msOWSLookupMetadata(&(lp->metadata), "MO", "cache_ttl")) != NULL) {
+    nCacheTTL = MS_MAX(atoi(pszTmp), 0);
+  }
+
   /* ------------------------------------------------------------------
    * Check if we want to use in memory images instead of writing to disk.
    * ------------------------------------------------------------------ */
@@ -1146,6 +1209,8 @@ int msPrepareWMSLayerRequest(int nLayerId, mapObj *map, layerObj *lp,
     pasReqInfo[(*numRequests)-1].debug |= lp->debug;
     if (nTimeout > pasReqInfo[(*numRequests)-1].nTimeout)
       pasReqInfo[(*numRequests)-1].nTimeout = nTimeout;
+    if (nCacheTTL < pasReqInfo[(*numRequests)-1].nCacheTTL)
+      pasReqInfo[(*numRequests)-1].nCacheTTL = nCacheTTL;
   } else {
     /* ------------------------------------------------------------------
      * Add a request to the array (already preallocated)
@@ -1163,6 +1228,7 @@ int msPrepareWMSLayerRequest(int nLayerId, mapObj *map, layerObj *lp,
       pasReqInfo[(*numRequests)].pszOutputFile = NULL;
     pasReqInfo[(*numRequests)].nStatus = 0;
     pasReqInfo[(*numRequests)].nTimeout = nTimeout;
+    pasReqInfo[(*numRequests)].nCacheTTL = nCacheTTL;
     pasReqInfo[(*numRequests)].bbox   = bbox;
     pasReqInfo[(*numRequests)].width  = bbox_width;
     pasReqInfo[(*numRequests)].height = bbox_height;
@@ -1533,3 +1599,319 @@ int msWMSLayerExecuteRequest(mapObj *map, int nOWSLayers, int nClickX, int nClic
 #endif /* USE_WMS_LYR */
 
 }
+
+/**********************************************************************
+ *                    Cascaded WMS response cache
+ *
+ * The GetMap responses of layers with a wms_cache_ttl metadata (in
+ * seconds) are kept in a process wide LRU of CONFIG
+ * "MS_WMS_CACHE_MEMORY" MB and/or in the CONFIG "MS_WMS_CACHE_DIR"
+ * directory, keyed on the final upstream URL, and served while younger
+ * than the TTL. wms_cache_grid makes the requests of nearby views
+ * identical, see msBuildWMSLayerURL(). The GetFeature responses of WFS
+ * client layers with a wfs_cache_ttl metadata share the same cache.
+ **********************************************************************/
+
+#if defined(USE_WMS_LYR) || defined(USE_WFS_LYR)
+
+typedef struct wmsCachedResponseObj {
+  char *key;
+  unsigned char *data;
+  int size;
+  char *mimetype;
+  time_t created;
+  struct wmsCachedResponseObj *prev, *next; /* LRU list, most recent first */
+  UT_hash_handle hh;
+} wmsCachedResponseObj;
+
+/* protected by TLOCK_WMSCACHE */
+static wmsCachedResponseObj *wms_responses = NULL;
+static wmsCachedResponseObj *wms_responses_head = NULL, *wms_responses_tail = NULL;
+static size_t wms_responses_bytes = 0;
+
+static void msWMSCacheUnlink(wmsCachedResponseObj *resp)
+{
+  if(resp->prev) resp->prev->next = resp->next;
+  else wms_responses_head = resp->next;
+  if(resp->next) resp->next->prev = resp->prev;
+  else wms_responses_tail = resp->prev;
+  resp->prev = resp->next = NULL;
+}
+
+static void msWMSCacheLinkFront(wmsCachedResponseObj *resp)
+{
+  resp->prev = NULL;
+  resp->next = wms_responses_head;
+  if(wms_responses_head) wms_responses_head->prev = resp;
+  wms_responses_head = resp;
+  if(!wms_responses_tail) wms_responses_tail = resp;
+}
+
+static void msWMSCacheRemove(wmsCachedResponseObj *resp)
+{
+  UT_HASH_DEL(wms_responses, resp);
+  msWMSCacheUnlink(resp);
+  wms_responses_bytes -= resp->size;
+  free(resp->key);
+  free(resp->data);
+  free(resp->mimetype);
+  free(resp);
+}
+
+static void msWMSCacheInsert(const char *key, const unsigned char *data, int size,
+                             const char *mimetype, time_t created, size_t limit)
+{
+  wmsCachedResponseObj *resp;
+
+  if((size_t) size > limit)
+    return;
+
+  msAcquireLock(TLOCK_WMSCACHE);
+  UT_HASH_FIND_STR(wms_responses, key, resp);
+  if(resp)
+    msWMSCacheRemove(resp);
+  while(wms_responses_tail && wms_responses_bytes + size > limit)
+    msWMSCacheRemove(wms_responses_tail);
+
+  resp = (wmsCachedResponseObj *) msSmallCalloc(1, sizeof(wmsCachedResponseObj));
+  resp->key = msStrdup(key);
+  resp->data = (unsigned char *) msSmallMalloc(size);
+  memcpy(resp->data, data, size);
+  resp->size = size;
+  resp->mimetype = msStrdup(mimetype);
+  resp->created = created;
+  UT_HASH_ADD_KEYPTR(hh, wms_responses, resp->key, strlen(resp->key), resp);
+  msWMSCacheLinkFront(resp);
+  wms_responses_bytes += size;
+  msReleaseLock(TLOCK_WMSCACHE);
+}
+
+/* the URL and whatever else is sent that may change the response */
+static char *msWMSCacheKey(httpRequestObj *psReq)
+{
+  char *key = msStrdup(psReq->pszGetUrl);
+
+  if(psReq->pszHTTPCookieData)
+    key = msStringConcatenate(msStringConcatenate(key, "\nCookie: "), psReq->pszHTTPCookieData);
+  if(psReq->pszHttpUsername)
+    key = msStringConcatenate(msStringConcatenate(key, "\nUser: "), psReq->pszHttpUsername);
+  if(psReq->pszPostRequest)
+    key = msStringConcatenate(msStringConcatenate(key, "\nPOST: "), psReq->pszPostRequest);
+
+  return key;
+}
+
+static char *msWMSCacheFile(const char *dir, const char *key)
+{
+  char hash[17];
+
+  msHashRequestKey(key, hash);
+  return msStringConcatenate(msStringConcatenate(msStringConcatenate(msStrdup(dir), "/"), hash), ".wms");
+}
+
+static size_t msWMSCacheMemoryLimit(mapObj *map)
+{
+  const char *memory = msGetConfigOption(map, "MS_WMS_CACHE_MEMORY");
+
+  return memory ? (size_t) (atof(memory) * 1024 * 1024) : 0;
+}
+
+/* the response downloaded to pszOutputFile */
+static unsigned char *msWMSCacheReadOutputFile(const char *path, int *size)
+{
+  FILE *fp;
+  struct stat st;
+  unsigned char *data = NULL;
+
+  if((fp = fopen(path, "rb")) == NULL)
+    return NULL;
+  if(fstat(fileno(fp), &st) == 0 && st.st_size > 0 && st.st_size < INT_MAX) {
+    *size = (int) st.st_size;
+    data = (unsigned char *) msSmallMalloc(*size);
+    if(fread(data, 1, *size, fp) != (size_t) *size) {
+      free(data);
+      data = NULL;
+    }
+  }
+  fclose(fp);
+
+  return data;
+}
+
+#endif /* USE_WMS_LYR || USE_WFS_LYR */
+
+/**********************************************************************
+ *                          msWMSCacheGet()
+ *
+ * Fills psReq with a cached response, marking it with status 242 so
+ * that msHTTPExecuteRequests() skips it. Returns MS_TRUE on a hit.
+ **********************************************************************/
+int msWMSCacheGet(mapObj *map, httpRequestObj *psReq)
+{
+#if defined(USE_WMS_LYR) || defined(USE_WFS_LYR)
+  const char *dir = msGetConfigOption(map, "MS_WMS_CACHE_DIR");
+  size_t limit = msWMSCacheMemoryLimit(map);
+  unsigned char *data = NULL;
+  char *mimetype = NULL, *key;
+  int size = 0, hit = MS_FALSE;
+  time_t now;
+
+  if(psReq->nCacheTTL <= 0 || psReq->pszGetUrl == NULL ||
+      (limit == 0 && !(dir && *dir)))
+    return MS_FALSE;
+
+  key = msWMSCacheKey(psReq);
+  now = time(NULL);
+
+  if(limit > 0) {
+    wmsCachedResponseObj *resp;
+
+    msAcquireLock(TLOCK_WMSCACHE);
+    UT_HASH_FIND_STR(wms_responses, key, resp);
+    /* not dropped when too old: the TTL is per layer */
+    if(resp && now - resp->created < psReq->nCacheTTL) {
+      data = (unsigned char *) msSmallMalloc(resp->size + 1);
+      memcpy(data, resp->data, resp->size);
+      size = resp->size;
+      mimetype = msStrdup(resp->mimetype);
+      msWMSCacheUnlink(resp);
+      msWMSCacheLinkFront(resp);
+      hit = MS_TRUE;
+    }
+    msReleaseLock(TLOCK_WMSCACHE);
+  }
+
+  if(!hit && dir && *dir) {
+    char *path = msWMSCacheFile(dir, key);
+    struct stat st;
+
+    if(stat(path, &st) == 0 && now - st.st_mtime < psReq->nCacheTTL &&
+        msReadKeyedFile(path, key, &data, &size, &mimetype) == MS_SUCCESS) {
+      hit = MS_TRUE;
+      if(limit > 0)
+        msWMSCacheInsert(key, data, size, mimetype, st.st_mtime, limit);
+      data = (unsigned char *) msSmallRealloc(data, size + 1);
+    }
+    free(path);
+  }
+
+  if(hit && psReq->pszOutputFile) {
+    FILE *fp = fopen(psReq->pszOutputFile, "wb");
+    int ok = fp && fwrite(data, 1, size, fp) == (size_t) size;
+
+    if(fp && fclose(fp) != 0)
+      ok = MS_FALSE;
+    if(!ok) {
+      if(fp)
+        unlink(psReq->pszOutputFile);
+      hit = MS_FALSE; /* download it after all */
+    }
+    msFree(data);
+    data = NULL;
+  }
+
+  if(hit) {
+    if(data) {
+      data[size] = '\0';
+      msFree(psReq->result_data);
+      psReq->result_data = (char *) data;
+      psReq->result_size = size;
+      psReq->result_buf_size = size + 1;
+      data = NULL;
+    }
+    msFree(psReq->pszContentType);
+    psReq->pszContentType = mimetype;
+    mimetype = NULL;
+    psReq->nStatus = 242;
+
+    if(psReq->debug)
+      msDebug("msWMSCacheGet(): layer %d served from the cache: %s\n",
+              psReq->nLayerId, psReq->pszGetUrl);
+  }
+  msMetricsCacheLookup(MS_METRICS_CACHE_WMS, hit);
+
+  msFree(data);
+  msFree(mimetype);
+  free(key);
+  return hit;
+#else
+  return MS_FALSE;
+#endif /* USE_WMS_LYR || USE_WFS_LYR */
+}
+
+/**********************************************************************
+ *                          msWMSCachePut()
+ *
+ * Caches the response of a successful request that may be, unless it
+ * is a service exception: any XML response of a WMS layer, an
+ * ExceptionReport / ServiceExceptionReport of a WFS layer.
+ **********************************************************************/
+void msWMSCachePut(mapObj *map, httpRequestObj *psReq)
+{
+#if defined(USE_WMS_LYR) || defined(USE_WFS_LYR)
+  const char *dir = msGetConfigOption(map, "MS_WMS_CACHE_DIR");
+  size_t limit = msWMSCacheMemoryLimit(map);
+  const unsigned char *data;
+  unsigned char *filedata = NULL;
+  int size;
+  char *key;
+
+  int isWFS;
+
+  if(psReq->nCacheTTL <= 0 || psReq->nStatus != 200 || psReq->pszGetUrl == NULL ||
+      (limit == 0 && !(dir && *dir)))
+    return;
+  isWFS = psReq->nLayerId >= 0 && psReq->nLayerId < map->numlayers &&
+          GET_LAYER(map, psReq->nLayerId)->connectiontype == MS_WFS;
+  if(psReq->pszContentType == NULL ||
+      (!isWFS && strstr(psReq->pszContentType, "xml") != NULL))
+    return;
+
+  if(psReq->pszOutputFile) {
+    data = filedata = msWMSCacheReadOutputFile(psReq->pszOutputFile, &size);
+  } else {
+    data = (const unsigned char *) psReq->result_data;
+    size = psReq->result_size;
+  }
+  if(data == NULL || size <= 0)
+    return;
+  if(isWFS) {
+    char head[2000];
+    int n = MS_MIN(size, (int) sizeof(head) - 1);
+
+    memcpy(head, data, n);
+    head[n] = '\0';
+    if(strstr(head, "ExceptionReport") != NULL) {
+      msFree(filedata);
+      return;
+    }
+  }
+
+  key = msWMSCacheKey(psReq);
+  if(limit > 0)
+    msWMSCacheInsert(key, data, size, psReq->pszContentType, time(NULL), limit);
+  if(dir && *dir) {
+    char *path = msWMSCacheFile(dir, key);
+
+    if(msWriteKeyedFile(path, key, data, size, psReq->pszContentType) != MS_SUCCESS && psReq->debug)
+      msDebug("msWMSCachePut(): failed to write %s.\n", path);
+    free(path);
+  }
+  free(key);
+  msFree(filedata);
+#endif /* USE_WMS_LYR || USE_WFS_LYR */
+}
+
+/**********************************************************************
+ *                          msWMSCacheCleanup()
+ *
+ **********************************************************************/
+void msWMSCacheCleanup(void)
+{
+#if defined(USE_WMS_LYR) || defined(USE_WFS_LYR)
+  msAcquireLock(TLOCK_WMSCACHE);
+  while(wms_responses_head)
+    msWMSCacheRemove(wms_responses_head);
+  msReleaseLock(TLOCK_WMSCACHE);
+#endif /* USE_WMS_LYR || USE_WFS_LYR */
+}
@@ -31,8 +31,11 @@
 #define _FILE_OFFSET_BITS 64
 
 #include "mapserver.h"
+#include "mapthread.h"
+#include "uthash.h"
 #include <stdlib.h> /* for atof() and atoi() */
 #include <math.h>
+#include <sys/stat.h>
 
 
 
@@ -195,7 +198,7 @@ DBFHandle msDBFOpen( const char * pszFilename, const char * pszAccess )
   psDBF->pszStringField = NULL;
   psDBF->nStringFieldLen = 0;
 
-  free( pszDBFFilename );
+  psDBF->pszFilename = pszDBFFilename;
 
   /* -------------------------------------------------------------------- */
   /*  Read Table Header info                                              */
@@ -203,6 +206,7 @@ DBFHandle msDBFOpen( const char * pszFilename, const char * pszAccess )
   pabyBuf = (uchar *) msSmallMalloc(500);
   if( fread( pabyBuf, 32, 1, psDBF->fp ) != 1 )
   {
+    msFree(psDBF->pszFilename);
     msFree(psDBF);
     msFree(pabyBuf);
     return( NULL );
@@ -228,6 +232,7 @@ DBFHandle msDBFOpen( const char * pszFilename, const char * pszAccess )
   if( fread( pabyBuf, nHeadLen - 32, 1, psDBF->fp ) != 1 )
   {
     msFree(psDBF->pszCurrentRecord);
+    msFree(psDBF->pszFilename);
     msFree(psDBF);
     msFree(pabyBuf);
     return( NULL );
@@ -315,6 +320,7 @@ void  msDBFClose(DBFHandle psDBF)
   free( psDBF->pszCurrentRecord );
 
   free(psDBF->pszStringField);
+  free(psDBF->pszFilename);
 
   free( psDBF );
 }
@@ -374,6 +380,8 @@ DBFHandle msDBFCreate( const char * pszFilename )
   psDBF->pszStringField = NULL;
   psDBF->nStringFieldLen = 0;
 
+  psDBF->pszFilename = msStrdup(pszFilename);
+
   psDBF->bNoHeader = MS_TRUE;
   psDBF->bUpdated = MS_FALSE;
 
@@ -503,53 +511,18 @@ static int DBFIsValueNULL( const char* pszValue, char type )
 }
 
 /************************************************************************/
-/*                          msDBFReadAttribute()                        */
+/*                        msDBFExtractAttribute()                       */
 /*                                                                      */
-/*      Read one of the attribute fields of a record.                   */
+/*      Extract one of the attribute fields from a raw record buffer,   */
+/*      trimming blanks and mapping numeric nulls to "0". The result    */
+/*      lives in psDBF->pszStringField.                                 */
 /************************************************************************/
-static const char *msDBFReadAttribute(DBFHandle psDBF, int hEntity, int iField )
+static const char *msDBFExtractAttribute(DBFHandle psDBF, const uchar *pabyRec, int iField )
 
 {
   int         i;
-  unsigned int nRecordOffset;
-  const uchar *pabyRec;
   const char  *pReturnField = NULL;
 
-  /* -------------------------------------------------------------------- */
-  /*  Is the request valid?                             */
-  /* -------------------------------------------------------------------- */
-  if( iField < 0 || iField >= psDBF->nFields ) {
-    msSetError(MS_DBFERR, "Invalid field index %d.", "msDBFReadAttribute()",iField );
-    return( NULL );
-  }
-
-  if( hEntity < 0 || hEntity >= psDBF->nRecords ) {
-    msSetError(MS_DBFERR, "Invalid record number %d.", "msDBFReadAttribute()",hEntity );
-    return( NULL );
-  }
-
-  /* -------------------------------------------------------------------- */
-  /*  Have we read the record?              */
-  /* -------------------------------------------------------------------- */
-  if( psDBF->nCurrentRecord != hEntity ) {
-    flushRecord( psDBF );
-
-    nRecordOffset = psDBF->nRecordLength * hEntity + psDBF->nHeaderLength;
-
-    safe_fseek( psDBF->fp, nRecordOffset, 0 );
-    if( fread( psDBF->pszCurrentRecord, psDBF->nRecordLength, 1, psDBF->fp ) != 1 )
-    {
-      msSetError(MS_DBFERR, "Cannot read record %d.", "msDBFReadAttribute()",hEntity );
-      return( NULL );
-    }
-
-    psDBF->nCurrentRecord = hEntity;
-  }
-
-  pabyRec = (const uchar *) psDBF->pszCurrentRecord;
-  /* DEBUG */
-  /* printf("CurrentRecord(%c):%s\n", psDBF->pachFieldType[iField], pabyRec); */
-
   /* -------------------------------------------------------------------- */
   /*  Ensure our field buffer is large enough to hold this buffer.      */
   /* -------------------------------------------------------------------- */
@@ -596,6 +569,53 @@ static const char *msDBFReadAttribute(DBFHandle psDBF, int hEntity, int iField )
   return( pReturnField );
 }
 
+/************************************************************************/
+/*                          msDBFReadAttribute()                        */
+/*                                                                      */
+/*      Read one of the attribute fields of a record.                   */
+/************************************************************************/
+static const char *msDBFReadAttribute(DBFHandle psDBF, int hEntity, int iField )
+
+{
+  unsigned int nRecordOffset;
+
+  /* -------------------------------------------------------------------- */
+  /*  Is the request valid?                             */
+  /* -------------------------------------------------------------------- */
+  if( iField < 0 || iField >= psDBF->nFields ) {
+    msSetError(MS_DBFERR, "Invalid field index %d.", "msDBFReadAttribute()",iField );
+    return( NULL );
+  }
+
+  if( hEntity < 0 || hEntity >= psDBF->nRecords ) {
+    msSetError(MS_DBFERR, "Invalid record number %d.", "msDBFReadAttribute()",hEntity );
+    return( NULL );
+  }
+
+  /* -------------------------------------------------------------------- */
+  /*  Have we read the record?              */
+  /* -------------------------------------------------------------------- */
+  if( psDBF->nCurrentRecord != hEntity ) {
+    flushRecord( psDBF );
+
+    nRecordOffset = psDBF->nRecordLength * hEntity + psDBF->nHeaderLength;
+
+    safe_fseek( psDBF->fp, nRecordOffset, 0 );
+    if( fread( psDBF->pszCurrentRecord, psDBF->nRecordLength, 1, psDBF->fp ) != 1 )
+    {
+      msSetError(MS_DBFERR, "Cannot read record %d.", "msDBFReadAttribute()",hEntity );
+      return( NULL );
+    }
+
+    psDBF->nCurrentRecord = hEntity;
+  }
+
+  /* DEBUG */
+  /* printf("CurrentRecord(%c):%s\n", psDBF->pachFieldType[iField], psDBF->pszCurrentRecord); */
+
+  return( msDBFExtractAttribute( psDBF, (const uchar *) psDBF->pszCurrentRecord, iField ) );
+}
+
 /************************************************************************/
 /*                        msDBFReadIntAttribute()                       */
 /*                                                                      */
@@ -921,3 +941,368 @@ char **msDBFGetValueList(DBFHandle dbffile, int record, int *itemindexes, int nu
 
   return(values);
 }
+
+/* -------------------------------------------------------------------- */
+/*      Process wide columnar cache of .dbf attributes, enabled with    */
+/*      the MS_DBF_CACHE config option. Only the columns a layer asks   */
+/*      for are loaded, in one sequential pass over the file. Each      */
+/*      column holds a dictionary of its distinct values plus one code  */
+/*      per record, numeric columns also keep the parsed doubles.       */
+/*      Entries are keyed on the .dbf filename and are invalidated      */
+/*      when the file modification time or size changes. Loaded         */
+/*      columns are never modified, so they can be read without the     */
+/*      lock by any holder of a reference.                              */
+/*                                                                      */
+/*      These static structures are protected by the TLOCK_DBFCACHE     */
+/*      mutex.                                                          */
+/* -------------------------------------------------------------------- */
+#define MS_DBF_CACHE_MAX         16
+#define MS_DBF_CACHE_READ_RECORDS 512
+
+typedef struct {
+  int *panCodes;        /* one dictionary index per record */
+  double *padfValues;   /* one value per record, numeric fields only */
+  char **papszValues;   /* distinct values of the column */
+  int nValues;
+} dbfColumnObj;
+
+struct dbfColumnCacheObj {
+  char *filename;
+  time_t mtime;
+  off_t size;
+  int nRecords;
+  int nFields;
+  int refcount;
+  int stale;
+  unsigned long last_used;
+  dbfColumnObj **papoColumns; /* nFields entries, NULL until loaded */
+};
+
+typedef struct {
+  char *value;
+  int code;
+  UT_hash_handle hh;
+} dbfDictionaryEntryObj;
+
+static int dbfColumnCacheCount = 0;
+static unsigned long dbfColumnCacheClock = 0;
+static dbfColumnCacheObj *dbfColumnCache[MS_DBF_CACHE_MAX];
+
+static void dbfColumnCacheFree(dbfColumnCacheObj *cache)
+{
+  int i, j;
+
+  for( i = 0; i < cache->nFields; i++ ) {
+    dbfColumnObj *column = cache->papoColumns[i];
+    if( !column )
+      continue;
+    for( j = 0; j < column->nValues; j++ )
+      free(column->papszValues[j]);
+    free(column->papszValues);
+    free(column->panCodes);
+    free(column->padfValues);
+    free(column);
+  }
+  free(cache->papoColumns);
+  free(cache->filename);
+  free(cache);
+}
+
+static void dbfColumnCacheRemove(int i)
+{
+  if( dbfColumnCache[i]->refcount > 0 )
+    dbfColumnCache[i]->stale = MS_TRUE; /* freed by the last release */
+  else
+    dbfColumnCacheFree(dbfColumnCache[i]);
+
+  dbfColumnCacheCount--;
+  if( i != dbfColumnCacheCount )
+    dbfColumnCache[i] = dbfColumnCache[dbfColumnCacheCount];
+}
+
+/*
+** Read the given (not yet loaded) fields of every record in one pass. Failures
+** aren't reported as errors since the caller simply falls back to the file.
+*/
+static int dbfColumnCacheLoad(dbfColumnCacheObj *cache, DBFHandle psDBF, int *fields, int numfields)
+{
+  int i, j, k, nChunk, status = MS_SUCCESS;
+  uchar *pabyRecords;
+  dbfColumnObj **columns;
+  dbfDictionaryEntryObj **dictionaries;
+
+  pabyRecords = (uchar *) malloc((size_t) psDBF->nRecordLength * MS_DBF_CACHE_READ_RECORDS);
+  columns = (dbfColumnObj **) calloc(numfields, sizeof(dbfColumnObj *));
+  dictionaries = (dbfDictionaryEntryObj **) calloc(numfields, sizeof(dbfDictionaryEntryObj *));
+  if( !pabyRecords || !columns || !dictionaries ) {
+    free(pabyRecords);
+    free(columns);
+    free(dictionaries);
+    return MS_FAILURE;
+  }
+
+  for( k = 0; k < numfields; k++ ) {
+    columns[k] = (dbfColumnObj *) calloc(1, sizeof(dbfColumnObj));
+    if( columns[k] )
+      columns[k]->panCodes = (int *) malloc(sizeof(int) * MS_MAX(cache->nRecords, 1));
+    if( columns[k] && (psDBF->pachFieldType[fields[k]] == 'N' || psDBF->pachFieldType[fields[k]] == 'F') )
+      columns[k]->padfValues = (double *) malloc(sizeof(double) * MS_MAX(cache->nRecords, 1));
+    if( !columns[k] || !columns[k]->panCodes ||
+        ((psDBF->pachFieldType[fields[k]] == 'N' || psDBF->pachFieldType[fields[k]] == 'F') && !columns[k]->padfValues) )
+      status = MS_FAILURE;
+  }
+
+  flushRecord( psDBF );
+  if( status == MS_SUCCESS && safe_fseek( psDBF->fp, psDBF->nHeaderLength, 0 ) != 0 )
+    status = MS_FAILURE;
+
+  for( i = 0; status == MS_SUCCESS && i < cache->nRecords; i += nChunk ) {
+    nChunk = MS_MIN(MS_DBF_CACHE_READ_RECORDS, cache->nRecords - i);
+    if( fread( pabyRecords, psDBF->nRecordLength, nChunk, psDBF->fp ) != (size_t) nChunk ) {
+      status = MS_FAILURE;
+      break;
+    }
+
+    for( j = 0; j < nChunk; j++ ) {
+      const uchar *pabyRec = pabyRecords + (size_t) j * psDBF->nRecordLength;
+
+      for( k = 0; k < numfields; k++ ) {
+        dbfColumnObj *column = columns[k];
+        dbfDictionaryEntryObj *entry = NULL;
+        const char *value = msDBFExtractAttribute( psDBF, pabyRec, fields[k] );
+
+        UT_HASH_FIND_STR(dictionaries[k], value, entry);
+        if( !entry ) {
+          if( column->nValues % 64 == 0 )
+            column->papszValues = (char **) msSmallRealloc(column->papszValues, sizeof(char *) * (column->nValues + 64));
+          entry = (dbfDictionaryEntryObj *) msSmallMalloc(sizeof(dbfDictionaryEntryObj));
+          entry->value = column->papszValues[column->nValues] = msStrdup(value);
+          entry->code = column->nValues++;
+          UT_HASH_ADD_KEYPTR(hh, dictionaries[k], entry->value, strlen(entry->value), entry);
+        }
+
+        column->panCodes[i + j] = entry->code;
+        if( column->padfValues )
+          column->padfValues[i + j] = atof(value);
+      }
+    }
+  }
+
+  /* the record buffer of the handle no longer matches the file position */
+  psDBF->nCurrentRecord = -1;
+
+  for( k = 0; k < numfields; k++ ) {
+    dbfDictionaryEntryObj *entry, *tmp;
+    UT_HASH_ITER(hh, dictionaries[k], entry, tmp) {
+      UT_HASH_DEL(dictionaries[k], entry);
+      free(entry);
+    }
+
+    if( status == MS_SUCCESS ) {
+      cache->papoColumns[fields[k]] = columns[k];
+    } else if( columns[k] ) {
+      for( j = 0; j < columns[k]->nValues; j++ )
+        free(columns[k]->papszValues[j]);
+      free(columns[k]->papszValues);
+      free(columns[k]->panCodes);
+      free(columns[k]->padfValues);
+      free(columns[k]);
+    }
+  }
+
+  free(pabyRecords);
+  free(columns);
+  free(dictionaries);
+
+  return status;
+}
+
+/************************************************************************/
+/*                       msDBFColumnCacheAcquire()                      */
+/*                                                                      */
+/*      Return a reference to the cached columns of a .dbf, loading     */
+/*      the requested fields that aren't cached yet. Returns NULL if    */
+/*      the file can't be cached, callers then fall back to reading     */
+/*      the file. Must be given back with msDBFColumnCacheRelease().    */
+/************************************************************************/
+dbfColumnCacheObj *msDBFColumnCacheAcquire(DBFHandle dbffile, int *itemindexes, int numitems)
+{
+  int i, numfields = 0, slot = -1;
+  int *fields;
+  struct stat sStat;
+  dbfColumnCacheObj *cache = NULL;
+
+  if( !dbffile || !dbffile->pszFilename || numitems <= 0 || !itemindexes )
+    return NULL;
+
+  if( stat(dbffile->pszFilename, &sStat) != 0 )
+    return NULL;
+
+  msAcquireLock( TLOCK_DBFCACHE );
+  for( i = dbfColumnCacheCount - 1; i >= 0; i-- ) {
+    if( strcmp(dbfColumnCache[i]->filename, dbffile->pszFilename) != 0 )
+      continue;
+
+    if( dbfColumnCache[i]->mtime != sStat.st_mtime || dbfColumnCache[i]->size != sStat.st_size ||
+        dbfColumnCache[i]->nRecords != dbffile->nRecords || dbfColumnCache[i]->nFields != dbffile->nFields ) {
+      dbfColumnCacheRemove(i); /* the file has been rewritten */
+      continue;
+    }
+
+    cache = dbfColumnCache[i];
+    break;
+  }
+
+  if( !cache ) {
+    /* evict the least recently used unreferenced entry if the cache is full */
+    if( dbfColumnCacheCount == MS_DBF_CACHE_MAX ) {
+      for( i = 0; i < dbfColumnCacheCount; i++ ) {
+        if( dbfColumnCache[i]->refcount == 0 &&
+            (slot == -1 || dbfColumnCache[i]->last_used < dbfColumnCache[slot]->last_used) )
+          slot = i;
+      }
+      if( slot == -1 ) {
+        msReleaseLock( TLOCK_DBFCACHE );
+        return NULL;
+      }
+      dbfColumnCacheRemove(slot);
+    }
+
+    cache = (dbfColumnCacheObj *) calloc(1, sizeof(dbfColumnCacheObj));
+    if( cache )
+      cache->papoColumns = (dbfColumnObj **) calloc(MS_MAX(dbffile->nFields, 1), sizeof(dbfColumnObj *));
+    if( !cache || !cache->papoColumns ) {
+      free(cache);
+      msReleaseLock( TLOCK_DBFCACHE );
+      return NULL;
+    }
+    cache->filename = msStrdup(dbffile->pszFilename);
+    cache->mtime = sStat.st_mtime;
+    cache->size = sStat.st_size;
+    cache->nRecords = dbffile->nRecords;
+    cache->nFields = dbffile->nFields;
+    dbfColumnCache[dbfColumnCacheCount++] = cache;
+  }
+
+  cache->refcount++;
+  cache->last_used = ++dbfColumnCacheClock;
+
+  /* -------------------------------------------------------------------- */
+  /*      Load the missing columns. This is done while holding the        */
+  /*      lock so a column is only ever read once per process.            */
+  /* -------------------------------------------------------------------- */
+  fields = (int *) msSmallMalloc(sizeof(int) * numitems);
+  for( i = 0; i < numitems; i++ ) {
+    int j;
+    if( itemindexes[i] < 0 || itemindexes[i] >= cache->nFields || cache->papoColumns[itemindexes[i]] )
+      continue;
+    for( j = 0; j < numfields && fields[j] != itemindexes[i]; j++ ) {}
+    if( j == numfields )
+      fields[numfields++] = itemindexes[i];
+  }
+
+  if( numfields > 0 && dbfColumnCacheLoad(cache, dbffile, fields, numfields) != MS_SUCCESS ) {
+    cache->refcount--;
+    cache = NULL;
+  }
+  free(fields);
+  msReleaseLock( TLOCK_DBFCACHE );
+
+  return cache;
+}
+
+/************************************************************************/
+/*                       msDBFColumnCacheRelease()                      */
+/************************************************************************/
+void msDBFColumnCacheRelease(dbfColumnCacheObj *cache)
+{
+  if( !cache )
+    return;
+
+  msAcquireLock( TLOCK_DBFCACHE );
+  cache->refcount--;
+  if( cache->refcount == 0 && cache->stale )
+    dbfColumnCacheFree(cache);
+  msReleaseLock( TLOCK_DBFCACHE );
+}
+
+/************************************************************************/
+/*                     msDBFColumnCacheReadString()                     */
+/*                                                                      */
+/*      Same value msDBFReadStringAttribute() would return, the field   */
+/*      must have been loaded by msDBFColumnCacheAcquire().             */
+/************************************************************************/
+const char *msDBFColumnCacheReadString(dbfColumnCacheObj *cache, int record, int field)
+{
+  dbfColumnObj *column;
+
+  if( field < 0 || field >= cache->nFields || (column = cache->papoColumns[field]) == NULL ) {
+    msSetError(MS_DBFERR, "Field %d is not cached.", "msDBFColumnCacheReadString()", field);
+    return NULL;
+  }
+  if( record < 0 || record >= cache->nRecords ) {
+    msSetError(MS_DBFERR, "Invalid record number %d.", "msDBFColumnCacheReadString()", record);
+    return NULL;
+  }
+
+  return column->papszValues[column->panCodes[record]];
+}
+
+/************************************************************************/
+/*                     msDBFColumnCacheReadDouble()                     */
+/*                                                                      */
+/*      Fetch the parsed value of a cached numeric (N or F) field.      */
+/************************************************************************/
+int msDBFColumnCacheReadDouble(dbfColumnCacheObj *cache, int record, int field, double *value)
+{
+  dbfColumnObj *column;
+
+  if( field < 0 || field >= cache->nFields || (column = cache->papoColumns[field]) == NULL ||
+      column->padfValues == NULL || record < 0 || record >= cache->nRecords )
+    return MS_FAILURE;
+
+  *value = column->padfValues[record];
+  return MS_SUCCESS;
+}
+
+/************************************************************************/
+/*                    msDBFColumnCacheGetValueList()                    */
+/*                                                                      */
+/*      Cached equivalent of msDBFGetValueList().                       */
+/************************************************************************/
+char **msDBFColumnCacheGetValueList(dbfColumnCacheObj *cache, int record, int *itemindexes, int numitems)
+{
+  const char *value;
+  char **values=NULL;
+  int i;
+
+  if(numitems == 0) return(NULL);
+
+  values = (char **)malloc(sizeof(char *)*numitems);
+  MS_CHECK_ALLOC(values, sizeof(char *)*numitems, NULL);
+
+  for(i=0; i<numitems; i++) {
+    value = msDBFColumnCacheReadString(cache, record, itemindexes[i]);
+    if (value == NULL) {
+      while(--i >= 0) free(values[i]);
+      free(values);
+      return NULL; /* Error already reported by msDBFColumnCacheReadString() */
+    }
+    values[i] = msStrdup(value);
+  }
+
+  return(values);
+}
+
+/************************************************************************/
+/*                       msDBFColumnCacheCleanup()                      */
+/*                                                                      */
+/*      Free all cached columns, called from msCleanup().               */
+/************************************************************************/
+void msDBFColumnCacheCleanup()
+{
+  msAcquireLock( TLOCK_DBFCACHE );
+  while( dbfColumnCacheCount > 0 )
+    dbfColumnCacheRemove(0);
+  msReleaseLock( TLOCK_DBFCACHE );
+}
@@ -0,0 +1,361 @@
+/******************************************************************************
+ * $Id$
+ *
+ * Project:  MapServer
+ * Purpose:  Command line utility measuring the throughput of msProjectShape(),
+ *           msProjectRect() and msProjTransformer() for a few common
+ *           projection pairs.
+ * Author:   Steve Lime and the MapServer team.
+ *
+ ******************************************************************************
+ * Copyright (c) 1996-2005 Regents of the University of Minnesota.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies of this Software or works derived from this Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mapserver.h"
+#include "mapresample.h"
+#include "mapthread.h"
+#include "maptime.h"
+
+
+
+/* ---- the pairs run when none is given, extents are in the source projection ---- */
+static const struct {
+  const char *src, *dst;
+  double minx, miny, maxx, maxy;
+} default_pairs[] = {
+  { "init=epsg:4326",  "init=epsg:3857",  -10, 35, 30, 60 },
+  { "init=epsg:3857",  "init=epsg:4326",  -1113195, 4163881, 3339584, 8399738 },
+  { "init=epsg:4326",  "init=epsg:32631", 0, 40, 6, 60 },
+  { "init=epsg:32631", "init=epsg:3857",  300000, 4500000, 700000, 6600000 },
+  { "init=epsg:4326",  "init=epsg:3035",  -10, 35, 30, 60 },
+  { "init=epsg:3035",  "init=epsg:4326",  2500000, 1500000, 6500000, 5000000 }
+};
+
+enum { BENCH_SHAPE, BENCH_RECT, BENCH_TRANSFORMER };
+static const char *bench_names[] = { "msProjectShape", "msProjectRect", "msProjTransformer" };
+
+typedef struct {
+  int what;
+  projectionObj *in, *out;
+  rectObj extent;
+  int numpoints, iterations;
+  unsigned int seed;
+  long vertices; /* number of vertices transformed, the result */
+  int failures;
+} benchTaskObj;
+
+/* ---- a small LCG so that every task has its own reproducible sequence ---- */
+static double bench_random(unsigned int *seed)
+{
+  *seed = *seed * 1103515245 + 12345;
+  return ((*seed >> 8) & 0xffffff) / (double) 0x1000000;
+}
+
+/*
+** Each task runs its iterations on its own data but shares the projections
+** with the other tasks, as the layers of a map do between threads.
+*/
+static void run_bench_task(void *arg)
+{
+  benchTaskObj *task = (benchTaskObj *) arg;
+  double width = task->extent.maxx - task->extent.minx;
+  double height = task->extent.maxy - task->extent.miny;
+  int i, j;
+
+  if(task->what == BENCH_SHAPE) {
+    shapeObj shape;
+    lineObj line;
+
+    /* ---- a closed ring of numpoints vertices wandering over the extent ---- */
+    line.numpoints = task->numpoints;
+    line.point = (pointObj *) msSmallMalloc(sizeof(pointObj) * line.numpoints);
+
+    for(i=0; i<task->iterations; i++) {
+      for(j=0; j<line.numpoints-1; j++) {
+        line.point[j].x = task->extent.minx + width * bench_random(&task->seed);
+        line.point[j].y = task->extent.miny + height * bench_random(&task->seed);
+      }
+      line.point[line.numpoints-1] = line.point[0];
+
+      msInitShape(&shape);
+      shape.type = MS_SHAPE_POLYGON;
+      msAddLine(&shape, &line);
+      if(msProjectShape(task->in, task->out, &shape) != MS_SUCCESS)
+        task->failures++;
+      else
+        task->vertices += line.numpoints;
+      msFreeShape(&shape);
+    }
+
+    free(line.point);
+  } else if(task->what == BENCH_RECT) {
+    /* ---- random rects, so that the projected rect cache doesn't answer ---- */
+    for(i=0; i<task->iterations; i++) {
+      for(j=0; j<task->numpoints; j++) {
+        rectObj rect;
+        double x = bench_random(&task->seed), y = bench_random(&task->seed);
+        double w = (1 - x) * bench_random(&task->seed), h = (1 - y) * bench_random(&task->seed);
+
+        rect.minx = task->extent.minx + width * x;
+        rect.miny = task->extent.miny + height * y;
+        rect.maxx = rect.minx + width * w;
+        rect.maxy = rect.miny + height * h;
+        if(msProjectRect(task->in, task->out, &rect) != MS_SUCCESS)
+          task->failures++;
+        else
+          task->vertices++;
+      }
+    }
+  } else {
+#if defined(USE_PROJ) && defined(USE_GDAL)
+    /* ---- the inverse mapping a raster warp does, one row of numpoints pixels at a time ---- */
+    double srcgt[6], dstgt[6];
+    double *x, *y;
+    int *success;
+    void *transformer;
+
+    /* ---- the output is the extent in the destination projection, the input the extent in the source one ---- */
+    rectObj dstextent = task->extent;
+    msProjectRect(task->in, task->out, &dstextent);
+
+    srcgt[0] = task->extent.minx;
+    srcgt[1] = width / task->numpoints;
+    srcgt[2] = 0;
+    srcgt[3] = task->extent.maxy;
+    srcgt[4] = 0;
+    srcgt[5] = -height / task->numpoints;
+    dstgt[0] = dstextent.minx;
+    dstgt[1] = (dstextent.maxx - dstextent.minx) / task->numpoints;
+    dstgt[2] = 0;
+    dstgt[3] = dstextent.maxy;
+    dstgt[4] = 0;
+    dstgt[5] = -(dstextent.maxy - dstextent.miny) / task->numpoints;
+
+    transformer = msInitProjTransformer(task->in, srcgt, task->out, dstgt);
+    if(transformer == NULL) {
+      task->failures++;
+      return;
+    }
+
+    x = (double *) msSmallMalloc(sizeof(double) * task->numpoints);
+    y = (double *) msSmallMalloc(sizeof(double) * task->numpoints);
+    success = (int *) msSmallMalloc(sizeof(int) * task->numpoints);
+
+    for(i=0; i<task->iterations; i++) {
+      double row = task->numpoints * bench_random(&task->seed);
+
+      for(j=0; j<task->numpoints; j++) {
+        x[j] = j + 0.5;
+        y[j] = row;
+      }
+      if(!msProjTransformer(transformer, task->numpoints, x, y, success))
+        task->failures++;
+      else
+        task->vertices += task->numpoints;
+    }
+
+    free(x);
+    free(y);
+    free(success);
+    msFreeProjTransformer(transformer);
+#else
+    task->failures++;
+#endif
+  }
+}
+
+static void usage(void)
+{
+  fprintf(stderr,"Syntax: projbench [-n points] [-i iterations] [-t threads] [-b shape|rect|transformer]\n");
+  fprintf(stderr,"                  [-p srcproj dstproj minx miny maxx maxy] ...\n");
+  fprintf(stderr,"  -n: vertices per shape, rects per iteration or pixels per raster row (default 1000)\n");
+  fprintf(stderr,"  -i: iterations per thread (default 100)\n");
+  fprintf(stderr,"  -t: number of threads, each running all the iterations (default 1)\n");
+  fprintf(stderr,"  -b: only run this benchmark, may be repeated\n");
+  fprintf(stderr,"  -p: benchmark this projection pair over the extent (in srcproj units)\n");
+  fprintf(stderr,"      instead of the default ones, may be repeated\n");
+  exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+  int numpoints = 1000, iterations = 100, numthreads = 1;
+  int benches[3] = { 0, 0, 0 }, anybench = MS_FALSE;
+  int numpairs = 0, i, j, k, status = 0;
+  projectionObj *in, *out;
+  rectObj *extents;
+  benchTaskObj *tasks;
+  void **taskptrs;
+
+  if(argc > 1 && strcmp(argv[1], "-v") == 0) {
+    printf("%s\n", msGetVersion());
+    exit(0);
+  }
+
+#ifndef USE_PROJ
+  fprintf(stderr,"projbench: MapServer was built without projection support.\n");
+  exit(1);
+#endif
+
+  if(msSetup() != MS_SUCCESS) {
+    msWriteError(stderr);
+    exit(1);
+  }
+
+  /* ---- there can't be more pairs than arguments ---- */
+  in = (projectionObj *) msSmallMalloc(sizeof(projectionObj) * (argc + sizeof(default_pairs)/sizeof(default_pairs[0])));
+  out = (projectionObj *) msSmallMalloc(sizeof(projectionObj) * (argc + sizeof(default_pairs)/sizeof(default_pairs[0])));
+  extents = (rectObj *) msSmallMalloc(sizeof(rectObj) * (argc + sizeof(default_pairs)/sizeof(default_pairs[0])));
+
+  for(i=1; i<argc; i++) {
+    if(strcmp(argv[i], "-n") == 0 && i+1 < argc) {
+      numpoints = atoi(argv[++i]);
+    } else if(strcmp(argv[i], "-i") == 0 && i+1 < argc) {
+      iterations = atoi(argv[++i]);
+    } else if(strcmp(argv[i], "-t") == 0 && i+1 < argc) {
+      numthreads = atoi(argv[++i]);
+    } else if(strcmp(argv[i], "-b") == 0 && i+1 < argc) {
+      i++;
+      if(strcmp(argv[i], "shape") == 0) benches[BENCH_SHAPE] = 1;
+      else if(strcmp(argv[i], "rect") == 0) benches[BENCH_RECT] = 1;
+      else if(strcmp(argv[i], "transformer") == 0) {
+#if !defined(USE_GDAL)
+        fprintf(stderr,"projbench: msProjTransformer() is only available when MapServer is built with GDAL.\n");
+        exit(1);
+#endif
+        benches[BENCH_TRANSFORMER] = 1;
+      }
+      else usage();
+      anybench = MS_TRUE;
+    } else if(strcmp(argv[i], "-p") == 0 && i+6 < argc) {
+      msInitProjection(&in[numpairs]);
+      msInitProjection(&out[numpairs]);
+      if(msLoadProjectionString(&in[numpairs], argv[i+1]) != MS_SUCCESS ||
+          msLoadProjectionString(&out[numpairs], argv[i+2]) != MS_SUCCESS) {
+        msWriteError(stderr);
+        exit(1);
+      }
+      extents[numpairs].minx = atof(argv[i+3]);
+      extents[numpairs].miny = atof(argv[i+4]);
+      extents[numpairs].maxx = atof(argv[i+5]);
+      extents[numpairs].maxy = atof(argv[i+6]);
+      numpairs++;
+      i += 6;
+    } else {
+      usage();
+    }
+  }
+
+  if(numpoints < 2 || iterations < 1 || numthreads < 1)
+    usage();
+  if(!anybench) {
+    benches[BENCH_SHAPE] = benches[BENCH_RECT] = 1;
+#ifdef USE_GDAL
+    benches[BENCH_TRANSFORMER] = 1;
+#endif
+  }
+
+  if(numpairs == 0) {
+    for(i=0; i<sizeof(default_pairs)/sizeof(default_pairs[0]); i++) {
+      msInitProjection(&in[numpairs]);
+      msInitProjection(&out[numpairs]);
+      if(msLoadProjectionString(&in[numpairs], default_pairs[i].src) != MS_SUCCESS ||
+          msLoadProjectionString(&out[numpairs], default_pairs[i].dst) != MS_SUCCESS) {
+        msWriteError(stderr);
+        exit(1);
+      }
+      extents[numpairs].minx = default_pairs[i].minx;
+      extents[numpairs].miny = default_pairs[i].miny;
+      extents[numpairs].maxx = default_pairs[i].maxx;
+      extents[numpairs].maxy = default_pairs[i].maxy;
+      numpairs++;
+    }
+  }
+
+  tasks = (benchTaskObj *) msSmallMalloc(sizeof(benchTaskObj) * numthreads);
+  taskptrs = (void **) msSmallMalloc(sizeof(void *) * numthreads);
+
+  printf("%d thread(s), %d iteration(s) of %d point(s)\n", numthreads, iterations, numpoints);
+
+  for(i=0; i<numpairs; i++) {
+    char *src = msGetProjectionString(&in[i]), *dst = msGetProjectionString(&out[i]);
+
+    for(j=0; j<3; j++) {
+      struct mstimeval starttime, endtime;
+      double elapsed;
+      long vertices = 0;
+      int failures = 0;
+
+      if(!benches[j]) continue;
+
+      for(k=0; k<numthreads; k++) {
+        tasks[k].what = j;
+        tasks[k].in = &in[i];
+        tasks[k].out = &out[i];
+        tasks[k].extent = extents[i];
+        tasks[k].numpoints = numpoints;
+        tasks[k].iterations = iterations;
+        tasks[k].seed = 1 + k;
+        tasks[k].vertices = 0;
+        tasks[k].failures = 0;
+        taskptrs[k] = &tasks[k];
+      }
+
+      msGettimeofday(&starttime, NULL);
+      msThreadPoolRun(run_bench_task, taskptrs, numthreads, numthreads);
+      msGettimeofday(&endtime, NULL);
+
+      elapsed = (endtime.tv_sec - starttime.tv_sec) + (endtime.tv_usec - starttime.tv_usec) / 1000000.0;
+      for(k=0; k<numthreads; k++) {
+        vertices += tasks[k].vertices;
+        failures += tasks[k].failures;
+      }
+
+      printf("%-18s %s -> %s: %.3fs, %.0f %s/s", bench_names[j], src, dst, elapsed,
+             elapsed > 0 ? vertices / elapsed : 0.0, j == BENCH_RECT ? "rects" : "vertices");
+      if(failures > 0) {
+        printf(", %d failure(s)", failures);
+        status = 1;
+      }
+      printf("\n");
+    }
+
+    msFree(src);
+    msFree(dst);
+  }
+
+  for(i=0; i<numpairs; i++) {
+    msFreeProjection(&in[i]);
+    msFreeProjection(&out[i]);
+  }
+  free(in);
+  free(out);
+  free(extents);
+  free(tasks);
+  free(taskptrs);
+  msCleanup();
+
+  return(status);
+}
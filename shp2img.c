@@ -30,11 +30,286 @@
 #include "mapserver.h"
 #include "maptime.h"
 
+#if defined(USE_THREAD) && !defined(_WIN32)
+#include <pthread.h>
+#define SHP2IMG_BENCH_THREADS
+#endif
+
+/*
+** Benchmark mode (-bench): the map is drawn for each extent listed in a file,
+** -c times over, and the throughput and the latency percentiles of each
+** drawing stage (from the map statistics, see msStatsCreate()) reported.
+** With -bench_threads each thread draws on its own copy of the map.
+*/
+
+#define SHP2IMG_BENCH_TOTAL MS_STATS_NUMSTAGES /* sample index of the whole drawing */
+#define SHP2IMG_BENCH_SAMPLES (MS_STATS_NUMSTAGES+1)
+
+static const char *bench_stage_names[SHP2IMG_BENCH_SAMPLES] = { "load", "open", "whichshapes", "nextshape", "classify",
+                                                                "project", "render", "labelcache", "encode", "total"
+                                                              };
+
+typedef struct {
+  mapObj *map;
+  rectObj *extents;
+  int numextents;
+  int first, step, numjobs; /* the jobs of this thread are first, first+step, ... below numjobs */
+  int encode;
+  double *samples; /* SHP2IMG_BENCH_SAMPLES per drawing */
+  int numsamples;
+  int failed;
+} benchThreadObj;
+
+/*
+** Reads the extents to draw, one per line: "minx miny maxx maxy" or tile
+** coordinates "z x y" (spherical mercator, EPSG:3857, with the origin at
+** the top left). Commas are accepted as separators, # starts a comment.
+*/
+static int benchReadExtents(const char *filename, rectObj **extents)
+{
+  FILE *fp;
+  char line[1024], *c;
+  int numextents = 0, maxextents = 0;
+  double v[4];
+
+  if((fp = fopen(filename, "r")) == NULL) {
+    msSetError(MS_IOERR, "Unable to open %s.", "benchReadExtents()", filename);
+    return -1;
+  }
+
+  *extents = NULL;
+  while(fgets(line, sizeof(line), fp)) {
+    int n, end = 0;
+
+    if((c = strchr(line, '#')) != NULL)
+      *c = '\0';
+    for(c=line; *c; c++)
+      if(*c == ',') *c = ' ';
+
+    for(n=0; n<4; n++) {
+      int len;
+
+      if(sscanf(line + end, "%lf%n", &v[n], &len) != 1)
+        break;
+      end += len;
+    }
+    if(n == 0 && line[strspn(line, " \t\r\n")] == '\0')
+      continue;
+    if((n != 3 && n != 4) || line[end + strspn(line + end, " \t\r\n")] != '\0') {
+      msSetError(MS_MISCERR, "Invalid extent or tile \"%s\" in %s.", "benchReadExtents()", msStringChop(line), filename);
+      msFree(*extents);
+      fclose(fp);
+      return -1;
+    }
+
+    if(numextents == maxextents) {
+      maxextents = maxextents ? maxextents*2 : 256;
+      *extents = (rectObj *) msSmallRealloc(*extents, maxextents * sizeof(rectObj));
+    }
+    if(n == 4) {
+      (*extents)[numextents].minx = v[0];
+      (*extents)[numextents].miny = v[1];
+      (*extents)[numextents].maxx = v[2];
+      (*extents)[numextents].maxy = v[3];
+    } else {
+      double origin = MS_PI * 6378137.0;
+      double size = 2 * origin / pow(2, v[0]);
+
+      (*extents)[numextents].minx = -origin + v[1] * size;
+      (*extents)[numextents].maxx = (*extents)[numextents].minx + size;
+      (*extents)[numextents].maxy = origin - v[2] * size;
+      (*extents)[numextents].miny = (*extents)[numextents].maxy - size;
+    }
+    numextents++;
+  }
+  fclose(fp);
+
+  if(numextents == 0) {
+    msSetError(MS_MISCERR, "No extent found in %s.", "benchReadExtents()", filename);
+    return -1;
+  }
+  return numextents;
+}
+
+static void *benchRun(void *arg)
+{
+  benchThreadObj *bench = (benchThreadObj *) arg;
+  mapObj *map = bench->map;
+  int job, i, s;
+
+  for(job=bench->first; job<bench->numjobs; job+=bench->step) {
+    double *sample = bench->samples + bench->numsamples * SHP2IMG_BENCH_SAMPLES;
+    double start, encodestart;
+    imageObj *image;
+
+    map->extent = bench->extents[job % bench->numextents];
+    msStatsReset(map);
+
+    start = msStatsNow();
+    image = msDrawMap(map, MS_FALSE);
+    if(!image) {
+      msWriteError(stderr);
+      msResetErrorList();
+      bench->failed++;
+      continue;
+    }
+    if(bench->encode) {
+      int size = 0;
+      unsigned char *buffer;
+
+      encodestart = msStatsNow();
+      buffer = msSaveImageBuffer(image, &size, map->outputformat);
+      map->stats->seconds[MS_STATS_ENCODE] = msStatsElapsed(&encodestart);
+      if(!buffer) {
+        msWriteError(stderr);
+        msResetErrorList();
+        bench->failed++;
+      }
+      msFree(buffer);
+    }
+    msFreeImage(image);
+    sample[SHP2IMG_BENCH_TOTAL] = msStatsElapsed(&start);
+
+    /* the layer stages added up over the layers, the rendering time without the reprojection */
+    for(s=0; s<MS_STATS_NUMSTAGES; s++)
+      sample[s] = map->stats->seconds[s];
+    for(i=0; i<map->stats->numlayers; i++)
+      for(s=MS_STATS_OPEN; s<=MS_STATS_RENDER; s++)
+        sample[s] += map->stats->layers[i].seconds[s];
+    sample[MS_STATS_RENDER] = MS_MAX(0, sample[MS_STATS_RENDER] - sample[MS_STATS_PROJECT]);
+
+    bench->numsamples++;
+  }
+  return NULL;
+}
+
+static int benchCompareDouble(const void *a, const void *b)
+{
+  double da = *(const double *) a, db = *(const double *) b;
+  return (da < db) ? -1 : (da > db) ? 1 : 0;
+}
+
+/* nearest rank percentile of the n sorted values */
+static double benchPercentile(const double *values, int n, double percent)
+{
+  int rank = (int) ceil(percent / 100.0 * n);
+  return values[MS_MAX(rank, 1) - 1];
+}
+
+static int benchmark(mapObj *map, const char *filename, int iterations, int numthreads, int encode)
+{
+  benchThreadObj *benches;
+  rectObj *extents;
+  double start, elapsed, *values;
+  int numextents, numjobs, numsamples = 0, failed = 0, t, i, s;
+  int status = MS_SUCCESS;
+
+  if((numextents = benchReadExtents(filename, &extents)) < 0)
+    return MS_FAILURE;
+
+#ifndef SHP2IMG_BENCH_THREADS
+  if(numthreads > 1) {
+    fprintf(stderr, "Not built with thread support, -bench_threads ignored.\n");
+    numthreads = 1;
+  }
+#endif
+
+  numjobs = numextents * MS_MAX(iterations, 1);
+  numthreads = MS_MAX(1, MS_MIN(numthreads, numjobs));
+  benches = (benchThreadObj *) msSmallCalloc(numthreads, sizeof(benchThreadObj));
+  for(t=0; t<numthreads; t++) {
+    benches[t].map = map;
+    if(t > 0) {
+      benches[t].map = msNewMapObj();
+      if(!benches[t].map || msCopyMap(benches[t].map, map) != MS_SUCCESS) {
+        msWriteError(stderr);
+        numthreads = t;
+        status = MS_FAILURE;
+        break;
+      }
+    }
+    benches[t].extents = extents;
+    benches[t].numextents = numextents;
+    benches[t].first = t;
+    benches[t].step = numthreads;
+    benches[t].numjobs = numjobs;
+    benches[t].encode = encode;
+    benches[t].samples = (double *) msSmallMalloc((numjobs / numthreads + 1) * SHP2IMG_BENCH_SAMPLES * sizeof(double));
+  }
+
+  if(status == MS_SUCCESS) {
+#ifdef SHP2IMG_BENCH_THREADS
+    pthread_t *threads = (pthread_t *) msSmallMalloc(numthreads * sizeof(pthread_t));
+
+    start = msStatsNow();
+    for(t=1; t<numthreads; t++) {
+      if(pthread_create(&threads[t], NULL, benchRun, &benches[t]) != 0) {
+        fprintf(stderr, "Failed to start benchmark thread %d.\n", t);
+        benches[t].numjobs = 0;
+        threads[t] = threads[0];
+      }
+    }
+    benchRun(&benches[0]);
+    for(t=1; t<numthreads; t++) {
+      if(benches[t].numjobs > 0)
+        pthread_join(threads[t], NULL);
+    }
+    elapsed = msStatsElapsed(&start);
+    msFree(threads);
+#else
+    start = msStatsNow();
+    benchRun(&benches[0]);
+    elapsed = msStatsElapsed(&start);
+#endif
+
+    for(t=0; t<numthreads; t++) {
+      numsamples += benches[t].numsamples;
+      failed += benches[t].failed;
+    }
+
+    printf("Drew %d maps (%d extents x %d iterations, %d thread%s) in %.3fs: %.2f maps/s, %d failed%s\n",
+           numsamples, numextents, MS_MAX(iterations, 1), numthreads, (numthreads > 1) ? "s" : "",
+           elapsed, (elapsed > 0) ? numsamples / elapsed : 0.0, failed, encode ? "" : " (not encoded)");
+
+    if(numsamples > 0) {
+      values = (double *) msSmallMalloc(numsamples * sizeof(double));
+      printf("%-12s %10s %10s %10s %10s %10s\n", "stage (ms)", "mean", "p50", "p95", "p99", "max");
+      for(s=MS_STATS_OPEN; s<SHP2IMG_BENCH_SAMPLES; s++) {
+        double sum = 0;
+
+        if(s == MS_STATS_ENCODE && !encode)
+          continue;
+        numsamples = 0;
+        for(t=0; t<numthreads; t++) {
+          for(i=0; i<benches[t].numsamples; i++) {
+            values[numsamples] = benches[t].samples[i * SHP2IMG_BENCH_SAMPLES + s] * 1000.0;
+            sum += values[numsamples++];
+          }
+        }
+        qsort(values, numsamples, sizeof(double), benchCompareDouble);
+        printf("%-12s %10.3f %10.3f %10.3f %10.3f %10.3f\n", bench_stage_names[s], sum / numsamples,
+               benchPercentile(values, numsamples, 50), benchPercentile(values, numsamples, 95),
+               benchPercentile(values, numsamples, 99), values[numsamples - 1]);
+      }
+      msFree(values);
+    }
+  }
+
+  for(t=0; t<numthreads; t++) {
+    if(t > 0)
+      msFreeMap(benches[t].map);
+    msFree(benches[t].samples);
+  }
+  msFree(benches);
+  msFree(extents);
 
+  return (status == MS_SUCCESS && failed == 0) ? MS_SUCCESS : MS_FAILURE;
+}
 
 int main(int argc, char *argv[])
 {
   int i,j,k;
+  double loadstart;
 
   mapObj         *map=NULL;
   imageObj         *image = NULL;
@@ -49,6 +324,11 @@ int main(int argc, char *argv[])
   int iterations = 1;
   int draws = 0;
 
+  char *benchfile=NULL; /* -bench extents file */
+  int bench_iterations = 1;
+  int bench_threads = 1;
+  int bench_encode = MS_TRUE;
+
   for(i=1; i<argc; i++) {
     if (strcmp(argv[i],"-c") == 0) { /* user specified number of draws */
       iterations = atoi(argv[i+1]);
@@ -68,6 +348,26 @@ int main(int argc, char *argv[])
       continue;
     }
 
+    if(strcmp(argv[i], "-bench") == 0 && i < argc-1 ) { /* benchmark over the extents of a file */
+      benchfile = argv[++i];
+      continue;
+    }
+
+    if(strcmp(argv[i], "-bench_threads") == 0 && i < argc-1 ) {
+      bench_threads = atoi(argv[++i]);
+      continue;
+    }
+
+    if(strcmp(argv[i], "-bench_noencode") == 0) {
+      bench_encode = MS_FALSE;
+      continue;
+    }
+
+  }
+
+  if(benchfile) { /* the map is loaded once, -c applies to the extents list */
+    bench_iterations = iterations;
+    iterations = 1;
   }
 
   for(draws=0; draws<iterations; draws++) {
@@ -88,7 +388,8 @@ int main(int argc, char *argv[])
       fprintf(stdout,
               "Syntax: shp2img -m mapfile [-o image] [-e minx miny maxx maxy] [-s sizex sizey]\n"
               "               [-l \"layer1 [layers2...]\"] [-i format]\n"
-              "               [-all_debug n] [-map_debug n] [-layer_debug n] [-p n] [-c n] [-d layername datavalue]\n");
+              "               [-all_debug n] [-map_debug n] [-layer_debug n] [-p n] [-c n] [-d layername datavalue]\n"
+              "               [-bench file [-bench_threads n] [-bench_noencode]]\n");
 
 
       fprintf(stdout,"  -m mapfile: Map file to operate on - required\n" );
@@ -103,6 +404,10 @@ int main(int argc, char *argv[])
       fprintf(stdout,"  -c n: draw map n number of times\n" );
       fprintf(stdout,"  -p n: pause for n seconds after reading the map\n" );
       fprintf(stdout,"  -d layername datavalue: change DATA value for layer\n" );
+      fprintf(stdout,"  -bench file: draw the map for each extent (minx miny maxx maxy) or EPSG:3857 tile (z x y)\n"
+              "     listed in file, -c times over, and report the throughput and latencies by stage\n" );
+      fprintf(stdout,"  -bench_threads n: draw with n threads, each on its own copy of the map\n" );
+      fprintf(stdout,"  -bench_noencode: do not encode the images drawn\n" );
 
 
       exit(0);
@@ -126,6 +431,7 @@ int main(int argc, char *argv[])
     for(i=1; i<argc; i++) { /* Step though the user arguments, 1st to find map file */
 
       if(strcmp(argv[i],"-m") == 0) {
+        loadstart = msStatsNow();
         map = msLoadMap(argv[i+1], NULL);
         if(!map) {
           msWriteError(stderr);
@@ -133,6 +439,7 @@ int main(int argc, char *argv[])
           exit(1);
         }
         msApplyDefaultSubstitutions(map);
+        msStatsCreate(map, loadstart);
       }
     }
 
@@ -293,6 +600,16 @@ int main(int argc, char *argv[])
       }
     }
 
+    if(benchfile) {
+      int status = benchmark(map, benchfile, bench_iterations, bench_threads, bench_encode);
+
+      if(status != MS_SUCCESS)
+        msWriteError(stderr);
+      msFreeMap(map);
+      msCleanup();
+      exit(status == MS_SUCCESS ? 0 : 1);
+    }
+
     image = msDrawMap(map, MS_FALSE);
 
     if(!image) {
@@ -0,0 +1,82 @@
+/******************************************************************************
+ * $Id$
+ *
+ * Project:  MapServer
+ * Purpose:  Command line utility to build the attribute indexes (.aix) of
+ *           shapefile fields, used by equality FILTERs on these fields.
+ * Author:   Steve Lime and the MapServer team.
+ *
+ ******************************************************************************
+ * Copyright (c) 1996-2005 Regents of the University of Minnesota.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies of this Software or works derived from this Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mapserver.h"
+
+
+
+int main(int argc, char *argv[])
+{
+  shapefileObj shapefile;
+  char *filename;
+  int i;
+
+  if(argc > 1 && strcmp(argv[1], "-v") == 0) {
+    printf("%s\n", msGetVersion());
+    exit(0);
+  }
+
+  /* ------------------------------------------------------------------------------- */
+  /*       Check the number of arguments, return syntax if not correct               */
+  /* ------------------------------------------------------------------------------- */
+  if( argc < 3 ) {
+    fprintf(stderr,"Syntax: shpattrindex [shapefile] [item] ...\n" );
+    fprintf(stderr,"Writes [shapefile].[item].aix (the item in lower case) for every item listed.\n" );
+    fprintf(stderr,"A layer FILTER testing one of these items for equality only reads the records\n" );
+    fprintf(stderr,"its index lists. Indexes older than the .dbf file are ignored.\n" );
+    exit(1);
+  }
+
+  msSetErrorFile("stderr", NULL);
+
+  if(msShapefileOpen(&shapefile, "rb", argv[1], MS_TRUE) == -1) {
+    fprintf(stderr,"Unable to open %s shapefile.\n",argv[1]);
+    exit(1);
+  }
+
+  for(i=2; i<argc; i++) {
+    filename = msSHPAttributeIndexFilename(argv[1], argv[i]);
+    if(msSHPWriteAttributeIndex(&shapefile, argv[i], filename) != MS_SUCCESS) {
+      msWriteError(stderr);
+      free(filename);
+      msShapefileClose(&shapefile);
+      exit(1);
+    }
+    printf("%s: %d records\n", filename, shapefile.numshapes);
+    free(filename);
+  }
+
+  msShapefileClose(&shapefile);
+  return(0);
+}
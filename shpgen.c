@@ -0,0 +1,219 @@
+/******************************************************************************
+ * $Id$
+ *
+ * Project:  MapServer
+ * Purpose:  Command line utility to build the generalized geometry bands of
+ *           a line or polygon shapefile (see GENERALIZED_GEOMETRY).
+ * Author:   Steve Lime and the MapServer team.
+ *
+ ******************************************************************************
+ * Copyright (c) 1996-2005 Regents of the University of Minnesota.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies of this Software or works derived from this Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <string.h>
+
+#include "mapserver.h"
+
+
+
+/* ---- squared distance from p to the segment a-b ---- */
+static double segment_distance2(const pointObj *p, const pointObj *a, const pointObj *b)
+{
+  double dx = b->x - a->x, dy = b->y - a->y, t;
+
+  if(dx == 0 && dy == 0)
+    return (p->x - a->x)*(p->x - a->x) + (p->y - a->y)*(p->y - a->y);
+
+  t = ((p->x - a->x)*dx + (p->y - a->y)*dy) / (dx*dx + dy*dy);
+  if(t < 0) t = 0;
+  else if(t > 1) t = 1;
+
+  dx = a->x + t*dx - p->x;
+  dy = a->y + t*dy - p->y;
+  return dx*dx + dy*dy;
+}
+
+/*
+** Douglas-Peucker simplification of the points of line, in place. The first
+** and last points are always kept. Returns the number of points left.
+*/
+static int simplify_line(lineObj *line, double tolerance, char *keep, int *stack)
+{
+  int i, n, top = 0;
+  double tolerance2 = tolerance * tolerance;
+
+  if(line->numpoints < 3) return line->numpoints;
+
+  memset(keep, 0, line->numpoints);
+  keep[0] = keep[line->numpoints-1] = 1;
+  stack[top++] = 0;
+  stack[top++] = line->numpoints-1;
+
+  while(top > 0) {
+    int last = stack[--top], first = stack[--top], farthest = -1;
+    double max2 = tolerance2;
+
+    for(i=first+1; i<last; i++) {
+      double d2 = segment_distance2(&line->point[i], &line->point[first], &line->point[last]);
+      if(d2 > max2) {
+        max2 = d2;
+        farthest = i;
+      }
+    }
+
+    if(farthest != -1) {
+      keep[farthest] = 1;
+      stack[top++] = first;
+      stack[top++] = farthest;
+      stack[top++] = farthest;
+      stack[top++] = last;
+    }
+  }
+
+  for(i=0, n=0; i<line->numpoints; i++) {
+    if(keep[i]) line->point[n++] = line->point[i];
+  }
+  line->numpoints = n;
+
+  return n;
+}
+
+int main(int argc, char *argv[])
+{
+  SHPHandle    inSHP,outSHP; /* ---- Shapefile file pointers ---- */
+  shapeObj     shape;
+  int          shpType, nShapes;
+  int          i,j,k,band;
+  int          maxpoints = 0;
+  char         *keep = NULL, *filename;
+  int          *stack = NULL;
+  pointObj     *points = NULL;
+  double       tolerance;
+  long         inpoints, outpoints;
+
+  if(argc > 1 && strcmp(argv[1], "-v") == 0) {
+    printf("%s\n", msGetVersion());
+    exit(0);
+  }
+
+  /* ------------------------------------------------------------------------------- */
+  /*       Check the number of arguments, return syntax if not correct               */
+  /* ------------------------------------------------------------------------------- */
+  if( argc < 3 ) {
+    fprintf(stderr,"Syntax: shpgen [shapefile] [tolerance] ...\n" );
+    fprintf(stderr,"Writes [shapefile]_g1 for the first tolerance (in data units), [shapefile]_g2 for the next one...\n" );
+    exit(1);
+  }
+
+  msSetErrorFile("stderr", NULL);
+
+  /* ------------------------------------------------------------------------------- */
+  /*       Open the shapefile                                                        */
+  /* ------------------------------------------------------------------------------- */
+  inSHP = msSHPOpen(argv[1], "rb" );
+  if( !inSHP ) {
+    fprintf(stderr,"Unable to open %s shapefile.\n",argv[1]);
+    exit(1);
+  }
+  msSHPGetInfo(inSHP, &nShapes, &shpType);
+
+  if( shpType != SHP_ARC && shpType != SHP_POLYGON && shpType != SHP_ARCM && shpType != SHP_POLYGONM &&
+      shpType != SHP_ARCZ && shpType != SHP_POLYGONZ ) {
+    fprintf(stderr,"Only line and polygon shapefiles can be generalized.\n");
+    exit(1);
+  }
+
+  for(band=1; band<argc-1; band++) {
+    tolerance = atof(argv[band+1]);
+    if(tolerance <= 0) {
+      fprintf(stderr,"Invalid tolerance %s.\n", argv[band+1]);
+      exit(1);
+    }
+
+    filename = msSHPGeneralizedFilename(argv[1], band);
+    outSHP = msSHPCreate(filename, shpType);
+    if( outSHP == NULL ) {
+      fprintf( stderr, "Failed to create file '%s'.\n", filename );
+      exit( 1 );
+    }
+
+    /* ------------------------------------------------------------------------------- */
+    /*       Write every shape, in the same order, so records match the .dbf          */
+    /* ------------------------------------------------------------------------------- */
+    inpoints = outpoints = 0;
+    for(i=0; i<nShapes; i++) {
+      msInitShape(&shape);
+      msSHPReadShape( inSHP, i, &shape );
+
+      for(j=0, k=0; j<shape.numlines; j++) {
+        lineObj *line = &shape.line[j];
+        int minpoints = (shape.type == MS_SHAPE_POLYGON) ? 4 : 2;
+
+        inpoints += line->numpoints;
+
+        if(line->numpoints > maxpoints) {
+          maxpoints = line->numpoints;
+          keep = (char *) msSmallRealloc(keep, maxpoints);
+          stack = (int *) msSmallRealloc(stack, sizeof(int) * 2 * maxpoints);
+          points = (pointObj *) msSmallRealloc(points, sizeof(pointObj) * maxpoints);
+        }
+
+        /* ---- simplify a copy, rings that collapse are dropped unless they are all that is left of the shape ---- */
+        if(line->numpoints >= minpoints) {
+          lineObj simplified;
+
+          memcpy(points, line->point, sizeof(pointObj) * line->numpoints);
+          simplified.numpoints = line->numpoints;
+          simplified.point = points;
+
+          if(simplify_line(&simplified, tolerance, keep, stack) >= minpoints) {
+            memcpy(line->point, points, sizeof(pointObj) * simplified.numpoints);
+            line->numpoints = simplified.numpoints;
+          } else if(!(k == 0 && j == shape.numlines-1)) {
+            free(line->point);
+            continue;
+          }
+        }
+
+        outpoints += line->numpoints;
+        shape.line[k++] = *line;
+      }
+      if(shape.numlines > 0) shape.numlines = k;
+
+      msSHPWriteShape( outSHP, &shape );
+      msFreeShape( &shape );
+    }
+
+    msSHPClose(outSHP);
+    printf("%s: tolerance %g, %ld of %ld vertices kept.\n", filename, tolerance, outpoints, inpoints);
+    free(filename);
+  }
+
+  free(keep);
+  free(stack);
+  free(points);
+  msSHPClose(inSHP);
+
+  return(0);
+}
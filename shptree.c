@@ -71,6 +71,7 @@ int main(int argc, char *argv[])
   treeObj *tree;
   int byte_order = MS_NEW_LSB_ORDER, i;
   int depth=0;
+  int packed=MS_FALSE;
 
   if(argc > 1 && strcmp(argv[1], "-v") == 0) {
     printf("%s\n", msGetVersion());
@@ -96,9 +97,13 @@ int main(int argc, char *argv[])
     fprintf(stdout," <depth>   (optional) is the maximum depth of the index\n");
     fprintf(stdout,"           to create, default is 0 meaning that shptree\n");
     fprintf(stdout,"           will calculate a reasonable default depth.\n");
+    fprintf(stdout,"           For packed R-trees this is the number of entries\n");
+    fprintf(stdout,"           per node instead, 0 meaning %d.\n", MS_PACKED_TREE_NODE_SIZE);
     fprintf(stdout," <index_format> (optional) is one of:\n");
     fprintf(stdout,"           NL: LSB byte order, using new index format\n");
     fprintf(stdout,"           NM: MSB byte order, using new index format\n");
+    fprintf(stdout,"           PL: LSB byte order, packed R-tree (MapServer 7.2+)\n");
+    fprintf(stdout,"           PM: MSB byte order, packed R-tree (MapServer 7.2+)\n");
     fprintf(stdout,"       The following old format options are deprecated:\n");
     fprintf(stdout,"           N:  Native byte order\n");
     fprintf(stdout,"           L:  LSB (intel) byte order\n");
@@ -122,6 +127,14 @@ int main(int argc, char *argv[])
       byte_order = MS_NEW_LSB_ORDER;
     if( !strcasecmp(argv[3],"NM" ))
       byte_order = MS_NEW_MSB_ORDER;
+    if( !strcasecmp(argv[3],"PL" )) {
+      byte_order = MS_NEW_LSB_ORDER;
+      packed = MS_TRUE;
+    }
+    if( !strcasecmp(argv[3],"PM" )) {
+      byte_order = MS_NEW_MSB_ORDER;
+      packed = MS_TRUE;
+    }
   }
 
   if(msShapefileOpen(&shapefile, "rb", argv[1], MS_TRUE) == -1) {
@@ -129,10 +142,19 @@ int main(int argc, char *argv[])
     exit(0);
   }
 
-  printf( "creating index of %s %s format\n",(byte_order < 1 ? "old (deprecated)" :"new"),
+  printf( "creating index of %s %s format\n",(byte_order < 1 ? "old (deprecated)" : (packed ? "packed R-tree" : "new")),
           ((byte_order == MS_NATIVE_ORDER) ? "native" :
            ((byte_order == MS_LSB_ORDER) || (byte_order == MS_NEW_LSB_ORDER)? " LSB":"MSB")));
 
+  if(packed) {
+    if(msWritePackedTree(&shapefile, AddFileSuffix(argv[1], MS_INDEX_EXTENSION), byte_order, depth) != MS_TRUE) {
+      msWriteError(stdout);
+      exit(0);
+    }
+    msShapefileClose(&shapefile);
+    return(0);
+  }
+
   tree = msCreateTree(&shapefile, depth);
   if(!tree) {
 #if MAX_SUBNODE == 2
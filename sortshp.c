@@ -76,6 +76,44 @@ static int compare_number_ascending(const void *a, const void *b)
   return(0);
 }
 
+/* ---- Hilbert curve order of the grid cell (x,y), both in [0, HILBERT_SIZE) ---- */
+#define HILBERT_SIZE 65536
+
+static double hilbert_index(unsigned int x, unsigned int y)
+{
+  unsigned int rx, ry, s, t;
+  double d = 0;
+
+  for(s=HILBERT_SIZE/2; s>0; s/=2) {
+    rx = (x & s) > 0;
+    ry = (y & s) > 0;
+    d += (double)s * s * ((3 * rx) ^ ry);
+
+    /* ---- rotate the quadrant ---- */
+    if(ry == 0) {
+      if(rx == 1) {
+        x = HILBERT_SIZE-1 - x;
+        y = HILBERT_SIZE-1 - y;
+      }
+      t = x;
+      x = y;
+      y = t;
+    }
+  }
+  return(d);
+}
+
+static unsigned int hilbert_cell(double value, double min, double max)
+{
+  double cell;
+
+  if(max <= min) return(0);
+  cell = (value - min) / (max - min) * (HILBERT_SIZE-1);
+  if(cell < 0) return(0);
+  if(cell > HILBERT_SIZE-1) return(HILBERT_SIZE-1);
+  return((unsigned int) cell);
+}
+
 int main(int argc, char *argv[])
 {
   SHPHandle    inSHP,outSHP; /* ---- Shapefile file pointers ---- */
@@ -90,6 +128,7 @@ int main(int argc, char *argv[])
   char         buffer[1024];
   int i,j;
   int num_fields, num_records;
+  int hilbert = MS_FALSE; /* ---- Sort records in Hilbert curve order of their bounds center ---- */
 
   if(argc > 1 && strcmp(argv[1], "-v") == 0) {
     printf("%s\n", msGetVersion());
@@ -99,8 +138,11 @@ int main(int argc, char *argv[])
   /* ------------------------------------------------------------------------------- */
   /*       Check the number of arguments, return syntax if not correct               */
   /* ------------------------------------------------------------------------------- */
-  if( argc != 5 ) {
+  if( argc == 4 && strcasecmp(argv[3], "-hilbert") == 0 )
+    hilbert = MS_TRUE;
+  else if( argc != 5 ) {
     fprintf(stderr,"Syntax: sortshp [infile] [outfile] [item] [ascending|descending]\n" );
+    fprintf(stderr,"        sortshp [infile] [outfile] -hilbert\n" );
     exit(1);
   }
 
@@ -129,17 +171,19 @@ int main(int argc, char *argv[])
   num_fields = msDBFGetFieldCount(inDBF);
   num_records = msDBFGetRecordCount(inDBF);
 
-  for(i=0; i<num_fields; i++) {
-    msDBFGetFieldInfo(inDBF,i,fName,NULL,NULL);
-    if(strncasecmp(argv[3],fName,strlen(argv[3])) == 0) { /* ---- Found it ---- */
-      fieldNumber = i;
-      break;
+  if(!hilbert) {
+    for(i=0; i<num_fields; i++) {
+      msDBFGetFieldInfo(inDBF,i,fName,NULL,NULL);
+      if(strncasecmp(argv[3],fName,strlen(argv[3])) == 0) { /* ---- Found it ---- */
+        fieldNumber = i;
+        break;
+      }
     }
-  }
 
-  if(fieldNumber < 0) {
-    fprintf(stderr,"Item %s doesn't exist in %s\n",argv[3],buffer);
-    exit(1);
+    if(fieldNumber < 0) {
+      fprintf(stderr,"Item %s doesn't exist in %s\n",argv[3],buffer);
+      exit(1);
+    }
   }
 
   array = (sortStruct *)malloc(sizeof(sortStruct)*num_records); /* ---- Allocate the array ---- */
@@ -151,35 +195,51 @@ int main(int argc, char *argv[])
   /* ------------------------------------------------------------------------------- */
   /*       Load the array to be sorted                                               */
   /* ------------------------------------------------------------------------------- */
-  dbfField = msDBFGetFieldInfo(inDBF,fieldNumber,NULL,NULL,NULL);
-  switch (dbfField) {
-    case FTString:
-      for(i=0; i<num_records; i++) {
-        strlcpy(array[i].string, msDBFReadStringAttribute( inDBF, i, fieldNumber), sizeof(array[i].string));
-        array[i].index = i;
-      }
-
-      if(*argv[4] == 'd')
-        qsort(array, num_records, sizeof(sortStruct), compare_string_descending);
+  if(hilbert) {
+    rectObj bounds, shpBounds;
+
+    msSHPReadBounds(inSHP, -1, &shpBounds);
+    for(i=0; i<num_records; i++) {
+      if(msSHPReadBounds(inSHP, i, &bounds) == MS_SUCCESS)
+        array[i].number = hilbert_index(hilbert_cell((bounds.minx+bounds.maxx)/2, shpBounds.minx, shpBounds.maxx),
+                                        hilbert_cell((bounds.miny+bounds.maxy)/2, shpBounds.miny, shpBounds.maxy));
       else
-        qsort(array, num_records, sizeof(sortStruct), compare_string_ascending);
-      break;
-    case FTInteger:
-    case FTDouble:
-      for(i=0; i<num_records; i++) {
-        array[i].number = msDBFReadDoubleAttribute( inDBF, i, fieldNumber);
-        array[i].index = i;
-      }
-
-      if(*argv[4] == 'd')
-        qsort(array, num_records, sizeof(sortStruct), compare_number_descending);
-      else
-        qsort(array, num_records, sizeof(sortStruct), compare_number_ascending);
+        array[i].number = (double)HILBERT_SIZE * HILBERT_SIZE; /* ---- null shapes go last ---- */
+      array[i].index = i;
+    }
 
-      break;
-    default:
-      fprintf(stderr,"Data type for item %s not supported.\n",argv[3]);
-      exit(1);
+    qsort(array, num_records, sizeof(sortStruct), compare_number_ascending);
+  } else {
+    dbfField = msDBFGetFieldInfo(inDBF,fieldNumber,NULL,NULL,NULL);
+    switch (dbfField) {
+      case FTString:
+        for(i=0; i<num_records; i++) {
+          strlcpy(array[i].string, msDBFReadStringAttribute( inDBF, i, fieldNumber), sizeof(array[i].string));
+          array[i].index = i;
+        }
+
+        if(*argv[4] == 'd')
+          qsort(array, num_records, sizeof(sortStruct), compare_string_descending);
+        else
+          qsort(array, num_records, sizeof(sortStruct), compare_string_ascending);
+        break;
+      case FTInteger:
+      case FTDouble:
+        for(i=0; i<num_records; i++) {
+          array[i].number = msDBFReadDoubleAttribute( inDBF, i, fieldNumber);
+          array[i].index = i;
+        }
+
+        if(*argv[4] == 'd')
+          qsort(array, num_records, sizeof(sortStruct), compare_number_descending);
+        else
+          qsort(array, num_records, sizeof(sortStruct), compare_number_ascending);
+
+        break;
+      default:
+        fprintf(stderr,"Data type for item %s not supported.\n",argv[3]);
+        exit(1);
+    }
   }
 
   /* ------------------------------------------------------------------------------- */
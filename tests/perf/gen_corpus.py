@@ -0,0 +1,349 @@
+#!/usr/bin/env python3
+# ===========================================================================
+# Project:  MapServer
+# Purpose:  Generate the data of the performance corpus
+# Author:   MapServer team.
+#
+# ===========================================================================
+# Copyright (c) 1996-2016 Regents of the University of Minnesota.
+#
+# Permission is hereby granted, free of charge, to any person obtaining a
+# copy of this software and associated documentation files (the "Software"),
+# to deal in the Software without restriction, including without limitation
+# the rights to use, copy, modify, merge, publish, distribute, sublicense,
+# and/or sell copies of the Software, and to permit persons to whom the
+# Software is furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included
+# in all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+# OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+# THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+# FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+# DEALINGS IN THE SOFTWARE.
+# ===========================================================================
+
+"""Generate the data of the performance corpus, see README.
+
+Writes to the data directory (next to this script by default):
+
+  polygons.shp  star shaped polygons with a class (0-9) and a name
+  lines.shp     smoothly wandering lines with a name, for the labels that
+                follow them
+  points.shp    points with a name and a population
+  raster.tif    an 8 bit grayscale GeoTIFF (uncompressed, with raster.tfw)
+  postgis.sql   the same vector layers built in PostGIS
+  map.extents   windows of the data area at several scales, for shp2img -bench
+  tiles.extents EPSG:3857 tiles (z x y) of the data area, for shp2img -bench
+
+Everything only depends on the seed, so the data of two runs is the same and
+timings can be compared. Only the Python standard library is used.
+"""
+
+import argparse
+import math
+import os
+import random
+import struct
+
+# the data area, in EPSG:4326
+MINX, MINY, MAXX, MAXY = 0.0, 40.0, 10.0, 50.0
+
+
+class ShapefileWriter(object):
+    """Writes a .shp/.shx/.dbf triplet of one shape type."""
+
+    POINT, POLYLINE, POLYGON = 1, 3, 5
+
+    def __init__(self, basename, shapetype, fields):
+        self.basename = basename
+        self.shapetype = shapetype
+        self.fields = fields  # (name, 'C' or 'N', length, decimals)
+        self.records = []  # (content bytes, bounds)
+        self.attributes = []
+
+    def add_point(self, x, y, values):
+        self.records.append((struct.pack('<idd', self.POINT, x, y), (x, y, x, y)))
+        self.attributes.append(values)
+
+    def add_parts(self, parts, values):
+        points = [pt for part in parts for pt in part]
+        xs = [pt[0] for pt in points]
+        ys = [pt[1] for pt in points]
+        bounds = (min(xs), min(ys), max(xs), max(ys))
+        content = struct.pack('<i4d2i', self.shapetype, bounds[0], bounds[1], bounds[2], bounds[3],
+                              len(parts), len(points))
+        start = 0
+        for part in parts:
+            content += struct.pack('<i', start)
+            start += len(part)
+        content += b''.join(struct.pack('<2d', x, y) for x, y in points)
+        self.records.append((content, bounds))
+        self.attributes.append(values)
+
+    def _header(self, length_words, bounds):
+        return (struct.pack('>7i', 9994, 0, 0, 0, 0, 0, length_words) +
+                struct.pack('<2i4d4d', 1000, self.shapetype, bounds[0], bounds[1], bounds[2], bounds[3],
+                            0, 0, 0, 0))
+
+    def close(self):
+        bounds = (min(r[1][0] for r in self.records), min(r[1][1] for r in self.records),
+                  max(r[1][2] for r in self.records), max(r[1][3] for r in self.records))
+
+        shp_length = 50 + sum(4 + len(content) // 2 for content, _ in self.records)
+        with open(self.basename + '.shp', 'wb') as shp, open(self.basename + '.shx', 'wb') as shx:
+            shp.write(self._header(shp_length, bounds))
+            shx.write(self._header(50 + 4 * len(self.records), bounds))
+            offset = 50
+            for i, (content, _) in enumerate(self.records):
+                shp.write(struct.pack('>2i', i + 1, len(content) // 2))
+                shp.write(content)
+                shx.write(struct.pack('>2i', offset, len(content) // 2))
+                offset += 4 + len(content) // 2
+
+        record_length = 1 + sum(f[2] for f in self.fields)
+        with open(self.basename + '.dbf', 'wb') as dbf:
+            dbf.write(struct.pack('<4BIHH20x', 3, 116, 1, 1, len(self.attributes),
+                                  32 + 32 * len(self.fields) + 1, record_length))
+            for name, ftype, length, decimals in self.fields:
+                dbf.write(struct.pack('<11sc4xBB14x', name.encode('ascii'), ftype.encode('ascii'),
+                                      length, decimals))
+            dbf.write(b'\r')
+            for values in self.attributes:
+                dbf.write(b' ')
+                for (name, ftype, length, decimals), value in zip(self.fields, values):
+                    if ftype == 'N':
+                        text = ('%*.*f' % (length, decimals, value)) if decimals else ('%*d' % (length, value))
+                    else:
+                        text = str(value).ljust(length)
+                    dbf.write(text.encode('latin-1')[:length])
+            dbf.write(b'\x1a')
+
+
+def star(rng, cx, cy, radius, numvertices):
+    """A closed star shaped ring around cx, cy, clockwise (outer ring)."""
+    ring = []
+    for i in range(numvertices):
+        angle = -2 * math.pi * i / numvertices
+        r = radius * (0.6 + 0.4 * rng.random())
+        ring.append((cx + r * math.cos(angle), cy + r * math.sin(angle)))
+    ring.append(ring[0])
+    return ring
+
+
+def wander(rng, x, y, step, numvertices):
+    """A line of numvertices with a smoothly varying heading."""
+    heading = rng.uniform(0, 2 * math.pi)
+    turn = 0.0
+    line = [(x, y)]
+    for _ in range(numvertices - 1):
+        turn = 0.8 * turn + rng.uniform(-0.05, 0.05)
+        heading += turn
+        x = min(MAXX, max(MINX, x + step * math.cos(heading)))
+        y = min(MAXY, max(MINY, y + step * math.sin(heading)))
+        line.append((x, y))
+    return line
+
+
+def write_polygons(rng, path, count, numvertices):
+    shp = ShapefileWriter(path, ShapefileWriter.POLYGON, [('ID', 'N', 10, 0), ('CLASS', 'N', 2, 0),
+                                                          ('NAME', 'C', 24, 0)])
+    side = int(math.ceil(math.sqrt(count)))
+    cell = (MAXX - MINX) / side
+    for i in range(count):
+        cx = MINX + (i % side + 0.5) * cell
+        cy = MINY + (i // side + 0.5) * cell
+        outer = star(rng, cx, cy, cell * 0.45, numvertices)
+        parts = [outer]
+        if i % 4 == 0:  # some have a hole, counterclockwise
+            parts.append(list(reversed(star(rng, cx, cy, cell * 0.15, max(4, numvertices // 4)))))
+        shp.add_parts(parts, (i, i % 10, 'Polygon %d' % i))
+    shp.close()
+
+
+def write_lines(rng, path, count, numvertices):
+    shp = ShapefileWriter(path, ShapefileWriter.POLYLINE, [('ID', 'N', 10, 0), ('NAME', 'C', 24, 0)])
+    for i in range(count):
+        x, y = rng.uniform(MINX, MAXX), rng.uniform(MINY, MAXY)
+        shp.add_parts([wander(rng, x, y, (MAXX - MINX) / 2000.0, numvertices)], (i, 'Road %d' % i))
+    shp.close()
+
+
+def write_points(rng, path, count):
+    shp = ShapefileWriter(path, ShapefileWriter.POINT, [('ID', 'N', 10, 0), ('NAME', 'C', 24, 0),
+                                                        ('POP', 'N', 10, 0)])
+    for i in range(count):
+        shp.add_point(rng.uniform(MINX, MAXX), rng.uniform(MINY, MAXY),
+                      (i, 'Place %d' % i, int(rng.paretovariate(1.2) * 1000)))
+    shp.close()
+
+
+def write_raster(rng, path, size):
+    """An uncompressed 8 bit grayscale TIFF in strips, georeferenced by a world file."""
+    rowsperstrip = 64
+    numstrips = (size + rowsperstrip - 1) // rowsperstrip
+    waves = [(rng.uniform(2, 12), rng.uniform(2, 12), rng.uniform(0, 2 * math.pi)) for _ in range(3)]
+    # sin(a + b) = sin(a)cos(b) + cos(a)sin(b), with a along the rows and b along the columns
+    cols = [[(math.sin(fu * col * math.pi / size), math.cos(fu * col * math.pi / size))
+             for col in range(size)] for fu, fv, phase in waves]
+    row_bytes = []
+    for row in range(size):
+        values = [127.5] * size
+        for (fu, fv, phase), col_terms in zip(waves, cols):
+            b = fv * row * math.pi / size + phase
+            sb, cb = 42 * math.sin(b), 42 * math.cos(b)
+            values = [z + su * cb + cu * sb for z, (su, cu) in zip(values, col_terms)]
+        row_bytes.append(bytes(int(z) & 0xff for z in values))
+
+    entries = 9
+    ifd_offset = 8
+    offsets_offset = ifd_offset + 2 + entries * 12 + 4
+    counts_offset = offsets_offset + 4 * numstrips
+    data_offset = counts_offset + 4 * numstrips
+    strip_offsets, strip_counts = [], []
+    offset = data_offset
+    for s in range(numstrips):
+        rows = min(rowsperstrip, size - s * rowsperstrip)
+        strip_offsets.append(offset)
+        strip_counts.append(rows * size)
+        offset += rows * size
+
+    def entry(tag, ftype, count, value):
+        return struct.pack('<HHII', tag, ftype, count, value)
+
+    with open(path, 'wb') as tif:
+        tif.write(b'II' + struct.pack('<HI', 42, ifd_offset))
+        tif.write(struct.pack('<H', entries))
+        tif.write(entry(256, 4, 1, size))                 # ImageWidth
+        tif.write(entry(257, 4, 1, size))                 # ImageLength
+        tif.write(entry(258, 3, 1, 8))                    # BitsPerSample
+        tif.write(entry(259, 3, 1, 1))                    # Compression: none
+        tif.write(entry(262, 3, 1, 1))                    # Photometric: black is zero
+        tif.write(entry(273, 4, numstrips, offsets_offset if numstrips > 1 else strip_offsets[0]))
+        tif.write(entry(277, 3, 1, 1))                    # SamplesPerPixel
+        tif.write(entry(278, 4, 1, rowsperstrip))         # RowsPerStrip
+        tif.write(entry(279, 4, numstrips, counts_offset if numstrips > 1 else strip_counts[0]))
+        tif.write(struct.pack('<I', 0))
+        tif.write(struct.pack('<%dI' % numstrips, *strip_offsets))
+        tif.write(struct.pack('<%dI' % numstrips, *strip_counts))
+        for row in row_bytes:
+            tif.write(row)
+
+    pixel = (MAXX - MINX) / size
+    with open(os.path.splitext(path)[0] + '.tfw', 'w') as tfw:
+        tfw.write('%.12f\n0\n0\n%.12f\n%.12f\n%.12f\n' % (pixel, -pixel, MINX + pixel / 2, MAXY - pixel / 2))
+
+
+def write_postgis(path, polygons, lines, points):
+    """The vector layers built by the server, within the same area."""
+    side = int(math.ceil(math.sqrt(polygons)))
+    cell = (MAXX - MINX) / side
+    sql = """-- MapServer performance corpus, see tests/perf/README
+BEGIN;
+DROP TABLE IF EXISTS perf_polygons, perf_lines, perf_points;
+
+SELECT setseed(0.5);
+
+CREATE TABLE perf_polygons AS
+  SELECT i AS id, i %% 10 AS class, 'Polygon ' || i AS name,
+         ST_Buffer(ST_SetSRID(ST_MakePoint(%(minx)f + (i %% %(side)d + 0.5) * %(cell)f,
+                                           %(miny)f + (i / %(side)d + 0.5) * %(cell)f), 4326),
+                   %(radius)f, 8) AS geom
+  FROM generate_series(0, %(polygons)d - 1) AS i;
+
+CREATE TABLE perf_lines AS
+  SELECT l.id, 'Road ' || l.id AS name,
+         ST_SetSRID(ST_MakeLine(ST_MakePoint(l.x + %(step)f * v * cos(l.h + v / 40.0),
+                                             l.y + %(step)f * v * sin(l.h + v / 40.0)) ORDER BY v), 4326) AS geom
+  FROM (SELECT i AS id, %(minx)f + random() * %(width)f AS x, %(miny)f + random() * %(height)f AS y,
+               random() * 2 * pi() AS h
+        FROM generate_series(0, %(lines)d - 1) AS i) AS l,
+       generate_series(0, 199) AS v
+  GROUP BY l.id;
+
+CREATE TABLE perf_points AS
+  SELECT i AS id, 'Place ' || i AS name, (1000 / power(random() + 0.001, 0.8))::integer AS pop,
+         ST_SetSRID(ST_MakePoint(%(minx)f + random() * %(width)f, %(miny)f + random() * %(height)f), 4326) AS geom
+  FROM generate_series(0, %(points)d - 1) AS i;
+
+CREATE INDEX perf_polygons_geom ON perf_polygons USING GIST (geom);
+CREATE INDEX perf_lines_geom ON perf_lines USING GIST (geom);
+CREATE INDEX perf_points_geom ON perf_points USING GIST (geom);
+COMMIT;
+
+ANALYZE perf_polygons;
+ANALYZE perf_lines;
+ANALYZE perf_points;
+""" % {'minx': MINX, 'miny': MINY, 'width': MAXX - MINX, 'height': MAXY - MINY, 'side': side,
+       'cell': cell, 'radius': cell * 0.4, 'step': (MAXX - MINX) / 2000.0,
+       'polygons': polygons, 'lines': lines, 'points': points}
+    with open(path, 'w') as f:
+        f.write(sql)
+
+
+def write_extents(rng, path, count):
+    """The whole data area, and windows of it at the scale of a region and of a city."""
+    with open(path, 'w') as f:
+        f.write('# minx miny maxx maxy, in EPSG:4326\n')
+        f.write('%.6f %.6f %.6f %.6f\n' % (MINX, MINY, MAXX, MAXY))
+        for width in ((MAXX - MINX) / 8, (MAXX - MINX) / 64):
+            for _ in range(count):
+                x = rng.uniform(MINX, MAXX - width)
+                y = rng.uniform(MINY, MAXY - width)
+                f.write('%.6f %.6f %.6f %.6f\n' % (x, y, x + width, y + width))
+
+
+def write_tiles(rng, path, count):
+    """EPSG:3857 tiles of the data area at zooms 7 to 11."""
+    def tile(lon, lat, z):
+        n = 2 ** z
+        x = int((lon + 180.0) / 360.0 * n)
+        y = int((1.0 - math.asinh(math.tan(math.radians(lat))) / math.pi) / 2.0 * n)
+        return x, y
+
+    with open(path, 'w') as f:
+        f.write('# z x y\n')
+        for z in range(7, 12):
+            for _ in range(count):
+                x, y = tile(rng.uniform(MINX, MAXX), rng.uniform(MINY, MAXY), z)
+                f.write('%d %d %d\n' % (z, x, y))
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Generate the data of the MapServer performance corpus.')
+    parser.add_argument('--out', default=os.path.join(os.path.dirname(os.path.abspath(__file__)), 'data'),
+                        help='output directory (default: %(default)s)')
+    parser.add_argument('--scale', type=float, default=1.0,
+                        help='multiplies the number of features and the raster size (default: 1)')
+    parser.add_argument('--seed', type=int, default=4242, help='random seed (default: %(default)s)')
+    args = parser.parse_args()
+
+    if not os.path.isdir(args.out):
+        os.makedirs(args.out)
+
+    def scaled(n):
+        return max(1, int(n * args.scale))
+
+    polygons, lines, points = scaled(20000), scaled(4000), scaled(50000)
+    rng = random.Random(args.seed)
+
+    print('polygons.shp: %d polygons' % polygons)
+    write_polygons(rng, os.path.join(args.out, 'polygons'), polygons, 48)
+    print('lines.shp: %d lines' % lines)
+    write_lines(rng, os.path.join(args.out, 'lines'), lines, 200)
+    print('points.shp: %d points' % points)
+    write_points(rng, os.path.join(args.out, 'points'), points)
+    size = max(64, int(2048 * math.sqrt(args.scale)))
+    print('raster.tif: %dx%d pixels' % (size, size))
+    write_raster(rng, os.path.join(args.out, 'raster.tif'), size)
+    write_postgis(os.path.join(args.out, 'postgis.sql'), polygons, lines, points)
+    write_extents(rng, os.path.join(args.out, 'map.extents'), 10)
+    write_tiles(rng, os.path.join(args.out, 'tiles.extents'), 10)
+    print('Done, in %s. Run shptree on the shapefiles for the indexed cases (see README).' % args.out)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,213 @@
+#!/usr/bin/env python3
+# ===========================================================================
+# Project:  MapServer
+# Purpose:  Run the performance corpus and compare against a baseline
+# Author:   MapServer team.
+#
+# ===========================================================================
+# Copyright (c) 1996-2016 Regents of the University of Minnesota.
+#
+# Permission is hereby granted, free of charge, to any person obtaining a
+# copy of this software and associated documentation files (the "Software"),
+# to deal in the Software without restriction, including without limitation
+# the rights to use, copy, modify, merge, publish, distribute, sublicense,
+# and/or sell copies of the Software, and to permit persons to whom the
+# Software is furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included
+# in all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+# OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+# THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+# FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+# DEALINGS IN THE SOFTWARE.
+# ===========================================================================
+
+"""Run the performance corpus with shp2img -bench, see README.
+
+Each case draws a mapfile of this directory over an extents file of the
+generated data. The throughput and the latencies by stage are printed, and
+can be saved as a baseline (--save) or compared against one (--compare):
+the comparison fails (exit status 1) when a stage got slower than the
+threshold allows.
+
+Cases the build cannot run (no PROJ, GDAL or database) are reported as
+skipped, and left out of the comparison.
+"""
+
+import argparse
+import datetime
+import json
+import os
+import platform
+import re
+import shutil
+import subprocess
+import sys
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+
+# name: (mapfile, extents file in data/, layers or None for all)
+CASES = {
+    'labels': ('labels.map', 'map.extents', None),
+    'thematic': ('thematic.map', 'map.extents', None),
+    'reproject': ('reproject.map', 'tiles.extents', None),
+    'raster': ('raster.map', 'map.extents', None),
+    'postgis': ('postgis.map', 'map.extents', None),
+}
+
+# below this many milliseconds the differences are noise
+NOISE_FLOOR_MS = 0.5
+
+STAGE_LINE = re.compile(r'^(\w+)\s+([\d.]+)\s+([\d.]+)\s+([\d.]+)\s+([\d.]+)\s+([\d.]+)$')
+SUMMARY_LINE = re.compile(r'^Drew (\d+) maps .* in ([\d.]+)s: ([\d.]+) maps/s, (\d+) failed')
+
+
+def find_shp2img(path):
+    if path:
+        return path
+    for candidate in (os.path.join(HERE, '..', '..', 'build', 'shp2img'), shutil.which('shp2img')):
+        if candidate and os.path.exists(candidate):
+            return candidate
+    sys.exit('shp2img not found, pass it with --shp2img.')
+
+
+def run_case(shp2img, name, iterations, threads, noencode):
+    mapfile, extents, layers = CASES[name]
+    extents = os.path.join(HERE, 'data', extents)
+    if not os.path.exists(extents):
+        sys.exit('%s is missing, run gen_corpus.py first.' % extents)
+
+    command = [shp2img, '-m', mapfile, '-bench', extents, '-c', str(iterations),
+               '-bench_threads', str(threads)]
+    if noencode:
+        command.append('-bench_noencode')
+    if layers:
+        command += ['-l', layers]
+    proc = subprocess.run(command, cwd=HERE, stdout=subprocess.PIPE, stderr=subprocess.PIPE,
+                          universal_newlines=True)
+
+    result = {'stages': {}}
+    for line in proc.stdout.splitlines():
+        m = SUMMARY_LINE.match(line)
+        if m:
+            result.update(maps=int(m.group(1)), seconds=float(m.group(2)),
+                          maps_per_second=float(m.group(3)), failed=int(m.group(4)))
+            continue
+        m = STAGE_LINE.match(line)
+        if m:
+            result['stages'][m.group(1)] = dict(zip(('mean', 'p50', 'p95', 'p99', 'max'),
+                                                    (float(v) for v in m.groups()[1:])))
+
+    if proc.returncode != 0 or 'maps' not in result or result['failed'] == result['maps']:
+        message = (proc.stderr.strip() or proc.stdout.strip()).splitlines()
+        if not message:
+            return {'skipped': 'exit status %d' % proc.returncode}
+        return {'skipped': message[-1].replace('<br>', '').strip()}
+    return result
+
+
+def version(shp2img):
+    proc = subprocess.run([shp2img, '-v'], stdout=subprocess.PIPE, stderr=subprocess.STDOUT,
+                          universal_newlines=True)
+    return proc.stdout.strip()
+
+
+def print_results(results):
+    for name, result in results.items():
+        if 'skipped' in result:
+            print('%-10s skipped: %s' % (name, result['skipped']))
+            continue
+        print('%-10s %8.2f maps/s, %d maps, %d failed' % (name, result['maps_per_second'], result['maps'],
+                                                         result['failed']))
+        for stage, values in result['stages'].items():
+            print('  %-12s mean %9.3f  p50 %9.3f  p95 %9.3f  max %9.3f ms' %
+                  (stage, values['mean'], values['p50'], values['p95'], values['max']))
+
+
+def compare(results, baseline, metric, threshold):
+    """Prints the changes against the baseline, returns the number of regressions."""
+    regressions = 0
+    limit = 1.0 + threshold / 100.0
+
+    print('\n%-10s %-12s %12s %12s %9s' % ('case', 'stage', 'baseline', 'current', 'slowdown'))
+    for name, result in results.items():
+        base = baseline.get(name)
+        if 'skipped' in result or not base or 'skipped' in base:
+            continue
+
+        rows = [('maps/s', base['maps_per_second'], result['maps_per_second'],
+                 base['maps_per_second'] / max(result['maps_per_second'], 1e-9))]
+        for stage, values in result['stages'].items():
+            if stage in base['stages']:
+                before, after = base['stages'][stage][metric], values[metric]
+                if before >= NOISE_FLOOR_MS or after >= NOISE_FLOOR_MS:
+                    rows.append((stage, before, after, after / max(before, 1e-9)))
+
+        for stage, before, after, slowdown in rows:
+            flag = ''
+            if slowdown > limit:
+                flag = '  REGRESSION'
+                regressions += 1
+            elif slowdown < 1.0 / limit:
+                flag = '  improved'
+            print('%-10s %-12s %12.3f %12.3f %+8.1f%%%s' % (name, stage, before, after,
+                                                            (slowdown - 1.0) * 100.0, flag))
+    return regressions
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Run the MapServer performance corpus.')
+    parser.add_argument('cases', nargs='*', help='cases to run (default: all): %s' % ', '.join(CASES))
+    parser.add_argument('--shp2img', help='shp2img to run (default: build/shp2img, then the PATH)')
+    parser.add_argument('-c', '--iterations', type=int, default=3,
+                        help='times each extent is drawn (default: %(default)s)')
+    parser.add_argument('--threads', type=int, default=1, help='drawing threads (default: %(default)s)')
+    parser.add_argument('--noencode', action='store_true', help='do not encode the images')
+    parser.add_argument('--save', metavar='FILE', help='save the results as a baseline')
+    parser.add_argument('--compare', metavar='FILE', help='compare the results against a baseline')
+    parser.add_argument('--metric', default='p50', choices=('mean', 'p50', 'p95', 'p99', 'max'),
+                        help='latency compared (default: %(default)s)')
+    parser.add_argument('--threshold', type=float, default=10.0,
+                        help='slowdown in percent reported as a regression (default: %(default)s)')
+    args = parser.parse_args()
+
+    for name in args.cases:
+        if name not in CASES:
+            sys.exit('Unknown case %s, the cases are: %s' % (name, ', '.join(CASES)))
+
+    shp2img = find_shp2img(args.shp2img)
+    results = {}
+    for name in args.cases or CASES:
+        print('Running %s...' % name, file=sys.stderr)
+        results[name] = run_case(shp2img, name, args.iterations, args.threads, args.noencode)
+    print_results(results)
+
+    if args.save:
+        with open(args.save, 'w') as f:
+            json.dump({'version': version(shp2img), 'host': platform.node(), 'machine': platform.machine(),
+                       'date': datetime.datetime.now().isoformat(timespec='seconds'),
+                       'iterations': args.iterations, 'threads': args.threads, 'results': results},
+                      f, indent=2, sort_keys=True)
+        print('\nSaved to %s.' % args.save)
+
+    if args.compare:
+        with open(args.compare) as f:
+            baseline = json.load(f)
+        if baseline.get('threads', 1) != args.threads or baseline.get('iterations') != args.iterations:
+            print('\nWarning: the baseline ran with %s iterations and %s threads.' %
+                  (baseline.get('iterations'), baseline.get('threads', 1)))
+        regressions = compare(results, baseline['results'], args.metric, args.threshold)
+        if regressions:
+            print('\n%d regression%s over %.0f%% (%s).' % (regressions, 's' if regressions > 1 else '',
+                                                         args.threshold, args.metric))
+            return 1
+        print('\nNo regression over %.0f%% (%s).' % (args.threshold, args.metric))
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
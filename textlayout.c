@@ -439,6 +439,8 @@ int msLayoutTextSymbol(mapObj *map, textSymbolObj *ts, textPathObj *tgret) {
   text_run *runs;
   double oldpeny=3455,peny,penx=0; /*oldpeny is set to an unreasonable default initial value */
   fontSetObj *fontset = NULL;
+  char *cachekey;
+  textPathObj *cached;
 
   TextInfo glyphs;
   int num_glyphs = 0;
@@ -487,6 +489,21 @@ int msLayoutTextSymbol(mapObj *map, textSymbolObj *ts, textPathObj *tgret) {
   if( text_num_bytes == 0 )
       return 0;
 
+  /* the layout only depends on the string, the fonts, the glyph size and the wrapping settings */
+  cachekey = msSmallMalloc(text_num_bytes + (ts->label->font ? strlen(ts->label->font) : 0) + 64);
+  sprintf(cachekey, "%d:%d:%d:%d:%d:%s\x1f%s", fontset ? 1 : 0, tgret->glyph_size, ts->label->wrap,
+          ts->label->maxlength, ts->label->align, ts->label->font ? ts->label->font : "", ts->annotext);
+  cached = msGetCachedTextPath(cachekey);
+  if(cached) {
+    free(cachekey);
+    tgret->numglyphs = cached->numglyphs;
+    tgret->numlines = cached->numlines;
+    tgret->bounds.bbox = cached->bounds.bbox;
+    tgret->glyphs = msSmallMalloc(MS_MAX(cached->numglyphs,1) * sizeof(glyphObj));
+    memcpy(tgret->glyphs, cached->glyphs, cached->numglyphs * sizeof(glyphObj));
+    return MS_SUCCESS;
+  }
+
   if(text_num_bytes > STATIC_GLYPHS) {
 #ifdef USE_FRIBIDI
     glyphs.bidi_levels = msSmallMalloc(text_num_bytes * sizeof(FriBidiLevel));
@@ -841,7 +858,10 @@ int msLayoutTextSymbol(mapObj *map, textSymbolObj *ts, textPathObj *tgret) {
    * msDebug("bounds for %s: %f %f %f %f\n",ts->annotext,tgret->bounds.bbox.minx,tgret->bounds.bbox.miny,tgret->bounds.bbox.maxx,tgret->bounds.bbox.maxy);
    */
 
+  msCacheTextPath(cachekey, tgret);
+
 cleanup:
+  free(cachekey);
   if(line_descs != static_line_descs) free(line_descs);
   if(glyphs.codepoints != static_codepoints) {
 #ifdef USE_FRIBIDI
@@ -0,0 +1,375 @@
+/******************************************************************************
+ * $Id$
+ *
+ * Project:  MapServer
+ * Purpose:  Command line utility seeding the tiles of a map (Google Maps
+ *           scheme, spherical mercator) into a z/x/y directory tree.
+ * Author:   Steve Lime and the MapServer team.
+ *
+ ******************************************************************************
+ * Copyright (c) 1996-2005 Regents of the University of Minnesota.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies of this Software or works derived from this Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <direct.h>
+#endif
+
+#include "mapserver.h"
+#include "maptile.h"
+#include "mapthread.h"
+
+#if defined(USE_THREAD) && !defined(_WIN32)
+#define TILESEED_THREADS
+#endif
+
+/*
+** The map is loaded once and, with -threads, copied for each thread. The
+** metatiles (see the tile_metatile_level metadata) of each zoom level are
+** drawn in the order of a Hilbert curve over the requested area, so that
+** consecutive drawings read neighbouring data, and each metatile is drawn
+** once with msTileDrawMetatile() and cut into its tiles. The layers keep
+** their connections open between drawings (CLOSE_CONNECTION=DEFER, unless
+** the layer sets it).
+*/
+
+#define TILESEED_MAXZOOM 30
+#define TILESEED_MAXLAT 85.0511287798066
+
+typedef struct {
+  mapservObj *msObj; /* with the map of this thread */
+  const char *outdir;
+  rectObj bounds; /* in degrees */
+  int minzoom, maxzoom, metatile_level;
+  int index, numthreads; /* this thread draws the metatiles index, index+numthreads, ... */
+  int dirzoom, dirx; /* the last directory created */
+  int metatiles, tiles, failed;
+} seedThreadObj;
+
+static void usage(void)
+{
+  fprintf(stdout, "Syntax: tileseed -m mapfile -o directory -z minzoom maxzoom\n"
+          "                [-e minlon minlat maxlon maxlat] [-metatile level] [-threads n]\n\n"
+          "  Draws the tiles of the map over the area (in degrees, the world by\n"
+          "  default) into directory/z/x/y.<extension of the output format>.\n"
+          "  -metatile: tiles on a side of a drawing are 2^level, 0 to 2 (default:\n"
+          "             the tile_metatile_level metadata of the map).\n"
+          "  -threads:  number of drawing threads, each on its own copy of the map.\n");
+  exit(1);
+}
+
+static int seedLonToTile(double lon, int zoom)
+{
+  int n = 1 << zoom;
+  int x = (int) floor((lon + 180.0) / 360.0 * n);
+
+  return MS_MAX(0, MS_MIN(x, n - 1));
+}
+
+static int seedLatToTile(double lat, int zoom)
+{
+  int n = 1 << zoom;
+  double r;
+  int y;
+
+  lat = MS_MAX(-TILESEED_MAXLAT, MS_MIN(lat, TILESEED_MAXLAT));
+  r = lat * MS_PI / 180.0;
+  y = (int) floor((1.0 - log(tan(r) + 1.0 / cos(r)) / MS_PI) / 2.0 * n);
+
+  return MS_MAX(0, MS_MIN(y, n - 1));
+}
+
+/* the point at distance d along the Hilbert curve filling a side x side square, side a power of 2 */
+static void seedHilbertPoint(int side, long long d, int *x, int *y)
+{
+  int s, rx, ry, t;
+
+  *x = *y = 0;
+  for(s=1; s<side; s*=2) {
+    rx = (int) (1 & (d / 2));
+    ry = (int) (1 & (d ^ rx));
+    if(ry == 0) {
+      if(rx == 1) {
+        *x = s - 1 - *x;
+        *y = s - 1 - *y;
+      }
+      t = *x;
+      *x = *y;
+      *y = t;
+    }
+    *x += s * rx;
+    *y += s * ry;
+    d /= 4;
+  }
+}
+
+static int seedMakeDirectory(const char *path)
+{
+#ifdef _WIN32
+  if(_mkdir(path) != 0 && errno != EEXIST) {
+#else
+  if(mkdir(path, 0777) != 0 && errno != EEXIST) {
+#endif
+    msSetError(MS_IOERR, "Unable to create directory %s.", "seedMakeDirectory()", path);
+    return MS_FAILURE;
+  }
+  return MS_SUCCESS;
+}
+
+/* msTileDrawMetatile() callback, writes a tile */
+static int seedWriteTile(void *data, const char *coords, imageObj *img)
+{
+  seedThreadObj *seed = (seedThreadObj *) data;
+  mapObj *map = seed->msObj->map;
+  char path[MS_MAXPATHLEN];
+  int x, y, zoom;
+
+  if(sscanf(coords, "%d %d %d", &x, &y, &zoom) != 3) {
+    msSetError(MS_MISCERR, "Invalid tile coordinates %s.", "seedWriteTile()", coords);
+    return MS_FAILURE;
+  }
+
+  if(zoom != seed->dirzoom || x != seed->dirx) {
+    snprintf(path, sizeof(path), "%s/%d", seed->outdir, zoom);
+    if(seedMakeDirectory(path) != MS_SUCCESS)
+      return MS_FAILURE;
+    snprintf(path, sizeof(path), "%s/%d/%d", seed->outdir, zoom, x);
+    if(seedMakeDirectory(path) != MS_SUCCESS)
+      return MS_FAILURE;
+    seed->dirzoom = zoom;
+    seed->dirx = x;
+  }
+
+  snprintf(path, sizeof(path), "%s/%d/%d/%d.%s", seed->outdir, zoom, x, y,
+           map->outputformat->extension ? map->outputformat->extension : "img");
+  if(msSaveImage(map, img, path) != MS_SUCCESS)
+    return MS_FAILURE;
+
+  seed->tiles++;
+  return MS_SUCCESS;
+}
+
+static void seedRun(void *arg)
+{
+  seedThreadObj *seed = (seedThreadObj *) arg;
+  mapservObj *msObj = seed->msObj;
+  long long count = 0;
+  int zoom;
+
+  for(zoom=seed->minzoom; zoom<=seed->maxzoom; zoom++) {
+    /* as msTileSetup() does, no metatiles at the zoom levels that have fewer tiles */
+    int level = (seed->metatile_level >= zoom) ? 0 : seed->metatile_level;
+    int minx = seedLonToTile(seed->bounds.minx, zoom) >> level;
+    int maxx = seedLonToTile(seed->bounds.maxx, zoom) >> level;
+    int miny = seedLatToTile(seed->bounds.maxy, zoom) >> level;
+    int maxy = seedLatToTile(seed->bounds.miny, zoom) >> level;
+    int side = 1;
+    char value[64];
+    long long d;
+
+    snprintf(value, sizeof(value), "%d", level);
+    msInsertHashTable(&(msObj->map->web.metadata), "tile_metatile_level", value);
+
+    while(side <= maxx - minx || side <= maxy - miny)
+      side *= 2;
+
+    for(d=0; d<(long long) side * side; d++) {
+      int x, y;
+
+      seedHilbertPoint(side, d, &x, &y);
+      x += minx;
+      y += miny;
+      if(x > maxx || y > maxy)
+        continue;
+      if(count++ % seed->numthreads != seed->index)
+        continue;
+
+      snprintf(value, sizeof(value), "%d %d %d", x << level, y << level, zoom);
+      msFree(msObj->TileCoords);
+      msObj->TileCoords = msStrdup(value);
+
+      seed->metatiles++;
+      if(msTileSetExtent(msObj) != MS_SUCCESS || msTileDrawMetatile(msObj, seedWriteTile, seed) != MS_SUCCESS) {
+        fprintf(stderr, "Failed to draw the metatile of tile %s:\n", value);
+        msWriteError(stderr);
+        msResetErrorList();
+        seed->failed++;
+      }
+    }
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  const char *mapfile = NULL, *outdir = NULL;
+  int minzoom = -1, maxzoom = -1, metatile_level = -1, numthreads = 1;
+  rectObj bounds;
+  mapObj *map;
+  seedThreadObj *seeds;
+  void **tasks;
+  double start, elapsed;
+  int i, t, tiles = 0, metatiles = 0, failed = 0;
+  int status = MS_SUCCESS;
+
+  bounds.minx = -180.0;
+  bounds.miny = -90.0;
+  bounds.maxx = 180.0;
+  bounds.maxy = 90.0;
+
+  if(argc > 1 && strcmp(argv[1], "-v") == 0) {
+    printf("%s\n", msGetVersion());
+    exit(0);
+  }
+
+  for(i=1; i<argc; i++) {
+    if(strcmp(argv[i], "-m") == 0 && i+1 < argc) {
+      mapfile = argv[++i];
+    } else if(strcmp(argv[i], "-o") == 0 && i+1 < argc) {
+      outdir = argv[++i];
+    } else if(strcmp(argv[i], "-z") == 0 && i+2 < argc) {
+      minzoom = atoi(argv[++i]);
+      maxzoom = atoi(argv[++i]);
+    } else if(strcmp(argv[i], "-e") == 0 && i+4 < argc) {
+      bounds.minx = atof(argv[++i]);
+      bounds.miny = atof(argv[++i]);
+      bounds.maxx = atof(argv[++i]);
+      bounds.maxy = atof(argv[++i]);
+    } else if(strcmp(argv[i], "-metatile") == 0 && i+1 < argc) {
+      metatile_level = atoi(argv[++i]);
+    } else if(strcmp(argv[i], "-threads") == 0 && i+1 < argc) {
+      numthreads = atoi(argv[++i]);
+    } else {
+      usage();
+    }
+  }
+
+  if(!mapfile || !outdir || minzoom < 0 || maxzoom < minzoom || maxzoom > TILESEED_MAXZOOM ||
+      bounds.minx >= bounds.maxx || bounds.miny >= bounds.maxy || metatile_level > 2)
+    usage();
+
+#ifndef USE_TILE_API
+  fprintf(stderr, "Not built with the tile API (it requires PROJ support).\n");
+  exit(1);
+#endif
+
+#ifndef TILESEED_THREADS
+  if(numthreads > 1) {
+    fprintf(stderr, "Not built with thread support, -threads ignored.\n");
+    numthreads = 1;
+  }
+#endif
+  numthreads = MS_MAX(1, numthreads);
+
+  if(msSetup() != MS_SUCCESS) {
+    msWriteError(stderr);
+    exit(1);
+  }
+
+  map = msLoadMap((char *) mapfile, NULL);
+  if(!map) {
+    msWriteError(stderr);
+    msCleanup();
+    exit(1);
+  }
+
+  if(metatile_level < 0) {
+    const char *value = msLookupHashTable(&(map->web.metadata), "tile_metatile_level");
+    metatile_level = value ? MS_MAX(0, MS_MIN(atoi(value), 2)) : 0;
+  }
+  for(i=0; i<map->numlayers; i++) {
+    if(!msLayerGetProcessingKey(GET_LAYER(map, i), "CLOSE_CONNECTION"))
+      msLayerSetProcessingKey(GET_LAYER(map, i), "CLOSE_CONNECTION", "DEFER");
+  }
+
+  if(seedMakeDirectory(outdir) != MS_SUCCESS) {
+    msWriteError(stderr);
+    msFreeMap(map);
+    msCleanup();
+    exit(1);
+  }
+
+  seeds = (seedThreadObj *) msSmallCalloc(numthreads, sizeof(seedThreadObj));
+  tasks = (void **) msSmallMalloc(numthreads * sizeof(void *));
+  for(t=0; t<numthreads; t++) {
+    mapObj *copy = map;
+
+    if(t > 0) {
+      copy = msNewMapObj();
+      if(!copy || msCopyMap(copy, map) != MS_SUCCESS) {
+        msWriteError(stderr);
+        msFreeMap(copy);
+        status = MS_FAILURE;
+        break;
+      }
+    }
+    seeds[t].msObj = msAllocMapServObj();
+    seeds[t].msObj->map = copy;
+    seeds[t].msObj->TileMode = TILE_GMAP;
+    seeds[t].msObj->TileCoords = msStrdup("0 0 0");
+    seeds[t].outdir = outdir;
+    seeds[t].bounds = bounds;
+    seeds[t].minzoom = minzoom;
+    seeds[t].maxzoom = maxzoom;
+    seeds[t].metatile_level = metatile_level;
+    seeds[t].index = t;
+    seeds[t].numthreads = numthreads;
+    seeds[t].dirzoom = -1;
+    tasks[t] = &seeds[t];
+
+    /* the projections of the layers and of the tiles */
+    if(msTileSetup(seeds[t].msObj) != MS_SUCCESS) {
+      msWriteError(stderr);
+      status = MS_FAILURE;
+      t++;
+      break;
+    }
+  }
+
+  if(status == MS_SUCCESS) {
+    start = msStatsNow();
+    msThreadPoolRun(seedRun, tasks, numthreads, numthreads);
+    elapsed = msStatsElapsed(&start);
+
+    for(t=0; t<numthreads; t++) {
+      tiles += seeds[t].tiles;
+      metatiles += seeds[t].metatiles;
+      failed += seeds[t].failed;
+    }
+    printf("Seeded %d tiles (%d metatiles) of zoom levels %d to %d in %.3fs: %.1f tiles/s, %d failed\n",
+           tiles, metatiles, minzoom, maxzoom, elapsed, elapsed > 0 ? tiles / elapsed : 0.0, failed);
+  }
+
+  /* the map of the first thread is freed with its mapservObj */
+  for(i=0; i<t; i++)
+    msFreeMapServObj(seeds[i].msObj);
+  msFree(seeds);
+  msFree(tasks);
+
+  msCleanup();
+
+  return (status == MS_SUCCESS && failed == 0) ? 0 : 1;
+}